@@ -62,6 +62,14 @@ function(caffe_generate_export_configs)
     list(APPEND DEFINITIONS -DUSE_CUDNN)
   endif()
 
+  if(HAVE_NVJPEG)
+    list(APPEND Caffe_DEFINITIONS -DUSE_NVJPEG)
+  endif()
+
+  if(HAVE_NVTX)
+    list(APPEND Caffe_DEFINITIONS -DUSE_NVTX)
+  endif()
+
   if(BLAS STREQUAL "MKL" OR BLAS STREQUAL "mkl")
     list(APPEND Caffe_DEFINITIONS -DUSE_MKL)
   endif()
@@ -188,6 +188,50 @@ function(detect_cuDNN)
   endif()
 endfunction()
 
+################################################################################################
+# Short command for nvJPEG detection, part of the CUDA toolkit since 10.0
+# Usage:
+#   detect_nvJPEG()
+function(detect_nvJPEG)
+  find_path(NVJPEG_INCLUDE nvjpeg.h
+            PATHS ${CUDA_TOOLKIT_INCLUDE}
+            DOC "Path to nvJPEG include directory." )
+
+  get_filename_component(__libpath_hist ${CUDA_CUDART_LIBRARY} PATH)
+  find_library(NVJPEG_LIBRARY NAMES libnvjpeg.so
+                              PATHS ${__libpath_hist}
+                              DOC "Path to nvJPEG library.")
+
+  if(NVJPEG_INCLUDE AND NVJPEG_LIBRARY)
+    set(HAVE_NVJPEG TRUE PARENT_SCOPE)
+
+    mark_as_advanced(NVJPEG_INCLUDE NVJPEG_LIBRARY)
+    message(STATUS "Found nvJPEG (include: ${NVJPEG_INCLUDE}, library: ${NVJPEG_LIBRARY})")
+  endif()
+endfunction()
+
+################################################################################################
+# Short command for NVTX detection, part of the CUDA toolkit
+# Usage:
+#   detect_NVTX()
+function(detect_NVTX)
+  find_path(NVTX_INCLUDE nvToolsExt.h
+            PATHS ${CUDA_TOOLKIT_INCLUDE}
+            DOC "Path to NVTX include directory." )
+
+  get_filename_component(__libpath_hist ${CUDA_CUDART_LIBRARY} PATH)
+  find_library(NVTX_LIBRARY NAMES libnvToolsExt.so
+                            PATHS ${__libpath_hist}
+                            DOC "Path to NVTX library.")
+
+  if(NVTX_INCLUDE AND NVTX_LIBRARY)
+    set(HAVE_NVTX TRUE PARENT_SCOPE)
+
+    mark_as_advanced(NVTX_INCLUDE NVTX_LIBRARY)
+    message(STATUS "Found NVTX (include: ${NVTX_INCLUDE}, library: ${NVTX_LIBRARY})")
+  endif()
+endfunction()
+
 
 ################################################################################################
 ###  Non macro section
@@ -216,6 +260,26 @@ if(USE_CUDNN)
   endif()
 endif()
 
+# nvJPEG detection
+if(USE_NVJPEG)
+  detect_nvJPEG()
+  if(HAVE_NVJPEG)
+    add_definitions(-DUSE_NVJPEG)
+    include_directories(SYSTEM ${NVJPEG_INCLUDE})
+    list(APPEND Caffe_LINKER_LIBS ${NVJPEG_LIBRARY})
+  endif()
+endif()
+
+# NVTX detection
+if(USE_NVTX)
+  detect_NVTX()
+  if(HAVE_NVTX)
+    add_definitions(-DUSE_NVTX)
+    include_directories(SYSTEM ${NVTX_INCLUDE})
+    list(APPEND Caffe_LINKER_LIBS ${NVTX_LIBRARY})
+  endif()
+endif()
+
 # setting nvcc arch flags
 caffe_select_nvcc_arch_flags(NVCC_FLAGS_EXTRA)
 list(APPEND CUDA_NVCC_FLAGS ${NVCC_FLAGS_EXTRA})
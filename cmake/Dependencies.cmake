@@ -9,6 +9,10 @@ list(APPEND Caffe_LINKER_LIBS ${Boost_LIBRARIES})
 # ---[ Threads
 find_package(Threads REQUIRED)
 list(APPEND Caffe_LINKER_LIBS ${CMAKE_THREAD_LIBS_INIT})
+if(UNIX AND NOT APPLE)
+  # shm_open, for data services, is in librt before glibc 2.34
+  list(APPEND Caffe_LINKER_LIBS rt)
+endif()
 
 # ---[ Google-glog
 include("cmake/External/glog.cmake")
@@ -55,6 +59,10 @@ if(NOT HAVE_CUDA)
   # TODO: remove this not cross platform define in future. Use caffe_config.h instead.
   add_definitions(-DCPU_ONLY)
 endif()
+if(HAVE_CUDA AND USE_PER_THREAD_STREAMS)
+  add_definitions(-DCUDA_API_PER_THREAD_DEFAULT_STREAM)
+  list(APPEND CUDA_NVCC_FLAGS --default-stream per-thread)
+endif()
 
 # ---[ OpenCV
 find_package(OpenCV QUIET COMPONENTS core highgui imgproc imgcodecs)
@@ -136,6 +136,16 @@ function(caffe_print_configuration_summary)
     else()
       caffe_status("  cuDNN             :   Disabled")
     endif()
+    if(USE_NVJPEG)
+      caffe_status("  nvJPEG            : " HAVE_NVJPEG THEN "Yes" ELSE "Not found")
+    else()
+      caffe_status("  nvJPEG            :   Disabled")
+    endif()
+    if(USE_NVTX)
+      caffe_status("  NVTX              : " HAVE_NVTX THEN "Yes" ELSE "Not found")
+    else()
+      caffe_status("  NVTX              :   Disabled")
+    endif()
     caffe_status("")
   endif()
   if(HAVE_PYTHON)
@@ -0,0 +1,63 @@
+#ifndef CAFFE_BATCHER_HPP_
+#define CAFFE_BATCHER_HPP_
+
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/net.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Coalesces single items, submitted by any number of threads, into
+ * batches run by one forward pass of a net. A batch is run once it holds
+ * max_batch items, or once its first item waited max_delay_us, which bounds
+ * the latency of every item by max_delay_us plus the time of a pass.
+ *
+ * The net takes the items along the first axis of its first input blob,
+ * which is reshaped, together with the net, only when the batch size changes.
+ */
+template <typename Dtype>
+class Batcher : public InternalThread {
+ public:
+  Batcher(shared_ptr<Net<Dtype> > net, int max_batch, int max_delay_us);
+  virtual ~Batcher();
+
+  /**
+   * @brief Runs the net on one item, of input_blob->count(1) values, and
+   * returns the values of the item in every output blob, one after the
+   * other. Blocks until the batch of the item is done.
+   */
+  void Process(const Dtype* input, vector<Dtype>* output);
+  /**
+   * @brief Runs the net on count consecutive items, queued together, and
+   * returns the outputs of each item one after the other.
+   */
+  void Process(const Dtype* input, int count, vector<Dtype>* output);
+
+  /// The number of forward passes and items run so far
+  size_t batches() const;
+  size_t items() const;
+
+ protected:
+  virtual void InternalThreadEntry();
+  void Run(int count);
+
+  /**
+   Move synchronization fields out instead of including boost/thread.hpp
+   to avoid a boost/NVCC issues (#1009, #1010) on OSX.
+   */
+  class sync;
+
+  shared_ptr<Net<Dtype> > net_;
+  const int max_batch_;
+  const int max_delay_us_;
+  shared_ptr<sync> sync_;
+
+DISABLE_COPY_AND_ASSIGN(Batcher);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_BATCHER_HPP_
@@ -25,7 +25,8 @@ template <typename Dtype>
 class Blob {
  public:
   Blob()
-       : data_(), diff_(), count_(0), capacity_(0) {}
+       : data_(), diff_(), count_(0), capacity_(0), shape_version_(0),
+         layout_(NCHW) {}
 
   /// @brief Deprecated; use <code>Blob(const vector<int>& shape)</code>.
   explicit Blob(const int num, const int channels, const int height,
@@ -61,6 +62,12 @@ class Blob {
     return stream.str();
   }
   inline const vector<int>& shape() const { return shape_; }
+  /**
+   * @brief Returns a count of the changes of shape, which Net compares to
+   *        reshape only the layers whose bottoms changed shape. Reshaping to
+   *        the same shape keeps it.
+   */
+  inline int shape_version() const { return shape_version_; }
   /**
    * @brief Returns the dimension of the index-th axis (or the negative index-th
    *        axis from the end, if index is negative).
@@ -151,6 +158,15 @@ class Blob {
     return shape(index);
   }
 
+  /**
+   * @brief The order of the values of a blob of 4 axes: the shape is always
+   *        (num, channels, height, width), and NHWC blobs hold the channels
+   *        of each pixel next to each other, as indexed by offset. Kept by
+   *        Reshape; ReshapeLike and ShareItems take that of the other blob.
+   */
+  inline Layout layout() const { return layout_; }
+  inline void set_layout(Layout layout) { layout_ = layout; }
+
   inline int offset(const int n, const int c = 0, const int h = 0,
       const int w = 0) const {
     CHECK_GE(n, 0);
@@ -161,11 +177,19 @@ class Blob {
     CHECK_LE(h, height());
     CHECK_GE(width(), 0);
     CHECK_LE(w, width());
+    if (layout_ == NHWC) {
+      return ((n * height() + h) * width() + w) * channels() + c;
+    }
     return ((n * channels() + c) * height() + h) * width() + w;
   }
 
   inline int offset(const vector<int>& indices) const {
     CHECK_LE(indices.size(), num_axes());
+    if (layout_ == NHWC) {
+      vector<int> index(indices);
+      index.resize(4, 0);
+      return offset(index[0], index[1], index[2], index[3]);
+    }
     int offset = 0;
     for (int i = 0; i < num_axes(); ++i) {
       offset *= shape(i);
@@ -220,6 +244,7 @@ class Blob {
   const Dtype* cpu_data() const;
   void set_cpu_data(Dtype* data);
   const Dtype* gpu_data() const;
+  void set_gpu_data(Dtype* data);
   const Dtype* cpu_diff() const;
   const Dtype* gpu_diff() const;
   Dtype* mutable_cpu_data();
@@ -262,6 +287,31 @@ class Blob {
    * shared_ptr calls its destructor when reset with the "=" operator.
    */
   void ShareDiff(const Blob& other);
+  /**
+   * @brief Make data_ and diff_ views of count() elements of those of Blob
+   *        other, starting at the given element offset -- used by Concat and
+   *        Slice layers to let their parts be computed in place.
+   *
+   * Reshaping beyond count() reallocates private memory, ending the view.
+   */
+  void ShareView(const Blob& other, int offset);
+  /**
+   * @brief Make this Blob a view of the items [begin, end) of Blob other
+   *        along its first axis, shaped like other but for end - begin items
+   *        -- e.g. a micro-batch, or the part of a batch of one GPU.
+   *
+   * The view shares the state of other's memory, so it can be read or
+   * written on either side like any blob, and keeps that memory alive.
+   */
+  void ShareItems(const Blob& other, int begin, int end);
+  /**
+   * @brief Set the data_ shared_ptr to the given SyncedMemory, which must be
+   *        large enough for count() elements -- used by Net to let blobs that
+   *        are not needed at the same time use the same memory.
+   */
+  void SetDataStorage(const shared_ptr<SyncedMemory>& data);
+  /// @brief Same as SetDataStorage, for diff_.
+  void SetDiffStorage(const shared_ptr<SyncedMemory>& diff);
 
   bool ShapeEquals(const BlobProto& other);
 
@@ -271,6 +321,8 @@ class Blob {
   vector<int> shape_;
   int count_;
   int capacity_;
+  int shape_version_;
+  Layout layout_;
 
   DISABLE_COPY_AND_ASSIGN(Blob);
 };  // class Blob
@@ -93,6 +93,9 @@ using std::vector;
 // Currently it initializes google flags and google logging.
 void GlobalInit(int* pargc, char*** pargv);
 
+class Executor;
+class ThreadPool;
+
 // A singleton class to hold common caffe stuff, such as the handler that
 // caffe is going to use for cublas, curand, etc.
 class Caffe {
@@ -102,7 +105,11 @@ class Caffe {
   // Thread local context for Caffe. Moved to common.cpp instead of
   // including boost/thread.hpp to avoid a boost/NVCC issues (#1009, #1010)
   // on OSX. Also fails on Linux with CUDA 7.0.18.
-  static Caffe& Get();
+  // Read by most layers and math functions, so the thread_specific_ptr
+  // owning it, which looks it up in a map, is only used to create it.
+  inline static Caffe& Get() {
+    return thread_context_ ? *thread_context_ : CreateThreadContext();
+  }
 
   enum Brew { CPU, GPU };
 
@@ -132,6 +139,15 @@ class Caffe {
   inline static curandGenerator_t curand_generator() {
     return Get().curand_generator_;
   }
+  // The stream of the kernels, copies, cuBLAS and curand calls of this
+  // thread; 0, the default stream, unless set.
+  inline static cudaStream_t cuda_stream() { return Get().cuda_stream_; }
+  static void set_cuda_stream(cudaStream_t stream);
+  // Whether the cuBLAS calls of this thread may use tensor cores, which round
+  // their float inputs to lower precision and accumulate in float. Needs
+  // CUDA 9 or later; false by default.
+  inline static bool tensor_op_math() { return Get().tensor_op_math_; }
+  static void set_tensor_op_math(bool tensor_op_math);
 #endif
 
   // Returns the mode: running on CPU or GPU.
@@ -144,8 +160,9 @@ class Caffe {
   inline static void set_mode(Brew mode) { Get().mode_ = mode; }
   // Sets the random seed of both boost and curand
   static void set_random_seed(const unsigned int seed);
-  // Sets the device. Since we have cublas and curand stuff, set device also
-  // requires us to reset those values.
+  // Sets the device. The cublas handle and curand generator of each device
+  // are created on its first use by the thread and kept for the next ones;
+  // the stream and math mode are reset to their defaults on each change.
   static void SetDevice(const int device_id);
   // Prints the current GPU status.
   static void DeviceQuery();
@@ -154,21 +171,61 @@ class Caffe {
   inline static void set_solver_count(int val) { Get().solver_count_ = val; }
   inline static bool root_solver() { return Get().root_solver_; }
   inline static void set_root_solver(bool val) { Get().root_solver_ = val; }
+  // Number of threads running the loops of CPU layers, 1 by default
+  inline static int cpu_threads() { return Get().cpu_threads_; }
+  static void set_cpu_threads(const int threads);
+  // The pool of cpu_threads() threads, including the caller
+  static ThreadPool& thread_pool();
+  // The position of this machine among those training together, and their
+  // number. Unlike the above, shared by all threads of the process.
+  inline static int node_rank() { return node_rank_; }
+  inline static int node_count() { return node_count_; }
+  static void set_nodes(int rank, int count);
+  // Number of threads of the executor running the background work of the
+  // process, such as loading batches, or 0, the default, for threads of its
+  // own for each. Shared by all threads of the process, and set before the
+  // nets using it are created.
+  inline static int executor_threads() { return executor_threads_; }
+  static void set_executor_threads(int threads);
+  // NULL with 0 executor_threads
+  static Executor* executor();
 
  protected:
 #ifndef CPU_ONLY
   cublasHandle_t cublas_handle_;
   curandGenerator_t curand_generator_;
+  cudaStream_t cuda_stream_;
+  bool tensor_op_math_;
+  // The device of the handles above, and those of each device used
+  struct DeviceHandles {
+    cublasHandle_t cublas_handle;
+    curandGenerator_t curand_generator;
+  };
+  int device_;
+  std::map<int, DeviceHandles> device_handles_;
+
+  // Switches to the handles of device, creating them on its first use.
+  void UseDeviceHandles(int device);
 #endif
   shared_ptr<RNG> random_generator_;
 
   Brew mode_;
   int solver_count_;
   bool root_solver_;
+  int cpu_threads_;
+  shared_ptr<ThreadPool> thread_pool_;
+  static int node_rank_;
+  static int node_count_;
+  static int executor_threads_;
+  static shared_ptr<Executor> executor_;
 
  private:
   // The private constructor to avoid duplicate instantiation.
   Caffe();
+  static Caffe& CreateThreadContext();
+
+  // The context of the thread, owned by a thread_specific_ptr
+  static __thread Caffe* thread_context_;
 
   DISABLE_COPY_AND_ASSIGN(Caffe);
 };
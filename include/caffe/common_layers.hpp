@@ -12,6 +12,8 @@
 #include "caffe/loss_layers.hpp"
 #include "caffe/neuron_layers.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/packed_gemm.hpp"
 
 namespace caffe {
 
@@ -61,6 +63,8 @@ class ArgMaxLayer : public Layer<Dtype> {
    */
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
   /// @brief Not implemented (non-differentiable function)
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
@@ -85,6 +89,13 @@ class ConcatLayer : public Layer<Dtype> {
       const vector<Blob<Dtype>*>& top);
 
   virtual inline const char* type() const { return "Concat"; }
+  // Along the memory order of the axes, see Blob::layout, unless viewing
+  virtual inline bool AllowNHWC() const {
+    return !this->layer_param_.concat_param().view();
+  }
+  // Only copies
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const { return 0; }
   virtual inline int MinBottomBlobs() const { return 2; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
 
@@ -141,6 +152,8 @@ class ConcatLayer : public Layer<Dtype> {
   int num_concats_;
   int concat_input_size_;
   int concat_axis_;
+  /// Whether the bottoms are views of the top, needing no copies
+  bool viewing_;
 };
 
 /**
@@ -160,8 +173,29 @@ class EltwiseLayer : public Layer<Dtype> {
       const vector<Blob<Dtype>*>& top);
 
   virtual inline const char* type() const { return "Eltwise"; }
+  virtual inline bool AllowNHWC() const { return true; }
   virtual inline int MinBottomBlobs() const { return 2; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
+  virtual inline bool AllowAccumulateBottomDiff(const int bottom_index) const {
+    return this->layer_param_.eltwise_param().operation()
+        == EltwiseParameter_EltwiseOp_SUM;
+  }
+  // SUM scales each bottom by its coefficient while adding it, PROD and MAX
+  // take one operation per element of each bottom after the first
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    const double count = top[0]->count();
+    return op_ == EltwiseParameter_EltwiseOp_SUM ?
+        2 * count * bottom.size() : count * (bottom.size() - 1);
+  }
+  // PROD takes the product of the other bottoms for each one, SUM and MAX
+  // copy or scale the gradient
+  virtual inline double BackwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    const double count = top[0]->count();
+    return op_ == EltwiseParameter_EltwiseOp_PROD ?
+        2 * count * bottom.size() : count * bottom.size();
+  }
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -173,13 +207,142 @@ class EltwiseLayer : public Layer<Dtype> {
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
+  // Forward_cpu of the elements [begin, end), for the thread pool
+  void eltwise_forward_cpu(const vector<const Dtype*>& bottom_data,
+      Dtype* top_data, int begin, int end);
+
+  /// MAX passes the gradient of each output to the first bottom after the
+  /// first one equal to it, or else to the first one, which may be computed
+  /// in place, rather than keeping the index of the max.
   EltwiseParameter_EltwiseOp op_;
   vector<Dtype> coeffs_;
-  Blob<int> max_idx_;
 
   bool stable_prod_grad_;
 };
 
+/**
+ * @brief Looks up the rows of a table of learned weights for integer indices,
+ *        as an InnerProductLayer would for one-hot vectors, and (optionally)
+ *        adds biases. The top has the shape of the bottom with a last axis of
+ *        num_output.
+ *
+ * The gradient only touches the rows of the indices of the batch, which the
+ * layer gives as its param_rows, for Net and the solvers to clear and update
+ * only those rows of the table.
+ */
+template <typename Dtype>
+class EmbedLayer : public Layer<Dtype> {
+ public:
+  explicit EmbedLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "Embed"; }
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+  // The indices have no gradient
+  virtual inline bool AllowForceBackward(const int bottom_index) const {
+    return false;
+  }
+  virtual inline const vector<int>* param_rows(const int param_id) const {
+    return param_id == 0 ? &rows_ : NULL;
+  }
+  virtual void ClearParamRows(const int param_id);
+  // Reads the rows of the indices only, not the whole table
+  virtual inline double ForwardBytes(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return (bottom[0]->count() + 2.0 * top[0]->count()) * sizeof(Dtype);
+  }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  /// Checks the indices of the bottom, adding their rows to rows_
+  void AddRows(const Dtype* indices);
+
+  int M_;
+  int K_;
+  int N_;
+  bool bias_term_;
+  Blob<Dtype> bias_multiplier_;
+  /// The rows touched since ClearParamRows, and whether each row is
+  vector<int> rows_;
+  vector<bool> row_touched_;
+  /// The items of the batch grouped by row for the GPU backward to sum the
+  /// gradient of each row without atomics: the rows, the start of the items
+  /// of each row, and the items
+  Blob<int> group_rows_;
+  Blob<int> group_starts_;
+  Blob<int> group_items_;
+};
+
+/**
+ * @brief Passes its bottoms on while storing each of their items, in memory
+ *        or in a database, and then gives the stored items back once it has
+ *        those of an epoch, see FeatureCacheParameter.
+ *
+ * The bottoms are meant to be the output of a frozen trunk and the labels,
+ * for fine-tuning the layers above: Net then skips the layers only computing
+ * them, including the data layer, which must not shuffle nor augment the
+ * data. The items are keyed by their position in the epoch, the data layer
+ * reading its records in the same order each epoch.
+ */
+template <typename Dtype>
+class FeatureCacheLayer : public Layer<Dtype> {
+ public:
+  explicit FeatureCacheLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "FeatureCache"; }
+  virtual inline int MinBottomBlobs() const { return 1; }
+  virtual inline bool EqualNumBottomTopBlobs() const { return true; }
+  virtual inline bool AllowForceBackward(const int bottom_index) const {
+    return false;
+  }
+  virtual inline bool BottomsCached() const { return filled_ >= items_; }
+  // Only copies
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const { return 0; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  /// The bottoms are frozen, so there is no gradient to pass on.
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
+
+  // Stores the item n of the tops at the given position of the epoch, in
+  // memory or through the transaction, or reads it back.
+  void Store(const vector<Blob<Dtype>*>& top, int n, int position,
+      db::Transaction* txn);
+  void Load(const vector<Blob<Dtype>*>& top, int n, int position);
+
+  /// The items of an epoch, how many of them are stored, and the position in
+  /// the epoch of the next item
+  int items_;
+  int filled_;
+  int position_;
+  /// In memory, the items of each bottom
+  vector<shared_ptr<Blob<Dtype> > > cache_;
+  /// Or the database of the items, and the cursor reading them back in order
+  shared_ptr<db::DB> db_;
+  shared_ptr<db::Cursor> cursor_;
+};
+
 /**
  * @brief Takes two+ Blobs, interprets last Blob as a selector and
  *  filter remaining Blobs accordingly with selector data (0 means that
@@ -239,8 +402,17 @@ class FilterLayer : public Layer<Dtype> {
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
+#ifndef CPU_ONLY
+  // Compacts the selected items on the GPU into selected_ and positions_,
+  // returning their number, the only value read back for the top shape.
+  int select_gpu(const Blob<Dtype>& selector);
+#endif
+
   bool first_reshape_;
   vector<int> indices_to_forward_;
+  /// In GPU mode, the item of the bottoms of each top item, the item of the
+  /// tops of each bottom item or -1, and the number of selected items.
+  Blob<int> selected_, positions_, num_selected_;
 };
 
 /**
@@ -264,6 +436,7 @@ class FlattenLayer : public Layer<Dtype> {
   virtual inline const char* type() const { return "Flatten"; }
   virtual inline int ExactNumBottomBlobs() const { return 1; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
+  virtual inline bool SharesBottomData() const { return true; }
 
  protected:
   /**
@@ -307,8 +480,17 @@ class InnerProductLayer : public Layer<Dtype> {
       const vector<Blob<Dtype>*>& top);
 
   virtual inline const char* type() const { return "InnerProduct"; }
-  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  // One dense bottom, or the three of a sparse one (see sparse_dim)
+  virtual inline int MinBottomBlobs() const { return 1; }
+  virtual inline int MaxBottomBlobs() const { return 3; }
+  virtual inline bool AllowAccumulateBottomDiff(const int bottom_index) const {
+    return true;
+  }
   virtual inline int ExactNumTopBlobs() const { return 1; }
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return sparse_ ? 2.0 * bottom[0]->count() * N_ : 2.0 * M_ * K_ * N_;
+  }
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -320,11 +502,192 @@ class InnerProductLayer : public Layer<Dtype> {
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
+  /// Sorts the nonzeros of the sparse bottoms by column into the csc_ blobs,
+  /// for the weight gradient on the GPU to sum each column without atomics.
+  void SparseToColumns(const vector<Blob<Dtype>*>& bottom);
+  /// Builds the compressed sparse rows of the weights by the first forward,
+  /// returning whether the layer runs on them (see sparsity_param).
+  bool CompressWeights();
+
   int M_;
   int K_;
   int N_;
   bool bias_term_;
   Blob<Dtype> bias_multiplier_;
+  bool fused_relu_;
+  Dtype relu_slope_;
+  bool sparse_;
+  /// The nonzero columns, where the nonzeros of each start in csc_rows_ and
+  /// csc_values_ followed by their count, and the rows and values of these.
+  Blob<int> csc_columns_;
+  Blob<int> csc_offsets_;
+  Blob<int> csc_rows_;
+  Blob<Dtype> csc_values_;
+  /// Whether Forward_cpu runs on int8 values (quantization_param at TEST),
+  /// with the quantized weights and their scale per output, and the
+  /// quantized inputs and int32 outputs of the last forward.
+  bool quantized_;
+  vector<int8_t> weight_int8_;
+  vector<Dtype> weight_scale_;
+  vector<int8_t> input_int8_;
+  vector<int32_t> output_int32_;
+  /// Whether the forward runs on the nonzero weights only (sparsity_param at
+  /// TEST), with their values, columns, and the offset of each output's.
+  bool sparse_weights_;
+  Blob<Dtype> weight_values_;
+  Blob<int> weight_columns_;
+  Blob<int> weight_offsets_;
+  /// The weights packed for the dense products of Forward_cpu at TEST
+  PackedGemm<Dtype> packed_weight_;
+};
+
+/**
+ * @brief An InnerProductLayer with its outputs split across the GPUs of
+ *        InnerProductParameter.device, each computing its shard of the
+ *        outputs from the whole input.
+ *
+ * The layer is shared between the solvers of data parallel training, see
+ * ShareInParallel, so that its weights are neither replicated nor
+ * all-reduced. Each solver passes its own batch through all the shards,
+ * one solver at a time, and the gradients of the weights sum over the
+ * solvers, scaled as the synchronized ones. Each shard runs on a thread of
+ * its GPU, copying the inputs in and its outputs back.
+ */
+template <typename Dtype>
+class ModelParallelInnerProductLayer : public Layer<Dtype> {
+ public:
+  explicit ModelParallelInnerProductLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual ~ModelParallelInnerProductLayer();
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "InnerProduct"; }
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+  virtual inline bool AllowAccumulateBottomDiff(const int bottom_index) const {
+    return true;
+  }
+  virtual inline bool ShareInParallel() const { return true; }
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return 2.0 * M_ * K_ * N_;
+  }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  class Shard;  // The thread of a shard's GPU
+
+  /// The pass of the calling solver the shards run, in its memory
+  struct Pass {
+    int device;                 // GPU of the caller
+    int rows;                   // M_ of the caller
+    const Dtype* bottom_data;
+    Dtype* top_data;
+    const Dtype* top_diff;
+    bool bottom_propagate;      // Whether to compute the bottom diff
+    Dtype scale;                // Of the gradients of the weights
+  };
+  /// Run by the thread of a shard, from pass_
+  void ForwardShard(int shard);
+  void BackwardShard(int shard);
+  /// Runs all the shards on their threads, forward or backward
+  void RunShards(bool forward);
+  inline Blob<Dtype>* weight(int shard) const {
+    return this->blobs_[shard * (bias_term_ ? 2 : 1)].get();
+  }
+  inline Blob<Dtype>* bias(int shard) const {
+    return this->blobs_[shard * 2 + 1].get();
+  }
+  inline int weight_index(int shard) const {
+    return shard * (bias_term_ ? 2 : 1);
+  }
+
+  int M_;
+  int K_;
+  int N_;
+  int axis_;
+  bool bias_term_;
+  bool fused_relu_;
+  Dtype relu_slope_;
+  /// The outputs of each shard, and its GPU
+  vector<int> offsets_;
+  vector<int> counts_;
+  vector<int> devices_;
+  vector<shared_ptr<Shard> > shards_;
+  /// Per shard, in the memory of its GPU: the copied input, outputs and
+  /// their diff, the bottom diff it computes, and the bias multiplier.
+  vector<shared_ptr<Blob<Dtype> > > bottom_copies_;
+  vector<shared_ptr<Blob<Dtype> > > outputs_;
+  vector<shared_ptr<Blob<Dtype> > > output_diffs_;
+  vector<shared_ptr<Blob<Dtype> > > bottom_diffs_;
+  vector<shared_ptr<Blob<Dtype> > > bias_multipliers_;
+  Pass pass_;
+  /// Serializes the passes of the solvers sharing the layer
+  shared_ptr<boost::mutex> pass_mutex_;
+  BlockingQueue<int> done_;     // Shards done with pass_
+};
+
+/**
+ * @brief Normalizes each channel of the input to zero mean and unit variance
+ *        over the batch and the spatial dimensions.
+ *
+ * In the TRAIN phase, the mean and variance of the batch, computed in a
+ * single pass, normalize it and are accumulated into three blobs: the
+ * moving sums of the means and of the variances, and their normalizing
+ * factor, which decay by moving_average_fraction at each iteration. These
+ * blobs are not learned and have their lr_mult set to zero. In the TEST
+ * phase, or with use_global_stats, the moving averages normalize the input;
+ * tools/optimize_net then folds the layer into the Convolution or
+ * InnerProduct layer before it. The layer has no scale and shift of its own.
+ */
+template <typename Dtype>
+class BatchNormLayer : public Layer<Dtype> {
+ public:
+  explicit BatchNormLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "BatchNorm"; }
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  /// The factor scaling the moving sums into averages, 0 before any update
+  Dtype global_stats_scale() const;
+
+  bool use_global_stats_;
+  Dtype moving_average_fraction_;
+  Dtype eps_;
+  int num_, channels_, spatial_dim_;
+  /// Per channel, the mean and variance used by the last forward pass and
+  /// the inverse of the standard deviation they give.
+  Blob<Dtype> mean_, variance_, inv_std_;
+  /// Per channel, the means of the top diff and of its product with the
+  /// top, for backward.
+  Blob<Dtype> diff_sum_, diff_dot_;
 };
 
 /**
@@ -380,6 +743,7 @@ class ReshapeLayer : public Layer<Dtype> {
   virtual inline const char* type() const { return "Reshape"; }
   virtual inline int ExactNumBottomBlobs() const { return 1; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
+  virtual inline bool SharesBottomData() const { return true; }
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -489,6 +853,16 @@ class SoftmaxLayer : public Layer<Dtype> {
   virtual inline const char* type() const { return "Softmax"; }
   virtual inline int ExactNumBottomBlobs() const { return 1; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
+  // The max, subtraction, exponential, sum and division of each element
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return 5.0 * top[0]->count();
+  }
+  // The dot product with the top, subtraction and product of each element
+  virtual inline double BackwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return 4.0 * top[0]->count();
+  }
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -499,6 +873,9 @@ class SoftmaxLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  // Forward_cpu of the outer indices [begin, end), for the thread pool
+  void softmax_forward_cpu(const Dtype* bottom_data, Dtype* top_data,
+      Dtype* scale_data, int begin, int end);
 
   int outer_num_;
   int inner_num_;
@@ -536,6 +913,43 @@ class CuDNNSoftmaxLayer : public SoftmaxLayer<Dtype> {
   cudnnTensorDescriptor_t bottom_desc_;
   cudnnTensorDescriptor_t top_desc_;
 };
+
+#if CUDNN_VERSION_MIN(5, 0, 0)
+/**
+ * @brief cuDNN implementation of BatchNormLayer, keeping the same moving
+ *        averages. Fallback to BatchNormLayer for CPU mode.
+ */
+template <typename Dtype>
+class CuDNNBatchNormLayer : public BatchNormLayer<Dtype> {
+ public:
+  explicit CuDNNBatchNormLayer(const LayerParameter& param)
+      : BatchNormLayer<Dtype>(param), handles_setup_(false) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual ~CuDNNBatchNormLayer();
+
+ protected:
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  bool handles_setup_;
+  cudnnHandle_t             handle_;
+  cudnnTensorDescriptor_t bottom_desc_;
+  cudnnTensorDescriptor_t top_desc_;
+  cudnnTensorDescriptor_t stats_desc_;
+  /// The unit scale and zero shift cuDNN applies after normalizing, and
+  /// their unused gradients.
+  Blob<Dtype> scale_ones_, shift_zeros_, scale_diff_, shift_diff_;
+  /// The batch mean saved for backward
+  Blob<Dtype> save_mean_;
+  /// The input and top diff, when computing in place
+  Blob<Dtype> bottom_copy_;
+};
+#endif
 #endif
 
 /**
@@ -548,13 +962,32 @@ template <typename Dtype>
 class SplitLayer : public Layer<Dtype> {
  public:
   explicit SplitLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), share_diff_(false) {}
   virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
   virtual inline const char* type() const { return "Split"; }
+  virtual inline bool AllowNHWC() const { return true; }
   virtual inline int ExactNumBottomBlobs() const { return 1; }
   virtual inline int MinTopBlobs() const { return 1; }
+  virtual inline bool SharesBottomData() const { return true; }
+  // Backward sums the diffs of the tops, unless they share that of the bottom
+  virtual inline double BackwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return share_diff_ ? 0 : (top.size() - 1.0) * bottom[0]->count();
+  }
+  virtual inline double BackwardBytes(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return share_diff_ ? 0 :
+        (top.size() + 1.0) * bottom[0]->count() * sizeof(Dtype);
+  }
+
+  /**
+   * @brief Lets the tops share the diff of the bottom too, into which the
+   *        layers reading them must add their gradients, all but the first
+   *        to run Backward. Backward then has nothing to do.
+   */
+  void set_share_diff(bool share_diff) { share_diff_ = share_diff; }
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -567,6 +1000,71 @@ class SplitLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
   int count_;
+  bool share_diff_;
+};
+
+/**
+ * @brief Copies a blob computed by an earlier stage of a pipelined net, on
+ *        the GPU of that stage, to the GPU of the stage of this layer, and
+ *        the diff back in Backward. Net::Compile inserts them, see
+ *        PipelineParameter.
+ */
+template <typename Dtype>
+class TransferLayer : public Layer<Dtype> {
+ public:
+  explicit TransferLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "Transfer"; }
+  virtual inline bool AllowNHWC() const { return true; }
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+  // Only copies
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const { return 0; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+};
+
+/**
+ * @brief Converts a blob of 4 axes between the NCHW and NHWC layouts, see
+ *        Blob::layout. Net::Compile inserts them for NetParameter.layout.
+ */
+template <typename Dtype>
+class LayoutLayer : public Layer<Dtype> {
+ public:
+  explicit LayoutLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "Layout"; }
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+  virtual inline bool AllowNHWC() const { return true; }
+  // Only copies
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const { return 0; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 };
 
 /**
@@ -586,6 +1084,9 @@ class SliceLayer : public Layer<Dtype> {
       const vector<Blob<Dtype>*>& top);
 
   virtual inline const char* type() const { return "Slice"; }
+  // Only copies
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const { return 0; }
   virtual inline int ExactNumBottomBlobs() const { return 1; }
   virtual inline int MinTopBlobs() const { return 2; }
 
@@ -604,6 +1105,8 @@ class SliceLayer : public Layer<Dtype> {
   int slice_size_;
   int slice_axis_;
   vector<int> slice_point_;
+  /// Whether the tops are views of the bottom, needing no copies
+  bool viewing_;
 };
 
 }  // namespace caffe
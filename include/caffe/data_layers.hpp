@@ -16,7 +16,10 @@
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/data_stats.hpp"
 #include "caffe/util/db.hpp"
+#include "caffe/util/image_list.hpp"
+#include "caffe/util/nvjpeg.hpp"
 
 namespace caffe {
 
@@ -57,6 +60,12 @@ template <typename Dtype>
 class Batch {
  public:
   Blob<Dtype> data_, label_;
+  // With transform_param.gpu_transform, data_ only has the shape of the
+  // batch, which is transformed on the GPU from the uint8 pixels in raw_, of
+  // raw_shape_, and the crop offsets and mirroring of each item in params_
+  shared_ptr<SyncedMemory> raw_;
+  vector<int> raw_shape_;
+  Blob<int> params_;
 };
 
 template <typename Dtype>
@@ -75,18 +84,98 @@ class BasePrefetchingDataLayer :
   virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
-  // Prefetches batches (asynchronously if to GPU memory)
-  static const int PREFETCH_COUNT = 3;
+  // Number of batches prefetched (asynchronously if to GPU memory), set by
+  // the prefetch field of the data_param
+  inline int prefetch_count() const { return prefetch_.size(); }
+  // Number of threads loading batches, see data_param.loader_threads
+  inline int loader_count() const { return loader_count_; }
+
+  // Moves the counters of the pipeline feeding this layer since the last
+  // call to stats
+  virtual void collect_data_stats(DataStats* stats);
+
+  // Also waits for the batches being loaded by the executor, if any
+  void StopInternalThread();
 
  protected:
   virtual void InternalThreadEntry();
-  virtual void load_batch(Batch<Dtype>* batch) = 0;
-
-  Batch<Dtype> prefetch_[PREFETCH_COUNT];
+  // Fills a batch on one of the loader threads, given by its index. Unless
+  // ConcurrentLoadBatch, one loader at a time runs load_batch.
+  virtual void load_batch(Batch<Dtype>* batch, int loader) = 0;
+  // Whether loaders can run load_batch concurrently. It must then read its
+  // inputs between begin_read and end_read, and use the transformer and
+  // transformed data of its loader.
+  virtual inline bool ConcurrentLoadBatch() const { return false; }
+  // Lets one loader at a time read inputs, in the order the batches are
+  // then delivered if data_param.ordered_loading
+  void begin_read(int loader);
+  void end_read();
+  DataTransformer<Dtype>* transformer(int loader);
+  Blob<Dtype>* transformed_data(int loader);
+  // Takes the next prefetched batch, recording the wait in data_stats_
+  Batch<Dtype>* pop_batch();
+  // In GPU mode, or with micro_batches, the tops share the data of the batch
+  // instead of copying it, so the batch is held until the next forward into
+  // the same top
+  void hold_batch(const Blob<Dtype>* top, Batch<Dtype>* batch);
+  void release_batch(const Blob<Dtype>* top);
+  // With micro_batches, the batch held by the top, taking the next one
+  // after its last micro-batch, and the index of the micro-batch to deliver
+  Batch<Dtype>* micro_batch(const Blob<Dtype>* top, int* index);
+  // Reshapes the top to the micro-batches of the blob of a batch
+  void ReshapeMicroBatch(const Blob<Dtype>& blob, Blob<Dtype>* top) const;
+  // Makes the top a view of the index-th micro-batch of the blob of a batch
+  void ShareMicroBatch(const Blob<Dtype>& blob, int index,
+      Blob<Dtype>* top) const;
+  // Decodes the JPEG images of a batch into its raw_ on the GPU, with the
+  // decoder of the loader, if gpu_decode_. Returns false, decoding nothing,
+  // otherwise or unless the images are all JPEGs of the same size.
+  bool decode_raw_gpu(Batch<Dtype>* batch, const vector<const string*>& images,
+      int channels, int loader);
+  // Whether load_batch fills raw_ instead of data_, for transforming on the
+  // GPU. Set in GPU mode if transform_param.gpu_transform.
+  bool gpu_transform_;
+  // Whether load_batch decodes JPEGs into raw_ on the GPU, with gpu_transform
+  // and transform_param.gpu_decode, in builds with nvJPEG
+  bool gpu_decode_;
+
+  vector<shared_ptr<Batch<Dtype> > > prefetch_;
   BlockingQueue<Batch<Dtype>*> prefetch_free_;
   BlockingQueue<Batch<Dtype>*> prefetch_full_;
+  DataStats data_stats_;
 
   Blob<Dtype> transformed_data_;
+
+ private:
+  // Only in the .cpp, see BlockingQueue
+  class sync;
+  class Loader;
+
+  void load_loop(int loader);
+  // Loads a batch, pushes it to the GPU and delivers it to prefetch_full_
+  void fill_batch(Batch<Dtype>* batch, int loader);
+  // With Caffe::executor, batches are loaded by its tasks instead of the
+  // threads of the layer, a task for each free batch while loaders are free
+  void schedule_loads();
+  // Same, with the mutex of sync_ held
+  void submit_loads();
+  void load_task(Batch<Dtype>* batch, int loader);
+  // Returns a batch to prefetch_free_, loading it again
+  void recycle_batch(Batch<Dtype>* batch);
+
+  const int loader_count_;
+  const bool ordered_loading_;
+  const int micro_batches_;
+  shared_ptr<sync> sync_;
+  Executor* executor_;
+  // Transformers and transformed data of loaders after the first, which
+  // uses data_transformer_ and transformed_data_
+  vector<shared_ptr<DataTransformer<Dtype> > > loader_transformers_;
+  vector<shared_ptr<Blob<Dtype> > > loader_transformed_data_;
+#ifdef USE_NVJPEG
+  // A JPEG decoder per loader, with gpu_decode
+  vector<shared_ptr<JPEGDecoder> > decoders_;
+#endif
 };
 
 template <typename Dtype>
@@ -102,9 +191,16 @@ class DataLayer : public BasePrefetchingDataLayer<Dtype> {
   virtual inline int ExactNumBottomBlobs() const { return 0; }
   virtual inline int MinTopBlobs() const { return 1; }
   virtual inline int MaxTopBlobs() const { return 2; }
+  virtual void collect_data_stats(DataStats* stats);
 
  protected:
-  virtual void load_batch(Batch<Dtype>* batch);
+  virtual void load_batch(Batch<Dtype>* batch, int loader);
+  virtual inline bool ConcurrentLoadBatch() const { return true; }
+  // Fills raw_ for gpu_transform, decoding the datums like the transformer,
+  // on the GPU with gpu_decode
+  void load_raw(Batch<Dtype>* batch, const vector<Datum*>& datums,
+                DataTransformer<Dtype>* transformer, int loader);
+  void decode_raw(Datum* datum);
 
   DataReader reader_;
 };
@@ -146,13 +242,16 @@ class DummyDataLayer : public Layer<Dtype> {
 /**
  * @brief Provides data to the Net from HDF5 files.
  *
+ * The files are read on a prefetch thread, whole or in chunks of
+ * hdf5_data_param.chunk_size rows, so datasets need not fit in memory.
+ *
  * TODO(dox): thorough documentation for Forward and proto params.
  */
 template <typename Dtype>
-class HDF5DataLayer : public Layer<Dtype> {
+class HDF5DataLayer : public Layer<Dtype>, public InternalThread {
  public:
   explicit HDF5DataLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), file_id_(-1) {}
   virtual ~HDF5DataLayer();
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -175,27 +274,57 @@ class HDF5DataLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
-  virtual void LoadHDF5FileData(const char* filename);
+
+  // The rows of a batch, for each top
+  typedef vector<shared_ptr<Blob<Dtype> > > Rows;
+
+  virtual void InternalThreadEntry();
+  void load_batch(Rows* batch);
+  // Opens file_permutation_[current_file_] and orders its chunks
+  void open_file();
+  void close_file();
+  // Loads the current chunk into hdf_blobs_
+  void load_chunk();
+  // Moves to the next chunk, in the next file after the last one
+  void next_chunk();
 
   std::vector<std::string> hdf_filenames_;
   unsigned int num_files_;
   unsigned int current_file_;
+  hid_t file_id_;
+  hsize_t file_rows_;
+  hsize_t chunk_rows_;
+  unsigned int current_chunk_;
   hsize_t current_row_;
   std::vector<shared_ptr<Blob<Dtype> > > hdf_blobs_;
   std::vector<unsigned int> data_permutation_;
+  std::vector<unsigned int> chunk_permutation_;
+  // Whether each top holds the values of a sparse matrix, whose column
+  // indices and row offsets the next two tops hold, and the row offsets of
+  // the current chunk of these
+  std::vector<bool> sparse_;
+  std::vector<std::vector<hsize_t> > row_offsets_;
   std::vector<unsigned int> file_permutation_;
+  shared_ptr<Caffe::RNG> prefetch_rng_;
+
+  vector<Rows> prefetch_;
+  BlockingQueue<Rows*> prefetch_free_;
+  BlockingQueue<Rows*> prefetch_full_;
 };
 
 /**
  * @brief Write blobs to disk as HDF5 files.
  *
+ * Each forward appends its rows to the datasets, written on a background
+ * thread from a queue of hdf5_output_param.queue_size batches.
+ *
  * TODO(dox): thorough documentation for Forward and proto params.
  */
 template <typename Dtype>
-class HDF5OutputLayer : public Layer<Dtype> {
+class HDF5OutputLayer : public Layer<Dtype>, public InternalThread {
  public:
   explicit HDF5OutputLayer(const LayerParameter& param)
-      : Layer<Dtype>(param), file_opened_(false) {}
+      : Layer<Dtype>(param), file_opened_(false), rows_(0) {}
   virtual ~HDF5OutputLayer();
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -211,6 +340,8 @@ class HDF5OutputLayer : public Layer<Dtype> {
   virtual inline int ExactNumTopBlobs() const { return 0; }
 
   inline std::string file_name() const { return file_name_; }
+  // Waits until the batches forwarded so far are written to the file
+  void flush();
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -221,13 +352,26 @@ class HDF5OutputLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
-  virtual void SaveBlobs();
+
+  // The data and labels of a batch
+  typedef vector<shared_ptr<Blob<Dtype> > > Rows;
+
+  // Takes a free batch, shaped like the bottoms
+  Rows* free_batch(const vector<Blob<Dtype>*>& bottom);
+  virtual void InternalThreadEntry();
+  // Called on the writer thread
+  virtual void SaveBlobs(const Rows& batch);
 
   bool file_opened_;
   std::string file_name_;
   hid_t file_id_;
-  Blob<Dtype> data_blob_;
-  Blob<Dtype> label_blob_;
+  // Created with the first batch
+  vector<hid_t> dataset_ids_;
+  hsize_t rows_;
+
+  vector<Rows> batches_;
+  BlockingQueue<Rows*> free_;
+  BlockingQueue<Rows*> full_;
 };
 
 /**
@@ -251,10 +395,42 @@ class ImageDataLayer : public BasePrefetchingDataLayer<Dtype> {
  protected:
   shared_ptr<Caffe::RNG> prefetch_rng_;
   virtual void ShuffleImages();
-  virtual void load_batch(Batch<Dtype>* batch);
-
-  vector<std::pair<std::string, int> > lines_;
+  virtual void load_batch(Batch<Dtype>* batch, int loader);
+  virtual inline bool ConcurrentLoadBatch() const { return true; }
+  // Decodes the images, resized to height x width unless 0
+  void decode_images(const vector<std::pair<std::string, int> >& lines,
+                     int height, int width, vector<cv::Mat>* images,
+                     int begin, int end);
+  // Decodes the images of list_ to read their height and width
+  void read_sizes(vector<std::pair<int, int> >* sizes, int begin, int end);
+  // The bucket of the closest aspect ratio, then size, to the image
+  int find_bucket(int height, int width) const;
+  // Reads the files of the lines, still encoded, for gpu_decode
+  void read_files(const vector<std::pair<std::string, int> >& lines,
+                  vector<Datum>* files, int begin, int end);
+  // Fills raw_ for gpu_transform, decoding the images on the GPU with
+  // gpu_decode, unless they are resized
+  void load_raw(Batch<Dtype>* batch,
+                const vector<std::pair<std::string, int> >& lines,
+                int height, int width, DataTransformer<Dtype>* transformer,
+                int loader);
+
+  // The line at the position in the order of the list
+  inline std::pair<std::string, int> line(int id) const {
+    const size_t i = order_.empty() ? id : order_[id];
+    return std::make_pair(list_.name(i), list_.label(i));
+  }
+
+  // The images of the source, and the order of their indices when shuffled
+  ImageList list_;
+  vector<uint32_t> order_;
   int lines_id_;
+  // With buckets, the bucket of each image of the list, and the lines of
+  // each taken for the next batch
+  vector<uint16_t> line_buckets_;
+  vector<vector<std::pair<std::string, int> > > pending_;
+  // Threads of each loader decoding its batches, see decode_threads
+  vector<shared_ptr<ThreadPool> > decode_pools_;
 };
 
 /**
@@ -266,7 +442,8 @@ template <typename Dtype>
 class MemoryDataLayer : public BaseDataLayer<Dtype> {
  public:
   explicit MemoryDataLayer(const LayerParameter& param)
-      : BaseDataLayer<Dtype>(param), has_new_data_(false) {}
+      : BaseDataLayer<Dtype>(param), data_on_gpu_(false), added_(0),
+        has_new_data_(false) {}
   virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
@@ -274,6 +451,9 @@ class MemoryDataLayer : public BaseDataLayer<Dtype> {
   virtual inline int ExactNumBottomBlobs() const { return 0; }
   virtual inline int ExactNumTopBlobs() const { return 2; }
 
+  // Data added while the current data is used is staged in a second buffer,
+  // and replaces it once consumed, so adding can run on another thread than
+  // Forward. One set can be staged at a time.
   virtual void AddDatumVector(const vector<Datum>& datum_vector);
   virtual void AddMatVector(const vector<cv::Mat>& mat_vector,
       const vector<int>& labels);
@@ -281,6 +461,8 @@ class MemoryDataLayer : public BaseDataLayer<Dtype> {
   // Reset should accept const pointers, but can't, because the memory
   //  will be given to Blob, which is mutable
   void Reset(Dtype* data, Dtype* label, int n);
+  // Like Reset with device pointers, which the tops use in place in GPU mode
+  void ResetGPU(Dtype* data, Dtype* label, int n);
   void set_batch_size(int new_size);
 
   int batch_size() { return batch_size_; }
@@ -291,14 +473,21 @@ class MemoryDataLayer : public BaseDataLayer<Dtype> {
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  // Returns the buffer to add to, after checking none is staged
+  int added_buffer(int num);
+  void set_data(Dtype* data, Dtype* labels, int n, bool on_gpu);
 
   int batch_size_, channels_, height_, width_, size_;
   Dtype* data_;
   Dtype* labels_;
+  bool data_on_gpu_;
   int n_;
   size_t pos_;
-  Blob<Dtype> added_data_;
-  Blob<Dtype> added_label_;
+  Blob<Dtype> added_data_[2];
+  Blob<Dtype> added_label_[2];
+  // The buffer last added to, and the buffer staged if any
+  int added_;
+  BlockingQueue<int> staged_;
   bool has_new_data_;
 };
 
@@ -319,11 +508,30 @@ class WindowDataLayer : public BasePrefetchingDataLayer<Dtype> {
 
   virtual inline const char* type() const { return "WindowData"; }
   virtual inline int ExactNumBottomBlobs() const { return 0; }
-  virtual inline int ExactNumTopBlobs() const { return 2; }
+  virtual inline int ExactNumTopBlobs() const {
+    return this->layer_param_.window_data_param().rois_per_image() ? 3 : 2;
+  }
 
  protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
   virtual unsigned int PrefetchRand();
-  virtual void load_batch(Batch<Dtype>* batch);
+  virtual void load_batch(Batch<Dtype>* batch, int loader);
+  // Loads whole images and regions of interest, see rois_per_image
+  void load_roi_batch(Batch<Dtype>* batch);
+  // The tops the batches are read into, the regions and labels together
+  vector<Blob<Dtype>*> batch_top(const vector<Blob<Dtype>*>& top);
+  // Splits the regions and labels of roi_labels_ into their tops
+  void split_rois(const vector<Blob<Dtype>*>& top);
+  // Decodes an image, or takes it from the decoded cache
+  cv::Mat load_image(int index);
+  void warp_window(const vector<float>& window, bool do_mirror,
+                   const cv::Mat& cv_img, int item_id, Dtype* top_data);
+  void warp_windows(const vector<const vector<float>*>& windows,
+                    const vector<bool>& mirrors, const vector<cv::Mat>& images,
+                    Dtype* top_data, int begin, int end);
 
   shared_ptr<Caffe::RNG> prefetch_rng_;
   vector<std::pair<std::string, vector<int> > > image_database_;
@@ -336,6 +544,20 @@ class WindowDataLayer : public BasePrefetchingDataLayer<Dtype> {
   bool has_mean_values_;
   bool cache_images_;
   vector<std::pair<std::string, Datum > > image_database_cache_;
+  int rois_per_image_;
+  // The indices of the windows of each image, and the images with windows
+  vector<vector<int> > image_fg_windows_;
+  vector<vector<int> > image_bg_windows_;
+  vector<int> roi_images_;
+  // The (image, x1, y1, x2, y2, label) rows of the batch
+  Blob<Dtype> roi_labels_;
+
+ private:
+  // Only in the .cpp, see window_data_param.decoded_cache_size
+  class DecodedCache;
+  shared_ptr<DecodedCache> decoded_cache_;
+  // Threads warping the windows of batches, see window_threads
+  shared_ptr<ThreadPool> window_pool_;
 };
 
 }  // namespace caffe
@@ -3,11 +3,13 @@
 
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "caffe/common.hpp"
 #include "caffe/internal_thread.hpp"
 #include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/data_stats.hpp"
 #include "caffe/util/db.hpp"
 
 namespace caffe {
@@ -18,7 +20,15 @@ namespace caffe {
  * are running in parallel, e.g. for multi-GPU training. This makes sure
  * databases are read sequentially, and that each solver accesses a different
  * subset of the database. Data is distributed to solvers in a round-robin
- * way to keep parallel training deterministic.
+ * way to keep parallel training deterministic. With data_param.reader_threads,
+ * the solvers are split between several reading threads, each with its own
+ * cursor, which read the records of their solvers and skip the others.
+ * With data_param.random_access or shuffle_buffer, the cursors read the
+ * records in a random order instead, the same for all of them. With
+ * data_param.mix_source, the cursors mix the records of several sources on
+ * the same thread, each record drawn from a source picked by weight.
+ * When training over several machines, each reads its own share of the
+ * records of each source, see Caffe::node_rank.
  */
 class DataReader {
  public:
@@ -31,6 +41,10 @@ class DataReader {
   inline BlockingQueue<Datum*>& full() const {
     return queue_pair_->full_;
   }
+  // Read and decode times of the datums sent to this reader
+  inline DataStats& stats() const {
+    return queue_pair_->stats_;
+  }
 
  protected:
   // Queue pairs are shared between a body and its readers
@@ -41,6 +55,7 @@ class DataReader {
 
     BlockingQueue<Datum*> free_;
     BlockingQueue<Datum*> full_;
+    DataStats stats_;
 
   DISABLE_COPY_AND_ASSIGN(QueuePair);
   };
@@ -52,11 +67,30 @@ class DataReader {
     virtual ~Body();
 
    protected:
+    // Only in the .cpp, runs a shard after the first
+    class Shard;
+
     void InternalThreadEntry();
+    // A cursor over the sources, mixed, and in the order of random_access
+    // and shuffle_buffer
+    db::Cursor* new_cursor();
     void read_one(db::Cursor* cursor, QueuePair* qp);
+    // Reads the records of the solvers s with s % shards == shard, from the
+    // cursor placed after the first record of each solver
+    void read_shard(db::Cursor* cursor, int shard, int shards,
+                    const vector<shared_ptr<QueuePair> >& qps);
+    void skip_one(db::Cursor* cursor);
 
     const LayerParameter param_;
     BlockingQueue<shared_ptr<QueuePair> > new_queue_pairs_;
+    // The databases of the sources, with random_access the keys of the
+    // records of this machine, over several machines the first key and
+    // number of its records, and the seed of the random order shared by the
+    // cursors
+    vector<shared_ptr<db::DB> > dbs_;
+    vector<shared_ptr<const vector<string> > > keys_;
+    vector<std::pair<string, size_t> > ranges_;
+    unsigned int seed_;
 
     friend class DataReader;
 
@@ -66,7 +100,11 @@ class DataReader {
   // A source is uniquely identified by its layer name + path, in case
   // the same database is read from two different locations in the net.
   static inline string source_key(const LayerParameter& param) {
-    return param.name() + ":" + param.data_param().source();
+    string key = param.name() + ":" + param.data_param().source();
+    for (int i = 0; i < param.data_param().mix_source_size(); ++i) {
+      key += ":" + param.data_param().mix_source(i);
+    }
+    return key;
   }
 
   const shared_ptr<QueuePair> queue_pair_;
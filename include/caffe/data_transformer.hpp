@@ -122,6 +122,66 @@ class DataTransformer {
    *    cv::Mat containing the data to be transformed.
    */
   vector<int> InferBlobShape(const cv::Mat& cv_img);
+  /**
+   * @brief Infers the shape of transformed_blob will have when
+   *    the transformation is applied to the data.
+   *
+   * @param shape
+   *    The channels, height and width of the data, e.g. the raw_shape_ of
+   *    a batch for gpu_transform.
+   */
+  vector<int> InferBlobShape(const vector<int>& shape);
+
+  /**
+   * @brief Draws the crop offsets and mirroring Transform would use for a
+   *    datum of the given size, as (h_off, w_off, mirror) in params.
+   */
+  void TransformParams(int height, int width, int* params);
+
+  /**
+   * @brief Crops windows of an image, warps each to the height and width
+   *    of transformed_blob with bilinear interpolation, as for R-CNN
+   *    detection, and subtracts the mean and scales them. Runs on the GPU
+   *    in GPU mode.
+   *
+   * @param image
+   *    A blob of 1 x channels x height x width holding the image.
+   * @param windows
+   *    The ymin, xmin, ymax and xmax of each window, the ends excluded, one
+   *    window per item of transformed_blob.
+   * @param context_pad
+   *    If positive, each window grows so that a border of context_pad
+   *    pixels of the warped window is context around it, and the part of
+   *    it outside the image is the mean, as detector.py does.
+   */
+  void TransformWindows(const Blob<Dtype>& image, const vector<int>& windows,
+      int context_pad, Blob<Dtype>* transformed_blob);
+
+  /**
+   * @brief Subtracts mean, of channels x height x width of the transformed
+   *    items, in TransformWindows, in place of a mean_file.
+   */
+  void SetMean(const Blob<Dtype>& mean);
+
+#ifndef CPU_ONLY
+  /**
+   * @brief Transforms a batch of uint8 pixels on the GPU.
+   *
+   * @param shape
+   *    The channels, height and width of each item of data.
+   * @param data
+   *    The pixels of transformed_blob->num() items, in GPU memory.
+   * @param params
+   *    The crop offsets and mirroring of each item, from TransformParams,
+   *    in GPU memory.
+   */
+  void Transform_gpu(const vector<int>& shape, const uint8_t* data,
+                     const int* params, Blob<Dtype>* transformed_blob);
+  // Warps the windows of TransformWindows on the GPU, their regions of the
+  // image and of the items given by params, 8 values per window.
+  void TransformWindows_gpu(const Blob<Dtype>& image, const int* params,
+      const Dtype* mean, bool mean_per_pixel, Blob<Dtype>* transformed_blob);
+#endif
 
  protected:
    /**
@@ -135,6 +195,8 @@ class DataTransformer {
   virtual int Rand(int n);
 
   void Transform(const Datum& datum, Dtype* transformed_data);
+  // Fills mean_values_blob_ with the mean_value of each of channels.
+  void MeanValues(int channels);
   // Tranformation parameters
   TransformationParameter param_;
 
@@ -143,6 +205,8 @@ class DataTransformer {
   Phase phase_;
   Blob<Dtype> data_mean_;
   vector<Dtype> mean_values_;
+  // A value per channel, for Transform_gpu and TransformWindows
+  Blob<Dtype> mean_values_blob_;
 };
 
 }  // namespace caffe
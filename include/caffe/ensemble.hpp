@@ -0,0 +1,60 @@
+#ifndef CAFFE_ENSEMBLE_HPP_
+#define CAFFE_ENSEMBLE_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Runs the nets of an ensemble on the same inputs, preprocessed
+ * once: the first input blob of each net shares the data of the input blob
+ * of the ensemble. The nets run concurrently, a thread each, on the
+ * streams of their nets in GPU mode (see cuda_stream), and the weighted
+ * average of their first outputs is computed on the device.
+ *
+ * The nets must not change their input, e.g. with layers in place on it or
+ * input_bucket, and their first outputs must have the same shape.
+ */
+template <typename Dtype>
+class Ensemble {
+ public:
+  /// The weights of the nets in the average, equal by default
+  explicit Ensemble(const vector<shared_ptr<Net<Dtype> > >& nets,
+                    const vector<float>& weights = vector<float>());
+  ~Ensemble();
+
+  /// Takes the inputs, of the shape of the inputs of the nets by default
+  inline Blob<Dtype>* input() { return &input_; }
+  /// Runs the nets on the input and returns the average of their outputs
+  const Blob<Dtype>& Forward();
+
+  inline const vector<shared_ptr<Net<Dtype> > >& nets() const {
+    return nets_;
+  }
+
+ protected:
+  // Runs the forward passes of a net, on a thread of its own
+  void Work(int net, int device, int rand_seed, int cpu_threads);
+
+  /**
+   Move synchronization fields out instead of including boost/thread.hpp
+   to avoid a boost/NVCC issues (#1009, #1010) on OSX.
+   */
+  class sync;
+
+  vector<shared_ptr<Net<Dtype> > > nets_;
+  vector<Dtype> weights_;
+  Blob<Dtype> input_;
+  Blob<Dtype> output_;
+  shared_ptr<sync> sync_;
+
+DISABLE_COPY_AND_ASSIGN(Ensemble);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_ENSEMBLE_HPP_
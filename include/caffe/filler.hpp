@@ -1,6 +1,8 @@
 // Fillers are random number generators that fills a blob using the specified
 // algorithm. The expectation is that they are only going to be used during
-// initialization time and will not involve any GPUs.
+// initialization time. The uniform and Gaussian values of large blobs are
+// drawn by the threads of the pool or, in GPU mode, on the GPU, where the
+// blob is then used, rather than by a single CPU thread.
 
 #ifndef CAFFE_FILLER_HPP
 #define CAFFE_FILLER_HPP
@@ -12,6 +14,7 @@
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/syncedmem.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 namespace caffe {
 
@@ -23,6 +26,45 @@ class Filler {
   virtual ~Filler() {}
   virtual void Fill(Blob<Dtype>* blob) = 0;
  protected:
+  // Blobs smaller than this keep the values of the sequential generator, and
+  // so of the seeds used so far; larger ones are filled from the key of a
+  // PhiloxRNG drawn from it, the same values whatever the number of threads.
+  static const int kParallelFillCount = kParallelGrain;
+
+  void FillUniform(Blob<Dtype>* blob, const Dtype a, const Dtype b) {
+    const int count = blob->count();
+    if (count < kParallelFillCount) {
+      caffe_rng_uniform<Dtype>(count, a, b, blob->mutable_cpu_data());
+      return;
+    }
+#ifndef CPU_ONLY
+    if (Caffe::mode() == Caffe::GPU) {
+      caffe_gpu_philox_uniform<Dtype>(count, a, b, caffe_rng_key(),
+          blob->mutable_gpu_data());
+      return;
+    }
+#endif
+    caffe_philox_uniform<Dtype>(count, a, b, caffe_rng_key(),
+        blob->mutable_cpu_data());
+  }
+
+  void FillGaussian(Blob<Dtype>* blob, const Dtype mean, const Dtype std) {
+    const int count = blob->count();
+    if (count < kParallelFillCount) {
+      caffe_rng_gaussian<Dtype>(count, mean, std, blob->mutable_cpu_data());
+      return;
+    }
+#ifndef CPU_ONLY
+    if (Caffe::mode() == Caffe::GPU) {
+      caffe_gpu_philox_gaussian<Dtype>(count, mean, std, caffe_rng_key(),
+          blob->mutable_gpu_data());
+      return;
+    }
+#endif
+    caffe_philox_gaussian<Dtype>(count, mean, std, caffe_rng_key(),
+        blob->mutable_cpu_data());
+  }
+
   FillerParameter filler_param_;
 };  // class Filler
 
@@ -54,8 +96,8 @@ class UniformFiller : public Filler<Dtype> {
       : Filler<Dtype>(param) {}
   virtual void Fill(Blob<Dtype>* blob) {
     CHECK(blob->count());
-    caffe_rng_uniform<Dtype>(blob->count(), Dtype(this->filler_param_.min()),
-        Dtype(this->filler_param_.max()), blob->mutable_cpu_data());
+    this->FillUniform(blob, Dtype(this->filler_param_.min()),
+        Dtype(this->filler_param_.max()));
     CHECK_EQ(this->filler_param_.sparse(), -1)
          << "Sparsity not supported by this Filler.";
   }
@@ -68,10 +110,9 @@ class GaussianFiller : public Filler<Dtype> {
   explicit GaussianFiller(const FillerParameter& param)
       : Filler<Dtype>(param) {}
   virtual void Fill(Blob<Dtype>* blob) {
-    Dtype* data = blob->mutable_cpu_data();
     CHECK(blob->count());
-    caffe_rng_gaussian<Dtype>(blob->count(), Dtype(this->filler_param_.mean()),
-        Dtype(this->filler_param_.std()), blob->mutable_cpu_data());
+    this->FillGaussian(blob, Dtype(this->filler_param_.mean()),
+        Dtype(this->filler_param_.std()));
     int sparse = this->filler_param_.sparse();
     CHECK_GE(sparse, -1);
     if (sparse >= 0) {
@@ -85,6 +126,7 @@ class GaussianFiller : public Filler<Dtype> {
       rand_vec_.reset(new SyncedMemory(blob->count() * sizeof(int)));
       int* mask = reinterpret_cast<int*>(rand_vec_->mutable_cpu_data());
       caffe_rng_bernoulli(blob->count(), non_zero_probability, mask);
+      Dtype* data = blob->mutable_cpu_data();
       for (int i = 0; i < blob->count(); ++i) {
         data[i] *= mask[i];
       }
@@ -159,8 +201,7 @@ class XavierFiller : public Filler<Dtype> {
       n = fan_out;
     }
     Dtype scale = sqrt(Dtype(3) / n);
-    caffe_rng_uniform<Dtype>(blob->count(), -scale, scale,
-        blob->mutable_cpu_data());
+    this->FillUniform(blob, -scale, scale);
     CHECK_EQ(this->filler_param_.sparse(), -1)
          << "Sparsity not supported by this Filler.";
   }
@@ -201,8 +242,7 @@ class MSRAFiller : public Filler<Dtype> {
       n = fan_out;
     }
     Dtype std = sqrt(Dtype(2) / n);
-    caffe_rng_gaussian<Dtype>(blob->count(), Dtype(0), std,
-        blob->mutable_cpu_data());
+    this->FillGaussian(blob, Dtype(0), std);
     CHECK_EQ(this->filler_param_.sparse(), -1)
          << "Sparsity not supported by this Filler.";
   }
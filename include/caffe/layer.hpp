@@ -10,6 +10,7 @@
 #include "caffe/layer_factory.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/device_alternate.hpp"
+#include "caffe/util/nvtx.hpp"
 
 /**
  Forward declare boost::thread instead of including boost/thread.hpp
@@ -67,7 +68,15 @@ class Layer {
   void SetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
     InitMutex();
+#ifdef USE_NVTX
+    nvtx_forward_ = layer_param_.name() + " " + type() + " forward";
+    nvtx_backward_ = layer_param_.name() + " " + type() + " backward";
+#endif
     CheckBlobCounts(bottom, top);
+    for (int i = 0; i < bottom.size(); ++i) {
+      CHECK(bottom[i]->layout() == NCHW || AllowNHWC()) << type()
+          << " Layer does not take NHWC bottom blobs.";
+    }
     LayerSetUp(bottom, top);
     Reshape(bottom, top);
     SetLossWeights(top);
@@ -139,6 +148,9 @@ class Layer {
    * @param top
    *     the preshaped output blobs, whose data fields will store this layers'
    *     outputs
+   * @param gpu_loss
+   *     optional; in GPU mode, a value in device memory the loss is added to
+   *     instead of being returned, so that the call does not wait for the GPU
    * \return The total loss from the layer.
    *
    * The Forward wrapper calls the relevant device wrapper function
@@ -149,7 +161,15 @@ class Layer {
    * Your layer should implement Forward_cpu and (optionally) Forward_gpu.
    */
   inline Dtype Forward(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top);
+      const vector<Blob<Dtype>*>& top, Dtype* gpu_loss = NULL);
+
+  /**
+   * @brief As Forward, but without calling Reshape first, when the bottom
+   *        blobs kept the shapes of the last Reshape. Net uses it with
+   *        NetParameter.static_shapes.
+   */
+  inline Dtype ForwardReshaped(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top, Dtype* gpu_loss = NULL);
 
   /**
    * @brief Given the top blob error gradients, compute the bottom blob error
@@ -188,6 +208,21 @@ class Layer {
    */
   const LayerParameter& layer_param() const { return layer_param_; }
 
+  /**
+   * @brief Returns the mode the layer runs in: that of its
+   *        LayerParameter.device if set, or else the mode of Caffe.
+   */
+  inline Caffe::Brew mode() const {
+    switch (layer_param_.device()) {
+    case LayerParameter_Device_CPU:
+      return Caffe::CPU;
+    case LayerParameter_Device_GPU:
+      return Caffe::GPU;
+    default:
+      return Caffe::mode();
+    }
+  }
+
   /**
    * @brief Writes the layer parameter to a protocol buffer
    */
@@ -294,6 +329,129 @@ class Layer {
     return true;
   }
 
+  /**
+   * @brief Returns whether the top blobs share the data of the first bottom
+   *        blob instead of holding their own.
+   *
+   * Net needs to know it to reuse the memory of blobs that are no longer
+   * needed, see NetParameter.reuse_activations.
+   */
+  virtual inline bool SharesBottomData() const { return false; }
+
+  /**
+   * @brief Returns whether the layer currently computes its tops without
+   *        reading its bottoms, having cached them, e.g. FeatureCache.
+   *
+   * Net then skips the forward of the layers only computing the bottoms.
+   */
+  virtual inline bool BottomsCached() const { return false; }
+
+  /**
+   * @brief Returns, for a param whose gradient only touches some of its rows
+   *        (the slices along its first axis), e.g. a lookup table, the rows
+   *        Backward added to since ClearParamRows, or NULL for a param with
+   *        a dense gradient.
+   *
+   * Net then clears, and solvers update, only those rows of the diff, the
+   * others being zero.
+   */
+  virtual inline const vector<int>* param_rows(const int param_id) const {
+    return NULL;
+  }
+  /// @brief Forgets the rows of param_rows, once their diffs are cleared.
+  virtual void ClearParamRows(const int param_id) {}
+
+  /**
+   * @brief Returns the number of arithmetic operations of Forward for the
+   *        given blobs, which Net reports when profiling. Defaults to one
+   *        per top element, none for layers sharing the data of their bottom.
+   */
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    double flops = 0;
+    for (int i = 0; i < top.size() && !SharesBottomData(); ++i) {
+      flops += top[i]->count();
+    }
+    return flops;
+  }
+  /**
+   * @brief Returns the number of arithmetic operations of Backward. Defaults
+   *        to twice those of Forward, for the gradients w.r.t. the bottoms
+   *        and those w.r.t. the params.
+   */
+  virtual inline double BackwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return 2 * ForwardFlops(bottom, top);
+  }
+  /**
+   * @brief Returns the bytes Forward reads from and writes to memory, which
+   *        with the FLOPs place a layer on a roofline. Defaults to reading the
+   *        bottoms and params once and writing the tops once, nothing for
+   *        layers sharing the data of their bottom.
+   */
+  virtual inline double ForwardBytes(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    if (SharesBottomData()) {
+      return 0;
+    }
+    double count = 0;
+    for (int i = 0; i < bottom.size(); ++i) {
+      count += bottom[i]->count();
+    }
+    for (int i = 0; i < top.size(); ++i) {
+      count += top[i]->count();
+    }
+    for (int i = 0; i < blobs_.size(); ++i) {
+      count += blobs_[i]->count();
+    }
+    return count * sizeof(Dtype);
+  }
+  /**
+   * @brief Returns the bytes Backward reads from and writes to memory.
+   *        Defaults to twice those of Forward, the diffs moving alongside
+   *        the data.
+   */
+  virtual inline double BackwardBytes(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return 2 * ForwardBytes(bottom, top);
+  }
+
+  /**
+   * @brief Returns whether Backward can add the gradient w.r.t. the bottom
+   *        blob at the given index to its diff, instead of overwriting it,
+   *        when set_accumulate_bottom_diff asks for it.
+   *
+   * Net uses it to let several layers reading one blob add their gradients
+   * into its diff, see NetParameter.accumulate_split_diffs.
+   */
+  virtual inline bool AllowAccumulateBottomDiff(const int bottom_index) const {
+    return false;
+  }
+  /**
+   * @brief Returns whether the layer computes on NHWC bottom blobs, its tops
+   *        then being NHWC too, see NetParameter.layout.
+   */
+  virtual inline bool AllowNHWC() const { return false; }
+  /// @brief Whether Backward adds to the diff of the given bottom blob.
+  inline bool accumulate_bottom_diff(const int bottom_index) const {
+    return (accumulate_bottom_diff_.size() > bottom_index) ?
+        accumulate_bottom_diff_[bottom_index] : false;
+  }
+  /**
+   * @brief Sets whether Backward adds the gradient w.r.t. the bottom blob at
+   *        the given index to its diff, which the layer must allow.
+   */
+  inline void set_accumulate_bottom_diff(const int bottom_index,
+      const bool value) {
+    CHECK(!value || AllowAccumulateBottomDiff(bottom_index))
+        << type() << " Layer cannot accumulate the diff of bottom "
+        << bottom_index;
+    if (accumulate_bottom_diff_.size() <= bottom_index) {
+      accumulate_bottom_diff_.resize(bottom_index + 1, false);
+    }
+    accumulate_bottom_diff_[bottom_index] = value;
+  }
+
   /**
    * @brief Specifies whether the layer should compute gradients w.r.t. a
    *        parameter at a particular index given by param_id.
@@ -326,6 +484,8 @@ class Layer {
   vector<shared_ptr<Blob<Dtype> > > blobs_;
   /** Vector indicating whether to compute the diff of each param blob. */
   vector<bool> param_propagate_down_;
+  /** Vector indicating whether Backward adds to the diff of each bottom. */
+  vector<bool> accumulate_bottom_diff_;
 
   /** The vector that indicates whether each top blob has a non-zero weight in
    *  the objective function. */
@@ -431,11 +591,21 @@ class Layer {
   /** Whether this layer is actually shared by other nets*/
   bool is_shared_;
 
+#ifdef USE_NVTX
+  /** The names of the NVTX ranges of Forward and Backward */
+  string nvtx_forward_;
+  string nvtx_backward_;
+#endif
+
   /** The mutex for sequential forward if this layer is shared */
   shared_ptr<boost::mutex> forward_mutex_;
 
   /** Initialize forward_mutex_ */
   void InitMutex();
+  /** Forward_cpu or Forward_gpu by mode, returning the weighted loss */
+  Dtype ForwardByMode(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top, Dtype* gpu_loss);
+
   /** Lock forward_mutex_ if this layer is shared */
   void Lock();
   /** Unlock forward_mutex_ if this layer is shared */
@@ -449,12 +619,30 @@ class Layer {
 // functions.
 template <typename Dtype>
 inline Dtype Layer<Dtype>::Forward(const vector<Blob<Dtype>*>& bottom,
-    const vector<Blob<Dtype>*>& top) {
+    const vector<Blob<Dtype>*>& top, Dtype* gpu_loss) {
   // Lock during forward to ensure sequential forward
   Lock();
-  Dtype loss = 0;
   Reshape(bottom, top);
-  switch (Caffe::mode()) {
+  const Dtype loss = ForwardByMode(bottom, top, gpu_loss);
+  Unlock();
+  return loss;
+}
+
+template <typename Dtype>
+inline Dtype Layer<Dtype>::ForwardReshaped(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top, Dtype* gpu_loss) {
+  Lock();
+  const Dtype loss = ForwardByMode(bottom, top, gpu_loss);
+  Unlock();
+  return loss;
+}
+
+template <typename Dtype>
+inline Dtype Layer<Dtype>::ForwardByMode(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top, Dtype* gpu_loss) {
+  NVTX_RANGE(nvtx_forward_);
+  Dtype loss = 0;
+  switch (mode()) {
   case Caffe::CPU:
     Forward_cpu(bottom, top);
     for (int top_id = 0; top_id < top.size(); ++top_id) {
@@ -473,6 +661,10 @@ inline Dtype Layer<Dtype>::Forward(const vector<Blob<Dtype>*>& bottom,
       const int count = top[top_id]->count();
       const Dtype* data = top[top_id]->gpu_data();
       const Dtype* loss_weights = top[top_id]->gpu_diff();
+      if (gpu_loss) {
+        caffe_gpu_dot_add(count, data, loss_weights, gpu_loss);
+        continue;
+      }
       Dtype blob_loss = 0;
       caffe_gpu_dot(count, data, loss_weights, &blob_loss);
       loss += blob_loss;
@@ -482,7 +674,6 @@ inline Dtype Layer<Dtype>::Forward(const vector<Blob<Dtype>*>& bottom,
   default:
     LOG(FATAL) << "Unknown caffe mode.";
   }
-  Unlock();
   return loss;
 }
 
@@ -490,7 +681,8 @@ template <typename Dtype>
 inline void Layer<Dtype>::Backward(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down,
     const vector<Blob<Dtype>*>& bottom) {
-  switch (Caffe::mode()) {
+  NVTX_RANGE(nvtx_backward_);
+  switch (mode()) {
   case Caffe::CPU:
     Backward_cpu(top, propagate_down, bottom);
     break;
@@ -135,6 +135,19 @@ class LayerRegisterer {
   }                                                                            \
   REGISTER_LAYER_CREATOR(type, Creator_##type##Layer)
 
+// The layers an engine of AUTO may create, the engine set in each, the first
+// created until Net::Init times them: empty unless the layer's engine is AUTO.
+template <typename Dtype>
+vector<LayerParameter> EngineCandidates(const LayerParameter& param);
+
+// Gets the engine Net::Init timed fastest for a key, naming the layer's
+// params, shapes and device, if this process or the cache file already did.
+bool GetCachedEngine(const string& key, int* engine);
+// Remembers the engine timed fastest, adding it to the cache file if set.
+void CacheEngine(const string& key, int engine);
+// Loads the engines cached in the file, which then keeps later ones.
+void SetEngineCacheFile(const string& path);
+
 }  // namespace caffe
 
 #endif  // CAFFE_LAYER_FACTORY_H_
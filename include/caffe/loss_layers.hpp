@@ -68,6 +68,10 @@ class AccuracyLayer : public Layer<Dtype> {
    */
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  /// @brief Ranks the labels and reduces to the accuracy on the GPU, without
+  ///        copying the predictions to the host.
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
 
 
   /// @brief Not implemented -- AccuracyLayer cannot be used as a loss.
@@ -86,6 +90,9 @@ class AccuracyLayer : public Layer<Dtype> {
   bool has_ignore_label_;
   /// The label indicating that an instance should be ignored.
   int ignore_label_;
+  /// In GPU mode, whether each instance is correct, and counted
+  Blob<Dtype> correct_;
+  Blob<Dtype> counted_;
 };
 
 /**
@@ -356,6 +363,8 @@ class HingeLossLayer : public LossLayer<Dtype> {
   /// @copydoc HingeLossLayer
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
 
   /**
    * @brief Computes the hinge loss error gradient w.r.t. the predictions.
@@ -386,6 +395,8 @@ class HingeLossLayer : public LossLayer<Dtype> {
    */
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 };
 
 /**
@@ -443,6 +454,8 @@ class InfogainLossLayer : public LossLayer<Dtype> {
   /// @copydoc InfogainLossLayer
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
 
   /**
    * @brief Computes the infogain loss error gradient w.r.t. the predictions.
@@ -478,6 +491,8 @@ class InfogainLossLayer : public LossLayer<Dtype> {
    */
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
   Blob<Dtype> infogain_;
 };
@@ -525,6 +540,8 @@ class MultinomialLogisticLossLayer : public LossLayer<Dtype> {
   /// @copydoc MultinomialLogisticLossLayer
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
 
   /**
    * @brief Computes the multinomial logistic loss error gradient w.r.t. the
@@ -556,6 +573,8 @@ class MultinomialLogisticLossLayer : public LossLayer<Dtype> {
    */
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 };
 
 /**
@@ -759,10 +778,88 @@ class SoftmaxWithLossLayer : public LossLayer<Dtype> {
   /// Whether to normalize the loss by the total number of values present
   /// (otherwise just by the batch size).
   bool normalize_;
+  /// Whether Forward_gpu already computed the gradient, which it does when
+  /// training, and the loss weight over normalizer_ it was scaled by.
+  bool fused_diff_;
+  Dtype fused_scale_;
+  /// The number of labels (or the batch size) the loss was divided by.
+  Dtype normalizer_;
 
   int softmax_axis_, outer_num_, inner_num_;
 };
 
+/**
+ * @brief Computes the inner product of its input with the weights of a large
+ *        number of classes and the softmax loss of these logits, computing
+ *        when training only the logits of the classes of the batch's labels
+ *        and of a few sampled others.
+ *
+ * Its weights and bias have the shapes of those of an InnerProductLayer with
+ * the same inner_product_param, so that a model trained with this layer can
+ * be deployed with an InnerProductLayer (and a SoftmaxLayer), and vice versa.
+ * When training, the sampled logits are offset by minus the log of the
+ * expected number of times their class is drawn, so that the loss estimates
+ * that of the full softmax. At test it computes the full softmax loss.
+ *
+ * @param bottom input Blob vector (length 2)
+ *   -# @f$ (N \times C \times H \times W) @f$
+ *      the features, flattened from inner_product_param.axis on
+ *   -# @f$ (N \times 1 \times 1 \times 1) @f$
+ *      the labels, in @f$ [0, num\_output - 1] @f$
+ * @param top output Blob vector (length 1)
+ *   -# @f$ (1 \times 1 \times 1 \times 1) @f$
+ *      the cross-entropy loss, as for SoftmaxWithLossLayer
+ */
+template <typename Dtype>
+class SampledSoftmaxWithLossLayer : public LossLayer<Dtype> {
+ public:
+  explicit SampledSoftmaxWithLossLayer(const LayerParameter& param)
+      : LossLayer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "SampledSoftmaxWithLoss"; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  /// Draws the classes whose logits to compute into candidates_, with their
+  /// offsets in offsets_, and maps labels_ to their position among them.
+  void Sample(const Dtype* label);
+
+  int M_;
+  int K_;
+  int N_;
+  bool bias_term_;
+  bool sampling_;
+  Blob<Dtype> bias_multiplier_;
+  /// The classes of the labels followed by the sampled ones when training.
+  Blob<int> candidates_;
+  /// Minus the log of the expected number of draws of each candidate.
+  Blob<Dtype> offsets_;
+  /// The weights and the bias plus offset of the candidates.
+  Blob<Dtype> sampled_weight_;
+  Blob<Dtype> sampled_bias_;
+  /// The logits of the candidates, or of all classes at test.
+  Blob<Dtype> logits_;
+  /// The labels as positions among the candidates, -1 for ignored ones.
+  Blob<Dtype> labels_;
+  /// The position of each class among the candidates, or -1.
+  vector<int> position_;
+  /// The internal SoftmaxWithLossLayer computing the loss of the logits.
+  shared_ptr<SoftmaxWithLossLayer<Dtype> > softmax_loss_layer_;
+  vector<Blob<Dtype>*> softmax_loss_bottom_vec_;
+};
+
 }  // namespace caffe
 
 #endif  // CAFFE_LOSS_LAYERS_HPP_
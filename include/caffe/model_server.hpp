@@ -0,0 +1,66 @@
+#ifndef CAFFE_MODEL_SERVER_HPP_
+#define CAFFE_MODEL_SERVER_HPP_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/batcher.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+
+namespace caffe {
+
+class Socket;
+
+/**
+ * @brief Serves the forward passes of nets over HTTP, the items of
+ * concurrent requests batched together by a Batcher per instance of a net.
+ *
+ * Requests:
+ *   - POST /models/NAME with a body of items of the input blob of the model,
+ *     as floats in host order, answers the values of the outputs of each
+ *     item one after the other, as Batcher::Process.
+ *   - GET /models lists the models with the sizes of their items.
+ *   - GET /metrics answers the counts of requests, items and batches, and
+ *     histograms of the latency of requests, in the Prometheus text format.
+ */
+class ModelServer {
+ public:
+  ModelServer(int max_batch, int max_delay_us);
+  ~ModelServer();
+
+  /**
+   * @brief Loads a TEST net of the model and weights on each device, -1
+   * for the CPU. Each device runs instances inference contexts sharing its
+   * weights, so that the batches of one run while the next fill. They are
+   * warmed up with a full batch before this returns.
+   */
+  void AddModel(const string& name, const string& model,
+                const string& weights, const vector<int>& devices,
+                int instances);
+  /// Accepts connections on the port, a thread each, and never returns
+  void Serve(int port);
+  /// The HTTP status, content type and body of the response to a request
+  int Handle(const string& method, const string& path, const string& body,
+             string* content_type, string* response);
+
+ protected:
+  // Only in the .cpp, see Batcher
+  struct Model;
+
+  // Answers the requests of a connection, until the client closes it
+  void Connection(shared_ptr<Socket> socket);
+  int Predict(Model* model, const string& body, string* response);
+  string Metrics();
+
+  const int max_batch_;
+  const int max_delay_us_;
+  std::map<string, shared_ptr<Model> > models_;
+
+DISABLE_COPY_AND_ASSIGN(ModelServer);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_MODEL_SERVER_HPP_
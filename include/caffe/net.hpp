@@ -11,9 +11,14 @@
 #include "caffe/common.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/array_stats.hpp"
 
 namespace caffe {
 
+class MappedFile;
+class EventTimer;
+class Timer;
+
 /**
  * @brief Connects Layer%s together into a directed acyclic graph (DAG)
  *        specified by a NetParameter.
@@ -26,7 +31,7 @@ class Net {
   explicit Net(const NetParameter& param, const Net* root_net = NULL);
   explicit Net(const string& param_file, Phase phase,
       const Net* root_net = NULL);
-  virtual ~Net() {}
+  virtual ~Net();
 
   /// @brief Initialize a network with a NetParameter.
   void Init(const NetParameter& param);
@@ -49,6 +54,21 @@ class Net {
   Dtype ForwardFromTo(int start, int end);
   Dtype ForwardFrom(int start);
   Dtype ForwardTo(int end);
+  /// @brief The number of stages of the net, 1 unless split by
+  ///        NetParameter.pipeline, and the GPU of each in GPU mode.
+  inline int num_stages() const { return stage_begin_.size() - 1; }
+  inline int stage_device(int stage) const { return stage_devices_[stage]; }
+  /**
+   * @brief Runs the forward, or backward, of the layers of one stage on the
+   *        calling thread, which must be on the GPU of the stage, e.g. its
+   *        DeviceThread. ForwardFromTo and BackwardFromTo run the stages on
+   *        the DeviceThread of their GPUs one after the other.
+   */
+  Dtype ForwardStage(int stage);
+  void BackwardStage(int stage);
+  /// @brief The number of layers at the start of the net reading no params
+  ///        with a non-zero lr_mult, which can run during an update.
+  int FrozenPrefix() const;
   /// @brief Run forward using a set of bottom blobs, and return the result.
   const vector<Blob<Dtype>*>& Forward(const vector<Blob<Dtype>* > & bottom,
       Dtype* loss = NULL);
@@ -78,7 +98,9 @@ class Net {
    * @brief Reshape all layers from bottom to top.
    *
    * This is useful to propagate changes to layer sizes without running
-   * a forward pass, e.g. to compute output feature size.
+   * a forward pass, e.g. to compute output feature size. Layers whose bottoms
+   * kept their shapes since they last reshaped are skipped, as they are in
+   * forward passes.
    */
   void Reshape();
 
@@ -98,12 +120,143 @@ class Net {
    * called manually.
    */
   void ShareWeights();
+  /**
+   * @brief Lets the tops of the splits read by layers able to accumulate
+   *        their bottom diff share the diff of the split bottom, if the net
+   *        was configured to accumulate_split_diffs.
+   *
+   * Backward then needs to run all the layers reading the split. Note: this
+   * is called by Net::Init, and thus should normally not be called manually.
+   */
+  void AccumulateSplitDiffs();
+  /**
+   * @brief Lets blobs with disjoint lifetimes in a forward pass share memory,
+   *        if the net was configured to reuse activations.
+   *
+   * Note: this is called by Net::Init and Net::Reshape, and thus should
+   * normally not be called manually.
+   */
+  void ReuseActivations();
+  /**
+   * @brief Lets the activations of layers marked for recompute share memory
+   *        between segments, as they get recomputed before backward.
+   *
+   * Note: this is called by Net::Init and Net::Reshape, and thus should
+   * normally not be called manually.
+   */
+  void SetUpRecompute();
+  /**
+   * @brief Finds the blobs computed by layers marked for offload, to copy to
+   *        the host after their last forward reader while sharing their GPU
+   *        memory, and back before its backward.
+   *
+   * Note: this is called by Net::Init and Net::Reshape, and thus should
+   * normally not be called manually.
+   */
+  void SetUpOffload();
+  /**
+   * @brief Finds the blobs passed between layers running on different
+   *        devices (see LayerParameter.device), to copy right after the
+   *        layer computing their data, or diffs, on a stream of their own.
+   *
+   * Note: this is called by Net::Init, and thus should normally not be
+   * called manually.
+   */
+  void SetUpPlacement();
+  /**
+   * @brief Makes the params the same memory as the params of the same shape
+   *        and values other nets already made theirs, if dedup_weights is
+   *        set.
+   *
+   * Note: this is called by Net::CopyTrainedLayersFrom, and thus should
+   * normally not be called manually.
+   */
+  void DedupWeights();
+  /**
+   * @brief Finds the learnable params with a zero lr_mult and no layer
+   *        computing their diff, which are then never updated, nor their
+   *        diffs cleared, allocated or synchronized across solvers.
+   *
+   * Note: this is called by Net::Init, and thus should normally not be
+   * called manually.
+   */
+  void FreezeParams(bool force_backward);
+  /**
+   * @brief Lays out the data and diffs of the params updated, neither frozen,
+   *        shared in parallel nor row-sparse, contiguously in flat_params_, in
+   *        the order of the buffers of Params, for ClearParamDiffs and Update
+   *        to make a single call over all of them.
+   *
+   * Note: this is called by Net::Init, and thus should normally not be
+   * called manually.
+   */
+  void LayOutParams();
+  /// Whether the params updated are still laid out in flat_params_, which
+  /// e.g. Params replacing their memory ends
+  bool params_flat() const;
+  /// Gathers the param_rows of the row-sparse params from their layers
+  void GatherParamRows();
+  /// Clears the diff of a row-sparse param in its param_rows only
+  void ClearParamRows(const int learnable_param_id);
+  /**
+   * @brief Records the shapes of the bottoms each layer was reshaped for, to
+   *        skip reshaping it until one of them changes shape, and finds the
+   *        layers to reshape on every pass. Takes the current shapes of the
+   *        blobs as fixed if the net was configured with static_shapes.
+   *
+   * Note: this is called by Net::Init and Net::Reshape, and thus should
+   * normally not be called manually.
+   */
+  void TrackShapes();
+  /**
+   * @brief Finds the layers only computing the bottoms of FeatureCache
+   *        layers, which forward passes skip once these have cached them.
+   *
+   * Note: this is called by Net::Init, and thus should normally not be
+   * called manually.
+   */
+  void SetUpCachedLayers();
+  /**
+   * @brief Finds the layers each layer depends on, to run independent layers
+   *        at the same time if the net was configured with branch_threads.
+   *
+   * Note: this is called by Net::Init, and thus should normally not be
+   * called manually.
+   */
+  void SetUpBranches(int threads);
 
   /**
    * @brief For an already initialized net, implicitly copies (i.e., using no
    *        additional memory) the pre-trained layers from another Net.
    */
   void ShareTrainedLayersWith(const Net* other);
+  /**
+   * @brief For an already initialized net, copies the values of the
+   *        pre-trained layers of another Net, which may be on another device,
+   *        so that they no longer change with it.
+   */
+  void CopyTrainedLayersFrom(const Net* other);
+  /**
+   * @brief Creates a TEST net that shares the weights of this net and only
+   *        owns its activations, to run forward passes concurrently with
+   *        this net and other contexts, one thread each, on a single copy
+   *        of the weights.
+   *
+   * The weights are synced to the device of the current mode first, so that
+   * contexts only read them. They must not be changed while contexts run.
+   */
+  shared_ptr<Net<Dtype> > CreateInferenceContext() const;
+  /**
+   * @brief Runs a forward pass on zeroed inputs of the given shapes, one per
+   *        input blob, or of their current shapes if none are given, so
+   *        that the first real pass is not slowed by allocating blobs,
+   *        choosing cuDNN algorithms and loading kernels.
+   *
+   * The inputs keep the shapes. Warm up the largest shapes served first, as
+   * smaller ones then reuse their memory. Data layers read a batch.
+   */
+  void WarmUp(const vector<vector<int> >& input_shapes =
+              vector<vector<int> >());
   // For an already initialized net, CopyTrainedLayersFrom() copies the already
   // trained layers from another net parameter instance.
   /**
@@ -111,13 +264,35 @@ class Net {
    *        another Net.
    */
   void CopyTrainedLayersFrom(const NetParameter& param);
+  /**
+   * @brief Copies the pre-trained layers of a file, by its extension a
+   *        mapped weights file, an HDF5 file or a binary NetParameter, then
+   *        shares the params of nets with dedup_weights.
+   */
   void CopyTrainedLayersFrom(const string trained_filename);
+  /**
+   * @brief Copies the layers of a binary NetParameter, streaming its layers
+   *        and their blobs into the net rather than reading it as a whole,
+   *        unless it has to be upgraded.
+   */
   void CopyTrainedLayersFromBinaryProto(const string trained_filename);
   void CopyTrainedLayersFromHDF5(const string trained_filename);
+  /**
+   * @brief Copies the layers of a mapped weights file, see
+   *        WriteMappedWeights. Nets of floats use the values in place, the
+   *        file staying mapped as long as the net exists.
+   */
+  void CopyTrainedLayersFromMapped(const string trained_filename);
   /// @brief Writes the net to a proto.
   void ToProto(NetParameter* param, bool write_diff = false) const;
+  /// @brief Writes the net to a proto, the params, in the order of params(),
+  ///        taken from the given blobs, e.g. copies of those.
+  void ToProto(NetParameter* param, bool write_diff,
+      const vector<shared_ptr<Blob<Dtype> > >& params) const;
   /// @brief Writes the net to an HDF5 file.
   void ToHDF5(const string& filename, bool write_diff = false) const;
+  void ToHDF5(const string& filename, bool write_diff,
+      const vector<shared_ptr<Blob<Dtype> > >& params) const;
 
   /// @brief returns the network name.
   inline const string& name() const { return name_; }
@@ -168,6 +343,29 @@ class Net {
   /// @brief returns the learnable parameter learning rate multipliers
   inline const vector<float>& params_lr() const { return params_lr_; }
   inline const vector<bool>& has_params_lr() const { return has_params_lr_; }
+  /// @brief returns whether each learnable parameter is frozen
+  inline const vector<bool>& params_frozen() const { return params_frozen_; }
+  /// @brief returns whether each learnable parameter belongs to a layer that
+  ///        is shared by the nets of all solvers, see Layer::ShareInParallel
+  inline const vector<bool>& params_shared() const { return params_shared_; }
+  /// @brief returns whether each learnable parameter has a row-sparse
+  ///        gradient, see Layer::param_rows
+  inline const vector<bool>& params_sparse() const { return params_sparse_; }
+  /**
+   * @brief Returns the rows of a row-sparse learnable param whose diffs the
+   *        backward passes since ClearParamDiffs touched, sorted, the other
+   *        rows of the diff being zero, or NULL for a dense param.
+   */
+  inline const vector<int>* param_rows(const int learnable_param_id) const {
+    return params_sparse_[learnable_param_id] ?
+        &param_rows_[learnable_param_id] : NULL;
+  }
+  /// @brief Adds rows to param_rows, e.g. for the diffs of other nets summed
+  ///        into those of this one.
+  void AddParamRows(const int learnable_param_id, const vector<int>& rows);
+  /// @brief Treats the row-sparse params as dense, for diffs summed densely
+  ///        with those of other nets.
+  void DensifyParams();
   /// @brief returns the learnable parameter decay multipliers
   inline const vector<float>& params_weight_decay() const {
     return params_weight_decay_;
@@ -201,6 +399,79 @@ class Net {
 
   void set_debug_info(const bool value) { debug_info_ = value; }
 
+  /**
+   * @brief In GPU mode, makes the forward passes add the loss of the net to a
+   *        value in device memory and return 0, so that they do not wait for
+   *        the GPU. AccumulatedLoss reads it back. Ignored for nets run in
+   *        pipeline stages or by branch threads.
+   */
+  void set_device_loss(const bool value);
+  inline bool device_loss() const { return device_loss_.get() != NULL; }
+  /// @brief The loss added on the device since the last call, which resets
+  ///        it, waiting for the GPU.
+  Dtype AccumulatedLoss();
+
+  /**
+   * @brief Turns on or off the recording of the wall time, GPU time, FLOPs
+   *        and bytes moved of each layer call in Forward and Backward.
+   *
+   * Layers then run in order, one at a time. The GPU time is read lazily,
+   * see EventTimer, so the host does not wait for the layers and the wall
+   * time in GPU mode is that of issuing them.
+   */
+  void set_profile(const bool value);
+  inline bool profile() const { return profile_; }
+  /// @brief Forgets the layer calls recorded so far.
+  void ClearProfile();
+  /// @brief Returns the totals of each layer and the size of each blob as
+  ///        JSON.
+  string ProfileJSON() const;
+  /// @brief Returns the recorded layer calls in the Chrome trace event
+  ///        format, to be loaded in chrome://tracing.
+  string ProfileTrace() const;
+
+  /**
+   * @brief Returns as JSON the bytes of memory held by the data and diff of
+   *        each blob and by the params of each layer, and their total, which
+   *        counts memory shared by several blobs once.
+   *
+   * Only the memory allocated on the side of the mode, GPU or host, is
+   * counted, as far as the head of each SyncedMemory tells. With predicted,
+   * the memory a pass would allocate is instead derived from the shapes,
+   * forward and backward for TRAIN nets and forward alone otherwise, e.g.
+   * for a net set up in CPU mode to size it for a GPU without allocating
+   * there. Buffers of layers outside their blobs, such as cuDNN workspaces,
+   * are not included, see CaffeGPUMemoryUsage.
+   */
+  string MemoryJSON(const bool predicted = false) const;
+  /// @brief The total of MemoryJSON.
+  size_t MemoryBytes(const bool predicted = false) const;
+
+  /**
+   * @brief Makes the copies between host and device that layer calls in
+   *        Forward and Backward trigger by reading data on the side it is not
+   *        at fatal, naming the layer, to catch stray cpu_data() calls on
+   *        GPU blobs. The profile counts these copies for each layer.
+   *
+   * Layers then run in order, one at a time.
+   */
+  void set_fail_on_transfer(const bool value) { fail_on_transfer_ = value; }
+  inline bool fail_on_transfer() const { return fail_on_transfer_; }
+
+  // Invoked after each layer in Backward, e.g. to start exchanging the
+  // gradients of layers that are done while earlier layers still compute.
+  class Callback {
+   protected:
+    virtual void run(int layer) = 0;
+
+    template <typename T>
+    friend class Net;
+  };
+  const vector<Callback*>& after_backward() const { return after_backward_; }
+  void add_after_backward(Callback* value) {
+    after_backward_.push_back(value);
+  }
+
   // Helpers for Init.
   /**
    * @brief Remove layers that the user specified should be excluded given the current
@@ -208,6 +479,47 @@ class Net {
    */
   static void FilterNet(const NetParameter& param,
       NetParameter* param_filtered);
+  /**
+   * @brief Fold each ReLU computed in place on the only top of the Convolution
+   *        or InnerProduct layer right before it into that layer.
+   */
+  static void FuseReLU(const NetParameter& param, NetParameter* param_fused);
+  /**
+   * @brief Replace each chain of element-wise layers whose tops but the last
+   *        only the next layer of the chain reads by a FusedElementwise layer.
+   */
+  static void FuseElementwise(const NetParameter& param,
+      NetParameter* param_fused);
+  /**
+   * @brief Compute the layers that allow it in place on a bottom that no
+   *        other layer reads, recording the names of their former tops as
+   *        aliases of those bottoms.
+   */
+  static void PlanInPlace(const NetParameter& param,
+      NetParameter* param_in_place, map<string, string>* aliases);
+  /**
+   * @brief Insert a Transfer layer at the start of each pipeline stage for
+   *        each blob it reads from earlier stages, renaming the blob in the
+   *        stage. Layers computing in place on such blobs then compute on
+   *        the copies, whose names the former names become aliases of.
+   */
+  static void InsertTransfers(const NetParameter& param,
+      NetParameter* param_transfers, map<string, string>* aliases);
+  /**
+   * @brief With NHWC layout, insert a Layout layer for each blob passing
+   *        between layers that run in different layouts, and for each
+   *        output of the net computed NHWC, which keeps its name. Layers
+   *        computing in place on such blobs then compute on the converted
+   *        copies, whose names the former names become aliases of.
+   */
+  static void InsertLayouts(const NetParameter& param,
+      NetParameter* param_layouts, map<string, string>* aliases);
+  /**
+   * @brief Filter, plan, fuse, convert and split the layers of a net as Init
+   *        does, into a compiled NetParameter that Init sets up as it is. See
+   *        NetParameter.compiled.
+   */
+  static void Compile(const NetParameter& param, NetParameter* compiled);
   /// @brief return whether NetState state meets NetStateRule rule
   static bool StateMeetsRule(const NetState& state, const NetStateRule& rule,
       const string& layer_name);
@@ -226,6 +538,78 @@ class Net {
   void AppendParam(const NetParameter& param, const int layer_id,
                    const int param_id);
 
+  /// @brief Maps each blob to the blob whose data it shares, if any, e.g. for
+  ///        tops of Split layers.
+  void DataHolders(vector<int>* holders) const;
+  /// @brief Shares or copies the pre-trained layers of another Net.
+  void TrainedLayersFrom(const Net* other, bool share);
+
+  /// @brief Runs the forward, or backward, of layers on the calling thread.
+  ///        Recomputed layers do not add their loss to the device loss.
+  Dtype ForwardLayers(int start, int end, bool recompute = false);
+  void BackwardLayers(int start, int end);
+  /// @brief Runs the forward of a layer, reshaping it only if needed.
+  Dtype ForwardLayer(const int layer_id, bool recompute = false);
+  /// @brief Runs the copies of the offloaded blobs before or after the
+  ///        forward, or backward, of a layer.
+  void OffloadForward(const int layer_id, bool after);
+  void OffloadBackward(const int layer_id, bool after);
+  /// @brief Copies an offloaded blob back to the GPU, once the work issued
+  ///        so far is done.
+  void OffloadPush(const int index);
+  /// @brief Waits for the copies in flight of the blobs of a layer placed
+  ///        on another device, before its forward or backward.
+  void PlacementWait(const int layer_id);
+  /// @brief Starts the copies of the data, or diffs, of blobs to the device
+  ///        other than that of the layer which computed them.
+  void PlacementCopy(const int layer_id, const vector<int>& blob_ids,
+      bool diff);
+  /// @brief Waits for all the copies in flight, at the end of a pass.
+  void PlacementDone();
+  /// @brief Replaces a layer of engine AUTO, set up, by the fastest of the
+  ///        engines supporting it on its shapes.
+  void SelectEngine(int layer_id);
+  /// @brief Helpers running the work of a pipeline stage on its thread.
+  void SetUpLayer(int layer_id, unsigned int seed);
+  void RunForwardStage(int stage, int start, int end, Dtype* loss);
+  void RunBackwardStage(int start, int end);
+  /// @brief Allocates the params of the layers of a stage on its GPU.
+  void PlaceStageParams(int stage);
+  /// @brief Finds the GPU of each stage and the blobs it passes on, and
+  ///        places the params there.
+  void SetUpStages(const NetParameter& param);
+  /// @brief Whether a layer needs to reshape before its next forward.
+  bool LayerNeedsReshape(const int layer_id) const;
+  /// @brief Records the shapes of the bottoms a layer was reshaped for.
+  void RecordBottomShapes(const int layer_id);
+
+  /// @brief Counts the memory of the data and diff of each blob and of the
+  ///        params of each layer, returning the total, see MemoryJSON.
+  size_t MemoryUsage(const bool predicted, vector<size_t>* blob_bytes,
+      vector<size_t>* param_bytes) const;
+  /// @brief Whether a forward pass over all the layers runs in micro-batches.
+  bool MicroBatched() const;
+  /// @brief Runs a forward pass over all the layers in micro-batches.
+  Dtype ForwardMicroBatches();
+  /// @brief With micro_batch, reshapes the inputs of more items to that many,
+  ///        returning the shapes to restore with RestoreInputs.
+  void ClampInputs(vector<vector<int> >* shapes);
+  void RestoreInputs(const vector<vector<int> >& shapes);
+  /// @brief Sets the net up for each input_bucket, growing the blobs to the
+  ///        largest, and makes the scratch blobs padding the inputs.
+  void SetUpInputBuckets(const NetParameter& param);
+  /// @brief Pads the inputs with zeros up to the smallest bucket they fit.
+  void PadInputs();
+  /// @brief Resolves the exits of the cascade, in the order of their layers.
+  void SetUpExits(const NetParameter& param);
+  /// @brief Runs a forward pass over all the layers, dropping the items
+  ///        that exit from the blobs the later layers read.
+  Dtype ForwardExits();
+
+  /// @brief Helpers recording the profile of a layer call.
+  void ProfileStart(const int layer_id, const bool backward);
+  void ProfileStop(const int layer_id, const bool backward);
+
   /// @brief Helper for displaying debug info in Forward about input Blobs.
   void InputDebugInfo(const int layer_id);
   /// @brief Helper for displaying debug info in Forward.
@@ -235,6 +619,8 @@ class Net {
   /// @brief Helper for displaying debug info in Update.
   void UpdateDebugInfo(const int param_id);
 
+  /// @brief The parameters the net was initialized with
+  NetParameter net_param_;
   /// @brief The network name
   string name_;
   /// @brief The phase: TRAIN or TEST
@@ -285,6 +671,17 @@ class Net {
   /// the learning rate multipliers for learnable_params_
   vector<float> params_lr_;
   vector<bool> has_params_lr_;
+  /// whether learnable_params_ are frozen, see FreezeParams
+  vector<bool> params_frozen_;
+  /// whether learnable_params_ are those of layers shared in parallel
+  vector<bool> params_shared_;
+  /// the data and diffs of the params updated, see LayOutParams
+  shared_ptr<Blob<Dtype> > flat_params_;
+  /// whether learnable_params_ are row-sparse, and their rows, see param_rows
+  vector<bool> params_sparse_;
+  vector<vector<int> > param_rows_;
+  /// the rows of a param for ClearParamDiffs on the GPU
+  Blob<int> clear_rows_;
   /// the weight decay multipliers for learnable_params_
   vector<float> params_weight_decay_;
   vector<bool> has_params_decay_;
@@ -292,8 +689,131 @@ class Net {
   size_t memory_used_;
   /// Whether to compute and display debug info for the net.
   bool debug_info_;
+  /// The norms of the blobs of a layer or of all the params for debug info
+  ArrayStats<Dtype> debug_stats_;
+  /// With set_device_loss, the loss accumulated on the GPU
+  shared_ptr<Blob<Dtype> > device_loss_;
+  /// Whether to record the profile of layer calls, and what it recorded
+  bool profile_;
+  struct LayerProfile {
+    LayerProfile() : calls(), wall_us(), flops(), bytes(),
+        transfers(), transfer_bytes(), transfer_us() {}
+    int calls[2];
+    double wall_us[2];
+    double flops[2];
+    double bytes[2];
+    // The implicit copies between host and device, see TransferCount
+    int transfers[2];
+    double transfer_bytes[2];
+    double transfer_us[2];
+  };
+  struct ProfileEvent {
+    int layer_id;
+    bool backward;
+    double start_us;
+    double wall_us;
+  };
+  vector<LayerProfile> layer_profiles_;
+  vector<ProfileEvent> profile_events_;
+  /// the GPU time of each layer and pass, keyed 2 * layer_id + backward
+  shared_ptr<EventTimer> profile_timer_;
+  double profile_start_us_;
+  TransferCount profile_start_transfers_;
+  /// Whether implicit copies in layer calls are fatal
+  bool fail_on_transfer_;
+  /// Whether blobs share memory when their values are not needed together
+  bool reuse_activations_;
+  /// Whether params share memory with those of other nets of equal values
+  bool dedup_weights_;
+  /// Whether forward passes skip reshaping layers, see static_shapes
+  bool static_shapes_;
+  /// The most items of the inputs a forward pass runs at once, or 0
+  int micro_batch_;
+  /// The shape of each input in each input_bucket
+  vector<vector<vector<int> > > input_buckets_;
+  /// Holding the inputs while they are padded, with the memory of the
+  /// largest bucket
+  vector<shared_ptr<Blob<Dtype> > > bucket_scratch_;
+  /// For each exit, the layer computing its blob, its blob and its threshold
+  vector<int> exit_layers_;
+  vector<int> exit_blobs_;
+  vector<float> exit_thresholds_;
+  /// The output the exits give their probabilities as
+  int exit_output_;
+  /// For each exit, the blobs read after its layer that are compacted
+  vector<vector<int> > exit_compacted_;
+  /// The outputs of the items of the batch, as they exit
+  Blob<Dtype> exit_scratch_;
+  /// The layers reshaped on every pass, whatever the shapes of their bottoms
+  vector<bool> layer_reshapes_;
+  /// The shape_version of each bottom of each layer as it last reshaped
+  vector<vector<int> > bottom_shape_versions_;
+  /// With static_shapes, the shapes of the blobs as fixed
+  vector<vector<int> > static_blob_shapes_;
+  /// First layer of the recompute segment of each layer, or -1
+  vector<int> segment_begin_;
+  /// Lower layers each layer depends on, and higher ones depending on it
+  vector<vector<int> > layer_deps_;
+  vector<vector<int> > layer_dependents_;
+  /// With offload, the offloaded blobs, the ones using their GPU buffer
+  /// before and after them or -1, whether they are being copied back, and
+  /// their buffer
+  vector<int> offload_blobs_;
+  vector<int> offload_previous_;
+  vector<int> offload_next_;
+  vector<bool> offload_pushed_;
+  vector<shared_ptr<SyncedMemory> > offload_buffers_;
+  /// The offloaded blobs computed, and last read, by each layer
+  vector<vector<int> > offload_first_;
+  vector<vector<int> > offload_last_;
+#ifndef CPU_ONLY
+  /// The stream of the copies, and the events they wait for and record
+  cudaStream_t offload_stream_;
+  cudaEvent_t offload_event_;
+  vector<cudaEvent_t> offload_pull_events_;
+  vector<cudaEvent_t> offload_push_events_;
+#endif
+  /// With layers placed on other devices, the blobs whose data each layer
+  /// copies to the other device after its forward, and whose diffs after
+  /// its backward, the mode they were found for, and the blobs with a copy
+  /// in flight
+  vector<vector<int> > placement_data_;
+  vector<vector<int> > placement_diffs_;
+  Caffe::Brew placement_mode_;
+  vector<bool> placement_pending_;
+  int placement_in_flight_;
+#ifndef CPU_ONLY
+  /// The stream of the copies, the event they wait for, and that of the
+  /// last copy of each blob
+  cudaStream_t placement_stream_;
+  cudaEvent_t placement_event_;
+  vector<cudaEvent_t> placement_events_;
+#endif
+  /// The FeatureCache layer whose bottoms each layer only computes, or -1
+  vector<int> cached_by_;
+  /// Runs independent layers on branch threads, if any
+  class Scheduler;
+  shared_ptr<Scheduler> scheduler_;
+#ifndef CPU_ONLY
+  /// The stream of the net's GPU work, or 0 for that of the calling thread
+  cudaStream_t stream_;
+  /// Whether the net's cuBLAS calls may use tensor cores
+  bool tensor_op_math_;
+#endif
+  /// The first layer of each pipeline stage, then the number of layers, the
+  /// stage of each layer, and the GPU of each stage, or -1 in CPU mode
+  vector<int> stage_begin_;
+  vector<int> layer_stages_;
+  vector<int> stage_devices_;
+  /// Whether the stages run on the DeviceThread of their GPUs
+  bool staged_;
+  /// The blobs of each stage read by later ones, whose diffs it allocates
+  vector<vector<int> > stage_outputs_;
   /// The root net that actually holds the shared layers in data parallelism
   const Net* const root_net_;
+  vector<Callback*> after_backward_;
+  /// The mapped weights files the params use
+  vector<shared_ptr<MappedFile> > mapped_weights_;
   DISABLE_COPY_AND_ASSIGN(Net);
 };
 
@@ -194,7 +194,11 @@ class DropoutLayer : public NeuronLayer<Dtype> {
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
-  /// when divided by UINT_MAX, the randomly generated values @f$u\sim U(0,1)@f$
+  // Forward_cpu in TRAIN of the mask words [begin, end), for the thread pool
+  void dropout_forward_cpu(const Dtype* bottom_data, Dtype* top_data,
+      int count, uint64_t key, int begin, int end);
+
+  /// the mask of the inputs kept, a bit each, 32 a word, lowest bit first
   Blob<unsigned int> rand_vec_;
   /// the probability @f$ p @f$ of dropping any input
   Dtype threshold_;
@@ -267,6 +271,57 @@ class ExpLayer : public NeuronLayer<Dtype> {
   Dtype inner_scale_, outer_scale_;
 };
 
+/**
+ * @brief Applies a chain of Power, Exp, Log, ReLU, Sigmoid, TanH and AbsVal
+ *        layers in one pass over the blobs, as the fuse_elementwise option
+ *        of NetParameter sets it up, rather than a pass per layer.
+ *
+ * Backward recomputes the outputs of the layers of the chain from its inputs
+ * instead of reading them, so that they take no memory. Computed in place,
+ * the layer keeps a copy of its inputs for Backward.
+ */
+template <typename Dtype>
+class FusedElementwiseLayer : public NeuronLayer<Dtype> {
+ public:
+  /**
+   * @param param provides FusedElementwiseParameter fused_elementwise_param,
+   *     with FusedElementwiseLayer options:
+   *   - layer the layers applied in turn, of the types above
+   */
+  explicit FusedElementwiseLayer(const LayerParameter& param)
+      : NeuronLayer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "FusedElementwise"; }
+
+  // Whether the layer of param can be part of a chain
+  static bool IsFusible(const LayerParameter& param);
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  void forward_cpu(const Dtype* bottom_data, Dtype* top_data, Dtype* input,
+      int begin, int end);
+  void backward_cpu(const Dtype* bottom_data, const Dtype* top_diff,
+      Dtype* bottom_diff, int begin, int end);
+
+  // The ElementwiseOp of each layer, then its three arguments
+  Blob<Dtype> ops_;
+  int num_ops_;
+  // The inputs when in place, else empty
+  Blob<Dtype> input_;
+};
+
 /**
  * @brief Computes @f$ y = log_{\gamma}(\alpha x + \beta) @f$,
  *        as specified by the scale @f$ \alpha @f$, shift @f$ \beta @f$,
@@ -423,6 +478,7 @@ class ReLULayer : public NeuronLayer<Dtype> {
       : NeuronLayer<Dtype>(param) {}
 
   virtual inline const char* type() const { return "ReLU"; }
+  virtual inline bool AllowNHWC() const { return true; }
 
  protected:
   /**
@@ -799,8 +855,7 @@ class PReLULayer : public NeuronLayer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
   bool channel_shared_;
-  Blob<Dtype> multiplier_;  // dot multiplier for backward computation of params
-  Blob<Dtype> backward_buff_;  // temporary buffer for backward computation
+  Blob<Dtype> backward_buff_;  // per channel slope gradients, if shared
   Blob<Dtype> bottom_memory_;  // memory for in-place computation
 };
 
@@ -2,7 +2,9 @@
 #define CAFFE_PARALLEL_HPP_
 
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/barrier.hpp>
 
+#include <string>
 #include <vector>
 
 #include "caffe/blob.hpp"
@@ -13,12 +15,15 @@
 #include "caffe/solver.hpp"
 #include "caffe/syncedmem.hpp"
 #include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/socket.hpp"
+#include "caffe/util/spsc_queue.hpp"
 
 namespace caffe {
 
 // Represents a net parameters. Once a net is created, its parameter buffers can
 // be replaced by ones from Params, to allow parallelization. Params ensures
-// parameters are allocated in one consecutive array.
+// parameters are allocated in one consecutive array. The frozen params come
+// last in the data and have no diff, so they are never synchronized.
 template<typename Dtype>
 class Params {
  public:
@@ -37,7 +42,8 @@ class Params {
   }
 
  protected:
-  const size_t size_;           // Size of buffers
+  const size_t size_;           // Size of the params updated
+  const size_t data_size_;      // Size of data_, with the frozen params
   Dtype* data_;                 // Network parameters
   Dtype* diff_;                 // Gradient
 
@@ -55,6 +61,7 @@ class GPUParams : public Params<Dtype> {
 
  protected:
   using Params<Dtype>::size_;
+  using Params<Dtype>::data_size_;
   using Params<Dtype>::data_;
   using Params<Dtype>::diff_;
 };
@@ -72,8 +79,14 @@ class DevicePair {
     return device_;
   }
 
-  // Group GPUs in pairs, by proximity depending on machine's topology
+  // Group GPUs in pairs, by proximity depending on machine's topology: GPUs
+  // of a board or joined by NVLink first, then those behind a PCIe switch,
+  // then those of a CPU socket, and only the remaining ones across sockets.
   static void compute(const vector<int> devices, vector<DevicePair>* pairs);
+  // Group GPUs in pairs by their position in devices, as a binomial tree:
+  // each with the next, then by fours, eights... whatever the topology.
+  static void compute_in_order(const vector<int> devices,
+                               vector<DevicePair>* pairs);
 
  protected:
   int parent_;
@@ -81,9 +94,18 @@ class DevicePair {
 };
 
 // Synchronous data parallelism using map-reduce between local GPUs.
+// Gradients are either reduced up the tree of device pairs, or, if the
+// solver's sync_mode is RING, all-reduced around a ring of devices. In ASYNC
+// mode, all devices are children of the root, which applies gradients as
+// they arrive, within the solver's max_staleness bound.
+// In tree mode, slices of the gradient buffer are sent to the parent as soon
+// as the layers owning them are done with backward, overlapping transfers
+// with the backward pass of earlier layers.
+// With the solver's local_steps, each device instead updates its own copy of
+// the weights, and the copies are averaged every local_steps iterations.
 template<typename Dtype>
 class P2PSync : public GPUParams<Dtype>, public Solver<Dtype>::Callback,
-    public InternalThread {
+    public Net<Dtype>::Callback, public InternalThread {
  public:
   explicit P2PSync(shared_ptr<Solver<Dtype> > root_solver,
                    P2PSync<Dtype>* parent, const SolverParameter& param);
@@ -98,9 +120,37 @@ class P2PSync : public GPUParams<Dtype>, public Solver<Dtype>::Callback,
  protected:
   void on_start();
   void on_gradients_ready();
+  // With shard_update, all-gathers the chunks of the weights each solver
+  // updated, with local_steps, averages the weights every local_steps
+  void on_update_applied();
+  // Called by the net after backward of each layer
+  void run(int layer);
+  // Copies the weights from parent to children, starting on the root
+  void broadcast_weights();
+  // Sums the weights of all solvers in diff_ of the root, through the tree
+  // or the ring of the gradients
+  void sum_weights();
+  // Averages the weights of all solvers, the root overwriting those of the
+  // others
+  virtual void average_weights();
 
   void InternalThreadEntry();
 
+  // Places this solver in the gradient ring between prev and next
+  void ring_setup(P2PSync<Dtype>* prev, P2PSync<Dtype>* next, int rank,
+                  int size);
+  // Sums diff_ over all solvers in the ring, in size_ / ring_size_ chunks
+  void ring_all_reduce();
+  // Runs the steps [first, last) of ring_all_reduce, the gathering ones
+  // copying data_ instead of diff_ with weights
+  void ring_steps(int first, int last, bool weights);
+  // Splits diff_ in slices that get ready together during backward
+  void compute_slices(bool overlap);
+  // Reduces slices up to the given count from children and sends to parent
+  void reduce_slices(int count);
+  // Sends gradients to the root, or on the root, sums those received
+  void async_gradients_ready();
+
   P2PSync<Dtype>* parent_;
   vector<P2PSync<Dtype>*> children_;
   BlockingQueue<P2PSync<Dtype>*> queue_;
@@ -108,11 +158,197 @@ class P2PSync : public GPUParams<Dtype>, public Solver<Dtype>::Callback,
   Dtype* parent_grads_;
   shared_ptr<Solver<Dtype> > solver_;
 
+  // With fp16_transfer, weights and gradients travel as half precision
+  uint16_t* half_;              // Sent or received by this solver
+  uint16_t* parent_half_;       // Receives gradients on parent
+  Dtype* residual_;             // Rounding errors of gradients sent
+
+  // Slice k spans [slice_begin_[k], slice_begin_[k - 1]) of diff_, slice 0
+  // ending at size_. Slices are ordered from the last layer to the first.
+  vector<size_t> slice_begin_;
+  vector<int> layer_slices_;    // Slices complete after backward of a layer
+  int slices_reduced_;          // Slices reduced in the current iteration
+  int backward_passes_;         // Of the iter_size ones, in this iteration
+  int local_steps_;             // Updates since the weights were averaged
+  vector<int> children_slices_;  // Slices received from each child
+  // In ASYNC mode, iteration of the weights each child computes gradients
+  // on, or -1 if these got applied and the child waits for new weights.
+  vector<int> children_versions_;
+#ifndef CPU_ONLY
+  cudaStream_t stream_;         // Sends slices to parent
+  cudaEvent_t ready_event_;     // Slice summed in diff_, ready to send
+  vector<cudaEvent_t> slice_events_;  // Slice copied to parent_grads_
+#endif
+
+  // Ring all-reduce state, unused in tree mode
+  P2PSync<Dtype>* ring_prev_;
+  P2PSync<Dtype>* ring_next_;
+  int ring_rank_;
+  int ring_size_;
+  Dtype* ring_buffer_;          // Receives one chunk from ring_prev_
+  bool ring_peer_access_;       // Whether p2p access to ring_prev_ is owned
+  SPSCQueue<P2PSync<Dtype>*> ring_queue_;  // Chunk ready, from prev
+  SPSCQueue<P2PSync<Dtype>*> ring_ack_;    // Reads done, from next
+
+  using Params<Dtype>::size_;
+  using Params<Dtype>::data_;
+  using Params<Dtype>::diff_;
+};
+
+// Synchronous data parallelism across machines. Gradients are first reduced
+// between local GPUs by P2PSync, then all-reduced over TCP between the root
+// GPUs of each machine. All machines then apply the same update, which is
+// broadcast to local GPUs as in P2PSync. With the solver's sparse_transfer,
+// each machine sends only its largest gradients, keeping the others for the
+// next iteration.
+template<typename Dtype>
+class NodeSync : public P2PSync<Dtype> {
+ public:
+  // hosts lists "host:port" for each machine, rank is this machine's position
+  NodeSync(shared_ptr<Solver<Dtype> > root_solver,
+           const SolverParameter& param, const vector<string>& hosts,
+           int rank);
+  virtual ~NodeSync();
+
+  void run(const vector<int>& gpus);
+
+ protected:
+  void on_gradients_ready();
+  // Averages the weights of the local solvers, then those of the machines
+  void average_weights();
+
+  SocketRing ring_;
+  Dtype* host_buffer_;          // Pinned copy of the buffers for transfers
+
+  // With sparse_transfer, the gradients not sent yet, and those sent
+  vector<Dtype> sparse_residual_;
+  vector<Dtype> sparse_values_;
+  vector<int> sparse_indices_;
+
+  using P2PSync<Dtype>::solver_;
+  using Params<Dtype>::size_;
+  using Params<Dtype>::data_size_;
+  using Params<Dtype>::data_;
+  using Params<Dtype>::diff_;
+};
+
+// Synchronous data parallelism between solvers on CPU threads, e.g. on
+// machines without GPUs. The solvers share the weights in one host buffer,
+// which only the root solver updates, while the others wait for the next
+// iteration. Each solver computes the gradients of its share of the batch in
+// a buffer of its own, on the NUMA node its thread is bound to with
+// NUMAAffinity(). Once all are ready, each solver sums its chunk of the
+// gradients of all of them into the root's, so that the reduction reads
+// and writes all buffers in parallel.
+template<typename Dtype>
+class CPUSync : public Params<Dtype>, public Solver<Dtype>::Callback,
+    public InternalThread {
+ public:
+  CPUSync(shared_ptr<Solver<Dtype> > root_solver, CPUSync<Dtype>* root,
+          const SolverParameter& param);
+  virtual ~CPUSync();
+
+  inline const shared_ptr<Solver<Dtype> >& solver() const {
+    return solver_;
+  }
+
+  // Trains with Caffe::solver_count() solvers, the root one on the calling
+  // thread. Each runs Caffe::cpu_threads() threads of CPU layers.
+  void run();
+
+ protected:
+  void on_start();
+  // Sums the gradients of all solvers into those of the root, each solver
+  // a slice of them, only in the rows touched for row-sparse params
+  void on_gradients_ready();
+  // Sums count gradients from begin into those of the root
+  void sum(size_t begin, size_t count);
+  // The rows of a row-sparse param touched by any solver
+  vector<int> touched_rows(int param_id) const;
+
+  void InternalThreadEntry();
+  // Binds the calling thread to the NUMA node of the solver's rank, zeroing
+  // diff_ there so that its pages are allocated on that node
+  void bind_thread();
+
+  CPUSync<Dtype>* root_;
+  vector<CPUSync<Dtype>*> syncs_;  // On the root, all solvers by rank
+  int rank_;
+  const int initial_iter_;
+  int cpu_threads_;
+  shared_ptr<Solver<Dtype> > solver_;
+  shared_ptr<boost::barrier> barrier_;
+
   using Params<Dtype>::size_;
   using Params<Dtype>::data_;
   using Params<Dtype>::diff_;
 };
 
+// Data parallel inference. Replicas of a TEST net, one per device, run
+// forward passes at the same time, each on its own thread, with the weights
+// loaded once. The Data layers of the replicas share the records of their
+// sources in round robin, so that the passes of all replicas read the
+// records the passes of a single net would.
+template<typename Dtype>
+class NetReplicas {
+ public:
+  // devices lists the GPU of each replica, or -1 for the CPU
+  NetReplicas(const NetParameter& param, const string& weights,
+              const vector<int>& devices);
+
+  // Runs passes forward passes, a multiple of the replicas, replica i
+  // running passes i, i + replicas... Returns the loss of each pass, and the
+  // values of the net outputs, one after the other.
+  void Forward(int passes, vector<Dtype>* losses,
+               vector<vector<Dtype> >* outputs);
+
+  inline int size() const { return nets_.size(); }
+  inline const Net<Dtype>& net(int i) const { return *nets_[i]; }
+
+ protected:
+  void ForwardReplica(int replica, int passes, int cpu_threads,
+                      vector<Dtype>* losses, vector<vector<Dtype> >* outputs);
+
+  const vector<int> devices_;
+  vector<shared_ptr<Net<Dtype> > > nets_;
+
+  DISABLE_COPY_AND_ASSIGN(NetReplicas);
+};
+
+// Pipeline parallel training of a net split in stages across GPUs, see
+// PipelineParameter. The passes of an iteration run as micro-batches, each
+// on a replica of the net sharing its weights and gradients. Each micro-batch
+// moves on to the next stage as soon as it is done with one, forward, then
+// backward, so that the stages work on different micro-batches at the same
+// time. The Data layers of the replicas share the records of their sources
+// in round robin, as in NetReplicas, so the micro-batches read the records
+// the passes of a single net would.
+template<typename Dtype>
+class NetPipeline {
+ public:
+  NetPipeline(const NetParameter& param, int micro_batches);
+
+  // Runs the forward and backward passes of all micro-batches, adding their
+  // gradients to the diffs of the params, and returns the sum of their
+  // losses. In CPU mode, the micro-batches run one after the other.
+  Dtype ForwardBackward();
+
+  inline int size() const { return nets_.size(); }
+  // The replica of micro-batch i, that of the first holding the params
+  inline const shared_ptr<Net<Dtype> >& net(int i) const { return nets_[i]; }
+
+ protected:
+  // Run on the DeviceThread of the stage
+  void Forward(int replica, int stage);
+  void Backward(int replica, int stage);
+
+  vector<shared_ptr<Net<Dtype> > > nets_;
+  vector<Dtype> losses_;
+  BlockingQueue<int> done_;  // Micro-batches done with backward
+
+  DISABLE_COPY_AND_ASSIGN(NetPipeline);
+};
+
 }  // namespace caffe
 
 #endif
@@ -2,29 +2,103 @@
 #define CAFFE_PYTHON_LAYER_HPP_
 
 #include <boost/python.hpp>
+#include <boost/thread.hpp>
 #include <vector>
 
+#include "caffe/internal_thread.hpp"
 #include "caffe/layer.hpp"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/math_functions.hpp"
 
 namespace bp = boost::python;
 
 namespace caffe {
 
+// Holds the GIL for the calls into Python of a thread running a net. The nets
+// run with the GIL released, by pycaffe and the caffe tool, so that only the
+// Python layers serialize on the interpreter.
+class ScopedGIL {
+ public:
+  ScopedGIL() : state_(PyGILState_Ensure()) {}
+  ~ScopedGIL() { PyGILState_Release(state_); }
+
+ private:
+  PyGILState_STATE state_;
+
+  DISABLE_COPY_AND_ASSIGN(ScopedGIL);
+};
+
+// Releases the GIL held by the calling thread, if it holds it, for the scope.
+class ScopedGILRelease {
+ public:
+  ScopedGILRelease() : state_(HoldsGIL() ? PyEval_SaveThread() : NULL) {}
+  ~ScopedGILRelease() {
+    if (state_) {
+      PyEval_RestoreThread(state_);
+    }
+  }
+
+  static bool HoldsGIL() {
+    if (!Py_IsInitialized()) {
+      return false;
+    }
+#if PY_VERSION_HEX >= 0x03040000
+    return PyGILState_Check();
+#else
+    PyThreadState* state = PyGILState_GetThisThreadState();
+    return state && state == _PyThreadState_Current;
+#endif
+  }
+
+ private:
+  PyThreadState* state_;
+
+  DISABLE_COPY_AND_ASSIGN(ScopedGILRelease);
+};
+
 template <typename Dtype>
-class PythonLayer : public Layer<Dtype> {
+class PythonLayer : public Layer<Dtype>, public InternalThread {
  public:
   PythonLayer(PyObject* self, const LayerParameter& param)
       : Layer<Dtype>(param), self_(bp::handle<>(bp::borrowed(self))) { }
+  virtual ~PythonLayer() {
+    // The prefetch thread may wait for the GIL
+    ScopedGILRelease release;
+    StopInternalThread();
+  }
 
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+    const int prefetch = this->layer_param_.python_param().prefetch();
+    CHECK(prefetch == 0 || bottom.empty())
+        << "Only Python data layers, without bottoms, can prefetch";
+    ScopedGIL gil;
     self_.attr("param_str") = bp::str(
         this->layer_param_.python_param().param_str());
     self_.attr("setup")(bottom, top);
   }
   virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
-    self_.attr("reshape")(bottom, top);
+    if (is_started()) {
+      // Forward takes the shapes of the prefetched batches
+      return;
+    }
+    {
+      ScopedGIL gil;
+      self_.attr("reshape")(bottom, top);
+    }
+    const int prefetch = this->layer_param_.python_param().prefetch();
+    if (prefetch > 0) {
+      // Now that the net has the shapes of the tops, on to the batches
+      prefetch_.resize(prefetch);
+      for (int i = 0; i < prefetch; ++i) {
+        for (int j = 0; j < top.size(); ++j) {
+          prefetch_[i].push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+        }
+        prefetch_free_.push(&prefetch_[i]);
+      }
+      StartInternalThread();
+    }
   }
 
   virtual inline bool ShareInParallel() const {
@@ -36,15 +110,59 @@ class PythonLayer : public Layer<Dtype> {
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+    if (is_started()) {
+      vector<shared_ptr<Blob<Dtype> > >* batch = prefetch_full_.pop(
+          "Waiting for the Python layer " + this->layer_param_.name());
+      for (int i = 0; i < top.size(); ++i) {
+        const Blob<Dtype>& blob = *(*batch)[i];
+        top[i]->ReshapeLike(blob);
+        caffe_copy(blob.count(), blob.cpu_data(), top[i]->mutable_cpu_data());
+      }
+      prefetch_free_.push(batch);
+      return;
+    }
+    ScopedGIL gil;
     self_.attr("forward")(bottom, top);
   }
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    ScopedGIL gil;
     self_.attr("backward")(top, propagate_down, bottom);
   }
 
+  // Runs reshape and forward of the Python layer into the free batches.
+  virtual void InternalThreadEntry() {
+    const vector<Blob<Dtype>*> bottom;
+    try {
+      while (!must_stop()) {
+        vector<shared_ptr<Blob<Dtype> > >* batch = prefetch_free_.pop();
+        vector<Blob<Dtype>*> top(batch->size());
+        for (int i = 0; i < top.size(); ++i) {
+          top[i] = (*batch)[i].get();
+        }
+        {
+          ScopedGIL gil;
+          try {
+            self_.attr("reshape")(bottom, top);
+            self_.attr("forward")(bottom, top);
+          } catch (bp::error_already_set) {
+            PyErr_Print();
+            LOG(FATAL) << "Python layer " << this->layer_param_.name()
+                       << " failed to prefetch";
+          }
+        }
+        prefetch_full_.push(batch);
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+  }
+
  private:
   bp::object self_;
+  vector<vector<shared_ptr<Blob<Dtype> > > > prefetch_;
+  BlockingQueue<vector<shared_ptr<Blob<Dtype> > >*> prefetch_free_;
+  BlockingQueue<vector<shared_ptr<Blob<Dtype> > >*> prefetch_full_;
 };
 
 }  // namespace caffe
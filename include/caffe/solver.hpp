@@ -1,13 +1,21 @@
 #ifndef CAFFE_OPTIMIZATION_SOLVER_HPP_
 #define CAFFE_OPTIMIZATION_SOLVER_HPP_
 
+#include <boost/function.hpp>
 #include <string>
 #include <vector>
 
 #include "caffe/net.hpp"
+#include "caffe/util/array_stats.hpp"
+#include "caffe/util/data_stats.hpp"
+#include "caffe/util/fused_update.hpp"
+#include "caffe/util/metrics.hpp"
 
 namespace caffe {
 
+template <typename Dtype>
+class NetPipeline;
+
 /**
  * @brief An interface for classes that perform optimization on Net%s.
  *
@@ -45,6 +53,8 @@ class Solver {
    protected:
     virtual void on_start() = 0;
     virtual void on_gradients_ready() = 0;
+    // Once the update is applied, before the next iteration
+    virtual void on_update_applied() {}
 
     template <typename T>
     friend class Solver;
@@ -54,6 +64,32 @@ class Solver {
     callbacks_.push_back(value);
   }
 
+  // Called on the root solver after each snapshot taken by Step, which
+  // returns there, before max_iter, if it returns true. E.g. to go on
+  // training from that snapshot on another set of devices.
+  void set_stop_at_snapshot(const boost::function<bool()>& stop) {
+    stop_at_snapshot_ = stop;
+  }
+  // The solver state file of the last snapshot
+  string SnapshotStateFilename();
+
+  // The parts of the iterations run by Step. SYNC covers the callbacks,
+  // where P2PSync exchanges weights and gradients, and the data wait is
+  // part of FORWARD.
+  enum StepPhase {
+    STEP_TEST, STEP_SYNC, STEP_FORWARD, STEP_BACKWARD, STEP_UPDATE,
+    STEP_SNAPSHOT, NUM_STEP_PHASES
+  };
+  // Times the phases of Step from now on, resetting the times, or stops.
+  // Timed with Timer, so in GPU mode until the work of each phase is done.
+  void set_step_timing(bool timing);
+  // Microseconds spent in a phase since set_step_timing(true)
+  double step_time(StepPhase phase) const;
+  // Updates the metrics at every iteration from now on, timing Step for the
+  // time of each phase. Set on the root solver, the solvers of the other
+  // devices of P2PSync report the memory they use there too.
+  void set_metrics(const shared_ptr<Metrics>& metrics);
+
  protected:
   // Make and apply the update value for the current iteration.
   virtual void ApplyUpdate() = 0;
@@ -62,16 +98,36 @@ class Solver {
   // function that produces a SolverState protocol buffer that needs to be
   // written to disk together with the learned net.
   void Snapshot();
+  // Writes the snapshot of snapshot_iter_, from the copies of the params with
+  // snapshot_async.
+  void WriteSnapshot();
+  // Waits for the snapshot written with snapshot_async, if any.
+  void WaitForSnapshot();
+  // With snapshot_async, copies what SnapshotSolverState writes to host
+  // memory, for it to write the copy on the snapshot thread.
+  virtual void CopySolverState() {}
   string SnapshotFilename(const string extension);
   string SnapshotToBinaryProto();
   string SnapshotToHDF5();
+  // Writes the profile of the train net, if the profile_prefix is set.
+  void WriteProfile();
   // The test routine
   void TestAll();
   void Test(const int test_net_id = 0);
+  // Runs a test net on the weights it holds, for the given iteration.
+  void Score(const int test_net_id, const int iter);
+  // Waits for the test started by TestAll with test_async, if any.
+  void WaitForTest();
   virtual void SnapshotSolverState(const string& model_filename) = 0;
   virtual void RestoreSolverStateFromHDF5(const string& state_file) = 0;
   virtual void RestoreSolverStateFromBinaryProto(const string& state_file) = 0;
   void DisplayOutputBlobs(const int net_id);
+  // Logs and resets the counters of the data layers of the train net.
+  void DisplayDataStats();
+  // Adds the time since the last lap to phase, if Step is timed
+  void StepLap(StepPhase phase);
+  // Sets the metrics of the iteration just done, given its smoothed loss
+  void UpdateMetrics(Dtype loss);
 
   SolverParameter param_;
   int iter_;
@@ -79,11 +135,40 @@ class Solver {
   shared_ptr<Net<Dtype> > net_;
   vector<shared_ptr<Net<Dtype> > > test_nets_;
   vector<Callback*> callbacks_;
+  boost::function<bool()> stop_at_snapshot_;
+  // With set_step_timing, the times of the phases of Step
+  shared_ptr<Timer> step_timer_;
+  vector<double> step_times_;
+  shared_ptr<Metrics> metrics_;
+  // With metrics and data_stats_interval, the counters of each layer of the
+  // train net taken for the metrics, until displayed
+  vector<shared_ptr<DataStats> > data_stats_;
 
   // The root solver that holds root nets (actually containing shared layers)
   // in data parallelism
   const Solver* const root_solver_;
 
+  // The iteration and step of the snapshot being written, and with
+  // snapshot_async, host copies of the params of the net
+  int snapshot_iter_;
+  int snapshot_current_step_;
+  vector<shared_ptr<Blob<Dtype> > > snapshot_params_;
+
+  // Creates and runs the test nets with test_async. Declared last so that
+  // it stops before the nets it uses are destroyed.
+  class TestThread;
+  shared_ptr<TestThread> test_thread_;
+  // Writes the snapshots with snapshot_async
+  class SnapshotThread;
+  shared_ptr<SnapshotThread> snapshot_thread_;
+  // Runs the FrozenPrefix of the train net during updates with
+  // prefetch_forward
+  class ForwardThread;
+  shared_ptr<ForwardThread> forward_thread_;
+  // Runs the iter_size passes of each iteration as micro-batches with
+  // pipeline_iter_size, net_ being its first replica
+  shared_ptr<NetPipeline<Dtype> > pipeline_;
+
   DISABLE_COPY_AND_ASSIGN(Solver);
 };
 
@@ -118,31 +203,75 @@ class WorkerSolver : public Solver<Dtype> {
 template <typename Dtype>
 class SGDSolver : public Solver<Dtype> {
  public:
-  explicit SGDSolver(const SolverParameter& param)
-      : Solver<Dtype>(param) { PreSolve(); }
+  explicit SGDSolver(const SolverParameter& param,
+      const Solver<Dtype>* root_solver = NULL)
+      : Solver<Dtype>(param, root_solver) { PreSolve(); }
   explicit SGDSolver(const string& param_file)
       : Solver<Dtype>(param_file) { PreSolve(); }
+  // A snapshot being written reads the history copies
+  virtual ~SGDSolver() { this->WaitForSnapshot(); }
 
   const vector<shared_ptr<Blob<Dtype> > >& history() { return history_; }
 
+  // Splits the update between solvers of the same net, shards[i] updating
+  // the elements [bounds[i], bounds[i + 1]) of the params, in the order of
+  // learnable_params, and keeping the history of those only. Called on the
+  // solver holding the whole history, one of the shards, which then gathers
+  // it from the others in snapshots.
+  void ShardUpdate(const vector<SGDSolver<Dtype>*>& shards,
+                   const vector<size_t>& bounds);
+  // The history of all the params, gathered from the shards if sharded
+  void GatherHistory(vector<shared_ptr<Blob<Dtype> > >* history) const;
+
  protected:
   void PreSolve();
+  // Keeps the history of the elements [begin, end) of the params only,
+  // copied from that of source
+  void TakeHistoryShard(const SGDSolver<Dtype>& source, size_t begin,
+                        size_t end);
   Dtype GetLearningRate();
+  // Normalizes and regularizes the gradients, computes the update values and
+  // applies them in a single pass over the params, a single kernel launch on
+  // the GPU, following the rule of update_type.
   virtual void ApplyUpdate();
-  virtual void Normalize(int param_id);
-  virtual void Regularize(int param_id);
-  virtual void ComputeUpdateValue(int param_id, Dtype rate);
-  virtual void ClipGradients();
+  virtual inline SolverParameter_SolverType update_type() const {
+    return SolverParameter_SolverType_SGD;
+  }
+  void FusedUpdateCPU(const FusedUpdateConfig<Dtype>& config);
+  void FusedUpdateGPU(const FusedUpdateConfig<Dtype>& config);
+  // The elements of a param to update, relative to update_begin_, as starts
+  // and ends: all of them, or the rows a row-sparse param's gradient touched
+  // (see Net::param_rows), whose other rows keep their values and history,
+  // momentum and decay being applied lazily.
+  void UpdateRanges(int param_id, vector<int>* ranges) const;
+  // The factor scaling the gradients down to an L2 norm of clip_gradients,
+  // or 1, which the update applies along with the normalization
+  virtual Dtype ClipGradients();
+  virtual void CopySolverState();
   virtual void SnapshotSolverState(const string& model_filename);
   virtual void SnapshotSolverStateToBinaryProto(const string& model_filename);
   virtual void SnapshotSolverStateToHDF5(const string& model_filename);
   virtual void RestoreSolverStateFromHDF5(const string& state_file);
   virtual void RestoreSolverStateFromBinaryProto(const string& state_file);
   // history maintains the historical momentum data.
-  // update maintains update related data and is not needed in snapshots.
-  // temp maintains other information that might be needed in computation
-  //   of gradients/updates and is not needed in snapshots
-  vector<shared_ptr<Blob<Dtype> > > history_, update_, temp_;
+  vector<shared_ptr<Blob<Dtype> > > history_;
+  // The elements of each param updated, those the history holds, all of
+  // them unless the update is sharded
+  vector<int> update_begin_;
+  vector<int> update_count_;
+  bool update_sharded_;
+  // The solvers sharing the update, on the one gathering their history
+  vector<SGDSolver<Dtype>*> shards_;
+  // The history written by the snapshot thread with snapshot_async
+  vector<shared_ptr<Blob<Dtype> > > snapshot_history_;
+  // The pointers of the params on the GPU, with their chunks and multipliers,
+  // kept until the params move, e.g. into the buffers of P2PSync.
+  vector<Dtype*> fused_params_;
+  shared_ptr<SyncedMemory> fused_params_gpu_;
+  Blob<int> fused_chunks_;
+  Blob<Dtype> fused_mults_;
+  // The norms of the gradients of the params, for clip_gradients
+  ArrayStats<Dtype> clip_stats_;
 
   DISABLE_COPY_AND_ASSIGN(SGDSolver);
 };
@@ -150,13 +279,16 @@ class SGDSolver : public Solver<Dtype> {
 template <typename Dtype>
 class NesterovSolver : public SGDSolver<Dtype> {
  public:
-  explicit NesterovSolver(const SolverParameter& param)
-      : SGDSolver<Dtype>(param) {}
+  explicit NesterovSolver(const SolverParameter& param,
+      const Solver<Dtype>* root_solver = NULL)
+      : SGDSolver<Dtype>(param, root_solver) {}
   explicit NesterovSolver(const string& param_file)
       : SGDSolver<Dtype>(param_file) {}
 
  protected:
-  virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual inline SolverParameter_SolverType update_type() const {
+    return SolverParameter_SolverType_NESTEROV;
+  }
 
   DISABLE_COPY_AND_ASSIGN(NesterovSolver);
 };
@@ -164,13 +296,16 @@ class NesterovSolver : public SGDSolver<Dtype> {
 template <typename Dtype>
 class AdaGradSolver : public SGDSolver<Dtype> {
  public:
-  explicit AdaGradSolver(const SolverParameter& param)
-      : SGDSolver<Dtype>(param) { constructor_sanity_check(); }
+  explicit AdaGradSolver(const SolverParameter& param,
+      const Solver<Dtype>* root_solver = NULL)
+      : SGDSolver<Dtype>(param, root_solver) { constructor_sanity_check(); }
   explicit AdaGradSolver(const string& param_file)
       : SGDSolver<Dtype>(param_file) { constructor_sanity_check(); }
 
  protected:
-  virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual inline SolverParameter_SolverType update_type() const {
+    return SolverParameter_SolverType_ADAGRAD;
+  }
   void constructor_sanity_check() {
     CHECK_EQ(0, this->param_.momentum())
         << "Momentum cannot be used with AdaGrad.";
@@ -183,13 +318,16 @@ class AdaGradSolver : public SGDSolver<Dtype> {
 template <typename Dtype>
 class RMSPropSolver : public SGDSolver<Dtype> {
  public:
-  explicit RMSPropSolver(const SolverParameter& param)
-      : SGDSolver<Dtype>(param) { constructor_sanity_check(); }
+  explicit RMSPropSolver(const SolverParameter& param,
+      const Solver<Dtype>* root_solver = NULL)
+      : SGDSolver<Dtype>(param, root_solver) { constructor_sanity_check(); }
   explicit RMSPropSolver(const string& param_file)
       : SGDSolver<Dtype>(param_file) { constructor_sanity_check(); }
 
  protected:
-  virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual inline SolverParameter_SolverType update_type() const {
+    return SolverParameter_SolverType_RMSPROP;
+  }
   void constructor_sanity_check() {
     CHECK_EQ(0, this->param_.momentum())
         << "Momentum cannot be used with RMSProp.";
@@ -205,14 +343,17 @@ class RMSPropSolver : public SGDSolver<Dtype> {
 template <typename Dtype>
 class AdaDeltaSolver : public SGDSolver<Dtype> {
  public:
-  explicit AdaDeltaSolver(const SolverParameter& param)
-      : SGDSolver<Dtype>(param) { AdaDeltaPreSolve(); }
+  explicit AdaDeltaSolver(const SolverParameter& param,
+      const Solver<Dtype>* root_solver = NULL)
+      : SGDSolver<Dtype>(param, root_solver) { AdaDeltaPreSolve(); }
   explicit AdaDeltaSolver(const string& param_file)
       : SGDSolver<Dtype>(param_file) { AdaDeltaPreSolve(); }
 
  protected:
   void AdaDeltaPreSolve();
-  virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual inline SolverParameter_SolverType update_type() const {
+    return SolverParameter_SolverType_ADADELTA;
+  }
 
   DISABLE_COPY_AND_ASSIGN(AdaDeltaSolver);
 };
@@ -228,35 +369,39 @@ class AdaDeltaSolver : public SGDSolver<Dtype> {
 template <typename Dtype>
 class AdamSolver : public SGDSolver<Dtype> {
  public:
-  explicit AdamSolver(const SolverParameter& param)
-      : SGDSolver<Dtype>(param) { AdamPreSolve();}
+  explicit AdamSolver(const SolverParameter& param,
+      const Solver<Dtype>* root_solver = NULL)
+      : SGDSolver<Dtype>(param, root_solver) { AdamPreSolve();}
   explicit AdamSolver(const string& param_file)
       : SGDSolver<Dtype>(param_file) { AdamPreSolve(); }
 
  protected:
   void AdamPreSolve();
-  virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual inline SolverParameter_SolverType update_type() const {
+    return SolverParameter_SolverType_ADAM;
+  }
 
   DISABLE_COPY_AND_ASSIGN(AdamSolver);
 };
 
 template <typename Dtype>
-Solver<Dtype>* GetSolver(const SolverParameter& param) {
+Solver<Dtype>* GetSolver(const SolverParameter& param,
+    const Solver<Dtype>* root_solver = NULL) {
   SolverParameter_SolverType type = param.solver_type();
 
   switch (type) {
   case SolverParameter_SolverType_SGD:
-      return new SGDSolver<Dtype>(param);
+      return new SGDSolver<Dtype>(param, root_solver);
   case SolverParameter_SolverType_NESTEROV:
-      return new NesterovSolver<Dtype>(param);
+      return new NesterovSolver<Dtype>(param, root_solver);
   case SolverParameter_SolverType_ADAGRAD:
-      return new AdaGradSolver<Dtype>(param);
+      return new AdaGradSolver<Dtype>(param, root_solver);
   case SolverParameter_SolverType_RMSPROP:
-      return new RMSPropSolver<Dtype>(param);
+      return new RMSPropSolver<Dtype>(param, root_solver);
   case SolverParameter_SolverType_ADADELTA:
-      return new AdaDeltaSolver<Dtype>(param);
+      return new AdaDeltaSolver<Dtype>(param, root_solver);
   case SolverParameter_SolverType_ADAM:
-      return new AdamSolver<Dtype>(param);
+      return new AdamSolver<Dtype>(param, root_solver);
   default:
       LOG(FATAL) << "Unknown SolverType: " << type;
   }
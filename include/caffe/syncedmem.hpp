@@ -8,32 +8,88 @@
 
 namespace caffe {
 
+#ifndef CPU_ONLY
+// Memory is served from caches of blocks previously freed by Caffe, with
+// sizes rounded up to buckets, and only allocated from CUDA on a miss.
+// cudaMallocHost is slow and takes a global lock, while cudaMalloc and
+// cudaFree synchronize the device, which would stall the GPU each time a
+// blob grows or a net is rebuilt. Freed device blocks can be handed out
+// again right away, so they must not be in use by work still queued on a
+// non-blocking stream. All have cudaMalloc's signature to be wrapped in
+// CUDA_CHECK.
+cudaError_t CaffeMallocPinned(void** ptr, size_t size);
+cudaError_t CaffeFreePinned(void* ptr);
+cudaError_t CaffeMallocGPU(void** ptr, size_t size);
+cudaError_t CaffeFreeGPU(void* ptr);
+// Returns the cached blocks of the current device to the driver
+void CaffeReleaseGPUCache();
+// Logs allocation counts, cache hit rate and memory held by the caches
+void CaffeLogMemoryStats();
+// The bytes of memory allocated by Caffe on the current device, blobs, cuDNN
+// workspaces and convolution buffers alike, in use and at most since the
+// last reset. Blocks are counted at their cached size, and cached free
+// blocks are not counted.
+void CaffeGPUMemoryUsage(size_t* used, size_t* peak);
+void CaffeResetGPUMemoryPeak();
+// Whether SyncedMemory allocates its buffers in GPU mode as CUDA managed
+// memory, on devices able to access it concurrently with the host (CUDA 8
+// or later). The host and the device then share the buffer: changing the
+// head only synchronizes, with a hint moving the pages to the device ahead
+// of the kernels, and the host only migrates the pages it touches. Managed
+// memory may exceed the memory of the device. Off by default, and only
+// affects the buffers allocated after.
+void CaffeSetManagedMemory(bool managed);
+bool CaffeManagedMemory();
+#endif
+
+// The copies between host and device made by SyncedMemory when data is read
+// or written on the side its head is not at, rather than pushed ahead with
+// async_gpu_push, e.g. a cpu_data() call on a blob computed on the GPU.
+struct TransferCount {
+  TransferCount() : calls(), bytes(), us() {}
+  // To the host, and to the device
+  int calls[2];
+  double bytes[2];
+  double us[2];
+};
+// Returns the copies made on the calling thread so far.
+const TransferCount& CaffeTransferCount();
+// Makes the copies on the calling thread fatal while what, e.g. the name of a
+// layer, is not NULL, naming it in the error.
+void CaffeFailOnTransfer(const char* what);
+
 // If CUDA is available and in GPU mode, host memory will be allocated pinned,
 // using cudaMallocHost. It avoids dynamic pinning for transfers (DMA).
 // The improvement in performance seems negligible in the single GPU case,
 // but might be more significant for parallel training. Most importantly,
 // it improved stability for large models on many GPUs.
-inline void CaffeMallocHost(void** ptr, size_t size) {
-#ifndef CPU_ONLY
-  if (Caffe::mode() == Caffe::GPU) {
-    CUDA_CHECK(cudaMallocHost(ptr, size));
-    return;
-  }
-#endif
-  *ptr = malloc(size);
-  CHECK(*ptr) << "host allocation of size " << size << " failed";
-}
+// In CPU mode, allocations of at least the huge pages threshold are backed by
+// huge pages, see CaffeSetHugePages.
+void CaffeMallocHost(void** ptr, size_t size);
+void CaffeFreeHost(void* ptr);
 
-inline void CaffeFreeHost(void* ptr) {
-#ifndef CPU_ONLY
-  if (Caffe::mode() == Caffe::GPU) {
-    CUDA_CHECK(cudaFreeHost(ptr));
-    return;
-  }
-#endif
-  free(ptr);
-}
+// Makes the host allocations of at least threshold bytes in CPU mode 2MB
+// aligned mappings backed by huge pages, cutting the TLB misses of GEMM and
+// im2col over large blobs. They come from the hugetlbfs pool reserved in
+// /proc/sys/vm/nr_hugepages if hugetlbfs, falling back to transparent huge
+// pages once it runs out, else are madvised as transparent huge pages. Their
+// pages are not touched when allocating, so each lands on the NUMA node of
+// the thread first writing it. 0, the default, allocates with malloc. Only
+// affects the buffers allocated after.
+void CaffeSetHugePages(size_t threshold, bool hugetlbfs);
+size_t CaffeHugePagesThreshold();
 
+// The huge page allocations made so far, by all threads.
+struct HugePageStats {
+  HugePageStats() : allocations(), hugetlbfs(), used(), peak() {}
+  int allocations;
+  int hugetlbfs;   // Of them, from the hugetlbfs pool
+  size_t used;     // Bytes mapped, rounded to huge pages
+  size_t peak;     // At most
+};
+HugePageStats CaffeHugePageStats();
+// Logs them, if huge pages are on
+void CaffeLogHugePageStats();
 
 /**
  * @brief Manages memory allocation and synchronization between the host (CPU)
@@ -45,10 +101,17 @@ class SyncedMemory {
  public:
   SyncedMemory()
       : cpu_ptr_(NULL), gpu_ptr_(NULL), size_(0), head_(UNINITIALIZED),
-        own_cpu_data_(false), own_gpu_data_(false), gpu_device_(-1) {}
+        own_cpu_data_(false), own_gpu_data_(false), managed_(false),
+        gpu_device_(-1), offset_(0), version_(0) {}
   explicit SyncedMemory(size_t size)
       : cpu_ptr_(NULL), gpu_ptr_(NULL), size_(size), head_(UNINITIALIZED),
-        own_cpu_data_(false), own_gpu_data_(false), gpu_device_(-1) {}
+        own_cpu_data_(false), own_gpu_data_(false), managed_(false),
+        gpu_device_(-1), offset_(0), version_(0) {}
+  // A view of size bytes of parent from offset. It has no memory or state of
+  // its own: accessing it syncs the whole parent, and writes go to it. Setting
+  // its memory ends the view.
+  SyncedMemory(const shared_ptr<SyncedMemory>& parent, size_t offset,
+      size_t size);
   ~SyncedMemory();
   const void* cpu_data();
   void set_cpu_data(void* data);
@@ -57,23 +120,49 @@ class SyncedMemory {
   void* mutable_cpu_data();
   void* mutable_gpu_data();
   enum SyncedHead { UNINITIALIZED, HEAD_AT_CPU, HEAD_AT_GPU, SYNCED };
-  SyncedHead head() { return head_; }
+  SyncedHead head() { return parent_ ? parent_->head() : head_; }
   size_t size() { return size_; }
+  // Counts the calls that could change the data, e.g. mutable_cpu_data, for
+  // values derived from it to tell they are stale. Writes through pointers
+  // taken earlier are not counted.
+  size_t version() { return parent_ ? parent_->version() : version_; }
+
+  // Whether this is a view of another SyncedMemory
+  bool is_view() const { return parent_.get() != NULL; }
+  // The SyncedMemory holding the memory, this one unless a view
+  SyncedMemory* owner() { return parent_ ? parent_->owner() : this; }
 
 #ifndef CPU_ONLY
   void async_gpu_push(const cudaStream_t& stream);
+  // Copies the data to the host on the stream, if at the GPU, leaving the
+  // head at the CPU so that the GPU memory may be reused once the copy is
+  // done.
+  void async_cpu_pull(const cudaStream_t& stream);
+  // Copies the data to the host on the stream, which must be at the GPU,
+  // leaving it synced like async_gpu_push, for the host to read it once the
+  // copy is done.
+  void async_cpu_copy(const cudaStream_t& stream);
 #endif
 
  private:
   void to_cpu();
   void to_gpu();
+  // Allocates the buffer as managed memory, if set and supported, returning
+  // whether it did, and frees it.
+  bool malloc_managed();
+  void free_managed();
   void* cpu_ptr_;
   void* gpu_ptr_;
   size_t size_;
   SyncedHead head_;
   bool own_cpu_data_;
   bool own_gpu_data_;
+  // Whether cpu_ptr_ and gpu_ptr_ are the same managed memory, owned
+  bool managed_;
   int gpu_device_;
+  shared_ptr<SyncedMemory> parent_;
+  size_t offset_;
+  size_t version_;
 
   DISABLE_COPY_AND_ASSIGN(SyncedMemory);
 };  // class SyncedMemory
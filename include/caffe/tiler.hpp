@@ -0,0 +1,126 @@
+#ifndef CAFFE_TILER_HPP_
+#define CAFFE_TILER_HPP_
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/net.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+namespace caffe {
+
+/**
+ * @brief An image too large to hold at once, read a region at a time, e.g.
+ * by decoding the blocks of a file around it.
+ */
+template <typename Dtype>
+class TileSource {
+ public:
+  virtual ~TileSource() {}
+  /// The channels, height and width of the image
+  virtual int channels() const = 0;
+  virtual int height() const = 0;
+  virtual int width() const = 0;
+  /// Reads the region of height x width pixels from (y, x) into data, one
+  /// channel after the other.
+  virtual void Read(int y, int x, int height, int width, Dtype* data) = 0;
+};
+
+/// @brief The image of a blob of 1 x channels x height x width.
+template <typename Dtype>
+class BlobTileSource : public TileSource<Dtype> {
+ public:
+  explicit BlobTileSource(const Blob<Dtype>& image);
+  virtual int channels() const { return image_.channels(); }
+  virtual int height() const { return image_.height(); }
+  virtual int width() const { return image_.width(); }
+  virtual void Read(int y, int x, int height, int width, Dtype* data);
+
+ protected:
+  const Blob<Dtype>& image_;
+};
+
+/**
+ * @brief Runs a fully convolutional net over an image larger than it can
+ * take at once, in tiles, and stitches its output over the whole image.
+ *
+ * The net reads the tiles from its first and only input blob, of
+ * N x channels x tile height x tile width, N tiles at a time, and the
+ * output over the image is its first output blob. Following the
+ * Convolution and Pooling layers, and the layers keeping the height and
+ * width of their bottoms, from the input to the output gives the stride of
+ * the output and its receptive field in the input. The tiles then start at
+ * multiples of the stride and overlap by the receptive field, and of each
+ * tile only the outputs whose receptive field lies within the tile, or
+ * which the border of the image cuts as well, are kept, so the stitched
+ * output is the one of a single pass over the whole image. A thread reads
+ * the next tiles from the source while the net runs the current ones.
+ */
+template <typename Dtype>
+class Tiler : public InternalThread {
+ public:
+  explicit Tiler(shared_ptr<Net<Dtype> > net);
+  virtual ~Tiler();
+
+  /// @brief Runs the net over the image of source into output, reshaped to
+  ///        1 x output channels x output height x output width.
+  void Run(TileSource<Dtype>* source, Blob<Dtype>* output);
+
+  /// The stride of the output in the input, along the height and width
+  int stride(int axis) const { return stride_[axis]; }
+  /// The receptive field of the output, along the height and width
+  int receptive_field(int axis) const { return field_[axis]; }
+  /// The number of tiles and forward passes of the last Run
+  int tiles() const { return tiles_.size(); }
+  int batches() const { return batches_.size(); }
+
+ protected:
+  // A region of the image, the first output of the net it keeps, and where
+  // that goes in the output over the image
+  struct Tile {
+    int y, x, height, width;
+    int out_y, out_x, out_height, out_width;
+    int to_y, to_x;
+  };
+  // The tiles of a forward pass, all of the same shape, and their pixels
+  struct TileBatch {
+    int begin, end;
+    Blob<Dtype> data;
+  };
+
+  virtual void InternalThreadEntry();
+  // Finds the stride and receptive field of the output from the layers.
+  void Trace();
+  // Places the tiles along an axis of the image of the given length,
+  // returning their origins and lengths.
+  void Place(int axis, int length, vector<int>* origins,
+      vector<int>* lengths) const;
+  // The height and width of the output of tiles of the given shape
+  const vector<int>& OutputShape(int height, int width);
+
+  shared_ptr<Net<Dtype> > net_;
+  // The tile shape and number per pass the net was set up for
+  vector<int> input_shape_;
+  int stride_[2];
+  int field_[2];
+  // The input pixel of the receptive field of the first output, relative to
+  // the tile, e.g. negative with padding
+  int first_[2];
+  map<std::pair<int, int>, vector<int> > output_shapes_;
+  TileSource<Dtype>* source_;
+  vector<Tile> tiles_;
+  vector<std::pair<int, int> > batches_;
+  vector<shared_ptr<TileBatch> > prefetch_;
+  BlockingQueue<TileBatch*> prefetch_free_;
+  BlockingQueue<TileBatch*> prefetch_full_;
+
+DISABLE_COPY_AND_ASSIGN(Tiler);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_TILER_HPP_
@@ -0,0 +1,107 @@
+#ifndef CAFFE_UTIL_APPROX_MATH_HPP_
+#define CAFFE_UTIL_APPROX_MATH_HPP_
+
+#include <cmath>
+
+// The approximations are compiled for the host and, by nvcc, for the device.
+#ifdef __CUDACC__
+#define CAFFE_HOST_DEVICE __host__ __device__
+#else
+#define CAFFE_HOST_DEVICE
+#endif
+
+namespace caffe {
+
+// Approximations of exp, tanh and the sigmoid, used by the layers with
+// approximate_math set. On the host, the float ones are made of a polynomial
+// and of integer operations on the bits of floats, which the compiler
+// vectorizes in loops, unlike calls to libm or compares of floats, and are
+// within a relative error of 2e-7. On the device, exp is the __expf
+// intrinsic, within 2 + 1.2 |x| ulps. NaNs are not propagated. The double
+// ones are exact.
+
+union ApproxFloatBits {
+  float f;
+  int i;
+};
+
+CAFFE_HOST_DEVICE inline int approx_float_bits(float f) {
+  ApproxFloatBits u;
+  u.f = f;
+  return u.i;
+}
+
+CAFFE_HOST_DEVICE inline float approx_bits_float(int i) {
+  ApproxFloatBits u;
+  u.i = i;
+  return u.f;
+}
+
+// The bits of 87.3f, beyond which exp(x) saturates to exp(87.3) and
+// exp(-x) to exp(-87.3)
+const int kApproxExpLimitBits = 0x42ae999a;
+// The bits of 0.625f, below which tanh is a polynomial
+const int kApproxTanhSmallBits = 0x3f200000;
+
+CAFFE_HOST_DEVICE inline float approx_exp(float x) {
+#ifdef __CUDA_ARCH__
+  return __expf(x);
+#else
+  const int bits = approx_float_bits(x);
+  const int abs_bits = bits & 0x7fffffff;
+  x = approx_bits_float((abs_bits < kApproxExpLimitBits ?
+      abs_bits : kApproxExpLimitBits) | (bits & ~0x7fffffff));
+  // x = n ln(2) + r, |r| <= ln(2) / 2, truncating a positive value to round
+  // x / ln(2) to the nearest n
+  const int n = static_cast<int>(x * 1.44269504f + 127.5f) - 127;
+  const float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+  // exp(r) by the polynomial of Cephes' expf
+  float p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  p = p * r * r + r + 1.f;
+  // times 2^n, made of its exponent bits
+  return p * approx_bits_float((n + 127) << 23);
+#endif
+}
+
+CAFFE_HOST_DEVICE inline double approx_exp(double x) {
+  return exp(x);
+}
+
+CAFFE_HOST_DEVICE inline float approx_tanh(float x) {
+  const int bits = approx_float_bits(x);
+  const int abs_bits = bits & 0x7fffffff;
+  const float a = approx_bits_float(abs_bits);
+  // The odd polynomial of Cephes' tanhf for small values, whose relative
+  // precision 1 - 2 / (exp(2x) + 1) loses
+  const float z = a * a;
+  float p = -5.70498872745e-3f;
+  p = p * z + 2.06390887954e-2f;
+  p = p * z - 5.37397155531e-2f;
+  p = p * z + 1.33314422036e-1f;
+  p = p * z - 3.33332819422e-1f;
+  const float small = p * z * a + a;
+  const float large = 1.f - 2.f / (approx_exp(2.f * a) + 1.f);
+  // Selected by a mask rather than a branch, which would keep the division
+  // from being vectorized
+  const int mask = -static_cast<int>(abs_bits < kApproxTanhSmallBits);
+  return approx_bits_float((approx_float_bits(small) & mask)
+      | (approx_float_bits(large) & ~mask) | (bits & ~0x7fffffff));
+}
+
+CAFFE_HOST_DEVICE inline double approx_tanh(double x) {
+  return tanh(x);
+}
+
+template <typename Dtype>
+CAFFE_HOST_DEVICE inline Dtype approx_sigmoid(Dtype x) {
+  return Dtype(1) / (Dtype(1) + approx_exp(-x));
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_APPROX_MATH_HPP_
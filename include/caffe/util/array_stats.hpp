@@ -0,0 +1,61 @@
+#ifndef CAFFE_UTIL_ARRAY_STATS_HPP_
+#define CAFFE_UTIL_ARRAY_STATS_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/syncedmem.hpp"
+
+namespace caffe {
+
+// The elements of an array summed by a block of caffe_gpu_array_stats
+const int kArrayStatsChunk = 65536;
+
+/**
+ * @brief Sums the absolute values and the squares of each of many arrays,
+ * e.g. the diffs of the params of a net. In GPU mode, all the sums take a
+ * single launch and a single copy back, rather than a reduction and a
+ * synchronization for each array.
+ */
+template <typename Dtype>
+class ArrayStats {
+ public:
+  ArrayStats() : num_chunks_() {}
+
+  /// Sums the arrays of counts elements, in the memory of the current mode
+  void Compute(const vector<const Dtype*>& arrays, const vector<int>& counts);
+
+  inline Dtype asum(int i) const {
+    return asums_[i];
+  }
+  inline Dtype sumsq(int i) const {
+    return sumsqs_[i];
+  }
+
+ protected:
+  vector<Dtype> asums_;
+  vector<Dtype> sumsqs_;
+  // The arrays the device tables were made for, kept while they do not
+  // change, as for the params of a net
+  vector<const Dtype*> arrays_;
+  vector<int> counts_;
+  shared_ptr<SyncedMemory> pointers_;
+  Blob<int> chunks_;
+  Blob<Dtype> stats_;
+  int num_chunks_;
+
+DISABLE_COPY_AND_ASSIGN(ArrayStats);
+};
+
+// Sums the absolute values and the squares of the elements of each chunk, a
+// block per chunk, in a single launch. Each chunk is an array, a start and
+// an end, of at most kArrayStatsChunk elements. stats receives the two sums
+// of each chunk.
+template <typename Dtype>
+void caffe_gpu_array_stats(const int num_chunks, const int* chunks,
+    const Dtype* const* arrays, Dtype* stats);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_ARRAY_STATS_HPP_
@@ -0,0 +1,63 @@
+#ifndef CAFFE_UTIL_ASYNC_READER_HPP_
+#define CAFFE_UTIL_ASYNC_READER_HPP_
+
+#include <stdint.h>
+
+#include <map>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// Reads ranges of files with up to depth reads outstanding, e.g. the records
+// of a database read in a random order, so that cold reads from NVMe or
+// network filesystems are bound by their bandwidth rather than the latency
+// of each. Reads go through io_uring where the kernel supports it, else
+// through depth threads each reading one at a time. Not thread safe.
+class AsyncReader {
+ public:
+  // With threads, reads with threads even if io_uring is supported
+  explicit AsyncReader(int depth, bool threads = false);
+  // Waits for the reads outstanding
+  ~AsyncReader();
+
+  inline int depth() const {
+    return depth_;
+  }
+  // Whether the reads go through io_uring
+  bool uring() const;
+
+  // Starts reading size bytes of the file at the offset into the buffer,
+  // which must outlive the read, waiting first for one of the reads
+  // outstanding if there are depth of them. Returns the id of the read.
+  uint64_t submit(int fd, uint64_t offset, size_t size, char* buffer);
+  // Waits for the read, fatal if it failed or reached the end of the file
+  void wait(uint64_t id);
+
+ protected:
+  // Only in the .cpp, see BlockingQueue
+  class sync;
+  class Ring;
+  class Read;
+
+  // Pushes the rest of the read to the ring
+  void push(uint64_t id, Read* read);
+  // Waits for at least one completion of the ring
+  void reap();
+  // Runs the reads of the queue, on each thread
+  void entry();
+
+  const int depth_;
+  shared_ptr<sync> sync_;
+  shared_ptr<Ring> ring_;
+  // Reads submitted and not waited for yet, by id
+  std::map<uint64_t, shared_ptr<Read> > reads_;
+  uint64_t next_id_;
+  int outstanding_;
+
+DISABLE_COPY_AND_ASSIGN(AsyncReader);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_ASYNC_READER_HPP_
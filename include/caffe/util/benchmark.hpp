@@ -3,6 +3,10 @@
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <map>
+#include <vector>
+
+#include "caffe/common.hpp"
 #include "caffe/util/device_alternate.hpp"
 
 namespace caffe {
@@ -47,6 +51,69 @@ class CPUTimer : public Timer {
   virtual float MicroSeconds();
 };
 
+/**
+ * @brief Times many intervals, e.g. every layer call, without waiting for
+ *        the GPU as Timer does.
+ *
+ * In GPU mode, Start and Stop record events on the stream of the thread,
+ * the events of a ring of intervals created once. The durations are read
+ * lazily, by Poll once the GPU is done with an interval, or by Synchronize,
+ * and added to the total of the key of the interval. The ring waits for its
+ * oldest interval only when full, so make it hold a few iterations. In CPU
+ * mode intervals are timed on the wall clock at Stop.
+ *
+ * Intervals of different keys may nest. A timer is used by one thread, on
+ * the device and in the mode it was created in.
+ */
+class EventTimer {
+ public:
+  explicit EventTimer(int capacity = 4096);
+  ~EventTimer();
+
+  void Start(int key);
+  void Stop(int key);
+  /// @brief Adds the durations of the intervals the GPU is done with to
+  ///        their totals, without waiting.
+  void Poll();
+  /// @brief Waits for the stopped intervals and adds their durations.
+  void Synchronize();
+  /// @brief Forgets the totals and the intervals not read yet.
+  void Clear();
+
+  /// @brief The total of the intervals of a key read so far
+  double MicroSeconds(int key) const;
+  /// @brief The number of intervals of a key read so far
+  int count(int key) const;
+
+ protected:
+  struct Interval {
+    int key;
+    bool stopped;
+    boost::posix_time::ptime start_cpu;
+    double elapsed_us;
+#ifndef CPU_ONLY
+    cudaEvent_t start_gpu;
+    cudaEvent_t stop_gpu;
+#endif
+  };
+  // Reads the oldest interval, waiting for it if wait, or returns false
+  bool ReadOldest(bool wait);
+
+  bool gpu_;
+  vector<Interval> ring_;
+  // The events of the first created_ intervals of the ring are created
+  int created_;
+  // The oldest interval not read, and the number of those
+  int tail_;
+  int size_;
+  // The interval started of each key not stopped
+  std::map<int, int> open_;
+  vector<double> totals_;
+  vector<int> counts_;
+
+  DISABLE_COPY_AND_ASSIGN(EventTimer);
+};
+
 }  // namespace caffe
 
 #endif   // CAFFE_UTIL_BENCHMARK_H_
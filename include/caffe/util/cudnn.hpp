@@ -4,9 +4,14 @@
 
 #include <cudnn.h>
 
+#include <string>
+
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
 
+#define CUDNN_VERSION_MIN(major, minor, patch) \
+    (CUDNN_VERSION >= (major * 1000 + minor * 100 + patch))
+
 #define CUDNN_CHECK(condition) \
   do { \
     cudnnStatus_t status = condition; \
@@ -84,6 +89,17 @@ inline void setTensor4dDesc(cudnnTensorDescriptor_t* desc,
                          stride_n, stride_c, stride_h, stride_w);
 }
 
+// The strides of a blob of the given layout, see Blob::layout
+template <typename Dtype>
+inline void setTensor4dDesc(cudnnTensorDescriptor_t* desc,
+    int n, int c, int h, int w, Layout layout) {
+  if (layout == NHWC) {
+    setTensor4dDesc<Dtype>(desc, n, c, h, w, h * w * c, 1, w * c, c);
+  } else {
+    setTensor4dDesc<Dtype>(desc, n, c, h, w);
+  }
+}
+
 template <typename Dtype>
 inline void createFilterDesc(cudnnFilterDescriptor_t* desc,
     int n, int c, int h, int w) {
@@ -124,6 +140,33 @@ inline void createPoolingDesc(cudnnPoolingDescriptor_t* pool_desc,
         pad_h, pad_w, stride_h, stride_w));
 }
 
+#if CUDNN_VERSION_MIN(3, 0, 0)
+template <typename Dtype>
+inline void createLRNDesc(cudnnLRNDescriptor_t* desc, int size, Dtype alpha,
+    Dtype beta, Dtype k) {
+  CUDNN_CHECK(cudnnCreateLRNDescriptor(desc));
+  CUDNN_CHECK(cudnnSetLRNDescriptor(*desc, size, alpha, beta, k));
+}
+#endif
+
+// Gets the forward algorithm autotuned for a convolution key, naming its
+// shapes and device, if this process or the cache file already tuned it.
+bool GetCachedAlgo(const std::string& key, int* algo);
+// Remembers an autotuned algorithm, adding it to the cache file if set.
+void CacheAlgo(const std::string& key, int algo);
+// Loads the algorithms cached in the file, which then keeps later ones.
+void SetAlgoCacheFile(const std::string& path);
+
+// The layers a thread runs on a device, one after the other, share cuDNN
+// handles and one workspace rather than each creating their own.
+// Returns the i-th shared handle, created on a stream of its own on first use.
+cudnnHandle_t SharedHandle(int i);
+// Returns the stream of SharedHandle(i).
+cudaStream_t SharedStream(int i);
+// Returns the shared workspace, grown to at least size bytes, or NULL if it
+// cannot grow to size.
+void* SharedWorkspace(size_t size);
+
 }  // namespace cudnn
 
 }  // namespace caffe
@@ -0,0 +1,45 @@
+#ifndef CAFFE_UTIL_DATA_STATS_HPP_
+#define CAFFE_UTIL_DATA_STATS_HPP_
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// Counters of the pipeline feeding a data layer, to tell whether training
+// waits for data. Times are in microseconds. Counters are updated by the
+// reader, prefetch and solver threads, so all methods are thread safe.
+class DataStats {
+ public:
+  enum Counter {
+    QUEUE_DEPTH,  // Prefetched batches ready when the net asks for one
+    WAIT,         // Time the net waits for a batch, sampled every iteration
+    READ,         // Time reading records from the source
+    DECODE,       // Time parsing records into datums
+    TRANSFORM,    // Time transforming datums into a batch
+    NUM_COUNTERS
+  };
+
+  DataStats();
+
+  void add(Counter counter, double value);
+  double total(Counter counter) const;
+  size_t samples(Counter counter) const;
+
+  // Adds the counters of other to these, and resets those of other
+  void take(DataStats* other);
+  void reset();
+
+ protected:
+  // Only in the .cpp, see BlockingQueue
+  class sync;
+
+  shared_ptr<sync> sync_;
+  double totals_[NUM_COUNTERS];
+  size_t samples_[NUM_COUNTERS];
+
+DISABLE_COPY_AND_ASSIGN(DataStats);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_DATA_STATS_HPP_
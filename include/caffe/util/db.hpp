@@ -1,15 +1,21 @@
 #ifndef CAFFE_UTIL_DB_HPP
 #define CAFFE_UTIL_DB_HPP
 
+#include <stdint.h>
+
 #include <string>
+#include <vector>
 
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/rng.hpp"
 
 namespace caffe { namespace db {
 
 enum Mode { READ, WRITE, NEW };
 
+class DB;
+
 class Cursor {
  public:
   Cursor() { }
@@ -18,17 +24,150 @@ class Cursor {
   virtual void Next() = 0;
   virtual string key() = 0;
   virtual string value() = 0;
+  // The value without a copy, valid until the cursor moves
+  virtual const char* value_data() = 0;
+  virtual size_t value_size() = 0;
   virtual bool valid() = 0;
+  // Moves to the record of the key, returning whether there is one
+  virtual bool Seek(const string& key) = 0;
+  // Hints that the value of the current record will be read soon, e.g. to
+  // read it ahead from disk
+  virtual void WillNeed() { }
 
   DISABLE_COPY_AND_ASSIGN(Cursor);
 };
 
+// Reads the records of a database in a random order, permuted anew each time
+// it moves to the first, by seeking their keys. Cursors over the same keys
+// created with the same seed read the same records. The values of the
+// records readahead positions ahead are read ahead.
+class RandomCursor : public Cursor {
+ public:
+  RandomCursor(DB* db, shared_ptr<const vector<string> > keys,
+               unsigned int seed, int readahead);
+  virtual void SeekToFirst();
+  virtual void Next();
+  virtual string key() { return cursor_->key(); }
+  virtual string value() { return cursor_->value(); }
+  virtual const char* value_data() { return cursor_->value_data(); }
+  virtual size_t value_size() { return cursor_->value_size(); }
+  virtual bool valid() { return position_ < order_.size(); }
+  virtual bool Seek(const string& key) { return cursor_->Seek(key); }
+
+  // The keys of the database, read once with a cursor
+  static shared_ptr<const vector<string> > ReadKeys(DB* db);
+
+ private:
+  // Moves the cursor to the record at the position in the order
+  void Place(size_t position);
+  // Moves the cursor ahead to the record at the position and reads it ahead
+  void ReadAhead(size_t position);
+
+  shared_ptr<Cursor> cursor_;
+  shared_ptr<Cursor> ahead_;
+  shared_ptr<const vector<string> > keys_;
+  const unsigned int seed_;
+  const int readahead_;
+  int epoch_;
+  vector<int> order_;
+  size_t position_;
+};
+
+// Reads a range of the records of a cursor, the given number of them from
+// the record of the first key, e.g. the share of a machine of a database
+class RangeCursor : public Cursor {
+ public:
+  RangeCursor(Cursor* cursor, const string& first, size_t records);
+  virtual void SeekToFirst();
+  virtual void Next();
+  virtual string key() { return cursor_->key(); }
+  virtual string value() { return cursor_->value(); }
+  virtual const char* value_data() { return cursor_->value_data(); }
+  virtual size_t value_size() { return cursor_->value_size(); }
+  virtual bool valid() { return position_ < records_ && cursor_->valid(); }
+  virtual bool Seek(const string& key);
+  virtual void WillNeed() { cursor_->WillNeed(); }
+
+ private:
+  shared_ptr<Cursor> cursor_;
+  const string first_;
+  const size_t records_;
+  size_t position_;
+};
+
+// Mixes the records of several cursors, each record read from one drawn at
+// random with the probability of its weight. Each cursor wraps around past
+// its last record, so this cursor stays valid. Cursors over the same
+// sources created with the same seed read the same records.
+class MixCursor : public Cursor {
+ public:
+  // Takes ownership of the cursors
+  MixCursor(const vector<Cursor*>& cursors, const vector<float>& weights,
+            unsigned int seed);
+  virtual void SeekToFirst();
+  virtual void Next();
+  virtual string key() { return cursors_[current_]->key(); }
+  virtual string value() { return cursors_[current_]->value(); }
+  virtual const char* value_data() {
+    return cursors_[current_]->value_data();
+  }
+  virtual size_t value_size() { return cursors_[current_]->value_size(); }
+  virtual bool valid() { return true; }
+  virtual bool Seek(const string& key);
+
+  // The cursor the current record is read from
+  inline int current() const { return current_; }
+
+ private:
+  void Draw();
+
+  vector<shared_ptr<Cursor> > cursors_;
+  // The cumulative weights of the cursors
+  vector<double> cumulative_;
+  const unsigned int seed_;
+  rng_t rng_;
+  int current_;
+};
+
+// Reads the records of a cursor through a buffer of the given size, in which
+// each record read replaces the one last delivered, and the next delivered
+// is drawn at random. Moving past the last record of the cursor wraps
+// around, so this cursor stays valid. Cursors over the same records created
+// with the same seed deliver the same records.
+class ShuffleBufferCursor : public Cursor {
+ public:
+  ShuffleBufferCursor(Cursor* cursor, int size, unsigned int seed);
+  virtual void SeekToFirst();
+  virtual void Next();
+  virtual string key() { return keys_[current_]; }
+  virtual string value() { return values_[current_]; }
+  virtual const char* value_data() { return values_[current_].data(); }
+  virtual size_t value_size() { return values_[current_].size(); }
+  virtual bool valid() { return true; }
+  virtual bool Seek(const string& key);
+
+ private:
+  // Copies the record of the cursor into the slot, and moves it to the next
+  void Read(int slot);
+
+  shared_ptr<Cursor> cursor_;
+  const int size_;
+  const unsigned int seed_;
+  rng_t rng_;
+  vector<string> keys_;
+  vector<string> values_;
+  int current_;
+};
+
 class Transaction {
  public:
   Transaction() { }
   virtual ~Transaction() { }
   virtual void Put(const string& key, const string& value) = 0;
   virtual void Commit() = 0;
+  // Promises that keys are put in increasing order, after those already in
+  // the database, which lets LMDB append them.
+  virtual void set_append(bool value) { }
 
   DISABLE_COPY_AND_ASSIGN(Transaction);
 };
@@ -45,8 +184,19 @@ class DB {
   DISABLE_COPY_AND_ASSIGN(DB);
 };
 
+// Little-endian integers of the files of the CHUNKS and RECORDS backends
+void AppendFixed32(uint32_t value, string* out);
+void AppendFixed64(uint64_t value, string* out);
+uint32_t Fixed32(const char* data);
+uint64_t Fixed64(const char* data);
+// Writes all bytes to the file, fatal on errors
+void WriteAll(int fd, const char* data, size_t size);
+
 DB* GetDB(DataParameter::DB backend);
 DB* GetDB(const string& backend);
+// The database of a data layer, with the options of its backend. Databases
+// of chunks only read the chunks of the shard out of shards.
+DB* GetDB(const DataParameter& param, int shard, int shards);
 
 }  // namespace db
 }  // namespace caffe
@@ -0,0 +1,166 @@
+#ifndef CAFFE_UTIL_DB_CHUNKS_HPP
+#define CAFFE_UTIL_DB_CHUNKS_HPP
+
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "caffe/util/db.hpp"
+
+namespace caffe { namespace db {
+
+// Reads byte ranges of a file, local or remote
+class ChunkFile {
+ public:
+  virtual ~ChunkFile() { }
+  virtual size_t size() = 0;
+  // Reads size bytes from offset into data, returning once all are read
+  virtual void Read(size_t offset, size_t size, char* data) = 0;
+
+  // Opens a local path, or an http:// URL read with range requests, e.g.
+  // of an object store
+  static ChunkFile* Open(const string& source);
+};
+
+// Where the records of a chunk are in the file
+struct ChunkInfo {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t records;
+  string first_key;
+};
+
+// Reads the records of a shard of the chunks in order, while threads read
+// the next readahead chunks. Past the last chunk, the first ones are read
+// ahead again, as the data layers start over.
+class ChunkCursor : public Cursor {
+ public:
+  // Reads the chunks of the index at the given positions, each copied to
+  // the cache prefix followed by its position in the index, unless empty
+  ChunkCursor(shared_ptr<ChunkFile> file,
+              shared_ptr<const vector<ChunkInfo> > index,
+              const vector<int>& chunks, bool sorted, int readahead,
+              const string& cache);
+  virtual ~ChunkCursor();
+  virtual void SeekToFirst();
+  virtual void Next();
+  virtual string key() { return string(key_, key_size_); }
+  virtual string value() { return string(value_, value_size_); }
+  // Points to the chunk read
+  virtual const char* value_data() { return value_; }
+  virtual size_t value_size() { return value_size_; }
+  virtual bool valid() { return position_ < chunks_.size(); }
+  // Finds the chunk of the key from the first key of each, so needs keys
+  // written in increasing order. Reads the whole chunk, so reading records
+  // at random is slow, prefer shuffle_buffer.
+  virtual bool Seek(const string& key);
+
+ private:
+  // Only in the .cpp, see BlockingQueue
+  struct Fetch;
+
+  // Makes the chunk at the position current, from the chunks read ahead if
+  // it is the next one
+  void Load(int position);
+  // Starts reading the next chunk to read ahead
+  void FetchNext();
+  // Waits for the chunks read ahead, and drops them
+  void Cancel();
+  // Points to the record at offset_ of the current chunk
+  void Parse();
+
+  shared_ptr<ChunkFile> file_;
+  shared_ptr<const vector<ChunkInfo> > index_;
+  const vector<int> chunks_;
+  const bool sorted_;
+  const int readahead_;
+  const string cache_;
+  std::deque<shared_ptr<Fetch> > fetches_;
+  int next_fetch_;
+  shared_ptr<Fetch> current_;
+  size_t position_;
+  uint32_t record_;
+  size_t offset_;
+  const char* key_;
+  uint32_t key_size_;
+  const char* value_;
+  uint32_t value_size_;
+};
+
+class ChunkDB;
+
+// Records are written once their chunk is full, the last one and the index
+// on closing the database
+class ChunkTransaction : public Transaction {
+ public:
+  explicit ChunkTransaction(ChunkDB* db) : db_(db) { }
+  virtual void Put(const string& key, const string& value);
+  virtual void Commit() { }
+
+ private:
+  ChunkDB* db_;
+
+  DISABLE_COPY_AND_ASSIGN(ChunkTransaction);
+};
+
+// A file of records in large chunks, followed by an index of the chunks,
+// which suits reading in order from remote storage: each chunk is read with
+// one request, several at a time. The source is a local path, or an http://
+// URL to read from, written locally then uploaded.
+class ChunkDB : public DB {
+ public:
+  // Chunks of 64 MB by default
+  static const size_t kChunkSize = 64 << 20;
+
+  explicit ChunkDB(size_t chunk_size = kChunkSize);
+  virtual ~ChunkDB() { Close(); }
+  virtual void Open(const string& source, Mode mode);
+  virtual void Close();
+  virtual ChunkCursor* NewCursor();
+  virtual ChunkTransaction* NewTransaction() {
+    return new ChunkTransaction(this);
+  }
+
+  // The number of chunks cursors read ahead, 4 by default
+  void set_readahead(int chunks) { readahead_ = chunks; }
+  // A local directory, e.g. on SSD, keeping a copy of the chunks read to
+  // read them from there next time
+  void set_cache(const string& directory) { cache_ = directory; }
+  // Cursors only read the chunks i of i % shards == shard
+  void set_shard(int shard, int shards) {
+    shard_ = shard;
+    shards_ = shards;
+  }
+
+ protected:
+  friend class ChunkTransaction;
+
+  void Put(const string& key, const string& value);
+  // Reads the index at the end of the file, returning its offset
+  uint64_t ReadIndex(ChunkFile* file);
+  void WriteChunk();
+
+  const size_t chunk_size_;
+  string source_;
+  int readahead_;
+  string cache_;
+  int shard_;
+  int shards_;
+  shared_ptr<ChunkFile> file_;
+  shared_ptr<vector<ChunkInfo> > index_;
+  // Whether the keys were written in increasing order
+  bool sorted_;
+  // The file written, and the chunk being filled
+  int fd_;
+  uint64_t offset_;
+  string chunk_;
+  ChunkInfo info_;
+  string last_key_;
+};
+
+}  // namespace db
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_DB_CHUNKS_HPP
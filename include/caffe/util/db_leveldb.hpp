@@ -19,7 +19,13 @@ class LevelDBCursor : public Cursor {
   virtual void Next() { iter_->Next(); }
   virtual string key() { return iter_->key().ToString(); }
   virtual string value() { return iter_->value().ToString(); }
+  virtual const char* value_data() { return iter_->value().data(); }
+  virtual size_t value_size() { return iter_->value().size(); }
   virtual bool valid() { return iter_->Valid(); }
+  virtual bool Seek(const string& key) {
+    iter_->Seek(key);
+    return iter_->Valid() && iter_->key() == key;
+  }
 
  private:
   leveldb::Iterator* iter_;
@@ -32,7 +32,20 @@ class LMDBCursor : public Cursor {
     return string(static_cast<const char*>(mdb_value_.mv_data),
         mdb_value_.mv_size);
   }
+  // Points to the memory mapped file
+  virtual const char* value_data() {
+    return static_cast<const char*>(mdb_value_.mv_data);
+  }
+  virtual size_t value_size() { return mdb_value_.mv_size; }
   virtual bool valid() { return valid_; }
+  virtual bool Seek(const string& key) {
+    mdb_key_.mv_data = const_cast<char*>(key.data());
+    mdb_key_.mv_size = key.size();
+    Seek(MDB_SET_KEY);
+    return valid_;
+  }
+  // Advises the kernel to read the pages of the value from the file
+  virtual void WillNeed();
 
  private:
   void Seek(MDB_cursor_op op) {
@@ -54,13 +67,15 @@ class LMDBCursor : public Cursor {
 class LMDBTransaction : public Transaction {
  public:
   explicit LMDBTransaction(MDB_dbi* mdb_dbi, MDB_txn* mdb_txn)
-    : mdb_dbi_(mdb_dbi), mdb_txn_(mdb_txn) { }
+    : mdb_dbi_(mdb_dbi), mdb_txn_(mdb_txn), append_(false) { }
   virtual void Put(const string& key, const string& value);
   virtual void Commit() { MDB_CHECK(mdb_txn_commit(mdb_txn_)); }
+  virtual void set_append(bool value) { append_ = value; }
 
  private:
   MDB_dbi* mdb_dbi_;
   MDB_txn* mdb_txn_;
+  bool append_;
 
   DISABLE_COPY_AND_ASSIGN(LMDBTransaction);
 };
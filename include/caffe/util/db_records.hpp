@@ -0,0 +1,148 @@
+#ifndef CAFFE_UTIL_DB_RECORDS_HPP
+#define CAFFE_UTIL_DB_RECORDS_HPP
+
+#include <stdint.h>
+
+#include <boost/thread/mutex.hpp>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/util/async_reader.hpp"
+#include "caffe/util/db.hpp"
+
+namespace caffe { namespace db {
+
+class RecordDB;
+
+// Reads the records of the memory mapped data file. Moving to the next
+// record reads the data ahead from disk by windows of kReadahead bytes.
+// Seeking a record read ahead with WillNeed takes it from the database
+// instead.
+class RecordCursor : public Cursor {
+ public:
+  static const size_t kReadahead = 32 << 20;
+
+  explicit RecordCursor(RecordDB* db) : db_(db) { SeekToFirst(); }
+  virtual void SeekToFirst();
+  virtual void Next();
+  virtual string key() { return string(key_, key_size_); }
+  virtual string value() { return string(key_ + key_size_, value_size_); }
+  // Points to the memory mapped file
+  virtual const char* value_data() { return key_ + key_size_; }
+  virtual size_t value_size() { return value_size_; }
+  virtual bool valid();
+  virtual bool Seek(const string& key);
+  // Starts reading the record from the file, see RecordDB::ReadAhead
+  virtual void WillNeed();
+
+ private:
+  // Points to the record, reading ahead if sequential
+  void Place(size_t record, bool sequential);
+
+  RecordDB* db_;
+  size_t record_;
+  const char* key_;
+  uint32_t key_size_;
+  uint32_t value_size_;
+  // The end of the data read ahead
+  uint64_t ahead_;
+  // The record, if it was read ahead
+  string buffer_;
+};
+
+// Records are written on commit, the data then the index, so that a
+// database always holds the records of its last commit
+class RecordTransaction : public Transaction {
+ public:
+  explicit RecordTransaction(RecordDB* db) : db_(db) { }
+  virtual void Put(const string& key, const string& value);
+  virtual void Commit();
+
+ private:
+  RecordDB* db_;
+  string data_;
+  vector<uint32_t> sizes_;
+
+  DISABLE_COPY_AND_ASSIGN(RecordTransaction);
+};
+
+// A directory of two files written once: the records one after the other,
+// keys then values, in a data file, and the offset and sizes of each in an
+// index of 16 bytes per record. Unlike LMDB there are no pages to fill or
+// map size to set, so the database is about the size of its records, and
+// reading it in order reads the data file in order.
+class RecordDB : public DB {
+ public:
+  RecordDB();
+  virtual ~RecordDB() { Close(); }
+  virtual void Open(const string& source, Mode mode);
+  virtual void Close();
+  virtual RecordCursor* NewCursor() { return new RecordCursor(this); }
+  virtual RecordTransaction* NewTransaction() {
+    return new RecordTransaction(this);
+  }
+
+  inline size_t records() const { return records_; }
+  inline const char* data() const { return data_; }
+  inline size_t data_size() const { return data_size_; }
+  // The offset in the data file and sizes of the record
+  void Entry(size_t record, uint64_t* offset, uint32_t* key_size,
+             uint32_t* value_size) const;
+  string Key(size_t record) const;
+  // The record of the key, or records() if none. Binary searches the keys,
+  // in the order of a permutation sorting them, computed on the first search
+  // if they were not written in increasing order.
+  size_t Find(const string& key);
+  // Starts reading the record from the data file, with up to kReadDepth
+  // reads outstanding, for the next cursor seeking it to take. Unlike the
+  // memory mapped file, which reads the pages of a cold record one fault at
+  // a time, this keeps a fast disk busy when reading in a random order.
+  void ReadAhead(size_t record);
+  // Moves the data of the record into the buffer, waiting for it to be
+  // read, and returns true if it was read ahead
+  bool TakeAhead(size_t record, string* buffer);
+
+  // Reads outstanding at most, and records read ahead kept at most, the
+  // oldest dropped, e.g. those of cursors that moved elsewhere
+  static const int kReadDepth = 64;
+  static const int kMaxAhead = 1024;
+
+ protected:
+  friend class RecordTransaction;
+
+  // Appends the records of a transaction, of the given sizes of each key
+  // then value, to the files
+  void Append(const string& data, const vector<uint32_t>& sizes);
+
+  string source_;
+  int data_fd_;
+  int index_fd_;
+  // The memory mapped files, when reading
+  char* data_;
+  size_t data_size_;
+  char* index_;
+  size_t index_size_;
+  size_t records_;
+  // Whether the keys were written in increasing order
+  bool sorted_;
+  vector<uint32_t> order_;
+  boost::mutex order_mutex_;
+  // The records read ahead, by record, with the id of their read, and the
+  // order they were read ahead in
+  shared_ptr<AsyncReader> reader_;
+  std::map<size_t, std::pair<uint64_t, string> > ahead_;
+  std::deque<size_t> ahead_order_;
+  boost::mutex ahead_mutex_;
+  // When writing, the end of the data file and the last key
+  uint64_t end_;
+  string last_key_;
+};
+
+}  // namespace db
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_DB_RECORDS_HPP
@@ -0,0 +1,110 @@
+#ifndef CAFFE_UTIL_DB_SERVICE_HPP
+#define CAFFE_UTIL_DB_SERVICE_HPP
+
+#include <stdint.h>
+
+#include <string>
+
+#include "caffe/util/db.hpp"
+
+namespace caffe { namespace db {
+
+class ServiceDB;
+
+// Reads the records published after it was created, in order, pointing to
+// them in shared memory. Blocks until the next record is published, and
+// holds back the service until it moves past the current one.
+class ServiceCursor : public Cursor {
+ public:
+  explicit ServiceCursor(ServiceDB* db);
+  virtual ~ServiceCursor();
+  // The stream has no first record, the cursor stays where it is
+  virtual void SeekToFirst() { }
+  virtual void Next();
+  // The number of the record, in the order of publication
+  virtual string key();
+  virtual string value() { return string(value_data(), value_size()); }
+  virtual const char* value_data();
+  virtual size_t value_size();
+  virtual bool valid() { return true; }
+  virtual bool Seek(const string& key);
+
+ private:
+  // Waits for the record at position_ to be published
+  void Wait();
+
+  ServiceDB* db_;
+  // The slot of the cursor in the readers of the service
+  int reader_;
+  uint64_t position_;
+  // The number of records published when last checked
+  uint64_t published_;
+};
+
+// Publishes each record put, blocking while the ring is full
+class ServiceTransaction : public Transaction {
+ public:
+  explicit ServiceTransaction(ServiceDB* db) : db_(db) { }
+  virtual void Put(const string& key, const string& value);
+  virtual void Commit() { }
+
+ private:
+  ServiceDB* db_;
+
+  DISABLE_COPY_AND_ASSIGN(ServiceTransaction);
+};
+
+// A ring of records in POSIX shared memory, written by one process, e.g.
+// tools/data_service reading and decoding a database once, and read by
+// the data layers of the jobs of the host. Each cursor reads all records
+// published while it exists, so the service goes at the pace of the
+// slowest job. Readers and writers that exit without closing are detected
+// from their process ids.
+class ServiceDB : public DB {
+ public:
+  // 64 slots of 4 MB by default
+  static const int kSlots = 64;
+  static const size_t kSlotSize = 4 << 20;
+  // The number of cursors reading a service at a time
+  static const int kReaders = 64;
+
+  ServiceDB();
+  virtual ~ServiceDB() { Close(); }
+  // Creates the shared memory of the name when writing, or waits for it to
+  // be created when reading
+  virtual void Open(const string& source, Mode mode);
+  virtual void Close();
+  virtual ServiceCursor* NewCursor() { return new ServiceCursor(this); }
+  virtual ServiceTransaction* NewTransaction();
+
+  // The size of the ring created by Open, each record at most slot_size
+  void set_ring(int slots, size_t slot_size) {
+    slots_ = slots;
+    slot_size_ = slot_size;
+  }
+
+ protected:
+  friend class ServiceCursor;
+  friend class ServiceTransaction;
+  // Only in the .cpp
+  struct Header;
+
+  void Publish(const string& value);
+  // The size then data of the slot of the record
+  inline char* slot(uint64_t record) const {
+    return data_ + (record % slots_) * (sizeof(uint64_t) + slot_size_);
+  }
+
+  string name_;
+  bool writer_;
+  int slots_;
+  size_t slot_size_;
+  Header* header_;
+  char* data_;
+  size_t size_;
+};
+
+}  // namespace db
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_DB_SERVICE_HPP
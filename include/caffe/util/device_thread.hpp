@@ -0,0 +1,43 @@
+#ifndef CAFFE_UTIL_DEVICE_THREAD_HPP_
+#define CAFFE_UTIL_DEVICE_THREAD_HPP_
+
+#include <boost/function.hpp>
+
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+namespace caffe {
+
+// A thread of the process on one GPU, running the work queued to it in
+// order, e.g. the stages of the pipelined nets placed on that GPU. Work
+// queued by several threads thus never runs on the GPU at the same time.
+class DeviceThread : public InternalThread {
+ public:
+  // The thread of device, started in the current mode on first use
+  static DeviceThread* Get(int device);
+  virtual ~DeviceThread();
+
+  inline int device() const {
+    return device_;
+  }
+
+  // Queues work and returns
+  void Run(const boost::function<void()>& work);
+  // Queues work and returns once it ran. Must not be called from the
+  // thread itself.
+  void RunAndWait(const boost::function<void()>& work);
+
+ protected:
+  explicit DeviceThread(int device);
+  void InternalThreadEntry();
+
+  const int device_;
+  BlockingQueue<boost::function<void()> > queue_;
+
+DISABLE_COPY_AND_ASSIGN(DeviceThread);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_DEVICE_THREAD_HPP_
@@ -0,0 +1,87 @@
+#ifndef CAFFE_UTIL_ELEMENTWISE_OPS_HPP_
+#define CAFFE_UTIL_ELEMENTWISE_OPS_HPP_
+
+#include <cmath>
+
+// The functions are compiled for the host and, by nvcc, for the device.
+#ifdef __CUDACC__
+#define CAFFE_HOST_DEVICE __host__ __device__
+#else
+#define CAFFE_HOST_DEVICE
+#endif
+
+namespace caffe {
+
+// The element-wise functions of the layers FusedElementwiseLayer chains, each
+// of up to three arguments:
+//    - POWER: (shift + scale x)^power, of power, scale and shift
+//    - EXP: outer_scale exp(inner_scale x), of inner_scale and outer_scale
+//    - LOG: base_scale log(shift + scale x), of scale, shift and base_scale
+//    - RELU: max(x, 0) + negative_slope min(x, 0), of negative_slope
+//    - SIGMOID, TANH and ABSVAL
+enum ElementwiseOp {
+  ELEMENTWISE_POWER,
+  ELEMENTWISE_EXP,
+  ELEMENTWISE_LOG,
+  ELEMENTWISE_RELU,
+  ELEMENTWISE_SIGMOID,
+  ELEMENTWISE_TANH,
+  ELEMENTWISE_ABSVAL
+};
+
+// The most layers a FusedElementwiseLayer chains, whose outputs Backward
+// keeps in registers
+const int kMaxElementwiseOps = 8;
+
+template <typename Dtype>
+CAFFE_HOST_DEVICE inline Dtype elementwise_forward(int op, const Dtype* args,
+    Dtype x) {
+  switch (op) {
+  case ELEMENTWISE_POWER: {
+    const Dtype u = args[2] + args[1] * x;
+    return args[0] == Dtype(1) ? u : pow(u, args[0]);
+  }
+  case ELEMENTWISE_EXP:
+    return args[1] * exp(args[0] * x);
+  case ELEMENTWISE_LOG:
+    return args[2] * log(args[1] + args[0] * x);
+  case ELEMENTWISE_RELU:
+    return (x > 0 ? x : Dtype(0)) + args[0] * (x < 0 ? x : Dtype(0));
+  case ELEMENTWISE_SIGMOID:
+    return Dtype(1) / (Dtype(1) + exp(-x));
+  case ELEMENTWISE_TANH:
+    return tanh(x);
+  default:
+    return fabs(x);
+  }
+}
+
+// The derivative of op at x, of output y
+template <typename Dtype>
+CAFFE_HOST_DEVICE inline Dtype elementwise_derivative(int op,
+    const Dtype* args, Dtype x, Dtype y) {
+  switch (op) {
+  case ELEMENTWISE_POWER:
+    if (args[0] == Dtype(0)) {
+      return Dtype(0);
+    }
+    return args[0] == Dtype(1) ? args[1] :
+        args[0] * args[1] * pow(args[2] + args[1] * x, args[0] - Dtype(1));
+  case ELEMENTWISE_EXP:
+    return args[0] * y;
+  case ELEMENTWISE_LOG:
+    return args[0] * args[2] / (args[1] + args[0] * x);
+  case ELEMENTWISE_RELU:
+    return (x > 0) + args[0] * (x <= 0);
+  case ELEMENTWISE_SIGMOID:
+    return y * (Dtype(1) - y);
+  case ELEMENTWISE_TANH:
+    return Dtype(1) - y * y;
+  default:
+    return Dtype((Dtype(0) < x) - (x < Dtype(0)));
+  }
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_ELEMENTWISE_OPS_HPP_
@@ -0,0 +1,52 @@
+#ifndef CAFFE_UTIL_EXECUTOR_HPP_
+#define CAFFE_UTIL_EXECUTOR_HPP_
+
+#include <boost/function.hpp>
+
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// Threads shared by the background work of the process, such as loading the
+// batches of data layers, instead of threads of its own for each. Each
+// thread has a queue of tasks, taking those it submitted itself newest
+// first, and stealing the oldest of the others' when it has none left.
+// Tasks of high priority, e.g. feeding training, run before any of low
+// priority. See Caffe::set_executor_threads.
+class Executor {
+ public:
+  enum Priority { HIGH, LOW };
+
+  explicit Executor(int size);
+  // Runs the tasks left, then stops the threads
+  ~Executor();
+
+  inline int size() const {
+    return size_;
+  }
+
+  // Runs the task on one of the threads, set to the mode, device and solver
+  // of the caller as an InternalThread would be. A task waiting for another
+  // one holds a thread, so tasks should only wait for those already running.
+  void submit(const boost::function<void()>& task, Priority priority);
+
+ protected:
+  // Only in the .cpp, see BlockingQueue
+  class sync;
+  class Task;
+
+  void entry(int index);
+  // Takes a task to run from the queues, which must hold one
+  void take(int index, Task* task);
+
+  const int size_;
+  shared_ptr<sync> sync_;
+
+DISABLE_COPY_AND_ASSIGN(Executor);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_EXECUTOR_HPP_
@@ -0,0 +1,104 @@
+#ifndef CAFFE_UTIL_FUSED_UPDATE_HPP_
+#define CAFFE_UTIL_FUSED_UPDATE_HPP_
+
+#include <cmath>
+
+#include "caffe/proto/caffe.pb.h"
+
+// The update rule is compiled for the host and, by nvcc, for the device.
+#ifdef __CUDACC__
+#define CAFFE_HOST_DEVICE __host__ __device__
+#else
+#define CAFFE_HOST_DEVICE
+#endif
+
+namespace caffe {
+
+// The hyperparameters of an update of the params by an SGD family solver.
+template <typename Dtype>
+struct FusedUpdateConfig {
+  SolverParameter_SolverType type;
+  // Scales the gradients accumulated over iter_size passes
+  Dtype normalization;
+  Dtype weight_decay;
+  bool l1;
+  // The learning rate, with the bias correction of Adam
+  Dtype rate;
+  Dtype momentum;
+  Dtype momentum2;
+  Dtype delta;
+  Dtype rms_decay;
+};
+
+// The elements of a param updated by a block of caffe_gpu_fused_update
+const int kFusedUpdateChunk = 8192;
+
+// Normalizes and regularizes the gradient diff of a value data of a param,
+// updates its history, and returns the value to subtract from data. history2
+// is the second history of AdaDelta and Adam.
+template <typename Dtype>
+CAFFE_HOST_DEVICE inline Dtype FusedUpdateValue(
+    const FusedUpdateConfig<Dtype>& config, const Dtype lr_mult,
+    const Dtype decay_mult, const Dtype data, const Dtype diff,
+    Dtype* history, Dtype* history2) {
+  Dtype g = diff * config.normalization;
+  const Dtype local_decay = config.weight_decay * decay_mult;
+  if (local_decay) {
+    g += local_decay * (config.l1
+        ? Dtype((Dtype(0) < data) - (data < Dtype(0))) : data);
+  }
+  const Dtype local_rate = config.rate * lr_mult;
+  const Dtype momentum = config.momentum;
+  Dtype h = *history;
+  Dtype update;
+  switch (config.type) {
+  case SolverParameter_SolverType_NESTEROV: {
+    const Dtype previous = h;
+    h = momentum * h + local_rate * g;
+    update = (Dtype(1) + momentum) * h - momentum * previous;
+    break;
+  }
+  case SolverParameter_SolverType_ADAGRAD:
+    h += g * g;
+    update = local_rate * g / (sqrt(h) + config.delta);
+    break;
+  case SolverParameter_SolverType_RMSPROP:
+    h = config.rms_decay * h + (Dtype(1) - config.rms_decay) * g * g;
+    update = local_rate * g / (sqrt(h) + config.delta);
+    break;
+  case SolverParameter_SolverType_ADADELTA: {
+    h = momentum * h + (Dtype(1) - momentum) * g * g;
+    update = g * sqrt((*history2 + config.delta) / (h + config.delta));
+    *history2 = momentum * *history2 + (Dtype(1) - momentum) * update * update;
+    update *= local_rate;
+    break;
+  }
+  case SolverParameter_SolverType_ADAM: {
+    h = momentum * h + (Dtype(1) - momentum) * g;
+    const Dtype v = config.momentum2 * *history2
+        + (Dtype(1) - config.momentum2) * g * g;
+    *history2 = v;
+    update = local_rate * h / (sqrt(v) + config.delta);
+    break;
+  }
+  default:
+    h = momentum * h + local_rate * g;
+    update = h;
+    break;
+  }
+  *history = h;
+  return update;
+}
+
+// Updates the params in a single launch. Each chunk is a param, a start and
+// an end, of at most kFusedUpdateChunk elements. params holds the data, diff,
+// history and second history, or NULL, of each param, and mults its lr_mult
+// and decay_mult. The diffs are left holding the update values.
+template <typename Dtype>
+void caffe_gpu_fused_update(const int num_chunks, const int* chunks,
+    Dtype* const* params, const Dtype* mults,
+    const FusedUpdateConfig<Dtype>& config);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FUSED_UPDATE_HPP_
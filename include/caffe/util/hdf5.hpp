@@ -2,6 +2,7 @@
 #define CAFFE_UTIL_HDF5_H_
 
 #include <string>
+#include <vector>
 
 #include "hdf5.h"
 #include "hdf5_hl.h"
@@ -10,6 +11,11 @@
 
 namespace caffe {
 
+// Checks the dataset is float or double, with min_dim to max_dim axes, and
+// returns its dimensions
+std::vector<hsize_t> hdf5_get_nd_dataset_dims(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim);
+
 template <typename Dtype>
 void hdf5_load_nd_dataset_helper(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
@@ -20,11 +26,31 @@ void hdf5_load_nd_dataset(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
     Blob<Dtype>* blob);
 
+// Loads count rows of the dataset from row start, along its first axis, so
+// datasets larger than memory, or a Blob, can be read in parts
+template <typename Dtype>
+void hdf5_load_nd_dataset_rows(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    hsize_t start, hsize_t count, Blob<Dtype>* blob);
+
 template <typename Dtype>
 void hdf5_save_nd_dataset(
     const hid_t file_id, const string& dataset_name, const Blob<Dtype>& blob,
     bool write_diff = false);
 
+// Creates a dataset of rows shaped like those of blob, which rows can be
+// appended to. It is stored in chunks of chunk_rows rows, compressed with
+// gzip at compression_level unless it is 0. Close it with H5Dclose.
+template <typename Dtype>
+hid_t hdf5_create_appendable_dataset(
+    hid_t file_id, const string& dataset_name, const Blob<Dtype>& blob,
+    int chunk_rows, int compression_level);
+
+// Writes the rows of blob from row start of the dataset, extending it
+template <typename Dtype>
+void hdf5_append_nd_dataset(
+    hid_t dataset_id, hsize_t start, const Blob<Dtype>& blob);
+
 int hdf5_load_int(hid_t loc_id, const string& dataset_name);
 void hdf5_save_int(hid_t loc_id, const string& dataset_name, int i);
 string hdf5_load_string(hid_t loc_id, const string& dataset_name);
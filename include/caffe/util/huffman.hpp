@@ -0,0 +1,37 @@
+#ifndef CAFFE_UTIL_HUFFMAN_HPP_
+#define CAFFE_UTIL_HUFFMAN_HPP_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// Canonical Huffman coding of byte symbols, as used for the codes of
+// codebook blobs (see BlobProto). The codes follow from their lengths
+// alone: in order of length, then of symbol, each code is the previous one
+// plus one, shifted left by the increase in length.
+
+// The longest code HuffmanDecode reads
+const int kHuffmanMaxBits = 30;
+
+// Sets the lengths of the codes of the symbols of the given counts, none
+// longer than max_bits, and 0 for the symbols that do not occur.
+void HuffmanCodeLengths(const vector<uint64_t>& counts, int max_bits,
+    vector<uint32_t>* lengths);
+
+// Appends the codes of the n symbols to bits, most significant bit first,
+// the last byte padded with zeros.
+void HuffmanEncode(const vector<uint32_t>& lengths, const uint8_t* symbols,
+    int n, string* bits);
+
+// Decodes n symbols from bits.
+void HuffmanDecode(const vector<uint32_t>& lengths, const string& bits,
+    int n, uint8_t* symbols);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_HUFFMAN_HPP_
@@ -9,11 +9,55 @@ void im2col_cpu(const Dtype* data_im, const int channels,
     const int pad_h, const int pad_w, const int stride_h,
     const int stride_w, Dtype* data_col);
 
+// Adds to data_im instead of overwriting it if accumulate is true.
 template <typename Dtype>
 void col2im_cpu(const Dtype* data_col, const int channels,
     const int height, const int width, const int patch_h, const int patch_w,
     const int pad_h, const int pad_w, const int stride_h,
-    const int stride_w, Dtype* data_im);
+    const int stride_w, Dtype* data_im, bool accumulate = false);
+
+// Same as im2col_cpu and col2im_cpu on an NHWC image, see Blob::layout:
+// the column matrix has a row per output, of the (kernel_h, kernel_w,
+// channels) values of its window.
+template <typename Dtype>
+void im2col_nhwc_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, Dtype* data_col);
+
+template <typename Dtype>
+void col2im_nhwc_cpu(const Dtype* data_col, const int channels,
+    const int height, const int width, const int patch_h, const int patch_w,
+    const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, Dtype* data_im, bool accumulate = false);
+
+// Convolution of an image whose channels are split into groups of a few,
+// e.g. the single channel groups of depthwise convolution, straight from the
+// image instead of a small GEMM per group over its columns. The weights are
+// the (out_channels, channels / groups, kernel_h, kernel_w) filters, the
+// output the out_channels planes of the windows im2col would take.
+template <typename Dtype>
+void grouped_conv_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const Dtype* weights, Dtype* data_out);
+
+// The gradient of the image, added to data_im if accumulate is true
+template <typename Dtype>
+void grouped_conv_data_cpu(const Dtype* data_out, const int channels,
+    const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const Dtype* weights, Dtype* data_im, bool accumulate = false);
+
+// The gradient of the weights, always added to them
+template <typename Dtype>
+void grouped_conv_weights_cpu(const Dtype* data_im, const Dtype* data_out,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* weights);
 
 template <typename Dtype>
 void im2col_gpu(const Dtype* data_im, const int channels,
@@ -25,7 +69,40 @@ template <typename Dtype>
 void col2im_gpu(const Dtype* data_col, const int channels,
     const int height, const int width, const int patch_h, const int patch_w,
     const int pad_h, const int pad_w, const int stride_h,
-    const int stride_w, Dtype* data_im);
+    const int stride_w, Dtype* data_im, bool accumulate = false);
+
+template <typename Dtype>
+void im2col_nhwc_gpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, Dtype* data_col);
+
+template <typename Dtype>
+void col2im_nhwc_gpu(const Dtype* data_col, const int channels,
+    const int height, const int width, const int patch_h, const int patch_w,
+    const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, Dtype* data_im, bool accumulate = false);
+
+template <typename Dtype>
+void grouped_conv_gpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const Dtype* weights, Dtype* data_out);
+
+template <typename Dtype>
+void grouped_conv_data_gpu(const Dtype* data_out, const int channels,
+    const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const Dtype* weights, Dtype* data_im, bool accumulate = false);
+
+template <typename Dtype>
+void grouped_conv_weights_gpu(const Dtype* data_im, const Dtype* data_out,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* weights);
 
 }  // namespace caffe
 
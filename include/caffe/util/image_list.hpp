@@ -0,0 +1,68 @@
+#ifndef CAFFE_UTIL_IMAGE_LIST_HPP
+#define CAFFE_UTIL_IMAGE_LIST_HPP
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// The file names and labels of the images of an ImageData layer, kept in a
+// table of names, with the offset of each, and a table of labels, instead of
+// a string per image. Lists written as an index by Write are memory mapped,
+// so huge lists cost no parsing and their pages are shared by the processes
+// and layers reading them.
+class ImageList {
+ public:
+  ImageList();
+  ~ImageList() { Close(); }
+
+  // Reads a text list of "filename label" lines, or "filename label height
+  // width" lines if sizes, or maps an index, detected from its first bytes,
+  // which holds sizes if its list did
+  void Open(const string& source, bool sizes);
+  void Close();
+  // Writes the list as an index to map
+  void Write(const string& path) const;
+
+  inline size_t size() const { return size_; }
+  inline string name(size_t i) const {
+    return string(names_ + offsets_[i], offsets_[i + 1] - offsets_[i]);
+  }
+  inline int label(size_t i) const { return labels_[i]; }
+  inline bool has_sizes() const { return sizes_ != NULL; }
+  inline int height(size_t i) const { return sizes_[2 * i]; }
+  inline int width(size_t i) const { return sizes_[2 * i + 1]; }
+
+  // Whether the file is an index rather than a text list
+  static bool IsIndex(const string& path);
+
+ protected:
+  void Parse(const string& source, bool sizes);
+  void Map(const string& source);
+
+  size_t size_;
+  // size_ + 1 offsets, in the names, of each name and of their end
+  const uint64_t* offsets_;
+  const int32_t* labels_;
+  // The height then width of each image, or NULL
+  const uint32_t* sizes_;
+  const char* names_;
+  // The tables of a text list
+  vector<uint64_t> offsets_data_;
+  vector<int32_t> labels_data_;
+  vector<uint32_t> sizes_data_;
+  string names_data_;
+  // The mapped index
+  char* map_;
+  size_t map_size_;
+
+  DISABLE_COPY_AND_ASSIGN(ImageList);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_IMAGE_LIST_HPP
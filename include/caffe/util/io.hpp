@@ -3,6 +3,7 @@
 
 #include <unistd.h>
 #include <string>
+#include <vector>
 
 #include "google/protobuf/message.h"
 
@@ -81,6 +82,21 @@ inline void WriteProtoToBinaryFile(
   WriteProtoToBinaryFile(proto, filename.c_str());
 }
 
+// Write and read the protos, a thread each, e.g. the shards of a snapshot.
+// Files ending in .gz are compressed with gzip.
+void WriteProtosToBinaryFiles(const vector<const Message*>& protos,
+    const vector<string>& filenames);
+void ReadProtosFromBinaryFilesOrDie(const vector<string>& filenames,
+    const vector<Message*>& protos);
+
+// Splits items of the given sizes into shards contiguous ranges of about the
+// same total size, range k being [bounds[k], bounds[k + 1]).
+vector<int> ShardBounds(const vector<size_t>& sizes, int shards);
+// The name of a shard of a file, in its directory, as listed by the file
+string ShardFilename(const string& filename, int shard, bool compressed);
+// The path of a shard listed by a file
+string ShardPath(const string& filename, const string& shard);
+
 bool ReadFileToDatum(const string& filename, const int label, Datum* datum);
 
 inline bool ReadFileToDatum(const string& filename, Datum* datum) {
@@ -123,6 +139,12 @@ bool DecodeDatum(Datum* datum, bool is_color);
 cv::Mat ReadImageToCVMat(const string& filename,
     const int height, const int width, const bool is_color);
 
+// Lets JPEGs be decoded at 1/2, 1/4 or 1/8 of their size when still larger
+// than height x width, before resizing, if supported by OpenCV (3.1+).
+cv::Mat ReadImageToCVMat(const string& filename,
+    const int height, const int width, const bool is_color,
+    const bool reduced_decode);
+
 cv::Mat ReadImageToCVMat(const string& filename,
     const int height, const int width);
 
@@ -133,9 +155,49 @@ cv::Mat ReadImageToCVMat(const string& filename);
 
 cv::Mat DecodeDatumToCVMatNative(const Datum& datum);
 cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color);
+// Decodes the datum in 3 or 1 channels, or its own if 0, reading its bytes
+// in place rather than copying them first
+bool DecodeDatumToCVMat(const Datum& datum, int channels, cv::Mat* cv_img);
 
 void CVMatToDatum(const cv::Mat& cv_img, Datum* datum);
 
+// Raw records store a datum as a fixed header, giving its shape, label, type
+// and whether it is encoded, followed by its bytes or floats in host order.
+// Reading one is then a copy instead of a protobuf parse.
+void DatumToRawRecord(const Datum& datum, string* record);
+bool IsRawRecord(const char* data, size_t size);
+// Fills a datum from a raw record or a serialized Datum.
+bool ParseDatum(const char* data, size_t size, Datum* datum);
+
+// Mapped weights files hold the magic kMappedWeightsMagic, the size of the
+// index as a uint64, and the index, a NetParameter listing the layers with
+// the shapes of their blobs but not their values. The values follow as
+// floats in host order, each blob starting kMappedWeightsAlignment bytes
+// aligned, so that nets can use them in place from a mapping of the file.
+extern const char kMappedWeightsMagic[8];
+const size_t kMappedWeightsAlignment = 64;
+
+// Writes the blobs of a trained net, e.g. read from a .caffemodel, as a
+// mapped weights file.
+void WriteMappedWeights(const NetParameter& trained, const string& filename);
+
+// A file mapped copy-on-write, pages being shared between the processes
+// mapping it until written.
+class MappedFile {
+ public:
+  explicit MappedFile(const string& filename);
+  ~MappedFile();
+
+  inline char* data() const { return data_; }
+  inline size_t size() const { return size_; }
+
+ private:
+  char* data_;
+  size_t size_;
+
+  DISABLE_COPY_AND_ASSIGN(MappedFile);
+};
+
 }  // namespace caffe
 
 #endif   // CAFFE_UTIL_IO_H_
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <cmath>  // for std::fabs and std::signbit
+#include <cstring>  // for memset
 
 #include "glog/logging.h"
 
@@ -69,6 +70,10 @@ void caffe_powx(const int n, const Dtype* a, const Dtype b, Dtype* y);
 
 unsigned int caffe_rng_rand();
 
+// A 64-bit key of a PhiloxRNG, see caffe/util/philox.hpp, made of two
+// caffe_rng_rand()
+uint64_t caffe_rng_key();
+
 template <typename Dtype>
 Dtype caffe_nextafter(const Dtype b);
 
@@ -79,6 +84,16 @@ template <typename Dtype>
 void caffe_rng_gaussian(const int n, const Dtype mu, const Dtype sigma,
                         Dtype* r);
 
+// Values uniform in [a, b), and Gaussian, made of the values of stream 0 of
+// a PhiloxRNG key (see caffe/util/philox.hpp), and filled by the thread pool
+template <typename Dtype>
+void caffe_philox_uniform(const int n, const Dtype a, const Dtype b,
+                          const uint64_t key, Dtype* r);
+
+template <typename Dtype>
+void caffe_philox_gaussian(const int n, const Dtype mu, const Dtype sigma,
+                           const uint64_t key, Dtype* r);
+
 template <typename Dtype>
 void caffe_rng_bernoulli(const int n, const Dtype p, int* r);
 
@@ -88,6 +103,10 @@ void caffe_rng_bernoulli(const int n, const Dtype p, unsigned int* r);
 template <typename Dtype>
 void caffe_exp(const int n, const Dtype* a, Dtype* y);
 
+// exp by approx_exp, see caffe/util/approx_math.hpp
+template <typename Dtype>
+void caffe_approx_exp(const int n, const Dtype* a, Dtype* y);
+
 template <typename Dtype>
 void caffe_log(const int n, const Dtype* a, Dtype* y);
 
@@ -145,6 +164,77 @@ DEFINE_CAFFE_CPU_UNARY_FUNC(fabs, y[i] = std::fabs(x[i]));
 template <typename Dtype>
 void caffe_cpu_scale(const int n, const Dtype alpha, const Dtype *x, Dtype* y);
 
+// Adds bias[(i / inner) % channels] to y[i], unless bias is NULL, then
+// applies a ReLU of the given negative slope: the fused epilogue of layers
+// followed by a ReLU.
+template <typename Dtype>
+void caffe_cpu_bias_relu(const int n, const int channels, const int inner,
+    const Dtype* bias, const Dtype negative_slope, Dtype* y);
+
+// Backward of the ReLU above, from its outputs y, in place on diff.
+template <typename Dtype>
+void caffe_cpu_relu_backward(const int n, const Dtype* y,
+    const Dtype negative_slope, Dtype* diff);
+
+// Transposes each of the num rows x cols matrices of x into y, e.g. the
+// items of a blob between the NCHW and NHWC layouts.
+template <typename Dtype>
+void caffe_cpu_transpose(const int num, const int rows, const int cols,
+    const Dtype* x, Dtype* y);
+
+// Returns the largest absolute value of the elements of vector x
+template <typename Dtype>
+Dtype caffe_cpu_amax(const int n, const Dtype* x);
+
+// Quantizes x to y = round(x / scale), saturated to [-127, 127], or to zeros
+// if scale is 0.
+template <typename Dtype>
+void caffe_cpu_quantize(const int n, const Dtype scale, const Dtype* x,
+    int8_t* y);
+
+// Quantizes each row of dim values of x with its own scale, that of its
+// largest absolute value to 127, into scales.
+template <typename Dtype>
+void caffe_cpu_quantize_rows(const int rows, const int dim, const Dtype* x,
+    Dtype* scales, int8_t* y);
+
+// C = A * B^T for the M x K int8 matrix A and N x K int8 matrix B, summed in
+// int32. Both have K contiguous, so each output is a dot product of two
+// contiguous rows, which compilers turn into packed int8 multiply-adds.
+void caffe_cpu_gemm_int8(const int M, const int N, const int K,
+    const int8_t* A, const int8_t* B, int32_t* C);
+
+// Writes the M + 1 offsets of the compressed sparse rows of the M x K matrix
+// A: offsets[m] is the index of the first nonzero of row m among all of
+// them, and offsets[M] their number.
+template <typename Dtype>
+void caffe_cpu_csr_offsets(const int M, const int K, const Dtype* A,
+    int* offsets);
+
+// Writes the nonzeros of the M x K matrix A, row by row, and their columns.
+template <typename Dtype>
+void caffe_cpu_csr(const int M, const int K, const Dtype* A, Dtype* values,
+    int* columns);
+
+// C = A * B for the M x K matrix A in compressed sparse rows and the K x N
+// matrix B, the work being that of the nonzeros of A.
+template <typename Dtype>
+void caffe_cpu_csrmm(const int M, const int N, const Dtype* values,
+    const int* columns, const int* offsets, const Dtype* B, Dtype* C);
+
+// C = B * A^T for the M x K matrix B and the N x K matrix A in compressed
+// sparse rows.
+template <typename Dtype>
+void caffe_cpu_csrmm_trans(const int M, const int N, const int K,
+    const Dtype* B, const Dtype* values, const int* columns,
+    const int* offsets, Dtype* C);
+
+// Moves the k elements of x of largest magnitude to values, and writes their
+// indices, in increasing order, to indices. They are zeroed in x.
+template <typename Dtype>
+void caffe_cpu_top_k(const int n, const int k, Dtype* x, Dtype* values,
+    int* indices);
+
 #ifndef CPU_ONLY  // GPU
 
 // Decaf gpu gemm provides an interface that is almost the same as the cpu
@@ -174,9 +264,14 @@ void caffe_gpu_memcpy(const size_t N, const void *X, void *Y);
 template <typename Dtype>
 void caffe_gpu_set(const int N, const Dtype alpha, Dtype *X);
 
+// Sets the num_rows rows of row_size elements of X given by rows to alpha.
+template <typename Dtype>
+void caffe_gpu_set_rows(const int num_rows, const int* rows,
+    const int row_size, const Dtype alpha, Dtype* X);
+
 inline void caffe_gpu_memset(const size_t N, const int alpha, void* X) {
 #ifndef CPU_ONLY
-  CUDA_CHECK(cudaMemset(X, alpha, N));  // NOLINT(caffe/alt_fn)
+  CUDA_CHECK(cudaMemsetAsync(X, alpha, N, Caffe::cuda_stream()));
 #else
   NO_GPU;
 #endif
@@ -206,6 +301,9 @@ void caffe_gpu_abs(const int n, const Dtype* a, Dtype* y);
 template <typename Dtype>
 void caffe_gpu_exp(const int n, const Dtype* a, Dtype* y);
 
+template <typename Dtype>
+void caffe_gpu_approx_exp(const int n, const Dtype* a, Dtype* y);
+
 template <typename Dtype>
 void caffe_gpu_log(const int n, const Dtype* a, Dtype* y);
 
@@ -228,12 +326,28 @@ template <typename Dtype>
 void caffe_gpu_rng_gaussian(const int n, const Dtype mu, const Dtype sigma,
                             Dtype* r);
 
+// The values of caffe_philox_uniform and caffe_philox_gaussian, up to the
+// rounding of the device
+template <typename Dtype>
+void caffe_gpu_philox_uniform(const int n, const Dtype a, const Dtype b,
+                              const uint64_t key, Dtype* r);
+
+template <typename Dtype>
+void caffe_gpu_philox_gaussian(const int n, const Dtype mu,
+                               const Dtype sigma, const uint64_t key, Dtype* r);
+
 template <typename Dtype>
 void caffe_gpu_rng_bernoulli(const int n, const Dtype p, int* r);
 
 template <typename Dtype>
 void caffe_gpu_dot(const int n, const Dtype* x, const Dtype* y, Dtype* out);
 
+// Adds the dot product of x and y to *out, in device memory, without waiting
+// for the GPU as caffe_gpu_dot does to return it.
+template <typename Dtype>
+void caffe_gpu_dot_add(const int n, const Dtype* x, const Dtype* y,
+    Dtype* out);
+
 template <typename Dtype>
 uint32_t caffe_gpu_hamming_distance(const int n, const Dtype* x,
                                     const Dtype* y);
@@ -253,6 +367,38 @@ void caffe_gpu_fabs(const int n, const Dtype* x, Dtype* y);
 template <typename Dtype>
 void caffe_gpu_scale(const int n, const Dtype alpha, const Dtype *x, Dtype* y);
 
+template <typename Dtype>
+void caffe_gpu_bias_relu(const int n, const int channels, const int inner,
+    const Dtype* bias, const Dtype negative_slope, Dtype* y);
+
+template <typename Dtype>
+void caffe_gpu_relu_backward(const int n, const Dtype* y,
+    const Dtype negative_slope, Dtype* diff);
+
+template <typename Dtype>
+void caffe_gpu_transpose(const int num, const int rows, const int cols,
+    const Dtype* x, Dtype* y);
+
+// The products of caffe_cpu_csrmm and caffe_cpu_csrmm_trans
+template <typename Dtype>
+void caffe_gpu_csrmm(const int M, const int N, const Dtype* values,
+    const int* columns, const int* offsets, const Dtype* B, Dtype* C);
+
+template <typename Dtype>
+void caffe_gpu_csrmm_trans(const int M, const int N, const int K,
+    const Dtype* B, const Dtype* values, const int* columns,
+    const int* offsets, Dtype* C);
+
+// Converts to IEEE half precision, stored as 16 bit words. If residual is not
+// NULL, it is added to x before rounding and replaced by the rounding error,
+// so that errors do not build up over successive conversions.
+template <typename Dtype>
+void caffe_gpu_to_half(const int n, const Dtype* x, uint16_t* y,
+                       Dtype* residual = NULL);
+
+template <typename Dtype>
+void caffe_gpu_from_half(const int n, const uint16_t* x, Dtype* y);
+
 #define DEFINE_AND_INSTANTIATE_GPU_UNARY_FUNC(name, operation) \
 template<typename Dtype> \
 __global__ void name##_kernel(const int n, const Dtype* x, Dtype* y) { \
@@ -0,0 +1,55 @@
+#ifndef CAFFE_UTIL_METRICS_HPP_
+#define CAFFE_UTIL_METRICS_HPP_
+
+#include <map>
+#include <string>
+#include <utility>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+class Socket;
+
+// Named values exported in the Prometheus text format, e.g. the progress of
+// training for dashboards to scrape instead of parsing logs. Each metric
+// holds a series per set of labels, given as comma separated name="value"
+// pairs, or empty. Updated by the solver threads while served, so all
+// methods are thread safe.
+class Metrics {
+ public:
+  enum Type { COUNTER, GAUGE };
+
+  Metrics();
+
+  void set(const string& name, Type type, const string& labels,
+           double value);
+  void add(const string& name, Type type, const string& labels,
+           double value);
+  // 0 for a series never set
+  double get(const string& name, const string& labels) const;
+  // All series, each metric preceded by its type
+  string text() const;
+
+  // Answers GET /metrics on the port, one connection at a time, from a
+  // thread of its own running as long as the process, so the metrics must
+  // outlive it.
+  void Serve(int port);
+
+ protected:
+  // Only in the .cpp, see BlockingQueue
+  class sync;
+
+  void Accept(shared_ptr<Socket> listener);
+  void Answer(Socket* socket);
+
+  shared_ptr<sync> sync_;
+  // The type and the series of each metric, by name then labels
+  std::map<string, std::pair<Type, std::map<string, double> > > metrics_;
+
+DISABLE_COPY_AND_ASSIGN(Metrics);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_METRICS_HPP_
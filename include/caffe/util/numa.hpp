@@ -0,0 +1,49 @@
+#ifndef CAFFE_UTIL_NUMA_HPP_
+#define CAFFE_UTIL_NUMA_HPP_
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// Whether the threads serving a GPU run on the CPUs of its NUMA node, the
+// node its PCIe root hangs off. Their pinned host memory, allocated from the
+// node of the CPU it is first touched on, then stays local too. Process-wide,
+// off by default.
+void SetNUMAAffinity(bool affinity);
+bool NUMAAffinity();
+
+// Parses a CPU list as found in sysfs, e.g. "0-7,16-23", into cpus.
+bool ParseCPUList(const string& list, vector<int>* cpus);
+
+// The CPUs local to a GPU, and the NUMA node they belong to, -1 if unknown.
+// Empty if the platform does not tell.
+vector<int> DeviceCPUs(int device, int* node);
+
+// Restricts the calling thread to the CPUs local to device if NUMAAffinity().
+void BindThreadToDevice(int device);
+
+// The path of a GPU in the PCIe hierarchy of sysfs, from its host bridge down
+// through the bridges above it, e.g. "pci0000:00/0000:00:02.0/0000:03:00.0/
+// 0000:04:08.0/0000:06:00.0". Empty if the platform does not tell.
+string DevicePCIPath(int device);
+
+// The number of PCIe bridges two devices of these paths share below their
+// host bridge, 0 if they only meet at the root complex, -1 if not even
+// there. Devices behind the same PCIe switch share at least its root port.
+int SharedPCIBridges(const string& path0, const string& path1);
+
+// The NUMA nodes of the machine, and the CPUs of one of them. Empty if the
+// platform does not tell.
+vector<int> NUMANodes();
+vector<int> NodeCPUs(int node);
+
+// Restricts the calling thread to the CPUs of node if NUMAAffinity(), e.g.
+// for the CPU solvers of CPUSync.
+void BindThreadToNode(int node);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_NUMA_HPP_
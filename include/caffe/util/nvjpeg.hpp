@@ -0,0 +1,62 @@
+#ifndef CAFFE_UTIL_NVJPEG_H_
+#define CAFFE_UTIL_NVJPEG_H_
+#ifdef USE_NVJPEG
+
+#include <nvjpeg.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/syncedmem.hpp"
+
+#define NVJPEG_CHECK(condition) \
+  do { \
+    nvjpegStatus_t status = condition; \
+    CHECK_EQ(status, NVJPEG_STATUS_SUCCESS) << " nvJPEG status " << status; \
+  } while (0)
+
+namespace caffe {
+
+/**
+ * @brief Decodes batches of JPEG images on the GPU with nvJPEG, into the
+ * uint8 pixels gpu_transform reads, of channels x height x width per image
+ * and BGR for color, as DecodeDatumToCVMat and a Datum would have them.
+ *
+ * A decoder holds the nvJPEG state and stream of one loader thread.
+ */
+class JPEGDecoder {
+ public:
+  JPEGDecoder();
+  ~JPEGDecoder();
+
+  /**
+   * @brief Decodes the images into raw, reallocated if too small, and
+   *    sets the channels, height and width of each in shape.
+   *
+   * @param channels
+   *    1 for gray, 3 for color, or 0 for those of the first image.
+   * @return false, decoding nothing, unless the images are all JPEGs of the
+   *    same height and width.
+   */
+  bool Decode(const vector<const string*>& images, int channels,
+      vector<int>* shape, shared_ptr<SyncedMemory>* raw);
+
+  /// Whether data starts like a JPEG file
+  static bool IsJPEG(const string& data);
+
+ protected:
+  nvjpegHandle_t handle_;
+  nvjpegJpegState_t state_;
+  cudaStream_t stream_;
+  // The batch size and output format the state was initialized for
+  int batch_size_;
+  nvjpegOutputFormat_t format_;
+
+  DISABLE_COPY_AND_ASSIGN(JPEGDecoder);
+};
+
+}  // namespace caffe
+
+#endif  // USE_NVJPEG
+#endif  // CAFFE_UTIL_NVJPEG_H_
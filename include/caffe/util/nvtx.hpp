@@ -0,0 +1,41 @@
+#ifndef CAFFE_UTIL_NVTX_H_
+#define CAFFE_UTIL_NVTX_H_
+
+#ifdef USE_NVTX
+
+#include <nvToolsExt.h>
+
+#include <string>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Names the time from its construction to its destruction on the
+ * timeline of the calling thread in nvprof and Nsight, e.g. to tell the
+ * kernels of a layer. Ranges nest. Without a profiler attached, NVTX calls
+ * return at once.
+ */
+class NVTXRange {
+ public:
+  explicit NVTXRange(const char* name) { nvtxRangePushA(name); }
+  explicit NVTXRange(const string& name) { nvtxRangePushA(name.c_str()); }
+  ~NVTXRange() { nvtxRangePop(); }
+
+ private:
+  DISABLE_COPY_AND_ASSIGN(NVTXRange);
+};
+
+}  // namespace caffe
+
+// Names the rest of the scope. Builds without USE_NVTX do not even
+// evaluate the name.
+#define NVTX_RANGE(name) caffe::NVTXRange nvtx_range(name)
+
+#else  // USE_NVTX
+
+#define NVTX_RANGE(name)
+
+#endif  // USE_NVTX
+#endif  // CAFFE_UTIL_NVTX_H_
@@ -0,0 +1,52 @@
+#ifndef CAFFE_UTIL_PACKED_GEMM_HPP_
+#define CAFFE_UTIL_PACKED_GEMM_HPP_
+
+#include "caffe/common.hpp"
+#include "caffe/syncedmem.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+/**
+ * @brief One operand of the products C = op(A) op(B) + beta C of a shape,
+ * packed once into the layout of the BLAS to be multiplied faster many
+ * times over, e.g. the weights of a layer at TEST. Only MKL 2017 or later
+ * packs matrices (cblas_?gemm_pack); otherwise Gemm runs caffe_cpu_gemm on
+ * the operand itself.
+ */
+template <typename Dtype>
+class PackedGemm {
+ public:
+  PackedGemm()
+      : packed_(NULL), matrix_(NULL), memory_(NULL), version_(0),
+        pack_a_(false), trans_(CblasNoTrans), M_(0), N_(0), K_(0) {}
+  ~PackedGemm();
+
+  /**
+   * Packs op(A) if pack_a, or else op(B), of the products of M x K by K x N
+   * matrices, unless already packed from the same values: memory holds the
+   * matrix, and its version tells whether it was written since.
+   */
+  void Pack(bool pack_a, CBLAS_TRANSPOSE trans, int M, int N, int K,
+      const Dtype* matrix, SyncedMemory* memory);
+  /// C = op(A) op(B) + beta C, given the other operand and its transpose
+  void Gemm(CBLAS_TRANSPOSE trans, const Dtype* other, Dtype beta,
+      Dtype* C) const;
+
+ protected:
+  void Free();
+
+  Dtype* packed_;
+  const Dtype* matrix_;
+  SyncedMemory* memory_;
+  size_t version_;
+  bool pack_a_;
+  CBLAS_TRANSPOSE trans_;
+  int M_, N_, K_;
+
+DISABLE_COPY_AND_ASSIGN(PackedGemm);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_PACKED_GEMM_HPP_
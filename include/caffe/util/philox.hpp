@@ -0,0 +1,127 @@
+#ifndef CAFFE_UTIL_PHILOX_HPP_
+#define CAFFE_UTIL_PHILOX_HPP_
+
+#include <stdint.h>
+
+#include <cmath>
+
+// The generator is compiled for the host and, by nvcc, for the device.
+#ifdef __CUDACC__
+#define CAFFE_HOST_DEVICE __host__ __device__
+#else
+#define CAFFE_HOST_DEVICE
+#endif
+
+namespace caffe {
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2,
+// 3", SC 2011), a counter-based generator: block c of the values of key k
+// is a function of (k, c) alone. Threads, CPU or GPU, can thus each draw
+// their part of a stream in any order, from a seed and an index, with the
+// same results as drawing it sequentially. The key is typically drawn by
+// caffe_rng_key() once per iteration, keeping runs with the same seed
+// reproducible, and the counter is the index of an element or an image.
+
+// Encrypts the 4 words of counter with the 2 words of key, in place.
+CAFFE_HOST_DEVICE inline void philox4x32_10(uint32_t counter[4],
+    uint32_t key0, uint32_t key1) {
+  for (int round = 0; round < 10; ++round) {
+    const uint64_t product0 = uint64_t(0xD2511F53u) * counter[0];
+    const uint64_t product1 = uint64_t(0xCD9E8D57u) * counter[2];
+    const uint32_t c1 = counter[1];
+    const uint32_t c3 = counter[3];
+    counter[0] = static_cast<uint32_t>(product1 >> 32) ^ c1 ^ key0;
+    counter[1] = static_cast<uint32_t>(product1);
+    counter[2] = static_cast<uint32_t>(product0 >> 32) ^ c3 ^ key1;
+    counter[3] = static_cast<uint32_t>(product0);
+    key0 += 0x9E3779B9u;
+    key1 += 0xBB67AE85u;
+  }
+}
+
+// A value uniform in [0, 1) from a value uniform over 32-bit integers
+CAFFE_HOST_DEVICE inline float philox_uniform(uint32_t value) {
+  return (value >> 8) * (1.f / 16777216.f);
+}
+
+// Two independent standard normal values from two values uniform over
+// 32-bit integers, by the Box-Muller transform
+template <typename Dtype>
+CAFFE_HOST_DEVICE inline void philox_gaussians(uint32_t value0,
+    uint32_t value1, Dtype* normal0, Dtype* normal1) {
+  // In (0, 1], for the log
+  const Dtype uniform0 = Dtype(1) - philox_uniform(value0);
+  const Dtype radius = sqrt(Dtype(-2) * log(uniform0));
+  const Dtype angle = Dtype(6.283185307179586) * philox_uniform(value1);
+  *normal0 = radius * cos(angle);
+  *normal1 = radius * sin(angle);
+}
+
+// The values of the stream of a seed and a stream number, 4 per block of the
+// counter {block, stream}.
+class PhiloxRNG {
+ public:
+  CAFFE_HOST_DEVICE PhiloxRNG(uint64_t seed, uint64_t stream,
+      uint64_t offset = 0)
+      : key0_(static_cast<uint32_t>(seed)),
+        key1_(static_cast<uint32_t>(seed >> 32)),
+        stream_(stream),
+        block_(offset / 4),
+        index_(offset % 4) {
+    generate();
+  }
+
+  // The next value, uniform over 32-bit integers
+  CAFFE_HOST_DEVICE uint32_t operator()() {
+    if (index_ == 4) {
+      ++block_;
+      index_ = 0;
+      generate();
+    }
+    return values_[index_++];
+  }
+
+  // The next value, uniform in [0, 1)
+  CAFFE_HOST_DEVICE float uniform() {
+    return philox_uniform((*this)());
+  }
+
+ protected:
+  CAFFE_HOST_DEVICE void generate() {
+    values_[0] = static_cast<uint32_t>(block_);
+    values_[1] = static_cast<uint32_t>(block_ >> 32);
+    values_[2] = static_cast<uint32_t>(stream_);
+    values_[3] = static_cast<uint32_t>(stream_ >> 32);
+    philox4x32_10(values_, key0_, key1_);
+  }
+
+  uint32_t key0_;
+  uint32_t key1_;
+  uint64_t stream_;
+  uint64_t block_;
+  int index_;
+  uint32_t values_[4];
+};
+
+// Values 4 block to 4 block + 3 of stream 0 of a seed
+CAFFE_HOST_DEVICE inline void philox_block(uint64_t seed, uint64_t block,
+    uint32_t values[4]) {
+  values[0] = static_cast<uint32_t>(block);
+  values[1] = static_cast<uint32_t>(block >> 32);
+  values[2] = 0;
+  values[3] = 0;
+  philox4x32_10(values, static_cast<uint32_t>(seed),
+      static_cast<uint32_t>(seed >> 32));
+}
+
+// Value index of stream 0 of a seed, for drawing one value per element
+CAFFE_HOST_DEVICE inline uint32_t philox_value(uint64_t seed,
+    uint64_t index) {
+  uint32_t values[4];
+  philox_block(seed, index / 4, values);
+  return values[index % 4];
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_PHILOX_HPP_
@@ -0,0 +1,89 @@
+#ifndef CAFFE_UTIL_SOCKET_HPP_
+#define CAFFE_UTIL_SOCKET_HPP_
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// Blocking TCP connection. Errors are fatal, as a lost peer cannot be
+// recovered from during synchronous training.
+class Socket {
+ public:
+  explicit Socket(int fd);
+  ~Socket();
+
+  // Binds and listens on the given port, on all interfaces, queuing up to
+  // backlog connections
+  static shared_ptr<Socket> listen(int port, int backlog = 1);
+  // Connects to a listening socket, retrying while the peer is starting up
+  static shared_ptr<Socket> connect(const string& host, int port,
+                                    int timeout_seconds = 60);
+  shared_ptr<Socket> accept();
+
+  // Both return only once size bytes have been transferred
+  void send(const void* data, size_t size);
+  void recv(void* data, size_t size);
+  // Return false if the connection is lost instead of failing, for servers
+  // whose clients may leave at any time
+  bool try_send(const void* data, size_t size);
+  bool try_recv(void* data, size_t size);
+
+ protected:
+  int fd_;
+
+DISABLE_COPY_AND_ASSIGN(Socket);
+};
+
+// Processes chained in a ring over TCP, e.g. one per machine. Each member
+// connects to the next one and accepts a connection from the previous one.
+class SocketRing {
+ public:
+  // hosts lists "host:port" for each member, rank is this member's position.
+  // Blocks until both neighbours are connected.
+  SocketRing(const vector<string>& hosts, int rank);
+
+  inline int rank() const {
+    return rank_;
+  }
+  inline int size() const {
+    return size_;
+  }
+
+  // Sums count values over all members, in place. Uses a reduce-scatter then
+  // an all-gather of size() chunks, so each member sends about 2 * count
+  // values whatever the ring size.
+  template<typename Dtype>
+  void all_reduce(Dtype* data, size_t count);
+  // Copies count values from member 0 to all others
+  template<typename Dtype>
+  void broadcast(Dtype* data, size_t count);
+  // Sums the sparse vectors of all members into data, whose count values
+  // are zeroed first. Each member gives the indices and values of its
+  // nonzeros, which travel all around the ring, so each member sends the
+  // pairs of size() - 1 members. They are summed in rank order, so that all
+  // members end with the same values.
+  template<typename Dtype>
+  void sparse_all_reduce(const vector<int>& indices,
+                         const vector<Dtype>& values, Dtype* data,
+                         size_t count);
+
+ protected:
+  // Sends to the next member while receiving from the previous one, as TCP
+  // buffers would not hold a whole chunk if all members sent first.
+  void exchange(const void* send, size_t send_size,
+                void* recv, size_t recv_size);
+
+  const int rank_;
+  const int size_;
+  shared_ptr<Socket> next_;
+  shared_ptr<Socket> prev_;
+
+DISABLE_COPY_AND_ASSIGN(SocketRing);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_SOCKET_HPP_
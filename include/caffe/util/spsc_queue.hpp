@@ -0,0 +1,50 @@
+#ifndef CAFFE_UTIL_SPSC_QUEUE_HPP_
+#define CAFFE_UTIL_SPSC_QUEUE_HPP_
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// A bounded queue for a single producer thread and a single consumer thread,
+// handing items over through a ring buffer without locks. A thread finding
+// the queue empty, or full, spins for a while before parking until the other
+// one moves. Same interface as BlockingQueue.
+template<typename T>
+class SPSCQueue {
+ public:
+  // The capacity is rounded up to a power of two
+  explicit SPSCQueue(size_t capacity = 64);
+
+  void push(const T& t);
+
+  bool try_pop(T* t);
+
+  // This logs a message if the thread needs to park
+  T pop(const string& log_on_wait = "");
+
+  size_t size() const;
+
+ protected:
+  // Keeps boost/atomic.hpp and boost/thread.hpp out of the header, see
+  // BlockingQueue.
+  class sync;
+
+  // Spins then parks until the queue has an item, or a free slot if room is
+  // set, and returns the position to pop from or push to.
+  size_t wait(bool room, const string& log_on_wait);
+  // Unparks the other thread if it waits.
+  void wake();
+
+  vector<T> buffer_;
+  const size_t mask_;
+  shared_ptr<sync> sync_;
+
+DISABLE_COPY_AND_ASSIGN(SPSCQueue);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_SPSC_QUEUE_HPP_
@@ -0,0 +1,54 @@
+#ifndef CAFFE_UTIL_THREAD_POOL_HPP_
+#define CAFFE_UTIL_THREAD_POOL_HPP_
+
+#include <boost/function.hpp>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// Minimum number of items per thread in elementwise loops, below which
+// starting threads costs more than it saves
+const int kParallelGrain = 16384;
+
+// Threads running the chunks of parallel loops of CPU layers. The calling
+// thread takes part in each loop, so a pool of size 1 has no threads and
+// runs loops serially. See Caffe::set_cpu_threads.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int size);
+  ~ThreadPool();
+
+  inline int size() const {
+    return size_;
+  }
+
+  // Calls loop(begin, end) on consecutive ranges covering [0, count), of at
+  // least grain items each, and returns once all have been processed. Must
+  // not be called by two threads at a time. A loop calling
+  // Caffe::thread_pool().run again, as the vector math functions do within
+  // layers' loops, runs the inner loop serially: on the calling thread, as
+  // the pool is busy, and on the others, as their pools have one thread.
+  void run(int count, int grain, const boost::function<void(int, int)>& loop);
+
+ protected:
+  // Only in the .cpp, see BlockingQueue
+  class sync;
+
+  void entry(int index);
+  void run_chunk(int index);
+
+  const int size_;
+  shared_ptr<sync> sync_;
+  const boost::function<void(int, int)>* loop_;
+  int count_;
+  int chunks_;
+  // Whether the calling thread is running a loop
+  bool running_;
+
+DISABLE_COPY_AND_ASSIGN(ThreadPool);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_THREAD_POOL_HPP_
@@ -59,6 +59,19 @@ void ReadNetParamsFromTextFileOrDie(const string& param_file,
 void ReadNetParamsFromBinaryFileOrDie(const string& param_file,
                                       NetParameter* param);
 
+// Keeps the nets compiled by Net::Compile from prototxt files in a directory,
+// named by a hash of the text of the file and the phase, so that later runs
+// read them instead of parsing, upgrading and compiling the file again.
+// Processes may share the directory. Empty, the default, keeps none.
+void SetNetCacheDir(const string& dir);
+// The file keeping the compiled net of a prototxt for a phase, or empty
+string NetCacheFile(const string& param_file, Phase phase);
+// Reads the compiled net of a prototxt for a phase, if the cache keeps it.
+bool ReadCachedNet(const string& param_file, Phase phase, NetParameter* param);
+// Adds the compiled net of a prototxt for a phase to the cache, if set.
+void CacheNet(const string& param_file, Phase phase,
+              const NetParameter& param);
+
 }  // namespace caffe
 
 #endif   // CAFFE_UTIL_UPGRADE_PROTO_H_
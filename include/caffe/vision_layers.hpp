@@ -33,6 +33,19 @@ class BaseConvolutionLayer : public Layer<Dtype> {
   virtual inline int MinBottomBlobs() const { return 1; }
   virtual inline int MinTopBlobs() const { return 1; }
   virtual inline bool EqualNumBottomTopBlobs() const { return true; }
+  // A multiply and an add per weight and output, for every bottom
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return 2.0 * bottom.size() * num_ * conv_out_channels_
+        * conv_out_spatial_dim_ * kernel_dim_ / group_;
+  }
+  // Plus writing the column buffer of each image and reading it back
+  virtual inline double ForwardBytes(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    const double col = is_1x1_ ? 0 : 2.0 * bottom.size() * num_
+        * kernel_dim_ * conv_out_spatial_dim_ * sizeof(Dtype);
+    return Layer<Dtype>::ForwardBytes(bottom, top) + col;
+  }
 
  protected:
   // Helper functions that abstract away the column buffer and gemm arguments.
@@ -40,22 +53,52 @@ class BaseConvolutionLayer : public Layer<Dtype> {
   // we just called weight_cpu_gemm with the same input.
   void forward_cpu_gemm(const Dtype* input, const Dtype* weights,
       Dtype* output, bool skip_im2col = false);
+  // Adds the bias, and applies the fused ReLU if any, in which case bias may
+  // be NULL for bias_term false.
   void forward_cpu_bias(Dtype* output, const Dtype* bias);
-  void backward_cpu_gemm(const Dtype* input, const Dtype* weights,
+  // Same as forward_cpu_gemm for consecutive images, as one wider GEMM
+  void forward_cpu_gemm_batch(const Dtype* input, int images,
+      const Dtype* weights, Dtype* output);
+  // Same as forward_cpu_gemm on int8 inputs and weights, for quantized_
+  void forward_cpu_gemm_int8(const Dtype* input, const Dtype* weights,
       Dtype* output);
+  // Same as forward_cpu_gemm on the nonzero weights, for sparse_weights_
+  void forward_cpu_gemm_sparse(const Dtype* input, Dtype* output);
+  // Builds the compressed sparse rows of the weights by the first forward,
+  // returning whether the layer runs on them (see sparsity_param).
+  bool compress_weights();
+  // Adds to output instead of overwriting it if accumulate is true.
+  void backward_cpu_gemm(const Dtype* input, const Dtype* weights,
+      Dtype* output, bool accumulate = false);
   void weight_cpu_gemm(const Dtype* input, const Dtype* output, Dtype*
       weights);
   void backward_cpu_bias(Dtype* bias, const Dtype* input);
+  // Turns the diff of top into that of the outputs before the fused ReLU.
+  void backward_cpu_relu(Blob<Dtype>* top);
+  // Forward and backward of all the images of NHWC blobs, see Blob::layout,
+  // convolved with group 1 as a product of the columns of im2col_nhwc_cpu
+  // by the weights reordered to match them. Adds the bias, and applies the
+  // fused ReLU if any. input_diff may be NULL when not propagating down.
+  void forward_cpu_nhwc(const Dtype* input, Dtype* output);
+  void backward_cpu_nhwc(const Dtype* output, const Dtype* input,
+      Dtype* input_diff, bool accumulate);
 
 #ifndef CPU_ONLY
   void forward_gpu_gemm(const Dtype* col_input, const Dtype* weights,
       Dtype* output, bool skip_im2col = false);
   void forward_gpu_bias(Dtype* output, const Dtype* bias);
+  void forward_gpu_gemm_sparse(const Dtype* input, Dtype* output);
+  void forward_gpu_gemm_batch(const Dtype* input, int images,
+      const Dtype* weights, Dtype* output);
   void backward_gpu_gemm(const Dtype* input, const Dtype* weights,
-      Dtype* col_output);
+      Dtype* col_output, bool accumulate = false);
   void weight_gpu_gemm(const Dtype* col_input, const Dtype* output, Dtype*
       weights);
   void backward_gpu_bias(Dtype* bias, const Dtype* input);
+  void backward_gpu_relu(Blob<Dtype>* top);
+  void forward_gpu_nhwc(const Dtype* input, Dtype* output);
+  void backward_gpu_nhwc(const Dtype* output, const Dtype* input,
+      Dtype* input_diff, bool accumulate);
 #endif
 
   // reverse_dimensions should return true iff we are implementing deconv, so
@@ -75,6 +118,17 @@ class BaseConvolutionLayer : public Layer<Dtype> {
   int height_out_, width_out_;
   bool bias_term_;
   bool is_1x1_;
+  int images_per_gemm_;
+  bool fused_relu_;
+  Dtype relu_slope_;
+  // Whether Forward_cpu runs on int8 values (quantization_param at TEST)
+  bool quantized_;
+  // Whether the forward runs on the nonzero weights only (sparsity_param at
+  // TEST)
+  bool sparse_weights_;
+  // Whether the groups are few channels each, e.g. depthwise convolution,
+  // convolved straight from the images by the grouped_conv functions
+  bool direct_groups_;
 
  private:
   // wrap im2col/col2im so we don't have to remember the (long) argument lists
@@ -82,20 +136,64 @@ class BaseConvolutionLayer : public Layer<Dtype> {
     im2col_cpu(data, conv_in_channels_, conv_in_height_, conv_in_width_,
         kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_, col_buff);
   }
-  inline void conv_col2im_cpu(const Dtype* col_buff, Dtype* data) {
+  inline void conv_col2im_cpu(const Dtype* col_buff, Dtype* data,
+      bool accumulate) {
     col2im_cpu(col_buff, conv_in_channels_, conv_in_height_, conv_in_width_,
-        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_, data);
+        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_, data,
+        accumulate);
+  }
+  inline void conv_grouped_cpu(const Dtype* data, const Dtype* weights,
+      Dtype* output) {
+    grouped_conv_cpu(data, conv_in_channels_, conv_in_height_,
+        conv_in_width_, group_, conv_out_channels_, kernel_h_, kernel_w_,
+        pad_h_, pad_w_, stride_h_, stride_w_, weights, output);
+  }
+  inline void conv_grouped_data_cpu(const Dtype* output,
+      const Dtype* weights, Dtype* data, bool accumulate) {
+    grouped_conv_data_cpu(output, conv_in_channels_, conv_in_height_,
+        conv_in_width_, group_, conv_out_channels_, kernel_h_, kernel_w_,
+        pad_h_, pad_w_, stride_h_, stride_w_, weights, data, accumulate);
+  }
+  inline void conv_grouped_weights_cpu(const Dtype* data,
+      const Dtype* output, Dtype* weights) {
+    grouped_conv_weights_cpu(data, output, conv_in_channels_,
+        conv_in_height_, conv_in_width_, group_, conv_out_channels_,
+        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_, weights);
   }
 #ifndef CPU_ONLY
   inline void conv_im2col_gpu(const Dtype* data, Dtype* col_buff) {
     im2col_gpu(data, conv_in_channels_, conv_in_height_, conv_in_width_,
         kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_, col_buff);
   }
-  inline void conv_col2im_gpu(const Dtype* col_buff, Dtype* data) {
+  inline void conv_col2im_gpu(const Dtype* col_buff, Dtype* data,
+      bool accumulate) {
     col2im_gpu(col_buff, conv_in_channels_, conv_in_height_, conv_in_width_,
-        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_, data);
+        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_, data,
+        accumulate);
+  }
+  inline void conv_grouped_gpu(const Dtype* data, const Dtype* weights,
+      Dtype* output) {
+    grouped_conv_gpu(data, conv_in_channels_, conv_in_height_,
+        conv_in_width_, group_, conv_out_channels_, kernel_h_, kernel_w_,
+        pad_h_, pad_w_, stride_h_, stride_w_, weights, output);
+  }
+  inline void conv_grouped_data_gpu(const Dtype* output,
+      const Dtype* weights, Dtype* data, bool accumulate) {
+    grouped_conv_data_gpu(output, conv_in_channels_, conv_in_height_,
+        conv_in_width_, group_, conv_out_channels_, kernel_h_, kernel_w_,
+        pad_h_, pad_w_, stride_h_, stride_w_, weights, data, accumulate);
+  }
+  inline void conv_grouped_weights_gpu(const Dtype* data,
+      const Dtype* output, Dtype* weights) {
+    grouped_conv_weights_gpu(data, output, conv_in_channels_,
+        conv_in_height_, conv_in_width_, group_, conv_out_channels_,
+        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_, weights);
   }
 #endif
+  // Points col_buffer_ to the workspace shared by all the convolutions run
+  // by the calling thread, growing it if needed. Columns are recomputed by
+  // every call using them, so they need not survive across layers.
+  void share_col_buffer();
 
   int conv_out_channels_;
   int conv_in_channels_;
@@ -109,6 +207,26 @@ class BaseConvolutionLayer : public Layer<Dtype> {
 
   Blob<Dtype> col_buffer_;
   Blob<Dtype> bias_multiplier_;
+  // Columns and outputs of images_per_gemm_ images, side by side
+  Blob<Dtype> batch_col_buffer_;
+  Blob<Dtype> batch_output_buffer_;
+  // The quantized weights and their scale per output, the quantized columns,
+  // and those of a group transposed with its int32 outputs
+  vector<int8_t> weight_int8_;
+  vector<Dtype> weight_scale_;
+  vector<int8_t> col_int8_;
+  vector<int8_t> row_int8_;
+  vector<int32_t> output_int32_;
+  // The nonzero weights, their columns within their group's kernel, and the
+  // offset of each output's
+  Blob<Dtype> weight_values_;
+  Blob<int> weight_columns_;
+  Blob<int> weight_offsets_;
+  // The weights of each group packed for forward_cpu_gemm at TEST
+  vector<shared_ptr<PackedGemm<Dtype> > > packed_weights_;
+  // The weights reordered to (kernel_h, kernel_w, channels) for NHWC
+  // inputs, and the gradient in that order, both recomputed by every pass
+  Blob<Dtype> weight_nhwc_;
 };
 
 /**
@@ -155,13 +273,19 @@ class ConvolutionLayer : public BaseConvolutionLayer<Dtype> {
    *  first group and input channels 3-4 and output channels 5-8 into the second
    *  group.
    *  - bias_term (\b optional, default true). Whether to have a bias.
-   *  - engine: convolution has CAFFE (matrix multiplication) and CUDNN (library
-   *    kernels + stream parallelism) engines.
+   *  - engine: convolution has CAFFE (matrix multiplication), CUDNN (library
+   *    kernels + stream parallelism) and WINOGRAD (minimal filtering of 3x3
+   *    filters, see WinogradConvolutionLayer) engines.
    */
   explicit ConvolutionLayer(const LayerParameter& param)
       : BaseConvolutionLayer<Dtype>(param) {}
 
   virtual inline const char* type() const { return "Convolution"; }
+  virtual inline bool AllowAccumulateBottomDiff(const int bottom_index) const {
+    return true;
+  }
+  // With group 1
+  virtual inline bool AllowNHWC() const { return true; }
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -176,6 +300,118 @@ class ConvolutionLayer : public BaseConvolutionLayer<Dtype> {
   virtual void compute_output_shape();
 };
 
+/**
+ * @brief Winograd minimal filtering implementation of ConvolutionLayer for
+ *        3x3 filters with stride 1, F(2x2, 3x3) or F(4x4, 3x3).
+ *
+ *   The input is cut in overlapping (m + 2) x (m + 2) tiles, each giving an
+ *   m x m output tile. Tiles and filters are transformed such that the
+ *   convolution becomes an elementwise product, computed as one GEMM over
+ *   channels per tile element; this takes 2.25 (m = 2) or 4 (m = 4) times
+ *   fewer multiplications than direct convolution. Forward on CPU uses this
+ *   engine, while backward and GPU mode fall back to ConvolutionLayer.
+ */
+template <typename Dtype>
+class WinogradConvolutionLayer : public ConvolutionLayer<Dtype> {
+ public:
+  explicit WinogradConvolutionLayer(const LayerParameter& param)
+      : ConvolutionLayer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline bool AllowNHWC() const { return false; }
+
+  /// Whether filters of the parameters can be computed by this engine
+  static bool IsSupported(const ConvolutionParameter& param);
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  // Transforms all filters, as they change between iterations
+  void TransformWeights();
+
+  int tile_;  // m, side of the output tiles
+  int alpha_;  // m + 2, side of the input tiles
+  int tiles_h_, tiles_w_;
+  // Transform matrices, alpha x alpha (B^T), alpha x 3 (G), m x alpha (A^T)
+  vector<Dtype> input_transform_;
+  vector<Dtype> weight_transform_;
+  vector<Dtype> output_transform_;
+  // (alpha * alpha) x num_output x (channels / group)
+  Blob<Dtype> weights_;
+  // (alpha * alpha) x channels x tiles, and x num_output x tiles
+  Blob<Dtype> input_tiles_;
+  Blob<Dtype> output_tiles_;
+};
+
+/**
+ * @brief Direct implementation of ConvolutionLayer on CPU, for filters of any
+ *        size and stride without groups.
+ *
+ *   Instead of expanding the input kernel_h x kernel_w times into columns
+ *   for a GEMM, the input, filters and output are reordered into blocks of
+ *   channels, the channels of each pixel innermost (nChw8c, or nChw16c
+ *   when built for AVX-512), and each output is accumulated in place from
+ *   the input windows: the sums of a few neighboring pixels of a block of
+ *   outputs stay in vector registers while the filters of each input
+ *   channel are multiplied into them. Rows of output blocks are spread
+ *   over the thread pool. Only the input and the output are reordered, at
+ *   the boundaries of the layer, and the filters when they change. Forward
+ *   on CPU uses this engine, while backward and GPU mode fall back to
+ *   ConvolutionLayer.
+ */
+template <typename Dtype>
+class DirectConvolutionLayer : public ConvolutionLayer<Dtype> {
+ public:
+  explicit DirectConvolutionLayer(const LayerParameter& param)
+      : ConvolutionLayer<Dtype>(param), weight_memory_(NULL),
+        weight_version_(0), bias_memory_(NULL), bias_version_(0) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline bool AllowNHWC() const { return false; }
+
+  /// Whether filters of the parameters can be computed by this engine
+  static bool IsSupported(const ConvolutionParameter& param);
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  // Reorders the filters and biases into blocks, unless unchanged since
+  void ReorderWeights();
+  // Loops over the blocks of channels of the images, the rows of blocks of
+  // outputs, and the blocks of outputs of the images, run on the thread pool
+  void reorder_input_cpu(const Dtype* bottom_data, Dtype* input, int begin,
+      int end);
+  void forward_rows_cpu(const Dtype* input, const Dtype* weights,
+      const Dtype* bias, Dtype* output, int begin, int end);
+  void reorder_output_cpu(const Dtype* output, Dtype* top_data, int begin,
+      int end);
+
+  int blocks_in_, blocks_out_;
+  // Sides of the input with the padding
+  int padded_h_, padded_w_;
+  // num x blocks_in x padded_h x padded_w x block
+  Blob<Dtype> input_blocks_;
+  // blocks_out x blocks_in x kernel_h x kernel_w x block (in) x block (out)
+  Blob<Dtype> weight_blocks_;
+  // blocks_out x block, zero without bias
+  Blob<Dtype> bias_blocks_;
+  // num x blocks_out x height_out x width_out x block
+  Blob<Dtype> output_blocks_;
+  // The filters and biases last reordered, see PackedGemm
+  SyncedMemory* weight_memory_;
+  size_t weight_version_;
+  SyncedMemory* bias_memory_;
+  size_t bias_version_;
+};
+
 /**
  * @brief Convolve the input with a bank of learned filters, and (optionally)
  *        add biases, treating filters and convolution parameters in the
@@ -211,6 +447,58 @@ class DeconvolutionLayer : public BaseConvolutionLayer<Dtype> {
   virtual void compute_output_shape();
 };
 
+/**
+ * @brief Upsamples each channel by an integer factor, interpolating
+ *        bilinearly or repeating the nearest value.
+ *
+ * BILINEAR computes the same outputs as the fixed Deconvolution of
+ * fully convolutional nets, with a "bilinear" weight_filler, group and
+ * num_output the channels and lr_mult 0, but straight from the two rows and
+ * columns under each output rather than through columns and a GEMM per
+ * channel.
+ */
+template <typename Dtype>
+class UpsampleLayer : public Layer<Dtype> {
+ public:
+  explicit UpsampleLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "Upsample"; }
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  // Sets the two input positions and their weights of each output position
+  // along an axis of the given input size
+  void Taps(const int size, Blob<int>* index, Blob<Dtype>* weight);
+  void upsample_planes_cpu(const Dtype* bottom_data, Dtype* top_data,
+      int begin, int end);
+  void downsample_planes_cpu(const Dtype* top_diff, Dtype* bottom_diff,
+      int begin, int end);
+
+  int scale_;
+  UpsampleParameter_Mode mode_;
+  int height_, width_;
+  int height_out_, width_out_;
+  // (size_out, 2) input rows and columns under each output, out of the
+  // input ones having a weight of 0
+  Blob<int> row_index_, col_index_;
+  Blob<Dtype> row_weight_, col_weight_;
+};
+
 #ifdef USE_CUDNN
 /*
  * @brief cuDNN implementation of ConvolutionLayer.
@@ -243,16 +531,66 @@ class CuDNNConvolutionLayer : public ConvolutionLayer<Dtype> {
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
+  // Picks fwd_algo_, by autotuning or cuDNN's heuristic, and grows the
+  // workspace for it.
+  void SelectForwardAlgo(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  // Times the forward of the first group with each algorithm on the data of
+  // bottom, into top, and returns the fastest.
+  cudnnConvolutionFwdAlgo_t TuneForwardAlgo(Blob<Dtype>* bottom,
+      Blob<Dtype>* top);
+
   bool handles_setup_;
-  cudnnHandle_t* handle_;
-  cudaStream_t*  stream_;
   vector<cudnnTensorDescriptor_t> bottom_descs_, top_descs_;
   cudnnTensorDescriptor_t    bias_desc_;
   cudnnFilterDescriptor_t      filter_desc_;
   vector<cudnnConvolutionDescriptor_t> conv_descs_;
   int bottom_offset_, top_offset_, weight_offset_, bias_offset_;
+  // The bytes of the shared workspace each group uses, one after the other
   size_t workspaceSizeInBytes;
-  void *workspace;
+  // The forward algorithm of all bottoms, picked for the shapes of algo_key_
+  cudnnConvolutionFwdAlgo_t fwd_algo_;
+  string algo_key_;
+  // The algorithm and workspace picked for each algo_key_ seen, so that
+  // returning to earlier shapes, e.g. input buckets, does not pick again
+  map<string, std::pair<cudnnConvolutionFwdAlgo_t, size_t> > fwd_algos_;
+};
+#endif
+
+#ifdef USE_CUDNN
+/*
+ * @brief cuDNN implementation of DeconvolutionLayer.
+ *        Fallback to DeconvolutionLayer for CPU mode.
+ *
+ * The forward pass is the backward pass w.r.t. the data of the convolution
+ * with the same filters, and the backward pass w.r.t. the bottom is its
+ * forward pass, run in parallel over groups as in CuDNNConvolutionLayer.
+ */
+template <typename Dtype>
+class CuDNNDeconvolutionLayer : public DeconvolutionLayer<Dtype> {
+ public:
+  explicit CuDNNDeconvolutionLayer(const LayerParameter& param)
+      : DeconvolutionLayer<Dtype>(param), handles_setup_(false) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual ~CuDNNDeconvolutionLayer();
+
+ protected:
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  bool handles_setup_;
+  // The bottoms are the outputs of the underlying convolution, and the tops
+  // its inputs.
+  vector<cudnnTensorDescriptor_t> bottom_descs_, top_descs_;
+  cudnnTensorDescriptor_t    bias_desc_;
+  cudnnFilterDescriptor_t      filter_desc_;
+  vector<cudnnConvolutionDescriptor_t> conv_descs_;
+  int bottom_offset_, top_offset_, weight_offset_, bias_offset_;
 };
 #endif
 
@@ -316,6 +654,13 @@ class LRNLayer : public Layer<Dtype> {
   virtual inline const char* type() const { return "LRN"; }
   virtual inline int ExactNumBottomBlobs() const { return 1; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
+  // Squares, the sum over the window, then the scale, power and product
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    const int window = this->layer_param_.lrn_param().norm_region()
+        == LRNParameter_NormRegion_WITHIN_CHANNEL ? size_ * size_ : size_;
+    return (window + 4.0) * bottom[0]->count();
+  }
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -339,6 +684,23 @@ class LRNLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void WithinChannelBackward(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void WithinChannelForward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void WithinChannelBackward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  // The CPU passes over the items [begin, end), for the thread pool. Items
+  // are tiles of kLRNTile pixels of an image across channels, and planes
+  // within channels.
+  void cross_channel_forward_cpu(const Dtype* bottom_data, Dtype* top_data,
+      Dtype* scale_data, int begin, int end);
+  void cross_channel_backward_cpu(const Dtype* top_diff, const Dtype* top_data,
+      const Dtype* bottom_data, const Dtype* scale_data, Dtype* bottom_diff,
+      int begin, int end);
+  void within_channel_forward_cpu(const Dtype* bottom_data, Dtype* top_data,
+      Dtype* scale_data, int begin, int end);
+  void within_channel_backward_cpu(const Dtype* top_diff,
+      const Dtype* top_data, const Dtype* bottom_data,
+      const Dtype* scale_data, Dtype* bottom_diff, int begin, int end);
 
   int size_;
   int pre_pad_;
@@ -350,11 +712,10 @@ class LRNLayer : public Layer<Dtype> {
   int height_;
   int width_;
 
-  // Fields used for normalization ACROSS_CHANNELS
-  // scale_ stores the intermediate summing results
+  // scale_ stores the intermediate summing results, of both regions on CPU
   Blob<Dtype> scale_;
 
-  // Fields used for normalization WITHIN_CHANNEL
+  // Fields used for normalization WITHIN_CHANNEL on GPU
   shared_ptr<SplitLayer<Dtype> > split_layer_;
   vector<Blob<Dtype>*> split_top_vec_;
   shared_ptr<PowerLayer<Dtype> > square_layer_;
@@ -373,6 +734,37 @@ class LRNLayer : public Layer<Dtype> {
   vector<Blob<Dtype>*> product_bottom_vec_;
 };
 
+#ifdef USE_CUDNN
+#if CUDNN_VERSION_MIN(3, 0, 0)
+/**
+ * @brief cuDNN implementation of the ACROSS_CHANNELS LRNLayer.
+ *        Fallback to LRNLayer for CPU mode.
+ */
+template <typename Dtype>
+class CuDNNLRNLayer : public LRNLayer<Dtype> {
+ public:
+  explicit CuDNNLRNLayer(const LayerParameter& param)
+      : LRNLayer<Dtype>(param), handles_setup_(false) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual ~CuDNNLRNLayer();
+
+ protected:
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  bool handles_setup_;
+  cudnnHandle_t             handle_;
+  cudnnLRNDescriptor_t norm_desc_;
+  cudnnTensorDescriptor_t bottom_desc_, top_desc_;
+};
+#endif
+#endif
+
 
 /**
  * @brief Pools the input image by taking the max, average, etc. within regions.
@@ -383,7 +775,7 @@ template <typename Dtype>
 class PoolingLayer : public Layer<Dtype> {
  public:
   explicit PoolingLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), mask_skipped_(false) {}
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
   virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
@@ -391,6 +783,11 @@ class PoolingLayer : public Layer<Dtype> {
 
   virtual inline const char* type() const { return "Pooling"; }
   virtual inline int ExactNumBottomBlobs() const { return 1; }
+  // But for STOCHASTIC
+  virtual inline bool AllowNHWC() const { return true; }
+  virtual inline bool AllowAccumulateBottomDiff(const int bottom_index) const {
+    return true;
+  }
   virtual inline int MinTopBlobs() const { return 1; }
   // MAX POOL layers can output an extra top blob for the mask;
   // others can only output the pooled inputs.
@@ -398,6 +795,18 @@ class PoolingLayer : public Layer<Dtype> {
     return (this->layer_param_.pooling_param().pool() ==
             PoolingParameter_PoolMethod_MAX) ? 2 : 1;
   }
+  // A comparison or an add per element of each window
+  virtual inline double ForwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return 1.0 * top[0]->count() * kernel_h_ * kernel_w_;
+  }
+  // MAX routes each gradient to one element, AVE spreads it on the window
+  virtual inline double BackwardFlops(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) const {
+    return this->layer_param_.pooling_param().pool() ==
+        PoolingParameter_PoolMethod_MAX ? top[0]->count() :
+        ForwardFlops(bottom, top);
+  }
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -408,6 +817,23 @@ class PoolingLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  // Forward of the planes [begin, end) over all images and channels, run in
+  // parallel on the thread pool. max_pool_cpu writes no mask when both mask
+  // and top_mask are NULL.
+  void max_pool_cpu(const Dtype* bottom_data, Dtype* top_data, int* mask,
+      Dtype* top_mask, int begin, int end);
+  void ave_pool_cpu(const Dtype* bottom_data, Dtype* top_data, int begin,
+      int end);
+  // Same for NHWC blobs, over the rows of windows [begin, end) of all
+  // images, the masks holding the same indices within planes
+  void max_pool_nhwc_cpu(const Dtype* bottom_data, Dtype* top_data,
+      int* mask, Dtype* top_mask, int begin, int end);
+  void ave_pool_nhwc_cpu(const Dtype* bottom_data, Dtype* top_data,
+      int begin, int end);
+  // Returns the numbers of rows and columns of windows of each plane that
+  // the CPU kernels specialized on fixed_kernel_ pool, the others being left
+  // to the generic loops
+  void specialized_windows(int* rows, int* cols) const;
 
   int kernel_h_, kernel_w_;
   int stride_h_, stride_w_;
@@ -416,8 +842,14 @@ class PoolingLayer : public Layer<Dtype> {
   int height_, width_;
   int pooled_height_, pooled_width_;
   bool global_pooling_;
+  // The size of square windows at a stride of 2 that forward pools with
+  // kernels specialized at compile time, 2 or 3, else 0
+  int fixed_kernel_;
   Blob<Dtype> rand_idx_;
   Blob<int> max_idx_;
+  // Whether Forward_cpu skipped max_idx_ at TEST phase, in which case
+  // Backward_cpu finds the maxima again
+  bool mask_skipped_;
 };
 
 #ifdef USE_CUDNN
@@ -453,11 +885,58 @@ class CuDNNPoolingLayer : public PoolingLayer<Dtype> {
 };
 #endif
 
+/**
+ * @brief Max pools each region of interest of a feature map to a fixed grid,
+ *        as in Fast R-CNN, so that the convolutions of an image are computed
+ *        once for all its regions instead of once per warped window.
+ *
+ * The bottoms are the (N, C, H, W) feature maps and the (R, 5) regions, each
+ * (image, x1, y1, x2, y2) in pixels of the image, spatial_scale bringing them
+ * to the feature maps. The top is (R, C, pooled_h, pooled_w). The regions get
+ * no gradient.
+ */
+template <typename Dtype>
+class ROIPoolingLayer : public Layer<Dtype> {
+ public:
+  explicit ROIPoolingLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "ROIPooling"; }
+  virtual inline int ExactNumBottomBlobs() const { return 2; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  void forward_rois_cpu(const Dtype* bottom_data, const Dtype* rois,
+      Dtype* top_data, int* argmax, int begin, int end);
+
+  int pooled_h_, pooled_w_;
+  Dtype spatial_scale_;
+  int channels_, height_, width_;
+  /// the position of the maximum in each bin, -1 for empty bins
+  Blob<int> max_idx_;
+};
+
 /**
  * @brief Does spatial pyramid pooling on the input image
  *        by taking the max, average, etc. within regions
  *        so that the result vector of different sized
  *        images are of the same size.
+ *
+ * Every level of the pyramid is pooled straight into its place in the
+ * output, without intermediate blobs.
  */
 template <typename Dtype>
 class SPPLayer : public Layer<Dtype> {
@@ -471,52 +950,25 @@ class SPPLayer : public Layer<Dtype> {
 
   virtual inline const char* type() const { return "SPP"; }
   virtual inline int ExactNumBottomBlobs() const { return 1; }
-  virtual inline int MinTopBlobs() const { return 1; }
-  // MAX POOL layers can output an extra top blob for the mask;
-  // others can only output the pooled inputs.
-  virtual inline int MaxTopBlobs() const {
-    return (this->layer_param_.pooling_param().pool() ==
-            PoolingParameter_PoolMethod_MAX) ? 2 : 1;
-  }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
-  // calculates the kernel and stride dimensions for the pooling layer,
-  // returns a correctly configured LayerParameter for a PoolingLayer
-  virtual LayerParameter GetPoolingParam(const int pyramid_level,
-      const int bottom_h, const int bottom_w, const SPPParameter spp_param);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
   int pyramid_height_;
   int bottom_h_, bottom_w_;
   int channels_;
-  int kernel_h_, kernel_w_;
-  int pad_h_, pad_w_;
-
-  /// the internal Split layer that feeds the pooling layers
-  shared_ptr<SplitLayer<Dtype> > split_layer_;
-  /// top vector holder used in call to the underlying SplitLayer::Forward
-  vector<Blob<Dtype>*> split_top_vec_;
-  /// bottom vector holder used in call to the underlying PoolingLayer::Forward
-  vector<vector<Blob<Dtype>*>*> pooling_bottom_vecs_;
-  /// the internal Pooling layers of different kernel sizes
-  vector<shared_ptr<PoolingLayer<Dtype> > > pooling_layers_;
-  /// top vector holders used in call to the underlying PoolingLayer::Forward
-  vector<vector<Blob<Dtype>*>*> pooling_top_vecs_;
-  /// pooling_outputs stores the outputs of the PoolingLayers
-  vector<Blob<Dtype>*> pooling_outputs_;
-  /// the internal Flatten layers that the Pooling layers feed into
-  vector<FlattenLayer<Dtype>*> flatten_layers_;
-  /// top vector holders used in call to the underlying FlattenLayer::Forward
-  vector<vector<Blob<Dtype>*>*> flatten_top_vecs_;
-  /// flatten_outputs stores the outputs of the FlattenLayers
-  vector<Blob<Dtype>*> flatten_outputs_;
-  /// bottom vector holder used in call to the underlying ConcatLayer::Forward
-  vector<Blob<Dtype>*> concat_bottom_vec_;
-  /// the internal Concat layers that the Flatten layers feed into
-  shared_ptr<ConcatLayer<Dtype> > concat_layer_;
+  /// the position of the maximum in each window, for MAX pooling
+  Blob<int> max_idx_;
+  /// the sampled position in each window, for STOCHASTIC pooling
+  Blob<Dtype> rand_idx_;
 };
 
 }  // namespace caffe
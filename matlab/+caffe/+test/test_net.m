@@ -55,6 +55,9 @@ classdef test_net < matlab.unittest.TestCase
       self.net.blobs('data').set_diff(-2 * ones(self.net.blobs('data').shape));
       self.verifyEqual(self.net.blobs('data').get_diff(), ...
         -2 * ones(self.net.blobs('data').shape, 'single'));
+      buffer = zeros(self.net.blobs('data').shape, 'single');
+      buffer = self.net.blobs('data').get_diff(buffer);
+      self.verifyEqual(buffer, -2 * ones(self.net.blobs('data').shape, 'single'));
       original_shape = self.net.blobs('data').shape;
       self.net.blobs('data').reshape([6 5 4 3 2 1]);
       self.verifyEqual(self.net.blobs('data').shape, [6 5 4 3 2 1]);
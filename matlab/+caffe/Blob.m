@@ -19,15 +19,29 @@ classdef Blob < handle
       shape = self.check_and_preprocess_shape(shape);
       caffe_('blob_reshape', self.hBlob_self, shape);
     end
-    function data = get_data(self)
-      data = caffe_('blob_get_data', self.hBlob_self);
+    function data = get_data(self, out)
+      % With out, a single array of the size of the blob, the data is
+      % copied into out in place instead of into a new array. Reuse such a
+      % buffer across batches; it must not share its memory with a copy.
+      if nargin < 2
+        data = caffe_('blob_get_data', self.hBlob_self);
+      else
+        caffe_('blob_get_data_into', self.hBlob_self, out);
+        data = out;
+      end
     end
     function set_data(self, data)
       data = self.check_and_preprocess_data(data);
       caffe_('blob_set_data', self.hBlob_self, data);
     end
-    function diff = get_diff(self)
-      diff = caffe_('blob_get_diff', self.hBlob_self);
+    function diff = get_diff(self, out)
+      % As get_data
+      if nargin < 2
+        diff = caffe_('blob_get_diff', self.hBlob_self);
+      else
+        caffe_('blob_get_diff_into', self.hBlob_self, out);
+        diff = out;
+      end
     end
     function set_diff(self, diff)
       diff = self.check_and_preprocess_data(diff);
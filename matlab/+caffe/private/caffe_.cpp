@@ -106,6 +106,30 @@ static mxArray* blob_to_mx_mat(const Blob<float>* blob,
   return mx_mat;
 }
 
+// Copy Blob data or diff into an existing single matlab array of as many
+// elements, in place, sparing the allocation of blob_to_mx_mat. The layouts
+// match, so this is a single copy.
+static void blob_to_existing_mx_mat(const Blob<float>* blob,
+    WhichMemory data_or_diff, mxArray* mx_mat) {
+  mxCHECK(mxIsSingle(mx_mat) && !mxIsComplex(mx_mat),
+      "output array must be real single");
+  mxCHECK(blob->count() == mxGetNumberOfElements(mx_mat),
+      "number of elements in output mxArray doesn't match that in blob");
+  float* mat_mem_ptr = reinterpret_cast<float*>(mxGetData(mx_mat));
+  const float* blob_mem_ptr = NULL;
+  switch (Caffe::mode()) {
+  case Caffe::CPU:
+    blob_mem_ptr = (data_or_diff == DATA ? blob->cpu_data() : blob->cpu_diff());
+    break;
+  case Caffe::GPU:
+    blob_mem_ptr = (data_or_diff == DATA ? blob->gpu_data() : blob->gpu_diff());
+    break;
+  default:
+    mxERROR("Unknown Caffe mode");
+  }
+  caffe_copy(blob->count(), blob_mem_ptr, mat_mem_ptr);
+}
+
 // Convert vector<int> to matlab row vector
 static mxArray* int_vec_to_mx_vec(const vector<int>& int_vec) {
   mxArray* mx_vec = mxCreateDoubleMatrix(int_vec.size(), 1, mxREAL);
@@ -401,6 +425,14 @@ static void blob_get_data(MEX_ARGS) {
   plhs[0] = blob_to_mx_mat(blob, DATA);
 }
 
+// Usage: caffe_('blob_get_data_into', hBlob, out)
+static void blob_get_data_into(MEX_ARGS) {
+  mxCHECK(nrhs == 2 && mxIsStruct(prhs[0]),
+      "Usage: caffe_('blob_get_data_into', hBlob, out)");
+  Blob<float>* blob = handle_to_ptr<Blob<float> >(prhs[0]);
+  blob_to_existing_mx_mat(blob, DATA, const_cast<mxArray*>(prhs[1]));
+}
+
 // Usage: caffe_('blob_set_data', hBlob, new_data)
 static void blob_set_data(MEX_ARGS) {
   mxCHECK(nrhs == 2 && mxIsStruct(prhs[0]) && mxIsSingle(prhs[1]),
@@ -417,6 +449,14 @@ static void blob_get_diff(MEX_ARGS) {
   plhs[0] = blob_to_mx_mat(blob, DIFF);
 }
 
+// Usage: caffe_('blob_get_diff_into', hBlob, out)
+static void blob_get_diff_into(MEX_ARGS) {
+  mxCHECK(nrhs == 2 && mxIsStruct(prhs[0]),
+      "Usage: caffe_('blob_get_diff_into', hBlob, out)");
+  Blob<float>* blob = handle_to_ptr<Blob<float> >(prhs[0]);
+  blob_to_existing_mx_mat(blob, DIFF, const_cast<mxArray*>(prhs[1]));
+}
+
 // Usage: caffe_('blob_set_diff', hBlob, new_diff)
 static void blob_set_diff(MEX_ARGS) {
   mxCHECK(nrhs == 2 && mxIsStruct(prhs[0]) && mxIsSingle(prhs[1]),
@@ -506,8 +546,10 @@ static handler_registry handlers[] = {
   { "blob_get_shape",     blob_get_shape  },
   { "blob_reshape",       blob_reshape    },
   { "blob_get_data",      blob_get_data   },
+  { "blob_get_data_into", blob_get_data_into },
   { "blob_set_data",      blob_set_data   },
   { "blob_get_diff",      blob_get_diff   },
+  { "blob_get_diff_into", blob_get_diff_into },
   { "blob_set_diff",      blob_set_diff   },
   { "set_mode_cpu",       set_mode_cpu    },
   { "set_mode_gpu",       set_mode_gpu    },
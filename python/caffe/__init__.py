@@ -1,5 +1,8 @@
 from .pycaffe import Net, SGDSolver
 from ._caffe import set_mode_cpu, set_mode_gpu, set_device, Layer, get_solver, layer_type_list
+from ._caffe import gpu_memory_usage, reset_gpu_memory_peak
+from ._caffe import solver_count, set_solver_count, root_solver, set_root_solver, P2PSync
+from ._caffe import Ensemble
 from .proto.caffe_pb2 import TRAIN, TEST
 from .classifier import Classifier
 from .detector import Detector
@@ -16,11 +16,13 @@
 
 #include "caffe/caffe.hpp"
 #include "caffe/python_layer.hpp"
+#include "caffe/util/math_functions.hpp"
 
 // Temporary solution for numpy < 1.7 versions: old macro, no promises.
 // You're strongly advised to upgrade to >= 1.7.
 #ifndef NPY_ARRAY_C_CONTIGUOUS
 #define NPY_ARRAY_C_CONTIGUOUS NPY_C_CONTIGUOUS
+#define NPY_ARRAY_IN_ARRAY NPY_IN_ARRAY
 #define PyArray_SetBaseObject(arr, x) (PyArray_BASE(arr) = (x))
 #endif
 
@@ -36,6 +38,22 @@ const int NPY_DTYPE = NPY_FLOAT32;
 void set_mode_cpu() { Caffe::set_mode(Caffe::CPU); }
 void set_mode_gpu() { Caffe::set_mode(Caffe::GPU); }
 
+// The bytes of GPU memory in use and at most, on the current device.
+bp::tuple gpu_memory_usage() {
+  size_t used = 0;
+  size_t peak = 0;
+#ifndef CPU_ONLY
+  CaffeGPUMemoryUsage(&used, &peak);
+#endif
+  return bp::make_tuple(used, peak);
+}
+
+void reset_gpu_memory_peak() {
+#ifndef CPU_ONLY
+  CaffeResetGPUMemoryPeak();
+#endif
+}
+
 // For convenience, check that input files can be opened, and raise an
 // exception that boost will send to Python if not (caffe could still crash
 // later if the input files are disturbed before they are actually used, but
@@ -76,6 +94,7 @@ shared_ptr<Net<Dtype> > Net_Init(
     string param_file, int phase) {
   CheckFile(param_file);
 
+  ScopedGILRelease release;
   shared_ptr<Net<Dtype> > net(new Net<Dtype>(param_file,
       static_cast<Phase>(phase)));
   return net;
@@ -87,6 +106,7 @@ shared_ptr<Net<Dtype> > Net_Init_Load(
   CheckFile(param_file);
   CheckFile(pretrained_param_file);
 
+  ScopedGILRelease release;
   shared_ptr<Net<Dtype> > net(new Net<Dtype>(param_file,
       static_cast<Phase>(phase)));
   net->CopyTrainedLayersFrom(pretrained_param_file);
@@ -94,6 +114,7 @@ shared_ptr<Net<Dtype> > Net_Init_Load(
 }
 
 void Net_Save(const Net<Dtype>& net, string filename) {
+  ScopedGILRelease release;
   NetParameter net_param;
   net.ToProto(&net_param, false);
   WriteProtoToBinaryFile(net_param, filename.c_str());
@@ -132,8 +153,20 @@ void Net_SetInputArrays(Net<Dtype>* net, bp::object data_obj,
 }
 
 Solver<Dtype>* GetSolverFromFile(const string& filename) {
+  ScopedGILRelease release;
+  SolverParameter param;
+  ReadProtoFromTextFileOrDie(filename, &param);
+  return GetSolver<Dtype>(param);
+}
+
+// As GetSolverFromFile, on the given device instead of the device_id of the
+// file, as the root solver of P2PSync on the first of its GPUs.
+Solver<Dtype>* GetSolverFromFileOnDevice(const string& filename,
+    int device_id) {
+  ScopedGILRelease release;
   SolverParameter param;
   ReadProtoFromTextFileOrDie(filename, &param);
+  param.set_device_id(device_id);
   return GetSolver<Dtype>(param);
 }
 
@@ -176,6 +209,121 @@ struct NdarrayCallPolicies : public bp::default_call_policies {
   }
 };
 
+// Copies an array of as many values as the blob into its data, converting it
+// to C contiguous float32 if needed. In GPU mode the data is pinned host
+// memory, pushed to the device asynchronously on the stream of the thread,
+// ahead of the kernels reading it.
+void Blob_SetData(Blob<Dtype>* blob, bp::object obj) {
+  bp::handle<> array(PyArray_FROM_OTF(obj.ptr(), NPY_DTYPE,
+      NPY_ARRAY_IN_ARRAY));
+  PyArrayObject* arr = reinterpret_cast<PyArrayObject*>(array.get());
+  if (PyArray_SIZE(arr) != blob->count()) {
+    throw std::runtime_error("set_data needs as many values as the blob");
+  }
+  ScopedGILRelease release;
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    // The previous push may still read the host memory
+    CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+  }
+#endif
+  caffe_copy(blob->count(), static_cast<const Dtype*>(PyArray_DATA(arr)),
+      blob->mutable_cpu_data());
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    blob->data()->async_gpu_push(Caffe::cuda_stream());
+  }
+#endif
+}
+
+// Crops the windows of an image, of channels x height x width, warps them to
+// the items of the blob, one per window, and subtracts the mean, of a value
+// per channel or of the shape of the items, and scales them.
+void Blob_SetWindows(Blob<Dtype>* blob, bp::object image_obj,
+    bp::object windows_obj, int context_pad, Dtype scale,
+    bp::object mean_obj) {
+  bp::handle<> image_array(PyArray_FROM_OTF(image_obj.ptr(), NPY_DTYPE,
+      NPY_ARRAY_IN_ARRAY));
+  bp::handle<> windows_array(PyArray_FROM_OTF(windows_obj.ptr(), NPY_INT32,
+      NPY_ARRAY_IN_ARRAY));
+  PyArrayObject* image = reinterpret_cast<PyArrayObject*>(image_array.get());
+  PyArrayObject* windows =
+      reinterpret_cast<PyArrayObject*>(windows_array.get());
+  if (PyArray_NDIM(image) != 3) {
+    throw std::runtime_error("set_windows needs an image of channels x "
+        "height x width");
+  }
+  if (PyArray_NDIM(windows) != 2 || PyArray_DIMS(windows)[1] != 4) {
+    throw std::runtime_error("set_windows needs windows of ymin, xmin, ymax, "
+        "xmax");
+  }
+  TransformationParameter param;
+  param.set_scale(scale);
+  Blob<Dtype> mean;
+  if (!mean_obj.is_none()) {
+    bp::handle<> mean_array(PyArray_FROM_OTF(mean_obj.ptr(), NPY_DTYPE,
+        NPY_ARRAY_IN_ARRAY));
+    PyArrayObject* arr = reinterpret_cast<PyArrayObject*>(mean_array.get());
+    const Dtype* values = static_cast<const Dtype*>(PyArray_DATA(arr));
+    if (PyArray_NDIM(arr) == 1) {
+      for (int c = 0; c < PyArray_SIZE(arr); ++c) {
+        param.add_mean_value(values[c]);
+      }
+    } else {
+      if (PyArray_SIZE(arr) != blob->count(1)) {
+        throw std::runtime_error("set_windows needs a mean of a value per "
+            "channel or of the shape of an item");
+      }
+      mean.Reshape(1, blob->channels(), blob->height(), blob->width());
+      caffe_copy(mean.count(), values, mean.mutable_cpu_data());
+    }
+  }
+  Blob<Dtype> image_blob(1, PyArray_DIMS(image)[0], PyArray_DIMS(image)[1],
+      PyArray_DIMS(image)[2]);
+  caffe_copy(image_blob.count(), static_cast<const Dtype*>(
+      PyArray_DATA(image)), image_blob.mutable_cpu_data());
+  const int* values = static_cast<const int*>(PyArray_DATA(windows));
+  vector<int> window_values(values, values + PyArray_SIZE(windows));
+  ScopedGILRelease release;
+  blob->Reshape(PyArray_DIMS(windows)[0], blob->channels(), blob->height(),
+      blob->width());
+  DataTransformer<Dtype> transformer(param, TEST);
+  if (mean.count() > 0) {
+    transformer.SetMean(mean);
+  }
+  transformer.TransformWindows(image_blob, window_values, context_pad, blob);
+}
+
+// The device addresses of the data and diff, for __cuda_array_interface__.
+// The values then stay on the device, without round trips through the host.
+size_t Blob_GPUData(Blob<Dtype>* blob) {
+#ifdef CPU_ONLY
+  throw std::runtime_error("Caffe is built with CPU_ONLY");
+#else
+  return reinterpret_cast<size_t>(blob->mutable_gpu_data());
+#endif
+}
+
+size_t Blob_GPUDiff(Blob<Dtype>* blob) {
+#ifdef CPU_ONLY
+  throw std::runtime_error("Caffe is built with CPU_ONLY");
+#else
+  return reinterpret_cast<size_t>(blob->mutable_gpu_diff());
+#endif
+}
+
+// A new blob viewing the items [begin, end) of the blob along its first
+// axis, e.g. to pass part of a batch to a net without copying it.
+shared_ptr<Blob<Dtype> > Blob_Items(Blob<Dtype>* blob, int begin, int end) {
+  if (blob->num_axes() == 0 || begin < 0 || begin > end
+      || end > blob->shape(0)) {
+    throw std::runtime_error("Blob.items range out of bounds");
+  }
+  shared_ptr<Blob<Dtype> > view(new Blob<Dtype>());
+  view->ShareItems(*blob, begin, end);
+  return view;
+}
+
 bp::object Blob_Reshape(bp::tuple args, bp::dict kwargs) {
   if (bp::len(kwargs) > 0) {
     throw std::runtime_error("Blob.reshape takes no kwargs");
@@ -190,15 +338,185 @@ bp::object Blob_Reshape(bp::tuple args, bp::dict kwargs) {
   return bp::object();
 }
 
-BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(SolveOverloads, Solve, 0, 1);
+// The C++ work of a net runs with the GIL released, for other Python threads
+// and the threads of the net itself, like prefetching Python layers. These
+// take the GIL for their calls into Python.
+Dtype Net_Forward(Net<Dtype>* net, int start, int end) {
+  ScopedGILRelease release;
+  return net->ForwardFromTo(start, end);
+}
+
+void Net_Backward(Net<Dtype>* net, int start, int end) {
+  ScopedGILRelease release;
+  net->BackwardFromTo(start, end);
+}
+
+void Net_Reshape(Net<Dtype>* net) {
+  ScopedGILRelease release;
+  net->Reshape();
+}
+
+// Takes a list of the shapes of the inputs, as lists or tuples
+void Net_WarmUp(Net<Dtype>* net, const bp::list& shapes_list) {
+  vector<vector<int> > shapes(bp::len(shapes_list));
+  for (int i = 0; i < shapes.size(); ++i) {
+    bp::object shape = shapes_list[i];
+    for (int j = 0; j < bp::len(shape); ++j) {
+      shapes[i].push_back(bp::extract<int>(shape[j]));
+    }
+  }
+  ScopedGILRelease release;
+  net->WarmUp(shapes);
+}
+
+void Net_CopyFrom(Net<Dtype>* net, const string& filename) {
+  ScopedGILRelease release;
+  net->CopyTrainedLayersFrom(filename);
+}
+
+void Solver_Solve(Solver<Dtype>* solver) {
+  ScopedGILRelease release;
+  solver->Solve();
+}
+
+void Solver_Solve_Resume(Solver<Dtype>* solver, const string& resume_file) {
+  ScopedGILRelease release;
+  solver->Solve(resume_file);
+}
+
+void Solver_Step(Solver<Dtype>* solver, int iters) {
+  ScopedGILRelease release;
+  solver->Step(iters);
+}
+
+void Solver_Restore(Solver<Dtype>* solver, const char* state_file) {
+  ScopedGILRelease release;
+  solver->Restore(state_file);
+}
+
+// Calls a Python function with the iteration after each update of a solver.
+// The calls run on a thread of their own, so that the solver, and with
+// P2PSync the solvers waiting for its weights, do not wait for Python.
+class PythonCallback : public Solver<Dtype>::Callback {
+ public:
+  PythonCallback(Solver<Dtype>* solver, bp::object function)
+      : solver_(solver), function_(function),
+        thread_(&PythonCallback::entry, this) {}
+  // Delivers the pending calls first
+  virtual ~PythonCallback() {
+    iters_.push(-1);
+    ScopedGILRelease release;
+    thread_.join();
+  }
+
+  // Waits for the pending calls
+  void flush() {
+    iters_.push(0);
+    ScopedGILRelease release;
+    flushed_.pop();
+  }
+
+ protected:
+  virtual void on_start() {}
+  virtual void on_gradients_ready() {}
+  virtual void on_update_applied() {
+    // The iteration counter is incremented right after
+    iters_.push(solver_->iter() + 1);
+  }
+
+  void entry() {
+    for (int iter = iters_.pop(); iter >= 0; iter = iters_.pop()) {
+      if (iter == 0) {
+        flushed_.push(0);
+        continue;
+      }
+      ScopedGIL gil;
+      try {
+        function_(iter);
+      } catch (bp::error_already_set) {
+        PyErr_Print();
+      }
+    }
+  }
+
+  Solver<Dtype>* solver_;
+  bp::object function_;
+  BlockingQueue<int> iters_;    // Iterations to call with, 0 to flush
+  BlockingQueue<int> flushed_;
+  boost::thread thread_;
+};
+
+shared_ptr<PythonCallback> Solver_AddCallback(Solver<Dtype>* solver,
+    bp::object function) {
+  shared_ptr<PythonCallback> callback(new PythonCallback(solver, function));
+  solver->add_callback(callback.get());
+  return callback;
+}
+
+// Takes a list of nets and an optional list of their weights
+shared_ptr<Ensemble<Dtype> > Ensemble_Init(const bp::list& nets_list,
+    const bp::list& weights_list) {
+  vector<shared_ptr<Net<Dtype> > > nets(bp::len(nets_list));
+  for (int i = 0; i < nets.size(); ++i) {
+    nets[i] = bp::extract<shared_ptr<Net<Dtype> > >(nets_list[i]);
+  }
+  vector<float> weights(bp::len(weights_list));
+  for (int i = 0; i < weights.size(); ++i) {
+    weights[i] = bp::extract<float>(weights_list[i]);
+  }
+  if (weights.size() && weights.size() != nets.size()) {
+    throw std::runtime_error("Give the weight of each net of the ensemble");
+  }
+  return shared_ptr<Ensemble<Dtype> >(new Ensemble<Dtype>(nets, weights));
+}
+
+Blob<Dtype>* Ensemble_Forward(Ensemble<Dtype>* ensemble) {
+  ScopedGILRelease release;
+  return const_cast<Blob<Dtype>*>(&ensemble->Forward());
+}
+
+shared_ptr<P2PSync<Dtype> > P2PSync_Init(shared_ptr<Solver<Dtype> > solver) {
+  if (!Caffe::root_solver()) {
+    throw std::runtime_error("P2PSync needs the root solver");
+  }
+  return shared_ptr<P2PSync<Dtype> >(new P2PSync<Dtype>(solver, NULL,
+      solver->param()));
+}
+
+// Trains on the GPUs, a solver per GPU on a thread of its own, this one
+// running the root solver, which must be on the first GPU.
+void P2PSync_Run(P2PSync<Dtype>* sync, const bp::list& gpus_list) {
+  vector<int> gpus(bp::len(gpus_list));
+  for (int i = 0; i < gpus.size(); ++i) {
+    gpus[i] = bp::extract<int>(gpus_list[i]);
+  }
+  if (gpus.empty() || gpus[0] != sync->solver()->param().device_id()) {
+    throw std::runtime_error("The solver must be on the first of the GPUs,"
+        " see get_solver");
+  }
+  if (Caffe::solver_count() != gpus.size()) {
+    throw std::runtime_error("set_solver_count to the number of GPUs before"
+        " creating the solver");
+  }
+  ScopedGILRelease release;
+  sync->run(gpus);
+}
 
 BOOST_PYTHON_MODULE(_caffe) {
   // below, we prepend an underscore to methods that will be replaced
   // in Python
+  // Creates the GIL, for the threads of the nets to take
+  PyEval_InitThreads();
   // Caffe utility functions
   bp::def("set_mode_cpu", &set_mode_cpu);
   bp::def("set_mode_gpu", &set_mode_gpu);
+  bp::def("gpu_memory_usage", &gpu_memory_usage);
+  bp::def("reset_gpu_memory_peak", &reset_gpu_memory_peak);
   bp::def("set_device", &Caffe::SetDevice);
+  bp::def("solver_count", &Caffe::solver_count);
+  bp::def("set_solver_count", &Caffe::set_solver_count);
+  bp::def("root_solver", &Caffe::root_solver);
+  bp::def("set_root_solver", &Caffe::set_root_solver);
 
   bp::def("layer_type_list", &LayerRegistry<Dtype>::LayerTypeList);
 
@@ -206,12 +524,11 @@ BOOST_PYTHON_MODULE(_caffe) {
     bp::no_init)
     .def("__init__", bp::make_constructor(&Net_Init))
     .def("__init__", bp::make_constructor(&Net_Init_Load))
-    .def("_forward", &Net<Dtype>::ForwardFromTo)
-    .def("_backward", &Net<Dtype>::BackwardFromTo)
-    .def("reshape", &Net<Dtype>::Reshape)
-    // The cast is to select a particular overload.
-    .def("copy_from", static_cast<void (Net<Dtype>::*)(const string)>(
-        &Net<Dtype>::CopyTrainedLayersFrom))
+    .def("_forward", &Net_Forward)
+    .def("_backward", &Net_Backward)
+    .def("reshape", &Net_Reshape)
+    .def("warm_up", &Net_WarmUp, (bp::arg("shapes") = bp::list()))
+    .def("copy_from", &Net_CopyFrom)
     .def("share_with", &Net<Dtype>::ShareTrainedLayersWith)
     .add_property("_blob_loss_weights", bp::make_function(
         &Net<Dtype>::blob_loss_weights, bp::return_internal_reference<>()))
@@ -228,6 +545,7 @@ BOOST_PYTHON_MODULE(_caffe) {
     .add_property("_outputs",
         bp::make_function(&Net<Dtype>::output_blob_indices,
         bp::return_value_policy<bp::copy_const_reference>()))
+    .def("_memory_json", &Net<Dtype>::MemoryJSON)
     .def("_set_input_arrays", &Net_SetInputArrays,
         bp::with_custodian_and_ward<1, 2, bp::with_custodian_and_ward<1, 3> >())
     .def("save", &Net_Save);
@@ -249,7 +567,12 @@ BOOST_PYTHON_MODULE(_caffe) {
     .add_property("data",     bp::make_function(&Blob<Dtype>::mutable_cpu_data,
           NdarrayCallPolicies()))
     .add_property("diff",     bp::make_function(&Blob<Dtype>::mutable_cpu_diff,
-          NdarrayCallPolicies()));
+          NdarrayCallPolicies()))
+    .def("set_data",          &Blob_SetData)
+    .def("set_windows",       &Blob_SetWindows)
+    .def("items",             &Blob_Items)
+    .add_property("_gpu_data_ptr", &Blob_GPUData)
+    .add_property("_gpu_diff_ptr", &Blob_GPUDiff);
 
   bp::class_<Layer<Dtype>, shared_ptr<PythonLayer<Dtype> >,
     boost::noncopyable>("Layer", bp::init<const LayerParameter&>())
@@ -268,10 +591,12 @@ BOOST_PYTHON_MODULE(_caffe) {
     .add_property("test_nets", bp::make_function(&Solver<Dtype>::test_nets,
           bp::return_internal_reference<>()))
     .add_property("iter", &Solver<Dtype>::iter)
-    .def("solve", static_cast<void (Solver<Dtype>::*)(const char*)>(
-          &Solver<Dtype>::Solve), SolveOverloads())
-    .def("step", &Solver<Dtype>::Step)
-    .def("restore", &Solver<Dtype>::Restore);
+    .def("solve", &Solver_Solve)
+    .def("solve", &Solver_Solve_Resume)
+    .def("step", &Solver_Step)
+    .def("restore", &Solver_Restore)
+    .def("add_callback", &Solver_AddCallback,
+        bp::with_custodian_and_ward_postcall<1, 0>());
 
   bp::class_<SGDSolver<Dtype>, bp::bases<Solver<Dtype> >,
     shared_ptr<SGDSolver<Dtype> >, boost::noncopyable>(
@@ -285,6 +610,28 @@ BOOST_PYTHON_MODULE(_caffe) {
 
   bp::def("get_solver", &GetSolverFromFile,
       bp::return_value_policy<bp::manage_new_object>());
+  bp::def("get_solver", &GetSolverFromFileOnDevice,
+      bp::return_value_policy<bp::manage_new_object>());
+
+  bp::class_<PythonCallback, shared_ptr<PythonCallback>, boost::noncopyable>(
+      "SolverCallback", bp::no_init)
+    .def("flush", &PythonCallback::flush);
+
+  bp::class_<P2PSync<Dtype>, shared_ptr<P2PSync<Dtype> >,
+    boost::noncopyable>("P2PSync", bp::no_init)
+    .def("__init__", bp::make_constructor(&P2PSync_Init))
+    .add_property("solver", bp::make_function(&P2PSync<Dtype>::solver,
+          bp::return_value_policy<bp::copy_const_reference>()))
+    .def("run", &P2PSync_Run);
+
+  bp::class_<Ensemble<Dtype>, shared_ptr<Ensemble<Dtype> >,
+    boost::noncopyable>("Ensemble", bp::no_init)
+    .def("__init__", bp::make_constructor(&Ensemble_Init,
+          bp::default_call_policies(),
+          (bp::arg("nets"), bp::arg("weights") = bp::list())))
+    .add_property("input", bp::make_function(&Ensemble<Dtype>::input,
+          bp::return_internal_reference<>()))
+    .def("forward", &Ensemble_Forward, bp::return_internal_reference<>());
 
   // vector wrappers for all the vector types we use
   bp::class_<vector<shared_ptr<Blob<Dtype> > > >("BlobVec")
@@ -56,7 +56,8 @@ class Detector(caffe.Net):
     def detect_windows(self, images_windows):
         """
         Do windowed detection over given images and windows. Windows are
-        extracted then warped to the input dimensions of the net.
+        extracted then warped to the input dimensions of the net, in C++ and
+        on the GPU in GPU mode.
 
         Parameters
         ----------
@@ -68,22 +69,42 @@ class Detector(caffe.Net):
         detections: list of {filename: image filename, window: crop coordinates,
             predictions: prediction vector} dicts.
         """
-        # Extract windows.
-        window_inputs = []
+        # Preprocess each image once, then crop and warp its windows in C++
+        # straight into the input blob, a batch at a time, with the mean
+        # subtracted and the input scale applied there.
+        in_ = self.inputs[0]
+        batch_size = self.blobs[in_].data.shape[0]
+        transpose = self.transformer.transpose.get(in_)
+        channel_swap = self.transformer.channel_swap.get(in_)
+        raw_scale = self.transformer.raw_scale.get(in_)
+        mean = self.transformer.mean.get(in_)
+        input_scale = self.transformer.input_scale.get(in_)
+        if mean is not None:
+            if mean.shape[1:] == (1, 1):
+                mean = mean.reshape(-1)
+            else:
+                mean = np.broadcast_to(mean, self.blobs[in_].data.shape[1:])
+        if input_scale is None:
+            input_scale = 1.
+        predictions = []
         for image_fname, windows in images_windows:
             image = caffe.io.load_image(image_fname).astype(np.float32)
-            for window in windows:
-                window_inputs.append(self.crop(image, window))
-
-        # Run through the net (warping windows to input dimensions).
-        in_ = self.inputs[0]
-        caffe_in = np.zeros((len(window_inputs), window_inputs[0].shape[2])
-                            + self.blobs[in_].data.shape[2:],
-                            dtype=np.float32)
-        for ix, window_in in enumerate(window_inputs):
-            caffe_in[ix] = self.transformer.preprocess(in_, window_in)
-        out = self.forward_all(**{in_: caffe_in})
-        predictions = out[self.outputs[0]].squeeze(axis=(2, 3))
+            if transpose is not None:
+                image = image.transpose(transpose)
+            if channel_swap is not None:
+                image = image[channel_swap, :, :]
+            if raw_scale is not None:
+                image *= raw_scale
+            windows = np.asarray(windows, dtype=np.int32).reshape(-1, 4)
+            for start in range(0, len(windows), batch_size):
+                self.blobs[in_].set_windows(
+                    image, windows[start:start + batch_size],
+                    self.context_pad or 0, input_scale, mean)
+                self.reshape()
+                out = self.forward()
+                predictions.extend(
+                    out[self.outputs[0]].squeeze(axis=(2, 3)).copy())
+        predictions = np.array(predictions)
 
         # Package predictions with images and windows.
         detections = []
@@ -4,13 +4,14 @@ interface.
 """
 
 from collections import OrderedDict
+import json
 try:
     from itertools import izip_longest
 except:
     from itertools import zip_longest as izip_longest
 import numpy as np
 
-from ._caffe import Net, SGDSolver
+from ._caffe import Net, SGDSolver, Blob
 import caffe.io
 
 # We directly update methods from Net here (rather than using composition or
@@ -99,7 +100,7 @@ def _Net_forward(self, blobs=None, start=None, end=None, **kwargs):
         for in_, blob in kwargs.iteritems():
             if blob.shape[0] != self.blobs[in_].num:
                 raise Exception('Input is not batch sized')
-            self.blobs[in_].data[...] = blob
+            self.blobs[in_].set_data(blob)
 
     self._forward(start_ind, end_ind)
 
@@ -244,6 +245,33 @@ def _Net_set_input_arrays(self, data, labels):
     return self._set_input_arrays(data, labels)
 
 
+def _Net_memory_usage(self, predicted=False):
+    """
+    The bytes of memory held by the data and diff of each blob and by the
+    params of each layer, and their total, counting shared memory once.
+
+    Parameters
+    ----------
+    predicted: derive the memory a pass would allocate from the shapes,
+        forward and backward for TRAIN nets, rather than count what is
+        allocated in the current mode. Set up the net in CPU mode to size it
+        for a GPU without allocating there.
+
+    Returns
+    -------
+    usage: dict of 'blobs', mapping names to (data, diff) bytes, 'layers',
+        mapping names to param bytes, and 'total'.
+    """
+    usage = json.loads(self._memory_json(predicted))
+    return {
+        'blobs': OrderedDict((b['name'], (b['data_bytes'], b['diff_bytes']))
+                             for b in usage['blobs']),
+        'layers': OrderedDict((l['name'], l['param_bytes'])
+                              for l in usage['layers']),
+        'total': usage['total_bytes'],
+    }
+
+
 def _Net_batch(self, blobs):
     """
     Batch blob lists according to net's batch size.
@@ -277,6 +305,40 @@ def _Net_batch(self, blobs):
                                                  padding])
         yield padded_batch
 
+
+class _CUDAArray(object):
+    """
+    The data or diff of a blob on the GPU, exported through
+    __cuda_array_interface__ to CuPy, Numba, PyTorch and the like without
+    copies. It refers to the blob, which must keep its shape meanwhile.
+    """
+
+    def __init__(self, blob, ptr):
+        self._blob = blob
+        self.__cuda_array_interface__ = {
+            'shape': tuple(blob.shape),
+            'typestr': '<f4',
+            'data': (ptr, False),
+            'version': 2,
+        }
+
+
+@property
+def _Blob_gpu_data(self):
+    """
+    The data of the blob in GPU memory, synced to the device, for
+    __cuda_array_interface__ consumers. Unlike data, reading it does not copy
+    the values to the host.
+    """
+    return _CUDAArray(self, self._gpu_data_ptr)
+
+
+@property
+def _Blob_gpu_diff(self):
+    """As gpu_data, for the diff."""
+    return _CUDAArray(self, self._gpu_diff_ptr)
+
+
 # Attach methods to Net.
 Net.blobs = _Net_blobs
 Net.blob_loss_weights = _Net_blob_loss_weights
@@ -287,5 +349,10 @@ Net.forward_all = _Net_forward_all
 Net.forward_backward_all = _Net_forward_backward_all
 Net.set_input_arrays = _Net_set_input_arrays
 Net._batch = _Net_batch
+Net.memory_usage = _Net_memory_usage
 Net.inputs = _Net_inputs
 Net.outputs = _Net_outputs
+
+# Attach methods to Blob.
+Blob.gpu_data = _Blob_gpu_data
+Blob.gpu_diff = _Blob_gpu_diff
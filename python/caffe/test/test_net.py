@@ -1,6 +1,7 @@
 import unittest
 import tempfile
 import os
+import threading
 import numpy as np
 import six
 
@@ -63,6 +64,64 @@ class TestNet(unittest.TestCase):
         self.net.forward()
         self.net.backward()
 
+    def test_memory_usage(self):
+        predicted = self.net.memory_usage(predicted=True)
+        # Float data and diff, the loss propagating down to ip
+        self.assertEqual(predicted['blobs']['ip'], (5 * 13 * 4, 5 * 13 * 4))
+        self.assertEqual(predicted['layers']['loss'], 0)
+        self.net.forward()
+        self.net.backward()
+        usage = self.net.memory_usage()
+        self.assertEqual(usage['blobs']['ip'], predicted['blobs']['ip'])
+        self.assertEqual(usage['total'], predicted['total'])
+
+    def test_set_data(self):
+        blob = self.net.blobs['data']
+        values = np.arange(blob.count).reshape(blob.data.shape)
+        # Converted to float32
+        blob.set_data(values)
+        self.assertTrue(np.array_equal(blob.data, values))
+        with self.assertRaises(RuntimeError):
+            blob.set_data(np.zeros(blob.count + 1))
+
+    def test_items(self):
+        blob = self.net.blobs['data']
+        view = blob.items(1, 3)
+        self.assertEqual(view.shape, [2] + blob.shape[1:])
+        view.data[...] = 7
+        self.assertTrue(np.all(blob.data[1:3] == 7))
+        blob.data[...] = 0
+        self.assertTrue(np.all(view.data == 0))
+        with self.assertRaises(RuntimeError):
+            blob.items(2, blob.num + 1)
+
+    def test_threads(self):
+        """Check that threads, each with a net, run forward concurrently"""
+        net_file = simple_net_file(self.num_output)
+        f = tempfile.NamedTemporaryFile(mode='w+', delete=False)
+        f.close()
+        self.net.save(f.name)
+        losses = {}
+
+        def run(i):
+            # The mode and device are per thread, CPU by default
+            net = caffe.Net(net_file, f.name, caffe.TEST)
+            losses[i] = [float(net.forward()['loss']) for _ in range(5)]
+
+        threads = [threading.Thread(target=run, args=(i,)) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        os.remove(net_file)
+        os.remove(f.name)
+        self.assertEqual(len(losses), 4)
+        # The DummyData data is random, so only check that all finished
+        for values in losses.values():
+            self.assertEqual(len(values), 5)
+            for loss in values:
+                self.assertTrue(np.isfinite(loss))
+
     def test_inputs_outputs(self):
         self.assertEqual(self.net.inputs, [])
         self.assertEqual(self.net.outputs, ['loss'])
@@ -22,6 +22,23 @@ class SimpleLayer(caffe.Layer):
         bottom[0].diff[...] = 10 * top[0].diff
 
 
+class CountingLayer(caffe.Layer):
+    """A data layer filling its top with the number of batches so far"""
+
+    def setup(self, bottom, top):
+        self.count = 0
+
+    def reshape(self, bottom, top):
+        top[0].reshape(2, 3)
+
+    def forward(self, bottom, top):
+        top[0].data[...] = self.count
+        self.count += 1
+
+    def backward(self, top, propagate_down, bottom):
+        pass
+
+
 class ExceptionLayer(caffe.Layer):
     """A layer for checking exceptions from Python"""
 
@@ -52,6 +69,15 @@ def exception_net_file():
         return f.name
 
 
+def prefetch_net_file():
+    with tempfile.NamedTemporaryFile(mode='w+', delete=False) as f:
+        f.write("""name: 'prefetchnet'
+        layer { type: 'Python' name: 'data' top: 'data'
+          python_param { module: 'test_python_layer' layer: 'CountingLayer'
+            prefetch: 3 } }""")
+        return f.name
+
+
 class TestPythonLayer(unittest.TestCase):
     def setUp(self):
         net_file = python_net_file()
@@ -84,3 +110,13 @@ class TestPythonLayer(unittest.TestCase):
         net_file = exception_net_file()
         self.assertRaises(RuntimeError, caffe.Net, net_file, caffe.TEST)
         os.remove(net_file)
+
+    def test_prefetch(self):
+        net_file = prefetch_net_file()
+        net = caffe.Net(net_file, caffe.TRAIN)
+        os.remove(net_file)
+        for i in range(10):
+            net.forward()
+            self.assertEqual(net.blobs['data'].data.shape, (2, 3))
+            for y in net.blobs['data'].data.flat:
+                self.assertEqual(y, i)
@@ -37,6 +37,13 @@ class TestSolver(unittest.TestCase):
         self.solver.solve()
         self.assertEqual(self.solver.iter, 100)
 
+    def test_callback(self):
+        iters = []
+        callback = self.solver.add_callback(iters.append)
+        self.solver.step(5)
+        callback.flush()
+        self.assertEqual(iters, [1, 2, 3, 4, 5])
+
     def test_net_memory(self):
         """Check that nets survive after the solver is destroyed."""
 
@@ -0,0 +1,181 @@
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "caffe/batcher.hpp"
+
+namespace caffe {
+
+using boost::posix_time::ptime;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::microseconds;
+
+template <typename Dtype>
+class Batcher<Dtype>::sync {
+ public:
+  struct Request {
+    const Dtype* input;
+    vector<Dtype>* output;
+    ptime arrival;
+    bool done;
+  };
+
+  sync() : batches_(), items_() {}
+
+  mutable boost::mutex mutex_;
+  boost::condition_variable queued_;
+  boost::condition_variable done_;
+  std::deque<Request*> queue_;
+  vector<Request*> batch_;
+  size_t batches_;
+  size_t items_;
+};
+
+template <typename Dtype>
+Batcher<Dtype>::Batcher(shared_ptr<Net<Dtype> > net, int max_batch,
+                        int max_delay_us)
+    : net_(net), max_batch_(max_batch), max_delay_us_(max_delay_us),
+      sync_(new sync()) {
+  CHECK_GT(max_batch_, 0);
+  CHECK_GE(max_delay_us_, 0);
+  CHECK_GT(net_->input_blobs().size(), 0)
+      << "Batcher needs a net with an input blob";
+  StartInternalThread();
+}
+
+template <typename Dtype>
+Batcher<Dtype>::~Batcher() {
+  StopInternalThread();
+}
+
+template <typename Dtype>
+void Batcher<Dtype>::Process(const Dtype* input, vector<Dtype>* output) {
+  typename sync::Request request;
+  request.input = input;
+  request.output = output;
+  request.arrival = microsec_clock::universal_time();
+  request.done = false;
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  sync_->queue_.push_back(&request);
+  sync_->queued_.notify_one();
+  while (!request.done) {
+    sync_->done_.wait(lock);
+  }
+}
+
+template <typename Dtype>
+void Batcher<Dtype>::Process(const Dtype* input, int count,
+                             vector<Dtype>* output) {
+  const int input_dim = net_->input_blobs()[0]->count(1);
+  vector<typename sync::Request> requests(count);
+  vector<vector<Dtype> > outputs(count);
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    const ptime arrival = microsec_clock::universal_time();
+    for (int i = 0; i < count; ++i) {
+      requests[i].input = input + i * input_dim;
+      requests[i].output = &outputs[i];
+      requests[i].arrival = arrival;
+      requests[i].done = false;
+      sync_->queue_.push_back(&requests[i]);
+    }
+    sync_->queued_.notify_one();
+    for (int i = 0; i < count; ++i) {
+      while (!requests[i].done) {
+        sync_->done_.wait(lock);
+      }
+    }
+  }
+  output->clear();
+  for (int i = 0; i < count; ++i) {
+    output->insert(output->end(), outputs[i].begin(), outputs[i].end());
+  }
+}
+
+template <typename Dtype>
+size_t Batcher<Dtype>::batches() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return sync_->batches_;
+}
+
+template <typename Dtype>
+size_t Batcher<Dtype>::items() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return sync_->items_;
+}
+
+template <typename Dtype>
+void Batcher<Dtype>::InternalThreadEntry() {
+  vector<typename sync::Request*>& batch = sync_->batch_;
+  try {
+    while (!must_stop()) {
+      {
+        boost::mutex::scoped_lock lock(sync_->mutex_);
+        while (sync_->queue_.empty()) {
+          sync_->queued_.wait(lock);
+        }
+        // Wait for more items until the first one is due
+        const ptime due = sync_->queue_.front()->arrival
+            + microseconds(max_delay_us_);
+        while (sync_->queue_.size() < max_batch_
+            && microsec_clock::universal_time() < due) {
+          sync_->queued_.timed_wait(lock, due);
+        }
+        const int count = std::min<int>(sync_->queue_.size(), max_batch_);
+        batch.assign(sync_->queue_.begin(), sync_->queue_.begin() + count);
+        sync_->queue_.erase(sync_->queue_.begin(),
+                            sync_->queue_.begin() + count);
+      }
+      Run(batch.size());
+      boost::mutex::scoped_lock lock(sync_->mutex_);
+      for (int i = 0; i < batch.size(); ++i) {
+        batch[i]->done = true;
+      }
+      ++sync_->batches_;
+      sync_->items_ += batch.size();
+      sync_->done_.notify_all();
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+template <typename Dtype>
+void Batcher<Dtype>::Run(int count) {
+  const vector<typename sync::Request*>& batch = sync_->batch_;
+  Blob<Dtype>* input = net_->input_blobs()[0];
+  if (input->shape(0) != count) {
+    vector<int> shape(input->shape());
+    shape[0] = count;
+    input->Reshape(shape);
+    net_->Reshape();
+  }
+  const int input_dim = input->count(1);
+  Dtype* input_data = input->mutable_cpu_data();
+  for (int i = 0; i < count; ++i) {
+    std::copy(batch[i]->input, batch[i]->input + input_dim,
+              input_data + i * input_dim);
+  }
+  const vector<Blob<Dtype>*>& outputs = net_->ForwardPrefilled();
+  int output_dim = 0;
+  for (int j = 0; j < outputs.size(); ++j) {
+    output_dim += outputs[j]->count(1);
+  }
+  for (int i = 0; i < count; ++i) {
+    batch[i]->output->resize(output_dim);
+    Dtype* output = &(*batch[i]->output)[0];
+    for (int j = 0; j < outputs.size(); ++j) {
+      const int dim = outputs[j]->count(1);
+      std::copy(outputs[j]->cpu_data() + i * dim,
+                outputs[j]->cpu_data() + (i + 1) * dim, output);
+      output += dim;
+    }
+  }
+}
+
+INSTANTIATE_CLASS(Batcher);
+
+}  // namespace caffe
@@ -1,9 +1,12 @@
+#include <algorithm>
 #include <climits>
+#include <string>
 #include <vector>
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/syncedmem.hpp"
+#include "caffe/util/huffman.hpp"
 #include "caffe/util/math_functions.hpp"
 
 namespace caffe {
@@ -22,11 +25,16 @@ void Blob<Dtype>::Reshape(const int num, const int channels, const int height,
 template <typename Dtype>
 void Blob<Dtype>::Reshape(const vector<int>& shape) {
   CHECK_LE(shape.size(), kMaxBlobAxes);
+  if (shape != shape_) {
+    ++shape_version_;
+  }
   count_ = 1;
   shape_.resize(shape.size());
   for (int i = 0; i < shape.size(); ++i) {
     CHECK_GE(shape[i], 0);
-    CHECK_LE(shape[i], INT_MAX / count_) << "blob size exceeds INT_MAX";
+    if (count_ != 0) {
+      CHECK_LE(shape[i], INT_MAX / count_) << "blob size exceeds INT_MAX";
+    }
     count_ *= shape[i];
     shape_[i] = shape[i];
   }
@@ -50,20 +58,21 @@ void Blob<Dtype>::Reshape(const BlobShape& shape) {
 template <typename Dtype>
 void Blob<Dtype>::ReshapeLike(const Blob<Dtype>& other) {
   Reshape(other.shape());
+  layout_ = other.layout_;
 }
 
 template <typename Dtype>
 Blob<Dtype>::Blob(const int num, const int channels, const int height,
     const int width)
   // capacity_ must be initialized before calling Reshape
-  : capacity_(0) {
+  : capacity_(0), shape_version_(0), layout_(NCHW) {
   Reshape(num, channels, height, width);
 }
 
 template <typename Dtype>
 Blob<Dtype>::Blob(const vector<int>& shape)
   // capacity_ must be initialized before calling Reshape
-  : capacity_(0) {
+  : capacity_(0), shape_version_(0), layout_(NCHW) {
   Reshape(shape);
 }
 
@@ -85,6 +94,12 @@ const Dtype* Blob<Dtype>::gpu_data() const {
   return (const Dtype*)data_->gpu_data();
 }
 
+template <typename Dtype>
+void Blob<Dtype>::set_gpu_data(Dtype* data) {
+  CHECK(data);
+  data_->set_gpu_data(data);
+}
+
 template <typename Dtype>
 const Dtype* Blob<Dtype>::cpu_diff() const {
   CHECK(diff_);
@@ -133,6 +148,47 @@ void Blob<Dtype>::ShareDiff(const Blob& other) {
   diff_ = other.diff();
 }
 
+template <typename Dtype>
+void Blob<Dtype>::ShareView(const Blob& other, int offset) {
+  CHECK_GE(offset, 0);
+  CHECK_LE(offset + count_, other.count());
+  data_.reset(new SyncedMemory(other.data(), offset * sizeof(Dtype),
+      count_ * sizeof(Dtype)));
+  diff_.reset(new SyncedMemory(other.diff(), offset * sizeof(Dtype),
+      count_ * sizeof(Dtype)));
+  capacity_ = count_;
+}
+
+template <typename Dtype>
+void Blob<Dtype>::ShareItems(const Blob& other, int begin, int end) {
+  CHECK_GT(other.num_axes(), 0) << "Can't take the items of a scalar blob";
+  CHECK_GE(begin, 0);
+  CHECK_LE(begin, end);
+  CHECK_LE(end, other.shape(0));
+  vector<int> shape = other.shape();
+  shape[0] = end - begin;
+  Reshape(shape);
+  layout_ = other.layout_;
+  ShareView(other, begin * other.count(1));
+}
+
+template <typename Dtype>
+void Blob<Dtype>::SetDataStorage(const shared_ptr<SyncedMemory>& data) {
+  const int elements = data->size() / sizeof(Dtype);
+  CHECK_GE(elements, count_);
+  data_ = data;
+  // Reshaping beyond the storage reallocates private memory
+  capacity_ = std::min(capacity_, elements);
+}
+
+template <typename Dtype>
+void Blob<Dtype>::SetDiffStorage(const shared_ptr<SyncedMemory>& diff) {
+  const int elements = diff->size() / sizeof(Dtype);
+  CHECK_GE(elements, count_);
+  diff_ = diff;
+  capacity_ = std::min(capacity_, elements);
+}
+
 // The "update" method is used for parameter blobs in a Net, which are stored
 // as Blob<float> or Blob<double> -- hence we do not define it for
 // Blob<int> or Blob<unsigned int>.
@@ -456,7 +512,42 @@ void Blob<Dtype>::FromProto(const BlobProto& proto, bool reshape) {
   }
   // copy data
   Dtype* data_vec = mutable_cpu_data();
-  if (proto.double_data_size() > 0) {
+  if (proto.has_int8_data()) {
+    const string& int8_data = proto.int8_data();
+    CHECK_EQ(count_, static_cast<int>(int8_data.size()));
+    CHECK_GT(proto.int8_scale_size(), 0);
+    CHECK_EQ(count_ % proto.int8_scale_size(), 0);
+    const int slice = count_ / proto.int8_scale_size();
+    for (int i = 0; i < count_; ++i) {
+      data_vec[i] = static_cast<int8_t>(int8_data[i])
+          * proto.int8_scale(i / slice);
+    }
+  } else if (proto.codebook_size() > 0) {
+    vector<uint8_t> codes(count_);
+    if (proto.code_bits_size() > 0) {
+      CHECK_EQ(proto.code_bits_size(), proto.codebook_size());
+      const vector<uint32_t> lengths(proto.code_bits().begin(),
+          proto.code_bits().end());
+      HuffmanDecode(lengths, proto.code_data(), count_, &codes[0]);
+    } else {
+      CHECK_EQ(count_, static_cast<int>(proto.code_data().size()));
+      std::copy(proto.code_data().begin(), proto.code_data().end(),
+          codes.begin());
+    }
+    for (int i = 0; i < count_; ++i) {
+      CHECK_LT(codes[i], proto.codebook_size()) << "code out of range";
+      data_vec[i] = proto.codebook(codes[i]);
+    }
+  } else if (proto.sparse_index_size() > 0) {
+    CHECK_EQ(proto.sparse_data_size(), proto.sparse_index_size());
+    std::fill(data_vec, data_vec + count_, Dtype(0));
+    int index = 0;
+    for (int i = 0; i < proto.sparse_data_size(); ++i) {
+      index += proto.sparse_index(i);
+      CHECK_LT(index, count_) << "sparse index out of range";
+      data_vec[index] = proto.sparse_data(i);
+    }
+  } else if (proto.double_data_size() > 0) {
     CHECK_EQ(count_, proto.double_data_size());
     for (int i = 0; i < count_; ++i) {
       data_vec[i] = proto.double_data(i);
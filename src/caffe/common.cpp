@@ -4,18 +4,27 @@
 #include <ctime>
 
 #include "caffe/common.hpp"
+#include "caffe/util/executor.hpp"
+#include "caffe/util/numa.hpp"
 #include "caffe/util/rng.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 namespace caffe {
 
 // Make sure each thread can have different values.
 static boost::thread_specific_ptr<Caffe> thread_instance_;
 
-Caffe& Caffe::Get() {
-  if (!thread_instance_.get()) {
-    thread_instance_.reset(new Caffe());
-  }
-  return *(thread_instance_.get());
+__thread Caffe* Caffe::thread_context_ = NULL;
+
+int Caffe::node_rank_ = 0;
+int Caffe::node_count_ = 1;
+int Caffe::executor_threads_ = 0;
+shared_ptr<Executor> Caffe::executor_;
+
+Caffe& Caffe::CreateThreadContext() {
+  thread_instance_.reset(new Caffe());
+  thread_context_ = thread_instance_.get();
+  return *thread_context_;
 }
 
 // random seeding
@@ -48,13 +57,54 @@ void GlobalInit(int* pargc, char*** pargv) {
   ::google::InstallFailureSignalHandler();
 }
 
+void Caffe::set_cpu_threads(const int threads) {
+  CHECK_GT(threads, 0);
+  if (threads != Get().cpu_threads_) {
+    Get().cpu_threads_ = threads;
+    Get().thread_pool_.reset();
+  }
+}
+
+void Caffe::set_nodes(int rank, int count) {
+  CHECK_GE(rank, 0);
+  CHECK_LT(rank, count);
+  node_rank_ = rank;
+  node_count_ = count;
+}
+
+void Caffe::set_executor_threads(int threads) {
+  CHECK_GE(threads, 0);
+  executor_threads_ = threads;
+  executor_.reset();
+}
+
+Executor* Caffe::executor() {
+  static boost::mutex mutex;
+  boost::mutex::scoped_lock lock(mutex);
+  if (!executor_ && executor_threads_ > 0) {
+    executor_.reset(new Executor(executor_threads_));
+  }
+  return executor_.get();
+}
+
+ThreadPool& Caffe::thread_pool() {
+  if (!Get().thread_pool_) {
+    Get().thread_pool_.reset(new ThreadPool(Get().cpu_threads_));
+  }
+  return *Get().thread_pool_;
+}
+
 #ifdef CPU_ONLY  // CPU-only Caffe.
 
 Caffe::Caffe()
     : random_generator_(), mode_(Caffe::CPU),
-      solver_count_(1), root_solver_(true) { }
+      solver_count_(1), root_solver_(true), cpu_threads_(1) { }
 
-Caffe::~Caffe() { }
+Caffe::~Caffe() {
+  if (thread_context_ == this) {
+    thread_context_ = NULL;
+  }
+}
 
 void Caffe::set_random_seed(const unsigned int seed) {
   // RNG seed
@@ -95,27 +145,63 @@ void* Caffe::RNG::generator() {
 #else  // Normal GPU + CPU Caffe.
 
 Caffe::Caffe()
-    : cublas_handle_(NULL), curand_generator_(NULL), random_generator_(),
-    mode_(Caffe::CPU), solver_count_(1), root_solver_(true) {
-  // Try to create a cublas handler, and report an error if failed (but we will
-  // keep the program running as one might just want to run CPU code).
-  if (cublasCreate(&cublas_handle_) != CUBLAS_STATUS_SUCCESS) {
-    LOG(ERROR) << "Cannot create Cublas handle. Cublas won't be available.";
-  }
-  // Try to create a curand handler.
-  if (curandCreateGenerator(&curand_generator_, CURAND_RNG_PSEUDO_DEFAULT)
-      != CURAND_STATUS_SUCCESS ||
-      curandSetPseudoRandomGeneratorSeed(curand_generator_, cluster_seedgen())
-      != CURAND_STATUS_SUCCESS) {
-    LOG(ERROR) << "Cannot create Curand generator. Curand won't be available.";
+    : cublas_handle_(NULL), curand_generator_(NULL), cuda_stream_(0),
+    tensor_op_math_(false), device_(-1), device_handles_(),
+    random_generator_(), mode_(Caffe::CPU), solver_count_(1),
+    root_solver_(true), cpu_threads_(1) {
+  int device;
+  if (cudaGetDevice(&device) != cudaSuccess) {
+    device = 0;
   }
+  UseDeviceHandles(device);
 }
 
 Caffe::~Caffe() {
-  if (cublas_handle_) CUBLAS_CHECK(cublasDestroy(cublas_handle_));
-  if (curand_generator_) {
-    CURAND_CHECK(curandDestroyGenerator(curand_generator_));
+  // Destroyed on the exit of its thread
+  if (thread_context_ == this) {
+    thread_context_ = NULL;
+  }
+  for (std::map<int, DeviceHandles>::iterator it = device_handles_.begin();
+       it != device_handles_.end(); ++it) {
+    // Handles are destroyed on their device
+    if (it->first != device_) {
+      CUDA_CHECK(cudaSetDevice(it->first));
+    }
+    if (it->second.cublas_handle) {
+      CUBLAS_CHECK(cublasDestroy(it->second.cublas_handle));
+    }
+    if (it->second.curand_generator) {
+      CURAND_CHECK(curandDestroyGenerator(it->second.curand_generator));
+    }
+  }
+  if (device_handles_.size() > 1) {
+    CUDA_CHECK(cudaSetDevice(device_));
+  }
+}
+
+void Caffe::UseDeviceHandles(int device) {
+  std::map<int, DeviceHandles>::iterator it = device_handles_.find(device);
+  if (it == device_handles_.end()) {
+    DeviceHandles handles = { NULL, NULL };
+    // Try to create a cublas handler, and report an error if failed (but we
+    // will keep the program running as one might just want to run CPU code).
+    if (cublasCreate(&handles.cublas_handle) != CUBLAS_STATUS_SUCCESS) {
+      LOG(ERROR) << "Cannot create Cublas handle. Cublas won't be available.";
+      handles.cublas_handle = NULL;
+    }
+    // Try to create a curand handler.
+    if (curandCreateGenerator(&handles.curand_generator,
+        CURAND_RNG_PSEUDO_DEFAULT) != CURAND_STATUS_SUCCESS ||
+        curandSetPseudoRandomGeneratorSeed(handles.curand_generator,
+        cluster_seedgen()) != CURAND_STATUS_SUCCESS) {
+      LOG(ERROR) << "Cannot create Curand generator. "
+                 << "Curand won't be available.";
+    }
+    it = device_handles_.insert(std::make_pair(device, handles)).first;
   }
+  device_ = device;
+  cublas_handle_ = it->second.cublas_handle;
+  curand_generator_ = it->second.curand_generator;
 }
 
 void Caffe::set_random_seed(const unsigned int seed) {
@@ -137,23 +223,49 @@ void Caffe::set_random_seed(const unsigned int seed) {
 }
 
 void Caffe::SetDevice(const int device_id) {
+  BindThreadToDevice(device_id);
   int current_device;
   CUDA_CHECK(cudaGetDevice(&current_device));
-  if (current_device == device_id) {
+  if (current_device != device_id) {
+    // The call to cudaSetDevice must come before any calls to Get, which
+    // may perform initialization using the GPU.
+    CUDA_CHECK(cudaSetDevice(device_id));
+  }
+  if (Get().device_ == device_id) {
     return;
   }
-  // The call to cudaSetDevice must come before any calls to Get, which
-  // may perform initialization using the GPU.
-  CUDA_CHECK(cudaSetDevice(device_id));
-  if (Get().cublas_handle_) CUBLAS_CHECK(cublasDestroy(Get().cublas_handle_));
+  Get().UseDeviceHandles(device_id);
+  // Streams belong to a device, and the handles may have been left on
+  // another stream or math mode by their last use.
+  set_cuda_stream(0);
+  set_tensor_op_math(false);
+}
+
+void Caffe::set_cuda_stream(cudaStream_t stream) {
+  Get().cuda_stream_ = stream;
+  if (Get().cublas_handle_) {
+    CUBLAS_CHECK(cublasSetStream(Get().cublas_handle_, stream));
+  }
   if (Get().curand_generator_) {
-    CURAND_CHECK(curandDestroyGenerator(Get().curand_generator_));
+    CURAND_CHECK(curandSetStream(Get().curand_generator_, stream));
   }
-  CUBLAS_CHECK(cublasCreate(&Get().cublas_handle_));
-  CURAND_CHECK(curandCreateGenerator(&Get().curand_generator_,
-      CURAND_RNG_PSEUDO_DEFAULT));
-  CURAND_CHECK(curandSetPseudoRandomGeneratorSeed(Get().curand_generator_,
-      cluster_seedgen()));
+}
+
+void Caffe::set_tensor_op_math(bool tensor_op_math) {
+  Get().tensor_op_math_ = tensor_op_math;
+#if CUDA_VERSION >= 11000
+  // Float GEMMs run on tensor cores in TF32.
+  const cublasMath_t math = CUBLAS_TF32_TENSOR_OP_MATH;
+#elif CUDA_VERSION >= 9000
+  // Float GEMMs may be converted to fp16 for tensor cores.
+  const cublasMath_t math = CUBLAS_TENSOR_OP_MATH;
+#endif
+#if CUDA_VERSION >= 9000
+  if (Get().cublas_handle_) {
+    CUBLAS_CHECK(cublasSetMathMode(Get().cublas_handle_,
+        tensor_op_math ? math : CUBLAS_DEFAULT_MATH));
+  }
+#endif
 }
 
 void Caffe::DeviceQuery() {
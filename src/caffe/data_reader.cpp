@@ -1,12 +1,18 @@
 #include <boost/thread.hpp>
+#include <algorithm>
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "caffe/common.hpp"
 #include "caffe/data_layers.hpp"
 #include "caffe/data_reader.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/nvtx.hpp"
 
 namespace caffe {
 
@@ -60,6 +66,34 @@ DataReader::QueuePair::~QueuePair() {
 
 //
 
+class DataReader::Body::Shard : public InternalThread {
+ public:
+  Shard(Body* body, shared_ptr<db::Cursor> cursor, int shard, int shards,
+        const vector<shared_ptr<QueuePair> >& qps)
+      : body_(body), cursor_(cursor), shard_(shard), shards_(shards),
+        qps_(qps) {
+    StartInternalThread();
+  }
+  virtual ~Shard() {
+    StopInternalThread();
+  }
+
+ protected:
+  virtual void InternalThreadEntry() {
+    try {
+      body_->read_shard(cursor_.get(), shard_, shards_, qps_);
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+  }
+
+  Body* body_;
+  shared_ptr<db::Cursor> cursor_;
+  const int shard_;
+  const int shards_;
+  const vector<shared_ptr<QueuePair> > qps_;
+};
+
 DataReader::Body::Body(const LayerParameter& param)
     : param_(param),
       new_queue_pairs_() {
@@ -71,12 +105,53 @@ DataReader::Body::~Body() {
 }
 
 void DataReader::Body::InternalThreadEntry() {
-  shared_ptr<db::DB> db(db::GetDB(param_.data_param().backend()));
-  db->Open(param_.data_param().source(), db::READ);
-  shared_ptr<db::Cursor> cursor(db->NewCursor());
+  const DataParameter& param = param_.data_param();
+  vector<string> sources(param.mix_source().begin(),
+                         param.mix_source().end());
+  if (sources.empty()) {
+    sources.push_back(param.source());
+  }
+  // In TRAIN, each machine reads its own share of the records: databases
+  // of chunks their chunks i of i % nodes == rank, others a range of
+  // records found from their keys. The shares follow the number of nodes
+  // of when the reader starts. Data services are local to their machine.
+  const int rank = param_.phase() == TRAIN ? Caffe::node_rank() : 0;
+  const int nodes = param_.phase() == TRAIN ? Caffe::node_count() : 1;
+  const bool service = param.backend() == DataParameter_DB_SERVICE;
+  CHECK(!service || !param.random_access())
+      << "The records of a data service are only read in order";
+  const bool ranges = nodes > 1 && !service &&
+      param.backend() != DataParameter_DB_CHUNKS;
+  for (int i = 0; i < sources.size(); ++i) {
+    dbs_.push_back(shared_ptr<db::DB>(db::GetDB(param, rank, nodes)));
+    dbs_.back()->Open(sources[i], db::READ);
+    if (param.random_access() || ranges) {
+      shared_ptr<const vector<string> > keys =
+          db::RandomCursor::ReadKeys(dbs_.back().get());
+      if (ranges) {
+        const size_t begin = keys->size() * rank / nodes;
+        const size_t end = keys->size() * (rank + 1) / nodes;
+        CHECK_LT(begin, end) << "No records of " << sources[i]
+            << " for node " << rank << " of " << nodes;
+        LOG(INFO) << "Node " << rank << " reads records " << begin << " to "
+                  << end << " of " << sources[i];
+        ranges_.push_back(std::make_pair((*keys)[begin], end - begin));
+        keys.reset(new vector<string>(keys->begin() + begin,
+                                      keys->begin() + end));
+      }
+      if (param.random_access()) {
+        keys_.push_back(keys);
+      }
+    }
+  }
+  seed_ = caffe_rng_rand();
+  shared_ptr<db::Cursor> cursor(new_cursor());
   vector<shared_ptr<QueuePair> > qps;
   try {
     int solver_count = param_.phase() == TRAIN ? Caffe::solver_count() : 1;
+    if (param_.data_param().readers() > 0) {
+      solver_count = param_.data_param().readers();
+    }
 
     // To ensure deterministic runs, only start running once all solvers
     // are ready. But solvers need to peek on one item during initialization,
@@ -86,34 +161,103 @@ void DataReader::Body::InternalThreadEntry() {
       read_one(cursor.get(), qp.get());
       qps.push_back(qp);
     }
-    // Main loop
-    while (!must_stop()) {
-      for (int i = 0; i < solver_count; ++i) {
-        read_one(cursor.get(), qps[i].get());
+    // Other shards start with their own cursor at the same record. They are
+    // stopped on leaving the scope.
+    const int shards = std::min<int>(param_.data_param().reader_threads(),
+                                     solver_count);
+    vector<shared_ptr<Shard> > others;
+    for (int i = 1; i < shards; ++i) {
+      shared_ptr<db::Cursor> other(new_cursor());
+      for (int j = 0; j < solver_count; ++j) {
+        skip_one(other.get());
       }
-      // Check no additional readers have been created. This can happen if
-      // more than one net is trained at a time per process, whether single
-      // or multi solver. It might also happen if two data layers have same
-      // name and same source.
-      CHECK_EQ(new_queue_pairs_.size(), 0);
+      others.push_back(shared_ptr<Shard>(
+          new Shard(this, other, i, shards, qps)));
     }
+    // Main loop
+    read_shard(cursor.get(), 0, shards, qps);
   } catch (boost::thread_interrupted&) {
     // Interrupted exception is expected on shutdown
   }
 }
 
+db::Cursor* DataReader::Body::new_cursor() {
+  const DataParameter& param = param_.data_param();
+  vector<db::Cursor*> cursors;
+  for (int i = 0; i < dbs_.size(); ++i) {
+    if (keys_.size()) {
+      cursors.push_back(new db::RandomCursor(dbs_[i].get(), keys_[i],
+          seed_ + i, param.readahead()));
+    } else if (ranges_.size()) {
+      cursors.push_back(new db::RangeCursor(dbs_[i]->NewCursor(),
+          ranges_[i].first, ranges_[i].second));
+    } else {
+      cursors.push_back(dbs_[i]->NewCursor());
+    }
+  }
+  db::Cursor* cursor = cursors[0];
+  if (cursors.size() > 1) {
+    vector<float> weights(param.mix_weight().begin(),
+                          param.mix_weight().end());
+    cursor = new db::MixCursor(cursors, weights, seed_);
+  }
+  if (param.shuffle_buffer() > 0) {
+    cursor = new db::ShuffleBufferCursor(cursor, param.shuffle_buffer(),
+        seed_);
+  }
+  return cursor;
+}
+
+void DataReader::Body::read_shard(db::Cursor* cursor, int shard, int shards,
+                                  const vector<shared_ptr<QueuePair> >& qps) {
+  const int solver_count = qps.size();
+  while (!boost::this_thread::interruption_requested()) {
+    for (int i = 0; i < solver_count; ++i) {
+      if (i % shards == shard) {
+        read_one(cursor, qps[i].get());
+      } else {
+        skip_one(cursor);
+      }
+    }
+    // Check no additional readers have been created. This can happen if
+    // more than one net is trained at a time per process, whether single
+    // or multi solver. It might also happen if two data layers have same
+    // name and same source.
+    CHECK_EQ(new_queue_pairs_.size(), 0);
+  }
+}
+
+void DataReader::Body::skip_one(db::Cursor* cursor) {
+  cursor->Next();
+  if (!cursor->valid()) {
+    cursor->SeekToFirst();
+  }
+}
+
 void DataReader::Body::read_one(db::Cursor* cursor, QueuePair* qp) {
   Datum* datum = qp->free_.pop();
-  // TODO deserialize in-place instead of copy?
-  datum->ParseFromString(cursor->value());
+  NVTX_RANGE("DataReader read_one");
+  CPUTimer timer;
+  timer.Start();
+  // Parse straight from the database, e.g. the memory mapped file of LMDB
+  const char* data = cursor->value_data();
+  const size_t size = cursor->value_size();
+  double read_time = timer.MicroSeconds();
+  timer.Start();
+  CHECK(ParseDatum(data, size, datum)) << "Cannot parse the datum of "
+      << cursor->key();
+  qp->stats_.add(DataStats::DECODE, timer.MicroSeconds());
   qp->full_.push(datum);
 
   // go to the next iter
+  timer.Start();
   cursor->Next();
   if (!cursor->valid()) {
     DLOG(INFO) << "Restarting data prefetching from start.";
     cursor->SeekToFirst();
   }
+  read_time += timer.MicroSeconds();
+  qp->stats_.add(DataStats::READ, read_time);
 }
 
 }  // namespace caffe
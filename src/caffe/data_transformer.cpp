@@ -1,5 +1,7 @@
 #include <opencv2/core/core.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <vector>
 
@@ -36,6 +38,28 @@ DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
   }
 }
 
+// Transforms one row of a channel, src_step apart in the input. The cases
+// are chosen per row, so the loops over pixels have no branches.
+template<typename Dtype, typename Src>
+static void transform_row(const Src* src, int src_step, const Dtype* mean,
+    Dtype mean_value, Dtype scale, int width, bool mirror, Dtype* dst) {
+  const int dst_step = mirror ? -1 : 1;
+  if (mirror) {
+    dst += width - 1;
+  }
+  if (mean) {
+    for (int w = 0; w < width; ++w) {
+      dst[w * dst_step] = (static_cast<Dtype>(src[w * src_step]) - mean[w])
+          * scale;
+    }
+  } else {
+    for (int w = 0; w < width; ++w) {
+      dst[w * dst_step] = (static_cast<Dtype>(src[w * src_step]) - mean_value)
+          * scale;
+    }
+  }
+}
+
 template<typename Dtype>
 void DataTransformer<Dtype>::Transform(const Datum& datum,
                                        Dtype* transformed_data) {
@@ -91,34 +115,21 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
     }
   }
 
-  Dtype datum_element;
-  int top_index, data_index;
+  const uint8_t* uint8_data = reinterpret_cast<const uint8_t*>(data.data());
+  const float* float_data = datum.float_data().data();
   for (int c = 0; c < datum_channels; ++c) {
+    const Dtype mean_value = has_mean_values ? mean_values_[c] : 0;
     for (int h = 0; h < height; ++h) {
-      for (int w = 0; w < width; ++w) {
-        data_index = (c * datum_height + h_off + h) * datum_width + w_off + w;
-        if (do_mirror) {
-          top_index = (c * height + h) * width + (width - 1 - w);
-        } else {
-          top_index = (c * height + h) * width + w;
-        }
-        if (has_uint8) {
-          datum_element =
-            static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
-        } else {
-          datum_element = datum.float_data(data_index);
-        }
-        if (has_mean_file) {
-          transformed_data[top_index] =
-            (datum_element - mean[data_index]) * scale;
-        } else {
-          if (has_mean_values) {
-            transformed_data[top_index] =
-              (datum_element - mean_values_[c]) * scale;
-          } else {
-            transformed_data[top_index] = datum_element * scale;
-          }
-        }
+      const int data_index = (c * datum_height + h_off + h) * datum_width
+          + w_off;
+      const Dtype* mean_row = has_mean_file ? mean + data_index : NULL;
+      Dtype* top_row = transformed_data + (c * height + h) * width;
+      if (has_uint8) {
+        transform_row(uint8_data + data_index, 1, mean_row, mean_value, scale,
+                      width, do_mirror, top_row);
+      } else {
+        transform_row(float_data + data_index, 1, mean_row, mean_value, scale,
+                      width, do_mirror, top_row);
       }
     }
   }
@@ -131,13 +142,11 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
   if (datum.encoded()) {
     CHECK(!(param_.force_color() && param_.force_gray()))
         << "cannot set both force_color and force_gray";
-    cv::Mat cv_img;
-    if (param_.force_color() || param_.force_gray()) {
     // If force_color then decode in color otherwise decode in gray.
-      cv_img = DecodeDatumToCVMat(datum, param_.force_color());
-    } else {
-      cv_img = DecodeDatumToCVMatNative(datum);
-    }
+    const int channels = param_.force_color() ? 3 :
+        param_.force_gray() ? 1 : 0;
+    cv::Mat cv_img;
+    DecodeDatumToCVMat(datum, channels, &cv_img);
     // Transform the cv::image into blob.
     return Transform(cv_img, transformed_blob);
   } else {
@@ -286,32 +295,15 @@ void DataTransformer<Dtype>::Transform(const cv::Mat& cv_img,
   CHECK(cv_cropped_img.data);
 
   Dtype* transformed_data = transformed_blob->mutable_cpu_data();
-  int top_index;
   for (int h = 0; h < height; ++h) {
     const uchar* ptr = cv_cropped_img.ptr<uchar>(h);
-    int img_index = 0;
-    for (int w = 0; w < width; ++w) {
-      for (int c = 0; c < img_channels; ++c) {
-        if (do_mirror) {
-          top_index = (c * height + h) * width + (width - 1 - w);
-        } else {
-          top_index = (c * height + h) * width + w;
-        }
-        // int top_index = (c * height + h) * width + w;
-        Dtype pixel = static_cast<Dtype>(ptr[img_index++]);
-        if (has_mean_file) {
-          int mean_index = (c * img_height + h_off + h) * img_width + w_off + w;
-          transformed_data[top_index] =
-            (pixel - mean[mean_index]) * scale;
-        } else {
-          if (has_mean_values) {
-            transformed_data[top_index] =
-              (pixel - mean_values_[c]) * scale;
-          } else {
-            transformed_data[top_index] = pixel * scale;
-          }
-        }
-      }
+    // Pixels are interleaved, each channel is read img_channels apart
+    for (int c = 0; c < img_channels; ++c) {
+      const Dtype mean_value = has_mean_values ? mean_values_[c] : 0;
+      const Dtype* mean_row = has_mean_file ?
+          mean + (c * img_height + h_off + h) * img_width + w_off : NULL;
+      transform_row(ptr + c, img_channels, mean_row, mean_value, scale, width,
+                    do_mirror, transformed_data + (c * height + h) * width);
     }
   }
 }
@@ -434,13 +426,11 @@ vector<int> DataTransformer<Dtype>::InferBlobShape(const Datum& datum) {
   if (datum.encoded()) {
     CHECK(!(param_.force_color() && param_.force_gray()))
         << "cannot set both force_color and force_gray";
-    cv::Mat cv_img;
-    if (param_.force_color() || param_.force_gray()) {
     // If force_color then decode in color otherwise decode in gray.
-      cv_img = DecodeDatumToCVMat(datum, param_.force_color());
-    } else {
-      cv_img = DecodeDatumToCVMatNative(datum);
-    }
+    const int channels = param_.force_color() ? 3 :
+        param_.force_gray() ? 1 : 0;
+    cv::Mat cv_img;
+    DecodeDatumToCVMat(datum, channels, &cv_img);
     // InferBlobShape using the cv::image.
     return InferBlobShape(cv_img);
   }
@@ -462,6 +452,21 @@ vector<int> DataTransformer<Dtype>::InferBlobShape(const Datum& datum) {
   return shape;
 }
 
+template<typename Dtype>
+vector<int> DataTransformer<Dtype>::InferBlobShape(const vector<int>& shape) {
+  CHECK_EQ(shape.size(), 3);
+  const int crop_size = param_.crop_size();
+  CHECK_GT(shape[0], 0);
+  CHECK_GE(shape[1], crop_size);
+  CHECK_GE(shape[2], crop_size);
+  vector<int> blob_shape(4);
+  blob_shape[0] = 1;
+  blob_shape[1] = shape[0];
+  blob_shape[2] = crop_size ? crop_size : shape[1];
+  blob_shape[3] = crop_size ? crop_size : shape[2];
+  return blob_shape;
+}
+
 template<typename Dtype>
 vector<int> DataTransformer<Dtype>::InferBlobShape(
     const vector<Datum> & datum_vector) {
@@ -505,6 +510,166 @@ vector<int> DataTransformer<Dtype>::InferBlobShape(
   return shape;
 }
 
+// The rows, or columns, of the image the window from lo to hi, hi excluded,
+// takes, as the first and the number, and those of the item of the given
+// size it warps to, following detector.py.
+static void window_axis(int lo, int hi, int image_size, int size,
+    int context_pad, int* params) {
+  params[2] = 0;
+  params[3] = size;
+  if (context_pad > 0) {
+    // Expanded such that after warping there is context_pad of context on
+    // each side, clipped to the image
+    const double context_scale = static_cast<double>(size)
+        / (size - 2 * context_pad);
+    const double half = (hi - lo + 1) / 2.0;
+    const double center = lo + half;
+    lo = static_cast<int>(round(center - half * context_scale));
+    hi = static_cast<int>(round(center + half * context_scale));
+    const double scale = static_cast<double>(size) / (hi - lo + 1);
+    params[2] = static_cast<int>(round(std::max(0, -lo) * scale));
+    lo = std::min(std::max(lo, 0), image_size);
+    hi = std::min(std::max(hi, 0), image_size);
+    params[3] = std::min(static_cast<int>(round((hi - lo + 1) * scale)),
+                         size - params[2]);
+  }
+  CHECK_GE(lo, 0) << "The window is outside the image";
+  CHECK_LE(hi, image_size) << "The window is outside the image";
+  CHECK_LT(lo, hi) << "The window is empty";
+  params[0] = lo;
+  params[1] = hi - lo;
+}
+
+// The pixel of a warped window at (h, w) of its item, with bilinear
+// interpolation between the pixels of the window in image, and the mean
+// outside the window.
+template <typename Dtype>
+static Dtype window_pixel(const Dtype* image, int image_width,
+    const int* params, int h, int w, Dtype mean) {
+  const int dh = h - params[2];
+  const int dw = w - params[6];
+  if (dh < 0 || dh >= params[3] || dw < 0 || dw >= params[7]) {
+    return mean;
+  }
+  const Dtype y = std::min(std::max((dh + Dtype(0.5)) * params[1] / params[3]
+      - Dtype(0.5), Dtype(0)), Dtype(params[1] - 1));
+  const Dtype x = std::min(std::max((dw + Dtype(0.5)) * params[5] / params[7]
+      - Dtype(0.5), Dtype(0)), Dtype(params[5] - 1));
+  const int y0 = static_cast<int>(y);
+  const int x0 = static_cast<int>(x);
+  const int y1 = std::min(y0 + 1, params[1] - 1);
+  const int x1 = std::min(x0 + 1, params[5] - 1);
+  const Dtype fy = y - y0;
+  const Dtype fx = x - x0;
+  const Dtype* top = image + (params[0] + y0) * image_width + params[4];
+  const Dtype* bottom = image + (params[0] + y1) * image_width + params[4];
+  return (1 - fy) * ((1 - fx) * top[x0] + fx * top[x1])
+      + fy * ((1 - fx) * bottom[x0] + fx * bottom[x1]);
+}
+
+template <typename Dtype>
+void DataTransformer<Dtype>::TransformWindows(const Blob<Dtype>& image,
+    const vector<int>& windows, int context_pad,
+    Blob<Dtype>* transformed_blob) {
+  const int num = transformed_blob->num();
+  const int channels = transformed_blob->channels();
+  const int height = transformed_blob->height();
+  const int width = transformed_blob->width();
+  CHECK_EQ(image.num(), 1);
+  CHECK_EQ(image.channels(), channels);
+  CHECK_EQ(windows.size(), num * 4) << "TransformWindows needs a window per "
+      << "item";
+  // The rows and columns of the image and of the item of each window
+  vector<int> params(num * 8);
+  for (int n = 0; n < num; ++n) {
+    window_axis(windows[n * 4], windows[n * 4 + 2], image.height(), height,
+        context_pad, &params[n * 8]);
+    window_axis(windows[n * 4 + 1], windows[n * 4 + 3], image.width(), width,
+        context_pad, &params[n * 8 + 4]);
+  }
+  const bool mean_per_pixel = data_mean_.count() > 0;
+  if (mean_per_pixel) {
+    CHECK_EQ(channels, data_mean_.channels());
+    CHECK_EQ(height, data_mean_.height());
+    CHECK_EQ(width, data_mean_.width());
+  }
+  if (mean_values_.size() > 0) {
+    MeanValues(channels);
+  }
+  const Blob<Dtype>* mean = mean_per_pixel ? &data_mean_
+      : mean_values_.size() > 0 ? &mean_values_blob_ : NULL;
+  if (Caffe::mode() == Caffe::GPU) {
+#ifndef CPU_ONLY
+    SyncedMemory gpu_params(params.size() * sizeof(int));
+    caffe_copy(params.size() * sizeof(int), reinterpret_cast<const char*>(
+        &params[0]), static_cast<char*>(gpu_params.mutable_cpu_data()));
+    TransformWindows_gpu(image, static_cast<const int*>(
+        gpu_params.gpu_data()), mean ? mean->gpu_data() : NULL,
+        mean_per_pixel, transformed_blob);
+    return;
+#else
+    NO_GPU;
+#endif
+  }
+  const Dtype scale = param_.scale();
+  const Dtype* image_data = image.cpu_data();
+  const Dtype* mean_data = mean ? mean->cpu_data() : NULL;
+  Dtype* transformed_data = transformed_blob->mutable_cpu_data();
+  for (int n = 0; n < num; ++n) {
+    for (int c = 0; c < channels; ++c) {
+      const Dtype* channel = image_data + image.offset(0, c);
+      for (int h = 0; h < height; ++h) {
+        for (int w = 0; w < width; ++w) {
+          const Dtype m = !mean_data ? Dtype(0) : mean_per_pixel
+              ? mean_data[(c * height + h) * width + w] : mean_data[c];
+          *transformed_data++ = (window_pixel(channel, image.width(),
+              &params[n * 8], h, w, m) - m) * scale;
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void DataTransformer<Dtype>::SetMean(const Blob<Dtype>& mean) {
+  data_mean_.CopyFrom(mean, false, true);
+}
+
+template <typename Dtype>
+void DataTransformer<Dtype>::MeanValues(int channels) {
+  CHECK(mean_values_.size() == 1 || mean_values_.size() == channels) <<
+   "Specify either 1 mean_value or as many as channels: " << channels;
+  if (mean_values_blob_.count() != channels) {
+    vector<int> mean_shape(1, channels);
+    mean_values_blob_.Reshape(mean_shape);
+    Dtype* values = mean_values_blob_.mutable_cpu_data();
+    for (int c = 0; c < channels; ++c) {
+      values[c] = mean_values_[mean_values_.size() == 1 ? 0 : c];
+    }
+  }
+}
+
+template <typename Dtype>
+void DataTransformer<Dtype>::TransformParams(int height, int width,
+                                             int* params) {
+  const int crop_size = param_.crop_size();
+  // Same draws as Transform, so both give the same results
+  params[2] = param_.mirror() && Rand(2);
+  params[0] = 0;
+  params[1] = 0;
+  if (crop_size) {
+    CHECK_GE(height, crop_size);
+    CHECK_GE(width, crop_size);
+    if (phase_ == TRAIN) {
+      params[0] = Rand(height - crop_size + 1);
+      params[1] = Rand(width - crop_size + 1);
+    } else {
+      params[0] = (height - crop_size) / 2;
+      params[1] = (width - crop_size) / 2;
+    }
+  }
+}
+
 template <typename Dtype>
 void DataTransformer<Dtype>::InitRand() {
   const bool needs_rand = param_.mirror() ||
@@ -0,0 +1,134 @@
+#include <stdint.h>
+
+#include <vector>
+
+#include "caffe/data_transformer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+// Each output element reads its pixel from the crop of its item, mirrored
+// if requested. mean is per pixel of the input, per channel, or NULL.
+template <typename Dtype>
+__global__ void TransformForward(const int n, const uint8_t* data,
+    const int* params, const Dtype* mean, const bool mean_per_pixel,
+    const int channels, const int height, const int width,
+    const int top_height, const int top_width, const Dtype scale,
+    Dtype* out) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int w = index % top_width;
+    const int h = (index / top_width) % top_height;
+    const int c = (index / top_width / top_height) % channels;
+    const int i = index / top_width / top_height / channels;
+    const int* p = params + 3 * i;
+    const int data_w = p[1] + (p[2] ? top_width - 1 - w : w);
+    const int data_index = (c * height + p[0] + h) * width + data_w;
+    Dtype value = data[i * channels * height * width + data_index];
+    if (mean) {
+      value -= mean_per_pixel ? mean[data_index] : mean[c];
+    }
+    out[index] = value * scale;
+  }
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::Transform_gpu(const vector<int>& shape,
+    const uint8_t* data, const int* params, Blob<Dtype>* transformed_blob) {
+  CHECK_EQ(shape.size(), 3);
+  const int channels = shape[0];
+  const int height = shape[1];
+  const int width = shape[2];
+  CHECK_EQ(transformed_blob->channels(), channels);
+  CHECK_LE(transformed_blob->height(), height);
+  CHECK_LE(transformed_blob->width(), width);
+
+  const Dtype* mean = NULL;
+  if (param_.has_mean_file()) {
+    CHECK_EQ(channels, data_mean_.channels());
+    CHECK_EQ(height, data_mean_.height());
+    CHECK_EQ(width, data_mean_.width());
+    mean = data_mean_.gpu_data();
+  }
+  if (mean_values_.size() > 0) {
+    MeanValues(channels);
+    mean = mean_values_blob_.gpu_data();
+  }
+
+  const int count = transformed_blob->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  TransformForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+      0, Caffe::cuda_stream()>>>(count, data, params, mean,
+      param_.has_mean_file(), channels, height, width,
+      transformed_blob->height(), transformed_blob->width(),
+      Dtype(param_.scale()), transformed_blob->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+// Each output element interpolates its pixel from the window of its item,
+// params giving the rows and columns of the window in the image and in the
+// item, and is the mean outside the window.
+template <typename Dtype>
+__global__ void WindowTransformForward(const int n, const Dtype* image,
+    const int* params, const Dtype* mean, const bool mean_per_pixel,
+    const int channels, const int height, const int width,
+    const int top_height, const int top_width, const Dtype scale,
+    Dtype* out) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int w = index % top_width;
+    const int h = (index / top_width) % top_height;
+    const int c = (index / top_width / top_height) % channels;
+    const int i = index / top_width / top_height / channels;
+    const int* p = params + 8 * i;
+    const Dtype m = !mean ? Dtype(0) : mean_per_pixel
+        ? mean[(c * top_height + h) * top_width + w] : mean[c];
+    const int dh = h - p[2];
+    const int dw = w - p[6];
+    Dtype value = m;
+    if (dh >= 0 && dh < p[3] && dw >= 0 && dw < p[7]) {
+      const Dtype y = min(max((dh + Dtype(0.5)) * p[1] / p[3] - Dtype(0.5),
+          Dtype(0)), Dtype(p[1] - 1));
+      const Dtype x = min(max((dw + Dtype(0.5)) * p[5] / p[7] - Dtype(0.5),
+          Dtype(0)), Dtype(p[5] - 1));
+      const int y0 = static_cast<int>(y);
+      const int x0 = static_cast<int>(x);
+      const int y1 = min(y0 + 1, p[1] - 1);
+      const int x1 = min(x0 + 1, p[5] - 1);
+      const Dtype fy = y - y0;
+      const Dtype fx = x - x0;
+      const Dtype* top = image + (c * height + p[0] + y0) * width + p[4];
+      const Dtype* bottom = image + (c * height + p[0] + y1) * width + p[4];
+      value = (1 - fy) * ((1 - fx) * top[x0] + fx * top[x1])
+          + fy * ((1 - fx) * bottom[x0] + fx * bottom[x1]);
+    }
+    out[index] = (value - m) * scale;
+  }
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::TransformWindows_gpu(const Blob<Dtype>& image,
+    const int* params, const Dtype* mean, bool mean_per_pixel,
+    Blob<Dtype>* transformed_blob) {
+  const int count = transformed_blob->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  WindowTransformForward<Dtype><<<CAFFE_GET_BLOCKS(count),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count,
+      image.gpu_data(), params, mean, mean_per_pixel, image.channels(),
+      image.height(), image.width(), transformed_blob->height(),
+      transformed_blob->width(), Dtype(param_.scale()),
+      transformed_blob->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void DataTransformer<float>::Transform_gpu(const vector<int>& shape,
+    const uint8_t* data, const int* params, Blob<float>* transformed_blob);
+template void DataTransformer<double>::Transform_gpu(const vector<int>& shape,
+    const uint8_t* data, const int* params, Blob<double>* transformed_blob);
+
+template void DataTransformer<float>::TransformWindows_gpu(
+    const Blob<float>& image, const int* params, const float* mean,
+    bool mean_per_pixel, Blob<float>* transformed_blob);
+template void DataTransformer<double>::TransformWindows_gpu(
+    const Blob<double>& image, const int* params, const double* mean,
+    bool mean_per_pixel, Blob<double>* transformed_blob);
+
+}  // namespace caffe
@@ -0,0 +1,153 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <vector>
+
+#include "caffe/ensemble.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class Ensemble<Dtype>::sync {
+ public:
+  sync() : generation_(0), running_(0), stop_(false) {}
+
+  boost::mutex mutex_;
+  boost::condition_variable start_;
+  boost::condition_variable done_;
+  boost::thread_group workers_;
+  // Counts the passes started, for the workers to tell a new one
+  size_t generation_;
+  // The nets of the current pass still running
+  int running_;
+  Caffe::Brew mode_;
+  bool stop_;
+};
+
+template <typename Dtype>
+Ensemble<Dtype>::Ensemble(const vector<shared_ptr<Net<Dtype> > >& nets,
+                          const vector<float>& weights)
+    : nets_(nets), sync_(new sync()) {
+  CHECK_GT(nets_.size(), 0) << "An ensemble needs nets";
+  CHECK(weights.empty() || weights.size() == nets_.size())
+      << "Give the weight of each net of the ensemble";
+  for (int i = 0; i < nets_.size(); ++i) {
+    CHECK_GT(nets_[i]->num_inputs(), 0)
+        << "The nets of an ensemble need an input blob";
+    CHECK_GT(nets_[i]->num_outputs(), 0)
+        << "The nets of an ensemble need an output blob";
+    weights_.push_back(weights.empty() ? Dtype(1) / nets_.size() :
+                       Dtype(weights[i]));
+  }
+  input_.ReshapeLike(*nets_[0]->input_blobs()[0]);
+  // Workers take the settings of this thread, as in InternalThread
+  int device = 0;
+#ifndef CPU_ONLY
+  CUDA_CHECK(cudaGetDevice(&device));
+#endif
+  for (int i = 0; i < nets_.size(); ++i) {
+    sync_->workers_.create_thread(boost::bind(&Ensemble::Work, this, i,
+        device, caffe_rng_rand(), Caffe::cpu_threads()));
+  }
+}
+
+template <typename Dtype>
+Ensemble<Dtype>::~Ensemble() {
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    sync_->stop_ = true;
+  }
+  sync_->start_.notify_all();
+  sync_->workers_.join_all();
+}
+
+template <typename Dtype>
+void Ensemble<Dtype>::Work(int net, int device, int rand_seed,
+                           int cpu_threads) {
+#ifndef CPU_ONLY
+  CUDA_CHECK(cudaSetDevice(device));
+#endif
+  Caffe::set_random_seed(rand_seed);
+  Caffe::set_cpu_threads(cpu_threads);
+  size_t generation = 0;
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  while (true) {
+    while (sync_->generation_ == generation && !sync_->stop_) {
+      sync_->start_.wait(lock);
+    }
+    if (sync_->stop_) {
+      return;
+    }
+    generation = sync_->generation_;
+    Caffe::set_mode(sync_->mode_);
+    lock.unlock();
+    nets_[net]->ForwardPrefilled();
+    lock.lock();
+    if (--sync_->running_ == 0) {
+      sync_->done_.notify_one();
+    }
+  }
+}
+
+template <typename Dtype>
+const Blob<Dtype>& Ensemble<Dtype>::Forward() {
+  // Copied to the device once, rather than by each net
+  if (Caffe::mode() == Caffe::GPU) {
+    input_.gpu_data();
+  } else {
+    input_.cpu_data();
+  }
+  for (int i = 0; i < nets_.size(); ++i) {
+    Blob<Dtype>* input = nets_[i]->input_blobs()[0];
+    if (input->shape() != input_.shape()) {
+      input->ReshapeLike(input_);
+    }
+    input->ShareData(input_);
+  }
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    sync_->mode_ = Caffe::mode();
+    sync_->running_ = nets_.size();
+    ++sync_->generation_;
+    sync_->start_.notify_all();
+    while (sync_->running_ > 0) {
+      sync_->done_.wait(lock);
+    }
+  }
+  const Blob<Dtype>& first = *nets_[0]->output_blobs()[0];
+  output_.ReshapeLike(first);
+  for (int i = 1; i < nets_.size(); ++i) {
+    CHECK_EQ(nets_[i]->output_blobs()[0]->count(), output_.count())
+        << "The nets of an ensemble need outputs of the same shape";
+  }
+  switch (Caffe::mode()) {
+  case Caffe::CPU:
+    caffe_cpu_scale(output_.count(), weights_[0], first.cpu_data(),
+                    output_.mutable_cpu_data());
+    for (int i = 1; i < nets_.size(); ++i) {
+      caffe_axpy(output_.count(), weights_[i],
+                 nets_[i]->output_blobs()[0]->cpu_data(),
+                 output_.mutable_cpu_data());
+    }
+    break;
+  case Caffe::GPU:
+#ifndef CPU_ONLY
+    caffe_gpu_scale(output_.count(), weights_[0], first.gpu_data(),
+                    output_.mutable_gpu_data());
+    for (int i = 1; i < nets_.size(); ++i) {
+      caffe_gpu_axpy(output_.count(), weights_[i],
+                     nets_[i]->output_blobs()[0]->gpu_data(),
+                     output_.mutable_gpu_data());
+    }
+#else
+    NO_GPU;
+#endif
+    break;
+  }
+  return output_;
+}
+
+INSTANTIATE_CLASS(Ensemble);
+
+}  // namespace caffe
@@ -3,6 +3,7 @@
 
 #include "caffe/internal_thread.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/numa.hpp"
 
 namespace caffe {
 
@@ -42,6 +43,9 @@ void InternalThread::entry(int device, Caffe::Brew mode, int rand_seed,
     int solver_count, bool root_solver) {
 #ifndef CPU_ONLY
   CUDA_CHECK(cudaSetDevice(device));
+  if (mode == Caffe::GPU) {
+    BindThreadToDevice(device);
+  }
 #endif
   Caffe::set_mode(mode);
   Caffe::set_random_seed(rand_seed);
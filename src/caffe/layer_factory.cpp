@@ -3,7 +3,12 @@
 #ifdef WITH_PYTHON_LAYER
 #include <boost/python.hpp>
 #endif
+#include <boost/thread/mutex.hpp>
+
+#include <fstream>  // NOLINT(readability/streams)
+#include <map>
 #include <string>
+#include <vector>
 
 #include "caffe/layer.hpp"
 #include "caffe/layer_factory.hpp"
@@ -21,14 +26,40 @@ template <typename Dtype>
 shared_ptr<Layer<Dtype> > GetConvolutionLayer(
     const LayerParameter& param) {
   ConvolutionParameter_Engine engine = param.convolution_param().engine();
+  // AUTO starts from the first candidate, until Net::Init times the others.
+  if (engine == ConvolutionParameter_Engine_AUTO) {
+    engine = EngineCandidates<Dtype>(param).front().convolution_param()
+        .engine();
+  }
   if (engine == ConvolutionParameter_Engine_DEFAULT) {
     engine = ConvolutionParameter_Engine_CAFFE;
 #ifdef USE_CUDNN
-    engine = ConvolutionParameter_Engine_CUDNN;
+    // Only Caffe's own layer runs on sparse weights.
+    if (!param.has_sparsity_param()) {
+      engine = ConvolutionParameter_Engine_CUDNN;
+    }
 #endif
   }
   if (engine == ConvolutionParameter_Engine_CAFFE) {
     return shared_ptr<Layer<Dtype> >(new ConvolutionLayer<Dtype>(param));
+  } else if (engine == ConvolutionParameter_Engine_WINOGRAD) {
+    if (!WinogradConvolutionLayer<Dtype>::IsSupported(
+        param.convolution_param())) {
+      LOG(INFO) << "WINOGRAD only supports 3x3 filters with stride 1. "
+                << "Using Caffe's own convolution layer.";
+      return shared_ptr<Layer<Dtype> >(new ConvolutionLayer<Dtype>(param));
+    }
+    return shared_ptr<Layer<Dtype> >(
+        new WinogradConvolutionLayer<Dtype>(param));
+  } else if (engine == ConvolutionParameter_Engine_DIRECT) {
+    if (!DirectConvolutionLayer<Dtype>::IsSupported(
+        param.convolution_param())) {
+      LOG(INFO) << "DIRECT does not support groups. "
+                << "Using Caffe's own convolution layer.";
+      return shared_ptr<Layer<Dtype> >(new ConvolutionLayer<Dtype>(param));
+    }
+    return shared_ptr<Layer<Dtype> >(
+        new DirectConvolutionLayer<Dtype>(param));
 #ifdef USE_CUDNN
   } else if (engine == ConvolutionParameter_Engine_CUDNN) {
     return shared_ptr<Layer<Dtype> >(new CuDNNConvolutionLayer<Dtype>(param));
@@ -40,10 +71,54 @@ shared_ptr<Layer<Dtype> > GetConvolutionLayer(
 
 REGISTER_LAYER_CREATOR(Convolution, GetConvolutionLayer);
 
+// Get deconvolution layer according to engine.
+template <typename Dtype>
+shared_ptr<Layer<Dtype> > GetDeconvolutionLayer(
+    const LayerParameter& param) {
+  ConvolutionParameter_Engine engine = param.convolution_param().engine();
+  if (engine == ConvolutionParameter_Engine_AUTO) {
+    engine = EngineCandidates<Dtype>(param).front().convolution_param()
+        .engine();
+  }
+  if (engine == ConvolutionParameter_Engine_DEFAULT) {
+    engine = ConvolutionParameter_Engine_CAFFE;
+#ifdef USE_CUDNN
+    engine = ConvolutionParameter_Engine_CUDNN;
+#endif
+  }
+  if (engine == ConvolutionParameter_Engine_CAFFE) {
+    return shared_ptr<Layer<Dtype> >(new DeconvolutionLayer<Dtype>(param));
+#ifdef USE_CUDNN
+  } else if (engine == ConvolutionParameter_Engine_CUDNN) {
+    return shared_ptr<Layer<Dtype> >(
+        new CuDNNDeconvolutionLayer<Dtype>(param));
+#endif
+  } else {
+    LOG(FATAL) << "Layer " << param.name() << " has unknown engine.";
+  }
+}
+
+REGISTER_LAYER_CREATOR(Deconvolution, GetDeconvolutionLayer);
+
+// Get inner product layer, split across GPUs if it lists devices.
+template <typename Dtype>
+shared_ptr<Layer<Dtype> > GetInnerProductLayer(const LayerParameter& param) {
+  if (param.inner_product_param().device_size() > 0) {
+    return shared_ptr<Layer<Dtype> >(
+        new ModelParallelInnerProductLayer<Dtype>(param));
+  }
+  return shared_ptr<Layer<Dtype> >(new InnerProductLayer<Dtype>(param));
+}
+
+REGISTER_LAYER_CREATOR(InnerProduct, GetInnerProductLayer);
+
 // Get pooling layer according to engine.
 template <typename Dtype>
 shared_ptr<Layer<Dtype> > GetPoolingLayer(const LayerParameter& param) {
   PoolingParameter_Engine engine = param.pooling_param().engine();
+  if (engine == PoolingParameter_Engine_AUTO) {
+    engine = EngineCandidates<Dtype>(param).front().pooling_param().engine();
+  }
   if (engine == PoolingParameter_Engine_DEFAULT) {
     engine = PoolingParameter_Engine_CAFFE;
 #ifdef USE_CUDNN
@@ -70,6 +145,44 @@ shared_ptr<Layer<Dtype> > GetPoolingLayer(const LayerParameter& param) {
 
 REGISTER_LAYER_CREATOR(Pooling, GetPoolingLayer);
 
+// Get LRN layer according to engine.
+template <typename Dtype>
+shared_ptr<Layer<Dtype> > GetLRNLayer(const LayerParameter& param) {
+  LRNParameter_Engine engine = param.lrn_param().engine();
+  if (engine == LRNParameter_Engine_DEFAULT) {
+    engine = LRNParameter_Engine_CAFFE;
+#ifdef USE_CUDNN
+    engine = LRNParameter_Engine_CUDNN;
+#endif
+  }
+  if (engine == LRNParameter_Engine_CAFFE) {
+    return shared_ptr<Layer<Dtype> >(new LRNLayer<Dtype>(param));
+#ifdef USE_CUDNN
+  } else if (engine == LRNParameter_Engine_CUDNN) {
+#if CUDNN_VERSION_MIN(3, 0, 0)
+    const LRNParameter& lrn_param = param.lrn_param();
+    if (lrn_param.norm_region() == LRNParameter_NormRegion_ACROSS_CHANNELS
+        && lrn_param.local_size() >= CUDNN_LRN_MIN_N
+        && lrn_param.local_size() <= CUDNN_LRN_MAX_N
+        && lrn_param.beta() >= CUDNN_LRN_MIN_BETA
+        && lrn_param.k() >= CUDNN_LRN_MIN_K) {
+      return shared_ptr<Layer<Dtype> >(new CuDNNLRNLayer<Dtype>(param));
+    }
+    LOG(INFO) << "CUDNN does not support these LRN parameters. "
+              << "Using Caffe's own LRN layer.";
+#else
+    LOG(INFO) << "CUDNN supports LRN from version 3. "
+              << "Using Caffe's own LRN layer.";
+#endif
+    return shared_ptr<Layer<Dtype> >(new LRNLayer<Dtype>(param));
+#endif
+  } else {
+    LOG(FATAL) << "Layer " << param.name() << " has unknown engine.";
+  }
+}
+
+REGISTER_LAYER_CREATOR(LRN, GetLRNLayer);
+
 // Get relu layer according to engine.
 template <typename Dtype>
 shared_ptr<Layer<Dtype> > GetReLULayer(const LayerParameter& param) {
@@ -100,7 +213,9 @@ shared_ptr<Layer<Dtype> > GetSigmoidLayer(const LayerParameter& param) {
   if (engine == SigmoidParameter_Engine_DEFAULT) {
     engine = SigmoidParameter_Engine_CAFFE;
 #ifdef USE_CUDNN
-    engine = SigmoidParameter_Engine_CUDNN;
+    if (!param.approximate_math()) {
+      engine = SigmoidParameter_Engine_CUDNN;
+    }
 #endif
   }
   if (engine == SigmoidParameter_Engine_CAFFE) {
@@ -123,7 +238,9 @@ shared_ptr<Layer<Dtype> > GetSoftmaxLayer(const LayerParameter& param) {
   if (engine == SoftmaxParameter_Engine_DEFAULT) {
     engine = SoftmaxParameter_Engine_CAFFE;
 #ifdef USE_CUDNN
-    engine = SoftmaxParameter_Engine_CUDNN;
+    if (!param.approximate_math()) {
+      engine = SoftmaxParameter_Engine_CUDNN;
+    }
 #endif
   }
   if (engine == SoftmaxParameter_Engine_CAFFE) {
@@ -139,6 +256,41 @@ shared_ptr<Layer<Dtype> > GetSoftmaxLayer(const LayerParameter& param) {
 
 REGISTER_LAYER_CREATOR(Softmax, GetSoftmaxLayer);
 
+// Get batch normalization layer according to engine.
+template <typename Dtype>
+shared_ptr<Layer<Dtype> > GetBatchNormLayer(const LayerParameter& param) {
+  BatchNormParameter_Engine engine = param.batch_norm_param().engine();
+  if (engine == BatchNormParameter_Engine_DEFAULT) {
+    engine = BatchNormParameter_Engine_CAFFE;
+#ifdef USE_CUDNN
+    engine = BatchNormParameter_Engine_CUDNN;
+#endif
+  }
+  if (engine == BatchNormParameter_Engine_CAFFE) {
+    return shared_ptr<Layer<Dtype> >(new BatchNormLayer<Dtype>(param));
+#ifdef USE_CUDNN
+  } else if (engine == BatchNormParameter_Engine_CUDNN) {
+#if CUDNN_VERSION_MIN(5, 0, 0)
+    // Compared in float, the precision eps is given in
+    if (param.batch_norm_param().eps()
+        >= static_cast<float>(CUDNN_BN_MIN_EPSILON)) {
+      return shared_ptr<Layer<Dtype> >(new CuDNNBatchNormLayer<Dtype>(param));
+    }
+    LOG(INFO) << "CUDNN does not support an eps below "
+              << CUDNN_BN_MIN_EPSILON << ". Using Caffe's own BatchNorm layer.";
+#else
+    LOG(INFO) << "CUDNN supports BatchNorm from version 5. "
+              << "Using Caffe's own BatchNorm layer.";
+#endif
+    return shared_ptr<Layer<Dtype> >(new BatchNormLayer<Dtype>(param));
+#endif
+  } else {
+    LOG(FATAL) << "Layer " << param.name() << " has unknown engine.";
+  }
+}
+
+REGISTER_LAYER_CREATOR(BatchNorm, GetBatchNormLayer);
+
 // Get tanh layer according to engine.
 template <typename Dtype>
 shared_ptr<Layer<Dtype> > GetTanHLayer(const LayerParameter& param) {
@@ -146,7 +298,9 @@ shared_ptr<Layer<Dtype> > GetTanHLayer(const LayerParameter& param) {
   if (engine == TanHParameter_Engine_DEFAULT) {
     engine = TanHParameter_Engine_CAFFE;
 #ifdef USE_CUDNN
-    engine = TanHParameter_Engine_CUDNN;
+    if (!param.approximate_math()) {
+      engine = TanHParameter_Engine_CUDNN;
+    }
 #endif
   }
   if (engine == TanHParameter_Engine_CAFFE) {
@@ -162,14 +316,131 @@ shared_ptr<Layer<Dtype> > GetTanHLayer(const LayerParameter& param) {
 
 REGISTER_LAYER_CREATOR(TanH, GetTanHLayer);
 
+template <typename Dtype>
+vector<LayerParameter> EngineCandidates(const LayerParameter& param) {
+  vector<LayerParameter> candidates;
+  const string& type = param.type();
+  const bool gpu = Caffe::mode() == Caffe::GPU;
+  if ((type == "Convolution" || type == "Deconvolution")
+      && param.convolution_param().engine()
+      == ConvolutionParameter_Engine_AUTO) {
+    const ConvolutionParameter& conv_param = param.convolution_param();
+    vector<ConvolutionParameter_Engine> engines;
+    engines.push_back(ConvolutionParameter_Engine_CAFFE);
+    if (type == "Convolution" && !gpu) {
+      if (WinogradConvolutionLayer<Dtype>::IsSupported(conv_param)) {
+        engines.push_back(ConvolutionParameter_Engine_WINOGRAD);
+      }
+      if (DirectConvolutionLayer<Dtype>::IsSupported(conv_param)
+          && !param.has_quantization_param() && !param.has_sparsity_param()) {
+        engines.push_back(ConvolutionParameter_Engine_DIRECT);
+      }
+    }
+#ifdef USE_CUDNN
+    if (gpu && !(type == "Convolution" && param.has_sparsity_param())) {
+      engines.insert(engines.begin(), ConvolutionParameter_Engine_CUDNN);
+    }
+#endif
+    for (int i = 0; i < engines.size(); ++i) {
+      candidates.push_back(param);
+      candidates.back().mutable_convolution_param()->set_engine(engines[i]);
+    }
+  } else if (type == "Pooling"
+      && param.pooling_param().engine() == PoolingParameter_Engine_AUTO) {
+    candidates.push_back(param);
+    candidates.back().mutable_pooling_param()->set_engine(
+        PoolingParameter_Engine_CAFFE);
+#ifdef USE_CUDNN
+    const PoolingParameter& p_param = param.pooling_param();
+    if (gpu && !p_param.pad() && !p_param.pad_h() && !p_param.pad_w()
+        && param.top_size() <= 1) {
+      candidates.insert(candidates.begin(), param);
+      candidates.front().mutable_pooling_param()->set_engine(
+          PoolingParameter_Engine_CUDNN);
+    }
+#endif
+  }
+  return candidates;
+}
+
+template vector<LayerParameter> EngineCandidates<float>(
+    const LayerParameter& param);
+template vector<LayerParameter> EngineCandidates<double>(
+    const LayerParameter& param);
+
+// Engines timed are shared by the nets of all threads.
+struct EngineCache {
+  boost::mutex mutex;
+  std::map<string, int> engines;
+  string file;
+};
+static EngineCache engine_cache;
+
+bool GetCachedEngine(const string& key, int* engine) {
+  boost::mutex::scoped_lock lock(engine_cache.mutex);
+  std::map<string, int>::const_iterator it = engine_cache.engines.find(key);
+  if (it == engine_cache.engines.end()) {
+    return false;
+  }
+  *engine = it->second;
+  return true;
+}
+
+void CacheEngine(const string& key, int engine) {
+  boost::mutex::scoped_lock lock(engine_cache.mutex);
+  engine_cache.engines[key] = engine;
+  if (!engine_cache.file.empty()) {
+    std::ofstream file(engine_cache.file.c_str(), std::ios::app);
+    file << key << " " << engine << std::endl;
+    CHECK(file) << "Cannot write the engine cache " << engine_cache.file;
+  }
+}
+
+void SetEngineCacheFile(const string& path) {
+  boost::mutex::scoped_lock lock(engine_cache.mutex);
+  engine_cache.file = path;
+  // A missing file is created by the first engine timed.
+  std::ifstream file(path.c_str());
+  string key;
+  int engine;
+  while (file >> key >> engine) {
+    engine_cache.engines[key] = engine;
+  }
+  LOG(INFO) << "Read " << engine_cache.engines.size() << " engines from "
+            << path;
+}
+
 #ifdef WITH_PYTHON_LAYER
+// Drops the reference to the Python object of a layer holding the GIL, the
+// net being destroyed without it.
+template <typename Dtype>
+struct PythonLayerDeleter {
+  explicit PythonLayerDeleter(const shared_ptr<PythonLayer<Dtype> >& layer)
+      : layer_(layer) {}
+  void operator()(Layer<Dtype>*) {
+    ScopedGIL gil;
+    layer_.reset();
+  }
+  shared_ptr<PythonLayer<Dtype> > layer_;
+};
+
 template <typename Dtype>
 shared_ptr<Layer<Dtype> > GetPythonLayer(const LayerParameter& param) {
-  Py_Initialize();
+  if (!Py_IsInitialized()) {
+    // Embedded, as in the caffe tool: the threads running nets take the GIL
+    // in turn for their Python layers, the one initializing included
+    Py_Initialize();
+    PyEval_InitThreads();
+    PyEval_SaveThread();
+  }
+  ScopedGIL gil;
   try {
     bp::object module = bp::import(param.python_param().module().c_str());
     bp::object layer = module.attr(param.python_param().layer().c_str())(param);
-    return bp::extract<shared_ptr<PythonLayer<Dtype> > >(layer)();
+    shared_ptr<PythonLayer<Dtype> > python_layer =
+        bp::extract<shared_ptr<PythonLayer<Dtype> > >(layer)();
+    return shared_ptr<Layer<Dtype> >(python_layer.get(),
+        PythonLayerDeleter<Dtype>(python_layer));
   } catch (bp::error_already_set) {
     PyErr_Print();
     throw;
@@ -38,6 +38,8 @@ void AccuracyLayer<Dtype>::Reshape(
       << "with integer values in {0, 1, ..., C-1}.";
   vector<int> top_shape(0);  // Accuracy is a scalar; 0 axes.
   top[0]->Reshape(top_shape);
+  correct_.Reshape(vector<int>(1, outer_num_ * inner_num_));
+  counted_.Reshape(vector<int>(1, outer_num_ * inner_num_));
 }
 
 template <typename Dtype>
@@ -85,6 +87,10 @@ void AccuracyLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   // Accuracy layer should not be used as a loss function.
 }
 
+#ifdef CPU_ONLY
+STUB_GPU_FORWARD(AccuracyLayer, Forward);
+#endif
+
 INSTANTIATE_CLASS(AccuracyLayer);
 REGISTER_LAYER_CLASS(Accuracy);
 
@@ -0,0 +1,101 @@
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// A block per instance counts the labels ranked before the true one, in the
+// order of the partial sort of Forward_cpu: by score, then higher labels
+// first on ties.
+template <typename Dtype>
+__global__ void AccuracyForward(const int num_labels, const int inner_num,
+    const Dtype* data, const Dtype* label, const bool has_ignore_label,
+    const int ignore_label, const int top_k, Dtype* correct,
+    Dtype* counted) {
+  __shared__ int ranked[CAFFE_CUDA_NUM_THREADS];
+  const int index = blockIdx.x;
+  const int label_value = static_cast<int>(label[index]);
+  if (has_ignore_label && label_value == ignore_label) {
+    if (threadIdx.x == 0) {
+      correct[index] = 0;
+      counted[index] = 0;
+    }
+    return;
+  }
+  const int i = index / inner_num;
+  const int j = index % inner_num;
+  const Dtype* scores = data + i * num_labels * inner_num + j;
+  const Dtype label_score = scores[label_value * inner_num];
+  int count = 0;
+  for (int k = threadIdx.x; k < num_labels; k += blockDim.x) {
+    const Dtype score = scores[k * inner_num];
+    count += score > label_score || (score == label_score && k > label_value);
+  }
+  ranked[threadIdx.x] = count;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      ranked[threadIdx.x] += ranked[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    correct[index] = ranked[0] < top_k;
+    counted[index] = 1;
+  }
+}
+
+template <typename Dtype>
+__global__ void AccuracyReduce(const int n, const Dtype* correct,
+    const Dtype* counted, Dtype* accuracy) {
+  __shared__ Dtype corrects[CAFFE_CUDA_NUM_THREADS];
+  __shared__ Dtype counts[CAFFE_CUDA_NUM_THREADS];
+  Dtype correct_sum = 0;
+  Dtype count_sum = 0;
+  for (int i = threadIdx.x; i < n; i += blockDim.x) {
+    correct_sum += correct[i];
+    count_sum += counted[i];
+  }
+  corrects[threadIdx.x] = correct_sum;
+  counts[threadIdx.x] = count_sum;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      corrects[threadIdx.x] += corrects[threadIdx.x + s];
+      counts[threadIdx.x] += counts[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    *accuracy = corrects[0] / counts[0];
+  }
+}
+
+template <typename Dtype>
+void AccuracyLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const int num_labels = bottom[0]->shape(label_axis_);
+  const int count = outer_num_ * inner_num_;
+  // Enough threads for the labels, as a power of two for the reduction
+  int threads = 1;
+  while (threads < num_labels && threads < CAFFE_CUDA_NUM_THREADS) {
+    threads *= 2;
+  }
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  AccuracyForward<Dtype><<<count, threads, 0, Caffe::cuda_stream()>>>(
+      num_labels, inner_num_, bottom[0]->gpu_data(), bottom[1]->gpu_data(),
+      has_ignore_label_, ignore_label_, top_k_, correct_.mutable_gpu_data(),
+      counted_.mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  AccuracyReduce<Dtype><<<1, CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(count, correct_.gpu_data(), counted_.gpu_data(),
+      top[0]->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_LAYER_GPU_FORWARD(AccuracyLayer);
+
+}  // namespace caffe
@@ -0,0 +1,85 @@
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// A block per item picks its top_k values in turn, each the greatest below
+// the last picked, in the order of the partial sort of Forward_cpu: by
+// value, then higher indices first on ties.
+template <typename Dtype>
+__global__ void ArgMaxForward(const int dim, const int top_k,
+    const bool out_max_val, const Dtype* bottom_data, Dtype* top_data) {
+  __shared__ Dtype values[CAFFE_CUDA_NUM_THREADS];
+  __shared__ int indices[CAFFE_CUDA_NUM_THREADS];
+  const int n = blockIdx.x;
+  const Dtype* data = bottom_data + n * dim;
+  Dtype last_value = 0;
+  int last_index = -1;
+  for (int k = 0; k < top_k; ++k) {
+    Dtype best_value = 0;
+    int best_index = -1;
+    for (int j = threadIdx.x; j < dim; j += blockDim.x) {
+      const Dtype value = data[j];
+      if (last_index >= 0 && !(value < last_value
+          || (value == last_value && j < last_index))) {
+        continue;
+      }
+      if (best_index < 0 || value > best_value
+          || (value == best_value && j > best_index)) {
+        best_value = value;
+        best_index = j;
+      }
+    }
+    values[threadIdx.x] = best_value;
+    indices[threadIdx.x] = best_index;
+    __syncthreads();
+    for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+      if (threadIdx.x < s) {
+        const Dtype value = values[threadIdx.x + s];
+        const int index = indices[threadIdx.x + s];
+        const Dtype best = values[threadIdx.x];
+        const int best_index = indices[threadIdx.x];
+        if (index >= 0 && (best_index < 0 || value > best
+            || (value == best && index > best_index))) {
+          values[threadIdx.x] = value;
+          indices[threadIdx.x] = index;
+        }
+      }
+      __syncthreads();
+    }
+    last_value = values[0];
+    last_index = indices[0];
+    if (threadIdx.x == 0) {
+      const int channels = out_max_val ? 2 : 1;
+      top_data[n * channels * top_k + k] = last_index;
+      if (out_max_val) {
+        top_data[(n * channels + 1) * top_k + k] = last_value;
+      }
+    }
+    // All read the result before the next pick overwrites it
+    __syncthreads();
+  }
+}
+
+template <typename Dtype>
+void ArgMaxLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const int num = bottom[0]->num();
+  const int dim = bottom[0]->count() / num;
+  // Enough threads for the values, as a power of two for the reduction
+  int threads = 1;
+  while (threads < dim && threads < CAFFE_CUDA_NUM_THREADS) {
+    threads *= 2;
+  }
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  ArgMaxForward<Dtype><<<num, threads, 0, Caffe::cuda_stream()>>>(
+      dim, top_k_, out_max_val_, bottom[0]->gpu_data(),
+      top[0]->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_LAYER_GPU_FORWARD(ArgMaxLayer);
+
+}  // namespace caffe
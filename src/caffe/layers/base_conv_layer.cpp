@@ -1,3 +1,5 @@
+#include <boost/thread/tss.hpp>
+#include <algorithm>
 #include <vector>
 
 #include "caffe/filler.hpp"
@@ -8,6 +10,10 @@
 
 namespace caffe {
 
+// Most channels per group convolved by grouped_conv_cpu/gpu rather than by a
+// GEMM per group, whose few rows leave the BLAS mostly idle
+static const int kDirectGroupChannels = 4;
+
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
@@ -53,6 +59,24 @@ void BaseConvolutionLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   // and no padding, so flag for skipping the buffer and transformation.
   is_1x1_ = kernel_w_ == 1 && kernel_h_ == 1
       && stride_h_ == 1 && stride_w_ == 1 && pad_h_ == 0 && pad_w_ == 0;
+  images_per_gemm_ = conv_param.images_per_gemm();
+  CHECK_GT(images_per_gemm_, 0);
+  fused_relu_ = conv_param.has_fused_relu();
+  relu_slope_ = conv_param.fused_relu().negative_slope();
+  CHECK(!fused_relu_ || !reverse_dimensions())
+      << "fused_relu is only supported by Convolution";
+  quantized_ = this->layer_param_.has_quantization_param()
+      && this->phase_ == TEST;
+  CHECK(!quantized_ || !reverse_dimensions())
+      << "quantization_param is only supported by Convolution";
+  weight_int8_.clear();
+  sparse_weights_ = this->layer_param_.has_sparsity_param()
+      && this->phase_ == TEST;
+  CHECK(!sparse_weights_ || !reverse_dimensions())
+      << "sparsity_param is only supported by Convolution";
+  CHECK(!sparse_weights_ || !quantized_)
+      << "sparsity_param is not implemented with quantization_param";
+  weight_offsets_.Reshape(vector<int>(1, 0));
   // Configure output channels and groups.
   channels_ = bottom[0]->channels();
   num_output_ = this->layer_param_.convolution_param().num_output();
@@ -68,6 +92,8 @@ void BaseConvolutionLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     conv_out_channels_ = num_output_;
     conv_in_channels_ = channels_;
   }
+  direct_groups_ = group_ > 1
+      && conv_in_channels_ / group_ <= kDirectGroupChannels;
   // Handle the parameters: weights and biases.
   // - blobs_[0] holds the filter weights
   // - blobs_[1] holds the biases (optional)
@@ -120,10 +146,21 @@ void BaseConvolutionLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
     CHECK_EQ(width_, bottom[bottom_id]->width())
         << "Inputs must have same width.";
   }
+  const Layout layout = bottom[0]->layout();
+  for (int bottom_id = 1; bottom_id < bottom.size(); ++bottom_id) {
+    CHECK_EQ(layout, bottom[bottom_id]->layout())
+        << "Inputs must have the same layout.";
+  }
+  if (layout == NHWC) {
+    CHECK_EQ(group_, 1) << "NHWC inputs are only convolved with group 1";
+    CHECK(!quantized_ && !sparse_weights_) << "NHWC inputs are not "
+        << "convolved with quantization_param or sparsity_param";
+  }
   // Shape the tops.
   compute_output_shape();
   for (int top_id = 0; top_id < top.size(); ++top_id) {
     top[top_id]->Reshape(num_, num_output_, height_out_, width_out_);
+    top[top_id]->set_layout(layout);
   }
   if (reverse_dimensions()) {
     conv_in_height_ = height_out_;
@@ -139,13 +176,20 @@ void BaseConvolutionLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   col_offset_ = kernel_dim_ * conv_out_spatial_dim_ / group_;
   output_offset_ = conv_out_channels_ * conv_out_spatial_dim_ / group_;
   // The im2col result buffer will only hold one image at a time to avoid
-  // overly large memory usage. In the special case of 1x1 convolution
-  // it goes lazily unused to save memory.
+  // overly large memory usage, and its memory is shared with the other
+  // convolutions (see share_col_buffer). In the special case of 1x1
+  // convolution it goes lazily unused to save memory.
   if (reverse_dimensions()) {
     col_buffer_.Reshape(1, kernel_dim_, height_, width_);
   } else {
     col_buffer_.Reshape(1, kernel_dim_, height_out_, width_out_);
   }
+  const int images = std::min(images_per_gemm_, num_);
+  if (images > 1 && !reverse_dimensions() && !direct_groups_) {
+    batch_col_buffer_.Reshape(1, kernel_dim_, images, conv_out_spatial_dim_);
+    batch_output_buffer_.Reshape(1, conv_out_channels_, images,
+        conv_out_spatial_dim_);
+  }
   // Set up the all ones "bias multiplier" for adding biases by BLAS
   if (bias_term_) {
     vector<int> bias_multiplier_shape(1, height_out_ * width_out_);
@@ -155,17 +199,62 @@ void BaseConvolutionLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   }
 }
 
+// Per thread, as solvers of a parallel run each have their own
+template <typename Dtype>
+static shared_ptr<SyncedMemory>& col_workspace() {
+  static boost::thread_specific_ptr<shared_ptr<SyncedMemory> > workspace;
+  if (!workspace.get()) {
+    workspace.reset(new shared_ptr<SyncedMemory>());
+  }
+  return *workspace;
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::share_col_buffer() {
+  shared_ptr<SyncedMemory>& workspace = col_workspace<Dtype>();
+  const size_t size = col_buffer_.count() * sizeof(Dtype);
+  if (!workspace || workspace->size() < size) {
+    workspace.reset(new SyncedMemory(size));
+  }
+  if (col_buffer_.data() != workspace) {
+    col_buffer_.SetDataStorage(workspace);
+  }
+}
+
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::forward_cpu_gemm(const Dtype* input,
     const Dtype* weights, Dtype* output, bool skip_im2col) {
+  if (direct_groups_) {
+    conv_grouped_cpu(input, weights, output);
+    return;
+  }
   const Dtype* col_buff = input;
   if (!is_1x1_) {
+    share_col_buffer();
     if (!skip_im2col) {
       conv_im2col_cpu(input, col_buffer_.mutable_cpu_data());
     }
     col_buff = col_buffer_.cpu_data();
   }
+  // At TEST, the weights of each group are packed by the first forward, and
+  // again once changed.
+  const bool packed = this->phase_ == TEST
+      && weights == this->blobs_[0]->cpu_data();
+  if (packed && packed_weights_.size() != group_) {
+    packed_weights_.resize(group_);
+    for (int g = 0; g < group_; ++g) {
+      packed_weights_[g].reset(new PackedGemm<Dtype>());
+    }
+  }
   for (int g = 0; g < group_; ++g) {
+    if (packed) {
+      packed_weights_[g]->Pack(true, CblasNoTrans, conv_out_channels_ /
+          group_, conv_out_spatial_dim_, kernel_dim_ / group_,
+          weights + weight_offset_ * g, this->blobs_[0]->data().get());
+      packed_weights_[g]->Gemm(CblasNoTrans, col_buff + col_offset_ * g,
+          (Dtype)0., output + output_offset_ * g);
+      continue;
+    }
     caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, conv_out_channels_ /
         group_, conv_out_spatial_dim_, kernel_dim_ / group_,
         (Dtype)1., weights + weight_offset_ * g, col_buff + col_offset_ * g,
@@ -173,37 +262,190 @@ void BaseConvolutionLayer<Dtype>::forward_cpu_gemm(const Dtype* input,
   }
 }
 
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::forward_cpu_gemm_int8(const Dtype* input,
+    const Dtype* weights, Dtype* output) {
+  const int out_channels = conv_out_channels_ / group_;
+  const int spatial_dim = conv_out_spatial_dim_;
+  const int group_kernel_dim = kernel_dim_ / group_;
+  // The weights are quantized by the first forward and kept from then on.
+  if (weight_int8_.empty()) {
+    weight_int8_.resize(conv_out_channels_ * group_kernel_dim);
+    weight_scale_.resize(conv_out_channels_);
+    caffe_cpu_quantize_rows(conv_out_channels_, group_kernel_dim, weights,
+        &weight_scale_[0], &weight_int8_[0]);
+  }
+  const Dtype* col_buff = input;
+  if (!is_1x1_) {
+    share_col_buffer();
+    conv_im2col_cpu(input, col_buffer_.mutable_cpu_data());
+    col_buff = col_buffer_.cpu_data();
+  }
+  const QuantizationParameter& param = this->layer_param_.quantization_param();
+  const Dtype input_scale = param.has_input_scale() ? param.input_scale()
+      : caffe_cpu_amax(kernel_dim_ * spatial_dim, col_buff) / Dtype(127);
+  // Each group's quantized columns are transposed, to spatial_dim rows of
+  // its kernel dimension, for the products to run along contiguous rows.
+  col_int8_.resize(kernel_dim_ * spatial_dim);
+  row_int8_.resize(col_offset_);
+  output_int32_.resize(out_channels * spatial_dim);
+  caffe_cpu_quantize(kernel_dim_ * spatial_dim, input_scale, col_buff,
+      &col_int8_[0]);
+  for (int g = 0; g < group_; ++g) {
+    const int8_t* col_int8 = &col_int8_[0] + col_offset_ * g;
+    for (int k = 0; k < group_kernel_dim; ++k) {
+      for (int s = 0; s < spatial_dim; ++s) {
+        row_int8_[s * group_kernel_dim + k] = col_int8[k * spatial_dim + s];
+      }
+    }
+    caffe_cpu_gemm_int8(out_channels, spatial_dim, group_kernel_dim,
+        &weight_int8_[0] + weight_offset_ * g, &row_int8_[0],
+        &output_int32_[0]);
+    for (int o = 0; o < out_channels; ++o) {
+      const Dtype scale = input_scale * weight_scale_[g * out_channels + o];
+      Dtype* out = output + output_offset_ * g + o * spatial_dim;
+      for (int s = 0; s < spatial_dim; ++s) {
+        out[s] = output_int32_[o * spatial_dim + s] * scale;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+bool BaseConvolutionLayer<Dtype>::compress_weights() {
+  if (!sparse_weights_ || weight_offsets_.count() > 0) {
+    return sparse_weights_;
+  }
+  const int group_kernel_dim = kernel_dim_ / group_;
+  const Dtype* weights = this->blobs_[0]->cpu_data();
+  weight_offsets_.Reshape(vector<int>(1, conv_out_channels_ + 1));
+  int* offsets = weight_offsets_.mutable_cpu_data();
+  caffe_cpu_csr_offsets(conv_out_channels_, group_kernel_dim, weights,
+      offsets);
+  const int nonzeros = offsets[conv_out_channels_];
+  const float sparsity = 1 - static_cast<float>(nonzeros)
+      / (conv_out_channels_ * group_kernel_dim);
+  if (sparsity < this->layer_param_.sparsity_param().min_sparsity()) {
+    LOG(INFO) << this->layer_param_.name() << " runs dense, with only "
+              << sparsity << " of its weights zero";
+    sparse_weights_ = false;
+    return false;
+  }
+  const vector<int> shape(1, std::max(nonzeros, 1));
+  weight_values_.Reshape(shape);
+  weight_columns_.Reshape(shape);
+  caffe_cpu_csr(conv_out_channels_, group_kernel_dim, weights,
+      weight_values_.mutable_cpu_data(), weight_columns_.mutable_cpu_data());
+  return true;
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::forward_cpu_gemm_sparse(const Dtype* input,
+    Dtype* output) {
+  const Dtype* col_buff = input;
+  if (!is_1x1_) {
+    share_col_buffer();
+    conv_im2col_cpu(input, col_buffer_.mutable_cpu_data());
+    col_buff = col_buffer_.cpu_data();
+  }
+  // The offsets of a group's outputs index into all the nonzeros.
+  const int out_channels = conv_out_channels_ / group_;
+  for (int g = 0; g < group_; ++g) {
+    caffe_cpu_csrmm(out_channels, conv_out_spatial_dim_,
+        weight_values_.cpu_data(), weight_columns_.cpu_data(),
+        weight_offsets_.cpu_data() + out_channels * g,
+        col_buff + col_offset_ * g, output + output_offset_ * g);
+  }
+}
+
+// Copies a rows x cols matrix between buffers of different row strides
+template <typename Dtype>
+static void copy_rows_cpu(const int rows, const int cols, const Dtype* src,
+    const int src_stride, Dtype* dst, const int dst_stride) {
+  for (int r = 0; r < rows; ++r) {
+    caffe_copy(cols, src + r * src_stride, dst + r * dst_stride);
+  }
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::forward_cpu_gemm_batch(const Dtype* input,
+    const int images, const Dtype* weights, Dtype* output) {
+  const int spatial_dim = conv_out_spatial_dim_;
+  const int width = images * spatial_dim;
+  const int input_dim = conv_in_channels_ * conv_in_height_ * conv_in_width_;
+  const int output_dim = conv_out_channels_ * spatial_dim;
+  Dtype* cols = batch_col_buffer_.mutable_cpu_data();
+  for (int n = 0; n < images; ++n) {
+    const Dtype* col_buff = input + n * input_dim;
+    if (!is_1x1_) {
+      share_col_buffer();
+      conv_im2col_cpu(col_buff, col_buffer_.mutable_cpu_data());
+      col_buff = col_buffer_.cpu_data();
+    }
+    copy_rows_cpu(kernel_dim_, spatial_dim, col_buff, spatial_dim,
+        cols + n * spatial_dim, width);
+  }
+  Dtype* outputs = batch_output_buffer_.mutable_cpu_data();
+  for (int g = 0; g < group_; ++g) {
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, conv_out_channels_ /
+        group_, width, kernel_dim_ / group_,
+        (Dtype)1., weights + weight_offset_ * g,
+        cols + kernel_dim_ / group_ * width * g,
+        (Dtype)0., outputs + conv_out_channels_ / group_ * width * g);
+  }
+  for (int n = 0; n < images; ++n) {
+    copy_rows_cpu(conv_out_channels_, spatial_dim, outputs + n * spatial_dim,
+        width, output + n * output_dim, spatial_dim);
+  }
+}
+
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::forward_cpu_bias(Dtype* output,
     const Dtype* bias) {
+  const int spatial_dim = height_out_ * width_out_;
+  if (fused_relu_) {
+    caffe_cpu_bias_relu(num_output_ * spatial_dim, num_output_, spatial_dim,
+        bias, relu_slope_, output);
+    return;
+  }
   caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num_output_,
-      height_out_ * width_out_, 1, (Dtype)1., bias, bias_multiplier_.cpu_data(),
+      spatial_dim, 1, (Dtype)1., bias, bias_multiplier_.cpu_data(),
       (Dtype)1., output);
 }
 
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::backward_cpu_gemm(const Dtype* output,
-    const Dtype* weights, Dtype* input) {
-  Dtype* col_buff = col_buffer_.mutable_cpu_data();
-  if (is_1x1_) {
-    col_buff = input;
+    const Dtype* weights, Dtype* input, bool accumulate) {
+  if (direct_groups_) {
+    conv_grouped_data_cpu(output, weights, input, accumulate);
+    return;
+  }
+  Dtype* col_buff = input;
+  if (!is_1x1_) {
+    share_col_buffer();
+    col_buff = col_buffer_.mutable_cpu_data();
   }
   for (int g = 0; g < group_; ++g) {
     caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, kernel_dim_ / group_,
         conv_out_spatial_dim_, conv_out_channels_ / group_,
         (Dtype)1., weights + weight_offset_ * g, output + output_offset_ * g,
-        (Dtype)0., col_buff + col_offset_ * g);
+        (Dtype)(accumulate && is_1x1_), col_buff + col_offset_ * g);
   }
   if (!is_1x1_) {
-    conv_col2im_cpu(col_buff, input);
+    conv_col2im_cpu(col_buff, input, accumulate);
   }
 }
 
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::weight_cpu_gemm(const Dtype* input,
     const Dtype* output, Dtype* weights) {
+  if (direct_groups_) {
+    conv_grouped_weights_cpu(input, output, weights);
+    return;
+  }
   const Dtype* col_buff = input;
   if (!is_1x1_) {
+    share_col_buffer();
     conv_im2col_cpu(input, col_buffer_.mutable_cpu_data());
     col_buff = col_buffer_.cpu_data();
   }
@@ -222,13 +464,135 @@ void BaseConvolutionLayer<Dtype>::backward_cpu_bias(Dtype* bias,
       input, bias_multiplier_.cpu_data(), 1., bias);
 }
 
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::backward_cpu_relu(Blob<Dtype>* top) {
+  if (fused_relu_) {
+    caffe_cpu_relu_backward(top->count(), top->cpu_data(), relu_slope_,
+        top->mutable_cpu_diff());
+  }
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::forward_cpu_nhwc(const Dtype* input,
+    Dtype* output) {
+  const int spatial_dim = conv_out_spatial_dim_;
+  const int input_dim = conv_in_channels_ * conv_in_height_ * conv_in_width_;
+  const int output_dim = conv_out_channels_ * spatial_dim;
+  weight_nhwc_.ReshapeLike(*this->blobs_[0]);
+  caffe_cpu_transpose(conv_out_channels_, conv_in_channels_,
+      kernel_h_ * kernel_w_, this->blobs_[0]->cpu_data(),
+      weight_nhwc_.mutable_cpu_data());
+  const Dtype* weights = weight_nhwc_.cpu_data();
+  if (is_1x1_) {
+    // The pixels of all the images are the rows of one product
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, num_ * spatial_dim,
+        conv_out_channels_, kernel_dim_, (Dtype)1., input, weights,
+        (Dtype)0., output);
+  } else {
+    share_col_buffer();
+    for (int n = 0; n < num_; ++n) {
+      im2col_nhwc_cpu(input + n * input_dim, conv_in_channels_,
+          conv_in_height_, conv_in_width_, kernel_h_, kernel_w_, pad_h_,
+          pad_w_, stride_h_, stride_w_, col_buffer_.mutable_cpu_data());
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, spatial_dim,
+          conv_out_channels_, kernel_dim_, (Dtype)1., col_buffer_.cpu_data(),
+          weights, (Dtype)0., output + n * output_dim);
+    }
+  }
+  const Dtype* bias = bias_term_ ? this->blobs_[1]->cpu_data() : NULL;
+  if (fused_relu_) {
+    // The bias of each value is that of its channel, the innermost axis
+    caffe_cpu_bias_relu(num_ * output_dim, num_output_, 1, bias, relu_slope_,
+        output);
+  } else if (bias_term_) {
+    for (int n = 0; n < num_; ++n) {
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, spatial_dim,
+          num_output_, 1, (Dtype)1., bias_multiplier_.cpu_data(), bias,
+          (Dtype)1., output + n * output_dim);
+    }
+  }
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::backward_cpu_nhwc(const Dtype* output,
+    const Dtype* input, Dtype* input_diff, bool accumulate) {
+  const int spatial_dim = conv_out_spatial_dim_;
+  const int input_dim = conv_in_channels_ * conv_in_height_ * conv_in_width_;
+  const int output_dim = conv_out_channels_ * spatial_dim;
+  if (bias_term_ && this->param_propagate_down_[1]) {
+    Dtype* bias_diff = this->blobs_[1]->mutable_cpu_diff();
+    for (int n = 0; n < num_; ++n) {
+      caffe_cpu_gemv<Dtype>(CblasTrans, spatial_dim, num_output_, 1.,
+          output + n * output_dim, bias_multiplier_.cpu_data(), 1.,
+          bias_diff);
+    }
+  }
+  const bool weight_grad = this->param_propagate_down_[0];
+  if (!weight_grad && !input_diff) {
+    return;
+  }
+  weight_nhwc_.ReshapeLike(*this->blobs_[0]);
+  caffe_cpu_transpose(conv_out_channels_, conv_in_channels_,
+      kernel_h_ * kernel_w_, this->blobs_[0]->cpu_data(),
+      weight_nhwc_.mutable_cpu_data());
+  if (weight_grad) {
+    caffe_set(weight_nhwc_.count(), Dtype(0),
+        weight_nhwc_.mutable_cpu_diff());
+  }
+  if (!is_1x1_) {
+    share_col_buffer();
+  }
+  for (int n = 0; n < num_; ++n) {
+    // gradient w.r.t. weight, in the order of the columns
+    if (weight_grad) {
+      const Dtype* col_buff = input + n * input_dim;
+      if (!is_1x1_) {
+        im2col_nhwc_cpu(col_buff, conv_in_channels_, conv_in_height_,
+            conv_in_width_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_,
+            stride_w_, col_buffer_.mutable_cpu_data());
+        col_buff = col_buffer_.cpu_data();
+      }
+      caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, conv_out_channels_,
+          kernel_dim_, spatial_dim, (Dtype)1., output + n * output_dim,
+          col_buff, (Dtype)1., weight_nhwc_.mutable_cpu_diff());
+    }
+    // gradient w.r.t. bottom data, if necessary.
+    if (input_diff) {
+      Dtype* col_buff = is_1x1_ ? input_diff + n * input_dim :
+          col_buffer_.mutable_cpu_data();
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, spatial_dim,
+          kernel_dim_, conv_out_channels_, (Dtype)1., output + n * output_dim,
+          weight_nhwc_.cpu_data(), (Dtype)(accumulate && is_1x1_), col_buff);
+      if (!is_1x1_) {
+        col2im_nhwc_cpu(col_buff, conv_in_channels_, conv_in_height_,
+            conv_in_width_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_,
+            stride_w_, input_diff + n * input_dim, accumulate);
+      }
+    }
+  }
+  if (weight_grad) {
+    // Back to the order of the weights, through the reordered weights no
+    // longer needed
+    caffe_cpu_transpose(conv_out_channels_, kernel_h_ * kernel_w_,
+        conv_in_channels_, weight_nhwc_.cpu_diff(),
+        weight_nhwc_.mutable_cpu_data());
+    caffe_axpy(weight_nhwc_.count(), Dtype(1), weight_nhwc_.cpu_data(),
+        this->blobs_[0]->mutable_cpu_diff());
+  }
+}
+
 #ifndef CPU_ONLY
 
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::forward_gpu_gemm(const Dtype* input,
     const Dtype* weights, Dtype* output, bool skip_im2col) {
+  if (direct_groups_) {
+    conv_grouped_gpu(input, weights, output);
+    return;
+  }
   const Dtype* col_buff = input;
   if (!is_1x1_) {
+    share_col_buffer();
     if (!skip_im2col) {
       conv_im2col_gpu(input, col_buffer_.mutable_gpu_data());
     }
@@ -242,37 +606,111 @@ void BaseConvolutionLayer<Dtype>::forward_gpu_gemm(const Dtype* input,
   }
 }
 
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::forward_gpu_gemm_sparse(const Dtype* input,
+    Dtype* output) {
+  const Dtype* col_buff = input;
+  if (!is_1x1_) {
+    share_col_buffer();
+    conv_im2col_gpu(input, col_buffer_.mutable_gpu_data());
+    col_buff = col_buffer_.gpu_data();
+  }
+  const int out_channels = conv_out_channels_ / group_;
+  for (int g = 0; g < group_; ++g) {
+    caffe_gpu_csrmm(out_channels, conv_out_spatial_dim_,
+        weight_values_.gpu_data(), weight_columns_.gpu_data(),
+        weight_offsets_.gpu_data() + out_channels * g,
+        col_buff + col_offset_ * g, output + output_offset_ * g);
+  }
+}
+
+template <typename Dtype>
+static void copy_rows_gpu(const int rows, const int cols, const Dtype* src,
+    const int src_stride, Dtype* dst, const int dst_stride) {
+  CUDA_CHECK(cudaMemcpy2D(dst, dst_stride * sizeof(Dtype), src,
+      src_stride * sizeof(Dtype), cols * sizeof(Dtype), rows,
+      cudaMemcpyDeviceToDevice));
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::forward_gpu_gemm_batch(const Dtype* input,
+    const int images, const Dtype* weights, Dtype* output) {
+  const int spatial_dim = conv_out_spatial_dim_;
+  const int width = images * spatial_dim;
+  const int input_dim = conv_in_channels_ * conv_in_height_ * conv_in_width_;
+  const int output_dim = conv_out_channels_ * spatial_dim;
+  Dtype* cols = batch_col_buffer_.mutable_gpu_data();
+  for (int n = 0; n < images; ++n) {
+    const Dtype* col_buff = input + n * input_dim;
+    if (!is_1x1_) {
+      share_col_buffer();
+      conv_im2col_gpu(col_buff, col_buffer_.mutable_gpu_data());
+      col_buff = col_buffer_.gpu_data();
+    }
+    copy_rows_gpu(kernel_dim_, spatial_dim, col_buff, spatial_dim,
+        cols + n * spatial_dim, width);
+  }
+  Dtype* outputs = batch_output_buffer_.mutable_gpu_data();
+  for (int g = 0; g < group_; ++g) {
+    caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, conv_out_channels_ /
+        group_, width, kernel_dim_ / group_,
+        (Dtype)1., weights + weight_offset_ * g,
+        cols + kernel_dim_ / group_ * width * g,
+        (Dtype)0., outputs + conv_out_channels_ / group_ * width * g);
+  }
+  for (int n = 0; n < images; ++n) {
+    copy_rows_gpu(conv_out_channels_, spatial_dim, outputs + n * spatial_dim,
+        width, output + n * output_dim, spatial_dim);
+  }
+}
+
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::forward_gpu_bias(Dtype* output,
     const Dtype* bias) {
+  const int spatial_dim = height_out_ * width_out_;
+  if (fused_relu_) {
+    caffe_gpu_bias_relu(num_output_ * spatial_dim, num_output_, spatial_dim,
+        bias, relu_slope_, output);
+    return;
+  }
   caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num_output_,
-      height_out_ * width_out_, 1, (Dtype)1., bias, bias_multiplier_.gpu_data(),
+      spatial_dim, 1, (Dtype)1., bias, bias_multiplier_.gpu_data(),
       (Dtype)1., output);
 }
 
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::backward_gpu_gemm(const Dtype* output,
-    const Dtype* weights, Dtype* input) {
-  Dtype* col_buff = col_buffer_.mutable_gpu_data();
-  if (is_1x1_) {
-    col_buff = input;
+    const Dtype* weights, Dtype* input, bool accumulate) {
+  if (direct_groups_) {
+    conv_grouped_data_gpu(output, weights, input, accumulate);
+    return;
+  }
+  Dtype* col_buff = input;
+  if (!is_1x1_) {
+    share_col_buffer();
+    col_buff = col_buffer_.mutable_gpu_data();
   }
   for (int g = 0; g < group_; ++g) {
     caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, kernel_dim_ / group_,
         conv_out_spatial_dim_, conv_out_channels_ / group_,
         (Dtype)1., weights + weight_offset_ * g, output + output_offset_ * g,
-        (Dtype)0., col_buff + col_offset_ * g);
+        (Dtype)(accumulate && is_1x1_), col_buff + col_offset_ * g);
   }
   if (!is_1x1_) {
-    conv_col2im_gpu(col_buff, input);
+    conv_col2im_gpu(col_buff, input, accumulate);
   }
 }
 
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::weight_gpu_gemm(const Dtype* input,
     const Dtype* output, Dtype* weights) {
+  if (direct_groups_) {
+    conv_grouped_weights_gpu(input, output, weights);
+    return;
+  }
   const Dtype* col_buff = input;
   if (!is_1x1_) {
+    share_col_buffer();
     conv_im2col_gpu(input, col_buffer_.mutable_gpu_data());
     col_buff = col_buffer_.gpu_data();
   }
@@ -291,6 +729,117 @@ void BaseConvolutionLayer<Dtype>::backward_gpu_bias(Dtype* bias,
       input, bias_multiplier_.gpu_data(), 1., bias);
 }
 
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::backward_gpu_relu(Blob<Dtype>* top) {
+  if (fused_relu_) {
+    caffe_gpu_relu_backward(top->count(), top->gpu_data(), relu_slope_,
+        top->mutable_gpu_diff());
+  }
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::forward_gpu_nhwc(const Dtype* input,
+    Dtype* output) {
+  const int spatial_dim = conv_out_spatial_dim_;
+  const int input_dim = conv_in_channels_ * conv_in_height_ * conv_in_width_;
+  const int output_dim = conv_out_channels_ * spatial_dim;
+  weight_nhwc_.ReshapeLike(*this->blobs_[0]);
+  caffe_gpu_transpose(conv_out_channels_, conv_in_channels_,
+      kernel_h_ * kernel_w_, this->blobs_[0]->gpu_data(),
+      weight_nhwc_.mutable_gpu_data());
+  const Dtype* weights = weight_nhwc_.gpu_data();
+  if (is_1x1_) {
+    caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, num_ * spatial_dim,
+        conv_out_channels_, kernel_dim_, (Dtype)1., input, weights,
+        (Dtype)0., output);
+  } else {
+    share_col_buffer();
+    for (int n = 0; n < num_; ++n) {
+      im2col_nhwc_gpu(input + n * input_dim, conv_in_channels_,
+          conv_in_height_, conv_in_width_, kernel_h_, kernel_w_, pad_h_,
+          pad_w_, stride_h_, stride_w_, col_buffer_.mutable_gpu_data());
+      caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, spatial_dim,
+          conv_out_channels_, kernel_dim_, (Dtype)1., col_buffer_.gpu_data(),
+          weights, (Dtype)0., output + n * output_dim);
+    }
+  }
+  const Dtype* bias = bias_term_ ? this->blobs_[1]->gpu_data() : NULL;
+  if (fused_relu_) {
+    caffe_gpu_bias_relu(num_ * output_dim, num_output_, 1, bias, relu_slope_,
+        output);
+  } else if (bias_term_) {
+    for (int n = 0; n < num_; ++n) {
+      caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, spatial_dim,
+          num_output_, 1, (Dtype)1., bias_multiplier_.gpu_data(), bias,
+          (Dtype)1., output + n * output_dim);
+    }
+  }
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::backward_gpu_nhwc(const Dtype* output,
+    const Dtype* input, Dtype* input_diff, bool accumulate) {
+  const int spatial_dim = conv_out_spatial_dim_;
+  const int input_dim = conv_in_channels_ * conv_in_height_ * conv_in_width_;
+  const int output_dim = conv_out_channels_ * spatial_dim;
+  if (bias_term_ && this->param_propagate_down_[1]) {
+    Dtype* bias_diff = this->blobs_[1]->mutable_gpu_diff();
+    for (int n = 0; n < num_; ++n) {
+      caffe_gpu_gemv<Dtype>(CblasTrans, spatial_dim, num_output_, 1.,
+          output + n * output_dim, bias_multiplier_.gpu_data(), 1.,
+          bias_diff);
+    }
+  }
+  const bool weight_grad = this->param_propagate_down_[0];
+  if (!weight_grad && !input_diff) {
+    return;
+  }
+  weight_nhwc_.ReshapeLike(*this->blobs_[0]);
+  caffe_gpu_transpose(conv_out_channels_, conv_in_channels_,
+      kernel_h_ * kernel_w_, this->blobs_[0]->gpu_data(),
+      weight_nhwc_.mutable_gpu_data());
+  if (weight_grad) {
+    caffe_gpu_set(weight_nhwc_.count(), Dtype(0),
+        weight_nhwc_.mutable_gpu_diff());
+  }
+  if (!is_1x1_) {
+    share_col_buffer();
+  }
+  for (int n = 0; n < num_; ++n) {
+    if (weight_grad) {
+      const Dtype* col_buff = input + n * input_dim;
+      if (!is_1x1_) {
+        im2col_nhwc_gpu(col_buff, conv_in_channels_, conv_in_height_,
+            conv_in_width_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_,
+            stride_w_, col_buffer_.mutable_gpu_data());
+        col_buff = col_buffer_.gpu_data();
+      }
+      caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, conv_out_channels_,
+          kernel_dim_, spatial_dim, (Dtype)1., output + n * output_dim,
+          col_buff, (Dtype)1., weight_nhwc_.mutable_gpu_diff());
+    }
+    if (input_diff) {
+      Dtype* col_buff = is_1x1_ ? input_diff + n * input_dim :
+          col_buffer_.mutable_gpu_data();
+      caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, spatial_dim,
+          kernel_dim_, conv_out_channels_, (Dtype)1., output + n * output_dim,
+          weight_nhwc_.gpu_data(), (Dtype)(accumulate && is_1x1_), col_buff);
+      if (!is_1x1_) {
+        col2im_nhwc_gpu(col_buff, conv_in_channels_, conv_in_height_,
+            conv_in_width_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_,
+            stride_w_, input_diff + n * input_dim, accumulate);
+      }
+    }
+  }
+  if (weight_grad) {
+    caffe_gpu_transpose(conv_out_channels_, kernel_h_ * kernel_w_,
+        conv_in_channels_, weight_nhwc_.gpu_diff(),
+        weight_nhwc_.mutable_gpu_data());
+    caffe_gpu_axpy(weight_nhwc_.count(), Dtype(1), weight_nhwc_.gpu_data(),
+        this->blobs_[0]->mutable_gpu_diff());
+  }
+}
+
 #endif  // !CPU_ONLY
 
 INSTANTIATE_CLASS(BaseConvolutionLayer);
@@ -1,10 +1,15 @@
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
+#include <map>
 #include <string>
 #include <vector>
 
 #include "caffe/data_layers.hpp"
 #include "caffe/net.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/executor.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/nvtx.hpp"
 
 namespace caffe {
 
@@ -29,81 +34,426 @@ void BaseDataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   DataLayerSetUp(bottom, top);
 }
 
+template <typename Dtype>
+class BasePrefetchingDataLayer<Dtype>::sync {
+ public:
+  explicit sync(int loaders)
+      : tickets_(loaders), reading_(), next_ticket_(), next_push_(),
+        tasks_(), stopping_() {}
+#ifndef CPU_ONLY
+  ~sync() {
+    for (int i = 0; i < streams_.size(); ++i) {
+      CUDA_CHECK(cudaStreamDestroy(streams_[i]));
+    }
+  }
+
+  // The stream each loader pushes its batches to the GPU on
+  vector<cudaStream_t> streams_;
+#endif
+
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  // The batch each loader is filling, in the order of reads
+  vector<unsigned int> tickets_;
+  bool reading_;
+  unsigned int next_ticket_;
+  unsigned int next_push_;
+  // Batches shared by the tops of each net using the layer
+  std::map<const Blob<Dtype>*, Batch<Dtype>*> held_;
+  // The next micro-batch of the batch held by each top
+  std::map<const Blob<Dtype>*, int> micro_batches_;
+  // With an executor, the loaders not running a task, and the tasks running
+  vector<int> free_loaders_;
+  int tasks_;
+  bool stopping_;
+};
+
+// Runs the loaders after the first, which runs on the thread of the layer
+template <typename Dtype>
+class BasePrefetchingDataLayer<Dtype>::Loader : public InternalThread {
+ public:
+  Loader(BasePrefetchingDataLayer<Dtype>* layer, int index)
+      : layer_(layer), index_(index) {
+    StartInternalThread();
+  }
+  virtual ~Loader() {
+    StopInternalThread();
+  }
+
+ protected:
+  virtual void InternalThreadEntry() {
+    layer_->load_loop(index_);
+  }
+
+  BasePrefetchingDataLayer<Dtype>* layer_;
+  const int index_;
+};
+
 template <typename Dtype>
 BasePrefetchingDataLayer<Dtype>::BasePrefetchingDataLayer(
     const LayerParameter& param)
     : BaseDataLayer<Dtype>(param),
-      prefetch_free_(), prefetch_full_() {
-  for (int i = 0; i < PREFETCH_COUNT; ++i) {
-    prefetch_free_.push(&prefetch_[i]);
+      prefetch_(param.data_param().prefetch()),
+      prefetch_free_(), prefetch_full_(), gpu_transform_(false),
+      gpu_decode_(false),
+      loader_count_(param.data_param().loader_threads()),
+      ordered_loading_(param.data_param().ordered_loading()),
+      micro_batches_(param.data_param().micro_batches()),
+      sync_(new sync(loader_count_)), executor_() {
+  CHECK_GT(prefetch_.size(), 0) << "Prefetch at least one batch";
+  CHECK_GT(loader_count_, 0) << "Use at least one loader thread";
+  CHECK_GT(micro_batches_, 0) << "Split batches in at least one micro-batch";
+  for (int i = 0; i < prefetch_.size(); ++i) {
+    prefetch_[i].reset(new Batch<Dtype>());
+    prefetch_free_.push(prefetch_[i].get());
   }
 }
 
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::LayerSetUp(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  gpu_transform_ = this->transform_param_.gpu_transform() &&
+      Caffe::mode() == Caffe::GPU;
+  gpu_decode_ = gpu_transform_ && this->transform_param_.gpu_decode();
+#ifdef USE_NVJPEG
+  if (gpu_decode_) {
+    for (int i = 0; i < loader_count_; ++i) {
+      decoders_.push_back(shared_ptr<JPEGDecoder>(new JPEGDecoder()));
+    }
+  }
+#else
+  if (gpu_decode_) {
+    LOG(INFO) << "Ignoring gpu_decode, as Caffe is built without nvJPEG";
+    gpu_decode_ = false;
+  }
+#endif
   BaseDataLayer<Dtype>::LayerSetUp(bottom, top);
+  if (micro_batches_ > 1) {
+    CHECK(!gpu_transform_) << "micro_batches does not support gpu_transform";
+    for (int i = 0; i < top.size(); ++i) {
+      ReshapeMicroBatch(*top[i], top[i]);
+    }
+  }
   // Before starting the prefetch thread, we make cpu_data and gpu_data
   // calls so that the prefetch thread does not accidentally make simultaneous
   // cudaMalloc calls when the main thread is running. In some GPUs this
   // seems to cause failures if we do not so.
-  for (int i = 0; i < PREFETCH_COUNT; ++i) {
-    prefetch_[i].data_.mutable_cpu_data();
+  // With gpu_transform, data_ is never allocated, batches only hold their
+  // uint8 pixels and transform parameters.
+  for (int i = 0; i < prefetch_.size(); ++i) {
+    if (gpu_transform_) {
+      CHECK(prefetch_[i]->raw_) << this->type()
+          << " does not support gpu_transform";
+      prefetch_[i]->raw_->mutable_cpu_data();
+      prefetch_[i]->params_.mutable_cpu_data();
+    } else {
+      prefetch_[i]->data_.mutable_cpu_data();
+    }
     if (this->output_labels_) {
-      prefetch_[i].label_.mutable_cpu_data();
+      prefetch_[i]->label_.mutable_cpu_data();
     }
   }
 #ifndef CPU_ONLY
   if (Caffe::mode() == Caffe::GPU) {
-    for (int i = 0; i < PREFETCH_COUNT; ++i) {
-      prefetch_[i].data_.mutable_gpu_data();
+    for (int i = 0; i < prefetch_.size(); ++i) {
+      if (gpu_transform_) {
+        prefetch_[i]->raw_->mutable_gpu_data();
+        prefetch_[i]->params_.mutable_gpu_data();
+      } else {
+        prefetch_[i]->data_.mutable_gpu_data();
+      }
       if (this->output_labels_) {
-        prefetch_[i].label_.mutable_gpu_data();
+        prefetch_[i]->label_.mutable_gpu_data();
       }
     }
+    for (int i = 0; i < loader_count_; ++i) {
+      cudaStream_t stream;
+      CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+      sync_->streams_.push_back(stream);
+    }
   }
 #endif
   DLOG(INFO) << "Initializing prefetch";
   this->data_transformer_->InitRand();
-  StartInternalThread();
+  if (loader_count_ > 1) {
+    for (int i = 1; i < loader_count_; ++i) {
+      loader_transformers_.push_back(shared_ptr<DataTransformer<Dtype> >(
+          new DataTransformer<Dtype>(this->transform_param_, this->phase_)));
+      loader_transformers_.back()->InitRand();
+      loader_transformed_data_.push_back(shared_ptr<Blob<Dtype> >(
+          new Blob<Dtype>()));
+      loader_transformed_data_.back()->ReshapeLike(transformed_data_);
+    }
+  }
+  executor_ = Caffe::executor();
+  if (executor_) {
+    for (int i = loader_count_ - 1; i >= 0; --i) {
+      sync_->free_loaders_.push_back(i);
+    }
+    schedule_loads();
+  } else {
+    StartInternalThread();
+  }
   DLOG(INFO) << "Prefetch initialized.";
 }
 
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::StopInternalThread() {
+  if (executor_) {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    sync_->stopping_ = true;
+    while (sync_->tasks_) {
+      sync_->condition_.wait(lock);
+    }
+  }
+  InternalThread::StopInternalThread();
+}
+
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::InternalThreadEntry() {
-#ifndef CPU_ONLY
-  cudaStream_t stream;
-  if (Caffe::mode() == Caffe::GPU) {
-    CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  // The other loaders are stopped when this thread is, on leaving the scope
+  vector<shared_ptr<Loader> > loaders;
+  for (int i = 1; i < loader_count_; ++i) {
+    loaders.push_back(shared_ptr<Loader>(new Loader(this, i)));
   }
-#endif
+  load_loop(0);
+}
 
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::load_loop(int loader) {
   try {
-    while (!must_stop()) {
-      Batch<Dtype>* batch = prefetch_free_.pop();
-      load_batch(batch);
-#ifndef CPU_ONLY
-      if (Caffe::mode() == Caffe::GPU) {
-        batch->data_.data().get()->async_gpu_push(stream);
-        CUDA_CHECK(cudaStreamSynchronize(stream));
-      }
-#endif
-      prefetch_full_.push(batch);
+    while (!boost::this_thread::interruption_requested()) {
+      fill_batch(prefetch_free_.pop(), loader);
     }
   } catch (boost::thread_interrupted&) {
     // Interrupted exception is expected on shutdown
   }
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::fill_batch(Batch<Dtype>* batch,
+                                                 int loader) {
+  {
+    NVTX_RANGE(this->layer_param_.name() + " load_batch");
+    if (ConcurrentLoadBatch()) {
+      load_batch(batch, loader);
+    } else {
+      begin_read(loader);
+      load_batch(batch, loader);
+      end_read();
+    }
+  }
 #ifndef CPU_ONLY
   if (Caffe::mode() == Caffe::GPU) {
-    CUDA_CHECK(cudaStreamDestroy(stream));
+    cudaStream_t stream = sync_->streams_[loader];
+    if (gpu_transform_) {
+      // Unless decoded there already
+      if (batch->raw_->head() == SyncedMemory::HEAD_AT_CPU) {
+        batch->raw_->async_gpu_push(stream);
+      }
+      batch->params_.data().get()->async_gpu_push(stream);
+    } else {
+      batch->data_.data().get()->async_gpu_push(stream);
+    }
+    if (this->output_labels_) {
+      batch->label_.data().get()->async_gpu_push(stream);
+    }
+    CUDA_CHECK(cudaStreamSynchronize(stream));
+  }
+#endif
+  if (loader_count_ > 1 && ordered_loading_) {
+    // Deliver batches in the order their inputs were read
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    while (sync_->next_push_ != sync_->tickets_[loader]) {
+      sync_->condition_.wait(lock);
+    }
+    prefetch_full_.push(batch);
+    sync_->next_push_++;
+    sync_->condition_.notify_all();
+  } else {
+    prefetch_full_.push(batch);
+  }
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::schedule_loads() {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  submit_loads();
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::submit_loads() {
+  Batch<Dtype>* batch;
+  while (!sync_->stopping_ && sync_->free_loaders_.size() &&
+         prefetch_free_.try_pop(&batch)) {
+    const int loader = sync_->free_loaders_.back();
+    sync_->free_loaders_.pop_back();
+    ++sync_->tasks_;
+    // Batches for training first, tests can wait
+    executor_->submit(boost::bind(&BasePrefetchingDataLayer<Dtype>::load_task,
+        this, batch, loader), this->phase_ == TRAIN ? Executor::HIGH :
+        Executor::LOW);
+  }
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::load_task(Batch<Dtype>* batch,
+                                                int loader) {
+  fill_batch(batch, loader);
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  sync_->free_loaders_.push_back(loader);
+  submit_loads();
+  // Last, as the layer may be destroyed once no task runs
+  --sync_->tasks_;
+  sync_->condition_.notify_all();
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::recycle_batch(Batch<Dtype>* batch) {
+  prefetch_free_.push(batch);
+  if (executor_) {
+    schedule_loads();
+  }
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::begin_read(int loader) {
+  if (loader_count_ == 1) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  while (sync_->reading_) {
+    sync_->condition_.wait(lock);
+  }
+  sync_->reading_ = true;
+  sync_->tickets_[loader] = sync_->next_ticket_++;
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::end_read() {
+  if (loader_count_ == 1) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  sync_->reading_ = false;
+  sync_->condition_.notify_all();
+}
+
+template <typename Dtype>
+DataTransformer<Dtype>* BasePrefetchingDataLayer<Dtype>::transformer(
+    int loader) {
+  return loader ? loader_transformers_[loader - 1].get() :
+      this->data_transformer_.get();
+}
+
+template <typename Dtype>
+Blob<Dtype>* BasePrefetchingDataLayer<Dtype>::transformed_data(int loader) {
+  return loader ? loader_transformed_data_[loader - 1].get() :
+      &transformed_data_;
+}
+
+template <typename Dtype>
+bool BasePrefetchingDataLayer<Dtype>::decode_raw_gpu(Batch<Dtype>* batch,
+    const vector<const string*>& images, int channels, int loader) {
+#ifdef USE_NVJPEG
+  if (gpu_decode_) {
+    return decoders_[loader]->Decode(images, channels, &batch->raw_shape_,
+        &batch->raw_);
   }
 #endif
+  return false;
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::collect_data_stats(DataStats* stats) {
+  stats->take(&data_stats_);
+}
+
+template <typename Dtype>
+Batch<Dtype>* BasePrefetchingDataLayer<Dtype>::pop_batch() {
+  data_stats_.add(DataStats::QUEUE_DEPTH, prefetch_full_.size());
+  CPUTimer timer;
+  timer.Start();
+  Batch<Dtype>* batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  data_stats_.add(DataStats::WAIT, timer.MicroSeconds());
+  return batch;
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::hold_batch(const Blob<Dtype>* top,
+                                                 Batch<Dtype>* batch) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  CHECK(sync_->held_.insert(std::make_pair(top, batch)).second);
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::release_batch(const Blob<Dtype>* top) {
+  Batch<Dtype>* batch = NULL;
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    typename std::map<const Blob<Dtype>*, Batch<Dtype>*>::iterator it =
+        sync_->held_.find(top);
+    if (it == sync_->held_.end()) {
+      return;
+    }
+    batch = it->second;
+    sync_->held_.erase(it);
+  }
+  recycle_batch(batch);
+}
+
+template <typename Dtype>
+Batch<Dtype>* BasePrefetchingDataLayer<Dtype>::micro_batch(
+    const Blob<Dtype>* top, int* index) {
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    int& next = sync_->micro_batches_[top];
+    *index = next;
+    next = (next + 1) % micro_batches_;
+    if (*index > 0) {
+      return sync_->held_[top];
+    }
+  }
+  release_batch(top);
+  Batch<Dtype>* batch = pop_batch();
+  hold_batch(top, batch);
+  return batch;
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::ReshapeMicroBatch(
+    const Blob<Dtype>& blob, Blob<Dtype>* top) const {
+  vector<int> shape = blob.shape();
+  CHECK_EQ(shape[0] % micro_batches_, 0)
+      << "The batch size should be a multiple of micro_batches";
+  shape[0] /= micro_batches_;
+  top->Reshape(shape);
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::ShareMicroBatch(
+    const Blob<Dtype>& blob, int index, Blob<Dtype>* top) const {
+  CHECK_EQ(blob.shape(0) % micro_batches_, 0)
+      << "The batch size should be a multiple of micro_batches";
+  const int items = blob.shape(0) / micro_batches_;
+  top->ShareItems(blob, index * items, (index + 1) * items);
 }
 
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::Forward_cpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  Batch<Dtype>* batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  if (micro_batches_ > 1) {
+    int index;
+    Batch<Dtype>* batch = micro_batch(top[0], &index);
+    // Views of the micro-batch, the batch held until the last one is done
+    ShareMicroBatch(batch->data_, index, top[0]);
+    if (this->output_labels_) {
+      ShareMicroBatch(batch->label_, index, top[1]);
+    }
+    return;
+  }
+  release_batch(top[0]);
+  Batch<Dtype>* batch = pop_batch();
   // Reshape to loaded data.
   top[0]->Reshape(batch->data_.num(), batch->data_.channels(),
       batch->data_.height(), batch->data_.width());
@@ -119,7 +469,7 @@ void BasePrefetchingDataLayer<Dtype>::Forward_cpu(
         top[1]->mutable_cpu_data());
   }
 
-  prefetch_free_.push(batch);
+  recycle_batch(batch);
 }
 
 #ifdef CPU_ONLY
@@ -7,21 +7,37 @@ namespace caffe {
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::Forward_gpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  Batch<Dtype>* batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  if (micro_batches_ > 1) {
+    // Views of the micro-batch, the batch held until the last one is done
+    int index;
+    Batch<Dtype>* batch = micro_batch(top[0], &index);
+    ShareMicroBatch(batch->data_, index, top[0]);
+    if (this->output_labels_) {
+      ShareMicroBatch(batch->label_, index, top[1]);
+    }
+    return;
+  }
+  // The batch shared by the tops since the last forward can be refilled
+  release_batch(top[0]);
+  Batch<Dtype>* batch = pop_batch();
   // Reshape to loaded data.
   top[0]->ReshapeLike(batch->data_);
-  // Copy the data
-  caffe_copy(batch->data_.count(), batch->data_.gpu_data(),
-      top[0]->mutable_gpu_data());
+  if (gpu_transform_) {
+    this->data_transformer_->Transform_gpu(batch->raw_shape_,
+        static_cast<const uint8_t*>(batch->raw_->gpu_data()),
+        batch->params_.gpu_data(), top[0]);
+  } else {
+    // Share the data, already pushed to the GPU by the prefetch thread
+    top[0]->ShareData(batch->data_);
+  }
   if (this->output_labels_) {
     // Reshape to loaded labels.
     top[1]->ReshapeLike(batch->label_);
-    // Copy the labels.
-    caffe_copy(batch->label_.count(), batch->label_.gpu_data(),
-        top[1]->mutable_gpu_data());
+    // Share the labels.
+    top[1]->ShareData(batch->label_);
   }
 
-  prefetch_free_.push(batch);
+  hold_batch(top[0], batch);
 }
 
 INSTANTIATE_LAYER_GPU_FORWARD(BasePrefetchingDataLayer);
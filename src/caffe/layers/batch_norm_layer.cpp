@@ -0,0 +1,172 @@
+#include <cmath>
+#include <vector>
+
+#include "caffe/common_layers.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void BatchNormLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const BatchNormParameter& param = this->layer_param_.batch_norm_param();
+  moving_average_fraction_ = param.moving_average_fraction();
+  use_global_stats_ = this->phase_ == TEST;
+  if (param.has_use_global_stats()) {
+    use_global_stats_ = param.use_global_stats();
+  }
+  eps_ = param.eps();
+  CHECK_GE(bottom[0]->num_axes(), 2)
+      << "Input must have a num and a channels axis.";
+  channels_ = bottom[0]->shape(1);
+  if (this->blobs_.size() > 0) {
+    LOG(INFO) << "Skipping parameter initialization";
+  } else {
+    this->blobs_.resize(3);
+    vector<int> shape(1, channels_);
+    this->blobs_[0].reset(new Blob<Dtype>(shape));
+    this->blobs_[1].reset(new Blob<Dtype>(shape));
+    shape[0] = 1;
+    this->blobs_[2].reset(new Blob<Dtype>(shape));
+    for (int i = 0; i < this->blobs_.size(); ++i) {
+      caffe_set(this->blobs_[i]->count(), Dtype(0),
+          this->blobs_[i]->mutable_cpu_data());
+    }
+  }
+  // The moving averages are computed by the layer, not by the solver.
+  for (int i = 0; i < this->blobs_.size(); ++i) {
+    if (this->layer_param_.param_size() == i) {
+      ParamSpec* param_spec = this->layer_param_.add_param();
+      param_spec->set_lr_mult(0);
+      param_spec->set_decay_mult(0);
+    } else {
+      CHECK_EQ(this->layer_param_.param(i).lr_mult(), 0)
+          << "The moving averages of BatchNorm cannot be learned.";
+    }
+  }
+}
+
+template <typename Dtype>
+void BatchNormLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  CHECK_EQ(bottom[0]->shape(1), channels_)
+      << "The number of channels cannot change.";
+  top[0]->ReshapeLike(*bottom[0]);
+  num_ = bottom[0]->shape(0);
+  spatial_dim_ = bottom[0]->count(2);
+  vector<int> shape(1, channels_);
+  mean_.Reshape(shape);
+  variance_.Reshape(shape);
+  inv_std_.Reshape(shape);
+  diff_sum_.Reshape(shape);
+  diff_dot_.Reshape(shape);
+}
+
+template <typename Dtype>
+Dtype BatchNormLayer<Dtype>::global_stats_scale() const {
+  const Dtype factor = this->blobs_[2]->cpu_data()[0];
+  return factor == 0 ? Dtype(0) : 1 / factor;
+}
+
+template <typename Dtype>
+void BatchNormLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = top[0]->mutable_cpu_data();
+  Dtype* mean = mean_.mutable_cpu_data();
+  Dtype* variance = variance_.mutable_cpu_data();
+  if (use_global_stats_) {
+    const Dtype scale = global_stats_scale();
+    caffe_cpu_scale(channels_, scale, this->blobs_[0]->cpu_data(), mean);
+    caffe_cpu_scale(channels_, scale, this->blobs_[1]->cpu_data(), variance);
+  } else {
+    // Welford's single pass update of the mean and of the sum of squared
+    // differences from it.
+    for (int c = 0; c < channels_; ++c) {
+      Dtype m = 0;
+      Dtype m2 = 0;
+      int k = 0;
+      for (int n = 0; n < num_; ++n) {
+        const Dtype* x = bottom_data + (n * channels_ + c) * spatial_dim_;
+        for (int i = 0; i < spatial_dim_; ++i) {
+          const Dtype delta = x[i] - m;
+          m += delta / ++k;
+          m2 += delta * (x[i] - m);
+        }
+      }
+      mean[c] = m;
+      variance[c] = m2 / k;
+    }
+    // The moving averages keep the unbiased variance.
+    const int m = num_ * spatial_dim_;
+    const Dtype correction = m > 1 ? Dtype(m) / (m - 1) : Dtype(1);
+    Dtype* factor = this->blobs_[2]->mutable_cpu_data();
+    factor[0] = factor[0] * moving_average_fraction_ + 1;
+    caffe_cpu_axpby(channels_, Dtype(1), mean, moving_average_fraction_,
+        this->blobs_[0]->mutable_cpu_data());
+    caffe_cpu_axpby(channels_, correction, variance, moving_average_fraction_,
+        this->blobs_[1]->mutable_cpu_data());
+  }
+  Dtype* inv_std = inv_std_.mutable_cpu_data();
+  for (int c = 0; c < channels_; ++c) {
+    inv_std[c] = 1 / std::sqrt(variance[c] + eps_);
+  }
+  for (int n = 0; n < num_; ++n) {
+    for (int c = 0; c < channels_; ++c) {
+      const int offset = (n * channels_ + c) * spatial_dim_;
+      for (int i = 0; i < spatial_dim_; ++i) {
+        top_data[offset + i] = (bottom_data[offset + i] - mean[c]) * inv_std[c];
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void BatchNormLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+    const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) {
+    return;
+  }
+  // The top holds the normalized input y, in place or not. With the batch
+  // statistics, dE/dx = (dE/dy - mean(dE/dy) - y * mean(dE/dy * y)) / std,
+  // the means being over the batch and spatial dimensions of each channel.
+  const Dtype* top_data = top[0]->cpu_data();
+  const Dtype* top_diff = top[0]->cpu_diff();
+  Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
+  const Dtype* inv_std = inv_std_.cpu_data();
+  Dtype* diff_sum = diff_sum_.mutable_cpu_data();
+  Dtype* diff_dot = diff_dot_.mutable_cpu_data();
+  caffe_set(channels_, Dtype(0), diff_sum);
+  caffe_set(channels_, Dtype(0), diff_dot);
+  if (!use_global_stats_) {
+    for (int n = 0; n < num_; ++n) {
+      for (int c = 0; c < channels_; ++c) {
+        const int offset = (n * channels_ + c) * spatial_dim_;
+        for (int i = 0; i < spatial_dim_; ++i) {
+          diff_sum[c] += top_diff[offset + i];
+          diff_dot[c] += top_diff[offset + i] * top_data[offset + i];
+        }
+      }
+    }
+    caffe_scal(channels_, Dtype(1) / (num_ * spatial_dim_), diff_sum);
+    caffe_scal(channels_, Dtype(1) / (num_ * spatial_dim_), diff_dot);
+  }
+  for (int n = 0; n < num_; ++n) {
+    for (int c = 0; c < channels_; ++c) {
+      const int offset = (n * channels_ + c) * spatial_dim_;
+      for (int i = 0; i < spatial_dim_; ++i) {
+        bottom_diff[offset + i] = inv_std[c] * (top_diff[offset + i]
+            - diff_sum[c] - top_data[offset + i] * diff_dot[c]);
+      }
+    }
+  }
+}
+
+#ifdef CPU_ONLY
+STUB_GPU(BatchNormLayer);
+#endif
+
+INSTANTIATE_CLASS(BatchNormLayer);
+
+}  // namespace caffe
@@ -0,0 +1,185 @@
+#include <vector>
+
+#include "caffe/common_layers.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+// One block per channel: each thread updates the mean and the sum of squared
+// differences of its share of the values in a single pass, by Welford's
+// method, and the block merges them pairwise.
+template <typename Dtype>
+__global__ void BatchNormStatistics(const int num, const int channels,
+    const int spatial_dim, const Dtype* bottom_data, Dtype* mean,
+    Dtype* variance) {
+  __shared__ Dtype counts[CAFFE_CUDA_NUM_THREADS];
+  __shared__ Dtype means[CAFFE_CUDA_NUM_THREADS];
+  __shared__ Dtype m2s[CAFFE_CUDA_NUM_THREADS];
+  const int c = blockIdx.x;
+  Dtype k = 0;
+  Dtype m = 0;
+  Dtype m2 = 0;
+  for (int j = threadIdx.x; j < num * spatial_dim; j += blockDim.x) {
+    const Dtype x = bottom_data[((j / spatial_dim) * channels + c)
+        * spatial_dim + j % spatial_dim];
+    const Dtype delta = x - m;
+    k += 1;
+    m += delta / k;
+    m2 += delta * (x - m);
+  }
+  counts[threadIdx.x] = k;
+  means[threadIdx.x] = m;
+  m2s[threadIdx.x] = m2;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s && counts[threadIdx.x + s] > 0) {
+      const Dtype ka = counts[threadIdx.x];
+      const Dtype kb = counts[threadIdx.x + s];
+      const Dtype delta = means[threadIdx.x + s] - means[threadIdx.x];
+      counts[threadIdx.x] = ka + kb;
+      means[threadIdx.x] += delta * kb / (ka + kb);
+      m2s[threadIdx.x] += m2s[threadIdx.x + s] + delta * delta * ka * kb
+          / (ka + kb);
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    mean[c] = means[0];
+    variance[c] = m2s[0] / counts[0];
+  }
+}
+
+template <typename Dtype>
+__global__ void BatchNormInvStd(const int channels, const Dtype eps,
+    const Dtype* variance, Dtype* inv_std) {
+  CUDA_KERNEL_LOOP(c, channels) {
+    inv_std[c] = 1 / sqrt(variance[c] + eps);
+  }
+}
+
+template <typename Dtype>
+__global__ void BatchNormForward(const int count, const int channels,
+    const int spatial_dim, const Dtype* bottom_data, const Dtype* mean,
+    const Dtype* inv_std, Dtype* top_data) {
+  CUDA_KERNEL_LOOP(index, count) {
+    const int c = (index / spatial_dim) % channels;
+    top_data[index] = (bottom_data[index] - mean[c]) * inv_std[c];
+  }
+}
+
+// One block per channel averages the top diff and its product with the top.
+template <typename Dtype>
+__global__ void BatchNormGradientMeans(const int num, const int channels,
+    const int spatial_dim, const Dtype* top_data, const Dtype* top_diff,
+    Dtype* diff_sum, Dtype* diff_dot) {
+  __shared__ Dtype sums[CAFFE_CUDA_NUM_THREADS];
+  __shared__ Dtype dots[CAFFE_CUDA_NUM_THREADS];
+  const int c = blockIdx.x;
+  Dtype sum = 0;
+  Dtype dot = 0;
+  for (int j = threadIdx.x; j < num * spatial_dim; j += blockDim.x) {
+    const int index = ((j / spatial_dim) * channels + c) * spatial_dim
+        + j % spatial_dim;
+    sum += top_diff[index];
+    dot += top_diff[index] * top_data[index];
+  }
+  sums[threadIdx.x] = sum;
+  dots[threadIdx.x] = dot;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      sums[threadIdx.x] += sums[threadIdx.x + s];
+      dots[threadIdx.x] += dots[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    diff_sum[c] = sums[0] / (num * spatial_dim);
+    diff_dot[c] = dots[0] / (num * spatial_dim);
+  }
+}
+
+template <typename Dtype>
+__global__ void BatchNormBackward(const int count, const int channels,
+    const int spatial_dim, const bool use_global_stats, const Dtype* top_data,
+    const Dtype* top_diff, const Dtype* inv_std, const Dtype* diff_sum,
+    const Dtype* diff_dot, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, count) {
+    const int c = (index / spatial_dim) % channels;
+    if (use_global_stats) {
+      bottom_diff[index] = inv_std[c] * top_diff[index];
+    } else {
+      bottom_diff[index] = inv_std[c] * (top_diff[index] - diff_sum[c]
+          - top_data[index] * diff_dot[c]);
+    }
+  }
+}
+
+template <typename Dtype>
+void BatchNormLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const Dtype* bottom_data = bottom[0]->gpu_data();
+  Dtype* top_data = top[0]->mutable_gpu_data();
+  const int count = bottom[0]->count();
+  if (use_global_stats_) {
+    const Dtype scale = global_stats_scale();
+    caffe_gpu_scale(channels_, scale, this->blobs_[0]->gpu_data(),
+        mean_.mutable_gpu_data());
+    caffe_gpu_scale(channels_, scale, this->blobs_[1]->gpu_data(),
+        variance_.mutable_gpu_data());
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    BatchNormStatistics<Dtype><<<channels_, CAFFE_CUDA_NUM_THREADS, 0,
+        Caffe::cuda_stream()>>>(num_, channels_, spatial_dim_, bottom_data,
+        mean_.mutable_gpu_data(), variance_.mutable_gpu_data());
+    CUDA_POST_KERNEL_CHECK;
+    const int m = num_ * spatial_dim_;
+    const Dtype correction = m > 1 ? Dtype(m) / (m - 1) : Dtype(1);
+    Dtype* factor = this->blobs_[2]->mutable_cpu_data();
+    factor[0] = factor[0] * moving_average_fraction_ + 1;
+    caffe_gpu_axpby(channels_, Dtype(1), mean_.gpu_data(),
+        moving_average_fraction_, this->blobs_[0]->mutable_gpu_data());
+    caffe_gpu_axpby(channels_, correction, variance_.gpu_data(),
+        moving_average_fraction_, this->blobs_[1]->mutable_gpu_data());
+  }
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  BatchNormInvStd<Dtype><<<CAFFE_GET_BLOCKS(channels_),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(channels_, eps_,
+      variance_.gpu_data(), inv_std_.mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  BatchNormForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+      0, Caffe::cuda_stream()>>>(count, channels_, spatial_dim_, bottom_data,
+      mean_.gpu_data(), inv_std_.gpu_data(), top_data);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template <typename Dtype>
+void BatchNormLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) {
+    return;
+  }
+  const Dtype* top_data = top[0]->gpu_data();
+  const Dtype* top_diff = top[0]->gpu_diff();
+  const int count = top[0]->count();
+  if (!use_global_stats_) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    BatchNormGradientMeans<Dtype><<<channels_, CAFFE_CUDA_NUM_THREADS, 0,
+        Caffe::cuda_stream()>>>(num_, channels_, spatial_dim_, top_data,
+        top_diff, diff_sum_.mutable_gpu_data(), diff_dot_.mutable_gpu_data());
+    CUDA_POST_KERNEL_CHECK;
+  }
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  BatchNormBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+      0, Caffe::cuda_stream()>>>(count, channels_, spatial_dim_,
+      use_global_stats_, top_data, top_diff, inv_std_.gpu_data(),
+      diff_sum_.gpu_data(), diff_dot_.gpu_data(),
+      bottom[0]->mutable_gpu_diff());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(BatchNormLayer);
+
+}  // namespace caffe
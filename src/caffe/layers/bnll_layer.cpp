@@ -1,7 +1,9 @@
 #include <algorithm>
+#include <cmath>
 #include <vector>
 
 #include "caffe/layer.hpp"
+#include "caffe/util/approx_math.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
@@ -14,10 +16,17 @@ void BNLLLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = top[0]->mutable_cpu_data();
   const int count = bottom[0]->count();
-  for (int i = 0; i < count; ++i) {
-    top_data[i] = bottom_data[i] > 0 ?
-        bottom_data[i] + log(1. + exp(-bottom_data[i])) :
-        log(1. + exp(bottom_data[i]));
+  if (this->layer_param_.approximate_math()) {
+    for (int i = 0; i < count; ++i) {
+      top_data[i] = std::max(bottom_data[i], Dtype(0))
+          + log(Dtype(1) + approx_exp(-std::abs(bottom_data[i])));
+    }
+  } else {
+    for (int i = 0; i < count; ++i) {
+      top_data[i] = bottom_data[i] > 0 ?
+          bottom_data[i] + log(1. + exp(-bottom_data[i])) :
+          log(1. + exp(bottom_data[i]));
+    }
   }
 }
 
@@ -30,10 +39,17 @@ void BNLLLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const Dtype* top_diff = top[0]->cpu_diff();
     Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
     const int count = bottom[0]->count();
-    Dtype expval;
-    for (int i = 0; i < count; ++i) {
-      expval = exp(std::min(bottom_data[i], Dtype(kBNLL_THRESHOLD)));
-      bottom_diff[i] = top_diff[i] * expval / (expval + 1.);
+    if (this->layer_param_.approximate_math()) {
+      // exp(x) / (exp(x) + 1)
+      for (int i = 0; i < count; ++i) {
+        bottom_diff[i] = top_diff[i] * approx_sigmoid(bottom_data[i]);
+      }
+    } else {
+      Dtype expval;
+      for (int i = 0; i < count; ++i) {
+        expval = exp(std::min(bottom_data[i], Dtype(kBNLL_THRESHOLD)));
+        bottom_diff[i] = top_diff[i] * expval / (expval + 1.);
+      }
     }
   }
 }
@@ -2,6 +2,7 @@
 #include <vector>
 
 #include "caffe/layer.hpp"
+#include "caffe/util/approx_math.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
@@ -9,11 +10,17 @@ namespace caffe {
 const float kBNLL_THRESHOLD = 50.;
 
 template <typename Dtype>
-__global__ void BNLLForward(const int n, const Dtype* in, Dtype* out) {
+__global__ void BNLLForward(const int n, const bool approximate,
+    const Dtype* in, Dtype* out) {
   CUDA_KERNEL_LOOP(index, n) {
-    out[index] = in[index] > 0 ?
-        in[index] + log(1. + exp(-in[index])) :
-        log(1. + exp(in[index]));
+    if (approximate) {
+      out[index] = max(in[index], Dtype(0))
+          + log(Dtype(1) + approx_exp(-abs(in[index])));
+    } else {
+      out[index] = in[index] > 0 ?
+          in[index] + log(1. + exp(-in[index])) :
+          log(1. + exp(in[index]));
+    }
   }
 }
 
@@ -24,17 +31,22 @@ void BNLLLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
   Dtype* top_data = top[0]->mutable_gpu_data();
   const int count = bottom[0]->count();
   // NOLINT_NEXT_LINE(whitespace/operators)
-  BNLLForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-      count, bottom_data, top_data);
+  BNLLForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(count, this->layer_param_.approximate_math(),
+      bottom_data, top_data);
   CUDA_POST_KERNEL_CHECK;
 }
 
 template <typename Dtype>
-__global__ void BNLLBackward(const int n, const Dtype* in_diff,
-    const Dtype* in_data, Dtype* out_diff) {
+__global__ void BNLLBackward(const int n, const bool approximate,
+    const Dtype* in_diff, const Dtype* in_data, Dtype* out_diff) {
   CUDA_KERNEL_LOOP(index, n) {
-    Dtype expval = exp(min(in_data[index], Dtype(kBNLL_THRESHOLD)));
-    out_diff[index] = in_diff[index] * expval / (expval + 1.);
+    if (approximate) {
+      out_diff[index] = in_diff[index] * approx_sigmoid(in_data[index]);
+    } else {
+      Dtype expval = exp(min(in_data[index], Dtype(kBNLL_THRESHOLD)));
+      out_diff[index] = in_diff[index] * expval / (expval + 1.);
+    }
   }
 }
 
@@ -48,8 +60,9 @@ void BNLLLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
     const int count = bottom[0]->count();
     // NOLINT_NEXT_LINE(whitespace/operators)
-    BNLLBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-        count, top_diff, bottom_data, bottom_diff);
+    BNLLBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS, 0,
+        Caffe::cuda_stream()>>>(count, this->layer_param_.approximate_math(),
+        top_diff, bottom_data, bottom_diff);
     CUDA_POST_KERNEL_CHECK;
   }
 }
@@ -34,10 +34,28 @@ void ConcatLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   vector<int> top_shape = bottom[0]->shape();
   num_concats_ = bottom[0]->count(0, concat_axis_);
   concat_input_size_ = bottom[0]->count(concat_axis_ + 1);
+  if (bottom[0]->layout() == NHWC) {
+    // The axes in the order of memory, (num, height, width, channels)
+    const int axes[] = {0, 2, 3, 1};
+    num_concats_ = 1;
+    concat_input_size_ = 1;
+    bool before = true;
+    for (int j = 0; j < 4; ++j) {
+      if (axes[j] == concat_axis_) {
+        before = false;
+      } else if (before) {
+        num_concats_ *= bottom[0]->shape(axes[j]);
+      } else {
+        concat_input_size_ *= bottom[0]->shape(axes[j]);
+      }
+    }
+  }
   int bottom_count_sum = bottom[0]->count();
   for (int i = 1; i < bottom.size(); ++i) {
     CHECK_EQ(num_axes, bottom[i]->num_axes())
         << "All inputs must have the same #axes.";
+    CHECK_EQ(bottom[0]->layout(), bottom[i]->layout())
+        << "All inputs must have the same layout.";
     for (int j = 0; j < num_axes; ++j) {
       if (j == concat_axis_) { continue; }
       CHECK_EQ(top_shape[j], bottom[i]->shape(j))
@@ -47,12 +65,22 @@ void ConcatLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
     top_shape[concat_axis_] += bottom[i]->shape(concat_axis_);
   }
   top[0]->Reshape(top_shape);
+  top[0]->set_layout(bottom[0]->layout());
   CHECK_EQ(bottom_count_sum, top[0]->count());
+  viewing_ = concat_param.view() && num_concats_ == 1;
+  if (viewing_) {
+    int offset = 0;
+    for (int i = 0; i < bottom.size(); ++i) {
+      bottom[i]->ShareView(*top[0], offset);
+      offset += bottom[i]->count();
+    }
+  }
 }
 
 template <typename Dtype>
 void ConcatLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  if (viewing_) { return; }
   Dtype* top_data = top[0]->mutable_cpu_data();
   int offset_concat_axis = 0;
   const int top_concat_axis = top[0]->shape(concat_axis_);
@@ -72,6 +100,7 @@ void ConcatLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void ConcatLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (viewing_) { return; }
   const Dtype* top_diff = top[0]->cpu_diff();
   int offset_concat_axis = 0;
   const int top_concat_axis = top[0]->shape(concat_axis_);
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <vector>
 
 #include "caffe/filler.hpp"
@@ -19,16 +20,42 @@ void ConvolutionLayer<Dtype>::compute_output_shape() {
 template <typename Dtype>
 void ConvolutionLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  if (bottom[0]->layout() == NHWC) {
+    for (int i = 0; i < bottom.size(); ++i) {
+      this->forward_cpu_nhwc(bottom[i]->cpu_data(),
+          top[i]->mutable_cpu_data());
+    }
+    return;
+  }
   const Dtype* weight = this->blobs_[0]->cpu_data();
+  const bool sparse = this->compress_weights();
+  // The int8, sparse and direct grouped products run an image at a time.
+  const int step = this->quantized_ || sparse || this->direct_groups_ ? 1 :
+      this->images_per_gemm_;
   for (int i = 0; i < bottom.size(); ++i) {
     const Dtype* bottom_data = bottom[i]->cpu_data();
     Dtype* top_data = top[i]->mutable_cpu_data();
-    for (int n = 0; n < this->num_; ++n) {
-      this->forward_cpu_gemm(bottom_data + bottom[i]->offset(n), weight,
-          top_data + top[i]->offset(n));
-      if (this->bias_term_) {
-        const Dtype* bias = this->blobs_[1]->cpu_data();
-        this->forward_cpu_bias(top_data + top[i]->offset(n), bias);
+    for (int n = 0; n < this->num_; n += step) {
+      const int images = std::min(step, this->num_ - n);
+      if (this->quantized_) {
+        this->forward_cpu_gemm_int8(bottom_data + bottom[i]->offset(n),
+            weight, top_data + top[i]->offset(n));
+      } else if (sparse) {
+        this->forward_cpu_gemm_sparse(bottom_data + bottom[i]->offset(n),
+            top_data + top[i]->offset(n));
+      } else if (images == 1) {
+        this->forward_cpu_gemm(bottom_data + bottom[i]->offset(n), weight,
+            top_data + top[i]->offset(n));
+      } else {
+        this->forward_cpu_gemm_batch(bottom_data + bottom[i]->offset(n),
+            images, weight, top_data + top[i]->offset(n));
+      }
+      if (this->bias_term_ || this->fused_relu_) {
+        const Dtype* bias =
+            this->bias_term_ ? this->blobs_[1]->cpu_data() : NULL;
+        for (int m = n; m < n + images; ++m) {
+          this->forward_cpu_bias(top_data + top[i]->offset(m), bias);
+        }
       }
     }
   }
@@ -40,6 +67,13 @@ void ConvolutionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
   const Dtype* weight = this->blobs_[0]->cpu_data();
   Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
   for (int i = 0; i < top.size(); ++i) {
+    this->backward_cpu_relu(top[i]);
+    if (bottom[i]->layout() == NHWC) {
+      this->backward_cpu_nhwc(top[i]->cpu_diff(), bottom[i]->cpu_data(),
+          propagate_down[i] ? bottom[i]->mutable_cpu_diff() : NULL,
+          this->accumulate_bottom_diff(i));
+      continue;
+    }
     const Dtype* top_diff = top[i]->cpu_diff();
     const Dtype* bottom_data = bottom[i]->cpu_data();
     Dtype* bottom_diff = bottom[i]->mutable_cpu_diff();
@@ -60,7 +94,8 @@ void ConvolutionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
         // gradient w.r.t. bottom data, if necessary.
         if (propagate_down[i]) {
           this->backward_cpu_gemm(top_diff + top[i]->offset(n), weight,
-              bottom_diff + bottom[i]->offset(n));
+              bottom_diff + bottom[i]->offset(n),
+              this->accumulate_bottom_diff(i));
         }
       }
     }
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <vector>
 
 #include "caffe/filler.hpp"
@@ -11,16 +12,38 @@ namespace caffe {
 template <typename Dtype>
 void ConvolutionLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  if (bottom[0]->layout() == NHWC) {
+    for (int i = 0; i < bottom.size(); ++i) {
+      this->forward_gpu_nhwc(bottom[i]->gpu_data(),
+          top[i]->mutable_gpu_data());
+    }
+    return;
+  }
   const Dtype* weight = this->blobs_[0]->gpu_data();
+  const bool sparse = this->compress_weights();
+  const int step = sparse || this->direct_groups_ ? 1 :
+      this->images_per_gemm_;
   for (int i = 0; i < bottom.size(); ++i) {
     const Dtype* bottom_data = bottom[i]->gpu_data();
     Dtype* top_data = top[i]->mutable_gpu_data();
-    for (int n = 0; n < this->num_; ++n) {
-      this->forward_gpu_gemm(bottom_data + bottom[i]->offset(n), weight,
-          top_data + top[i]->offset(n));
-      if (this->bias_term_) {
-        const Dtype* bias = this->blobs_[1]->gpu_data();
-        this->forward_gpu_bias(top_data + top[i]->offset(n), bias);
+    for (int n = 0; n < this->num_; n += step) {
+      const int images = std::min(step, this->num_ - n);
+      if (sparse) {
+        this->forward_gpu_gemm_sparse(bottom_data + bottom[i]->offset(n),
+            top_data + top[i]->offset(n));
+      } else if (images == 1) {
+        this->forward_gpu_gemm(bottom_data + bottom[i]->offset(n), weight,
+            top_data + top[i]->offset(n));
+      } else {
+        this->forward_gpu_gemm_batch(bottom_data + bottom[i]->offset(n),
+            images, weight, top_data + top[i]->offset(n));
+      }
+      if (this->bias_term_ || this->fused_relu_) {
+        const Dtype* bias =
+            this->bias_term_ ? this->blobs_[1]->gpu_data() : NULL;
+        for (int m = n; m < n + images; ++m) {
+          this->forward_gpu_bias(top_data + top[i]->offset(m), bias);
+        }
       }
     }
   }
@@ -32,6 +55,13 @@ void ConvolutionLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
   const Dtype* weight = this->blobs_[0]->gpu_data();
   Dtype* weight_diff = this->blobs_[0]->mutable_gpu_diff();
   for (int i = 0; i < top.size(); ++i) {
+    this->backward_gpu_relu(top[i]);
+    if (bottom[i]->layout() == NHWC) {
+      this->backward_gpu_nhwc(top[i]->gpu_diff(), bottom[i]->gpu_data(),
+          propagate_down[i] ? bottom[i]->mutable_gpu_diff() : NULL,
+          this->accumulate_bottom_diff(i));
+      continue;
+    }
     const Dtype* top_diff = top[i]->gpu_diff();
     // Bias gradient, if necessary.
     if (this->bias_term_ && this->param_propagate_down_[1]) {
@@ -52,7 +82,8 @@ void ConvolutionLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
         // gradient w.r.t. bottom data, if necessary.
         if (propagate_down[i]) {
           this->backward_gpu_gemm(top_diff + top[i]->offset(n), weight,
-              bottom_diff + bottom[i]->offset(n));
+              bottom_diff + bottom[i]->offset(n),
+              this->accumulate_bottom_diff(i));
         }
       }
     }
@@ -0,0 +1,61 @@
+#ifdef USE_CUDNN
+#include <vector>
+
+#include "caffe/common_layers.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#if CUDNN_VERSION_MIN(5, 0, 0)
+namespace caffe {
+
+template <typename Dtype>
+void CuDNNBatchNormLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  BatchNormLayer<Dtype>::LayerSetUp(bottom, top);
+  vector<int> shape(1, this->channels_);
+  scale_ones_.Reshape(shape);
+  shift_zeros_.Reshape(shape);
+  scale_diff_.Reshape(shape);
+  shift_diff_.Reshape(shape);
+  save_mean_.Reshape(shape);
+  caffe_set(this->channels_, Dtype(1), scale_ones_.mutable_cpu_data());
+  caffe_set(this->channels_, Dtype(0), shift_zeros_.mutable_cpu_data());
+  // Initialize CUDNN.
+  CUDNN_CHECK(cudnnCreate(&handle_));
+  cudnn::createTensor4dDesc<Dtype>(&bottom_desc_);
+  cudnn::createTensor4dDesc<Dtype>(&top_desc_);
+  cudnn::createTensor4dDesc<Dtype>(&stats_desc_);
+  handles_setup_ = true;
+}
+
+template <typename Dtype>
+void CuDNNBatchNormLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  BatchNormLayer<Dtype>::Reshape(bottom, top);
+  cudnn::setTensor4dDesc<Dtype>(&bottom_desc_, this->num_, this->channels_,
+      this->spatial_dim_, 1);
+  cudnn::setTensor4dDesc<Dtype>(&top_desc_, this->num_, this->channels_,
+      this->spatial_dim_, 1);
+  CUDNN_CHECK(cudnnDeriveBNTensorDescriptor(stats_desc_, bottom_desc_,
+      CUDNN_BATCHNORM_SPATIAL));
+  if (bottom[0] == top[0]) {
+    bottom_copy_.ReshapeLike(*bottom[0]);
+  }
+}
+
+template <typename Dtype>
+CuDNNBatchNormLayer<Dtype>::~CuDNNBatchNormLayer() {
+  // Check that handles have been setup before destroying.
+  if (!handles_setup_) { return; }
+
+  cudnnDestroyTensorDescriptor(bottom_desc_);
+  cudnnDestroyTensorDescriptor(top_desc_);
+  cudnnDestroyTensorDescriptor(stats_desc_);
+  cudnnDestroy(handle_);
+}
+
+INSTANTIATE_CLASS(CuDNNBatchNormLayer);
+
+}  // namespace caffe
+#endif
+#endif
@@ -0,0 +1,92 @@
+#ifdef USE_CUDNN
+#include <algorithm>
+#include <vector>
+
+#include "caffe/common_layers.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#if CUDNN_VERSION_MIN(5, 0, 0)
+namespace caffe {
+
+template <typename Dtype>
+void CuDNNBatchNormLayer<Dtype>::Forward_gpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  // Normalizing with the moving averages is a single elementwise pass,
+  // which cuDNN does no better.
+  if (this->use_global_stats_) {
+    BatchNormLayer<Dtype>::Forward_gpu(bottom, top);
+    return;
+  }
+  const Dtype* bottom_data = bottom[0]->gpu_data();
+  if (bottom[0] == top[0]) {
+    caffe_copy(bottom[0]->count(), bottom_data,
+        bottom_copy_.mutable_gpu_data());
+    bottom_data = bottom_copy_.gpu_data();
+  }
+  Dtype* top_data = top[0]->mutable_gpu_data();
+  // With an average factor of 1, cuDNN leaves the mean and the unbiased
+  // variance of the batch in mean_ and variance_, which then go into the
+  // moving averages as in BatchNormLayer.
+  caffe_gpu_set(this->channels_, Dtype(0), this->mean_.mutable_gpu_data());
+  caffe_gpu_set(this->channels_, Dtype(0),
+      this->variance_.mutable_gpu_data());
+  CUDNN_CHECK(cudnnSetStream(handle_, Caffe::cuda_stream()));
+  CUDNN_CHECK(cudnnBatchNormalizationForwardTraining(handle_,
+        CUDNN_BATCHNORM_SPATIAL,
+        cudnn::dataType<Dtype>::one,
+        cudnn::dataType<Dtype>::zero,
+        bottom_desc_, bottom_data,
+        top_desc_, top_data,
+        stats_desc_, scale_ones_.gpu_data(), shift_zeros_.gpu_data(),
+        1., this->mean_.mutable_gpu_data(),
+        this->variance_.mutable_gpu_data(),
+        std::max(static_cast<double>(this->eps_), CUDNN_BN_MIN_EPSILON),
+        save_mean_.mutable_gpu_data(), this->inv_std_.mutable_gpu_data()));
+  Dtype* factor = this->blobs_[2]->mutable_cpu_data();
+  factor[0] = factor[0] * this->moving_average_fraction_ + 1;
+  caffe_gpu_axpby(this->channels_, Dtype(1), this->mean_.gpu_data(),
+      this->moving_average_fraction_, this->blobs_[0]->mutable_gpu_data());
+  caffe_gpu_axpby(this->channels_, Dtype(1), this->variance_.gpu_data(),
+      this->moving_average_fraction_, this->blobs_[1]->mutable_gpu_data());
+}
+
+template <typename Dtype>
+void CuDNNBatchNormLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) {
+    return;
+  }
+  if (this->use_global_stats_) {
+    BatchNormLayer<Dtype>::Backward_gpu(top, propagate_down, bottom);
+    return;
+  }
+  const Dtype* bottom_data = bottom[0]->gpu_data();
+  const Dtype* top_diff = top[0]->gpu_diff();
+  if (bottom[0] == top[0]) {
+    caffe_copy(top[0]->count(), top_diff, bottom_copy_.mutable_gpu_diff());
+    bottom_data = bottom_copy_.gpu_data();
+    top_diff = bottom_copy_.gpu_diff();
+  }
+  CUDNN_CHECK(cudnnSetStream(handle_, Caffe::cuda_stream()));
+  CUDNN_CHECK(cudnnBatchNormalizationBackward(handle_,
+        CUDNN_BATCHNORM_SPATIAL,
+        cudnn::dataType<Dtype>::one,
+        cudnn::dataType<Dtype>::zero,
+        cudnn::dataType<Dtype>::one,
+        cudnn::dataType<Dtype>::zero,
+        bottom_desc_, bottom_data,
+        top_desc_, top_diff,
+        bottom_desc_, bottom[0]->mutable_gpu_diff(),
+        stats_desc_, scale_ones_.gpu_data(),
+        scale_diff_.mutable_gpu_data(), shift_diff_.mutable_gpu_data(),
+        std::max(static_cast<double>(this->eps_), CUDNN_BN_MIN_EPSILON),
+        save_mean_.gpu_data(), this->inv_std_.gpu_data()));
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(CuDNNBatchNormLayer);
+
+}  // namespace caffe
+#endif
+#endif
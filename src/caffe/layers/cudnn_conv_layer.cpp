@@ -1,4 +1,6 @@
 #ifdef USE_CUDNN
+#include <sstream>
+#include <string>
 #include <vector>
 
 #include "caffe/filler.hpp"
@@ -9,10 +11,8 @@
 
 namespace caffe {
 
-// Set to three for the benefit of the backward pass, which
-// can use separate streams for calculating the gradient w.r.t.
-// bias, filter weights, and bottom data for each group independently
-#define CUDNN_STREAMS_PER_GROUP 3
+// Forwards timed for each algorithm when autotuning, after an untimed one
+static const int kTuneRuns = 3;
 
 /**
  * TODO(dox) explain cuDNN interface
@@ -21,17 +21,11 @@ template <typename Dtype>
 void CuDNNConvolutionLayer<Dtype>::LayerSetUp(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
   ConvolutionLayer<Dtype>::LayerSetUp(bottom, top);
-  // Initialize CUDA streams and cuDNN.
-  stream_         = new cudaStream_t[this->group_ * CUDNN_STREAMS_PER_GROUP];
-  handle_         = new cudnnHandle_t[this->group_ * CUDNN_STREAMS_PER_GROUP];
+  // The streams, cuDNN handles and workspace are shared with the other
+  // layers of the thread, see cudnn::SharedHandle.
   workspaceSizeInBytes = 0;
-  workspace = NULL;
-
-  for (int g = 0; g < this->group_ * CUDNN_STREAMS_PER_GROUP; g++) {
-    CUDA_CHECK(cudaStreamCreate(&stream_[g]));
-    CUDNN_CHECK(cudnnCreate(&handle_[g]));
-    CUDNN_CHECK(cudnnSetStream(handle_[g], stream_[g]));
-  }
+  algo_key_.clear();
+  fwd_algos_.clear();
 
   // Set the indexing parameters.
   weight_offset_ = (this->num_output_ / this->group_)
@@ -74,20 +68,28 @@ void CuDNNConvolutionLayer<Dtype>::Reshape(
       * this->height_out_ * this->width_out_;
 
   for (int i = 0; i < bottom.size(); i++) {
-    cudnn::setTensor4dDesc<Dtype>(&bottom_descs_[i],
-        this->num_,
-        this->channels_ / this->group_,
-        this->height_, this->width_,
-        this->channels_ * this->height_ * this->width_,
-        this->height_ * this->width_,
-        this->width_, 1);
-    cudnn::setTensor4dDesc<Dtype>(&top_descs_[i],
-        this->num_,
-        this->num_output_ / this->group_,
-        this->height_out_, this->width_out_,
-        this->num_output_ * this->height_out_ * this->width_out_,
-        this->height_out_ * this->width_out_,
-        this->width_out_, 1);
+    if (bottom[i]->layout() == NHWC) {
+      // With group 1, see BaseConvolutionLayer::Reshape
+      cudnn::setTensor4dDesc<Dtype>(&bottom_descs_[i], this->num_,
+          this->channels_, this->height_, this->width_, NHWC);
+      cudnn::setTensor4dDesc<Dtype>(&top_descs_[i], this->num_,
+          this->num_output_, this->height_out_, this->width_out_, NHWC);
+    } else {
+      cudnn::setTensor4dDesc<Dtype>(&bottom_descs_[i],
+          this->num_,
+          this->channels_ / this->group_,
+          this->height_, this->width_,
+          this->channels_ * this->height_ * this->width_,
+          this->height_ * this->width_,
+          this->width_, 1);
+      cudnn::setTensor4dDesc<Dtype>(&top_descs_[i],
+          this->num_,
+          this->num_output_ / this->group_,
+          this->height_out_, this->width_out_,
+          this->num_output_ * this->height_out_ * this->width_out_,
+          this->height_out_ * this->width_out_,
+          this->width_out_, 1);
+    }
     cudnn::setConvolutionDesc<Dtype>(&conv_descs_[i], bottom_descs_[i],
         filter_desc_, this->pad_h_, this->pad_w_,
         this->stride_h_, this->stride_w_);
@@ -98,6 +100,126 @@ void CuDNNConvolutionLayer<Dtype>::Reshape(
     cudnn::setTensor4dDesc<Dtype>(&bias_desc_,
         1, this->num_output_ / this->group_, 1, 1);
   }
+
+  // Pick the forward algorithm again only when the shapes change.
+  int device;
+  CUDA_CHECK(cudaGetDevice(&device));
+  std::ostringstream key;
+  key << "cudnn" << CUDNN_VERSION << ":device" << device << ":"
+      << sizeof(Dtype) << ":" << this->num_ << "x" << this->channels_ << "x"
+      << this->height_ << "x" << this->width_ << ":" << this->group_ << "x"
+      << this->num_output_ << "x" << this->kernel_h_ << "x"
+      << this->kernel_w_ << ":pad" << this->pad_h_ << "x" << this->pad_w_
+      << ":stride" << this->stride_h_ << "x" << this->stride_w_;
+  if (key.str() != algo_key_) {
+    algo_key_ = key.str();
+    typename map<string, std::pair<cudnnConvolutionFwdAlgo_t, size_t> >::
+        const_iterator it = fwd_algos_.find(algo_key_);
+    if (it != fwd_algos_.end()) {
+      fwd_algo_ = it->second.first;
+      workspaceSizeInBytes = it->second.second;
+    } else {
+      SelectForwardAlgo(bottom, top);
+      fwd_algos_[algo_key_] = std::make_pair(fwd_algo_, workspaceSizeInBytes);
+    }
+  }
+}
+
+template <typename Dtype>
+void CuDNNConvolutionLayer<Dtype>::SelectForwardAlgo(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  // All bottoms have the same shape, and the groups the same descriptors.
+  if (this->layer_param_.convolution_param().cudnn_autotune()) {
+    int algo;
+    if (!cudnn::GetCachedAlgo(algo_key_, &algo)) {
+      algo = TuneForwardAlgo(bottom[0], top[0]);
+      cudnn::CacheAlgo(algo_key_, algo);
+    }
+    fwd_algo_ = static_cast<cudnnConvolutionFwdAlgo_t>(algo);
+  } else {
+    const size_t workspace_limit_bytes = this->kernel_h_ * this->kernel_w_
+        * this->channels_ * sizeof(int) + 1;
+    CUDNN_CHECK(cudnnGetConvolutionForwardAlgorithm(cudnn::SharedHandle(0),
+        bottom_descs_[0], filter_desc_, conv_descs_[0], top_descs_[0],
+        CUDNN_CONVOLUTION_FWD_SPECIFY_WORKSPACE_LIMIT, workspace_limit_bytes,
+        &fwd_algo_));
+  }
+
+  // get minimum size of the workspace needed for the desired algorithm, and
+  // grow the shared workspace to a part for each group as they run at the
+  // same time.
+  CUDNN_CHECK(cudnnGetConvolutionForwardWorkspaceSize(cudnn::SharedHandle(0),
+      bottom_descs_[0], filter_desc_, conv_descs_[0], top_descs_[0],
+      fwd_algo_, &workspaceSizeInBytes));
+  if (workspaceSizeInBytes > 0
+      && !cudnn::SharedWorkspace(workspaceSizeInBytes * this->group_)) {
+    // force zero memory path
+    fwd_algo_ = CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_GEMM;
+    workspaceSizeInBytes = 0;
+  }
+}
+
+template <typename Dtype>
+cudnnConvolutionFwdAlgo_t CuDNNConvolutionLayer<Dtype>::TuneForwardAlgo(
+    Blob<Dtype>* bottom, Blob<Dtype>* top) {
+  const Dtype* bottom_data = bottom->gpu_data();
+  const Dtype* weight = this->blobs_[0]->gpu_data();
+  Dtype* top_data = top->mutable_gpu_data();
+  cudnnHandle_t handle = cudnn::SharedHandle(0);
+  cudaStream_t stream = cudnn::SharedStream(0);
+  if (Caffe::cuda_stream()) {
+    // The bottom may still be computed on the stream of this thread.
+    CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+  }
+  cudaEvent_t start, stop;
+  CUDA_CHECK(cudaEventCreate(&start));
+  CUDA_CHECK(cudaEventCreate(&stop));
+  cudnnConvolutionFwdAlgo_t best = CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_GEMM;
+  float best_ms = -1;
+  for (int a = CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_GEMM;
+       a <= CUDNN_CONVOLUTION_FWD_ALGO_DIRECT; ++a) {
+    const cudnnConvolutionFwdAlgo_t algo =
+        static_cast<cudnnConvolutionFwdAlgo_t>(a);
+    // Algorithms that do not apply, or whose workspace does not fit, fail.
+    size_t workspace_size = 0;
+    void* workspace_data = NULL;
+    if (cudnnGetConvolutionForwardWorkspaceSize(handle, bottom_descs_[0],
+            filter_desc_, conv_descs_[0], top_descs_[0], algo,
+            &workspace_size) != CUDNN_STATUS_SUCCESS
+        || (workspace_size > 0 && CaffeMallocGPU(&workspace_data,
+            workspace_size) != cudaSuccess)) {
+      continue;
+    }
+    cudnnStatus_t status = CUDNN_STATUS_SUCCESS;
+    for (int r = 0; r <= kTuneRuns && status == CUDNN_STATUS_SUCCESS; ++r) {
+      if (r == 1) {
+        CUDA_CHECK(cudaEventRecord(start, stream));
+      }
+      status = cudnnConvolutionForward(handle,
+          cudnn::dataType<Dtype>::one, bottom_descs_[0], bottom_data,
+          filter_desc_, weight, conv_descs_[0], algo, workspace_data,
+          workspace_size, cudnn::dataType<Dtype>::zero, top_descs_[0],
+          top_data);
+    }
+    float ms = -1;
+    if (status == CUDNN_STATUS_SUCCESS) {
+      CUDA_CHECK(cudaEventRecord(stop, stream));
+      CUDA_CHECK(cudaEventSynchronize(stop));
+      CUDA_CHECK(cudaEventElapsedTime(&ms, start, stop));
+    }
+    CUDA_CHECK(cudaStreamSynchronize(stream));
+    CUDA_CHECK(CaffeFreeGPU(workspace_data));
+    if (ms >= 0 && (best_ms < 0 || ms < best_ms)) {
+      best = algo;
+      best_ms = ms;
+    }
+  }
+  CUDA_CHECK(cudaEventDestroy(start));
+  CUDA_CHECK(cudaEventDestroy(stop));
+  LOG(INFO) << "Autotuned " << this->layer_param_.name()
+            << ": forward algorithm " << best << " in "
+            << best_ms / kTuneRuns << " ms";
+  return best;
 }
 
 template <typename Dtype>
@@ -114,14 +236,6 @@ CuDNNConvolutionLayer<Dtype>::~CuDNNConvolutionLayer() {
     cudnnDestroyTensorDescriptor(bias_desc_);
   }
   cudnnDestroyFilterDescriptor(filter_desc_);
-
-  for (int g = 0; g < this->group_ * CUDNN_STREAMS_PER_GROUP; g++) {
-    cudaStreamDestroy(stream_[g]);
-    cudnnDestroy(handle_[g]);
-  }
-
-  delete [] stream_;
-  delete [] handle_;
 }
 
 INSTANTIATE_CLASS(CuDNNConvolutionLayer);
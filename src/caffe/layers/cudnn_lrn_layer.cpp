@@ -0,0 +1,51 @@
+#ifdef USE_CUDNN
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+
+#if CUDNN_VERSION_MIN(3, 0, 0)
+namespace caffe {
+
+template <typename Dtype>
+void CuDNNLRNLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  LRNLayer<Dtype>::LayerSetUp(bottom, top);
+  CHECK_EQ(this->layer_param_.lrn_param().norm_region(),
+      LRNParameter_NormRegion_ACROSS_CHANNELS)
+      << "CuDNN LRN only normalizes across channels.";
+  // initialize cuDNN
+  CUDNN_CHECK(cudnnCreate(&handle_));
+  cudnn::createLRNDesc<Dtype>(&norm_desc_, this->size_, this->alpha_,
+      this->beta_, this->k_);
+  cudnn::createTensor4dDesc<Dtype>(&bottom_desc_);
+  cudnn::createTensor4dDesc<Dtype>(&top_desc_);
+  handles_setup_ = true;
+}
+
+template <typename Dtype>
+void CuDNNLRNLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  LRNLayer<Dtype>::Reshape(bottom, top);
+  cudnn::setTensor4dDesc<Dtype>(&bottom_desc_, this->num_, this->channels_,
+      this->height_, this->width_);
+  cudnn::setTensor4dDesc<Dtype>(&top_desc_, this->num_, this->channels_,
+      this->height_, this->width_);
+}
+
+template <typename Dtype>
+CuDNNLRNLayer<Dtype>::~CuDNNLRNLayer() {
+  // Check that handles have been setup before destroying.
+  if (!handles_setup_) { return; }
+
+  cudnnDestroyTensorDescriptor(bottom_desc_);
+  cudnnDestroyTensorDescriptor(top_desc_);
+  cudnnDestroyLRNDescriptor(norm_desc_);
+  cudnnDestroy(handle_);
+}
+
+INSTANTIATE_CLASS(CuDNNLRNLayer);
+
+}  // namespace caffe
+#endif
+#endif
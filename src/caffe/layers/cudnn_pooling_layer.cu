@@ -14,6 +14,7 @@ void CuDNNPoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = top[0]->mutable_gpu_data();
+  CUDNN_CHECK(cudnnSetStream(handle_, Caffe::cuda_stream()));
   CUDNN_CHECK(cudnnPoolingForward(handle_, pooling_desc_,
         cudnn::dataType<Dtype>::one,
         bottom_desc_, bottom_data,
@@ -31,11 +32,13 @@ void CuDNNPoolingLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
   const Dtype* top_data = top[0]->gpu_data();
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
+  CUDNN_CHECK(cudnnSetStream(handle_, Caffe::cuda_stream()));
   CUDNN_CHECK(cudnnPoolingBackward(handle_, pooling_desc_,
         cudnn::dataType<Dtype>::one,
         top_desc_, top_data, top_desc_, top_diff,
         bottom_desc_, bottom_data,
-        cudnn::dataType<Dtype>::zero,
+        this->accumulate_bottom_diff(0) ? cudnn::dataType<Dtype>::one
+            : cudnn::dataType<Dtype>::zero,
         bottom_desc_, bottom_diff));
 }
 
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -38,8 +39,19 @@ void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   // Reshape top[0] and prefetch_data according to the batch_size.
   top_shape[0] = batch_size;
   top[0]->Reshape(top_shape);
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].data_.Reshape(top_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->data_.Reshape(top_shape);
+  }
+  if (this->gpu_transform_) {
+    Datum decoded = datum;
+    decode_raw(&decoded);
+    vector<int> params_shape(2, batch_size);
+    params_shape[1] = 3;
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->raw_.reset(new SyncedMemory(batch_size *
+          decoded.channels() * decoded.height() * decoded.width()));
+      this->prefetch_[i]->params_.Reshape(params_shape);
+    }
   }
   LOG(INFO) << "output data size: " << top[0]->num() << ","
       << top[0]->channels() << "," << top[0]->height() << ","
@@ -48,35 +60,57 @@ void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   if (this->output_labels_) {
     vector<int> label_shape(1, batch_size);
     top[1]->Reshape(label_shape);
-    for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-      this->prefetch_[i].label_.Reshape(label_shape);
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->label_.Reshape(label_shape);
     }
   }
 }
 
 // This function is called on prefetch thread
 template<typename Dtype>
-void DataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
+void DataLayer<Dtype>::load_batch(Batch<Dtype>* batch, int loader) {
   CPUTimer batch_timer;
   batch_timer.Start();
   double read_time = 0;
   double trans_time = 0;
   CPUTimer timer;
   CHECK(batch->data_.count());
-  CHECK(this->transformed_data_.count());
+  DataTransformer<Dtype>* transformer = this->transformer(loader);
+  Blob<Dtype>* transformed_data = this->transformed_data(loader);
+  CHECK(transformed_data->count());
+
+  // Take the datums of the batch, then transform them while other loaders
+  // take theirs
+  const int batch_size = this->layer_param_.data_param().batch_size();
+  vector<Datum*> datums(batch_size);
+  this->begin_read(loader);
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    timer.Start();
+    // get a datum
+    datums[item_id] = reader_.full().pop("Waiting for data");
+    read_time += timer.MicroSeconds();
+  }
+  this->end_read();
 
   // Reshape according to the first datum of each batch
   // on single input batches allows for inputs of varying dimension.
-  const int batch_size = this->layer_param_.data_param().batch_size();
-  Datum& datum = *(reader_.full().peek());
   // Use data_transformer to infer the expected blob shape from datum.
-  vector<int> top_shape = this->data_transformer_->InferBlobShape(datum);
-  this->transformed_data_.Reshape(top_shape);
+  vector<int> top_shape;
+  if (this->gpu_transform_) {
+    timer.Start();
+    load_raw(batch, datums, transformer, loader);
+    trans_time += timer.MicroSeconds();
+    top_shape = transformer->InferBlobShape(batch->raw_shape_);
+  } else {
+    top_shape = transformer->InferBlobShape(*datums[0]);
+  }
+  transformed_data->Reshape(top_shape);
   // Reshape batch according to the batch_size.
   top_shape[0] = batch_size;
   batch->data_.Reshape(top_shape);
 
-  Dtype* top_data = batch->data_.mutable_cpu_data();
+  Dtype* top_data = this->gpu_transform_ ? NULL :
+      batch->data_.mutable_cpu_data();
   Dtype* top_label = NULL;  // suppress warnings about uninitialized variables
 
   if (this->output_labels_) {
@@ -84,27 +118,91 @@ void DataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
   }
   for (int item_id = 0; item_id < batch_size; ++item_id) {
     timer.Start();
-    // get a datum
-    Datum& datum = *(reader_.full().pop("Waiting for data"));
-    read_time += timer.MicroSeconds();
-    timer.Start();
+    const Datum& datum = *datums[item_id];
     // Apply data transformations (mirror, scale, crop...)
-    int offset = batch->data_.offset(item_id);
-    this->transformed_data_.set_cpu_data(top_data + offset);
-    this->data_transformer_->Transform(datum, &(this->transformed_data_));
+    if (!this->gpu_transform_) {
+      int offset = batch->data_.offset(item_id);
+      transformed_data->set_cpu_data(top_data + offset);
+      transformer->Transform(datum, transformed_data);
+    }
     // Copy label.
     if (this->output_labels_) {
       top_label[item_id] = datum.label();
     }
     trans_time += timer.MicroSeconds();
 
-    reader_.free().push(const_cast<Datum*>(&datum));
+    reader_.free().push(datums[item_id]);
   }
   timer.Stop();
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
   DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
   DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  this->data_stats_.add(DataStats::TRANSFORM, trans_time);
+}
+
+template<typename Dtype>
+void DataLayer<Dtype>::decode_raw(Datum* datum) {
+  const TransformationParameter& param = this->transform_param_;
+  if (param.force_color() || param.force_gray()) {
+    DecodeDatum(datum, param.force_color());
+  } else {
+    DecodeDatumNative(datum);
+  }
+}
+
+// Copies the pixels of the datums to raw_, or decodes them there on the GPU
+// with gpu_decode, and draws their crops, leaving the rest of the
+// transformation to Forward_gpu
+template<typename Dtype>
+void DataLayer<Dtype>::load_raw(Batch<Dtype>* batch,
+    const vector<Datum*>& datums, DataTransformer<Dtype>* transformer,
+    int loader) {
+  vector<const string*> images;
+  for (int item_id = 0; item_id < datums.size(); ++item_id) {
+    if (datums[item_id]->encoded()) {
+      images.push_back(&datums[item_id]->data());
+    }
+  }
+  const TransformationParameter& param = this->transform_param_;
+  const int channels = param.force_color() ? 3 : param.force_gray() ? 1 : 0;
+  if (images.size() < datums.size() ||
+      !this->decode_raw_gpu(batch, images, channels, loader)) {
+    for (int item_id = 0; item_id < datums.size(); ++item_id) {
+      decode_raw(datums[item_id]);
+    }
+    vector<int> shape(3);
+    shape[0] = datums[0]->channels();
+    shape[1] = datums[0]->height();
+    shape[2] = datums[0]->width();
+    const size_t size = shape[0] * shape[1] * shape[2];
+    if (batch->raw_->size() < datums.size() * size) {
+      batch->raw_.reset(new SyncedMemory(datums.size() * size));
+    }
+    batch->raw_shape_ = shape;
+    uint8_t* raw = static_cast<uint8_t*>(batch->raw_->mutable_cpu_data());
+    for (int item_id = 0; item_id < datums.size(); ++item_id) {
+      const Datum& datum = *datums[item_id];
+      CHECK(datum.channels() == shape[0] && datum.height() == shape[1] &&
+            datum.width() == shape[2])
+          << "gpu_transform needs datums of the same size within a batch";
+      CHECK_EQ(datum.data().size(), size)
+          << "gpu_transform only supports uint8 data";
+      std::copy(datum.data().begin(), datum.data().end(),
+          raw + item_id * size);
+    }
+  }
+  const vector<int>& shape = batch->raw_shape_;
+  int* params = batch->params_.mutable_cpu_data();
+  for (int item_id = 0; item_id < datums.size(); ++item_id) {
+    transformer->TransformParams(shape[1], shape[2], params + item_id * 3);
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::collect_data_stats(DataStats* stats) {
+  BasePrefetchingDataLayer<Dtype>::collect_data_stats(stats);
+  stats->take(&reader_.stats());
 }
 
 INSTANTIATE_CLASS(DataLayer);
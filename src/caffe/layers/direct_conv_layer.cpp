@@ -0,0 +1,244 @@
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// Channels per block, as many floats as a vector register holds
+#ifdef __AVX512F__
+static const int kBlock = 16;
+#else
+static const int kBlock = 8;
+#endif
+// Neighboring outputs of a row whose sums are kept in registers together
+static const int kTileW = 4;
+
+template <typename Dtype>
+bool DirectConvolutionLayer<Dtype>::IsSupported(
+    const ConvolutionParameter& param) {
+  return param.group() == 1;
+}
+
+template <typename Dtype>
+void DirectConvolutionLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  ConvolutionLayer<Dtype>::LayerSetUp(bottom, top);
+  CHECK(IsSupported(this->layer_param_.convolution_param()))
+      << "DIRECT does not support groups";
+  CHECK(!this->quantized_ && !this->sparse_weights_)
+      << "DIRECT does not support quantization_param nor sparsity_param";
+}
+
+template <typename Dtype>
+void DirectConvolutionLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  ConvolutionLayer<Dtype>::Reshape(bottom, top);
+  blocks_in_ = (this->channels_ + kBlock - 1) / kBlock;
+  blocks_out_ = (this->num_output_ + kBlock - 1) / kBlock;
+  padded_h_ = this->height_ + 2 * this->pad_h_;
+  padded_w_ = this->width_ + 2 * this->pad_w_;
+  vector<int> shape(5);
+  shape[0] = this->num_;
+  shape[1] = blocks_in_;
+  shape[2] = padded_h_;
+  shape[3] = padded_w_;
+  shape[4] = kBlock;
+  input_blocks_.Reshape(shape);
+  shape[1] = blocks_out_;
+  shape[2] = this->height_out_;
+  shape[3] = this->width_out_;
+  output_blocks_.Reshape(shape);
+  shape.resize(6);
+  shape[0] = blocks_out_;
+  shape[1] = blocks_in_;
+  shape[2] = this->kernel_h_;
+  shape[3] = this->kernel_w_;
+  shape[4] = kBlock;
+  shape[5] = kBlock;
+  weight_blocks_.Reshape(shape);
+  shape.resize(2);
+  shape[0] = blocks_out_;
+  shape[1] = kBlock;
+  bias_blocks_.Reshape(shape);
+  // Shapes changed, so the blocks do
+  weight_memory_ = NULL;
+  bias_memory_ = NULL;
+}
+
+template <typename Dtype>
+void DirectConvolutionLayer<Dtype>::ReorderWeights() {
+  SyncedMemory* weight_memory = this->blobs_[0]->data().get();
+  if (weight_memory != weight_memory_
+      || weight_memory->version() != weight_version_) {
+    const int kernel_h = this->kernel_h_;
+    const int kernel_w = this->kernel_w_;
+    const int channels = this->channels_;
+    const Dtype* weights = this->blobs_[0]->cpu_data();
+    Dtype* blocks = weight_blocks_.mutable_cpu_data();
+    // Channels past the last filter or input channel stay zero
+    caffe_set(weight_blocks_.count(), Dtype(0), blocks);
+    for (int o = 0; o < this->num_output_; ++o) {
+      for (int c = 0; c < channels; ++c) {
+        for (int i = 0; i < kernel_h; ++i) {
+          for (int j = 0; j < kernel_w; ++j) {
+            blocks[((((o / kBlock * blocks_in_ + c / kBlock) * kernel_h + i)
+                * kernel_w + j) * kBlock + c % kBlock) * kBlock + o % kBlock] =
+                weights[((o * channels + c) * kernel_h + i) * kernel_w + j];
+          }
+        }
+      }
+    }
+    weight_memory_ = weight_memory;
+    weight_version_ = weight_memory->version();
+  }
+  if (!this->bias_term_) {
+    if (!bias_memory_) {
+      caffe_set(bias_blocks_.count(), Dtype(0),
+          bias_blocks_.mutable_cpu_data());
+      bias_memory_ = bias_blocks_.data().get();
+    }
+    return;
+  }
+  SyncedMemory* bias_memory = this->blobs_[1]->data().get();
+  if (bias_memory != bias_memory_
+      || bias_memory->version() != bias_version_) {
+    Dtype* blocks = bias_blocks_.mutable_cpu_data();
+    caffe_set(bias_blocks_.count(), Dtype(0), blocks);
+    caffe_copy(this->num_output_, this->blobs_[1]->cpu_data(), blocks);
+    bias_memory_ = bias_memory;
+    bias_version_ = bias_memory->version();
+  }
+}
+
+template <typename Dtype>
+void DirectConvolutionLayer<Dtype>::reorder_input_cpu(
+    const Dtype* bottom_data, Dtype* input, int begin, int end) {
+  const int height = this->height_;
+  const int width = this->width_;
+  for (int index = begin; index < end; ++index) {
+    const int n = index / blocks_in_;
+    const int c0 = (index % blocks_in_) * kBlock;
+    const int channels = std::min(kBlock, this->channels_ - c0);
+    Dtype* block = input + index * padded_h_ * padded_w_ * kBlock;
+    // The padding and the channels past the last
+    caffe_set(padded_h_ * padded_w_ * kBlock, Dtype(0), block);
+    for (int c = 0; c < channels; ++c) {
+      const Dtype* plane =
+          bottom_data + (n * this->channels_ + c0 + c) * height * width;
+      for (int h = 0; h < height; ++h) {
+        Dtype* row = block + ((h + this->pad_h_) * padded_w_ + this->pad_w_)
+            * kBlock + c;
+        for (int w = 0; w < width; ++w) {
+          row[w * kBlock] = plane[h * width + w];
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void DirectConvolutionLayer<Dtype>::forward_rows_cpu(const Dtype* input,
+    const Dtype* weights, const Dtype* bias, Dtype* output, int begin,
+    int end) {
+  const int kernel_h = this->kernel_h_;
+  const int kernel_w = this->kernel_w_;
+  const int stride_h = this->stride_h_;
+  const int stride_w = this->stride_w_;
+  const int height_out = this->height_out_;
+  const int width_out = this->width_out_;
+  const int input_block = padded_h_ * padded_w_ * kBlock;
+  const int weight_block = kernel_h * kernel_w * kBlock * kBlock;
+  const bool relu = this->fused_relu_;
+  const Dtype slope = this->relu_slope_;
+  Dtype sums[kTileW][kBlock];
+  for (int row = begin; row < end; ++row) {
+    const int h_out = row % height_out;
+    const int block_out = (row / height_out) % blocks_out_;
+    const int n = row / (height_out * blocks_out_);
+    Dtype* out = output + row * width_out * kBlock;
+    for (int w0 = 0; w0 < width_out; w0 += kTileW) {
+      const int tile = std::min(kTileW, width_out - w0);
+      for (int t = 0; t < tile; ++t) {
+        for (int o = 0; o < kBlock; ++o) {
+          sums[t][o] = bias[block_out * kBlock + o];
+        }
+      }
+      for (int block_in = 0; block_in < blocks_in_; ++block_in) {
+        const Dtype* in = input + (n * blocks_in_ + block_in) * input_block
+            + (h_out * stride_h * padded_w_ + w0 * stride_w) * kBlock;
+        const Dtype* filter = weights
+            + (block_out * blocks_in_ + block_in) * weight_block;
+        for (int i = 0; i < kernel_h; ++i) {
+          for (int j = 0; j < kernel_w; ++j, filter += kBlock * kBlock) {
+            const Dtype* window = in + (i * padded_w_ + j) * kBlock;
+            // Each input channel times its filters, into every output
+            for (int c = 0; c < kBlock; ++c) {
+              const Dtype* f = filter + c * kBlock;
+              for (int t = 0; t < tile; ++t) {
+                const Dtype x = window[t * stride_w * kBlock + c];
+                for (int o = 0; o < kBlock; ++o) {
+                  sums[t][o] += x * f[o];
+                }
+              }
+            }
+          }
+        }
+      }
+      for (int t = 0; t < tile; ++t) {
+        Dtype* pixel = out + (w0 + t) * kBlock;
+        for (int o = 0; o < kBlock; ++o) {
+          const Dtype sum = sums[t][o];
+          pixel[o] = (relu && sum < 0) ? sum * slope : sum;
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void DirectConvolutionLayer<Dtype>::reorder_output_cpu(
+    const Dtype* output, Dtype* top_data, int begin, int end) {
+  const int spatial_dim = this->height_out_ * this->width_out_;
+  for (int index = begin; index < end; ++index) {
+    const int n = index / blocks_out_;
+    const int o0 = (index % blocks_out_) * kBlock;
+    const int outputs = std::min(kBlock, this->num_output_ - o0);
+    const Dtype* block = output + index * spatial_dim * kBlock;
+    for (int o = 0; o < outputs; ++o) {
+      Dtype* plane = top_data + (n * this->num_output_ + o0 + o) * spatial_dim;
+      for (int p = 0; p < spatial_dim; ++p) {
+        plane[p] = block[p * kBlock + o];
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void DirectConvolutionLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  ReorderWeights();
+  Dtype* input = input_blocks_.mutable_cpu_data();
+  Dtype* output = output_blocks_.mutable_cpu_data();
+  for (int i = 0; i < bottom.size(); ++i) {
+    Caffe::thread_pool().run(this->num_ * blocks_in_, 1,
+        boost::bind(&DirectConvolutionLayer<Dtype>::reorder_input_cpu, this,
+                    bottom[i]->cpu_data(), input, _1, _2));
+    Caffe::thread_pool().run(this->num_ * blocks_out_ * this->height_out_, 1,
+        boost::bind(&DirectConvolutionLayer<Dtype>::forward_rows_cpu, this,
+                    input, weight_blocks_.cpu_data(),
+                    bias_blocks_.cpu_data(), output, _1, _2));
+    Caffe::thread_pool().run(this->num_ * blocks_out_, 1,
+        boost::bind(&DirectConvolutionLayer<Dtype>::reorder_output_cpu, this,
+                    output, top[i]->mutable_cpu_data(), _1, _2));
+  }
+}
+
+INSTANTIATE_CLASS(DirectConvolutionLayer);
+
+}  // namespace caffe
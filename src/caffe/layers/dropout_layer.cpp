@@ -1,11 +1,16 @@
 // TODO (sergeyk): effect should not be dependent on phase. wasted memcpy.
 
+#include <boost/bind.hpp>
+
+#include <algorithm>
 #include <vector>
 
 #include "caffe/common.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/syncedmem.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/philox.hpp"
+#include "caffe/util/thread_pool.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
@@ -25,9 +30,28 @@ template <typename Dtype>
 void DropoutLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   NeuronLayer<Dtype>::Reshape(bottom, top);
-  // Set up the cache for random number generation
-  rand_vec_.Reshape(bottom[0]->num(), bottom[0]->channels(),
-      bottom[0]->height(), bottom[0]->width());
+  // Set up the mask, a bit per input
+  vector<int> mask_shape(1, (bottom[0]->count() + 31) / 32);
+  rand_vec_.Reshape(mask_shape);
+}
+
+template <typename Dtype>
+void DropoutLayer<Dtype>::dropout_forward_cpu(const Dtype* bottom_data,
+    Dtype* top_data, int count, uint64_t key, int begin, int end) {
+  unsigned int* mask = rand_vec_.mutable_cpu_data();
+  // Values begin * 32 on of the stream read by philox_value
+  PhiloxRNG rng(key, 0, begin * 32);
+  for (int word = begin; word < end; ++word) {
+    const int first = word * 32;
+    const int last = std::min(first + 32, count);
+    unsigned int bits = 0;
+    for (int i = first; i < last; ++i) {
+      const unsigned int keep = rng() > uint_thres_;
+      bits |= keep << (i - first);
+      top_data[i] = bottom_data[i] * keep * scale_;
+    }
+    mask[word] = bits;
+  }
 }
 
 template <typename Dtype>
@@ -35,14 +59,14 @@ void DropoutLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = top[0]->mutable_cpu_data();
-  unsigned int* mask = rand_vec_.mutable_cpu_data();
   const int count = bottom[0]->count();
   if (this->phase_ == TRAIN) {
-    // Create random numbers
-    caffe_rng_bernoulli(count, 1. - threshold_, mask);
-    for (int i = 0; i < count; ++i) {
-      top_data[i] = bottom_data[i] * mask[i] * scale_;
-    }
+    // Each input draws the value of its index in the stream of a new key,
+    // the same as on GPU, whatever the number of threads
+    rand_vec_.mutable_cpu_data();  // synced before the threads use it
+    Caffe::thread_pool().run(rand_vec_.count(), kParallelGrain / 32,
+        boost::bind(&DropoutLayer<Dtype>::dropout_forward_cpu, this,
+                    bottom_data, top_data, count, caffe_rng_key(), _1, _2));
   } else {
     caffe_copy(bottom[0]->count(), bottom_data, top_data);
   }
@@ -59,7 +83,8 @@ void DropoutLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const unsigned int* mask = rand_vec_.cpu_data();
       const int count = bottom[0]->count();
       for (int i = 0; i < count; ++i) {
-        bottom_diff[i] = top_diff[i] * mask[i] * scale_;
+        const unsigned int keep = (mask[i / 32] >> (i % 32)) & 1;
+        bottom_diff[i] = top_diff[i] * keep * scale_;
       }
     } else {
       caffe_copy(top[0]->count(), top_diff, bottom_diff);
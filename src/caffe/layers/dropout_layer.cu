@@ -6,17 +6,38 @@
 #include "caffe/layer.hpp"
 #include "caffe/syncedmem.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/philox.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
 
+// The votes of the lanes of a warp, lane i giving bit i
+__device__ inline unsigned int dropout_ballot(const bool vote) {
+#if CUDA_VERSION >= 9000
+  return __ballot_sync(0xffffffff, vote);
+#else
+  return __ballot(vote);
+#endif
+}
 
+// Draws whether to keep each input from the value of its index in the
+// Philox stream of key, as Forward_cpu does, and packs the mask with a warp
+// vote. words * 32 threads run, a whole number of warps, so that all the
+// lanes of a warp vote together.
 template <typename Dtype>
-__global__ void DropoutForward(const int n, const Dtype* in,
-    const unsigned int* mask, const unsigned int threshold, const float scale,
-    Dtype* out) {
-  CUDA_KERNEL_LOOP(index, n) {
-    out[index] = in[index] * (mask[index] > threshold) * scale;
+__global__ void DropoutForward(const int n, const int words, const Dtype* in,
+    const uint64_t key, const unsigned int threshold, const float scale,
+    Dtype* out, unsigned int* mask) {
+  CUDA_KERNEL_LOOP(index, words * 32) {
+    bool keep = false;
+    if (index < n) {
+      keep = philox_value(key, index) > threshold;
+      out[index] = in[index] * keep * scale;
+    }
+    const unsigned int bits = dropout_ballot(keep);
+    if (index % 32 == 0) {
+      mask[index / 32] = bits;
+    }
   }
 }
 
@@ -27,13 +48,12 @@ void DropoutLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
   Dtype* top_data = top[0]->mutable_gpu_data();
   const int count = bottom[0]->count();
   if (this->phase_ == TRAIN) {
-    unsigned int* mask =
-        static_cast<unsigned int*>(rand_vec_.mutable_gpu_data());
-    caffe_gpu_rng_uniform(count, mask);
-    // set thresholds
+    unsigned int* mask = rand_vec_.mutable_gpu_data();
+    const int words = rand_vec_.count();
     // NOLINT_NEXT_LINE(whitespace/operators)
-    DropoutForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-        count, bottom_data, mask, uint_thres_, scale_, top_data);
+    DropoutForward<Dtype><<<CAFFE_GET_BLOCKS(words * 32),
+        CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count, words,
+        bottom_data, caffe_rng_key(), uint_thres_, scale_, top_data, mask);
     CUDA_POST_KERNEL_CHECK;
   } else {
     caffe_copy(count, bottom_data, top_data);
@@ -42,10 +62,10 @@ void DropoutLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
 
 template <typename Dtype>
 __global__ void DropoutBackward(const int n, const Dtype* in_diff,
-    const unsigned int* mask, const unsigned int threshold, const float scale,
-    Dtype* out_diff) {
+    const unsigned int* mask, const float scale, Dtype* out_diff) {
   CUDA_KERNEL_LOOP(index, n) {
-    out_diff[index] = in_diff[index] * scale * (mask[index] > threshold);
+    const unsigned int keep = (mask[index / 32] >> (index % 32)) & 1;
+    out_diff[index] = in_diff[index] * scale * keep;
   }
 }
 
@@ -57,13 +77,12 @@ void DropoutLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const Dtype* top_diff = top[0]->gpu_diff();
     Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
     if (this->phase_ == TRAIN) {
-      const unsigned int* mask =
-          static_cast<const unsigned int*>(rand_vec_.gpu_data());
+      const unsigned int* mask = rand_vec_.gpu_data();
       const int count = bottom[0]->count();
       // NOLINT_NEXT_LINE(whitespace/operators)
       DropoutBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
-        CAFFE_CUDA_NUM_THREADS>>>(
-          count, top_diff, mask, uint_thres_, scale_, bottom_diff);
+        CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+          count, top_diff, mask, scale_, bottom_diff);
       CUDA_POST_KERNEL_CHECK;
     } else {
       caffe_copy(top[0]->count(), top_diff, bottom_diff);
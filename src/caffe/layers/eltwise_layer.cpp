@@ -1,8 +1,11 @@
-#include <cfloat>
+#include <boost/bind.hpp>
+
+#include <algorithm>
 #include <vector>
 
 #include "caffe/layer.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
@@ -33,62 +36,55 @@ void EltwiseLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   for (int i = 1; i < bottom.size(); ++i) {
     CHECK(bottom[i]->shape() == bottom[0]->shape());
+    CHECK_EQ(bottom[0]->layout(), bottom[i]->layout())
+        << "All inputs must have the same layout.";
   }
   top[0]->ReshapeLike(*bottom[0]);
-  // If max operation, we will initialize the vector index part.
-  if (this->layer_param_.eltwise_param().operation() ==
-      EltwiseParameter_EltwiseOp_MAX && top.size() == 1) {
-    max_idx_.Reshape(bottom[0]->shape());
-  }
 }
 
 template <typename Dtype>
-void EltwiseLayer<Dtype>::Forward_cpu(
-    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  int* mask = NULL;
+void EltwiseLayer<Dtype>::eltwise_forward_cpu(
+    const vector<const Dtype*>& bottom_data, Dtype* top_data, int begin,
+    int end) {
+  const int count = end - begin;
   const Dtype* bottom_data_a = NULL;
   const Dtype* bottom_data_b = NULL;
-  const int count = top[0]->count();
-  Dtype* top_data = top[0]->mutable_cpu_data();
+  top_data += begin;
   switch (op_) {
   case EltwiseParameter_EltwiseOp_PROD:
-    caffe_mul(count, bottom[0]->cpu_data(), bottom[1]->cpu_data(), top_data);
-    for (int i = 2; i < bottom.size(); ++i) {
-      caffe_mul(count, top_data, bottom[i]->cpu_data(), top_data);
+    caffe_mul(count, bottom_data[0] + begin, bottom_data[1] + begin,
+        top_data);
+    for (int i = 2; i < bottom_data.size(); ++i) {
+      caffe_mul(count, top_data, bottom_data[i] + begin, top_data);
     }
     break;
   case EltwiseParameter_EltwiseOp_SUM:
-    caffe_set(count, Dtype(0), top_data);
+    // In place, the first bottom is scaled rather than added.
+    if (bottom_data[0] + begin == top_data) {
+      if (coeffs_[0] != Dtype(1)) {
+        caffe_scal(count, coeffs_[0], top_data);
+      }
+    } else {
+      caffe_set(count, Dtype(0), top_data);
+      caffe_axpy(count, coeffs_[0], bottom_data[0] + begin, top_data);
+    }
     // TODO(shelhamer) does BLAS optimize to sum for coeff = 1?
-    for (int i = 0; i < bottom.size(); ++i) {
-      caffe_axpy(count, coeffs_[i], bottom[i]->cpu_data(), top_data);
+    for (int i = 1; i < bottom_data.size(); ++i) {
+      caffe_axpy(count, coeffs_[i], bottom_data[i] + begin, top_data);
     }
     break;
   case EltwiseParameter_EltwiseOp_MAX:
-    // Initialize
-    mask = max_idx_.mutable_cpu_data();
-    caffe_set(count, -1, mask);
-    caffe_set(count, Dtype(-FLT_MAX), top_data);
     // bottom 0 & 1
-    bottom_data_a = bottom[0]->cpu_data();
-    bottom_data_b = bottom[1]->cpu_data();
+    bottom_data_a = bottom_data[0] + begin;
+    bottom_data_b = bottom_data[1] + begin;
     for (int idx = 0; idx < count; ++idx) {
-      if (bottom_data_a[idx] > bottom_data_b[idx]) {
-        top_data[idx] = bottom_data_a[idx];  // maxval
-        mask[idx] = 0;  // maxid
-      } else {
-        top_data[idx] = bottom_data_b[idx];  // maxval
-        mask[idx] = 1;  // maxid
-      }
+      top_data[idx] = std::max(bottom_data_a[idx], bottom_data_b[idx]);
     }
     // bottom 2++
-    for (int blob_idx = 2; blob_idx < bottom.size(); ++blob_idx) {
-      bottom_data_b = bottom[blob_idx]->cpu_data();
+    for (int blob_idx = 2; blob_idx < bottom_data.size(); ++blob_idx) {
+      bottom_data_b = bottom_data[blob_idx] + begin;
       for (int idx = 0; idx < count; ++idx) {
-        if (bottom_data_b[idx] > top_data[idx]) {
-          top_data[idx] = bottom_data_b[idx];  // maxval
-          mask[idx] = blob_idx;  // maxid
-        }
+        top_data[idx] = std::max(top_data[idx], bottom_data_b[idx]);
       }
     }
     break;
@@ -97,14 +93,56 @@ void EltwiseLayer<Dtype>::Forward_cpu(
   }
 }
 
+template <typename Dtype>
+void EltwiseLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  vector<const Dtype*> bottom_data(bottom.size());
+  for (int i = 0; i < bottom.size(); ++i) {
+    bottom_data[i] = bottom[i]->cpu_data();
+  }
+  Caffe::thread_pool().run(top[0]->count(), kParallelGrain,
+      boost::bind(&EltwiseLayer<Dtype>::eltwise_forward_cpu, this,
+                  boost::cref(bottom_data), top[0]->mutable_cpu_data(),
+                  _1, _2));
+}
+
 template <typename Dtype>
 void EltwiseLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
-  const int* mask = NULL;
   const int count = top[0]->count();
   const Dtype* top_data = top[0]->cpu_data();
   const Dtype* top_diff = top[0]->cpu_diff();
-  for (int i = 0; i < bottom.size(); ++i) {
+  if (op_ == EltwiseParameter_EltwiseOp_MAX) {
+    vector<const Dtype*> bottom_data(bottom.size());
+    vector<Dtype*> bottom_diff(bottom.size(), static_cast<Dtype*>(NULL));
+    for (int i = 0; i < bottom.size(); ++i) {
+      bottom_data[i] = bottom[i]->cpu_data();
+      if (propagate_down[i]) {
+        bottom_diff[i] = bottom[i]->mutable_cpu_diff();
+      }
+    }
+    // Each output reads the bottoms after the first one until it finds
+    // itself, and its diff is read before the first bottom's, which it may
+    // be, is written.
+    for (int index = 0; index < count; ++index) {
+      const Dtype diff = top_diff[index];
+      int max_idx = 0;
+      for (int i = 1; i < bottom.size(); ++i) {
+        if (bottom_data[i][index] == top_data[index]) {
+          max_idx = i;
+          break;
+        }
+      }
+      for (int i = 0; i < bottom.size(); ++i) {
+        if (bottom_diff[i]) {
+          bottom_diff[i][index] = i == max_idx ? diff : Dtype(0);
+        }
+      }
+    }
+    return;
+  }
+  // The first bottom comes last, as it shares its diff with the top in place.
+  for (int i = bottom.size() - 1; i >= 0; --i) {
     if (propagate_down[i]) {
       const Dtype* bottom_data = bottom[i]->cpu_data();
       Dtype* bottom_diff = bottom[i]->mutable_cpu_diff();
@@ -128,22 +166,14 @@ void EltwiseLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
         caffe_mul(count, bottom_diff, top_diff, bottom_diff);
         break;
       case EltwiseParameter_EltwiseOp_SUM:
-        if (coeffs_[i] == Dtype(1)) {
+        if (this->accumulate_bottom_diff(i)) {
+          caffe_axpy(count, coeffs_[i], top_diff, bottom_diff);
+        } else if (coeffs_[i] == Dtype(1)) {
           caffe_copy(count, top_diff, bottom_diff);
         } else {
           caffe_cpu_scale(count, coeffs_[i], top_diff, bottom_diff);
         }
         break;
-      case EltwiseParameter_EltwiseOp_MAX:
-        mask = max_idx_.cpu_data();
-        for (int index = 0; index < count; ++index) {
-          Dtype gradient = 0;
-          if (mask[index] == i) {
-            gradient += top_diff[index];
-          }
-          bottom_diff[index] = gradient;
-        }
-        break;
       default:
         LOG(FATAL) << "Unknown elementwise operation.";
       }
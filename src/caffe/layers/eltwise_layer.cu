@@ -1,4 +1,4 @@
-#include <cfloat>
+#include <algorithm>
 #include <vector>
 
 #include "caffe/layer.hpp"
@@ -7,125 +7,178 @@
 
 namespace caffe {
 
+// The bottoms a kernel reads, passed by value rather than through device
+// memory, with their diffs, coefficients and whether to add to the diffs.
+const int kEltwiseMaxBottoms = 32;
+
+template <typename Dtype>
+struct EltwiseBottoms {
+  const Dtype* data[kEltwiseMaxBottoms];
+  Dtype* diff[kEltwiseMaxBottoms];
+  Dtype coeff[kEltwiseMaxBottoms];
+  bool accumulate[kEltwiseMaxBottoms];
+};
+
+// Combines the num bottoms into the top in one pass, folding them into the
+// top rather than the first of them when from_top, for the bottoms after the
+// first kEltwiseMaxBottoms. In place, the first bottom is the top.
 template <typename Dtype>
-__global__ void MaxForward(const int nthreads, const Dtype* bottom_data_a,
-    const Dtype* bottom_data_b, const int blob_idx, Dtype* top_data,
-    int* mask) {
+__global__ void EltwiseForward(const int nthreads, const int op,
+    const int num, const bool from_top, const EltwiseBottoms<Dtype> bottoms,
+    Dtype* top_data) {
   CUDA_KERNEL_LOOP(index, nthreads) {
-    Dtype maxval = -FLT_MAX;
-    int maxidx = -1;
-    if (bottom_data_a[index] > bottom_data_b[index]) {
-      // only update for very first bottom_data blob (blob_idx == 0)
-      if (blob_idx == 0) {
-        maxval = bottom_data_a[index];
-        top_data[index] = maxval;
-        maxidx = blob_idx;
-        mask[index] = maxidx;
-      }
+    int i = 0;
+    Dtype value;
+    if (from_top) {
+      value = top_data[index];
     } else {
-      maxval = bottom_data_b[index];
-      top_data[index] = maxval;
-      maxidx = blob_idx + 1;
-      mask[index] = maxidx;
+      value = bottoms.data[0][index];
+      if (op == EltwiseParameter_EltwiseOp_SUM) {
+        value *= bottoms.coeff[0];
+      }
+      i = 1;
+    }
+    for (; i < num; ++i) {
+      const Dtype x = bottoms.data[i][index];
+      if (op == EltwiseParameter_EltwiseOp_PROD) {
+        value *= x;
+      } else if (op == EltwiseParameter_EltwiseOp_SUM) {
+        value += bottoms.coeff[i] * x;
+      } else {
+        value = max(value, x);
+      }
+    }
+    top_data[index] = value;
+  }
+}
+
+// Fills the bottoms [begin, end) for a kernel, with the diffs of those to
+// propagate down to, none in forward.
+template <typename Dtype>
+static EltwiseBottoms<Dtype> GetEltwiseBottoms(
+    const vector<Blob<Dtype>*>& bottom, const vector<Dtype>& coeffs,
+    int begin, int end, const vector<bool>& propagate_down,
+    const vector<bool>& accumulate) {
+  EltwiseBottoms<Dtype> bottoms;
+  for (int i = begin; i < end; ++i) {
+    bottoms.data[i - begin] = bottom[i]->gpu_data();
+    bottoms.coeff[i - begin] = coeffs[i];
+    bottoms.diff[i - begin] = NULL;
+    bottoms.accumulate[i - begin] = false;
+    if (i < propagate_down.size() && propagate_down[i]) {
+      bottoms.diff[i - begin] = bottom[i]->mutable_gpu_diff();
+      bottoms.accumulate[i - begin] = accumulate[i];
     }
   }
+  return bottoms;
 }
 
 template <typename Dtype>
 void EltwiseLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
-  int* mask = NULL;
   const int count = top[0]->count();
   Dtype* top_data = top[0]->mutable_gpu_data();
-  switch (op_) {
-  case EltwiseParameter_EltwiseOp_PROD:
-    caffe_gpu_mul(count, bottom[0]->gpu_data(), bottom[1]->gpu_data(),
-        top_data);
-    for (int i = 2; i < bottom.size(); ++i) {
-      caffe_gpu_mul(count, top_data, bottom[i]->gpu_data(), top_data);
-    }
-    break;
-  case EltwiseParameter_EltwiseOp_SUM:
-    caffe_gpu_set(count, Dtype(0.), top_data);
-    // TODO(shelhamer) does cuBLAS optimize to sum for coeff = 1?
-    for (int i = 0; i < bottom.size(); ++i) {
-      caffe_gpu_axpy(count, coeffs_[i], bottom[i]->gpu_data(), top_data);
-    }
-    break;
-  case EltwiseParameter_EltwiseOp_MAX:
-    mask = max_idx_.mutable_gpu_data();
+  for (int begin = 0; begin < bottom.size(); begin += kEltwiseMaxBottoms) {
+    const int end = std::min(begin + kEltwiseMaxBottoms,
+        static_cast<int>(bottom.size()));
     // NOLINT_NEXT_LINE(whitespace/operators)
-    MaxForward<Dtype> <<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-        count, bottom[0]->gpu_data(), bottom[1]->gpu_data(), 0, top_data, mask);
-    for (int i = 2; i < bottom.size(); ++i) {
-      // NOLINT_NEXT_LINE(whitespace/operators)
-      MaxForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-          count, top_data, bottom[i]->gpu_data(), i-1, top_data, mask);
-    }
-    break;
-  default:
-    LOG(FATAL) << "Unknown elementwise operation.";
+    EltwiseForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+        0, Caffe::cuda_stream()>>>(count, op_, end - begin, begin > 0,
+        GetEltwiseBottoms(bottom, coeffs_, begin, end, vector<bool>(),
+        vector<bool>()), top_data);
+    CUDA_POST_KERNEL_CHECK;
   }
 }
 
+// Writes the diffs of the num bottoms in one pass over the top diff. SUM
+// scales it by their coefficients. MAX passes it to the first bottom after
+// the first one equal to the top, or else to the first one. The top diff is
+// read before the first bottom's diff, which it is in place, is written.
 template <typename Dtype>
-__global__ void MaxBackward(const int nthreads, const Dtype* top_diff,
-    const int blob_idx, const int* mask, Dtype* bottom_diff) {
+__global__ void EltwiseBackward(const int nthreads, const int op,
+    const int num, const EltwiseBottoms<Dtype> bottoms, const Dtype* top_data,
+    const Dtype* top_diff) {
   CUDA_KERNEL_LOOP(index, nthreads) {
-    Dtype gradient = 0;
-    if (mask[index] == blob_idx) {
-      gradient += top_diff[index];
+    const Dtype diff = top_diff[index];
+    int max_idx = 0;
+    if (op == EltwiseParameter_EltwiseOp_MAX) {
+      for (int i = 1; i < num; ++i) {
+        if (bottoms.data[i][index] == top_data[index]) {
+          max_idx = i;
+          break;
+        }
+      }
+    }
+    for (int i = 0; i < num; ++i) {
+      if (bottoms.diff[i]) {
+        Dtype gradient;
+        if (op == EltwiseParameter_EltwiseOp_SUM) {
+          gradient = bottoms.coeff[i] * diff;
+        } else {
+          gradient = i == max_idx ? diff : Dtype(0);
+        }
+        if (bottoms.accumulate[i]) {
+          gradient += bottoms.diff[i][index];
+        }
+        bottoms.diff[i][index] = gradient;
+      }
     }
-    bottom_diff[index] = gradient;
   }
 }
 
 template <typename Dtype>
 void EltwiseLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
-  const int* mask = NULL;
   const int count = top[0]->count();
   const Dtype* top_data = top[0]->gpu_data();
   const Dtype* top_diff = top[0]->gpu_diff();
-  for (int i = 0; i < bottom.size(); ++i) {
+  if (op_ != EltwiseParameter_EltwiseOp_PROD) {
+    // MAX looks for the output among all the bottoms at once.
+    CHECK(op_ == EltwiseParameter_EltwiseOp_SUM
+        || static_cast<int>(bottom.size()) <= kEltwiseMaxBottoms)
+        << "Eltwise MAX backward takes at most " << kEltwiseMaxBottoms
+        << " bottoms on the GPU.";
+    vector<bool> accumulate(bottom.size());
+    for (int i = 0; i < bottom.size(); ++i) {
+      accumulate[i] = this->accumulate_bottom_diff(i);
+    }
+    // The first bottoms come last, as the first shares its diff with the top
+    // in place.
+    const int chunks = (bottom.size() - 1) / kEltwiseMaxBottoms;
+    for (int begin = chunks * kEltwiseMaxBottoms; begin >= 0;
+         begin -= kEltwiseMaxBottoms) {
+      const int end = std::min(begin + kEltwiseMaxBottoms,
+          static_cast<int>(bottom.size()));
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      EltwiseBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count, op_,
+          end - begin, GetEltwiseBottoms(bottom, coeffs_, begin, end,
+          propagate_down, accumulate), top_data, top_diff);
+      CUDA_POST_KERNEL_CHECK;
+    }
+    return;
+  }
+  // The first bottom comes last, as it shares its diff with the top in place.
+  for (int i = bottom.size() - 1; i >= 0; --i) {
     if (propagate_down[i]) {
       const Dtype* bottom_data = bottom[i]->gpu_data();
       Dtype* bottom_diff = bottom[i]->mutable_gpu_diff();
-      switch (op_) {
-      case EltwiseParameter_EltwiseOp_PROD:
-        if (stable_prod_grad_) {
-          bool initialized = false;
-          for (int j = 0; j < bottom.size(); ++j) {
-            if (i == j) { continue; }
-            if (!initialized) {
-              caffe_copy(count, bottom[j]->gpu_data(), bottom_diff);
-              initialized = true;
-            } else {
-              caffe_gpu_mul(count, bottom[j]->gpu_data(), bottom_diff,
-                            bottom_diff);
-            }
+      if (stable_prod_grad_) {
+        bool initialized = false;
+        for (int j = 0; j < bottom.size(); ++j) {
+          if (i == j) { continue; }
+          if (!initialized) {
+            caffe_copy(count, bottom[j]->gpu_data(), bottom_diff);
+            initialized = true;
+          } else {
+            caffe_gpu_mul(count, bottom[j]->gpu_data(), bottom_diff,
+                          bottom_diff);
           }
-        } else {
-          caffe_gpu_div(count, top_data, bottom_data, bottom_diff);
-        }
-        caffe_gpu_mul(count, bottom_diff, top_diff, bottom_diff);
-        break;
-      case EltwiseParameter_EltwiseOp_SUM:
-        if (coeffs_[i] == Dtype(1.)) {
-          caffe_copy(count, top_diff, bottom_diff);
-        } else {
-          caffe_gpu_scale(count, coeffs_[i], top_diff, bottom_diff);
         }
-        break;
-      case EltwiseParameter_EltwiseOp_MAX:
-        mask = max_idx_.gpu_data();
-        MaxBackward<Dtype>  // NOLINT_NEXT_LINE(whitespace/operators)
-            <<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-            count, top_diff, i, mask, bottom_diff);
-        break;
-      default:
-        LOG(FATAL) << "Unknown elementwise operation.";
+      } else {
+        caffe_gpu_div(count, top_data, bottom_data, bottom_diff);
       }
+      caffe_gpu_mul(count, bottom_diff, top_diff, bottom_diff);
     }
   }
 }
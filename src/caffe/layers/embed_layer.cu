@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/common_layers.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+__global__ void EmbedForward(const int nthreads, const Dtype* bottom_data,
+    const Dtype* weight, const int N, Dtype* top_data) {
+  CUDA_KERNEL_LOOP(top_index, nthreads) {
+    const int n = top_index / N;
+    const int d = top_index % N;
+    const int index = static_cast<int>(bottom_data[n]);
+    top_data[top_index] = weight[index * N + d];
+  }
+}
+
+// Each element of a touched row sums the gradient of the items of the row.
+template <typename Dtype>
+__global__ void EmbedBackward(const int nthreads, const int N,
+    const int* rows, const int* starts, const int* items,
+    const Dtype* top_diff, Dtype* weight_diff) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int group = index / N;
+    const int d = index % N;
+    Dtype sum = 0;
+    for (int i = starts[group]; i < starts[group + 1]; ++i) {
+      sum += top_diff[items[i] * N + d];
+    }
+    weight_diff[rows[group] * N + d] += sum;
+  }
+}
+
+template <typename Dtype>
+void EmbedLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const Dtype* bottom_data = bottom[0]->gpu_data();
+  Dtype* top_data = top[0]->mutable_gpu_data();
+  const Dtype* weight = this->blobs_[0]->gpu_data();
+  const int count = top[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  EmbedForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+      0, Caffe::cuda_stream()>>>(count, bottom_data, weight, N_, top_data);
+  CUDA_POST_KERNEL_CHECK;
+  if (bias_term_) {
+    caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, N_, 1, Dtype(1),
+        bias_multiplier_.gpu_data(), this->blobs_[1]->gpu_data(), Dtype(1),
+        top_data);
+  }
+}
+
+template <typename Dtype>
+void EmbedLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  CHECK(!propagate_down[0]) << "Can't backpropagate to EmbedLayer input.";
+  const Dtype* top_diff = top[0]->gpu_diff();
+  if (this->param_propagate_down_[0]) {
+    // The rows are needed on the host anyway, to record them
+    const Dtype* bottom_data = bottom[0]->cpu_data();
+    AddRows(bottom_data);
+    vector<pair<int, int> > pairs(M_);
+    for (int n = 0; n < M_; ++n) {
+      pairs[n] = make_pair(static_cast<int>(bottom_data[n]), n);
+    }
+    std::sort(pairs.begin(), pairs.end());
+    group_items_.Reshape(vector<int>(1, std::max(M_, 1)));
+    group_starts_.Reshape(vector<int>(1, M_ + 1));
+    group_rows_.Reshape(vector<int>(1, std::max(M_, 1)));
+    int* items = group_items_.mutable_cpu_data();
+    int* starts = group_starts_.mutable_cpu_data();
+    int* rows = group_rows_.mutable_cpu_data();
+    int groups = 0;
+    for (int i = 0; i < M_; ++i) {
+      if (i == 0 || pairs[i].first != pairs[i - 1].first) {
+        rows[groups] = pairs[i].first;
+        starts[groups++] = i;
+      }
+      items[i] = pairs[i].second;
+    }
+    starts[groups] = M_;
+    const int count = groups * N_;
+    if (count > 0) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      EmbedBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+          0, Caffe::cuda_stream()>>>(count, N_, group_rows_.gpu_data(),
+          group_starts_.gpu_data(), group_items_.gpu_data(), top_diff,
+          this->blobs_[0]->mutable_gpu_diff());
+      CUDA_POST_KERNEL_CHECK;
+    }
+  }
+  if (bias_term_ && this->param_propagate_down_[1]) {
+    Dtype* bias_diff = this->blobs_[1]->mutable_gpu_diff();
+    caffe_gpu_gemv<Dtype>(CblasTrans, M_, N_, Dtype(1), top_diff,
+        bias_multiplier_.gpu_data(), Dtype(1), bias_diff);
+  }
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(EmbedLayer);
+
+}  // namespace caffe
@@ -34,11 +34,16 @@ void ExpLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   const int count = bottom[0]->count();
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = top[0]->mutable_cpu_data();
-  if (inner_scale_ == Dtype(1)) {
-    caffe_exp(count, bottom_data, top_data);
-  } else {
+  const bool approximate = this->layer_param_.approximate_math();
+  const Dtype* exp_data = bottom_data;
+  if (inner_scale_ != Dtype(1)) {
     caffe_cpu_scale(count, inner_scale_, bottom_data, top_data);
-    caffe_exp(count, top_data, top_data);
+    exp_data = top_data;
+  }
+  if (approximate) {
+    caffe_approx_exp(count, exp_data, top_data);
+  } else {
+    caffe_exp(count, exp_data, top_data);
   }
   if (outer_scale_ != Dtype(1)) {
     caffe_scal(count, outer_scale_, top_data);
@@ -13,11 +13,16 @@ void ExpLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
   const int count = bottom[0]->count();
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = top[0]->mutable_gpu_data();
-  if (inner_scale_ == Dtype(1)) {
-    caffe_gpu_exp(count, bottom_data, top_data);
-  } else {
+  const bool approximate = this->layer_param_.approximate_math();
+  const Dtype* exp_data = bottom_data;
+  if (inner_scale_ != Dtype(1)) {
     caffe_gpu_scale(count, inner_scale_, bottom_data, top_data);
-    caffe_gpu_exp(count, top_data, top_data);
+    exp_data = top_data;
+  }
+  if (approximate) {
+    caffe_gpu_approx_exp(count, exp_data, top_data);
+  } else {
+    caffe_gpu_exp(count, exp_data, top_data);
   }
   if (outer_scale_ != Dtype(1)) {
     caffe_gpu_scal(count, outer_scale_, top_data);
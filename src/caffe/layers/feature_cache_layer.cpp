@@ -0,0 +1,149 @@
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void FeatureCacheLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const FeatureCacheParameter& param =
+      this->layer_param_.feature_cache_param();
+  CHECK_GT(param.items(), 0) << "FeatureCache needs the number of items of "
+      << "an epoch";
+  items_ = param.items();
+  filled_ = 0;
+  position_ = 0;
+  for (int i = 0; i < bottom.size(); ++i) {
+    CHECK_NE(top[i], bottom[i]) << this->type() << " Layer does not "
+        "allow in-place computation.";
+  }
+  if (!param.source().empty()) {
+    db_.reset(db::GetDB(param.backend()));
+    db_->Open(param.source(), db::NEW);
+    return;
+  }
+  cache_.resize(bottom.size());
+  for (int i = 0; i < bottom.size(); ++i) {
+    vector<int> shape = bottom[i]->shape();
+    shape[0] = items_;
+    cache_[i].reset(new Blob<Dtype>(shape));
+  }
+}
+
+template <typename Dtype>
+void FeatureCacheLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  for (int i = 0; i < bottom.size(); ++i) {
+    CHECK_EQ(bottom[i]->num(), bottom[0]->num())
+        << "The bottoms must have the same number of items";
+    CHECK(cache_.empty() || bottom[i]->count(1) == cache_[i]->count(1))
+        << "The items of the bottoms must keep their shape";
+    top[i]->ReshapeLike(*bottom[i]);
+  }
+}
+
+template <typename Dtype>
+void FeatureCacheLayer<Dtype>::Store(const vector<Blob<Dtype>*>& top, int n,
+    int position, db::Transaction* txn) {
+  if (!txn) {
+    for (int i = 0; i < top.size(); ++i) {
+      const int dim = top[i]->count(1);
+      caffe_copy(dim, top[i]->cpu_data() + n * dim,
+          cache_[i]->mutable_cpu_data() + position * dim);
+    }
+    return;
+  }
+  Datum datum;
+  for (int i = 0; i < top.size(); ++i) {
+    const int dim = top[i]->count(1);
+    const Dtype* data = top[i]->cpu_data() + n * dim;
+    for (int k = 0; k < dim; ++k) {
+      datum.add_float_data(data[k]);
+    }
+  }
+  char key[16];
+  snprintf(key, sizeof(key), "%08d", position);
+  string value;
+  datum.SerializeToString(&value);
+  txn->Put(key, value);
+}
+
+template <typename Dtype>
+void FeatureCacheLayer<Dtype>::Load(const vector<Blob<Dtype>*>& top, int n,
+    int position) {
+  if (!db_) {
+    for (int i = 0; i < top.size(); ++i) {
+      const int dim = top[i]->count(1);
+      caffe_copy(dim, cache_[i]->cpu_data() + position * dim,
+          top[i]->mutable_cpu_data() + n * dim);
+    }
+    return;
+  }
+  if (!cursor_->valid()) {
+    cursor_->SeekToFirst();
+  }
+  Datum datum;
+  CHECK(datum.ParseFromArray(cursor_->value_data(), cursor_->value_size()));
+  int offset = 0;
+  for (int i = 0; i < top.size(); ++i) {
+    const int dim = top[i]->count(1);
+    CHECK_LE(offset + dim, datum.float_data_size())
+        << "The cached item " << cursor_->key() << " is too small";
+    Dtype* data = top[i]->mutable_cpu_data() + n * dim;
+    for (int k = 0; k < dim; ++k) {
+      data[k] = datum.float_data(offset + k);
+    }
+    offset += dim;
+  }
+  cursor_->Next();
+}
+
+template <typename Dtype>
+void FeatureCacheLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const int num = top[0]->num();
+  const bool cached = BottomsCached();
+  if (!cached) {
+    for (int i = 0; i < bottom.size(); ++i) {
+      caffe_copy(bottom[i]->count(), bottom[i]->cpu_data(),
+          top[i]->mutable_cpu_data());
+    }
+  }
+  shared_ptr<db::Transaction> txn;
+  if (db_ && !cached) {
+    txn.reset(db_->NewTransaction());
+    // The positions are stored in order.
+    txn->set_append(true);
+  }
+  for (int n = 0; n < num; ++n) {
+    const int position = (position_ + n) % items_;
+    if (cached) {
+      Load(top, n, position);
+    } else if (filled_ < items_) {
+      Store(top, n, position, txn.get());
+      ++filled_;
+    }
+  }
+  if (txn) {
+    txn->Commit();
+  }
+  position_ = (position_ + num) % items_;
+  if (db_ && !cursor_ && BottomsCached()) {
+    // The epoch ended within this batch, after which the next one goes on.
+    cursor_.reset(db_->NewCursor());
+    for (int n = 0; n < position_; ++n) {
+      cursor_->Next();
+    }
+  }
+}
+
+INSTANTIATE_CLASS(FeatureCacheLayer);
+REGISTER_LAYER_CLASS(FeatureCache);
+
+}  // namespace caffe
@@ -29,25 +29,33 @@ void FilterLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
         "Each bottom should have the same 0th dimension as the selector blob";
   }
 
-  const Dtype* bottom_data_selector = bottom[selector_index]->cpu_data();
-  indices_to_forward_.clear();
-
-  // look for non-zero elements in bottom[0]. Items of each bottom that
-  // have the same index as the items in bottom[0] with value == non-zero
-  // will be forwarded
-  for (int item_id = 0; item_id < bottom[selector_index]->shape(0); ++item_id) {
-    // we don't need an offset because item size == 1
-    const Dtype* tmp_data_selector = bottom_data_selector + item_id;
-    if (*tmp_data_selector) {
-      indices_to_forward_.push_back(item_id);
-    }
-  }
-  // only filtered items will be forwarded
-  int new_tops_num = indices_to_forward_.size();
+  int new_tops_num = bottom[0]->shape(0);
   // init
   if (first_reshape_) {
-    new_tops_num = bottom[0]->shape(0);
     first_reshape_ = false;
+  } else if (Caffe::mode() == Caffe::GPU) {
+#ifndef CPU_ONLY
+    new_tops_num = select_gpu(*bottom[selector_index]);
+#else
+    NO_GPU;
+#endif
+  } else {
+    const Dtype* bottom_data_selector = bottom[selector_index]->cpu_data();
+    indices_to_forward_.clear();
+
+    // look for non-zero elements in bottom[0]. Items of each bottom that
+    // have the same index as the items in bottom[0] with value == non-zero
+    // will be forwarded
+    for (int item_id = 0; item_id < bottom[selector_index]->shape(0);
+         ++item_id) {
+      // we don't need an offset because item size == 1
+      const Dtype* tmp_data_selector = bottom_data_selector + item_id;
+      if (*tmp_data_selector) {
+        indices_to_forward_.push_back(item_id);
+      }
+    }
+    // only filtered items will be forwarded
+    new_tops_num = indices_to_forward_.size();
   }
   for (int t = 0; t < top.size(); ++t) {
     int num_axes = bottom[t]->num_axes();
@@ -6,21 +6,90 @@
 
 namespace caffe {
 
+// A single block scans the selector in chunks of its size, giving each
+// selected item its position in the tops.
+template <typename Dtype>
+__global__ void FilterSelect(const int num, const Dtype* selector,
+    int* selected, int* positions, int* num_selected) {
+  __shared__ int scan[CAFFE_CUDA_NUM_THREADS];
+  int base = 0;
+  for (int begin = 0; begin < num; begin += blockDim.x) {
+    const int n = begin + threadIdx.x;
+    const int flag = n < num && selector[n] != 0;
+    scan[threadIdx.x] = flag;
+    __syncthreads();
+    for (int s = 1; s < blockDim.x; s <<= 1) {
+      const int value = threadIdx.x >= s ? scan[threadIdx.x - s] : 0;
+      __syncthreads();
+      scan[threadIdx.x] += value;
+      __syncthreads();
+    }
+    if (n < num) {
+      const int position = base + scan[threadIdx.x] - flag;
+      positions[n] = flag ? position : -1;
+      if (flag) {
+        selected[position] = n;
+      }
+    }
+    base += scan[blockDim.x - 1];
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    *num_selected = base;
+  }
+}
+
+template <typename Dtype>
+int FilterLayer<Dtype>::select_gpu(const Blob<Dtype>& selector) {
+  const int num = selector.shape(0);
+  const vector<int> shape(1, num);
+  selected_.Reshape(shape);
+  positions_.Reshape(shape);
+  num_selected_.Reshape(vector<int>(1, 1));
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  FilterSelect<Dtype><<<1, CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(num, selector.gpu_data(),
+      selected_.mutable_gpu_data(), positions_.mutable_gpu_data(),
+      num_selected_.mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+  return num_selected_.cpu_data()[0];
+}
+template int FilterLayer<float>::select_gpu(const Blob<float>& selector);
+template int FilterLayer<double>::select_gpu(const Blob<double>& selector);
+
+template <typename Dtype>
+__global__ void FilterForward(const int nthreads, const int dim,
+    const int* selected, const Dtype* bottom_data, Dtype* top_data) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    top_data[index] = bottom_data[selected[index / dim] * dim + index % dim];
+  }
+}
+
+template <typename Dtype>
+__global__ void FilterBackward(const int nthreads, const int dim,
+    const int* positions, const Dtype* top_diff, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int position = positions[index / dim];
+    bottom_diff[index] = position < 0 ? Dtype(0) :
+        top_diff[position * dim + index % dim];
+  }
+}
+
 template <typename Dtype>
 void FilterLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
-  int new_tops_num = indices_to_forward_.size();
   // forward all filtered items for all bottoms but the Selector (bottom[last])
   for (int t = 0; t < top.size(); ++t) {
-    const Dtype* bottom_data = bottom[t]->gpu_data();
-    Dtype* top_data = top[t]->mutable_gpu_data();
-    int dim = bottom[t]->count() / bottom[t]->shape(0);
-    for (int n = 0; n < new_tops_num; ++n) {
-      int data_offset_top = n * dim;
-      int data_offset_bottom = indices_to_forward_[n] * dim;
-      caffe_copy(dim, bottom_data + data_offset_bottom,
-          top_data + data_offset_top);
+    const int count = top[t]->count();
+    if (count == 0) {
+      continue;
     }
+    const int dim = bottom[t]->count(1);
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    FilterForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+        0, Caffe::cuda_stream()>>>(count, dim, selected_.gpu_data(),
+        bottom[t]->gpu_data(), top[t]->mutable_gpu_data());
+    CUDA_POST_KERNEL_CHECK;
   }
 }
 
@@ -35,32 +104,13 @@ void FilterLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     // bottom[last] is the selector and never needs backpropagation
     // so we can iterate over top vector because top.size() == bottom.size() -1
     if (propagate_down[i]) {
-      const int dim = top[i]->count() / top[i]->shape(0);
-      int next_to_backward_offset = 0;
-      int batch_offset = 0;
-      int data_offset_bottom = 0;
-      int data_offset_top = 0;
-      for (int n = 0; n < bottom[i]->shape(0); ++n) {
-        if (next_to_backward_offset >= indices_to_forward_.size()) {
-          // we already visited all items that were been forwarded, so
-          // just set to zero remaining ones
-          data_offset_bottom = n * dim;
-          caffe_gpu_set(dim, Dtype(0),
-              bottom[i]->mutable_gpu_diff() + data_offset_bottom);
-        } else {
-          batch_offset = indices_to_forward_[next_to_backward_offset];
-          data_offset_bottom = n * dim;
-          if (n != batch_offset) {  // this data was not been forwarded
-            caffe_gpu_set(dim, Dtype(0),
-                bottom[i]->mutable_gpu_diff() + data_offset_bottom);
-          } else {  // this data was been forwarded
-            data_offset_top = next_to_backward_offset * dim;
-            ++next_to_backward_offset;  // point to next forwarded item index
-            caffe_copy(dim, top[i]->mutable_gpu_diff() + data_offset_top,
-                bottom[i]->mutable_gpu_diff() + data_offset_bottom);
-          }
-        }
-      }
+      const int count = bottom[i]->count();
+      const int dim = bottom[i]->count(1);
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      FilterBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+          0, Caffe::cuda_stream()>>>(count, dim, positions_.gpu_data(),
+          top[i]->gpu_diff(), bottom[i]->mutable_gpu_diff());
+      CUDA_POST_KERNEL_CHECK;
     }
   }
 }
@@ -0,0 +1,172 @@
+#include <boost/bind.hpp>
+
+#include <cmath>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/neuron_layers.hpp"
+#include "caffe/util/elementwise_ops.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+bool FusedElementwiseLayer<Dtype>::IsFusible(const LayerParameter& param) {
+  const string& type = param.type();
+  if (type != "Power" && type != "Exp" && type != "Log" && type != "ReLU"
+      && type != "Sigmoid" && type != "TanH" && type != "AbsVal") {
+    return false;
+  }
+  // Neither learnable nor approximated, and computed on every pass
+  return param.bottom_size() == 1 && param.top_size() == 1
+      && param.loss_weight_size() == 0 && param.propagate_down_size() == 0
+      && param.param_size() == 0 && !param.approximate_math()
+      && !param.recompute() && !param.offload();
+}
+
+// The log of base, exactly 1 for base e
+template <typename Dtype>
+static Dtype LogBase(const LayerParameter& param, Dtype base) {
+  if (base == Dtype(-1)) {
+    return Dtype(1);
+  }
+  CHECK_GT(base, 0) << param.name() << ": base must be strictly positive.";
+  const Dtype log_base = log(base);
+  CHECK(!isnan(log_base) && !isinf(log_base) && log_base != 0)
+      << param.name() << ": bad result of log(base) = log(" << base << ") = "
+      << log_base;
+  return log_base;
+}
+
+template <typename Dtype>
+void FusedElementwiseLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  NeuronLayer<Dtype>::LayerSetUp(bottom, top);
+  const FusedElementwiseParameter& fused_param =
+      this->layer_param_.fused_elementwise_param();
+  num_ops_ = fused_param.layer_size();
+  CHECK_GT(num_ops_, 0) << "No layer to apply";
+  CHECK_LE(num_ops_, kMaxElementwiseOps) << "Too many layers to apply";
+  vector<int> shape(2);
+  shape[0] = num_ops_;
+  shape[1] = 4;
+  ops_.Reshape(shape);
+  Dtype* ops = ops_.mutable_cpu_data();
+  caffe_set(ops_.count(), Dtype(0), ops);
+  for (int i = 0; i < num_ops_; ++i) {
+    const LayerParameter& param = fused_param.layer(i);
+    CHECK(IsFusible(param)) << "Cannot fuse layer " << param.name();
+    const string& type = param.type();
+    Dtype* op = ops + i * 4;
+    Dtype* args = op + 1;
+    if (type == "Power") {
+      op[0] = ELEMENTWISE_POWER;
+      args[0] = param.power_param().power();
+      args[1] = param.power_param().scale();
+      args[2] = param.power_param().shift();
+    } else if (type == "Exp") {
+      const ExpParameter& exp_param = param.exp_param();
+      const Dtype log_base = LogBase(param, Dtype(exp_param.base()));
+      op[0] = ELEMENTWISE_EXP;
+      args[0] = log_base * exp_param.scale();
+      args[1] = exp(log_base * exp_param.shift());
+    } else if (type == "Log") {
+      const LogParameter& log_param = param.log_param();
+      op[0] = ELEMENTWISE_LOG;
+      args[0] = log_param.scale();
+      args[1] = log_param.shift();
+      args[2] = Dtype(1) / LogBase(param, Dtype(log_param.base()));
+    } else if (type == "ReLU") {
+      op[0] = ELEMENTWISE_RELU;
+      args[0] = param.relu_param().negative_slope();
+    } else if (type == "Sigmoid") {
+      op[0] = ELEMENTWISE_SIGMOID;
+    } else if (type == "TanH") {
+      op[0] = ELEMENTWISE_TANH;
+    } else {
+      op[0] = ELEMENTWISE_ABSVAL;
+    }
+  }
+}
+
+template <typename Dtype>
+void FusedElementwiseLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  NeuronLayer<Dtype>::Reshape(bottom, top);
+  if (bottom[0] == top[0]) {
+    input_.ReshapeLike(*bottom[0]);
+  }
+}
+
+template <typename Dtype>
+void FusedElementwiseLayer<Dtype>::forward_cpu(const Dtype* bottom_data,
+    Dtype* top_data, Dtype* input, int begin, int end) {
+  const Dtype* ops = ops_.cpu_data();
+  for (int i = begin; i < end; ++i) {
+    Dtype x = bottom_data[i];
+    if (input) {
+      input[i] = x;
+    }
+    for (int k = 0; k < num_ops_; ++k) {
+      x = elementwise_forward(static_cast<int>(ops[k * 4]), ops + k * 4 + 1,
+          x);
+    }
+    top_data[i] = x;
+  }
+}
+
+template <typename Dtype>
+void FusedElementwiseLayer<Dtype>::backward_cpu(const Dtype* bottom_data,
+    const Dtype* top_diff, Dtype* bottom_diff, int begin, int end) {
+  const Dtype* ops = ops_.cpu_data();
+  Dtype x[kMaxElementwiseOps + 1];
+  for (int i = begin; i < end; ++i) {
+    x[0] = bottom_data[i];
+    for (int k = 0; k < num_ops_; ++k) {
+      x[k + 1] = elementwise_forward(static_cast<int>(ops[k * 4]),
+          ops + k * 4 + 1, x[k]);
+    }
+    Dtype diff = top_diff[i];
+    for (int k = num_ops_ - 1; k >= 0; --k) {
+      diff *= elementwise_derivative(static_cast<int>(ops[k * 4]),
+          ops + k * 4 + 1, x[k], x[k + 1]);
+    }
+    bottom_diff[i] = diff;
+  }
+}
+
+template <typename Dtype>
+void FusedElementwiseLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = top[0]->mutable_cpu_data();
+  Dtype* input = input_.count() ? input_.mutable_cpu_data() : NULL;
+  Caffe::thread_pool().run(bottom[0]->count(), kParallelGrain,
+      boost::bind(&FusedElementwiseLayer<Dtype>::forward_cpu, this,
+                  bottom_data, top_data, input, _1, _2));
+}
+
+template <typename Dtype>
+void FusedElementwiseLayer<Dtype>::Backward_cpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) {
+    return;
+  }
+  const Dtype* bottom_data = bottom[0] == top[0] ? input_.cpu_data() :
+      bottom[0]->cpu_data();
+  Caffe::thread_pool().run(bottom[0]->count(), kParallelGrain,
+      boost::bind(&FusedElementwiseLayer<Dtype>::backward_cpu, this,
+                  bottom_data, top[0]->cpu_diff(),
+                  bottom[0]->mutable_cpu_diff(), _1, _2));
+}
+
+#ifdef CPU_ONLY
+STUB_GPU(FusedElementwiseLayer);
+#endif
+
+INSTANTIATE_CLASS(FusedElementwiseLayer);
+REGISTER_LAYER_CLASS(FusedElementwise);
+
+}  // namespace caffe
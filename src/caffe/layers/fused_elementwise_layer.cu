@@ -0,0 +1,79 @@
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/neuron_layers.hpp"
+#include "caffe/util/elementwise_ops.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+__global__ void FusedElementwiseForward(const int n, const int num_ops,
+    const Dtype* ops, const Dtype* in, Dtype* out, Dtype* input) {
+  CUDA_KERNEL_LOOP(index, n) {
+    Dtype x = in[index];
+    if (input) {
+      input[index] = x;
+    }
+    for (int k = 0; k < num_ops; ++k) {
+      x = elementwise_forward(static_cast<int>(ops[k * 4]), ops + k * 4 + 1,
+          x);
+    }
+    out[index] = x;
+  }
+}
+
+template <typename Dtype>
+void FusedElementwiseLayer<Dtype>::Forward_gpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const Dtype* bottom_data = bottom[0]->gpu_data();
+  Dtype* top_data = top[0]->mutable_gpu_data();
+  Dtype* input = input_.count() ? input_.mutable_gpu_data() : NULL;
+  const int count = bottom[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  FusedElementwiseForward<Dtype><<<CAFFE_GET_BLOCKS(count),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count, num_ops_,
+      ops_.gpu_data(), bottom_data, top_data, input);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template <typename Dtype>
+__global__ void FusedElementwiseBackward(const int n, const int num_ops,
+    const Dtype* ops, const Dtype* in_data, const Dtype* out_diff,
+    Dtype* in_diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    Dtype x[kMaxElementwiseOps + 1];
+    x[0] = in_data[index];
+    for (int k = 0; k < num_ops; ++k) {
+      x[k + 1] = elementwise_forward(static_cast<int>(ops[k * 4]),
+          ops + k * 4 + 1, x[k]);
+    }
+    Dtype diff = out_diff[index];
+    for (int k = num_ops - 1; k >= 0; --k) {
+      diff *= elementwise_derivative(static_cast<int>(ops[k * 4]),
+          ops + k * 4 + 1, x[k], x[k + 1]);
+    }
+    in_diff[index] = diff;
+  }
+}
+
+template <typename Dtype>
+void FusedElementwiseLayer<Dtype>::Backward_gpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) {
+    return;
+  }
+  const Dtype* bottom_data = bottom[0] == top[0] ? input_.gpu_data() :
+      bottom[0]->gpu_data();
+  const int count = bottom[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  FusedElementwiseBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count, num_ops_,
+      ops_.gpu_data(), bottom_data, top[0]->gpu_diff(),
+      bottom[0]->mutable_gpu_diff());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(FusedElementwiseLayer);
+
+}  // namespace caffe
@@ -1,11 +1,9 @@
 /*
 TODO:
-- load file in a separate thread ("prefetch")
-- can be smarter about the memcpy call instead of doing it row-by-row
-  :: use util functions caffe_copy, and Blob->offset()
-  :: don't forget to update hdf5_daa_layer.cu accordingly
-- add ability to shuffle filenames if flag is set
+- read chunks of several files at once, to shuffle across files
 */
+#include <boost/thread.hpp>
+#include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
@@ -17,55 +15,172 @@ TODO:
 #include "caffe/data_layers.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/hdf5.hpp"
+#include "caffe/util/rng.hpp"
 
 namespace caffe {
 
 template <typename Dtype>
-HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() { }
+HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() {
+  this->StopInternalThread();
+  close_file();
+}
 
-// Load data and label from HDF5 filename into the class property blobs.
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::LoadHDF5FileData(const char* filename) {
-  DLOG(INFO) << "Loading HDF5 file: " << filename;
-  hid_t file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
-  if (file_id < 0) {
+void HDF5DataLayer<Dtype>::open_file() {
+  close_file();
+  const char* filename =
+      hdf_filenames_[file_permutation_[current_file_]].c_str();
+  DLOG(INFO) << "Opening HDF5 file: " << filename;
+  file_id_ = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (file_id_ < 0) {
     LOG(FATAL) << "Failed opening HDF5 file: " << filename;
   }
 
-  int top_size = this->layer_param_.top_size();
-  hdf_blobs_.resize(top_size);
-
   const int MIN_DATA_DIM = 1;
   const int MAX_DATA_DIM = INT_MAX;
 
-  for (int i = 0; i < top_size; ++i) {
-    hdf_blobs_[i] = shared_ptr<Blob<Dtype> >(new Blob<Dtype>());
-    hdf5_load_nd_dataset(file_id, this->layer_param_.top(i).c_str(),
-        MIN_DATA_DIM, MAX_DATA_DIM, hdf_blobs_[i].get());
+  // MinTopBlobs==1 guarantees at least one top blob
+  for (int i = 0; i < this->layer_param_.top_size(); ++i) {
+    hsize_t rows;
+    if (sparse_[i]) {
+      const string offsets = this->layer_param_.top(i) + "_indptr";
+      std::vector<hsize_t> dims =
+          hdf5_get_nd_dataset_dims(file_id_, offsets.c_str(), 1, 1);
+      CHECK_GE(dims[0], 1) << "Missing the count of nonzeros in " << offsets;
+      rows = dims[0] - 1;
+    } else {
+      std::vector<hsize_t> dims = hdf5_get_nd_dataset_dims(file_id_,
+          this->layer_param_.top(i).c_str(), MIN_DATA_DIM, MAX_DATA_DIM);
+      rows = dims[0];
+    }
+    if (i == 0) {
+      file_rows_ = rows;
+    } else {
+      CHECK_EQ(rows, file_rows_);
+    }
+    if (sparse_[i]) {
+      i += 2;
+    }
   }
+  CHECK_GT(file_rows_, 0) << "No rows in HDF5 file: " << filename;
 
-  herr_t status = H5Fclose(file_id);
-  CHECK_GE(status, 0) << "Failed to close HDF5 file: " << filename;
+  const HDF5DataParameter& param = this->layer_param_.hdf5_data_param();
+  chunk_rows_ = file_rows_;
+  if (param.chunk_size() > 0 && param.chunk_size() < file_rows_) {
+    chunk_rows_ = param.chunk_size();
+  }
+  chunk_permutation_.resize((file_rows_ + chunk_rows_ - 1) / chunk_rows_);
+  for (int i = 0; i < chunk_permutation_.size(); ++i) {
+    chunk_permutation_[i] = i;
+  }
+  if (param.shuffle()) {
+    caffe::rng_t* rng = static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+    shuffle(chunk_permutation_.begin(), chunk_permutation_.end(), rng);
+  }
+  current_chunk_ = 0;
+}
 
-  // MinTopBlobs==1 guarantees at least one top blob
-  CHECK_GE(hdf_blobs_[0]->num_axes(), 1) << "Input must have at least 1 axis.";
-  const int num = hdf_blobs_[0]->shape(0);
-  for (int i = 1; i < top_size; ++i) {
-    CHECK_EQ(hdf_blobs_[i]->shape(0), num);
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::close_file() {
+  if (file_id_ >= 0) {
+    herr_t status = H5Fclose(file_id_);
+    CHECK_GE(status, 0) << "Failed to close HDF5 file: "
+        << hdf_filenames_[file_permutation_[current_file_]];
+    file_id_ = -1;
+  }
+}
+
+// Load the rows of the current chunk into the class property blobs.
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::load_chunk() {
+  const hsize_t start = chunk_permutation_[current_chunk_] * chunk_rows_;
+  const hsize_t rows = std::min(chunk_rows_, file_rows_ - start);
+  const int top_size = this->layer_param_.top_size();
+  hdf_blobs_.resize(top_size);
+  row_offsets_.resize(top_size);
+  for (int i = 0; i < top_size; ++i) {
+    if (!hdf_blobs_[i]) {
+      hdf_blobs_[i].reset(new Blob<Dtype>());
+    }
+  }
+  for (int i = 0; i < top_size; ++i) {
+    if (!sparse_[i]) {
+      hdf5_load_nd_dataset_rows(file_id_, this->layer_param_.top(i).c_str(),
+          1, INT_MAX, start, rows, hdf_blobs_[i].get());
+      continue;
+    }
+    // The offsets of the rows and the end of the last one, then the values
+    // and column indices of the nonzeros in between
+    const string& name = this->layer_param_.top(i);
+    Blob<double> offsets;
+    hdf5_load_nd_dataset_rows(file_id_, (name + "_indptr").c_str(), 1, 1,
+        start, rows + 1, &offsets);
+    row_offsets_[i].assign(offsets.cpu_data(), offsets.cpu_data() + rows + 1);
+    const hsize_t begin = row_offsets_[i][0];
+    const hsize_t nonzeros = row_offsets_[i][rows] - begin;
+    for (int j = 0; j < 2; ++j) {
+      const string dataset = name + (j == 0 ? "_data" : "_indices");
+      if (nonzeros > 0) {
+        hdf5_load_nd_dataset_rows(file_id_, dataset.c_str(), 1, 1, begin,
+            nonzeros, hdf_blobs_[i + j].get());
+      } else {
+        hdf_blobs_[i + j]->Reshape(vector<int>(1, 0));
+      }
+    }
+    i += 2;
   }
   // Default to identity permutation.
-  data_permutation_.clear();
-  data_permutation_.resize(hdf_blobs_[0]->shape(0));
-  for (int i = 0; i < hdf_blobs_[0]->shape(0); i++)
+  data_permutation_.resize(rows);
+  for (int i = 0; i < rows; i++)
     data_permutation_[i] = i;
 
   // Shuffle if needed.
   if (this->layer_param_.hdf5_data_param().shuffle()) {
-    std::random_shuffle(data_permutation_.begin(), data_permutation_.end());
-    DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->shape(0)
-               << " rows (shuffled)";
+    caffe::rng_t* rng = static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+    shuffle(data_permutation_.begin(), data_permutation_.end(), rng);
+    DLOG(INFO) << "Successully loaded " << rows << " rows (shuffled)";
   } else {
-    DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->shape(0) << " rows";
+    DLOG(INFO) << "Successully loaded " << rows << " rows";
+  }
+  current_row_ = 0;
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::next_chunk() {
+  const bool shuffle_data = this->layer_param_.hdf5_data_param().shuffle();
+  if (++current_chunk_ < chunk_permutation_.size()) {
+    load_chunk();
+  } else if (num_files_ > 1) {
+    ++current_file_;
+    if (current_file_ == num_files_) {
+      current_file_ = 0;
+      if (shuffle_data) {
+        caffe::rng_t* rng =
+            static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+        shuffle(file_permutation_.begin(), file_permutation_.end(), rng);
+      }
+      DLOG(INFO) << "Looping around to first file.";
+    }
+    open_file();
+    load_chunk();
+  } else if (chunk_permutation_.size() > 1) {
+    // Read the chunks of the one file again, in a new order if shuffling
+    current_chunk_ = 0;
+    if (shuffle_data) {
+      caffe::rng_t* rng =
+          static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+      shuffle(chunk_permutation_.begin(), chunk_permutation_.end(), rng);
+    }
+    load_chunk();
+  } else {
+    // The whole of the one file is still loaded
+    current_chunk_ = 0;
+    current_row_ = 0;
+    if (shuffle_data) {
+      caffe::rng_t* rng =
+          static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+      shuffle(data_permutation_.begin(), data_permutation_.end(), rng);
+    }
   }
 }
 
@@ -75,8 +190,29 @@ void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   // Refuse transformation parameters since HDF5 is totally generic.
   CHECK(!this->layer_param_.has_transform_param()) <<
       this->type() << " does not transform data.";
+  // Set up again from the start if already prefetching
+  this->StopInternalThread();
+  close_file();
+  Rows* rows;
+  while (prefetch_free_.try_pop(&rows)) {}
+  while (prefetch_full_.try_pop(&rows)) {}
+
   // Read the source to parse the filenames.
-  const string& source = this->layer_param_.hdf5_data_param().source();
+  const HDF5DataParameter& param = this->layer_param_.hdf5_data_param();
+  const int top_size = this->layer_param_.top_size();
+  sparse_.assign(top_size, false);
+  for (int i = 0; i < top_size; ++i) {
+    for (int j = 0; j < param.sparse_size(); ++j) {
+      sparse_[i] = sparse_[i] || this->layer_param_.top(i) == param.sparse(j);
+    }
+    if (sparse_[i]) {
+      CHECK_LT(i + 2, top_size) << "The sparse top "
+          << this->layer_param_.top(i)
+          << " must be followed by tops for its indices and row offsets";
+      i += 2;
+    }
+  }
+  const string& source = param.source();
   LOG(INFO) << "Loading list of HDF5 filenames from: " << source;
   hdf_filenames_.clear();
   std::ifstream source_file(source.c_str());
@@ -103,58 +239,151 @@ void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   }
 
   // Shuffle if needed.
-  if (this->layer_param_.hdf5_data_param().shuffle()) {
-    std::random_shuffle(file_permutation_.begin(), file_permutation_.end());
+  if (param.shuffle()) {
+    const unsigned int prefetch_rng_seed = caffe_rng_rand();
+    prefetch_rng_.reset(new Caffe::RNG(prefetch_rng_seed));
+    caffe::rng_t* rng = static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+    shuffle(file_permutation_.begin(), file_permutation_.end(), rng);
   }
 
-  // Load the first HDF5 file and initialize the line counter.
-  LoadHDF5FileData(hdf_filenames_[file_permutation_[current_file_]].c_str());
-  current_row_ = 0;
+  // Load the first chunk of the first HDF5 file.
+  open_file();
+  load_chunk();
 
   // Reshape blobs.
-  const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
-  const int top_size = this->layer_param_.top_size();
+  const int batch_size = param.batch_size();
   vector<int> top_shape;
   for (int i = 0; i < top_size; ++i) {
-    top_shape.resize(hdf_blobs_[i]->num_axes());
-    top_shape[0] = batch_size;
-    for (int j = 1; j < top_shape.size(); ++j) {
-      top_shape[j] = hdf_blobs_[i]->shape(j);
+    if (sparse_[i]) {
+      // Batches of sparse tops are reshaped to their number of nonzeros.
+      top[i]->Reshape(vector<int>(1, 1));
+      top[i + 1]->Reshape(vector<int>(1, 1));
+      top[i + 2]->Reshape(vector<int>(1, batch_size + 1));
+      i += 2;
+      continue;
     }
+    CHECK_GE(hdf_blobs_[i]->num_axes(), 1)
+        << "Input must have at least 1 axis.";
+    top_shape = hdf_blobs_[i]->shape();
+    top_shape[0] = batch_size;
     top[i]->Reshape(top_shape);
   }
+
+  // Prefetch batches of the same shapes, in pinned memory if on the GPU
+  CHECK_GT(param.prefetch(), 0);
+  prefetch_.resize(param.prefetch());
+  for (int i = 0; i < prefetch_.size(); ++i) {
+    prefetch_[i].resize(top_size);
+    for (int j = 0; j < top_size; ++j) {
+      prefetch_[i][j].reset(new Blob<Dtype>(top[j]->shape()));
+      prefetch_[i][j]->mutable_cpu_data();
+#ifndef CPU_ONLY
+      if (Caffe::mode() == Caffe::GPU) {
+        prefetch_[i][j]->mutable_gpu_data();
+      }
+#endif
+    }
+    prefetch_free_.push(&prefetch_[i]);
+  }
+  DLOG(INFO) << "Initializing prefetch";
+  this->StartInternalThread();
+  DLOG(INFO) << "Prefetch initialized.";
 }
 
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top) {
+void HDF5DataLayer<Dtype>::InternalThreadEntry() {
+#ifndef CPU_ONLY
+  cudaStream_t stream;
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  }
+#endif
+
+  try {
+    while (!must_stop()) {
+      Rows* batch = prefetch_free_.pop();
+      load_batch(batch);
+#ifndef CPU_ONLY
+      if (Caffe::mode() == Caffe::GPU) {
+        for (int i = 0; i < batch->size(); ++i) {
+          (*batch)[i]->data().get()->async_gpu_push(stream);
+        }
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+      }
+#endif
+      prefetch_full_.push(batch);
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamDestroy(stream));
+  }
+#endif
+}
+
+// This function is called on prefetch thread
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::load_batch(Rows* batch) {
   const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
+  // The values, column indices and row offsets of each sparse top
+  vector<vector<Dtype> > values(batch->size());
+  vector<vector<Dtype> > indices(batch->size());
+  vector<vector<Dtype> > offsets(batch->size());
   for (int i = 0; i < batch_size; ++i, ++current_row_) {
-    if (current_row_ == hdf_blobs_[0]->shape(0)) {
-      if (num_files_ > 1) {
-        ++current_file_;
-        if (current_file_ == num_files_) {
-          current_file_ = 0;
-          if (this->layer_param_.hdf5_data_param().shuffle()) {
-            std::random_shuffle(file_permutation_.begin(),
-                                file_permutation_.end());
-          }
-          DLOG(INFO) << "Looping around to first file.";
-        }
-        LoadHDF5FileData(
-            hdf_filenames_[file_permutation_[current_file_]].c_str());
+    if (current_row_ == data_permutation_.size()) {
+      next_chunk();
+    }
+    const int row = data_permutation_[current_row_];
+    for (int j = 0; j < batch->size(); ++j) {
+      if (sparse_[j]) {
+        const hsize_t begin = row_offsets_[j][row] - row_offsets_[j][0];
+        const hsize_t end = row_offsets_[j][row + 1] - row_offsets_[j][0];
+        offsets[j].push_back(values[j].size());
+        values[j].insert(values[j].end(), hdf_blobs_[j]->cpu_data() + begin,
+            hdf_blobs_[j]->cpu_data() + end);
+        indices[j].insert(indices[j].end(),
+            hdf_blobs_[j + 1]->cpu_data() + begin,
+            hdf_blobs_[j + 1]->cpu_data() + end);
+        j += 2;
+        continue;
       }
-      current_row_ = 0;
-      if (this->layer_param_.hdf5_data_param().shuffle())
-        std::random_shuffle(data_permutation_.begin(), data_permutation_.end());
+      const int data_dim = (*batch)[j]->count(1);
+      CHECK_EQ(hdf_blobs_[j]->count(1), data_dim)
+          << "Rows of " << this->layer_param_.top(j) << " change size";
+      caffe_copy(data_dim, &hdf_blobs_[j]->cpu_data()[row * data_dim],
+          &(*batch)[j]->mutable_cpu_data()[i * data_dim]);
     }
-    for (int j = 0; j < this->layer_param_.top_size(); ++j) {
-      int data_dim = top[j]->count() / top[j]->shape(0);
-      caffe_copy(data_dim,
-          &hdf_blobs_[j]->cpu_data()[data_permutation_[current_row_]
-            * data_dim], &top[j]->mutable_cpu_data()[i * data_dim]);
+  }
+  for (int j = 0; j < batch->size(); ++j) {
+    if (!sparse_[j]) {
+      continue;
     }
+    offsets[j].push_back(values[j].size());
+    (*batch)[j]->Reshape(vector<int>(1, values[j].size()));
+    (*batch)[j + 1]->Reshape(vector<int>(1, indices[j].size()));
+    (*batch)[j + 2]->Reshape(vector<int>(1, offsets[j].size()));
+    std::copy(values[j].begin(), values[j].end(),
+        (*batch)[j]->mutable_cpu_data());
+    std::copy(indices[j].begin(), indices[j].end(),
+        (*batch)[j + 1]->mutable_cpu_data());
+    std::copy(offsets[j].begin(), offsets[j].end(),
+        (*batch)[j + 2]->mutable_cpu_data());
+    j += 2;
+  }
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  Rows* batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  for (int j = 0; j < top.size(); ++j) {
+    top[j]->ReshapeLike(*(*batch)[j]);
+    caffe_copy((*batch)[j]->count(), (*batch)[j]->cpu_data(),
+        top[j]->mutable_cpu_data());
   }
+  prefetch_free_.push(batch);
 }
 
 #ifdef CPU_ONLY
@@ -1,3 +1,5 @@
+#include <boost/thread.hpp>
+#include <algorithm>
 #include <vector>
 
 #include "hdf5.h"
@@ -14,51 +16,110 @@ namespace caffe {
 template <typename Dtype>
 void HDF5OutputLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
-  file_name_ = this->layer_param_.hdf5_output_param().file_name();
+  const HDF5OutputParameter& param = this->layer_param_.hdf5_output_param();
+  file_name_ = param.file_name();
   file_id_ = H5Fcreate(file_name_.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
                        H5P_DEFAULT);
   CHECK_GE(file_id_, 0) << "Failed to open HDF5 file" << file_name_;
   file_opened_ = true;
+  CHECK_LE(param.compression_level(), 9);
+  CHECK_GT(param.queue_size(), 0);
+  batches_.resize(param.queue_size());
+  for (int i = 0; i < batches_.size(); ++i) {
+    batches_[i].push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    batches_[i].push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    free_.push(&batches_[i]);
+  }
+  this->StartInternalThread();
 }
 
 template <typename Dtype>
 HDF5OutputLayer<Dtype>::~HDF5OutputLayer<Dtype>() {
   if (file_opened_) {
+    flush();
+    this->StopInternalThread();
+    for (int i = 0; i < dataset_ids_.size(); ++i) {
+      H5Dclose(dataset_ids_[i]);
+    }
     herr_t status = H5Fclose(file_id_);
     CHECK_GE(status, 0) << "Failed to close HDF5 file " << file_name_;
   }
 }
 
 template <typename Dtype>
-void HDF5OutputLayer<Dtype>::SaveBlobs() {
+void HDF5OutputLayer<Dtype>::flush() {
+  // Batches are free again once written
+  vector<Rows*> batches(batches_.size());
+  for (int i = 0; i < batches.size(); ++i) {
+    batches[i] = free_.pop();
+  }
+  herr_t status = H5Fflush(file_id_, H5F_SCOPE_LOCAL);
+  CHECK_GE(status, 0) << "Failed to flush HDF5 file " << file_name_;
+  for (int i = 0; i < batches.size(); ++i) {
+    free_.push(batches[i]);
+  }
+}
+
+template <typename Dtype>
+typename HDF5OutputLayer<Dtype>::Rows* HDF5OutputLayer<Dtype>::free_batch(
+    const vector<Blob<Dtype>*>& bottom) {
+  CHECK_GE(bottom.size(), 2);
+  CHECK_EQ(bottom[0]->num(), bottom[1]->num());
+  Rows* batch = free_.pop("Waiting for the HDF5 writer");
+  for (int i = 0; i < batch->size(); ++i) {
+    (*batch)[i]->Reshape(bottom[i]->num(), bottom[i]->channels(),
+                         bottom[i]->height(), bottom[i]->width());
+  }
+  return batch;
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::InternalThreadEntry() {
+  try {
+    while (!must_stop()) {
+      Rows* batch = full_.pop();
+      SaveBlobs(*batch);
+      free_.push(batch);
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::SaveBlobs(const Rows& batch) {
   // TODO: no limit on the number of blobs
-  LOG(INFO) << "Saving HDF5 file " << file_name_;
-  CHECK_EQ(data_blob_.num(), label_blob_.num()) <<
+  const Blob<Dtype>& data_blob = *batch[0];
+  const Blob<Dtype>& label_blob = *batch[1];
+  DLOG(INFO) << "Saving HDF5 file " << file_name_;
+  CHECK_EQ(data_blob.num(), label_blob.num()) <<
       "data blob and label blob must have the same batch size";
-  hdf5_save_nd_dataset(file_id_, HDF5_DATA_DATASET_NAME, data_blob_);
-  hdf5_save_nd_dataset(file_id_, HDF5_DATA_LABEL_NAME, label_blob_);
-  LOG(INFO) << "Successfully saved " << data_blob_.num() << " rows";
+  if (dataset_ids_.empty()) {
+    const HDF5OutputParameter& param = this->layer_param_.hdf5_output_param();
+    const int chunk_rows = param.chunk_rows() > 0 ? param.chunk_rows() :
+        std::max(data_blob.num(), 1);
+    dataset_ids_.push_back(hdf5_create_appendable_dataset(file_id_,
+        HDF5_DATA_DATASET_NAME, data_blob, chunk_rows,
+        param.compression_level()));
+    dataset_ids_.push_back(hdf5_create_appendable_dataset(file_id_,
+        HDF5_DATA_LABEL_NAME, label_blob, chunk_rows,
+        param.compression_level()));
+  }
+  hdf5_append_nd_dataset(dataset_ids_[0], rows_, data_blob);
+  hdf5_append_nd_dataset(dataset_ids_[1], rows_, label_blob);
+  rows_ += data_blob.num();
+  DLOG(INFO) << "Successfully saved " << data_blob.num() << " rows";
 }
 
 template <typename Dtype>
 void HDF5OutputLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
-  CHECK_GE(bottom.size(), 2);
-  CHECK_EQ(bottom[0]->num(), bottom[1]->num());
-  data_blob_.Reshape(bottom[0]->num(), bottom[0]->channels(),
-                     bottom[0]->height(), bottom[0]->width());
-  label_blob_.Reshape(bottom[1]->num(), bottom[1]->channels(),
-                     bottom[1]->height(), bottom[1]->width());
-  const int data_datum_dim = bottom[0]->count() / bottom[0]->num();
-  const int label_datum_dim = bottom[1]->count() / bottom[1]->num();
-
-  for (int i = 0; i < bottom[0]->num(); ++i) {
-    caffe_copy(data_datum_dim, &bottom[0]->cpu_data()[i * data_datum_dim],
-        &data_blob_.mutable_cpu_data()[i * data_datum_dim]);
-    caffe_copy(label_datum_dim, &bottom[1]->cpu_data()[i * label_datum_dim],
-        &label_blob_.mutable_cpu_data()[i * label_datum_dim]);
+  Rows* batch = free_batch(bottom);
+  for (int i = 0; i < batch->size(); ++i) {
+    caffe_copy(bottom[i]->count(), bottom[i]->cpu_data(),
+        (*batch)[i]->mutable_cpu_data());
   }
-  SaveBlobs();
+  full_.push(batch);
 }
 
 template <typename Dtype>
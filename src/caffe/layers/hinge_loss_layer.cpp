@@ -76,6 +76,10 @@ void HingeLossLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
   }
 }
 
+#ifdef CPU_ONLY
+STUB_GPU(HingeLossLayer);
+#endif
+
 INSTANTIATE_CLASS(HingeLossLayer);
 REGISTER_LAYER_CLASS(HingeLoss);
 
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// The margin violations max(0, 1 - t_n * x_nk), with t_n = 1 for the label
+// and -1 otherwise.
+template <typename Dtype>
+__global__ void HingeLossForward(const int count, const int dim,
+    const Dtype* bottom_data, const Dtype* label, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, count) {
+    const Dtype value = index % dim == static_cast<int>(label[index / dim]) ?
+        -bottom_data[index] : bottom_data[index];
+    bottom_diff[index] = max(Dtype(0), 1 + value);
+  }
+}
+
+// Turns the violations into the gradient, of the L1 norm if l1 and of the
+// squared L2 norm otherwise.
+template <typename Dtype>
+__global__ void HingeLossBackward(const int count, const int dim,
+    const Dtype* label, const bool l1, const Dtype scale,
+    Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, count) {
+    Dtype value = bottom_diff[index];
+    if (index % dim == static_cast<int>(label[index / dim])) {
+      value = -value;
+    }
+    if (l1) {
+      value = (Dtype(0) < value) - (value < Dtype(0));
+    }
+    bottom_diff[index] = scale * value;
+  }
+}
+
+template <typename Dtype>
+void HingeLossLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
+  int num = bottom[0]->num();
+  int count = bottom[0]->count();
+  int dim = count / num;
+
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  HingeLossForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+      0, Caffe::cuda_stream()>>>(count, dim, bottom[0]->gpu_data(),
+      bottom[1]->gpu_data(), bottom_diff);
+  CUDA_POST_KERNEL_CHECK;
+  Dtype loss;
+  switch (this->layer_param_.hinge_loss_param().norm()) {
+  case HingeLossParameter_Norm_L1:
+    caffe_gpu_asum(count, bottom_diff, &loss);
+    break;
+  case HingeLossParameter_Norm_L2:
+    caffe_gpu_dot(count, bottom_diff, bottom_diff, &loss);
+    break;
+  default:
+    LOG(FATAL) << "Unknown Norm";
+  }
+  top[0]->mutable_cpu_data()[0] = loss / num;
+}
+
+template <typename Dtype>
+void HingeLossLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (propagate_down[1]) {
+    LOG(FATAL) << this->type()
+               << " Layer cannot backpropagate to label inputs.";
+  }
+  if (propagate_down[0]) {
+    int num = bottom[0]->num();
+    int count = bottom[0]->count();
+    int dim = count / num;
+
+    const Dtype loss_weight = top[0]->cpu_diff()[0];
+    bool l1 = false;
+    Dtype scale = 0;
+    switch (this->layer_param_.hinge_loss_param().norm()) {
+    case HingeLossParameter_Norm_L1:
+      l1 = true;
+      scale = loss_weight / num;
+      break;
+    case HingeLossParameter_Norm_L2:
+      scale = loss_weight * 2 / num;
+      break;
+    default:
+      LOG(FATAL) << "Unknown Norm";
+    }
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    HingeLossBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+        0, Caffe::cuda_stream()>>>(count, dim, bottom[1]->gpu_data(), l1,
+        scale, bottom[0]->mutable_gpu_diff());
+    CUDA_POST_KERNEL_CHECK;
+  }
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(HingeLossLayer);
+
+}  // namespace caffe
@@ -1,5 +1,8 @@
 #include <opencv2/core/core.hpp>
 
+#include <boost/bind.hpp>
+
+#include <cmath>
 #include <fstream>  // NOLINT(readability/streams)
 #include <iostream>  // NOLINT(readability/streams)
 #include <string>
@@ -12,6 +15,7 @@
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 namespace caffe {
 
@@ -31,14 +35,60 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK((new_height == 0 && new_width == 0) ||
       (new_height > 0 && new_width > 0)) << "Current implementation requires "
       "new_height and new_width to be set at the same time.";
+  const ImageDataParameter& param = this->layer_param_.image_data_param();
+  const int buckets = param.bucket_height_size();
+  CHECK_EQ(buckets, param.bucket_width_size())
+      << "Set a bucket_width for each bucket_height";
+  CHECK(buckets == 0 || new_height == 0)
+      << "Buckets replace new_height and new_width";
+  for (int i = 0; i < buckets; ++i) {
+    CHECK(param.bucket_height(i) > 0 && param.bucket_width(i) > 0)
+        << "Buckets need a positive height and width";
+  }
   // Read the file with filenames and labels
   const string& source = this->layer_param_.image_data_param().source();
   LOG(INFO) << "Opening file " << source;
-  std::ifstream infile(source.c_str());
-  string filename;
-  int label;
-  while (infile >> filename >> label) {
-    lines_.push_back(std::make_pair(filename, label));
+  list_.Open(source, param.source_sizes());
+  CHECK_LT(list_.size(), 1UL << 31) << "Too many images in " << source;
+  const int lines_size = list_.size();
+  LOG(INFO) << "A total of " << lines_size << " images.";
+  const int decode_threads =
+      this->layer_param_.image_data_param().decode_threads();
+  CHECK_GT(decode_threads, 0);
+  for (int i = 0; i < this->loader_count(); ++i) {
+    decode_pools_.push_back(shared_ptr<ThreadPool>(
+        new ThreadPool(decode_threads)));
+  }
+  // Put each image in the bucket of its shape, and preallocate batches of
+  // the largest bucket so that others fit without reallocating
+  int largest = -1;
+  if (buckets > 0) {
+    CHECK_LE(buckets, 1 << 16) << "Too many buckets";
+    vector<std::pair<int, int> > sizes(lines_size);
+    if (list_.has_sizes()) {
+      for (int i = 0; i < lines_size; ++i) {
+        sizes[i] = std::make_pair(list_.height(i), list_.width(i));
+      }
+    } else {
+      LOG(INFO) << "Decoding the images to read their sizes";
+      decode_pools_[0]->run(lines_size, 1, boost::bind(
+          &ImageDataLayer::read_sizes, this, &sizes, _1, _2));
+    }
+    line_buckets_.resize(lines_size);
+    vector<int> counts(buckets);
+    for (int i = 0; i < lines_size; ++i) {
+      line_buckets_[i] = find_bucket(sizes[i].first, sizes[i].second);
+      ++counts[line_buckets_[i]];
+    }
+    for (int i = 0; i < buckets; ++i) {
+      LOG(INFO) << "Bucket " << param.bucket_height(i) << "x"
+                << param.bucket_width(i) << ": " << counts[i] << " images";
+      if (largest < 0 || param.bucket_height(i) * param.bucket_width(i) >
+          param.bucket_height(largest) * param.bucket_width(largest)) {
+        largest = i;
+      }
+    }
+    pending_.resize(buckets);
   }
 
   if (this->layer_param_.image_data_param().shuffle()) {
@@ -48,7 +98,6 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
     prefetch_rng_.reset(new Caffe::RNG(prefetch_rng_seed));
     ShuffleImages();
   }
-  LOG(INFO) << "A total of " << lines_.size() << " images.";
 
   lines_id_ = 0;
   // Check if we would need to randomly skip a few data points
@@ -56,13 +105,15 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
     unsigned int skip = caffe_rng_rand() %
         this->layer_param_.image_data_param().rand_skip();
     LOG(INFO) << "Skipping first " << skip << " data points.";
-    CHECK_GT(lines_.size(), skip) << "Not enough points to skip";
+    CHECK_GT(lines_size, skip) << "Not enough points to skip";
     lines_id_ = skip;
   }
   // Read an image, and use it to initialize the top blob.
-  cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_].first,
-                                    new_height, new_width, is_color);
-  CHECK(cv_img.data) << "Could not load " << lines_[lines_id_].first;
+  cv::Mat cv_img = ReadImageToCVMat(root_folder + line(lines_id_).first,
+      largest < 0 ? new_height : param.bucket_height(largest),
+      largest < 0 ? new_width : param.bucket_width(largest), is_color,
+      this->layer_param_.image_data_param().reduced_decode());
+  CHECK(cv_img.data) << "Could not load " << line(lines_id_).first;
   // Use data_transformer to infer the expected blob shape from a cv_image.
   vector<int> top_shape = this->data_transformer_->InferBlobShape(cv_img);
   this->transformed_data_.Reshape(top_shape);
@@ -70,10 +121,19 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   const int batch_size = this->layer_param_.image_data_param().batch_size();
   CHECK_GT(batch_size, 0) << "Positive batch size required";
   top_shape[0] = batch_size;
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].data_.Reshape(top_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->data_.Reshape(top_shape);
   }
   top[0]->Reshape(top_shape);
+  if (this->gpu_transform_) {
+    vector<int> params_shape(2, batch_size);
+    params_shape[1] = 3;
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->raw_.reset(new SyncedMemory(batch_size *
+          cv_img.channels() * cv_img.rows * cv_img.cols));
+      this->prefetch_[i]->params_.Reshape(params_shape);
+    }
+  }
 
   LOG(INFO) << "output data size: " << top[0]->num() << ","
       << top[0]->channels() << "," << top[0]->height() << ","
@@ -81,8 +141,131 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   // label
   vector<int> label_shape(1, batch_size);
   top[1]->Reshape(label_shape);
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].label_.Reshape(label_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->label_.Reshape(label_shape);
+  }
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::decode_images(
+    const vector<std::pair<std::string, int> >& lines, int height, int width,
+    vector<cv::Mat>* images, int begin, int end) {
+  const ImageDataParameter& param = this->layer_param_.image_data_param();
+  for (int i = begin; i < end; ++i) {
+    (*images)[i] = ReadImageToCVMat(param.root_folder() + lines[i].first,
+        height, width, param.is_color(), param.reduced_decode());
+    CHECK((*images)[i].data) << "Could not load " << lines[i].first;
+  }
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::read_sizes(vector<std::pair<int, int> >* sizes,
+    int begin, int end) {
+  const ImageDataParameter& param = this->layer_param_.image_data_param();
+  for (int i = begin; i < end; ++i) {
+    cv::Mat image = ReadImageToCVMat(param.root_folder() + list_.name(i),
+        param.is_color());
+    CHECK(image.data) << "Could not load " << list_.name(i);
+    (*sizes)[i] = std::make_pair(image.rows, image.cols);
+  }
+}
+
+template <typename Dtype>
+int ImageDataLayer<Dtype>::find_bucket(int height, int width) const {
+  const ImageDataParameter& param = this->layer_param_.image_data_param();
+  CHECK(height > 0 && width > 0) << "Images need a positive height and width";
+  int best = 0;
+  double best_ratio = 0;
+  double best_area = 0;
+  for (int i = 0; i < param.bucket_height_size(); ++i) {
+    const double h = param.bucket_height(i);
+    const double w = param.bucket_width(i);
+    // Distances in log scale, so that twice as wide is as far as twice as
+    // tall, with some tolerance on the ratio to then prefer the size
+    const double ratio = std::fabs(std::log(height * w / (width * h)));
+    const double area = std::fabs(std::log(height * width / (h * w)));
+    if (i == 0 || ratio < best_ratio - 1e-3 ||
+        (ratio < best_ratio + 1e-3 && area < best_area)) {
+      best = i;
+      best_ratio = ratio;
+      best_area = area;
+    }
+  }
+  return best;
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::read_files(
+    const vector<std::pair<std::string, int> >& lines,
+    vector<Datum>* files, int begin, int end) {
+  const string& root_folder =
+      this->layer_param_.image_data_param().root_folder();
+  for (int i = begin; i < end; ++i) {
+    CHECK(ReadFileToDatum(root_folder + lines[i].first, &(*files)[i]))
+        << "Could not load " << lines[i].first;
+  }
+}
+
+// Decodes the images into raw_, on the GPU with gpu_decode if they are
+// JPEGs kept at their size, and draws their crops, leaving the rest of the
+// transformation to Forward_gpu
+template <typename Dtype>
+void ImageDataLayer<Dtype>::load_raw(Batch<Dtype>* batch,
+    const vector<std::pair<std::string, int> >& lines, int height, int width,
+    DataTransformer<Dtype>* transformer, int loader) {
+  const ImageDataParameter& param = this->layer_param_.image_data_param();
+  const int batch_size = lines.size();
+  bool decoded = false;
+  if (this->gpu_decode_ && height == 0) {
+    vector<Datum> files(batch_size);
+    decode_pools_[loader]->run(batch_size, 1, boost::bind(
+        &ImageDataLayer::read_files, this, boost::cref(lines), &files, _1,
+        _2));
+    vector<const string*> images(batch_size);
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      images[item_id] = &files[item_id].data();
+    }
+    decoded = this->decode_raw_gpu(batch, images, param.is_color() ? 3 : 1,
+        loader);
+  }
+  if (!decoded) {
+    vector<cv::Mat> images(batch_size);
+    decode_pools_[loader]->run(batch_size, 1, boost::bind(
+        &ImageDataLayer::decode_images, this, boost::cref(lines), height,
+        width, &images, _1, _2));
+    vector<int> shape(3);
+    shape[0] = images[0].channels();
+    shape[1] = images[0].rows;
+    shape[2] = images[0].cols;
+    const size_t size = shape[0] * shape[1] * shape[2];
+    if (batch->raw_->size() < batch_size * size) {
+      batch->raw_.reset(new SyncedMemory(batch_size * size));
+    }
+    batch->raw_shape_ = shape;
+    uint8_t* raw = static_cast<uint8_t*>(batch->raw_->mutable_cpu_data());
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      const cv::Mat& image = images[item_id];
+      CHECK(image.channels() == shape[0] && image.rows == shape[1] &&
+            image.cols == shape[2])
+          << "gpu_transform needs images of the same size within a batch";
+      CHECK_EQ(image.depth(), CV_8U)
+          << "gpu_transform only supports uint8 images";
+      // From interleaved to a plane per channel, like a Datum
+      uint8_t* dst = raw + item_id * size;
+      for (int h = 0; h < shape[1]; ++h) {
+        const uchar* src = image.ptr<uchar>(h);
+        for (int w = 0; w < shape[2]; ++w) {
+          for (int c = 0; c < shape[0]; ++c) {
+            dst[(c * shape[1] + h) * shape[2] + w] = *src++;
+          }
+        }
+      }
+    }
+  }
+  const vector<int>& shape = batch->raw_shape_;
+  int* params = batch->params_.mutable_cpu_data();
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    transformer->TransformParams(shape[1], shape[2], params + item_id * 3);
   }
 }
 
@@ -90,34 +273,98 @@ template <typename Dtype>
 void ImageDataLayer<Dtype>::ShuffleImages() {
   caffe::rng_t* prefetch_rng =
       static_cast<caffe::rng_t*>(prefetch_rng_->generator());
-  shuffle(lines_.begin(), lines_.end(), prefetch_rng);
+  // Shuffles the indices of the images, which the list keeps in place
+  if (order_.empty()) {
+    order_.resize(list_.size());
+    for (uint32_t i = 0; i < order_.size(); ++i) {
+      order_[i] = i;
+    }
+  }
+  shuffle(order_.begin(), order_.end(), prefetch_rng);
 }
 
 // This function is called on prefetch thread
 template <typename Dtype>
-void ImageDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
+void ImageDataLayer<Dtype>::load_batch(Batch<Dtype>* batch, int loader) {
   CPUTimer batch_timer;
   batch_timer.Start();
   double read_time = 0;
   double trans_time = 0;
   CPUTimer timer;
   CHECK(batch->data_.count());
-  CHECK(this->transformed_data_.count());
+  DataTransformer<Dtype>* transformer = this->transformer(loader);
+  Blob<Dtype>* transformed_data = this->transformed_data(loader);
+  CHECK(transformed_data->count());
   ImageDataParameter image_data_param = this->layer_param_.image_data_param();
   const int batch_size = image_data_param.batch_size();
-  const int new_height = image_data_param.new_height();
-  const int new_width = image_data_param.new_width();
-  const bool is_color = image_data_param.is_color();
-  string root_folder = image_data_param.root_folder();
+
+  // Take the lines of the batch, then read them while other loaders take
+  // theirs. With buckets, lines wait in the pending lines of their bucket
+  // until one has a batch.
+  vector<std::pair<std::string, int> > lines;
+  int bucket = -1;
+  const int lines_size = list_.size();
+  this->begin_read(loader);
+  while (lines.size() < batch_size) {
+    CHECK_GT(lines_size, lines_id_);
+    if (line_buckets_.empty()) {
+      lines.push_back(line(lines_id_));
+    } else {
+      const int line_bucket = line_buckets_[order_.empty() ? lines_id_ :
+                                            order_[lines_id_]];
+      pending_[line_bucket].push_back(line(lines_id_));
+      if (pending_[line_bucket].size() == batch_size) {
+        bucket = line_bucket;
+        lines.swap(pending_[bucket]);
+      }
+    }
+    // go to the next iter
+    lines_id_++;
+    if (lines_id_ >= lines_size) {
+      // We have reached the end. Restart from the first.
+      DLOG(INFO) << "Restarting data prefetching from start.";
+      lines_id_ = 0;
+      if (this->layer_param_.image_data_param().shuffle()) {
+        ShuffleImages();
+      }
+    }
+  }
+  this->end_read();
+  const int height = bucket < 0 ? image_data_param.new_height() :
+      image_data_param.bucket_height(bucket);
+  const int width = bucket < 0 ? image_data_param.new_width() :
+      image_data_param.bucket_width(bucket);
+
+  if (this->gpu_transform_) {
+    timer.Start();
+    load_raw(batch, lines, height, width, transformer, loader);
+    read_time += timer.MicroSeconds();
+    vector<int> top_shape = transformer->InferBlobShape(batch->raw_shape_);
+    transformed_data->Reshape(top_shape);
+    top_shape[0] = batch_size;
+    batch->data_.Reshape(top_shape);
+    Dtype* prefetch_label = batch->label_.mutable_cpu_data();
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      prefetch_label[item_id] = lines[item_id].second;
+    }
+    this->data_stats_.add(DataStats::READ, read_time);
+    return;
+  }
+
+  // Decode the batch, on this thread and the decode pool of the loader
+  timer.Start();
+  vector<cv::Mat> images(batch_size);
+  decode_pools_[loader]->run(batch_size, 1, boost::bind(
+      &ImageDataLayer::decode_images, this, boost::cref(lines), height, width,
+      &images, _1, _2));
+  read_time += timer.MicroSeconds();
 
   // Reshape according to the first image of each batch
-  // on single input batches allows for inputs of varying dimension.
-  cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_].first,
-      new_height, new_width, is_color);
-  CHECK(cv_img.data) << "Could not load " << lines_[lines_id_].first;
+  // on single input batches allows for inputs of varying dimension, and
+  // with buckets to the shape of the bucket.
   // Use data_transformer to infer the expected blob shape from a cv_img.
-  vector<int> top_shape = this->data_transformer_->InferBlobShape(cv_img);
-  this->transformed_data_.Reshape(top_shape);
+  vector<int> top_shape = transformer->InferBlobShape(images[0]);
+  transformed_data->Reshape(top_shape);
   // Reshape batch according to the batch_size.
   top_shape[0] = batch_size;
   batch->data_.Reshape(top_shape);
@@ -126,38 +373,23 @@ void ImageDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
   Dtype* prefetch_label = batch->label_.mutable_cpu_data();
 
   // datum scales
-  const int lines_size = lines_.size();
   for (int item_id = 0; item_id < batch_size; ++item_id) {
-    // get a blob
-    timer.Start();
-    CHECK_GT(lines_size, lines_id_);
-    cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_].first,
-        new_height, new_width, is_color);
-    CHECK(cv_img.data) << "Could not load " << lines_[lines_id_].first;
-    read_time += timer.MicroSeconds();
     timer.Start();
     // Apply transformations (mirror, crop...) to the image
     int offset = batch->data_.offset(item_id);
-    this->transformed_data_.set_cpu_data(prefetch_data + offset);
-    this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
+    transformed_data->set_cpu_data(prefetch_data + offset);
+    transformer->Transform(images[item_id], transformed_data);
     trans_time += timer.MicroSeconds();
 
-    prefetch_label[item_id] = lines_[lines_id_].second;
-    // go to the next iter
-    lines_id_++;
-    if (lines_id_ >= lines_size) {
-      // We have reached the end. Restart from the first.
-      DLOG(INFO) << "Restarting data prefetching from start.";
-      lines_id_ = 0;
-      if (this->layer_param_.image_data_param().shuffle()) {
-        ShuffleImages();
-      }
-    }
+    prefetch_label[item_id] = lines[item_id].second;
   }
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
   DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
   DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  // Images are read and decoded together
+  this->data_stats_.add(DataStats::READ, read_time);
+  this->data_stats_.add(DataStats::TRANSFORM, trans_time);
 }
 
 INSTANTIATE_CLASS(ImageDataLayer);
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// A single block sums the weighted log probabilities into the top, which
+// thus stays on the device.
+template <typename Dtype>
+__global__ void InfogainLossForward(const int num, const int dim,
+    const Dtype* bottom_data, const Dtype* label, const Dtype* infogain_mat,
+    const Dtype threshold, Dtype* loss) {
+  __shared__ Dtype losses[CAFFE_CUDA_NUM_THREADS];
+  Dtype sum = 0;
+  for (int index = threadIdx.x; index < num * dim; index += blockDim.x) {
+    const int label_value = static_cast<int>(label[index / dim]);
+    const int j = index % dim;
+    sum -= infogain_mat[label_value * dim + j]
+        * log(max(bottom_data[index], threshold));
+  }
+  losses[threadIdx.x] = sum;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      losses[threadIdx.x] += losses[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    *loss = losses[0] / num;
+  }
+}
+
+template <typename Dtype>
+__global__ void InfogainLossBackward(const int count, const int dim,
+    const Dtype* bottom_data, const Dtype* label, const Dtype* infogain_mat,
+    const Dtype threshold, const Dtype scale, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, count) {
+    const int label_value = static_cast<int>(label[index / dim]);
+    const int j = index % dim;
+    bottom_diff[index] = scale * infogain_mat[label_value * dim + j]
+        / max(bottom_data[index], threshold);
+  }
+}
+
+template <typename Dtype>
+void InfogainLossLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const Dtype* infogain_mat = NULL;
+  if (bottom.size() < 3) {
+    infogain_mat = infogain_.gpu_data();
+  } else {
+    infogain_mat = bottom[2]->gpu_data();
+  }
+  int num = bottom[0]->num();
+  int dim = bottom[0]->count() / bottom[0]->num();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  InfogainLossForward<Dtype><<<1, CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(num, dim, bottom[0]->gpu_data(),
+      bottom[1]->gpu_data(), infogain_mat, Dtype(kLOG_THRESHOLD),
+      top[0]->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template <typename Dtype>
+void InfogainLossLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  if (propagate_down[1]) {
+    LOG(FATAL) << this->type()
+               << " Layer cannot backpropagate to label inputs.";
+  }
+  if (propagate_down.size() > 2 && propagate_down[2]) {
+    LOG(FATAL) << this->type()
+               << " Layer cannot backpropagate to infogain inputs.";
+  }
+  if (propagate_down[0]) {
+    const Dtype* infogain_mat = NULL;
+    if (bottom.size() < 3) {
+      infogain_mat = infogain_.gpu_data();
+    } else {
+      infogain_mat = bottom[2]->gpu_data();
+    }
+    int count = bottom[0]->count();
+    int num = bottom[0]->num();
+    int dim = count / num;
+    const Dtype scale = - top[0]->cpu_diff()[0] / num;
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    InfogainLossBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
+        CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count, dim,
+        bottom[0]->gpu_data(), bottom[1]->gpu_data(), infogain_mat,
+        Dtype(kLOG_THRESHOLD), scale, bottom[0]->mutable_gpu_diff());
+    CUDA_POST_KERNEL_CHECK;
+  }
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(InfogainLossLayer);
+
+}  // namespace caffe
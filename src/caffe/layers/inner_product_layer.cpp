@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <utility>
 #include <vector>
 
 #include "caffe/blob.hpp"
@@ -5,6 +7,7 @@
 #include "caffe/filler.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/packed_gemm.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
@@ -14,13 +17,36 @@ void InnerProductLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   const int num_output = this->layer_param_.inner_product_param().num_output();
   bias_term_ = this->layer_param_.inner_product_param().bias_term();
+  fused_relu_ = this->layer_param_.inner_product_param().has_fused_relu();
+  relu_slope_ =
+      this->layer_param_.inner_product_param().fused_relu().negative_slope();
   N_ = num_output;
-  const int axis = bottom[0]->CanonicalAxisIndex(
-      this->layer_param_.inner_product_param().axis());
-  // Dimensions starting from "axis" are "flattened" into a single
-  // length K_ vector. For example, if bottom[0]'s shape is (N, C, H, W),
-  // and axis == 1, N inner products with dimension CHW are performed.
-  K_ = bottom[0]->count(axis);
+  sparse_ = this->layer_param_.inner_product_param().has_sparse_dim();
+  quantized_ = this->layer_param_.has_quantization_param()
+      && this->phase_ == TEST;
+  CHECK(!quantized_ || !sparse_)
+      << "quantization_param is not implemented for sparse inputs";
+  weight_int8_.clear();
+  sparse_weights_ = this->layer_param_.has_sparsity_param()
+      && this->phase_ == TEST;
+  CHECK(!sparse_weights_ || (!sparse_ && !quantized_))
+      << "sparsity_param is not implemented for sparse inputs or with "
+      << "quantization_param";
+  weight_offsets_.Reshape(vector<int>(1, 0));
+  if (sparse_) {
+    CHECK_EQ(bottom.size(), 3) << "A sparse input takes three bottoms: "
+        << "values, column indices and row offsets";
+    CHECK(!fused_relu_) << "fused_relu is not implemented for sparse inputs";
+    K_ = this->layer_param_.inner_product_param().sparse_dim();
+  } else {
+    CHECK_EQ(bottom.size(), 1) << "Only sparse inputs take three bottoms";
+    const int axis = bottom[0]->CanonicalAxisIndex(
+        this->layer_param_.inner_product_param().axis());
+    // Dimensions starting from "axis" are "flattened" into a single
+    // length K_ vector. For example, if bottom[0]'s shape is (N, C, H, W),
+    // and axis == 1, N inner products with dimension CHW are performed.
+    K_ = bottom[0]->count(axis);
+  }
   // Check if we need to set up the weights
   if (this->blobs_.size() > 0) {
     LOG(INFO) << "Skipping parameter initialization";
@@ -54,21 +80,32 @@ void InnerProductLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void InnerProductLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
-  // Figure out the dimensions
-  const int axis = bottom[0]->CanonicalAxisIndex(
-      this->layer_param_.inner_product_param().axis());
-  const int new_K = bottom[0]->count(axis);
-  CHECK_EQ(K_, new_K)
-      << "Input size incompatible with inner product parameters.";
-  // The first "axis" dimensions are independent inner products; the total
-  // number of these is M_, the product over these dimensions.
-  M_ = bottom[0]->count(0, axis);
-  // The top shape will be the bottom shape with the flattened axes dropped,
-  // and replaced by a single axis with dimension num_output (N_).
-  vector<int> top_shape = bottom[0]->shape();
-  top_shape.resize(axis + 1);
-  top_shape[axis] = N_;
-  top[0]->Reshape(top_shape);
+  if (sparse_) {
+    CHECK_EQ(bottom[0]->count(), bottom[1]->count())
+        << "Sparse inputs need a column index for each value.";
+    M_ = bottom[2]->count() - 1;
+    CHECK_GE(M_, 0) << "Sparse inputs need an offset past their last row.";
+    vector<int> top_shape(2);
+    top_shape[0] = M_;
+    top_shape[1] = N_;
+    top[0]->Reshape(top_shape);
+  } else {
+    // Figure out the dimensions
+    const int axis = bottom[0]->CanonicalAxisIndex(
+        this->layer_param_.inner_product_param().axis());
+    const int new_K = bottom[0]->count(axis);
+    CHECK_EQ(K_, new_K)
+        << "Input size incompatible with inner product parameters.";
+    // The first "axis" dimensions are independent inner products; the total
+    // number of these is M_, the product over these dimensions.
+    M_ = bottom[0]->count(0, axis);
+    // The top shape will be the bottom shape with the flattened axes dropped,
+    // and replaced by a single axis with dimension num_output (N_).
+    vector<int> top_shape = bottom[0]->shape();
+    top_shape.resize(axis + 1);
+    top_shape[axis] = N_;
+    top[0]->Reshape(top_shape);
+  }
   // Set up the bias multiplier
   if (bias_term_) {
     vector<int> bias_shape(1, M_);
@@ -83,9 +120,77 @@ void InnerProductLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = top[0]->mutable_cpu_data();
   const Dtype* weight = this->blobs_[0]->cpu_data();
-  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, N_, K_, (Dtype)1.,
-      bottom_data, weight, (Dtype)0., top_data);
-  if (bias_term_) {
+  bool bias_added = false;
+  if (sparse_) {
+    // Each output sums over the nonzeros of its row only
+    const Dtype* indices = bottom[1]->cpu_data();
+    const Dtype* offsets = bottom[2]->cpu_data();
+    for (int m = 0; m < M_; ++m) {
+      const int begin = static_cast<int>(offsets[m]);
+      const int end = static_cast<int>(offsets[m + 1]);
+      for (int n = 0; n < N_; ++n) {
+        Dtype sum = 0;
+        for (int e = begin; e < end; ++e) {
+          sum += bottom_data[e] * weight[n * K_ + static_cast<int>(indices[e])];
+        }
+        top_data[m * N_ + n] = sum;
+      }
+    }
+  } else if (quantized_) {
+    // The weights are quantized by the first forward and kept from then on.
+    if (weight_int8_.empty()) {
+      weight_int8_.resize(N_ * K_);
+      weight_scale_.resize(N_);
+      caffe_cpu_quantize_rows(N_, K_, weight, &weight_scale_[0],
+          &weight_int8_[0]);
+    }
+    const QuantizationParameter& param =
+        this->layer_param_.quantization_param();
+    const Dtype input_scale = param.has_input_scale() ? param.input_scale()
+        : caffe_cpu_amax(M_ * K_, bottom_data) / Dtype(127);
+    input_int8_.resize(M_ * K_);
+    output_int32_.resize(M_ * N_);
+    caffe_cpu_quantize(M_ * K_, input_scale, bottom_data, &input_int8_[0]);
+    caffe_cpu_gemm_int8(M_, N_, K_, &input_int8_[0], &weight_int8_[0],
+        &output_int32_[0]);
+    for (int m = 0; m < M_; ++m) {
+      for (int n = 0; n < N_; ++n) {
+        top_data[m * N_ + n] =
+            output_int32_[m * N_ + n] * input_scale * weight_scale_[n];
+      }
+    }
+  } else if (CompressWeights()) {
+    caffe_cpu_csrmm_trans(M_, N_, K_, bottom_data, weight_values_.cpu_data(),
+        weight_columns_.cpu_data(), weight_offsets_.cpu_data(), top_data);
+  } else {
+    // The bias goes into the outputs first for the product to add to it,
+    // rather than by a second GEMM.
+    Dtype beta = 0;
+    if (bias_term_ && !fused_relu_) {
+      const Dtype* bias = this->blobs_[1]->cpu_data();
+      for (int m = 0; m < M_; ++m) {
+        caffe_copy(N_, bias, top_data + m * N_);
+      }
+      beta = 1;
+      bias_added = true;
+    }
+    if (M_ == 1) {
+      caffe_cpu_gemv<Dtype>(CblasNoTrans, N_, K_, (Dtype)1., weight,
+          bottom_data, beta, top_data);
+    } else if (this->phase_ == TEST) {
+      // The weights are packed by the first forward, and again once changed
+      packed_weight_.Pack(false, CblasTrans, M_, N_, K_, weight,
+          this->blobs_[0]->data().get());
+      packed_weight_.Gemm(CblasNoTrans, bottom_data, beta, top_data);
+    } else {
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, N_, K_, (Dtype)1.,
+          bottom_data, weight, beta, top_data);
+    }
+  }
+  if (fused_relu_) {
+    caffe_cpu_bias_relu(M_ * N_, N_, 1,
+        bias_term_ ? this->blobs_[1]->cpu_data() : NULL, relu_slope_, top_data);
+  } else if (bias_term_ && !bias_added) {
     caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, N_, 1, (Dtype)1.,
         bias_multiplier_.cpu_data(),
         this->blobs_[1]->cpu_data(), (Dtype)1., top_data);
@@ -96,7 +201,33 @@ template <typename Dtype>
 void InnerProductLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down,
     const vector<Blob<Dtype>*>& bottom) {
-  if (this->param_propagate_down_[0]) {
+  if (fused_relu_) {
+    caffe_cpu_relu_backward(top[0]->count(), top[0]->cpu_data(), relu_slope_,
+        top[0]->mutable_cpu_diff());
+  }
+  if (sparse_) {
+    for (int i = 0; i < bottom.size(); ++i) {
+      CHECK(!propagate_down[i]) << this->type()
+          << " Layer cannot backpropagate to sparse inputs.";
+    }
+  }
+  if (this->param_propagate_down_[0] && sparse_) {
+    const Dtype* top_diff = top[0]->cpu_diff();
+    const Dtype* bottom_data = bottom[0]->cpu_data();
+    const Dtype* indices = bottom[1]->cpu_data();
+    const Dtype* offsets = bottom[2]->cpu_data();
+    Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
+    // Only the columns of the nonzeros get a gradient
+    for (int m = 0; m < M_; ++m) {
+      for (int e = static_cast<int>(offsets[m]);
+           e < static_cast<int>(offsets[m + 1]); ++e) {
+        const int column = static_cast<int>(indices[e]);
+        for (int n = 0; n < N_; ++n) {
+          weight_diff[n * K_ + column] += bottom_data[e] * top_diff[m * N_ + n];
+        }
+      }
+    }
+  } else if (this->param_propagate_down_[0]) {
     const Dtype* top_diff = top[0]->cpu_diff();
     const Dtype* bottom_data = bottom[0]->cpu_data();
     // Gradient with respect to weight
@@ -114,9 +245,74 @@ void InnerProductLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const Dtype* top_diff = top[0]->cpu_diff();
     // Gradient with respect to bottom data
     caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, K_, N_, (Dtype)1.,
-        top_diff, this->blobs_[0]->cpu_data(), (Dtype)0.,
-        bottom[0]->mutable_cpu_diff());
+        top_diff, this->blobs_[0]->cpu_data(),
+        (Dtype)this->accumulate_bottom_diff(0), bottom[0]->mutable_cpu_diff());
+  }
+}
+
+template <typename Dtype>
+void InnerProductLayer<Dtype>::SparseToColumns(
+    const vector<Blob<Dtype>*>& bottom) {
+  const Dtype* values = bottom[0]->cpu_data();
+  const Dtype* indices = bottom[1]->cpu_data();
+  const Dtype* offsets = bottom[2]->cpu_data();
+  // The column and row of each nonzero, and its index
+  vector<std::pair<std::pair<int, int>, int> > nonzeros;
+  nonzeros.reserve(bottom[0]->count());
+  for (int m = 0; m < M_; ++m) {
+    for (int e = static_cast<int>(offsets[m]);
+         e < static_cast<int>(offsets[m + 1]); ++e) {
+      nonzeros.push_back(std::make_pair(
+          std::make_pair(static_cast<int>(indices[e]), m), e));
+    }
+  }
+  std::sort(nonzeros.begin(), nonzeros.end());
+  vector<int> columns;
+  vector<int> column_offsets;
+  const vector<int> shape(1, nonzeros.size());
+  csc_rows_.Reshape(shape);
+  csc_values_.Reshape(shape);
+  int* rows = csc_rows_.mutable_cpu_data();
+  Dtype* column_values = csc_values_.mutable_cpu_data();
+  for (int i = 0; i < nonzeros.size(); ++i) {
+    const int column = nonzeros[i].first.first;
+    if (columns.empty() || columns.back() != column) {
+      columns.push_back(column);
+      column_offsets.push_back(i);
+    }
+    rows[i] = nonzeros[i].first.second;
+    column_values[i] = values[nonzeros[i].second];
+  }
+  column_offsets.push_back(nonzeros.size());
+  csc_columns_.Reshape(vector<int>(1, columns.size()));
+  csc_offsets_.Reshape(vector<int>(1, column_offsets.size()));
+  std::copy(columns.begin(), columns.end(), csc_columns_.mutable_cpu_data());
+  std::copy(column_offsets.begin(), column_offsets.end(),
+      csc_offsets_.mutable_cpu_data());
+}
+
+template <typename Dtype>
+bool InnerProductLayer<Dtype>::CompressWeights() {
+  if (!sparse_weights_ || weight_offsets_.count() > 0) {
+    return sparse_weights_;
+  }
+  const Dtype* weight = this->blobs_[0]->cpu_data();
+  weight_offsets_.Reshape(vector<int>(1, N_ + 1));
+  int* offsets = weight_offsets_.mutable_cpu_data();
+  caffe_cpu_csr_offsets(N_, K_, weight, offsets);
+  const float sparsity = 1 - static_cast<float>(offsets[N_]) / (N_ * K_);
+  if (sparsity < this->layer_param_.sparsity_param().min_sparsity()) {
+    LOG(INFO) << this->layer_param_.name() << " runs dense, with only "
+              << sparsity << " of its weights zero";
+    sparse_weights_ = false;
+    return false;
   }
+  const vector<int> shape(1, std::max(offsets[N_], 1));
+  weight_values_.Reshape(shape);
+  weight_columns_.Reshape(shape);
+  caffe_cpu_csr(N_, K_, weight, weight_values_.mutable_cpu_data(),
+      weight_columns_.mutable_cpu_data());
+  return true;
 }
 
 #ifdef CPU_ONLY
@@ -124,6 +320,5 @@ STUB_GPU(InnerProductLayer);
 #endif
 
 INSTANTIATE_CLASS(InnerProductLayer);
-REGISTER_LAYER_CLASS(InnerProduct);
 
 }  // namespace caffe
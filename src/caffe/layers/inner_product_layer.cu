@@ -9,13 +9,88 @@
 
 namespace caffe {
 
+// Each output of a sparse input sums over the nonzeros of its row.
+template <typename Dtype>
+__global__ void SparseForward(const int n, const int num_output,
+    const int dim, const Dtype* values, const Dtype* indices,
+    const Dtype* offsets, const Dtype* weight, Dtype* out) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int m = index / num_output;
+    const Dtype* weight_row = weight + (index % num_output) * dim;
+    Dtype sum = 0;
+    for (int e = static_cast<int>(offsets[m]);
+         e < static_cast<int>(offsets[m + 1]); ++e) {
+      sum += values[e] * weight_row[static_cast<int>(indices[e])];
+    }
+    out[index] = sum;
+  }
+}
+
+// Each weight of a nonzero column sums the gradient over the column's
+// nonzeros, as sorted by SparseToColumns.
+template <typename Dtype>
+__global__ void SparseWeightBackward(const int n, const int num_columns,
+    const int num_output, const int dim, const int* columns,
+    const int* column_offsets, const int* rows, const Dtype* values,
+    const Dtype* top_diff, Dtype* weight_diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int c = index % num_columns;
+    const int output = index / num_columns;
+    Dtype sum = 0;
+    for (int e = column_offsets[c]; e < column_offsets[c + 1]; ++e) {
+      sum += values[e] * top_diff[rows[e] * num_output + output];
+    }
+    weight_diff[output * dim + columns[c]] += sum;
+  }
+}
+
 template <typename Dtype>
 void InnerProductLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = top[0]->mutable_gpu_data();
   const Dtype* weight = this->blobs_[0]->gpu_data();
-  if (M_ == 1) {
+  if (sparse_) {
+    const int count = M_ * N_;
+    if (count > 0) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      SparseForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+          0, Caffe::cuda_stream()>>>(count, N_, K_, bottom_data,
+          bottom[1]->gpu_data(), bottom[2]->gpu_data(), weight, top_data);
+      CUDA_POST_KERNEL_CHECK;
+    }
+    if (bias_term_) {
+      caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, N_, 1, (Dtype)1.,
+          bias_multiplier_.gpu_data(), this->blobs_[1]->gpu_data(),
+          (Dtype)1., top_data);
+    }
+    return;
+  }
+  if (CompressWeights()) {
+    caffe_gpu_csrmm_trans(M_, N_, K_, bottom_data, weight_values_.gpu_data(),
+        weight_columns_.gpu_data(), weight_offsets_.gpu_data(), top_data);
+    if (fused_relu_) {
+      caffe_gpu_bias_relu(M_ * N_, N_, 1,
+          bias_term_ ? this->blobs_[1]->gpu_data() : NULL, relu_slope_,
+          top_data);
+    } else if (bias_term_) {
+      caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, N_, 1, (Dtype)1.,
+          bias_multiplier_.gpu_data(), this->blobs_[1]->gpu_data(),
+          (Dtype)1., top_data);
+    }
+    return;
+  }
+  if (fused_relu_) {
+    if (M_ == 1) {
+      caffe_gpu_gemv<Dtype>(CblasNoTrans, N_, K_, (Dtype)1.,
+                           weight, bottom_data, (Dtype)0., top_data);
+    } else {
+      caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, N_, K_, (Dtype)1.,
+                            bottom_data, weight, (Dtype)0., top_data);
+    }
+    caffe_gpu_bias_relu(M_ * N_, N_, 1,
+        bias_term_ ? this->blobs_[1]->gpu_data() : NULL, relu_slope_, top_data);
+  } else if (M_ == 1) {
     caffe_gpu_gemv<Dtype>(CblasNoTrans, N_, K_, (Dtype)1.,
                          weight, bottom_data, (Dtype)0., top_data);
     if (bias_term_)
@@ -35,7 +110,30 @@ template <typename Dtype>
 void InnerProductLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down,
     const vector<Blob<Dtype>*>& bottom) {
-  if (this->param_propagate_down_[0]) {
+  if (fused_relu_) {
+    caffe_gpu_relu_backward(top[0]->count(), top[0]->gpu_data(), relu_slope_,
+        top[0]->mutable_gpu_diff());
+  }
+  if (sparse_) {
+    for (int i = 0; i < bottom.size(); ++i) {
+      CHECK(!propagate_down[i]) << this->type()
+          << " Layer cannot backpropagate to sparse inputs.";
+    }
+  }
+  if (this->param_propagate_down_[0] && sparse_) {
+    SparseToColumns(bottom);
+    const int count = csc_columns_.count() * N_;
+    if (count > 0) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      SparseWeightBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count,
+          csc_columns_.count(), N_, K_, csc_columns_.gpu_data(),
+          csc_offsets_.gpu_data(), csc_rows_.gpu_data(),
+          csc_values_.gpu_data(), top[0]->gpu_diff(),
+          this->blobs_[0]->mutable_gpu_diff());
+      CUDA_POST_KERNEL_CHECK;
+    }
+  } else if (this->param_propagate_down_[0]) {
     const Dtype* top_diff = top[0]->gpu_diff();
     const Dtype* bottom_data = bottom[0]->gpu_data();
     // Gradient with respect to weight
@@ -53,8 +151,8 @@ void InnerProductLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const Dtype* top_diff = top[0]->gpu_diff();
     // Gradient with respect to bottom data
     caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, K_, N_, (Dtype)1.,
-        top_diff, this->blobs_[0]->gpu_data(), (Dtype)0.,
-        bottom[0]->mutable_gpu_diff());
+        top_diff, this->blobs_[0]->gpu_data(),
+        (Dtype)this->accumulate_bottom_diff(0), bottom[0]->mutable_gpu_diff());
   }
 }
 
@@ -0,0 +1,54 @@
+#include <vector>
+
+#include "caffe/common_layers.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void LayoutLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  CHECK_NE(top[0], bottom[0]) << this->type() << " Layer does not "
+      "allow in-place computation.";
+  CHECK_EQ(4, bottom[0]->num_axes()) << "Input must have 4 axes, "
+      << "corresponding to (num, channels, height, width)";
+  const Layout layout = this->layer_param_.layout_param().layout();
+  CHECK_NE(bottom[0]->layout(), layout) << "The bottom is already in the "
+      << "layout of the top";
+  top[0]->ReshapeLike(*bottom[0]);
+  top[0]->set_layout(layout);
+}
+
+// Each item is a channels x pixels matrix in NCHW, and its transpose in NHWC.
+template <typename Dtype>
+void LayoutLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const int channels = bottom[0]->channels();
+  const int pixels = bottom[0]->height() * bottom[0]->width();
+  const bool nhwc = top[0]->layout() == NHWC;
+  caffe_cpu_transpose(bottom[0]->num(), nhwc ? channels : pixels,
+      nhwc ? pixels : channels, bottom[0]->cpu_data(),
+      top[0]->mutable_cpu_data());
+}
+
+template <typename Dtype>
+void LayoutLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) { return; }
+  const int channels = bottom[0]->channels();
+  const int pixels = bottom[0]->height() * bottom[0]->width();
+  const bool nhwc = top[0]->layout() == NHWC;
+  caffe_cpu_transpose(bottom[0]->num(), nhwc ? pixels : channels,
+      nhwc ? channels : pixels, top[0]->cpu_diff(),
+      bottom[0]->mutable_cpu_diff());
+}
+
+#ifdef CPU_ONLY
+STUB_GPU(LayoutLayer);
+#endif
+
+INSTANTIATE_CLASS(LayoutLayer);
+REGISTER_LAYER_CLASS(Layout);
+
+}  // namespace caffe
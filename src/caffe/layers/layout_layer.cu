@@ -0,0 +1,34 @@
+#include <vector>
+
+#include "caffe/common_layers.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void LayoutLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const int channels = bottom[0]->channels();
+  const int pixels = bottom[0]->height() * bottom[0]->width();
+  const bool nhwc = top[0]->layout() == NHWC;
+  caffe_gpu_transpose(bottom[0]->num(), nhwc ? channels : pixels,
+      nhwc ? pixels : channels, bottom[0]->gpu_data(),
+      top[0]->mutable_gpu_data());
+}
+
+template <typename Dtype>
+void LayoutLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) { return; }
+  const int channels = bottom[0]->channels();
+  const int pixels = bottom[0]->height() * bottom[0]->width();
+  const bool nhwc = top[0]->layout() == NHWC;
+  caffe_gpu_transpose(bottom[0]->num(), nhwc ? pixels : channels,
+      nhwc ? channels : pixels, top[0]->gpu_diff(),
+      bottom[0]->mutable_gpu_diff());
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(LayoutLayer);
+
+}  // namespace caffe
@@ -1,11 +1,18 @@
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 #include "caffe/layer.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
 
+using std::min;
+
 template <typename Dtype>
 void LRNLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
@@ -81,6 +88,7 @@ void LRNLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
     scale_.Reshape(num_, channels_, height_, width_);
     break;
   case LRNParameter_NormRegion_WITHIN_CHANNEL:
+    scale_.Reshape(num_, channels_, height_, width_);
     split_layer_->Reshape(bottom, split_top_vec_);
     square_layer_->Reshape(square_bottom_vec_, square_top_vec_);
     pool_layer_->Reshape(square_top_vec_, pool_top_vec_);
@@ -90,6 +98,71 @@ void LRNLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   }
 }
 
+// Pixels of an image processed together across channels, small enough for
+// the running sum and the rows of each channel to stay in L1
+const int kLRNTile = 256;
+
+// Sets output to input * scale^-beta, the common beta of 0.75 taking two
+// square roots instead of pow
+template <typename Dtype>
+static inline void lrn_scale_output(int n, const Dtype* input,
+    const Dtype* scale, const Dtype beta, Dtype* output) {
+  if (beta == Dtype(0.75)) {
+    for (int i = 0; i < n; ++i) {
+      output[i] = input[i] / std::sqrt(scale[i] * std::sqrt(scale[i]));
+    }
+  } else {
+    for (int i = 0; i < n; ++i) {
+      output[i] = input[i] * std::pow(scale[i], -beta);
+    }
+  }
+}
+
+// Sums the values of a height x width plane over the zero padded windows of
+// 2 * pad + 1 rows and columns centered on each element, with a running sum
+// along each row and then one along the columns
+template <typename Dtype>
+static void lrn_box_sum(const Dtype* values, int height, int width, int pad,
+    Dtype* rows, Dtype* sums) {
+  for (int h = 0; h < height; ++h) {
+    const Dtype* value = values + h * width;
+    Dtype* row = rows + h * width;
+    Dtype sum = 0;
+    for (int w = 0; w < min(pad, width); ++w) {
+      sum += value[w];
+    }
+    for (int w = 0; w < width; ++w) {
+      if (w + pad < width) {
+        sum += value[w + pad];
+      }
+      row[w] = sum;
+      if (w >= pad) {
+        sum -= value[w - pad];
+      }
+    }
+  }
+  caffe_set(width, Dtype(0), sums);
+  for (int h = 0; h <= pad && h < height; ++h) {
+    caffe_axpy(width, Dtype(1), rows + h * width, sums);
+  }
+  for (int h = 1; h < height; ++h) {
+    Dtype* sum = sums + h * width;
+    caffe_copy(width, sum - width, sum);
+    if (h + pad < height) {
+      const Dtype* head = rows + (h + pad) * width;
+      for (int w = 0; w < width; ++w) {
+        sum[w] += head[w];
+      }
+    }
+    if (h > pad) {
+      const Dtype* tail = rows + (h - pad - 1) * width;
+      for (int w = 0; w < width; ++w) {
+        sum[w] -= tail[w];
+      }
+    }
+  }
+}
+
 template <typename Dtype>
 void LRNLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
@@ -98,58 +171,102 @@ void LRNLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     CrossChannelForward_cpu(bottom, top);
     break;
   case LRNParameter_NormRegion_WITHIN_CHANNEL:
-    WithinChannelForward(bottom, top);
+    WithinChannelForward_cpu(bottom, top);
     break;
   default:
     LOG(FATAL) << "Unknown normalization region.";
   }
 }
 
+template <typename Dtype>
+void LRNLayer<Dtype>::cross_channel_forward_cpu(const Dtype* bottom_data,
+    Dtype* top_data, Dtype* scale_data, int begin, int end) {
+  const int spatial = height_ * width_;
+  const int tiles = (spatial + kLRNTile - 1) / kLRNTile;
+  const Dtype alpha_over_size = alpha_ / size_;
+  // The window of channel c spans [c - pre_pad_, c + pre_pad_], size_ being
+  // odd, and slides by adding its head and subtracting its tail
+  Dtype accum[kLRNTile];
+  for (int i = begin; i < end; ++i) {
+    const int offset = (i / tiles) * channels_ * spatial
+        + (i % tiles) * kLRNTile;
+    const int n = min(kLRNTile, spatial - (i % tiles) * kLRNTile);
+    const Dtype* bottom = bottom_data + offset;
+    Dtype* top = top_data + offset;
+    Dtype* scale = scale_data + offset;
+    caffe_set(n, Dtype(0), accum);
+    for (int c = 0; c < min(pre_pad_, channels_); ++c) {
+      const Dtype* head = bottom + c * spatial;
+      for (int j = 0; j < n; ++j) {
+        accum[j] += head[j] * head[j];
+      }
+    }
+    for (int c = 0; c < channels_; ++c) {
+      if (c + pre_pad_ < channels_) {
+        const Dtype* head = bottom + (c + pre_pad_) * spatial;
+        for (int j = 0; j < n; ++j) {
+          accum[j] += head[j] * head[j];
+        }
+      }
+      if (c > pre_pad_) {
+        const Dtype* tail = bottom + (c - pre_pad_ - 1) * spatial;
+        for (int j = 0; j < n; ++j) {
+          accum[j] -= tail[j] * tail[j];
+        }
+      }
+      Dtype* scale_c = scale + c * spatial;
+      for (int j = 0; j < n; ++j) {
+        scale_c[j] = k_ + alpha_over_size * accum[j];
+      }
+      lrn_scale_output(n, bottom + c * spatial, scale_c, beta_,
+          top + c * spatial);
+    }
+  }
+}
+
 template <typename Dtype>
 void LRNLayer<Dtype>::CrossChannelForward_cpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = top[0]->mutable_cpu_data();
   Dtype* scale_data = scale_.mutable_cpu_data();
-  // start with the constant value
-  for (int i = 0; i < scale_.count(); ++i) {
-    scale_data[i] = k_;
-  }
-  Blob<Dtype> padded_square(1, channels_ + size_ - 1, height_, width_);
-  Dtype* padded_square_data = padded_square.mutable_cpu_data();
-  caffe_set(padded_square.count(), Dtype(0), padded_square_data);
-  Dtype alpha_over_size = alpha_ / size_;
-  // go through the images
-  for (int n = 0; n < num_; ++n) {
-    // compute the padded square
-    caffe_sqr(channels_ * height_ * width_,
-        bottom_data + bottom[0]->offset(n),
-        padded_square_data + padded_square.offset(0, pre_pad_));
-    // Create the first channel scale
-    for (int c = 0; c < size_; ++c) {
-      caffe_axpy<Dtype>(height_ * width_, alpha_over_size,
-          padded_square_data + padded_square.offset(0, c),
-          scale_data + scale_.offset(n, 0));
+  const int tiles = (height_ * width_ + kLRNTile - 1) / kLRNTile;
+  Caffe::thread_pool().run(num_ * tiles, 1,
+      boost::bind(&LRNLayer<Dtype>::cross_channel_forward_cpu, this,
+                  bottom_data, top_data, scale_data, _1, _2));
+}
+
+template <typename Dtype>
+void LRNLayer<Dtype>::within_channel_forward_cpu(const Dtype* bottom_data,
+    Dtype* top_data, Dtype* scale_data, int begin, int end) {
+  const int spatial = height_ * width_;
+  const Dtype alpha_over_area = alpha_ / (size_ * size_);
+  vector<Dtype> buffer(2 * spatial);
+  Dtype* squares = &buffer[0];
+  Dtype* rows = squares + spatial;
+  for (int i = begin; i < end; ++i) {
+    const Dtype* bottom = bottom_data + i * spatial;
+    Dtype* scale = scale_data + i * spatial;
+    for (int j = 0; j < spatial; ++j) {
+      squares[j] = bottom[j] * bottom[j];
     }
-    for (int c = 1; c < channels_; ++c) {
-      // copy previous scale
-      caffe_copy<Dtype>(height_ * width_,
-          scale_data + scale_.offset(n, c - 1),
-          scale_data + scale_.offset(n, c));
-      // add head
-      caffe_axpy<Dtype>(height_ * width_, alpha_over_size,
-          padded_square_data + padded_square.offset(0, c + size_ - 1),
-          scale_data + scale_.offset(n, c));
-      // subtract tail
-      caffe_axpy<Dtype>(height_ * width_, -alpha_over_size,
-          padded_square_data + padded_square.offset(0, c - 1),
-          scale_data + scale_.offset(n, c));
+    lrn_box_sum(squares, height_, width_, pre_pad_, rows, scale);
+    for (int j = 0; j < spatial; ++j) {
+      scale[j] = 1 + alpha_over_area * scale[j];
     }
+    lrn_scale_output(spatial, bottom, scale, beta_, top_data + i * spatial);
   }
+}
 
-  // In the end, compute output
-  caffe_powx<Dtype>(scale_.count(), scale_data, -beta_, top_data);
-  caffe_mul<Dtype>(scale_.count(), top_data, bottom_data, top_data);
+template <typename Dtype>
+void LRNLayer<Dtype>::WithinChannelForward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = top[0]->mutable_cpu_data();
+  Dtype* scale_data = scale_.mutable_cpu_data();
+  Caffe::thread_pool().run(num_ * channels_, 1,
+      boost::bind(&LRNLayer<Dtype>::within_channel_forward_cpu, this,
+                  bottom_data, top_data, scale_data, _1, _2));
 }
 
 template <typename Dtype>
@@ -170,68 +287,112 @@ void LRNLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     CrossChannelBackward_cpu(top, propagate_down, bottom);
     break;
   case LRNParameter_NormRegion_WITHIN_CHANNEL:
-    WithinChannelBackward(top, propagate_down, bottom);
+    WithinChannelBackward_cpu(top, propagate_down, bottom);
     break;
   default:
     LOG(FATAL) << "Unknown normalization region.";
   }
 }
 
+template <typename Dtype>
+void LRNLayer<Dtype>::cross_channel_backward_cpu(const Dtype* top_diff,
+    const Dtype* top_data, const Dtype* bottom_data, const Dtype* scale_data,
+    Dtype* bottom_diff, int begin, int end) {
+  const int spatial = height_ * width_;
+  const int tiles = (spatial + kLRNTile - 1) / kLRNTile;
+  const Dtype cache_ratio_value = 2. * alpha_ * beta_ / size_;
+  // Each bottom element gets the top diff times top data over scale of the
+  // channels whose window it is in, that is of those in its own window
+  Dtype accum[kLRNTile];
+  for (int i = begin; i < end; ++i) {
+    const int offset = (i / tiles) * channels_ * spatial
+        + (i % tiles) * kLRNTile;
+    const int n = min(kLRNTile, spatial - (i % tiles) * kLRNTile);
+    const Dtype* diff = top_diff + offset;
+    const Dtype* data = top_data + offset;
+    const Dtype* scale = scale_data + offset;
+    caffe_set(n, Dtype(0), accum);
+    for (int c = 0; c < min(pre_pad_, channels_); ++c) {
+      const int head = c * spatial;
+      for (int j = 0; j < n; ++j) {
+        accum[j] += diff[head + j] * data[head + j] / scale[head + j];
+      }
+    }
+    for (int c = 0; c < channels_; ++c) {
+      if (c + pre_pad_ < channels_) {
+        const int head = (c + pre_pad_) * spatial;
+        for (int j = 0; j < n; ++j) {
+          accum[j] += diff[head + j] * data[head + j] / scale[head + j];
+        }
+      }
+      if (c > pre_pad_) {
+        const int tail = (c - pre_pad_ - 1) * spatial;
+        for (int j = 0; j < n; ++j) {
+          accum[j] -= diff[tail + j] * data[tail + j] / scale[tail + j];
+        }
+      }
+      const int index = offset + c * spatial;
+      Dtype* bottom = bottom_diff + index;
+      lrn_scale_output(n, top_diff + index, scale_data + index, beta_,
+          bottom);
+      for (int j = 0; j < n; ++j) {
+        bottom[j] -= cache_ratio_value * bottom_data[index + j] * accum[j];
+      }
+    }
+  }
+}
+
 template <typename Dtype>
 void LRNLayer<Dtype>::CrossChannelBackward_cpu(
     const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
     const vector<Blob<Dtype>*>& bottom) {
-  const Dtype* top_diff = top[0]->cpu_diff();
-  const Dtype* top_data = top[0]->cpu_data();
-  const Dtype* bottom_data = bottom[0]->cpu_data();
-  const Dtype* scale_data = scale_.cpu_data();
-  Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
-  Blob<Dtype> padded_ratio(1, channels_ + size_ - 1, height_, width_);
-  Blob<Dtype> accum_ratio(1, 1, height_, width_);
-  Dtype* padded_ratio_data = padded_ratio.mutable_cpu_data();
-  Dtype* accum_ratio_data = accum_ratio.mutable_cpu_data();
-  // We hack a little bit by using the diff() to store an additional result
-  Dtype* accum_ratio_times_bottom = accum_ratio.mutable_cpu_diff();
-  caffe_set(padded_ratio.count(), Dtype(0), padded_ratio_data);
-  Dtype cache_ratio_value = 2. * alpha_ * beta_ / size_;
-
-  caffe_powx<Dtype>(scale_.count(), scale_data, -beta_, bottom_diff);
-  caffe_mul<Dtype>(scale_.count(), top_diff, bottom_diff, bottom_diff);
+  const int tiles = (height_ * width_ + kLRNTile - 1) / kLRNTile;
+  Caffe::thread_pool().run(num_ * tiles, 1,
+      boost::bind(&LRNLayer<Dtype>::cross_channel_backward_cpu, this,
+                  top[0]->cpu_diff(), top[0]->cpu_data(),
+                  bottom[0]->cpu_data(), scale_.cpu_data(),
+                  bottom[0]->mutable_cpu_diff(), _1, _2));
+}
 
-  // go through individual data
-  int inverse_pre_pad = size_ - (size_ + 1) / 2;
-  for (int n = 0; n < num_; ++n) {
-    int block_offset = scale_.offset(n);
-    // first, compute diff_i * y_i / s_i
-    caffe_mul<Dtype>(channels_ * height_ * width_,
-        top_diff + block_offset, top_data + block_offset,
-        padded_ratio_data + padded_ratio.offset(0, inverse_pre_pad));
-    caffe_div<Dtype>(channels_ * height_ * width_,
-        padded_ratio_data + padded_ratio.offset(0, inverse_pre_pad),
-        scale_data + block_offset,
-        padded_ratio_data + padded_ratio.offset(0, inverse_pre_pad));
-    // Now, compute the accumulated ratios and the bottom diff
-    caffe_set(accum_ratio.count(), Dtype(0), accum_ratio_data);
-    for (int c = 0; c < size_ - 1; ++c) {
-      caffe_axpy<Dtype>(height_ * width_, 1.,
-          padded_ratio_data + padded_ratio.offset(0, c), accum_ratio_data);
+template <typename Dtype>
+void LRNLayer<Dtype>::within_channel_backward_cpu(const Dtype* top_diff,
+    const Dtype* top_data, const Dtype* bottom_data, const Dtype* scale_data,
+    Dtype* bottom_diff, int begin, int end) {
+  const int spatial = height_ * width_;
+  const Dtype cache_ratio_value = 2. * alpha_ * beta_ / (size_ * size_);
+  vector<Dtype> buffer(3 * spatial);
+  Dtype* ratios = &buffer[0];
+  Dtype* rows = ratios + spatial;
+  Dtype* sums = rows + spatial;
+  for (int i = begin; i < end; ++i) {
+    const int offset = i * spatial;
+    for (int j = 0; j < spatial; ++j) {
+      ratios[j] = top_diff[offset + j] * top_data[offset + j]
+          / scale_data[offset + j];
     }
-    for (int c = 0; c < channels_; ++c) {
-      caffe_axpy<Dtype>(height_ * width_, 1.,
-          padded_ratio_data + padded_ratio.offset(0, c + size_ - 1),
-          accum_ratio_data);
-      // compute bottom diff
-      caffe_mul<Dtype>(height_ * width_,
-          bottom_data + top[0]->offset(n, c),
-          accum_ratio_data, accum_ratio_times_bottom);
-      caffe_axpy<Dtype>(height_ * width_, -cache_ratio_value,
-          accum_ratio_times_bottom, bottom_diff + top[0]->offset(n, c));
-      caffe_axpy<Dtype>(height_ * width_, -1.,
-          padded_ratio_data + padded_ratio.offset(0, c), accum_ratio_data);
+    lrn_box_sum(ratios, height_, width_, pre_pad_, rows, sums);
+    Dtype* bottom = bottom_diff + offset;
+    lrn_scale_output(spatial, top_diff + offset, scale_data + offset, beta_,
+        bottom);
+    for (int j = 0; j < spatial; ++j) {
+      bottom[j] -= cache_ratio_value * bottom_data[offset + j] * sums[j];
     }
   }
 }
 
+template <typename Dtype>
+void LRNLayer<Dtype>::WithinChannelBackward_cpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  if (propagate_down[0]) {
+    Caffe::thread_pool().run(num_ * channels_, 1,
+        boost::bind(&LRNLayer<Dtype>::within_channel_backward_cpu, this,
+                    top[0]->cpu_diff(), top[0]->cpu_data(),
+                    bottom[0]->cpu_data(), scale_.cpu_data(),
+                    bottom[0]->mutable_cpu_diff(), _1, _2));
+  }
+}
+
 template <typename Dtype>
 void LRNLayer<Dtype>::WithinChannelBackward(
     const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
@@ -254,6 +415,5 @@ STUB_GPU_BACKWARD(LRNLayer, CrossChannelBackward);
 #endif
 
 INSTANTIATE_CLASS(LRNLayer);
-REGISTER_LAYER_CLASS(LRN);
 
 }  // namespace caffe
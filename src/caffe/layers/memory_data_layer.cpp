@@ -22,94 +22,122 @@ void MemoryDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   vector<int> label_shape(1, batch_size_);
   top[0]->Reshape(batch_size_, channels_, height_, width_);
   top[1]->Reshape(label_shape);
-  added_data_.Reshape(batch_size_, channels_, height_, width_);
-  added_label_.Reshape(label_shape);
+  for (int i = 0; i < 2; ++i) {
+    added_data_[i].Reshape(batch_size_, channels_, height_, width_);
+    added_label_[i].Reshape(label_shape);
+    added_data_[i].cpu_data();
+    added_label_[i].cpu_data();
+  }
   data_ = NULL;
   labels_ = NULL;
-  added_data_.cpu_data();
-  added_label_.cpu_data();
 }
 
 template <typename Dtype>
-void MemoryDataLayer<Dtype>::AddDatumVector(const vector<Datum>& datum_vector) {
-  CHECK(!has_new_data_) <<
-      "Can't add data until current data has been consumed.";
-  size_t num = datum_vector.size();
-  CHECK_GT(num, 0) << "There is no datum to add.";
+int MemoryDataLayer<Dtype>::added_buffer(int num) {
+  CHECK_EQ(staged_.size(), 0) <<
+      "Can't add data until the staged data has been used.";
+  CHECK_GT(num, 0) << "There is no data to add.";
   CHECK_EQ(num % batch_size_, 0) <<
       "The added data must be a multiple of the batch size.";
-  added_data_.Reshape(num, channels_, height_, width_);
-  added_label_.Reshape(num, 1, 1, 1);
+  // The other buffer can be in use by the tops
+  const int buffer = 1 - added_;
+  added_data_[buffer].Reshape(num, channels_, height_, width_);
+  added_label_[buffer].Reshape(num, 1, 1, 1);
+  return buffer;
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::AddDatumVector(const vector<Datum>& datum_vector) {
+  size_t num = datum_vector.size();
+  const int buffer = added_buffer(num);
   // Apply data transformations (mirror, scale, crop...)
-  this->data_transformer_->Transform(datum_vector, &added_data_);
+  this->data_transformer_->Transform(datum_vector, &added_data_[buffer]);
   // Copy Labels
-  Dtype* top_label = added_label_.mutable_cpu_data();
+  Dtype* top_label = added_label_[buffer].mutable_cpu_data();
   for (int item_id = 0; item_id < num; ++item_id) {
     top_label[item_id] = datum_vector[item_id].label();
   }
-  // num_images == batch_size_
-  Dtype* top_data = added_data_.mutable_cpu_data();
-  Reset(top_data, top_label, num);
-  has_new_data_ = true;
+  added_ = buffer;
+  staged_.push(buffer);
 }
 
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::AddMatVector(const vector<cv::Mat>& mat_vector,
     const vector<int>& labels) {
   size_t num = mat_vector.size();
-  CHECK(!has_new_data_) <<
-      "Can't add mat until current data has been consumed.";
-  CHECK_GT(num, 0) << "There is no mat to add";
-  CHECK_EQ(num % batch_size_, 0) <<
-      "The added data must be a multiple of the batch size.";
-  added_data_.Reshape(num, channels_, height_, width_);
-  added_label_.Reshape(num, 1, 1, 1);
+  const int buffer = added_buffer(num);
   // Apply data transformations (mirror, scale, crop...)
-  this->data_transformer_->Transform(mat_vector, &added_data_);
+  this->data_transformer_->Transform(mat_vector, &added_data_[buffer]);
   // Copy Labels
-  Dtype* top_label = added_label_.mutable_cpu_data();
+  Dtype* top_label = added_label_[buffer].mutable_cpu_data();
   for (int item_id = 0; item_id < num; ++item_id) {
     top_label[item_id] = labels[item_id];
   }
-  // num_images == batch_size_
-  Dtype* top_data = added_data_.mutable_cpu_data();
-  Reset(top_data, top_label, num);
-  has_new_data_ = true;
+  added_ = buffer;
+  staged_.push(buffer);
 }
 
 template <typename Dtype>
-void MemoryDataLayer<Dtype>::Reset(Dtype* data, Dtype* labels, int n) {
+void MemoryDataLayer<Dtype>::set_data(Dtype* data, Dtype* labels, int n,
+    bool on_gpu) {
   CHECK(data);
   CHECK(labels);
   CHECK_EQ(n % batch_size_, 0) << "n must be a multiple of batch size";
+  data_ = data;
+  labels_ = labels;
+  data_on_gpu_ = on_gpu;
+  n_ = n;
+  pos_ = 0;
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::Reset(Dtype* data, Dtype* labels, int n) {
   // Warn with transformation parameters since a memory array is meant to
   // be generic and no transformations are done with Reset().
   if (this->layer_param_.has_transform_param()) {
     LOG(WARNING) << this->type() << " does not transform array data on Reset()";
   }
-  data_ = data;
-  labels_ = labels;
-  n_ = n;
-  pos_ = 0;
+  set_data(data, labels, n, false);
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::ResetGPU(Dtype* data, Dtype* labels, int n) {
+  if (this->layer_param_.has_transform_param()) {
+    LOG(WARNING) << this->type()
+        << " does not transform array data on ResetGPU()";
+  }
+  set_data(data, labels, n, true);
 }
 
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::set_batch_size(int new_size) {
-  CHECK(!has_new_data_) <<
+  CHECK(!has_new_data_ && staged_.size() == 0) <<
       "Can't change batch_size until current data has been consumed.";
   batch_size_ = new_size;
-  added_data_.Reshape(batch_size_, channels_, height_, width_);
-  added_label_.Reshape(batch_size_, 1, 1, 1);
 }
 
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  // Move to the staged data once the current data was consumed
+  int buffer;
+  if (!has_new_data_ && staged_.try_pop(&buffer)) {
+    set_data(added_data_[buffer].mutable_cpu_data(),
+        added_label_[buffer].mutable_cpu_data(), added_data_[buffer].num(),
+        false);
+    has_new_data_ = true;
+  }
   CHECK(data_) << "MemoryDataLayer needs to be initalized by calling Reset";
   top[0]->Reshape(batch_size_, channels_, height_, width_);
   top[1]->Reshape(batch_size_, 1, 1, 1);
-  top[0]->set_cpu_data(data_ + pos_ * size_);
-  top[1]->set_cpu_data(labels_ + pos_);
+  if (data_on_gpu_) {
+    CHECK(Caffe::mode() == Caffe::GPU) << "ResetGPU data needs GPU mode";
+    top[0]->set_gpu_data(data_ + pos_ * size_);
+    top[1]->set_gpu_data(labels_ + pos_);
+  } else {
+    top[0]->set_cpu_data(data_ + pos_ * size_);
+    top[1]->set_cpu_data(labels_ + pos_);
+  }
   pos_ = (pos_ + batch_size_) % n_;
   if (pos_ == 0)
     has_new_data_ = false;
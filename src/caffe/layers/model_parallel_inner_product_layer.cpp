@@ -0,0 +1,402 @@
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/syncedmem.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+enum ShardOp { kShardForward, kShardBackward };
+
+// Each shard's work runs on a thread of its GPU, with its own cuBLAS handle
+// and stream, so that the shards of a pass run at the same time.
+template <typename Dtype>
+class ModelParallelInnerProductLayer<Dtype>::Shard : public InternalThread {
+ public:
+  Shard(ModelParallelInnerProductLayer<Dtype>* layer, int index)
+      : layer_(layer), index_(index) {
+  }
+  virtual ~Shard() {
+    StopInternalThread();
+  }
+
+  void Run(ShardOp op) {
+    ops_.push(op);
+  }
+
+ protected:
+  virtual void InternalThreadEntry() {
+    try {
+      while (!must_stop()) {
+        const int op = ops_.pop();
+        if (op == kShardForward) {
+          layer_->ForwardShard(index_);
+        } else {
+          layer_->BackwardShard(index_);
+        }
+        layer_->done_.push(index_);
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+  }
+
+  ModelParallelInnerProductLayer<Dtype>* layer_;
+  const int index_;
+  BlockingQueue<int> ops_;
+};
+
+template <typename Dtype>
+ModelParallelInnerProductLayer<Dtype>::~ModelParallelInnerProductLayer() {
+  // Before the state the threads use
+  shards_.clear();
+}
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const InnerProductParameter& param = this->layer_param_.inner_product_param();
+  CHECK(!param.has_sparse_dim())
+      << "Sparse inputs are not supported by model parallel layers";
+  CHECK(!this->layer_param_.has_quantization_param())
+      << "quantization_param is not supported by model parallel layers";
+  CHECK(!this->layer_param_.has_sparsity_param())
+      << "sparsity_param is not supported by model parallel layers";
+  N_ = param.num_output();
+  bias_term_ = param.bias_term();
+  fused_relu_ = param.has_fused_relu();
+  relu_slope_ = param.fused_relu().negative_slope();
+  axis_ = bottom[0]->CanonicalAxisIndex(param.axis());
+  K_ = bottom[0]->count(axis_);
+  const int num_shards = param.device_size();
+  CHECK_GT(num_shards, 0) << "Model parallel layers need their devices";
+  CHECK_LE(num_shards, N_) << "More shards than outputs";
+  // The first N_ % num_shards shards take an extra output
+  offsets_.resize(num_shards);
+  counts_.resize(num_shards);
+  devices_.assign(param.device().begin(), param.device().end());
+  for (int s = 0; s < num_shards; ++s) {
+    counts_[s] = N_ / num_shards + (s < N_ % num_shards);
+    offsets_[s] = s ? offsets_[s - 1] + counts_[s - 1] : 0;
+  }
+  const int blobs_per_shard = bias_term_ ? 2 : 1;
+  if (this->blobs_.size() > 0) {
+    CHECK_EQ(this->blobs_.size(), num_shards * blobs_per_shard)
+        << "Incorrect number of weight blobs for the shards";
+    LOG(INFO) << "Skipping parameter initialization";
+  } else {
+    this->blobs_.resize(num_shards * blobs_per_shard);
+    shared_ptr<Filler<Dtype> > weight_filler(
+        GetFiller<Dtype>(param.weight_filler()));
+    shared_ptr<Filler<Dtype> > bias_filler(
+        GetFiller<Dtype>(param.bias_filler()));
+    for (int s = 0; s < num_shards; ++s) {
+      vector<int> weight_shape(2);
+      weight_shape[0] = counts_[s];
+      weight_shape[1] = K_;
+      this->blobs_[weight_index(s)].reset(new Blob<Dtype>(weight_shape));
+      weight_filler->Fill(weight(s));
+      if (bias_term_) {
+        this->blobs_[weight_index(s) + 1].reset(
+            new Blob<Dtype>(vector<int>(1, counts_[s])));
+        bias_filler->Fill(bias(s));
+      }
+    }
+  }
+  this->param_propagate_down_.resize(this->blobs_.size(), true);
+  bottom_copies_.resize(num_shards);
+  outputs_.resize(num_shards);
+  output_diffs_.resize(num_shards);
+  bottom_diffs_.resize(num_shards);
+  bias_multipliers_.resize(num_shards);
+  for (int s = 0; s < num_shards; ++s) {
+    bottom_copies_[s].reset(new Blob<Dtype>());
+    outputs_[s].reset(new Blob<Dtype>());
+    output_diffs_[s].reset(new Blob<Dtype>());
+    bottom_diffs_[s].reset(new Blob<Dtype>());
+    bias_multipliers_[s].reset(new Blob<Dtype>());
+  }
+  pass_mutex_.reset(new boost::mutex());
+  shards_.clear();
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+    for (int s = 0; s < num_shards; ++s) {
+      // The solver of this GPU clears and updates the weights of all shards
+      if (devices_[s] != device) {
+        int access;
+        CUDA_CHECK(cudaDeviceCanAccessPeer(&access, device, devices_[s]));
+        CHECK(access) << "GPU " << device << " has no peer access to GPU "
+            << devices_[s] << " for the shard of layer "
+            << this->layer_param_.name();
+        const cudaError_t err = cudaDeviceEnablePeerAccess(devices_[s], 0);
+        if (err == cudaErrorPeerAccessAlreadyEnabled) {
+          cudaGetLastError();
+        } else {
+          CUDA_CHECK(err);
+        }
+      }
+      // Places the weights on the shard's GPU, and starts its thread there
+      CUDA_CHECK(cudaSetDevice(devices_[s]));
+      for (int b = 0; b < blobs_per_shard; ++b) {
+        Blob<Dtype>* blob = this->blobs_[weight_index(s) + b].get();
+        blob->mutable_gpu_data();
+        blob->mutable_gpu_diff();
+      }
+      shards_.push_back(shared_ptr<Shard>(new Shard(this, s)));
+      shards_.back()->StartInternalThread();
+      CUDA_CHECK(cudaSetDevice(device));
+    }
+  }
+#endif
+}
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  CHECK_EQ(K_, bottom[0]->count(axis_))
+      << "Input size incompatible with inner product parameters.";
+  M_ = bottom[0]->count(0, axis_);
+  vector<int> top_shape = bottom[0]->shape();
+  top_shape.resize(axis_ + 1);
+  top_shape[axis_] = N_;
+  top[0]->Reshape(top_shape);
+}
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  boost::mutex::scoped_lock lock(*pass_mutex_);
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = top[0]->mutable_cpu_data();
+  for (int s = 0; s < counts_.size(); ++s) {
+    const int n = counts_[s];
+    outputs_[s]->Reshape(vector<int>(1, M_ * n));
+    Dtype* output = outputs_[s]->mutable_cpu_data();
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, n, K_, (Dtype)1.,
+        bottom_data, weight(s)->cpu_data(), (Dtype)0., output);
+    const Dtype* bias_data = bias_term_ ? bias(s)->cpu_data() : NULL;
+    if (fused_relu_) {
+      caffe_cpu_bias_relu(M_ * n, n, 1, bias_data, relu_slope_, output);
+    } else if (bias_term_) {
+      for (int m = 0; m < M_; ++m) {
+        caffe_axpy<Dtype>(n, (Dtype)1., bias_data, output + m * n);
+      }
+    }
+    for (int m = 0; m < M_; ++m) {
+      caffe_copy(n, output + m * n, top_data + m * N_ + offsets_[s]);
+    }
+  }
+}
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::Backward_cpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  boost::mutex::scoped_lock lock(*pass_mutex_);
+  const int M = bottom[0]->count(0, axis_);
+  if (fused_relu_) {
+    caffe_cpu_relu_backward(top[0]->count(), top[0]->cpu_data(), relu_slope_,
+        top[0]->mutable_cpu_diff());
+  }
+  const Dtype* top_diff = top[0]->cpu_diff();
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  // The weights sum the gradients of all the solvers sharing the layer
+  const Dtype scale = Dtype(1) / Caffe::solver_count();
+  for (int s = 0; s < counts_.size(); ++s) {
+    const int n = counts_[s];
+    output_diffs_[s]->Reshape(vector<int>(1, M * n));
+    Dtype* output_diff = output_diffs_[s]->mutable_cpu_data();
+    for (int m = 0; m < M; ++m) {
+      caffe_copy(n, top_diff + m * N_ + offsets_[s], output_diff + m * n);
+    }
+    if (this->param_propagate_down_[weight_index(s)]) {
+      caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, n, K_, M, scale,
+          output_diff, bottom_data, (Dtype)1., weight(s)->mutable_cpu_diff());
+    }
+    if (bias_term_ && this->param_propagate_down_[weight_index(s) + 1]) {
+      Dtype* bias_diff = bias(s)->mutable_cpu_diff();
+      for (int m = 0; m < M; ++m) {
+        caffe_axpy<Dtype>(n, scale, output_diff + m * n, bias_diff);
+      }
+    }
+    if (propagate_down[0]) {
+      // The first shard sets or accumulates, the others add
+      const Dtype beta = s ? Dtype(1) : Dtype(this->accumulate_bottom_diff(0));
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M, K_, n, (Dtype)1.,
+          output_diff, weight(s)->cpu_data(), beta,
+          bottom[0]->mutable_cpu_diff());
+    }
+  }
+}
+
+#ifndef CPU_ONLY
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::RunShards(bool forward) {
+  CHECK_EQ(shards_.size(), devices_.size())
+      << "Model parallel layers run on GPU only if set up in GPU mode";
+  for (int s = 0; s < shards_.size(); ++s) {
+    shards_[s]->Run(forward ? kShardForward : kShardBackward);
+  }
+  for (int s = 0; s < shards_.size(); ++s) {
+    done_.pop();
+  }
+}
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::ForwardShard(int s) {
+  const int M = pass_.rows;
+  const int n = counts_[s];
+  const Dtype* bottom_data = pass_.bottom_data;
+  if (devices_[s] != pass_.device) {
+    bottom_copies_[s]->Reshape(vector<int>(1, M * K_));
+    caffe_gpu_memcpy(M * K_ * sizeof(Dtype), bottom_data,
+        bottom_copies_[s]->mutable_gpu_data());
+    bottom_data = bottom_copies_[s]->gpu_data();
+  }
+  outputs_[s]->Reshape(vector<int>(1, M * n));
+  Dtype* output = outputs_[s]->mutable_gpu_data();
+  caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M, n, K_, (Dtype)1.,
+      bottom_data, weight(s)->gpu_data(), (Dtype)0., output);
+  if (fused_relu_) {
+    caffe_gpu_bias_relu(M * n, n, 1, bias_term_ ? bias(s)->gpu_data() : NULL,
+        relu_slope_, output);
+  } else if (bias_term_) {
+    bias_multipliers_[s]->Reshape(vector<int>(1, M));
+    caffe_gpu_set(M, Dtype(1), bias_multipliers_[s]->mutable_gpu_data());
+    caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M, n, 1, (Dtype)1.,
+        bias_multipliers_[s]->gpu_data(), bias(s)->gpu_data(), (Dtype)1.,
+        output);
+  }
+  // Its columns of the caller's outputs
+  const cudaStream_t stream = Caffe::cuda_stream();
+  CUDA_CHECK(cudaMemcpy2DAsync(pass_.top_data + offsets_[s],
+      N_ * sizeof(Dtype), output, n * sizeof(Dtype), n * sizeof(Dtype), M,
+      cudaMemcpyDefault, stream));
+  CUDA_CHECK(cudaStreamSynchronize(stream));
+}
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::BackwardShard(int s) {
+  const int M = pass_.rows;
+  const int n = counts_[s];
+  const cudaStream_t stream = Caffe::cuda_stream();
+  output_diffs_[s]->Reshape(vector<int>(1, M * n));
+  Dtype* output_diff = output_diffs_[s]->mutable_gpu_data();
+  CUDA_CHECK(cudaMemcpy2DAsync(output_diff, n * sizeof(Dtype),
+      pass_.top_diff + offsets_[s], N_ * sizeof(Dtype), n * sizeof(Dtype), M,
+      cudaMemcpyDefault, stream));
+  if (this->param_propagate_down_[weight_index(s)]) {
+    const Dtype* bottom_data = pass_.bottom_data;
+    if (devices_[s] != pass_.device) {
+      bottom_copies_[s]->Reshape(vector<int>(1, M * K_));
+      caffe_gpu_memcpy(M * K_ * sizeof(Dtype), bottom_data,
+          bottom_copies_[s]->mutable_gpu_data());
+      bottom_data = bottom_copies_[s]->gpu_data();
+    }
+    caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, n, K_, M, pass_.scale,
+        output_diff, bottom_data, (Dtype)1., weight(s)->mutable_gpu_diff());
+  }
+  if (bias_term_ && this->param_propagate_down_[weight_index(s) + 1]) {
+    bias_multipliers_[s]->Reshape(vector<int>(1, M));
+    caffe_gpu_set(M, Dtype(1), bias_multipliers_[s]->mutable_gpu_data());
+    caffe_gpu_gemv<Dtype>(CblasTrans, M, n, pass_.scale, output_diff,
+        bias_multipliers_[s]->gpu_data(), (Dtype)1.,
+        bias(s)->mutable_gpu_diff());
+  }
+  if (pass_.bottom_propagate) {
+    bottom_diffs_[s]->Reshape(vector<int>(1, M * K_));
+    caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M, K_, n, (Dtype)1.,
+        output_diff, weight(s)->gpu_data(), (Dtype)0.,
+        bottom_diffs_[s]->mutable_gpu_data());
+  }
+  CUDA_CHECK(cudaStreamSynchronize(stream));
+}
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::Forward_gpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  boost::mutex::scoped_lock lock(*pass_mutex_);
+  CUDA_CHECK(cudaGetDevice(&pass_.device));
+  pass_.rows = M_;
+  pass_.bottom_data = bottom[0]->gpu_data();
+  pass_.top_data = top[0]->mutable_gpu_data();
+  // The shards read the input from their streams
+  CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+  RunShards(true);
+}
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::Backward_gpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  boost::mutex::scoped_lock lock(*pass_mutex_);
+  if (fused_relu_) {
+    caffe_gpu_relu_backward(top[0]->count(), top[0]->gpu_data(), relu_slope_,
+        top[0]->mutable_gpu_diff());
+  }
+  const int M = bottom[0]->count(0, axis_);
+  CUDA_CHECK(cudaGetDevice(&pass_.device));
+  pass_.rows = M;
+  pass_.bottom_data = bottom[0]->gpu_data();
+  pass_.top_diff = top[0]->gpu_diff();
+  pass_.bottom_propagate = propagate_down[0];
+  pass_.scale = Dtype(1) / Caffe::solver_count();
+  CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+  RunShards(false);
+  if (!propagate_down[0]) {
+    return;
+  }
+  // Sums the bottom diffs of the shards, staging those of other GPUs here
+  Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
+  if (!this->accumulate_bottom_diff(0)) {
+    caffe_gpu_set(M * K_, Dtype(0), bottom_diff);
+  }
+  SyncedMemory staging(M * K_ * sizeof(Dtype));
+  for (int s = 0; s < shards_.size(); ++s) {
+    const Dtype* diff = bottom_diffs_[s]->gpu_data();
+    if (devices_[s] != pass_.device) {
+      // Ordered after the previous axpy on the caller's stream
+      caffe_gpu_memcpy(M * K_ * sizeof(Dtype), diff,
+          staging.mutable_gpu_data());
+      diff = static_cast<const Dtype*>(staging.gpu_data());
+    }
+    caffe_gpu_axpy<Dtype>(M * K_, (Dtype)1., diff, bottom_diff);
+  }
+  // Before the staging memory goes back to the pool
+  CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+}
+
+#else
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::RunShards(bool forward) {
+  NO_GPU;
+}
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::ForwardShard(int s) {
+  NO_GPU;
+}
+
+template <typename Dtype>
+void ModelParallelInnerProductLayer<Dtype>::BackwardShard(int s) {
+  NO_GPU;
+}
+
+STUB_GPU(ModelParallelInnerProductLayer);
+#endif
+
+INSTANTIATE_CLASS(ModelParallelInnerProductLayer);
+
+}  // namespace caffe
@@ -61,6 +61,10 @@ void MultinomialLogisticLossLayer<Dtype>::Backward_cpu(
   }
 }
 
+#ifdef CPU_ONLY
+STUB_GPU(MultinomialLogisticLossLayer);
+#endif
+
 INSTANTIATE_CLASS(MultinomialLogisticLossLayer);
 REGISTER_LAYER_CLASS(MultinomialLogisticLoss);
 
@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// A single block sums the losses of the few instances into the top, which
+// thus stays on the device.
+template <typename Dtype>
+__global__ void MultinomialLogisticLossForward(const int num, const int dim,
+    const Dtype* bottom_data, const Dtype* label, const Dtype threshold,
+    Dtype* loss) {
+  __shared__ Dtype losses[CAFFE_CUDA_NUM_THREADS];
+  Dtype sum = 0;
+  for (int i = threadIdx.x; i < num; i += blockDim.x) {
+    const int label_value = static_cast<int>(label[i]);
+    sum -= log(max(bottom_data[i * dim + label_value], threshold));
+  }
+  losses[threadIdx.x] = sum;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      losses[threadIdx.x] += losses[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    *loss = losses[0] / num;
+  }
+}
+
+template <typename Dtype>
+__global__ void MultinomialLogisticLossBackward(const int num, const int dim,
+    const Dtype* bottom_data, const Dtype* label, const Dtype threshold,
+    const Dtype scale, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(i, num) {
+    const int label_value = static_cast<int>(label[i]);
+    bottom_diff[i * dim + label_value] =
+        scale / max(bottom_data[i * dim + label_value], threshold);
+  }
+}
+
+template <typename Dtype>
+void MultinomialLogisticLossLayer<Dtype>::Forward_gpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  int num = bottom[0]->num();
+  int dim = bottom[0]->count() / bottom[0]->num();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  MultinomialLogisticLossForward<Dtype><<<1, CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(num, dim, bottom[0]->gpu_data(),
+      bottom[1]->gpu_data(), Dtype(kLOG_THRESHOLD),
+      top[0]->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template <typename Dtype>
+void MultinomialLogisticLossLayer<Dtype>::Backward_gpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  if (propagate_down[1]) {
+    LOG(FATAL) << this->type()
+               << " Layer cannot backpropagate to label inputs.";
+  }
+  if (propagate_down[0]) {
+    Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
+    int num = bottom[0]->num();
+    int dim = bottom[0]->count() / bottom[0]->num();
+    caffe_gpu_set(bottom[0]->count(), Dtype(0), bottom_diff);
+    const Dtype scale = - top[0]->cpu_diff()[0] / num;
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    MultinomialLogisticLossBackward<Dtype><<<CAFFE_GET_BLOCKS(num),
+        CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(num, dim,
+        bottom[0]->gpu_data(), bottom[1]->gpu_data(), Dtype(kLOG_THRESHOLD),
+        scale, bottom_diff);
+    CUDA_POST_KERNEL_CHECK;
+  }
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(MultinomialLogisticLossLayer);
+
+}  // namespace caffe
@@ -1,3 +1,5 @@
+#include <boost/bind.hpp>
+
 #include <algorithm>
 #include <cfloat>
 #include <vector>
@@ -6,6 +8,7 @@
 #include "caffe/layer.hpp"
 #include "caffe/syncedmem.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
@@ -76,6 +79,12 @@ void PoolingLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     CHECK_LT(pad_h_, kernel_h_);
     CHECK_LT(pad_w_, kernel_w_);
   }
+  // Most nets pool 2x2 or 3x3 windows at a stride of 2
+  fixed_kernel_ = 0;
+  if (!global_pooling_ && kernel_h_ == kernel_w_ && stride_h_ == 2
+      && stride_w_ == 2 && (kernel_h_ == 2 || kernel_h_ == 3)) {
+    fixed_kernel_ = kernel_h_;
+  }
 }
 
 template <typename Dtype>
@@ -108,6 +117,10 @@ void PoolingLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   }
   top[0]->Reshape(bottom[0]->num(), channels_, pooled_height_,
       pooled_width_);
+  top[0]->set_layout(bottom[0]->layout());
+  CHECK(bottom[0]->layout() == NCHW || this->layer_param_.pooling_param()
+      .pool() != PoolingParameter_PoolMethod_STOCHASTIC)
+      << "STOCHASTIC pooling does not take NHWC bottoms";
   if (top.size() > 1) {
     top[1]->ReshapeLike(*top[0]);
   }
@@ -125,14 +138,277 @@ void PoolingLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   }
 }
 
+// Max pools the rows x cols windows of K x K elements at a stride of S
+// lying entirely inside a plane, with no bounds checks, recording the index
+// of each maximum in mask unless it is NULL. Without a mask the loop is
+// branch free for the compiler to vectorize.
+template <typename Dtype, typename Mask, int K, int S>
+static void max_pool_plane(const Dtype* bottom, int width, int rows,
+    int cols, int pooled_width, Dtype* top, Mask* mask) {
+  for (int ph = 0; ph < rows; ++ph) {
+    const Dtype* window = bottom + ph * S * width;
+    Dtype* pooled = top + ph * pooled_width;
+    if (mask) {
+      Mask* pooled_mask = mask + ph * pooled_width;
+      for (int pw = 0; pw < cols; ++pw) {
+        int index = ph * S * width + pw * S;
+        Dtype value = bottom[index];
+        for (int kh = 0; kh < K; ++kh) {
+          for (int kw = 0; kw < K; ++kw) {
+            const int i = (ph * S + kh) * width + pw * S + kw;
+            if (bottom[i] > value) {
+              value = bottom[i];
+              index = i;
+            }
+          }
+        }
+        pooled[pw] = value;
+        pooled_mask[pw] = static_cast<Mask>(index);
+      }
+    } else {
+      for (int pw = 0; pw < cols; ++pw) {
+        Dtype value = window[pw * S];
+        for (int kh = 0; kh < K; ++kh) {
+          for (int kw = 0; kw < K; ++kw) {
+            value = max(value, window[kh * width + pw * S + kw]);
+          }
+        }
+        pooled[pw] = value;
+      }
+    }
+  }
+}
+
+// Average pools the rows x cols windows of K x K elements at a stride of S
+// lying entirely inside a plane
+template <typename Dtype, int K, int S>
+static void ave_pool_plane(const Dtype* bottom, int width, int rows,
+    int cols, int pooled_width, Dtype* top) {
+  const Dtype scale = Dtype(1) / (K * K);
+  for (int ph = 0; ph < rows; ++ph) {
+    const Dtype* window = bottom + ph * S * width;
+    Dtype* pooled = top + ph * pooled_width;
+    for (int pw = 0; pw < cols; ++pw) {
+      Dtype sum = 0;
+      for (int kh = 0; kh < K; ++kh) {
+        for (int kw = 0; kw < K; ++kw) {
+          sum += window[kh * width + pw * S + kw];
+        }
+      }
+      pooled[pw] = sum * scale;
+    }
+  }
+}
+
+template <typename Dtype>
+void PoolingLayer<Dtype>::specialized_windows(int* rows, int* cols) const {
+  *rows = *cols = 0;
+  if (!fixed_kernel_ || pad_h_ || pad_w_ || height_ < kernel_h_
+      || width_ < kernel_w_) {
+    return;
+  }
+  // The last windows may be clipped by the edges of the plane
+  *rows = min(pooled_height_, (height_ - kernel_h_) / stride_h_ + 1);
+  *cols = min(pooled_width_, (width_ - kernel_w_) / stride_w_ + 1);
+}
+
 // TODO(Yangqing): Is there a faster way to do pooling in the channel-first
 // case?
+template <typename Dtype>
+void PoolingLayer<Dtype>::max_pool_cpu(const Dtype* bottom_data,
+    Dtype* top_data, int* mask, Dtype* top_mask, int begin, int end) {
+  const int bottom_dim = height_ * width_;
+  const int top_dim = pooled_height_ * pooled_width_;
+  int rows, cols;
+  specialized_windows(&rows, &cols);
+  for (int i = begin; i < end; ++i) {
+    const Dtype* bottom = bottom_data + i * bottom_dim;
+    Dtype* top = top_data + i * top_dim;
+    int* plane_mask = mask ? mask + i * top_dim : NULL;
+    Dtype* plane_top_mask = top_mask ? top_mask + i * top_dim : NULL;
+    if (fixed_kernel_ == 2 && rows) {
+      if (plane_top_mask) {
+        max_pool_plane<Dtype, Dtype, 2, 2>(bottom, width_, rows, cols,
+            pooled_width_, top, plane_top_mask);
+      } else {
+        max_pool_plane<Dtype, int, 2, 2>(bottom, width_, rows, cols,
+            pooled_width_, top, plane_mask);
+      }
+    } else if (fixed_kernel_ == 3 && rows) {
+      if (plane_top_mask) {
+        max_pool_plane<Dtype, Dtype, 3, 2>(bottom, width_, rows, cols,
+            pooled_width_, top, plane_top_mask);
+      } else {
+        max_pool_plane<Dtype, int, 3, 2>(bottom, width_, rows, cols,
+            pooled_width_, top, plane_mask);
+      }
+    }
+    // The windows left by the specialized kernels
+    for (int ph = 0; ph < pooled_height_; ++ph) {
+      for (int pw = ph < rows ? cols : 0; pw < pooled_width_; ++pw) {
+        int hstart = ph * stride_h_ - pad_h_;
+        int wstart = pw * stride_w_ - pad_w_;
+        int hend = min(hstart + kernel_h_, height_);
+        int wend = min(wstart + kernel_w_, width_);
+        hstart = max(hstart, 0);
+        wstart = max(wstart, 0);
+        Dtype value = -FLT_MAX;
+        int max_index = -1;
+        for (int h = hstart; h < hend; ++h) {
+          for (int w = wstart; w < wend; ++w) {
+            const int index = h * width_ + w;
+            if (bottom[index] > value) {
+              value = bottom[index];
+              max_index = index;
+            }
+          }
+        }
+        const int pool_index = ph * pooled_width_ + pw;
+        top[pool_index] = value;
+        if (plane_top_mask) {
+          plane_top_mask[pool_index] = static_cast<Dtype>(max_index);
+        } else if (plane_mask) {
+          plane_mask[pool_index] = max_index;
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void PoolingLayer<Dtype>::ave_pool_cpu(const Dtype* bottom_data,
+    Dtype* top_data, int begin, int end) {
+  const int bottom_dim = height_ * width_;
+  const int top_dim = pooled_height_ * pooled_width_;
+  int rows, cols;
+  specialized_windows(&rows, &cols);
+  for (int i = begin; i < end; ++i) {
+    const Dtype* bottom = bottom_data + i * bottom_dim;
+    Dtype* top = top_data + i * top_dim;
+    if (fixed_kernel_ == 2 && rows) {
+      ave_pool_plane<Dtype, 2, 2>(bottom, width_, rows, cols, pooled_width_,
+          top);
+    } else if (fixed_kernel_ == 3 && rows) {
+      ave_pool_plane<Dtype, 3, 2>(bottom, width_, rows, cols, pooled_width_,
+          top);
+    }
+    // The windows left by the specialized kernels
+    for (int ph = 0; ph < pooled_height_; ++ph) {
+      for (int pw = ph < rows ? cols : 0; pw < pooled_width_; ++pw) {
+        int hstart = ph * stride_h_ - pad_h_;
+        int wstart = pw * stride_w_ - pad_w_;
+        int hend = min(hstart + kernel_h_, height_ + pad_h_);
+        int wend = min(wstart + kernel_w_, width_ + pad_w_);
+        int pool_size = (hend - hstart) * (wend - wstart);
+        hstart = max(hstart, 0);
+        wstart = max(wstart, 0);
+        hend = min(hend, height_);
+        wend = min(wend, width_);
+        Dtype sum = 0;
+        for (int h = hstart; h < hend; ++h) {
+          for (int w = wstart; w < wend; ++w) {
+            sum += bottom[h * width_ + w];
+          }
+        }
+        top[ph * pooled_width_ + pw] = sum / pool_size;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void PoolingLayer<Dtype>::max_pool_nhwc_cpu(const Dtype* bottom_data,
+    Dtype* top_data, int* mask, Dtype* top_mask, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    const int n = i / pooled_height_;
+    const int ph = i % pooled_height_;
+    for (int pw = 0; pw < pooled_width_; ++pw) {
+      int hstart = ph * stride_h_ - pad_h_;
+      int wstart = pw * stride_w_ - pad_w_;
+      int hend = min(hstart + kernel_h_, height_);
+      int wend = min(wstart + kernel_w_, width_);
+      hstart = max(hstart, 0);
+      wstart = max(wstart, 0);
+      const int pool_index = (i * pooled_width_ + pw) * channels_;
+      Dtype* top = top_data + pool_index;
+      int* pixel_mask = mask ? mask + pool_index : NULL;
+      Dtype* pixel_top_mask = top_mask ? top_mask + pool_index : NULL;
+      caffe_set(channels_, Dtype(-FLT_MAX), top);
+      if (pixel_mask) {
+        caffe_set(channels_, -1, pixel_mask);
+      } else if (pixel_top_mask) {
+        caffe_set(channels_, Dtype(-1), pixel_top_mask);
+      }
+      for (int h = hstart; h < hend; ++h) {
+        for (int w = wstart; w < wend; ++w) {
+          const int index = h * width_ + w;
+          const Dtype* bottom = bottom_data
+              + (n * height_ * width_ + index) * channels_;
+          if (pixel_mask) {
+            for (int c = 0; c < channels_; ++c) {
+              if (bottom[c] > top[c]) {
+                top[c] = bottom[c];
+                pixel_mask[c] = index;
+              }
+            }
+          } else if (pixel_top_mask) {
+            for (int c = 0; c < channels_; ++c) {
+              if (bottom[c] > top[c]) {
+                top[c] = bottom[c];
+                pixel_top_mask[c] = static_cast<Dtype>(index);
+              }
+            }
+          } else {
+            for (int c = 0; c < channels_; ++c) {
+              top[c] = max(top[c], bottom[c]);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void PoolingLayer<Dtype>::ave_pool_nhwc_cpu(const Dtype* bottom_data,
+    Dtype* top_data, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    const int n = i / pooled_height_;
+    const int ph = i % pooled_height_;
+    for (int pw = 0; pw < pooled_width_; ++pw) {
+      int hstart = ph * stride_h_ - pad_h_;
+      int wstart = pw * stride_w_ - pad_w_;
+      int hend = min(hstart + kernel_h_, height_ + pad_h_);
+      int wend = min(wstart + kernel_w_, width_ + pad_w_);
+      int pool_size = (hend - hstart) * (wend - wstart);
+      hstart = max(hstart, 0);
+      wstart = max(wstart, 0);
+      hend = min(hend, height_);
+      wend = min(wend, width_);
+      Dtype* top = top_data + (i * pooled_width_ + pw) * channels_;
+      caffe_set(channels_, Dtype(0), top);
+      for (int h = hstart; h < hend; ++h) {
+        for (int w = wstart; w < wend; ++w) {
+          const Dtype* bottom = bottom_data
+              + ((n * height_ + h) * width_ + w) * channels_;
+          for (int c = 0; c < channels_; ++c) {
+            top[c] += bottom[c];
+          }
+        }
+      }
+      caffe_scal(channels_, Dtype(1) / pool_size, top);
+    }
+  }
+}
+
 template <typename Dtype>
 void PoolingLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = top[0]->mutable_cpu_data();
-  const int top_count = top[0]->count();
+  const bool nhwc = bottom[0]->layout() == NHWC;
+  // The NHWC kernels run a row of windows at a time, over all channels
+  const int planes = bottom[0]->num() * (nhwc ? pooled_height_ : channels_);
   // We'll output the mask to top[1] if it's of size >1.
   const bool use_top_mask = top.size() > 1;
   int* mask = NULL;  // suppress warnings about uninitalized variables
@@ -141,85 +417,26 @@ void PoolingLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   // loop to save time, although this results in more code.
   switch (this->layer_param_.pooling_param().pool()) {
   case PoolingParameter_PoolMethod_MAX:
-    // Initialize
+    // At TEST phase backward rarely runs, so only find the maxima again
+    // when it does rather than writing the mask on every forward
     if (use_top_mask) {
       top_mask = top[1]->mutable_cpu_data();
-      caffe_set(top_count, Dtype(-1), top_mask);
-    } else {
+    } else if (this->phase_ != TEST) {
       mask = max_idx_.mutable_cpu_data();
-      caffe_set(top_count, -1, mask);
     }
-    caffe_set(top_count, Dtype(-FLT_MAX), top_data);
+    mask_skipped_ = !use_top_mask && this->phase_ == TEST;
     // The main loop
-    for (int n = 0; n < bottom[0]->num(); ++n) {
-      for (int c = 0; c < channels_; ++c) {
-        for (int ph = 0; ph < pooled_height_; ++ph) {
-          for (int pw = 0; pw < pooled_width_; ++pw) {
-            int hstart = ph * stride_h_ - pad_h_;
-            int wstart = pw * stride_w_ - pad_w_;
-            int hend = min(hstart + kernel_h_, height_);
-            int wend = min(wstart + kernel_w_, width_);
-            hstart = max(hstart, 0);
-            wstart = max(wstart, 0);
-            const int pool_index = ph * pooled_width_ + pw;
-            for (int h = hstart; h < hend; ++h) {
-              for (int w = wstart; w < wend; ++w) {
-                const int index = h * width_ + w;
-                if (bottom_data[index] > top_data[pool_index]) {
-                  top_data[pool_index] = bottom_data[index];
-                  if (use_top_mask) {
-                    top_mask[pool_index] = static_cast<Dtype>(index);
-                  } else {
-                    mask[pool_index] = index;
-                  }
-                }
-              }
-            }
-          }
-        }
-        // compute offset
-        bottom_data += bottom[0]->offset(0, 1);
-        top_data += top[0]->offset(0, 1);
-        if (use_top_mask) {
-          top_mask += top[0]->offset(0, 1);
-        } else {
-          mask += top[0]->offset(0, 1);
-        }
-      }
-    }
+    Caffe::thread_pool().run(planes, 1,
+        boost::bind(nhwc ? &PoolingLayer<Dtype>::max_pool_nhwc_cpu :
+                    &PoolingLayer<Dtype>::max_pool_cpu, this, bottom_data,
+                    top_data, mask, top_mask, _1, _2));
     break;
   case PoolingParameter_PoolMethod_AVE:
-    for (int i = 0; i < top_count; ++i) {
-      top_data[i] = 0;
-    }
     // The main loop
-    for (int n = 0; n < bottom[0]->num(); ++n) {
-      for (int c = 0; c < channels_; ++c) {
-        for (int ph = 0; ph < pooled_height_; ++ph) {
-          for (int pw = 0; pw < pooled_width_; ++pw) {
-            int hstart = ph * stride_h_ - pad_h_;
-            int wstart = pw * stride_w_ - pad_w_;
-            int hend = min(hstart + kernel_h_, height_ + pad_h_);
-            int wend = min(wstart + kernel_w_, width_ + pad_w_);
-            int pool_size = (hend - hstart) * (wend - wstart);
-            hstart = max(hstart, 0);
-            wstart = max(wstart, 0);
-            hend = min(hend, height_);
-            wend = min(wend, width_);
-            for (int h = hstart; h < hend; ++h) {
-              for (int w = wstart; w < wend; ++w) {
-                top_data[ph * pooled_width_ + pw] +=
-                    bottom_data[h * width_ + w];
-              }
-            }
-            top_data[ph * pooled_width_ + pw] /= pool_size;
-          }
-        }
-        // compute offset
-        bottom_data += bottom[0]->offset(0, 1);
-        top_data += top[0]->offset(0, 1);
-      }
-    }
+    Caffe::thread_pool().run(planes, 1,
+        boost::bind(nhwc ? &PoolingLayer<Dtype>::ave_pool_nhwc_cpu :
+                    &PoolingLayer<Dtype>::ave_pool_cpu, this, bottom_data,
+                    top_data, _1, _2));
     break;
   case PoolingParameter_PoolMethod_STOCHASTIC:
     NOT_IMPLEMENTED;
@@ -239,19 +456,54 @@ void PoolingLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
   Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
   // Different pooling methods. We explicitly do the switch outside the for
   // loop to save time, although this results in more codes.
-  caffe_set(bottom[0]->count(), Dtype(0), bottom_diff);
+  if (!this->accumulate_bottom_diff(0)) {
+    caffe_set(bottom[0]->count(), Dtype(0), bottom_diff);
+  }
+  const bool nhwc = bottom[0]->layout() == NHWC;
   // We'll output the mask to top[1] if it's of size >1.
   const bool use_top_mask = top.size() > 1;
   const int* mask = NULL;  // suppress warnings about uninitialized variables
   const Dtype* top_mask = NULL;
   switch (this->layer_param_.pooling_param().pool()) {
   case PoolingParameter_PoolMethod_MAX:
+    if (mask_skipped_ && !use_top_mask) {
+      Blob<Dtype> pooled(top[0]->shape());
+      if (nhwc) {
+        max_pool_nhwc_cpu(bottom[0]->cpu_data(), pooled.mutable_cpu_data(),
+            max_idx_.mutable_cpu_data(), NULL, 0,
+            top[0]->num() * pooled_height_);
+      } else {
+        max_pool_cpu(bottom[0]->cpu_data(), pooled.mutable_cpu_data(),
+            max_idx_.mutable_cpu_data(), NULL, 0, top[0]->num() * channels_);
+      }
+      mask_skipped_ = false;
+    }
     // The main loop
     if (use_top_mask) {
       top_mask = top[1]->cpu_data();
     } else {
       mask = max_idx_.cpu_data();
     }
+    if (nhwc) {
+      // The masks hold the index of the pixel within the plane
+      const int bottom_dim = height_ * width_;
+      const int top_dim = pooled_height_ * pooled_width_;
+      for (int n = 0; n < top[0]->num(); ++n) {
+        for (int index = 0; index < top_dim * channels_; ++index) {
+          const int pixel = use_top_mask ? top_mask[index] : mask[index];
+          bottom_diff[pixel * channels_ + index % channels_] +=
+              top_diff[index];
+        }
+        bottom_diff += bottom_dim * channels_;
+        top_diff += top_dim * channels_;
+        if (use_top_mask) {
+          top_mask += top_dim * channels_;
+        } else {
+          mask += top_dim * channels_;
+        }
+      }
+      break;
+    }
     for (int n = 0; n < top[0]->num(); ++n) {
       for (int c = 0; c < channels_; ++c) {
         for (int ph = 0; ph < pooled_height_; ++ph) {
@@ -273,6 +525,31 @@ void PoolingLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     }
     break;
   case PoolingParameter_PoolMethod_AVE:
+    if (nhwc) {
+      for (int n = 0; n < top[0]->num(); ++n) {
+        for (int ph = 0; ph < pooled_height_; ++ph) {
+          for (int pw = 0; pw < pooled_width_; ++pw) {
+            int hstart = ph * stride_h_ - pad_h_;
+            int wstart = pw * stride_w_ - pad_w_;
+            int hend = min(hstart + kernel_h_, height_ + pad_h_);
+            int wend = min(wstart + kernel_w_, width_ + pad_w_);
+            int pool_size = (hend - hstart) * (wend - wstart);
+            hstart = max(hstart, 0);
+            wstart = max(wstart, 0);
+            hend = min(hend, height_);
+            wend = min(wend, width_);
+            for (int h = hstart; h < hend; ++h) {
+              for (int w = wstart; w < wend; ++w) {
+                caffe_axpy(channels_, Dtype(1) / pool_size,
+                    top_diff + top[0]->offset(n, 0, ph, pw),
+                    bottom_diff + bottom[0]->offset(n, 0, h, w));
+              }
+            }
+          }
+        }
+      }
+      break;
+    }
     // The main loop
     for (int n = 0; n < top[0]->num(); ++n) {
       for (int c = 0; c < channels_; ++c) {
@@ -8,7 +8,9 @@
 
 namespace caffe {
 
-template <typename Dtype>
+// Kernel and Stride, when not 0, are the size and stride of square windows
+// known at compile time, for which the loops over the windows are unrolled
+template <typename Dtype, int Kernel, int Stride>
 __global__ void MaxPoolForward(const int nthreads,
     const Dtype* const bottom_data, const int num, const int channels,
     const int height, const int width, const int pooled_height,
@@ -20,21 +22,39 @@ __global__ void MaxPoolForward(const int nthreads,
     const int ph = (index / pooled_width) % pooled_height;
     const int c = (index / pooled_width / pooled_height) % channels;
     const int n = index / pooled_width / pooled_height / channels;
-    int hstart = ph * stride_h - pad_h;
-    int wstart = pw * stride_w - pad_w;
-    const int hend = min(hstart + kernel_h, height);
-    const int wend = min(wstart + kernel_w, width);
-    hstart = max(hstart, 0);
-    wstart = max(wstart, 0);
     Dtype maxval = -FLT_MAX;
     int maxidx = -1;
     const Dtype* const bottom_slice =
         bottom_data + (n * channels + c) * height * width;
-    for (int h = hstart; h < hend; ++h) {
-      for (int w = wstart; w < wend; ++w) {
-        if (bottom_slice[h * width + w] > maxval) {
-          maxidx = h * width + w;
-          maxval = bottom_slice[maxidx];
+    if (Kernel) {
+      const int hstart = ph * Stride - pad_h;
+      const int wstart = pw * Stride - pad_w;
+#pragma unroll
+      for (int i = 0; i < Kernel; ++i) {
+#pragma unroll
+        for (int j = 0; j < Kernel; ++j) {
+          const int h = hstart + i;
+          const int w = wstart + j;
+          if (h >= 0 && h < height && w >= 0 && w < width
+              && bottom_slice[h * width + w] > maxval) {
+            maxidx = h * width + w;
+            maxval = bottom_slice[maxidx];
+          }
+        }
+      }
+    } else {
+      int hstart = ph * stride_h - pad_h;
+      int wstart = pw * stride_w - pad_w;
+      const int hend = min(hstart + kernel_h, height);
+      const int wend = min(wstart + kernel_w, width);
+      hstart = max(hstart, 0);
+      wstart = max(wstart, 0);
+      for (int h = hstart; h < hend; ++h) {
+        for (int w = wstart; w < wend; ++w) {
+          if (bottom_slice[h * width + w] > maxval) {
+            maxidx = h * width + w;
+            maxval = bottom_slice[maxidx];
+          }
         }
       }
     }
@@ -47,7 +67,7 @@ __global__ void MaxPoolForward(const int nthreads,
   }
 }
 
-template <typename Dtype>
+template <typename Dtype, int Kernel, int Stride>
 __global__ void AvePoolForward(const int nthreads,
     const Dtype* const bottom_data, const int num, const int channels,
     const int height, const int width, const int pooled_height,
@@ -59,27 +79,77 @@ __global__ void AvePoolForward(const int nthreads,
     const int ph = (index / pooled_width) % pooled_height;
     const int c = (index / pooled_width / pooled_height) % channels;
     const int n = index / pooled_width / pooled_height / channels;
-    int hstart = ph * stride_h - pad_h;
-    int wstart = pw * stride_w - pad_w;
-    int hend = min(hstart + kernel_h, height + pad_h);
-    int wend = min(wstart + kernel_w, width + pad_w);
-    const int pool_size = (hend - hstart) * (wend - wstart);
-    hstart = max(hstart, 0);
-    wstart = max(wstart, 0);
-    hend = min(hend, height);
-    wend = min(wend, width);
     Dtype aveval = 0;
     const Dtype* const bottom_slice =
         bottom_data + (n * channels + c) * height * width;
-    for (int h = hstart; h < hend; ++h) {
-      for (int w = wstart; w < wend; ++w) {
-        aveval += bottom_slice[h * width + w];
+    if (Kernel) {
+      const int hstart = ph * Stride - pad_h;
+      const int wstart = pw * Stride - pad_w;
+      const int pool_size = (min(hstart + Kernel, height + pad_h) - hstart)
+          * (min(wstart + Kernel, width + pad_w) - wstart);
+#pragma unroll
+      for (int i = 0; i < Kernel; ++i) {
+#pragma unroll
+        for (int j = 0; j < Kernel; ++j) {
+          const int h = hstart + i;
+          const int w = wstart + j;
+          if (h >= 0 && h < height && w >= 0 && w < width) {
+            aveval += bottom_slice[h * width + w];
+          }
+        }
+      }
+      top_data[index] = aveval / pool_size;
+    } else {
+      int hstart = ph * stride_h - pad_h;
+      int wstart = pw * stride_w - pad_w;
+      int hend = min(hstart + kernel_h, height + pad_h);
+      int wend = min(wstart + kernel_w, width + pad_w);
+      const int pool_size = (hend - hstart) * (wend - wstart);
+      hstart = max(hstart, 0);
+      wstart = max(wstart, 0);
+      hend = min(hend, height);
+      wend = min(wend, width);
+      for (int h = hstart; h < hend; ++h) {
+        for (int w = wstart; w < wend; ++w) {
+          aveval += bottom_slice[h * width + w];
+        }
       }
+      top_data[index] = aveval / pool_size;
     }
-    top_data[index] = aveval / pool_size;
   }
 }
 
+// Launches the forward kernels, with the windows known at compile time
+template <typename Dtype, int Kernel, int Stride>
+static void max_pool_forward_gpu(const int count,
+    const Dtype* const bottom_data, const int num, const int channels,
+    const int height, const int width, const int pooled_height,
+    const int pooled_width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    Dtype* const top_data, int* mask, Dtype* top_mask) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  MaxPoolForward<Dtype, Kernel, Stride><<<CAFFE_GET_BLOCKS(count),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+      count, bottom_data, num, channels, height, width, pooled_height,
+      pooled_width, kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w,
+      top_data, mask, top_mask);
+}
+
+template <typename Dtype, int Kernel, int Stride>
+static void ave_pool_forward_gpu(const int count,
+    const Dtype* const bottom_data, const int num, const int channels,
+    const int height, const int width, const int pooled_height,
+    const int pooled_width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    Dtype* const top_data) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  AvePoolForward<Dtype, Kernel, Stride><<<CAFFE_GET_BLOCKS(count),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+      count, bottom_data, num, channels, height, width, pooled_height,
+      pooled_width, kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w,
+      top_data);
+}
+
 template <typename Dtype>
 __global__ void StoPoolForwardTrain(const int nthreads,
     const Dtype* const bottom_data,
@@ -155,6 +225,80 @@ __global__ void StoPoolForwardTest(const int nthreads,
 }
 
 
+// Same as MaxPoolForward and AvePoolForward on NHWC blobs, consecutive
+// threads reading the consecutive channels of a pixel
+template <typename Dtype>
+__global__ void MaxPoolForwardNHWC(const int nthreads,
+    const Dtype* const bottom_data, const int num, const int channels,
+    const int height, const int width, const int pooled_height,
+    const int pooled_width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    Dtype* const top_data, int* mask, Dtype* top_mask) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int c = index % channels;
+    const int pw = (index / channels) % pooled_width;
+    const int ph = (index / channels / pooled_width) % pooled_height;
+    const int n = index / channels / pooled_width / pooled_height;
+    int hstart = ph * stride_h - pad_h;
+    int wstart = pw * stride_w - pad_w;
+    const int hend = min(hstart + kernel_h, height);
+    const int wend = min(wstart + kernel_w, width);
+    hstart = max(hstart, 0);
+    wstart = max(wstart, 0);
+    Dtype maxval = -FLT_MAX;
+    int maxidx = -1;
+    const Dtype* const bottom_slice =
+        bottom_data + n * height * width * channels + c;
+    for (int h = hstart; h < hend; ++h) {
+      for (int w = wstart; w < wend; ++w) {
+        if (bottom_slice[(h * width + w) * channels] > maxval) {
+          maxidx = h * width + w;
+          maxval = bottom_slice[maxidx * channels];
+        }
+      }
+    }
+    top_data[index] = maxval;
+    if (mask) {
+      mask[index] = maxidx;
+    } else {
+      top_mask[index] = maxidx;
+    }
+  }
+}
+
+template <typename Dtype>
+__global__ void AvePoolForwardNHWC(const int nthreads,
+    const Dtype* const bottom_data, const int num, const int channels,
+    const int height, const int width, const int pooled_height,
+    const int pooled_width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    Dtype* const top_data) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int c = index % channels;
+    const int pw = (index / channels) % pooled_width;
+    const int ph = (index / channels / pooled_width) % pooled_height;
+    const int n = index / channels / pooled_width / pooled_height;
+    int hstart = ph * stride_h - pad_h;
+    int wstart = pw * stride_w - pad_w;
+    int hend = min(hstart + kernel_h, height + pad_h);
+    int wend = min(wstart + kernel_w, width + pad_w);
+    const int pool_size = (hend - hstart) * (wend - wstart);
+    hstart = max(hstart, 0);
+    wstart = max(wstart, 0);
+    hend = min(hend, height);
+    wend = min(wend, width);
+    Dtype aveval = 0;
+    const Dtype* const bottom_slice =
+        bottom_data + n * height * width * channels + c;
+    for (int h = hstart; h < hend; ++h) {
+      for (int w = wstart; w < wend; ++w) {
+        aveval += bottom_slice[(h * width + w) * channels];
+      }
+    }
+    top_data[index] = aveval / pool_size;
+  }
+}
+
 template <typename Dtype>
 void PoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
@@ -165,6 +309,7 @@ void PoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
   const bool use_top_mask = top.size() > 1;
   int* mask = NULL;
   Dtype* top_mask = NULL;
+  const bool nhwc = bottom[0]->layout() == NHWC;
   switch (this->layer_param_.pooling_param().pool()) {
   case PoolingParameter_PoolMethod_MAX:
     if (use_top_mask) {
@@ -172,19 +317,64 @@ void PoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
     } else {
       mask = max_idx_.mutable_gpu_data();
     }
-    // NOLINT_NEXT_LINE(whitespace/operators)
-    MaxPoolForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-        count, bottom_data, bottom[0]->num(), channels_,
-        height_, width_, pooled_height_, pooled_width_, kernel_h_,
-        kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_, top_data,
-        mask, top_mask);
+    if (nhwc) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      MaxPoolForwardNHWC<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+          count, bottom_data, bottom[0]->num(), channels_, height_, width_,
+          pooled_height_, pooled_width_, kernel_h_, kernel_w_, stride_h_,
+          stride_w_, pad_h_, pad_w_, top_data, mask, top_mask);
+      break;
+    }
+    switch (fixed_kernel_) {
+    case 2:
+      max_pool_forward_gpu<Dtype, 2, 2>(count, bottom_data, bottom[0]->num(),
+          channels_, height_, width_, pooled_height_, pooled_width_,
+          kernel_h_, kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_,
+          top_data, mask, top_mask);
+      break;
+    case 3:
+      max_pool_forward_gpu<Dtype, 3, 2>(count, bottom_data, bottom[0]->num(),
+          channels_, height_, width_, pooled_height_, pooled_width_,
+          kernel_h_, kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_,
+          top_data, mask, top_mask);
+      break;
+    default:
+      max_pool_forward_gpu<Dtype, 0, 0>(count, bottom_data, bottom[0]->num(),
+          channels_, height_, width_, pooled_height_, pooled_width_,
+          kernel_h_, kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_,
+          top_data, mask, top_mask);
+    }
     break;
   case PoolingParameter_PoolMethod_AVE:
-    // NOLINT_NEXT_LINE(whitespace/operators)
-    AvePoolForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-        count, bottom_data, bottom[0]->num(), channels_,
-        height_, width_, pooled_height_, pooled_width_, kernel_h_,
-        kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_, top_data);
+    if (nhwc) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      AvePoolForwardNHWC<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+          count, bottom_data, bottom[0]->num(), channels_, height_, width_,
+          pooled_height_, pooled_width_, kernel_h_, kernel_w_, stride_h_,
+          stride_w_, pad_h_, pad_w_, top_data);
+      break;
+    }
+    switch (fixed_kernel_) {
+    case 2:
+      ave_pool_forward_gpu<Dtype, 2, 2>(count, bottom_data, bottom[0]->num(),
+          channels_, height_, width_, pooled_height_, pooled_width_,
+          kernel_h_, kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_,
+          top_data);
+      break;
+    case 3:
+      ave_pool_forward_gpu<Dtype, 3, 2>(count, bottom_data, bottom[0]->num(),
+          channels_, height_, width_, pooled_height_, pooled_width_,
+          kernel_h_, kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_,
+          top_data);
+      break;
+    default:
+      ave_pool_forward_gpu<Dtype, 0, 0>(count, bottom_data, bottom[0]->num(),
+          channels_, height_, width_, pooled_height_, pooled_width_,
+          kernel_h_, kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_,
+          top_data);
+    }
     break;
   case PoolingParameter_PoolMethod_STOCHASTIC:
     if (this->phase_ == TRAIN) {
@@ -193,7 +383,7 @@ void PoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
                             rand_idx_.mutable_gpu_data());
       // NOLINT_NEXT_LINE(whitespace/operators)
       StoPoolForwardTrain<Dtype><<<CAFFE_GET_BLOCKS(count),
-                                   CAFFE_CUDA_NUM_THREADS>>>(
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
           count, bottom_data, bottom[0]->num(), channels_,
           height_, width_, pooled_height_, pooled_width_, kernel_h_,
           kernel_w_, stride_h_, stride_w_,
@@ -201,7 +391,7 @@ void PoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
     } else {
       // NOLINT_NEXT_LINE(whitespace/operators)
       StoPoolForwardTest<Dtype><<<CAFFE_GET_BLOCKS(count),
-                                  CAFFE_CUDA_NUM_THREADS>>>(
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
           count, bottom_data, bottom[0]->num(), channels_,
           height_, width_, pooled_height_, pooled_width_, kernel_h_,
           kernel_w_, stride_h_, stride_w_, top_data);
@@ -220,7 +410,7 @@ __global__ void MaxPoolBackward(const int nthreads, const Dtype* const top_diff,
     const int channels, const int height, const int width,
     const int pooled_height, const int pooled_width, const int kernel_h,
     const int kernel_w, const int stride_h, const int stride_w, const int pad_h,
-    const int pad_w, Dtype* const bottom_diff) {
+    const int pad_w, const bool accumulate, Dtype* const bottom_diff) {
   CUDA_KERNEL_LOOP(index, nthreads) {
     // find out the local index
     // find out the local offset
@@ -256,7 +446,7 @@ __global__ void MaxPoolBackward(const int nthreads, const Dtype* const top_diff,
         }
       }
     }
-    bottom_diff[index] = gradient;
+    bottom_diff[index] = accumulate ? bottom_diff[index] + gradient : gradient;
   }
 }
 
@@ -266,7 +456,7 @@ __global__ void AvePoolBackward(const int nthreads, const Dtype* const top_diff,
     const int width, const int pooled_height, const int pooled_width,
     const int kernel_h, const int kernel_w, const int stride_h,
     const int stride_w, const int pad_h, const int pad_w,
-    Dtype* const bottom_diff) {
+    const bool accumulate, Dtype* const bottom_diff) {
   CUDA_KERNEL_LOOP(index, nthreads) {
     // find out the local index
     // find out the local offset
@@ -292,7 +482,7 @@ __global__ void AvePoolBackward(const int nthreads, const Dtype* const top_diff,
         gradient += top_diff_slice[ph * pooled_width + pw] / pool_size;
       }
     }
-    bottom_diff[index] = gradient;
+    bottom_diff[index] = accumulate ? bottom_diff[index] + gradient : gradient;
   }
 }
 
@@ -303,7 +493,7 @@ __global__ void StoPoolBackward(const int nthreads,
     const int num, const int channels, const int height,
     const int width, const int pooled_height, const int pooled_width,
     const int kernel_h, const int kernel_w, const int stride_h,
-    const int stride_w, Dtype* const bottom_diff) {
+    const int stride_w, const bool accumulate, Dtype* const bottom_diff) {
   CUDA_KERNEL_LOOP(index, nthreads) {
     // find out the local index
     // find out the local offset
@@ -326,7 +516,78 @@ __global__ void StoPoolBackward(const int nthreads,
             (index == static_cast<int>(rand_idx_slice[ph * pooled_width + pw]));
       }
     }
-    bottom_diff[index] = gradient;
+    bottom_diff[index] = accumulate ? bottom_diff[index] + gradient : gradient;
+  }
+}
+
+
+// Same as MaxPoolBackward and AvePoolBackward on NHWC blobs
+template <typename Dtype>
+__global__ void MaxPoolBackwardNHWC(const int nthreads,
+    const Dtype* const top_diff, const int* const mask,
+    const Dtype* const top_mask, const int num, const int channels,
+    const int height, const int width, const int pooled_height,
+    const int pooled_width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    const bool accumulate, Dtype* const bottom_diff) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int c = index % channels;
+    const int w = (index / channels) % width;
+    const int h = (index / channels / width) % height;
+    const int n = index / channels / width / height;
+    const int phstart =
+         (h + pad_h < kernel_h) ? 0 : (h + pad_h - kernel_h) / stride_h + 1;
+    const int phend = min((h + pad_h) / stride_h + 1, pooled_height);
+    const int pwstart =
+         (w + pad_w < kernel_w) ? 0 : (w + pad_w - kernel_w) / stride_w + 1;
+    const int pwend = min((w + pad_w) / stride_w + 1, pooled_width);
+    Dtype gradient = 0;
+    const int offset = n * pooled_height * pooled_width * channels + c;
+    for (int ph = phstart; ph < phend; ++ph) {
+      for (int pw = pwstart; pw < pwend; ++pw) {
+        const int top_index = offset + (ph * pooled_width + pw) * channels;
+        const int maxidx = mask ? mask[top_index] :
+            static_cast<int>(top_mask[top_index]);
+        if (maxidx == h * width + w) {
+          gradient += top_diff[top_index];
+        }
+      }
+    }
+    bottom_diff[index] = accumulate ? bottom_diff[index] + gradient : gradient;
+  }
+}
+
+template <typename Dtype>
+__global__ void AvePoolBackwardNHWC(const int nthreads,
+    const Dtype* const top_diff, const int num, const int channels,
+    const int height, const int width, const int pooled_height,
+    const int pooled_width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    const bool accumulate, Dtype* const bottom_diff) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int c = index % channels;
+    const int w = (index / channels) % width + pad_w;
+    const int h = (index / channels / width) % height + pad_h;
+    const int n = index / channels / width / height;
+    const int phstart = (h < kernel_h) ? 0 : (h - kernel_h) / stride_h + 1;
+    const int phend = min(h / stride_h + 1, pooled_height);
+    const int pwstart = (w < kernel_w) ? 0 : (w - kernel_w) / stride_w + 1;
+    const int pwend = min(w / stride_w + 1, pooled_width);
+    Dtype gradient = 0;
+    const Dtype* const top_diff_slice =
+        top_diff + n * pooled_height * pooled_width * channels + c;
+    for (int ph = phstart; ph < phend; ++ph) {
+      for (int pw = pwstart; pw < pwend; ++pw) {
+        int hstart = ph * stride_h - pad_h;
+        int wstart = pw * stride_w - pad_w;
+        int hend = min(hstart + kernel_h, height + pad_h);
+        int wend = min(wstart + kernel_w, width + pad_w);
+        int pool_size = (hend - hstart) * (wend - wstart);
+        gradient += top_diff_slice[(ph * pooled_width + pw) * channels]
+            / pool_size;
+      }
+    }
+    bottom_diff[index] = accumulate ? bottom_diff[index] + gradient : gradient;
   }
 }
 
@@ -340,7 +601,8 @@ void PoolingLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
   const Dtype* top_diff = top[0]->gpu_diff();
   Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
   const int count = bottom[0]->count();
-  caffe_gpu_set(count, Dtype(0.), bottom_diff);
+  const bool accumulate = this->accumulate_bottom_diff(0);
+  const bool nhwc = bottom[0]->layout() == NHWC;
   // We'll output the mask to top[1] if it's of size >1.
   const bool use_top_mask = top.size() > 1;
   const int* mask = NULL;
@@ -352,27 +614,51 @@ void PoolingLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     } else {
       mask = max_idx_.gpu_data();
     }
+    if (nhwc) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      MaxPoolBackwardNHWC<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+          count, top_diff, mask, top_mask, top[0]->num(), channels_,
+          height_, width_, pooled_height_, pooled_width_,
+          kernel_h_, kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_,
+          accumulate, bottom_diff);
+      break;
+    }
     // NOLINT_NEXT_LINE(whitespace/operators)
-    MaxPoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+    MaxPoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS, 0,
+        Caffe::cuda_stream()>>>(
         count, top_diff, mask, top_mask, top[0]->num(), channels_,
         height_, width_, pooled_height_, pooled_width_,
         kernel_h_, kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_,
-        bottom_diff);
+        accumulate, bottom_diff);
     break;
   case PoolingParameter_PoolMethod_AVE:
+    if (nhwc) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      AvePoolBackwardNHWC<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+          count, top_diff, top[0]->num(), channels_,
+          height_, width_, pooled_height_, pooled_width_, kernel_h_,
+          kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_, accumulate,
+          bottom_diff);
+      break;
+    }
     // NOLINT_NEXT_LINE(whitespace/operators)
-    AvePoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+    AvePoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS, 0,
+        Caffe::cuda_stream()>>>(
         count, top_diff, top[0]->num(), channels_,
         height_, width_, pooled_height_, pooled_width_, kernel_h_,
-        kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_, bottom_diff);
+        kernel_w_, stride_h_, stride_w_, pad_h_, pad_w_, accumulate,
+        bottom_diff);
     break;
   case PoolingParameter_PoolMethod_STOCHASTIC:
     // NOLINT_NEXT_LINE(whitespace/operators)
-    StoPoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+    StoPoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS, 0,
+        Caffe::cuda_stream()>>>(
         count, rand_idx_.gpu_data(), top_diff,
         top[0]->num(), channels_, height_, width_, pooled_height_,
         pooled_width_, kernel_h_, kernel_w_, stride_h_, stride_w_,
-        bottom_diff);
+        accumulate, bottom_diff);
     break;
   default:
     LOG(FATAL) << "Unknown pooling method.";
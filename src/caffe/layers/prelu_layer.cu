@@ -29,12 +29,52 @@ __global__ void PReLUBackward(const int n, const int channels, const int dim,
   }
 }
 
-// CUDA kernel for element-wise parameter backward
+// CUDA kernel for parameter backward: one block per channel sums the top
+// diff times the input where the input is not positive, adding it to
+// slope_diff if accumulate.
 template <typename Dtype>
-__global__ void PReLUParamBackward(const int n, const Dtype* in_diff,
-    const Dtype* in_data, Dtype* out_diff) {
-  CUDA_KERNEL_LOOP(index, n) {
-    out_diff[index] = in_diff[index] * in_data[index] * (in_data[index] <= 0);
+__global__ void PReLUParamBackward(const int num, const int channels,
+    const int dim, const Dtype* in_diff, const Dtype* in_data,
+    const bool accumulate, Dtype* slope_diff) {
+  __shared__ Dtype buffer[CAFFE_CUDA_NUM_THREADS];
+  const int c = blockIdx.x;
+  Dtype sum = 0;
+  for (int j = threadIdx.x; j < num * dim; j += blockDim.x) {
+    const int index = ((j / dim) * channels + c) * dim + j % dim;
+    sum += in_diff[index] * in_data[index] * (in_data[index] <= 0);
+  }
+  buffer[threadIdx.x] = sum;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      buffer[threadIdx.x] += buffer[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    slope_diff[c] = (accumulate ? slope_diff[c] : Dtype(0)) + buffer[0];
+  }
+}
+
+// Adds the per channel gradients of a shared slope to its diff.
+template <typename Dtype>
+__global__ void PReLUSharedParamBackward(const int channels,
+    const Dtype* channel_diff, Dtype* slope_diff) {
+  __shared__ Dtype buffer[CAFFE_CUDA_NUM_THREADS];
+  Dtype sum = 0;
+  for (int c = threadIdx.x; c < channels; c += blockDim.x) {
+    sum += channel_diff[c];
+  }
+  buffer[threadIdx.x] = sum;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      buffer[threadIdx.x] += buffer[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    slope_diff[0] += buffer[0];
   }
 }
 
@@ -55,7 +95,8 @@ void PReLULayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
   }
 
   // NOLINT_NEXT_LINE(whitespace/operators)
-  PReLUForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+  PReLUForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(
       count, channels, dim, bottom_data, top_data, slope_data, div_factor);
   CUDA_POST_KERNEL_CHECK;
 }
@@ -81,30 +122,18 @@ void PReLULayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
   // keep top_diff unchanged.
   if (this->param_propagate_down_[0]) {
     Dtype* slope_diff = this->blobs_[0]->mutable_gpu_diff();
-    int cdim = channels * dim;
-    Dtype dsum = 0.;
-    for (int n = 0; n < bottom[0]->num(); ++n) {
-      // compute element-wise diff
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    PReLUParamBackward<Dtype><<<channels, CAFFE_CUDA_NUM_THREADS, 0,
+        Caffe::cuda_stream()>>>(bottom[0]->num(), channels, dim, top_diff,
+        bottom_data, !channel_shared_,
+        channel_shared_ ? backward_buff_.mutable_gpu_diff() : slope_diff);
+    CUDA_POST_KERNEL_CHECK;
+    if (channel_shared_) {
       // NOLINT_NEXT_LINE(whitespace/operators)
-      PReLUParamBackward<Dtype><<<CAFFE_GET_BLOCKS(cdim),
-          CAFFE_CUDA_NUM_THREADS>>>(
-          cdim, top_diff + top[0]->offset(n),
-          bottom_data + bottom[0]->offset(n),
-          backward_buff_.mutable_gpu_diff());
+      PReLUSharedParamBackward<Dtype><<<1, CAFFE_CUDA_NUM_THREADS, 0,
+          Caffe::cuda_stream()>>>(channels, backward_buff_.gpu_diff(),
+          slope_diff);
       CUDA_POST_KERNEL_CHECK;
-      if (channel_shared_) {
-        Dtype d;
-        caffe_gpu_dot<Dtype>(channels * dim, backward_buff_.gpu_diff(),
-            multiplier_.gpu_data(), &d);
-        dsum += d;
-      } else {
-        caffe_gpu_gemv<Dtype>(CblasNoTrans, channels, dim, 1.,
-            backward_buff_.gpu_diff(), multiplier_.gpu_data(), 1.,
-            slope_diff);
-      }
-    }
-    if (channel_shared_) {
-      caffe_gpu_add_scalar(this->blobs_[0]->count(), Dtype(dsum), slope_diff);
     }
   }
   // Propagate to bottom
@@ -114,7 +143,7 @@ void PReLULayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     int div_factor = channel_shared_ ? channels : 1;
     // NOLINT_NEXT_LINE(whitespace/operators)
     PReLUBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
-        CAFFE_CUDA_NUM_THREADS>>>(
+        CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
         count, channels, dim, top_diff, bottom_data, bottom_diff, slope_data,
         div_factor);
     CUDA_POST_KERNEL_CHECK;
@@ -1,4 +1,3 @@
-#include <cfloat>
 #include <vector>
 
 #include "caffe/layer.hpp"
@@ -7,39 +6,72 @@
 
 namespace caffe {
 
+// One block per row reduces its dim values, scaled by coeff, into the top,
+// which thus stays on the device.
 template <typename Dtype>
-void ReductionLayer<Dtype>::Forward_gpu(
-    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  const Dtype* bottom_data = bottom[0]->gpu_data();
-  const Dtype* mult_data = NULL;
-  if (sum_multiplier_.count() > 0) {
-    mult_data = sum_multiplier_.gpu_data();
-  }
-  Dtype* top_data = top[0]->mutable_cpu_data();
-  for (int i = 0; i < num_; ++i) {
-    switch (op_) {
-    case ReductionParameter_ReductionOp_SUM:
-    case ReductionParameter_ReductionOp_MEAN:
-      caffe_gpu_dot(dim_, mult_data, bottom_data, top_data);
+__global__ void ReductionForward(const int dim, const int op,
+    const Dtype coeff, const Dtype* bottom_data, Dtype* top_data) {
+  __shared__ Dtype buffer[CAFFE_CUDA_NUM_THREADS];
+  const Dtype* row = bottom_data + blockIdx.x * dim;
+  Dtype sum = 0;
+  for (int j = threadIdx.x; j < dim; j += blockDim.x) {
+    const Dtype x = row[j];
+    switch (op) {
+    case ReductionParameter_ReductionOp_ASUM:
+      sum += abs(x);
       break;
+    case ReductionParameter_ReductionOp_SUMSQ:
+      sum += x * x;
+      break;
+    default:
+      sum += x;
+    }
+  }
+  buffer[threadIdx.x] = sum;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      buffer[threadIdx.x] += buffer[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    top_data[blockIdx.x] = coeff * buffer[0];
+  }
+}
+
+template <typename Dtype>
+__global__ void ReductionBackward(const int nthreads, const int dim,
+    const int op, const Dtype coeff, const Dtype* bottom_data,
+    const Dtype* top_diff, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const Dtype bottom_coeff = coeff * top_diff[index / dim];
+    switch (op) {
     case ReductionParameter_ReductionOp_ASUM:
-      caffe_gpu_asum(dim_, bottom_data, top_data);
+      bottom_diff[index] = bottom_coeff
+          * ((Dtype(0) < bottom_data[index]) - (bottom_data[index] < Dtype(0)));
       break;
     case ReductionParameter_ReductionOp_SUMSQ:
-      caffe_gpu_dot(dim_, bottom_data, bottom_data, top_data);
+      bottom_diff[index] = 2 * bottom_coeff * bottom_data[index];
       break;
     default:
-      LOG(FATAL) << "Unknown reduction op: "
-          << ReductionParameter_ReductionOp_Name(op_);
+      bottom_diff[index] = bottom_coeff;
     }
-    bottom_data += dim_;
-    ++top_data;
   }
-  if (coeff_ != Dtype(1)) {
-    // Reset the top_data pointer.
-    top_data = top[0]->mutable_gpu_data();
-    caffe_gpu_scal(num_, coeff_, top_data);
+}
+
+template <typename Dtype>
+void ReductionLayer<Dtype>::Forward_gpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  // The smallest power of two block covering a row, of at least a warp
+  int threads = 32;
+  while (threads < dim_ && threads < CAFFE_CUDA_NUM_THREADS) {
+    threads *= 2;
   }
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  ReductionForward<Dtype><<<num_, threads, 0, Caffe::cuda_stream()>>>(dim_,
+      op_, coeff_, bottom[0]->gpu_data(), top[0]->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
 }
 
 template <typename Dtype>
@@ -62,30 +94,12 @@ void ReductionLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     LOG(FATAL) << "Unknown reduction op: "
         << ReductionParameter_ReductionOp_Name(op_);
   }
-  const Dtype* top_diff = top[0]->cpu_diff();
-  Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
-  for (int i = 0; i < num_; ++i) {
-    const Dtype bottom_coeff = (*top_diff) * coeff_;
-    switch (op_) {
-    case ReductionParameter_ReductionOp_SUM:
-    case ReductionParameter_ReductionOp_MEAN:
-      caffe_gpu_set(dim_, bottom_coeff, bottom_diff);
-      break;
-    case ReductionParameter_ReductionOp_ASUM:
-      caffe_gpu_sign(dim_, bottom_data, bottom_diff);
-      caffe_gpu_scal(dim_, bottom_coeff, bottom_diff);
-      break;
-    case ReductionParameter_ReductionOp_SUMSQ:
-      caffe_gpu_scale(dim_, 2 * bottom_coeff, bottom_data, bottom_diff);
-      break;
-    default:
-      LOG(FATAL) << "Unknown reduction op: "
-          << ReductionParameter_ReductionOp_Name(op_);
-    }
-    bottom_data += dim_;
-    bottom_diff += dim_;
-    ++top_diff;
-  }
+  const int count = bottom[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  ReductionBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+      0, Caffe::cuda_stream()>>>(count, dim_, op_, coeff_, bottom_data,
+      top[0]->gpu_diff(), bottom[0]->mutable_gpu_diff());
+  CUDA_POST_KERNEL_CHECK;
 }
 
 INSTANTIATE_LAYER_GPU_FUNCS(ReductionLayer);
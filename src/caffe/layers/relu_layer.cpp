@@ -1,11 +1,23 @@
+#include <boost/bind.hpp>
+
 #include <algorithm>
 #include <vector>
 
 #include "caffe/layer.hpp"
+#include "caffe/util/thread_pool.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
 
+template <typename Dtype>
+static void relu_forward_cpu(const Dtype* bottom_data, Dtype* top_data,
+    const Dtype negative_slope, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    top_data[i] = std::max(bottom_data[i], Dtype(0))
+        + negative_slope * std::min(bottom_data[i], Dtype(0));
+  }
+}
+
 template <typename Dtype>
 void ReLULayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
@@ -13,10 +25,9 @@ void ReLULayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   Dtype* top_data = top[0]->mutable_cpu_data();
   const int count = bottom[0]->count();
   Dtype negative_slope = this->layer_param_.relu_param().negative_slope();
-  for (int i = 0; i < count; ++i) {
-    top_data[i] = std::max(bottom_data[i], Dtype(0))
-        + negative_slope * std::min(bottom_data[i], Dtype(0));
-  }
+  Caffe::thread_pool().run(count, kParallelGrain,
+      boost::bind(&relu_forward_cpu<Dtype>, bottom_data, top_data,
+                  negative_slope, _1, _2));
 }
 
 template <typename Dtype>
@@ -0,0 +1,136 @@
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const ROIPoolingParameter& param = this->layer_param_.roi_pooling_param();
+  pooled_h_ = param.pooled_h();
+  pooled_w_ = param.pooled_w();
+  CHECK_GT(pooled_h_, 0) << "pooled_h must be positive";
+  CHECK_GT(pooled_w_, 0) << "pooled_w must be positive";
+  spatial_scale_ = param.spatial_scale();
+}
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  CHECK_EQ(4, bottom[0]->num_axes()) << "Input must have 4 axes, "
+      << "corresponding to (num, channels, height, width)";
+  CHECK_EQ(NCHW, bottom[0]->layout()) << "ROIPooling takes NCHW inputs";
+  CHECK_EQ(5, bottom[1]->count(1))
+      << "Regions of interest must be (image, x1, y1, x2, y2)";
+  channels_ = bottom[0]->channels();
+  height_ = bottom[0]->height();
+  width_ = bottom[0]->width();
+  top[0]->Reshape(bottom[1]->shape(0), channels_, pooled_h_, pooled_w_);
+  max_idx_.Reshape(bottom[1]->shape(0), channels_, pooled_h_, pooled_w_);
+}
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::forward_rois_cpu(const Dtype* bottom_data,
+    const Dtype* rois, Dtype* top_data, int* argmax, int begin, int end) {
+  for (int r = begin; r < end; ++r) {
+    const Dtype* roi = rois + r * 5;
+    const int n = roi[0];
+    const int roi_start_w = round(roi[1] * spatial_scale_);
+    const int roi_start_h = round(roi[2] * spatial_scale_);
+    const int roi_end_w = round(roi[3] * spatial_scale_);
+    const int roi_end_h = round(roi[4] * spatial_scale_);
+    // Boxes too small are one pixel
+    const int roi_height = std::max(roi_end_h - roi_start_h + 1, 1);
+    const int roi_width = std::max(roi_end_w - roi_start_w + 1, 1);
+    const Dtype bin_h = static_cast<Dtype>(roi_height) / pooled_h_;
+    const Dtype bin_w = static_cast<Dtype>(roi_width) / pooled_w_;
+    for (int c = 0; c < channels_; ++c) {
+      const Dtype* in = bottom_data + (n * channels_ + c) * height_ * width_;
+      const int offset = (r * channels_ + c) * pooled_h_ * pooled_w_;
+      for (int ph = 0; ph < pooled_h_; ++ph) {
+        const int hstart = std::min(std::max(roi_start_h
+            + static_cast<int>(floor(ph * bin_h)), 0), height_);
+        const int hend = std::min(std::max(roi_start_h
+            + static_cast<int>(ceil((ph + 1) * bin_h)), 0), height_);
+        for (int pw = 0; pw < pooled_w_; ++pw) {
+          const int wstart = std::min(std::max(roi_start_w
+              + static_cast<int>(floor(pw * bin_w)), 0), width_);
+          const int wend = std::min(std::max(roi_start_w
+              + static_cast<int>(ceil((pw + 1) * bin_w)), 0), width_);
+          // Bins outside of the map are 0
+          Dtype max = hend > hstart && wend > wstart ? -FLT_MAX : 0;
+          int max_index = -1;
+          for (int h = hstart; h < hend; ++h) {
+            for (int w = wstart; w < wend; ++w) {
+              if (in[h * width_ + w] > max) {
+                max = in[h * width_ + w];
+                max_index = h * width_ + w;
+              }
+            }
+          }
+          top_data[offset + ph * pooled_w_ + pw] = max;
+          argmax[offset + ph * pooled_w_ + pw] = max_index;
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const int num_rois = bottom[1]->shape(0);
+  const Dtype* rois = bottom[1]->cpu_data();
+  for (int r = 0; r < num_rois; ++r) {
+    CHECK_GE(rois[r * 5], 0);
+    CHECK_LT(rois[r * 5], bottom[0]->num());
+  }
+  Caffe::thread_pool().run(num_rois,
+      kParallelGrain / (channels_ * pooled_h_ * pooled_w_),
+      boost::bind(&ROIPoolingLayer<Dtype>::forward_rois_cpu, this,
+                  bottom[0]->cpu_data(), rois, top[0]->mutable_cpu_data(),
+                  max_idx_.mutable_cpu_data(), _1, _2));
+}
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+    const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) { return; }
+  const Dtype* top_diff = top[0]->cpu_diff();
+  const Dtype* rois = bottom[1]->cpu_data();
+  const int* argmax = max_idx_.cpu_data();
+  Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
+  caffe_set(bottom[0]->count(), Dtype(0), bottom_diff);
+  // Regions overlap, so their maxima are added up in turn
+  const int pooled_dim = pooled_h_ * pooled_w_;
+  for (int r = 0; r < bottom[1]->shape(0); ++r) {
+    const int n = rois[r * 5];
+    for (int c = 0; c < channels_; ++c) {
+      Dtype* in_diff = bottom_diff + (n * channels_ + c) * height_ * width_;
+      const int offset = (r * channels_ + c) * pooled_dim;
+      for (int i = 0; i < pooled_dim; ++i) {
+        if (argmax[offset + i] >= 0) {
+          in_diff[argmax[offset + i]] += top_diff[offset + i];
+        }
+      }
+    }
+  }
+}
+
+#ifdef CPU_ONLY
+STUB_GPU(ROIPoolingLayer);
+#endif
+
+INSTANTIATE_CLASS(ROIPoolingLayer);
+REGISTER_LAYER_CLASS(ROIPooling);
+
+}  // namespace caffe
@@ -0,0 +1,139 @@
+#include <cfloat>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// The bins of a region, as in ROIPoolingLayer::forward_rois_cpu
+template <typename Dtype>
+__device__ void roi_bins(const Dtype* roi, const Dtype spatial_scale,
+    const int pooled_h, const int pooled_w, int* roi_start_h,
+    int* roi_start_w, Dtype* bin_h, Dtype* bin_w) {
+  *roi_start_w = round(roi[1] * spatial_scale);
+  *roi_start_h = round(roi[2] * spatial_scale);
+  const int roi_end_w = round(roi[3] * spatial_scale);
+  const int roi_end_h = round(roi[4] * spatial_scale);
+  *bin_h = static_cast<Dtype>(max(roi_end_h - *roi_start_h + 1, 1))
+      / pooled_h;
+  *bin_w = static_cast<Dtype>(max(roi_end_w - *roi_start_w + 1, 1))
+      / pooled_w;
+}
+
+// A thread per bin
+template <typename Dtype>
+__global__ void ROIPoolForward(const int n, const Dtype* bottom_data,
+    const Dtype* rois, const Dtype spatial_scale, const int channels,
+    const int height, const int width, const int pooled_h,
+    const int pooled_w, Dtype* top_data, int* argmax) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int pw = index % pooled_w;
+    const int ph = (index / pooled_w) % pooled_h;
+    const int c = (index / pooled_w / pooled_h) % channels;
+    const Dtype* roi = rois + index / pooled_w / pooled_h / channels * 5;
+    int roi_start_h, roi_start_w;
+    Dtype bin_h, bin_w;
+    roi_bins(roi, spatial_scale, pooled_h, pooled_w, &roi_start_h,
+        &roi_start_w, &bin_h, &bin_w);
+    const int hstart = min(max(roi_start_h
+        + static_cast<int>(floor(ph * bin_h)), 0), height);
+    const int hend = min(max(roi_start_h
+        + static_cast<int>(ceil((ph + 1) * bin_h)), 0), height);
+    const int wstart = min(max(roi_start_w
+        + static_cast<int>(floor(pw * bin_w)), 0), width);
+    const int wend = min(max(roi_start_w
+        + static_cast<int>(ceil((pw + 1) * bin_w)), 0), width);
+    const Dtype* in = bottom_data
+        + (static_cast<int>(roi[0]) * channels + c) * height * width;
+    Dtype maxval = hend > hstart && wend > wstart ? -FLT_MAX : 0;
+    int maxidx = -1;
+    for (int h = hstart; h < hend; ++h) {
+      for (int w = wstart; w < wend; ++w) {
+        if (in[h * width + w] > maxval) {
+          maxval = in[h * width + w];
+          maxidx = h * width + w;
+        }
+      }
+    }
+    top_data[index] = maxval;
+    argmax[index] = maxidx;
+  }
+}
+
+// A thread per value of the feature maps, adding up the bins of the regions
+// of its image whose maximum it is, instead of scattering them with atomics
+template <typename Dtype>
+__global__ void ROIPoolBackward(const int n, const Dtype* top_diff,
+    const int* argmax, const int num_rois, const Dtype* rois,
+    const Dtype spatial_scale, const int channels, const int height,
+    const int width, const int pooled_h, const int pooled_w,
+    Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int w = index % width;
+    const int h = (index / width) % height;
+    const int c = (index / width / height) % channels;
+    const int image = index / width / height / channels;
+    Dtype gradient = 0;
+    for (int r = 0; r < num_rois; ++r) {
+      const Dtype* roi = rois + r * 5;
+      if (static_cast<int>(roi[0]) != image) {
+        continue;
+      }
+      int roi_start_h, roi_start_w;
+      Dtype bin_h, bin_w;
+      roi_bins(roi, spatial_scale, pooled_h, pooled_w, &roi_start_h,
+          &roi_start_w, &bin_h, &bin_w);
+      // The bins which may hold (h, w)
+      const int phstart = max(static_cast<int>(
+          floor((h - roi_start_h) / bin_h)), 0);
+      const int phend = min(static_cast<int>(
+          ceil((h - roi_start_h + 1) / bin_h)), pooled_h);
+      const int pwstart = max(static_cast<int>(
+          floor((w - roi_start_w) / bin_w)), 0);
+      const int pwend = min(static_cast<int>(
+          ceil((w - roi_start_w + 1) / bin_w)), pooled_w);
+      const int offset = (r * channels + c) * pooled_h * pooled_w;
+      for (int ph = phstart; ph < phend; ++ph) {
+        for (int pw = pwstart; pw < pwend; ++pw) {
+          if (argmax[offset + ph * pooled_w + pw] == h * width + w) {
+            gradient += top_diff[offset + ph * pooled_w + pw];
+          }
+        }
+      }
+    }
+    bottom_diff[index] = gradient;
+  }
+}
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const int count = top[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  ROIPoolForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+      0, Caffe::cuda_stream()>>>(count, bottom[0]->gpu_data(),
+      bottom[1]->gpu_data(), spatial_scale_, channels_, height_, width_,
+      pooled_h_, pooled_w_, top[0]->mutable_gpu_data(),
+      max_idx_.mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) { return; }
+  const int count = bottom[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  ROIPoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+      0, Caffe::cuda_stream()>>>(count, top[0]->gpu_diff(),
+      max_idx_.gpu_data(), bottom[1]->shape(0), bottom[1]->gpu_data(),
+      spatial_scale_, channels_, height_, width_, pooled_h_, pooled_w_,
+      bottom[0]->mutable_gpu_diff());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(ROIPoolingLayer);
+
+}  // namespace caffe
@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "caffe/filler.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void SampledSoftmaxWithLossLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  LossLayer<Dtype>::LayerSetUp(bottom, top);
+  const InnerProductParameter& ip_param =
+      this->layer_param_.inner_product_param();
+  CHECK(!ip_param.has_fused_relu())
+      << "SampledSoftmaxWithLoss does not apply a ReLU to its logits";
+  CHECK_GT(this->layer_param_.sampled_softmax_param().num_sampled(), 0);
+  N_ = ip_param.num_output();
+  bias_term_ = ip_param.bias_term();
+  sampling_ = this->phase_ == TRAIN;
+  const int axis = bottom[0]->CanonicalAxisIndex(ip_param.axis());
+  K_ = bottom[0]->count(axis);
+  M_ = bottom[0]->count(0, axis);
+  // Set up the weights as InnerProductLayer does
+  if (this->blobs_.size() > 0) {
+    LOG(INFO) << "Skipping parameter initialization";
+  } else {
+    this->blobs_.resize(bias_term_ ? 2 : 1);
+    vector<int> weight_shape(2);
+    weight_shape[0] = N_;
+    weight_shape[1] = K_;
+    this->blobs_[0].reset(new Blob<Dtype>(weight_shape));
+    shared_ptr<Filler<Dtype> > weight_filler(GetFiller<Dtype>(
+        ip_param.weight_filler()));
+    weight_filler->Fill(this->blobs_[0].get());
+    if (bias_term_) {
+      vector<int> bias_shape(1, N_);
+      this->blobs_[1].reset(new Blob<Dtype>(bias_shape));
+      shared_ptr<Filler<Dtype> > bias_filler(GetFiller<Dtype>(
+          ip_param.bias_filler()));
+      bias_filler->Fill(this->blobs_[1].get());
+    }
+  }
+  this->param_propagate_down_.resize(this->blobs_.size(), true);
+  position_.assign(N_, -1);
+
+  // The labels given to the internal layer are positions, ignored ones -1.
+  LayerParameter softmax_loss_param(this->layer_param_);
+  softmax_loss_param.set_type("SoftmaxWithLoss");
+  softmax_loss_param.clear_blobs();
+  softmax_loss_param.mutable_softmax_param()->set_axis(1);
+  if (softmax_loss_param.loss_param().has_ignore_label()) {
+    softmax_loss_param.mutable_loss_param()->set_ignore_label(-1);
+  }
+  softmax_loss_layer_.reset(
+      new SoftmaxWithLossLayer<Dtype>(softmax_loss_param));
+  vector<int> logits_shape(2);
+  logits_shape[0] = M_;
+  logits_shape[1] = sampling_ ? 1 : N_;
+  logits_.Reshape(logits_shape);
+  labels_.Reshape(vector<int>(1, M_));
+  softmax_loss_bottom_vec_.clear();
+  softmax_loss_bottom_vec_.push_back(&logits_);
+  softmax_loss_bottom_vec_.push_back(&labels_);
+  softmax_loss_layer_->SetUp(softmax_loss_bottom_vec_, top);
+}
+
+template <typename Dtype>
+void SampledSoftmaxWithLossLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  LossLayer<Dtype>::Reshape(bottom, top);
+  const int axis = bottom[0]->CanonicalAxisIndex(
+      this->layer_param_.inner_product_param().axis());
+  CHECK_EQ(K_, bottom[0]->count(axis))
+      << "Input size incompatible with inner product parameters.";
+  M_ = bottom[0]->count(0, axis);
+  CHECK_EQ(M_, bottom[1]->count())
+      << "Number of labels must match number of inner products.";
+  // The sampled logits have a bias even without bias_term for the offsets.
+  bias_multiplier_.Reshape(vector<int>(1, M_));
+  caffe_set(M_, Dtype(1), bias_multiplier_.mutable_cpu_data());
+  labels_.Reshape(vector<int>(1, M_));
+  if (!sampling_) {
+    vector<int> logits_shape(2);
+    logits_shape[0] = M_;
+    logits_shape[1] = N_;
+    logits_.Reshape(logits_shape);
+  }
+}
+
+template <typename Dtype>
+void SampledSoftmaxWithLossLayer<Dtype>::Sample(const Dtype* label) {
+  const LossParameter& loss_param = this->layer_param_.loss_param();
+  vector<int> candidates;
+  Dtype* labels = labels_.mutable_cpu_data();
+  for (int i = 0; i < M_; ++i) {
+    const int label_value = static_cast<int>(label[i]);
+    if (loss_param.has_ignore_label()
+        && label_value == loss_param.ignore_label()) {
+      labels[i] = -1;
+      continue;
+    }
+    CHECK_GE(label_value, 0);
+    CHECK_LT(label_value, N_);
+    if (!sampling_) {
+      labels[i] = label_value;
+      continue;
+    }
+    if (position_[label_value] < 0) {
+      position_[label_value] = candidates.size();
+      candidates.push_back(label_value);
+    }
+    labels[i] = position_[label_value];
+  }
+  if (!sampling_) {
+    return;
+  }
+  const SampledSoftmaxParameter& param =
+      this->layer_param_.sampled_softmax_param();
+  const int num_sampled = param.num_sampled();
+  const bool log_uniform =
+      param.sampler() == SampledSoftmaxParameter_Sampler_LOG_UNIFORM;
+  const double log_range = log(N_ + 1.);
+  vector<Dtype> draws(num_sampled);
+  caffe_rng_uniform<Dtype>(num_sampled, Dtype(0), Dtype(1), &draws[0]);
+  for (int i = 0; i < num_sampled; ++i) {
+    int c = log_uniform ? static_cast<int>(exp(draws[i] * log_range)) - 1
+        : static_cast<int>(draws[i] * N_);
+    c = std::min(std::max(c, 0), N_ - 1);
+    if (position_[c] < 0) {
+      position_[c] = candidates.size();
+      candidates.push_back(c);
+    }
+  }
+  const vector<int> shape(1, candidates.size());
+  candidates_.Reshape(shape);
+  offsets_.Reshape(shape);
+  int* candidate_data = candidates_.mutable_cpu_data();
+  Dtype* offsets = offsets_.mutable_cpu_data();
+  for (int i = 0; i < candidates.size(); ++i) {
+    const int c = candidates[i];
+    const double p = log_uniform ? log((c + 2.) / (c + 1.)) / log_range
+        : 1. / N_;
+    offsets[i] = -log(num_sampled * p);
+    candidate_data[i] = c;
+    position_[c] = -1;
+  }
+}
+
+template <typename Dtype>
+void SampledSoftmaxWithLossLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  Sample(bottom[1]->cpu_data());
+  const Dtype* weight = this->blobs_[0]->cpu_data();
+  const Dtype* bias = bias_term_ ? this->blobs_[1]->cpu_data() : NULL;
+  int num_candidates = N_;
+  if (sampling_) {
+    num_candidates = candidates_.count();
+    vector<int> shape(2);
+    shape[0] = num_candidates;
+    shape[1] = K_;
+    sampled_weight_.Reshape(shape);
+    sampled_bias_.ReshapeLike(offsets_);
+    const int* candidates = candidates_.cpu_data();
+    const Dtype* offsets = offsets_.cpu_data();
+    Dtype* sampled_weight = sampled_weight_.mutable_cpu_data();
+    Dtype* sampled_bias = sampled_bias_.mutable_cpu_data();
+    for (int i = 0; i < num_candidates; ++i) {
+      caffe_copy(K_, weight + candidates[i] * K_, sampled_weight + i * K_);
+      sampled_bias[i] = offsets[i] + (bias ? bias[candidates[i]] : Dtype(0));
+    }
+    weight = sampled_weight_.cpu_data();
+    bias = sampled_bias_.cpu_data();
+    shape[0] = M_;
+    shape[1] = num_candidates;
+    logits_.Reshape(shape);
+  }
+  Dtype* logits = logits_.mutable_cpu_data();
+  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, num_candidates, K_,
+      (Dtype)1., bottom[0]->cpu_data(), weight, (Dtype)0., logits);
+  if (bias) {
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, num_candidates, 1,
+        (Dtype)1., bias_multiplier_.cpu_data(), bias, (Dtype)1., logits);
+  }
+  softmax_loss_layer_->Forward(softmax_loss_bottom_vec_, top);
+}
+
+template <typename Dtype>
+void SampledSoftmaxWithLossLayer<Dtype>::Backward_cpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  if (propagate_down[1]) {
+    LOG(FATAL) << this->type()
+               << " Layer cannot backpropagate to label inputs.";
+  }
+  vector<bool> softmax_propagate_down(2, false);
+  softmax_propagate_down[0] = true;
+  softmax_loss_layer_->Backward(top, softmax_propagate_down,
+      softmax_loss_bottom_vec_);
+  const int num_candidates = logits_.shape(1);
+  const Dtype* logits_diff = logits_.cpu_diff();
+  const int* candidates = sampling_ ? candidates_.cpu_data() : NULL;
+  if (this->param_propagate_down_[0]) {
+    const Dtype* bottom_data = bottom[0]->cpu_data();
+    Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
+    if (sampling_) {
+      // Only the rows of the candidates get a gradient
+      Dtype* sampled_weight_diff = sampled_weight_.mutable_cpu_diff();
+      caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, num_candidates, K_, M_,
+          (Dtype)1., logits_diff, bottom_data, (Dtype)0., sampled_weight_diff);
+      for (int i = 0; i < num_candidates; ++i) {
+        caffe_axpy(K_, Dtype(1), sampled_weight_diff + i * K_,
+            weight_diff + candidates[i] * K_);
+      }
+    } else {
+      caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, N_, K_, M_, (Dtype)1.,
+          logits_diff, bottom_data, (Dtype)1., weight_diff);
+    }
+  }
+  if (bias_term_ && this->param_propagate_down_[1]) {
+    Dtype* bias_diff = this->blobs_[1]->mutable_cpu_diff();
+    if (sampling_) {
+      Dtype* sampled_bias_diff = sampled_bias_.mutable_cpu_diff();
+      caffe_cpu_gemv<Dtype>(CblasTrans, M_, num_candidates, (Dtype)1.,
+          logits_diff, bias_multiplier_.cpu_data(), (Dtype)0.,
+          sampled_bias_diff);
+      for (int i = 0; i < num_candidates; ++i) {
+        bias_diff[candidates[i]] += sampled_bias_diff[i];
+      }
+    } else {
+      caffe_cpu_gemv<Dtype>(CblasTrans, M_, N_, (Dtype)1., logits_diff,
+          bias_multiplier_.cpu_data(), (Dtype)1., bias_diff);
+    }
+  }
+  if (propagate_down[0]) {
+    const Dtype* weight = sampling_ ? sampled_weight_.cpu_data()
+        : this->blobs_[0]->cpu_data();
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, K_, num_candidates,
+        (Dtype)1., logits_diff, weight, (Dtype)0.,
+        bottom[0]->mutable_cpu_diff());
+  }
+}
+
+#ifdef CPU_ONLY
+STUB_GPU(SampledSoftmaxWithLossLayer);
+#endif
+
+INSTANTIATE_CLASS(SampledSoftmaxWithLossLayer);
+REGISTER_LAYER_CLASS(SampledSoftmaxWithLoss);
+
+}  // namespace caffe
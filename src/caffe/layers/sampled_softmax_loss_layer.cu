@@ -0,0 +1,139 @@
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// Copies the rows of the candidates, of dim values each, from src to dst.
+template <typename Dtype>
+__global__ void SampledSoftmaxGather(const int n, const int dim,
+    const int* candidates, const Dtype* src, Dtype* dst) {
+  CUDA_KERNEL_LOOP(index, n) {
+    dst[index] = src[candidates[index / dim] * dim + index % dim];
+  }
+}
+
+// Adds the rows of src to those of the candidates in dst. Candidates are
+// distinct, so no two threads add to the same value.
+template <typename Dtype>
+__global__ void SampledSoftmaxScatter(const int n, const int dim,
+    const int* candidates, const Dtype* src, Dtype* dst) {
+  CUDA_KERNEL_LOOP(index, n) {
+    dst[candidates[index / dim] * dim + index % dim] += src[index];
+  }
+}
+
+template <typename Dtype>
+void SampledSoftmaxWithLossLayer<Dtype>::Forward_gpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  Sample(bottom[1]->cpu_data());
+  const Dtype* weight = this->blobs_[0]->gpu_data();
+  const Dtype* bias = bias_term_ ? this->blobs_[1]->gpu_data() : NULL;
+  int num_candidates = N_;
+  if (sampling_) {
+    num_candidates = candidates_.count();
+    vector<int> shape(2);
+    shape[0] = num_candidates;
+    shape[1] = K_;
+    sampled_weight_.Reshape(shape);
+    sampled_bias_.ReshapeLike(offsets_);
+    const int* candidates = candidates_.gpu_data();
+    const int count = num_candidates * K_;
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    SampledSoftmaxGather<Dtype><<<CAFFE_GET_BLOCKS(count),
+        CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count, K_,
+        candidates, weight, sampled_weight_.mutable_gpu_data());
+    CUDA_POST_KERNEL_CHECK;
+    Dtype* sampled_bias = sampled_bias_.mutable_gpu_data();
+    if (bias) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      SampledSoftmaxGather<Dtype><<<CAFFE_GET_BLOCKS(num_candidates),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(num_candidates,
+          1, candidates, bias, sampled_bias);
+      CUDA_POST_KERNEL_CHECK;
+      caffe_gpu_add(num_candidates, offsets_.gpu_data(), sampled_bias,
+          sampled_bias);
+    } else {
+      caffe_copy(num_candidates, offsets_.gpu_data(), sampled_bias);
+    }
+    weight = sampled_weight_.gpu_data();
+    bias = sampled_bias_.gpu_data();
+    shape[0] = M_;
+    shape[1] = num_candidates;
+    logits_.Reshape(shape);
+  }
+  Dtype* logits = logits_.mutable_gpu_data();
+  caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, num_candidates, K_,
+      (Dtype)1., bottom[0]->gpu_data(), weight, (Dtype)0., logits);
+  if (bias) {
+    caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, num_candidates, 1,
+        (Dtype)1., bias_multiplier_.gpu_data(), bias, (Dtype)1., logits);
+  }
+  softmax_loss_layer_->Forward(softmax_loss_bottom_vec_, top);
+}
+
+template <typename Dtype>
+void SampledSoftmaxWithLossLayer<Dtype>::Backward_gpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  if (propagate_down[1]) {
+    LOG(FATAL) << this->type()
+               << " Layer cannot backpropagate to label inputs.";
+  }
+  vector<bool> softmax_propagate_down(2, false);
+  softmax_propagate_down[0] = true;
+  softmax_loss_layer_->Backward(top, softmax_propagate_down,
+      softmax_loss_bottom_vec_);
+  const int num_candidates = logits_.shape(1);
+  const Dtype* logits_diff = logits_.gpu_diff();
+  const int* candidates = sampling_ ? candidates_.gpu_data() : NULL;
+  if (this->param_propagate_down_[0]) {
+    const Dtype* bottom_data = bottom[0]->gpu_data();
+    Dtype* weight_diff = this->blobs_[0]->mutable_gpu_diff();
+    if (sampling_) {
+      // Only the rows of the candidates get a gradient
+      Dtype* sampled_weight_diff = sampled_weight_.mutable_gpu_diff();
+      caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, num_candidates, K_, M_,
+          (Dtype)1., logits_diff, bottom_data, (Dtype)0., sampled_weight_diff);
+      const int count = num_candidates * K_;
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      SampledSoftmaxScatter<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count, K_,
+          candidates, sampled_weight_diff, weight_diff);
+      CUDA_POST_KERNEL_CHECK;
+    } else {
+      caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, N_, K_, M_, (Dtype)1.,
+          logits_diff, bottom_data, (Dtype)1., weight_diff);
+    }
+  }
+  if (bias_term_ && this->param_propagate_down_[1]) {
+    Dtype* bias_diff = this->blobs_[1]->mutable_gpu_diff();
+    if (sampling_) {
+      Dtype* sampled_bias_diff = sampled_bias_.mutable_gpu_diff();
+      caffe_gpu_gemv<Dtype>(CblasTrans, M_, num_candidates, (Dtype)1.,
+          logits_diff, bias_multiplier_.gpu_data(), (Dtype)0.,
+          sampled_bias_diff);
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      SampledSoftmaxScatter<Dtype><<<CAFFE_GET_BLOCKS(num_candidates),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(num_candidates,
+          1, candidates, sampled_bias_diff, bias_diff);
+      CUDA_POST_KERNEL_CHECK;
+    } else {
+      caffe_gpu_gemv<Dtype>(CblasTrans, M_, N_, (Dtype)1., logits_diff,
+          bias_multiplier_.gpu_data(), (Dtype)1., bias_diff);
+    }
+  }
+  if (propagate_down[0]) {
+    const Dtype* weight = sampling_ ? sampled_weight_.gpu_data()
+        : this->blobs_[0]->gpu_data();
+    caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, K_, num_candidates,
+        (Dtype)1., logits_diff, weight, (Dtype)0.,
+        bottom[0]->mutable_gpu_diff());
+  }
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(SampledSoftmaxWithLossLayer);
+
+}  // namespace caffe
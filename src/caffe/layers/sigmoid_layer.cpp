@@ -3,6 +3,7 @@
 #include <vector>
 
 #include "caffe/layer.hpp"
+#include "caffe/util/approx_math.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
@@ -18,8 +19,14 @@ void SigmoidLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = top[0]->mutable_cpu_data();
   const int count = bottom[0]->count();
-  for (int i = 0; i < count; ++i) {
-    top_data[i] = sigmoid(bottom_data[i]);
+  if (this->layer_param_.approximate_math()) {
+    for (int i = 0; i < count; ++i) {
+      top_data[i] = approx_sigmoid(bottom_data[i]);
+    }
+  } else {
+    for (int i = 0; i < count; ++i) {
+      top_data[i] = sigmoid(bottom_data[i]);
+    }
   }
 }
 
@@ -1,8 +1,11 @@
+#include <boost/bind.hpp>
+
 #include <algorithm>
 #include <vector>
 
 #include "caffe/layer.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
@@ -25,17 +28,16 @@ void SoftmaxLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
 }
 
 template <typename Dtype>
-void SoftmaxLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-    const vector<Blob<Dtype>*>& top) {
-  const Dtype* bottom_data = bottom[0]->cpu_data();
-  Dtype* top_data = top[0]->mutable_cpu_data();
-  Dtype* scale_data = scale_.mutable_cpu_data();
-  int channels = bottom[0]->shape(softmax_axis_);
-  int dim = bottom[0]->count() / outer_num_;
-  caffe_copy(bottom[0]->count(), bottom_data, top_data);
+void SoftmaxLayer<Dtype>::softmax_forward_cpu(const Dtype* bottom_data,
+    Dtype* top_data, Dtype* scale_data, int begin, int end) {
+  int channels = sum_multiplier_.count();
+  int dim = channels * inner_num_;
+  top_data += begin * dim;
+  scale_data += begin * inner_num_;
+  caffe_copy((end - begin) * dim, bottom_data + begin * dim, top_data);
   // We need to subtract the max to avoid numerical issues, compute the exp,
   // and then normalize.
-  for (int i = 0; i < outer_num_; ++i) {
+  for (int i = begin; i < end; ++i, scale_data += inner_num_) {
     // initialize scale_data to the first plane
     caffe_copy(inner_num_, bottom_data + i * dim, scale_data);
     for (int j = 0; j < channels; j++) {
@@ -48,7 +50,11 @@ void SoftmaxLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, channels, inner_num_,
         1, -1., sum_multiplier_.cpu_data(), scale_data, 1., top_data);
     // exponentiation
-    caffe_exp<Dtype>(dim, top_data, top_data);
+    if (this->layer_param_.approximate_math()) {
+      caffe_approx_exp<Dtype>(dim, top_data, top_data);
+    } else {
+      caffe_exp<Dtype>(dim, top_data, top_data);
+    }
     // sum after exp
     caffe_cpu_gemv<Dtype>(CblasTrans, channels, inner_num_, 1.,
         top_data, sum_multiplier_.cpu_data(), 0., scale_data);
@@ -60,6 +66,18 @@ void SoftmaxLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   }
 }
 
+template <typename Dtype>
+void SoftmaxLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = top[0]->mutable_cpu_data();
+  Dtype* scale_data = scale_.mutable_cpu_data();
+  sum_multiplier_.cpu_data();  // synced before the threads use it
+  Caffe::thread_pool().run(outer_num_, 1,
+      boost::bind(&SoftmaxLayer<Dtype>::softmax_forward_cpu, this,
+                  bottom_data, top_data, scale_data, _1, _2));
+}
+
 template <typename Dtype>
 void SoftmaxLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down,
@@ -8,85 +8,177 @@
 
 namespace caffe {
 
+// Threads of the kernel taking a block per position, for many classes
+static const int kSoftmaxLossThreads = 256;
+
+// Merges the running max and sum of exponentials of two parts of a position
+// into the first, in the manner of an online softmax.
+template <typename Dtype>
+__device__ void SoftmaxLossMerge(Dtype* row_max, Dtype* row_sum,
+    const Dtype other_max, const Dtype other_sum) {
+  if (other_max > *row_max) {
+    *row_sum = *row_sum * exp(*row_max - other_max) + other_sum;
+    *row_max = other_max;
+  } else {
+    *row_sum += other_sum * exp(other_max - *row_max);
+  }
+}
+
+// Writes the probabilities of the classes first, first + step, ... of a
+// position, the scaled gradient if diff is not NULL, and its loss for the
+// first class. data, prob and diff point at the position's first class.
+template <typename Dtype>
+__device__ void SoftmaxLossWrite(const int first, const int step,
+    const int channels, const int spatial_dim, const Dtype row_max,
+    const Dtype row_sum, const Dtype* data, const int label_value,
+    const bool ignored, const Dtype scale, Dtype* prob, Dtype* diff,
+    Dtype* loss) {
+  for (int c = first; c < channels; c += step) {
+    const Dtype p = exp(data[c * spatial_dim] - row_max) / row_sum;
+    prob[c * spatial_dim] = p;
+    if (diff) {
+      diff[c * spatial_dim] =
+          ignored ? Dtype(0) : scale * (p - (c == label_value));
+    }
+  }
+  if (first == 0) {
+    *loss = ignored ? Dtype(0) : -log(max(exp(data[label_value * spatial_dim]
+        - row_max) / row_sum, Dtype(FLT_MIN)));
+  }
+}
+
+// One thread per position, for few classes.
 template <typename Dtype>
-__global__ void SoftmaxLossForwardGPU(const int nthreads,
-          const Dtype* prob_data, const Dtype* label, Dtype* loss,
-          const int num, const int dim, const int spatial_dim,
-          const bool has_ignore_label_, const int ignore_label_,
-          Dtype* counts) {
+__global__ void SoftmaxLossThreadGPU(const int nthreads, const int channels,
+    const int spatial_dim, const Dtype* bottom_data, const Dtype* label,
+    const bool has_ignore_label_, const int ignore_label_, const Dtype scale,
+    Dtype* prob_data, Dtype* loss, Dtype* bottom_diff) {
   CUDA_KERNEL_LOOP(index, nthreads) {
-    const int n = index / spatial_dim;
-    const int s = index % spatial_dim;
-    const int label_value = static_cast<int>(label[n * spatial_dim + s]);
-    if (has_ignore_label_ && label_value == ignore_label_) {
-      loss[index] = 0;
-      counts[index] = 0;
-    } else {
-      loss[index] = -log(max(prob_data[n * dim + label_value * spatial_dim + s],
-                      Dtype(FLT_MIN)));
-      counts[index] = 1;
+    const int offset = (index / spatial_dim) * channels * spatial_dim
+        + index % spatial_dim;
+    const Dtype* data = bottom_data + offset;
+    Dtype row_max = -FLT_MAX;
+    Dtype row_sum = 0;
+    for (int c = 0; c < channels; ++c) {
+      SoftmaxLossMerge(&row_max, &row_sum, data[c * spatial_dim], Dtype(1));
+    }
+    const int label_value = static_cast<int>(label[index]);
+    SoftmaxLossWrite(0, 1, channels, spatial_dim, row_max, row_sum, data,
+        label_value, has_ignore_label_ && label_value == ignore_label_, scale,
+        prob_data + offset, bottom_diff ? bottom_diff + offset : NULL,
+        loss + index);
+  }
+}
+
+// One block of kSoftmaxLossThreads per position, for many classes.
+template <typename Dtype>
+__global__ void SoftmaxLossBlockGPU(const int nthreads, const int channels,
+    const int spatial_dim, const Dtype* bottom_data, const Dtype* label,
+    const bool has_ignore_label_, const int ignore_label_, const Dtype scale,
+    Dtype* prob_data, Dtype* loss, Dtype* bottom_diff) {
+  __shared__ Dtype shared_max[kSoftmaxLossThreads];
+  __shared__ Dtype shared_sum[kSoftmaxLossThreads];
+  const int t = threadIdx.x;
+  for (int index = blockIdx.x; index < nthreads; index += gridDim.x) {
+    const int offset = (index / spatial_dim) * channels * spatial_dim
+        + index % spatial_dim;
+    const Dtype* data = bottom_data + offset;
+    Dtype row_max = -FLT_MAX;
+    Dtype row_sum = 0;
+    for (int c = t; c < channels; c += blockDim.x) {
+      SoftmaxLossMerge(&row_max, &row_sum, data[c * spatial_dim], Dtype(1));
     }
+    shared_max[t] = row_max;
+    shared_sum[t] = row_sum;
+    __syncthreads();
+    for (int stride = blockDim.x / 2; stride > 0; stride /= 2) {
+      if (t < stride) {
+        SoftmaxLossMerge(&shared_max[t], &shared_sum[t],
+            shared_max[t + stride], shared_sum[t + stride]);
+      }
+      __syncthreads();
+    }
+    row_max = shared_max[0];
+    row_sum = shared_sum[0];
+    // Everyone has read the totals before the next position overwrites them.
+    __syncthreads();
+    const int label_value = static_cast<int>(label[index]);
+    SoftmaxLossWrite(t, blockDim.x, channels, spatial_dim, row_max, row_sum,
+        data, label_value, has_ignore_label_ && label_value == ignore_label_,
+        scale, prob_data + offset, bottom_diff ? bottom_diff + offset : NULL,
+        loss + index);
+  }
+}
+
+template <typename Dtype>
+__global__ void SoftmaxLossCountGPU(const int nthreads, const Dtype* label,
+    const int ignore_label_, Dtype* counts) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    counts[index] = static_cast<int>(label[index]) == ignore_label_ ? 0 : 1;
   }
 }
 
+// Computes the probabilities, the loss of each position into loss and, if
+// bottom_diff is not NULL, the gradient times scale, reading the predictions
+// once to reduce and once to write.
+template <typename Dtype>
+static void SoftmaxLossFused(const int outer_num, const int channels,
+    const int inner_num, const Dtype* bottom_data, const Dtype* label,
+    const bool has_ignore_label, const int ignore_label, const Dtype scale,
+    Dtype* prob_data, Dtype* loss, Dtype* bottom_diff) {
+  const int nthreads = outer_num * inner_num;
+  if (channels >= kSoftmaxLossThreads) {
+    // Grids are at most 65535 blocks wide on older devices.
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    SoftmaxLossBlockGPU<Dtype><<<std::min(nthreads, 65535),
+        kSoftmaxLossThreads, 0, Caffe::cuda_stream()>>>(nthreads, channels,
+        inner_num, bottom_data, label, has_ignore_label, ignore_label, scale,
+        prob_data, loss, bottom_diff);
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    SoftmaxLossThreadGPU<Dtype><<<CAFFE_GET_BLOCKS(nthreads),
+        CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(nthreads, channels,
+        inner_num, bottom_data, label, has_ignore_label, ignore_label, scale,
+        prob_data, loss, bottom_diff);
+  }
+  CUDA_POST_KERNEL_CHECK;
+}
+
 template <typename Dtype>
 void SoftmaxWithLossLayer<Dtype>::Forward_gpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  softmax_layer_->Forward(softmax_bottom_vec_, softmax_top_vec_);
-  const Dtype* prob_data = prob_.gpu_data();
   const Dtype* label = bottom[1]->gpu_data();
-  const int dim = prob_.count() / outer_num_;
+  const int channels = bottom[0]->shape(softmax_axis_);
   const int nthreads = outer_num_ * inner_num_;
-  // Since this memory is not used for anything until it is overwritten
-  // on the backward pass, we use it here to avoid having to allocate new GPU
-  // memory to accumulate intermediate results in the kernel.
-  Dtype* loss_data = bottom[0]->mutable_gpu_diff();
-  // Similarly, this memory is never used elsewhere, and thus we can use it
-  // to avoid having to allocate additional GPU memory.
-  Dtype* counts = prob_.mutable_gpu_diff();
-  // NOLINT_NEXT_LINE(whitespace/operators)
-  SoftmaxLossForwardGPU<Dtype><<<CAFFE_GET_BLOCKS(nthreads),
-      CAFFE_CUDA_NUM_THREADS>>>(nthreads, prob_data, label, loss_data,
-      outer_num_, dim, inner_num_, has_ignore_label_, ignore_label_, counts);
-  Dtype loss;
-  caffe_gpu_asum(nthreads, loss_data, &loss);
-  if (normalize_) {
-    Dtype count;
-    caffe_gpu_asum(nthreads, counts, &count);
-    loss /= count;
+  // The diff of prob_ is never used elsewhere, and thus we can use it to
+  // avoid having to allocate additional GPU memory, first for the counts and
+  // then for the loss of each position.
+  Dtype* scratch = prob_.mutable_gpu_diff();
+  if (normalize_ && has_ignore_label_) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    SoftmaxLossCountGPU<Dtype><<<CAFFE_GET_BLOCKS(nthreads),
+        CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(nthreads, label,
+        ignore_label_, scratch);
+    caffe_gpu_asum(nthreads, scratch, &normalizer_);
   } else {
-    loss /= outer_num_;
+    normalizer_ = normalize_ ? nthreads : outer_num_;
   }
-  top[0]->mutable_cpu_data()[0] = loss;
+  // When training the gradient follows from the same pass; Backward_gpu
+  // computes it if it is needed otherwise.
+  fused_diff_ = this->phase_ == TRAIN;
+  fused_scale_ = top[0]->cpu_diff()[0] / normalizer_;
+  SoftmaxLossFused(outer_num_, channels, inner_num_, bottom[0]->gpu_data(),
+      label, has_ignore_label_, ignore_label_, fused_scale_,
+      prob_.mutable_gpu_data(), scratch,
+      fused_diff_ ? bottom[0]->mutable_gpu_diff() : NULL);
+  Dtype loss;
+  caffe_gpu_asum(nthreads, scratch, &loss);
+  top[0]->mutable_cpu_data()[0] = loss / normalizer_;
   if (top.size() == 2) {
     top[1]->ShareData(prob_);
   }
 }
 
-template <typename Dtype>
-__global__ void SoftmaxLossBackwardGPU(const int nthreads, const Dtype* top,
-          const Dtype* label, Dtype* bottom_diff, const int num, const int dim,
-          const int spatial_dim, const bool has_ignore_label_,
-          const int ignore_label_, Dtype* counts) {
-  const int channels = dim / spatial_dim;
-
-  CUDA_KERNEL_LOOP(index, nthreads) {
-    const int n = index / spatial_dim;
-    const int s = index % spatial_dim;
-    const int label_value = static_cast<int>(label[n * spatial_dim + s]);
-
-    if (has_ignore_label_ && label_value == ignore_label_) {
-      for (int c = 0; c < channels; ++c) {
-        bottom_diff[n * dim + c * spatial_dim + s] = 0;
-      }
-      counts[index] = 0;
-    } else {
-      bottom_diff[n * dim + label_value * spatial_dim + s] -= 1;
-      counts[index] = 1;
-    }
-  }
-}
-
 template <typename Dtype>
 void SoftmaxWithLossLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
@@ -95,27 +187,16 @@ void SoftmaxWithLossLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
                << " Layer cannot backpropagate to label inputs.";
   }
   if (propagate_down[0]) {
+    const Dtype scale = top[0]->cpu_diff()[0] / normalizer_;
     Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
-    const Dtype* prob_data = prob_.gpu_data();
-    const Dtype* top_data = top[0]->gpu_data();
-    caffe_gpu_memcpy(prob_.count() * sizeof(Dtype), prob_data, bottom_diff);
-    const Dtype* label = bottom[1]->gpu_data();
-    const int dim = prob_.count() / outer_num_;
-    const int nthreads = outer_num_ * inner_num_;
-    // Since this memory is never used for anything else,
-    // we use to to avoid allocating new GPU memory.
-    Dtype* counts = prob_.mutable_gpu_diff();
-    // NOLINT_NEXT_LINE(whitespace/operators)
-    SoftmaxLossBackwardGPU<Dtype><<<CAFFE_GET_BLOCKS(nthreads),
-        CAFFE_CUDA_NUM_THREADS>>>(nthreads, top_data, label, bottom_diff,
-        outer_num_, dim, inner_num_, has_ignore_label_, ignore_label_, counts);
-    const Dtype loss_weight = top[0]->cpu_diff()[0];
-    if (normalize_) {
-      Dtype count;
-      caffe_gpu_asum(nthreads, counts, &count);
-      caffe_gpu_scal(prob_.count(), loss_weight / count, bottom_diff);
-    } else {
-      caffe_gpu_scal(prob_.count(), loss_weight / outer_num_, bottom_diff);
+    if (!fused_diff_ || fused_scale_ == 0) {
+      SoftmaxLossFused(outer_num_, bottom[0]->shape(softmax_axis_),
+          inner_num_, bottom[0]->gpu_data(), bottom[1]->gpu_data(),
+          has_ignore_label_, ignore_label_, scale, prob_.mutable_gpu_data(),
+          prob_.mutable_gpu_diff(), bottom_diff);
+    } else if (scale != fused_scale_) {
+      // The loss weight changed since Forward_gpu.
+      caffe_gpu_scal(prob_.count(), scale / fused_scale_, bottom_diff);
     }
   }
 }
@@ -13,52 +13,17 @@ namespace caffe {
 using std::min;
 using std::max;
 
-template <typename Dtype>
-LayerParameter SPPLayer<Dtype>::GetPoolingParam(const int pyramid_level,
-      const int bottom_h, const int bottom_w, const SPPParameter spp_param) {
-  LayerParameter pooling_param;
-  int num_bins = pow(2, pyramid_level);
-
-  // find padding and kernel size so that the pooling is
-  // performed across the entire image
-  int kernel_h = ceil(bottom_h / static_cast<double>(num_bins));
-  // remainder_h is the min number of pixels that need to be padded before
-  // entire image height is pooled over with the chosen kernel dimension
-  int remainder_h = kernel_h * num_bins - bottom_h;
-  // pooling layer pads (2 * pad_h) pixels on the top and bottom of the
-  // image.
-  int pad_h = (remainder_h + 1) / 2;
-
-  // similar logic for width
-  int kernel_w = ceil(bottom_w / static_cast<double>(num_bins));
-  int remainder_w = kernel_w * num_bins - bottom_w;
-  int pad_w = (remainder_w + 1) / 2;
-
-  pooling_param.mutable_pooling_param()->set_pad_h(pad_h);
-  pooling_param.mutable_pooling_param()->set_pad_w(pad_w);
-  pooling_param.mutable_pooling_param()->set_kernel_h(kernel_h);
-  pooling_param.mutable_pooling_param()->set_kernel_w(kernel_w);
-  pooling_param.mutable_pooling_param()->set_stride_h(kernel_h);
-  pooling_param.mutable_pooling_param()->set_stride_w(kernel_w);
-
-  switch (spp_param.pool()) {
-  case SPPParameter_PoolMethod_MAX:
-    pooling_param.mutable_pooling_param()->set_pool(
-        PoolingParameter_PoolMethod_MAX);
-    break;
-  case SPPParameter_PoolMethod_AVE:
-    pooling_param.mutable_pooling_param()->set_pool(
-        PoolingParameter_PoolMethod_AVE);
-    break;
-  case SPPParameter_PoolMethod_STOCHASTIC:
-    pooling_param.mutable_pooling_param()->set_pool(
-        PoolingParameter_PoolMethod_STOCHASTIC);
-    break;
-  default:
-    LOG(FATAL) << "Unknown pooling method.";
-  }
-
-  return pooling_param;
+// Finds the kernel size, which is also the stride, and the padding of the
+// num_bins windows pooling the entire image along a dimension of the given
+// size.
+static void SPPWindow(const int size, const int num_bins, int* kernel,
+    int* pad) {
+  *kernel = (size + num_bins - 1) / num_bins;
+  // the remainder is the min number of pixels that need to be padded before
+  // the entire image is pooled over with the chosen kernel dimension; half
+  // of it goes before the image.
+  const int remainder = *kernel * num_bins - size;
+  *pad = (remainder + 1) / 2;
 }
 
 template <typename Dtype>
@@ -72,62 +37,15 @@ void SPPLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_GT(bottom_w_, 0) << "Input dimensions cannot be zero.";
 
   pyramid_height_ = spp_param.pyramid_height();
-  split_top_vec_.clear();
-  pooling_bottom_vecs_.clear();
-  pooling_layers_.clear();
-  pooling_top_vecs_.clear();
-  pooling_outputs_.clear();
-  flatten_layers_.clear();
-  flatten_top_vecs_.clear();
-  flatten_outputs_.clear();
-  concat_bottom_vec_.clear();
-
-  // split layer output holders setup
-  for (int i = 0; i < pyramid_height_; i++) {
-    split_top_vec_.push_back(new Blob<Dtype>());
-  }
-
-  // split layer setup
-  LayerParameter split_param;
-  split_layer_.reset(new SplitLayer<Dtype>(split_param));
-  split_layer_->SetUp(bottom, split_top_vec_);
-
-  for (int i = 0; i < pyramid_height_; i++) {
-    // pooling layer input holders setup
-    pooling_bottom_vecs_.push_back(new vector<Blob<Dtype>*>);
-    pooling_bottom_vecs_[i]->push_back(split_top_vec_[i]);
-
-    // pooling layer output holders setup
-    pooling_outputs_.push_back(new Blob<Dtype>());
-    pooling_top_vecs_.push_back(new vector<Blob<Dtype>*>);
-    pooling_top_vecs_[i]->push_back(pooling_outputs_[i]);
-
-    // pooling layer setup
-    LayerParameter pooling_param = GetPoolingParam(
-        i, bottom_h_, bottom_w_, spp_param);
-
-    pooling_layers_.push_back(shared_ptr<PoolingLayer<Dtype> > (
-        new PoolingLayer<Dtype>(pooling_param)));
-    pooling_layers_[i]->SetUp(*pooling_bottom_vecs_[i], *pooling_top_vecs_[i]);
-
-    // flatten layer output holders setup
-    flatten_outputs_.push_back(new Blob<Dtype>());
-    flatten_top_vecs_.push_back(new vector<Blob<Dtype>*>);
-    flatten_top_vecs_[i]->push_back(flatten_outputs_[i]);
-
-    // flatten layer setup
-    LayerParameter flatten_param;
-    flatten_layers_.push_back(new FlattenLayer<Dtype>(flatten_param));
-    flatten_layers_[i]->SetUp(*pooling_top_vecs_[i], *flatten_top_vecs_[i]);
-
-    // concat layer input holders setup
-    concat_bottom_vec_.push_back(flatten_outputs_[i]);
+  CHECK_GT(pyramid_height_, 0) << "Pyramid height cannot be zero.";
+  switch (spp_param.pool()) {
+  case SPPParameter_PoolMethod_MAX:
+  case SPPParameter_PoolMethod_AVE:
+  case SPPParameter_PoolMethod_STOCHASTIC:
+    break;
+  default:
+    LOG(FATAL) << "Unknown pooling method.";
   }
-
-  // concat layer setup
-  LayerParameter concat_param;
-  concat_layer_.reset(new ConcatLayer<Dtype>(concat_param));
-  concat_layer_->SetUp(concat_bottom_vec_, top);
 }
 
 template <typename Dtype>
@@ -138,35 +56,95 @@ void SPPLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   channels_ = bottom[0]->channels();
   bottom_h_ = bottom[0]->height();
   bottom_w_ = bottom[0]->width();
-  SPPParameter spp_param = this->layer_param_.spp_param();
-  split_layer_->Reshape(bottom, split_top_vec_);
-  for (int i = 0; i < pyramid_height_; i++) {
-    LayerParameter pooling_param = GetPoolingParam(
-        i, bottom_h_, bottom_w_, spp_param);
-
-    pooling_layers_[i].reset(
-        new PoolingLayer<Dtype>(pooling_param));
-    pooling_layers_[i]->SetUp(
-        *pooling_bottom_vecs_[i], *pooling_top_vecs_[i]);
-    pooling_layers_[i]->Reshape(
-        *pooling_bottom_vecs_[i], *pooling_top_vecs_[i]);
-    flatten_layers_[i]->Reshape(
-        *pooling_top_vecs_[i], *flatten_top_vecs_[i]);
+  // The windows of every level must start inside the padded image, as for
+  // the PoolingLayer.
+  for (int l = 0; l < pyramid_height_; ++l) {
+    int kernel_h, kernel_w, pad_h, pad_w;
+    SPPWindow(bottom_h_, 1 << l, &kernel_h, &pad_h);
+    SPPWindow(bottom_w_, 1 << l, &kernel_w, &pad_w);
+    CHECK_LT(pad_h, kernel_h) << "Input too small for the pyramid height.";
+    CHECK_LT(pad_w, kernel_w) << "Input too small for the pyramid height.";
+  }
+  // Each level l pools channels * 4^l bins, flattened one after the other.
+  vector<int> top_shape(2);
+  top_shape[0] = bottom[0]->num();
+  top_shape[1] = channels_ * ((1 << (2 * pyramid_height_)) - 1) / 3;
+  top[0]->Reshape(top_shape);
+  switch (this->layer_param_.spp_param().pool()) {
+  case SPPParameter_PoolMethod_MAX:
+    max_idx_.Reshape(top_shape);
+    break;
+  case SPPParameter_PoolMethod_STOCHASTIC:
+    rand_idx_.Reshape(top_shape);
+    break;
+  default:
+    break;
   }
-  concat_layer_->Reshape(concat_bottom_vec_, top);
 }
 
 template <typename Dtype>
 void SPPLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
-  split_layer_->Forward(bottom, split_top_vec_);
-  for (int i = 0; i < pyramid_height_; i++) {
-    pooling_layers_[i]->Forward(
-        *pooling_bottom_vecs_[i], *pooling_top_vecs_[i]);
-    flatten_layers_[i]->Forward(
-        *pooling_top_vecs_[i], *flatten_top_vecs_[i]);
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = top[0]->mutable_cpu_data();
+  const SPPParameter_PoolMethod pool = this->layer_param_.spp_param().pool();
+  if (pool == SPPParameter_PoolMethod_STOCHASTIC) {
+    NOT_IMPLEMENTED;
+  }
+  int* mask = pool == SPPParameter_PoolMethod_MAX ?
+      max_idx_.mutable_cpu_data() : NULL;
+  const int num = bottom[0]->num();
+  const int top_dim = top[0]->count(1);
+  for (int n = 0; n < num; ++n) {
+    int level_begin = n * top_dim;
+    for (int l = 0; l < pyramid_height_; ++l) {
+      const int num_bins = 1 << l;
+      int kernel_h, kernel_w, pad_h, pad_w;
+      SPPWindow(bottom_h_, num_bins, &kernel_h, &pad_h);
+      SPPWindow(bottom_w_, num_bins, &kernel_w, &pad_w);
+      for (int c = 0; c < channels_; ++c) {
+        const Dtype* bottom_slice =
+            bottom_data + (n * channels_ + c) * bottom_h_ * bottom_w_;
+        for (int ph = 0; ph < num_bins; ++ph) {
+          for (int pw = 0; pw < num_bins; ++pw) {
+            const int index = level_begin + (c * num_bins + ph) * num_bins + pw;
+            int hstart = ph * kernel_h - pad_h;
+            int wstart = pw * kernel_w - pad_w;
+            int hend = min(hstart + kernel_h, bottom_h_ + pad_h);
+            int wend = min(wstart + kernel_w, bottom_w_ + pad_w);
+            const int pool_size = (hend - hstart) * (wend - wstart);
+            hstart = max(hstart, 0);
+            wstart = max(wstart, 0);
+            hend = min(hend, bottom_h_);
+            wend = min(wend, bottom_w_);
+            if (mask) {
+              Dtype maxval = -FLT_MAX;
+              int maxidx = -1;
+              for (int h = hstart; h < hend; ++h) {
+                for (int w = wstart; w < wend; ++w) {
+                  if (bottom_slice[h * bottom_w_ + w] > maxval) {
+                    maxidx = h * bottom_w_ + w;
+                    maxval = bottom_slice[maxidx];
+                  }
+                }
+              }
+              top_data[index] = maxval;
+              mask[index] = maxidx;
+            } else {
+              Dtype aveval = 0;
+              for (int h = hstart; h < hend; ++h) {
+                for (int w = wstart; w < wend; ++w) {
+                  aveval += bottom_slice[h * bottom_w_ + w];
+                }
+              }
+              top_data[index] = aveval / pool_size;
+            }
+          }
+        }
+      }
+      level_begin += channels_ * num_bins * num_bins;
+    }
   }
-  concat_layer_->Forward(concat_bottom_vec_, top);
 }
 
 template <typename Dtype>
@@ -175,17 +153,61 @@ void SPPLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
   if (!propagate_down[0]) {
     return;
   }
-  vector<bool> concat_propagate_down(pyramid_height_, true);
-  concat_layer_->Backward(top, concat_propagate_down, concat_bottom_vec_);
-  for (int i = 0; i < pyramid_height_; i++) {
-    flatten_layers_[i]->Backward(
-        *flatten_top_vecs_[i], propagate_down, *pooling_top_vecs_[i]);
-    pooling_layers_[i]->Backward(
-        *pooling_top_vecs_[i], propagate_down, *pooling_bottom_vecs_[i]);
+  const Dtype* top_diff = top[0]->cpu_diff();
+  Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
+  caffe_set(bottom[0]->count(), Dtype(0), bottom_diff);
+  const SPPParameter_PoolMethod pool = this->layer_param_.spp_param().pool();
+  if (pool == SPPParameter_PoolMethod_STOCHASTIC) {
+    NOT_IMPLEMENTED;
+  }
+  const int* mask = pool == SPPParameter_PoolMethod_MAX ?
+      max_idx_.cpu_data() : NULL;
+  const int num = bottom[0]->num();
+  const int top_dim = top[0]->count(1);
+  for (int n = 0; n < num; ++n) {
+    int level_begin = n * top_dim;
+    for (int l = 0; l < pyramid_height_; ++l) {
+      const int num_bins = 1 << l;
+      int kernel_h, kernel_w, pad_h, pad_w;
+      SPPWindow(bottom_h_, num_bins, &kernel_h, &pad_h);
+      SPPWindow(bottom_w_, num_bins, &kernel_w, &pad_w);
+      for (int c = 0; c < channels_; ++c) {
+        Dtype* bottom_slice =
+            bottom_diff + (n * channels_ + c) * bottom_h_ * bottom_w_;
+        for (int ph = 0; ph < num_bins; ++ph) {
+          for (int pw = 0; pw < num_bins; ++pw) {
+            const int index = level_begin + (c * num_bins + ph) * num_bins + pw;
+            if (mask) {
+              if (mask[index] >= 0) {
+                bottom_slice[mask[index]] += top_diff[index];
+              }
+              continue;
+            }
+            int hstart = ph * kernel_h - pad_h;
+            int wstart = pw * kernel_w - pad_w;
+            int hend = min(hstart + kernel_h, bottom_h_ + pad_h);
+            int wend = min(wstart + kernel_w, bottom_w_ + pad_w);
+            const int pool_size = (hend - hstart) * (wend - wstart);
+            hstart = max(hstart, 0);
+            wstart = max(wstart, 0);
+            hend = min(hend, bottom_h_);
+            wend = min(wend, bottom_w_);
+            for (int h = hstart; h < hend; ++h) {
+              for (int w = wstart; w < wend; ++w) {
+                bottom_slice[h * bottom_w_ + w] += top_diff[index] / pool_size;
+              }
+            }
+          }
+        }
+      }
+      level_begin += channels_ * num_bins * num_bins;
+    }
   }
-  split_layer_->Backward(split_top_vec_, propagate_down, bottom);
 }
 
+#ifdef CPU_ONLY
+STUB_GPU(SPPLayer);
+#endif
 
 INSTANTIATE_CLASS(SPPLayer);
 REGISTER_LAYER_CLASS(SPP);
@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// Finds the kernel size, which is also the stride, and the padding of the
+// num_bins windows pooling the entire image along a dimension of the given
+// size, as SPPWindow in spp_layer.cpp.
+__device__ void SPPWindowGPU(const int size, const int num_bins, int* kernel,
+    int* pad) {
+  *kernel = (size + num_bins - 1) / num_bins;
+  *pad = (*kernel * num_bins - size + 1) / 2;
+}
+
+// Finds the channel, the bin and the number of bins of the pyramid level of
+// the index-th value of a top row, the levels being flattened one after the
+// other.
+__device__ void SPPLocate(const int index, const int channels, int* c,
+    int* ph, int* pw, int* num_bins) {
+  int level_begin = 0;
+  *num_bins = 1;
+  while (index >= level_begin + channels * *num_bins * *num_bins) {
+    level_begin += channels * *num_bins * *num_bins;
+    *num_bins *= 2;
+  }
+  const int offset = index - level_begin;
+  *pw = offset % *num_bins;
+  *ph = (offset / *num_bins) % *num_bins;
+  *c = offset / *num_bins / *num_bins;
+}
+
+// One thread per top value, for every level at once
+template <typename Dtype>
+__global__ void SPPMaxForward(const int nthreads,
+    const Dtype* const bottom_data, const int channels, const int height,
+    const int width, const int top_dim, Dtype* const top_data, int* mask) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int n = index / top_dim;
+    int c, ph, pw, num_bins, kernel_h, kernel_w, pad_h, pad_w;
+    SPPLocate(index % top_dim, channels, &c, &ph, &pw, &num_bins);
+    SPPWindowGPU(height, num_bins, &kernel_h, &pad_h);
+    SPPWindowGPU(width, num_bins, &kernel_w, &pad_w);
+    int hstart = ph * kernel_h - pad_h;
+    int wstart = pw * kernel_w - pad_w;
+    const int hend = min(hstart + kernel_h, height);
+    const int wend = min(wstart + kernel_w, width);
+    hstart = max(hstart, 0);
+    wstart = max(wstart, 0);
+    Dtype maxval = -FLT_MAX;
+    int maxidx = -1;
+    const Dtype* const bottom_slice =
+        bottom_data + (n * channels + c) * height * width;
+    for (int h = hstart; h < hend; ++h) {
+      for (int w = wstart; w < wend; ++w) {
+        if (bottom_slice[h * width + w] > maxval) {
+          maxidx = h * width + w;
+          maxval = bottom_slice[maxidx];
+        }
+      }
+    }
+    top_data[index] = maxval;
+    mask[index] = maxidx;
+  }
+}
+
+template <typename Dtype>
+__global__ void SPPAveForward(const int nthreads,
+    const Dtype* const bottom_data, const int channels, const int height,
+    const int width, const int top_dim, Dtype* const top_data) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int n = index / top_dim;
+    int c, ph, pw, num_bins, kernel_h, kernel_w, pad_h, pad_w;
+    SPPLocate(index % top_dim, channels, &c, &ph, &pw, &num_bins);
+    SPPWindowGPU(height, num_bins, &kernel_h, &pad_h);
+    SPPWindowGPU(width, num_bins, &kernel_w, &pad_w);
+    int hstart = ph * kernel_h - pad_h;
+    int wstart = pw * kernel_w - pad_w;
+    int hend = min(hstart + kernel_h, height + pad_h);
+    int wend = min(wstart + kernel_w, width + pad_w);
+    const int pool_size = (hend - hstart) * (wend - wstart);
+    hstart = max(hstart, 0);
+    wstart = max(wstart, 0);
+    hend = min(hend, height);
+    wend = min(wend, width);
+    Dtype aveval = 0;
+    const Dtype* const bottom_slice =
+        bottom_data + (n * channels + c) * height * width;
+    for (int h = hstart; h < hend; ++h) {
+      for (int w = wstart; w < wend; ++w) {
+        aveval += bottom_slice[h * width + w];
+      }
+    }
+    top_data[index] = aveval / pool_size;
+  }
+}
+
+// The stochastic windows are not padded, as in the PoolingLayer.
+template <typename Dtype>
+__global__ void SPPStoForwardTrain(const int nthreads,
+    const Dtype* const bottom_data, const int channels, const int height,
+    const int width, const int top_dim, Dtype* const rand_idx,
+    Dtype* const top_data) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int n = index / top_dim;
+    int c, ph, pw, num_bins, kernel_h, kernel_w, pad_h, pad_w;
+    SPPLocate(index % top_dim, channels, &c, &ph, &pw, &num_bins);
+    SPPWindowGPU(height, num_bins, &kernel_h, &pad_h);
+    SPPWindowGPU(width, num_bins, &kernel_w, &pad_w);
+    const int hstart = ph * kernel_h;
+    const int hend = min(hstart + kernel_h, height);
+    const int wstart = pw * kernel_w;
+    const int wend = min(wstart + kernel_w, width);
+    Dtype cumsum = 0.;
+    const Dtype* const bottom_slice =
+        bottom_data + (n * channels + c) * height * width;
+    // First pass: get sum
+    for (int h = hstart; h < hend; ++h) {
+      for (int w = wstart; w < wend; ++w) {
+        cumsum += bottom_slice[h * width + w];
+      }
+    }
+    const float thres = rand_idx[index] * cumsum;
+    // Second pass: get value, and set index.
+    cumsum = 0;
+    for (int h = hstart; h < hend; ++h) {
+      for (int w = wstart; w < wend; ++w) {
+        cumsum += bottom_slice[h * width + w];
+        if (cumsum >= thres) {
+          rand_idx[index] = ((n * channels + c) * height + h) * width + w;
+          top_data[index] = bottom_slice[h * width + w];
+          return;
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+__global__ void SPPStoForwardTest(const int nthreads,
+    const Dtype* const bottom_data, const int channels, const int height,
+    const int width, const int top_dim, Dtype* const top_data) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int n = index / top_dim;
+    int c, ph, pw, num_bins, kernel_h, kernel_w, pad_h, pad_w;
+    SPPLocate(index % top_dim, channels, &c, &ph, &pw, &num_bins);
+    SPPWindowGPU(height, num_bins, &kernel_h, &pad_h);
+    SPPWindowGPU(width, num_bins, &kernel_w, &pad_w);
+    const int hstart = ph * kernel_h;
+    const int hend = min(hstart + kernel_h, height);
+    const int wstart = pw * kernel_w;
+    const int wend = min(wstart + kernel_w, width);
+    // We set cumsum to be 0 to avoid divide-by-zero problems
+    Dtype cumsum = FLT_MIN;
+    Dtype cumvalues = 0.;
+    const Dtype* const bottom_slice =
+        bottom_data + (n * channels + c) * height * width;
+    for (int h = hstart; h < hend; ++h) {
+      for (int w = wstart; w < wend; ++w) {
+        cumsum += bottom_slice[h * width + w];
+        cumvalues += bottom_slice[h * width + w] * bottom_slice[h * width + w];
+      }
+    }
+    top_data[index] = cumvalues / cumsum;
+  }
+}
+
+template <typename Dtype>
+void SPPLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const Dtype* bottom_data = bottom[0]->gpu_data();
+  Dtype* top_data = top[0]->mutable_gpu_data();
+  const int count = top[0]->count();
+  const int top_dim = top[0]->count(1);
+  switch (this->layer_param_.spp_param().pool()) {
+  case SPPParameter_PoolMethod_MAX:
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    SPPMaxForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+        0, Caffe::cuda_stream()>>>(count, bottom_data, channels_, bottom_h_,
+        bottom_w_, top_dim, top_data, max_idx_.mutable_gpu_data());
+    break;
+  case SPPParameter_PoolMethod_AVE:
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    SPPAveForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+        0, Caffe::cuda_stream()>>>(count, bottom_data, channels_, bottom_h_,
+        bottom_w_, top_dim, top_data);
+    break;
+  case SPPParameter_PoolMethod_STOCHASTIC:
+    if (this->phase_ == TRAIN) {
+      // We need to create the random index as well.
+      caffe_gpu_rng_uniform(count, Dtype(0), Dtype(1),
+                            rand_idx_.mutable_gpu_data());
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      SPPStoForwardTrain<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count,
+          bottom_data, channels_, bottom_h_, bottom_w_, top_dim,
+          rand_idx_.mutable_gpu_data(), top_data);
+    } else {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      SPPStoForwardTest<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(count,
+          bottom_data, channels_, bottom_h_, bottom_w_, top_dim, top_data);
+    }
+    break;
+  default:
+    LOG(FATAL) << "Unknown pooling method.";
+  }
+  CUDA_POST_KERNEL_CHECK;
+}
+
+// One thread per bottom value gathers the gradients of the window holding it
+// at every level, which is unique as the windows of a level do not overlap.
+template <typename Dtype>
+__global__ void SPPBackward(const int nthreads, const Dtype* const top_diff,
+    const int* const mask, const Dtype* const rand_idx,
+    const SPPParameter_PoolMethod pool, const int channels, const int height,
+    const int width, const int pyramid_height, const int top_dim,
+    Dtype* const bottom_diff) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int w = index % width;
+    const int h = (index / width) % height;
+    const int c = (index / width / height) % channels;
+    const int n = index / width / height / channels;
+    Dtype gradient = 0;
+    int level_begin = n * top_dim;
+    for (int l = 0; l < pyramid_height; ++l) {
+      const int num_bins = 1 << l;
+      int kernel_h, kernel_w, pad_h, pad_w;
+      SPPWindowGPU(height, num_bins, &kernel_h, &pad_h);
+      SPPWindowGPU(width, num_bins, &kernel_w, &pad_w);
+      const int level_c = level_begin + c * num_bins * num_bins;
+      if (pool == SPPParameter_PoolMethod_STOCHASTIC) {
+        const int top_index =
+            level_c + (h / kernel_h) * num_bins + w / kernel_w;
+        gradient += top_diff[top_index] *
+            (index == static_cast<int>(rand_idx[top_index]));
+      } else {
+        const int ph = (h + pad_h) / kernel_h;
+        const int pw = (w + pad_w) / kernel_w;
+        const int top_index = level_c + ph * num_bins + pw;
+        if (pool == SPPParameter_PoolMethod_MAX) {
+          if (mask[top_index] == h * width + w) {
+            gradient += top_diff[top_index];
+          }
+        } else {
+          const int hstart = ph * kernel_h - pad_h;
+          const int wstart = pw * kernel_w - pad_w;
+          const int hend = min(hstart + kernel_h, height + pad_h);
+          const int wend = min(wstart + kernel_w, width + pad_w);
+          const int pool_size = (hend - hstart) * (wend - wstart);
+          gradient += top_diff[top_index] / pool_size;
+        }
+      }
+      level_begin += channels * num_bins * num_bins;
+    }
+    bottom_diff[index] = gradient;
+  }
+}
+
+template <typename Dtype>
+void SPPLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) {
+    return;
+  }
+  const SPPParameter_PoolMethod pool = this->layer_param_.spp_param().pool();
+  const int count = bottom[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  SPPBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(count, top[0]->gpu_diff(),
+      pool == SPPParameter_PoolMethod_MAX ? max_idx_.gpu_data() : NULL,
+      pool == SPPParameter_PoolMethod_STOCHASTIC ? rand_idx_.gpu_data() : NULL,
+      pool, channels_, bottom_h_, bottom_w_, pyramid_height_,
+      top[0]->count(1), bottom[0]->mutable_gpu_diff());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(SPPLayer);
+
+}  // namespace caffe
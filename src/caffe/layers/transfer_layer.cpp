@@ -0,0 +1,40 @@
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void TransferLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  CHECK_NE(top[0], bottom[0]) << this->type() << " Layer does not "
+      "allow in-place computation.";
+  top[0]->ReshapeLike(*bottom[0]);
+}
+
+template <typename Dtype>
+void TransferLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  caffe_copy(bottom[0]->count(), bottom[0]->cpu_data(),
+      top[0]->mutable_cpu_data());
+}
+
+template <typename Dtype>
+void TransferLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) { return; }
+  caffe_copy(top[0]->count(), top[0]->cpu_diff(),
+      bottom[0]->mutable_cpu_diff());
+}
+
+
+#ifdef CPU_ONLY
+STUB_GPU(TransferLayer);
+#endif
+
+INSTANTIATE_CLASS(TransferLayer);
+REGISTER_LAYER_CLASS(Transfer);
+
+}  // namespace caffe
@@ -0,0 +1,32 @@
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// The bottom is on the GPU of an earlier stage, which caffe_copy reaches
+// with a copy between devices, and has no pending work as that stage
+// synchronized its stream.
+template <typename Dtype>
+void TransferLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  caffe_copy(bottom[0]->count(), bottom[0]->gpu_data(),
+      top[0]->mutable_gpu_data());
+}
+
+// The net allocated the bottom diff on the GPU of its stage, see
+// Net::ForwardStage.
+template <typename Dtype>
+void TransferLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) { return; }
+  caffe_copy(top[0]->count(), top[0]->gpu_diff(),
+      bottom[0]->mutable_gpu_diff());
+}
+
+
+INSTANTIATE_LAYER_GPU_FUNCS(TransferLayer);
+
+}  // namespace caffe
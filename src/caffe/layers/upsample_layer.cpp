@@ -0,0 +1,151 @@
+#include <boost/bind.hpp>
+
+#include <cmath>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void UpsampleLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const UpsampleParameter& param = this->layer_param_.upsample_param();
+  scale_ = param.scale();
+  CHECK_GT(scale_, 0) << "scale must be positive";
+  mode_ = param.mode();
+}
+
+template <typename Dtype>
+void UpsampleLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  CHECK_EQ(4, bottom[0]->num_axes()) << "Input must have 4 axes, "
+      << "corresponding to (num, channels, height, width)";
+  CHECK_EQ(NCHW, bottom[0]->layout()) << "Upsample takes NCHW inputs";
+  height_ = bottom[0]->height();
+  width_ = bottom[0]->width();
+  height_out_ = height_ * scale_;
+  width_out_ = width_ * scale_;
+  top[0]->Reshape(bottom[0]->num(), bottom[0]->channels(), height_out_,
+      width_out_);
+  Taps(height_, &row_index_, &row_weight_);
+  Taps(width_, &col_index_, &col_weight_);
+}
+
+template <typename Dtype>
+void UpsampleLayer<Dtype>::Taps(const int size, Blob<int>* index,
+    Blob<Dtype>* weight) {
+  vector<int> shape(2);
+  shape[0] = size * scale_;
+  shape[1] = 2;
+  index->Reshape(shape);
+  weight->Reshape(shape);
+  int* indices = index->mutable_cpu_data();
+  Dtype* weights = weight->mutable_cpu_data();
+  // The kernel, padding and weights of the bilinear Deconvolution
+  const int kernel = 2 * scale_ - scale_ % 2;
+  const int pad = scale_ / 2;
+  const float center = (2 * scale_ - 1 - scale_ % 2) / (2. * scale_);
+  for (int y = 0; y < shape[0]; ++y) {
+    for (int k = 0; k < 2; ++k) {
+      int i;
+      Dtype w;
+      if (mode_ == UpsampleParameter_Mode_NEAREST) {
+        i = y / scale_;
+        w = k == 0;
+      } else {
+        // The inputs whose kernels, scale_ apart, cover y at offset t
+        i = (y + pad) / scale_ - k;
+        const int t = (y + pad) % scale_ + k * scale_;
+        w = t < kernel ? 1 - fabs(t / static_cast<float>(scale_) - center) : 0;
+      }
+      if (i < 0 || i >= size) {
+        i = 0;
+        w = 0;
+      }
+      indices[y * 2 + k] = i;
+      weights[y * 2 + k] = w;
+    }
+  }
+}
+
+template <typename Dtype>
+void UpsampleLayer<Dtype>::upsample_planes_cpu(const Dtype* bottom_data,
+    Dtype* top_data, int begin, int end) {
+  const int* rows = row_index_.cpu_data();
+  const int* cols = col_index_.cpu_data();
+  const Dtype* row_weights = row_weight_.cpu_data();
+  const Dtype* col_weights = col_weight_.cpu_data();
+  for (int p = begin; p < end; ++p) {
+    const Dtype* in = bottom_data + p * height_ * width_;
+    Dtype* out = top_data + p * height_out_ * width_out_;
+    for (int y = 0; y < height_out_; ++y, out += width_out_) {
+      const Dtype* in0 = in + rows[y * 2] * width_;
+      const Dtype* in1 = in + rows[y * 2 + 1] * width_;
+      const Dtype w0 = row_weights[y * 2];
+      const Dtype w1 = row_weights[y * 2 + 1];
+      for (int x = 0; x < width_out_; ++x) {
+        const int c0 = cols[x * 2];
+        const int c1 = cols[x * 2 + 1];
+        out[x] = col_weights[x * 2] * (w0 * in0[c0] + w1 * in1[c0])
+            + col_weights[x * 2 + 1] * (w0 * in0[c1] + w1 * in1[c1]);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void UpsampleLayer<Dtype>::downsample_planes_cpu(const Dtype* top_diff,
+    Dtype* bottom_diff, int begin, int end) {
+  const int* rows = row_index_.cpu_data();
+  const int* cols = col_index_.cpu_data();
+  const Dtype* row_weights = row_weight_.cpu_data();
+  const Dtype* col_weights = col_weight_.cpu_data();
+  for (int p = begin; p < end; ++p) {
+    Dtype* in = bottom_diff + p * height_ * width_;
+    const Dtype* out = top_diff + p * height_out_ * width_out_;
+    caffe_set(height_ * width_, Dtype(0), in);
+    for (int y = 0; y < height_out_; ++y, out += width_out_) {
+      for (int k = 0; k < 2; ++k) {
+        Dtype* in_row = in + rows[y * 2 + k] * width_;
+        const Dtype w = row_weights[y * 2 + k];
+        for (int x = 0; x < width_out_; ++x) {
+          const Dtype diff = w * out[x];
+          in_row[cols[x * 2]] += col_weights[x * 2] * diff;
+          in_row[cols[x * 2 + 1]] += col_weights[x * 2 + 1] * diff;
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void UpsampleLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  Caffe::thread_pool().run(bottom[0]->num() * bottom[0]->channels(),
+      kParallelGrain / (height_out_ * width_out_),
+      boost::bind(&UpsampleLayer<Dtype>::upsample_planes_cpu, this,
+                  bottom[0]->cpu_data(), top[0]->mutable_cpu_data(), _1, _2));
+}
+
+template <typename Dtype>
+void UpsampleLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+    const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) { return; }
+  Caffe::thread_pool().run(bottom[0]->num() * bottom[0]->channels(),
+      kParallelGrain / (height_out_ * width_out_),
+      boost::bind(&UpsampleLayer<Dtype>::downsample_planes_cpu, this,
+                  top[0]->cpu_diff(), bottom[0]->mutable_cpu_diff(), _1, _2));
+}
+
+#ifdef CPU_ONLY
+STUB_GPU(UpsampleLayer);
+#endif
+
+INSTANTIATE_CLASS(UpsampleLayer);
+REGISTER_LAYER_CLASS(Upsample);
+
+}  // namespace caffe
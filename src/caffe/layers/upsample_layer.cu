@@ -0,0 +1,99 @@
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// A thread per output, from the two rows and columns under it
+template <typename Dtype>
+__global__ void UpsampleForward(const int n, const Dtype* bottom_data,
+    const int height, const int width, const int height_out,
+    const int width_out, const int* rows, const int* cols,
+    const Dtype* row_weights, const Dtype* col_weights, Dtype* top_data) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int x = index % width_out;
+    const int y = (index / width_out) % height_out;
+    const Dtype* in = bottom_data
+        + index / width_out / height_out * height * width;
+    Dtype val = 0;
+    for (int k = 0; k < 2; ++k) {
+      const Dtype* in_row = in + rows[y * 2 + k] * width;
+      val += row_weights[y * 2 + k]
+          * (col_weights[x * 2] * in_row[cols[x * 2]]
+             + col_weights[x * 2 + 1] * in_row[cols[x * 2 + 1]]);
+    }
+    top_data[index] = val;
+  }
+}
+
+// A thread per input, adding up the outputs within scale of it which it is
+// under, instead of scattering the outputs with atomics
+template <typename Dtype>
+__global__ void UpsampleBackward(const int n, const Dtype* top_diff,
+    const int height, const int width, const int height_out,
+    const int width_out, const int scale, const int* rows, const int* cols,
+    const Dtype* row_weights, const Dtype* col_weights, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int w = index % width;
+    const int h = (index / width) % height;
+    const Dtype* out = top_diff
+        + index / width / height * height_out * width_out;
+    const int y_end = min((h + 2) * scale, height_out);
+    const int x_end = min((w + 2) * scale, width_out);
+    Dtype val = 0;
+    for (int y = max((h - 1) * scale, 0); y < y_end; ++y) {
+      Dtype row_weight = 0;
+      for (int k = 0; k < 2; ++k) {
+        if (rows[y * 2 + k] == h) {
+          row_weight += row_weights[y * 2 + k];
+        }
+      }
+      if (row_weight == 0) {
+        continue;
+      }
+      for (int x = max((w - 1) * scale, 0); x < x_end; ++x) {
+        Dtype col_weight = 0;
+        for (int k = 0; k < 2; ++k) {
+          if (cols[x * 2 + k] == w) {
+            col_weight += col_weights[x * 2 + k];
+          }
+        }
+        val += row_weight * col_weight * out[y * width_out + x];
+      }
+    }
+    bottom_diff[index] = val;
+  }
+}
+
+template <typename Dtype>
+void UpsampleLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const int count = top[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  UpsampleForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+      0, Caffe::cuda_stream()>>>(count, bottom[0]->gpu_data(), height_,
+      width_, height_out_, width_out_, row_index_.gpu_data(),
+      col_index_.gpu_data(), row_weight_.gpu_data(), col_weight_.gpu_data(),
+      top[0]->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template <typename Dtype>
+void UpsampleLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) { return; }
+  const int count = bottom[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  UpsampleBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS,
+      0, Caffe::cuda_stream()>>>(count, top[0]->gpu_diff(), height_, width_,
+      height_out_, width_out_, scale_, row_index_.gpu_data(),
+      col_index_.gpu_data(), row_weight_.gpu_data(), col_weight_.gpu_data(),
+      bottom[0]->mutable_gpu_diff());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(UpsampleLayer);
+
+}  // namespace caffe
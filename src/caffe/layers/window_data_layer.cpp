@@ -1,7 +1,10 @@
 #include <opencv2/highgui/highgui_c.h>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+
 #include <algorithm>
+#include <list>
 #include <map>
 #include <string>
 #include <utility>
@@ -18,6 +21,7 @@
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 // caffe.proto > LayerParameter > WindowDataParameter
 //   'source' field specifies the window_file
@@ -25,6 +29,39 @@
 
 namespace caffe {
 
+// Least recently used decoded images, by image index. Only used by
+// load_batch, which loaders run one at a time.
+template <typename Dtype>
+class WindowDataLayer<Dtype>::DecodedCache {
+ public:
+  explicit DecodedCache(int capacity)
+      : capacity_(capacity) {}
+
+  bool get(int index, cv::Mat* image) {
+    typename map<int, Entry>::iterator it = index_.find(index);
+    if (it == index_.end()) {
+      return false;
+    }
+    images_.splice(images_.begin(), images_, it->second);
+    *image = images_.front().second;
+    return true;
+  }
+  void put(int index, const cv::Mat& image) {
+    images_.push_front(std::make_pair(index, image));
+    index_[index] = images_.begin();
+    if (images_.size() > capacity_) {
+      index_.erase(images_.back().first);
+      images_.pop_back();
+    }
+  }
+
+ protected:
+  typedef typename std::list<pair<int, cv::Mat> >::iterator Entry;
+  const int capacity_;
+  std::list<pair<int, cv::Mat> > images_;
+  map<int, Entry> index_;
+};
+
 template <typename Dtype>
 WindowDataLayer<Dtype>::~WindowDataLayer<Dtype>() {
   this->StopInternalThread();
@@ -61,7 +98,21 @@ void WindowDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       << this->layer_param_.window_data_param().root_folder();
 
   cache_images_ = this->layer_param_.window_data_param().cache_images();
+  const int decoded_cache_size =
+      this->layer_param_.window_data_param().decoded_cache_size();
+  if (decoded_cache_size > 0) {
+    decoded_cache_.reset(new DecodedCache(decoded_cache_size));
+  }
+  window_pool_.reset(new ThreadPool(
+      this->layer_param_.window_data_param().window_threads()));
   string root_folder = this->layer_param_.window_data_param().root_folder();
+  rois_per_image_ = this->layer_param_.window_data_param().rois_per_image();
+  if (rois_per_image_ > 0) {
+    CHECK_EQ(this->layer_param_.window_data_param().context_pad(), 0)
+        << "rois_per_image warps whole images, without context_pad";
+    CHECK_EQ(this->layer_param_.window_data_param().crop_mode(), "warp")
+        << "rois_per_image warps whole images, without crop_mode square";
+  }
 
   const bool prefetch_needs_rand =
       this->transform_param_.mirror() ||
@@ -96,6 +147,10 @@ void WindowDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
     infile >> image_size[0] >> image_size[1] >> image_size[2];
     channels = image_size[0];
     image_database_.push_back(std::make_pair(image_path, image_size));
+    if (image_fg_windows_.size() <= image_index) {
+      image_fg_windows_.resize(image_index + 1);
+      image_bg_windows_.resize(image_index + 1);
+    }
 
     if (cache_images_) {
       Datum datum;
@@ -130,6 +185,7 @@ void WindowDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       if (overlap >= fg_threshold) {
         int label = window[WindowDataLayer::LABEL];
         CHECK_GT(label, 0);
+        image_fg_windows_[image_index].push_back(fg_windows_.size());
         fg_windows_.push_back(window);
         label_hist.insert(std::make_pair(label, 0));
         label_hist[label]++;
@@ -137,6 +193,7 @@ void WindowDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
         // background window, force label and overlap to 0
         window[WindowDataLayer::LABEL] = 0;
         window[WindowDataLayer::OVERLAP] = 0;
+        image_bg_windows_[image_index].push_back(bg_windows_.size());
         bg_windows_.push_back(window);
         label_hist[0]++;
       }
@@ -153,6 +210,11 @@ void WindowDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   } while (infile >> hashtag >> image_index);
 
   LOG(INFO) << "Number of images: " << image_index+1;
+  for (int i = 0; i < image_fg_windows_.size(); ++i) {
+    if (image_fg_windows_[i].size() || image_bg_windows_[i].size()) {
+      roi_images_.push_back(i);
+    }
+  }
 
   for (map<int, int>::iterator it = label_hist.begin();
       it != label_hist.end(); ++it) {
@@ -171,8 +233,8 @@ void WindowDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_GT(crop_size, 0);
   const int batch_size = this->layer_param_.window_data_param().batch_size();
   top[0]->Reshape(batch_size, channels, crop_size, crop_size);
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i)
-    this->prefetch_[i].data_.Reshape(
+  for (int i = 0; i < this->prefetch_.size(); ++i)
+    this->prefetch_[i]->data_.Reshape(
         batch_size, channels, crop_size, crop_size);
 
   LOG(INFO) << "output data size: " << top[0]->num() << ","
@@ -180,9 +242,21 @@ void WindowDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       << top[0]->width();
   // label
   vector<int> label_shape(1, batch_size);
-  top[1]->Reshape(label_shape);
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].label_.Reshape(label_shape);
+  if (rois_per_image_ > 0) {
+    CHECK(roi_images_.size()) << "No image has windows";
+    // The regions and labels, read together then split
+    vector<int> roi_shape(2, batch_size * rois_per_image_);
+    roi_shape[1] = 5;
+    top[1]->Reshape(roi_shape);
+    label_shape[0] = roi_shape[0];
+    top[2]->Reshape(label_shape);
+    roi_shape[1] = 6;
+    label_shape = roi_shape;
+  } else {
+    top[1]->Reshape(label_shape);
+  }
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->label_.Reshape(label_shape);
   }
 
   // data mean
@@ -221,31 +295,19 @@ unsigned int WindowDataLayer<Dtype>::PrefetchRand() {
   return (*prefetch_rng)();
 }
 
-// This function is called on prefetch thread
+// Crops the window out of its image, warps it and copies it into top_data
 template <typename Dtype>
-void WindowDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
-  // At each iteration, sample N windows where N*p are foreground (object)
-  // windows and N*(1-p) are background (non-object) windows
-  CPUTimer batch_timer;
-  batch_timer.Start();
-  double read_time = 0;
-  double trans_time = 0;
-  CPUTimer timer;
-  Dtype* top_data = batch->data_.mutable_cpu_data();
-  Dtype* top_label = batch->label_.mutable_cpu_data();
+void WindowDataLayer<Dtype>::warp_window(const vector<float>& window,
+    bool do_mirror, const cv::Mat& cv_img, int item_id, Dtype* top_data) {
   const Dtype scale = this->layer_param_.window_data_param().scale();
-  const int batch_size = this->layer_param_.window_data_param().batch_size();
   const int context_pad = this->layer_param_.window_data_param().context_pad();
   const int crop_size = this->transform_param_.crop_size();
-  const bool mirror = this->transform_param_.mirror();
-  const float fg_fraction =
-      this->layer_param_.window_data_param().fg_fraction();
-  Dtype* mean = NULL;
+  const Dtype* mean = NULL;
   int mean_off = 0;
   int mean_width = 0;
   int mean_height = 0;
   if (this->has_mean_file_) {
-    mean = this->data_mean_.mutable_cpu_data();
+    mean = this->data_mean_.cpu_data();
     mean_off = (this->data_mean_.width() - crop_size) / 2;
     mean_width = this->data_mean_.width();
     mean_height = this->data_mean_.height();
@@ -255,6 +317,189 @@ void WindowDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
 
   bool use_square = (crop_mode == "square") ? true : false;
 
+  const int channels = cv_img.channels();
+
+  // crop window out of image and warp it
+  int x1 = window[WindowDataLayer<Dtype>::X1];
+  int y1 = window[WindowDataLayer<Dtype>::Y1];
+  int x2 = window[WindowDataLayer<Dtype>::X2];
+  int y2 = window[WindowDataLayer<Dtype>::Y2];
+
+  int pad_w = 0;
+  int pad_h = 0;
+  if (context_pad > 0 || use_square) {
+    // scale factor by which to expand the original region
+    // such that after warping the expanded region to crop_size x crop_size
+    // there's exactly context_pad amount of padding on each side
+    Dtype context_scale = static_cast<Dtype>(crop_size) /
+        static_cast<Dtype>(crop_size - 2*context_pad);
+
+    // compute the expanded region
+    Dtype half_height = static_cast<Dtype>(y2-y1+1)/2.0;
+    Dtype half_width = static_cast<Dtype>(x2-x1+1)/2.0;
+    Dtype center_x = static_cast<Dtype>(x1) + half_width;
+    Dtype center_y = static_cast<Dtype>(y1) + half_height;
+    if (use_square) {
+      if (half_height > half_width) {
+        half_width = half_height;
+      } else {
+        half_height = half_width;
+      }
+    }
+    x1 = static_cast<int>(round(center_x - half_width*context_scale));
+    x2 = static_cast<int>(round(center_x + half_width*context_scale));
+    y1 = static_cast<int>(round(center_y - half_height*context_scale));
+    y2 = static_cast<int>(round(center_y + half_height*context_scale));
+
+    // the expanded region may go outside of the image
+    // so we compute the clipped (expanded) region and keep track of
+    // the extent beyond the image
+    int unclipped_height = y2-y1+1;
+    int unclipped_width = x2-x1+1;
+    int pad_x1 = std::max(0, -x1);
+    int pad_y1 = std::max(0, -y1);
+    int pad_x2 = std::max(0, x2 - cv_img.cols + 1);
+    int pad_y2 = std::max(0, y2 - cv_img.rows + 1);
+    // clip bounds
+    x1 = x1 + pad_x1;
+    x2 = x2 - pad_x2;
+    y1 = y1 + pad_y1;
+    y2 = y2 - pad_y2;
+    CHECK_GT(x1, -1);
+    CHECK_GT(y1, -1);
+    CHECK_LT(x2, cv_img.cols);
+    CHECK_LT(y2, cv_img.rows);
+
+    int clipped_height = y2-y1+1;
+    int clipped_width = x2-x1+1;
+
+    // scale factors that would be used to warp the unclipped
+    // expanded region
+    Dtype scale_x =
+        static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_width);
+    Dtype scale_y =
+        static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_height);
+
+    // size to warp the clipped expanded region to
+    cv_crop_size.width =
+        static_cast<int>(round(static_cast<Dtype>(clipped_width)*scale_x));
+    cv_crop_size.height =
+        static_cast<int>(round(static_cast<Dtype>(clipped_height)*scale_y));
+    pad_x1 = static_cast<int>(round(static_cast<Dtype>(pad_x1)*scale_x));
+    pad_x2 = static_cast<int>(round(static_cast<Dtype>(pad_x2)*scale_x));
+    pad_y1 = static_cast<int>(round(static_cast<Dtype>(pad_y1)*scale_y));
+    pad_y2 = static_cast<int>(round(static_cast<Dtype>(pad_y2)*scale_y));
+
+    pad_h = pad_y1;
+    // if we're mirroring, we mirror the padding too (to be pedantic)
+    if (do_mirror) {
+      pad_w = pad_x2;
+    } else {
+      pad_w = pad_x1;
+    }
+
+    // ensure that the warped, clipped region plus the padding fits in the
+    // crop_size x crop_size image (it might not due to rounding)
+    if (pad_h + cv_crop_size.height > crop_size) {
+      cv_crop_size.height = crop_size - pad_h;
+    }
+    if (pad_w + cv_crop_size.width > crop_size) {
+      cv_crop_size.width = crop_size - pad_w;
+    }
+  }
+
+  cv::Rect roi(x1, y1, x2-x1+1, y2-y1+1);
+  cv::Mat cv_cropped_img = cv_img(roi);
+  cv::resize(cv_cropped_img, cv_cropped_img,
+      cv_crop_size, 0, 0, cv::INTER_LINEAR);
+
+  // horizontal flip at random
+  if (do_mirror) {
+    cv::flip(cv_cropped_img, cv_cropped_img, 1);
+  }
+
+  // copy the warped window into top_data
+  for (int h = 0; h < cv_cropped_img.rows; ++h) {
+    const uchar* ptr = cv_cropped_img.ptr<uchar>(h);
+    int img_index = 0;
+    for (int w = 0; w < cv_cropped_img.cols; ++w) {
+      for (int c = 0; c < channels; ++c) {
+        int top_index = ((item_id * channels + c) * crop_size + h + pad_h)
+                 * crop_size + w + pad_w;
+        // int top_index = (c * height + h) * width + w;
+        Dtype pixel = static_cast<Dtype>(ptr[img_index++]);
+        if (this->has_mean_file_) {
+          int mean_index = (c * mean_height + h + mean_off + pad_h)
+                       * mean_width + w + mean_off + pad_w;
+          top_data[top_index] = (pixel - mean[mean_index]) * scale;
+        } else {
+          if (this->has_mean_values_) {
+            top_data[top_index] = (pixel - this->mean_values_[c]) * scale;
+          } else {
+            top_data[top_index] = pixel * scale;
+          }
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void WindowDataLayer<Dtype>::warp_windows(
+    const vector<const vector<float>*>& windows,
+    const vector<bool>& mirrors, const vector<cv::Mat>& images,
+    Dtype* top_data, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    warp_window(*windows[i], mirrors[i], images[i], i, top_data);
+  }
+}
+
+template <typename Dtype>
+cv::Mat WindowDataLayer<Dtype>::load_image(int index) {
+  if (decoded_cache_) {
+    cv::Mat cv_img;
+    if (decoded_cache_->get(index, &cv_img)) {
+      return cv_img;
+    }
+  }
+  cv::Mat cv_img;
+  if (this->cache_images_) {
+    cv_img = DecodeDatumToCVMat(image_database_cache_[index].second, true);
+  } else {
+    cv_img = cv::imread(image_database_[index].first, CV_LOAD_IMAGE_COLOR);
+    if (!cv_img.data) {
+      LOG(ERROR) << "Could not open or find file "
+                 << image_database_[index].first;
+      return cv_img;
+    }
+  }
+  if (decoded_cache_) {
+    decoded_cache_->put(index, cv_img);
+  }
+  return cv_img;
+}
+
+// This function is called on prefetch thread
+template <typename Dtype>
+void WindowDataLayer<Dtype>::load_batch(Batch<Dtype>* batch, int loader) {
+  if (rois_per_image_ > 0) {
+    load_roi_batch(batch);
+    return;
+  }
+  // At each iteration, sample N windows where N*p are foreground (object)
+  // windows and N*(1-p) are background (non-object) windows
+  CPUTimer batch_timer;
+  batch_timer.Start();
+  double read_time = 0;
+  double trans_time = 0;
+  CPUTimer timer;
+  Dtype* top_data = batch->data_.mutable_cpu_data();
+  Dtype* top_label = batch->label_.mutable_cpu_data();
+  const int batch_size = this->layer_param_.window_data_param().batch_size();
+  const bool mirror = this->transform_param_.mirror();
+  const float fg_fraction =
+      this->layer_param_.window_data_param().fg_fraction();
+
   // zero out batch
   caffe_set(batch->data_.count(), Dtype(0), top_data);
 
@@ -262,206 +507,190 @@ void WindowDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
       * fg_fraction);
   const int num_samples[2] = { batch_size - num_fg, num_fg };
 
-  int item_id = 0;
+  // Sample the windows, then load their images, each once per batch
+  vector<const vector<float>*> windows;
+  vector<bool> mirrors;
+  vector<cv::Mat> images;
+  map<int, cv::Mat> batch_images;
   // sample from bg set then fg set
   for (int is_fg = 0; is_fg < 2; ++is_fg) {
     for (int dummy = 0; dummy < num_samples[is_fg]; ++dummy) {
       // sample a window
-      timer.Start();
       const unsigned int rand_index = PrefetchRand();
-      vector<float> window = (is_fg) ?
+      const vector<float>& window = (is_fg) ?
           fg_windows_[rand_index % fg_windows_.size()] :
           bg_windows_[rand_index % bg_windows_.size()];
-
-      bool do_mirror = mirror && PrefetchRand() % 2;
+      windows.push_back(&window);
+      mirrors.push_back(mirror && PrefetchRand() % 2);
 
       // load the image containing the window
-      pair<std::string, vector<int> > image =
-          image_database_[window[WindowDataLayer<Dtype>::IMAGE_INDEX]];
-
-      cv::Mat cv_img;
-      if (this->cache_images_) {
-        pair<std::string, Datum> image_cached =
-          image_database_cache_[window[WindowDataLayer<Dtype>::IMAGE_INDEX]];
-        cv_img = DecodeDatumToCVMat(image_cached.second, true);
-      } else {
-        cv_img = cv::imread(image.first, CV_LOAD_IMAGE_COLOR);
+      timer.Start();
+      const int index = window[WindowDataLayer<Dtype>::IMAGE_INDEX];
+      map<int, cv::Mat>::iterator it = batch_images.find(index);
+      if (it == batch_images.end()) {
+        cv::Mat cv_img = load_image(index);
         if (!cv_img.data) {
-          LOG(ERROR) << "Could not open or find file " << image.first;
           return;
         }
+        it = batch_images.insert(std::make_pair(index, cv_img)).first;
       }
+      images.push_back(it->second);
       read_time += timer.MicroSeconds();
-      timer.Start();
-      const int channels = cv_img.channels();
-
-      // crop window out of image and warp it
-      int x1 = window[WindowDataLayer<Dtype>::X1];
-      int y1 = window[WindowDataLayer<Dtype>::Y1];
-      int x2 = window[WindowDataLayer<Dtype>::X2];
-      int y2 = window[WindowDataLayer<Dtype>::Y2];
-
-      int pad_w = 0;
-      int pad_h = 0;
-      if (context_pad > 0 || use_square) {
-        // scale factor by which to expand the original region
-        // such that after warping the expanded region to crop_size x crop_size
-        // there's exactly context_pad amount of padding on each side
-        Dtype context_scale = static_cast<Dtype>(crop_size) /
-            static_cast<Dtype>(crop_size - 2*context_pad);
-
-        // compute the expanded region
-        Dtype half_height = static_cast<Dtype>(y2-y1+1)/2.0;
-        Dtype half_width = static_cast<Dtype>(x2-x1+1)/2.0;
-        Dtype center_x = static_cast<Dtype>(x1) + half_width;
-        Dtype center_y = static_cast<Dtype>(y1) + half_height;
-        if (use_square) {
-          if (half_height > half_width) {
-            half_width = half_height;
-          } else {
-            half_height = half_width;
-          }
-        }
-        x1 = static_cast<int>(round(center_x - half_width*context_scale));
-        x2 = static_cast<int>(round(center_x + half_width*context_scale));
-        y1 = static_cast<int>(round(center_y - half_height*context_scale));
-        y2 = static_cast<int>(round(center_y + half_height*context_scale));
-
-        // the expanded region may go outside of the image
-        // so we compute the clipped (expanded) region and keep track of
-        // the extent beyond the image
-        int unclipped_height = y2-y1+1;
-        int unclipped_width = x2-x1+1;
-        int pad_x1 = std::max(0, -x1);
-        int pad_y1 = std::max(0, -y1);
-        int pad_x2 = std::max(0, x2 - cv_img.cols + 1);
-        int pad_y2 = std::max(0, y2 - cv_img.rows + 1);
-        // clip bounds
-        x1 = x1 + pad_x1;
-        x2 = x2 - pad_x2;
-        y1 = y1 + pad_y1;
-        y2 = y2 - pad_y2;
-        CHECK_GT(x1, -1);
-        CHECK_GT(y1, -1);
-        CHECK_LT(x2, cv_img.cols);
-        CHECK_LT(y2, cv_img.rows);
-
-        int clipped_height = y2-y1+1;
-        int clipped_width = x2-x1+1;
-
-        // scale factors that would be used to warp the unclipped
-        // expanded region
-        Dtype scale_x =
-            static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_width);
-        Dtype scale_y =
-            static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_height);
-
-        // size to warp the clipped expanded region to
-        cv_crop_size.width =
-            static_cast<int>(round(static_cast<Dtype>(clipped_width)*scale_x));
-        cv_crop_size.height =
-            static_cast<int>(round(static_cast<Dtype>(clipped_height)*scale_y));
-        pad_x1 = static_cast<int>(round(static_cast<Dtype>(pad_x1)*scale_x));
-        pad_x2 = static_cast<int>(round(static_cast<Dtype>(pad_x2)*scale_x));
-        pad_y1 = static_cast<int>(round(static_cast<Dtype>(pad_y1)*scale_y));
-        pad_y2 = static_cast<int>(round(static_cast<Dtype>(pad_y2)*scale_y));
-
-        pad_h = pad_y1;
-        // if we're mirroring, we mirror the padding too (to be pedantic)
-        if (do_mirror) {
-          pad_w = pad_x2;
-        } else {
-          pad_w = pad_x1;
-        }
+    }
+  }
 
-        // ensure that the warped, clipped region plus the padding fits in the
-        // crop_size x crop_size image (it might not due to rounding)
-        if (pad_h + cv_crop_size.height > crop_size) {
-          cv_crop_size.height = crop_size - pad_h;
-        }
-        if (pad_w + cv_crop_size.width > crop_size) {
-          cv_crop_size.width = crop_size - pad_w;
-        }
-      }
+  // Crop and warp the windows, on this thread and the window pool
+  timer.Start();
+  window_pool_->run(windows.size(), 1, boost::bind(
+      &WindowDataLayer::warp_windows, this, boost::cref(windows),
+      boost::cref(mirrors), boost::cref(images), top_data, _1, _2));
+  trans_time += timer.MicroSeconds();
 
-      cv::Rect roi(x1, y1, x2-x1+1, y2-y1+1);
-      cv::Mat cv_cropped_img = cv_img(roi);
-      cv::resize(cv_cropped_img, cv_cropped_img,
-          cv_crop_size, 0, 0, cv::INTER_LINEAR);
+  for (int item_id = 0; item_id < windows.size(); ++item_id) {
+    // get window label
+    top_label[item_id] = (*windows[item_id])[WindowDataLayer<Dtype>::LABEL];
+  }
+  batch_timer.Stop();
+  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
+  DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
+  DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  // Images are read and decoded together
+  this->data_stats_.add(DataStats::READ, read_time);
+  this->data_stats_.add(DataStats::TRANSFORM, trans_time);
+}
 
-      // horizontal flip at random
-      if (do_mirror) {
-        cv::flip(cv_cropped_img, cv_cropped_img, 1);
-      }
+template <typename Dtype>
+void WindowDataLayer<Dtype>::load_roi_batch(Batch<Dtype>* batch) {
+  // Each image is warped whole, its windows scaled along, N*p of them
+  // foreground (object) windows and N*(1-p) background ones
+  CPUTimer batch_timer;
+  batch_timer.Start();
+  double read_time = 0;
+  double trans_time = 0;
+  CPUTimer timer;
+  Dtype* top_data = batch->data_.mutable_cpu_data();
+  Dtype* top_rois = batch->label_.mutable_cpu_data();
+  const int batch_size = this->layer_param_.window_data_param().batch_size();
+  const bool mirror = this->transform_param_.mirror();
+  const int crop_size = this->transform_param_.crop_size();
+  const float fg_fraction =
+      this->layer_param_.window_data_param().fg_fraction();
+  const int num_fg = static_cast<int>(static_cast<float>(rois_per_image_)
+      * fg_fraction);
 
-      // copy the warped window into top_data
-      for (int h = 0; h < cv_cropped_img.rows; ++h) {
-        const uchar* ptr = cv_cropped_img.ptr<uchar>(h);
-        int img_index = 0;
-        for (int w = 0; w < cv_cropped_img.cols; ++w) {
-          for (int c = 0; c < channels; ++c) {
-            int top_index = ((item_id * channels + c) * crop_size + h + pad_h)
-                     * crop_size + w + pad_w;
-            // int top_index = (c * height + h) * width + w;
-            Dtype pixel = static_cast<Dtype>(ptr[img_index++]);
-            if (this->has_mean_file_) {
-              int mean_index = (c * mean_height + h + mean_off + pad_h)
-                           * mean_width + w + mean_off + pad_w;
-              top_data[top_index] = (pixel - mean[mean_index]) * scale;
-            } else {
-              if (this->has_mean_values_) {
-                top_data[top_index] = (pixel - this->mean_values_[c]) * scale;
-              } else {
-                top_data[top_index] = pixel * scale;
-              }
-            }
-          }
-        }
+  caffe_set(batch->data_.count(), Dtype(0), top_data);
+
+  // The whole images as windows, warped as in load_batch
+  vector<vector<float> > frames(batch_size, vector<float>(NUM));
+  vector<const vector<float>*> windows;
+  vector<bool> mirrors;
+  vector<cv::Mat> images;
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    const int index = roi_images_[PrefetchRand() % roi_images_.size()];
+    timer.Start();
+    cv::Mat cv_img = load_image(index);
+    if (!cv_img.data) {
+      return;
+    }
+    read_time += timer.MicroSeconds();
+    const bool do_mirror = mirror && PrefetchRand() % 2;
+    vector<float>& frame = frames[item_id];
+    frame[IMAGE_INDEX] = index;
+    frame[X2] = cv_img.cols - 1;
+    frame[Y2] = cv_img.rows - 1;
+    windows.push_back(&frame);
+    mirrors.push_back(do_mirror);
+    images.push_back(cv_img);
+
+    // Sample the regions, from the other set if the image has none
+    const vector<int>* sets[2] = { &image_bg_windows_[index],
+                                   &image_fg_windows_[index] };
+    const vector<vector<float> >* all[2] = { &bg_windows_, &fg_windows_ };
+    const Dtype scale_x = static_cast<Dtype>(crop_size) / cv_img.cols;
+    const Dtype scale_y = static_cast<Dtype>(crop_size) / cv_img.rows;
+    for (int r = 0; r < rois_per_image_; ++r) {
+      int is_fg = r < num_fg;
+      if (sets[is_fg]->empty()) {
+        is_fg = !is_fg;
       }
-      trans_time += timer.MicroSeconds();
-      // get window label
-      top_label[item_id] = window[WindowDataLayer<Dtype>::LABEL];
-
-      #if 0
-      // useful debugging code for dumping transformed windows to disk
-      string file_id;
-      std::stringstream ss;
-      ss << PrefetchRand();
-      ss >> file_id;
-      std::ofstream inf((string("dump/") + file_id +
-          string("_info.txt")).c_str(), std::ofstream::out);
-      inf << image.first << std::endl
-          << window[WindowDataLayer<Dtype>::X1]+1 << std::endl
-          << window[WindowDataLayer<Dtype>::Y1]+1 << std::endl
-          << window[WindowDataLayer<Dtype>::X2]+1 << std::endl
-          << window[WindowDataLayer<Dtype>::Y2]+1 << std::endl
-          << do_mirror << std::endl
-          << top_label[item_id] << std::endl
-          << is_fg << std::endl;
-      inf.close();
-      std::ofstream top_data_file((string("dump/") + file_id +
-          string("_data.txt")).c_str(),
-          std::ofstream::out | std::ofstream::binary);
-      for (int c = 0; c < channels; ++c) {
-        for (int h = 0; h < crop_size; ++h) {
-          for (int w = 0; w < crop_size; ++w) {
-            top_data_file.write(reinterpret_cast<char*>(
-                &top_data[((item_id * channels + c) * crop_size + h)
-                          * crop_size + w]),
-                sizeof(Dtype));
-          }
-        }
+      const vector<float>& window = (*all[is_fg])[
+          (*sets[is_fg])[PrefetchRand() % sets[is_fg]->size()]];
+      Dtype* roi = top_rois + (item_id * rois_per_image_ + r) * 6;
+      roi[0] = item_id;
+      roi[1] = window[X1] * scale_x;
+      roi[2] = window[Y1] * scale_y;
+      roi[3] = window[X2] * scale_x;
+      roi[4] = window[Y2] * scale_y;
+      if (do_mirror) {
+        const Dtype x1 = roi[1];
+        roi[1] = crop_size - 1 - roi[3];
+        roi[3] = crop_size - 1 - x1;
       }
-      top_data_file.close();
-      #endif
-
-      item_id++;
+      roi[5] = window[LABEL];
     }
   }
+
+  timer.Start();
+  window_pool_->run(windows.size(), 1, boost::bind(
+      &WindowDataLayer::warp_windows, this, boost::cref(windows),
+      boost::cref(mirrors), boost::cref(images), top_data, _1, _2));
+  trans_time += timer.MicroSeconds();
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
   DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
   DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  this->data_stats_.add(DataStats::READ, read_time);
+  this->data_stats_.add(DataStats::TRANSFORM, trans_time);
+}
+
+template <typename Dtype>
+vector<Blob<Dtype>*> WindowDataLayer<Dtype>::batch_top(
+    const vector<Blob<Dtype>*>& top) {
+  vector<Blob<Dtype>*> tops(2, top[0]);
+  tops[1] = &roi_labels_;
+  return tops;
+}
+
+template <typename Dtype>
+void WindowDataLayer<Dtype>::split_rois(const vector<Blob<Dtype>*>& top) {
+  const int num = roi_labels_.shape(0);
+  vector<int> shape(2, num);
+  shape[1] = 5;
+  top[1]->Reshape(shape);
+  top[2]->Reshape(vector<int>(1, num));
+  const Dtype* rows = roi_labels_.cpu_data();
+  Dtype* rois = top[1]->mutable_cpu_data();
+  Dtype* labels = top[2]->mutable_cpu_data();
+  for (int i = 0; i < num; ++i) {
+    // The image within the micro-batch, see micro_batches
+    rois[i * 5] = static_cast<int>(rows[i * 6]) % top[0]->num();
+    for (int j = 1; j < 5; ++j) {
+      rois[i * 5 + j] = rows[i * 6 + j];
+    }
+    labels[i] = rows[i * 6 + 5];
+  }
+}
+
+template <typename Dtype>
+void WindowDataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  if (rois_per_image_ == 0) {
+    BasePrefetchingDataLayer<Dtype>::Forward_cpu(bottom, top);
+    return;
+  }
+  BasePrefetchingDataLayer<Dtype>::Forward_cpu(bottom, batch_top(top));
+  split_rois(top);
+}
+
+template <typename Dtype>
+void WindowDataLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  if (rois_per_image_ == 0) {
+    BasePrefetchingDataLayer<Dtype>::Forward_gpu(bottom, top);
+    return;
+  }
+  BasePrefetchingDataLayer<Dtype>::Forward_gpu(bottom, batch_top(top));
+  split_rois(top);
 }
 
 INSTANTIATE_CLASS(WindowDataLayer);
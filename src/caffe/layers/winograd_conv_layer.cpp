@@ -0,0 +1,240 @@
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// Transforms from Lavin and Gray, "Fast Algorithms for Convolutional Neural
+// Networks", for F(2x2, 3x3) and F(4x4, 3x3), row major.
+static const double kInputTransform2[] = {
+  1,  0, -1,  0,
+  0,  1,  1,  0,
+  0, -1,  1,  0,
+  0,  1,  0, -1
+};
+static const double kWeightTransform2[] = {
+  1,    0,   0,
+  0.5,  0.5, 0.5,
+  0.5, -0.5, 0.5,
+  0,    0,   1
+};
+static const double kOutputTransform2[] = {
+  1, 1,  1,  0,
+  0, 1, -1, -1
+};
+static const double kInputTransform4[] = {
+  4,  0, -5,  0, 1, 0,
+  0, -4, -4,  1, 1, 0,
+  0,  4, -4, -1, 1, 0,
+  0, -2, -1,  2, 1, 0,
+  0,  2, -1, -2, 1, 0,
+  0,  4,  0, -5, 0, 1
+};
+static const double kWeightTransform4[] = {
+  1. / 4,   0,        0,
+  -1. / 6,  -1. / 6,  -1. / 6,
+  -1. / 6,  1. / 6,   -1. / 6,
+  1. / 24,  1. / 12,  1. / 6,
+  1. / 24,  -1. / 12, 1. / 6,
+  0,        0,        1
+};
+static const double kOutputTransform4[] = {
+  1, 1,  1, 1,  1, 0,
+  0, 1, -1, 2, -2, 0,
+  0, 1,  1, 4,  4, 0,
+  0, 1, -1, 8, -8, 1
+};
+
+template <typename Dtype>
+bool WinogradConvolutionLayer<Dtype>::IsSupported(
+    const ConvolutionParameter& param) {
+  const int kernel_h = param.has_kernel_size() ?
+      param.kernel_size() : param.kernel_h();
+  const int kernel_w = param.has_kernel_size() ?
+      param.kernel_size() : param.kernel_w();
+  const int stride_h = param.has_stride_h() ?
+      param.stride_h() : param.stride();
+  const int stride_w = param.has_stride_w() ?
+      param.stride_w() : param.stride();
+  return kernel_h == 3 && kernel_w == 3 && stride_h == 1 && stride_w == 1;
+}
+
+template <typename Dtype>
+void WinogradConvolutionLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  ConvolutionLayer<Dtype>::LayerSetUp(bottom, top);
+  CHECK(IsSupported(this->layer_param_.convolution_param()))
+      << "WINOGRAD only supports 3x3 filters with stride 1";
+  tile_ = this->layer_param_.convolution_param().winograd_tile();
+  alpha_ = tile_ + 2;
+  if (tile_ == 2) {
+    input_transform_.assign(kInputTransform2, kInputTransform2 + 16);
+    weight_transform_.assign(kWeightTransform2, kWeightTransform2 + 12);
+    output_transform_.assign(kOutputTransform2, kOutputTransform2 + 8);
+  } else if (tile_ == 4) {
+    input_transform_.assign(kInputTransform4, kInputTransform4 + 36);
+    weight_transform_.assign(kWeightTransform4, kWeightTransform4 + 18);
+    output_transform_.assign(kOutputTransform4, kOutputTransform4 + 24);
+  } else {
+    LOG(FATAL) << "Unsupported winograd_tile " << tile_ << ", use 2 or 4";
+  }
+}
+
+template <typename Dtype>
+void WinogradConvolutionLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  ConvolutionLayer<Dtype>::Reshape(bottom, top);
+  tiles_h_ = (this->height_out_ + tile_ - 1) / tile_;
+  tiles_w_ = (this->width_out_ + tile_ - 1) / tile_;
+  vector<int> shape(3);
+  shape[0] = alpha_ * alpha_;
+  shape[1] = this->num_output_;
+  shape[2] = this->channels_ / this->group_;
+  weights_.Reshape(shape);
+  shape[1] = this->channels_;
+  shape[2] = tiles_h_ * tiles_w_;
+  input_tiles_.Reshape(shape);
+  shape[1] = this->num_output_;
+  output_tiles_.Reshape(shape);
+}
+
+template <typename Dtype>
+void WinogradConvolutionLayer<Dtype>::TransformWeights() {
+  const int a = alpha_;
+  const int filters = this->num_output_ * (this->channels_ / this->group_);
+  const Dtype* g = this->blobs_[0]->cpu_data();
+  const Dtype* G = &weight_transform_[0];
+  Dtype* u = weights_.mutable_cpu_data();
+  vector<Dtype> Gg(a * 3);
+  for (int f = 0; f < filters; ++f, g += 9) {
+    // u = G g G^T
+    for (int i = 0; i < a; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        Dtype sum = 0;
+        for (int k = 0; k < 3; ++k) {
+          sum += G[i * 3 + k] * g[k * 3 + j];
+        }
+        Gg[i * 3 + j] = sum;
+      }
+    }
+    for (int i = 0; i < a; ++i) {
+      for (int j = 0; j < a; ++j) {
+        Dtype sum = 0;
+        for (int k = 0; k < 3; ++k) {
+          sum += Gg[i * 3 + k] * G[j * 3 + k];
+        }
+        u[(i * a + j) * filters + f] = sum;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void WinogradConvolutionLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  TransformWeights();
+  const int m = tile_;
+  const int a = alpha_;
+  const int tiles = tiles_h_ * tiles_w_;
+  const int channels = this->channels_;
+  const int outputs = this->num_output_;
+  const int group_channels = channels / this->group_;
+  const int group_outputs = outputs / this->group_;
+  const Dtype* BT = &input_transform_[0];
+  const Dtype* AT = &output_transform_[0];
+  const Dtype* u = weights_.cpu_data();
+  Dtype* v = input_tiles_.mutable_cpu_data();
+  Dtype* y = output_tiles_.mutable_cpu_data();
+  vector<Dtype> d(a * a);
+  vector<Dtype> BTd(a * a);
+  vector<Dtype> ATy(m * a);
+  for (int i = 0; i < bottom.size(); ++i) {
+    const Dtype* bottom_data = bottom[i]->cpu_data();
+    Dtype* top_data = top[i]->mutable_cpu_data();
+    for (int n = 0; n < this->num_; ++n) {
+      // v = B^T d B for every input tile d of every channel
+      for (int c = 0; c < channels; ++c) {
+        const Dtype* plane = bottom_data + bottom[i]->offset(n, c);
+        for (int p = 0; p < tiles; ++p) {
+          const int h0 = (p / tiles_w_) * m - this->pad_h_;
+          const int w0 = (p % tiles_w_) * m - this->pad_w_;
+          for (int r = 0; r < a; ++r) {
+            for (int s = 0; s < a; ++s) {
+              const int h = h0 + r;
+              const int w = w0 + s;
+              d[r * a + s] = (h >= 0 && h < this->height_ && w >= 0
+                  && w < this->width_) ? plane[h * this->width_ + w] : 0;
+            }
+          }
+          for (int r = 0; r < a; ++r) {
+            for (int s = 0; s < a; ++s) {
+              Dtype sum = 0;
+              for (int k = 0; k < a; ++k) {
+                sum += BT[r * a + k] * d[k * a + s];
+              }
+              BTd[r * a + s] = sum;
+            }
+          }
+          for (int r = 0; r < a; ++r) {
+            for (int s = 0; s < a; ++s) {
+              Dtype sum = 0;
+              for (int k = 0; k < a; ++k) {
+                sum += BTd[r * a + k] * BT[s * a + k];
+              }
+              v[((r * a + s) * channels + c) * tiles + p] = sum;
+            }
+          }
+        }
+      }
+      // The elementwise products, summed over channels
+      for (int e = 0; e < a * a; ++e) {
+        for (int g = 0; g < this->group_; ++g) {
+          caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, group_outputs,
+              tiles, group_channels, (Dtype)1.,
+              u + (e * outputs + g * group_outputs) * group_channels,
+              v + (e * channels + g * group_channels) * tiles,
+              (Dtype)0., y + (e * outputs + g * group_outputs) * tiles);
+        }
+      }
+      // A^T y A gives the output tiles, cropped at the borders
+      for (int o = 0; o < outputs; ++o) {
+        Dtype* plane = top_data + top[i]->offset(n, o);
+        for (int p = 0; p < tiles; ++p) {
+          const Dtype* tile = y + o * tiles + p;
+          const int e_stride = outputs * tiles;
+          for (int r = 0; r < m; ++r) {
+            for (int s = 0; s < a; ++s) {
+              Dtype sum = 0;
+              for (int k = 0; k < a; ++k) {
+                sum += AT[r * a + k] * tile[(k * a + s) * e_stride];
+              }
+              ATy[r * a + s] = sum;
+            }
+          }
+          const int h0 = (p / tiles_w_) * m;
+          const int w0 = (p % tiles_w_) * m;
+          for (int r = 0; r < m && h0 + r < this->height_out_; ++r) {
+            for (int s = 0; s < m && w0 + s < this->width_out_; ++s) {
+              Dtype sum = 0;
+              for (int k = 0; k < a; ++k) {
+                sum += ATy[r * a + k] * AT[s * a + k];
+              }
+              plane[(h0 + r) * this->width_out_ + w0 + s] = sum;
+            }
+          }
+        }
+      }
+      if (this->bias_term_ || this->fused_relu_) {
+        const Dtype* bias =
+            this->bias_term_ ? this->blobs_[1]->cpu_data() : NULL;
+        this->forward_cpu_bias(top_data + top[i]->offset(n), bias);
+      }
+    }
+  }
+}
+
+INSTANTIATE_CLASS(WinogradConvolutionLayer);
+
+}  // namespace caffe
@@ -0,0 +1,339 @@
+#include <sys/socket.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "caffe/model_server.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/socket.hpp"
+
+namespace caffe {
+
+// Upper bounds in seconds of the buckets of the latency histograms
+static const double kLatencyBuckets[] = {
+  0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5
+};
+static const int kLatencyBucketCount =
+    sizeof(kLatencyBuckets) / sizeof(kLatencyBuckets[0]);
+// Limits of the lines and bodies of requests
+static const size_t kMaxLine = 8192;
+static const size_t kMaxBody = 256 << 20;
+
+struct ModelServer::Model {
+  struct Instance {
+    shared_ptr<Net<float> > net;
+    shared_ptr<Batcher<float> > batcher;
+    // Requests being processed
+    int pending;
+  };
+
+  vector<Instance> instances;
+  int input_dim;
+  int output_dim;
+  // Guards the pending requests and the metrics
+  boost::mutex mutex;
+  size_t requests;
+  size_t items;
+  size_t errors;
+  // Requests of each bucket, not cumulated, the last one above all bounds
+  vector<size_t> latencies;
+  double latency_sum;
+};
+
+ModelServer::ModelServer(int max_batch, int max_delay_us)
+    : max_batch_(max_batch), max_delay_us_(max_delay_us) {
+}
+
+ModelServer::~ModelServer() {
+}
+
+void ModelServer::AddModel(const string& name, const string& model,
+    const string& weights, const vector<int>& devices, int instances) {
+  CHECK(models_.find(name) == models_.end()) << "Model " << name
+      << " added twice";
+  CHECK_GT(devices.size(), 0) << "Serve the model on a device";
+  CHECK_GT(instances, 0);
+  shared_ptr<Model> served(new Model());
+  for (int i = 0; i < devices.size(); ++i) {
+    if (devices[i] >= 0) {
+#ifndef CPU_ONLY
+      Caffe::SetDevice(devices[i]);
+      Caffe::set_mode(Caffe::GPU);
+#else
+      NO_GPU;
+#endif
+    } else {
+      Caffe::set_mode(Caffe::CPU);
+    }
+    shared_ptr<Net<float> > net(new Net<float>(model, TEST));
+    if (weights.size()) {
+      net->CopyTrainedLayersFrom(weights);
+    }
+    for (int j = 0; j < instances; ++j) {
+      Model::Instance instance;
+      instance.net = j == 0 ? net : net->CreateInferenceContext();
+      // Ready for a full batch before serving the first request
+      vector<vector<int> > shapes;
+      for (int k = 0; k < instance.net->num_inputs(); ++k) {
+        shapes.push_back(instance.net->input_blobs()[k]->shape());
+        shapes.back()[0] = max_batch_;
+      }
+      instance.net->WarmUp(shapes);
+      instance.batcher.reset(new Batcher<float>(instance.net, max_batch_,
+                                                max_delay_us_));
+      instance.pending = 0;
+      served->instances.push_back(instance);
+    }
+    LOG(INFO) << "Serving " << name << " on "
+              << (devices[i] >= 0 ? "GPU " : "the CPU")
+              << (devices[i] >= 0 ? boost::lexical_cast<string>(devices[i]) :
+                  string()) << ", " << instances << " instances";
+  }
+  const Net<float>& net = *served->instances[0].net;
+  served->input_dim = net.input_blobs()[0]->count(1);
+  served->output_dim = 0;
+  for (int i = 0; i < net.output_blobs().size(); ++i) {
+    served->output_dim += net.output_blobs()[i]->count(1);
+  }
+  served->requests = 0;
+  served->items = 0;
+  served->errors = 0;
+  served->latencies.assign(kLatencyBucketCount + 1, 0);
+  served->latency_sum = 0;
+  models_[name] = served;
+}
+
+// Reads a line without its CRLF, returning false if the connection is lost
+static bool ReadLine(Socket* socket, string* line) {
+  line->clear();
+  for (char c; ;) {
+    if (!socket->try_recv(&c, 1) || line->size() > kMaxLine) {
+      return false;
+    }
+    if (c == '\n') {
+      break;
+    }
+    line->push_back(c);
+  }
+  if (!line->empty() && (*line)[line->size() - 1] == '\r') {
+    line->resize(line->size() - 1);
+  }
+  return true;
+}
+
+static const char* Reason(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 413:
+    return "Payload Too Large";
+  default:
+    return "Error";
+  }
+}
+
+void ModelServer::Serve(int port) {
+  shared_ptr<Socket> listener = Socket::listen(port, SOMAXCONN);
+  LOG(INFO) << "Serving " << models_.size() << " models on port " << port;
+  for (;;) {
+    boost::thread(&ModelServer::Connection, this, listener->accept())
+        .detach();
+  }
+}
+
+void ModelServer::Connection(shared_ptr<Socket> socket) {
+  for (string line; ReadLine(socket.get(), &line); ) {
+    string method, path, version;
+    std::istringstream(line) >> method >> path >> version;
+    bool keep_alive = version == "HTTP/1.1";
+    size_t length = 0;
+    for (;;) {
+      if (!ReadLine(socket.get(), &line)) {
+        return;
+      }
+      if (line.empty()) {
+        break;
+      }
+      const size_t colon = line.find(':');
+      string header = line.substr(0, colon);
+      string value = colon == string::npos ? "" : line.substr(colon + 1);
+      for (int i = 0; i < header.size(); ++i) {
+        header[i] = tolower(header[i]);
+      }
+      value.erase(0, value.find_first_not_of(' '));
+      if (header == "content-length") {
+        length = strtoull(value.c_str(), NULL, 10);
+      } else if (header == "connection") {
+        keep_alive = value != "close" && (keep_alive || value == "keep-alive");
+      }
+    }
+    string type = "text/plain";
+    string body;
+    string response;
+    int status;
+    if (length > kMaxBody) {
+      status = 413;
+      keep_alive = false;
+    } else {
+      body.resize(length);
+      if (length > 0 && !socket->try_recv(&body[0], length)) {
+        return;
+      }
+      status = Handle(method, path, body, &type, &response);
+    }
+    std::ostringstream header;
+    header << "HTTP/1.1 " << status << " " << Reason(status) << "\r\n"
+           << "Content-Type: " << type << "\r\n"
+           << "Content-Length: " << response.size() << "\r\n"
+           << (keep_alive ? "" : "Connection: close\r\n") << "\r\n";
+    const string head = header.str();
+    if (!socket->try_send(head.data(), head.size()) ||
+        !socket->try_send(response.data(), response.size()) || !keep_alive) {
+      return;
+    }
+  }
+}
+
+int ModelServer::Handle(const string& method, const string& path,
+    const string& body, string* content_type, string* response) {
+  *content_type = "text/plain";
+  response->clear();
+  if (path == "/metrics" || path == "/models") {
+    if (method != "GET") {
+      return 405;
+    }
+    if (path == "/metrics") {
+      *content_type = "text/plain; version=0.0.4";
+      *response = Metrics();
+    } else {
+      std::ostringstream list;
+      for (std::map<string, shared_ptr<Model> >::const_iterator it =
+           models_.begin(); it != models_.end(); ++it) {
+        list << it->first << " input " << it->second->input_dim
+             << " output " << it->second->output_dim << " instances "
+             << it->second->instances.size() << "\n";
+      }
+      *response = list.str();
+    }
+    return 200;
+  }
+  const string prefix = "/models/";
+  std::map<string, shared_ptr<Model> >::iterator it = models_.end();
+  if (path.compare(0, prefix.size(), prefix) == 0) {
+    it = models_.find(path.substr(prefix.size()));
+  }
+  if (it == models_.end()) {
+    *response = "Unknown path " + path + "\n";
+    return 404;
+  }
+  if (method != "POST") {
+    return 405;
+  }
+  const int status = Predict(it->second.get(), body, response);
+  if (status == 200) {
+    *content_type = "application/octet-stream";
+  }
+  return status;
+}
+
+int ModelServer::Predict(Model* model, const string& body,
+                         string* response) {
+  CPUTimer timer;
+  timer.Start();
+  const size_t item_size = model->input_dim * sizeof(float);
+  if (body.empty() || body.size() % item_size) {
+    boost::mutex::scoped_lock lock(model->mutex);
+    ++model->requests;
+    ++model->errors;
+    *response = "The body must hold items of " +
+        boost::lexical_cast<string>(model->input_dim) + " floats\n";
+    return 400;
+  }
+  const int count = body.size() / item_size;
+  // Aligned for the batcher
+  vector<float> input(count * model->input_dim);
+  memcpy(&input[0], body.data(), body.size());
+  // Queues the items on the instance with the fewest pending requests
+  Model::Instance* instance = &model->instances[0];
+  {
+    boost::mutex::scoped_lock lock(model->mutex);
+    for (int i = 1; i < model->instances.size(); ++i) {
+      if (model->instances[i].pending < instance->pending) {
+        instance = &model->instances[i];
+      }
+    }
+    ++instance->pending;
+  }
+  vector<float> output;
+  instance->batcher->Process(&input[0], count, &output);
+  response->assign(reinterpret_cast<const char*>(&output[0]),
+                   output.size() * sizeof(float));
+  const double seconds = timer.MicroSeconds() / 1e6;
+  boost::mutex::scoped_lock lock(model->mutex);
+  --instance->pending;
+  ++model->requests;
+  model->items += count;
+  int bucket = 0;
+  while (bucket < kLatencyBucketCount && seconds > kLatencyBuckets[bucket]) {
+    ++bucket;
+  }
+  ++model->latencies[bucket];
+  model->latency_sum += seconds;
+  return 200;
+}
+
+string ModelServer::Metrics() {
+  std::ostringstream requests, items, errors, batches, latency;
+  requests << "# TYPE caffe_requests_total counter\n";
+  items << "# TYPE caffe_items_total counter\n";
+  errors << "# TYPE caffe_request_errors_total counter\n";
+  batches << "# TYPE caffe_batches_total counter\n";
+  latency << "# TYPE caffe_request_latency_seconds histogram\n";
+  for (std::map<string, shared_ptr<Model> >::const_iterator it =
+       models_.begin(); it != models_.end(); ++it) {
+    Model* model = it->second.get();
+    const string label = "model=\"" + it->first + "\"";
+    for (int i = 0; i < model->instances.size(); ++i) {
+      batches << "caffe_batches_total{" << label << ",instance=\"" << i
+              << "\"} " << model->instances[i].batcher->batches() << "\n";
+    }
+    boost::mutex::scoped_lock lock(model->mutex);
+    requests << "caffe_requests_total{" << label << "} " << model->requests
+             << "\n";
+    items << "caffe_items_total{" << label << "} " << model->items << "\n";
+    errors << "caffe_request_errors_total{" << label << "} "
+           << model->errors << "\n";
+    size_t count = 0;
+    for (int i = 0; i <= kLatencyBucketCount; ++i) {
+      count += model->latencies[i];
+      latency << "caffe_request_latency_seconds_bucket{" << label << ",le=\"";
+      if (i < kLatencyBucketCount) {
+        latency << kLatencyBuckets[i];
+      } else {
+        latency << "+Inf";
+      }
+      latency << "\"} " << count << "\n";
+    }
+    latency << "caffe_request_latency_seconds_sum{" << label << "} "
+            << model->latency_sum << "\n";
+    latency << "caffe_request_latency_seconds_count{" << label << "} "
+            << count << "\n";
+  }
+  return requests.str() + items.str() + errors.str() + batches.str() +
+      latency.str();
+}
+
+}  // namespace caffe
@@ -1,6 +1,20 @@
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread.hpp>
+#include <boost/weak_ptr.hpp>
+#include <fcntl.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <climits>
+#include <deque>
 #include <map>
 #include <set>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
@@ -8,12 +22,18 @@
 #include "hdf5.h"
 
 #include "caffe/common.hpp"
+#include "caffe/common_layers.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/net.hpp"
+#include "caffe/neuron_layers.hpp"
 #include "caffe/parallel.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/device_thread.hpp"
+#include "caffe/util/elementwise_ops.hpp"
 #include "caffe/util/hdf5.hpp"
 #include "caffe/util/insert_splits.hpp"
+#include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/upgrade_proto.hpp"
 
@@ -21,6 +41,196 @@
 
 namespace caffe {
 
+using boost::weak_ptr;
+using google::protobuf::internal::WireFormatLite;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::FileInputStream;
+using google::protobuf::io::StringOutputStream;
+
+#ifndef CPU_ONLY
+// Issues the GPU work of the calling thread to a stream, if not 0, until the
+// end of its scope, and then waits for that work. Its cuBLAS calls meanwhile
+// use tensor cores if tensor_op_math.
+class StreamScope {
+ public:
+  StreamScope(cudaStream_t stream, bool tensor_op_math)
+      : stream_(stream), previous_(Caffe::cuda_stream()),
+        tensor_op_math_(tensor_op_math),
+        previous_tensor_op_math_(Caffe::tensor_op_math()) {
+    if (stream_) {
+      Caffe::set_cuda_stream(stream_);
+    }
+    if (tensor_op_math_ != previous_tensor_op_math_) {
+      Caffe::set_tensor_op_math(tensor_op_math_);
+    }
+  }
+  ~StreamScope() {
+    if (tensor_op_math_ != previous_tensor_op_math_) {
+      Caffe::set_tensor_op_math(previous_tensor_op_math_);
+    }
+    if (stream_) {
+      Caffe::set_cuda_stream(previous_);
+      CUDA_CHECK(cudaStreamSynchronize(stream_));
+    }
+  }
+
+ private:
+  cudaStream_t stream_;
+  cudaStream_t previous_;
+  bool tensor_op_math_;
+  bool previous_tensor_op_math_;
+};
+#endif
+
+// Runs the layers of a pass on worker threads, each one as soon as the layers
+// it depends on are done. Losses are summed and after backward callbacks run
+// on the calling thread, in the order of a sequential pass.
+template <typename Dtype>
+class Net<Dtype>::Scheduler {
+ public:
+  Scheduler(Net* net, int threads)
+      : net_(net), pending_(net->layers_.size()),
+        finished_(net->layers_.size()), losses_(net->layers_.size()),
+        stop_(false) {
+    // Workers take the settings of this thread, as in InternalThread
+    int device = 0;
+#ifndef CPU_ONLY
+    CUDA_CHECK(cudaGetDevice(&device));
+#endif
+    for (int i = 0; i < threads; ++i) {
+      workers_.create_thread(boost::bind(&Scheduler::Work, this, device,
+          caffe_rng_rand(), Caffe::solver_count(), Caffe::root_solver(),
+          Caffe::cpu_threads()));
+    }
+  }
+
+  ~Scheduler() {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stop_ = true;
+    }
+    ready_.notify_all();
+    workers_.join_all();
+  }
+
+  // Forward from start to end, or backward from start down to end
+  Dtype Run(int start, int end, bool backward) {
+    boost::mutex::scoped_lock lock(mutex_);
+    mode_ = Caffe::mode();
+    backward_ = backward;
+    first_ = backward ? end : start;
+    last_ = backward ? start : end;
+    remaining_ = last_ - first_ + 1;
+    for (int i = first_; i <= last_; ++i) {
+      const vector<int>& before = backward ?
+          net_->layer_dependents_[i] : net_->layer_deps_[i];
+      pending_[i] = 0;
+      for (int j = 0; j < before.size(); ++j) {
+        pending_[i] += before[j] >= first_ && before[j] <= last_;
+      }
+      finished_[i] = false;
+      if (!pending_[i]) {
+        queue_.push_back(i);
+      }
+    }
+    ready_.notify_all();
+    int next = start;
+    while (remaining_ > 0 || (backward && next >= end)) {
+      if (backward && finished_[next]) {
+        int done = next;
+        while (done >= end && finished_[done]) {
+          --done;
+        }
+        lock.unlock();
+        for (; next > done; --next) {
+          for (int c = 0; c < net_->after_backward_.size(); ++c) {
+            net_->after_backward_[c]->run(next);
+          }
+        }
+        lock.lock();
+        continue;
+      }
+      done_.wait(lock);
+    }
+    Dtype loss = 0;
+    for (int i = start; !backward && i <= end; ++i) {
+      loss += losses_[i];
+    }
+    return loss;
+  }
+
+ protected:
+  void Work(int device, int rand_seed, int solver_count, bool root_solver,
+            int cpu_threads) {
+#ifndef CPU_ONLY
+    CUDA_CHECK(cudaSetDevice(device));
+    Caffe::set_tensor_op_math(net_->tensor_op_math_);
+#endif
+    Caffe::set_random_seed(rand_seed);
+    Caffe::set_solver_count(solver_count);
+    Caffe::set_root_solver(root_solver);
+    Caffe::set_cpu_threads(cpu_threads);
+    boost::mutex::scoped_lock lock(mutex_);
+    while (true) {
+      while (queue_.empty() && !stop_) {
+        ready_.wait(lock);
+      }
+      if (stop_) {
+        return;
+      }
+      const int i = queue_.front();
+      queue_.pop_front();
+      const bool backward = backward_;
+      Caffe::set_mode(mode_);
+      lock.unlock();
+      Dtype loss = 0;
+      if (!backward) {
+        loss = net_->ForwardLayer(i);
+      } else if (net_->layer_need_backward_[i]) {
+        net_->layers_[i]->Backward(net_->top_vecs_[i],
+            net_->bottom_need_backward_[i], net_->bottom_vecs_[i]);
+      }
+#ifndef CPU_ONLY
+      // The next layers may be issued to the streams of other threads
+      if (Caffe::mode() == Caffe::GPU) {
+        CUDA_CHECK(cudaStreamSynchronize(0));
+      }
+#endif
+      lock.lock();
+      losses_[i] = loss;
+      finished_[i] = true;
+      --remaining_;
+      const vector<int>& after = backward ?
+          net_->layer_deps_[i] : net_->layer_dependents_[i];
+      for (int j = 0; j < after.size(); ++j) {
+        const int k = after[j];
+        if (k >= first_ && k <= last_ && !--pending_[k]) {
+          queue_.push_back(k);
+          ready_.notify_one();
+        }
+      }
+      done_.notify_one();
+    }
+  }
+
+  Net* net_;
+  boost::mutex mutex_;
+  boost::condition_variable ready_;
+  boost::condition_variable done_;
+  std::deque<int> queue_;
+  vector<int> pending_;
+  vector<bool> finished_;
+  vector<Dtype> losses_;
+  Caffe::Brew mode_;
+  bool backward_;
+  int first_;
+  int last_;
+  int remaining_;
+  bool stop_;
+  boost::thread_group workers_;
+};
+
 template <typename Dtype>
 Net<Dtype>::Net(const NetParameter& param, const Net* root_net)
     : root_net_(root_net) {
@@ -31,28 +241,200 @@ template <typename Dtype>
 Net<Dtype>::Net(const string& param_file, Phase phase, const Net* root_net)
     : root_net_(root_net) {
   NetParameter param;
-  ReadNetParamsFromTextFileOrDie(param_file, &param);
-  param.mutable_state()->set_phase(phase);
+  if (!ReadCachedNet(param_file, phase, &param)) {
+    NetParameter in_param;
+    ReadNetParamsFromTextFileOrDie(param_file, &in_param);
+    in_param.mutable_state()->set_phase(phase);
+    Compile(in_param, &param);
+    CacheNet(param_file, phase, param);
+  }
   Init(param);
 }
 
 template <typename Dtype>
-void Net<Dtype>::Init(const NetParameter& in_param) {
-  CHECK(Caffe::root_solver() || root_net_)
-      << "root_net_ needs to be set for all non-root solvers";
-  // Set phase from the state.
-  phase_ = in_param.state().phase();
+Net<Dtype>::~Net() {
+#ifndef CPU_ONLY
+  if (stream_) {
+    CUDA_CHECK(cudaStreamDestroy(stream_));
+  }
+  if (offload_stream_) {
+    CUDA_CHECK(cudaStreamSynchronize(offload_stream_));
+    for (int i = 0; i < offload_pull_events_.size(); ++i) {
+      CUDA_CHECK(cudaEventDestroy(offload_pull_events_[i]));
+      CUDA_CHECK(cudaEventDestroy(offload_push_events_[i]));
+    }
+    CUDA_CHECK(cudaEventDestroy(offload_event_));
+    CUDA_CHECK(cudaStreamDestroy(offload_stream_));
+  }
+  if (placement_stream_) {
+    CUDA_CHECK(cudaStreamSynchronize(placement_stream_));
+    for (int i = 0; i < placement_events_.size(); ++i) {
+      CUDA_CHECK(cudaEventDestroy(placement_events_[i]));
+    }
+    CUDA_CHECK(cudaEventDestroy(placement_event_));
+    CUDA_CHECK(cudaStreamDestroy(placement_stream_));
+  }
+#endif
+}
+
+// Whether a layer's top does not keep the memory it was given, as it shares
+// or replaces it
+static bool ReplacesTop(const LayerParameter& layer_param) {
+  const string& type = layer_param.type();
+  return type == "Data" || type == "ImageData" || type == "MemoryData"
+      || type == "Flatten" || type == "Reshape" || type == "Split"
+      || type == "SoftmaxWithLoss"
+      || (type == "Slice" && layer_param.slice_param().view());
+}
+
+// Whether the layer computes on NHWC blobs in a net of that layout, given
+// whether any of its bottoms was last written NHWC
+static bool RunsNHWC(const LayerParameter& layer_param, bool nhwc_bottom) {
+  const string& type = layer_param.type();
+  if (type == "Convolution") {
+    const ConvolutionParameter& conv_param = layer_param.convolution_param();
+    return conv_param.group() == 1
+        && conv_param.engine() != ConvolutionParameter_Engine_WINOGRAD
+        && conv_param.engine() != ConvolutionParameter_Engine_DIRECT
+        && !layer_param.has_quantization_param()
+        && !layer_param.has_sparsity_param();
+  }
+  if (type == "Pooling") {
+    return layer_param.pooling_param().pool()
+        != PoolingParameter_PoolMethod_STOCHASTIC;
+  }
+  return nhwc_bottom && (type == "ReLU" || type == "Eltwise"
+      || (type == "Concat" && !layer_param.concat_param().view()));
+}
+
+// A name no blob of the net has, added to the names
+static string UniqueName(const string& name, set<string>* names) {
+  string unique = name;
+  for (int i = 1; !names->insert(unique).second; ++i) {
+    ostringstream numbered;
+    numbered << name << "_" << i;
+    unique = numbered.str();
+  }
+  return unique;
+}
+
+static void AddLayout(const string& bottom, const string& top, Layout layout,
+    NetParameter* param) {
+  LayerParameter* layer_param = param->add_layer();
+  layer_param->set_name(top + "_layout");
+  layer_param->set_type("Layout");
+  layer_param->add_bottom(bottom);
+  layer_param->add_top(top);
+  layer_param->mutable_layout_param()->set_layout(layout);
+}
+
+// Checks that the memory made a view of, or into, by the Concat and Slice
+// layers with view set is only computed and read through the view: blobs
+// they view must be written by a layer keeping its top, then only in place,
+// and not be read by any other layer.
+static void CheckViews(const NetParameter& param) {
+  for (int i = 0; i < param.layer_size(); ++i) {
+    const LayerParameter& layer_param = param.layer(i);
+    const bool concat = layer_param.type() == "Concat"
+        && layer_param.concat_param().view();
+    const bool slice = layer_param.type() == "Slice"
+        && layer_param.slice_param().view();
+    if (!concat && !slice) {
+      continue;
+    }
+    CHECK(!param.reuse_activations() && !layer_param.recompute()
+          && !layer_param.offload()) << layer_param.name()
+        << ": views cannot be used with reuse_activations, recompute or "
+        << "offload";
+    set<string> viewed;
+    for (int j = 0; j < (concat ? layer_param.bottom_size() : 1); ++j) {
+      const string& blob_name = layer_param.bottom(j);
+      CHECK(viewed.insert(blob_name).second) << layer_param.name()
+          << ": cannot view " << blob_name << " more than once";
+      for (int k = 0; k < param.layer_size(); ++k) {
+        const LayerParameter& other = param.layer(k);
+        bool reads = false;
+        bool writes = false;
+        for (int b = 0; b < other.bottom_size(); ++b) {
+          reads = reads || other.bottom(b) == blob_name;
+        }
+        for (int t = 0; t < other.top_size(); ++t) {
+          writes = writes || other.top(t) == blob_name;
+        }
+        if (k == i || (!reads && !writes)) {
+          continue;
+        }
+        CHECK(k < i && writes) << layer_param.name() << ": " << blob_name
+            << " cannot be read by " << other.name() << " out of place";
+        CHECK(reads || !ReplacesTop(other)) << layer_param.name()
+            << ": " << other.type() << " layer " << other.name()
+            << " does not write its top in place of a view";
+        CHECK(!other.recompute() && !other.offload()) << layer_param.name()
+            << ": " << blob_name << " cannot be recomputed or offloaded";
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::Compile(const NetParameter& in_param,
+    NetParameter* compiled) {
+  CHECK(!in_param.compiled()) << "Net " << in_param.name()
+      << " is already compiled";
   // Filter layers based on their include/exclude rules and
   // the current NetState.
   NetParameter filtered_param;
   FilterNet(in_param, &filtered_param);
+  if (in_param.fuse_elementwise()) {
+    // Before planning in place, which would make the chains in place
+    NetParameter unfused_param;
+    unfused_param.Swap(&filtered_param);
+    FuseElementwise(unfused_param, &filtered_param);
+  }
+  map<string, string> aliases;
+  if (in_param.auto_in_place()) {
+    NetParameter planned_param;
+    PlanInPlace(filtered_param, &planned_param, &aliases);
+    filtered_param.Swap(&planned_param);
+  }
+  if (in_param.fuse_relu()) {
+    NetParameter unfused_param;
+    unfused_param.Swap(&filtered_param);
+    FuseReLU(unfused_param, &filtered_param);
+  }
+  CheckViews(filtered_param);
   if (Caffe::root_solver()) {
     LOG(INFO) << "Initializing net from parameters: " << std::endl
               << filtered_param.DebugString();
   }
   // Create a copy of filtered_param with splits added where necessary.
+  NetParameter layout_param;
+  InsertLayouts(filtered_param, &layout_param, &aliases);
+  NetParameter split_param;
+  InsertSplits(layout_param, &split_param);
+  InsertTransfers(split_param, compiled, &aliases);
+  compiled->set_compiled(true);
+  for (map<string, string>::const_iterator it = aliases.begin();
+      it != aliases.end(); ++it) {
+    BlobAlias* alias = compiled->add_alias();
+    alias->set_name(it->first);
+    alias->set_blob(it->second);
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::Init(const NetParameter& in_param) {
+  CHECK(Caffe::root_solver() || root_net_)
+      << "root_net_ needs to be set for all non-root solvers";
+  net_param_ = in_param;
+  // Set phase from the state.
+  phase_ = in_param.state().phase();
   NetParameter param;
-  InsertSplits(filtered_param, &param);
+  if (in_param.compiled()) {
+    param = in_param;
+  } else {
+    Compile(in_param, &param);
+  }
   // Basically, build all the layers and set up their connections.
   name_ = param.name();
   map<string, int> blob_name_to_idx;
@@ -73,6 +455,18 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
     const int layer_id = -1;  // inputs have fake layer ID -1
     AppendTop(param, layer_id, input_id, &available_blobs, &blob_name_to_idx);
   }
+  micro_batch_ = 0;
+  if (param.micro_batch() > 0) {
+    if (phase_ != TEST || param.static_shapes() || param.has_pipeline()) {
+      LOG(INFO) << "Ignoring micro_batch, as it only applies to TEST nets "
+                << "without static_shapes or pipeline";
+    } else {
+      micro_batch_ = param.micro_batch();
+    }
+  }
+  // The layers are set up for a micro-batch
+  vector<vector<int> > input_shapes;
+  ClampInputs(&input_shapes);
   DLOG_IF(INFO, Caffe::root_solver())
       << "Memory required for data: " << memory_used_ * sizeof(Dtype);
   // For each layer, set up its input and output
@@ -82,6 +476,17 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
   param_id_vecs_.resize(param.layer_size());
   top_id_vecs_.resize(param.layer_size());
   bottom_need_backward_.resize(param.layer_size());
+  // The stages of the pipeline, set up each on the thread of its GPU
+  const PipelineParameter& pipeline = param.pipeline();
+  stage_begin_.assign(1, 0);
+  layer_stages_.clear();
+  staged_ = pipeline.stage_begin_size() > 0 && Caffe::mode() == Caffe::GPU;
+  if (staged_) {
+    CHECK_EQ(pipeline.device_size(), pipeline.stage_begin_size() + 1)
+        << "Each pipeline stage needs a device";
+    CHECK(Caffe::root_solver() && !root_net_)
+        << "Pipelined nets cannot be shared by several solvers";
+  }
   for (int layer_id = 0; layer_id < param.layer_size(); ++layer_id) {
     // For non-root solvers, whether this layer is shared from root_net_.
     bool share_from_root = !Caffe::root_solver()
@@ -90,8 +495,18 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
     if (!param.layer(layer_id).has_phase()) {
       param.mutable_layer(layer_id)->set_phase(phase_);
     }
+    if (!param.layer(layer_id).has_approximate_math()) {
+      param.mutable_layer(layer_id)->set_approximate_math(
+          param.approximate_math());
+    }
     // Setup layer.
     const LayerParameter& layer_param = param.layer(layer_id);
+    const int stage = stage_begin_.size() - 1;
+    if (stage < pipeline.stage_begin_size()
+        && layer_param.name() == pipeline.stage_begin(stage)) {
+      stage_begin_.push_back(layer_id);
+    }
+    layer_stages_.push_back(stage_begin_.size() - 1);
     if (layer_param.propagate_down_size() > 0) {
       CHECK_EQ(layer_param.propagate_down_size(),
           layer_param.bottom_size())
@@ -148,9 +563,16 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
             << this_top[top_id]->shape_string() <<  ") for shared layer "
             << layer_param.name();
       }
+    } else if (staged_) {
+      // From the random generator of this thread, for reproducible fillers
+      const int device = pipeline.device(layer_stages_[layer_id]);
+      DeviceThread::Get(device)->RunAndWait(boost::bind(&Net::SetUpLayer,
+          this, layer_id, caffe_rng_rand()));
     } else {
       layers_[layer_id]->SetUp(bottom_vecs_[layer_id], top_vecs_[layer_id]);
+      SelectEngine(layer_id);
     }
+    layer = layers_[layer_id].get();
     if (Caffe::root_solver()) {
       LOG(INFO) << "Setting up " << layer_names_[layer_id];
     }
@@ -178,18 +600,18 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
     const int num_param_blobs = layers_[layer_id]->blobs().size();
     CHECK_LE(param_size, num_param_blobs)
         << "Too many params specified for layer " << layer_param.name();
-    ParamSpec default_param_spec;
     for (int param_id = 0; param_id < num_param_blobs; ++param_id) {
-      const ParamSpec* param_spec = (param_id < param_size) ?
-          &layer_param.param(param_id) : &default_param_spec;
-      const bool param_need_backward = param_spec->lr_mult() > 0;
+      AppendParam(param, layer_id, param_id);
+    }
+    for (int param_id = 0; param_id < num_param_blobs; ++param_id) {
+      // The lr_mult of the owner for shared params without their own
+      const int net_param_id = param_id_vecs_[layer_id][param_id];
+      const bool param_need_backward =
+          params_lr_[learnable_param_ids_[net_param_id]] > 0;
       need_backward |= param_need_backward;
       layers_[layer_id]->set_param_propagate_down(param_id,
                                                   param_need_backward);
     }
-    for (int param_id = 0; param_id < num_param_blobs; ++param_id) {
-      AppendParam(param, layer_id, param_id);
-    }
     // Finally, set the backward flag
     layer_need_backward_.push_back(need_backward);
     if (need_backward) {
@@ -276,6 +698,12 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
       }
     }
   }
+  FreezeParams(param.force_backward());
+  CHECK_EQ(stage_begin_.size(), pipeline.stage_begin_size() + 1)
+      << "Layer " << pipeline.stage_begin(stage_begin_.size() - 1)
+      << " beginning a pipeline stage not found";
+  stage_begin_.push_back(layers_.size());
+  SetUpStages(param);
   // In the end, all remaining blobs are considered output blobs.
   for (set<string>::iterator it = available_blobs.begin();
       it != available_blobs.end(); ++it) {
@@ -288,17 +716,324 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
   for (size_t blob_id = 0; blob_id < blob_names_.size(); ++blob_id) {
     blob_names_index_[blob_names_[blob_id]] = blob_id;
   }
+  for (int i = 0; i < param.alias_size(); ++i) {
+    blob_names_index_[param.alias(i).name()] =
+        blob_names_index_[param.alias(i).blob()];
+  }
   for (size_t layer_id = 0; layer_id < layer_names_.size(); ++layer_id) {
     layer_names_index_[layer_names_[layer_id]] = layer_id;
   }
   ShareWeights();
+  // The params all of whose layers give the rows their gradients touch
+  params_sparse_.assign(learnable_params_.size(), !staged_);
+  for (int i = 0; i < params_.size(); ++i) {
+    const pair<int, int>& index = param_layer_indices_[i];
+    if (!layers_[index.first]->param_rows(index.second)) {
+      params_sparse_[learnable_param_ids_[i]] = false;
+    }
+  }
+  param_rows_.assign(learnable_params_.size(), vector<int>());
+  // Trained params on a single device, see PlaceStageParams
+  if (phase_ == TRAIN && !staged_) {
+    LayOutParams();
+  }
   debug_info_ = param.debug_info();
+  profile_ = false;
+  fail_on_transfer_ = false;
+  reuse_activations_ = param.reuse_activations() && phase_ == TEST;
+  dedup_weights_ = param.dedup_weights() && phase_ == TEST;
+  if (reuse_activations_ && staged_) {
+    LOG(INFO) << "Ignoring reuse_activations, as the blobs of different "
+              << "pipeline stages are on different devices";
+    reuse_activations_ = false;
+  }
+  if (param.accumulate_split_diffs()) {
+    if (param.branch_threads() > 1 || reuse_activations_) {
+      LOG(INFO) << "Ignoring accumulate_split_diffs, as layers reading the "
+                << "same blob could run at the same time or share diffs";
+    } else {
+      AccumulateSplitDiffs();
+    }
+  }
+  ReuseActivations();
+  SetUpRecompute();
+  static_shapes_ = param.static_shapes();
+  TrackShapes();
+#ifndef CPU_ONLY
+  // Before the branch threads, which take it up
+  tensor_op_math_ = param.tensor_op_math();
+  offload_stream_ = 0;
+  offload_event_ = 0;
+  placement_stream_ = 0;
+  placement_event_ = 0;
+#endif
+  if (staged_ && (param.branch_threads() > 1 || param.cuda_stream())) {
+    LOG(INFO) << "Ignoring branch_threads and cuda_stream, as the pipeline "
+              << "stages run on the threads of their devices";
+  }
+  SetUpCachedLayers();
+  SetUpOffload();
+  SetUpPlacement();
+  SetUpBranches(staged_ ? 1 : param.branch_threads());
+#ifndef CPU_ONLY
+  stream_ = 0;
+  if (param.cuda_stream() && Caffe::mode() == Caffe::GPU && !staged_) {
+    CUDA_CHECK(cudaStreamCreate(&stream_));
+  }
+#endif
+  SetUpInputBuckets(param);
+  SetUpExits(param);
+  RestoreInputs(input_shapes);
   if (Caffe::root_solver()) {
     LOG(INFO) << "Network initialization done.";
     LOG(INFO) << "Memory required for data: " << memory_used_ * sizeof(Dtype);
   }
 }
 
+template <typename Dtype>
+void Net<Dtype>::SetUpLayer(int layer_id, unsigned int seed) {
+  Caffe::set_random_seed(seed);
+  layers_[layer_id]->SetUp(bottom_vecs_[layer_id], top_vecs_[layer_id]);
+  SelectEngine(layer_id);
+}
+
+// The engine set in the param of a layer EngineCandidates gives
+static int EngineOf(const LayerParameter& layer_param) {
+  return layer_param.type() == "Pooling" ? layer_param.pooling_param().engine()
+      : layer_param.convolution_param().engine();
+}
+
+static string EngineName(const LayerParameter& layer_param) {
+  return layer_param.type() == "Pooling" ?
+      PoolingParameter_Engine_Name(layer_param.pooling_param().engine()) :
+      ConvolutionParameter_Engine_Name(
+          layer_param.convolution_param().engine());
+}
+
+template <typename Dtype>
+void Net<Dtype>::SelectEngine(int layer_id) {
+  // Passes timed after the first, which warms up
+  const int kTimedPasses = 3;
+  const LayerParameter& layer_param = layers_[layer_id]->layer_param();
+  const vector<LayerParameter> candidates =
+      EngineCandidates<Dtype>(layer_param);
+  if (candidates.size() < 2) {
+    return;
+  }
+  const vector<Blob<Dtype>*>& bottom = bottom_vecs_[layer_id];
+  const vector<Blob<Dtype>*>& top = top_vecs_[layer_id];
+  // The params the engines depend on, without those naming the layer
+  LayerParameter key_param(layer_param);
+  key_param.clear_name();
+  key_param.clear_bottom();
+  key_param.clear_top();
+  key_param.clear_param();
+  key_param.clear_blobs();
+  key_param.clear_include();
+  key_param.clear_exclude();
+  key_param.clear_loss_weight();
+  key_param.clear_propagate_down();
+  string params = key_param.ShortDebugString();
+  std::replace(params.begin(), params.end(), ' ', '_');
+  ostringstream key;
+  key << sizeof(Dtype) << ":";
+  if (Caffe::mode() == Caffe::GPU) {
+    int device = 0;
+#ifndef CPU_ONLY
+    CUDA_CHECK(cudaGetDevice(&device));
+#endif
+    key << "device" << device;
+  } else {
+    key << "cpu" << Caffe::cpu_threads();
+  }
+  bool nhwc = false;
+  for (int i = 0; i < bottom.size(); ++i) {
+    key << ":" << (bottom[i]->layout() == NHWC ? "nhwc" : "nchw");
+    for (int j = 0; j < bottom[i]->num_axes(); ++j) {
+      key << (j ? "x" : "") << bottom[i]->shape(j);
+    }
+    nhwc |= bottom[i]->layout() == NHWC;
+  }
+  key << ":" << params;
+  int engine;
+  int best = -1;
+  if (GetCachedEngine(key.str(), &engine)) {
+    for (int c = 0; c < candidates.size(); ++c) {
+      if (EngineOf(candidates[c]) == engine) {
+        best = c;
+      }
+    }
+  }
+  if (best < 0) {
+    // Constant inputs of the shapes of the layer's, leaving the net's blobs
+    // as they are
+    vector<shared_ptr<Blob<Dtype> > > blobs;
+    vector<Blob<Dtype>*> time_bottom;
+    vector<Blob<Dtype>*> time_top;
+    for (int i = 0; i < bottom.size(); ++i) {
+      blobs.push_back(shared_ptr<Blob<Dtype> >(
+          new Blob<Dtype>(bottom[i]->shape())));
+      blobs.back()->set_layout(bottom[i]->layout());
+      caffe_set(blobs.back()->count(), Dtype(1),
+          blobs.back()->mutable_cpu_data());
+      time_bottom.push_back(blobs.back().get());
+    }
+    for (int i = 0; i < top.size(); ++i) {
+      blobs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+      time_top.push_back(blobs.back().get());
+    }
+    const bool backward = phase_ == TRAIN;
+    const vector<bool> propagate_down(bottom.size(), true);
+    float best_ms = 0;
+    for (int c = 0; c < candidates.size(); ++c) {
+      shared_ptr<Layer<Dtype> > layer =
+          LayerRegistry<Dtype>::CreateLayer(candidates[c]);
+      if (nhwc && !layer->AllowNHWC()) {
+        continue;
+      }
+      // Copies of the weights, so that setting up fills nothing and the
+      // gradients do not reach the net's
+      for (int i = 0; i < layers_[layer_id]->blobs().size(); ++i) {
+        layer->blobs().push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+        layer->blobs().back()->CopyFrom(*layers_[layer_id]->blobs()[i],
+            false, true);
+      }
+      layer->SetUp(time_bottom, time_top);
+      Timer timer;
+      for (int pass = 0; pass <= kTimedPasses; ++pass) {
+        if (pass == 1) {
+          timer.Start();
+        }
+        layer->Forward(time_bottom, time_top);
+        if (backward) {
+          if (pass == 0) {
+            for (int i = 0; i < time_top.size(); ++i) {
+              caffe_set(time_top[i]->count(), Dtype(1),
+                  time_top[i]->mutable_cpu_diff());
+            }
+          }
+          layer->Backward(time_top, propagate_down, time_bottom);
+        }
+      }
+      timer.Stop();
+      // Microseconds, as the CPU timer counts whole milliseconds
+      const float ms = timer.MicroSeconds() / 1000 / kTimedPasses;
+      if (Caffe::root_solver()) {
+        LOG(INFO) << "Layer " << layer_param.name() << " takes " << ms
+                  << " ms with engine " << EngineName(candidates[c]);
+      }
+      if (best < 0 || ms < best_ms) {
+        best = c;
+        best_ms = ms;
+      }
+    }
+    CHECK_GE(best, 0) << "No engine of layer " << layer_param.name()
+                      << " takes its bottoms";
+    CacheEngine(key.str(), EngineOf(candidates[best]));
+  }
+  if (Caffe::root_solver()) {
+    LOG(INFO) << "Layer " << layer_param.name() << " runs engine "
+              << EngineName(candidates[best]);
+  }
+  if (best == 0) {
+    // The factory's default, which the layer already is
+    return;
+  }
+  shared_ptr<Layer<Dtype> > layer =
+      LayerRegistry<Dtype>::CreateLayer(candidates[best]);
+  layer->blobs() = layers_[layer_id]->blobs();
+  layer->SetUp(bottom, top);
+  layers_[layer_id] = layer;
+}
+
+template <typename Dtype>
+void Net<Dtype>::SetUpStages(const NetParameter& param) {
+  const int num_layers = layers_.size();
+  for (int layer_id = 1; layer_id < num_layers; ++layer_id) {
+    CHECK(layer_stages_[layer_id] == layer_stages_[layer_id - 1]
+          || !layers_[layer_id]->layer_param().recompute()
+          || !layers_[layer_id - 1]->layer_param().recompute())
+        << "The recompute segment of layer " << layer_names_[layer_id]
+        << " spans two pipeline stages";
+  }
+  for (int i = 0; i < params_.size(); ++i) {
+    const int owner = param_owners_[i];
+    CHECK(owner < 0 || layer_stages_[param_layer_indices_[i].first]
+          == layer_stages_[param_layer_indices_[owner].first])
+        << "Param " << param_display_names_[i] << " is shared with a layer "
+        << "of another pipeline stage";
+  }
+  stage_devices_.assign(num_stages(), -1);
+  stage_outputs_.assign(num_stages(), vector<int>());
+#ifndef CPU_ONLY
+  if (!staged_) {
+    if (Caffe::mode() == Caffe::GPU) {
+      CUDA_CHECK(cudaGetDevice(&stage_devices_[0]));
+    }
+    return;
+  }
+  for (int s = 0; s < num_stages(); ++s) {
+    stage_devices_[s] = param.pipeline().device(s);
+  }
+  // The blobs the Transfer layers of later stages read, by the stage
+  // computing them
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    if (!dynamic_cast<TransferLayer<Dtype>*>(layers_[layer_id].get())
+        || !bottom_need_backward_[layer_id][0]) {
+      continue;
+    }
+    const int blob_id = bottom_id_vecs_[layer_id][0];
+    int producer = 0;
+    for (int l = 0; l < layer_id; ++l) {
+      const vector<int>& tops = top_id_vecs_[l];
+      if (std::find(tops.begin(), tops.end(), blob_id) != tops.end()) {
+        producer = layer_stages_[l];
+      }
+    }
+    stage_outputs_[producer].push_back(blob_id);
+  }
+  for (int s = 0; s < num_stages(); ++s) {
+    DeviceThread::Get(stage_devices_[s])->RunAndWait(boost::bind(
+        &Net::PlaceStageParams, this, s));
+  }
+  if (phase_ != TRAIN) {
+    return;
+  }
+  // The solver of this thread clears and updates the params of all stages
+  int device;
+  CUDA_CHECK(cudaGetDevice(&device));
+  for (int s = 0; s < num_stages(); ++s) {
+    if (stage_devices_[s] == device) {
+      continue;
+    }
+    int access;
+    CUDA_CHECK(cudaDeviceCanAccessPeer(&access, device, stage_devices_[s]));
+    CHECK(access) << "GPU " << device << " has no peer access to GPU "
+        << stage_devices_[s] << " for pipeline stage " << s;
+    const cudaError_t err = cudaDeviceEnablePeerAccess(stage_devices_[s], 0);
+    if (err == cudaErrorPeerAccessAlreadyEnabled) {
+      cudaGetLastError();
+    } else {
+      CUDA_CHECK(err);
+    }
+  }
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::PlaceStageParams(int stage) {
+  for (int i = 0; i < params_.size(); ++i) {
+    if (param_owners_[i] >= 0
+        || layer_stages_[param_layer_indices_[i].first] != stage) {
+      continue;
+    }
+    params_[i]->gpu_data();
+    if (!params_frozen_[learnable_param_ids_[i]]) {
+      params_[i]->gpu_diff();
+    }
+  }
+}
+
 template <typename Dtype>
 void Net<Dtype>::FilterNet(const NetParameter& param,
     NetParameter* param_filtered) {
@@ -330,47 +1065,482 @@ void Net<Dtype>::FilterNet(const NetParameter& param,
 }
 
 template <typename Dtype>
-bool Net<Dtype>::StateMeetsRule(const NetState& state,
-    const NetStateRule& rule, const string& layer_name) {
-  // Check whether the rule is broken due to phase.
-  if (rule.has_phase()) {
-      if (rule.phase() != state.phase()) {
-        if (Caffe::root_solver()) {
-          LOG(INFO) << "The NetState phase (" << state.phase()
-                    << ") differed from the phase (" << rule.phase()
-                    << ") specified by a rule in layer " << layer_name;
-        }
+void Net<Dtype>::FuseReLU(const NetParameter& param,
+    NetParameter* param_fused) {
+  param_fused->CopyFrom(param);
+  param_fused->clear_layer();
+  for (int i = 0; i < param.layer_size(); ++i) {
+    const LayerParameter& layer_param = param.layer(i);
+    LayerParameter* fused = param_fused->add_layer();
+    fused->CopyFrom(layer_param);
+    const bool conv = layer_param.type() == "Convolution";
+    if ((!conv && layer_param.type() != "InnerProduct")
+        || layer_param.top_size() != 1 || layer_param.loss_weight_size() > 0
+        || layer_param.convolution_param().has_fused_relu()
+        || layer_param.inner_product_param().has_fused_relu()
+        || i + 1 == param.layer_size()) {
+      continue;
+    }
+    const LayerParameter& relu_param = param.layer(i + 1);
+    if (relu_param.type() != "ReLU" || relu_param.bottom_size() != 1
+        || relu_param.top_size() != 1
+        || relu_param.bottom(0) != layer_param.top(0)
+        || relu_param.top(0) != layer_param.top(0)
+        || relu_param.loss_weight_size() > 0
+        || relu_param.propagate_down_size() > 0
+        || relu_param.recompute() != layer_param.recompute()
+        || relu_param.relu_param().negative_slope() < 0) {
+      continue;
+    }
+    if (conv) {
+      fused->mutable_convolution_param()->mutable_fused_relu()->CopyFrom(
+          relu_param.relu_param());
+    } else {
+      fused->mutable_inner_product_param()->mutable_fused_relu()->CopyFrom(
+          relu_param.relu_param());
+    }
+    if (Caffe::root_solver()) {
+      LOG(INFO) << "Fusing layer " << relu_param.name() << " into "
+                << layer_param.name();
+    }
+    ++i;
+  }
+}
+
+// Whether a layer after the one at index reads blob before a layer writes it
+// again
+static bool ReadAfter(const NetParameter& param, int index,
+    const string& blob) {
+  for (int i = index + 1; i < param.layer_size(); ++i) {
+    const LayerParameter& layer_param = param.layer(i);
+    for (int j = 0; j < layer_param.bottom_size(); ++j) {
+      if (layer_param.bottom(j) == blob) {
+        return true;
+      }
+    }
+    for (int j = 0; j < layer_param.top_size(); ++j) {
+      if (layer_param.top(j) == blob) {
         return false;
       }
+    }
   }
-  // Check whether the rule is broken due to min level.
-  if (rule.has_min_level()) {
-    if (state.level() < rule.min_level()) {
-      if (Caffe::root_solver()) {
-        LOG(INFO) << "The NetState level (" << state.level()
-                  << ") is above the min_level (" << rule.min_level()
-                  << ") specified by a rule in layer " << layer_name;
+  return false;
+}
+
+template <typename Dtype>
+void Net<Dtype>::FuseElementwise(const NetParameter& param,
+    NetParameter* param_fused) {
+  param_fused->CopyFrom(param);
+  param_fused->clear_layer();
+  for (int i = 0; i < param.layer_size(); ++i) {
+    const LayerParameter& layer_param = param.layer(i);
+    // The chain from layer i to layer last
+    int last = i;
+    if (FusedElementwiseLayer<Dtype>::IsFusible(layer_param)) {
+      while (last + 1 < param.layer_size()
+          && last + 1 - i < kMaxElementwiseOps) {
+        const LayerParameter& next = param.layer(last + 1);
+        const string& top = param.layer(last).top(0);
+        if (!FusedElementwiseLayer<Dtype>::IsFusible(next)
+            || next.bottom(0) != top || next.device() != layer_param.device()
+            || (next.top(0) != top && ReadAfter(param, last + 1, top))) {
+          break;
+        }
+        ++last;
       }
-      return false;
     }
-  }
-  // Check whether the rule is broken due to max level.
-  if (rule.has_max_level()) {
-    if (state.level() > rule.max_level()) {
-      if (Caffe::root_solver()) {
-        LOG(INFO) << "The NetState level (" << state.level()
-                  << ") is above the max_level (" << rule.max_level()
-                  << ") specified by a rule in layer " << layer_name;
+    if (last == i) {
+      param_fused->add_layer()->CopyFrom(layer_param);
+      continue;
+    }
+    LayerParameter* fused = param_fused->add_layer();
+    fused->set_name(layer_param.name());
+    fused->set_type("FusedElementwise");
+    if (layer_param.has_phase()) {
+      fused->set_phase(layer_param.phase());
+    }
+    fused->set_device(layer_param.device());
+    fused->add_bottom(layer_param.bottom(0));
+    fused->add_top(param.layer(last).top(0));
+    for (int j = i; j <= last; ++j) {
+      fused->mutable_fused_elementwise_param()->add_layer()->CopyFrom(
+          param.layer(j));
+      if (j > i) {
+        fused->set_name(fused->name() + "+" + param.layer(j).name());
       }
-      return false;
     }
+    if (Caffe::root_solver()) {
+      LOG(INFO) << "Fusing layers " << fused->name();
+    }
+    i = last;
   }
-  // Check whether the rule is broken due to stage. The NetState must
-  // contain ALL of the rule's stages to meet it.
-  for (int i = 0; i < rule.stage_size(); ++i) {
-    // Check that the NetState contains the rule's ith stage.
-    bool has_stage = false;
-    for (int j = 0; !has_stage && j < state.stage_size(); ++j) {
+}
+
+// Whether a layer computes in place correctly, its backward reading only its
+// top data, if any
+static bool AllowsInPlace(const LayerParameter& layer_param) {
+  const string& type = layer_param.type();
+  if (type == "Eltwise") {
+    return layer_param.eltwise_param().operation()
+        == EltwiseParameter_EltwiseOp_SUM;
+  }
+  return type == "ReLU" || type == "Sigmoid" || type == "TanH"
+      || type == "Exp" || type == "Dropout";
+}
+
+// Whether the backward of producer does not read the top data that layer
+// would overwrite, nor the bottom data if producer is in place
+static bool KeepsTopInPlace(const LayerParameter& producer,
+    const LayerParameter& layer_param) {
+  const string& type = producer.type();
+  const bool in_place = producer.bottom_size() > 0 && producer.top_size() > 0
+      && producer.bottom(0) == producer.top(0);
+  // Dropout keeps the sign of the values it keeps, and zeroes the gradient
+  // of the others, for which ReLU masks would differ.
+  const bool masked = layer_param.type() == "Dropout";
+  if (type == "Convolution" || type == "InnerProduct") {
+    return masked || (!producer.convolution_param().has_fused_relu()
+        && !producer.inner_product_param().has_fused_relu());
+  }
+  if (type == "ReLU") {
+    return masked || !in_place;
+  }
+  if (type == "Eltwise") {
+    return producer.eltwise_param().operation()
+        == EltwiseParameter_EltwiseOp_SUM;
+  }
+  return type == "Deconvolution" || type == "Pooling" || type == "Concat"
+      || type == "FusedElementwise"
+      || type == "Split" || type == "Dropout" || type == "Data"
+      || type == "ImageData" || type == "HDF5Data" || type == "WindowData"
+      || type == "DummyData";
+}
+
+template <typename Dtype>
+void Net<Dtype>::PlanInPlace(const NetParameter& param,
+    NetParameter* param_in_place, map<string, string>* aliases) {
+  param_in_place->CopyFrom(param);
+  const int num_layers = param_in_place->layer_size();
+  for (int i = 0; i < num_layers; ++i) {
+    LayerParameter* layer_param = param_in_place->mutable_layer(i);
+    if (!AllowsInPlace(*layer_param) || layer_param->top_size() != 1
+        || layer_param->loss_weight_size() > 0 || layer_param->recompute()
+        || layer_param->propagate_down_size() > 0) {
+      continue;
+    }
+    const string top_name = layer_param->top(0);
+    bool in_place = false;
+    bool top_read = false;
+    for (int j = 0; j < layer_param->bottom_size(); ++j) {
+      in_place = in_place || layer_param->bottom(j) == top_name;
+    }
+    for (int j = i + 1; j < num_layers; ++j) {
+      const LayerParameter& later = param_in_place->layer(j);
+      for (int k = 0; k < later.bottom_size(); ++k) {
+        top_read = top_read || later.bottom(k) == top_name;
+      }
+    }
+    // Outputs keep blobs, and names, of their own.
+    for (int b = 0; top_read && !in_place && b < layer_param->bottom_size();
+        ++b) {
+      const string name = layer_param->bottom(b);
+      // The bottom must come from a layer, not an input of the net, be read
+      // by this layer alone, and not be written by a later layer.
+      int producer = i - 1;
+      for (; producer >= 0; --producer) {
+        const LayerParameter& earlier = param_in_place->layer(producer);
+        if (std::count(earlier.top().begin(), earlier.top().end(), name)) {
+          break;
+        }
+      }
+      int readers = 0;
+      bool rewritten = false;
+      for (int j = producer + 1; producer >= 0 && j < num_layers; ++j) {
+        const LayerParameter& other = param_in_place->layer(j);
+        readers += std::count(other.bottom().begin(), other.bottom().end(),
+            name);
+        rewritten = rewritten || (j > i && std::count(other.top().begin(),
+            other.top().end(), name) > 0);
+      }
+      if (producer < 0 || readers != 1 || rewritten) {
+        continue;
+      }
+      const LayerParameter& producer_param = param_in_place->layer(producer);
+      if (producer_param.loss_weight_size() > 0 || producer_param.recompute()
+          || !KeepsTopInPlace(producer_param, *layer_param)) {
+        continue;
+      }
+      // Eltwise computes in place on its first bottom.
+      if (b > 0) {
+        layer_param->mutable_bottom()->SwapElements(0, b);
+        EltwiseParameter* eltwise_param =
+            layer_param->mutable_eltwise_param();
+        if (eltwise_param->coeff_size() > 0) {
+          eltwise_param->mutable_coeff()->SwapElements(0, b);
+        }
+      }
+      layer_param->set_top(0, name);
+      for (int j = i + 1; j < num_layers; ++j) {
+        LayerParameter* later = param_in_place->mutable_layer(j);
+        for (int k = 0; k < later->bottom_size(); ++k) {
+          if (later->bottom(k) == top_name) {
+            later->set_bottom(k, name);
+          }
+        }
+        for (int k = 0; k < later->top_size(); ++k) {
+          if (later->top(k) == top_name) {
+            later->set_top(k, name);
+          }
+        }
+      }
+      for (map<string, string>::iterator it = aliases->begin();
+          it != aliases->end(); ++it) {
+        if (it->second == top_name) {
+          it->second = name;
+        }
+      }
+      (*aliases)[top_name] = name;
+      if (Caffe::root_solver()) {
+        LOG(INFO) << "Computing layer " << layer_param->name()
+                  << " in place on " << name;
+      }
+      in_place = true;
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::InsertTransfers(const NetParameter& param,
+    NetParameter* param_transfers, map<string, string>* aliases) {
+  param_transfers->CopyFrom(param);
+  const PipelineParameter& pipeline = param.pipeline();
+  if (pipeline.stage_begin_size() == 0) {
+    return;
+  }
+  param_transfers->clear_layer();
+  PipelineParameter* stages = param_transfers->mutable_pipeline();
+  // The blob and stage a name refers to, renamed in the later stages it is
+  // transferred to, and whether a later stage computed in place on it.
+  // Inputs are on the first stage.
+  map<string, pair<string, int> > blobs;
+  set<string> changed;
+  int stage = 0;
+  for (int i = 0; i < param.layer_size(); ++i) {
+    LayerParameter layer_param(param.layer(i));
+    bool begins = stage < pipeline.stage_begin_size()
+        && layer_param.name() == pipeline.stage_begin(stage);
+    if (begins) {
+      ++stage;
+    }
+    for (int j = 0; j < layer_param.bottom_size(); ++j) {
+      const string name = layer_param.bottom(j);
+      map<string, pair<string, int> >::iterator it = blobs.find(name);
+      pair<string, int> blob = (it == blobs.end()) ?
+          std::make_pair(name, 0) : it->second;
+      if (blob.second != stage) {
+        ostringstream renamed;
+        renamed << name << "_stage" << stage;
+        LayerParameter* transfer = param_transfers->add_layer();
+        transfer->set_name(renamed.str() + "_transfer");
+        transfer->set_type("Transfer");
+        transfer->add_bottom(blob.first);
+        transfer->add_top(renamed.str());
+        // The stage begins with its transfers
+        if (begins) {
+          stages->set_stage_begin(stage - 1, transfer->name());
+          begins = false;
+        }
+        blob = std::make_pair(renamed.str(), stage);
+        blobs[name] = blob;
+      }
+      layer_param.set_bottom(j, blob.first);
+    }
+    for (int j = 0; j < layer_param.top_size(); ++j) {
+      const string name = layer_param.top(j);
+      bool in_place = false;
+      for (int k = 0; k < param.layer(i).bottom_size(); ++k) {
+        in_place |= param.layer(i).bottom(k) == name;
+      }
+      map<string, pair<string, int> >::iterator it = blobs.find(name);
+      if (in_place && it != blobs.end()) {
+        layer_param.set_top(j, it->second.first);
+        if (it->second.first != name) {
+          changed.insert(name);
+        }
+      } else if (!in_place) {
+        blobs[name] = std::make_pair(name, stage);
+        changed.erase(name);
+      }
+    }
+    param_transfers->add_layer()->CopyFrom(layer_param);
+  }
+  CHECK_EQ(stage, pipeline.stage_begin_size()) << "Layer "
+      << pipeline.stage_begin(stage) << " beginning pipeline stage "
+      << stage + 1 << " not found after the layers of the stage before";
+  // The names of blobs computed in place by later stages refer to the
+  // copies holding the final values
+  for (set<string>::iterator it = changed.begin(); it != changed.end();
+      ++it) {
+    const string& blob = blobs[*it].first;
+    for (map<string, string>::iterator alias = aliases->begin();
+        alias != aliases->end(); ++alias) {
+      if (alias->second == *it) {
+        alias->second = blob;
+      }
+    }
+    (*aliases)[*it] = blob;
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::InsertLayouts(const NetParameter& param,
+    NetParameter* param_layouts, map<string, string>* aliases) {
+  param_layouts->CopyFrom(param);
+  if (param.layout() != NHWC) {
+    return;
+  }
+  param_layouts->clear_layer();
+  set<string> names(param.input().begin(), param.input().end());
+  for (int i = 0; i < param.layer_size(); ++i) {
+    names.insert(param.layer(i).bottom().begin(),
+        param.layer(i).bottom().end());
+    names.insert(param.layer(i).top().begin(), param.layer(i).top().end());
+  }
+  // The blobs holding the values of each name in either layout, empty when
+  // stale, and the layout last written. Inputs are NCHW. Read are the
+  // blobs some layer takes, the others being outputs of the net.
+  map<string, vector<string> > blobs;
+  map<string, Layout> written;
+  set<string> read;
+  for (int i = 0; i < param.layer_size(); ++i) {
+    LayerParameter layer_param(param.layer(i));
+    bool nhwc_bottom = false;
+    for (int j = 0; j < layer_param.bottom_size(); ++j) {
+      map<string, Layout>::iterator it = written.find(layer_param.bottom(j));
+      nhwc_bottom |= it != written.end() && it->second == NHWC;
+    }
+    const Layout layout = RunsNHWC(layer_param, nhwc_bottom) ? NHWC : NCHW;
+    for (int j = 0; j < layer_param.bottom_size(); ++j) {
+      const string name = layer_param.bottom(j);
+      if (!blobs.count(name)) {
+        blobs[name] = vector<string>(2);
+        blobs[name][NCHW] = name;
+        written[name] = NCHW;
+      }
+      vector<string>& versions = blobs[name];
+      if (versions[layout].empty()) {
+        versions[layout] = UniqueName(
+            name + (layout == NHWC ? "_nhwc" : "_nchw"), &names);
+        AddLayout(versions[written[name]], versions[layout], layout,
+            param_layouts);
+        read.insert(versions[written[name]]);
+      }
+      layer_param.set_bottom(j, versions[layout]);
+      read.insert(versions[layout]);
+    }
+    for (int j = 0; j < layer_param.top_size(); ++j) {
+      const string name = layer_param.top(j);
+      bool in_place = false;
+      for (int k = 0; k < param.layer(i).bottom_size(); ++k) {
+        in_place |= param.layer(i).bottom(k) == name;
+      }
+      vector<string>& versions = blobs[name];
+      if (in_place) {
+        layer_param.set_top(j, versions[layout]);
+      } else {
+        versions = vector<string>(2);
+        versions[layout] = name;
+      }
+      versions[layout == NHWC ? NCHW : NHWC].clear();
+      written[name] = layout;
+    }
+    param_layouts->add_layer()->CopyFrom(layer_param);
+  }
+  for (map<string, vector<string> >::iterator it = blobs.begin();
+      it != blobs.end(); ++it) {
+    const string& name = it->first;
+    const string blob = it->second[written[name]];
+    string final_blob = blob;
+    // Outputs of the net keep the NCHW order, under their own names when
+    // the net computed them under those
+    if (written[name] == NHWC && !read.count(blob)) {
+      if (blob == name) {
+        const string renamed = UniqueName(name + "_nhwc", &names);
+        for (int i = 0; i < param_layouts->layer_size(); ++i) {
+          LayerParameter* layer_param = param_layouts->mutable_layer(i);
+          for (int j = 0; j < layer_param->bottom_size(); ++j) {
+            if (layer_param->bottom(j) == name) {
+              layer_param->set_bottom(j, renamed);
+            }
+          }
+          for (int j = 0; j < layer_param->top_size(); ++j) {
+            if (layer_param->top(j) == name) {
+              layer_param->set_top(j, renamed);
+            }
+          }
+        }
+        AddLayout(renamed, name, NCHW, param_layouts);
+      } else {
+        final_blob = UniqueName(name + "_nchw", &names);
+        AddLayout(blob, final_blob, NCHW, param_layouts);
+      }
+    }
+    // The names of blobs computed in place on a copy in the other layout
+    // refer to the copy holding the final values
+    if (final_blob != name) {
+      for (map<string, string>::iterator alias = aliases->begin();
+          alias != aliases->end(); ++alias) {
+        if (alias->second == name) {
+          alias->second = final_blob;
+        }
+      }
+      (*aliases)[name] = final_blob;
+    }
+  }
+}
+
+template <typename Dtype>
+bool Net<Dtype>::StateMeetsRule(const NetState& state,
+    const NetStateRule& rule, const string& layer_name) {
+  // Check whether the rule is broken due to phase.
+  if (rule.has_phase()) {
+      if (rule.phase() != state.phase()) {
+        if (Caffe::root_solver()) {
+          LOG(INFO) << "The NetState phase (" << state.phase()
+                    << ") differed from the phase (" << rule.phase()
+                    << ") specified by a rule in layer " << layer_name;
+        }
+        return false;
+      }
+  }
+  // Check whether the rule is broken due to min level.
+  if (rule.has_min_level()) {
+    if (state.level() < rule.min_level()) {
+      if (Caffe::root_solver()) {
+        LOG(INFO) << "The NetState level (" << state.level()
+                  << ") is above the min_level (" << rule.min_level()
+                  << ") specified by a rule in layer " << layer_name;
+      }
+      return false;
+    }
+  }
+  // Check whether the rule is broken due to max level.
+  if (rule.has_max_level()) {
+    if (state.level() > rule.max_level()) {
+      if (Caffe::root_solver()) {
+        LOG(INFO) << "The NetState level (" << state.level()
+                  << ") is above the max_level (" << rule.max_level()
+                  << ") specified by a rule in layer " << layer_name;
+      }
+      return false;
+    }
+  }
+  // Check whether the rule is broken due to stage. The NetState must
+  // contain ALL of the rule's stages to meet it.
+  for (int i = 0; i < rule.stage_size(); ++i) {
+    // Check that the NetState contains the rule's ith stage.
+    bool has_stage = false;
+    for (int j = 0; !has_stage && j < state.stage_size(); ++j) {
       if (rule.stage(i) == state.stage(j)) { has_stage = true; }
     }
     if (!has_stage) {
@@ -525,6 +1695,7 @@ void Net<Dtype>::AppendParam(const NetParameter& param, const int layer_id,
     has_params_decay_.push_back(param_spec->has_decay_mult());
     params_lr_.push_back(param_spec->lr_mult());
     params_weight_decay_.push_back(param_spec->decay_mult());
+    params_shared_.push_back(layers_[layer_id]->ShareInParallel());
   } else {
     // Named param blob with name we've seen before: share params
     const int owner_net_param_id = param_names_index_[param_name];
@@ -578,162 +1749,1290 @@ template <typename Dtype>
 Dtype Net<Dtype>::ForwardFromTo(int start, int end) {
   CHECK_GE(start, 0);
   CHECK_LT(end, layers_.size());
+  if (start == 0 && !input_buckets_.empty()) {
+    PadInputs();
+  }
+  if (start == 0 && end == layers_.size() - 1 && !exit_layers_.empty()) {
+    return ForwardExits();
+  }
+  if (start == 0 && end == layers_.size() - 1 && MicroBatched()) {
+    return ForwardMicroBatches();
+  }
+  if (!staged_) {
+    return ForwardLayers(start, end);
+  }
+  // Each stage on the thread of its GPU, one after the other
   Dtype loss = 0;
-  if (debug_info_) {
-    for (int i = 0; i < net_input_blobs_.size(); ++i) {
-      InputDebugInfo(i);
+  for (int s = 0; s < num_stages(); ++s) {
+    const int first = std::max(start, stage_begin_[s]);
+    const int last = std::min(end, stage_begin_[s + 1] - 1);
+    if (first <= last) {
+      Dtype stage_loss;
+      DeviceThread::Get(stage_devices_[s])->RunAndWait(boost::bind(
+          &Net::RunForwardStage, this, s, first, last, &stage_loss));
+      loss += stage_loss;
     }
   }
-  for (int i = start; i <= end; ++i) {
-    // LOG(ERROR) << "Forwarding " << layer_names_[i];
-    Dtype layer_loss = layers_[i]->Forward(bottom_vecs_[i], top_vecs_[i]);
-    loss += layer_loss;
-    if (debug_info_) { ForwardDebugInfo(i); }
-  }
   return loss;
 }
 
 template <typename Dtype>
-Dtype Net<Dtype>::ForwardFrom(int start) {
-  return ForwardFromTo(start, layers_.size() - 1);
-}
-
-template <typename Dtype>
-Dtype Net<Dtype>::ForwardTo(int end) {
-  return ForwardFromTo(0, end);
-}
-
-template <typename Dtype>
-const vector<Blob<Dtype>*>& Net<Dtype>::ForwardPrefilled(Dtype* loss) {
-  if (loss != NULL) {
-    *loss = ForwardFromTo(0, layers_.size() - 1);
-  } else {
-    ForwardFromTo(0, layers_.size() - 1);
+bool Net<Dtype>::MicroBatched() const {
+  // The loss on the device would add up rather than average
+  if (!micro_batch_ || net_input_blobs_.empty() || device_loss_) {
+    return false;
   }
-  return net_output_blobs_;
-}
-
-template <typename Dtype>
-const vector<Blob<Dtype>*>& Net<Dtype>::Forward(
-    const vector<Blob<Dtype>*> & bottom, Dtype* loss) {
-  // Copy bottom to internal bottom
-  for (int i = 0; i < bottom.size(); ++i) {
-    net_input_blobs_[i]->CopyFrom(*bottom[i]);
+  for (int i = 0; i < net_input_blobs_.size(); ++i) {
+    const Blob<Dtype>& input = *net_input_blobs_[i];
+    if (!input.num_axes() || input.shape(0) <= micro_batch_
+        || input.shape(0) != net_input_blobs_[0]->shape(0)) {
+      return false;
+    }
   }
-  return ForwardPrefilled(loss);
+  return true;
 }
 
 template <typename Dtype>
-string Net<Dtype>::Forward(const string& input_blob_protos, Dtype* loss) {
-  BlobProtoVector blob_proto_vec;
-  if (net_input_blobs_.size()) {
-    blob_proto_vec.ParseFromString(input_blob_protos);
-    CHECK_EQ(blob_proto_vec.blobs_size(), net_input_blobs_.size())
-        << "Incorrect input size.";
-    for (int i = 0; i < blob_proto_vec.blobs_size(); ++i) {
-      net_input_blobs_[i]->FromProto(blob_proto_vec.blobs(i));
+Dtype Net<Dtype>::ForwardMicroBatches() {
+  const int num = net_input_blobs_[0]->shape(0);
+  // The inputs keep their storage in holders, of which each micro-batch is
+  // a view.
+  vector<shared_ptr<Blob<Dtype> > > inputs(net_input_blobs_.size());
+  for (int i = 0; i < inputs.size(); ++i) {
+    inputs[i].reset(new Blob<Dtype>());
+    inputs[i]->ReshapeLike(*net_input_blobs_[i]);
+    inputs[i]->SetDataStorage(net_input_blobs_[i]->data());
+    inputs[i]->SetDiffStorage(net_input_blobs_[i]->diff());
+  }
+  // The outputs are gathered in memory of their own, which the output blobs
+  // take in the end.
+  vector<shared_ptr<Blob<Dtype> > > outputs(net_output_blobs_.size());
+  vector<bool> batched(outputs.size());
+  Dtype loss = 0;
+  for (int offset = 0; offset < num; offset += micro_batch_) {
+    const int items = std::min(micro_batch_, num - offset);
+    for (int i = 0; i < inputs.size(); ++i) {
+      net_input_blobs_[i]->ShareItems(*inputs[i], offset, offset + items);
+    }
+    loss += ForwardLayers(0, layers_.size() - 1) * items / num;
+    for (int i = 0; i < outputs.size(); ++i) {
+      const Blob<Dtype>& output = *net_output_blobs_[i];
+      if (!offset) {
+        batched[i] = output.num_axes() && output.shape(0) == items;
+        vector<int> shape = output.shape();
+        if (batched[i]) {
+          shape[0] = num;
+        }
+        outputs[i].reset(new Blob<Dtype>(shape));
+      }
+      if (batched[i]) {
+        CHECK_EQ(output.count(), items * outputs[i]->count(1))
+            << "Output " << blob_names_[net_output_blob_indices_[i]]
+            << " changed shape between micro-batches";
+        caffe_copy(output.count(), Caffe::mode() == Caffe::GPU ?
+            output.gpu_data() : output.cpu_data(),
+            (Caffe::mode() == Caffe::GPU ? outputs[i]->mutable_gpu_data() :
+            outputs[i]->mutable_cpu_data()) + offset * output.count(1));
+        continue;
+      }
+      // Averaged, weighted by the items of each micro-batch, into memory
+      // that starts zeroed
+      CHECK_EQ(output.count(), outputs[i]->count());
+      const Dtype weight = Dtype(items) / num;
+      switch (Caffe::mode()) {
+      case Caffe::CPU:
+        caffe_axpy(output.count(), weight, output.cpu_data(),
+            outputs[i]->mutable_cpu_data());
+        break;
+      case Caffe::GPU:
+#ifndef CPU_ONLY
+        caffe_gpu_axpy(output.count(), weight, output.gpu_data(),
+            outputs[i]->mutable_gpu_data());
+#else
+        NO_GPU;
+#endif
+        break;
+      }
     }
   }
-  ForwardPrefilled(loss);
-  blob_proto_vec.Clear();
-  for (int i = 0; i < net_output_blobs_.size(); ++i) {
-    net_output_blobs_[i]->ToProto(blob_proto_vec.add_blobs());
+  for (int i = 0; i < inputs.size(); ++i) {
+    net_input_blobs_[i]->ReshapeLike(*inputs[i]);
+    net_input_blobs_[i]->SetDataStorage(inputs[i]->data());
+    net_input_blobs_[i]->SetDiffStorage(inputs[i]->diff());
   }
-  string output;
-  blob_proto_vec.SerializeToString(&output);
-  return output;
+  for (int i = 0; i < outputs.size(); ++i) {
+    net_output_blobs_[i]->ReshapeLike(*outputs[i]);
+    net_output_blobs_[i]->SetDataStorage(outputs[i]->data());
+  }
+  return loss;
 }
 
 template <typename Dtype>
-void Net<Dtype>::BackwardFromTo(int start, int end) {
-  CHECK_GE(end, 0);
-  CHECK_LT(start, layers_.size());
-  for (int i = start; i >= end; --i) {
-    if (layer_need_backward_[i]) {
-      layers_[i]->Backward(
-          top_vecs_[i], bottom_need_backward_[i], bottom_vecs_[i]);
-      if (debug_info_) { BackwardDebugInfo(i); }
+void Net<Dtype>::ClampInputs(vector<vector<int> >* shapes) {
+  shapes->assign(net_input_blobs_.size(), vector<int>());
+  for (int i = 0; micro_batch_ && i < net_input_blobs_.size(); ++i) {
+    Blob<Dtype>* input = net_input_blobs_[i];
+    if (input->num_axes() && input->shape(0) > micro_batch_) {
+      (*shapes)[i] = input->shape();
+      vector<int> shape = input->shape();
+      shape[0] = micro_batch_;
+      input->Reshape(shape);
     }
   }
 }
 
 template <typename Dtype>
-void Net<Dtype>::InputDebugInfo(const int input_id) {
-  const Blob<Dtype>& blob = *net_input_blobs_[input_id];
-  const string& blob_name = blob_names_[net_input_blob_indices_[input_id]];
-  const Dtype data_abs_val_mean = blob.asum_data() / blob.count();
-  if (Caffe::root_solver()) {
-    LOG(INFO) << "    [Forward] "
-              << "Input " << blob_name << " data: " << data_abs_val_mean;
+void Net<Dtype>::RestoreInputs(const vector<vector<int> >& shapes) {
+  for (int i = 0; i < shapes.size(); ++i) {
+    if (shapes[i].size()) {
+      net_input_blobs_[i]->Reshape(shapes[i]);
+    }
   }
 }
 
 template <typename Dtype>
-void Net<Dtype>::ForwardDebugInfo(const int layer_id) {
-  for (int top_id = 0; top_id < top_vecs_[layer_id].size(); ++top_id) {
-    const Blob<Dtype>& blob = *top_vecs_[layer_id][top_id];
-    const string& blob_name = blob_names_[top_id_vecs_[layer_id][top_id]];
-    const Dtype data_abs_val_mean = blob.asum_data() / blob.count();
-    if (Caffe::root_solver()) {
-      LOG(INFO) << "    [Forward] "
-                << "Layer " << layer_names_[layer_id]
-                << ", top blob " << blob_name
-                << " data: " << data_abs_val_mean;
+void Net<Dtype>::SetUpInputBuckets(const NetParameter& param) {
+  input_buckets_.clear();
+  bucket_scratch_.clear();
+  if (!param.input_bucket_size()) {
+    return;
+  }
+  if (micro_batch_ || staged_ || reuse_activations_) {
+    LOG(INFO) << "Ignoring input_bucket, as it does not apply to micro_batch, "
+              << "pipeline or reuse_activations";
+    return;
+  }
+  input_buckets_.resize(param.input_bucket_size());
+  vector<int> scratch_count(net_input_blobs_.size(), 0);
+  for (int b = 0; b < input_buckets_.size(); ++b) {
+    const InputBucket& bucket = param.input_bucket(b);
+    CHECK_EQ(bucket.shape_size(), net_input_blobs_.size())
+        << "Each input_bucket needs a shape per input";
+    for (int i = 0; i < net_input_blobs_.size(); ++i) {
+      Blob<Dtype>* input = net_input_blobs_[i];
+      input_buckets_[b].push_back(
+          vector<int>(bucket.shape(i).dim().begin(),
+                      bucket.shape(i).dim().end()));
+      CHECK_EQ(input_buckets_[b][i].size(), input->num_axes())
+          << "The input_bucket shapes of " << blob_names_[
+          net_input_blob_indices_[i]] << " need its number of axes";
+      input->Reshape(input_buckets_[b][i]);
+      scratch_count[i] = std::max(scratch_count[i], input->count());
     }
+    // Grows the blobs and lets the layers configure for the bucket
+    Reshape();
+    LOG_IF(INFO, Caffe::root_solver())
+        << "Set up input bucket " << b << ", memory required for data: "
+        << MemoryBytes();
   }
-  for (int param_id = 0; param_id < layers_[layer_id]->blobs().size();
-       ++param_id) {
-    const Blob<Dtype>& blob = *layers_[layer_id]->blobs()[param_id];
-    const int net_param_id = param_id_vecs_[layer_id][param_id];
-    const string& blob_name = param_display_names_[net_param_id];
-    const Dtype data_abs_val_mean = blob.asum_data() / blob.count();
-    if (Caffe::root_solver()) {
-      LOG(INFO) << "    [Forward] "
-                << "Layer " << layer_names_[layer_id]
-                << ", param blob " << blob_name
-                << " data: " << data_abs_val_mean;
+  for (int i = 0; i < net_input_blobs_.size(); ++i) {
+    bucket_scratch_.push_back(shared_ptr<Blob<Dtype> >(
+        new Blob<Dtype>(vector<int>(1, scratch_count[i]))));
+    // Allocated now rather than by the first request
+    if (Caffe::mode() == Caffe::GPU) {
+      bucket_scratch_[i]->mutable_gpu_data();
+    } else {
+      bucket_scratch_[i]->mutable_cpu_data();
+    }
+  }
+  // Back to the shapes the net was declared with
+  for (int i = 0; i < net_input_blobs_.size(); ++i) {
+    if (param.input_shape_size()) {
+      net_input_blobs_[i]->Reshape(param.input_shape(i));
+    } else if (param.input_dim_size()) {
+      net_input_blobs_[i]->Reshape(param.input_dim(i * 4),
+          param.input_dim(i * 4 + 1), param.input_dim(i * 4 + 2),
+          param.input_dim(i * 4 + 3));
     }
   }
+  Reshape();
 }
 
+// Copies src into the leading corner of dst, which is at least as large
+// along each axis and zeroed, a block of rows of the last two axes at a time.
 template <typename Dtype>
-void Net<Dtype>::BackwardDebugInfo(const int layer_id) {
-  const vector<Blob<Dtype>*>& bottom_vec = bottom_vecs_[layer_id];
-  for (int bottom_id = 0; bottom_id < bottom_vec.size(); ++bottom_id) {
-    if (!bottom_need_backward_[layer_id][bottom_id]) { continue; }
-    const Blob<Dtype>& blob = *bottom_vec[bottom_id];
-    const string& blob_name = blob_names_[bottom_id_vecs_[layer_id][bottom_id]];
-    const Dtype diff_abs_val_mean = blob.asum_diff() / blob.count();
-    if (Caffe::root_solver()) {
-      LOG(INFO) << "    [Backward] "
-                << "Layer " << layer_names_[layer_id]
-                << ", bottom blob " << blob_name
-                << " diff: " << diff_abs_val_mean;
-    }
+static void PadBlob(const Blob<Dtype>& src, Blob<Dtype>* dst) {
+  const int axes = src.num_axes();
+  const int cols = axes > 0 ? src.shape(-1) : 1;
+  const int rows = axes > 1 ? src.shape(-2) : 1;
+  const int dst_cols = axes > 0 ? dst->shape(-1) : 1;
+  const int dst_rows = axes > 1 ? dst->shape(-2) : 1;
+  if (!src.count()) {
+    return;
   }
-  for (int param_id = 0; param_id < layers_[layer_id]->blobs().size();
-       ++param_id) {
-    if (!layers_[layer_id]->param_propagate_down(param_id)) { continue; }
-    const Blob<Dtype>& blob = *layers_[layer_id]->blobs()[param_id];
-    const Dtype diff_abs_val_mean = blob.asum_diff() / blob.count();
-    if (Caffe::root_solver()) {
-      LOG(INFO) << "    [Backward] "
-                << "Layer " << layer_names_[layer_id]
-                << ", param blob " << param_id
-                << " diff: " << diff_abs_val_mean;
+  const int blocks = src.count() / (rows * cols);
+  const bool gpu = Caffe::mode() == Caffe::GPU;
+  const Dtype* src_data = gpu ? src.gpu_data() : src.cpu_data();
+  Dtype* dst_data = gpu ? dst->mutable_gpu_data() : dst->mutable_cpu_data();
+  for (int block = 0; block < blocks; ++block) {
+    // The index of the block along the leading axes, in dst
+    int dst_block = 0;
+    int stride = 1;
+    for (int a = axes - 3, rest = block; a >= 0; --a) {
+      dst_block += (rest % src.shape(a)) * stride;
+      rest /= src.shape(a);
+      stride *= dst->shape(a);
+    }
+    const Dtype* from = src_data + block * rows * cols;
+    Dtype* to = dst_data + dst_block * dst_rows * dst_cols;
+    if (gpu) {
+#ifndef CPU_ONLY
+      CUDA_CHECK(cudaMemcpy2DAsync(to, dst_cols * sizeof(Dtype), from,
+          cols * sizeof(Dtype), cols * sizeof(Dtype), rows,
+          cudaMemcpyDeviceToDevice, Caffe::cuda_stream()));
+#else
+      NO_GPU;
+#endif
+    } else {
+      for (int r = 0; r < rows; ++r) {
+        caffe_copy(cols, from + r * cols, to + r * dst_cols);
+      }
     }
   }
 }
 
 template <typename Dtype>
-void Net<Dtype>::UpdateDebugInfo(const int param_id) {
-  const Blob<Dtype>& blob = *params_[param_id];
-  const int param_owner = param_owners_[param_id];
-  const string& layer_name = layer_names_[param_layer_indices_[param_id].first];
-  const string& param_display_name = param_display_names_[param_id];
-  const Dtype diff_abs_val_mean = blob.asum_diff() / blob.count();
-  if (param_owner < 0) {
-    const Dtype data_abs_val_mean = blob.asum_data() / blob.count();
+void Net<Dtype>::PadInputs() {
+  // The bucket of the fewest elements that all inputs fit
+  int best = -1;
+  size_t best_count = 0;
+  for (int b = 0; b < input_buckets_.size(); ++b) {
+    bool fits = true;
+    size_t count = 0;
+    for (int i = 0; fits && i < net_input_blobs_.size(); ++i) {
+      const vector<int>& shape = input_buckets_[b][i];
+      const Blob<Dtype>& input = *net_input_blobs_[i];
+      fits = input.num_axes() == shape.size();
+      size_t bucket_count = 1;
+      for (int a = 0; fits && a < shape.size(); ++a) {
+        fits = input.shape(a) <= shape[a];
+        bucket_count *= shape[a];
+      }
+      count += bucket_count;
+    }
+    if (fits && (best < 0 || count < best_count)) {
+      best = b;
+      best_count = count;
+    }
+  }
+  if (best < 0) {
+    LOG_FIRST_N(WARNING, 1) << "The inputs of " << name_ << " fit no "
+        << "input_bucket, running them at their own shapes";
+    return;
+  }
+  bool reshaped = false;
+  for (int i = 0; i < net_input_blobs_.size(); ++i) {
+    Blob<Dtype>* input = net_input_blobs_[i];
+    const vector<int>& shape = input_buckets_[best][i];
+    if (input->shape() == shape) {
+      continue;
+    }
+    Blob<Dtype>* scratch = bucket_scratch_[i].get();
+    scratch->ReshapeLike(*input);
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      caffe_copy(scratch->count(), input->cpu_data(),
+          scratch->mutable_cpu_data());
+      input->Reshape(shape);
+      caffe_set(input->count(), Dtype(0), input->mutable_cpu_data());
+      break;
+    case Caffe::GPU:
+#ifndef CPU_ONLY
+      caffe_copy(scratch->count(), input->gpu_data(),
+          scratch->mutable_gpu_data());
+      input->Reshape(shape);
+      caffe_gpu_set(input->count(), Dtype(0), input->mutable_gpu_data());
+#else
+      NO_GPU;
+#endif
+      break;
+    }
+    PadBlob(*scratch, input);
+    reshaped = true;
+  }
+  // The layers reshape on their own, unless their shapes are fixed.
+  if (reshaped && static_shapes_) {
+    Reshape();
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::SetUpExits(const NetParameter& param) {
+  exit_layers_.clear();
+  exit_blobs_.clear();
+  exit_thresholds_.clear();
+  exit_compacted_.clear();
+  if (!param.exit_size()) {
+    return;
+  }
+  if (phase_ != TEST || micro_batch_ || static_shapes_ || staged_ ||
+      reuse_activations_ || !offload_blobs_.empty()) {
+    LOG(INFO) << "Ignoring exit, as it only applies to TEST nets without "
+              << "micro_batch, static_shapes, pipeline, offload or "
+              << "reuse_activations";
+    return;
+  }
+  CHECK(net_output_blob_indices_.size()) << "The exits need an output";
+  // Heads of exits are outputs too, before the deepest one
+  vector<std::pair<int, int> > exits;
+  exit_output_ = -1;
+  for (int e = 0; e < param.exit_size(); ++e) {
+    const ExitParameter& exit = param.exit(e);
+    CHECK(has_blob(exit.blob())) << "Unknown exit blob " << exit.blob();
+    const int blob_id = blob_names_index_[exit.blob()];
+    int layer_id = -1;
+    for (int i = 0; i < layers_.size(); ++i) {
+      const vector<int>& tops = top_id_vecs_[i];
+      if (std::find(tops.begin(), tops.end(), blob_id) != tops.end()) {
+        layer_id = i;
+      }
+    }
+    CHECK_GE(layer_id, 0) << "The exit blob " << exit.blob()
+        << " is not computed by a layer";
+    int output_id = net_output_blob_indices_.back();
+    if (exit.has_output()) {
+      CHECK(has_blob(exit.output())) << "Unknown exit output "
+          << exit.output();
+      output_id = blob_names_index_[exit.output()];
+      CHECK(std::find(net_output_blob_indices_.begin(),
+          net_output_blob_indices_.end(), output_id) !=
+          net_output_blob_indices_.end()) << exit.output()
+          << " is not an output of the net";
+    }
+    CHECK(exit_output_ < 0 || exit_output_ == output_id)
+        << "All exits need the same output";
+    exit_output_ = output_id;
+    CHECK_EQ(blobs_[blob_id]->count(1), blobs_[output_id]->count(1))
+        << "The exit blob " << exit.blob() << " needs as many values per "
+        << "item as " << blob_names_[output_id];
+    exits.push_back(std::make_pair(layer_id, e));
+  }
+  std::sort(exits.begin(), exits.end());
+  for (int e = 0; e < exits.size(); ++e) {
+    const int layer_id = exits[e].first;
+    const ExitParameter& exit = param.exit(exits[e].second);
+    exit_layers_.push_back(layer_id);
+    exit_blobs_.push_back(blob_names_index_[exit.blob()]);
+    exit_thresholds_.push_back(exit.threshold());
+    // The inputs and the blobs computed so far that later layers read
+    vector<bool> computed(blobs_.size(), false);
+    for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+      computed[net_input_blob_indices_[i]] = true;
+    }
+    for (int i = 0; i <= layer_id; ++i) {
+      for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+        computed[top_id_vecs_[i][j]] = true;
+      }
+    }
+    vector<bool> read(blobs_.size(), false);
+    for (int i = layer_id + 1; i < layers_.size(); ++i) {
+      for (int j = 0; j < bottom_id_vecs_[i].size(); ++j) {
+        read[bottom_id_vecs_[i][j]] = true;
+      }
+    }
+    exit_compacted_.push_back(vector<int>());
+    for (int i = 0; i < blobs_.size(); ++i) {
+      if (computed[i] && read[i]) {
+        exit_compacted_.back().push_back(i);
+      }
+    }
+    LOG_IF(INFO, Caffe::root_solver()) << "Exit at " << exit.blob()
+        << " after " << layer_names_[layer_id] << " for probabilities of at "
+        << "least " << exit.threshold();
+  }
+}
+
+// Moves the given rows of a blob, in increasing order, to its first rows,
+// and shrinks its first axis to them.
+template <typename Dtype>
+static void CompactRows(const vector<int>& rows, Blob<Dtype>* blob) {
+  const int dim = blob->count(1);
+  Dtype* data = Caffe::mode() == Caffe::GPU ? blob->mutable_gpu_data() :
+      blob->mutable_cpu_data();
+  for (int k = 0; k < rows.size(); ) {
+    // Moves runs of consecutive rows at once, no longer than the distance
+    // they move so that the copies do not overlap
+    const int shift = rows[k] - k;
+    int end = k + 1;
+    while (end < rows.size() && rows[end] == rows[k] + end - k &&
+           (shift == 0 || end - k < shift)) {
+      ++end;
+    }
+    if (shift) {
+      caffe_copy((end - k) * dim, data + rows[k] * dim, data + k * dim);
+    }
+    k = end;
+  }
+  vector<int> shape(blob->shape());
+  shape[0] = rows.size();
+  blob->Reshape(shape);
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardExits() {
+  // The item of the batch of each row of the blobs
+  vector<int> items;
+  // The blobs compacted and their shapes, restored for the next pass
+  vector<std::pair<int, vector<int> > > compacted;
+  Dtype loss = 0;
+  int start = 0;
+  int num = 0;
+  for (int e = 0; e < exit_layers_.size() && start < layers_.size(); ++e) {
+    loss += ForwardLayers(start, exit_layers_[e]);
+    start = exit_layers_[e] + 1;
+    const Blob<Dtype>& probs = *blobs_[exit_blobs_[e]];
+    const int rows = probs.shape(0);
+    const int dim = probs.count(1);
+    if (e == 0) {
+      num = rows;
+      for (int i = 0; i < num; ++i) {
+        items.push_back(i);
+      }
+      exit_scratch_.ReshapeLike(probs);
+    }
+    CHECK_EQ(rows, items.size()) << "The exit blob "
+        << blob_names_[exit_blobs_[e]] << " needs a row per item";
+    const Dtype* data = probs.cpu_data();
+    Dtype* exited = exit_scratch_.mutable_cpu_data();
+    vector<int> keep;
+    for (int r = 0; r < rows; ++r) {
+      const Dtype* row = data + r * dim;
+      if (*std::max_element(row, row + dim) >= exit_thresholds_[e]) {
+        std::copy(row, row + dim, exited + items[r] * dim);
+      } else {
+        items[keep.size()] = items[r];
+        keep.push_back(r);
+      }
+    }
+    if (keep.size() == rows) {
+      continue;
+    }
+    items.resize(keep.size());
+    if (keep.empty()) {
+      start = layers_.size();
+      break;
+    }
+    for (int i = 0; i < exit_compacted_[e].size(); ++i) {
+      const int blob_id = exit_compacted_[e][i];
+      Blob<Dtype>* blob = blobs_[blob_id].get();
+      if (blob->num_axes() && blob->shape(0) == rows) {
+        compacted.push_back(std::make_pair(blob_id, blob->shape()));
+        CompactRows(keep, blob);
+      }
+    }
+  }
+  if (start < layers_.size()) {
+    loss += ForwardLayers(start, layers_.size() - 1);
+  }
+  // The output of the items that reached the end, then of all of them
+  if (items.size() < num) {
+    Blob<Dtype>* output = blobs_[exit_output_].get();
+    const int dim = exit_scratch_.count(1);
+    Dtype* exited = exit_scratch_.mutable_cpu_data();
+    const Dtype* data = output->cpu_data();
+    for (int r = 0; r < items.size(); ++r) {
+      std::copy(data + r * dim, data + (r + 1) * dim, exited + items[r] * dim);
+    }
+    vector<int> shape(output->shape());
+    shape[0] = num;
+    output->Reshape(shape);
+    std::copy(exited, exited + exit_scratch_.count(),
+              output->mutable_cpu_data());
+  }
+  // The layers before the exits write the full batch to them
+  for (int i = compacted.size() - 1; i >= 0; --i) {
+    blobs_[compacted[i].first]->Reshape(compacted[i].second);
+  }
+  return loss;
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardStage(int stage) {
+  Dtype loss;
+  RunForwardStage(stage, stage_begin_[stage], stage_begin_[stage + 1] - 1,
+                  &loss);
+  return loss;
+}
+
+template <typename Dtype>
+void Net<Dtype>::RunForwardStage(int stage, int start, int end,
+    Dtype* loss) {
+  *loss = ForwardLayers(start, end);
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    // Allocated here, rather than by the later stages copying them back
+    const vector<int>& outputs = stage_outputs_[stage];
+    for (int i = 0; i < outputs.size(); ++i) {
+      Blob<Dtype>* blob = blobs_[outputs[i]].get();
+      if (blob->diff()->head() == SyncedMemory::UNINITIALIZED) {
+        blob->mutable_gpu_diff();
+      }
+    }
+    // Later stages copy the outputs from their own streams
+    CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+  }
+#endif
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardLayers(int start, int end, bool recompute) {
+#ifndef CPU_ONLY
+  StreamScope scope(stream_, tensor_op_math_);
+#endif
+  for (int i = 0; static_shapes_ && i < net_input_blob_indices_.size(); ++i) {
+    const int blob_id = net_input_blob_indices_[i];
+    CHECK(blobs_[blob_id]->shape() == static_blob_shapes_[blob_id])
+        << "With static_shapes, call Reshape after reshaping the input "
+        << blob_names_[blob_id];
+  }
+  if (scheduler_ && !debug_info_ && !profile_ && !fail_on_transfer_) {
+    return scheduler_->Run(start, end, false);
+  }
+  Dtype loss = 0;
+  if (debug_info_) {
+    for (int i = 0; i < net_input_blobs_.size(); ++i) {
+      InputDebugInfo(i);
+    }
+  }
+  // The layers without a device follow the mode
+  if (placement_mode_ != Caffe::mode()) {
+    SetUpPlacement();
+  }
+  const bool placed = !placement_pending_.empty();
+  for (int i = start; i <= end; ++i) {
+    if (cached_by_[i] >= 0 && layers_[cached_by_[i]]->BottomsCached()) {
+      continue;
+    }
+    // LOG(ERROR) << "Forwarding " << layer_names_[i];
+    const bool offload = !offload_blobs_.empty() && !recompute;
+    if (offload) { OffloadForward(i, false); }
+    if (placed) { PlacementWait(i); }
+    if (fail_on_transfer_) { CaffeFailOnTransfer(layer_names_[i].c_str()); }
+    if (profile_) { ProfileStart(i, false); }
+    Dtype layer_loss = ForwardLayer(i, recompute);
+    if (profile_) { ProfileStop(i, false); }
+    if (fail_on_transfer_) { CaffeFailOnTransfer(NULL); }
+    loss += layer_loss;
+    if (debug_info_) { ForwardDebugInfo(i); }
+    if (offload) { OffloadForward(i, true); }
+    if (placed) { PlacementCopy(i, placement_data_[i], false); }
+  }
+  if (placed) { PlacementDone(); }
+  return loss;
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardLayer(const int layer_id, bool recompute) {
+  Dtype* gpu_loss = NULL;
+  if (device_loss_ && !recompute && layers_[layer_id]->mode() == Caffe::GPU) {
+    gpu_loss = device_loss_->mutable_gpu_data();
+  }
+  if (!LayerNeedsReshape(layer_id)) {
+    return layers_[layer_id]->ForwardReshaped(bottom_vecs_[layer_id],
+                                              top_vecs_[layer_id], gpu_loss);
+  }
+  const Dtype loss = layers_[layer_id]->Forward(bottom_vecs_[layer_id],
+      top_vecs_[layer_id], gpu_loss);
+  RecordBottomShapes(layer_id);
+  // The layers after this one did not reshape for other shapes.
+  const vector<int>& top_ids = top_id_vecs_[layer_id];
+  for (int i = 0; static_shapes_ && i < top_ids.size(); ++i) {
+    CHECK(blobs_[top_ids[i]]->shape() == static_blob_shapes_[top_ids[i]])
+        << "With static_shapes, " << layer_names_[layer_id]
+        << " cannot change the shape of " << blob_names_[top_ids[i]];
+  }
+  return loss;
+}
+
+template <typename Dtype>
+void Net<Dtype>::set_device_loss(const bool value) {
+  if (!value || staged_ || scheduler_) {
+    LOG_IF(INFO, value && Caffe::root_solver())
+        << "Ignoring device_loss for " << name_;
+    device_loss_.reset();
+    return;
+  }
+  if (!device_loss_) {
+    device_loss_.reset(new Blob<Dtype>(vector<int>(1, 1)));
+  }
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::AccumulatedLoss() {
+  if (!device_loss_) {
+    return 0;
+  }
+  const Dtype loss = device_loss_->cpu_data()[0];
+  device_loss_->mutable_cpu_data()[0] = 0;
+  return loss;
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardFrom(int start) {
+  return ForwardFromTo(start, layers_.size() - 1);
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardTo(int end) {
+  return ForwardFromTo(0, end);
+}
+
+template <typename Dtype>
+int Net<Dtype>::FrozenPrefix() const {
+  for (int i = 0; i < layers_.size(); ++i) {
+    const vector<int>& param_ids = param_id_vecs_[i];
+    for (int j = 0; j < param_ids.size(); ++j) {
+      if (params_lr_[learnable_param_ids_[param_ids[j]]] != 0) {
+        return i;
+      }
+    }
+  }
+  return layers_.size();
+}
+
+template <typename Dtype>
+const vector<Blob<Dtype>*>& Net<Dtype>::ForwardPrefilled(Dtype* loss) {
+  if (loss != NULL) {
+    *loss = ForwardFromTo(0, layers_.size() - 1);
+  } else {
+    ForwardFromTo(0, layers_.size() - 1);
+  }
+  return net_output_blobs_;
+}
+
+template <typename Dtype>
+const vector<Blob<Dtype>*>& Net<Dtype>::Forward(
+    const vector<Blob<Dtype>*> & bottom, Dtype* loss) {
+  // Copy bottom to internal bottom
+  for (int i = 0; i < bottom.size(); ++i) {
+    net_input_blobs_[i]->CopyFrom(*bottom[i]);
+  }
+  return ForwardPrefilled(loss);
+}
+
+template <typename Dtype>
+string Net<Dtype>::Forward(const string& input_blob_protos, Dtype* loss) {
+  BlobProtoVector blob_proto_vec;
+  if (net_input_blobs_.size()) {
+    blob_proto_vec.ParseFromString(input_blob_protos);
+    CHECK_EQ(blob_proto_vec.blobs_size(), net_input_blobs_.size())
+        << "Incorrect input size.";
+    for (int i = 0; i < blob_proto_vec.blobs_size(); ++i) {
+      net_input_blobs_[i]->FromProto(blob_proto_vec.blobs(i));
+    }
+  }
+  ForwardPrefilled(loss);
+  blob_proto_vec.Clear();
+  for (int i = 0; i < net_output_blobs_.size(); ++i) {
+    net_output_blobs_[i]->ToProto(blob_proto_vec.add_blobs());
+  }
+  string output;
+  blob_proto_vec.SerializeToString(&output);
+  return output;
+}
+
+template <typename Dtype>
+void Net<Dtype>::BackwardFromTo(int start, int end) {
+  CHECK_GE(end, 0);
+  CHECK_LT(start, layers_.size());
+  if (!staged_) {
+    BackwardLayers(start, end);
+    GatherParamRows();
+    return;
+  }
+  for (int s = num_stages() - 1; s >= 0; --s) {
+    const int first = std::min(start, stage_begin_[s + 1] - 1);
+    const int last = std::max(end, stage_begin_[s]);
+    if (first >= last) {
+      DeviceThread::Get(stage_devices_[s])->RunAndWait(boost::bind(
+          &Net::RunBackwardStage, this, first, last));
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::BackwardStage(int stage) {
+  RunBackwardStage(stage_begin_[stage + 1] - 1, stage_begin_[stage]);
+}
+
+template <typename Dtype>
+void Net<Dtype>::RunBackwardStage(int start, int end) {
+  BackwardLayers(start, end);
+#ifndef CPU_ONLY
+  // Earlier stages read the diffs copied back from their own streams
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+  }
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::BackwardLayers(int start, int end) {
+#ifndef CPU_ONLY
+  StreamScope scope(stream_, tensor_op_math_);
+#endif
+  if (scheduler_ && !debug_info_ && !profile_ && !fail_on_transfer_) {
+    scheduler_->Run(start, end, true);
+    return;
+  }
+  if (placement_mode_ != Caffe::mode()) {
+    SetUpPlacement();
+  }
+  const bool placed = !placement_pending_.empty();
+  for (int i = start; i >= end; --i) {
+    // Restore activations of the segment, overwritten by later segments
+    const int segment = segment_begin_[i];
+    if (segment >= 0 && (i == start || segment_begin_[i + 1] != segment)) {
+      ForwardLayers(segment, i, true);
+    }
+    if (!offload_blobs_.empty()) { OffloadBackward(i, false); }
+    if (layer_need_backward_[i]) {
+      if (placed) { PlacementWait(i); }
+      if (fail_on_transfer_) { CaffeFailOnTransfer(layer_names_[i].c_str()); }
+      if (profile_) { ProfileStart(i, true); }
+      layers_[i]->Backward(
+          top_vecs_[i], bottom_need_backward_[i], bottom_vecs_[i]);
+      if (profile_) { ProfileStop(i, true); }
+      if (fail_on_transfer_) { CaffeFailOnTransfer(NULL); }
+      if (debug_info_) { BackwardDebugInfo(i); }
+      if (placed) { PlacementCopy(i, placement_diffs_[i], true); }
+    }
+    if (!offload_blobs_.empty()) { OffloadBackward(i, true); }
+    for (int c = 0; c < after_backward_.size(); ++c) {
+      after_backward_[c]->run(i);
+    }
+  }
+  if (placed) { PlacementDone(); }
+}
+
+// Microseconds since the epoch, for the start of trace events
+static double now_us() {
+  static const boost::posix_time::ptime epoch(
+      boost::gregorian::date(1970, 1, 1));
+  return (boost::posix_time::microsec_clock::universal_time() - epoch)
+      .total_microseconds();
+}
+
+// The most layer calls kept for ProfileTrace, the totals are still updated
+static const size_t kMaxProfileEvents = 1 << 18;
+
+template <typename Dtype>
+void Net<Dtype>::OffloadForward(const int layer_id, bool after) {
+#ifndef CPU_ONLY
+  const cudaStream_t stream = Caffe::cuda_stream();
+  if (!after) {
+    // The blobs computed by the layer take the GPU memory of the previous
+    // ones once copied out, without copying in their stale data.
+    const vector<int>& computed = offload_first_[layer_id];
+    for (int i = 0; i < computed.size(); ++i) {
+      const int index = computed[i];
+      const int previous = offload_previous_[index];
+      if (previous >= 0) {
+        CUDA_CHECK(cudaStreamWaitEvent(stream,
+            offload_pull_events_[previous], 0));
+      }
+      CUDA_CHECK(cudaStreamWaitEvent(stream, offload_push_events_[index], 0));
+      SyncedMemory* data = blobs_[offload_blobs_[index]]->data().get();
+      SyncedMemory* buffer = offload_buffers_[index].get();
+      // Unless the blob grew since, with memory of its own
+      if (data->size() <= buffer->size()) {
+        data->set_gpu_data(buffer->mutable_gpu_data());
+      }
+    }
+    return;
+  }
+  const vector<int>& read = offload_last_[layer_id];
+  for (int i = 0; i < read.size(); ++i) {
+    const int index = read[i];
+    // The last blob of a buffer stays there for the backward
+    if (offload_next_[index] < 0) {
+      continue;
+    }
+    CUDA_CHECK(cudaEventRecord(offload_event_, stream));
+    CUDA_CHECK(cudaStreamWaitEvent(offload_stream_, offload_event_, 0));
+    blobs_[offload_blobs_[index]]->data()->async_cpu_pull(offload_stream_);
+    CUDA_CHECK(cudaEventRecord(offload_pull_events_[index], offload_stream_));
+    offload_pushed_[index] = false;
+  }
+#else
+  NO_GPU;
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::OffloadBackward(const int layer_id, bool after) {
+#ifndef CPU_ONLY
+  if (!after) {
+    // The blobs whose backward starts here must be back on the GPU.
+    const vector<int>& read = offload_last_[layer_id];
+    for (int i = 0; i < read.size(); ++i) {
+      const int index = read[i];
+      if (offload_next_[index] < 0) {
+        continue;
+      }
+      if (!offload_pushed_[index]) {
+        // Not prefetched, as the backward started below the next blob
+        OffloadPush(index);
+      }
+      CUDA_CHECK(cudaStreamWaitEvent(Caffe::cuda_stream(),
+          offload_push_events_[index], 0));
+    }
+    return;
+  }
+  // The blobs computed here are done with, so the previous ones using their
+  // memory are copied back ahead of the layers reading them.
+  const vector<int>& computed = offload_first_[layer_id];
+  for (int i = 0; i < computed.size(); ++i) {
+    const int previous = offload_previous_[computed[i]];
+    if (previous >= 0 && !offload_pushed_[previous]) {
+      OffloadPush(previous);
+    }
+  }
+#else
+  NO_GPU;
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::OffloadPush(const int index) {
+#ifndef CPU_ONLY
+  CUDA_CHECK(cudaEventRecord(offload_event_, Caffe::cuda_stream()));
+  CUDA_CHECK(cudaStreamWaitEvent(offload_stream_, offload_event_, 0));
+  SyncedMemory* data = blobs_[offload_blobs_[index]]->data().get();
+  if (data->head() == SyncedMemory::HEAD_AT_CPU) {
+    data->async_gpu_push(offload_stream_);
+  }
+  CUDA_CHECK(cudaEventRecord(offload_push_events_[index], offload_stream_));
+  offload_pushed_[index] = true;
+#else
+  NO_GPU;
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::PlacementWait(const int layer_id) {
+#ifndef CPU_ONLY
+  const bool gpu = layers_[layer_id]->mode() == Caffe::GPU;
+  for (int t = 0; t < 2; ++t) {
+    const vector<int>& blob_ids =
+        t ? top_id_vecs_[layer_id] : bottom_id_vecs_[layer_id];
+    for (int i = 0; i < blob_ids.size(); ++i) {
+      const int blob_id = blob_ids[i];
+      if (!placement_pending_[blob_id]) {
+        continue;
+      }
+      // The GPU waits on the stream, leaving the copy pending for the host
+      if (gpu) {
+        CUDA_CHECK(cudaStreamWaitEvent(Caffe::cuda_stream(),
+            placement_events_[blob_id], 0));
+      } else {
+        CUDA_CHECK(cudaEventSynchronize(placement_events_[blob_id]));
+        placement_pending_[blob_id] = false;
+        --placement_in_flight_;
+      }
+    }
+  }
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::PlacementCopy(const int layer_id,
+    const vector<int>& blob_ids, bool diff) {
+#ifndef CPU_ONLY
+  const bool gpu = layers_[layer_id]->mode() == Caffe::GPU;
+  const SyncedMemory::SyncedHead head =
+      gpu ? SyncedMemory::HEAD_AT_GPU : SyncedMemory::HEAD_AT_CPU;
+  bool after_stream = false;
+  for (int i = 0; i < blob_ids.size(); ++i) {
+    const int blob_id = blob_ids[i];
+    SyncedMemory* memory = diff ? blobs_[blob_id]->diff().get() :
+        blobs_[blob_id]->data().get();
+    // Unless already on both devices, or not written
+    if (memory->head() != head) {
+      continue;
+    }
+    if (!after_stream) {
+      // After the kernels computing the blobs, or using their memory
+      CUDA_CHECK(cudaEventRecord(placement_event_, Caffe::cuda_stream()));
+      CUDA_CHECK(cudaStreamWaitEvent(placement_stream_, placement_event_,
+          0));
+      after_stream = true;
+    }
+    if (gpu) {
+      memory->async_cpu_copy(placement_stream_);
+    } else {
+      memory->async_gpu_push(placement_stream_);
+    }
+    CUDA_CHECK(cudaEventRecord(placement_events_[blob_id],
+        placement_stream_));
+    if (!placement_pending_[blob_id]) {
+      placement_pending_[blob_id] = true;
+      ++placement_in_flight_;
+    }
+  }
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::PlacementDone() {
+#ifndef CPU_ONLY
+  // The blobs are synced, so no copy may be left for the caller to read
+  if (placement_in_flight_) {
+    CUDA_CHECK(cudaStreamSynchronize(placement_stream_));
+    placement_pending_.assign(placement_pending_.size(), false);
+    placement_in_flight_ = 0;
+  }
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::set_profile(const bool value) {
+  profile_ = value;
+  if (profile_) {
+    profile_timer_.reset(new EventTimer());
+    ClearProfile();
+  } else {
+    profile_timer_.reset();
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ClearProfile() {
+  layer_profiles_.clear();
+  layer_profiles_.resize(layers_.size());
+  profile_events_.clear();
+  if (profile_timer_) {
+    profile_timer_->Clear();
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ProfileStart(const int layer_id, const bool backward) {
+  if (Caffe::mode() == Caffe::GPU) {
+    profile_timer_->Start(2 * layer_id + backward);
+  }
+  profile_start_transfers_ = CaffeTransferCount();
+  profile_start_us_ = now_us();
+}
+
+template <typename Dtype>
+void Net<Dtype>::ProfileStop(const int layer_id, const bool backward) {
+  LayerProfile& profile = layer_profiles_[layer_id];
+  // The GPU time is read later, without waiting for the layer
+  if (Caffe::mode() == Caffe::GPU) {
+    profile_timer_->Stop(2 * layer_id + backward);
+  }
+  const double wall_us = now_us() - profile_start_us_;
+  const vector<Blob<Dtype>*>& bottom = bottom_vecs_[layer_id];
+  const vector<Blob<Dtype>*>& top = top_vecs_[layer_id];
+  const Layer<Dtype>& layer = *layers_[layer_id];
+  profile.calls[backward]++;
+  profile.wall_us[backward] += wall_us;
+  profile.flops[backward] += backward ? layer.BackwardFlops(bottom, top)
+      : layer.ForwardFlops(bottom, top);
+  profile.bytes[backward] += backward ? layer.BackwardBytes(bottom, top)
+      : layer.ForwardBytes(bottom, top);
+  const TransferCount& transfers = CaffeTransferCount();
+  for (int i = 0; i < 2; ++i) {
+    profile.transfers[backward] +=
+        transfers.calls[i] - profile_start_transfers_.calls[i];
+    profile.transfer_bytes[backward] +=
+        transfers.bytes[i] - profile_start_transfers_.bytes[i];
+    profile.transfer_us[backward] +=
+        transfers.us[i] - profile_start_transfers_.us[i];
+  }
+  if (profile_events_.size() < kMaxProfileEvents) {
+    ProfileEvent event;
+    event.layer_id = layer_id;
+    event.backward = backward;
+    event.start_us = profile_start_us_;
+    event.wall_us = wall_us;
+    profile_events_.push_back(event);
+  }
+}
+
+// Quotes a name for JSON
+static string json_string(const string& value) {
+  string quoted = "\"";
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] == '"' || value[i] == '\\') {
+      quoted += '\\';
+    }
+    quoted += value[i];
+  }
+  return quoted + "\"";
+}
+
+template <typename Dtype>
+string Net<Dtype>::ProfileJSON() const {
+  static const char* passes[] = { "forward", "backward" };
+  std::ostringstream json;
+  json << std::fixed;
+  json.precision(1);
+  json << "{\"name\": " << json_string(name_) << ",\n \"layers\": [";
+  if (profile_timer_) {
+    profile_timer_->Synchronize();
+  }
+  for (int i = 0; i < layer_profiles_.size(); ++i) {
+    const LayerProfile& profile = layer_profiles_[i];
+    json << (i ? "," : "") << "\n  {\"name\": " << json_string(layer_names_[i])
+         << ", \"type\": " << json_string(layers_[i]->type());
+    for (int pass = 0; pass < 2; ++pass) {
+      json << ",\n   \"" << passes[pass] << "\": {\"calls\": "
+           << profile.calls[pass] << ", \"wall_us\": " << profile.wall_us[pass]
+           << ", \"gpu_us\": " << (profile_timer_ ?
+              profile_timer_->MicroSeconds(2 * i + pass) : 0)
+           << ", \"flops\": "
+           << profile.flops[pass] << ", \"bytes\": " << profile.bytes[pass]
+           << ", \"transfers\": " << profile.transfers[pass]
+           << ", \"transfer_bytes\": " << profile.transfer_bytes[pass]
+           << ", \"transfer_us\": " << profile.transfer_us[pass] << "}";
+    }
+    json << "}";
+  }
+  json << "],\n \"blobs\": [";
+  for (int i = 0; i < blobs_.size(); ++i) {
+    json << (i ? "," : "") << "\n  {\"name\": " << json_string(blob_names_[i])
+         << ", \"shape\": [";
+    const vector<int>& shape = blobs_[i]->shape();
+    for (int j = 0; j < shape.size(); ++j) {
+      json << (j ? ", " : "") << shape[j];
+    }
+    json << "], \"bytes\": " << blobs_[i]->count() * sizeof(Dtype) << "}";
+  }
+  json << "]}\n";
+  return json.str();
+}
+
+template <typename Dtype>
+string Net<Dtype>::ProfileTrace() const {
+  static const char* passes[] = { "forward", "backward" };
+  std::ostringstream json;
+  json << std::fixed;
+  json.precision(0);
+  json << "{\"traceEvents\": [";
+  for (int i = 0; i < profile_events_.size(); ++i) {
+    const ProfileEvent& event = profile_events_[i];
+    json << (i ? "," : "") << "\n {\"name\": "
+         << json_string(layer_names_[event.layer_id]) << ", \"cat\": \""
+         << passes[event.backward] << "\", \"ph\": \"X\", \"ts\": "
+         << event.start_us << ", \"dur\": " << event.wall_us
+         << ", \"pid\": 0, \"tid\": 0}";
+  }
+  json << "]}\n";
+  return json.str();
+}
+
+// Returns the bytes of the data or diff of a blob if held, adding those of
+// the memory holding it to total unless counted already.
+template <typename Dtype>
+static size_t memory_bytes(const Blob<Dtype>& blob, const bool diff,
+    const bool needed, const bool predicted, std::set<SyncedMemory*>* counted,
+    size_t* total) {
+  if (!blob.count()) {
+    return 0;
+  }
+  const shared_ptr<SyncedMemory>& memory = diff ? blob.diff() : blob.data();
+  const SyncedMemory::SyncedHead head = memory->head();
+  const SyncedMemory::SyncedHead side = Caffe::mode() == Caffe::GPU ?
+      SyncedMemory::HEAD_AT_GPU : SyncedMemory::HEAD_AT_CPU;
+  if (predicted ? !needed : head != side && head != SyncedMemory::SYNCED) {
+    return 0;
+  }
+  SyncedMemory* owner = memory->owner();
+  if (counted->insert(owner).second) {
+    *total += owner->size();
+  }
+  return memory->size();
+}
+
+template <typename Dtype>
+size_t Net<Dtype>::MemoryUsage(const bool predicted, vector<size_t>* blob_bytes,
+    vector<size_t>* param_bytes) const {
+  // The blobs whose diff backward computes, in training nets, or the loss
+  // weights fill
+  const bool backward = phase_ == TRAIN;
+  vector<bool> need_diff(blobs_.size(), false);
+  for (int i = 0; backward && i < layers_.size(); ++i) {
+    for (int j = 0; layer_need_backward_[i] && j < top_id_vecs_[i].size();
+         ++j) {
+      need_diff[top_id_vecs_[i][j]] = true;
+    }
+    for (int j = 0; j < bottom_id_vecs_[i].size(); ++j) {
+      if (bottom_need_backward_[i][j]) {
+        need_diff[bottom_id_vecs_[i][j]] = true;
+      }
+    }
+  }
+  std::set<SyncedMemory*> counted;
+  size_t total = 0;
+  blob_bytes->resize(2 * blobs_.size());
+  for (int i = 0; i < blobs_.size(); ++i) {
+    const bool diff = need_diff[i] || blob_loss_weights_[i] != Dtype(0);
+    (*blob_bytes)[2 * i] = memory_bytes(*blobs_[i], false, true, predicted,
+        &counted, &total);
+    (*blob_bytes)[2 * i + 1] = memory_bytes(*blobs_[i], true, diff,
+        predicted, &counted, &total);
+  }
+  param_bytes->assign(layers_.size(), 0);
+  for (int i = 0; i < layers_.size(); ++i) {
+    const vector<shared_ptr<Blob<Dtype> > >& params = layers_[i]->blobs();
+    for (int j = 0; j < params.size(); ++j) {
+      (*param_bytes)[i] += memory_bytes(*params[j], false, true, predicted,
+          &counted, &total);
+      (*param_bytes)[i] += memory_bytes(*params[j], true,
+          backward && layer_need_backward_[i], predicted, &counted, &total);
+    }
+  }
+  return total;
+}
+
+template <typename Dtype>
+size_t Net<Dtype>::MemoryBytes(const bool predicted) const {
+  vector<size_t> blob_bytes;
+  vector<size_t> param_bytes;
+  return MemoryUsage(predicted, &blob_bytes, &param_bytes);
+}
+
+template <typename Dtype>
+string Net<Dtype>::MemoryJSON(const bool predicted) const {
+  vector<size_t> blob_bytes;
+  vector<size_t> param_bytes;
+  const size_t total = MemoryUsage(predicted, &blob_bytes, &param_bytes);
+  std::ostringstream json;
+  json << "{\"name\": " << json_string(name_) << ",\n \"blobs\": [";
+  for (int i = 0; i < blobs_.size(); ++i) {
+    json << (i ? "," : "") << "\n  {\"name\": " << json_string(blob_names_[i])
+         << ", \"data_bytes\": " << blob_bytes[2 * i] << ", \"diff_bytes\": "
+         << blob_bytes[2 * i + 1] << "}";
+  }
+  json << "],\n \"layers\": [";
+  for (int i = 0; i < layers_.size(); ++i) {
+    json << (i ? "," : "") << "\n  {\"name\": "
+         << json_string(layer_names_[i]) << ", \"param_bytes\": "
+         << param_bytes[i] << "}";
+  }
+  json << "],\n \"total_bytes\": " << total << "}\n";
+  return json.str();
+}
+
+// The data or the diff of a blob in the memory of the current mode
+template <typename Dtype>
+static const Dtype* ModeArray(const Blob<Dtype>& blob, bool diff) {
+  if (Caffe::mode() == Caffe::GPU) {
+    return diff ? blob.gpu_diff() : blob.gpu_data();
+  }
+  return diff ? blob.cpu_diff() : blob.cpu_data();
+}
+
+template <typename Dtype>
+void Net<Dtype>::InputDebugInfo(const int input_id) {
+  const Blob<Dtype>& blob = *net_input_blobs_[input_id];
+  const string& blob_name = blob_names_[net_input_blob_indices_[input_id]];
+  const Dtype data_abs_val_mean = blob.asum_data() / blob.count();
+  if (Caffe::root_solver()) {
+    LOG(INFO) << "    [Forward] "
+              << "Input " << blob_name << " data: " << data_abs_val_mean;
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ForwardDebugInfo(const int layer_id) {
+  // The tops and the params of the layer summed at once
+  const vector<Blob<Dtype>*>& top_vec = top_vecs_[layer_id];
+  const vector<shared_ptr<Blob<Dtype> > >& param_vec =
+      layers_[layer_id]->blobs();
+  vector<const Dtype*> arrays;
+  vector<int> counts;
+  for (int top_id = 0; top_id < top_vec.size(); ++top_id) {
+    arrays.push_back(ModeArray(*top_vec[top_id], false));
+    counts.push_back(top_vec[top_id]->count());
+  }
+  for (int param_id = 0; param_id < param_vec.size(); ++param_id) {
+    arrays.push_back(ModeArray(*param_vec[param_id], false));
+    counts.push_back(param_vec[param_id]->count());
+  }
+  debug_stats_.Compute(arrays, counts);
+  for (int top_id = 0; top_id < top_vec.size(); ++top_id) {
+    const string& blob_name = blob_names_[top_id_vecs_[layer_id][top_id]];
+    const Dtype data_abs_val_mean =
+        debug_stats_.asum(top_id) / top_vec[top_id]->count();
+    if (Caffe::root_solver()) {
+      LOG(INFO) << "    [Forward] "
+                << "Layer " << layer_names_[layer_id]
+                << ", top blob " << blob_name
+                << " data: " << data_abs_val_mean;
+    }
+  }
+  for (int param_id = 0; param_id < param_vec.size(); ++param_id) {
+    const int net_param_id = param_id_vecs_[layer_id][param_id];
+    const string& blob_name = param_display_names_[net_param_id];
+    const Dtype data_abs_val_mean =
+        debug_stats_.asum(top_vec.size() + param_id) /
+        param_vec[param_id]->count();
+    if (Caffe::root_solver()) {
+      LOG(INFO) << "    [Forward] "
+                << "Layer " << layer_names_[layer_id]
+                << ", param blob " << blob_name
+                << " data: " << data_abs_val_mean;
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::BackwardDebugInfo(const int layer_id) {
+  // The bottoms and the params propagated to, summed at once
+  const vector<Blob<Dtype>*>& bottom_vec = bottom_vecs_[layer_id];
+  const vector<shared_ptr<Blob<Dtype> > >& param_vec =
+      layers_[layer_id]->blobs();
+  vector<int> bottom_ids, param_ids;
+  vector<const Dtype*> arrays;
+  vector<int> counts;
+  for (int bottom_id = 0; bottom_id < bottom_vec.size(); ++bottom_id) {
+    if (!bottom_need_backward_[layer_id][bottom_id]) { continue; }
+    bottom_ids.push_back(bottom_id);
+    arrays.push_back(ModeArray(*bottom_vec[bottom_id], true));
+    counts.push_back(bottom_vec[bottom_id]->count());
+  }
+  for (int param_id = 0; param_id < param_vec.size(); ++param_id) {
+    if (!layers_[layer_id]->param_propagate_down(param_id)) { continue; }
+    param_ids.push_back(param_id);
+    arrays.push_back(ModeArray(*param_vec[param_id], true));
+    counts.push_back(param_vec[param_id]->count());
+  }
+  debug_stats_.Compute(arrays, counts);
+  for (int i = 0; i < bottom_ids.size(); ++i) {
+    const int bottom_id = bottom_ids[i];
+    const string& blob_name = blob_names_[bottom_id_vecs_[layer_id][bottom_id]];
+    const Dtype diff_abs_val_mean = debug_stats_.asum(i) / counts[i];
+    if (Caffe::root_solver()) {
+      LOG(INFO) << "    [Backward] "
+                << "Layer " << layer_names_[layer_id]
+                << ", bottom blob " << blob_name
+                << " diff: " << diff_abs_val_mean;
+    }
+  }
+  for (int i = 0; i < param_ids.size(); ++i) {
+    const int j = bottom_ids.size() + i;
+    const Dtype diff_abs_val_mean = debug_stats_.asum(j) / counts[j];
+    if (Caffe::root_solver()) {
+      LOG(INFO) << "    [Backward] "
+                << "Layer " << layer_names_[layer_id]
+                << ", param blob " << param_ids[i]
+                << " diff: " << diff_abs_val_mean;
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::UpdateDebugInfo(const int param_id) {
+  const Blob<Dtype>& blob = *params_[param_id];
+  const int param_owner = param_owners_[param_id];
+  const string& layer_name = layer_names_[param_layer_indices_[param_id].first];
+  const string& param_display_name = param_display_names_[param_id];
+  const Dtype diff_abs_val_mean = blob.asum_diff() / blob.count();
+  if (param_owner < 0) {
+    const Dtype data_abs_val_mean = blob.asum_data() / blob.count();
     if (Caffe::root_solver()) {
       LOG(INFO) << "    [Update] Layer " << layer_name
                 << ", param " << param_display_name
@@ -754,67 +3053,893 @@ void Net<Dtype>::UpdateDebugInfo(const int param_id) {
 }
 
 template <typename Dtype>
-void Net<Dtype>::ShareTrainedLayersWith(const Net* other) {
-  int num_source_layers = other->layers().size();
-  for (int i = 0; i < num_source_layers; ++i) {
-    Layer<Dtype>* source_layer = other->layers()[i].get();
-    const string& source_layer_name = other->layer_names()[i];
-    int target_layer_id = 0;
-    while (target_layer_id != layer_names_.size() &&
-        layer_names_[target_layer_id] != source_layer_name) {
-      ++target_layer_id;
+void Net<Dtype>::ShareTrainedLayersWith(const Net* other) {
+  TrainedLayersFrom(other, true);
+}
+
+template <typename Dtype>
+void Net<Dtype>::CopyTrainedLayersFrom(const Net* other) {
+  TrainedLayersFrom(other, false);
+}
+
+template <typename Dtype>
+void Net<Dtype>::TrainedLayersFrom(const Net* other, bool share) {
+  int num_source_layers = other->layers().size();
+  for (int i = 0; i < num_source_layers; ++i) {
+    Layer<Dtype>* source_layer = other->layers()[i].get();
+    const string& source_layer_name = other->layer_names()[i];
+    int target_layer_id = 0;
+    while (target_layer_id != layer_names_.size() &&
+        layer_names_[target_layer_id] != source_layer_name) {
+      ++target_layer_id;
+    }
+    if (target_layer_id == layer_names_.size()) {
+      DLOG(INFO) << "Ignoring source layer " << source_layer_name;
+      continue;
+    }
+    DLOG(INFO) << "Copying source layer " << source_layer_name;
+    vector<shared_ptr<Blob<Dtype> > >& target_blobs =
+        layers_[target_layer_id]->blobs();
+    CHECK_EQ(target_blobs.size(), source_layer->blobs().size())
+        << "Incompatible number of blobs for layer " << source_layer_name;
+    for (int j = 0; j < target_blobs.size(); ++j) {
+      Blob<Dtype>* source_blob = source_layer->blobs()[j].get();
+      CHECK(target_blobs[j]->shape() == source_blob->shape());
+      if (share) {
+        target_blobs[j]->ShareData(*source_blob);
+      } else {
+        target_blobs[j]->CopyFrom(*source_blob);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+shared_ptr<Net<Dtype> > Net<Dtype>::CreateInferenceContext() const {
+  NetParameter param(net_param_);
+  param.mutable_state()->set_phase(TEST);
+  shared_ptr<Net<Dtype> > context(new Net<Dtype>(param));
+  // Frees the weights the context was initialized with
+  context->ShareTrainedLayersWith(this);
+  for (int i = 0; i < params_.size(); ++i) {
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      params_[i]->cpu_data();
+      break;
+    case Caffe::GPU:
+      params_[i]->gpu_data();
+      break;
+    }
+  }
+  return context;
+}
+
+template <typename Dtype>
+void Net<Dtype>::WarmUp(const vector<vector<int> >& input_shapes) {
+  CHECK(input_shapes.empty() || input_shapes.size() == num_inputs())
+      << "Give the shape of each input blob to warm up";
+  for (int i = 0; i < input_shapes.size(); ++i) {
+    net_input_blobs_[i]->Reshape(input_shapes[i]);
+  }
+  if (input_shapes.size()) {
+    Reshape();
+  }
+  for (int i = 0; i < num_inputs(); ++i) {
+    Blob<Dtype>* input = net_input_blobs_[i];
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      caffe_set(input->count(), Dtype(0), input->mutable_cpu_data());
+      break;
+    case Caffe::GPU:
+#ifndef CPU_ONLY
+      caffe_gpu_set(input->count(), Dtype(0), input->mutable_gpu_data());
+#else
+      NO_GPU;
+#endif
+      break;
+    }
+  }
+  ForwardFromTo(0, layers_.size() - 1);
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    // Only warm once the kernels ran
+    CUDA_CHECK(cudaDeviceSynchronize());
+  }
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::BackwardFrom(int start) {
+  BackwardFromTo(start, 0);
+}
+
+template <typename Dtype>
+void Net<Dtype>::BackwardTo(int end) {
+  BackwardFromTo(layers_.size() - 1, end);
+}
+
+template <typename Dtype>
+void Net<Dtype>::Backward() {
+  BackwardFromTo(layers_.size() - 1, 0);
+  if (debug_info_) {
+    // The data and the diff of each owned param, in a single reduction
+    vector<const Dtype*> arrays;
+    vector<int> counts;
+    for (int i = 0; i < params_.size(); ++i) {
+      if (param_owners_[i] >= 0) { continue; }
+      arrays.push_back(ModeArray(*params_[i], false));
+      arrays.push_back(ModeArray(*params_[i], true));
+      counts.push_back(params_[i]->count());
+      counts.push_back(params_[i]->count());
+    }
+    debug_stats_.Compute(arrays, counts);
+    Dtype asum_data = 0, asum_diff = 0, sumsq_data = 0, sumsq_diff = 0;
+    for (int i = 0; i < arrays.size(); i += 2) {
+      asum_data += debug_stats_.asum(i);
+      asum_diff += debug_stats_.asum(i + 1);
+      sumsq_data += debug_stats_.sumsq(i);
+      sumsq_diff += debug_stats_.sumsq(i + 1);
+    }
+    const Dtype l2norm_data = std::sqrt(sumsq_data);
+    const Dtype l2norm_diff = std::sqrt(sumsq_diff);
+    LOG(ERROR) << "    [Backward] All net params (data, diff): "
+               << "L1 norm = (" << asum_data << ", " << asum_diff << "); "
+               << "L2 norm = (" << l2norm_data << ", " << l2norm_diff << ")";
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::Reshape() {
+  vector<vector<int> > input_shapes;
+  ClampInputs(&input_shapes);
+  // Only the layers whose bottoms changed shape, and thus in turn those
+  // after them whose bottoms they reshape, need to reshape. With
+  // static_shapes all of them do, as the shapes get fixed again.
+  for (int i = 0; i < layers_.size(); ++i) {
+    if (static_shapes_ || LayerNeedsReshape(i)) {
+      layers_[i]->Reshape(bottom_vecs_[i], top_vecs_[i]);
+    }
+  }
+  ReuseActivations();
+  SetUpRecompute();
+  SetUpOffload();
+  TrackShapes();
+  RestoreInputs(input_shapes);
+}
+
+template <typename Dtype>
+void Net<Dtype>::TrackShapes() {
+  // Layers sharing or replacing the memory of their tops may point them at
+  // other memory on every pass. Layers without bottoms and Python layers may
+  // change shapes on their own.
+  layer_reshapes_.resize(layers_.size());
+  bottom_shape_versions_.resize(layers_.size());
+  for (int i = 0; i < layers_.size(); ++i) {
+    const LayerParameter& layer_param = layers_[i]->layer_param();
+    layer_reshapes_[i] = layers_[i]->SharesBottomData()
+        || ReplacesTop(layer_param) || bottom_vecs_[i].empty()
+        || layer_param.type() == "Python";
+    RecordBottomShapes(i);
+  }
+  if (static_shapes_) {
+    static_blob_shapes_.resize(blobs_.size());
+    for (int i = 0; i < blobs_.size(); ++i) {
+      static_blob_shapes_[i] = blobs_[i]->shape();
+    }
+  }
+}
+
+template <typename Dtype>
+bool Net<Dtype>::LayerNeedsReshape(const int layer_id) const {
+  if (layer_reshapes_[layer_id]) {
+    return true;
+  }
+  if (static_shapes_) {
+    return false;
+  }
+  const vector<Blob<Dtype>*>& bottom = bottom_vecs_[layer_id];
+  const vector<int>& versions = bottom_shape_versions_[layer_id];
+  for (int i = 0; i < bottom.size(); ++i) {
+    if (bottom[i]->shape_version() != versions[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename Dtype>
+void Net<Dtype>::RecordBottomShapes(const int layer_id) {
+  const vector<Blob<Dtype>*>& bottom = bottom_vecs_[layer_id];
+  vector<int>& versions = bottom_shape_versions_[layer_id];
+  versions.resize(bottom.size());
+  for (int i = 0; i < bottom.size(); ++i) {
+    versions[i] = bottom[i]->shape_version();
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::DataHolders(vector<int>* holders) const {
+  vector<int>& holder = *holders;
+  holder.resize(blobs_.size());
+  for (int i = 0; i < blobs_.size(); ++i) {
+    holder[i] = i;
+  }
+  for (int layer_id = 0; layer_id < layers_.size(); ++layer_id) {
+    if (layers_[layer_id]->SharesBottomData()) {
+      const int bottom = holder[bottom_id_vecs_[layer_id][0]];
+      for (int top_id = 0; top_id < top_id_vecs_[layer_id].size(); ++top_id) {
+        holder[top_id_vecs_[layer_id][top_id]] = bottom;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::AccumulateSplitDiffs() {
+  const int num_layers = layers_.size();
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    SplitLayer<Dtype>* split =
+        dynamic_cast<SplitLayer<Dtype>*>(layers_[layer_id].get());
+    if (!split || !layer_need_backward_[layer_id]) {
+      continue;
+    }
+    // The one layer reading each top out of place, and bottom index in it
+    vector<pair<int, int> > readers;
+    bool shareable = true;
+    for (int i = 0; i < top_id_vecs_[layer_id].size() && shareable; ++i) {
+      const int blob_id = top_id_vecs_[layer_id][i];
+      shareable = split->loss(i) == 0;
+      int reads = 0;
+      for (int l = layer_id + 1; l < num_layers && shareable; ++l) {
+        for (int j = 0; j < bottom_id_vecs_[l].size(); ++j) {
+          if (bottom_id_vecs_[l][j] == blob_id) {
+            readers.push_back(std::make_pair(l, j));
+            ++reads;
+          }
+        }
+        for (int j = 0; j < top_id_vecs_[l].size(); ++j) {
+          shareable = shareable && top_id_vecs_[l][j] != blob_id;
+        }
+      }
+      shareable = shareable && reads == 1;
+    }
+    if (!shareable) {
+      continue;
+    }
+    // The last reader computing the gradient runs first in Backward and
+    // overwrites the diff, the others add theirs.
+    int last = -1;
+    for (int r = 0; r < readers.size(); ++r) {
+      const int l = readers[r].first;
+      const int j = readers[r].second;
+      if (bottom_need_backward_[l][j]
+          && (last < 0 || l > readers[last].first)) {
+        last = r;
+      }
+    }
+    // Layers reading several tops could compute their gradients in any order
+    set<int> reader_layers;
+    for (int r = 0; r < readers.size() && shareable; ++r) {
+      const int l = readers[r].first;
+      const int j = readers[r].second;
+      shareable = reader_layers.insert(l).second && (r == last
+          || !bottom_need_backward_[l][j]
+          || layers_[l]->AllowAccumulateBottomDiff(j));
+    }
+    if (last < 0 || !shareable) {
+      continue;
+    }
+    for (int r = 0; r < readers.size(); ++r) {
+      const int l = readers[r].first;
+      const int j = readers[r].second;
+      if (r != last && bottom_need_backward_[l][j]) {
+        layers_[l]->set_accumulate_bottom_diff(j, true);
+      }
+    }
+    split->set_share_diff(true);
+    if (Caffe::root_solver()) {
+      LOG(INFO) << "Accumulating the gradients of " << layer_names_[layer_id]
+                << " in place";
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ReuseActivations() {
+  if (!reuse_activations_) {
+    return;
+  }
+  // Group blobs that hold the same data, i.e. tops of layers that share the
+  // data of their bottom, under the blob that actually holds it.
+  vector<int> holder;
+  DataHolders(&holder);
+  // Lifetime of each holder, from the layer producing it to the last layer
+  // reading it or one of the blobs sharing its data. Inputs and outputs are
+  // kept for the whole pass.
+  const int num_layers = layers_.size();
+  vector<int> first(blobs_.size(), num_layers);
+  vector<int> last(blobs_.size(), -1);
+  vector<size_t> bytes(blobs_.size(), 0);
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    for (int i = 0; i < bottom_id_vecs_[layer_id].size(); ++i) {
+      const int h = holder[bottom_id_vecs_[layer_id][i]];
+      last[h] = std::max(last[h], layer_id);
+    }
+    for (int i = 0; i < top_id_vecs_[layer_id].size(); ++i) {
+      const int blob_id = top_id_vecs_[layer_id][i];
+      const int h = holder[blob_id];
+      first[h] = std::min(first[h], layer_id);
+      last[h] = std::max(last[h], layer_id);
+      bytes[h] = std::max(bytes[h], blobs_[blob_id]->count() * sizeof(Dtype));
+    }
+  }
+  for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+    first[holder[net_input_blob_indices_[i]]] = -1;
+  }
+  for (int i = 0; i < net_output_blob_indices_.size(); ++i) {
+    first[holder[net_output_blob_indices_[i]]] = -1;
+  }
+  // Walk holders in order of production and give each the smallest free
+  // storage that fits, or the largest one, which then grows.
+  vector<shared_ptr<SyncedMemory> > storages;
+  vector<size_t> storage_bytes;
+  vector<int> storage_last;
+  vector<int> storage_of(blobs_.size(), -1);
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    for (int i = 0; i < top_id_vecs_[layer_id].size(); ++i) {
+      const int h = top_id_vecs_[layer_id][i];
+      if (holder[h] != h || first[h] != layer_id || !bytes[h]) {
+        continue;
+      }
+      int best = -1;
+      for (int s = 0; s < storages.size(); ++s) {
+        if (storage_last[s] >= layer_id) {
+          continue;
+        }
+        if (best < 0) {
+          best = s;
+          continue;
+        }
+        const bool fits = storage_bytes[s] >= bytes[h];
+        const bool best_fits = storage_bytes[best] >= bytes[h];
+        const bool smaller = storage_bytes[s] < storage_bytes[best];
+        if (fits != best_fits ? fits : fits == smaller) {
+          best = s;
+        }
+      }
+      if (best < 0) {
+        best = storages.size();
+        storages.push_back(shared_ptr<SyncedMemory>());
+        storage_bytes.push_back(0);
+        storage_last.push_back(-1);
+      }
+      storage_bytes[best] = std::max(storage_bytes[best], bytes[h]);
+      storage_last[best] = last[h];
+      storage_of[h] = best;
+    }
+  }
+  size_t shared = 0;
+  for (int s = 0; s < storages.size(); ++s) {
+    storages[s].reset(new SyncedMemory(storage_bytes[s]));
+    shared += storage_bytes[s];
+  }
+  size_t total = 0;
+  for (int blob_id = 0; blob_id < blobs_.size(); ++blob_id) {
+    const int s = storage_of[holder[blob_id]];
+    if (s >= 0) {
+      blobs_[blob_id]->SetDataStorage(storages[s]);
+      total += blobs_[blob_id]->count() * sizeof(Dtype);
+    }
+  }
+  if (Caffe::root_solver()) {
+    LOG(INFO) << "Reusing activations: " << total << " bytes of data in "
+              << storages.size() << " buffers of total size " << shared;
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::SetUpRecompute() {
+  const int num_layers = layers_.size();
+  segment_begin_.assign(num_layers, -1);
+  if (reuse_activations_) {
+    // Already sharing all it can, and no backward is expected
+    return;
+  }
+  int num_segments = 0;
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    if (layers_[layer_id]->layer_param().recompute()) {
+      CHECK_GT(bottom_vecs_[layer_id].size(), 0) << "Layer "
+          << layer_names_[layer_id] << " has no input to be recomputed from";
+      const bool cont = layer_id > 0 && segment_begin_[layer_id - 1] >= 0;
+      segment_begin_[layer_id] = cont ? segment_begin_[layer_id - 1] : layer_id;
+      num_segments += !cont;
+    }
+  }
+  if (!num_segments) {
+    return;
+  }
+  // A blob is internal to a segment if it is produced and consumed only
+  // there, together with the blobs sharing its data.
+  vector<int> holder;
+  DataHolders(&holder);
+  vector<int> producer(blobs_.size(), -1);
+  vector<bool> internal(blobs_.size(), true);
+  vector<int> members(blobs_.size(), 0);
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    const int segment = segment_begin_[layer_id];
+    for (int i = 0; i < top_id_vecs_[layer_id].size(); ++i) {
+      const int blob_id = top_id_vecs_[layer_id][i];
+      const int h = holder[blob_id];
+      if (producer[blob_id] < 0) {
+        producer[blob_id] = layer_id;
+        ++members[h];
+      } else {
+        // Recomputing would otherwise change values already used
+        CHECK_EQ(segment_begin_[producer[blob_id]], segment) << "Layer "
+            << layer_names_[layer_id] << " modifies in place "
+            << blob_names_[blob_id] << ", so both should be recomputed or not";
+      }
+      if (segment < 0 || segment_begin_[producer[h]] != segment) {
+        internal[h] = false;
+      }
+    }
+    for (int i = 0; i < bottom_id_vecs_[layer_id].size(); ++i) {
+      const int h = holder[bottom_id_vecs_[layer_id][i]];
+      if (producer[h] < 0 || segment < 0
+          || segment_begin_[producer[h]] != segment) {
+        internal[h] = false;
+      }
+    }
+  }
+  for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+    internal[holder[net_input_blob_indices_[i]]] = false;
+  }
+  for (int i = 0; i < net_output_blob_indices_.size(); ++i) {
+    internal[holder[net_output_blob_indices_[i]]] = false;
+  }
+  for (int blob_id = 0; blob_id < blobs_.size(); ++blob_id) {
+    if (blob_loss_weights_.size() > blob_id && blob_loss_weights_[blob_id]) {
+      internal[holder[blob_id]] = false;
+    }
+  }
+  // The j-th internal blob of every segment uses the j-th data buffer, and
+  // unless other blobs alias its data, the j-th diff buffer.
+  vector<int> data_slot(blobs_.size(), -1);
+  vector<int> diff_slot(blobs_.size(), -1);
+  vector<size_t> data_bytes;
+  vector<size_t> diff_bytes;
+  int data_index = 0;
+  int diff_index = 0;
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    if (segment_begin_[layer_id] == layer_id) {
+      data_index = 0;
+      diff_index = 0;
+    }
+    for (int i = 0; i < top_id_vecs_[layer_id].size(); ++i) {
+      const int h = top_id_vecs_[layer_id][i];
+      if (holder[h] != h || producer[h] != layer_id || !internal[h]) {
+        continue;
+      }
+      const size_t bytes = blobs_[h]->count() * sizeof(Dtype);
+      if (data_index == data_bytes.size()) {
+        data_bytes.push_back(0);
+      }
+      data_bytes[data_index] = std::max(data_bytes[data_index], bytes);
+      data_slot[h] = data_index++;
+      if (members[h] == 1) {
+        if (diff_index == diff_bytes.size()) {
+          diff_bytes.push_back(0);
+        }
+        diff_bytes[diff_index] = std::max(diff_bytes[diff_index], bytes);
+        diff_slot[h] = diff_index++;
+      }
+    }
+  }
+  vector<shared_ptr<SyncedMemory> > data(data_bytes.size());
+  vector<shared_ptr<SyncedMemory> > diff(diff_bytes.size());
+  size_t shared = 0;
+  for (int i = 0; i < data.size(); ++i) {
+    data[i].reset(new SyncedMemory(std::max(data_bytes[i], size_t(1))));
+    shared += data_bytes[i];
+  }
+  for (int i = 0; i < diff.size(); ++i) {
+    diff[i].reset(new SyncedMemory(std::max(diff_bytes[i], size_t(1))));
+    shared += diff_bytes[i];
+  }
+  size_t total = 0;
+  for (int blob_id = 0; blob_id < blobs_.size(); ++blob_id) {
+    const int h = holder[blob_id];
+    if (data_slot[h] >= 0) {
+      blobs_[blob_id]->SetDataStorage(data[data_slot[h]]);
+      total += blobs_[blob_id]->count() * sizeof(Dtype);
+    }
+    if (diff_slot[h] >= 0) {
+      blobs_[blob_id]->SetDiffStorage(diff[diff_slot[h]]);
+      total += blobs_[blob_id]->count() * sizeof(Dtype);
+    }
+  }
+  if (Caffe::root_solver()) {
+    LOG(INFO) << "Recomputing " << num_segments << " segments: " << total
+              << " bytes of data and diffs in buffers of total size "
+              << shared;
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::SetUpOffload() {
+  const int num_layers = layers_.size();
+#ifndef CPU_ONLY
+  if (offload_stream_) {
+    // The copies in flight use the buffers about to be replaced.
+    CUDA_CHECK(cudaStreamSynchronize(offload_stream_));
+  }
+#endif
+  offload_blobs_.clear();
+  offload_previous_.clear();
+  offload_next_.clear();
+  offload_buffers_.clear();
+  offload_first_.assign(num_layers, vector<int>());
+  offload_last_.assign(num_layers, vector<int>());
+  bool offload = false;
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    offload |= layers_[layer_id]->layer_param().offload();
+  }
+  if (!offload) {
+    return;
+  }
+  if (Caffe::mode() != Caffe::GPU || reuse_activations_ || staged_
+      || net_param_.branch_threads() > 1) {
+    LOG(INFO) << "Ignoring offload, which needs GPU mode, and the layers "
+              << "to run in order on one thread with memory of their own";
+    return;
+  }
+  // The first layer computing the data of each blob, with the blobs sharing
+  // it, and the last layer using it
+  vector<int> holder;
+  DataHolders(&holder);
+  vector<int> first(blobs_.size(), -1);
+  vector<int> last(blobs_.size(), -1);
+  vector<bool> movable(blobs_.size(), true);
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    const LayerParameter& layer_param = layers_[layer_id]->layer_param();
+    // Recomputed segments read their bottoms again during backward, and
+    // the tops of some layers are not the memory they were given.
+    const bool recomputed = segment_begin_[layer_id] >= 0;
+    const bool replaced = !layers_[layer_id]->SharesBottomData()
+        && ReplacesTop(layer_param);
+    for (int i = 0; i < top_id_vecs_[layer_id].size(); ++i) {
+      const int h = holder[top_id_vecs_[layer_id][i]];
+      if (first[h] < 0) {
+        first[h] = layer_id;
+      }
+      last[h] = layer_id;
+      movable[h] = movable[h] && !recomputed && !replaced
+          && cached_by_[layer_id] < 0;
+    }
+    for (int i = 0; i < bottom_id_vecs_[layer_id].size(); ++i) {
+      const int h = holder[bottom_id_vecs_[layer_id][i]];
+      last[h] = layer_id;
+      movable[h] = movable[h] && !recomputed;
+    }
+  }
+  for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+    movable[holder[net_input_blob_indices_[i]]] = false;
+  }
+  for (int i = 0; i < net_output_blob_indices_.size(); ++i) {
+    movable[holder[net_output_blob_indices_[i]]] = false;
+  }
+  for (int blob_id = 0; blob_id < blobs_.size(); ++blob_id) {
+    if (blob_loss_weights_.size() > blob_id && blob_loss_weights_[blob_id]) {
+      movable[holder[blob_id]] = false;
+    }
+  }
+  // Each blob takes the first buffer whose last blob is no longer used by
+  // the time it is computed.
+  vector<int> tail;
+  vector<size_t> bytes;
+  vector<int> slot;
+  size_t total = 0;
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    if (!layers_[layer_id]->layer_param().offload()) {
+      continue;
+    }
+    for (int i = 0; i < top_id_vecs_[layer_id].size(); ++i) {
+      const int h = top_id_vecs_[layer_id][i];
+      if (holder[h] != h || first[h] != layer_id || last[h] == layer_id
+          || !movable[h] || blobs_[h]->data()->is_view()) {
+        continue;
+      }
+      int s = 0;
+      while (s < tail.size() && last[offload_blobs_[tail[s]]] >= layer_id) {
+        ++s;
+      }
+      const int index = offload_blobs_.size();
+      offload_blobs_.push_back(h);
+      offload_next_.push_back(-1);
+      if (s == tail.size()) {
+        offload_previous_.push_back(-1);
+        tail.push_back(index);
+        bytes.push_back(0);
+      } else {
+        offload_previous_.push_back(tail[s]);
+        offload_next_[tail[s]] = index;
+        tail[s] = index;
+      }
+      slot.push_back(s);
+      const size_t size = blobs_[h]->data()->size();
+      bytes[s] = std::max(bytes[s], size);
+      total += size;
+      offload_first_[layer_id].push_back(index);
+      offload_last_[last[h]].push_back(index);
+    }
+  }
+  vector<shared_ptr<SyncedMemory> > buffers(bytes.size());
+  size_t shared = 0;
+  for (int s = 0; s < buffers.size(); ++s) {
+    buffers[s].reset(new SyncedMemory(std::max(bytes[s], size_t(1))));
+    shared += bytes[s];
+  }
+  for (int index = 0; index < offload_blobs_.size(); ++index) {
+    offload_buffers_.push_back(buffers[slot[index]]);
+  }
+  offload_pushed_.assign(offload_blobs_.size(), true);
+#ifndef CPU_ONLY
+  if (!offload_stream_) {
+    CUDA_CHECK(cudaStreamCreateWithFlags(&offload_stream_,
+        cudaStreamNonBlocking));
+    CUDA_CHECK(cudaEventCreateWithFlags(&offload_event_,
+        cudaEventDisableTiming));
+  }
+  while (offload_pull_events_.size() < offload_blobs_.size()) {
+    cudaEvent_t pulled, pushed;
+    CUDA_CHECK(cudaEventCreateWithFlags(&pulled, cudaEventDisableTiming));
+    CUDA_CHECK(cudaEventCreateWithFlags(&pushed, cudaEventDisableTiming));
+    offload_pull_events_.push_back(pulled);
+    offload_push_events_.push_back(pushed);
+  }
+#endif
+  if (Caffe::root_solver()) {
+    LOG(INFO) << "Offloading " << offload_blobs_.size() << " blobs: "
+              << total << " bytes of data in GPU buffers of total size "
+              << shared;
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::SetUpPlacement() {
+  const int num_layers = layers_.size();
+  placement_mode_ = Caffe::mode();
+  placement_data_.assign(num_layers, vector<int>());
+  placement_diffs_.assign(num_layers, vector<int>());
+  placement_pending_.clear();
+  placement_in_flight_ = 0;
+  bool placed = false;
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+#ifdef CPU_ONLY
+    const LayerParameter& layer_param = layers_[layer_id]->layer_param();
+    CHECK_NE(layer_param.device(), LayerParameter_Device_GPU)
+        << layer_param.name() << ": cannot run on the GPU in CPU_ONLY mode";
+#endif
+    placed |= layers_[layer_id]->mode() != Caffe::mode();
+  }
+  if (!placed) {
+    return;
+  }
+  if (staged_ || net_param_.branch_threads() > 1) {
+    LOG(INFO) << "Copying the blobs of layers on other devices as they are "
+              << "read, as the layers run on several threads";
+    return;
+  }
+  // The data a layer reads is written last by the layer before it with the
+  // blob as top, and the diff it reads, in backward, by the layer after it
+  // with the blob as bottom.
+  int copies = 0;
+  vector<int> writer(blobs_.size(), -1);
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    const Caffe::Brew mode = layers_[layer_id]->mode();
+    const vector<int>& bottom_ids = bottom_id_vecs_[layer_id];
+    for (int i = 0; i < bottom_ids.size(); ++i) {
+      const int blob_id = bottom_ids[i];
+      const int w = writer[blob_id];
+      if (w < 0 || layers_[w]->mode() == mode) {
+        continue;
+      }
+      vector<int>& data = placement_data_[w];
+      if (std::find(data.begin(), data.end(), blob_id) == data.end()) {
+        data.push_back(blob_id);
+        ++copies;
+      }
     }
-    if (target_layer_id == layer_names_.size()) {
-      DLOG(INFO) << "Ignoring source layer " << source_layer_name;
-      continue;
+    const vector<int>& top_ids = top_id_vecs_[layer_id];
+    for (int i = 0; i < top_ids.size(); ++i) {
+      writer[top_ids[i]] = layer_id;
     }
-    DLOG(INFO) << "Copying source layer " << source_layer_name;
-    vector<shared_ptr<Blob<Dtype> > >& target_blobs =
-        layers_[target_layer_id]->blobs();
-    CHECK_EQ(target_blobs.size(), source_layer->blobs().size())
-        << "Incompatible number of blobs for layer " << source_layer_name;
-    for (int j = 0; j < target_blobs.size(); ++j) {
-      Blob<Dtype>* source_blob = source_layer->blobs()[j].get();
-      CHECK(target_blobs[j]->shape() == source_blob->shape());
-      target_blobs[j]->ShareData(*source_blob);
+  }
+  vector<int> diff_writer(blobs_.size(), -1);
+  for (int layer_id = num_layers - 1; layer_id >= 0; --layer_id) {
+    const Caffe::Brew mode = layers_[layer_id]->mode();
+    const vector<int>& top_ids = top_id_vecs_[layer_id];
+    for (int i = 0; i < top_ids.size(); ++i) {
+      const int blob_id = top_ids[i];
+      const int w = diff_writer[blob_id];
+      if (w < 0 || layers_[w]->mode() == mode) {
+        continue;
+      }
+      vector<int>& diffs = placement_diffs_[w];
+      if (std::find(diffs.begin(), diffs.end(), blob_id) == diffs.end()) {
+        diffs.push_back(blob_id);
+        ++copies;
+      }
     }
+    const vector<int>& bottom_ids = bottom_id_vecs_[layer_id];
+    for (int i = 0; i < bottom_ids.size(); ++i) {
+      diff_writer[bottom_ids[i]] =
+          bottom_need_backward_[layer_id][i] ? layer_id : -1;
+    }
+  }
+  if (!copies) {
+    return;
+  }
+  placement_pending_.assign(blobs_.size(), false);
+#ifndef CPU_ONLY
+  if (!placement_stream_) {
+    CUDA_CHECK(cudaStreamCreateWithFlags(&placement_stream_,
+        cudaStreamNonBlocking));
+    CUDA_CHECK(cudaEventCreateWithFlags(&placement_event_,
+        cudaEventDisableTiming));
+  }
+  while (placement_events_.size() < blobs_.size()) {
+    cudaEvent_t event;
+    CUDA_CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+    placement_events_.push_back(event);
+  }
+#endif
+  if (Caffe::root_solver()) {
+    LOG(INFO) << "Copying " << copies << " data and diffs between layers "
+              << "on different devices";
   }
 }
 
-template <typename Dtype>
-void Net<Dtype>::BackwardFrom(int start) {
-  BackwardFromTo(start, 0);
+static bool intersects(const set<int>& a, const set<int>& b) {
+  for (set<int>::const_iterator it = a.begin(); it != a.end(); ++it) {
+    if (b.count(*it)) {
+      return true;
+    }
+  }
+  return false;
 }
 
-template <typename Dtype>
-void Net<Dtype>::BackwardTo(int end) {
-  BackwardFromTo(layers_.size() - 1, end);
+// Whether the layer computes the same tops every epoch, which can then be
+// cached, rather than shuffling or augmenting the data
+static bool Deterministic(const LayerParameter& param, Phase phase) {
+  const TransformationParameter& transform = param.transform_param();
+  if (transform.mirror() || (transform.crop_size() > 0 && phase == TRAIN)) {
+    return false;
+  }
+  if (param.image_data_param().shuffle() || param.hdf5_data_param().shuffle()
+      || param.type() == "WindowData") {
+    return false;
+  }
+  return param.type() != "Dropout" || phase == TEST;
 }
 
 template <typename Dtype>
-void Net<Dtype>::Backward() {
-  BackwardFromTo(layers_.size() - 1, 0);
-  if (debug_info_) {
-    Dtype asum_data = 0, asum_diff = 0, sumsq_data = 0, sumsq_diff = 0;
-    for (int i = 0; i < params_.size(); ++i) {
-      if (param_owners_[i] >= 0) { continue; }
-      asum_data += params_[i]->asum_data();
-      asum_diff += params_[i]->asum_diff();
-      sumsq_data += params_[i]->sumsq_data();
-      sumsq_diff += params_[i]->sumsq_diff();
+void Net<Dtype>::SetUpCachedLayers() {
+  const int num_layers = layers_.size();
+  cached_by_.assign(num_layers, -1);
+  for (int j = 0; j < num_layers; ++j) {
+    if (string(layers_[j]->type()) != "FeatureCache") {
+      continue;
+    }
+    for (int k = 0; k < bottom_need_backward_[j].size(); ++k) {
+      CHECK(!bottom_need_backward_[j][k]) << "FeatureCache layer "
+          << layer_names_[j] << " caches blob "
+          << blob_names_[bottom_id_vecs_[j][k]] << " needing backward, "
+          << "rather than the output of frozen layers";
+    }
+    // Going down from the cache, a layer only computes its bottoms if all
+    // the layers reading its tops, until overwritten in place, do.
+    int skipped = 0;
+    for (int i = j - 1; i >= 0; --i) {
+      bool only = !layer_need_backward_[i] && !top_id_vecs_[i].empty();
+      for (int t = 0; only && t < top_id_vecs_[i].size(); ++t) {
+        const int blob_id = top_id_vecs_[i][t];
+        bool read = false;
+        for (int k = i + 1; only && k < num_layers; ++k) {
+          const vector<int>& bottoms = bottom_id_vecs_[k];
+          if (std::find(bottoms.begin(), bottoms.end(), blob_id)
+              != bottoms.end()) {
+            read = true;
+            only = k == j || cached_by_[k] == j;
+          }
+          const vector<int>& tops = top_id_vecs_[k];
+          if (std::find(tops.begin(), tops.end(), blob_id) != tops.end()) {
+            break;
+          }
+        }
+        only = only && read;
+      }
+      if (only) {
+        CHECK(Deterministic(layers_[i]->layer_param(), phase_)) << "Layer "
+            << layer_names_[i] << ", computing the bottoms of FeatureCache "
+            << "layer " << layer_names_[j] << ", shuffles or augments the "
+            << "data, which caching would freeze";
+        cached_by_[i] = j;
+        ++skipped;
+      }
+    }
+    if (Caffe::root_solver()) {
+      LOG(INFO) << "FeatureCache layer " << layer_names_[j] << " skips "
+                << skipped << " layers once it has the items of an epoch";
     }
-    const Dtype l2norm_data = std::sqrt(sumsq_data);
-    const Dtype l2norm_diff = std::sqrt(sumsq_diff);
-    LOG(ERROR) << "    [Backward] All net params (data, diff): "
-               << "L1 norm = (" << asum_data << ", " << asum_diff << "); "
-               << "L2 norm = (" << l2norm_data << ", " << l2norm_diff << ")";
   }
 }
 
 template <typename Dtype>
-void Net<Dtype>::Reshape() {
-  for (int i = 0; i < layers_.size(); ++i) {
-    layers_[i]->Reshape(bottom_vecs_[i], top_vecs_[i]);
+void Net<Dtype>::SetUpBranches(int threads) {
+  const int num_layers = layers_.size();
+  bool recompute = false;
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    recompute |= segment_begin_[layer_id] >= 0;
+  }
+  if (threads <= 1) {
+    return;
+  }
+  if (reuse_activations_ || recompute) {
+    LOG(INFO) << "Ignoring branch_threads, as blobs share memory in the "
+              << "order of a sequential pass";
+    return;
+  }
+  if (std::count(cached_by_.begin(), cached_by_.end(), -1) < num_layers) {
+    LOG(INFO) << "Ignoring branch_threads, as FeatureCache layers skip the "
+              << "layers computing their bottoms";
+    return;
+  }
+  // Layers depend on each other if they use the same blob or parameter, or
+  // if one writes data that the other accesses through a blob sharing it.
+  vector<int> holder;
+  DataHolders(&holder);
+  vector<set<int> > uses(num_layers);
+  vector<set<int> > accesses(num_layers);
+  vector<set<int> > writes(num_layers);
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    for (int i = 0; i < bottom_id_vecs_[layer_id].size(); ++i) {
+      const int blob_id = bottom_id_vecs_[layer_id][i];
+      uses[layer_id].insert(blob_id);
+      accesses[layer_id].insert(holder[blob_id]);
+    }
+    for (int i = 0; i < top_id_vecs_[layer_id].size(); ++i) {
+      const int blob_id = top_id_vecs_[layer_id][i];
+      uses[layer_id].insert(blob_id);
+      accesses[layer_id].insert(holder[blob_id]);
+      if (!layers_[layer_id]->SharesBottomData()) {
+        writes[layer_id].insert(holder[blob_id]);
+      }
+    }
+    for (int i = 0; i < param_id_vecs_[layer_id].size(); ++i) {
+      const int param_id = param_id_vecs_[layer_id][i];
+      const int owner = param_owners_[param_id];
+      // Offset past the blob ids
+      uses[layer_id].insert(blobs_.size() + (owner < 0 ? param_id : owner));
+    }
+  }
+  layer_deps_.assign(num_layers, vector<int>());
+  layer_dependents_.assign(num_layers, vector<int>());
+  int edges = 0;
+  for (int j = 0; j < num_layers; ++j) {
+    for (int i = 0; i < j; ++i) {
+      if (intersects(uses[i], uses[j]) || intersects(writes[i], accesses[j])
+          || intersects(accesses[i], writes[j])) {
+        layer_deps_[j].push_back(i);
+        layer_dependents_[i].push_back(j);
+        ++edges;
+      }
+    }
+  }
+  scheduler_.reset(new Scheduler(this, threads));
+  if (Caffe::root_solver()) {
+    LOG(INFO) << "Running layers on " << threads << " branch threads, with "
+              << edges << " dependencies";
   }
 }
 
@@ -847,20 +3972,371 @@ void Net<Dtype>::CopyTrainedLayersFrom(const NetParameter& param) {
 
 template <typename Dtype>
 void Net<Dtype>::CopyTrainedLayersFrom(const string trained_filename) {
+  if (dedup_weights_) {
+    // Loads into memory of the net's own, rather than the memory it may
+    // share with other nets
+    for (int i = 0; i < params_.size(); ++i) {
+      Blob<Dtype>* param = params_[i].get();
+      if (param_owners_[i] >= 0) {
+        continue;
+      }
+      shared_ptr<SyncedMemory> memory(
+          new SyncedMemory(param->count() * sizeof(Dtype)));
+      caffe_copy(param->count(), param->cpu_data(),
+                 static_cast<Dtype*>(memory->mutable_cpu_data()));
+      param->SetDataStorage(memory);
+    }
+    ShareWeights();
+  }
   if (trained_filename.size() >= 3 &&
       trained_filename.compare(trained_filename.size() - 3, 3, ".h5") == 0) {
     CopyTrainedLayersFromHDF5(trained_filename);
+  } else if (trained_filename.size() >= 5 && trained_filename.compare(
+      trained_filename.size() - 5, 5, ".mmap") == 0) {
+    // Not deduplicated, as the file is unmapped with the net. Nets mapping
+    // the same file share its pages anyway.
+    CopyTrainedLayersFromMapped(trained_filename);
+    return;
   } else {
     CopyTrainedLayersFromBinaryProto(trained_filename);
   }
+  DedupWeights();
+}
+
+// The memory of the params of the nets with dedup_weights, by device, shape
+// and hash of the values, shared by all threads. Entries expire with the
+// last net using them.
+template <typename Dtype>
+struct WeightStore {
+  typedef pair<pair<int, vector<int> >, size_t> Key;
+  static boost::mutex mutex;
+  static map<Key, weak_ptr<SyncedMemory> > memory;
+};
+
+template <typename Dtype>
+boost::mutex WeightStore<Dtype>::mutex;
+template <typename Dtype>
+map<typename WeightStore<Dtype>::Key, weak_ptr<SyncedMemory> >
+    WeightStore<Dtype>::memory;
+
+template <typename Dtype>
+void Net<Dtype>::DedupWeights() {
+  if (!dedup_weights_) {
+    return;
+  }
+  int device = -1;
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaGetDevice(&device));
+  }
+#endif
+  size_t bytes = 0;
+  boost::mutex::scoped_lock lock(WeightStore<Dtype>::mutex);
+  for (int i = 0; i < params_.size(); ++i) {
+    Blob<Dtype>* param = params_[i].get();
+    if (param_owners_[i] >= 0 || param->count() == 0) {
+      continue;
+    }
+    const Dtype* values = param->cpu_data();
+    const typename WeightStore<Dtype>::Key key(
+        make_pair(device, param->shape()),
+        boost::hash_range(values, values + param->count()));
+    weak_ptr<SyncedMemory>& stored = WeightStore<Dtype>::memory[key];
+    const shared_ptr<SyncedMemory> memory = stored.lock();
+    if (memory == param->data()) {
+      continue;
+    }
+    // Equal hashes of different values keep their own memory
+    if (memory && std::equal(values, values + param->count(),
+        static_cast<const Dtype*>(memory->cpu_data()))) {
+      param->SetDataStorage(memory);
+      bytes += param->count() * sizeof(Dtype);
+    } else if (!memory) {
+      stored = param->data();
+    }
+  }
+  // The params sharing the values of owners follow them.
+  ShareWeights();
+  if (Caffe::root_solver() && bytes > 0) {
+    LOG(INFO) << "Sharing " << bytes << " bytes of weights with other nets";
+  }
+}
+
+// Makes the data of a blob of floats the mapped values, copies them into
+// other blobs.
+static void SetMappedData(float* values, Blob<float>* blob) {
+  blob->data()->set_cpu_data(values);
+}
+
+static void SetMappedData(float* values, Blob<double>* blob) {
+  std::copy(values, values + blob->count(), blob->mutable_cpu_data());
+}
+
+template <typename Dtype>
+void Net<Dtype>::CopyTrainedLayersFromMapped(const string trained_filename) {
+  shared_ptr<MappedFile> file(new MappedFile(trained_filename));
+  const size_t kHeaderSize = sizeof(kMappedWeightsMagic) + sizeof(uint64_t);
+  CHECK_GE(file->size(), kHeaderSize) << "Truncated " << trained_filename;
+  CHECK(std::equal(kMappedWeightsMagic,
+      kMappedWeightsMagic + sizeof(kMappedWeightsMagic), file->data()))
+      << trained_filename << " is not a mapped weights file";
+  uint64_t index_size;
+  std::copy(file->data() + sizeof(kMappedWeightsMagic),
+      file->data() + kHeaderSize, reinterpret_cast<char*>(&index_size));
+  CHECK_LE(kHeaderSize + index_size, file->size())
+      << "Truncated " << trained_filename;
+  NetParameter index;
+  CHECK(index.ParseFromArray(file->data() + kHeaderSize, index_size))
+      << "Cannot parse the index of " << trained_filename;
+  size_t offset = kHeaderSize + index_size;
+  bool mapped = false;
+  for (int i = 0; i < index.layer_size(); ++i) {
+    const LayerParameter& source_layer = index.layer(i);
+    const string& source_layer_name = source_layer.name();
+    const map<string, int>::const_iterator target =
+        layer_names_index_.find(source_layer_name);
+    if (target == layer_names_index_.end()) {
+      DLOG(INFO) << "Ignoring source layer " << source_layer_name;
+    }
+    vector<shared_ptr<Blob<Dtype> > >* target_blobs =
+        target == layer_names_index_.end() ? NULL
+        : &layers_[target->second]->blobs();
+    CHECK(!target_blobs || target_blobs->size() == source_layer.blobs_size())
+        << "Incompatible number of blobs for layer " << source_layer_name;
+    for (int j = 0; j < source_layer.blobs_size(); ++j) {
+      const BlobShape& shape = source_layer.blobs(j).shape();
+      size_t count = 1;
+      for (int k = 0; k < shape.dim_size(); ++k) {
+        count *= shape.dim(k);
+      }
+      offset += (kMappedWeightsAlignment - offset % kMappedWeightsAlignment)
+          % kMappedWeightsAlignment;
+      const size_t bytes = count * sizeof(float);
+      CHECK_LE(offset + bytes, file->size())
+          << "Truncated " << trained_filename;
+      if (target_blobs && count > 0) {
+        Blob<Dtype>* blob = (*target_blobs)[j].get();
+        CHECK(blob->shape() == vector<int>(shape.dim().begin(),
+            shape.dim().end())) << "Cannot copy param " << j
+            << " weights from layer '" << source_layer_name
+            << "'; shape mismatch. Target param shape is "
+            << blob->shape_string();
+        SetMappedData(reinterpret_cast<float*>(file->data() + offset), blob);
+        mapped = true;
+      }
+      offset += bytes;
+    }
+  }
+  if (mapped) {
+    mapped_weights_.push_back(file);
+  }
+}
+
+// Reads the count values of a packed field of a BlobProto, stored as
+// Stored, into values. The wire format is little-endian, read as is like
+// mapped weights.
+template <typename Dtype, typename Stored>
+static void ReadPackedValues(CodedInputStream* input, int count,
+                             Dtype* values) {
+  uint32_t bytes;
+  CHECK(input->ReadVarint32(&bytes));
+  CHECK_EQ(bytes, count * sizeof(Stored)) << "Incompatible blob size";
+  if (sizeof(Stored) == sizeof(Dtype)) {
+    CHECK(input->ReadRaw(values, bytes));
+    return;
+  }
+  const int kChunk = 4096;
+  Stored buffer[kChunk];
+  for (int i = 0; i < count; i += kChunk) {
+    const int n = std::min(kChunk, count - i);
+    CHECK(input->ReadRaw(buffer, n * sizeof(Stored)));
+    for (int j = 0; j < n; ++j) {
+      values[i + j] = buffer[j];
+    }
+  }
+}
+
+// Reads a BlobProto, up to the limit of the input, into a blob: the values
+// straight into its memory, the other fields, such as its shape or
+// compressed values, through a BlobProto of their own.
+template <typename Dtype>
+static void StreamBlob(CodedInputStream* input, Blob<Dtype>* blob) {
+  string rest;
+  bool values = false;
+  {
+    StringOutputStream rest_stream(&rest);
+    CodedOutputStream rest_output(&rest_stream);
+    uint32_t tag;
+    while ((tag = input->ReadTag()) != 0) {
+      const int field = WireFormatLite::GetTagFieldNumber(tag);
+      const bool packed = WireFormatLite::GetTagWireType(tag) ==
+          WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+      if (packed && field == BlobProto::kDataFieldNumber) {
+        ReadPackedValues<Dtype, float>(input, blob->count(),
+                                       blob->mutable_cpu_data());
+        values = true;
+      } else if (packed && field == BlobProto::kDoubleDataFieldNumber) {
+        ReadPackedValues<Dtype, double>(input, blob->count(),
+                                        blob->mutable_cpu_data());
+        values = true;
+      } else if (packed && field == BlobProto::kDiffFieldNumber) {
+        ReadPackedValues<Dtype, float>(input, blob->count(),
+                                       blob->mutable_cpu_diff());
+      } else if (packed && field == BlobProto::kDoubleDiffFieldNumber) {
+        ReadPackedValues<Dtype, double>(input, blob->count(),
+                                        blob->mutable_cpu_diff());
+      } else {
+        CHECK(WireFormatLite::SkipField(input, tag, &rest_output));
+      }
+    }
+  }
+  BlobProto proto;
+  CHECK(proto.ParseFromString(rest));
+  if (values) {
+    CHECK(blob->ShapeEquals(proto)) << "Trying to copy blobs of different "
+        << "sizes: the layer's " << blob->shape_string();
+  } else {
+    const bool kReshape = false;
+    blob->FromProto(proto, kReshape);
+  }
+}
+
+// Reads the blobs of a LayerParameter, up to the limit of the input, into
+// the layer of the same name, if any.
+template <typename Dtype>
+static void StreamTrainedLayer(CodedInputStream* input,
+    const map<string, int>& layer_names_index,
+    const vector<shared_ptr<Layer<Dtype> > >& layers) {
+  string name;
+  bool named = false;
+  vector<shared_ptr<Blob<Dtype> > >* target_blobs = NULL;
+  // Blobs written before the name, which protobuf does not do, are kept
+  // until it is read.
+  vector<string> unnamed_blobs;
+  int blob_id = 0;
+  uint32_t tag;
+  while ((tag = input->ReadTag()) != 0) {
+    const int field = WireFormatLite::GetTagFieldNumber(tag);
+    if (field == LayerParameter::kBlobsFieldNumber) {
+      uint32_t length;
+      CHECK(input->ReadVarint32(&length));
+      if (!named) {
+        unnamed_blobs.push_back(string());
+        CHECK(input->ReadString(&unnamed_blobs.back(), length));
+      } else if (!target_blobs) {
+        CHECK(input->Skip(length));
+      } else {
+        CHECK_LT(blob_id, target_blobs->size())
+            << "Incompatible number of blobs for layer " << name;
+        const CodedInputStream::Limit limit = input->PushLimit(length);
+        StreamBlob(input, (*target_blobs)[blob_id++].get());
+        CHECK_EQ(input->BytesUntilLimit(), 0);
+        input->PopLimit(limit);
+      }
+    } else if (field == LayerParameter::kNameFieldNumber && !named) {
+      uint32_t length;
+      CHECK(input->ReadVarint32(&length));
+      CHECK(input->ReadString(&name, length));
+      named = true;
+      const map<string, int>::const_iterator target =
+          layer_names_index.find(name);
+      if (target == layer_names_index.end()) {
+        DLOG(INFO) << "Ignoring source layer " << name;
+        continue;
+      }
+      DLOG(INFO) << "Copying source layer " << name;
+      target_blobs = &layers[target->second]->blobs();
+      for (int j = 0; j < unnamed_blobs.size(); ++j) {
+        CHECK_LT(blob_id, target_blobs->size())
+            << "Incompatible number of blobs for layer " << name;
+        BlobProto proto;
+        CHECK(proto.ParseFromString(unnamed_blobs[j]));
+        const bool kReshape = false;
+        (*target_blobs)[blob_id++]->FromProto(proto, kReshape);
+      }
+      unnamed_blobs.clear();
+    } else {
+      CHECK(WireFormatLite::SkipField(input, tag));
+    }
+  }
+  CHECK(!target_blobs || blob_id == target_blobs->size())
+      << "Incompatible number of blobs for layer " << name;
+}
+
+// Reads the layers of a binary NetParameter one after the other, each blob
+// straight into the blob of the net, rather than the whole NetParameter
+// into memory. Returns false for a net of a deprecated format, which needs
+// upgrading as a whole.
+template <typename Dtype>
+static bool StreamTrainedLayers(const string& trained_filename,
+    const map<string, int>& layer_names_index,
+    const vector<shared_ptr<Layer<Dtype> > >& layers,
+    vector<string>* shards) {
+  const int fd = open(trained_filename.c_str(), O_RDONLY);
+  CHECK_NE(fd, -1) << "File not found: " << trained_filename;
+  FileInputStream raw_input(fd);
+  bool current = true;
+  while (current) {
+    // A coded stream for each field, as their byte limit is on the total
+    // they read: models can be over 2 GB, but not their layers.
+    CodedInputStream input(&raw_input);
+    input.SetTotalBytesLimit(INT_MAX, 536870912);
+    const uint32_t tag = input.ReadTag();
+    if (tag == 0) {
+      break;
+    }
+    const int field = WireFormatLite::GetTagFieldNumber(tag);
+    if (field == NetParameter::kLayerFieldNumber) {
+      uint32_t length;
+      CHECK(input.ReadVarint32(&length)) << "Cannot parse "
+          << trained_filename;
+      const CodedInputStream::Limit limit = input.PushLimit(length);
+      StreamTrainedLayer(&input, layer_names_index, layers);
+      CHECK_EQ(input.BytesUntilLimit(), 0) << "Cannot parse "
+          << trained_filename;
+      input.PopLimit(limit);
+    } else if (field == NetParameter::kShardFieldNumber) {
+      uint32_t length;
+      CHECK(input.ReadVarint32(&length));
+      shards->push_back(string());
+      CHECK(input.ReadString(&shards->back(), length));
+    } else if (field == NetParameter::kLayersFieldNumber) {
+      current = false;
+    } else {
+      CHECK(WireFormatLite::SkipField(&input, tag)) << "Cannot parse "
+          << trained_filename;
+    }
+  }
+  close(fd);
+  return current;
 }
 
 template <typename Dtype>
 void Net<Dtype>::CopyTrainedLayersFromBinaryProto(
     const string trained_filename) {
-  NetParameter param;
-  ReadNetParamsFromBinaryFileOrDie(trained_filename, &param);
-  CopyTrainedLayersFrom(param);
+  vector<string> shard_names;
+  if (!StreamTrainedLayers(trained_filename, layer_names_index_, layers_,
+                           &shard_names)) {
+    NetParameter param;
+    ReadNetParamsFromBinaryFileOrDie(trained_filename, &param);
+    CopyTrainedLayersFrom(param);
+    shard_names.assign(param.shard().begin(), param.shard().end());
+  }
+  if (shard_names.empty()) {
+    return;
+  }
+  // The blobs are in the shards, read in parallel.
+  vector<NetParameter> shards(shard_names.size());
+  vector<string> filenames;
+  vector<Message*> protos;
+  for (int k = 0; k < shard_names.size(); ++k) {
+    filenames.push_back(ShardPath(trained_filename, shard_names[k]));
+    protos.push_back(&shards[k]);
+  }
+  ReadProtosFromBinaryFilesOrDie(filenames, protos);
+  for (int k = 0; k < shards.size(); ++k) {
+    CopyTrainedLayersFrom(shards[k]);
+  }
 }
 
 template <typename Dtype>
@@ -915,6 +4391,13 @@ void Net<Dtype>::CopyTrainedLayersFromHDF5(const string trained_filename) {
 
 template <typename Dtype>
 void Net<Dtype>::ToProto(NetParameter* param, bool write_diff) const {
+  ToProto(param, write_diff, params_);
+}
+
+template <typename Dtype>
+void Net<Dtype>::ToProto(NetParameter* param, bool write_diff,
+    const vector<shared_ptr<Blob<Dtype> > >& params) const {
+  CHECK_EQ(params.size(), params_.size());
   param->Clear();
   param->set_name(name_);
   // Add bottom and top
@@ -923,19 +4406,26 @@ void Net<Dtype>::ToProto(NetParameter* param, bool write_diff) const {
   }
   DLOG(INFO) << "Serializing " << layers_.size() << " layers";
   for (int i = 0; i < layers_.size(); ++i) {
+    // As Layer::ToProto, with the given blobs
     LayerParameter* layer_param = param->add_layer();
-    for (int j = 0; j < bottom_id_vecs_[i].size(); ++j) {
-      layer_param->add_bottom(blob_names_[bottom_id_vecs_[i][j]]);
+    layer_param->CopyFrom(layers_[i]->layer_param());
+    layer_param->clear_blobs();
+    for (int j = 0; j < param_id_vecs_[i].size(); ++j) {
+      params[param_id_vecs_[i][j]]->ToProto(layer_param->add_blobs(),
+          write_diff);
     }
-    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
-      layer_param->add_top(blob_names_[top_id_vecs_[i][j]]);
-    }
-    layers_[i]->ToProto(layer_param, write_diff);
   }
 }
 
 template <typename Dtype>
 void Net<Dtype>::ToHDF5(const string& filename, bool write_diff) const {
+  ToHDF5(filename, write_diff, params_);
+}
+
+template <typename Dtype>
+void Net<Dtype>::ToHDF5(const string& filename, bool write_diff,
+    const vector<shared_ptr<Blob<Dtype> > >& params) const {
+  CHECK_EQ(params.size(), params_.size());
   hid_t file_hid = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
       H5P_DEFAULT);
   CHECK_GE(file_hid, 0)
@@ -971,12 +4461,12 @@ void Net<Dtype>::ToHDF5(const string& filename, bool write_diff) const {
       if (param_owners_[net_param_id] == -1) {
         // Only save params that own themselves
         hdf5_save_nd_dataset<Dtype>(layer_data_hid, dataset_name.str(),
-            *params_[net_param_id]);
+            *params[net_param_id]);
       }
       if (write_diff) {
         // Write diffs regardless of weight-sharing
         hdf5_save_nd_dataset<Dtype>(layer_diff_hid, dataset_name.str(),
-            *params_[net_param_id], true);
+            *params[net_param_id], true);
       }
     }
     H5Gclose(layer_data_hid);
@@ -991,32 +4481,208 @@ void Net<Dtype>::ToHDF5(const string& filename, bool write_diff) const {
   H5Fclose(file_hid);
 }
 
+template <typename Dtype>
+void Net<Dtype>::FreezeParams(bool force_backward) {
+  params_frozen_.assign(learnable_params_.size(), true);
+  for (int layer_id = 0; layer_id < layers_.size(); ++layer_id) {
+    const vector<int>& param_ids = param_id_vecs_[layer_id];
+    for (int j = 0; j < param_ids.size(); ++j) {
+      const int learnable_param_id = learnable_param_ids_[param_ids[j]];
+      // A later sharer may have set the lr_mult of the owner to 0.
+      if (params_lr_[learnable_param_id] == 0 && !force_backward) {
+        layers_[layer_id]->set_param_propagate_down(j, false);
+      }
+      if (params_lr_[learnable_param_id] != 0
+          || (layer_need_backward_[layer_id]
+              && layers_[layer_id]->param_propagate_down(j))) {
+        params_frozen_[learnable_param_id] = false;
+      }
+    }
+  }
+  int frozen = 0;
+  for (int i = 0; i < params_frozen_.size(); ++i) {
+    frozen += params_frozen_[i];
+  }
+  LOG_IF(INFO, Caffe::root_solver() && frozen) << "Freezing " << frozen
+      << " of " << params_frozen_.size() << " learnable params";
+}
+
+template <typename Dtype>
+void Net<Dtype>::LayOutParams() {
+  int count = 0;
+  for (int i = 0; i < learnable_params_.size(); ++i) {
+    if (!params_frozen_[i] && !params_shared_[i] && !params_sparse_[i]) {
+      count += learnable_params_[i]->count();
+    }
+  }
+  if (count == 0) {
+    return;
+  }
+  flat_params_.reset(new Blob<Dtype>(vector<int>(1, count)));
+  Dtype* flat_data = flat_params_->mutable_cpu_data();
+  int offset = 0;
+  for (int i = 0; i < learnable_params_.size(); ++i) {
+    if (params_frozen_[i] || params_shared_[i] || params_sparse_[i]) {
+      continue;
+    }
+    Blob<Dtype>* param = learnable_params_[i];
+    caffe_copy(param->count(), param->cpu_data(), flat_data + offset);
+    param->ShareView(*flat_params_, offset);
+    offset += param->count();
+  }
+  // The params sharing the values of owners follow them.
+  ShareWeights();
+}
+
+template <typename Dtype>
+bool Net<Dtype>::params_flat() const {
+  if (!flat_params_) {
+    return false;
+  }
+  for (int i = 0; i < learnable_params_.size(); ++i) {
+    if (params_frozen_[i] || params_shared_[i] || params_sparse_[i]) {
+      continue;
+    }
+    const Blob<Dtype>& param = *learnable_params_[i];
+    if (param.data()->owner() != flat_params_->data().get() ||
+        param.diff()->owner() != flat_params_->diff().get()) {
+      return false;
+    }
+  }
+  return true;
+}
+
 template <typename Dtype>
 void Net<Dtype>::Update() {
+  const bool flat = params_flat();
+  if (flat) {
+    flat_params_->Update();
+  }
   for (int i = 0; i < learnable_params_.size(); ++i) {
-    learnable_params_[i]->Update();
+    if (!params_frozen_[i] &&
+        !(flat && !params_shared_[i] && !params_sparse_[i])) {
+      learnable_params_[i]->Update();
+    }
+  }
+}
+
+template <typename Dtype>
+static void ClearDiff(Blob<Dtype>* blob) {
+  switch (Caffe::mode()) {
+  case Caffe::CPU:
+    caffe_set(blob->count(), static_cast<Dtype>(0), blob->mutable_cpu_diff());
+    break;
+  case Caffe::GPU:
+#ifndef CPU_ONLY
+    caffe_gpu_set(blob->count(), static_cast<Dtype>(0),
+                  blob->mutable_gpu_diff());
+#else
+    NO_GPU;
+#endif
+    break;
   }
 }
 
 template <typename Dtype>
 void Net<Dtype>::ClearParamDiffs() {
+  const bool flat = params_flat();
+  if (flat) {
+    ClearDiff(flat_params_.get());
+  }
   for (int i = 0; i < learnable_params_.size(); ++i) {
-    Blob<Dtype>* blob = learnable_params_[i];
-    switch (Caffe::mode()) {
-    case Caffe::CPU:
-      caffe_set(blob->count(), static_cast<Dtype>(0),
-                blob->mutable_cpu_diff());
-      break;
-    case Caffe::GPU:
+    // The root net clears the shared params, the others may still be adding
+    // to them
+    if (params_frozen_[i] || (params_shared_[i] && root_net_) ||
+        (flat && !params_shared_[i] && !params_sparse_[i])) {
+      continue;
+    }
+    if (params_sparse_[i]) {
+      ClearParamRows(i);
+    } else {
+      ClearDiff(learnable_params_[i]);
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ClearParamRows(const int learnable_param_id) {
+  Blob<Dtype>* blob = learnable_params_[learnable_param_id];
+  vector<int>& rows = param_rows_[learnable_param_id];
+  const int row_size = blob->count(1);
+  switch (Caffe::mode()) {
+  case Caffe::CPU: {
+    Dtype* diff = blob->mutable_cpu_diff();
+    for (int j = 0; j < rows.size(); ++j) {
+      caffe_set(row_size, static_cast<Dtype>(0), diff + rows[j] * row_size);
+    }
+    break;
+  }
+  case Caffe::GPU:
 #ifndef CPU_ONLY
-      caffe_gpu_set(blob->count(), static_cast<Dtype>(0),
-                    blob->mutable_gpu_diff());
+    if (rows.size()) {
+      clear_rows_.Reshape(vector<int>(1, rows.size()));
+      std::copy(rows.begin(), rows.end(), clear_rows_.mutable_cpu_data());
+      caffe_gpu_set_rows(rows.size(), clear_rows_.gpu_data(), row_size,
+                         static_cast<Dtype>(0), blob->mutable_gpu_diff());
+    }
 #else
-      NO_GPU;
+    NO_GPU;
 #endif
-      break;
+    break;
+  }
+  rows.clear();
+  for (int i = 0; i < params_.size(); ++i) {
+    if (learnable_param_ids_[i] == learnable_param_id) {
+      const pair<int, int>& index = param_layer_indices_[i];
+      layers_[index.first]->ClearParamRows(index.second);
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::GatherParamRows() {
+  for (int i = 0; i < params_sparse_.size(); ++i) {
+    if (params_sparse_[i]) {
+      param_rows_[i].clear();
+    }
+  }
+  for (int i = 0; i < params_.size(); ++i) {
+    const int learnable_param_id = learnable_param_ids_[i];
+    if (!params_sparse_[learnable_param_id]) {
+      continue;
     }
+    const pair<int, int>& index = param_layer_indices_[i];
+    const vector<int>& rows =
+        *layers_[index.first]->param_rows(index.second);
+    vector<int>& param_rows = param_rows_[learnable_param_id];
+    param_rows.insert(param_rows.end(), rows.begin(), rows.end());
   }
+  for (int i = 0; i < params_sparse_.size(); ++i) {
+    if (params_sparse_[i]) {
+      vector<int>& rows = param_rows_[i];
+      std::sort(rows.begin(), rows.end());
+      rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::AddParamRows(const int learnable_param_id,
+                              const vector<int>& rows) {
+  CHECK(params_sparse_[learnable_param_id]);
+  vector<int>& param_rows = param_rows_[learnable_param_id];
+  const int middle = param_rows.size();
+  param_rows.insert(param_rows.end(), rows.begin(), rows.end());
+  std::sort(param_rows.begin() + middle, param_rows.end());
+  std::inplace_merge(param_rows.begin(), param_rows.begin() + middle,
+                     param_rows.end());
+  param_rows.erase(std::unique(param_rows.begin(), param_rows.end()),
+                   param_rows.end());
+}
+
+template <typename Dtype>
+void Net<Dtype>::DensifyParams() {
+  params_sparse_.assign(params_sparse_.size(), false);
 }
 
 template <typename Dtype>
@@ -7,6 +7,8 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <climits>
 #include <cstdlib>
 #include <sstream>
 #include <string>
@@ -15,6 +17,9 @@
 #include "boost/thread.hpp"
 #include "caffe/caffe.hpp"
 #include "caffe/parallel.hpp"
+#include "caffe/util/device_thread.hpp"
+#include "caffe/util/numa.hpp"
+#include "caffe/util/nvtx.hpp"
 
 namespace caffe {
 
@@ -70,9 +75,34 @@ static size_t total_size(const vector<Blob<Dtype>*>& params) {
   return (size > 0) ? size : 1;
 }
 
+// The learnable params of a net that are updated, or with frozen all of them,
+// the frozen ones after the others, in the order of the buffers. The params of
+// layers shared by all solvers, e.g. model parallel ones, are the same blobs
+// in all nets, so are left out.
+template<typename Dtype>
+static vector<Blob<Dtype>*> buffer_params(const Net<Dtype>& net, bool frozen) {
+  vector<Blob<Dtype>*> params;
+  for (int pass = 0; pass < (frozen ? 2 : 1); ++pass) {
+    for (int i = 0; i < net.learnable_params().size(); ++i) {
+      if (!net.params_shared()[i] && net.params_frozen()[i] == (pass == 1)) {
+        params.push_back(net.learnable_params()[i]);
+      }
+    }
+  }
+  return params;
+}
+
+// Whether a net has params shared by all solvers, see buffer_params
+template<typename Dtype>
+static bool has_shared_params(const Net<Dtype>& net) {
+  const vector<bool>& shared = net.params_shared();
+  return std::find(shared.begin(), shared.end(), true) != shared.end();
+}
+
 template<typename Dtype>
 Params<Dtype>::Params(shared_ptr<Solver<Dtype> > root_solver)
-    : size_(total_size<Dtype>(root_solver->net()->learnable_params())),
+    : size_(total_size<Dtype>(buffer_params(*root_solver->net(), false))),
+      data_size_(total_size<Dtype>(buffer_params(*root_solver->net(), true))),
       data_(),
       diff_() {
 }
@@ -86,12 +116,11 @@ GPUParams<Dtype>::GPUParams(shared_ptr<Solver<Dtype> > root_solver, int device)
 
   // Allocate device buffers
   CUDA_CHECK(cudaSetDevice(device));
-  CUDA_CHECK(cudaMalloc(&data_, size_ * sizeof(Dtype)));
+  CUDA_CHECK(cudaMalloc(&data_, data_size_ * sizeof(Dtype)));
 
   // Copy blob values
-  const vector<Blob<Dtype>*>& net =
-      root_solver->net()->learnable_params();
-  apply_buffers(net, data_, size_, copy);
+  apply_buffers(buffer_params(*root_solver->net(), true), data_, data_size_,
+      copy);
 
   CUDA_CHECK(cudaMalloc(&diff_, size_ * sizeof(Dtype)));
   caffe_gpu_set(size_, Dtype(0), diff_);
@@ -112,81 +141,112 @@ GPUParams<Dtype>::~GPUParams() {
 
 template<typename Dtype>
 void GPUParams<Dtype>::configure(Solver<Dtype>* solver) const {
-  const vector<Blob<Dtype>*>& net =
-      solver->net()->learnable_params();
-  apply_buffers(net, data_, size_, replace_gpu);
-  apply_buffers(net, diff_, size_, replace_gpu_diff);
+  // The diffs are summed densely across devices, leaving in those of each
+  // solver the rows the others touched
+  solver->net()->DensifyParams();
+  const Net<Dtype>& net = *solver->net();
+  apply_buffers(buffer_params(net, true), data_, data_size_, replace_gpu);
+  apply_buffers(buffer_params(net, false), diff_, size_, replace_gpu_diff);
 }
 
-void DevicePair::compute(const vector<int> devices, vector<DevicePair>* pairs) {
 #ifndef CPU_ONLY
-  vector<int> remaining(devices);
+// Links between two GPUs, from the fastest. Reductions stay within the
+// fastest link level first, GPUs reaching the next level only through the
+// parents of their groups.
+enum GPULink {
+  kBoardLink,     // GPUs of the same multi-GPU board
+  kNVLink,        // Peer access over NVLink
+  kSwitchLink,    // Peer access behind a common PCIe switch
+  kSocketLink,    // Through the root complex of one CPU socket
+  kSystemLink,    // Across the link between sockets, e.g. QPI
+  kGPULinks
+};
 
-  // Depth for reduction tree
-  int remaining_depth = static_cast<int>(ceil(log2(remaining.size())));
+static GPULink ComputeGPULink(int a, int b) {
+  cudaDeviceProp props_a, props_b;
+  CUDA_CHECK(cudaGetDeviceProperties(&props_a, a));
+  CUDA_CHECK(cudaGetDeviceProperties(&props_b, b));
+  if (props_a.isMultiGpuBoard && props_b.isMultiGpuBoard &&
+      props_a.multiGpuBoardGroupID == props_b.multiGpuBoardGroupID) {
+    return kBoardLink;
+  }
+  int access;
+  CUDA_CHECK(cudaDeviceCanAccessPeer(&access, a, b));
+#if CUDART_VERSION >= 8000
+  // Native atomics between peers are, in practice, only supported over
+  // NVLink, which the runtime does not otherwise tell
+  int atomics = 0;
+  if (access) {
+    CUDA_CHECK(cudaDeviceGetP2PAttribute(&atomics,
+        cudaDevP2PAttrNativeAtomicSupported, a, b));
+  }
+  if (atomics) {
+    return kNVLink;
+  }
+#endif
+  const int bridges = SharedPCIBridges(DevicePCIPath(a), DevicePCIPath(b));
+  if (access && bridges > 0) {
+    return kSwitchLink;
+  }
+  int node_a, node_b;
+  DeviceCPUs(a, &node_a);
+  DeviceCPUs(b, &node_b);
+  if (bridges >= 0 || (node_a >= 0 && node_a == node_b)) {
+    return kSocketLink;
+  }
+  return kSystemLink;
+}
+#endif
 
-  // Group GPUs by board
-  for (int d = 0; d < remaining_depth; ++d) {
-    for (int i = 0; i < remaining.size(); ++i) {
-      for (int j = i + 1; j < remaining.size(); ++j) {
-        cudaDeviceProp a, b;
-        CUDA_CHECK(cudaGetDeviceProperties(&a, remaining[i]));
-        CUDA_CHECK(cudaGetDeviceProperties(&b, remaining[j]));
-        if (a.isMultiGpuBoard && b.isMultiGpuBoard) {
-          if (a.multiGpuBoardGroupID == b.multiGpuBoardGroupID) {
-            pairs->push_back(DevicePair(remaining[i], remaining[j]));
-            DLOG(INFO) << "GPU board: " << remaining[i] << ":" << remaining[j];
-            remaining.erase(remaining.begin() + j);
-            break;
-          }
-        }
-      }
+void DevicePair::compute(const vector<int> devices, vector<DevicePair>* pairs) {
+#ifndef CPU_ONLY
+  // Links between all GPUs, by index in devices
+  const int count = devices.size();
+  vector<vector<GPULink> > links(count, vector<GPULink>(count, kSystemLink));
+  for (int i = 0; i < count; ++i) {
+    for (int j = i + 1; j < count; ++j) {
+      links[i][j] = links[j][i] = ComputeGPULink(devices[i], devices[j]);
     }
   }
-  ostringstream s;
-  for (int i = 0; i < remaining.size(); ++i) {
-    s << (i ? ", " : "") << remaining[i];
-  }
-  DLOG(INFO) << "GPUs paired by boards, remaining: " << s.str();
 
-  // Group by P2P accessibility
-  remaining_depth = ceil(log2(remaining.size()));
-  for (int d = 0; d < remaining_depth; ++d) {
-    for (int i = 0; i < remaining.size(); ++i) {
-      for (int j = i + 1; j < remaining.size(); ++j) {
-        int access;
-        CUDA_CHECK(
-            cudaDeviceCanAccessPeer(&access, remaining[i], remaining[j]));
-        if (access) {
-          pairs->push_back(DevicePair(remaining[i], remaining[j]));
-          DLOG(INFO) << "P2P pair: " << remaining[i] << ":" << remaining[j];
-          remaining.erase(remaining.begin() + j);
-          break;
+  // Pair the GPUs left over each link, from the fastest, by rounds of the
+  // depth of their reduction tree. The parents of the pairs of a round, the
+  // GPUs remaining, are paired in the next. All pair over kSystemLink.
+  static const char* link_names[] = {"board", "NVLink", "PCIe switch",
+                                     "socket", "system"};
+  vector<int> remaining;
+  for (int i = 0; i < count; ++i) {
+    remaining.push_back(i);
+  }
+  for (int link = 0; link < kGPULinks; ++link) {
+    const int depth = static_cast<int>(ceil(log2(remaining.size())));
+    for (int d = 0; d < depth; ++d) {
+      for (int i = 0; i < remaining.size(); ++i) {
+        for (int j = i + 1; j < remaining.size(); ++j) {
+          if (links[remaining[i]][remaining[j]] <= link) {
+            const int parent = devices[remaining[i]];
+            const int device = devices[remaining[j]];
+            pairs->push_back(DevicePair(parent, device));
+            DLOG(INFO) << "Pair over " << link_names[link] << ": "
+                       << parent << ":" << device;
+            remaining.erase(remaining.begin() + j);
+            break;
+          }
         }
       }
     }
-  }
-  s.str("");
-  for (int i = 0; i < remaining.size(); ++i) {
-    s << (i ? ", " : "") << remaining[i];
-  }
-  DLOG(INFO) << "GPUs paired by P2P access, remaining: " << s.str();
-
-  // Group remaining
-  remaining_depth = ceil(log2(remaining.size()));
-  for (int d = 0; d < remaining_depth; ++d) {
+    ostringstream s;
     for (int i = 0; i < remaining.size(); ++i) {
-      pairs->push_back(DevicePair(remaining[i], remaining[i + 1]));
-      DLOG(INFO) << "Remaining pair: " << remaining[i] << ":"
-                 << remaining[i + 1];
-      remaining.erase(remaining.begin() + i + 1);
+      s << (i ? ", " : "") << devices[remaining[i]];
     }
+    DLOG(INFO) << "GPUs paired over " << link_names[link]
+               << ", remaining: " << s.str();
   }
 
   // Should only be the parent node remaining
   CHECK_EQ(remaining.size(), 1);
 
-  pairs->insert(pairs->begin(), DevicePair(-1, remaining[0]));
+  pairs->insert(pairs->begin(), DevicePair(-1, devices[remaining[0]]));
 
   CHECK(pairs->size() == devices.size());
   for (int i = 0; i < pairs->size(); ++i) {
@@ -200,6 +260,17 @@ void DevicePair::compute(const vector<int> devices, vector<DevicePair>* pairs) {
 #endif
 }
 
+void DevicePair::compute_in_order(const vector<int> devices,
+                                  vector<DevicePair>* pairs) {
+  pairs->push_back(DevicePair(-1, devices[0]));
+  const int count = devices.size();
+  for (int step = 1; step < count; step *= 2) {
+    for (int i = 0; i + step < count; i += 2 * step) {
+      pairs->push_back(DevicePair(devices[i], devices[i + step]));
+    }
+  }
+}
+
 //
 
 template<typename Dtype>
@@ -210,23 +281,101 @@ P2PSync<Dtype>::P2PSync(shared_ptr<Solver<Dtype> > root_solver,
       children_(),
       queue_(),
       initial_iter_(root_solver->iter()),
-      solver_() {
+      parent_grads_(),
+      solver_(),
+      half_(),
+      parent_half_(),
+      residual_(),
+      ring_prev_(),
+      ring_next_(),
+      ring_rank_(0),
+      ring_size_(1),
+      ring_buffer_(),
+      ring_peer_access_(false),
+      slices_reduced_(0),
+      backward_passes_(0),
+      local_steps_(0) {
 #ifndef CPU_ONLY
   int initial_device;
   CUDA_CHECK(cudaGetDevice(&initial_device));
   const int self = param.device_id();
   CUDA_CHECK(cudaSetDevice(self));
 
+  if (param.shard_update()) {
+    CHECK(param.sync_mode() == SolverParameter_SyncMode_RING)
+        << "shard_update requires RING mode";
+    CHECK_LT(param.clip_gradients(), 0)
+        << "clip_gradients is not supported with shard_update";
+  }
+  if (param.deterministic_reduction()) {
+    CHECK(param.sync_mode() != SolverParameter_SyncMode_ASYNC)
+        << "deterministic_reduction is not supported in ASYNC mode";
+  }
+  if (param.reduce_bucket_size() > 0) {
+    CHECK(param.sync_mode() == SolverParameter_SyncMode_TREE)
+        << "reduce_bucket_size requires TREE mode";
+  }
+  const bool local = param.local_steps() > 1;
+  if (local) {
+    CHECK(param.sync_mode() != SolverParameter_SyncMode_ASYNC)
+        << "local_steps is not supported in ASYNC mode";
+    CHECK(!param.shard_update())
+        << "local_steps is not supported with shard_update";
+    CHECK(!param.fp16_transfer())
+        << "local_steps is not supported with fp16_transfer";
+  }
+  if (has_shared_params(*root_solver->net())) {
+    // All solvers add to the gradients of the shared params, which the root
+    // applies once the others are done
+    CHECK(param.sync_mode() != SolverParameter_SyncMode_ASYNC)
+        << "Layers shared in parallel are not supported in ASYNC mode";
+    CHECK(!param.shard_update())
+        << "Layers shared in parallel are not supported with shard_update";
+    CHECK(!local)
+        << "Layers shared in parallel are not supported with local_steps";
+  }
   if (parent == NULL) {
     solver_ = root_solver;
   } else {
+    // Workers only compute gradients, unless they update their shard or
+    // their own weights
     Caffe::set_root_solver(false);
-    solver_.reset(new WorkerSolver<Dtype>(param, root_solver.get()));
+    if (param.shard_update() || local) {
+      solver_.reset(GetSolver<Dtype>(param, root_solver.get()));
+    } else {
+      solver_.reset(new WorkerSolver<Dtype>(param, root_solver.get()));
+    }
     Caffe::set_root_solver(true);
   }
   this->configure(solver_.get());
   solver_->add_callback(this);
 
+  // Gradients of the last layers are sent during backward in tree mode, in
+  // the last of the iter_size passes once they are accumulated. With
+  // local_steps, none are sent.
+  const bool overlap = param.sync_mode() == SolverParameter_SyncMode_TREE
+      && !local;
+  compute_slices(overlap);
+  if (overlap) {
+    solver_->net()->add_after_backward(this);
+  }
+  if (param.fp16_transfer()) {
+    CHECK(param.sync_mode() != SolverParameter_SyncMode_RING)
+        << "fp16_transfer is not supported in RING mode";
+    CUDA_CHECK(cudaMalloc(&half_, size_ * sizeof(uint16_t)));
+    if (parent && param.fp16_error_feedback()) {
+      CUDA_CHECK(cudaMalloc(&residual_, size_ * sizeof(Dtype)));
+      caffe_gpu_set(size_, Dtype(0), residual_);
+    }
+  }
+  CUDA_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+  CUDA_CHECK(cudaEventCreateWithFlags(&ready_event_, cudaEventDisableTiming));
+  slice_events_.resize(slice_begin_.size());
+  for (int i = 0; i < slice_events_.size(); ++i) {
+    CUDA_CHECK(cudaEventCreateWithFlags(&slice_events_[i],
+        cudaEventDisableTiming));
+  }
+
   if (parent) {
     // Enable p2p access between devices
     const int peer = parent->solver_->param().device_id();
@@ -237,10 +386,15 @@ P2PSync<Dtype>::P2PSync(shared_ptr<Solver<Dtype> > root_solver,
     } else {
       LOG(INFO)<< "GPU " << self << " does not have p2p access to GPU " << peer;
     }
-    // Allocate receiving buffer on parent
-    CUDA_CHECK(cudaSetDevice(peer));
-    CUDA_CHECK(cudaMalloc(&parent_grads_, size_ * sizeof(Dtype)));
-    CUDA_CHECK(cudaSetDevice(self));
+    // Allocate receiving buffer on parent, the ring uses its own buffers
+    if (param.sync_mode() != SolverParameter_SyncMode_RING) {
+      CUDA_CHECK(cudaSetDevice(peer));
+      CUDA_CHECK(cudaMalloc(&parent_grads_, size_ * sizeof(Dtype)));
+      if (param.fp16_transfer()) {
+        CUDA_CHECK(cudaMalloc(&parent_half_, size_ * sizeof(uint16_t)));
+      }
+      CUDA_CHECK(cudaSetDevice(self));
+    }
   }
 
   CUDA_CHECK(cudaSetDevice(initial_device));
@@ -258,7 +412,12 @@ P2PSync<Dtype>::~P2PSync() {
   CUDA_CHECK(cudaSetDevice(self));
 
   if (parent_) {
-    CUDA_CHECK(cudaFree(parent_grads_));
+    if (parent_grads_) {
+      CUDA_CHECK(cudaFree(parent_grads_));
+    }
+    if (parent_half_) {
+      CUDA_CHECK(cudaFree(parent_half_));
+    }
     const int peer = parent_->solver_->param().device_id();
     int access;
     CUDA_CHECK(cudaDeviceCanAccessPeer(&access, self, peer));
@@ -266,6 +425,24 @@ P2PSync<Dtype>::~P2PSync() {
       CUDA_CHECK(cudaDeviceDisablePeerAccess(peer));
     }
   }
+  if (half_) {
+    CUDA_CHECK(cudaFree(half_));
+  }
+  if (residual_) {
+    CUDA_CHECK(cudaFree(residual_));
+  }
+  if (ring_buffer_) {
+    CUDA_CHECK(cudaFree(ring_buffer_));
+  }
+  if (ring_peer_access_) {
+    CUDA_CHECK(cudaDeviceDisablePeerAccess(
+        ring_prev_->solver_->param().device_id()));
+  }
+  for (int i = 0; i < slice_events_.size(); ++i) {
+    CUDA_CHECK(cudaEventDestroy(slice_events_[i]));
+  }
+  CUDA_CHECK(cudaEventDestroy(ready_event_));
+  CUDA_CHECK(cudaStreamDestroy(stream_));
 
   CUDA_CHECK(cudaSetDevice(initial_device));
 #endif
@@ -289,6 +466,7 @@ void P2PSync<Dtype>::InternalThreadEntry() {
 
 template<typename Dtype>
 void P2PSync<Dtype>::on_start() {
+  NVTX_RANGE("P2PSync on_start");
 #ifndef CPU_ONLY
 #ifdef DEBUG
   int device;
@@ -298,14 +476,52 @@ void P2PSync<Dtype>::on_start() {
 //  CHECK(false);
 #endif
 
-  // Wait for update from parent
+  slices_reduced_ = 0;
+  backward_passes_ = 0;
+  children_slices_.assign(children_.size(), 0);
+  if (solver_->param().shard_update()) {
+    // Weights were all-gathered after the last update
+    return;
+  }
+  if (solver_->param().local_steps() > 1) {
+    // Each solver goes on from its own weights
+    return;
+  }
+  broadcast_weights();
+#endif
+}
+
+template<typename Dtype>
+void P2PSync<Dtype>::broadcast_weights() {
+#ifndef CPU_ONLY
+#ifdef DEBUG
+  int device;
+  CUDA_CHECK(cudaGetDevice(&device));
+#endif
+
+  // Wait for update from parent. In fp16, weights are forwarded to children
+  // as received, the root converts them once.
+  const bool half = solver_->param().fp16_transfer();
   if (parent_) {
     P2PSync<Dtype> *parent = queue_.pop();
     CHECK(parent == parent_);
+    if (half) {
+      caffe_gpu_from_half(size_, half_, data_);
+    }
+  } else if (half && children_.size()) {
+    caffe_gpu_to_half(size_, data_, half_);
   }
 
-  // Update children
+  // Update children, in ASYNC mode only those done with their weights
+  const bool async = solver_->param().sync_mode()
+      == SolverParameter_SyncMode_ASYNC;
   for (int i = children_.size() - 1; i >= 0; i--) {
+    if (async) {
+      if (children_versions_[i] >= 0) {
+        continue;
+      }
+      children_versions_[i] = solver_->iter();
+    }
     Dtype* src = data_;
     Dtype* dst = children_[i]->data_;
 
@@ -317,8 +533,14 @@ void P2PSync<Dtype>::on_start() {
     CHECK(attributes.device == children_[i]->solver_->param().device_id());
 #endif
 
-    CUDA_CHECK(cudaMemcpyAsync(dst, src, size_ * sizeof(Dtype),
-        cudaMemcpyDeviceToDevice, cudaStreamDefault));
+    if (half) {
+      CUDA_CHECK(cudaMemcpyAsync(children_[i]->half_, half_,
+          size_ * sizeof(uint16_t), cudaMemcpyDeviceToDevice,
+          cudaStreamDefault));
+    } else {
+      CUDA_CHECK(cudaMemcpyAsync(dst, src, size_ * sizeof(Dtype),
+          cudaMemcpyDeviceToDevice, cudaStreamDefault));
+    }
     CUDA_CHECK(cudaStreamSynchronize(cudaStreamDefault));
     children_[i]->queue_.push(this);
   }
@@ -327,6 +549,7 @@ void P2PSync<Dtype>::on_start() {
 
 template<typename Dtype>
 void P2PSync<Dtype>::on_gradients_ready() {
+  NVTX_RANGE("P2PSync on_gradients_ready");
 #ifndef CPU_ONLY
 #ifdef DEBUG
   int device;
@@ -334,52 +557,379 @@ void P2PSync<Dtype>::on_gradients_ready() {
   CHECK(device == solver_->param().device_id());
 #endif
 
-  // Sum children gradients as they appear in the queue
-  for (int i = 0; i < children_.size(); ++i) {
-    P2PSync<Dtype> *child = queue_.pop();
-    Dtype* src = child->parent_grads_;
-    Dtype* dst = diff_;
+  if (solver_->param().sync_mode() == SolverParameter_SyncMode_ASYNC) {
+    async_gradients_ready();
+    return;
+  }
+  if (solver_->param().local_steps() > 1) {
+    // Each solver applies its own gradients
+    return;
+  }
+
+  if (ring_size_ > 1 && solver_->param().shard_update()) {
+    // Only reduce-scatter, each solver then scales the chunk it updates.
+    const int n = ring_size_;
+    ring_steps(0, n - 1, false);
+    const int chunk = (ring_rank_ + 1) % n;
+    const size_t begin = size_ * chunk / n;
+    const size_t count = size_ * (chunk + 1) / n - begin;
+    if (count > 0) {
+      caffe_gpu_scal(count, Dtype(1.0 / Caffe::solver_count()),
+          diff_ + begin);
+    }
+    return;
+  }
+
+  if (ring_size_ > 1) {
+    ring_all_reduce();
+    if (!parent_) {
+      // See below, the root solver compensates for the split batch.
+      caffe_gpu_scal(size_, Dtype(1.0 / Caffe::solver_count()), diff_);
+    }
+    return;
+  }
+
+  // Reduce the slices not sent during backward
+  reduce_slices(slice_begin_.size());
+
+  if (!parent_) {
+    // Loss functions divide gradients by the batch size, so to compensate
+    // for split batch, the root solver divides by number of solvers.
+    caffe_gpu_scal(size_, Dtype(1.0 / Caffe::solver_count()), diff_);
+  }
+#endif
+}
+
+template<typename Dtype>
+void P2PSync<Dtype>::on_update_applied() {
+  if (ring_size_ > 1 && solver_->param().shard_update()) {
+    ring_steps(ring_size_ - 1, 2 * (ring_size_ - 1), true);
+  }
+  const int local_steps = solver_->param().local_steps();
+  if (local_steps > 1) {
+    // All solvers count the same iterations, so average together, and on
+    // the last one so that the trained weights are those of all of them
+    const bool last = solver_->iter() + 1 == solver_->param().max_iter();
+    if (++local_steps_ == local_steps || last) {
+      local_steps_ = 0;
+      average_weights();
+    }
+  }
+}
+
+template<typename Dtype>
+void P2PSync<Dtype>::sum_weights() {
+#ifndef CPU_ONLY
+  // The gradients were applied, diff_ is free to carry the weights
+  caffe_copy(size_, data_, diff_);
+  if (ring_size_ > 1) {
+    ring_all_reduce();
+  } else {
+    slices_reduced_ = 0;
+    children_slices_.assign(children_.size(), 0);
+    reduce_slices(slice_begin_.size());
+  }
+#endif
+}
+
+template<typename Dtype>
+void P2PSync<Dtype>::average_weights() {
+#ifndef CPU_ONLY
+  sum_weights();
+  if (!parent_) {
+    caffe_gpu_scale(size_, Dtype(1.0 / Caffe::solver_count()), diff_, data_);
+  }
+  broadcast_weights();
+#endif
+}
+
+template<typename Dtype>
+void P2PSync<Dtype>::run(int layer) {
+  if (backward_passes_ == solver_->param().iter_size() - 1) {
+    reduce_slices(layer_slices_[layer]);
+  }
+  if (layer == 0) {
+    ++backward_passes_;
+  }
+}
+
+template<typename Dtype>
+void P2PSync<Dtype>::compute_slices(bool overlap) {
+  slice_begin_.clear();
+  const shared_ptr<Net<Dtype> >& net = solver_->net();
+  const int num_layers = net->layers().size();
+  layer_slices_.assign(num_layers, 0);
+  if (!overlap) {
+    // A single slice, sent once the whole backward pass is done
+    slice_begin_.push_back(0);
+    return;
+  }
+  // Offset of each learnable param in diff_, and the lowest layer using it,
+  // i.e. the last one to add to its gradient during backward.
+  const vector<Blob<Dtype>*>& learnable = net->learnable_params();
+  vector<size_t> offsets(learnable.size() + 1, 0);
+  for (int i = 0; i < learnable.size(); ++i) {
+    offsets[i + 1] = offsets[i] + (net->params_frozen()[i]
+        || net->params_shared()[i] ? 0 : learnable[i]->count());
+  }
+  vector<int> last_layer(learnable.size(), num_layers);
+  vector<int> learnable_ids(net->params().size());
+  for (int i = 0, owners = 0; i < net->params().size(); ++i) {
+    const int owner = net->param_owners()[i];
+    learnable_ids[i] = owner < 0 ? owners++ : learnable_ids[owner];
+  }
+  for (int layer = 0, id = 0; layer < num_layers; ++layer) {
+    for (int j = 0; j < net->layers()[layer]->blobs().size(); ++j, ++id) {
+      const int l = learnable_ids[id];
+      last_layer[l] = std::min(last_layer[l], layer);
+    }
+  }
+  // Avoid many small transfers, e.g. for biases. Fixed-size buckets are
+  // sent once all of their values are ready.
+  const size_t kMinSliceSize = 1 << 16;
+  const size_t bucket = solver_->param().reduce_bucket_size();
+  size_t end = offsets.back();
+  int first = learnable.size();  // First param of the ready suffix
+  for (int layer = num_layers - 1; layer >= 0; --layer) {
+    while (first > 0 && last_layer[first - 1] >= layer) {
+      --first;
+    }
+    const size_t begin = offsets[first];
+    if (bucket > 0) {
+      const size_t ready = (begin + bucket - 1) / bucket * bucket;
+      while (end > ready) {
+        end = (end - 1) / bucket * bucket;
+        slice_begin_.push_back(end);
+      }
+    } else if (begin < end && (end - begin >= kMinSliceSize || begin == 0)) {
+      slice_begin_.push_back(begin);
+      end = begin;
+    }
+    layer_slices_[layer] = slice_begin_.size();
+  }
+  if (slice_begin_.empty() || slice_begin_.back() != 0) {
+    slice_begin_.push_back(0);
+  }
+}
+
+template<typename Dtype>
+void P2PSync<Dtype>::reduce_slices(int count) {
+#ifndef CPU_ONLY
+  for (; slices_reduced_ < count; ++slices_reduced_) {
+    const int k = slices_reduced_;
+    const size_t begin = slice_begin_[k];
+    const size_t size = (k == 0 ? size_ : slice_begin_[k - 1]) - begin;
+
+    // Sum children gradients, children might send several slices ahead
+    for (int i = 0; i < children_.size(); ++i) {
+      while (children_slices_[i] <= k) {
+        P2PSync<Dtype> *child = queue_.pop();
+        int j = 0;
+        while (j < children_.size() && children_[j] != child) {
+          ++j;
+        }
+        CHECK_LT(j, children_.size());
+        ++children_slices_[j];
+      }
+      P2PSync<Dtype> *child = children_[i];
+      Dtype* src = child->parent_grads_ + begin;
+      Dtype* dst = diff_ + begin;
 
 #ifdef DEBUG
-    bool ok = false;
-    for (int j = 0; j < children_.size(); ++j) {
-      if (child == children_[j]) {
-        ok = true;
+      cudaPointerAttributes attributes;
+      CUDA_CHECK(cudaPointerGetAttributes(&attributes, src));
+      CHECK(attributes.device == solver_->param().device_id());
+      CUDA_CHECK(cudaPointerGetAttributes(&attributes, dst));
+      CHECK(attributes.device == solver_->param().device_id());
+#endif
+
+      CUDA_CHECK(cudaStreamWaitEvent(cudaStreamDefault,
+          child->slice_events_[k], 0));
+      if (half_) {
+        caffe_gpu_from_half(size, child->parent_half_ + begin, src);
       }
+      caffe_gpu_add(size, src, dst, dst);
     }
-    CHECK(ok);
-    cudaPointerAttributes attributes;
-    CUDA_CHECK(cudaPointerGetAttributes(&attributes, src));
-    CHECK(attributes.device == device);
-    CUDA_CHECK(cudaPointerGetAttributes(&attributes, dst));
-    CHECK(attributes.device == device);
+
+    // Send gradients to parent, without blocking backward computation
+    if (parent_) {
+      Dtype* src = diff_ + begin;
+      Dtype* dst = parent_grads_ + begin;
+
+#ifdef DEBUG
+      cudaPointerAttributes attributes;
+      CUDA_CHECK(cudaPointerGetAttributes(&attributes, src));
+      CHECK(attributes.device == solver_->param().device_id());
+      CUDA_CHECK(cudaPointerGetAttributes(&attributes, dst));
+      CHECK(attributes.device == parent_->solver_->param().device_id());
 #endif
 
-    caffe_gpu_add(size_, src, dst, dst);
+      if (half_) {
+        caffe_gpu_to_half(size, src, half_ + begin,
+                          residual_ ? residual_ + begin : NULL);
+      }
+      CUDA_CHECK(cudaEventRecord(ready_event_, cudaStreamDefault));
+      CUDA_CHECK(cudaStreamWaitEvent(stream_, ready_event_, 0));
+      if (half_) {
+        CUDA_CHECK(cudaMemcpyAsync(parent_half_ + begin, half_ + begin,
+            size * sizeof(uint16_t), cudaMemcpyDeviceToDevice, stream_));
+      } else {
+        CUDA_CHECK(cudaMemcpyAsync(dst, src, size * sizeof(Dtype),  //
+            cudaMemcpyDeviceToDevice, stream_));
+      }
+      CUDA_CHECK(cudaEventRecord(slice_events_[k], stream_));
+      parent_->queue_.push(this);
+    }
   }
+#endif
+}
 
-  // Send gradients to parent
+template<typename Dtype>
+void P2PSync<Dtype>::async_gradients_ready() {
+#ifndef CPU_ONLY
   if (parent_) {
-    Dtype* src = diff_;
-    Dtype* dst = parent_grads_;
+    if (half_) {
+      caffe_gpu_to_half(size_, diff_, half_, residual_);
+      CUDA_CHECK(cudaMemcpyAsync(parent_half_, half_,
+          size_ * sizeof(uint16_t), cudaMemcpyDeviceToDevice,
+          cudaStreamDefault));
+    } else {
+      CUDA_CHECK(cudaMemcpyAsync(parent_grads_, diff_,
+          size_ * sizeof(Dtype), cudaMemcpyDeviceToDevice,
+          cudaStreamDefault));
+    }
+    CUDA_CHECK(cudaStreamSynchronize(cudaStreamDefault));
+    parent_->queue_.push(this);
+    return;
+  }
 
-#ifdef DEBUG
-    cudaPointerAttributes attributes;
-    CUDA_CHECK(cudaPointerGetAttributes(&attributes, src));
-    CHECK(attributes.device == device);
-    CUDA_CHECK(cudaPointerGetAttributes(&attributes, dst));
-    CHECK(attributes.device == parent_->solver_->param().device_id());
+  // Sum gradients that already arrived, only waiting for children whose
+  // gradients would exceed the staleness bound if applied later.
+  const int iter = solver_->iter();
+  const int max_staleness = solver_->param().max_staleness();
+  for (;;) {
+    bool late = false;
+    for (int i = 0; i < children_.size(); ++i) {
+      const int version = children_versions_[i];
+      late |= version >= 0 && iter - version >= max_staleness;
+    }
+    P2PSync<Dtype> *child;
+    if (late) {
+      child = queue_.pop();
+    } else if (!queue_.try_pop(&child)) {
+      break;
+    }
+    int i = 0;
+    while (i < children_.size() && children_[i] != child) {
+      ++i;
+    }
+    CHECK_LT(i, children_.size());
+    CHECK_GE(children_versions_[i], 0);
+    children_versions_[i] = -1;
+    if (half_) {
+      caffe_gpu_from_half(size_, child->parent_half_, child->parent_grads_);
+    }
+    caffe_gpu_add(size_, child->parent_grads_, diff_, diff_);
+  }
+
+  // As in TREE mode, the update has the size of a synchronous one once all
+  // solvers keep up.
+  caffe_gpu_scal(size_, Dtype(1.0 / Caffe::solver_count()), diff_);
 #endif
+}
 
-    CUDA_CHECK(cudaMemcpyAsync(dst, src, size_ * sizeof(Dtype),  //
+template<typename Dtype>
+void P2PSync<Dtype>::ring_setup(P2PSync<Dtype>* prev, P2PSync<Dtype>* next,
+                                int rank, int size) {
+#ifndef CPU_ONLY
+  ring_prev_ = prev;
+  ring_next_ = next;
+  ring_rank_ = rank;
+  ring_size_ = size;
+
+  int initial_device;
+  CUDA_CHECK(cudaGetDevice(&initial_device));
+  const int self = solver_->param().device_id();
+  CUDA_CHECK(cudaSetDevice(self));
+
+  // Chunks are read from the previous device, which might already be
+  // accessible if it is also the parent in the tree
+  const int peer = prev->solver_->param().device_id();
+  int access;
+  CUDA_CHECK(cudaDeviceCanAccessPeer(&access, self, peer));
+  if (access) {
+    cudaError_t err = cudaDeviceEnablePeerAccess(peer, 0);
+    if (err == cudaErrorPeerAccessAlreadyEnabled) {
+      cudaGetLastError();
+    } else {
+      CUDA_CHECK(err);
+      ring_peer_access_ = true;
+    }
+  } else {
+    LOG(INFO)<< "GPU " << self << " does not have p2p access to GPU " << peer;
+  }
+  // Largest chunk, see ring_all_reduce
+  const size_t chunk = (size_ + size - 1) / size;
+  CUDA_CHECK(cudaMalloc(&ring_buffer_, chunk * sizeof(Dtype)));
+
+  CUDA_CHECK(cudaSetDevice(initial_device));
+#else
+  NO_GPU;
+#endif
+}
+
+// Splits diff_ in ring_size_ chunks. In the first ring_size_ - 1 steps
+// (reduce-scatter), each solver adds the previous solver's partial sum of a
+// chunk to its own, so that solver r ends up with the total of chunk r + 1.
+// In the last ring_size_ - 1 steps (all-gather), totals are copied along the
+// ring. Each solver sends and receives 2 * (ring_size_ - 1) chunks per
+// iteration, so per-GPU traffic is about 2 * size_, whatever the GPU count.
+template<typename Dtype>
+void P2PSync<Dtype>::ring_all_reduce() {
+  ring_steps(0, 2 * (ring_size_ - 1), false);
+}
+
+template<typename Dtype>
+void P2PSync<Dtype>::ring_steps(int first, int last, bool weights) {
+#ifndef CPU_ONLY
+  const int n = ring_size_;
+  Dtype* buffer = weights ? data_ : diff_;
+
+  // The buffer is ready, the next solver can start reading it
+  CUDA_CHECK(cudaStreamSynchronize(cudaStreamDefault));
+  ring_next_->ring_queue_.push(this);
+
+  for (int step = first; step < last; ++step) {
+    P2PSync<Dtype> *prev = ring_queue_.pop();
+    CHECK(prev == ring_prev_);
+
+    // Solver r reads chunk r - step - 1 while reducing, then chunk r - step
+    // while gathering. The previous solver completed it in the step before.
+    const bool reduce = step < n - 1;
+    const int chunk_step = reduce ? step + 1 : step - (n - 1);
+    const int chunk = ((ring_rank_ - chunk_step) % n + n) % n;
+    const size_t begin = size_ * chunk / n;
+    const size_t count = size_ * (chunk + 1) / n - begin;
+
+    Dtype* src = (weights ? prev->data_ : prev->diff_) + begin;
+    Dtype* dst = reduce ? ring_buffer_ : buffer + begin;
+    CUDA_CHECK(cudaMemcpyAsync(dst, src, count * sizeof(Dtype),  //
         cudaMemcpyDeviceToDevice, cudaStreamDefault));
+    if (reduce && count > 0) {
+      caffe_gpu_add(count, ring_buffer_, buffer + begin, buffer + begin);
+    }
     CUDA_CHECK(cudaStreamSynchronize(cudaStreamDefault));
-    parent_->queue_.push(this);
-  } else {
-    // Loss functions divide gradients by the batch size, so to compensate
-    // for split batch, the root solver divides by number of solvers.
-    caffe_gpu_scal(size_, Dtype(1.0 / Caffe::solver_count()), diff_);
+
+    if (step < last - 1) {
+      ring_next_->ring_queue_.push(this);
+    }
   }
+
+  // Wait for the next solver to be done reading from this one before the
+  // buffer gets modified, and let the previous one know the same.
+  ring_prev_->ring_ack_.push(this);
+  P2PSync<Dtype> *next = ring_ack_.pop();
+  CHECK(next == ring_next_);
 #endif
 }
 
@@ -387,7 +937,11 @@ template<typename Dtype>
 void P2PSync<Dtype>::run(const vector<int>& gpus) {
   // Pair devices for map-reduce synchronization
   vector<DevicePair> pairs;
-  DevicePair::compute(gpus, &pairs);
+  if (solver_->param().deterministic_reduction()) {
+    DevicePair::compute_in_order(gpus, &pairs);
+  } else {
+    DevicePair::compute(gpus, &pairs);
+  }
   ostringstream s;
   for (int i = 1; i < pairs.size(); ++i) {
     s << (i == 1 ? "" : ", ") << pairs[i].parent() << ":" << pairs[i].device();
@@ -397,12 +951,14 @@ void P2PSync<Dtype>::run(const vector<int>& gpus) {
   SolverParameter param(solver_->param());
   vector<shared_ptr<P2PSync<Dtype> > > syncs(gpus.size());
 
-  // Build the GPU tree by finding the parent for each solver
+  // Build the GPU tree by finding the parent for each solver. In ASYNC mode
+  // gradients go straight to the root, which serves as parameter server.
+  const bool async = param.sync_mode() == SolverParameter_SyncMode_ASYNC;
   for (int attempts = 0; attempts < pairs.size(); ++attempts) {
     for (int i = 1; i < pairs.size(); ++i) {
       if (!syncs[i].get()) {
-        P2PSync<Dtype>* parent = NULL;
-        for (int j = 0; j < syncs.size(); ++j) {
+        P2PSync<Dtype>* parent = async ? this : NULL;
+        for (int j = 0; j < syncs.size() && !async; ++j) {
           P2PSync<Dtype>* sync = j == 0 ? this : syncs[j].get();
           if (sync) {
             const SolverParameter& p = sync->solver()->param();
@@ -420,6 +976,52 @@ void P2PSync<Dtype>::run(const vector<int>& gpus) {
     }
   }
 
+  if (async) {
+    children_versions_.assign(children_.size(), -1);
+    LOG(INFO)<< "Asynchronous updates, max staleness "
+             << param.max_staleness();
+  }
+
+  if (param.sync_mode() == SolverParameter_SyncMode_RING) {
+    // Order the ring by walking the tree depth first, so that most
+    // neighbours are on the same board or have p2p access.
+    vector<P2PSync<Dtype>*> ring;
+    vector<P2PSync<Dtype>*> stack(1, this);
+    while (stack.size()) {
+      P2PSync<Dtype>* sync = stack.back();
+      stack.pop_back();
+      ring.push_back(sync);
+      for (int i = sync->children_.size() - 1; i >= 0; --i) {
+        stack.push_back(sync->children_[i]);
+      }
+    }
+    CHECK_EQ(ring.size(), syncs.size());
+    const int n = ring.size();
+    ostringstream r;
+    for (int i = 0; i < n; ++i) {
+      ring[i]->ring_setup(ring[(i + n - 1) % n], ring[(i + 1) % n], i, n);
+      r << (i ? ", " : "") << ring[i]->solver()->param().device_id();
+    }
+    LOG(INFO)<< "GPUs ring " << r.str();
+
+    if (param.shard_update()) {
+      // Solver r updates chunk r + 1, the one it totals in the
+      // reduce-scatter, see ring_all_reduce.
+      vector<SGDSolver<Dtype>*> shards(n);
+      vector<size_t> bounds(n + 1);
+      for (int i = 0; i < n; ++i) {
+        shards[i] = dynamic_cast<SGDSolver<Dtype>*>(
+            ring[(i + n - 1) % n]->solver().get());
+        CHECK(shards[i]) << "shard_update requires an SGD family solver";
+        bounds[i] = size_ * i / n;
+      }
+      bounds[n] = size_;
+      dynamic_cast<SGDSolver<Dtype>*>(solver_.get())->ShardUpdate(shards,
+          bounds);
+      LOG(INFO)<< "Update sharded across " << n << " GPUs";
+    }
+  }
+
   LOG(INFO)<< "Starting Optimization";
 
   for (int i = 1; i < syncs.size(); ++i) {
@@ -434,8 +1036,462 @@ void P2PSync<Dtype>::run(const vector<int>& gpus) {
   }
 }
 
+template<typename Dtype>
+NodeSync<Dtype>::NodeSync(shared_ptr<Solver<Dtype> > root_solver,
+                          const SolverParameter& param,
+                          const vector<string>& hosts, int rank)
+    : P2PSync<Dtype>(root_solver, NULL, param),
+      ring_(hosts, rank),
+      host_buffer_() {
+#ifndef CPU_ONLY
+  CHECK(!param.shard_update())
+      << "shard_update is not supported across machines";
+  CHECK(!has_shared_params(*root_solver->net()))
+      << "Layers shared in parallel, e.g. model parallel ones, are not "
+      << "supported across machines";
+  CUDA_CHECK(CaffeMallocPinned(reinterpret_cast<void**>(&host_buffer_),
+                               data_size_ * sizeof(Dtype)));
+  const float sparse = param.sparse_transfer();
+  CHECK(sparse >= 0 && sparse <= 1) << "sparse_transfer must be in [0, 1]";
+  if (sparse > 0) {
+    CHECK_LE(size_, INT_MAX) << "Too many params for sparse_transfer";
+    const int k = std::max(1, static_cast<int>(size_ * sparse));
+    sparse_residual_.resize(size_);
+    sparse_values_.resize(k);
+    sparse_indices_.resize(k);
+    LOG(INFO) << "Sending " << k << " of " << size_
+              << " gradients to other machines";
+  }
+#else
+  NO_GPU;
+#endif
+}
+
+template<typename Dtype>
+NodeSync<Dtype>::~NodeSync() {
+#ifndef CPU_ONLY
+  CUDA_CHECK(CaffeFreePinned(host_buffer_));
+#endif
+}
+
+template<typename Dtype>
+void NodeSync<Dtype>::on_gradients_ready() {
+#ifndef CPU_ONLY
+  // Sum of local gradients, already divided by the local solver count
+  P2PSync<Dtype>::on_gradients_ready();
+  if (solver_->param().local_steps() > 1) {
+    // Machines exchange their weights in average_weights instead
+    return;
+  }
+
+  CUDA_CHECK(cudaMemcpy(host_buffer_, diff_, size_ * sizeof(Dtype),
+      cudaMemcpyDeviceToHost));
+  if (sparse_values_.size()) {
+    // Sends the largest of the gradients and those left from earlier
+    // iterations, and keeps the others
+    caffe_axpy<Dtype>(size_, Dtype(1), host_buffer_, &sparse_residual_[0]);
+    caffe_cpu_top_k<Dtype>(size_, sparse_values_.size(),
+        &sparse_residual_[0], &sparse_values_[0], &sparse_indices_[0]);
+    ring_.sparse_all_reduce(sparse_indices_, sparse_values_, host_buffer_,
+                            size_);
+  } else {
+    ring_.all_reduce(host_buffer_, size_);
+  }
+  CUDA_CHECK(cudaMemcpy(diff_, host_buffer_, size_ * sizeof(Dtype),
+      cudaMemcpyHostToDevice));
+  caffe_gpu_scal(size_, Dtype(1.0 / ring_.size()), diff_);
+#endif
+}
+
+template<typename Dtype>
+void NodeSync<Dtype>::average_weights() {
+#ifndef CPU_ONLY
+  this->sum_weights();
+  caffe_gpu_scale(size_, Dtype(1.0 / Caffe::solver_count()), diff_, data_);
+  CUDA_CHECK(cudaMemcpy(host_buffer_, data_, size_ * sizeof(Dtype),
+      cudaMemcpyDeviceToHost));
+  ring_.all_reduce(host_buffer_, size_);
+  CUDA_CHECK(cudaMemcpy(data_, host_buffer_, size_ * sizeof(Dtype),
+      cudaMemcpyHostToDevice));
+  caffe_gpu_scal(size_, Dtype(1.0 / ring_.size()), data_);
+  this->broadcast_weights();
+#endif
+}
+
+template<typename Dtype>
+void NodeSync<Dtype>::run(const vector<int>& gpus) {
+#ifndef CPU_ONLY
+  // Start all machines from the weights of the first one, frozen ones
+  // included, afterwards they stay in sync as they apply the same updates.
+  CUDA_CHECK(cudaMemcpy(host_buffer_, data_, data_size_ * sizeof(Dtype),
+      cudaMemcpyDeviceToHost));
+  ring_.broadcast(host_buffer_, data_size_);
+  CUDA_CHECK(cudaMemcpy(data_, host_buffer_, data_size_ * sizeof(Dtype),
+      cudaMemcpyHostToDevice));
+#endif
+  P2PSync<Dtype>::run(gpus);
+}
+
+template<typename Dtype>
+CPUSync<Dtype>::CPUSync(shared_ptr<Solver<Dtype> > root_solver,
+                        CPUSync<Dtype>* root, const SolverParameter& param)
+    : Params<Dtype>(root_solver),
+      root_(root),
+      syncs_(),
+      rank_(0),
+      initial_iter_(root_solver->iter()),
+      cpu_threads_(Caffe::cpu_threads()),
+      solver_(),
+      barrier_() {
+  CHECK(Caffe::mode() == Caffe::CPU) << "CPUSync trains in CPU mode";
+  CHECK_LE(param.local_steps(), 1)
+      << "local_steps is not supported on CPU, the solvers share the weights";
+  if (root == NULL) {
+    solver_ = root_solver;
+    data_ = static_cast<Dtype*>(malloc(size_ * sizeof(Dtype)));
+    CHECK(data_) << "Cannot allocate the weights";
+    apply_buffers(buffer_params(*solver_->net(), false), data_, size_, copy);
+  } else {
+    // Workers only compute gradients, on the weights of the root
+    Caffe::set_root_solver(false);
+    solver_.reset(new WorkerSolver<Dtype>(param, root_solver.get()));
+    Caffe::set_root_solver(true);
+    data_ = root->data_;
+    rank_ = root->syncs_.size();
+    barrier_ = root->barrier_;
+    // The frozen params are not shared, they start from the root's
+    const Net<Dtype>& root_net = *root_solver->net();
+    const Net<Dtype>& net = *solver_->net();
+    for (int i = 0; i < net.learnable_params().size(); ++i) {
+      if (net.params_frozen()[i]) {
+        caffe_copy(net.learnable_params()[i]->count(),
+            root_net.learnable_params()[i]->cpu_data(),
+            net.learnable_params()[i]->mutable_cpu_data());
+      }
+    }
+  }
+  // Not touched yet, see bind_thread
+  diff_ = static_cast<Dtype*>(malloc(size_ * sizeof(Dtype)));
+  CHECK(diff_) << "Cannot allocate the gradients";
+  const vector<Blob<Dtype>*> params = buffer_params(*solver_->net(), false);
+  apply_buffers(params, data_, size_, replace_cpu);
+  apply_buffers(params, diff_, size_, replace_cpu_diff);
+  solver_->add_callback(this);
+}
+
+template<typename Dtype>
+CPUSync<Dtype>::~CPUSync() {
+  if (!root_) {
+    free(data_);
+  }
+  free(diff_);
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::bind_thread() {
+  const vector<int> nodes = NUMANodes();
+  if (nodes.size()) {
+    BindThreadToNode(nodes[rank_ % nodes.size()]);
+  }
+  caffe_set(size_, Dtype(0), diff_);
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::InternalThreadEntry() {
+  Caffe::set_cpu_threads(cpu_threads_);
+  bind_thread();
+  CHECK(Caffe::root_solver());
+  Caffe::set_root_solver(false);
+  // As in P2PSync, solvers draw different random numbers
+  if (solver_->param().random_seed() >= 0) {
+    Caffe::set_random_seed(solver_->param().random_seed() + rank_);
+  }
+  solver_->Step(solver_->param().max_iter() - initial_iter_);
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::on_start() {
+  NVTX_RANGE("CPUSync on_start");
+  // The root is done updating the weights
+  barrier_->wait();
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::on_gradients_ready() {
+  NVTX_RANGE("CPUSync on_gradients_ready");
+  // All gradients are ready
+  barrier_->wait();
+  const vector<CPUSync<Dtype>*>& syncs = root_ ? root_->syncs_ : syncs_;
+  const int n = syncs.size();
+  const size_t begin = size_ * rank_ / n;
+  const size_t end = size_ * (rank_ + 1) / n;
+  // Row-sparse params only sum the rows any solver touched
+  const Net<Dtype>& net = *solver_->net();
+  const vector<bool>& sparse = net.params_sparse();
+  size_t offset = 0;
+  for (int i = 0; i < net.learnable_params().size(); ++i) {
+    if (net.params_shared()[i] || net.params_frozen()[i]) {
+      continue;
+    }
+    const size_t size = net.learnable_params()[i]->count();
+    const size_t lo = std::max(begin, offset);
+    const size_t hi = std::min(end, offset + size);
+    if (lo < hi && !sparse[i]) {
+      sum(lo, hi - lo);
+    } else if (lo < hi) {
+      const vector<int> rows = touched_rows(i);
+      const size_t row_size = net.learnable_params()[i]->count(1);
+      for (int r = 0; r < rows.size(); ++r) {
+        const size_t row_lo = std::max(lo, offset + rows[r] * row_size);
+        const size_t row_hi = std::min(hi, offset + (rows[r] + 1) * row_size);
+        if (row_lo < row_hi) {
+          sum(row_lo, row_hi - row_lo);
+        }
+      }
+    }
+    offset += size;
+  }
+  // The root updates the rows summed into its gradients, read while the
+  // other solvers still wait
+  vector<vector<int> > root_rows(sparse.size());
+  for (int i = 0; i < sparse.size() && rank_ == 0; ++i) {
+    if (sparse[i] && !net.params_shared()[i] && !net.params_frozen()[i]) {
+      root_rows[i] = touched_rows(i);
+    }
+  }
+  // The root can update the weights, the others clear their gradients.
+  barrier_->wait();
+  for (int i = 0; i < root_rows.size(); ++i) {
+    if (!root_rows[i].empty()) {
+      solver_->net()->AddParamRows(i, root_rows[i]);
+    }
+  }
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::sum(size_t begin, size_t count) {
+  const vector<CPUSync<Dtype>*>& syncs = root_ ? root_->syncs_ : syncs_;
+  const int n = syncs.size();
+  Dtype* total = syncs[0]->diff_ + begin;
+  for (int i = 1; i < n; ++i) {
+    caffe_axpy(count, Dtype(1), syncs[i]->diff_ + begin, total);
+  }
+  // Loss functions divide gradients by the batch size, so to compensate
+  // for the split batch, the sum is divided by the number of solvers.
+  caffe_scal(count, Dtype(1.0 / n), total);
+}
+
+template<typename Dtype>
+vector<int> CPUSync<Dtype>::touched_rows(int param_id) const {
+  const vector<CPUSync<Dtype>*>& syncs = root_ ? root_->syncs_ : syncs_;
+  vector<int> rows;
+  for (int i = 0; i < syncs.size(); ++i) {
+    const vector<int>& solver_rows =
+        *syncs[i]->solver_->net()->param_rows(param_id);
+    rows.insert(rows.end(), solver_rows.begin(), solver_rows.end());
+  }
+  std::sort(rows.begin(), rows.end());
+  rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+  return rows;
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::run() {
+  CHECK(!root_) << "CPUSync runs from the root solver";
+  const int solvers = Caffe::solver_count();
+  CHECK_GT(solvers, 1) << "Set the solver count to train on CPU threads";
+  barrier_.reset(new boost::barrier(solvers));
+  syncs_.push_back(this);
+  vector<shared_ptr<CPUSync<Dtype> > > workers;
+  for (int i = 1; i < solvers; ++i) {
+    workers.push_back(shared_ptr<CPUSync<Dtype> >(
+        new CPUSync<Dtype>(solver_, this, solver_->param())));
+    syncs_.push_back(workers.back().get());
+  }
+  // The workers inherit the affinity of this thread until they bind theirs
+  bind_thread();
+  LOG(INFO)<< "Starting Optimization on " << solvers << " CPU solvers of "
+           << cpu_threads_ << " threads each";
+  for (int i = 0; i < workers.size(); ++i) {
+    workers[i]->StartInternalThread();
+  }
+
+  // Run root solver on current thread
+  solver_->Solve();
+
+  for (int i = 0; i < workers.size(); ++i) {
+    workers[i]->StopInternalThread();
+  }
+  syncs_.clear();
+}
+
+static void SetReplicaDevice(int device) {
+  if (device >= 0) {
+    Caffe::SetDevice(device);
+    Caffe::set_mode(Caffe::GPU);
+  } else {
+    Caffe::set_mode(Caffe::CPU);
+  }
+}
+
+// Lets the Data layers of the replicas of a net share the records of their
+// sources in round robin
+static void ShareDataRecords(NetParameter* param, int replicas) {
+  for (int i = 0; i < param->layer_size(); ++i) {
+    LayerParameter* layer = param->mutable_layer(i);
+    if (layer->type() == "Data") {
+      layer->mutable_data_param()->set_readers(replicas);
+    } else {
+      CHECK(replicas == 1 || layer->bottom_size() > 0
+            || layer->type() == "DummyData")
+          << "Only the records of Data layers are shared among replicas, "
+          << "not those of " << layer->type() << " layer " << layer->name();
+    }
+  }
+}
+
+template<typename Dtype>
+NetReplicas<Dtype>::NetReplicas(const NetParameter& param,
+    const string& weights, const vector<int>& devices)
+    : devices_(devices) {
+  CHECK_GT(devices.size(), 0);
+  NetParameter test_param(param);
+  test_param.mutable_state()->set_phase(TEST);
+  NetParameter replica_param;
+  Net<Dtype>::FilterNet(test_param, &replica_param);
+  ShareDataRecords(&replica_param, devices.size());
+  const Caffe::Brew mode = Caffe::mode();
+  int device = -1;
+#ifndef CPU_ONLY
+  if (mode == Caffe::GPU) {
+    CUDA_CHECK(cudaGetDevice(&device));
+  }
+#endif
+  // Data layers get the records of a source in the order they are created.
+  NetParameter trained;
+  for (int i = 0; i < devices.size(); ++i) {
+    SetReplicaDevice(devices[i]);
+    nets_.push_back(shared_ptr<Net<Dtype> >(new Net<Dtype>(replica_param)));
+    if (i == 0) {
+      nets_[0]->CopyTrainedLayersFrom(weights);
+      nets_[0]->ToProto(&trained);
+    } else {
+      nets_[i]->CopyTrainedLayersFrom(trained);
+    }
+  }
+  if (device >= 0) {
+    Caffe::SetDevice(device);
+  }
+  Caffe::set_mode(mode);
+}
+
+template<typename Dtype>
+void NetReplicas<Dtype>::Forward(int passes, vector<Dtype>* losses,
+    vector<vector<Dtype> >* outputs) {
+  CHECK_EQ(passes % nets_.size(), 0)
+      << "The passes must be a multiple of the " << nets_.size()
+      << " replicas";
+  losses->assign(passes, Dtype(0));
+  outputs->assign(passes, vector<Dtype>());
+  boost::thread_group threads;
+  for (int i = 0; i < nets_.size(); ++i) {
+    threads.create_thread(boost::bind(&NetReplicas<Dtype>::ForwardReplica,
+        this, i, passes, Caffe::cpu_threads(), losses, outputs));
+  }
+  threads.join_all();
+}
+
+template<typename Dtype>
+void NetReplicas<Dtype>::ForwardReplica(int replica, int passes,
+    int cpu_threads, vector<Dtype>* losses, vector<vector<Dtype> >* outputs) {
+  SetReplicaDevice(devices_[replica]);
+  Caffe::set_cpu_threads(cpu_threads);
+  Net<Dtype>& net = *nets_[replica];
+  for (int pass = replica; pass < passes; pass += nets_.size()) {
+    const vector<Blob<Dtype>*>& result = net.ForwardPrefilled(
+        &(*losses)[pass]);
+    vector<Dtype>& values = (*outputs)[pass];
+    for (int j = 0; j < result.size(); ++j) {
+      const Dtype* data = result[j]->cpu_data();
+      values.insert(values.end(), data, data + result[j]->count());
+    }
+  }
+}
+
+template<typename Dtype>
+NetPipeline<Dtype>::NetPipeline(const NetParameter& param, int micro_batches) {
+  CHECK_GT(micro_batches, 0);
+  NetParameter replica_param;
+  Net<Dtype>::FilterNet(param, &replica_param);
+  ShareDataRecords(&replica_param, micro_batches);
+  // Data layers get the records of a source in the order they are created.
+  for (int i = 0; i < micro_batches; ++i) {
+    nets_.push_back(shared_ptr<Net<Dtype> >(new Net<Dtype>(replica_param)));
+    const vector<shared_ptr<Blob<Dtype> > >& params = nets_[0]->params();
+    for (int j = 0; i > 0 && j < params.size(); ++j) {
+      nets_[i]->params()[j]->ShareData(*params[j]);
+      nets_[i]->params()[j]->ShareDiff(*params[j]);
+    }
+  }
+}
+
+template<typename Dtype>
+Dtype NetPipeline<Dtype>::ForwardBackward() {
+  const int replicas = nets_.size();
+  losses_.assign(replicas, Dtype(0));
+  if (Caffe::mode() == Caffe::CPU) {
+    for (int i = 0; i < replicas; ++i) {
+      losses_[i] = nets_[i]->ForwardFromTo(0, nets_[i]->layers().size() - 1);
+      nets_[i]->Backward();
+    }
+  } else {
+    // The stages of a GPU run the micro-batches in the order they arrive,
+    // all forward passes first on the first stage.
+    DeviceThread* first = DeviceThread::Get(nets_[0]->stage_device(0));
+    for (int i = 0; i < replicas; ++i) {
+      first->Run(boost::bind(&NetPipeline::Forward, this, i, 0));
+    }
+    for (int i = 0; i < replicas; ++i) {
+      done_.pop();
+    }
+  }
+  Dtype loss = 0;
+  for (int i = 0; i < replicas; ++i) {
+    loss += losses_[i];
+  }
+  return loss;
+}
+
+template<typename Dtype>
+void NetPipeline<Dtype>::Forward(int replica, int stage) {
+  Net<Dtype>& net = *nets_[replica];
+  losses_[replica] += net.ForwardStage(stage);
+  if (stage + 1 < net.num_stages()) {
+    DeviceThread::Get(net.stage_device(stage + 1))->Run(
+        boost::bind(&NetPipeline::Forward, this, replica, stage + 1));
+  } else {
+    Backward(replica, stage);
+  }
+}
+
+template<typename Dtype>
+void NetPipeline<Dtype>::Backward(int replica, int stage) {
+  Net<Dtype>& net = *nets_[replica];
+  net.BackwardStage(stage);
+  if (stage > 0) {
+    DeviceThread::Get(net.stage_device(stage - 1))->Run(
+        boost::bind(&NetPipeline::Backward, this, replica, stage - 1));
+  } else {
+    done_.push(replica);
+  }
+}
+
 INSTANTIATE_CLASS(Params);
 INSTANTIATE_CLASS(GPUParams);
 INSTANTIATE_CLASS(P2PSync);
+INSTANTIATE_CLASS(NodeSync);
+INSTANTIATE_CLASS(CPUSync);
+INSTANTIATE_CLASS(NetReplicas);
+INSTANTIATE_CLASS(NetPipeline);
 
 }  // namespace caffe
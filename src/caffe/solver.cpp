@@ -1,22 +1,249 @@
 #include <cstdio>
 
 #include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
 
+#include "boost/thread.hpp"
 #include "hdf5.h"
 #include "hdf5_hl.h"
 
+#include "caffe/data_layers.hpp"
+#include "caffe/internal_thread.hpp"
 #include "caffe/net.hpp"
+#include "caffe/parallel.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/solver.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/hdf5.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/nvtx.hpp"
+#include "caffe/util/spsc_queue.hpp"
 #include "caffe/util/upgrade_proto.hpp"
 
 namespace caffe {
 
+// Creates the test nets on the test_device, then, for each TestAll, copies
+// the weights of the train net and scores the test nets on them while the
+// solver goes on training.
+template <typename Dtype>
+class Solver<Dtype>::TestThread : public InternalThread {
+ public:
+  explicit TestThread(Solver* solver) : solver_(solver), running_(false) {}
+  virtual ~TestThread() { StopInternalThread(); }
+
+  // Returns once the test nets are created.
+  void Init() {
+    StartInternalThread();
+    ready_.pop();
+  }
+  // Returns once the weights are copied, the test running on.
+  void Start() {
+    CHECK(!running_);
+#ifndef CPU_ONLY
+    // The test device reads the weights once the updates are done.
+    if (Caffe::mode() == Caffe::GPU) {
+      CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+    }
+#endif
+    running_ = true;
+    requests_.push(solver_->iter_);
+    ready_.pop();
+  }
+  void Wait() {
+    if (running_) {
+      done_.pop("Waiting for the last test");
+      running_ = false;
+    }
+  }
+
+ protected:
+  virtual void InternalThreadEntry() {
+#ifndef CPU_ONLY
+    const int device = solver_->param_.test_device();
+    if (Caffe::mode() == Caffe::GPU && device >= 0) {
+      Caffe::SetDevice(device);
+    }
+#endif
+    solver_->InitTestNets();
+    ready_.push(0);
+    try {
+      while (!must_stop()) {
+        const int iter = requests_.pop();
+        const vector<shared_ptr<Net<Dtype> > >& nets = solver_->test_nets_;
+        for (int i = 0; i < nets.size(); ++i) {
+          nets[i]->CopyTrainedLayersFrom(solver_->net_.get());
+        }
+        ready_.push(iter);
+        for (int i = 0; i < nets.size(); ++i) {
+          solver_->Score(i, iter);
+        }
+        done_.push(iter);
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+  }
+
+  Solver* const solver_;
+  bool running_;
+  BlockingQueue<int> requests_;
+  BlockingQueue<int> ready_;
+  BlockingQueue<int> done_;
+};
+
+// Writes the snapshots the training thread copied to host memory.
+template <typename Dtype>
+class Solver<Dtype>::SnapshotThread : public InternalThread {
+ public:
+  explicit SnapshotThread(Solver* solver) : solver_(solver), running_(false) {}
+  virtual ~SnapshotThread() { StopInternalThread(); }
+
+  void Start() {
+    CHECK(!running_);
+    running_ = true;
+    requests_.push(solver_->snapshot_iter_);
+  }
+  void Wait() {
+    if (running_) {
+      done_.pop("Waiting for the last snapshot");
+      running_ = false;
+    }
+  }
+
+ protected:
+  virtual void InternalThreadEntry() {
+    try {
+      while (!must_stop()) {
+        const int iter = requests_.pop();
+        solver_->WriteSnapshot();
+        done_.push(iter);
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+  }
+
+  Solver* const solver_;
+  bool running_;
+  BlockingQueue<int> requests_;
+  BlockingQueue<int> done_;
+};
+
+template <typename Dtype>
+class Solver<Dtype>::ForwardThread : public InternalThread {
+ public:
+  ForwardThread(Solver* solver, int layers)
+      : solver_(solver), layers_(layers), running_(false), loss_(0) {
+#ifndef CPU_ONLY
+    event_ = NULL;
+    if (Caffe::mode() == Caffe::GPU) {
+      CUDA_CHECK(cudaEventCreateWithFlags(&event_, cudaEventDisableTiming));
+    }
+#endif
+  }
+  virtual ~ForwardThread() {
+    StopInternalThread();
+#ifndef CPU_ONLY
+    if (event_) {
+      cudaEventDestroy(event_);
+    }
+#endif
+  }
+
+  // Starts the forward of the layers once the work issued so far is done.
+  void Start() {
+    CHECK(!running_);
+#ifndef CPU_ONLY
+    if (event_) {
+      CUDA_CHECK(cudaEventRecord(event_, Caffe::cuda_stream()));
+    }
+#endif
+    running_ = true;
+    requests_.push(solver_->iter_);
+  }
+  // Waits for the forward, if started, returning whether it was.
+  bool Wait(Dtype* loss) {
+    if (!running_) {
+      return false;
+    }
+    done_.pop("Waiting for the forward of the frozen layers");
+    running_ = false;
+    *loss = loss_;
+    return true;
+  }
+  inline int layers() const { return layers_; }
+
+ protected:
+  virtual void InternalThreadEntry() {
+#ifndef CPU_ONLY
+    // Not synchronized with the default stream of the updates
+    cudaStream_t stream = NULL;
+    if (event_) {
+      CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+      Caffe::set_cuda_stream(stream);
+    }
+#endif
+    try {
+      while (!must_stop()) {
+        const int iter = requests_.pop();
+#ifndef CPU_ONLY
+        if (stream) {
+          CUDA_CHECK(cudaStreamWaitEvent(stream, event_, 0));
+        }
+#endif
+        loss_ = solver_->net_->ForwardFromTo(0, layers_ - 1);
+#ifndef CPU_ONLY
+        if (stream) {
+          CUDA_CHECK(cudaStreamSynchronize(stream));
+        }
+#endif
+        done_.push(iter);
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+#ifndef CPU_ONLY
+    if (stream) {
+      Caffe::set_cuda_stream(NULL);
+      cudaStreamDestroy(stream);
+    }
+#endif
+  }
+
+  Solver* const solver_;
+  const int layers_;
+  bool running_;
+  Dtype loss_;
+#ifndef CPU_ONLY
+  cudaEvent_t event_;
+#endif
+  // A request and its completion each iteration, short enough to spin on
+  SPSCQueue<int> requests_;
+  SPSCQueue<int> done_;
+};
+
+// Copies the data, and the diff with diff, of src to the host memory of dst,
+// pinned in GPU mode, allocating dst if needed.
+template <typename Dtype>
+static void CopyToHost(const Blob<Dtype>& src, bool diff,
+    shared_ptr<Blob<Dtype> >* dst) {
+  if (!*dst) {
+    dst->reset(new Blob<Dtype>());
+  }
+  (*dst)->ReshapeLike(src);
+  const bool gpu = Caffe::mode() == Caffe::GPU;
+  caffe_copy(src.count(), gpu ? src.gpu_data() : src.cpu_data(),
+      (*dst)->mutable_cpu_data());
+  if (diff) {
+    caffe_copy(src.count(), gpu ? src.gpu_diff() : src.cpu_diff(),
+        (*dst)->mutable_cpu_diff());
+  }
+}
+
 template <typename Dtype>
 Solver<Dtype>::Solver(const SolverParameter& param, const Solver* root_solver)
     : net_(), callbacks_(), root_solver_(root_solver) {
@@ -38,18 +265,58 @@ void Solver<Dtype>::Init(const SolverParameter& param) {
   LOG_IF(INFO, Caffe::root_solver()) << "Initializing solver from parameters: "
     << std::endl << param.DebugString();
   param_ = param;
+  if (param_.global_iter_size() > 0) {
+    const int solvers = Caffe::solver_count();
+    CHECK_EQ(param_.global_iter_size() % solvers, 0)
+        << "global_iter_size must be a multiple of the " << solvers
+        << " solvers";
+    param_.set_iter_size(param_.global_iter_size() / solvers);
+  }
   CHECK_GE(param_.average_loss(), 1) << "average_loss should be non-negative.";
+  CHECK_GE(param_.snapshot_shards(), 1);
+  CHECK(param_.snapshot_shards() == 1
+      || param_.snapshot_format() == SolverParameter_SnapshotFormat_BINARYPROTO)
+      << "snapshot_shards needs the BINARYPROTO snapshot_format";
   if (Caffe::root_solver() && param_.random_seed() >= 0) {
     Caffe::set_random_seed(param_.random_seed());
   }
   // Scaffolding code
   InitTrainNet();
+  if (Caffe::root_solver() && param_.has_profile_prefix()) {
+    net_->set_profile(true);
+  }
   if (Caffe::root_solver()) {
-    InitTestNets();
+    if (param_.test_async()) {
+      test_thread_.reset(new TestThread(this));
+      test_thread_->Init();
+    } else {
+      InitTestNets();
+    }
+    if (param_.snapshot_async()) {
+      snapshot_thread_.reset(new SnapshotThread(this));
+      snapshot_thread_->StartInternalThread();
+    }
     LOG(INFO) << "Solver scaffolding done.";
   }
+  // Nothing to overlap without layers updated after the frozen ones
+  const int frozen = net_->FrozenPrefix();
+  if (param_.prefetch_forward() && frozen > 0 && frozen < net_->layers().size()
+      && !param_.debug_info() && !pipeline_) {
+    LOG_IF(INFO, Caffe::root_solver()) << "Running the forward of "
+        << frozen << " layers during the updates";
+    forward_thread_.reset(new ForwardThread(this, frozen));
+    forward_thread_->StartInternalThread();
+  }
+  if (param_.device_loss() && Caffe::mode() == Caffe::GPU) {
+    // The frozen layers would add to it on their own thread
+    LOG_IF(INFO, forward_thread_ && Caffe::root_solver())
+        << "Ignoring device_loss with prefetch_forward";
+    net_->set_device_loss(!forward_thread_);
+  }
   iter_ = 0;
   current_step_ = 0;
+  snapshot_iter_ = 0;
+  snapshot_current_step_ = 0;
 }
 
 template <typename Dtype>
@@ -90,7 +357,12 @@ void Solver<Dtype>::InitTrainNet() {
   net_state.MergeFrom(net_param.state());
   net_state.MergeFrom(param_.train_state());
   net_param.mutable_state()->CopyFrom(net_state);
-  if (Caffe::root_solver()) {
+  if (net_param.pipeline().pipeline_iter_size() && param_.iter_size() > 1) {
+    CHECK(Caffe::root_solver() && Caffe::solver_count() == 1)
+        << "pipeline_iter_size needs a single solver";
+    pipeline_.reset(new NetPipeline<Dtype>(net_param, param_.iter_size()));
+    net_ = pipeline_->net(0);
+  } else if (Caffe::root_solver()) {
     net_.reset(new Net<Dtype>(net_param));
   } else {
     net_.reset(new Net<Dtype>(net_param, root_solver_->net_.get()));
@@ -176,6 +448,8 @@ void Solver<Dtype>::InitTestNets() {
           root_solver_->test_nets_[i].get()));
     }
     test_nets_[i]->set_debug_info(param_.debug_info());
+    test_nets_[i]->set_device_loss(param_.device_loss()
+        && Caffe::mode() == Caffe::GPU);
   }
 }
 
@@ -187,29 +461,63 @@ void Solver<Dtype>::Step(int iters) {
   int average_loss = this->param_.average_loss();
   vector<Dtype> losses;
   Dtype smoothed_loss = 0;
+  // Whether the frozen layers ran during the last update, and their loss
+  bool frozen_done = false;
+  Dtype frozen_loss = 0;
+  // With device_loss, the iterations whose loss the net added up since the
+  // last display
+  int device_loss_iters = 0;
+  net_->AccumulatedLoss();
 
   while (iter_ < stop_iter) {
     // zero-init the params
     net_->ClearParamDiffs();
+    StepLap(STEP_UPDATE);
     if (param_.test_interval() && iter_ % param_.test_interval() == 0
         && (iter_ > 0 || param_.test_initialization())
         && Caffe::root_solver()) {
       TestAll();
     }
+    StepLap(STEP_TEST);
 
     for (int i = 0; i < callbacks_.size(); ++i) {
       callbacks_[i]->on_start();
     }
+    StepLap(STEP_SYNC);
     const bool display = param_.display() && iter_ % param_.display() == 0;
     net_->set_debug_info(display && param_.debug_info());
     // accumulate the loss and gradient
     Dtype loss = 0;
-    for (int i = 0; i < param_.iter_size(); ++i) {
-      loss += net_->ForwardBackward(bottom_vec);
+    if (pipeline_) {
+      loss = pipeline_->ForwardBackward();
+      StepLap(STEP_BACKWARD);
+    }
+    for (int i = 0; i < param_.iter_size() && !pipeline_; ++i) {
+      if (i == 0 && frozen_done) {
+        // The frozen layers ran during the last update.
+        loss += frozen_loss
+            + net_->ForwardFromTo(forward_thread_->layers(),
+                net_->layers().size() - 1);
+      } else {
+        Dtype iter_loss;
+        net_->Forward(bottom_vec, &iter_loss);
+        loss += iter_loss;
+      }
+      StepLap(STEP_FORWARD);
+      net_->Backward();
+      StepLap(STEP_BACKWARD);
     }
     loss /= param_.iter_size();
-    // average the loss across iterations for smoothed reporting
-    if (losses.size() < average_loss) {
+    if (net_->device_loss()) {
+      // Only read back to display, averaged since the last display
+      ++device_loss_iters;
+      if (display) {
+        smoothed_loss = net_->AccumulatedLoss() / param_.iter_size()
+            / device_loss_iters;
+        device_loss_iters = 0;
+      }
+    } else if (losses.size() < average_loss) {
+      // average the loss across iterations for smoothed reporting
       losses.push_back(loss);
       int size = losses.size();
       smoothed_loss = (smoothed_loss * (size - 1) + loss) / size;
@@ -241,22 +549,185 @@ void Solver<Dtype>::Step(int iters) {
         }
       }
     }
+    StepLap(STEP_FORWARD);
     for (int i = 0; i < callbacks_.size(); ++i) {
       callbacks_[i]->on_gradients_ready();
     }
+    StepLap(STEP_SYNC);
+    if (forward_thread_ && iter_ + 1 < stop_iter) {
+      forward_thread_->Start();
+    }
     ApplyUpdate();
+    StepLap(STEP_UPDATE);
+    for (int i = 0; i < callbacks_.size(); ++i) {
+      callbacks_[i]->on_update_applied();
+    }
+    StepLap(STEP_SYNC);
+    frozen_done = forward_thread_ && forward_thread_->Wait(&frozen_loss);
+    StepLap(STEP_FORWARD);
 
     // Increment the internal iter_ counter -- its value should always indicate
     // the number of times the weights have been updated.
     ++iter_;
 
+    if (metrics_ || (root_solver_ && root_solver_->metrics_)) {
+      UpdateMetrics(smoothed_loss);
+    }
+
+    if (param_.data_stats_interval()
+        && iter_ % param_.data_stats_interval() == 0
+        && Caffe::root_solver()) {
+      DisplayDataStats();
+    }
+
     // Save a snapshot if needed.
+    bool stop = false;
     if (param_.snapshot()
         && iter_ % param_.snapshot() == 0
         && Caffe::root_solver()) {
       Snapshot();
+      stop = stop_at_snapshot_ && stop_at_snapshot_();
+    }
+    StepLap(STEP_SNAPSHOT);
+    if (stop) {
+      LOG(INFO) << "Stopping at the snapshot of iteration " << iter_;
+      break;
     }
   }
+  WaitForTest();
+  StepLap(STEP_TEST);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::set_step_timing(bool timing) {
+  if (!timing) {
+    step_timer_.reset();
+    return;
+  }
+  step_times_.assign(NUM_STEP_PHASES, 0);
+  step_timer_.reset(new Timer());
+  step_timer_->Start();
+}
+
+template <typename Dtype>
+double Solver<Dtype>::step_time(StepPhase phase) const {
+  return step_times_.empty() ? 0 : step_times_[phase];
+}
+
+template <typename Dtype>
+void Solver<Dtype>::StepLap(StepPhase phase) {
+  if (!step_timer_) {
+    return;
+  }
+  step_times_[phase] += step_timer_->MicroSeconds();
+  step_timer_->Start();
+}
+
+template <typename Dtype>
+void Solver<Dtype>::set_metrics(const shared_ptr<Metrics>& metrics) {
+  metrics_ = metrics;
+  if (metrics && step_times_.empty()) {
+    set_step_timing(true);
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::UpdateMetrics(Dtype loss) {
+  Metrics* metrics = metrics_ ? metrics_.get() : root_solver_->metrics_.get();
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+    size_t used, peak;
+    CaffeGPUMemoryUsage(&used, &peak);
+    ostringstream labels_stream;
+    labels_stream << "device=\"" << device << "\"";
+    const string labels = labels_stream.str();
+    metrics->set("caffe_gpu_memory_bytes", Metrics::GAUGE, labels, used);
+    metrics->set("caffe_gpu_memory_peak_bytes", Metrics::GAUGE, labels, peak);
+  }
+#endif
+  if (!Caffe::root_solver()) {
+    return;
+  }
+  metrics->add("caffe_train_iterations_total", Metrics::COUNTER, "", 1);
+  metrics->set("caffe_train_iteration", Metrics::GAUGE, "", iter_);
+  metrics->set("caffe_train_loss", Metrics::GAUGE, "", loss);
+  // Items of the first top of the first layer, e.g. the images of a data
+  // layer, over the passes of all solvers
+  if (net_->top_vecs().size() && net_->top_vecs()[0].size()
+      && net_->top_vecs()[0][0]->num_axes()) {
+    metrics->add("caffe_train_items_total", Metrics::COUNTER, "",
+        static_cast<double>(net_->top_vecs()[0][0]->shape(0))
+        * param_.iter_size() * Caffe::solver_count());
+  }
+  const char* phases[] = {
+    "test", "sync", "forward", "backward", "update", "snapshot"
+  };
+  for (int i = 0; i < NUM_STEP_PHASES; ++i) {
+    metrics->set("caffe_train_step_seconds_total", Metrics::COUNTER,
+        string("phase=\"") + phases[i] + "\"",
+        step_time(static_cast<StepPhase>(i)) / 1e6);
+  }
+  const vector<shared_ptr<Layer<Dtype> > >& layers = net_->layers();
+  for (int i = 0; i < layers.size(); ++i) {
+    BasePrefetchingDataLayer<Dtype>* layer =
+        dynamic_cast<BasePrefetchingDataLayer<Dtype>*>(layers[i].get());
+    if (!layer) {
+      continue;
+    }
+    DataStats stats;
+    layer->collect_data_stats(&stats);
+    const string labels = "layer=\"" + net_->layer_names()[i] + "\"";
+    metrics->add("caffe_train_data_batches_total", Metrics::COUNTER, labels,
+        stats.samples(DataStats::WAIT));
+    metrics->add("caffe_train_data_wait_seconds_total", Metrics::COUNTER,
+        labels, stats.total(DataStats::WAIT) / 1e6);
+    if (stats.samples(DataStats::QUEUE_DEPTH)) {
+      metrics->set("caffe_train_data_queue_depth", Metrics::GAUGE, labels,
+          stats.total(DataStats::QUEUE_DEPTH)
+          / stats.samples(DataStats::QUEUE_DEPTH));
+    }
+    if (param_.data_stats_interval()) {
+      data_stats_.resize(layers.size());
+      if (!data_stats_[i]) {
+        data_stats_[i].reset(new DataStats());
+      }
+      data_stats_[i]->take(&stats);
+    }
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::DisplayDataStats() {
+  const vector<shared_ptr<Layer<Dtype> > >& layers = net_->layers();
+  for (int i = 0; i < layers.size(); ++i) {
+    BasePrefetchingDataLayer<Dtype>* layer =
+        dynamic_cast<BasePrefetchingDataLayer<Dtype>*>(layers[i].get());
+    if (!layer) {
+      continue;
+    }
+    // Those taken for the metrics first
+    DataStats stats;
+    if (i < data_stats_.size() && data_stats_[i]) {
+      stats.take(data_stats_[i].get());
+    }
+    layer->collect_data_stats(&stats);
+    const double batches = stats.samples(DataStats::WAIT);
+    if (!batches) {
+      continue;
+    }
+    LOG(INFO) << "Iteration " << iter_ << ", data layer "
+        << net_->layer_names()[i] << ": "
+        << stats.total(DataStats::QUEUE_DEPTH) / batches << " of "
+        << layer->prefetch_count()
+        << " batches ready, wait "
+        << stats.total(DataStats::WAIT) / batches / 1000 << " ms, read "
+        << stats.total(DataStats::READ) / batches / 1000 << " ms, decode "
+        << stats.total(DataStats::DECODE) / batches / 1000 << " ms, transform "
+        << stats.total(DataStats::TRANSFORM) / batches / 1000
+        << " ms per batch";
+  }
 }
 
 template <typename Dtype>
@@ -279,6 +750,12 @@ void Solver<Dtype>::Solve(const char* resume_file) {
       && (!param_.snapshot() || iter_ % param_.snapshot() != 0)) {
     Snapshot();
   }
+  WaitForSnapshot();
+  WriteProfile();
+  if (iter_ < param_.max_iter()) {
+    // Stopped at a snapshot, to go on from there
+    return;
+  }
   // After the optimization is done, run an additional train and test pass to
   // display the train and test loss/outputs if appropriate (based on the
   // display and test_interval settings, respectively).  Unlike in the rest of
@@ -287,11 +764,14 @@ void Solver<Dtype>::Solve(const char* resume_file) {
   // display the loss, which is computed in the forward pass.
   if (param_.display() && iter_ % param_.display() == 0) {
     Dtype loss;
+    net_->AccumulatedLoss();  // Drops that of the last iterations, if any
     net_->ForwardPrefilled(&loss);
+    loss += net_->AccumulatedLoss();
     LOG(INFO) << "Iteration " << iter_ << ", loss = " << loss;
   }
   if (param_.test_interval() && iter_ % param_.test_interval() == 0) {
     TestAll();
+    WaitForTest();
   }
   LOG(INFO) << "Optimization Done.";
 }
@@ -299,23 +779,44 @@ void Solver<Dtype>::Solve(const char* resume_file) {
 
 template <typename Dtype>
 void Solver<Dtype>::TestAll() {
+  if (test_thread_) {
+    test_thread_->Wait();
+    test_thread_->Start();
+    return;
+  }
   for (int test_net_id = 0; test_net_id < test_nets_.size(); ++test_net_id) {
     Test(test_net_id);
   }
 }
 
+template <typename Dtype>
+void Solver<Dtype>::WaitForTest() {
+  if (test_thread_) {
+    test_thread_->Wait();
+  }
+}
+
 template <typename Dtype>
 void Solver<Dtype>::Test(const int test_net_id) {
   CHECK(Caffe::root_solver());
-  LOG(INFO) << "Iteration " << iter_
-            << ", Testing net (#" << test_net_id << ")";
   CHECK_NOTNULL(test_nets_[test_net_id].get())->
       ShareTrainedLayersWith(net_.get());
+  Score(test_net_id, iter_);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::Score(const int test_net_id, const int iter) {
+  CHECK(Caffe::root_solver());
+  LOG(INFO) << "Iteration " << iter
+            << ", Testing net (#" << test_net_id << ")";
   vector<Dtype> test_score;
   vector<int> test_score_output_id;
   vector<Blob<Dtype>*> bottom_vec;
   const shared_ptr<Net<Dtype> >& test_net = test_nets_[test_net_id];
   Dtype loss = 0;
+  // With device_loss, the sums of the outputs on the GPU
+  vector<shared_ptr<Blob<Dtype> > > sums;
+  test_net->AccumulatedLoss();
   for (int i = 0; i < param_.test_iter(test_net_id); ++i) {
     Dtype iter_loss;
     const vector<Blob<Dtype>*>& result =
@@ -323,7 +824,20 @@ void Solver<Dtype>::Test(const int test_net_id) {
     if (param_.test_compute_loss()) {
       loss += iter_loss;
     }
-    if (i == 0) {
+    if (test_net->device_loss()) {
+#ifndef CPU_ONLY
+      for (int j = 0; j < result.size(); ++j) {
+        if (i == 0) {
+          sums.push_back(shared_ptr<Blob<Dtype> >(
+              new Blob<Dtype>(result[j]->shape())));
+          caffe_gpu_set(sums[j]->count(), Dtype(0),
+              sums[j]->mutable_gpu_data());
+        }
+        caffe_gpu_axpy(result[j]->count(), Dtype(1), result[j]->gpu_data(),
+            sums[j]->mutable_gpu_data());
+      }
+#endif
+    } else if (i == 0) {
       for (int j = 0; j < result.size(); ++j) {
         const Dtype* result_vec = result[j]->cpu_data();
         for (int k = 0; k < result[j]->count(); ++k) {
@@ -341,7 +855,15 @@ void Solver<Dtype>::Test(const int test_net_id) {
       }
     }
   }
+  for (int j = 0; j < sums.size(); ++j) {
+    const Dtype* sum = sums[j]->cpu_data();
+    for (int k = 0; k < sums[j]->count(); ++k) {
+      test_score.push_back(sum[k]);
+      test_score_output_id.push_back(j);
+    }
+  }
   if (param_.test_compute_loss()) {
+    loss += test_net->AccumulatedLoss();
     loss /= param_.test_iter(test_net_id);
     LOG(INFO) << "Test loss: " << loss;
   }
@@ -364,7 +886,35 @@ void Solver<Dtype>::Test(const int test_net_id) {
 
 template <typename Dtype>
 void Solver<Dtype>::Snapshot() {
+  NVTX_RANGE("Snapshot");
   CHECK(Caffe::root_solver());
+  if (snapshot_thread_) {
+    // The copies of the last snapshot get overwritten
+    snapshot_thread_->Wait();
+  }
+  snapshot_iter_ = iter_;
+  snapshot_current_step_ = current_step_;
+  if (snapshot_thread_) {
+    const vector<shared_ptr<Blob<Dtype> > >& params = net_->params();
+    snapshot_params_.resize(params.size());
+    for (int i = 0; i < params.size(); ++i) {
+      const int owner = net_->param_owners()[i];
+      if (owner < 0) {
+        CopyToHost(*params[i], param_.snapshot_diff(), &snapshot_params_[i]);
+      } else {
+        snapshot_params_[i] = snapshot_params_[owner];
+      }
+    }
+    CopySolverState();
+    snapshot_thread_->Start();
+  } else {
+    WriteSnapshot();
+  }
+  WriteProfile();
+}
+
+template <typename Dtype>
+void Solver<Dtype>::WriteSnapshot() {
   string model_filename;
   switch (param_.snapshot_format()) {
     case caffe::SolverParameter_SnapshotFormat_BINARYPROTO:
@@ -380,21 +930,78 @@ void Solver<Dtype>::Snapshot() {
   SnapshotSolverState(model_filename);
 }
 
+template <typename Dtype>
+void Solver<Dtype>::WaitForSnapshot() {
+  if (snapshot_thread_) {
+    snapshot_thread_->Wait();
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::WriteProfile() {
+  if (!net_->profile()) {
+    return;
+  }
+  const string& prefix = param_.profile_prefix();
+  LOG(INFO) << "Writing layer profile to " << prefix << ".json";
+  std::ofstream json((prefix + ".json").c_str());
+  CHECK(json) << "Cannot write " << prefix << ".json";
+  json << net_->ProfileJSON();
+  std::ofstream trace((prefix + "_trace.json").c_str());
+  CHECK(trace) << "Cannot write " << prefix << "_trace.json";
+  trace << net_->ProfileTrace();
+}
+
 template <typename Dtype>
 string Solver<Dtype>::SnapshotFilename(const string extension) {
   string filename(param_.snapshot_prefix());
   const int kBufferSize = 20;
   char iter_str_buffer[kBufferSize];
-  snprintf(iter_str_buffer, kBufferSize, "_iter_%d", iter_);
+  snprintf(iter_str_buffer, kBufferSize, "_iter_%d", snapshot_iter_);
   return filename + iter_str_buffer + extension;
 }
 
+template <typename Dtype>
+string Solver<Dtype>::SnapshotStateFilename() {
+  return SnapshotFilename(
+      param_.snapshot_format() == SolverParameter_SnapshotFormat_HDF5 ?
+      ".solverstate.h5" : ".solverstate");
+}
+
 template <typename Dtype>
 string Solver<Dtype>::SnapshotToBinaryProto() {
   string model_filename = SnapshotFilename(".caffemodel");
   LOG(INFO) << "Snapshotting to binary proto file " << model_filename;
   NetParameter net_param;
-  net_->ToProto(&net_param, param_.snapshot_diff());
+  net_->ToProto(&net_param, param_.snapshot_diff(),
+      snapshot_thread_ ? snapshot_params_ : net_->params());
+  const int shards = param_.snapshot_shards();
+  if (shards > 1) {
+    // Move the blobs of contiguous layers to each shard, leaving the layers
+    // and the names of the shards in the model file.
+    vector<size_t> sizes;
+    for (int i = 0; i < net_param.layer_size(); ++i) {
+      sizes.push_back(net_param.layer(i).ByteSize());
+    }
+    const vector<int> bounds = ShardBounds(sizes, shards);
+    vector<NetParameter> shard_params(shards);
+    vector<const Message*> protos;
+    vector<string> filenames;
+    for (int k = 0; k < shards; ++k) {
+      for (int i = bounds[k]; i < bounds[k + 1]; ++i) {
+        LayerParameter* layer = shard_params[k].add_layer();
+        layer->set_name(net_param.layer(i).name());
+        layer->mutable_blobs()->Swap(
+            net_param.mutable_layer(i)->mutable_blobs());
+      }
+      const string shard = ShardFilename(model_filename, k,
+          param_.snapshot_compression());
+      net_param.add_shard(shard);
+      protos.push_back(&shard_params[k]);
+      filenames.push_back(ShardPath(model_filename, shard));
+    }
+    WriteProtosToBinaryFiles(protos, filenames);
+  }
   WriteProtoToBinaryFile(net_param, model_filename);
   return model_filename;
 }
@@ -403,7 +1010,8 @@ template <typename Dtype>
 string Solver<Dtype>::SnapshotToHDF5() {
   string model_filename = SnapshotFilename(".caffemodel.h5");
   LOG(INFO) << "Snapshotting to HDF5 file " << model_filename;
-  net_->ToHDF5(model_filename, param_.snapshot_diff());
+  net_->ToHDF5(model_filename, param_.snapshot_diff(),
+      snapshot_thread_ ? snapshot_params_ : net_->params());
   return model_filename;
 }
 
@@ -478,174 +1086,305 @@ void SGDSolver<Dtype>::PreSolve() {
   // Initialize the history
   const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
   history_.clear();
-  update_.clear();
-  temp_.clear();
+  update_begin_.clear();
+  update_count_.clear();
+  const vector<bool>& net_params_frozen = this->net_->params_frozen();
   for (int i = 0; i < net_params.size(); ++i) {
     const vector<int>& shape = net_params[i]->shape();
     history_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(shape)));
-    update_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(shape)));
-    temp_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(shape)));
+    update_begin_.push_back(0);
+    update_count_.push_back(net_params_frozen[i] ? 0 : net_params[i]->count());
+  }
+  update_sharded_ = false;
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::TakeHistoryShard(const SGDSolver<Dtype>& source,
+    size_t begin, size_t end) {
+  CHECK(!source.update_sharded_);
+  CHECK_EQ(source.history_.size(), history_.size());
+  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
+  const int num_params = net_params.size();
+  // The offsets in the buffer of the params not frozen, see P2PSync
+  size_t offset = 0;
+  for (int i = 0; i < num_params; ++i) {
+    const size_t count = this->net_->params_frozen()[i]
+        ? 0 : net_params[i]->count();
+    const size_t lo = std::max(offset, begin);
+    const size_t hi = std::min(offset + count, end);
+    update_begin_[i] = lo < hi ? lo - offset : 0;
+    update_count_[i] = lo < hi ? hi - lo : 0;
+    offset += count;
+  }
+  // The AdaDelta and Adam histories follow those of SGDSolver::PreSolve
+  vector<shared_ptr<Blob<Dtype> > > history(history_.size());
+  for (int k = 0; k < history_.size(); ++k) {
+    const int i = k % num_params;
+    const int count = update_count_[i];
+    history[k].reset(new Blob<Dtype>(vector<int>(1, count)));
+    if (count > 0) {
+      const Dtype* src = source.history_[k]->cpu_data() + update_begin_[i];
+      std::copy(src, src + count, history[k]->mutable_cpu_data());
+    }
   }
+  history_.swap(history);
+  update_sharded_ = true;
+  fused_params_.clear();
 }
 
 template <typename Dtype>
-void SGDSolver<Dtype>::ClipGradients() {
+void SGDSolver<Dtype>::ShardUpdate(const vector<SGDSolver<Dtype>*>& shards,
+    const vector<size_t>& bounds) {
+  CHECK_EQ(bounds.size(), shards.size() + 1);
+  // This solver gives up the history it does not keep last
+  int self = -1;
+  for (int i = 0; i < shards.size(); ++i) {
+    if (shards[i] == this) {
+      self = i;
+    } else {
+      shards[i]->TakeHistoryShard(*this, bounds[i], bounds[i + 1]);
+    }
+  }
+  CHECK_GE(self, 0) << "The solver should be one of the shards";
+  TakeHistoryShard(*this, bounds[self], bounds[self + 1]);
+  shards_ = shards;
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::GatherHistory(
+    vector<shared_ptr<Blob<Dtype> > >* history) const {
+  if (!update_sharded_) {
+    *history = history_;
+    return;
+  }
+  CHECK(shards_.size()) << "The history is gathered by the root shard";
+  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
+  const int num_params = net_params.size();
+  history->resize(history_.size());
+  for (int k = 0; k < history_.size(); ++k) {
+    const int i = k % num_params;
+    (*history)[k].reset(new Blob<Dtype>(net_params[i]->shape()));
+    Dtype* dst = (*history)[k]->mutable_cpu_data();
+    for (int j = 0; j < shards_.size(); ++j) {
+      const SGDSolver<Dtype>& shard = *shards_[j];
+      const int count = shard.update_count_[i];
+      if (count > 0) {
+        const Dtype* src = shard.history_[k]->cpu_data();
+        std::copy(src, src + count, dst + shard.update_begin_[i]);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+Dtype SGDSolver<Dtype>::ClipGradients() {
   const Dtype clip_gradients = this->param_.clip_gradients();
-  if (clip_gradients < 0) { return; }
+  if (clip_gradients < 0) { return Dtype(1); }
   const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
-  Dtype sumsq_diff = 0;
+  const vector<bool>& net_params_frozen = this->net_->params_frozen();
+  // The norms of all the params at once
+  vector<const Dtype*> diffs;
+  vector<int> counts;
   for (int i = 0; i < net_params.size(); ++i) {
-    sumsq_diff += net_params[i]->sumsq_diff();
+    if (!net_params_frozen[i]) {
+      diffs.push_back(Caffe::mode() == Caffe::GPU ?
+          net_params[i]->gpu_diff() : net_params[i]->cpu_diff());
+      counts.push_back(net_params[i]->count());
+    }
+  }
+  clip_stats_.Compute(diffs, counts);
+  Dtype sumsq_diff = 0;
+  for (int i = 0; i < diffs.size(); ++i) {
+    sumsq_diff += clip_stats_.sumsq(i);
   }
   const Dtype l2norm_diff = std::sqrt(sumsq_diff);
-  if (l2norm_diff > clip_gradients) {
-    Dtype scale_factor = clip_gradients / l2norm_diff;
-    LOG(INFO) << "Gradient clipping: scaling down gradients (L2 norm "
-        << l2norm_diff << " > " << clip_gradients << ") "
-        << "by scale factor " << scale_factor;
-    for (int i = 0; i < net_params.size(); ++i) {
-      net_params[i]->scale_diff(scale_factor);
-    }
+  if (l2norm_diff <= clip_gradients) {
+    return Dtype(1);
   }
+  Dtype scale_factor = clip_gradients / l2norm_diff;
+  LOG(INFO) << "Gradient clipping: scaling down gradients (L2 norm "
+      << l2norm_diff << " > " << clip_gradients << ") "
+      << "by scale factor " << scale_factor;
+  return scale_factor;
 }
 
 template <typename Dtype>
 void SGDSolver<Dtype>::ApplyUpdate() {
-  CHECK(Caffe::root_solver());
+  NVTX_RANGE("ApplyUpdate");
+  CHECK(Caffe::root_solver() || update_sharded_);
   Dtype rate = GetLearningRate();
-  if (this->param_.display() && this->iter_ % this->param_.display() == 0) {
+  if (this->param_.display() && this->iter_ % this->param_.display() == 0
+      && Caffe::root_solver()) {
     LOG(INFO) << "Iteration " << this->iter_ << ", lr = " << rate;
   }
-  ClipGradients();
-  for (int param_id = 0; param_id < this->net_->learnable_params().size();
-       ++param_id) {
-    Normalize(param_id);
-    Regularize(param_id);
-    ComputeUpdateValue(param_id, rate);
+  const Dtype clip_scale = ClipGradients();
+  FusedUpdateConfig<Dtype> config;
+  config.type = update_type();
+  config.normalization = clip_scale / this->param_.iter_size();
+  config.weight_decay = this->param_.weight_decay();
+  const string& regularization_type = this->param_.regularization_type();
+  CHECK(regularization_type == "L2" || regularization_type == "L1")
+      << "Unknown regularization type: " << regularization_type;
+  config.l1 = regularization_type == "L1";
+  config.rate = rate;
+  config.momentum = this->param_.momentum();
+  config.momentum2 = this->param_.momentum2();
+  config.delta = this->param_.delta();
+  config.rms_decay = this->param_.rms_decay();
+  if (config.type == SolverParameter_SolverType_ADAM) {
+    const int t = this->iter_ + 1;
+    config.rate *= std::sqrt(Dtype(1) - pow(config.momentum2, t)) /
+        (Dtype(1.) - pow(config.momentum, t));
   }
-  this->net_->Update();
-}
-
-template <typename Dtype>
-void SGDSolver<Dtype>::Normalize(int param_id) {
-  if (this->param_.iter_size() == 1) { return; }
-  // Scale gradient to counterbalance accumulation.
-  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
-  const Dtype accum_normalization = Dtype(1.) / this->param_.iter_size();
   switch (Caffe::mode()) {
-  case Caffe::CPU: {
-    caffe_scal(net_params[param_id]->count(), accum_normalization,
-        net_params[param_id]->mutable_cpu_diff());
+  case Caffe::CPU:
+    FusedUpdateCPU(config);
     break;
-  }
-  case Caffe::GPU: {
+  case Caffe::GPU:
 #ifndef CPU_ONLY
-    caffe_gpu_scal(net_params[param_id]->count(), accum_normalization,
-        net_params[param_id]->mutable_gpu_diff());
+    FusedUpdateGPU(config);
 #else
     NO_GPU;
 #endif
     break;
-  }
   default:
     LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
   }
 }
 
 template <typename Dtype>
-void SGDSolver<Dtype>::Regularize(int param_id) {
+void SGDSolver<Dtype>::UpdateRanges(int param_id, vector<int>* ranges) const {
+  ranges->clear();
+  const int count = update_count_[param_id];
+  const vector<int>* rows = this->net_->param_rows(param_id);
+  if (!rows) {
+    if (count > 0) {
+      ranges->push_back(0);
+      ranges->push_back(count);
+    }
+    return;
+  }
+  const int row_size = this->net_->learnable_params()[param_id]->count(1);
+  const int begin = update_begin_[param_id];
+  for (int i = 0; i < rows->size(); ++i) {
+    // Within the shard of the update, adjacent rows in a single range
+    const int start = std::max((*rows)[i] * row_size - begin, 0);
+    const int end = std::min(((*rows)[i] + 1) * row_size - begin, count);
+    if (start >= end) {
+      continue;
+    }
+    if (!ranges->empty() && ranges->back() == start) {
+      ranges->back() = end;
+    } else {
+      ranges->push_back(start);
+      ranges->push_back(end);
+    }
+  }
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::FusedUpdateCPU(const FusedUpdateConfig<Dtype>& config) {
   const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
+  const vector<float>& net_params_lr = this->net_->params_lr();
   const vector<float>& net_params_weight_decay =
       this->net_->params_weight_decay();
-  Dtype weight_decay = this->param_.weight_decay();
-  string regularization_type = this->param_.regularization_type();
-  Dtype local_decay = weight_decay * net_params_weight_decay[param_id];
-  switch (Caffe::mode()) {
-  case Caffe::CPU: {
-    if (local_decay) {
-      if (regularization_type == "L2") {
-        // add weight decay
-        caffe_axpy(net_params[param_id]->count(),
-            local_decay,
-            net_params[param_id]->cpu_data(),
-            net_params[param_id]->mutable_cpu_diff());
-      } else if (regularization_type == "L1") {
-        caffe_cpu_sign(net_params[param_id]->count(),
-            net_params[param_id]->cpu_data(),
-            temp_[param_id]->mutable_cpu_data());
-        caffe_axpy(net_params[param_id]->count(),
-            local_decay,
-            temp_[param_id]->cpu_data(),
-            net_params[param_id]->mutable_cpu_diff());
-      } else {
-        LOG(FATAL) << "Unknown regularization type: " << regularization_type;
-      }
+  const int num_params = net_params.size();
+  vector<int> ranges;
+  for (int i = 0; i < num_params; ++i) {
+    UpdateRanges(i, &ranges);
+    if (ranges.empty()) {
+      continue;
     }
-    break;
-  }
-  case Caffe::GPU: {
-#ifndef CPU_ONLY
-    if (local_decay) {
-      if (regularization_type == "L2") {
-        // add weight decay
-        caffe_gpu_axpy(net_params[param_id]->count(),
-            local_decay,
-            net_params[param_id]->gpu_data(),
-            net_params[param_id]->mutable_gpu_diff());
-      } else if (regularization_type == "L1") {
-        caffe_gpu_sign(net_params[param_id]->count(),
-            net_params[param_id]->gpu_data(),
-            temp_[param_id]->mutable_gpu_data());
-        caffe_gpu_axpy(net_params[param_id]->count(),
-            local_decay,
-            temp_[param_id]->gpu_data(),
-            net_params[param_id]->mutable_gpu_diff());
-      } else {
-        LOG(FATAL) << "Unknown regularization type: " << regularization_type;
+    const Dtype lr_mult = net_params_lr[i];
+    const Dtype decay_mult = net_params_weight_decay[i];
+    Dtype* data = net_params[i]->mutable_cpu_data() + update_begin_[i];
+    Dtype* diff = net_params[i]->mutable_cpu_diff() + update_begin_[i];
+    Dtype* history = history_[i]->mutable_cpu_data();
+    Dtype* history2 = history_.size() > num_params
+        ? history_[num_params + i]->mutable_cpu_data() : NULL;
+    for (int r = 0; r < ranges.size(); r += 2) {
+      for (int j = ranges[r]; j < ranges[r + 1]; ++j) {
+        diff[j] = FusedUpdateValue(config, lr_mult, decay_mult, data[j],
+            diff[j], history + j, history2 ? history2 + j : NULL);
+        data[j] -= diff[j];
       }
     }
-#else
-    NO_GPU;
-#endif
-    break;
-  }
-  default:
-    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
   }
 }
 
 template <typename Dtype>
-void SGDSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
+void SGDSolver<Dtype>::FusedUpdateGPU(const FusedUpdateConfig<Dtype>& config) {
+#ifndef CPU_ONLY
   const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
-  const vector<float>& net_params_lr = this->net_->params_lr();
-  Dtype momentum = this->param_.momentum();
-  Dtype local_rate = rate * net_params_lr[param_id];
-  // Compute the update to history, then copy it to the parameter diff.
-  switch (Caffe::mode()) {
-  case Caffe::CPU: {
-    caffe_cpu_axpby(net_params[param_id]->count(), local_rate,
-              net_params[param_id]->cpu_diff(), momentum,
-              history_[param_id]->mutable_cpu_data());
-    caffe_copy(net_params[param_id]->count(),
-        history_[param_id]->cpu_data(),
-        net_params[param_id]->mutable_cpu_diff());
-    break;
+  const int num_params = net_params.size();
+  if (num_params == 0) {
+    return;
   }
-  case Caffe::GPU: {
-#ifndef CPU_ONLY
-    caffe_gpu_axpby(net_params[param_id]->count(), local_rate,
-              net_params[param_id]->gpu_diff(), momentum,
-              history_[param_id]->mutable_gpu_data());
-    caffe_copy(net_params[param_id]->count(),
-        history_[param_id]->gpu_data(),
-        net_params[param_id]->mutable_gpu_diff());
+  vector<Dtype*> params(4 * num_params);
+  for (int i = 0; i < num_params; ++i) {
+    if (update_count_[i] == 0) {
+      continue;
+    }
+    params[4 * i] = net_params[i]->mutable_gpu_data() + update_begin_[i];
+    params[4 * i + 1] = net_params[i]->mutable_gpu_diff() + update_begin_[i];
+    params[4 * i + 2] = history_[i]->mutable_gpu_data();
+    params[4 * i + 3] = history_.size() > num_params
+        ? history_[num_params + i]->mutable_gpu_data() : NULL;
+  }
+  // The rows of row-sparse params change with each batch
+  const vector<bool>& sparse = this->net_->params_sparse();
+  const bool rows = std::find(sparse.begin(), sparse.end(), true) !=
+      sparse.end();
+  if (params != fused_params_ || rows) {
+    if (params != fused_params_) {
+      fused_params_ = params;
+      fused_params_gpu_.reset(
+          new SyncedMemory(params.size() * sizeof(Dtype*)));
+      std::copy(params.begin(), params.end(),
+          static_cast<Dtype**>(fused_params_gpu_->mutable_cpu_data()));
+    }
+    vector<int> chunks;
+    vector<int> ranges;
+    for (int i = 0; i < num_params; ++i) {
+      UpdateRanges(i, &ranges);
+      for (int r = 0; r < ranges.size(); r += 2) {
+        for (int start = ranges[r]; start < ranges[r + 1];
+             start += kFusedUpdateChunk) {
+          chunks.push_back(i);
+          chunks.push_back(start);
+          chunks.push_back(std::min(start + kFusedUpdateChunk,
+                                    ranges[r + 1]));
+        }
+      }
+    }
+    fused_chunks_.Reshape(vector<int>(1, std::max<int>(chunks.size(), 1)));
+    std::copy(chunks.begin(), chunks.end(), fused_chunks_.mutable_cpu_data());
+    fused_mults_.Reshape(vector<int>(1, 2 * num_params));
+    Dtype* mults = fused_mults_.mutable_cpu_data();
+    for (int i = 0; i < num_params; ++i) {
+      mults[2 * i] = this->net_->params_lr()[i];
+      mults[2 * i + 1] = this->net_->params_weight_decay()[i];
+    }
+  }
+  caffe_gpu_fused_update(fused_chunks_.count() / 3,
+      fused_chunks_.gpu_data(),
+      static_cast<Dtype* const*>(fused_params_gpu_->gpu_data()),
+      fused_mults_.gpu_data(), config);
 #else
-    NO_GPU;
+  NO_GPU;
 #endif
-    break;
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::CopySolverState() {
+  if (update_sharded_) {
+    // Gathered in new blobs
+    GatherHistory(&snapshot_history_);
+    return;
   }
-  default:
-    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+  snapshot_history_.resize(history_.size());
+  for (int i = 0; i < history_.size(); ++i) {
+    CopyToHost(*history_[i], false, &snapshot_history_[i]);
   }
 }
 
@@ -667,18 +1406,48 @@ template <typename Dtype>
 void SGDSolver<Dtype>::SnapshotSolverStateToBinaryProto(
     const string& model_filename) {
   SolverState state;
-  state.set_iter(this->iter_);
+  state.set_iter(this->snapshot_iter_);
   state.set_learned_net(model_filename);
-  state.set_current_step(this->current_step_);
+  state.set_current_step(this->snapshot_current_step_);
   state.clear_history();
-  for (int i = 0; i < history_.size(); ++i) {
+  vector<shared_ptr<Blob<Dtype> > > history;
+  if (this->snapshot_thread_) {
+    history = snapshot_history_;
+  } else {
+    GatherHistory(&history);
+  }
+  for (int i = 0; i < history.size(); ++i) {
     // Add history
     BlobProto* history_blob = state.add_history();
-    history_[i]->ToProto(history_blob);
+    history[i]->ToProto(history_blob);
   }
   string snapshot_filename = Solver<Dtype>::SnapshotFilename(".solverstate");
   LOG(INFO)
     << "Snapshotting solver state to binary proto file" << snapshot_filename;
+  const int shards = this->param_.snapshot_shards();
+  if (shards > 1) {
+    // Move contiguous history blobs to each shard.
+    vector<size_t> sizes;
+    for (int i = 0; i < state.history_size(); ++i) {
+      sizes.push_back(state.history(i).ByteSize());
+    }
+    const vector<int> bounds = ShardBounds(sizes, shards);
+    vector<SolverState> shard_states(shards);
+    vector<const Message*> protos;
+    vector<string> filenames;
+    for (int k = 0; k < shards; ++k) {
+      for (int i = bounds[k]; i < bounds[k + 1]; ++i) {
+        shard_states[k].add_history()->Swap(state.mutable_history(i));
+      }
+      const string shard = ShardFilename(snapshot_filename, k,
+          this->param_.snapshot_compression());
+      state.add_shard(shard);
+      protos.push_back(&shard_states[k]);
+      filenames.push_back(ShardPath(snapshot_filename, shard));
+    }
+    state.clear_history();
+    WriteProtosToBinaryFiles(protos, filenames);
+  }
   WriteProtoToBinaryFile(state, snapshot_filename.c_str());
 }
 
@@ -692,17 +1461,23 @@ void SGDSolver<Dtype>::SnapshotSolverStateToHDF5(
       H5P_DEFAULT, H5P_DEFAULT);
   CHECK_GE(file_hid, 0)
       << "Couldn't open " << snapshot_filename << " to save solver state.";
-  hdf5_save_int(file_hid, "iter", this->iter_);
+  hdf5_save_int(file_hid, "iter", this->snapshot_iter_);
   hdf5_save_string(file_hid, "learned_net", model_filename);
-  hdf5_save_int(file_hid, "current_step", this->current_step_);
+  hdf5_save_int(file_hid, "current_step", this->snapshot_current_step_);
   hid_t history_hid = H5Gcreate2(file_hid, "history", H5P_DEFAULT, H5P_DEFAULT,
       H5P_DEFAULT);
   CHECK_GE(history_hid, 0)
       << "Error saving solver state to " << snapshot_filename << ".";
-  for (int i = 0; i < history_.size(); ++i) {
+  vector<shared_ptr<Blob<Dtype> > > history;
+  if (this->snapshot_thread_) {
+    history = snapshot_history_;
+  } else {
+    GatherHistory(&history);
+  }
+  for (int i = 0; i < history.size(); ++i) {
     ostringstream oss;
     oss << i;
-    hdf5_save_nd_dataset<Dtype>(history_hid, oss.str(), *history_[i]);
+    hdf5_save_nd_dataset<Dtype>(history_hid, oss.str(), *history[i]);
   }
   H5Gclose(history_hid);
   H5Fclose(file_hid);
@@ -713,13 +1488,27 @@ void SGDSolver<Dtype>::RestoreSolverStateFromBinaryProto(
     const string& state_file) {
   SolverState state;
   ReadProtoFromBinaryFile(state_file, &state);
+  if (state.shard_size()) {
+    vector<SolverState> shard_states(state.shard_size());
+    vector<string> filenames;
+    vector<Message*> protos;
+    for (int k = 0; k < state.shard_size(); ++k) {
+      filenames.push_back(ShardPath(state_file, state.shard(k)));
+      protos.push_back(&shard_states[k]);
+    }
+    ReadProtosFromBinaryFilesOrDie(filenames, protos);
+    for (int k = 0; k < shard_states.size(); ++k) {
+      for (int i = 0; i < shard_states[k].history_size(); ++i) {
+        state.add_history()->Swap(shard_states[k].mutable_history(i));
+      }
+    }
+  }
   this->iter_ = state.iter();
   if (state.has_learned_net()) {
-    NetParameter net_param;
-    ReadNetParamsFromBinaryFileOrDie(state.learned_net().c_str(), &net_param);
-    this->net_->CopyTrainedLayersFrom(net_param);
+    this->net_->CopyTrainedLayersFromBinaryProto(state.learned_net());
   }
   this->current_step_ = state.current_step();
+  CHECK(!update_sharded_) << "Restore the solver before sharding the update";
   CHECK_EQ(state.history_size(), history_.size())
       << "Incorrect length of history blobs.";
   LOG(INFO) << "SGDSolver: restoring history";
@@ -738,6 +1527,7 @@ void SGDSolver<Dtype>::RestoreSolverStateFromHDF5(const string& state_file) {
     this->net_->CopyTrainedLayersFrom(learned_net);
   }
   this->current_step_ = hdf5_load_int(file_hid, "current_step");
+  CHECK(!update_sharded_) << "Restore the solver before sharding the update";
   hid_t history_hid = H5Gopen2(file_hid, "history", H5P_DEFAULT);
   CHECK_GE(history_hid, 0) << "Error reading history from " << state_file;
   int state_history_size = hdf5_get_num_links(history_hid);
@@ -753,221 +1543,6 @@ void SGDSolver<Dtype>::RestoreSolverStateFromHDF5(const string& state_file) {
   H5Fclose(file_hid);
 }
 
-template <typename Dtype>
-void NesterovSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
-  CHECK(Caffe::root_solver());
-  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
-  const vector<float>& net_params_lr = this->net_->params_lr();
-  Dtype momentum = this->param_.momentum();
-  Dtype local_rate = rate * net_params_lr[param_id];
-  switch (Caffe::mode()) {
-  case Caffe::CPU: {
-    // save history momentum for stepping back
-    caffe_copy(net_params[param_id]->count(),
-        this->history_[param_id]->cpu_data(),
-        this->update_[param_id]->mutable_cpu_data());
-
-    // update history
-    caffe_cpu_axpby(net_params[param_id]->count(), local_rate,
-              net_params[param_id]->cpu_diff(), momentum,
-              this->history_[param_id]->mutable_cpu_data());
-
-    // compute update: step back then over step
-    caffe_cpu_axpby(net_params[param_id]->count(), Dtype(1) + momentum,
-        this->history_[param_id]->cpu_data(), -momentum,
-        this->update_[param_id]->mutable_cpu_data());
-
-    // copy
-    caffe_copy(net_params[param_id]->count(),
-        this->update_[param_id]->cpu_data(),
-        net_params[param_id]->mutable_cpu_diff());
-    break;
-  }
-  case Caffe::GPU: {
-#ifndef CPU_ONLY
-    // save history momentum for stepping back
-    caffe_copy(net_params[param_id]->count(),
-        this->history_[param_id]->gpu_data(),
-        this->update_[param_id]->mutable_gpu_data());
-
-    // update history
-    caffe_gpu_axpby(net_params[param_id]->count(), local_rate,
-              net_params[param_id]->gpu_diff(), momentum,
-              this->history_[param_id]->mutable_gpu_data());
-
-    // compute update: step back then over step
-    caffe_gpu_axpby(net_params[param_id]->count(), Dtype(1) + momentum,
-        this->history_[param_id]->gpu_data(), -momentum,
-        this->update_[param_id]->mutable_gpu_data());
-
-    // copy
-    caffe_copy(net_params[param_id]->count(),
-        this->update_[param_id]->gpu_data(),
-        net_params[param_id]->mutable_gpu_diff());
-#else
-    NO_GPU;
-#endif
-    break;
-  }
-  default:
-    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
-  }
-}
-
-template <typename Dtype>
-void AdaGradSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
-  CHECK(Caffe::root_solver());
-  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
-  const vector<float>& net_params_lr = this->net_->params_lr();
-  Dtype delta = this->param_.delta();
-  Dtype local_rate = rate * net_params_lr[param_id];
-  switch (Caffe::mode()) {
-  case Caffe::CPU: {
-    // compute square of gradient in update
-    caffe_powx(net_params[param_id]->count(),
-        net_params[param_id]->cpu_diff(), Dtype(2),
-        this->update_[param_id]->mutable_cpu_data());
-
-    // update history
-    caffe_add(net_params[param_id]->count(),
-        this->update_[param_id]->cpu_data(),
-        this->history_[param_id]->cpu_data(),
-        this->history_[param_id]->mutable_cpu_data());
-
-    // prepare update
-    caffe_powx(net_params[param_id]->count(),
-              this->history_[param_id]->cpu_data(), Dtype(0.5),
-              this->update_[param_id]->mutable_cpu_data());
-
-    caffe_add_scalar(net_params[param_id]->count(),
-              delta, this->update_[param_id]->mutable_cpu_data());
-
-    caffe_div(net_params[param_id]->count(),
-              net_params[param_id]->cpu_diff(),
-              this->update_[param_id]->cpu_data(),
-              this->update_[param_id]->mutable_cpu_data());
-
-    // scale and copy
-    caffe_cpu_axpby(net_params[param_id]->count(), local_rate,
-        this->update_[param_id]->cpu_data(), Dtype(0),
-        net_params[param_id]->mutable_cpu_diff());
-    break;
-  }
-  case Caffe::GPU: {
-#ifndef CPU_ONLY
-    // compute square of gradient in update
-    caffe_gpu_powx(net_params[param_id]->count(),
-        net_params[param_id]->gpu_diff(), Dtype(2),
-        this->update_[param_id]->mutable_gpu_data());
-
-    // update history
-    caffe_gpu_add(net_params[param_id]->count(),
-        this->update_[param_id]->gpu_data(),
-        this->history_[param_id]->gpu_data(),
-        this->history_[param_id]->mutable_gpu_data());
-
-    // prepare update
-    caffe_gpu_powx(net_params[param_id]->count(),
-              this->history_[param_id]->gpu_data(), Dtype(0.5),
-              this->update_[param_id]->mutable_gpu_data());
-
-    caffe_gpu_add_scalar(net_params[param_id]->count(),
-              delta, this->update_[param_id]->mutable_gpu_data());
-
-    caffe_gpu_div(net_params[param_id]->count(),
-              net_params[param_id]->gpu_diff(),
-              this->update_[param_id]->gpu_data(),
-              this->update_[param_id]->mutable_gpu_data());
-
-    // scale and copy
-    caffe_gpu_axpby(net_params[param_id]->count(), local_rate,
-        this->update_[param_id]->gpu_data(), Dtype(0),
-        net_params[param_id]->mutable_gpu_diff());
-#else
-    NO_GPU;
-#endif
-    break;
-  }
-  default:
-    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
-  }
-}
-
-template <typename Dtype>
-void RMSPropSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
-  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
-  const vector<float>& net_params_lr = this->net_->params_lr();
-
-  // get the learning rate
-  Dtype delta = this->param_.delta();
-  Dtype rms_decay = this->param_.rms_decay();
-  Dtype local_rate = rate * net_params_lr[param_id];
-
-  switch (Caffe::mode()) {
-  case Caffe::CPU:
-    // compute square of gradient in update
-    caffe_powx(net_params[param_id]->count(),
-        net_params[param_id]->cpu_diff(), Dtype(2),
-        this->update_[param_id]->mutable_cpu_data());
-
-    // update history
-    caffe_cpu_axpby(net_params[param_id] -> count(),
-        Dtype(1-rms_decay), this->update_[param_id]->cpu_data(),
-        rms_decay, this->history_[param_id]-> mutable_cpu_data());
-
-    // prepare update
-    caffe_powx(net_params[param_id]->count(),
-        this->history_[param_id]->cpu_data(), Dtype(0.5),
-        this->update_[param_id]->mutable_cpu_data());
-
-    caffe_add_scalar(net_params[param_id]->count(),
-        delta, this->update_[param_id]->mutable_cpu_data());
-
-    caffe_div(net_params[param_id]->count(),
-        net_params[param_id]->cpu_diff(), this->update_[param_id]->cpu_data(),
-        this->update_[param_id]->mutable_cpu_data());
-
-    // scale and copy
-    caffe_cpu_axpby(net_params[param_id]->count(), local_rate,
-        this->update_[param_id]->cpu_data(), Dtype(0),
-        net_params[param_id]->mutable_cpu_diff());
-    break;
-  case Caffe::GPU:
-#ifndef CPU_ONLY
-    // compute square of gradient in update
-    caffe_gpu_powx(net_params[param_id]->count(),
-        net_params[param_id]->gpu_diff(), Dtype(2),
-        this->update_[param_id]->mutable_gpu_data());
-
-    // update history
-    caffe_gpu_axpby(net_params[param_id] -> count(),
-        Dtype(1-rms_decay), this->update_[param_id]->gpu_data(),
-        rms_decay, this->history_[param_id]-> mutable_gpu_data());
-
-    // prepare update
-    caffe_gpu_powx(net_params[param_id]->count(),
-        this->history_[param_id]->gpu_data(), Dtype(0.5),
-        this->update_[param_id]->mutable_gpu_data());
-
-    caffe_gpu_add_scalar(net_params[param_id]->count(),
-        delta, this->update_[param_id]->mutable_gpu_data());
-
-    caffe_gpu_div(net_params[param_id]->count(),
-        net_params[param_id]->gpu_diff(), this->update_[param_id]->gpu_data(),
-        this->update_[param_id]->mutable_gpu_data());
-
-    caffe_gpu_axpby(net_params[param_id]->count(), local_rate,
-        this->update_[param_id]->gpu_data(), Dtype(0),
-        net_params[param_id]->mutable_gpu_diff());
-#else
-    NO_GPU;
-#endif
-    break;
-  default:
-    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
-  }
-}
-
 template <typename Dtype>
 void AdaDeltaSolver<Dtype>::AdaDeltaPreSolve() {
   // Add the extra history entries for AdaDelta after those from
@@ -980,140 +1555,6 @@ void AdaDeltaSolver<Dtype>::AdaDeltaPreSolve() {
   }
 }
 
-template <typename Dtype>
-void AdaDeltaSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
-  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
-  const vector<float>& net_params_lr = this->net_->params_lr();
-  Dtype delta = this->param_.delta();
-  Dtype momentum = this->param_.momentum();
-  Dtype local_rate = rate * net_params_lr[param_id];
-  size_t update_history_offset = net_params.size();
-  switch (Caffe::mode()) {
-  case Caffe::CPU: {
-    // compute square of gradient in update
-    caffe_powx(net_params[param_id]->count(),
-        net_params[param_id]->cpu_diff(), Dtype(2),
-        this->update_[param_id]->mutable_cpu_data());
-
-    // update history of gradients
-    caffe_cpu_axpby(net_params[param_id]->count(), Dtype(1) - momentum,
-        this->update_[param_id]->cpu_data(), momentum,
-        this->history_[param_id]->mutable_cpu_data());
-
-    // add delta to history to guard against dividing by zero later
-    caffe_set(net_params[param_id]->count(), delta,
-        this->temp_[param_id]->mutable_cpu_data());
-
-    caffe_add(net_params[param_id]->count(),
-        this->temp_[param_id]->cpu_data(),
-        this->history_[update_history_offset + param_id]->cpu_data(),
-        this->update_[param_id]->mutable_cpu_data());
-
-    caffe_add(net_params[param_id]->count(),
-        this->temp_[param_id]->cpu_data(),
-        this->history_[param_id]->cpu_data(),
-        this->temp_[param_id]->mutable_cpu_data());
-
-    // divide history of updates by history of gradients
-    caffe_div(net_params[param_id]->count(),
-        this->update_[param_id]->cpu_data(),
-        this->temp_[param_id]->cpu_data(),
-        this->update_[param_id]->mutable_cpu_data());
-
-    // jointly compute the RMS of both for update and gradient history
-    caffe_powx(net_params[param_id]->count(),
-        this->update_[param_id]->cpu_data(), Dtype(0.5),
-        this->update_[param_id]->mutable_cpu_data());
-
-    // compute the update
-    caffe_mul(net_params[param_id]->count(),
-        net_params[param_id]->cpu_diff(),
-        this->update_[param_id]->cpu_data(),
-        net_params[param_id]->mutable_cpu_diff());
-
-    // compute square of update
-    caffe_powx(net_params[param_id]->count(),
-        net_params[param_id]->cpu_diff(), Dtype(2),
-        this->update_[param_id]->mutable_cpu_data());
-
-    // update history of updates
-    caffe_cpu_axpby(net_params[param_id]->count(), Dtype(1) - momentum,
-        this->update_[param_id]->cpu_data(), momentum,
-        this->history_[update_history_offset + param_id]->mutable_cpu_data());
-
-    // apply learning rate
-    caffe_cpu_scale(net_params[param_id]->count(), local_rate,
-        net_params[param_id]->cpu_diff(),
-        net_params[param_id]->mutable_cpu_diff());
-    break;
-  }
-  case Caffe::GPU: {
-#ifndef CPU_ONLY
-    // compute square of gradient in update
-    caffe_gpu_powx(net_params[param_id]->count(),
-        net_params[param_id]->gpu_diff(), Dtype(2),
-        this->update_[param_id]->mutable_gpu_data());
-
-    // update history of gradients
-    caffe_gpu_axpby(net_params[param_id]->count(), Dtype(1) - momentum,
-        this->update_[param_id]->gpu_data(), momentum,
-        this->history_[param_id]->mutable_gpu_data());
-
-    // add delta to history to guard against dividing by zero later
-    caffe_gpu_set(net_params[param_id]->count(), delta,
-        this->temp_[param_id]->mutable_gpu_data());
-
-    caffe_gpu_add(net_params[param_id]->count(),
-        this->temp_[param_id]->gpu_data(),
-        this->history_[update_history_offset + param_id]->gpu_data(),
-        this->update_[param_id]->mutable_gpu_data());
-
-    caffe_gpu_add(net_params[param_id]->count(),
-        this->temp_[param_id]->gpu_data(),
-        this->history_[param_id]->gpu_data(),
-        this->temp_[param_id]->mutable_gpu_data());
-
-    // divide history of updates by history of gradients
-    caffe_gpu_div(net_params[param_id]->count(),
-        this->update_[param_id]->gpu_data(),
-        this->temp_[param_id]->gpu_data(),
-        this->update_[param_id]->mutable_gpu_data());
-
-    // jointly compute the RMS of both for update and gradient history
-    caffe_gpu_powx(net_params[param_id]->count(),
-        this->update_[param_id]->gpu_data(), Dtype(0.5),
-        this->update_[param_id]->mutable_gpu_data());
-
-    // compute the update and copy to net_diff
-    caffe_gpu_mul(net_params[param_id]->count(),
-        net_params[param_id]->gpu_diff(),
-        this->update_[param_id]->gpu_data(),
-        net_params[param_id]->mutable_gpu_diff());
-
-    // compute square of update
-    caffe_gpu_powx(net_params[param_id]->count(),
-        net_params[param_id]->gpu_diff(), Dtype(2),
-        this->update_[param_id]->mutable_gpu_data());
-
-    // update history of updates
-    caffe_gpu_axpby(net_params[param_id]->count(), Dtype(1) - momentum,
-        this->update_[param_id]->gpu_data(), momentum,
-        this->history_[update_history_offset + param_id]->mutable_gpu_data());
-
-    // apply learning rate
-    caffe_gpu_scale(net_params[param_id]->count(), local_rate,
-        net_params[param_id]->gpu_diff(),
-        net_params[param_id]->mutable_gpu_diff());
-#else
-    NO_GPU;
-#endif
-    break;
-  }
-  default:
-    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
-  }
-}
-
 template <typename Dtype>
 void AdamSolver<Dtype>::AdamPreSolve() {
   // Add the extra history entries for Adam after those from
@@ -1126,97 +1567,6 @@ void AdamSolver<Dtype>::AdamPreSolve() {
   }
 }
 
-template <typename Dtype>
-void AdamSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
-  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
-  const vector<float>& net_params_lr = this->net_->params_lr();
-  Dtype local_rate = rate * net_params_lr[param_id];
-  const Dtype beta1 = this->param_.momentum();
-  const Dtype beta2 = this->param_.momentum2();
-
-  // we create aliases for convenience
-  size_t update_history_offset = net_params.size();
-  Blob<Dtype>* val_m = this->history_[param_id].get();
-  Blob<Dtype>* val_v = this->history_[param_id + update_history_offset].get();
-  Blob<Dtype>* val_t = this->temp_[param_id].get();
-
-  const int t = this->iter_  + 1;
-  const Dtype correction = std::sqrt(Dtype(1) - pow(beta2, t)) /
-      (Dtype(1.) - pow(beta1, t));
-  const int N = net_params[param_id]->count();
-  const Dtype eps_hat = this->param_.delta();
-
-  switch (Caffe::mode()) {
-    case Caffe::CPU: {
-    // update m <- \beta_1 m_{t-1} + (1-\beta_1)g_t
-    caffe_cpu_axpby(N, Dtype(1)-beta1,
-        net_params[param_id]->cpu_diff(), beta1,
-        val_m->mutable_cpu_data());
-
-    // update v <- \beta_2 m_{t-1} + (1-\beta_2)g_t^2
-    caffe_mul(N,
-        net_params[param_id]->cpu_diff(),
-        net_params[param_id]->cpu_diff(),
-    val_t->mutable_cpu_data());
-    caffe_cpu_axpby(N, Dtype(1)-beta2,
-        val_t->cpu_data(), beta2,
-        val_v->mutable_cpu_data());
-
-    // set update
-    caffe_powx(N,
-        val_v->cpu_data(), Dtype(0.5),
-        val_t->mutable_cpu_data());
-    caffe_add_scalar(N, eps_hat, val_t->mutable_cpu_data());
-    caffe_div(N,
-        val_m->cpu_data(),
-        val_t->cpu_data(),
-        val_t->mutable_cpu_data());
-
-    caffe_cpu_scale(N, local_rate*correction,
-        val_t->cpu_data(),
-        net_params[param_id]->mutable_cpu_diff());
-    break;
-  }
-  case Caffe::GPU: {
-#ifndef CPU_ONLY
-    // update m <- \beta_1 m_{t-1} + (1-\beta_1)g_t
-    caffe_gpu_axpby(N, Dtype(1)-beta1,
-        net_params[param_id]->gpu_diff(), beta1,
-        val_m->mutable_gpu_data());
-
-    // update v <- \beta_2 m_{t-1} + (1-\beta_2)g_t^2
-    caffe_gpu_mul(N,
-        net_params[param_id]->gpu_diff(),
-        net_params[param_id]->gpu_diff(),
-        val_t->mutable_gpu_data());
-    caffe_gpu_axpby(N, Dtype(1)-beta2,
-        val_t->gpu_data(), beta2,
-        val_v->mutable_gpu_data());
-
-    // set update
-    caffe_gpu_powx(N,
-        val_v->gpu_data(), Dtype(0.5),
-        val_t->mutable_gpu_data());
-    caffe_gpu_add_scalar(N, eps_hat,
-        val_t->mutable_gpu_data());
-    caffe_gpu_div(N,
-        val_m->gpu_data(),
-        val_t->gpu_data(),
-        val_t->mutable_gpu_data());
-
-    caffe_gpu_scale(N, local_rate*correction,
-        val_t->gpu_data(),
-        net_params[param_id]->mutable_gpu_diff());
-#else
-    NO_GPU;
-#endif
-    break;
-  }
-  default:
-    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
-  }
-}
-
 INSTANTIATE_CLASS(Solver);
 INSTANTIATE_CLASS(SGDSolver);
 INSTANTIATE_CLASS(NesterovSolver);
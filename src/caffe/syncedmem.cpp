@@ -1,4 +1,13 @@
+#include <sys/mman.h>
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
 #include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "caffe/common.hpp"
 #include "caffe/syncedmem.hpp"
@@ -6,39 +15,532 @@
 
 namespace caffe {
 
+#ifndef CPU_ONLY
+namespace {
+
+// Caches blocks freed by Caffe, keyed by size bucket and, for device memory,
+// by device. Blocks are only returned to CUDA when an allocation fails.
+class MemoryPool {
+ public:
+  typedef cudaError_t (*Malloc)(void** ptr, size_t size);
+  typedef cudaError_t (*Free)(void* ptr);
+
+  MemoryPool(const string& name, Malloc malloc, Free free, bool per_device)
+      : name_(name), malloc_(malloc), free_(free), per_device_(per_device),
+        hits_(), misses_(), used_(), cached_bytes_(), peak_() {
+  }
+
+  cudaError_t allocate(void** ptr, size_t size) {
+    const int device = current_device();
+    const size_t rounded = bucket(size);
+    boost::mutex::scoped_lock lock(mutex_);
+    vector<void*>& blocks = cached_[std::make_pair(device, rounded)];
+    if (blocks.size()) {
+      *ptr = blocks.back();
+      blocks.pop_back();
+      cached_bytes_ -= rounded;
+      ++hits_;
+    } else {
+      cudaError_t err = malloc_(ptr, rounded);
+      if (err == cudaErrorMemoryAllocation) {
+        // Blocks cached for other sizes might be enough
+        cudaGetLastError();
+        release(device);
+        err = malloc_(ptr, rounded);
+      }
+      if (err != cudaSuccess) {
+        return err;
+      }
+      ++misses_;
+    }
+    allocated_[*ptr] = std::make_pair(device, rounded);
+    used_ += rounded;
+    peak_ = std::max(peak_, used_);
+    size_t& device_used = device_used_[device];
+    device_used += rounded;
+    device_peak_[device] = std::max(device_peak_[device], device_used);
+    return cudaSuccess;
+  }
+
+  cudaError_t deallocate(void* ptr) {
+    if (!ptr) {
+      return cudaSuccess;
+    }
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<void*, Key>::iterator it = allocated_.find(ptr);
+    CHECK(it != allocated_.end()) << "Block not allocated by the " << name_
+        << " pool";
+    cached_[it->second].push_back(ptr);
+    used_ -= it->second.second;
+    device_used_[it->second.first] -= it->second.second;
+    cached_bytes_ += it->second.second;
+    allocated_.erase(it);
+    return cudaSuccess;
+  }
+
+  void release() {
+    const int device = current_device();
+    boost::mutex::scoped_lock lock(mutex_);
+    release(device);
+  }
+
+  // The bytes in use on the current device, and at most since the reset
+  void usage(size_t* used, size_t* peak) {
+    const int device = current_device();
+    boost::mutex::scoped_lock lock(mutex_);
+    *used = device_used_[device];
+    *peak = device_peak_[device];
+  }
+
+  void reset_peak() {
+    const int device = current_device();
+    boost::mutex::scoped_lock lock(mutex_);
+    device_peak_[device] = device_used_[device];
+  }
+
+  void log_stats() {
+    boost::mutex::scoped_lock lock(mutex_);
+    const int total = hits_ + misses_;
+    LOG(INFO) << name_ << " memory: " << total << " allocations, "
+        << (total ? 100 * hits_ / total : 0) << "% from cache, "
+        << (used_ >> 20) << "MB in use, " << (cached_bytes_ >> 20)
+        << "MB cached, " << (peak_ >> 20) << "MB peak";
+  }
+
+ private:
+  typedef std::pair<int, size_t> Key;  // Device and rounded size
+
+  // Powers of two up to 1MB, then multiples of 1MB, wasting at most half of
+  // small blocks and little of large ones.
+  static size_t bucket(size_t size) {
+    const size_t kMinSize = 512;
+    const size_t kMaxPow2 = 1 << 20;
+    if (size > kMaxPow2) {
+      return (size + kMaxPow2 - 1) / kMaxPow2 * kMaxPow2;
+    }
+    size_t rounded = kMinSize;
+    while (rounded < size) {
+      rounded *= 2;
+    }
+    return rounded;
+  }
+
+  int current_device() const {
+    int device = -1;
+    if (per_device_) {
+      CUDA_CHECK(cudaGetDevice(&device));
+    }
+    return device;
+  }
+
+  // Called with the mutex held
+  void release(int device) {
+    int initial_device;
+    CUDA_CHECK(cudaGetDevice(&initial_device));
+    if (per_device_) {
+      CUDA_CHECK(cudaSetDevice(device));
+    }
+    for (std::map<Key, vector<void*> >::iterator it = cached_.begin();
+         it != cached_.end(); ++it) {
+      if (it->first.first == device) {
+        for (int i = 0; i < it->second.size(); ++i) {
+          CUDA_CHECK(free_(it->second[i]));
+        }
+        cached_bytes_ -= it->first.second * it->second.size();
+        it->second.clear();
+      }
+    }
+    CUDA_CHECK(cudaSetDevice(initial_device));
+  }
+
+  const string name_;
+  const Malloc malloc_;
+  const Free free_;
+  const bool per_device_;
+  boost::mutex mutex_;
+  std::map<void*, Key> allocated_;
+  std::map<Key, vector<void*> > cached_;
+  int hits_;
+  int misses_;
+  size_t used_;
+  size_t cached_bytes_;
+  size_t peak_;
+  std::map<int, size_t> device_used_;
+  std::map<int, size_t> device_peak_;
+};
+
+cudaError_t malloc_host(void** ptr, size_t size) {
+  return cudaMallocHost(ptr, size);
+}
+
+cudaError_t malloc_device(void** ptr, size_t size) {
+  return cudaMalloc(ptr, size);
+}
+
+// Never deleted, as freeing blocks at exit could happen after the CUDA
+// runtime shut down.
+MemoryPool* host_pool = new MemoryPool("Pinned host", malloc_host,
+                                       cudaFreeHost, false);
+MemoryPool* device_pool = new MemoryPool("GPU", malloc_device, cudaFree,
+                                         true);
+
+}  // namespace
+
+cudaError_t CaffeMallocPinned(void** ptr, size_t size) {
+  return host_pool->allocate(ptr, size);
+}
+
+cudaError_t CaffeFreePinned(void* ptr) {
+  return host_pool->deallocate(ptr);
+}
+
+cudaError_t CaffeMallocGPU(void** ptr, size_t size) {
+  return device_pool->allocate(ptr, size);
+}
+
+cudaError_t CaffeFreeGPU(void* ptr) {
+  return device_pool->deallocate(ptr);
+}
+
+void CaffeReleaseGPUCache() {
+  device_pool->release();
+}
+
+void CaffeLogMemoryStats() {
+  host_pool->log_stats();
+  device_pool->log_stats();
+}
+
+void CaffeGPUMemoryUsage(size_t* used, size_t* peak) {
+  device_pool->usage(used, peak);
+}
+
+void CaffeResetGPUMemoryPeak() {
+  device_pool->reset_peak();
+}
+
+static bool managed_memory = false;
+
+void CaffeSetManagedMemory(bool managed) {
+  managed_memory = managed;
+}
+
+bool CaffeManagedMemory() {
+  return managed_memory;
+}
+
+// Hints the driver to move managed memory to the device, or to the host, on
+// the stream ahead of its use there.
+static void PrefetchManaged(void* ptr, size_t size, int device, bool to_host,
+    const cudaStream_t& stream) {
+#if CUDART_VERSION >= 8000
+  CUDA_CHECK(cudaMemPrefetchAsync(ptr, size,
+      to_host ? cudaCpuDeviceId : device, stream));
+#endif
+}
+#endif  // CPU_ONLY
+
+namespace {
+
+const size_t kHugePageSize = 2 << 20;
+
+// The huge page mappings in use, by address, with their mapped size.
+// Allocations and frees only take the lock once huge pages were turned on.
+class HugePages {
+ public:
+  HugePages() : threshold_(), hugetlbfs_(), enabled_(false) {}
+
+  // Maps size bytes rounded up to huge pages, NULL if it cannot
+  void* allocate(size_t size) {
+    const size_t mapped = (size + kHugePageSize - 1) / kHugePageSize
+        * kHugePageSize;
+    bool from_pool = false;
+    void* ptr = NULL;
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    if (hugetlbfs_) {
+      // Aligned to the huge page size by the kernel
+      ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      from_pool = ptr != MAP_FAILED;
+    }
+#endif
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (!from_pool) {
+      // Over-allocates to align, then unmaps the ends
+      char* region = static_cast<char*>(mmap(NULL, mapped + kHugePageSize,
+          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+      if (region == MAP_FAILED) {
+        return NULL;
+      }
+      const size_t offset = (kHugePageSize
+          - reinterpret_cast<size_t>(region) % kHugePageSize) % kHugePageSize;
+      if (offset) {
+        munmap(region, offset);
+      }
+      munmap(region + offset + mapped, kHugePageSize - offset);
+      ptr = region + offset;
+      madvise(ptr, mapped, MADV_HUGEPAGE);
+    }
+#endif
+    if (!ptr || ptr == MAP_FAILED) {
+      return NULL;
+    }
+    boost::mutex::scoped_lock lock(mutex_);
+    mapped_[ptr] = mapped;
+    ++stats_.allocations;
+    stats_.hugetlbfs += from_pool;
+    stats_.used += mapped;
+    stats_.peak = std::max(stats_.peak, stats_.used);
+    return ptr;
+  }
+
+  // Unmaps ptr if it is a huge page mapping
+  bool deallocate(void* ptr) {
+    if (!enabled_ || !ptr) {
+      return false;
+    }
+    size_t mapped;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      std::map<void*, size_t>::iterator it = mapped_.find(ptr);
+      if (it == mapped_.end()) {
+        return false;
+      }
+      mapped = it->second;
+      stats_.used -= mapped;
+      mapped_.erase(it);
+    }
+    CHECK_EQ(munmap(ptr, mapped), 0) << "Cannot unmap huge pages";
+    return true;
+  }
+
+  HugePageStats stats() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return stats_;
+  }
+
+  size_t threshold_;
+  bool hugetlbfs_;
+  // Once set, stays so, as mappings may outlive turning huge pages off
+  bool enabled_;
+
+ private:
+  boost::mutex mutex_;
+  std::map<void*, size_t> mapped_;
+  HugePageStats stats_;
+};
+
+// Never deleted, as static blobs could be freed after it at exit
+HugePages* huge_pages = new HugePages();
+
+}  // namespace
+
+void CaffeSetHugePages(size_t threshold, bool hugetlbfs) {
+  huge_pages->threshold_ = threshold;
+  huge_pages->hugetlbfs_ = hugetlbfs;
+  if (threshold) {
+    huge_pages->enabled_ = true;
+  }
+}
+
+size_t CaffeHugePagesThreshold() {
+  return huge_pages->threshold_;
+}
+
+HugePageStats CaffeHugePageStats() {
+  return huge_pages->stats();
+}
+
+void CaffeLogHugePageStats() {
+  if (!huge_pages->enabled_) {
+    return;
+  }
+  const HugePageStats stats = huge_pages->stats();
+  LOG(INFO) << "Huge page memory: " << stats.allocations << " allocations, "
+      << stats.hugetlbfs << " from hugetlbfs, " << (stats.used >> 20)
+      << "MB in use, " << (stats.peak >> 20) << "MB peak";
+}
+
+void CaffeMallocHost(void** ptr, size_t size) {
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(CaffeMallocPinned(ptr, size));
+    return;
+  }
+#endif
+  const size_t threshold = huge_pages->threshold_;
+  if (threshold && size >= threshold) {
+    *ptr = huge_pages->allocate(size);
+    if (*ptr) {
+      return;
+    }
+  }
+  *ptr = malloc(size);
+  CHECK(*ptr) << "host allocation of size " << size << " failed";
+}
+
+void CaffeFreeHost(void* ptr) {
+  if (huge_pages->deallocate(ptr)) {
+    return;
+  }
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(CaffeFreePinned(ptr));
+    return;
+  }
+#endif
+  free(ptr);
+}
+
+SyncedMemory::SyncedMemory(const shared_ptr<SyncedMemory>& parent,
+    size_t offset, size_t size)
+    : cpu_ptr_(NULL), gpu_ptr_(NULL), size_(size), head_(UNINITIALIZED),
+      own_cpu_data_(false), own_gpu_data_(false), managed_(false),
+      gpu_device_(-1), parent_(parent), offset_(offset), version_(0) {
+  CHECK_LE(offset + size, parent->size()) << "View out of range";
+}
+
 SyncedMemory::~SyncedMemory() {
+  free_managed();
   if (cpu_ptr_ && own_cpu_data_) {
     CaffeFreeHost(cpu_ptr_);
   }
 
 #ifndef CPU_ONLY
   if (gpu_ptr_ && own_gpu_data_) {
-    int initial_device;
-    cudaGetDevice(&initial_device);
-    if (gpu_device_ != -1) {
-      CUDA_CHECK(cudaSetDevice(gpu_device_));
-    }
-    CUDA_CHECK(cudaFree(gpu_ptr_));
-    cudaSetDevice(initial_device);
+    CUDA_CHECK(CaffeFreeGPU(gpu_ptr_));
   }
 #endif  // CPU_ONLY
 }
 
+bool SyncedMemory::malloc_managed() {
+#if !defined(CPU_ONLY) && CUDART_VERSION >= 8000
+  if (!CaffeManagedMemory() || Caffe::mode() != Caffe::GPU) {
+    return false;
+  }
+  int device;
+  CUDA_CHECK(cudaGetDevice(&device));
+  int concurrent = 0;
+  CUDA_CHECK(cudaDeviceGetAttribute(&concurrent,
+      cudaDevAttrConcurrentManagedAccess, device));
+  if (!concurrent) {
+    LOG_FIRST_N(WARNING, 1) << "Ignoring managed memory, as GPU " << device
+        << " cannot access it concurrently with the host";
+    return false;
+  }
+  void* ptr;
+  CUDA_CHECK(cudaMallocManaged(&ptr, std::max(size_, size_t(1))));
+  cpu_ptr_ = ptr;
+  gpu_ptr_ = ptr;
+  gpu_device_ = device;
+  managed_ = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void SyncedMemory::free_managed() {
+#ifndef CPU_ONLY
+  if (managed_) {
+    CUDA_CHECK(cudaFree(cpu_ptr_));
+    cpu_ptr_ = NULL;
+    gpu_ptr_ = NULL;
+    managed_ = false;
+  }
+#endif
+}
+
+namespace {
+
+struct TransferState {
+  TransferState() : fail_in(NULL) {}
+  TransferCount count;
+  const char* fail_in;
+};
+
+boost::thread_specific_ptr<TransferState> transfer_state_;
+
+TransferState& transfer_state() {
+  if (!transfer_state_.get()) {
+    transfer_state_.reset(new TransferState());
+  }
+  return *transfer_state_;
+}
+
+// Counts a copy and its time, over its lifetime.
+class TransferRecord {
+ public:
+  TransferRecord(bool to_gpu, size_t bytes)
+      : state_(transfer_state()), to_gpu_(to_gpu),
+        start_(boost::posix_time::microsec_clock::universal_time()) {
+    CHECK(!state_.fail_in) << "Implicit copy of " << bytes << " bytes to the "
+        << (to_gpu ? "GPU" : "host") << " in " << state_.fail_in;
+    state_.count.calls[to_gpu]++;
+    state_.count.bytes[to_gpu] += bytes;
+  }
+  ~TransferRecord() {
+    state_.count.us[to_gpu_] +=
+        (boost::posix_time::microsec_clock::universal_time() - start_)
+        .total_microseconds();
+  }
+
+ private:
+  TransferState& state_;
+  const bool to_gpu_;
+  const boost::posix_time::ptime start_;
+};
+
+}  // namespace
+
+const TransferCount& CaffeTransferCount() {
+  return transfer_state().count;
+}
+
+void CaffeFailOnTransfer(const char* what) {
+  transfer_state().fail_in = what;
+}
+
+// Layers running on different threads may read the same memory, e.g. the
+// branches after a split, so moving it between devices takes one of a few
+// locks, picked by address.
+static boost::mutex& transfer_mutex(const SyncedMemory* memory) {
+  static boost::mutex mutexes[64];
+  return mutexes[(reinterpret_cast<size_t>(memory) >> 4) % 64];
+}
+
 inline void SyncedMemory::to_cpu() {
+  if (head_ == HEAD_AT_CPU || head_ == SYNCED) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(transfer_mutex(this));
   switch (head_) {
   case UNINITIALIZED:
-    CaffeMallocHost(&cpu_ptr_, size_);
+    if (!malloc_managed()) {
+      CaffeMallocHost(&cpu_ptr_, size_);
+      own_cpu_data_ = true;
+    }
     caffe_memset(size_, 0, cpu_ptr_);
     head_ = HEAD_AT_CPU;
-    own_cpu_data_ = true;
     break;
   case HEAD_AT_GPU:
 #ifndef CPU_ONLY
+    if (managed_) {
+      // Only the kernels writing it must be done, the pages the host then
+      // touches moving on their own.
+      TransferRecord record(false, 0);
+      CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+      head_ = SYNCED;
+      break;
+    }
     if (cpu_ptr_ == NULL) {
       CaffeMallocHost(&cpu_ptr_, size_);
       own_cpu_data_ = true;
     }
-    caffe_gpu_memcpy(size_, gpu_ptr_, cpu_ptr_);
+    {
+      TransferRecord record(false, size_);
+      caffe_gpu_memcpy(size_, gpu_ptr_, cpu_ptr_);
+    }
     head_ = SYNCED;
 #else
     NO_GPU;
@@ -52,21 +554,37 @@ inline void SyncedMemory::to_cpu() {
 
 inline void SyncedMemory::to_gpu() {
 #ifndef CPU_ONLY
+  if (head_ == HEAD_AT_GPU || head_ == SYNCED) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(transfer_mutex(this));
   switch (head_) {
   case UNINITIALIZED:
-    CUDA_CHECK(cudaGetDevice(&gpu_device_));
-    CUDA_CHECK(cudaMalloc(&gpu_ptr_, size_));
+    if (!malloc_managed()) {
+      CUDA_CHECK(cudaGetDevice(&gpu_device_));
+      CUDA_CHECK(CaffeMallocGPU(&gpu_ptr_, size_));
+      own_gpu_data_ = true;
+    }
     caffe_gpu_memset(size_, 0, gpu_ptr_);
     head_ = HEAD_AT_GPU;
-    own_gpu_data_ = true;
     break;
   case HEAD_AT_CPU:
+    if (managed_) {
+      TransferRecord record(true, size_);
+      PrefetchManaged(gpu_ptr_, size_, gpu_device_, false,
+          Caffe::cuda_stream());
+      head_ = SYNCED;
+      break;
+    }
     if (gpu_ptr_ == NULL) {
       CUDA_CHECK(cudaGetDevice(&gpu_device_));
-      CUDA_CHECK(cudaMalloc(&gpu_ptr_, size_));
+      CUDA_CHECK(CaffeMallocGPU(&gpu_ptr_, size_));
       own_gpu_data_ = true;
     }
-    caffe_gpu_memcpy(size_, cpu_ptr_, gpu_ptr_);
+    {
+      TransferRecord record(true, size_);
+      caffe_gpu_memcpy(size_, cpu_ptr_, gpu_ptr_);
+    }
     head_ = SYNCED;
     break;
   case HEAD_AT_GPU:
@@ -79,22 +597,37 @@ inline void SyncedMemory::to_gpu() {
 }
 
 const void* SyncedMemory::cpu_data() {
+  if (parent_) {
+    return static_cast<const char*>(parent_->cpu_data()) + offset_;
+  }
   to_cpu();
   return (const void*)cpu_ptr_;
 }
 
 void SyncedMemory::set_cpu_data(void* data) {
   CHECK(data);
+  // A view given memory of its own stops being one
+  parent_.reset();
+  offset_ = 0;
+  free_managed();
   if (own_cpu_data_) {
     CaffeFreeHost(cpu_ptr_);
   }
   cpu_ptr_ = data;
   head_ = HEAD_AT_CPU;
   own_cpu_data_ = false;
+  ++version_;
+  // Never sync into memory someone else set
+  if (!own_gpu_data_) {
+    gpu_ptr_ = NULL;
+  }
 }
 
 const void* SyncedMemory::gpu_data() {
 #ifndef CPU_ONLY
+  if (parent_) {
+    return static_cast<const char*>(parent_->gpu_data()) + offset_;
+  }
   to_gpu();
   return (const void*)gpu_ptr_;
 #else
@@ -105,33 +638,43 @@ const void* SyncedMemory::gpu_data() {
 void SyncedMemory::set_gpu_data(void* data) {
 #ifndef CPU_ONLY
   CHECK(data);
+  // A view given memory of its own stops being one
+  parent_.reset();
+  offset_ = 0;
+  free_managed();
   if (own_gpu_data_) {
-    int initial_device;
-    cudaGetDevice(&initial_device);
-    if (gpu_device_ != -1) {
-      CUDA_CHECK(cudaSetDevice(gpu_device_));
-    }
-    CUDA_CHECK(cudaFree(gpu_ptr_));
-    cudaSetDevice(initial_device);
+    CUDA_CHECK(CaffeFreeGPU(gpu_ptr_));
   }
   gpu_ptr_ = data;
   head_ = HEAD_AT_GPU;
   own_gpu_data_ = false;
+  ++version_;
+  if (!own_cpu_data_) {
+    cpu_ptr_ = NULL;
+  }
 #else
   NO_GPU;
 #endif
 }
 
 void* SyncedMemory::mutable_cpu_data() {
+  if (parent_) {
+    return static_cast<char*>(parent_->mutable_cpu_data()) + offset_;
+  }
   to_cpu();
   head_ = HEAD_AT_CPU;
+  ++version_;
   return cpu_ptr_;
 }
 
 void* SyncedMemory::mutable_gpu_data() {
 #ifndef CPU_ONLY
+  if (parent_) {
+    return static_cast<char*>(parent_->mutable_gpu_data()) + offset_;
+  }
   to_gpu();
   head_ = HEAD_AT_GPU;
+  ++version_;
   return gpu_ptr_;
 #else
   NO_GPU;
@@ -140,10 +683,19 @@ void* SyncedMemory::mutable_gpu_data() {
 
 #ifndef CPU_ONLY
 void SyncedMemory::async_gpu_push(const cudaStream_t& stream) {
+  if (parent_) {
+    parent_->async_gpu_push(stream);
+    return;
+  }
   CHECK(head_ == HEAD_AT_CPU);
+  if (managed_) {
+    PrefetchManaged(gpu_ptr_, size_, gpu_device_, false, stream);
+    head_ = SYNCED;
+    return;
+  }
   if (gpu_ptr_ == NULL) {
     CUDA_CHECK(cudaGetDevice(&gpu_device_));
-    CUDA_CHECK(cudaMalloc(&gpu_ptr_, size_));
+    CUDA_CHECK(CaffeMallocGPU(&gpu_ptr_, size_));
     own_gpu_data_ = true;
   }
   const cudaMemcpyKind put = cudaMemcpyHostToDevice;
@@ -151,6 +703,49 @@ void SyncedMemory::async_gpu_push(const cudaStream_t& stream) {
   // Assume caller will synchronize on the stream before use
   head_ = SYNCED;
 }
+
+void SyncedMemory::async_cpu_copy(const cudaStream_t& stream) {
+  if (parent_) {
+    parent_->async_cpu_copy(stream);
+    return;
+  }
+  CHECK(head_ == HEAD_AT_GPU);
+  if (managed_) {
+    PrefetchManaged(gpu_ptr_, size_, gpu_device_, true, stream);
+    head_ = SYNCED;
+    return;
+  }
+  if (cpu_ptr_ == NULL) {
+    CaffeMallocHost(&cpu_ptr_, size_);
+    own_cpu_data_ = true;
+  }
+  const cudaMemcpyKind get = cudaMemcpyDeviceToHost;
+  CUDA_CHECK(cudaMemcpyAsync(cpu_ptr_, gpu_ptr_, size_, get, stream));
+  // Assume caller will synchronize on the stream before use
+  head_ = SYNCED;
+}
+
+void SyncedMemory::async_cpu_pull(const cudaStream_t& stream) {
+  if (parent_) {
+    parent_->async_cpu_pull(stream);
+    return;
+  }
+  // The host already holds the data unless the head is at the GPU
+  if (head_ == HEAD_AT_GPU && managed_) {
+    PrefetchManaged(gpu_ptr_, size_, gpu_device_, true, stream);
+  } else if (head_ == HEAD_AT_GPU) {
+    if (cpu_ptr_ == NULL) {
+      CaffeMallocHost(&cpu_ptr_, size_);
+      own_cpu_data_ = true;
+    }
+    const cudaMemcpyKind get = cudaMemcpyDeviceToHost;
+    CUDA_CHECK(cudaMemcpyAsync(cpu_ptr_, gpu_ptr_, size_, get, stream));
+  }
+  // Assume caller will synchronize on the stream before reuse
+  if (head_ != UNINITIALIZED) {
+    head_ = HEAD_AT_CPU;
+  }
+}
 #endif
 
 }  // namespace caffe
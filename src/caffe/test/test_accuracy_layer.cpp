@@ -228,4 +228,29 @@ TYPED_TEST(AccuracyLayerTest, TestForwardCPUTopK) {
               num_correct_labels / 100.0, 1e-4);
 }
 
+#ifndef CPU_ONLY
+TYPED_TEST(AccuracyLayerTest, TestForwardGPUMatchesCPU) {
+  // Ties exercise the label order the CPU partial sort resolves them by
+  TypeParam* bottom_data = this->blob_bottom_data_->mutable_cpu_data();
+  for (int i = 0; i < this->blob_bottom_data_->count(); i += 7) {
+    bottom_data[i] = 0;
+  }
+  this->blob_bottom_label_->mutable_cpu_data()[5] = -1;
+  for (int top_k = 1; top_k <= this->top_k_; ++top_k) {
+    LayerParameter layer_param;
+    AccuracyParameter* accuracy_param = layer_param.mutable_accuracy_param();
+    accuracy_param->set_top_k(top_k);
+    accuracy_param->set_ignore_label(-1);
+    AccuracyLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    const TypeParam cpu_accuracy = this->blob_top_->cpu_data()[0];
+    Caffe::set_mode(Caffe::GPU);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    Caffe::set_mode(Caffe::CPU);
+    EXPECT_NEAR(cpu_accuracy, this->blob_top_->cpu_data()[0], 1e-4);
+  }
+}
+#endif
+
 }  // namespace caffe
@@ -164,5 +164,31 @@ TYPED_TEST(ArgMaxLayerTest, TestCPUMaxValTopK) {
   }
 }
 
+#ifndef CPU_ONLY
+TYPED_TEST(ArgMaxLayerTest, TestGPUMatchesCPU) {
+  // Ties must come out in the same order as the CPU partial sort
+  TypeParam* bottom_data = this->blob_bottom_->mutable_cpu_data();
+  for (int i = 0; i < this->blob_bottom_->count(); i += 3) {
+    bottom_data[i] = 0;
+  }
+  for (int out_max_val = 0; out_max_val <= 1; ++out_max_val) {
+    LayerParameter layer_param;
+    ArgMaxParameter* argmax_param = layer_param.mutable_argmax_param();
+    argmax_param->set_out_max_val(out_max_val);
+    argmax_param->set_top_k(this->top_k_);
+    ArgMaxLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    Blob<TypeParam> cpu_top;
+    cpu_top.CopyFrom(*this->blob_top_, false, true);
+    Caffe::set_mode(Caffe::GPU);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    Caffe::set_mode(Caffe::CPU);
+    for (int i = 0; i < cpu_top.count(); ++i) {
+      EXPECT_EQ(cpu_top.cpu_data()[i], this->blob_top_->cpu_data()[i]);
+    }
+  }
+}
+#endif
 
 }  // namespace caffe
@@ -0,0 +1,81 @@
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/util/array_stats.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class ArrayStatsTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    // Over a chunk, under a chunk, and a single element
+    const int counts[] = { kArrayStatsChunk + 1000, 37, 1 };
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    for (int i = 0; i < 3; ++i) {
+      blobs_.push_back(shared_ptr<Blob<Dtype> >(
+          new Blob<Dtype>(vector<int>(1, counts[i]))));
+      filler.Fill(blobs_.back().get());
+    }
+  }
+
+  void Compute(ArrayStats<Dtype>* stats) {
+    vector<const Dtype*> arrays;
+    vector<int> counts;
+    for (int i = 0; i < blobs_.size(); ++i) {
+      arrays.push_back(Caffe::mode() == Caffe::GPU ?
+          blobs_[i]->gpu_data() : blobs_[i]->cpu_data());
+      counts.push_back(blobs_[i]->count());
+    }
+    stats->Compute(arrays, counts);
+  }
+
+  void Check(const ArrayStats<Dtype>& stats) {
+    for (int i = 0; i < blobs_.size(); ++i) {
+      const Dtype* data = blobs_[i]->cpu_data();
+      Dtype asum = 0, sumsq = 0;
+      for (int j = 0; j < blobs_[i]->count(); ++j) {
+        asum += std::fabs(data[j]);
+        sumsq += data[j] * data[j];
+      }
+      EXPECT_NEAR(stats.asum(i), asum, 1e-4 * (1 + asum));
+      EXPECT_NEAR(stats.sumsq(i), sumsq, 1e-4 * (1 + sumsq));
+    }
+  }
+
+  vector<shared_ptr<Blob<Dtype> > > blobs_;
+};
+
+TYPED_TEST_CASE(ArrayStatsTest, TestDtypesAndDevices);
+
+TYPED_TEST(ArrayStatsTest, TestCompute) {
+  typedef typename TypeParam::Dtype Dtype;
+  ArrayStats<Dtype> stats;
+  this->Compute(&stats);
+  this->Check(stats);
+}
+
+TYPED_TEST(ArrayStatsTest, TestRecompute) {
+  typedef typename TypeParam::Dtype Dtype;
+  ArrayStats<Dtype> stats;
+  this->Compute(&stats);
+  // The same arrays with new values, as for the params of a net
+  caffe_scal(this->blobs_[0]->count(), Dtype(2),
+             this->blobs_[0]->mutable_cpu_data());
+  this->Compute(&stats);
+  this->Check(stats);
+}
+
+}  // namespace caffe
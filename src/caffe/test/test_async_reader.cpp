@@ -0,0 +1,96 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/async_reader.hpp"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class AsyncReaderTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    MakeTempFilename(&filename_);
+    for (int i = 0; i < 1 << 16; ++i) {
+      data_ += static_cast<char>(i * 7 + i / 251);
+    }
+    const int fd = open(filename_.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                        0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(data_.size(), write(fd, data_.data(), data_.size()));
+    close(fd);
+    fd_ = open(filename_.c_str(), O_RDONLY);
+    ASSERT_GE(fd_, 0);
+  }
+
+  virtual void TearDown() {
+    close(fd_);
+    unlink(filename_.c_str());
+  }
+
+  void TestRead(bool threads) {
+    AsyncReader reader(4, threads);
+    EXPECT_EQ(4, reader.depth());
+    // More reads than the depth, waited for in another order than submitted
+    const int reads = 20;
+    vector<string> buffers(reads);
+    vector<uint64_t> ids(reads);
+    for (int i = 0; i < reads; ++i) {
+      buffers[i].resize(1000 + i * 37);
+      ids[i] = reader.submit(fd_, i * 3001, buffers[i].size(),
+                             &buffers[i][0]);
+    }
+    for (int i = reads - 1; i >= 0; --i) {
+      reader.wait(ids[i]);
+      EXPECT_EQ(data_.substr(i * 3001, buffers[i].size()), buffers[i]) << i;
+    }
+    // Empty and to the end of the file
+    reader.wait(reader.submit(fd_, 0, 0, NULL));
+    string last(100, 0);
+    reader.wait(reader.submit(fd_, data_.size() - 100, 100, &last[0]));
+    EXPECT_EQ(data_.substr(data_.size() - 100), last);
+  }
+
+  void TestDestroyWhileReading(bool threads) {
+    vector<string> buffers(8, string(4096, 0));
+    {
+      AsyncReader reader(2, threads);
+      for (int i = 0; i < buffers.size(); ++i) {
+        reader.submit(fd_, i * 4096, 4096, &buffers[i][0]);
+      }
+    }
+    for (int i = 0; i < buffers.size(); ++i) {
+      EXPECT_EQ(data_.substr(i * 4096, 4096), buffers[i]);
+    }
+  }
+
+  string filename_;
+  string data_;
+  int fd_;
+};
+
+// With io_uring, where the kernel supports it
+TEST_F(AsyncReaderTest, TestRead) {
+  TestRead(false);
+}
+
+TEST_F(AsyncReaderTest, TestReadThreads) {
+  TestRead(true);
+}
+
+TEST_F(AsyncReaderTest, TestDestroyWhileReading) {
+  TestDestroyWhileReading(false);
+}
+
+TEST_F(AsyncReaderTest, TestDestroyWhileReadingThreads) {
+  TestDestroyWhileReading(true);
+}
+
+}  // namespace caffe
@@ -0,0 +1,211 @@
+#include <cmath>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/common_layers.hpp"
+#include "caffe/filler.hpp"
+#include "gtest/gtest.h"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class BatchNormLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+ protected:
+  BatchNormLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 3, 4, 5)),
+        blob_top_(new Blob<Dtype>()) {
+    // fill the values, off zero mean and unit variance
+    FillerParameter filler_param;
+    filler_param.set_mean(2);
+    filler_param.set_std(3);
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~BatchNormLayerTest() { delete blob_bottom_; delete blob_top_; }
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(BatchNormLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(BatchNormLayerTest, TestForward) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  BatchNormLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  const int num = this->blob_bottom_->num();
+  const int channels = this->blob_bottom_->channels();
+  const int height = this->blob_bottom_->height();
+  const int width = this->blob_bottom_->width();
+  const int m = num * height * width;
+  for (int j = 0; j < channels; ++j) {
+    Dtype sum = 0, var = 0;
+    Dtype bottom_sum = 0, bottom_var = 0;
+    for (int i = 0; i < num; ++i) {
+      for (int k = 0; k < height; ++k) {
+        for (int l = 0; l < width; ++l) {
+          Dtype data = this->blob_top_->data_at(i, j, k, l);
+          sum += data;
+          var += data * data;
+          data = this->blob_bottom_->data_at(i, j, k, l);
+          bottom_sum += data;
+          bottom_var += data * data;
+        }
+      }
+    }
+    sum /= m;
+    var /= m;
+    bottom_sum /= m;
+    bottom_var = bottom_var / m - bottom_sum * bottom_sum;
+
+    const Dtype kErrorBound = 0.001;
+    // expect zero mean
+    EXPECT_NEAR(0, sum, kErrorBound);
+    // expect unit variance
+    EXPECT_NEAR(1, var, kErrorBound);
+    // expect the moving averages of a single batch to be its statistics,
+    // with the unbiased variance
+    EXPECT_NEAR(bottom_sum, layer.blobs()[0]->cpu_data()[j], kErrorBound);
+    EXPECT_NEAR(bottom_var * m / (m - 1), layer.blobs()[1]->cpu_data()[j],
+        kErrorBound);
+  }
+  EXPECT_EQ(1, layer.blobs()[2]->cpu_data()[0]);
+}
+
+TYPED_TEST(BatchNormLayerTest, TestForwardGlobalStats) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.set_phase(TEST);
+  BatchNormLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const int channels = this->blob_bottom_->channels();
+  // Moving sums of the means 2 * j and variances j + 1, over a factor of 2
+  for (int j = 0; j < channels; ++j) {
+    layer.blobs()[0]->mutable_cpu_data()[j] = 4 * j;
+    layer.blobs()[1]->mutable_cpu_data()[j] = 2 * (j + 1);
+  }
+  layer.blobs()[2]->mutable_cpu_data()[0] = 2;
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  const Dtype eps = layer_param.batch_norm_param().eps();
+  for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+    const int j = (i / this->blob_bottom_->count(2)) % channels;
+    const Dtype expected = (this->blob_bottom_->cpu_data()[i] - 2 * j)
+        / std::sqrt(j + 1 + eps);
+    EXPECT_NEAR(expected, this->blob_top_->cpu_data()[i], 1e-4);
+  }
+  // The moving averages do not change in the TEST phase.
+  EXPECT_EQ(2, layer.blobs()[2]->cpu_data()[0]);
+}
+
+TYPED_TEST(BatchNormLayerTest, TestForwardInPlace) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  BatchNormLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  BatchNormLayer<Dtype> in_place_layer(layer_param);
+  in_place_layer.SetUp(this->blob_bottom_vec_, this->blob_bottom_vec_);
+  in_place_layer.Forward(this->blob_bottom_vec_, this->blob_bottom_vec_);
+  for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[i],
+        this->blob_bottom_->cpu_data()[i], 1e-5);
+  }
+}
+
+TYPED_TEST(BatchNormLayerTest, TestGradient) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  BatchNormLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(BatchNormLayerTest, TestGradientGlobalStats) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.set_phase(TEST);
+  BatchNormLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int j = 0; j < this->blob_bottom_->channels(); ++j) {
+    layer.blobs()[0]->mutable_cpu_data()[j] = j;
+    layer.blobs()[1]->mutable_cpu_data()[j] = j + 1;
+  }
+  layer.blobs()[2]->mutable_cpu_data()[0] = 1;
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+#ifdef USE_CUDNN
+#if CUDNN_VERSION_MIN(5, 0, 0)
+template <typename Dtype>
+class CuDNNBatchNormLayerTest : public GPUDeviceTest<Dtype> {
+ protected:
+  CuDNNBatchNormLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 3, 4, 5)),
+        blob_top_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    filler_param.set_mean(2);
+    filler_param.set_std(3);
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~CuDNNBatchNormLayerTest() { delete blob_bottom_; delete blob_top_; }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(CuDNNBatchNormLayerTest, TestDtypes);
+
+TYPED_TEST(CuDNNBatchNormLayerTest, TestForwardCuDNN) {
+  LayerParameter layer_param;
+  BatchNormLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  CuDNNBatchNormLayer<TypeParam> cudnn_layer(layer_param);
+  Blob<TypeParam> cudnn_top;
+  vector<Blob<TypeParam>*> cudnn_top_vec(1, &cudnn_top);
+  cudnn_layer.SetUp(this->blob_bottom_vec_, cudnn_top_vec);
+  cudnn_layer.Forward(this->blob_bottom_vec_, cudnn_top_vec);
+  for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[i], cudnn_top.cpu_data()[i],
+                1e-4);
+  }
+  // Both keep the same moving averages.
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    for (int j = 0; j < layer.blobs()[i]->count(); ++j) {
+      EXPECT_NEAR(layer.blobs()[i]->cpu_data()[j],
+          cudnn_layer.blobs()[i]->cpu_data()[j], 1e-4);
+    }
+  }
+}
+
+TYPED_TEST(CuDNNBatchNormLayerTest, TestGradientCuDNN) {
+  LayerParameter layer_param;
+  CuDNNBatchNormLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+#endif
+#endif
+
+}  // namespace caffe
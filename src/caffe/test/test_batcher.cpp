@@ -0,0 +1,115 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <string>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+#include "gtest/gtest.h"
+
+#include "caffe/batcher.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class BatcherTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  BatcherTest() : dim_(6), items_(8) {
+    const string proto =
+        "name: 'BatcherNetwork' "
+        "input: 'data' "
+        "input_dim: 1 "
+        "input_dim: 6 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { "
+        "  name: 'ip' "
+        "  type: 'InnerProduct' "
+        "  bottom: 'data' "
+        "  top: 'ip' "
+        "  inner_product_param { "
+        "    num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 1 } "
+        "    bias_filler { type: 'constant' value: 0.5 } "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'prob' "
+        "  type: 'Softmax' "
+        "  bottom: 'ip' "
+        "  top: 'prob' "
+        "} ";
+    NetParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+    net_.reset(new Net<Dtype>(param));
+    inputs_.resize(items_ * dim_);
+    for (int i = 0; i < inputs_.size(); ++i) {
+      inputs_[i] = (i % 7) * 0.25 - 0.75;
+    }
+    // Expected outputs, running one item at a time
+    expected_.resize(items_);
+    Blob<Dtype>* data = net_->input_blobs()[0];
+    for (int i = 0; i < items_; ++i) {
+      caffe_copy(dim_, &inputs_[i * dim_], data->mutable_cpu_data());
+      const vector<Blob<Dtype>*>& outputs = net_->ForwardPrefilled();
+      expected_[i].assign(outputs[0]->cpu_data(),
+                          outputs[0]->cpu_data() + outputs[0]->count());
+    }
+  }
+
+  void Process(Batcher<Dtype>* batcher, int item) {
+    batcher->Process(&inputs_[item * dim_], &outputs_[item]);
+  }
+
+  void Run(Batcher<Dtype>* batcher) {
+    outputs_.assign(items_, vector<Dtype>());
+    boost::thread_group clients;
+    for (int i = 0; i < items_; ++i) {
+      clients.create_thread(boost::bind(&BatcherTest::Process, this, batcher,
+                                        i));
+    }
+    clients.join_all();
+    for (int i = 0; i < items_; ++i) {
+      ASSERT_EQ(expected_[i].size(), outputs_[i].size());
+      for (int j = 0; j < expected_[i].size(); ++j) {
+        EXPECT_NEAR(expected_[i][j], outputs_[i][j], 1e-5);
+      }
+    }
+  }
+
+  const int dim_;
+  const int items_;
+  shared_ptr<Net<Dtype> > net_;
+  vector<Dtype> inputs_;
+  vector<vector<Dtype> > expected_;
+  vector<vector<Dtype> > outputs_;
+};
+
+TYPED_TEST_CASE(BatcherTest, TestDtypesAndDevices);
+
+TYPED_TEST(BatcherTest, TestFullBatches) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Batches only run full within the delay of 10 s
+  Batcher<Dtype> batcher(this->net_, this->items_ / 2, 10000000);
+  this->Run(&batcher);
+  EXPECT_EQ(2, batcher.batches());
+  EXPECT_EQ(this->items_, batcher.items());
+}
+
+TYPED_TEST(BatcherTest, TestDelay) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Batches never fill up, and run once the delay passed
+  Batcher<Dtype> batcher(this->net_, this->items_ * 2, 1000);
+  this->Run(&batcher);
+  EXPECT_EQ(this->items_, batcher.items());
+  EXPECT_LE(batcher.batches(), this->items_);
+}
+
+}  // namespace caffe
@@ -87,4 +87,42 @@ TYPED_TEST(BenchmarkTest, TestTimerSeconds) {
   EXPECT_TRUE(timer.has_run_at_least_once());
 }
 
+TYPED_TEST(BenchmarkTest, TestEventTimer) {
+  EventTimer timer;
+  // Intervals of different keys nest
+  timer.Start(1);
+  timer.Start(0);
+  usleep(100 * 1000);
+  timer.Stop(0);
+  usleep(50 * 1000);
+  timer.Stop(1);
+  timer.Synchronize();
+  EXPECT_EQ(timer.count(0), 1);
+  EXPECT_EQ(timer.count(1), 1);
+  EXPECT_GE(timer.MicroSeconds(0), (100 - kMillisecondsThreshold) * 1000);
+  EXPECT_LE(timer.MicroSeconds(0), (100 + kMillisecondsThreshold) * 1000);
+  EXPECT_GE(timer.MicroSeconds(1), (150 - kMillisecondsThreshold) * 1000);
+  EXPECT_LE(timer.MicroSeconds(1), (150 + kMillisecondsThreshold) * 1000);
+  EXPECT_EQ(timer.count(2), 0);
+  EXPECT_EQ(timer.MicroSeconds(2), 0);
+  timer.Clear();
+  EXPECT_EQ(timer.count(0), 0);
+  EXPECT_EQ(timer.MicroSeconds(1), 0);
+}
+
+TYPED_TEST(BenchmarkTest, TestEventTimerRing) {
+  // More intervals than the ring holds, read as it fills
+  EventTimer timer(2);
+  for (int i = 0; i < 5; ++i) {
+    timer.Start(0);
+    usleep(20 * 1000);
+    timer.Stop(0);
+    timer.Poll();
+  }
+  timer.Synchronize();
+  EXPECT_EQ(timer.count(0), 5);
+  EXPECT_GE(timer.MicroSeconds(0), (100 - kMillisecondsThreshold) * 1000);
+  EXPECT_LE(timer.MicroSeconds(0), (100 + kMillisecondsThreshold) * 1000);
+}
+
 }  // namespace caffe
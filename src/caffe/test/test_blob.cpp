@@ -1,4 +1,5 @@
 #include <cstring>
+#include <string>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -6,6 +7,7 @@
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
+#include "caffe/util/huffman.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 
@@ -52,6 +54,38 @@ TYPED_TEST(BlobSimpleTest, TestReshape) {
   EXPECT_EQ(this->blob_->count(), 120);
 }
 
+TYPED_TEST(BlobSimpleTest, TestShapeVersion) {
+  this->blob_->Reshape(2, 3, 4, 5);
+  const int version = this->blob_->shape_version();
+  this->blob_->Reshape(2, 3, 4, 5);
+  EXPECT_EQ(this->blob_->shape_version(), version);
+  this->blob_->Reshape(2, 3, 5, 4);
+  EXPECT_NE(this->blob_->shape_version(), version);
+}
+
+TYPED_TEST(BlobSimpleTest, TestShareItems) {
+  typedef TypeParam Dtype;
+  Blob<Dtype>* blob = this->blob_preshaped_;
+  for (int i = 0; i < blob->count(); ++i) {
+    blob->mutable_cpu_data()[i] = i;
+  }
+  Blob<Dtype> view;
+  view.ShareItems(*blob, 1, 2);
+  vector<int> shape = blob->shape();
+  shape[0] = 1;
+  EXPECT_EQ(view.shape(), shape);
+  EXPECT_EQ(view.cpu_data(), blob->cpu_data() + blob->count(1));
+  EXPECT_EQ(view.data_at(0, 1, 2, 3), blob->data_at(1, 1, 2, 3));
+  // Writes to the view go to the blob, and the other way around
+  view.mutable_cpu_diff()[0] = 5;
+  EXPECT_EQ(blob->diff_at(1, 0, 0, 0), 5);
+  blob->mutable_cpu_data()[blob->count(1)] = -1;
+  EXPECT_EQ(view.data_at(0, 0, 0, 0), -1);
+  // An empty range
+  view.ShareItems(*blob, 2, 2);
+  EXPECT_EQ(view.count(), 0);
+}
+
 TYPED_TEST(BlobSimpleTest, TestLegacyBlobProtoShapeEquals) {
   BlobProto blob_proto;
 
@@ -105,6 +139,76 @@ TYPED_TEST(BlobSimpleTest, TestLegacyBlobProtoShapeEquals) {
   EXPECT_FALSE(this->blob_->ShapeEquals(blob_proto));
 }
 
+TYPED_TEST(BlobSimpleTest, TestFromProtoInt8) {
+  BlobProto blob_proto;
+  blob_proto.mutable_shape()->add_dim(2);
+  blob_proto.mutable_shape()->add_dim(3);
+  const char values[] = {1, -2, 127, -127, 0, 5};
+  blob_proto.set_int8_data(string(values, 6));
+  // One scale for each of the two rows
+  blob_proto.add_int8_scale(0.5);
+  blob_proto.add_int8_scale(2);
+  this->blob_->FromProto(blob_proto);
+  ASSERT_EQ(this->blob_->count(), 6);
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(this->blob_->cpu_data()[i], values[i] * (i < 3 ? 0.5 : 2));
+  }
+}
+
+TYPED_TEST(BlobSimpleTest, TestFromProtoSparse) {
+  BlobProto blob_proto;
+  blob_proto.mutable_shape()->add_dim(2);
+  blob_proto.mutable_shape()->add_dim(3);
+  // The nonzeros at 1, 2 and 5, each index as the gap from the previous one
+  blob_proto.add_sparse_data(3);
+  blob_proto.add_sparse_index(1);
+  blob_proto.add_sparse_data(-1);
+  blob_proto.add_sparse_index(1);
+  blob_proto.add_sparse_data(4);
+  blob_proto.add_sparse_index(3);
+  this->blob_->FromProto(blob_proto);
+  ASSERT_EQ(this->blob_->count(), 6);
+  const float values[] = {0, 3, -1, 0, 0, 4};
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(this->blob_->cpu_data()[i], values[i]);
+  }
+}
+
+TYPED_TEST(BlobSimpleTest, TestFromProtoCodebook) {
+  BlobProto blob_proto;
+  blob_proto.mutable_shape()->add_dim(2);
+  blob_proto.mutable_shape()->add_dim(4);
+  blob_proto.add_codebook(-0.5);
+  blob_proto.add_codebook(0);
+  blob_proto.add_codebook(2);
+  const uint8_t codes[] = {1, 1, 0, 1, 2, 1, 1, 0};
+  blob_proto.set_code_data(string(codes, codes + 8));
+  this->blob_->FromProto(blob_proto);
+  ASSERT_EQ(this->blob_->count(), 8);
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_EQ(this->blob_->cpu_data()[i], blob_proto.codebook(codes[i]));
+  }
+  // The same codes, Huffman coded
+  vector<uint64_t> counts(3, 0);
+  for (int i = 0; i < 8; ++i) {
+    ++counts[codes[i]];
+  }
+  vector<uint32_t> lengths;
+  HuffmanCodeLengths(counts, kHuffmanMaxBits, &lengths);
+  EXPECT_EQ(lengths[1], 1);
+  string bits;
+  HuffmanEncode(lengths, codes, 8, &bits);
+  EXPECT_EQ(bits.size(), 2);
+  blob_proto.set_code_data(bits);
+  for (int j = 0; j < lengths.size(); ++j) {
+    blob_proto.add_code_bits(lengths[j]);
+  }
+  this->blob_->FromProto(blob_proto);
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_EQ(this->blob_->cpu_data()[i], blob_proto.codebook(codes[i]));
+  }
+}
+
 template <typename TypeParam>
 class BlobMathTest : public MultiDeviceTest<TypeParam> {
   typedef typename TypeParam::Dtype Dtype;
@@ -20,6 +20,23 @@ TEST_F(CommonTest, TestCublasHandlerGPU) {
   EXPECT_TRUE(Caffe::cublas_handle());
 }
 
+TEST_F(CommonTest, TestSetDeviceKeepsHandles) {
+  int device;
+  CUDA_CHECK(cudaGetDevice(&device));
+  int count;
+  CUDA_CHECK(cudaGetDeviceCount(&count));
+  const cublasHandle_t cublas_handle = Caffe::cublas_handle();
+  const curandGenerator_t curand_generator = Caffe::curand_generator();
+  if (count > 1) {
+    Caffe::SetDevice((device + 1) % count);
+    EXPECT_NE(cublas_handle, Caffe::cublas_handle());
+    EXPECT_NE(curand_generator, Caffe::curand_generator());
+  }
+  Caffe::SetDevice(device);
+  EXPECT_EQ(cublas_handle, Caffe::cublas_handle());
+  EXPECT_EQ(curand_generator, Caffe::curand_generator());
+}
+
 #endif
 
 TEST_F(CommonTest, TestBrewMode) {
@@ -154,6 +154,59 @@ TYPED_TEST(ConcatLayerTest, TestForwardChannels) {
   }
 }
 
+TYPED_TEST(ConcatLayerTest, TestForwardChannelsNHWC) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(this->blob_bottom_0_);
+  filler.Fill(this->blob_bottom_1_);
+  this->blob_bottom_0_->set_layout(NHWC);
+  this->blob_bottom_1_->set_layout(NHWC);
+  LayerParameter layer_param;
+  ConcatLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_0_, this->blob_top_vec_);
+  EXPECT_EQ(NHWC, this->blob_top_->layout());
+  EXPECT_EQ(8, this->blob_top_->channels());
+  layer.Forward(this->blob_bottom_vec_0_, this->blob_top_vec_);
+  for (int n = 0; n < this->blob_top_->num(); ++n) {
+    for (int c = 0; c < this->blob_top_->channels(); ++c) {
+      for (int h = 0; h < this->blob_top_->height(); ++h) {
+        for (int w = 0; w < this->blob_top_->width(); ++w) {
+          EXPECT_EQ(this->blob_top_->data_at(n, c, h, w), c < 3 ?
+              this->blob_bottom_0_->data_at(n, c, h, w) :
+              this->blob_bottom_1_->data_at(n, c - 3, h, w));
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(ConcatLayerTest, TestForwardNumView) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_concat_param()->set_axis(0);
+  layer_param.mutable_concat_param()->set_view(true);
+  ConcatLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_1_, this->blob_top_vec_);
+  // The bottoms are computed after being made views of the top
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(this->blob_bottom_0_);
+  filler.Fill(this->blob_bottom_2_);
+  EXPECT_EQ(this->blob_top_->cpu_data(), this->blob_bottom_0_->cpu_data());
+  EXPECT_EQ(this->blob_top_->cpu_data() + this->blob_bottom_0_->count(),
+      this->blob_bottom_2_->cpu_data());
+  layer.Forward(this->blob_bottom_vec_1_, this->blob_top_vec_);
+  for (int i = 0; i < this->blob_bottom_0_->count(); ++i) {
+    EXPECT_EQ(this->blob_bottom_0_->cpu_data()[i],
+        this->blob_top_->cpu_data()[i]);
+  }
+  for (int i = 0; i < this->blob_bottom_2_->count(); ++i) {
+    EXPECT_EQ(this->blob_bottom_2_->cpu_data()[i],
+        this->blob_top_->cpu_data()[i + this->blob_bottom_0_->count()]);
+  }
+}
+
 TYPED_TEST(ConcatLayerTest, TestGradientNum) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -173,4 +226,26 @@ TYPED_TEST(ConcatLayerTest, TestGradientChannels) {
     this->blob_top_vec_);
 }
 
+TYPED_TEST(ConcatLayerTest, TestGradientChannelsNHWC) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_0_->set_layout(NHWC);
+  this->blob_bottom_1_->set_layout(NHWC);
+  LayerParameter layer_param;
+  ConcatLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-2);
+  checker.CheckGradient(&layer, this->blob_bottom_vec_0_,
+    this->blob_top_vec_);
+}
+
+TYPED_TEST(ConcatLayerTest, TestGradientNumView) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_concat_param()->set_axis(0);
+  layer_param.mutable_concat_param()->set_view(true);
+  ConcatLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-2);
+  checker.CheckGradient(&layer, this->blob_bottom_vec_1_,
+    this->blob_top_vec_);
+}
+
 }  // namespace caffe
@@ -5,6 +5,7 @@
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
+#include "caffe/common_layers.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/vision_layers.hpp"
 
@@ -217,6 +218,50 @@ TYPED_TEST(ConvolutionLayerTest, TestSimpleConvolution) {
   }
 }
 
+TYPED_TEST(ConvolutionLayerTest, TestSharedColBuffer) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(4);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("constant");
+  convolution_param->mutable_bias_filler()->set_value(0.1);
+  shared_ptr<Layer<Dtype> > layer(
+      new ConvolutionLayer<Dtype>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // A layer with more columns grows the workspace in between
+  LayerParameter larger_param(layer_param);
+  larger_param.mutable_convolution_param()->set_kernel_size(1);
+  larger_param.mutable_convolution_param()->set_pad(1);
+  larger_param.mutable_convolution_param()->set_stride(1);
+  Blob<Dtype> larger_top;
+  vector<Blob<Dtype>*> larger_top_vec(1, &larger_top);
+  shared_ptr<Layer<Dtype> > larger_layer(
+      new ConvolutionLayer<Dtype>(larger_param));
+  larger_layer->SetUp(this->blob_bottom_vec_, larger_top_vec);
+  layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  larger_layer->Forward(this->blob_bottom_vec_, larger_top_vec);
+  layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Check against reference convolutions.
+  caffe_conv(this->blob_bottom_, convolution_param, layer->blobs(),
+      this->MakeReferenceTop(this->blob_top_));
+  const Dtype* top_data = this->blob_top_->cpu_data();
+  const Dtype* ref_top_data = this->ref_blob_top_->cpu_data();
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(top_data[i], ref_top_data[i], 1e-4);
+  }
+  caffe_conv(this->blob_bottom_, larger_param.mutable_convolution_param(),
+      larger_layer->blobs(), this->MakeReferenceTop(&larger_top));
+  top_data = larger_top.cpu_data();
+  ref_top_data = this->ref_blob_top_->cpu_data();
+  for (int i = 0; i < larger_top.count(); ++i) {
+    EXPECT_NEAR(top_data[i], ref_top_data[i], 1e-4);
+  }
+}
+
 TYPED_TEST(ConvolutionLayerTest, Test1x1Convolution) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -272,6 +317,201 @@ TYPED_TEST(ConvolutionLayerTest, TestSimpleConvolutionGroup) {
   }
 }
 
+TYPED_TEST(ConvolutionLayerTest, TestConvolutionGroupTest) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.set_phase(TEST);
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(3);
+  convolution_param->set_group(3);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("constant");
+  convolution_param->mutable_bias_filler()->set_value(0.1);
+  shared_ptr<Layer<Dtype> > layer(
+      new ConvolutionLayer<Dtype>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // The weights packed by the first forward are packed again once changed
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass > 0) {
+      caffe_scal(layer->blobs()[0]->count(), Dtype(-2),
+          layer->blobs()[0]->mutable_cpu_data());
+    }
+    layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    caffe_conv(this->blob_bottom_, convolution_param, layer->blobs(),
+        this->MakeReferenceTop(this->blob_top_));
+    const Dtype* top_data = this->blob_top_->cpu_data();
+    const Dtype* ref_top_data = this->ref_blob_top_->cpu_data();
+    for (int i = 0; i < this->blob_top_->count(); ++i) {
+      EXPECT_NEAR(top_data[i], ref_top_data[i], 1e-4);
+    }
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestConvolutionImagesPerGEMM) {
+  typedef typename TypeParam::Dtype Dtype;
+  // 5 images make a batch of 2 and a batch of 1 left over
+  this->blob_bottom_->Reshape(5, 3, 6, 4);
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(3);
+  convolution_param->set_group(3);
+  convolution_param->set_images_per_gemm(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("constant");
+  convolution_param->mutable_bias_filler()->set_value(0.1);
+  shared_ptr<Layer<Dtype> > layer(
+      new ConvolutionLayer<Dtype>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Check against reference convolution.
+  const Dtype* top_data;
+  const Dtype* ref_top_data;
+  caffe_conv(this->blob_bottom_, convolution_param, layer->blobs(),
+      this->MakeReferenceTop(this->blob_top_));
+  top_data = this->blob_top_->cpu_data();
+  ref_top_data = this->ref_blob_top_->cpu_data();
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(top_data[i], ref_top_data[i], 1e-4);
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestDepthwiseConvolution) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_pad(1);
+  convolution_param->set_stride(1);
+  // Two filters per channel
+  convolution_param->set_num_output(6);
+  convolution_param->set_group(3);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("constant");
+  convolution_param->mutable_bias_filler()->set_value(0.1);
+  shared_ptr<Layer<Dtype> > layer(
+      new ConvolutionLayer<Dtype>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  caffe_conv(this->blob_bottom_, convolution_param, layer->blobs(),
+      this->MakeReferenceTop(this->blob_top_));
+  const Dtype* top_data = this->blob_top_->cpu_data();
+  const Dtype* ref_top_data = this->ref_blob_top_->cpu_data();
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(top_data[i], ref_top_data[i], 1e-4);
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestSmallGroupConvolution) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Groups of 4 channels, the most convolved without a GEMM
+  this->blob_bottom_->Reshape(2, 8, 6, 5);
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_h(3);
+  convolution_param->set_kernel_w(2);
+  convolution_param->set_pad(1);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(4);
+  convolution_param->set_group(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("constant");
+  convolution_param->mutable_bias_filler()->set_value(0.1);
+  shared_ptr<Layer<Dtype> > layer(
+      new ConvolutionLayer<Dtype>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  caffe_conv(this->blob_bottom_, convolution_param, layer->blobs(),
+      this->MakeReferenceTop(this->blob_top_));
+  const Dtype* top_data = this->blob_top_->cpu_data();
+  const Dtype* ref_top_data = this->ref_blob_top_->cpu_data();
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(top_data[i], ref_top_data[i], 1e-4);
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestQuantizedConvolutionGroup) {
+  typedef typename TypeParam::Dtype Dtype;
+  // With integer inputs, a unit input scale and integer weights reaching 127
+  // in each output, the int8 products are exact.
+  for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+    this->blob_bottom_->mutable_cpu_data()[i] = i % 7 - 3;
+  }
+  LayerParameter layer_param;
+  layer_param.set_phase(TEST);
+  layer_param.mutable_quantization_param()->set_input_scale(1);
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(3);
+  convolution_param->set_group(3);
+  convolution_param->mutable_bias_filler()->set_type("constant");
+  convolution_param->mutable_bias_filler()->set_value(0.5);
+  shared_ptr<Layer<Dtype> > layer(
+      new ConvolutionLayer<Dtype>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  Dtype* weights = layer->blobs()[0]->mutable_cpu_data();
+  for (int i = 0; i < layer->blobs()[0]->count(); ++i) {
+    weights[i] = i % 9 == 0 ? 127 : (i * 37) % 255 - 127;
+  }
+  layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  caffe_conv(this->blob_bottom_, convolution_param, layer->blobs(),
+      this->MakeReferenceTop(this->blob_top_));
+  const Dtype* top_data = this->blob_top_->cpu_data();
+  const Dtype* ref_top_data = this->ref_blob_top_->cpu_data();
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(top_data[i], ref_top_data[i], 1e-4);
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestSparseWeightsConvolutionGroup) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.set_phase(TEST);
+  layer_param.mutable_sparsity_param();
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(3);
+  convolution_param->set_group(3);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("constant");
+  convolution_param->mutable_bias_filler()->set_value(0.1);
+  shared_ptr<Layer<Dtype> > layer(
+      new ConvolutionLayer<Dtype>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Two thirds of the weights zero, unevenly across the outputs
+  Dtype* weights = layer->blobs()[0]->mutable_cpu_data();
+  for (int i = 0; i < layer->blobs()[0]->count(); ++i) {
+    if (i % 3 != 0) {
+      weights[i] = 0;
+    }
+  }
+  layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  caffe_conv(this->blob_bottom_, convolution_param, layer->blobs(),
+      this->MakeReferenceTop(this->blob_top_));
+  const Dtype* top_data = this->blob_top_->cpu_data();
+  const Dtype* ref_top_data = this->ref_blob_top_->cpu_data();
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(top_data[i], ref_top_data[i], 1e-4);
+  }
+}
+
 TYPED_TEST(ConvolutionLayerTest, TestSobelConvolution) {
   // Test separable convolution by computing the Sobel operator
   // as a single filter then comparing the result
@@ -421,6 +661,269 @@ TYPED_TEST(ConvolutionLayerTest, TestGradientGroup) {
       this->blob_top_vec_);
 }
 
+TYPED_TEST(ConvolutionLayerTest, TestGradientDepthwise) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_pad(1);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(6);
+  convolution_param->set_group(3);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  ConvolutionLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestConvolutionNHWC) {
+  typedef typename TypeParam::Dtype Dtype;
+  for (int kernel_size = 1; kernel_size <= 3; kernel_size += 2) {
+    LayerParameter layer_param;
+    ConvolutionParameter* convolution_param =
+        layer_param.mutable_convolution_param();
+    convolution_param->set_kernel_size(kernel_size);
+    convolution_param->set_stride(kernel_size == 1 ? 1 : 2);
+    convolution_param->set_pad(kernel_size / 2);
+    convolution_param->set_num_output(4);
+    convolution_param->mutable_weight_filler()->set_type("gaussian");
+    convolution_param->mutable_bias_filler()->set_type("gaussian");
+    convolution_param->mutable_fused_relu()->set_negative_slope(0.1);
+    ConvolutionLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    LayerParameter layout_param;
+    LayoutLayer<Dtype> layout(layout_param);
+    Blob<Dtype> bottom_nhwc, top_nhwc;
+    vector<Blob<Dtype>*> bottom_nhwc_vec(1, &bottom_nhwc);
+    vector<Blob<Dtype>*> top_nhwc_vec(1, &top_nhwc);
+    layout.SetUp(this->blob_bottom_vec_, bottom_nhwc_vec);
+    layout.Forward(this->blob_bottom_vec_, bottom_nhwc_vec);
+    ConvolutionLayer<Dtype> layer_nhwc(layer_param);
+    layer_nhwc.SetUp(bottom_nhwc_vec, top_nhwc_vec);
+    for (int i = 0; i < layer.blobs().size(); ++i) {
+      layer_nhwc.blobs()[i]->CopyFrom(*layer.blobs()[i]);
+    }
+    EXPECT_EQ(NHWC, top_nhwc.layout());
+    EXPECT_EQ(this->blob_top_->shape(), top_nhwc.shape());
+    layer_nhwc.Forward(bottom_nhwc_vec, top_nhwc_vec);
+    for (int n = 0; n < top_nhwc.num(); ++n) {
+      for (int c = 0; c < top_nhwc.channels(); ++c) {
+        for (int h = 0; h < top_nhwc.height(); ++h) {
+          for (int w = 0; w < top_nhwc.width(); ++w) {
+            EXPECT_NEAR(this->blob_top_->data_at(n, c, h, w),
+                        top_nhwc.data_at(n, c, h, w), 1e-4);
+          }
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestGradientNHWC) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_->set_layout(NHWC);
+  this->blob_bottom_2_->set_layout(NHWC);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  this->blob_bottom_vec_.push_back(this->blob_bottom_2_);
+  this->blob_top_vec_.push_back(this->blob_top_2_);
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_pad(1);
+  convolution_param->set_num_output(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  ConvolutionLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(ConvolutionLayerTest, Test1x1GradientNHWC) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_->set_layout(NHWC);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(1);
+  convolution_param->set_stride(1);
+  convolution_param->set_num_output(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  ConvolutionLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+template <typename Dtype>
+class WinogradConvolutionLayerTest
+    : public ConvolutionLayerTest<CPUDevice<Dtype> > {
+ protected:
+  void TestForward(const int tile, const int group) {
+    this->blob_bottom_vec_.push_back(this->blob_bottom_2_);
+    this->blob_top_vec_.push_back(this->blob_top_2_);
+    LayerParameter layer_param;
+    ConvolutionParameter* convolution_param =
+        layer_param.mutable_convolution_param();
+    convolution_param->set_kernel_size(3);
+    convolution_param->set_pad(1);
+    convolution_param->set_num_output(6);
+    convolution_param->set_group(group);
+    convolution_param->set_engine(ConvolutionParameter_Engine_WINOGRAD);
+    convolution_param->set_winograd_tile(tile);
+    convolution_param->mutable_weight_filler()->set_type("gaussian");
+    convolution_param->mutable_bias_filler()->set_type("constant");
+    convolution_param->mutable_bias_filler()->set_value(0.1);
+    shared_ptr<Layer<Dtype> > layer(
+        new WinogradConvolutionLayer<Dtype>(layer_param));
+    layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    // Check against reference convolution.
+    for (int i = 0; i < this->blob_top_vec_.size(); ++i) {
+      caffe_conv(this->blob_bottom_vec_[i], convolution_param,
+          layer->blobs(), this->MakeReferenceTop(this->blob_top_vec_[i]));
+      const Dtype* top_data = this->blob_top_vec_[i]->cpu_data();
+      const Dtype* ref_top_data = this->ref_blob_top_->cpu_data();
+      for (int j = 0; j < this->ref_blob_top_->count(); ++j) {
+        EXPECT_NEAR(top_data[j], ref_top_data[j], 1e-3);
+      }
+    }
+  }
+};
+
+TYPED_TEST_CASE(WinogradConvolutionLayerTest, TestDtypes);
+
+TYPED_TEST(WinogradConvolutionLayerTest, TestSimpleConvolutionTile2) {
+  this->TestForward(2, 1);
+}
+
+TYPED_TEST(WinogradConvolutionLayerTest, TestSimpleConvolutionTile4) {
+  this->TestForward(4, 1);
+}
+
+TYPED_TEST(WinogradConvolutionLayerTest, TestSimpleConvolutionGroup) {
+  this->TestForward(4, 3);
+}
+
+TYPED_TEST(WinogradConvolutionLayerTest, TestGradient) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_num_output(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  WinogradConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+template <typename Dtype>
+class DirectConvolutionLayerTest
+    : public ConvolutionLayerTest<CPUDevice<Dtype> > {
+ protected:
+  void TestForward(const int kernel_size, const int stride, const int pad,
+      const int num_output) {
+    this->blob_bottom_vec_.push_back(this->blob_bottom_2_);
+    this->blob_top_vec_.push_back(this->blob_top_2_);
+    LayerParameter layer_param;
+    ConvolutionParameter* convolution_param =
+        layer_param.mutable_convolution_param();
+    convolution_param->set_kernel_size(kernel_size);
+    convolution_param->set_stride(stride);
+    convolution_param->set_pad(pad);
+    convolution_param->set_num_output(num_output);
+    convolution_param->set_engine(ConvolutionParameter_Engine_DIRECT);
+    convolution_param->mutable_weight_filler()->set_type("gaussian");
+    convolution_param->mutable_bias_filler()->set_type("gaussian");
+    shared_ptr<Layer<Dtype> > layer(
+        new DirectConvolutionLayer<Dtype>(layer_param));
+    layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    // The second pass runs on other filters than the first one reordered
+    for (int pass = 0; pass < 2; ++pass) {
+      if (pass) {
+        caffe_scal(layer->blobs()[0]->count(), Dtype(-2),
+            layer->blobs()[0]->mutable_cpu_data());
+      }
+      layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+      // Check against reference convolution.
+      for (int i = 0; i < this->blob_top_vec_.size(); ++i) {
+        caffe_conv(this->blob_bottom_vec_[i], convolution_param,
+            layer->blobs(), this->MakeReferenceTop(this->blob_top_vec_[i]));
+        const Dtype* top_data = this->blob_top_vec_[i]->cpu_data();
+        const Dtype* ref_top_data = this->ref_blob_top_->cpu_data();
+        for (int j = 0; j < this->ref_blob_top_->count(); ++j) {
+          EXPECT_NEAR(top_data[j], ref_top_data[j], 1e-4);
+        }
+      }
+    }
+  }
+};
+
+TYPED_TEST_CASE(DirectConvolutionLayerTest, TestDtypes);
+
+TYPED_TEST(DirectConvolutionLayerTest, TestSimpleConvolution) {
+  this->TestForward(3, 1, 1, 4);
+}
+
+TYPED_TEST(DirectConvolutionLayerTest, TestStridedConvolution) {
+  // More outputs than a block holds
+  this->TestForward(3, 2, 0, 20);
+}
+
+TYPED_TEST(DirectConvolutionLayerTest, Test1x1Convolution) {
+  this->TestForward(1, 1, 0, 9);
+}
+
+TYPED_TEST(DirectConvolutionLayerTest, TestFusedReLU) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_pad(1);
+  convolution_param->set_num_output(5);
+  convolution_param->mutable_fused_relu()->set_negative_slope(0.1);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  convolution_param->set_engine(ConvolutionParameter_Engine_DIRECT);
+  DirectConvolutionLayer<TypeParam> direct(layer_param);
+  vector<Blob<TypeParam>*> top_vec(1, this->blob_top_2_);
+  direct.SetUp(this->blob_bottom_vec_, top_vec);
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    direct.blobs()[i]->CopyFrom(*layer.blobs()[i]);
+  }
+  direct.Forward(this->blob_bottom_vec_, top_vec);
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[i],
+                this->blob_top_2_->cpu_data()[i], 1e-4);
+  }
+}
+
+TYPED_TEST(DirectConvolutionLayerTest, TestGradient) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  DirectConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
 #ifdef USE_CUDNN
 
 template <typename Dtype>
@@ -565,6 +1068,34 @@ TYPED_TEST(CuDNNConvolutionLayerTest, TestSimpleConvolutionGroupCuDNN) {
   }
 }
 
+TYPED_TEST(CuDNNConvolutionLayerTest, TestAutotuneGroupCuDNN) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(3);
+  convolution_param->set_group(3);
+  convolution_param->set_cudnn_autotune(true);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("constant");
+  convolution_param->mutable_bias_filler()->set_value(0.1);
+  // The second layer takes the algorithm the first tuned for the same shapes.
+  for (int i = 0; i < 2; ++i) {
+    shared_ptr<Layer<TypeParam> > layer(
+        new CuDNNConvolutionLayer<TypeParam>(layer_param));
+    layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    caffe_conv(this->blob_bottom_, convolution_param, layer->blobs(),
+        this->MakeReferenceTop(this->blob_top_));
+    const TypeParam* top_data = this->blob_top_->cpu_data();
+    const TypeParam* ref_top_data = this->ref_blob_top_->cpu_data();
+    for (int j = 0; j < this->blob_top_->count(); ++j) {
+      EXPECT_NEAR(top_data[j], ref_top_data[j], 1e-4);
+    }
+  }
+}
+
 TYPED_TEST(CuDNNConvolutionLayerTest, TestSobelConvolutionCuDNN) {
   // Test separable convolution by computing the Sobel operator
   // as a single filter then comparing the result
@@ -104,6 +104,161 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
     }
   }
 
+  void TestLoaderThreads() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(2);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_prefetch(5);
+    data_param->set_loader_threads(3);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_EQ(5, layer.prefetch_count());
+    EXPECT_EQ(3, layer.loader_count());
+    // Batches come in the order of the database, which has 5 datums
+    for (int iter = 0; iter < 20; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      for (int i = 0; i < 2; ++i) {
+        const int label = (iter * 2 + i) % 5;
+        EXPECT_EQ(label, blob_top_label_->cpu_data()[i]);
+        for (int j = 0; j < 24; ++j) {
+          EXPECT_EQ(label, blob_top_data_->cpu_data()[i * 24 + j])
+              << "debug: iter " << iter << " i " << i << " j " << j;
+        }
+      }
+    }
+  }
+
+  void TestMicroBatches() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(4);
+    data_param->set_micro_batches(2);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_EQ(2, blob_top_data_->num());
+    EXPECT_EQ(2, blob_top_label_->num());
+    // Each pair of forwards delivers the halves of a batch of 4 datums.
+    for (int iter = 0; iter < 10; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      ASSERT_EQ(2, blob_top_data_->num());
+      for (int i = 0; i < 2; ++i) {
+        const int label = (iter * 2 + i) % 5;
+        EXPECT_EQ(label, blob_top_label_->cpu_data()[i]);
+        for (int j = 0; j < 24; ++j) {
+          EXPECT_EQ(label, blob_top_data_->cpu_data()[i * 24 + j])
+              << "debug: iter " << iter << " i " << i << " j " << j;
+        }
+      }
+    }
+  }
+
+  // Same batches whether transformed by the loaders or, in GPU mode, by
+  // the layer on the GPU
+  void TestGPUTransform() {
+    vector<vector<Dtype> > batches[2];
+    for (int gpu = 0; gpu < 2; ++gpu) {
+      LayerParameter param;
+      param.set_name(gpu ? "gpu" : "cpu");
+      param.set_phase(TRAIN);
+      DataParameter* data_param = param.mutable_data_param();
+      data_param->set_batch_size(3);
+      data_param->set_source(filename_->c_str());
+      data_param->set_backend(backend_);
+      TransformationParameter* transform_param =
+          param.mutable_transform_param();
+      transform_param->set_crop_size(2);
+      transform_param->set_mirror(true);
+      transform_param->set_scale(0.5);
+      transform_param->add_mean_value(1);
+      transform_param->add_mean_value(2);
+      transform_param->set_gpu_transform(gpu);
+      Caffe::set_random_seed(1701);
+      DataLayer<Dtype> layer(param);
+      layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+      for (int iter = 0; iter < 4; ++iter) {
+        layer.Forward(blob_bottom_vec_, blob_top_vec_);
+        EXPECT_EQ(2, blob_top_data_->height());
+        EXPECT_EQ(2, blob_top_data_->width());
+        batches[gpu].push_back(vector<Dtype>(blob_top_data_->cpu_data(),
+            blob_top_data_->cpu_data() + blob_top_data_->count()));
+      }
+    }
+    for (int iter = 0; iter < batches[0].size(); ++iter) {
+      for (int i = 0; i < batches[0][iter].size(); ++i) {
+        EXPECT_EQ(batches[0][iter][i], batches[1][iter][i])
+            << "debug: iter " << iter << " i " << i;
+      }
+    }
+  }
+
+  void TestReaderThreads() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(1);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_reader_threads(2);
+
+    // Solvers get the records in turn, from any shard
+    const int solvers = 3;
+    Caffe::set_solver_count(solvers);
+    vector<shared_ptr<DataReader> > readers;
+    for (int i = 0; i < solvers; ++i) {
+      readers.push_back(shared_ptr<DataReader>(new DataReader(param)));
+    }
+    for (int iter = 0; iter < 4; ++iter) {
+      for (int i = 0; i < solvers; ++i) {
+        Datum* datum = readers[i]->full().pop();
+        EXPECT_EQ((iter * solvers + i) % 5, datum->label());
+        readers[i]->free().push(datum);
+      }
+    }
+    readers.clear();
+    Caffe::set_solver_count(1);
+  }
+
+  void TestDataStats() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(5);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    const int iters = 10;
+    for (int iter = 0; iter < iters; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+    }
+    DataStats stats;
+    layer.collect_data_stats(&stats);
+    EXPECT_EQ(iters, stats.samples(DataStats::WAIT));
+    EXPECT_EQ(iters, stats.samples(DataStats::QUEUE_DEPTH));
+    EXPECT_LE(stats.total(DataStats::QUEUE_DEPTH),
+              iters * layer.prefetch_count());
+    // Every batch consumed was transformed from datums read and decoded
+    EXPECT_GE(stats.samples(DataStats::TRANSFORM), iters);
+    EXPECT_GE(stats.samples(DataStats::READ), iters * 5);
+    EXPECT_GE(stats.samples(DataStats::DECODE), iters * 5);
+    // Collecting moves the counters
+    layer.collect_data_stats(&stats);
+    EXPECT_EQ(iters, stats.samples(DataStats::WAIT));
+    DataStats empty;
+    empty.take(&stats);
+    EXPECT_EQ(0, stats.samples(DataStats::WAIT));
+    EXPECT_EQ(iters, empty.samples(DataStats::WAIT));
+  }
+
   void TestReshape(DataParameter_DB backend) {
     const int num_inputs = 5;
     // Save data of varying shapes.
@@ -392,6 +547,44 @@ TYPED_TEST(DataLayerTest, TestReadLMDB) {
   this->TestRead();
 }
 
+TYPED_TEST(DataLayerTest, TestLoaderThreadsLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestLoaderThreads();
+}
+
+TYPED_TEST(DataLayerTest, TestExecutorLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  Caffe::set_executor_threads(2);
+  this->TestLoaderThreads();
+  Caffe::set_executor_threads(0);
+}
+
+TYPED_TEST(DataLayerTest, TestMicroBatchesLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestMicroBatches();
+}
+
+TYPED_TEST(DataLayerTest, TestGPUTransformLMDB) {
+  const bool unique_pixels = true;
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestGPUTransform();
+}
+
+TYPED_TEST(DataLayerTest, TestReaderThreadsLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestReaderThreads();
+}
+
+TYPED_TEST(DataLayerTest, TestDataStatsLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestDataStats();
+}
+
 TYPED_TEST(DataLayerTest, TestReshapeLMDB) {
   this->TestReshape(DataParameter_DB_LMDB);
 }
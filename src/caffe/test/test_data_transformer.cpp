@@ -3,6 +3,7 @@
 
 #include "gtest/gtest.h"
 #include "leveldb/db.h"
+#include "opencv2/core/core.hpp"
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
@@ -10,6 +11,7 @@
 #include "caffe/filler.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 
@@ -352,4 +354,104 @@ TYPED_TEST(DataTransformTest, TestMeanFile) {
   }
 }
 
+TYPED_TEST(DataTransformTest, TestMatMatchesDatum) {
+  TransformationParameter transform_param;
+  const int channels = 3;
+  const int height = 6;
+  const int width = 7;
+  const int crop_size = 4;
+  transform_param.set_crop_size(crop_size);
+  transform_param.set_mirror(true);
+  transform_param.set_scale(0.5);
+  for (int c = 0; c < channels; ++c) {
+    transform_param.add_mean_value(10 * c);
+  }
+  // The same pixels, planar in the datum and interleaved in the image
+  Datum datum;
+  FillDatum(0, channels, height, width, true, &datum);
+  cv::Mat cv_img(height, width, CV_8UC3);
+  for (int h = 0; h < height; ++h) {
+    for (int w = 0; w < width; ++w) {
+      for (int c = 0; c < channels; ++c) {
+        cv_img.ptr<uchar>(h)[w * channels + c] =
+            datum.data()[(c * height + h) * width + w];
+      }
+    }
+  }
+  DataTransformer<TypeParam> transformer(transform_param, TEST);
+  Blob<TypeParam> datum_blob(1, channels, crop_size, crop_size);
+  Blob<TypeParam> mat_blob(1, channels, crop_size, crop_size);
+  for (int iter = 0; iter < this->num_iter_; ++iter) {
+    Caffe::set_random_seed(this->seed_ + iter);
+    transformer.InitRand();
+    transformer.Transform(datum, &datum_blob);
+    Caffe::set_random_seed(this->seed_ + iter);
+    transformer.InitRand();
+    transformer.Transform(cv_img, &mat_blob);
+    for (int j = 0; j < datum_blob.count(); ++j) {
+      EXPECT_EQ(datum_blob.cpu_data()[j], mat_blob.cpu_data()[j]);
+    }
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestTransformWindows) {
+  TransformationParameter transform_param;
+  transform_param.add_mean_value(1);
+  transform_param.add_mean_value(2);
+  transform_param.set_scale(0.5);
+  Blob<TypeParam> image(1, 2, 6, 7);
+  for (int i = 0; i < image.count(); ++i) {
+    image.mutable_cpu_data()[i] = i;
+  }
+  // Windows of the size of the items are copied as they are
+  vector<int> windows;
+  windows.push_back(1);
+  windows.push_back(2);
+  windows.push_back(4);
+  windows.push_back(6);
+  windows.push_back(3);
+  windows.push_back(0);
+  windows.push_back(6);
+  windows.push_back(4);
+  Blob<TypeParam> blob(2, 2, 3, 4);
+  DataTransformer<TypeParam> transformer(transform_param, TEST);
+  transformer.TransformWindows(image, windows, 0, &blob);
+  for (int n = 0; n < 2; ++n) {
+    for (int c = 0; c < 2; ++c) {
+      for (int h = 0; h < 3; ++h) {
+        for (int w = 0; w < 4; ++w) {
+          EXPECT_EQ((image.data_at(0, c, windows[n * 4] + h,
+              windows[n * 4 + 1] + w) - (c + 1)) * 0.5,
+              blob.data_at(n, c, h, w));
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestTransformWindowsContextPad) {
+  TransformationParameter transform_param;
+  transform_param.add_mean_value(1);
+  DataTransformer<TypeParam> transformer(transform_param, TEST);
+  Blob<TypeParam> image(1, 2, 10, 10);
+  caffe_set(image.count(), TypeParam(5), image.mutable_cpu_data());
+  // The whole image, with a context of 2 pixels of the 8 of the item, takes
+  // 24 pixels, of which the image is the middle 4 after warping.
+  vector<int> windows;
+  windows.push_back(0);
+  windows.push_back(0);
+  windows.push_back(10);
+  windows.push_back(10);
+  Blob<TypeParam> blob(1, 2, 8, 8);
+  transformer.TransformWindows(image, windows, 2, &blob);
+  for (int c = 0; c < 2; ++c) {
+    for (int h = 0; h < 8; ++h) {
+      for (int w = 0; w < 8; ++w) {
+        const bool inside = h >= 2 && h < 6 && w >= 2 && w < 6;
+        EXPECT_EQ(inside ? 4 : 0, blob.data_at(0, c, h, w));
+      }
+    }
+  }
+}
+
 }  // namespace caffe
@@ -1,4 +1,13 @@
+#include <sys/stat.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <cstdio>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "boost/scoped_ptr.hpp"
 #include "gtest/gtest.h"
@@ -6,7 +15,11 @@
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/db.hpp"
+#include "caffe/util/db_chunks.hpp"
+#include "caffe/util/db_records.hpp"
+#include "caffe/util/db_service.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/socket.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 
@@ -56,8 +69,19 @@ struct TypeLMDB {
 };
 DataParameter_DB TypeLMDB::backend = DataParameter_DB_LMDB;
 
+struct TypeChunks {
+  static DataParameter_DB backend;
+};
+DataParameter_DB TypeChunks::backend = DataParameter_DB_CHUNKS;
+
+struct TypeRecords {
+  static DataParameter_DB backend;
+};
+DataParameter_DB TypeRecords::backend = DataParameter_DB_RECORDS;
+
 // typedef ::testing::Types<TypeLmdb> TestTypes;
-typedef ::testing::Types<TypeLevelDB, TypeLMDB> TestTypes;
+typedef ::testing::Types<TypeLevelDB, TypeLMDB, TypeChunks, TypeRecords>
+    TestTypes;
 
 TYPED_TEST_CASE(DBTest, TestTypes);
 
@@ -116,6 +140,120 @@ TYPED_TEST(DBTest, TestKeyValue) {
   EXPECT_FALSE(cursor->valid());
 }
 
+TYPED_TEST(DBTest, TestValueData) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  for (int i = 0; i < 2; ++i, cursor->Next()) {
+    EXPECT_TRUE(cursor->valid());
+    const string value = cursor->value();
+    EXPECT_EQ(value.size(), cursor->value_size());
+    EXPECT_EQ(value, string(cursor->value_data(), cursor->value_size()));
+    Datum datum;
+    EXPECT_TRUE(datum.ParseFromArray(cursor->value_data(),
+                                     cursor->value_size()));
+    EXPECT_EQ(datum.channels(), 3);
+  }
+  EXPECT_FALSE(cursor->valid());
+}
+
+TYPED_TEST(DBTest, TestSeek) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  EXPECT_TRUE(cursor->Seek("fish-bike.jpg"));
+  EXPECT_EQ(cursor->key(), "fish-bike.jpg");
+  cursor->WillNeed();
+  Datum datum;
+  datum.ParseFromString(cursor->value());
+  EXPECT_EQ(datum.label(), 1);
+  EXPECT_TRUE(cursor->Seek("cat.jpg"));
+  EXPECT_EQ(cursor->key(), "cat.jpg");
+  EXPECT_FALSE(cursor->Seek("dog.jpg"));
+}
+
+TYPED_TEST(DBTest, TestRandomCursor) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  shared_ptr<const vector<string> > keys = db::RandomCursor::ReadKeys(
+      db.get());
+  EXPECT_EQ(keys->size(), 2);
+  db::RandomCursor cursor(db.get(), keys, 1701, 1);
+  db::RandomCursor same(db.get(), keys, 1701, 1);
+  // Each epoch reads each record once, in the same order for both
+  for (int epoch = 0; epoch < 4; ++epoch) {
+    std::set<string> read;
+    for (; cursor.valid(); cursor.Next(), same.Next()) {
+      EXPECT_TRUE(same.valid());
+      EXPECT_EQ(cursor.key(), same.key());
+      Datum datum;
+      datum.ParseFromString(cursor.value());
+      EXPECT_EQ(datum.label(), cursor.key() == "cat.jpg" ? 0 : 1);
+      read.insert(cursor.key());
+    }
+    EXPECT_EQ(read.size(), 2);
+    cursor.SeekToFirst();
+    same.SeekToFirst();
+  }
+}
+
+TYPED_TEST(DBTest, TestShuffleBufferCursor) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  db::ShuffleBufferCursor cursor(db->NewCursor(), 4, 1701);
+  db::ShuffleBufferCursor same(db->NewCursor(), 4, 1701);
+  // The buffer holds both records, drawn at random and never running out
+  std::map<string, int> read;
+  for (int i = 0; i < 20; ++i, cursor.Next(), same.Next()) {
+    EXPECT_TRUE(cursor.valid());
+    EXPECT_EQ(cursor.key(), same.key());
+    Datum datum;
+    EXPECT_TRUE(datum.ParseFromArray(cursor.value_data(),
+                                     cursor.value_size()));
+    EXPECT_EQ(datum.label(), cursor.key() == "cat.jpg" ? 0 : 1);
+    read[cursor.key()]++;
+  }
+  EXPECT_EQ(read.size(), 2);
+}
+
+TYPED_TEST(DBTest, TestRangeCursor) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  db::RangeCursor cursor(db->NewCursor(), "fish-bike.jpg", 1);
+  for (int epoch = 0; epoch < 2; ++epoch) {
+    EXPECT_TRUE(cursor.valid());
+    EXPECT_EQ(cursor.key(), "fish-bike.jpg");
+    cursor.Next();
+    EXPECT_FALSE(cursor.valid());
+    cursor.SeekToFirst();
+  }
+}
+
+TYPED_TEST(DBTest, TestMixCursor) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  vector<db::Cursor*> cursors;
+  for (int i = 0; i < 3; ++i) {
+    cursors.push_back(db->NewCursor());
+  }
+  vector<float> weights;
+  weights.push_back(1);
+  weights.push_back(0);
+  weights.push_back(1);
+  db::MixCursor cursor(cursors, weights, 1701);
+  // Each source is read in order and wraps around, and the one of weight 0
+  // is never read
+  vector<int> read(3);
+  for (int i = 0; i < 40; ++i, cursor.Next()) {
+    EXPECT_TRUE(cursor.valid());
+    EXPECT_EQ(cursor.key(), read[cursor.current()]++ % 2 ? "fish-bike.jpg"
+        : "cat.jpg");
+  }
+  EXPECT_GT(read[0], 0);
+  EXPECT_EQ(read[1], 0);
+  EXPECT_GT(read[2], 0);
+}
+
 TYPED_TEST(DBTest, TestWrite) {
   scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
   db->Open(this->source_, db::WRITE);
@@ -131,4 +269,297 @@ TYPED_TEST(DBTest, TestWrite) {
   txn->Commit();
 }
 
+TYPED_TEST(DBTest, TestAppend) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::WRITE);
+  scoped_ptr<db::Transaction> txn(db->NewTransaction());
+  txn->set_append(true);
+  txn->Put("zebra_0", "a");
+  txn->Put("zebra_1", "b");
+  txn->Commit();
+  db->Close();
+  db->Open(this->source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_TRUE(cursor->valid());
+    cursor->Next();
+  }
+  EXPECT_EQ(cursor->key(), "zebra_0");
+  EXPECT_EQ(cursor->value(), "a");
+  cursor->Next();
+  EXPECT_EQ(cursor->key(), "zebra_1");
+  EXPECT_EQ(cursor->value(), "b");
+  cursor->Next();
+  EXPECT_FALSE(cursor->valid());
+}
+
+class ChunkDBTest : public ::testing::Test {
+ protected:
+  // 10 records of 100 bytes, 3 per chunk of 300 bytes
+  virtual void SetUp() {
+    MakeTempDir(&directory_);
+    source_ = directory_ + "/chunks";
+    db::ChunkDB db(300);
+    db.Open(source_, db::NEW);
+    scoped_ptr<db::Transaction> txn(db.NewTransaction());
+    for (int i = 0; i < 10; ++i) {
+      txn->Put(Key(i), string(100 - 8 - Key(i).size(), 'a' + i));
+    }
+    txn->Commit();
+  }
+
+  static string Key(int i) {
+    return "key_" + boost::lexical_cast<string>(i);
+  }
+
+  // Reads count records, checking each is the next of the chunks
+  void Check(db::Cursor* cursor, const vector<int>& records, int count) {
+    for (int i = 0; i < count; ++i, cursor->Next()) {
+      if (i % records.size() == 0 && i > 0) {
+        EXPECT_FALSE(cursor->valid());
+        cursor->SeekToFirst();
+      }
+      const int record = records[i % records.size()];
+      ASSERT_TRUE(cursor->valid());
+      EXPECT_EQ(cursor->key(), Key(record));
+      EXPECT_EQ(cursor->value_size(), 100 - 8 - Key(record).size());
+      EXPECT_EQ(cursor->value_data()[0], 'a' + record);
+    }
+  }
+
+  // Serves the ranges of the file over HTTP on the port, counting requests
+  void StartServer(int port) {
+    requests_ = 0;
+    server_.reset(new boost::thread(&ChunkDBTest::Serve, this,
+                                    Socket::listen(port)));
+  }
+
+  void StopServer(int port) {
+    shared_ptr<Socket> stop = Socket::connect("localhost", port);
+    const string request = "GET /stop HTTP/1.1\r\n\r\n";
+    stop->send(request.data(), request.size());
+    server_->join();
+  }
+
+  // Serves until a request for /stop
+  void Serve(shared_ptr<Socket> listener) {
+    scoped_ptr<db::ChunkFile> file(db::ChunkFile::Open(source_));
+    for (;;) {
+      shared_ptr<Socket> socket = listener->accept();
+      string path;
+      size_t begin = 0;
+      size_t end = file->size();
+      for (string line = ReadLine(socket.get()); !line.empty();
+           line = ReadLine(socket.get())) {
+        char buffer[256];
+        long long first, last;  // NOLINT(runtime/int)
+        if (sscanf(line.c_str(), "GET %255s", buffer) == 1) {
+          path = buffer;
+        } else if (sscanf(line.c_str(), "Range: bytes=%lld-%lld", &first,
+                          &last) == 2) {
+          begin = first;
+          end = last + 1;
+        } else if (sscanf(line.c_str(), "Range: bytes=-%lld", &last) == 1) {
+          begin = file->size() - last;
+        }
+      }
+      if (path == "/stop") {
+        return;
+      }
+      ++requests_;
+      string data(end - begin, 0);
+      file->Read(begin, data.size(), &data[0]);
+      std::ostringstream response;
+      response << "HTTP/1.1 206 Partial Content\r\n"
+               << "Content-Length: " << data.size() << "\r\n"
+               << "Content-Range: bytes " << begin << "-" << end - 1 << "/"
+               << file->size() << "\r\n\r\n" << data;
+      const string sent = response.str();
+      socket->send(sent.data(), sent.size());
+    }
+  }
+
+  static string ReadLine(Socket* socket) {
+    string line;
+    for (char c; socket->recv(&c, 1), c != '\n';) {
+      if (c != '\r') {
+        line += c;
+      }
+    }
+    return line;
+  }
+
+  string directory_;
+  string source_;
+  shared_ptr<boost::thread> server_;
+  int requests_;
+};
+
+TEST_F(ChunkDBTest, TestChunks) {
+  db::ChunkDB db;
+  db.set_readahead(2);
+  db.Open(source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db.NewCursor());
+  vector<int> records;
+  for (int i = 0; i < 10; ++i) {
+    records.push_back(i);
+  }
+  // Wraps around twice, reading the first chunks ahead again
+  Check(cursor.get(), records, 30);
+  EXPECT_TRUE(cursor->Seek(Key(7)));
+  EXPECT_EQ(cursor->value_data()[0], 'a' + 7);
+  EXPECT_TRUE(cursor->Seek(Key(2)));
+  cursor->Next();
+  EXPECT_EQ(cursor->key(), Key(3));
+  EXPECT_FALSE(cursor->Seek("key_45"));
+}
+
+TEST_F(ChunkDBTest, TestShards) {
+  // Chunks 1 and 3 of 4, of records 3 to 5 and 9
+  db::ChunkDB db;
+  db.set_shard(1, 2);
+  db.Open(source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db.NewCursor());
+  vector<int> records;
+  records.push_back(3);
+  records.push_back(4);
+  records.push_back(5);
+  records.push_back(9);
+  Check(cursor.get(), records, 8);
+  EXPECT_TRUE(cursor->Seek(Key(9)));
+  EXPECT_FALSE(cursor->Seek(Key(1)));
+}
+
+TEST_F(ChunkDBTest, TestHTTP) {
+  StartServer(27600);
+  string cache = directory_ + "/cache";
+  CHECK_EQ(mkdir(cache.c_str(), 0744), 0);
+  vector<int> records;
+  for (int i = 0; i < 10; ++i) {
+    records.push_back(i);
+  }
+  {
+    db::ChunkDB db;
+    db.set_cache(cache);
+    db.Open("http://localhost:27600/chunks", db::READ);
+    scoped_ptr<db::Cursor> cursor(db.NewCursor());
+    Check(cursor.get(), records, 20);
+  }
+  // The size and index, then each chunk once, then read from the cache
+  EXPECT_EQ(requests_, 3 + 4);
+  {
+    db::ChunkDB db;
+    db.set_cache(cache);
+    db.Open("http://localhost:27600/chunks", db::READ);
+    scoped_ptr<db::Cursor> cursor(db.NewCursor());
+    Check(cursor.get(), records, 10);
+  }
+  EXPECT_EQ(requests_, 3 + 4 + 3);
+  StopServer(27600);
+}
+
+TEST(RecordDBTest, TestUnsortedSeek) {
+  string source;
+  MakeTempDir(&source);
+  source += "/records";
+  db::RecordDB db;
+  db.Open(source, db::NEW);
+  scoped_ptr<db::Transaction> txn(db.NewTransaction());
+  const char* keys[] = {"b", "d", "a", "c"};
+  for (int i = 0; i < 4; ++i) {
+    txn->Put(keys[i], string(i + 1, keys[i][0]));
+  }
+  txn->Commit();
+  db.Close();
+  db.Open(source, db::READ);
+  scoped_ptr<db::Cursor> cursor(db.NewCursor());
+  // Read in the order written, found through the sorted keys
+  for (int i = 0; i < 4; ++i, cursor->Next()) {
+    EXPECT_EQ(cursor->key(), keys[i]);
+  }
+  EXPECT_FALSE(cursor->valid());
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(cursor->Seek(keys[i]));
+    EXPECT_EQ(cursor->value(), string(i + 1, keys[i][0]));
+  }
+  EXPECT_FALSE(cursor->Seek("e"));
+}
+
+TEST(RecordDBTest, TestReadAhead) {
+  string source;
+  MakeTempDir(&source);
+  source += "/records";
+  db::RecordDB db;
+  db.Open(source, db::NEW);
+  scoped_ptr<db::Transaction> txn(db.NewTransaction());
+  const int records = 100;
+  for (int i = 0; i < records; ++i) {
+    txn->Put(boost::lexical_cast<string>(1000 + i),
+             string(i * 97 % 5000 + 1, 'a' + i % 26));
+  }
+  txn->Commit();
+  db.Close();
+  db.Open(source, db::READ);
+  shared_ptr<const vector<string> > keys = db::RandomCursor::ReadKeys(&db);
+  db::RandomCursor cursor(&db, keys, 1701, 8);
+  // The records read ahead are those of the file
+  for (int epoch = 0; epoch < 2; ++epoch) {
+    int read = 0;
+    for (; cursor.valid(); cursor.Next(), ++read) {
+      const int i = boost::lexical_cast<int>(cursor.key()) - 1000;
+      EXPECT_EQ(string(i * 97 % 5000 + 1, 'a' + i % 26), cursor.value());
+    }
+    EXPECT_EQ(records, read);
+    cursor.SeekToFirst();
+  }
+  // Read ahead and never sought
+  scoped_ptr<db::Cursor> ahead(db.NewCursor());
+  for (int i = 0; i < records; ++i, ahead->Next()) {
+    ahead->WillNeed();
+  }
+  db.Close();
+}
+
+static void Publish(db::Transaction* txn, int count) {
+  for (int i = 0; i < count; ++i) {
+    txn->Put(string(), string(i + 1, 'a' + i));
+  }
+}
+
+TEST(ServiceDBTest, TestReaders) {
+  const string name = "/caffe_test_service_" +
+      boost::lexical_cast<string>(getpid());
+  db::ServiceDB writer;
+  writer.set_ring(4, 64);
+  writer.Open(name, db::NEW);
+  scoped_ptr<db::Transaction> txn(writer.NewTransaction());
+  db::ServiceDB reader;
+  reader.Open(name, db::READ);
+  // Both cursors read all records, the writer waiting for the slower one
+  scoped_ptr<db::Cursor> first(reader.NewCursor());
+  scoped_ptr<db::Cursor> second(reader.NewCursor());
+  boost::thread thread(&Publish, txn.get(), 10);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(first->key(), boost::lexical_cast<string>(i));
+    EXPECT_EQ(first->value(), string(i + 1, 'a' + i));
+    first->Next();
+    if (i % 2) {
+      // The second reads two records at a time
+      for (int j = i - 1; j <= i; ++j, second->Next()) {
+        EXPECT_TRUE(second->valid());
+        EXPECT_EQ(second->value(), string(j + 1, 'a' + j));
+      }
+    }
+  }
+  thread.join();
+  // New cursors read the records published after them
+  first.reset(reader.NewCursor());
+  Publish(txn.get(), 1);
+  EXPECT_EQ(first->key(), "10");
+  EXPECT_EQ(first->value(), "a");
+  first.reset();
+  second.reset();
+  writer.Close();
+}
+
 }  // namespace caffe
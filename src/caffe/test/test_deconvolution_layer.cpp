@@ -155,4 +155,121 @@ TYPED_TEST(DeconvolutionLayerTest, TestGradient) {
       this->blob_top_vec_);
 }
 
+TYPED_TEST(DeconvolutionLayerTest, TestGradientGroup) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_pad(1);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(3);
+  convolution_param->set_group(3);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  DeconvolutionLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+#ifdef USE_CUDNN
+
+template <typename Dtype>
+class CuDNNDeconvolutionLayerTest : public GPUDeviceTest<Dtype> {
+ protected:
+  CuDNNDeconvolutionLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 3, 6, 4)),
+        blob_top_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+
+  virtual ~CuDNNDeconvolutionLayerTest() {
+    delete blob_bottom_;
+    delete blob_top_;
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(CuDNNDeconvolutionLayerTest, TestDtypes);
+
+TYPED_TEST(CuDNNDeconvolutionLayerTest, TestForwardBackwardMatchCaffeCuDNN) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_pad(1);
+  convolution_param->set_num_output(6);
+  convolution_param->set_group(3);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  DeconvolutionLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  CuDNNDeconvolutionLayer<TypeParam> cudnn_layer(layer_param);
+  Blob<TypeParam> cudnn_top;
+  vector<Blob<TypeParam>*> cudnn_top_vec(1, &cudnn_top);
+  cudnn_layer.SetUp(this->blob_bottom_vec_, cudnn_top_vec);
+  ASSERT_TRUE(cudnn_top.shape() == this->blob_top_->shape());
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    cudnn_layer.blobs()[i]->CopyFrom(*layer.blobs()[i]);
+  }
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  cudnn_layer.Forward(this->blob_bottom_vec_, cudnn_top_vec);
+  for (int i = 0; i < cudnn_top.count(); ++i) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[i], cudnn_top.cpu_data()[i],
+                1e-4);
+  }
+  // The same gradients w.r.t. the bottom and the parameters
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(&cudnn_top);
+  caffe_copy(cudnn_top.count(), cudnn_top.cpu_data(),
+      this->blob_top_->mutable_cpu_diff());
+  caffe_copy(cudnn_top.count(), cudnn_top.cpu_data(),
+      cudnn_top.mutable_cpu_diff());
+  vector<bool> propagate_down(1, true);
+  layer.Backward(this->blob_top_vec_, propagate_down, this->blob_bottom_vec_);
+  Blob<TypeParam> bottom_diff;
+  bottom_diff.CopyFrom(*this->blob_bottom_, true, true);
+  cudnn_layer.Backward(cudnn_top_vec, propagate_down, this->blob_bottom_vec_);
+  for (int i = 0; i < bottom_diff.count(); ++i) {
+    EXPECT_NEAR(bottom_diff.cpu_diff()[i], this->blob_bottom_->cpu_diff()[i],
+                1e-4);
+  }
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    const Blob<TypeParam>& param = *layer.blobs()[i];
+    for (int j = 0; j < param.count(); ++j) {
+      EXPECT_NEAR(param.cpu_diff()[j], cudnn_layer.blobs()[i]->cpu_diff()[j],
+                  1e-4);
+    }
+  }
+}
+
+TYPED_TEST(CuDNNDeconvolutionLayerTest, TestGradientCuDNN) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(2);
+  convolution_param->set_stride(1);
+  convolution_param->set_num_output(1);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  CuDNNDeconvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+#endif
+
 }  // namespace caffe
@@ -6,6 +6,7 @@
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
+#include "caffe/util/math_functions.hpp"
 #include "caffe/vision_layers.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -103,6 +104,46 @@ TYPED_TEST(EltwiseLayerTest, TestSum) {
   }
 }
 
+TYPED_TEST(EltwiseLayerTest, TestSumManyBottoms) {
+  typedef typename TypeParam::Dtype Dtype;
+  // More bottoms than a GPU kernel takes at once
+  const int num_bottoms = 40;
+  LayerParameter layer_param;
+  EltwiseParameter* eltwise_param = layer_param.mutable_eltwise_param();
+  eltwise_param->set_operation(EltwiseParameter_EltwiseOp_SUM);
+  vector<shared_ptr<Blob<Dtype> > > bottoms;
+  vector<Blob<Dtype>*> bottom_vec;
+  FillerParameter filler_param;
+  UniformFiller<Dtype> filler(filler_param);
+  for (int i = 0; i < num_bottoms; ++i) {
+    eltwise_param->add_coeff(i % 3 - 1);
+    bottoms.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(2, 3, 4, 5)));
+    filler.Fill(bottoms.back().get());
+    bottom_vec.push_back(bottoms.back().get());
+  }
+  EltwiseLayer<Dtype> layer(layer_param);
+  layer.SetUp(bottom_vec, this->blob_top_vec_);
+  layer.Forward(bottom_vec, this->blob_top_vec_);
+  const int count = this->blob_top_->count();
+  for (int j = 0; j < count; ++j) {
+    Dtype sum = 0;
+    for (int i = 0; i < num_bottoms; ++i) {
+      sum += (i % 3 - 1) * bottoms[i]->cpu_data()[j];
+    }
+    EXPECT_NEAR(sum, this->blob_top_->cpu_data()[j], 1e-4);
+  }
+  caffe_copy(count, this->blob_bottom_a_->cpu_data(),
+      this->blob_top_->mutable_cpu_diff());
+  layer.Backward(this->blob_top_vec_, vector<bool>(num_bottoms, true),
+      bottom_vec);
+  for (int i = 0; i < num_bottoms; ++i) {
+    for (int j = 0; j < count; ++j) {
+      EXPECT_NEAR((i % 3 - 1) * this->blob_bottom_a_->cpu_data()[j],
+          bottoms[i]->cpu_diff()[j], 1e-5);
+    }
+  }
+}
+
 TYPED_TEST(EltwiseLayerTest, TestSumCoeff) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -126,6 +167,44 @@ TYPED_TEST(EltwiseLayerTest, TestSumCoeff) {
   }
 }
 
+TYPED_TEST(EltwiseLayerTest, TestSumCoeffInPlace) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  EltwiseParameter* eltwise_param = layer_param.mutable_eltwise_param();
+  eltwise_param->set_operation(EltwiseParameter_EltwiseOp_SUM);
+  eltwise_param->add_coeff(3);
+  eltwise_param->add_coeff(-0.5);
+  eltwise_param->add_coeff(2);
+  Blob<Dtype> in_a;
+  in_a.CopyFrom(*this->blob_bottom_a_, false, true);
+  vector<Blob<Dtype>*> top(1, this->blob_bottom_a_);
+  shared_ptr<EltwiseLayer<Dtype> > layer(
+      new EltwiseLayer<Dtype>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, top);
+  layer->Forward(this->blob_bottom_vec_, top);
+  const Dtype* data = this->blob_bottom_a_->cpu_data();
+  const int count = this->blob_bottom_a_->count();
+  const Dtype* in_data_a = in_a.cpu_data();
+  const Dtype* in_data_b = this->blob_bottom_b_->cpu_data();
+  const Dtype* in_data_c = this->blob_bottom_c_->cpu_data();
+  for (int i = 0; i < count; ++i) {
+    EXPECT_NEAR(data[i], 3*in_data_a[i] - 0.5*in_data_b[i] + 2*in_data_c[i],
+        1e-4);
+  }
+  // Each bottom gets the top diff scaled by its coeff
+  caffe_copy(count, in_data_a, this->blob_bottom_a_->mutable_cpu_diff());
+  vector<bool> propagate_down(3, true);
+  layer->Backward(top, propagate_down, this->blob_bottom_vec_);
+  const Dtype* diff_a = this->blob_bottom_a_->cpu_diff();
+  const Dtype* diff_b = this->blob_bottom_b_->cpu_diff();
+  const Dtype* diff_c = this->blob_bottom_c_->cpu_diff();
+  for (int i = 0; i < count; ++i) {
+    EXPECT_NEAR(diff_a[i], 3*in_data_a[i], 1e-4);
+    EXPECT_NEAR(diff_b[i], -0.5*in_data_a[i], 1e-4);
+    EXPECT_NEAR(diff_c[i], 2*in_data_a[i], 1e-4);
+  }
+}
+
 TYPED_TEST(EltwiseLayerTest, TestStableProdGradient) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
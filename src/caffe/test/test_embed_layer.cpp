@@ -0,0 +1,128 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/common_layers.hpp"
+#include "caffe/filler.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class EmbedLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+ protected:
+  EmbedLayerTest()
+      : blob_bottom_(new Blob<Dtype>(4, 1, 1, 1)),
+        blob_top_(new Blob<Dtype>()) {
+    // Indices in [0, 10), with a repeat
+    const int indices[] = { 3, 7, 3, 0 };
+    for (int i = 0; i < 4; ++i) {
+      blob_bottom_->mutable_cpu_data()[i] = indices[i];
+    }
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~EmbedLayerTest() { delete blob_bottom_; delete blob_top_; }
+
+  void SetParam(LayerParameter* layer_param, bool bias_term) {
+    EmbedParameter* embed_param = layer_param->mutable_embed_param();
+    embed_param->set_num_output(5);
+    embed_param->set_input_dim(10);
+    embed_param->set_bias_term(bias_term);
+    embed_param->mutable_weight_filler()->set_type("uniform");
+    embed_param->mutable_weight_filler()->set_min(-10);
+    embed_param->mutable_weight_filler()->set_max(10);
+    embed_param->mutable_bias_filler()->set_type("uniform");
+    embed_param->mutable_bias_filler()->set_min(-10);
+    embed_param->mutable_bias_filler()->set_max(10);
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(EmbedLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(EmbedLayerTest, TestSetUp) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  this->SetParam(&layer_param, true);
+  EmbedLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  ASSERT_EQ(this->blob_top_->num_axes(), 5);
+  EXPECT_EQ(this->blob_top_->shape(0), 4);
+  EXPECT_EQ(this->blob_top_->shape(4), 5);
+  ASSERT_EQ(layer.blobs().size(), 2);
+  EXPECT_EQ(layer.blobs()[0]->shape(0), 10);
+  EXPECT_EQ(layer.blobs()[0]->shape(1), 5);
+}
+
+TYPED_TEST(EmbedLayerTest, TestForward) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  this->SetParam(&layer_param, true);
+  EmbedLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  const Dtype* weight = layer.blobs()[0]->cpu_data();
+  const Dtype* bias = layer.blobs()[1]->cpu_data();
+  for (int n = 0; n < 4; ++n) {
+    const int index = static_cast<int>(this->blob_bottom_->cpu_data()[n]);
+    for (int d = 0; d < 5; ++d) {
+      EXPECT_NEAR(this->blob_top_->cpu_data()[n * 5 + d],
+                  weight[index * 5 + d] + bias[d], 1e-4);
+    }
+  }
+}
+
+TYPED_TEST(EmbedLayerTest, TestGradient) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  this->SetParam(&layer_param, false);
+  EmbedLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, -2);
+}
+
+TYPED_TEST(EmbedLayerTest, TestGradientWithBias) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  this->SetParam(&layer_param, true);
+  EmbedLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, -2);
+}
+
+TYPED_TEST(EmbedLayerTest, TestParamRows) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  this->SetParam(&layer_param, true);
+  EmbedLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  ASSERT_TRUE(layer.param_rows(0) != NULL);
+  EXPECT_TRUE(layer.param_rows(1) == NULL);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  caffe_set(this->blob_top_->count(), Dtype(1),
+            this->blob_top_->mutable_cpu_diff());
+  vector<bool> propagate_down(1, false);
+  layer.Backward(this->blob_top_vec_, propagate_down, this->blob_bottom_vec_);
+  // The rows of the indices, each once, in the order first touched
+  const vector<int>& rows = *layer.param_rows(0);
+  ASSERT_EQ(rows.size(), 3);
+  EXPECT_EQ(rows[0], 3);
+  EXPECT_EQ(rows[1], 7);
+  EXPECT_EQ(rows[2], 0);
+  layer.ClearParamRows(0);
+  EXPECT_EQ(layer.param_rows(0)->size(), 0);
+}
+
+}  // namespace caffe
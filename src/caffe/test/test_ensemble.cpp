@@ -0,0 +1,88 @@
+#include <string>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/ensemble.hpp"
+#include "caffe/net.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class EnsembleTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  EnsembleTest() {
+    const string proto =
+        "name: 'EnsembleMember' "
+        "input: 'data' "
+        "input_shape { dim: 4 dim: 5 } "
+        "layer { name: 'ip' type: 'InnerProduct' "
+        "  bottom: 'data' top: 'ip' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 1 } "
+        "    bias_filler { type: 'gaussian' std: 1 } } } "
+        "layer { name: 'prob' type: 'Softmax' "
+        "  bottom: 'ip' top: 'prob' } ";
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param_));
+    for (int i = 0; i < 3; ++i) {
+      nets_.push_back(shared_ptr<Net<Dtype> >(new Net<Dtype>(param_)));
+    }
+  }
+
+  NetParameter param_;
+  vector<shared_ptr<Net<Dtype> > > nets_;
+};
+
+TYPED_TEST_CASE(EnsembleTest, TestDtypesAndDevices);
+
+TYPED_TEST(EnsembleTest, TestForward) {
+  typedef typename TypeParam::Dtype Dtype;
+  vector<float> weights;
+  weights.push_back(0.5);
+  weights.push_back(0.3);
+  weights.push_back(0.2);
+  Ensemble<Dtype> ensemble(this->nets_, weights);
+  Blob<Dtype>* input = ensemble.input();
+  EXPECT_EQ(4, input->shape(0));
+  EXPECT_EQ(5, input->shape(1));
+  // A larger batch reshapes the nets
+  vector<int> shape(2);
+  shape[0] = 6;
+  shape[1] = 5;
+  input->Reshape(shape);
+  for (int i = 0; i < input->count(); ++i) {
+    input->mutable_cpu_data()[i] = (i % 7) * 0.25 - 0.75;
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    const Blob<Dtype>& output = ensemble.Forward();
+    ASSERT_EQ(6, output.shape(0));
+    ASSERT_EQ(3, output.shape(1));
+    // Against each net run alone on a copy of the input
+    vector<Dtype> expected(output.count(), 0);
+    for (int n = 0; n < 3; ++n) {
+      EXPECT_EQ(input->data(), this->nets_[n]->input_blobs()[0]->data());
+      Net<Dtype> alone(this->param_);
+      alone.ShareTrainedLayersWith(this->nets_[n].get());
+      alone.input_blobs()[0]->Reshape(shape);
+      caffe_copy(input->count(), input->cpu_data(),
+                 alone.input_blobs()[0]->mutable_cpu_data());
+      alone.ForwardPrefilled();
+      const Dtype* prob = alone.output_blobs()[0]->cpu_data();
+      for (int i = 0; i < expected.size(); ++i) {
+        expected[i] += weights[n] * prob[i];
+      }
+    }
+    for (int i = 0; i < output.count(); ++i) {
+      EXPECT_NEAR(expected[i], output.cpu_data()[i], 1e-5);
+    }
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,134 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/executor.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class ExecutorTest : public ::testing::Test {
+ public:
+  ExecutorTest() : done_(), started_() {}
+
+  void Count(int index) {
+    boost::mutex::scoped_lock lock(mutex_);
+    ++counts_[index];
+    ++done_;
+    condition_.notify_all();
+  }
+
+  // Submits the tasks counting children items from the executor threads
+  void Spawn(Executor* executor, int index, int children) {
+    for (int i = 0; i < children; ++i) {
+      executor->submit(boost::bind(&ExecutorTest::Count, this,
+          index * children + i), Executor::LOW);
+    }
+    Count(counts_.size() - 1 - index);
+  }
+
+  // Records the order tasks run in, the first one waiting for a signal
+  void Record(int index) {
+    boost::mutex::scoped_lock lock(mutex_);
+    started_ = true;
+    condition_.notify_all();
+    while (index == 0 && !done_) {
+      condition_.wait(lock);
+    }
+    order_.push_back(index);
+    condition_.notify_all();
+  }
+
+ protected:
+  void Wait(int done) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (done_ < done) {
+      condition_.wait(lock);
+    }
+  }
+
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  vector<int> counts_;
+  vector<int> order_;
+  int done_;
+  bool started_;
+};
+
+TEST_F(ExecutorTest, TestSubmit) {
+  Executor executor(4);
+  EXPECT_EQ(4, executor.size());
+  const int tasks = 1000;
+  counts_.resize(tasks, 0);
+  for (int i = 0; i < tasks; ++i) {
+    executor.submit(boost::bind(&ExecutorTest::Count, this, i),
+        i % 2 ? Executor::HIGH : Executor::LOW);
+  }
+  Wait(tasks);
+  for (int i = 0; i < tasks; ++i) {
+    EXPECT_EQ(1, counts_[i]);
+  }
+}
+
+TEST_F(ExecutorTest, TestNestedSubmit) {
+  Executor executor(3);
+  const int parents = 10;
+  const int children = 20;
+  counts_.resize(parents * children + parents, 0);
+  for (int i = 0; i < parents; ++i) {
+    executor.submit(boost::bind(&ExecutorTest::Spawn, this, &executor, i,
+        children), Executor::HIGH);
+  }
+  Wait(parents * children + parents);
+  for (int i = 0; i < counts_.size(); ++i) {
+    EXPECT_EQ(1, counts_[i]);
+  }
+}
+
+TEST_F(ExecutorTest, TestPriority) {
+  // The only thread busy until all the others are submitted
+  Executor executor(1);
+  executor.submit(boost::bind(&ExecutorTest::Record, this, 0),
+      Executor::HIGH);
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!started_) {
+      condition_.wait(lock);
+    }
+  }
+  for (int i = 1; i <= 4; ++i) {
+    executor.submit(boost::bind(&ExecutorTest::Record, this, i),
+        i <= 2 ? Executor::LOW : Executor::HIGH);
+  }
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    done_ = 1;
+    condition_.notify_all();
+    while (order_.size() < 5) {
+      condition_.wait(lock);
+    }
+  }
+  // High priority first, each priority newest first on a thread's own queue
+  const int expected[] = {0, 4, 3, 2, 1};
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(expected[i], order_[i]);
+  }
+}
+
+TEST_F(ExecutorTest, TestCaffeExecutor) {
+  EXPECT_TRUE(Caffe::executor() == NULL);
+  Caffe::set_executor_threads(2);
+  Executor* executor = Caffe::executor();
+  ASSERT_TRUE(executor != NULL);
+  EXPECT_EQ(2, executor->size());
+  EXPECT_EQ(executor, Caffe::executor());
+  Caffe::set_executor_threads(0);
+  EXPECT_TRUE(Caffe::executor() == NULL);
+}
+
+}  // namespace caffe
@@ -0,0 +1,160 @@
+#include <string>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class FeatureCacheLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  FeatureCacheLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 3, 1, 1)),
+        blob_top_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~FeatureCacheLayerTest() {
+    delete blob_bottom_;
+    delete blob_top_;
+  }
+
+  // Sets the bottom to the items of the given epoch positions.
+  void FillBottom(int first, int second) {
+    Dtype* data = blob_bottom_->mutable_cpu_data();
+    for (int k = 0; k < 3; ++k) {
+      data[k] = first * 10 + k;
+      data[3 + k] = second * 10 + k;
+    }
+  }
+
+  // With 3 items and batches of 2, the third batch begins within the epoch
+  // cached by the first two.
+  void TestForward(const LayerParameter& layer_param) {
+    FeatureCacheLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    this->FillBottom(0, 1);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    EXPECT_FALSE(layer.BottomsCached());
+    EXPECT_EQ(Dtype(11), this->blob_top_->cpu_data()[4]);
+    this->FillBottom(2, 0);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    EXPECT_TRUE(layer.BottomsCached());
+    // The bottom is no longer read.
+    caffe_set(this->blob_bottom_->count(), Dtype(-1),
+        this->blob_bottom_->mutable_cpu_data());
+    const int positions[] = {1, 2, 0, 1};
+    for (int batch = 0; batch < 2; ++batch) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+      const Dtype* top = this->blob_top_->cpu_data();
+      for (int n = 0; n < 2; ++n) {
+        for (int k = 0; k < 3; ++k) {
+          const int position = positions[batch * 2 + n];
+          EXPECT_EQ(Dtype(position * 10 + k), top[n * 3 + k]);
+        }
+      }
+    }
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(FeatureCacheLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(FeatureCacheLayerTest, TestForwardMemory) {
+  LayerParameter layer_param;
+  layer_param.mutable_feature_cache_param()->set_items(3);
+  this->TestForward(layer_param);
+}
+
+#ifdef USE_LMDB
+TYPED_TEST(FeatureCacheLayerTest, TestForwardLMDB) {
+  LayerParameter layer_param;
+  FeatureCacheParameter* param = layer_param.mutable_feature_cache_param();
+  param->set_items(3);
+  string source;
+  MakeTempDir(&source);
+  param->set_source(source + "/cache");
+  this->TestForward(layer_param);
+}
+#endif  // USE_LMDB
+
+TYPED_TEST(FeatureCacheLayerTest, TestNetSkipsTrunk) {
+  typedef typename TypeParam::Dtype Dtype;
+  const string proto =
+      "name: 'CachedNet' "
+      "state { phase: TRAIN } "
+      "layer { "
+      "  name: 'data' "
+      "  type: 'DummyData' "
+      "  dummy_data_param { "
+      "    shape { dim: 2 dim: 3 } "
+      "    shape { dim: 2 dim: 2 } "
+      "    data_filler { type: 'gaussian' std: 1 } "
+      "    data_filler { type: 'gaussian' std: 1 } "
+      "  } "
+      "  top: 'data' "
+      "  top: 'label' "
+      "} "
+      "layer { "
+      "  name: 'cache' "
+      "  type: 'FeatureCache' "
+      "  feature_cache_param { items: 2 } "
+      "  bottom: 'data' "
+      "  bottom: 'label' "
+      "  top: 'feature' "
+      "  top: 'cached_label' "
+      "} "
+      "layer { "
+      "  name: 'ip' "
+      "  type: 'InnerProduct' "
+      "  inner_product_param { "
+      "    num_output: 2 "
+      "    weight_filler { type: 'gaussian' std: 1 } "
+      "  } "
+      "  bottom: 'feature' "
+      "  top: 'ip' "
+      "} "
+      "layer { "
+      "  name: 'loss' "
+      "  type: 'EuclideanLoss' "
+      "  bottom: 'ip' "
+      "  bottom: 'cached_label' "
+      "  top: 'loss' "
+      "} ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  Net<Dtype> net(param);
+  Dtype loss;
+  net.ForwardPrefilled(&loss);
+  net.Backward();
+  const Blob<Dtype>& data = *net.blob_by_name("data");
+  const Blob<Dtype>& feature = *net.blob_by_name("feature");
+  const vector<Dtype> first(feature.cpu_data(),
+      feature.cpu_data() + feature.count());
+  net.ForwardPrefilled(&loss);
+  net.Backward();
+  for (int i = 0; i < feature.count(); ++i) {
+    EXPECT_EQ(feature.cpu_data()[i], first[i]);
+    // The data layer did not draw new data.
+    EXPECT_EQ(data.cpu_data()[i], first[i]);
+  }
+}
+
+}  // namespace caffe
@@ -142,6 +142,34 @@ TYPED_TEST(GaussianFillerTest, TestFill) {
   EXPECT_LE(var, target_var * 5.);
 }
 
+TYPED_TEST(GaussianFillerTest, TestFillLargeThreads) {
+  // Large enough to be filled by the threads of the pool
+  Blob<TypeParam> blob(4, 16, 32, 32);
+  Caffe::set_random_seed(1701);
+  this->filler_->Fill(&blob);
+  Blob<TypeParam> expected;
+  expected.CopyFrom(blob, false, true);
+  Caffe::set_cpu_threads(4);
+  Caffe::set_random_seed(1701);
+  this->filler_->Fill(&blob);
+  Caffe::set_cpu_threads(1);
+  const int count = blob.count();
+  const TypeParam* data = blob.cpu_data();
+  TypeParam mean = 0.;
+  TypeParam var = 0.;
+  for (int i = 0; i < count; ++i) {
+    EXPECT_EQ(expected.cpu_data()[i], data[i]);
+    mean += data[i];
+    var += (data[i] - this->filler_param_.mean()) *
+        (data[i] - this->filler_param_.mean());
+  }
+  mean /= count;
+  var /= count;
+  const TypeParam std = this->filler_param_.std();
+  EXPECT_NEAR(mean, this->filler_param_.mean(), std * 0.05);
+  EXPECT_NEAR(var, std * std, std * std * 0.05);
+}
+
 template <typename Dtype>
 class XavierFillerTest : public ::testing::Test {
  protected:
@@ -7,6 +7,7 @@
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
+#include "caffe/util/math_functions.hpp"
 #include "caffe/vision_layers.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -114,6 +115,38 @@ TYPED_TEST(FilterLayerTest, TestForward) {
     EXPECT_EQ(top_data[n], bottom_data[n]);
 }
 
+TYPED_TEST(FilterLayerTest, TestForwardLargeBatch) {
+  typedef typename TypeParam::Dtype Dtype;
+  // More items than the threads of a block, every third one selected
+  const int num = 2500;
+  Blob<Dtype> labels(num, 1, 1, 1);
+  Blob<Dtype> selector(num, 1, 1, 1);
+  for (int n = 0; n < num; ++n) {
+    labels.mutable_cpu_data()[n] = n;
+    selector.mutable_cpu_data()[n] = n % 3 == 1;
+  }
+  vector<Blob<Dtype>*> bottom_vec;
+  bottom_vec.push_back(&labels);
+  bottom_vec.push_back(&selector);
+  vector<Blob<Dtype>*> top_vec(1, this->blob_top_labels_);
+  LayerParameter layer_param;
+  FilterLayer<Dtype> layer(layer_param);
+  layer.SetUp(bottom_vec, top_vec);
+  layer.Forward(bottom_vec, top_vec);
+  ASSERT_EQ(num / 3, this->blob_top_labels_->shape(0));
+  for (int n = 0; n < num / 3; ++n) {
+    EXPECT_EQ(3 * n + 1, this->blob_top_labels_->cpu_data()[n]);
+  }
+  caffe_copy(num / 3, this->blob_top_labels_->cpu_data(),
+      this->blob_top_labels_->mutable_cpu_diff());
+  vector<bool> propagate_down(2, false);
+  propagate_down[0] = true;
+  layer.Backward(top_vec, propagate_down, bottom_vec);
+  for (int n = 0; n < num; ++n) {
+    EXPECT_EQ(n % 3 == 1 ? n : 0, labels.cpu_diff()[n]);
+  }
+}
+
 TYPED_TEST(FilterLayerTest, TestGradient) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -26,7 +26,8 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
  protected:
   GradientBasedSolverTest() :
       seed_(1701), num_(4), channels_(3), height_(10), width_(10),
-      share_(false) {
+      share_(false), snapshot_async_(false), snapshot_shards_(1),
+      prefetch_forward_(false), deterministic_reduction_(false) {
         input_file_ = new string(
         CMAKE_SOURCE_DIR "caffe/test/test_data/solver_data_list.txt" CMAKE_EXT);
       }
@@ -37,11 +38,16 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
   string snapshot_prefix_;
   shared_ptr<SGDSolver<Dtype> > solver_;
   shared_ptr<P2PSync<Dtype> > sync_;
+  shared_ptr<CPUSync<Dtype> > cpu_sync_;
   int seed_;
   // Dimensions are determined by generate_sample_data.py
   // TODO this is brittle and the hdf5 file should be checked instead.
   int num_, channels_, height_, width_;
   bool share_;
+  bool snapshot_async_;
+  int snapshot_shards_;
+  bool prefetch_forward_;
+  bool deterministic_reduction_;
   Dtype delta_;  // Stability constant for RMSProp, AdaGrad, AdaDelta and Adam
 
   // Test data: check out generate_sample_data.py in the same directory.
@@ -182,6 +188,20 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
     if (snapshot) {
       proto << "snapshot: " << num_iters << " ";
     }
+    if (snapshot_async_) {
+      proto << "snapshot_async: true ";
+    }
+    if (snapshot_shards_ > 1) {
+      proto << "snapshot_shards: " << snapshot_shards_ << " "
+            << "snapshot_compression: true ";
+    }
+    if (prefetch_forward_) {
+      proto << "prefetch_forward: true ";
+    }
+    if (deterministic_reduction_) {
+      proto << "deterministic_reduction: true "
+            << "reduce_bucket_size: 8 ";
+    }
     Caffe::set_random_seed(this->seed_);
     this->InitSolverFromProtoString(proto.str());
     if (from_snapshot != NULL) {
@@ -193,6 +213,13 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
     }
     if (devices == 1) {
       this->solver_->Solve();
+    } else if (Caffe::mode() == Caffe::CPU) {
+      LOG(INFO) << "Multi-CPU test on " << devices << " solvers";
+      Caffe::set_solver_count(devices);
+      this->cpu_sync_.reset(new CPUSync<Dtype>(
+          this->solver_, NULL, this->solver_->param()));
+      this->cpu_sync_->run();
+      Caffe::set_solver_count(1);
     } else {
       LOG(INFO) << "Multi-GPU test on " << devices << " devices";
       vector<int> gpus;
@@ -469,8 +496,8 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
       const int iter_to_check = 0) {
     const int kNum = num_;
     const int kIterSize = 1;
-    // Test over all numbers of devices.
-    int available_devices = 1;
+    // Test over all numbers of devices, or of 2 solvers on CPU.
+    int available_devices = Caffe::mode() == Caffe::CPU ? 2 : 1;
 #ifndef CPU_ONLY
     if (Caffe::mode() == Caffe::GPU) {
       CUDA_CHECK(cudaGetDeviceCount(&available_devices));
@@ -654,6 +681,45 @@ TYPED_TEST(SGDSolverTest, TestLeastSquaresUpdateWithEverything) {
   }
 }
 
+TYPED_TEST(SGDSolverTest, TestLeastSquaresUpdatePrefetchForward) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.5;
+  const int kNumIters = 4;
+  this->prefetch_forward_ = true;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(SGDSolverTest, TestLeastSquaresUpdateDeterministicReduction) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.5;
+  const int kNumIters = 4;
+  this->deterministic_reduction_ = true;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TEST(DevicePairTest, TestComputeInOrder) {
+  vector<int> devices;
+  for (int i = 0; i < 5; ++i) {
+    devices.push_back(4 - i);
+  }
+  vector<DevicePair> pairs;
+  DevicePair::compute_in_order(devices, &pairs);
+  const int expected[][2] = {{-1, 4}, {4, 3}, {2, 1}, {4, 2}, {4, 0}};
+  ASSERT_EQ(5, pairs.size());
+  for (int i = 0; i < pairs.size(); ++i) {
+    EXPECT_EQ(expected[i][0], pairs[i].parent());
+    EXPECT_EQ(expected[i][1], pairs[i].device());
+  }
+}
+
 TYPED_TEST(SGDSolverTest, TestLeastSquaresUpdateWithEverythingShare) {
   typedef typename TypeParam::Dtype Dtype;
   const Dtype kLearningRate = 0.01;
@@ -712,6 +778,43 @@ TYPED_TEST(SGDSolverTest, TestSnapshotShare) {
   }
 }
 
+TYPED_TEST(SGDSolverTest, TestSnapshotAsync) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  this->snapshot_async_ = true;
+  for (int i = 1; i <= kNumIters; ++i) {
+    this->TestSnapshot(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(SGDSolverTest, TestSnapshotAsyncShare) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  this->share_ = true;
+  this->snapshot_async_ = true;
+  for (int i = 1; i <= kNumIters; ++i) {
+    this->TestSnapshot(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(SGDSolverTest, TestSnapshotShards) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  this->snapshot_shards_ = 2;
+  for (int i = 1; i <= kNumIters; ++i) {
+    this->TestSnapshot(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
 
 template <typename TypeParam>
 class AdaGradSolverTest : public GradientBasedSolverTest<TypeParam> {
@@ -1,3 +1,5 @@
+#include <fstream>  // NOLINT(readability/streams)
+#include <set>
 #include <string>
 #include <vector>
 
@@ -7,6 +9,8 @@
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/hdf5.hpp"
+#include "caffe/util/io.hpp"
 #include "caffe/vision_layers.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -41,6 +45,87 @@ class HDF5DataLayerTest : public MultiDeviceTest<TypeParam> {
     delete filename;
   }
 
+  void TestRead(int chunk_size) {
+    // Create LayerParameter with the known parameters.
+    // The data file we are reading has 10 rows and 8 columns,
+    // with values from 0 to 10*8 reshaped in row-major order.
+    LayerParameter param;
+    param.add_top("data");
+    param.add_top("label");
+    param.add_top("label2");
+
+    HDF5DataParameter* hdf5_data_param = param.mutable_hdf5_data_param();
+    int batch_size = 5;
+    hdf5_data_param->set_batch_size(batch_size);
+    hdf5_data_param->set_source(*(filename));
+    hdf5_data_param->set_chunk_size(chunk_size);
+    int num_cols = 8;
+    int height = 6;
+    int width = 5;
+
+    // Test that the layer setup got the correct parameters.
+    HDF5DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_EQ(blob_top_data_->num(), batch_size);
+    EXPECT_EQ(blob_top_data_->channels(), num_cols);
+    EXPECT_EQ(blob_top_data_->height(), height);
+    EXPECT_EQ(blob_top_data_->width(), width);
+
+    EXPECT_EQ(blob_top_label_->num_axes(), 2);
+    EXPECT_EQ(blob_top_label_->shape(0), batch_size);
+    EXPECT_EQ(blob_top_label_->shape(1), 1);
+
+    EXPECT_EQ(blob_top_label2_->num_axes(), 2);
+    EXPECT_EQ(blob_top_label2_->shape(0), batch_size);
+    EXPECT_EQ(blob_top_label2_->shape(1), 1);
+
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+
+    // Go through the data 10 times (5 batches).
+    const int data_size = num_cols * height * width;
+    for (int iter = 0; iter < 10; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+
+      // On even iterations, we're reading the first half of the data.
+      // On odd iterations, we're reading the second half of the data.
+      // NB: label is 1-indexed
+      int label_offset = 1 + ((iter % 2 == 0) ? 0 : batch_size);
+      int label2_offset = 1 + label_offset;
+      int data_offset = (iter % 2 == 0) ? 0 : batch_size * data_size;
+
+      // Every two iterations we are reading the second file,
+      // which has the same labels, but data is offset by total data size,
+      // which is 2400 (see generate_sample_data).
+      int file_offset = (iter % 4 < 2) ? 0 : 2400;
+
+      for (int i = 0; i < batch_size; ++i) {
+        EXPECT_EQ(
+          label_offset + i,
+          blob_top_label_->cpu_data()[i]);
+        EXPECT_EQ(
+          label2_offset + i,
+          blob_top_label2_->cpu_data()[i]);
+      }
+      for (int i = 0; i < batch_size; ++i) {
+        for (int j = 0; j < num_cols; ++j) {
+          for (int h = 0; h < height; ++h) {
+            for (int w = 0; w < width; ++w) {
+              int idx = (
+                i * num_cols * height * width +
+                j * height * width +
+                h * width + w);
+              EXPECT_EQ(
+                file_offset + data_offset + idx,
+                blob_top_data_->cpu_data()[idx])
+                << "debug: i " << i << " j " << j
+                << " iter " << iter;
+            }
+          }
+        }
+      }
+    }
+  }
+
   string* filename;
   Blob<Dtype>* const blob_top_data_;
   Blob<Dtype>* const blob_top_label_;
@@ -52,81 +137,131 @@ class HDF5DataLayerTest : public MultiDeviceTest<TypeParam> {
 TYPED_TEST_CASE(HDF5DataLayerTest, TestDtypesAndDevices);
 
 TYPED_TEST(HDF5DataLayerTest, TestRead) {
+  this->TestRead(0);
+}
+
+TYPED_TEST(HDF5DataLayerTest, TestReadChunked) {
+  // Chunks of 3 rows do not divide the 10 rows of the files
+  this->TestRead(3);
+}
+
+TYPED_TEST(HDF5DataLayerTest, TestShuffleChunked) {
   typedef typename TypeParam::Dtype Dtype;
-  // Create LayerParameter with the known parameters.
-  // The data file we are reading has 10 rows and 8 columns,
-  // with values from 0 to 10*8 reshaped in row-major order.
   LayerParameter param;
   param.add_top("data");
   param.add_top("label");
   param.add_top("label2");
-
   HDF5DataParameter* hdf5_data_param = param.mutable_hdf5_data_param();
-  int batch_size = 5;
+  const int batch_size = 5;
   hdf5_data_param->set_batch_size(batch_size);
   hdf5_data_param->set_source(*(this->filename));
-  int num_cols = 8;
-  int height = 6;
-  int width = 5;
-
-  // Test that the layer setup got the correct parameters.
+  hdf5_data_param->set_chunk_size(4);
+  hdf5_data_param->set_shuffle(true);
   HDF5DataLayer<Dtype> layer(param);
   layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
-  EXPECT_EQ(this->blob_top_data_->num(), batch_size);
-  EXPECT_EQ(this->blob_top_data_->channels(), num_cols);
-  EXPECT_EQ(this->blob_top_data_->height(), height);
-  EXPECT_EQ(this->blob_top_data_->width(), width);
 
-  EXPECT_EQ(this->blob_top_label_->num_axes(), 2);
-  EXPECT_EQ(this->blob_top_label_->shape(0), batch_size);
-  EXPECT_EQ(this->blob_top_label_->shape(1), 1);
-
-  EXPECT_EQ(this->blob_top_label2_->num_axes(), 2);
-  EXPECT_EQ(this->blob_top_label2_->shape(0), batch_size);
-  EXPECT_EQ(this->blob_top_label2_->shape(1), 1);
-
-  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
-
-  // Go through the data 10 times (5 batches).
-  const int data_size = num_cols * height * width;
-  for (int iter = 0; iter < 10; ++iter) {
-    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
-
-    // On even iterations, we're reading the first half of the data.
-    // On odd iterations, we're reading the second half of the data.
-    // NB: label is 1-indexed
-    int label_offset = 1 + ((iter % 2 == 0) ? 0 : batch_size);
-    int label2_offset = 1 + label_offset;
-    int data_offset = (iter % 2 == 0) ? 0 : batch_size * data_size;
-
-    // Every two iterations we are reading the second file,
-    // which has the same labels, but data is offset by total data size,
-    // which is 2400 (see generate_sample_data).
-    int file_offset = (iter % 4 < 2) ? 0 : 2400;
+  // Each epoch of the two files of 10 rows outputs each row once, with a data
+  // and its labels staying together
+  const int data_size = this->blob_top_data_->count(1);
+  for (int epoch = 0; epoch < 2; ++epoch) {
+    std::set<int> rows;
+    for (int iter = 0; iter < 4; ++iter) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+      for (int i = 0; i < batch_size; ++i) {
+        const int value = this->blob_top_data_->cpu_data()[i * data_size];
+        const int row = (value % 2400) / data_size;
+        EXPECT_EQ(row + 1, this->blob_top_label_->cpu_data()[i]);
+        EXPECT_EQ(row + 2, this->blob_top_label2_->cpu_data()[i]);
+        rows.insert(value);
+      }
+    }
+    EXPECT_EQ(20, rows.size());
+  }
+}
 
-    for (int i = 0; i < batch_size; ++i) {
-      EXPECT_EQ(
-        label_offset + i,
-        this->blob_top_label_->cpu_data()[i]);
-      EXPECT_EQ(
-        label2_offset + i,
-        this->blob_top_label2_->cpu_data()[i]);
+TYPED_TEST(HDF5DataLayerTest, TestReadSparse) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Row r of the 5 x 4 matrix holds r + 1 at column r % 4, and 10 * r at
+  // column 3 if r is even, with label r.
+  const int num_rows = 5;
+  vector<Dtype> values;
+  vector<Dtype> indices;
+  vector<Dtype> offsets;
+  for (int r = 0; r < num_rows; ++r) {
+    offsets.push_back(values.size());
+    values.push_back(r + 1);
+    indices.push_back(r % 4);
+    if (r % 2 == 0 && r % 4 != 3) {
+      values.push_back(10 * r);
+      indices.push_back(3);
     }
+  }
+  offsets.push_back(values.size());
+  string filename;
+  MakeTempFilename(&filename);
+  hid_t file_id = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
+      H5P_DEFAULT);
+  ASSERT_GE(file_id, 0);
+  Blob<Dtype> blob;
+  blob.Reshape(vector<int>(1, values.size()));
+  caffe_copy(blob.count(), &values[0], blob.mutable_cpu_data());
+  hdf5_save_nd_dataset(file_id, "x_data", blob);
+  caffe_copy(blob.count(), &indices[0], blob.mutable_cpu_data());
+  hdf5_save_nd_dataset(file_id, "x_indices", blob);
+  blob.Reshape(vector<int>(1, offsets.size()));
+  caffe_copy(blob.count(), &offsets[0], blob.mutable_cpu_data());
+  hdf5_save_nd_dataset(file_id, "x_indptr", blob);
+  blob.Reshape(vector<int>(1, num_rows));
+  for (int r = 0; r < num_rows; ++r) {
+    blob.mutable_cpu_data()[r] = r;
+  }
+  hdf5_save_nd_dataset(file_id, "label", blob);
+  H5Fclose(file_id);
+  string source;
+  MakeTempFilename(&source);
+  std::ofstream(source.c_str()) << filename << std::endl;
+
+  LayerParameter param;
+  param.add_top("x");
+  param.add_top("x_indices");
+  param.add_top("x_indptr");
+  param.add_top("label");
+  HDF5DataParameter* hdf5_data_param = param.mutable_hdf5_data_param();
+  const int batch_size = 2;
+  hdf5_data_param->set_batch_size(batch_size);
+  hdf5_data_param->set_source(source);
+  hdf5_data_param->set_chunk_size(2);
+  hdf5_data_param->add_sparse("x");
+  Blob<Dtype> top_values;
+  Blob<Dtype> top_indices;
+  Blob<Dtype> top_offsets;
+  Blob<Dtype> top_label;
+  vector<Blob<Dtype>*> top_vec;
+  top_vec.push_back(&top_values);
+  top_vec.push_back(&top_indices);
+  top_vec.push_back(&top_offsets);
+  top_vec.push_back(&top_label);
+  HDF5DataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, top_vec);
+  EXPECT_EQ(top_offsets.count(), batch_size + 1);
+  // Batches go through the rows in order, across chunks and epochs.
+  for (int iter = 0; iter < 5; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, top_vec);
+    ASSERT_EQ(top_offsets.count(), batch_size + 1);
+    EXPECT_EQ(0, top_offsets.cpu_data()[0]);
+    EXPECT_EQ(top_values.count(), top_offsets.cpu_data()[batch_size]);
+    EXPECT_EQ(top_values.count(), top_indices.count());
     for (int i = 0; i < batch_size; ++i) {
-      for (int j = 0; j < num_cols; ++j) {
-        for (int h = 0; h < height; ++h) {
-          for (int w = 0; w < width; ++w) {
-            int idx = (
-              i * num_cols * height * width +
-              j * height * width +
-              h * width + w);
-            EXPECT_EQ(
-              file_offset + data_offset + idx,
-              this->blob_top_data_->cpu_data()[idx])
-              << "debug: i " << i << " j " << j
-              << " iter " << iter;
-          }
-        }
+      const int r = (iter * batch_size + i) % num_rows;
+      EXPECT_EQ(r, top_label.cpu_data()[i]);
+      const int begin = top_offsets.cpu_data()[i];
+      const int end = top_offsets.cpu_data()[i + 1];
+      const int first = offsets[r];
+      const int count = offsets[r + 1] - first;
+      ASSERT_EQ(count, end - begin);
+      for (int e = 0; e < count; ++e) {
+        EXPECT_EQ(values[first + e], top_values.cpu_data()[begin + e]);
+        EXPECT_EQ(indices[first + e], top_indices.cpu_data()[begin + e]);
       }
     }
   }
@@ -14,7 +14,7 @@
 namespace caffe {
 
 // Forward declare kernel functions
-template <typename Dtype>
+template <typename Dtype, int Kernel, int Stride>
 __global__ void im2col_gpu_kernel(const int n, const Dtype* data_im,
     const int height, const int width, const int kernel_h, const int kernel_w,
     const int pad_h, const int pad_w,
@@ -100,13 +100,27 @@ TYPED_TEST(Im2colKernelTest, TestGPU) {
   for (int grid_div = 2; grid_div <= 8; grid_div++) {
     for (int n = 0; n < this->blob_bottom_->num(); ++n) {
       int grid_dim = default_grid_dim/grid_div;
-      // NOLINT_NEXT_LINE(whitespace/operators)
-      im2col_gpu_kernel<TypeParam><<<grid_dim, CAFFE_CUDA_NUM_THREADS>>>(
-        num_kernels, bottom_data + this->blob_bottom_->offset(n),
-        this->height_, this->width_, this->kernel_size_, this->kernel_size_,
-        this->pad_, this->pad_, this->stride_, this->stride_,
-        this->height_col_, this->width_col_,
-        top_data + this->blob_top_->offset(n));
+      // Alternate the generic kernel and the one specialized for 3x3
+      // kernels at a stride of 2
+      if (grid_div % 2) {
+        // NOLINT_NEXT_LINE(whitespace/operators)
+        im2col_gpu_kernel<TypeParam, 3, 2><<<grid_dim,
+          CAFFE_CUDA_NUM_THREADS>>>(
+          num_kernels, bottom_data + this->blob_bottom_->offset(n),
+          this->height_, this->width_, this->kernel_size_, this->kernel_size_,
+          this->pad_, this->pad_, this->stride_, this->stride_,
+          this->height_col_, this->width_col_,
+          top_data + this->blob_top_->offset(n));
+      } else {
+        // NOLINT_NEXT_LINE(whitespace/operators)
+        im2col_gpu_kernel<TypeParam, 0, 0><<<grid_dim,
+          CAFFE_CUDA_NUM_THREADS>>>(
+          num_kernels, bottom_data + this->blob_bottom_->offset(n),
+          this->height_, this->width_, this->kernel_size_, this->kernel_size_,
+          this->pad_, this->pad_, this->stride_, this->stride_,
+          this->height_col_, this->width_col_,
+          top_data + this->blob_top_->offset(n));
+      }
       CUDA_POST_KERNEL_CHECK;
     }
 
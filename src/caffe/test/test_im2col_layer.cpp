@@ -68,6 +68,40 @@ TYPED_TEST(Im2colLayerTest, TestForward) {
   }
 }
 
+TYPED_TEST(Im2colLayerTest, TestForwardStrides) {
+  typedef typename TypeParam::Dtype Dtype;
+  // 3x3 padded and strided 1x1 kernels, each stride taking its own CPU path
+  for (int kernel = 1; kernel <= 3; kernel += 2) {
+    for (int stride = 1; stride <= 3; ++stride) {
+      const int pad = kernel / 2;
+      LayerParameter layer_param;
+      ConvolutionParameter* convolution_param =
+          layer_param.mutable_convolution_param();
+      convolution_param->set_kernel_size(kernel);
+      convolution_param->set_stride(stride);
+      convolution_param->set_pad(pad);
+      Im2colLayer<Dtype> layer(layer_param);
+      layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+      for (int c = 0; c < this->blob_top_->channels(); ++c) {
+        const int c_im = c / kernel / kernel;
+        const int h_offset = (c / kernel) % kernel;
+        const int w_offset = c % kernel;
+        for (int h = 0; h < this->blob_top_->height(); ++h) {
+          for (int w = 0; w < this->blob_top_->width(); ++w) {
+            const int h_im = h * stride - pad + h_offset;
+            const int w_im = w * stride - pad + w_offset;
+            const bool inside = h_im >= 0 && h_im < this->blob_bottom_->height()
+                && w_im >= 0 && w_im < this->blob_bottom_->width();
+            EXPECT_EQ(inside ? this->blob_bottom_->data_at(1, c_im, h_im, w_im)
+                : Dtype(0), this->blob_top_->data_at(1, c, h, w));
+          }
+        }
+      }
+    }
+  }
+}
+
 TYPED_TEST(Im2colLayerTest, TestGradient) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -115,6 +115,90 @@ TYPED_TEST(ImageDataLayerTest, TestResize) {
   }
 }
 
+TYPED_TEST(ImageDataLayerTest, TestDecodeThreads) {
+  typedef typename TypeParam::Dtype Dtype;
+  vector<Dtype> data[2];
+  for (int i = 0; i < 2; ++i) {
+    LayerParameter param;
+    param.set_name(i ? "threads" : "thread");
+    ImageDataParameter* image_data_param = param.mutable_image_data_param();
+    image_data_param->set_batch_size(5);
+    image_data_param->set_source(this->filename_reshape_.c_str());
+    image_data_param->set_new_height(64);
+    image_data_param->set_new_width(64);
+    image_data_param->set_shuffle(false);
+    image_data_param->set_decode_threads(i ? 3 : 1);
+    ImageDataLayer<Dtype> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int j = 0; j < 5; ++j) {
+      EXPECT_EQ(j % 2, this->blob_top_label_->cpu_data()[j]);
+    }
+    data[i].assign(this->blob_top_data_->cpu_data(),
+        this->blob_top_data_->cpu_data() + this->blob_top_data_->count());
+  }
+  for (int j = 0; j < data[0].size(); ++j) {
+    EXPECT_EQ(data[0][j], data[1][j]);
+  }
+}
+
+TYPED_TEST(ImageDataLayerTest, TestGPUDecode) {
+  typedef typename TypeParam::Dtype Dtype;
+  vector<Dtype> data[2];
+  for (int i = 0; i < 2; ++i) {
+    LayerParameter param;
+    param.set_phase(TEST);
+    ImageDataParameter* image_data_param = param.mutable_image_data_param();
+    image_data_param->set_batch_size(5);
+    image_data_param->set_source(this->filename_.c_str());
+    image_data_param->set_shuffle(false);
+    TransformationParameter* transform_param =
+        param.mutable_transform_param();
+    transform_param->set_crop_size(64);
+    transform_param->add_mean_value(100);
+    transform_param->set_gpu_transform(i);
+    transform_param->set_gpu_decode(i);
+    ImageDataLayer<Dtype> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    EXPECT_EQ(this->blob_top_data_->channels(), 3);
+    EXPECT_EQ(this->blob_top_data_->height(), 64);
+    for (int j = 0; j < 5; ++j) {
+      EXPECT_EQ(j, this->blob_top_label_->cpu_data()[j]);
+    }
+    data[i].assign(this->blob_top_data_->cpu_data(),
+        this->blob_top_data_->cpu_data() + this->blob_top_data_->count());
+  }
+  // nvJPEG and libjpeg may round some pixels differently
+  for (int j = 0; j < data[0].size(); ++j) {
+    EXPECT_NEAR(data[0][j], data[1][j], 4);
+  }
+}
+
+TYPED_TEST(ImageDataLayerTest, TestReducedDecode) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  ImageDataParameter* image_data_param = param.mutable_image_data_param();
+  image_data_param->set_batch_size(5);
+  image_data_param->set_source(this->filename_reshape_.c_str());
+  image_data_param->set_new_height(64);
+  image_data_param->set_new_width(80);
+  image_data_param->set_shuffle(false);
+  image_data_param->set_reduced_decode(true);
+  ImageDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int iter = 0; iter < 2; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    EXPECT_EQ(this->blob_top_data_->num(), 5);
+    EXPECT_EQ(this->blob_top_data_->channels(), 3);
+    EXPECT_EQ(this->blob_top_data_->height(), 64);
+    EXPECT_EQ(this->blob_top_data_->width(), 80);
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ((iter * 5 + i) % 2, this->blob_top_label_->cpu_data()[i]);
+    }
+  }
+}
+
 TYPED_TEST(ImageDataLayerTest, TestReshape) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter param;
@@ -142,6 +226,72 @@ TYPED_TEST(ImageDataLayerTest, TestReshape) {
   EXPECT_EQ(this->blob_top_data_->width(), 481);
 }
 
+TYPED_TEST(ImageDataLayerTest, TestBuckets) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  ImageDataParameter* image_data_param = param.mutable_image_data_param();
+  image_data_param->set_batch_size(1);
+  image_data_param->set_source(this->filename_reshape_.c_str());
+  image_data_param->set_shuffle(false);
+  image_data_param->add_bucket_height(200);
+  image_data_param->add_bucket_width(300);
+  image_data_param->add_bucket_height(300);
+  image_data_param->add_bucket_width(400);
+  ImageDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Preallocated for the largest bucket
+  EXPECT_EQ(this->blob_top_data_->height(), 300);
+  EXPECT_EQ(this->blob_top_data_->width(), 400);
+  // cat.jpg, 360x480
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_data_->height(), 300);
+  EXPECT_EQ(this->blob_top_data_->width(), 400);
+  EXPECT_EQ(this->blob_top_label_->cpu_data()[0], 0);
+  // fish-bike.jpg, 323x481
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_data_->height(), 200);
+  EXPECT_EQ(this->blob_top_data_->width(), 300);
+  EXPECT_EQ(this->blob_top_label_->cpu_data()[0], 1);
+}
+
+TYPED_TEST(ImageDataLayerTest, TestBucketBatches) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Images alternate between buckets, with their sizes in the list
+  string filename;
+  MakeTempFilename(&filename);
+  std::ofstream outfile(filename.c_str(), std::ofstream::out);
+  for (int i = 0; i < 4; ++i) {
+    if (i % 2 == 0) {
+      outfile << EXAMPLES_SOURCE_DIR "images/cat.jpg " << i << " 360 480\n";
+    } else {
+      outfile << EXAMPLES_SOURCE_DIR "images/fish-bike.jpg " << i
+              << " 323 481\n";
+    }
+  }
+  outfile.close();
+  LayerParameter param;
+  ImageDataParameter* image_data_param = param.mutable_image_data_param();
+  image_data_param->set_batch_size(2);
+  image_data_param->set_source(filename.c_str());
+  image_data_param->set_shuffle(false);
+  image_data_param->set_source_sizes(true);
+  image_data_param->add_bucket_height(300);
+  image_data_param->add_bucket_width(400);
+  image_data_param->add_bucket_height(200);
+  image_data_param->add_bucket_width(300);
+  ImageDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Each batch has the images of one bucket
+  for (int iter = 0; iter < 2; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    EXPECT_EQ(this->blob_top_data_->num(), 2);
+    EXPECT_EQ(this->blob_top_data_->height(), iter == 0 ? 300 : 200);
+    EXPECT_EQ(this->blob_top_data_->width(), iter == 0 ? 400 : 300);
+    EXPECT_EQ(this->blob_top_label_->cpu_data()[0], iter);
+    EXPECT_EQ(this->blob_top_label_->cpu_data()[1], iter + 2);
+  }
+}
+
 TYPED_TEST(ImageDataLayerTest, TestShuffle) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter param;
@@ -0,0 +1,72 @@
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/image_list.hpp"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class ImageListTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    MakeTempFilename(&filename_);
+    std::ofstream outfile(filename_.c_str(), std::ofstream::out);
+    outfile << "a/cat.jpg 3 360 480\nb/fish-bike.jpg 7 323 481\n";
+    outfile << "c.png -1 10 20";
+    outfile.close();
+  }
+
+  void Check(const ImageList& list, bool sizes) {
+    ASSERT_EQ(list.size(), 3);
+    EXPECT_EQ(list.name(0), "a/cat.jpg");
+    EXPECT_EQ(list.name(1), "b/fish-bike.jpg");
+    EXPECT_EQ(list.name(2), "c.png");
+    EXPECT_EQ(list.label(0), 3);
+    EXPECT_EQ(list.label(1), 7);
+    EXPECT_EQ(list.label(2), -1);
+    ASSERT_EQ(list.has_sizes(), sizes);
+    if (sizes) {
+      EXPECT_EQ(list.height(1), 323);
+      EXPECT_EQ(list.width(1), 481);
+      EXPECT_EQ(list.height(2), 10);
+      EXPECT_EQ(list.width(2), 20);
+    }
+  }
+
+  string filename_;
+};
+
+TEST_F(ImageListTest, TestParse) {
+  ImageList list;
+  list.Open(filename_, true);
+  Check(list, true);
+  EXPECT_FALSE(ImageList::IsIndex(filename_));
+}
+
+TEST_F(ImageListTest, TestIndex) {
+  for (int sizes = 0; sizes < 2; ++sizes) {
+    string index;
+    MakeTempFilename(&index);
+    {
+      ImageList list;
+      std::ofstream outfile(filename_.c_str(), std::ofstream::out);
+      outfile << "a/cat.jpg 3 " << (sizes ? "360 480\n" : "\n");
+      outfile << "b/fish-bike.jpg 7 " << (sizes ? "323 481\n" : "\n");
+      outfile << "c.png -1" << (sizes ? " 10 20" : "");
+      outfile.close();
+      list.Open(filename_, sizes);
+      list.Write(index);
+    }
+    EXPECT_TRUE(ImageList::IsIndex(index));
+    ImageList list;
+    list.Open(index, false);
+    Check(list, sizes);
+  }
+}
+
+}  // namespace caffe
@@ -149,4 +149,260 @@ TYPED_TEST(InnerProductLayerTest, TestGradient) {
   }
 }
 
+TYPED_TEST(InnerProductLayerTest, TestForwardQuantized) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_vec_.push_back(this->blob_bottom_);
+  LayerParameter layer_param;
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  inner_product_param->set_num_output(10);
+  inner_product_param->mutable_weight_filler()->set_type("uniform");
+  inner_product_param->mutable_weight_filler()->set_min(-1);
+  inner_product_param->mutable_bias_filler()->set_type("gaussian");
+  InnerProductLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  Blob<Dtype> ref_top;
+  ref_top.CopyFrom(*this->blob_top_, false, true);
+  // The same weights on int8 values, scaled by the range of the inputs
+  layer_param.set_phase(TEST);
+  layer_param.mutable_quantization_param();
+  InnerProductLayer<Dtype> quantized_layer(layer_param);
+  quantized_layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    quantized_layer.blobs()[i]->CopyFrom(*layer.blobs()[i]);
+  }
+  quantized_layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Inputs in [0, 1] and weights in [-1, 1] are off by 1 / 254 at most, and
+  // the errors of the 60 products add up to 0.015 on average.
+  for (int i = 0; i < ref_top.count(); ++i) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[i], ref_top.cpu_data()[i], 0.1);
+  }
+}
+
+// The products by hand, of each item by the weights plus the bias
+template <typename Dtype>
+static void CheckInnerProduct(const Blob<Dtype>& bottom,
+    Layer<Dtype>* layer, const Blob<Dtype>& top) {
+  const int num = top.shape(0);
+  const int N = top.count(1);
+  const int K = bottom.count(1);
+  const Dtype* weight = layer->blobs()[0]->cpu_data();
+  const Dtype* bias = layer->blobs()[1]->cpu_data();
+  for (int n = 0; n < num; ++n) {
+    for (int j = 0; j < N; ++j) {
+      Dtype expected = bias[j];
+      for (int k = 0; k < K; ++k) {
+        expected += bottom.cpu_data()[n * K + k] * weight[j * K + k];
+      }
+      EXPECT_NEAR(top.cpu_data()[n * N + j], expected, 1e-4);
+    }
+  }
+}
+
+TYPED_TEST(InnerProductLayerTest, TestForwardTest) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_vec_.push_back(this->blob_bottom_);
+  LayerParameter layer_param;
+  layer_param.set_phase(TEST);
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  inner_product_param->set_num_output(10);
+  inner_product_param->mutable_weight_filler()->set_type("uniform");
+  inner_product_param->mutable_weight_filler()->set_min(-1);
+  inner_product_param->mutable_bias_filler()->set_type("gaussian");
+  InnerProductLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  CheckInnerProduct(*this->blob_bottom_, &layer, *this->blob_top_);
+  // New weights are packed again
+  caffe_scal(layer.blobs()[0]->count(), Dtype(-2),
+      layer.blobs()[0]->mutable_cpu_data());
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  CheckInnerProduct(*this->blob_bottom_, &layer, *this->blob_top_);
+  // A single item, by the matrix-vector product
+  Blob<Dtype> item;
+  item.ShareItems(*this->blob_bottom_, 1, 2);
+  this->blob_bottom_vec_[0] = &item;
+  layer.Reshape(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_->num(), 1);
+  CheckInnerProduct(item, &layer, *this->blob_top_);
+}
+
+TYPED_TEST(InnerProductLayerTest, TestForwardSparseWeights) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_vec_.push_back(this->blob_bottom_);
+  LayerParameter layer_param;
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  inner_product_param->set_num_output(10);
+  inner_product_param->mutable_weight_filler()->set_type("uniform");
+  inner_product_param->mutable_weight_filler()->set_min(-1);
+  inner_product_param->mutable_bias_filler()->set_type("gaussian");
+  InnerProductLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Three quarters of the weights zero, a whole output's among them
+  Dtype* weights = layer.blobs()[0]->mutable_cpu_data();
+  for (int i = 0; i < layer.blobs()[0]->count(); ++i) {
+    if (i % 4 != 0 || i < 60) {
+      weights[i] = 0;
+    }
+  }
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  Blob<Dtype> ref_top;
+  ref_top.CopyFrom(*this->blob_top_, false, true);
+  layer_param.set_phase(TEST);
+  layer_param.mutable_sparsity_param();
+  InnerProductLayer<Dtype> sparse_layer(layer_param);
+  sparse_layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    sparse_layer.blobs()[i]->CopyFrom(*layer.blobs()[i]);
+  }
+  sparse_layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int i = 0; i < ref_top.count(); ++i) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[i], ref_top.cpu_data()[i], 1e-4);
+  }
+}
+
+TYPED_TEST(InnerProductLayerTest, TestSparse) {
+  typedef typename TypeParam::Dtype Dtype;
+  // A dense input with about a third of its values nonzero, and its rows in
+  // compressed sparse row form
+  const int num = 6;
+  const int dim = 8;
+  Blob<Dtype> dense(num, dim, 1, 1);
+  Blob<Dtype> values;
+  Blob<Dtype> indices;
+  Blob<Dtype> offsets(num + 1, 1, 1, 1);
+  vector<Dtype> nonzeros;
+  vector<Dtype> columns;
+  for (int m = 0; m < num; ++m) {
+    offsets.mutable_cpu_data()[m] = nonzeros.size();
+    for (int k = 0; k < dim; ++k) {
+      const bool nonzero = caffe_rng_rand() % 3 == 0;
+      dense.mutable_cpu_data()[m * dim + k] = nonzero ? m - k - 0.5 : 0;
+      if (nonzero) {
+        nonzeros.push_back(m - k - 0.5);
+        columns.push_back(k);
+      }
+    }
+  }
+  offsets.mutable_cpu_data()[num] = nonzeros.size();
+  values.Reshape(vector<int>(1, nonzeros.size()));
+  indices.Reshape(vector<int>(1, columns.size()));
+  caffe_copy(values.count(), &nonzeros[0], values.mutable_cpu_data());
+  caffe_copy(indices.count(), &columns[0], indices.mutable_cpu_data());
+
+  LayerParameter layer_param;
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  inner_product_param->set_num_output(5);
+  inner_product_param->mutable_weight_filler()->set_type("gaussian");
+  inner_product_param->mutable_bias_filler()->set_type("gaussian");
+  InnerProductLayer<Dtype> dense_layer(layer_param);
+  vector<Blob<Dtype>*> dense_bottom_vec(1, &dense);
+  Blob<Dtype> dense_top;
+  vector<Blob<Dtype>*> dense_top_vec(1, &dense_top);
+  dense_layer.SetUp(dense_bottom_vec, dense_top_vec);
+  inner_product_param->set_sparse_dim(dim);
+  InnerProductLayer<Dtype> layer(layer_param);
+  this->blob_bottom_vec_.push_back(&values);
+  this->blob_bottom_vec_.push_back(&indices);
+  this->blob_bottom_vec_.push_back(&offsets);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  ASSERT_EQ(this->blob_top_->num_axes(), 2);
+  EXPECT_EQ(this->blob_top_->shape(0), num);
+  EXPECT_EQ(this->blob_top_->shape(1), 5);
+  for (int i = 0; i < 2; ++i) {
+    layer.blobs()[i]->CopyFrom(*dense_layer.blobs()[i]);
+    caffe_set(layer.blobs()[i]->count(), Dtype(0),
+        layer.blobs()[i]->mutable_cpu_diff());
+    caffe_set(dense_layer.blobs()[i]->count(), Dtype(0),
+        dense_layer.blobs()[i]->mutable_cpu_diff());
+  }
+  dense_layer.Forward(dense_bottom_vec, dense_top_vec);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int i = 0; i < dense_top.count(); ++i) {
+    EXPECT_NEAR(dense_top.cpu_data()[i], this->blob_top_->cpu_data()[i],
+        1e-4);
+  }
+  // The same gradient gives the same weight and bias gradients.
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(&dense_top);
+  caffe_copy(dense_top.count(), dense_top.cpu_data(),
+      dense_top.mutable_cpu_diff());
+  caffe_copy(dense_top.count(), dense_top.cpu_data(),
+      this->blob_top_->mutable_cpu_diff());
+  dense_layer.Backward(dense_top_vec, vector<bool>(1, false),
+      dense_bottom_vec);
+  layer.Backward(this->blob_top_vec_, vector<bool>(3, false),
+      this->blob_bottom_vec_);
+  for (int i = 0; i < 2; ++i) {
+    const Blob<Dtype>& expected = *dense_layer.blobs()[i];
+    for (int j = 0; j < expected.count(); ++j) {
+      EXPECT_NEAR(expected.cpu_diff()[j], layer.blobs()[i]->cpu_diff()[j],
+          1e-4);
+    }
+  }
+}
+
+TYPED_TEST(InnerProductLayerTest, TestModelParallel) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_vec_.push_back(this->blob_bottom_);
+  LayerParameter layer_param;
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  inner_product_param->set_num_output(7);
+  inner_product_param->mutable_weight_filler()->set_type("uniform");
+  inner_product_param->mutable_bias_filler()->set_type("uniform");
+  // Two shards of 4 and 3 outputs, on the same GPU in GPU mode
+  inner_product_param->add_device(0);
+  inner_product_param->add_device(0);
+  ModelParallelInnerProductLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  ASSERT_EQ(4, layer.blobs().size());
+  EXPECT_EQ(4, layer.blobs()[0]->shape(0));
+  EXPECT_EQ(3, layer.blobs()[2]->shape(0));
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  // The same as one layer with the weights of the shards one after the other
+  InnerProductLayer<Dtype> reference(layer_param);
+  Blob<Dtype> reference_top;
+  vector<Blob<Dtype>*> reference_top_vec(1, &reference_top);
+  reference.SetUp(this->blob_bottom_vec_, reference_top_vec);
+  const int dim = this->blob_bottom_->count(1);
+  for (int s = 0; s < 2; ++s) {
+    const int offset = s ? 4 : 0;
+    caffe_copy(layer.blobs()[2 * s]->count(), layer.blobs()[2 * s]->cpu_data(),
+        reference.blobs()[0]->mutable_cpu_data() + offset * dim);
+    caffe_copy(layer.blobs()[2 * s + 1]->count(),
+        layer.blobs()[2 * s + 1]->cpu_data(),
+        reference.blobs()[1]->mutable_cpu_data() + offset);
+  }
+  reference.Forward(this->blob_bottom_vec_, reference_top_vec);
+  ASSERT_EQ(reference_top.count(), this->blob_top_->count());
+  for (int i = 0; i < reference_top.count(); ++i) {
+    EXPECT_NEAR(reference_top.cpu_data()[i], this->blob_top_->cpu_data()[i],
+        1e-4);
+  }
+}
+
+TYPED_TEST(InnerProductLayerTest, TestModelParallelGradient) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_vec_.push_back(this->blob_bottom_);
+  LayerParameter layer_param;
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  inner_product_param->set_num_output(7);
+  inner_product_param->mutable_weight_filler()->set_type("gaussian");
+  inner_product_param->mutable_bias_filler()->set_type("gaussian");
+  inner_product_param->add_device(0);
+  inner_product_param->add_device(0);
+  ModelParallelInnerProductLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
 }  // namespace caffe
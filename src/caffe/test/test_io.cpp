@@ -4,6 +4,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <string>
+#include <vector>
 
 #include "gtest/gtest.h"
 
@@ -419,4 +420,112 @@ TEST_F(IOTest, TestDecodeDatumToCVMatContentNative) {
   }
 }
 
+TEST_F(IOTest, TestDecodeDatumRecycled) {
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  Datum encoded, datum;
+  EXPECT_TRUE(ReadFileToDatum(filename, &encoded));
+  cv::Mat cv_img;
+  EXPECT_TRUE(DecodeDatumToCVMat(encoded, 1, &cv_img));
+  EXPECT_EQ(cv_img.channels(), 1);
+  // Decoding again into a recycled datum reuses its data
+  for (int i = 0; i < 2; ++i) {
+    datum = encoded;
+    EXPECT_TRUE(DecodeDatumNative(&datum));
+    EXPECT_EQ(datum.channels(), 3);
+    EXPECT_EQ(datum.height(), 360);
+    EXPECT_EQ(datum.width(), 480);
+    EXPECT_EQ(datum.data().size(), 3 * 360 * 480);
+  }
+  EXPECT_TRUE(DecodeDatumToCVMat(encoded, 0, &cv_img));
+  const cv::Mat cv_img_ref = ReadImageToCVMat(filename);
+  for (int h = 0; h < datum.height(); ++h) {
+    for (int w = 0; w < datum.width(); ++w) {
+      for (int c = 0; c < datum.channels(); ++c) {
+        EXPECT_EQ(cv_img.at<cv::Vec3b>(h, w)[c],
+                  cv_img_ref.at<cv::Vec3b>(h, w)[c]);
+        EXPECT_EQ(static_cast<uint8_t>(
+            datum.data()[(c * datum.height() + h) * datum.width() + w]),
+            cv_img_ref.at<cv::Vec3b>(h, w)[c]);
+      }
+    }
+  }
+}
+
+TEST_F(IOTest, TestRawRecord) {
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  Datum datum;
+  EXPECT_TRUE(ReadImageToDatum(filename, 7, &datum));
+  string record;
+  DatumToRawRecord(datum, &record);
+  EXPECT_TRUE(IsRawRecord(record.data(), record.size()));
+  Datum parsed;
+  EXPECT_TRUE(ParseDatum(record.data(), record.size(), &parsed));
+  EXPECT_EQ(datum.SerializeAsString(), parsed.SerializeAsString());
+  // Truncated records are rejected
+  EXPECT_FALSE(ParseDatum(record.data(), record.size() - 1, &parsed));
+}
+
+TEST_F(IOTest, TestRawRecordEncoded) {
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  Datum datum;
+  EXPECT_TRUE(ReadImageToDatum(filename, 1, std::string("jpg"), &datum));
+  string record;
+  DatumToRawRecord(datum, &record);
+  Datum parsed;
+  EXPECT_TRUE(ParseDatum(record.data(), record.size(), &parsed));
+  EXPECT_TRUE(parsed.encoded());
+  EXPECT_EQ(datum.data(), parsed.data());
+  EXPECT_EQ(1, parsed.label());
+}
+
+TEST_F(IOTest, TestRawRecordFloat) {
+  Datum datum;
+  datum.set_channels(2);
+  datum.set_height(1);
+  datum.set_width(3);
+  datum.set_label(-2);
+  for (int i = 0; i < 6; ++i) {
+    datum.add_float_data(i * 0.5f);
+  }
+  string record;
+  DatumToRawRecord(datum, &record);
+  Datum parsed;
+  EXPECT_TRUE(ParseDatum(record.data(), record.size(), &parsed));
+  EXPECT_EQ(2, parsed.channels());
+  EXPECT_EQ(1, parsed.height());
+  EXPECT_EQ(3, parsed.width());
+  EXPECT_EQ(-2, parsed.label());
+  EXPECT_FALSE(parsed.encoded());
+  EXPECT_EQ(0, parsed.data().size());
+  ASSERT_EQ(6, parsed.float_data_size());
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(i * 0.5f, parsed.float_data(i));
+  }
+}
+
+TEST_F(IOTest, TestParseDatumProto) {
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  Datum datum;
+  EXPECT_TRUE(ReadImageToDatum(filename, 3, &datum));
+  const string serialized = datum.SerializeAsString();
+  EXPECT_FALSE(IsRawRecord(serialized.data(), serialized.size()));
+  Datum parsed;
+  EXPECT_TRUE(ParseDatum(serialized.data(), serialized.size(), &parsed));
+  EXPECT_EQ(serialized, parsed.SerializeAsString());
+}
+
+TEST_F(IOTest, TestShardBounds) {
+  const size_t sizes[] = {4, 1, 1, 2, 8};
+  const vector<int> bounds =
+      ShardBounds(vector<size_t>(sizes, sizes + 5), 2);
+  ASSERT_EQ(bounds.size(), 3);
+  EXPECT_EQ(bounds[0], 0);
+  EXPECT_EQ(bounds[1], 4);
+  EXPECT_EQ(bounds[2], 5);
+  EXPECT_EQ(ShardFilename("/tmp/a.caffemodel", 1, true),
+      "a.caffemodel.shard1.gz");
+  EXPECT_EQ(ShardPath("/tmp/a.caffemodel", "a.caffemodel.shard1"),
+      "/tmp/a.caffemodel.shard1");
+}
+
 }  // namespace caffe
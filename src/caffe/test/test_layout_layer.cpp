@@ -0,0 +1,99 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/common_layers.hpp"
+#include "caffe/filler.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class LayoutLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  LayoutLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 3, 4, 5)),
+        blob_top_(new Blob<Dtype>()),
+        blob_back_(new Blob<Dtype>()) {
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~LayoutLayerTest() {
+    delete blob_bottom_;
+    delete blob_top_;
+    delete blob_back_;
+  }
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  Blob<Dtype>* const blob_back_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(LayoutLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(LayoutLayerTest, TestForward) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  LayoutLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(NHWC, this->blob_top_->layout());
+  EXPECT_EQ(this->blob_bottom_->shape(), this->blob_top_->shape());
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Channels innermost
+  EXPECT_EQ(this->blob_bottom_->data_at(1, 2, 3, 4),
+            this->blob_top_->cpu_data()[((1 * 4 + 3) * 5 + 4) * 3 + 2]);
+  // And back
+  layer_param.mutable_layout_param()->set_layout(NCHW);
+  LayoutLayer<Dtype> back(layer_param);
+  vector<Blob<Dtype>*> back_vec(1, this->blob_back_);
+  back.SetUp(this->blob_top_vec_, back_vec);
+  EXPECT_EQ(NCHW, this->blob_back_->layout());
+  back.Forward(this->blob_top_vec_, back_vec);
+  for (int n = 0; n < 2; ++n) {
+    for (int c = 0; c < 3; ++c) {
+      for (int h = 0; h < 4; ++h) {
+        for (int w = 0; w < 5; ++w) {
+          EXPECT_EQ(this->blob_bottom_->data_at(n, c, h, w),
+                    this->blob_top_->data_at(n, c, h, w));
+        }
+      }
+    }
+  }
+  for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+    EXPECT_EQ(this->blob_bottom_->cpu_data()[i],
+              this->blob_back_->cpu_data()[i]);
+  }
+}
+
+TYPED_TEST(LayoutLayerTest, TestGradient) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  LayoutLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(LayoutLayerTest, TestGradientToNCHW) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_->set_layout(NHWC);
+  LayerParameter layer_param;
+  layer_param.mutable_layout_param()->set_layout(NCHW);
+  LayoutLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+}  // namespace caffe
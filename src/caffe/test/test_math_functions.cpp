@@ -1,14 +1,17 @@
 #include <stdint.h>  // for uint32_t & uint64_t
 #include <time.h>
+#include <algorithm>
 #include <climits>
 #include <cmath>  // for std::fabs
 #include <cstdlib>  // for rand_r
+#include <vector>
 
 #include "gtest/gtest.h"
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
+#include "caffe/syncedmem.hpp"
 #include "caffe/util/math_functions.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -150,6 +153,38 @@ TYPED_TEST(CPUMathFunctionsTest, TestCopy) {
   }
 }
 
+TYPED_TEST(CPUMathFunctionsTest, TestTopK) {
+  const int n = this->blob_bottom_->count();
+  const int k = n / 10;
+  TypeParam* x = this->blob_bottom_->mutable_cpu_data();
+  // A tie at the threshold
+  x[1] = x[3];
+  vector<TypeParam> original(x, x + n);
+  vector<TypeParam> values(k);
+  vector<int> indices(k);
+  caffe_cpu_top_k<TypeParam>(n, k, x, &values[0], &indices[0]);
+  TypeParam smallest = std::fabs(values[0]);
+  for (int e = 0; e < k; ++e) {
+    if (e > 0) {
+      EXPECT_GT(indices[e], indices[e - 1]);
+    }
+    EXPECT_EQ(values[e], original[indices[e]]);
+    EXPECT_EQ(x[indices[e]], 0);
+    smallest = std::min(smallest, std::fabs(values[e]));
+  }
+  // The others are left, and none larger than those taken
+  int zeroed = 0;
+  for (int i = 0; i < n; ++i) {
+    if (x[i] == 0) {
+      ++zeroed;
+    } else {
+      EXPECT_EQ(x[i], original[i]);
+      EXPECT_LE(std::fabs(x[i]), smallest);
+    }
+  }
+  EXPECT_EQ(zeroed, k);
+}
+
 #ifndef CPU_ONLY
 
 template <typename Dtype>
@@ -240,6 +275,26 @@ TYPED_TEST(GPUMathFunctionsTest, TestCopy) {
   }
 }
 
+TYPED_TEST(GPUMathFunctionsTest, TestHalfWithResidual) {
+  const int n = this->blob_bottom_->count();
+  SyncedMemory half(n * sizeof(uint16_t));
+  uint16_t* half_data = static_cast<uint16_t*>(half.mutable_gpu_data());
+  TypeParam* residual = this->blob_bottom_->mutable_gpu_diff();
+  caffe_gpu_set<TypeParam>(n, 0, residual);
+  caffe_gpu_to_half<TypeParam>(n, this->blob_bottom_->gpu_data(), half_data,
+                               residual);
+  caffe_gpu_from_half<TypeParam>(n, half_data,
+                                 this->blob_top_->mutable_gpu_data());
+  const TypeParam* x = this->blob_bottom_->cpu_data();
+  const TypeParam* rounded = this->blob_top_->cpu_data();
+  residual = this->blob_bottom_->mutable_cpu_diff();
+  for (int i = 0; i < n; ++i) {
+    // 11 significant bits, less for subnormals
+    EXPECT_NEAR(x[i], rounded[i], std::fabs(x[i]) / 1024 + 1e-7);
+    EXPECT_NEAR(x[i], rounded[i] + residual[i], 1e-6);
+  }
+}
+
 #endif
 
 
@@ -113,6 +113,84 @@ TYPED_TEST(MemoryDataLayerTest, TestForward) {
   }
 }
 
+#ifndef CPU_ONLY
+// The tops use device data in place in GPU mode
+TYPED_TEST(MemoryDataLayerTest, TestForwardResetGPU) {
+  typedef typename TypeParam::Dtype Dtype;
+  if (Caffe::mode() != Caffe::GPU) {
+    return;
+  }
+  LayerParameter layer_param;
+  MemoryDataParameter* md_param = layer_param.mutable_memory_data_param();
+  md_param->set_batch_size(this->batch_size_);
+  md_param->set_channels(this->channels_);
+  md_param->set_height(this->height_);
+  md_param->set_width(this->width_);
+  MemoryDataLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.ResetGPU(this->data_->mutable_gpu_data(),
+      this->labels_->mutable_gpu_data(), this->data_->num());
+  for (int i = 0; i < this->batches_ * 2; ++i) {
+    const int batch_num = i % this->batches_;
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    EXPECT_EQ(this->data_->gpu_data() +
+        this->data_->offset(this->batch_size_ * batch_num),
+        this->data_blob_->gpu_data());
+    for (int j = 0; j < this->label_blob_->count(); ++j) {
+      EXPECT_EQ(this->labels_->cpu_data()[this->batch_size_ * batch_num + j],
+          this->label_blob_->cpu_data()[j]);
+    }
+  }
+}
+#endif
+
+// Data added while the current data is used only replaces it once consumed
+TYPED_TEST(MemoryDataLayerTest, TestAddWhileConsuming) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  MemoryDataParameter* memory_data_param = param.mutable_memory_data_param();
+  memory_data_param->set_batch_size(this->batch_size_);
+  memory_data_param->set_channels(this->channels_);
+  memory_data_param->set_height(this->height_);
+  memory_data_param->set_width(this->width_);
+  MemoryDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Two inputs of two batches, of pixels equal to the input and labels
+  // counting the items of both inputs
+  const int items = this->batch_size_ * 2;
+  vector<Datum> inputs[2];
+  for (int input = 0; input < 2; ++input) {
+    inputs[input].resize(items);
+    for (int i = 0; i < items; ++i) {
+      inputs[input][i].set_channels(this->channels_);
+      inputs[input][i].set_height(this->height_);
+      inputs[input][i].set_width(this->width_);
+      inputs[input][i].set_data(string(this->channels_ * this->height_ *
+          this->width_, static_cast<char>(input)));
+      inputs[input][i].set_label(input * items + i);
+    }
+  }
+  layer.AddDatumVector(inputs[0]);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  const Dtype* first = this->data_blob_->cpu_data();
+  layer.AddDatumVector(inputs[1]);
+  // Staging left the tops alone
+  EXPECT_EQ(first, this->data_blob_->cpu_data());
+  EXPECT_EQ(0, this->data_blob_->cpu_data()[0]);
+  // The rest of the first input, the second, then the second again
+  const int expected_inputs[] = {0, 1, 1, 1, 1};
+  const int expected_batches[] = {1, 0, 1, 0, 1};
+  for (int i = 0; i < 5; ++i) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    const int input = expected_inputs[i];
+    EXPECT_EQ(input, this->data_blob_->cpu_data()[0]);
+    for (int j = 0; j < this->batch_size_; ++j) {
+      EXPECT_EQ(input * items + expected_batches[i] * this->batch_size_ + j,
+          this->label_blob_->cpu_data()[j]);
+    }
+  }
+}
+
 TYPED_TEST(MemoryDataLayerTest, AddDatumVectorDefaultTransform) {
   typedef typename TypeParam::Dtype Dtype;
 
@@ -0,0 +1,65 @@
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/metrics.hpp"
+#include "caffe/util/socket.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class MetricsTest : public ::testing::Test {
+ protected:
+  // The whole response to a request, the server closing the connection
+  string Request(int port, const string& request) {
+    shared_ptr<Socket> socket = Socket::connect("localhost", port);
+    socket->send(request.data(), request.size());
+    string response;
+    char c;
+    while (socket->try_recv(&c, 1)) {
+      response += c;
+    }
+    return response;
+  }
+
+  Metrics metrics_;
+};
+
+TEST_F(MetricsTest, TestText) {
+  metrics_.add("caffe_items_total", Metrics::COUNTER, "", 2);
+  metrics_.add("caffe_items_total", Metrics::COUNTER, "", 3);
+  metrics_.set("caffe_loss", Metrics::GAUGE, "layer=\"a\"", 0.5);
+  metrics_.set("caffe_loss", Metrics::GAUGE, "layer=\"b\"", 1);
+  metrics_.set("caffe_loss", Metrics::GAUGE, "layer=\"a\"", 0.25);
+  EXPECT_EQ(5, metrics_.get("caffe_items_total", ""));
+  EXPECT_EQ(0.25, metrics_.get("caffe_loss", "layer=\"a\""));
+  EXPECT_EQ(0, metrics_.get("caffe_loss", "layer=\"c\""));
+  EXPECT_EQ(0, metrics_.get("caffe_unknown", ""));
+  EXPECT_EQ("# TYPE caffe_items_total counter\n"
+            "caffe_items_total 5\n"
+            "# TYPE caffe_loss gauge\n"
+            "caffe_loss{layer=\"a\"} 0.25\n"
+            "caffe_loss{layer=\"b\"} 1\n", metrics_.text());
+}
+
+TEST_F(MetricsTest, TestServe) {
+  const int port = 27520;
+  // Outlives the thread serving it
+  static Metrics metrics;
+  metrics.set("caffe_train_iteration", Metrics::GAUGE, "", 1000);
+  metrics.Serve(port);
+  const string response = Request(port,
+      "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  EXPECT_EQ(0, response.find("HTTP/1.1 200 OK\r\n"));
+  const string body = response.substr(response.find("\r\n\r\n") + 4);
+  EXPECT_EQ("# TYPE caffe_train_iteration gauge\n"
+            "caffe_train_iteration 1000\n", body);
+  EXPECT_EQ(0, Request(port, "GET /other HTTP/1.1\r\n\r\n")
+            .find("HTTP/1.1 404"));
+  EXPECT_EQ(0, Request(port, "POST /metrics HTTP/1.1\r\n\r\n")
+            .find("HTTP/1.1 405"));
+}
+
+}  // namespace caffe
@@ -0,0 +1,96 @@
+#include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/model_server.hpp"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class ModelServerTest : public ::testing::Test {
+ protected:
+  ModelServerTest() : server_(4, 1000) {
+    Caffe::set_mode(Caffe::CPU);
+    string model;
+    MakeTempFilename(&model);
+    std::ofstream outfile(model.c_str(), std::ofstream::out);
+    outfile << "name: 'ServerNetwork' "
+        "input: 'data' "
+        "input_dim: 1 "
+        "input_dim: 6 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { "
+        "  name: 'ip' "
+        "  type: 'InnerProduct' "
+        "  bottom: 'data' "
+        "  top: 'ip' "
+        "  inner_product_param { "
+        "    num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 1 } "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'prob' "
+        "  type: 'Softmax' "
+        "  bottom: 'ip' "
+        "  top: 'prob' "
+        "} ";
+    outfile.close();
+    server_.AddModel("net", model, "", vector<int>(1, -1), 2);
+  }
+
+  ModelServer server_;
+};
+
+TEST_F(ModelServerTest, TestPredict) {
+  vector<float> input(2 * 6);
+  for (int i = 0; i < input.size(); ++i) {
+    input[i] = (i % 5) * 0.5 - 1;
+  }
+  const string body(reinterpret_cast<const char*>(&input[0]),
+                    input.size() * sizeof(float));
+  string type;
+  string response;
+  ASSERT_EQ(server_.Handle("POST", "/models/net", body, &type, &response),
+            200);
+  EXPECT_EQ(type, "application/octet-stream");
+  ASSERT_EQ(response.size(), 2 * 3 * sizeof(float));
+  vector<float> output(2 * 3);
+  memcpy(&output[0], response.data(), response.size());
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_NEAR(output[i * 3] + output[i * 3 + 1] + output[i * 3 + 2], 1,
+                1e-5);
+  }
+  EXPECT_EQ(server_.Handle("GET", "/metrics", "", &type, &response), 200);
+  EXPECT_NE(response.find("caffe_requests_total{model=\"net\"} 1\n"),
+            string::npos);
+  EXPECT_NE(response.find("caffe_items_total{model=\"net\"} 2\n"),
+            string::npos);
+  EXPECT_NE(response.find(
+      "caffe_request_latency_seconds_bucket{model=\"net\",le=\"+Inf\"} 1\n"),
+      string::npos);
+}
+
+TEST_F(ModelServerTest, TestErrors) {
+  string type;
+  string response;
+  EXPECT_EQ(server_.Handle("POST", "/models/other", "", &type, &response),
+            404);
+  EXPECT_EQ(server_.Handle("GET", "/models/net", "", &type, &response), 405);
+  EXPECT_EQ(server_.Handle("POST", "/models/net", string(10, 0), &type,
+                           &response), 400);
+  EXPECT_EQ(server_.Handle("GET", "/models", "", &type, &response), 200);
+  EXPECT_EQ(response, "net input 6 output 3 instances 2\n");
+  EXPECT_EQ(server_.Handle("GET", "/metrics", "", &type, &response), 200);
+  EXPECT_NE(response.find("caffe_request_errors_total{model=\"net\"} 1\n"),
+            string::npos);
+}
+
+}  // namespace caffe
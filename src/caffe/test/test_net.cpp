@@ -1,3 +1,11 @@
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>  // NOLINT(readability/streams)
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
@@ -9,7 +17,9 @@
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/net.hpp"
+#include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/upgrade_proto.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 #include "caffe/test/test_gradient_check_util.hpp"
@@ -428,7 +438,7 @@ class NetTest : public MultiDeviceTest<TypeParam> {
     InitNetFromProtoString(proto);
   }
 
-  virtual void InitDiffDataUnsharedWeightsNet() {
+  virtual void InitDiffDataUnsharedWeightsNet(const string& state = "") {
     const string& proto =
         "name: 'DiffDataUnsharedWeightsNetwork' "
         "layer { "
@@ -487,7 +497,7 @@ class NetTest : public MultiDeviceTest<TypeParam> {
         "  bottom: 'data2' "
         "  bottom: 'innerproduct2' "
         "} ";
-    InitNetFromProtoString(proto);
+    InitNetFromProtoString(state + proto);
   }
 
   virtual void InitDiffDataSharedWeightsNet() {
@@ -552,8 +562,8 @@ class NetTest : public MultiDeviceTest<TypeParam> {
     InitNetFromProtoString(proto);
   }
 
-  virtual void InitReshapableNet() {
-    const string& proto =
+  virtual void InitReshapableNet(const bool reuse_activations = false) {
+    string proto =
         "name: 'ReshapableNetwork' "
         "input: 'data' "
         "input_dim: 1 "
@@ -611,6 +621,9 @@ class NetTest : public MultiDeviceTest<TypeParam> {
         "  bottom: 'norm1' "
         "  top: 'softmax' "
         "} ";
+    if (reuse_activations) {
+      proto += "reuse_activations: true ";
+    }
     InitNetFromProtoString(proto);
   }
 
@@ -713,6 +726,619 @@ class NetTest : public MultiDeviceTest<TypeParam> {
     InitNetFromProtoString(proto);
   }
 
+  // ip1, relu1, ip2 and ip4, relu4, ip5 form two segments around ip3, or
+  // with offload, have their tops offloaded
+  virtual void InitRecomputeNet(const bool recompute,
+                                const bool offload = false,
+                                const bool placed = false) {
+    const char* names[] = {"ip1", "relu1", "ip2", "ip3", "ip4", "relu4", "ip5"};
+    string proto =
+        "name: 'RecomputeNetwork' "
+        "input: 'data' "
+        "input_dim: 4 "
+        "input_dim: 6 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "input: 'label' "
+        "input_dim: 4 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 ";
+    string bottom = "data";
+    for (int i = 0; i < 7; ++i) {
+      const string name = names[i];
+      const bool relu = name.find("relu") == 0;
+      proto += "layer { name: '" + name + "' bottom: '" + bottom + "' ";
+      if (relu) {
+        proto += "type: 'ReLU' top: '" + bottom + "' ";
+      } else {
+        proto += "type: 'InnerProduct' top: '" + name + "' "
+            "inner_product_param { num_output: 3 "
+            "  weight_filler { type: 'gaussian' std: 0.5 } "
+            "  bias_filler { type: 'constant' value: 0.1 } } ";
+        bottom = name;
+      }
+      if (recompute && name != "ip3") {
+        proto += "recompute: true ";
+      }
+      if (offload && name != "ip3") {
+        proto += "offload: true ";
+      }
+      if (placed && (name == "ip2" || name == "ip4" || name == "relu4")) {
+        proto += "device: CPU ";
+      }
+      proto += "} ";
+    }
+    proto +=
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'ip5' "
+        "  bottom: 'label' "
+        "} ";
+    InitNetFromProtoString(proto);
+  }
+
+  virtual void InitBranchNet(const int branch_threads,
+                             const bool cuda_stream = false,
+                             const bool tensor_op_math = false,
+                             const string& pipeline = "") {
+    ostringstream proto;
+    proto <<
+        "name: 'BranchNetwork' "
+        "branch_threads: " << branch_threads << " "
+        "cuda_stream: " << (cuda_stream ? "true" : "false") << " "
+        "tensor_op_math: " << (tensor_op_math ? "true" : "false") << " "
+        << pipeline <<
+        "input: 'data' "
+        "input_dim: 4 "
+        "input_dim: 6 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "input: 'label' "
+        "input_dim: 4 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 ";
+    // Four branches between the split of data and a concat
+    for (int i = 0; i < 4; ++i) {
+      proto <<
+          "layer { name: 'ip" << i << "' type: 'InnerProduct' "
+          "  bottom: 'data' top: 'ip" << i << "' "
+          "  inner_product_param { num_output: " << i + 2 << " "
+          "    weight_filler { type: 'gaussian' std: 0.5 } "
+          "    bias_filler { type: 'constant' value: 0.1 } } } "
+          "layer { name: 'relu" << i << "' type: 'ReLU' "
+          "  bottom: 'ip" << i << "' top: 'ip" << i << "' } ";
+    }
+    proto <<
+        "layer { "
+        "  name: 'concat' "
+        "  type: 'Concat' "
+        "  bottom: 'ip0' "
+        "  bottom: 'ip1' "
+        "  bottom: 'ip2' "
+        "  bottom: 'ip3' "
+        "  top: 'concat' "
+        "} "
+        "layer { "
+        "  name: 'out' "
+        "  type: 'InnerProduct' "
+        "  bottom: 'concat' "
+        "  top: 'out' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } "
+        "} "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'out' "
+        "  bottom: 'label' "
+        "} ";
+    InitNetFromProtoString(proto.str());
+  }
+
+  virtual void InitFuseReLUNet(const bool fuse_relu) {
+    string proto =
+        "name: 'FuseReLUNetwork' "
+        "input: 'data' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 5 "
+        "input_dim: 5 "
+        "input: 'label' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { name: 'conv1' type: 'Convolution' "
+        "  bottom: 'data' top: 'conv1' "
+        "  convolution_param { num_output: 4 kernel_size: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } "
+        "    bias_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'relu1' type: 'ReLU' "
+        "  bottom: 'conv1' top: 'conv1' } "
+        "layer { name: 'conv2' type: 'Convolution' "
+        "  bottom: 'conv1' top: 'conv2' "
+        "  convolution_param { num_output: 4 kernel_size: 1 bias_term: false "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'relu2' type: 'ReLU' "
+        "  bottom: 'conv2' top: 'conv2' relu_param { negative_slope: 0.1 } } "
+        "layer { name: 'ip1' type: 'InnerProduct' "
+        "  bottom: 'conv2' top: 'ip1' "
+        "  inner_product_param { num_output: 5 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } "
+        "    bias_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'relu3' type: 'ReLU' "
+        "  bottom: 'ip1' top: 'ip1' } "
+        "layer { name: 'ip2' type: 'InnerProduct' "
+        "  bottom: 'ip1' top: 'ip2' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'relu4' type: 'ReLU' "
+        "  bottom: 'ip2' top: 'relu4' } "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'relu4' "
+        "  bottom: 'label' "
+        "} ";
+    if (fuse_relu) {
+      proto += "fuse_relu: true ";
+    }
+    InitNetFromProtoString(proto);
+  }
+
+  virtual void InitFuseElementwiseNet(const bool fuse_elementwise) {
+    string proto =
+        "name: 'FuseElementwiseNetwork' "
+        "input: 'data' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 4 "
+        "input_dim: 4 "
+        "input: 'label' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { name: 'ip1' type: 'InnerProduct' "
+        "  bottom: 'data' top: 'ip1' "
+        "  inner_product_param { num_output: 6 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } "
+        "    bias_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'sig1' type: 'Sigmoid' bottom: 'ip1' top: 'ip1' } "
+        "layer { name: 'tanh1' type: 'TanH' bottom: 'ip1' top: 'tanh1' } "
+        "layer { name: 'pow1' type: 'Power' bottom: 'tanh1' top: 'pow1' "
+        "  power_param { power: 2 shift: 1 } } "
+        "layer { name: 'ip2' type: 'InnerProduct' "
+        "  bottom: 'pow1' top: 'ip2' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } "
+        "    bias_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'sig2' type: 'Sigmoid' bottom: 'ip2' top: 'ip2' } "
+        "layer { name: 'relu2' type: 'ReLU' bottom: 'ip2' top: 'ip2' "
+        "  relu_param { negative_slope: 0.1 } } "
+        "layer { name: 'exp3' type: 'Exp' bottom: 'ip2' top: 'exp3' } "
+        "layer { name: 'log3' type: 'Log' bottom: 'exp3' top: 'log3' "
+        "  log_param { base: 2 shift: 1 } } "
+        "layer { name: 'abs3' type: 'AbsVal' bottom: 'log3' top: 'abs3' } "
+        "layer { name: 'sum' type: 'Eltwise' "
+        "  bottom: 'ip2' bottom: 'exp3' bottom: 'abs3' top: 'sum' } "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'sum' "
+        "  bottom: 'label' "
+        "} ";
+    if (fuse_elementwise) {
+      proto += "fuse_elementwise: true ";
+    }
+    InitNetFromProtoString(proto);
+  }
+
+  virtual void InitLayoutNet(const bool nhwc) {
+    string proto =
+        "name: 'LayoutNetwork' "
+        "input: 'data' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 6 "
+        "input_dim: 6 "
+        "input: 'label' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { name: 'conv1' type: 'Convolution' "
+        "  bottom: 'data' top: 'conv1' "
+        "  convolution_param { num_output: 4 kernel_size: 3 pad: 1 "
+        "    weight_filler { type: 'gaussian' std: 0.2 } "
+        "    bias_filler { type: 'gaussian' std: 0.2 } } } "
+        "layer { name: 'relu1' type: 'ReLU' "
+        "  bottom: 'conv1' top: 'conv1' } "
+        "layer { name: 'conv2' type: 'Convolution' "
+        "  bottom: 'conv1' top: 'conv2' "
+        "  convolution_param { num_output: 4 kernel_size: 1 "
+        "    weight_filler { type: 'gaussian' std: 0.2 } "
+        "    bias_filler { type: 'gaussian' std: 0.2 } } } "
+        "layer { name: 'sum' type: 'Eltwise' "
+        "  bottom: 'conv1' bottom: 'conv2' top: 'sum' } "
+        "layer { name: 'pool' type: 'Pooling' "
+        "  bottom: 'sum' top: 'pool' "
+        "  pooling_param { pool: MAX kernel_size: 2 stride: 2 } } "
+        "layer { name: 'conv3' type: 'Convolution' "
+        "  bottom: 'pool' top: 'conv3' "
+        "  convolution_param { num_output: 2 kernel_size: 3 pad: 1 "
+        "    weight_filler { type: 'gaussian' std: 0.2 } } } "
+        "layer { name: 'concat' type: 'Concat' "
+        "  bottom: 'pool' bottom: 'conv3' top: 'concat' } "
+        "layer { name: 'relu2' type: 'ReLU' "
+        "  bottom: 'concat' top: 'concat' relu_param { negative_slope: 0.1 } } "
+        "layer { name: 'pool2' type: 'Pooling' "
+        "  bottom: 'concat' top: 'pool2' "
+        "  pooling_param { pool: AVE kernel_size: 3 } } "
+        "layer { name: 'ip' type: 'InnerProduct' "
+        "  bottom: 'concat' top: 'ip' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.2 } } } "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'ip' "
+        "  bottom: 'label' "
+        "} ";
+    if (nhwc) {
+      proto += "layout: NHWC ";
+    }
+    InitNetFromProtoString(proto);
+  }
+
+  virtual void InitEngineNet(const string& engine) {
+    string proto =
+        "name: 'EngineNetwork' "
+        "input: 'data' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 6 "
+        "input_dim: 6 "
+        "input: 'label' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { name: 'conv1' type: 'Convolution' "
+        "  bottom: 'data' top: 'conv1' "
+        "  convolution_param { num_output: 4 kernel_size: 3 pad: 1 "
+        "    engine: " + engine + " "
+        "    weight_filler { type: 'gaussian' std: 0.2 } "
+        "    bias_filler { type: 'gaussian' std: 0.2 } } } "
+        "layer { name: 'conv2' type: 'Convolution' "
+        "  bottom: 'conv1' top: 'conv2' "
+        "  convolution_param { num_output: 4 kernel_size: 1 "
+        "    engine: " + engine + " "
+        "    weight_filler { type: 'gaussian' std: 0.2 } } } "
+        "layer { name: 'pool' type: 'Pooling' "
+        "  bottom: 'conv2' top: 'pool' "
+        "  pooling_param { pool: MAX kernel_size: 2 stride: 2 "
+        "    engine: " + engine + " } } "
+        "layer { name: 'ip' type: 'InnerProduct' "
+        "  bottom: 'pool' top: 'ip' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.2 } } } "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'ip' "
+        "  bottom: 'label' "
+        "} ";
+    InitNetFromProtoString(proto);
+  }
+
+  virtual void InitStaticShapesNet(const bool static_shapes) {
+    string proto =
+        "name: 'StaticShapesNetwork' "
+        "input: 'data' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 5 "
+        "input_dim: 5 "
+        "input: 'label' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { name: 'conv' type: 'Convolution' "
+        "  bottom: 'data' top: 'conv' "
+        "  convolution_param { num_output: 4 kernel_size: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } "
+        "    bias_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'relu' type: 'ReLU' "
+        "  bottom: 'conv' top: 'conv' } "
+        "layer { name: 'flatten' type: 'Flatten' "
+        "  bottom: 'conv' top: 'flatten' } "
+        "layer { name: 'ip' type: 'InnerProduct' "
+        "  bottom: 'flatten' top: 'ip' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'ip' "
+        "  bottom: 'label' "
+        "} ";
+    if (static_shapes) {
+      proto += "static_shapes: true ";
+    }
+    InitNetFromProtoString(proto);
+  }
+
+  virtual void InitMicroBatchNet(const int micro_batch) {
+    string proto =
+        "name: 'MicroBatchNetwork' "
+        "input: 'data' "
+        "input_dim: 5 "
+        "input_dim: 3 "
+        "input_dim: 5 "
+        "input_dim: 5 "
+        "input: 'label' "
+        "input_dim: 5 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { name: 'conv' type: 'Convolution' "
+        "  bottom: 'data' top: 'conv' "
+        "  convolution_param { num_output: 4 kernel_size: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } "
+        "    bias_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'relu' type: 'ReLU' "
+        "  bottom: 'conv' top: 'conv' } "
+        "layer { name: 'flatten' type: 'Flatten' "
+        "  bottom: 'conv' top: 'flatten' } "
+        "layer { name: 'ip' type: 'InnerProduct' "
+        "  bottom: 'flatten' top: 'ip' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'prob' type: 'Softmax' "
+        "  bottom: 'ip' top: 'prob' } "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'ip' "
+        "  bottom: 'label' "
+        "  top: 'loss' "
+        "} ";
+    proto += "micro_batch: " + boost::lexical_cast<string>(micro_batch);
+    InitNetFromProtoString(proto);
+  }
+
+  virtual void InitInputBucketNet(const bool buckets) {
+    string proto =
+        "name: 'InputBucketNetwork' "
+        "input: 'data' "
+        "input_shape { dim: 1 dim: 2 dim: 4 dim: 4 } "
+        "layer { name: 'conv1' type: 'Convolution' "
+        "  bottom: 'data' top: 'conv1' "
+        "  convolution_param { num_output: 3 kernel_size: 3 pad: 1 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } "
+        "    bias_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'relu' type: 'ReLU' "
+        "  bottom: 'conv1' top: 'conv1' } "
+        "layer { name: 'conv2' type: 'Convolution' "
+        "  bottom: 'conv1' top: 'conv2' "
+        "  convolution_param { num_output: 2 kernel_size: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } ";
+    if (buckets) {
+      proto +=
+          "input_bucket { shape { dim: 1 dim: 2 dim: 6 dim: 6 } } "
+          "input_bucket { shape { dim: 1 dim: 2 dim: 4 dim: 4 } } ";
+    }
+    InitNetFromProtoString(proto);
+  }
+
+  virtual void InitExitNet(const float threshold) {
+    std::ostringstream proto;
+    proto <<
+        "name: 'ExitNetwork' "
+        "input: 'data' "
+        "input_shape { dim: 6 dim: 4 } "
+        "layer { name: 'ip1' type: 'InnerProduct' "
+        "  bottom: 'data' top: 'ip1' "
+        "  inner_product_param { num_output: 5 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'relu1' type: 'ReLU' "
+        "  bottom: 'ip1' top: 'ip1' } "
+        "layer { name: 'exit_ip' type: 'InnerProduct' "
+        "  bottom: 'ip1' top: 'exit_ip' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 2 } } } "
+        "layer { name: 'exit_prob' type: 'Softmax' "
+        "  bottom: 'exit_ip' top: 'exit_prob' } "
+        "layer { name: 'ip2' type: 'InnerProduct' "
+        "  bottom: 'ip1' top: 'ip2' "
+        "  inner_product_param { num_output: 5 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'relu2' type: 'ReLU' "
+        "  bottom: 'ip2' top: 'ip2' } "
+        "layer { name: 'ip3' type: 'InnerProduct' "
+        "  bottom: 'ip2' top: 'ip3' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'prob' type: 'Softmax' "
+        "  bottom: 'ip3' top: 'prob' } "
+        "state { phase: TEST } ";
+    if (threshold >= 0) {
+      proto << "exit { blob: 'exit_prob' threshold: " << threshold << " } ";
+    }
+    InitNetFromProtoString(proto.str());
+  }
+
+  virtual void InitViewNet(const bool view) {
+    const string view_param = view ? "view: true " : "";
+    string proto =
+        "name: 'ViewNetwork' "
+        "input: 'data' "
+        "input_dim: 2 "
+        "input_dim: 4 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "input: 'label' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { name: 'ip1' type: 'InnerProduct' "
+        "  bottom: 'data' top: 'ip1' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } "
+        "    bias_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'relu1' type: 'ReLU' "
+        "  bottom: 'ip1' top: 'ip1' } "
+        "layer { name: 'ip2' type: 'InnerProduct' "
+        "  bottom: 'data' top: 'ip2' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'concat' type: 'Concat' "
+        "  bottom: 'ip1' bottom: 'ip2' top: 'concat' "
+        "  concat_param { axis: 0 " + view_param + "} } "
+        "layer { name: 'ip3' type: 'InnerProduct' "
+        "  bottom: 'concat' top: 'ip3' "
+        "  inner_product_param { num_output: 6 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'slice' type: 'Slice' "
+        "  bottom: 'ip3' top: 'slice1' top: 'slice2' "
+        "  slice_param { axis: 0 " + view_param + "} } "
+        "layer { name: 'tanh' type: 'TanH' "
+        "  bottom: 'slice1' top: 'slice1' } "
+        "layer { name: 'ip4' type: 'InnerProduct' "
+        "  bottom: 'slice1' top: 'ip4' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'ip5' type: 'InnerProduct' "
+        "  bottom: 'slice2' top: 'ip5' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'loss1' type: 'EuclideanLoss' "
+        "  bottom: 'ip4' bottom: 'label' } "
+        "layer { name: 'loss2' type: 'EuclideanLoss' "
+        "  bottom: 'ip5' bottom: 'label' } ";
+    InitNetFromProtoString(proto);
+  }
+
+  virtual void InitSplitNet(const bool accumulate_split_diffs) {
+    string proto =
+        "name: 'SplitNetwork' "
+        "force_backward: true "
+        "input: 'data' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 5 "
+        "input_dim: 5 "
+        "input: 'label' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { name: 'conv0' type: 'Convolution' "
+        "  bottom: 'data' top: 'x' "
+        "  convolution_param { num_output: 3 kernel_size: 1 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'conv1' type: 'Convolution' "
+        "  bottom: 'x' top: 'conv1' "
+        "  convolution_param { num_output: 3 kernel_size: 3 pad: 1 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'pool1' type: 'Pooling' "
+        "  bottom: 'x' top: 'pool1' "
+        "  pooling_param { pool: MAX kernel_size: 3 stride: 1 pad: 1 } } "
+        "layer { name: 'sum' type: 'Eltwise' "
+        "  bottom: 'conv1' bottom: 'pool1' bottom: 'x' top: 'sum' "
+        "  eltwise_param { operation: SUM coeff: 1 coeff: 1 coeff: 0.5 } } "
+        "layer { name: 'ip1' type: 'InnerProduct' "
+        "  bottom: 'sum' top: 'ip1' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'ip2' type: 'InnerProduct' "
+        "  bottom: 'x' top: 'ip2' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'ip3' type: 'InnerProduct' "
+        "  bottom: 'x' top: 'ip3' "
+        "  inner_product_param { num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } } } "
+        "layer { name: 'loss1' type: 'EuclideanLoss' "
+        "  bottom: 'ip1' bottom: 'label' } "
+        "layer { name: 'loss2' type: 'EuclideanLoss' "
+        "  bottom: 'ip2' bottom: 'label' } "
+        "layer { name: 'loss3' type: 'EuclideanLoss' "
+        "  bottom: 'ip3' bottom: 'label' } ";
+    if (accumulate_split_diffs) {
+      proto += "accumulate_split_diffs: true ";
+    }
+    InitNetFromProtoString(proto);
+  }
+
+  virtual string InPlaceNetProto(const bool auto_in_place) {
+    string proto =
+        "name: 'InPlaceNetwork' "
+        "input: 'data' "
+        "input_dim: 4 "
+        "input_dim: 6 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "input: 'label' "
+        "input_dim: 4 "
+        "input_dim: 3 "
+        "input_dim: 1 "
+        "input_dim: 1 ";
+    const char* ips[] = {"ip1", "ip2", "ip3", "ip4"};
+    const char* bottoms[] = {"data", "drop1", "data", "data"};
+    for (int i = 0; i < 4; ++i) {
+      proto += string("layer { name: '") + ips[i] + "' type: 'InnerProduct' "
+          "  bottom: '" + bottoms[i] + "' top: '" + ips[i] + "' "
+          "  inner_product_param { num_output: 3 "
+          "    weight_filler { type: 'gaussian' std: 0.5 } "
+          "    bias_filler { type: 'gaussian' std: 0.5 } } } ";
+      if (i == 0) {
+        proto +=
+            "layer { name: 'relu1' type: 'ReLU' "
+            "  bottom: 'ip1' top: 'relu1' } "
+            "layer { name: 'drop1' type: 'Dropout' "
+            "  bottom: 'relu1' top: 'drop1' } ";
+      }
+    }
+    proto +=
+        "layer { name: 'sig3' type: 'Sigmoid' bottom: 'ip3' top: 'sig3' } "
+        "layer { name: 'sig4' type: 'Sigmoid' bottom: 'ip4' top: 'sig4' } "
+        "layer { name: 'tanh4' type: 'TanH' bottom: 'sig4' top: 'tanh4' } "
+        "layer { name: 'sum' type: 'Eltwise' "
+        "  bottom: 'tanh4' bottom: 'ip2' bottom: 'sig3' top: 'sum' "
+        "  eltwise_param { coeff: 1 coeff: -0.5 coeff: 2 } } "
+        "layer { name: 'tanh' type: 'TanH' bottom: 'sum' top: 'tanh' } "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'tanh' "
+        "  bottom: 'label' "
+        "} ";
+    if (auto_in_place) {
+      proto += "auto_in_place: true ";
+    }
+    return proto;
+  }
+
+  virtual void InitInPlaceNet(const bool auto_in_place) {
+    InitNetFromProtoString(InPlaceNetProto(auto_in_place));
+  }
+
+  // Runs a forward pass of a context on its own copy of the inputs
+  static void ForwardContext(Net<Dtype>* context, Caffe::Brew mode,
+      const vector<Blob<Dtype>*>* bottom, Dtype* loss) {
+    Caffe::set_mode(mode);
+    for (int i = 0; i < 10; ++i) {
+      context->Forward(*bottom, loss);
+    }
+  }
+
   int seed_;
   shared_ptr<Net<Dtype> > net_;
 };
@@ -780,6 +1406,28 @@ TYPED_TEST(NetTest, TestBottomNeedBackwardForce) {
   EXPECT_EQ(false, bottom_need_backward[2][1]);
 }
 
+TYPED_TEST(NetTest, TestDeviceLoss) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->InitTinyNetEuclidean();
+  this->net_->set_device_loss(true);
+  EXPECT_TRUE(this->net_->device_loss());
+  const bool gpu = Caffe::mode() == Caffe::GPU;
+  Dtype expected_loss = 0;
+  for (int i = 0; i < 2; ++i) {
+    Dtype loss;
+    this->net_->ForwardPrefilled(&loss);
+    // The output of the loss layer, its weight being 1
+    const Dtype output = this->net_->output_blobs()[0]->cpu_data()[0];
+    EXPECT_NEAR(gpu ? 0 : output, loss, 1e-6);
+    expected_loss += output;
+  }
+  // Added up on the GPU only, then reset by reading it
+  EXPECT_NEAR(gpu ? expected_loss : 0, this->net_->AccumulatedLoss(), 1e-6);
+  EXPECT_EQ(0, this->net_->AccumulatedLoss());
+  this->net_->set_device_loss(false);
+  EXPECT_FALSE(this->net_->device_loss());
+}
+
 TYPED_TEST(NetTest, TestBottomNeedBackwardEuclideanForce) {
   const bool force_backward = true;
   this->InitTinyNetEuclidean(force_backward);
@@ -1180,6 +1828,103 @@ TYPED_TEST(NetTest, TestSharedWeightsUpdate) {
   }
 }
 
+TYPED_TEST(NetTest, TestFlatParams) {
+  typedef typename TypeParam::Dtype Dtype;
+  Caffe::set_random_seed(this->seed_);
+  // Params are laid out for training
+  this->InitDiffDataUnsharedWeightsNet("state: { phase: TRAIN } ");
+  const vector<Blob<Dtype>*>& params = this->net_->learnable_params();
+  ASSERT_EQ(params.size(), 2);
+  // The params are laid out one after the other
+  EXPECT_EQ(params[0]->cpu_data() + params[0]->count(), params[1]->cpu_data());
+  EXPECT_EQ(params[0]->cpu_diff() + params[0]->count(), params[1]->cpu_diff());
+  vector<Blob<Dtype>*> bottom;
+  this->net_->Forward(bottom);
+  this->net_->Backward();
+  Blob<Dtype> expected;
+  expected.CopyFrom(*params[1], false, true);
+  caffe_axpy(params[1]->count(), Dtype(-1), params[1]->cpu_diff(),
+             expected.mutable_cpu_data());
+  this->net_->Update();
+  for (int i = 0; i < params[1]->count(); ++i) {
+    EXPECT_EQ(expected.cpu_data()[i], params[1]->cpu_data()[i]);
+  }
+  this->net_->ClearParamDiffs();
+  for (int i = 0; i < params.size(); ++i) {
+    for (int j = 0; j < params[i]->count(); ++j) {
+      EXPECT_EQ(0, params[i]->cpu_diff()[j]);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestSparseParams) {
+  typedef typename TypeParam::Dtype Dtype;
+  Caffe::set_random_seed(this->seed_);
+  const string& proto =
+      "name: 'SparseParamsNetwork' "
+      "state: { phase: TRAIN } "
+      "input: 'index' "
+      "input_shape { dim: 4 } "
+      "input: 'target' "
+      "input_shape { dim: 4 dim: 5 } "
+      "layer { "
+      "  name: 'embed' "
+      "  type: 'Embed' "
+      "  embed_param { "
+      "    num_output: 5 "
+      "    input_dim: 10 "
+      "    weight_filler { type: 'gaussian' } "
+      "  } "
+      "  bottom: 'index' "
+      "  top: 'embed' "
+      "} "
+      "layer { "
+      "  name: 'loss' "
+      "  type: 'EuclideanLoss' "
+      "  bottom: 'embed' "
+      "  bottom: 'target' "
+      "} ";
+  this->InitNetFromProtoString(proto);
+  const vector<Blob<Dtype>*>& params = this->net_->learnable_params();
+  ASSERT_EQ(params.size(), 2);
+  EXPECT_TRUE(this->net_->params_sparse()[0]);
+  EXPECT_FALSE(this->net_->params_sparse()[1]);
+  EXPECT_TRUE(this->net_->param_rows(1) == NULL);
+  const int indices[] = { 7, 3, 7, 0 };
+  Blob<Dtype>* index = this->net_->input_blobs()[0];
+  for (int i = 0; i < 4; ++i) {
+    index->mutable_cpu_data()[i] = indices[i];
+  }
+  caffe_set(20, Dtype(0), this->net_->input_blobs()[1]->mutable_cpu_data());
+  vector<Blob<Dtype>*> bottom;
+  this->net_->Forward(bottom);
+  this->net_->Backward();
+  // The rows touched, sorted, the others of the diff zero
+  const vector<int>& rows = *this->net_->param_rows(0);
+  ASSERT_EQ(rows.size(), 3);
+  EXPECT_EQ(rows[0], 0);
+  EXPECT_EQ(rows[1], 3);
+  EXPECT_EQ(rows[2], 7);
+  const Dtype* diff = params[0]->cpu_diff();
+  for (int i = 0; i < 10; ++i) {
+    const bool touched = (i == 0 || i == 3 || i == 7);
+    for (int j = 0; j < 5; ++j) {
+      if (touched) {
+        EXPECT_NE(0, diff[i * 5 + j]);
+      } else {
+        EXPECT_EQ(0, diff[i * 5 + j]);
+      }
+    }
+  }
+  this->net_->ClearParamDiffs();
+  EXPECT_EQ(this->net_->param_rows(0)->size(), 0);
+  for (int i = 0; i < params.size(); ++i) {
+    for (int j = 0; j < params[i]->count(); ++j) {
+      EXPECT_EQ(0, params[i]->cpu_diff()[j]);
+    }
+  }
+}
+
 TYPED_TEST(NetTest, TestSharedWeightsResume) {
   typedef typename TypeParam::Dtype Dtype;
 
@@ -1226,33 +1971,131 @@ TYPED_TEST(NetTest, TestSharedWeightsResume) {
   }
 }
 
-TYPED_TEST(NetTest, TestParamPropagateDown) {
+TYPED_TEST(NetTest, TestSharedWeightsMapped) {
   typedef typename TypeParam::Dtype Dtype;
+  Caffe::set_random_seed(this->seed_);
+  this->InitDiffDataSharedWeightsNet();
   vector<Blob<Dtype>*> bottom;
-  const bool kBiasTerm = true, kForceBackward = false;
-  const Dtype* kLossWeight1 = NULL;
-  const Dtype* kLossWeight2 = NULL;
+  this->net_->ForwardBackward(bottom);
+  this->net_->Update();
+  Blob<Dtype> shared_params;
+  shared_params.CopyFrom(*this->net_->layers()[1]->blobs()[0], false, true);
+  NetParameter net_param;
+  this->net_->ToProto(&net_param);
+  string filename;
+  MakeTempFilename(&filename);
+  filename += ".mmap";
+  WriteMappedWeights(net_param, filename);
 
-  // Run the net with all params learned; check that gradients are non-zero.
+  // Reinitialize the net and load the weights from the mapped file.
   Caffe::set_random_seed(this->seed_);
-  Dtype blobs_lr_w1 = 1, blobs_lr_w2 = 1, blobs_lr_b1 = 2, blobs_lr_b2 = 2;
-  this->InitUnsharedWeightsNet(kLossWeight1, kLossWeight2, kForceBackward,
-      kBiasTerm, blobs_lr_w1, blobs_lr_w2, blobs_lr_b1, blobs_lr_b2);
-  this->net_->Forward(bottom);
-  this->net_->Backward();
-  const vector<shared_ptr<Blob<Dtype> > >& params = this->net_->params();
-  const int num_params = params.size();
-  ASSERT_EQ(4, num_params);
-  const Dtype kNonZeroTestMin = 1e-3;
-  vector<Dtype> param_asums(params.size());
-  for (int i = 0; i < num_params; ++i) {
-    const Dtype param_asum =
-       caffe_cpu_asum(params[i]->count(), params[i]->cpu_diff());
-    param_asums[i] = param_asum;
-    EXPECT_GT(param_asum, kNonZeroTestMin);
-  }
-
-  // Change the learning rates to different non-zero values; should see same
+  this->InitDiffDataSharedWeightsNet();
+  this->net_->CopyTrainedLayersFrom(filename);
+  Blob<Dtype>* ip1_weights = this->net_->layers()[1]->blobs()[0].get();
+  Blob<Dtype>* ip2_weights = this->net_->layers()[2]->blobs()[0].get();
+  EXPECT_EQ(ip1_weights->cpu_data(), ip2_weights->cpu_data());
+  EXPECT_EQ(ip1_weights->cpu_diff(), ip2_weights->cpu_diff());
+  // Values are stored as floats.
+  for (int i = 0; i < shared_params.count(); ++i) {
+    EXPECT_FLOAT_EQ(shared_params.cpu_data()[i], ip1_weights->cpu_data()[i]);
+  }
+  // The mapping is copy-on-write, the weights can be trained further.
+  this->net_->ForwardBackward(bottom);
+  this->net_->Update();
+}
+
+TYPED_TEST(NetTest, TestStreamedWeights) {
+  typedef typename TypeParam::Dtype Dtype;
+  Caffe::set_random_seed(this->seed_);
+  this->InitDiffDataUnsharedWeightsNet();
+  vector<Blob<Dtype>*> bottom;
+  this->net_->ForwardBackward(bottom);
+  this->net_->Update();
+  vector<shared_ptr<Blob<Dtype> > > params;
+  this->CopyNetParams(false, &params);
+  NetParameter net_param;
+  this->net_->ToProto(&net_param);
+  // A layer the net does not have is skipped
+  LayerParameter* unknown = net_param.add_layer();
+  unknown->set_name("unknown");
+  unknown->add_blobs()->add_data(1);
+  string filename;
+  MakeTempFilename(&filename);
+  WriteProtoToBinaryFile(net_param, filename);
+
+  // Reinitialize the net and stream the weights in from the file.
+  Caffe::set_random_seed(this->seed_ + 1);
+  this->InitDiffDataUnsharedWeightsNet();
+  this->net_->CopyTrainedLayersFrom(filename);
+  const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
+  ASSERT_EQ(params.size(), net_params.size());
+  for (int i = 0; i < params.size(); ++i) {
+    for (int j = 0; j < params[i]->count(); ++j) {
+      EXPECT_EQ(params[i]->cpu_data()[j], net_params[i]->cpu_data()[j]);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestFrozenParams) {
+  typedef typename TypeParam::Dtype Dtype;
+  vector<Blob<Dtype>*> bottom;
+  const bool kBiasTerm = true;
+  for (int force_backward = 0; force_backward < 2; ++force_backward) {
+    this->InitUnsharedWeightsNet(NULL, NULL, force_backward, kBiasTerm,
+        0, 0, 1, 2);
+    const vector<bool>& frozen = this->net_->params_frozen();
+    ASSERT_EQ(4, frozen.size());
+    const bool expected_frozen[] = {!force_backward, !force_backward,
+        false, false};
+    for (int i = 0; i < frozen.size(); ++i) {
+      EXPECT_EQ(expected_frozen[i], frozen[i]);
+    }
+    // The diffs of the frozen params are never allocated, their data left
+    // as is by the update.
+    const vector<Blob<Dtype>*>& params = this->net_->learnable_params();
+    Blob<Dtype> weights;
+    weights.CopyFrom(*params[0], false, true);
+    this->net_->ClearParamDiffs();
+    this->net_->Forward(bottom);
+    this->net_->Backward();
+    this->net_->Update();
+    for (int i = 0; i < frozen.size(); ++i) {
+      EXPECT_EQ(frozen[i],
+          params[i]->diff()->head() == SyncedMemory::UNINITIALIZED);
+    }
+    for (int i = 0; force_backward == 0 && i < weights.count(); ++i) {
+      EXPECT_EQ(weights.cpu_data()[i], params[0]->cpu_data()[i]);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestParamPropagateDown) {
+  typedef typename TypeParam::Dtype Dtype;
+  vector<Blob<Dtype>*> bottom;
+  const bool kBiasTerm = true, kForceBackward = false;
+  const Dtype* kLossWeight1 = NULL;
+  const Dtype* kLossWeight2 = NULL;
+
+  // Run the net with all params learned; check that gradients are non-zero.
+  Caffe::set_random_seed(this->seed_);
+  Dtype blobs_lr_w1 = 1, blobs_lr_w2 = 1, blobs_lr_b1 = 2, blobs_lr_b2 = 2;
+  this->InitUnsharedWeightsNet(kLossWeight1, kLossWeight2, kForceBackward,
+      kBiasTerm, blobs_lr_w1, blobs_lr_w2, blobs_lr_b1, blobs_lr_b2);
+  this->net_->Forward(bottom);
+  this->net_->Backward();
+  const vector<shared_ptr<Blob<Dtype> > >& params = this->net_->params();
+  const int num_params = params.size();
+  ASSERT_EQ(4, num_params);
+  const Dtype kNonZeroTestMin = 1e-3;
+  vector<Dtype> param_asums(params.size());
+  for (int i = 0; i < num_params; ++i) {
+    const Dtype param_asum =
+       caffe_cpu_asum(params[i]->count(), params[i]->cpu_diff());
+    param_asums[i] = param_asum;
+    EXPECT_GT(param_asum, kNonZeroTestMin);
+  }
+
+  // Change the learning rates to different non-zero values; should see same
   // gradients.
   Caffe::set_random_seed(this->seed_);
   blobs_lr_w1 *= 2, blobs_lr_w2 *= 2, blobs_lr_b1 *= 2, blobs_lr_b2 *= 2;
@@ -1342,6 +2185,1203 @@ TYPED_TEST(NetTest, TestFromTo) {
   }
 }
 
+template <typename Dtype>
+class RecordLayersCallback : public Net<Dtype>::Callback {
+ public:
+  vector<int> layers_;
+
+ protected:
+  void run(int layer) { layers_.push_back(layer); }
+};
+
+TYPED_TEST(NetTest, TestAfterBackwardCallback) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->InitTinyNet();
+  RecordLayersCallback<Dtype> callback;
+  this->net_->add_after_backward(&callback);
+  this->net_->ForwardPrefilled();
+  this->net_->Backward();
+  // Every layer is reported once, from the top of the net down.
+  const int num_layers = this->net_->layers().size();
+  ASSERT_EQ(num_layers, callback.layers_.size());
+  for (int i = 0; i < num_layers; ++i) {
+    EXPECT_EQ(num_layers - 1 - i, callback.layers_[i]);
+  }
+  callback.layers_.clear();
+  this->net_->BackwardFromTo(num_layers - 1, 1);
+  EXPECT_EQ(num_layers - 1, callback.layers_.size());
+  EXPECT_EQ(1, callback.layers_.back());
+}
+
+TYPED_TEST(NetTest, TestReuseActivations) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> input(1, 3, 100, 100);
+  filler.Fill(&input);
+  vector<Blob<Dtype>*> bottom(1, &input);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitReshapableNet();
+  const Blob<Dtype>* output = this->net_->Forward(bottom)[0];
+  Blob<Dtype> expected;
+  expected.CopyFrom(*output, false, true);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitReshapableNet(true);
+  // conv1 is dead once pooled, norm1 can take its memory
+  EXPECT_EQ(this->net_->blob_by_name("conv1")->data(),
+            this->net_->blob_by_name("norm1")->data());
+  EXPECT_NE(this->net_->blob_by_name("pool1")->data(),
+            this->net_->blob_by_name("norm1")->data());
+  output = this->net_->Forward(bottom)[0];
+  ASSERT_EQ(expected.count(), output->count());
+  for (int i = 0; i < output->count(); ++i) {
+    EXPECT_EQ(expected.cpu_data()[i], output->cpu_data()[i]);
+  }
+}
+
+TYPED_TEST(NetTest, TestRecompute) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(4, 6, 1, 1);
+  Blob<Dtype> label(4, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitRecomputeNet(false);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitRecomputeNet(true);
+  // ip1 and ip4 are needed only inside their segments
+  EXPECT_EQ(this->net_->blob_by_name("ip1")->data(),
+            this->net_->blob_by_name("ip4")->data());
+  EXPECT_EQ(this->net_->blob_by_name("ip1")->diff(),
+            this->net_->blob_by_name("ip4")->diff());
+  EXPECT_NE(this->net_->blob_by_name("ip2")->data(),
+            this->net_->blob_by_name("ip5")->data());
+  Dtype loss;
+  this->net_->Forward(bottom, &loss);
+  this->net_->Backward();
+  EXPECT_EQ(expected_loss, loss);
+  ASSERT_EQ(expected_params.size(), this->net_->params().size());
+  for (int i = 0; i < expected_params.size(); ++i) {
+    const Blob<Dtype>* param = this->net_->params()[i].get();
+    for (int j = 0; j < param->count(); ++j) {
+      EXPECT_EQ(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j]);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestOffload) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(4, 6, 1, 1);
+  Blob<Dtype> label(4, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitRecomputeNet(false);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+
+  // In GPU mode, ip4 and ip5 take the GPU memory of ip1 and ip2, which get
+  // copied out and back.
+  Caffe::set_random_seed(this->seed_);
+  this->InitRecomputeNet(false, true);
+  for (int iter = 0; iter < 2; ++iter) {
+    Dtype loss;
+    this->net_->Forward(bottom, &loss);
+    this->net_->ClearParamDiffs();
+    this->net_->Backward();
+    EXPECT_EQ(expected_loss, loss);
+    ASSERT_EQ(expected_params.size(), this->net_->params().size());
+    for (int i = 0; i < expected_params.size(); ++i) {
+      const Blob<Dtype>* param = this->net_->params()[i].get();
+      for (int j = 0; j < param->count(); ++j) {
+        EXPECT_EQ(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j]);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestLayerDevice) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(4, 6, 1, 1);
+  Blob<Dtype> label(4, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitRecomputeNet(false);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+
+  // In GPU mode, ip2, ip4 and relu4 run on the CPU, their bottoms and the
+  // diffs of their tops copied to the host, and the other way around.
+  Caffe::set_random_seed(this->seed_);
+  this->InitRecomputeNet(false, false, true);
+  EXPECT_EQ(Caffe::CPU, this->net_->layer_by_name("ip2")->mode());
+  EXPECT_EQ(Caffe::mode(), this->net_->layer_by_name("ip3")->mode());
+  const Dtype kErrorMargin = 1e-4;
+  for (int iter = 0; iter < 2; ++iter) {
+    Dtype loss;
+    this->net_->Forward(bottom, &loss);
+    this->net_->ClearParamDiffs();
+    this->net_->Backward();
+    EXPECT_NEAR(expected_loss, loss, kErrorMargin * (1 + expected_loss));
+    ASSERT_EQ(expected_params.size(), this->net_->params().size());
+    for (int i = 0; i < expected_params.size(); ++i) {
+      const Blob<Dtype>* param = this->net_->params()[i].get();
+      for (int j = 0; j < param->count(); ++j) {
+        EXPECT_NEAR(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j],
+                    kErrorMargin);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestBranchThreads) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(4, 6, 1, 1);
+  Blob<Dtype> label(4, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitBranchNet(1);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitBranchNet(4);
+  for (int iter = 0; iter < 3; ++iter) {
+    Dtype loss;
+    this->net_->Forward(bottom, &loss);
+    this->net_->ClearParamDiffs();
+    this->net_->Backward();
+    EXPECT_EQ(expected_loss, loss);
+    ASSERT_EQ(expected_params.size(), this->net_->params().size());
+    for (int i = 0; i < expected_params.size(); ++i) {
+      const Blob<Dtype>* param = this->net_->params()[i].get();
+      for (int j = 0; j < param->count(); ++j) {
+        EXPECT_EQ(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j]);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestPipelineStages) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(4, 6, 1, 1);
+  Blob<Dtype> label(4, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitBranchNet(1);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+  NetParameter trained;
+  this->net_->ToProto(&trained);
+
+  // Three stages on the current device, relu2 beginning the second
+  int device = 0;
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaGetDevice(&device));
+  }
+#endif
+  ostringstream pipeline;
+  pipeline << "pipeline { device: " << device << " device: " << device
+           << " device: " << device << " stage_begin: 'relu2' "
+           << " stage_begin: 'out' } ";
+  this->InitBranchNet(1, false, false, pipeline.str());
+  EXPECT_EQ(3, this->net_->num_stages());
+  EXPECT_TRUE(this->net_->has_layer("ip2_stage1_transfer"));
+  EXPECT_TRUE(this->net_->has_layer("label_stage2_transfer"));
+  // relu2 computes in place on the copy of ip2 in the second stage
+  EXPECT_EQ(this->net_->blob_by_name("ip2_stage1"),
+            this->net_->blob_by_name("ip2"));
+  this->net_->CopyTrainedLayersFrom(trained);
+  for (int iter = 0; iter < 2; ++iter) {
+    Dtype loss;
+    this->net_->Forward(bottom, &loss);
+    this->net_->ClearParamDiffs();
+    this->net_->Backward();
+    EXPECT_EQ(expected_loss, loss);
+    ASSERT_EQ(expected_params.size(), this->net_->params().size());
+    for (int i = 0; i < expected_params.size(); ++i) {
+      const Blob<Dtype>* param = this->net_->params()[i].get();
+      for (int j = 0; j < param->count(); ++j) {
+        EXPECT_EQ(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j]);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestFuseReLU) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(2, 3, 5, 5);
+  Blob<Dtype> label(2, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitFuseReLUNet(false);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitFuseReLUNet(true);
+  // The ReLUs in place are fused, not relu4 with a top of its own
+  EXPECT_FALSE(this->net_->has_layer("relu1"));
+  EXPECT_FALSE(this->net_->has_layer("relu2"));
+  EXPECT_FALSE(this->net_->has_layer("relu3"));
+  EXPECT_TRUE(this->net_->has_layer("relu4"));
+  Dtype loss;
+  this->net_->Forward(bottom, &loss);
+  this->net_->Backward();
+  const Dtype kErrorMargin = 1e-5;
+  EXPECT_NEAR(expected_loss, loss, kErrorMargin);
+  ASSERT_EQ(expected_params.size(), this->net_->params().size());
+  for (int i = 0; i < expected_params.size(); ++i) {
+    const Blob<Dtype>* param = this->net_->params()[i].get();
+    for (int j = 0; j < param->count(); ++j) {
+      EXPECT_NEAR(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j],
+                  kErrorMargin);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestFuseElementwise) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(2, 3, 4, 4);
+  Blob<Dtype> label(2, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitFuseElementwiseNet(false);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitFuseElementwiseNet(true);
+  // exp3 stays, as sum reads its top too, and sig2 and relu2 are in place
+  EXPECT_TRUE(this->net_->has_layer("sig1+tanh1+pow1"));
+  EXPECT_TRUE(this->net_->has_layer("sig2+relu2"));
+  EXPECT_TRUE(this->net_->has_layer("exp3"));
+  EXPECT_TRUE(this->net_->has_layer("log3+abs3"));
+  EXPECT_FALSE(this->net_->has_blob("tanh1"));
+  EXPECT_FALSE(this->net_->has_blob("log3"));
+  Dtype loss;
+  this->net_->Forward(bottom, &loss);
+  this->net_->Backward();
+  const Dtype kErrorMargin = 1e-5;
+  EXPECT_NEAR(expected_loss, loss, kErrorMargin);
+  ASSERT_EQ(expected_params.size(), this->net_->params().size());
+  for (int i = 0; i < expected_params.size(); ++i) {
+    const Blob<Dtype>* param = this->net_->params()[i].get();
+    for (int j = 0; j < param->count(); ++j) {
+      EXPECT_NEAR(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j],
+                  kErrorMargin);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestEngineAuto) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(2, 3, 6, 6);
+  Blob<Dtype> label(2, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitEngineNet("CAFFE");
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+
+  string filename;
+  MakeTempFilename(&filename);
+  SetEngineCacheFile(filename);
+  Caffe::set_random_seed(this->seed_);
+  this->InitEngineNet("AUTO");
+  // Timing the engines fills nothing, so the weights are the same
+  Dtype loss;
+  this->net_->Forward(bottom, &loss);
+  this->net_->Backward();
+  const Dtype kErrorMargin = 1e-4;
+  EXPECT_NEAR(expected_loss, loss, kErrorMargin * expected_loss);
+  ASSERT_EQ(expected_params.size(), this->net_->params().size());
+  for (int i = 0; i < expected_params.size(); ++i) {
+    const Blob<Dtype>* param = this->net_->params()[i].get();
+    for (int j = 0; j < param->count(); ++j) {
+      EXPECT_NEAR(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j],
+                  kErrorMargin);
+    }
+  }
+  // Each layer with a choice of engines is timed once, then read from the
+  // cache
+  this->InitEngineNet("AUTO");
+  std::ifstream file(filename.c_str());
+  string key;
+  int engine;
+  int cached = 0;
+  while (file >> key >> engine) {
+    ++cached;
+  }
+  SetEngineCacheFile("");
+  if (Caffe::mode() == Caffe::CPU) {
+    // WINOGRAD and DIRECT for conv1, DIRECT for conv2, only CAFFE for pool
+    EXPECT_EQ(2, cached);
+  }
+}
+
+TYPED_TEST(NetTest, TestLayoutNHWC) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(2, 3, 6, 6);
+  Blob<Dtype> label(2, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitLayoutNet(false);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  Blob<Dtype> expected_pool2;
+  expected_pool2.CopyFrom(*this->net_->blob_by_name("pool2"), false, true);
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitLayoutNet(true);
+  // Converted from the input, and back for InnerProduct and the output
+  EXPECT_TRUE(this->net_->has_layer("data_nhwc_layout"));
+  EXPECT_TRUE(this->net_->has_layer("concat_nchw_layout"));
+  EXPECT_TRUE(this->net_->has_layer("pool2_layout"));
+  EXPECT_EQ(NHWC, this->net_->blob_by_name("conv1")->layout());
+  EXPECT_EQ(NHWC, this->net_->blob_by_name("concat")->layout());
+  EXPECT_EQ(NCHW, this->net_->blob_by_name("pool2")->layout());
+  ASSERT_EQ(1, this->net_->num_outputs());
+  EXPECT_EQ(this->net_->blob_by_name("pool2").get(),
+            this->net_->output_blobs()[0]);
+  Dtype loss;
+  this->net_->Forward(bottom, &loss);
+  this->net_->Backward();
+  // Summed in another order
+  const Dtype kErrorMargin = 1e-5;
+  EXPECT_NEAR(expected_loss, loss, kErrorMargin * expected_loss);
+  const Blob<Dtype>* pool2 = this->net_->blob_by_name("pool2").get();
+  ASSERT_EQ(expected_pool2.count(), pool2->count());
+  for (int i = 0; i < pool2->count(); ++i) {
+    EXPECT_NEAR(expected_pool2.cpu_data()[i], pool2->cpu_data()[i],
+                kErrorMargin);
+  }
+  ASSERT_EQ(expected_params.size(), this->net_->params().size());
+  for (int i = 0; i < expected_params.size(); ++i) {
+    const Blob<Dtype>* param = this->net_->params()[i].get();
+    for (int j = 0; j < param->count(); ++j) {
+      const Dtype expected = expected_params[i]->cpu_diff()[j];
+      EXPECT_NEAR(expected, param->cpu_diff()[j],
+                  kErrorMargin * std::max(Dtype(1), std::abs(expected)));
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestViews) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(2, 4, 1, 1);
+  Blob<Dtype> label(2, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitViewNet(false);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitViewNet(true);
+  // The parts are computed right in the concatenated and sliced blobs
+  EXPECT_EQ(this->net_->blob_by_name("concat")->cpu_data(),
+            this->net_->blob_by_name("ip1")->cpu_data());
+  EXPECT_EQ(this->net_->blob_by_name("concat")->cpu_data() + 6,
+            this->net_->blob_by_name("ip2")->cpu_data());
+  EXPECT_EQ(this->net_->blob_by_name("ip3")->cpu_data() + 12,
+            this->net_->blob_by_name("slice2")->cpu_data());
+  Dtype loss;
+  this->net_->Forward(bottom, &loss);
+  this->net_->Backward();
+  const Dtype kErrorMargin = 1e-5;
+  EXPECT_NEAR(expected_loss, loss, kErrorMargin);
+  ASSERT_EQ(expected_params.size(), this->net_->params().size());
+  for (int i = 0; i < expected_params.size(); ++i) {
+    const Blob<Dtype>* param = this->net_->params()[i].get();
+    for (int j = 0; j < param->count(); ++j) {
+      EXPECT_NEAR(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j],
+                  kErrorMargin);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestAccumulateSplitDiffs) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(2, 3, 5, 5);
+  Blob<Dtype> label(2, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitSplitNet(false);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+  Blob<Dtype> expected_data_diff;
+  expected_data_diff.CopyFrom(*this->net_->blob_by_name("data"), true, true);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitSplitNet(true);
+  Dtype loss;
+  this->net_->Forward(bottom, &loss);
+  this->net_->Backward();
+  // The readers of x add their gradients right into its diff
+  EXPECT_EQ(this->net_->blob_by_name("x")->cpu_diff(),
+      this->net_->blob_by_name("x_conv0_0_split_0")->cpu_diff());
+  EXPECT_EQ(this->net_->blob_by_name("x")->cpu_diff(),
+      this->net_->blob_by_name("x_conv0_0_split_4")->cpu_diff());
+  // Sums are taken in another order
+  const Dtype kErrorMargin = 1e-5;
+  EXPECT_NEAR(expected_loss, loss, kErrorMargin * fabs(expected_loss));
+  ASSERT_EQ(expected_params.size(), this->net_->params().size());
+  for (int i = 0; i < expected_params.size(); ++i) {
+    const Blob<Dtype>* param = this->net_->params()[i].get();
+    for (int j = 0; j < param->count(); ++j) {
+      const Dtype expected = expected_params[i]->cpu_diff()[j];
+      EXPECT_NEAR(expected, param->cpu_diff()[j],
+                  kErrorMargin * std::max(Dtype(1), fabs(expected)));
+    }
+  }
+  const Blob<Dtype>* data_blob = this->net_->blob_by_name("data").get();
+  for (int j = 0; j < data_blob->count(); ++j) {
+    const Dtype expected = expected_data_diff.cpu_diff()[j];
+    EXPECT_NEAR(expected, data_blob->cpu_diff()[j],
+                kErrorMargin * std::max(Dtype(1), fabs(expected)));
+  }
+}
+
+TYPED_TEST(NetTest, TestAutoInPlace) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(4, 6, 1, 1);
+  Blob<Dtype> label(4, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitInPlaceNet(false);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+  const int num_blobs = this->net_->blobs().size();
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitInPlaceNet(true);
+  // The former tops name the blobs they are computed in
+  EXPECT_EQ(this->net_->blob_by_name("ip1"),
+            this->net_->blob_by_name("relu1"));
+  EXPECT_EQ(this->net_->blob_by_name("ip1"),
+            this->net_->blob_by_name("drop1"));
+  EXPECT_EQ(this->net_->blob_by_name("ip3"),
+            this->net_->blob_by_name("sig3"));
+  EXPECT_EQ(this->net_->blob_by_name("ip4"),
+            this->net_->blob_by_name("sig4"));
+  EXPECT_EQ(this->net_->blob_by_name("ip2"),
+            this->net_->blob_by_name("sum"));
+  EXPECT_EQ(this->net_->blob_by_name("ip2"),
+            this->net_->blob_by_name("tanh"));
+  // The backward of Sigmoid reads its top
+  EXPECT_NE(this->net_->blob_by_name("sig4"),
+            this->net_->blob_by_name("tanh4"));
+  EXPECT_EQ(num_blobs - 6, this->net_->blobs().size());
+  Dtype loss;
+  this->net_->Forward(bottom, &loss);
+  this->net_->Backward();
+  const Dtype kErrorMargin = 1e-5;
+  EXPECT_NEAR(expected_loss, loss, kErrorMargin);
+  ASSERT_EQ(expected_params.size(), this->net_->params().size());
+  for (int i = 0; i < expected_params.size(); ++i) {
+    const Blob<Dtype>* param = this->net_->params()[i].get();
+    for (int j = 0; j < param->count(); ++j) {
+      EXPECT_NEAR(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j],
+                  kErrorMargin);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestCompiledNet) {
+  typedef typename TypeParam::Dtype Dtype;
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->InPlaceNetProto(true), &param));
+  NetParameter compiled;
+  Net<Dtype>::Compile(param, &compiled);
+  EXPECT_TRUE(compiled.compiled());
+  EXPECT_EQ(6, compiled.alias_size());
+  Caffe::set_random_seed(this->seed_);
+  this->InitInPlaceNet(true);
+  Caffe::set_random_seed(this->seed_);
+  Net<Dtype> compiled_net(compiled);
+  // Init sets up the compiled net as it is, splits and aliases included
+  EXPECT_TRUE(this->net_->layer_names() == compiled_net.layer_names());
+  EXPECT_TRUE(this->net_->blob_names() == compiled_net.blob_names());
+  EXPECT_EQ(compiled_net.blob_by_name("ip1"),
+            compiled_net.blob_by_name("drop1"));
+  EXPECT_EQ(compiled_net.blob_by_name("ip2"),
+            compiled_net.blob_by_name("tanh"));
+  ASSERT_EQ(this->net_->params().size(), compiled_net.params().size());
+  for (int i = 0; i < compiled_net.params().size(); ++i) {
+    const Blob<Dtype>* expected = this->net_->params()[i].get();
+    const Blob<Dtype>* param = compiled_net.params()[i].get();
+    ASSERT_TRUE(expected->shape() == param->shape());
+    for (int j = 0; j < param->count(); ++j) {
+      EXPECT_EQ(expected->cpu_data()[j], param->cpu_data()[j]);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestNetCache) {
+  typedef typename TypeParam::Dtype Dtype;
+  string cache_dir;
+  MakeTempDir(&cache_dir);
+  string filename;
+  MakeTempFilename(&filename);
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->InPlaceNetProto(true), &param));
+  WriteProtoToTextFile(param, filename);
+  SetNetCacheDir(cache_dir);
+  // Each phase of a prototxt has its own compiled net
+  EXPECT_NE(NetCacheFile(filename, TRAIN), NetCacheFile(filename, TEST));
+  NetParameter cached;
+  EXPECT_FALSE(ReadCachedNet(filename, TRAIN, &cached));
+  Net<Dtype> net(filename, TRAIN);
+  EXPECT_TRUE(ReadCachedNet(filename, TRAIN, &cached));
+  EXPECT_TRUE(cached.compiled());
+  EXPECT_EQ(TRAIN, cached.state().phase());
+  EXPECT_FALSE(ReadCachedNet(filename, TEST, &cached));
+  Net<Dtype> cached_net(filename, TRAIN);
+  SetNetCacheDir("");
+  EXPECT_TRUE(NetCacheFile(filename, TRAIN).empty());
+  EXPECT_TRUE(net.layer_names() == cached_net.layer_names());
+  EXPECT_TRUE(net.blob_names() == cached_net.blob_names());
+  EXPECT_EQ(cached_net.blob_by_name("ip1"), cached_net.blob_by_name("drop1"));
+}
+
+TYPED_TEST(NetTest, TestDedupWeights) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->InitInPlaceNet(false);
+  NetParameter trained;
+  this->net_->ToProto(&trained);
+  string filename;
+  MakeTempFilename(&filename);
+  WriteProtoToBinaryFile(trained, filename);
+  const string proto = this->InPlaceNetProto(false) + "dedup_weights: true ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  Net<Dtype> net(param);
+  Net<Dtype> other_net(param);
+  net.CopyTrainedLayersFrom(filename);
+  other_net.CopyTrainedLayersFrom(filename);
+  ASSERT_EQ(net.params().size(), other_net.params().size());
+  for (int i = 0; i < net.params().size(); ++i) {
+    EXPECT_EQ(net.params()[i]->data(), other_net.params()[i]->data());
+    for (int j = 0; j < net.params()[i]->count(); ++j) {
+      EXPECT_EQ(this->net_->params()[i]->cpu_data()[j],
+                other_net.params()[i]->cpu_data()[j]);
+    }
+  }
+  // Other values, or nets without dedup_weights, keep their own memory
+  const Dtype value = net.params()[0]->cpu_data()[0];
+  this->net_->params()[0]->mutable_cpu_data()[0] += 1;
+  this->net_->ToProto(&trained);
+  WriteProtoToBinaryFile(trained, filename);
+  other_net.CopyTrainedLayersFrom(filename);
+  EXPECT_NE(net.params()[0]->data(), other_net.params()[0]->data());
+  EXPECT_EQ(value, net.params()[0]->cpu_data()[0]);
+  EXPECT_EQ(value + 1, other_net.params()[0]->cpu_data()[0]);
+  EXPECT_EQ(net.params()[1]->data(), other_net.params()[1]->data());
+  NetParameter private_param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->InPlaceNetProto(false), &private_param));
+  Net<Dtype> private_net(private_param);
+  private_net.CopyTrainedLayersFrom(filename);
+  EXPECT_NE(other_net.params()[0]->data(), private_net.params()[0]->data());
+}
+
+TYPED_TEST(NetTest, TestCudaStream) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(4, 6, 1, 1);
+  Blob<Dtype> label(4, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitBranchNet(1);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    expected_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    expected_params[i]->CopyFrom(*this->net_->params()[i], true, true);
+  }
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitBranchNet(1, true);
+  for (int iter = 0; iter < 3; ++iter) {
+    Dtype loss;
+    this->net_->Forward(bottom, &loss);
+    this->net_->ClearParamDiffs();
+    this->net_->Backward();
+    EXPECT_EQ(expected_loss, loss);
+    ASSERT_EQ(expected_params.size(), this->net_->params().size());
+    for (int i = 0; i < expected_params.size(); ++i) {
+      const Blob<Dtype>* param = this->net_->params()[i].get();
+      for (int j = 0; j < param->count(); ++j) {
+        EXPECT_EQ(expected_params[i]->cpu_diff()[j], param->cpu_diff()[j]);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestTensorOpMath) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(4, 6, 1, 1);
+  Blob<Dtype> label(4, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitBranchNet(1);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+
+  // The GEMMs may round their inputs, on branch threads as well.
+  for (int threads = 1; threads <= 2; ++threads) {
+    Caffe::set_random_seed(this->seed_);
+    this->InitBranchNet(threads, false, true);
+    Dtype loss;
+    this->net_->Forward(bottom, &loss);
+    EXPECT_NEAR(expected_loss, loss, 1e-2 * fabs(expected_loss));
+#ifndef CPU_ONLY
+    // The calling thread gets its own math back.
+    EXPECT_FALSE(Caffe::tensor_op_math());
+#endif
+  }
+}
+
+TYPED_TEST(NetTest, TestStaticShapes) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(2, 3, 5, 5);
+  Blob<Dtype> label(2, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+  Blob<Dtype> larger_data(3, 3, 5, 5);
+  Blob<Dtype> larger_label(3, 3, 1, 1);
+  filler.Fill(&larger_data);
+  filler.Fill(&larger_label);
+  vector<Blob<Dtype>*> larger_bottom;
+  larger_bottom.push_back(&larger_data);
+  larger_bottom.push_back(&larger_label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitStaticShapesNet(false);
+  Dtype expected_loss, expected_larger_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  this->net_->input_blobs()[0]->ReshapeLike(larger_data);
+  this->net_->input_blobs()[1]->ReshapeLike(larger_label);
+  this->net_->Forward(larger_bottom, &expected_larger_loss);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitStaticShapesNet(true);
+  const Dtype kErrorMargin = 1e-5;
+  // Passes skipping the reshapes give the same loss, after changing the
+  // data, and after reshaping the whole net for other inputs.
+  for (int i = 0; i < 2; ++i) {
+    Dtype loss;
+    this->net_->Forward(bottom, &loss);
+    EXPECT_NEAR(expected_loss, loss, kErrorMargin);
+  }
+  this->net_->input_blobs()[0]->ReshapeLike(larger_data);
+  this->net_->input_blobs()[1]->ReshapeLike(larger_label);
+  this->net_->Reshape();
+  Dtype larger_loss;
+  this->net_->Forward(larger_bottom, &larger_loss);
+  EXPECT_NEAR(expected_larger_loss, larger_loss, kErrorMargin);
+}
+
+TYPED_TEST(NetTest, TestMicroBatch) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(5, 3, 5, 5);
+  Blob<Dtype> label(5, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitMicroBatchNet(0);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  const Blob<Dtype>& expected_prob = *this->net_->blob_by_name("prob");
+  const vector<Dtype> expected(expected_prob.cpu_data(),
+      expected_prob.cpu_data() + expected_prob.count());
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitMicroBatchNet(2);
+  const Dtype kErrorMargin = 1e-5;
+  for (int i = 0; i < 2; ++i) {
+    Dtype loss;
+    this->net_->Forward(bottom, &loss);
+    EXPECT_NEAR(expected_loss, loss, kErrorMargin);
+    // The loss output is averaged over the micro-batches
+    EXPECT_NEAR(expected_loss, this->net_->blob_by_name("loss")->cpu_data()[0],
+        kErrorMargin);
+    const Blob<Dtype>& prob = *this->net_->blob_by_name("prob");
+    ASSERT_EQ(5, prob.shape(0));
+    for (int j = 0; j < prob.count(); ++j) {
+      EXPECT_NEAR(expected[j], prob.cpu_data()[j], kErrorMargin);
+    }
+    // The blobs inside only held a micro-batch, the last one of 1 item
+    EXPECT_EQ(1, this->net_->blob_by_name("conv")->shape(0));
+    EXPECT_EQ(5, this->net_->input_blobs()[0]->shape(0));
+  }
+}
+
+TYPED_TEST(NetTest, TestExits) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(6, 4, 1, 1);
+  filler.Fill(&data);
+  vector<Blob<Dtype>*> bottom(1, &data);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitExitNet(-1);
+  this->net_->Forward(bottom);
+  const Blob<Dtype>& exit_prob = *this->net_->blob_by_name("exit_prob");
+  const Blob<Dtype>& prob = *this->net_->blob_by_name("prob");
+  const vector<Dtype> exit_probs(exit_prob.cpu_data(),
+      exit_prob.cpu_data() + exit_prob.count());
+  const vector<Dtype> probs(prob.cpu_data(), prob.cpu_data() + prob.count());
+  // Half of the items exit
+  vector<Dtype> confidence(6);
+  for (int i = 0; i < 6; ++i) {
+    confidence[i] = *std::max_element(&exit_probs[i * 3],
+                                      &exit_probs[i * 3 + 3]);
+  }
+  vector<Dtype> sorted(confidence);
+  std::sort(sorted.begin(), sorted.end());
+  ASSERT_LT(sorted[2], sorted[3]);
+  const float thresholds[] = {(sorted[2] + sorted[3]) / 2, 0, 2};
+  const int exits[] = {3, 6, 0};
+  for (int t = 0; t < 3; ++t) {
+    Caffe::set_random_seed(this->seed_);
+    this->InitExitNet(thresholds[t]);
+    // Twice, as the compacted blobs take the full batch again
+    for (int pass = 0; pass < 2; ++pass) {
+      this->net_->Forward(bottom);
+      const Blob<Dtype>& output = *this->net_->blob_by_name("prob");
+      ASSERT_EQ(6, output.shape(0));
+      for (int i = 0; i < 6; ++i) {
+        const bool exited = confidence[i] >= thresholds[t];
+        for (int j = 0; j < 3; ++j) {
+          EXPECT_NEAR(exited ? exit_probs[i * 3 + j] : probs[i * 3 + j],
+                      output.cpu_data()[i * 3 + j], 1e-5);
+        }
+      }
+      if (exits[t] < 6) {
+        EXPECT_EQ(6 - exits[t], this->net_->blob_by_name("ip2")->shape(0));
+      }
+      EXPECT_EQ(6, this->net_->blob_by_name("ip1")->shape(0));
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestInputBucket) {
+  typedef typename TypeParam::Dtype Dtype;
+  Caffe::set_random_seed(this->seed_);
+  this->InitInputBucketNet(true);
+  shared_ptr<Net<Dtype> > net = this->net_;
+  Blob<Dtype>* input = net->input_blobs()[0];
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> request(1, 2, 5, 5);
+  filler.Fill(&request);
+  // The reference net runs on the request padded by hand.
+  this->InitInputBucketNet(false);
+  this->net_->ShareTrainedLayersWith(net.get());
+  Blob<Dtype> padded(1, 2, 6, 6);
+  for (int c = 0; c < 2; ++c) {
+    for (int h = 0; h < 6; ++h) {
+      for (int w = 0; w < 6; ++w) {
+        padded.mutable_cpu_data()[padded.offset(0, c, h, w)] = h < 5 && w < 5
+            ? request.cpu_data()[request.offset(0, c, h, w)] : Dtype(0);
+      }
+    }
+  }
+  vector<Blob<Dtype>*> bottom(1, &padded);
+  this->net_->input_blobs()[0]->ReshapeLike(padded);
+  const Blob<Dtype>& expected = *this->net_->Forward(bottom)[0];
+  vector<const Dtype*> data;
+  const Dtype kErrorMargin = 1e-5;
+  // Requests of 5x5, padded to the 6x6 bucket, and of 3x3, to the 4x4 one
+  for (int i = 0; i < 3; ++i) {
+    Blob<Dtype> small(1, 2, 3, 3);
+    filler.Fill(&small);
+    Blob<Dtype>* blob = i == 1 ? &small : &request;
+    input->ReshapeLike(*blob);
+    bottom[0] = blob;
+    const Blob<Dtype>& output = *net->Forward(bottom)[0];
+    EXPECT_EQ(i == 1 ? 4 : 6, input->height());
+    EXPECT_EQ(i == 1 ? 2 : 4, output.height());
+    if (i != 1) {
+      ASSERT_EQ(expected.count(), output.count());
+      for (int j = 0; j < output.count(); ++j) {
+        EXPECT_NEAR(expected.cpu_data()[j], output.cpu_data()[j],
+            kErrorMargin);
+      }
+    }
+    // No blob was allocated again.
+    for (int j = 0; j < net->blobs().size(); ++j) {
+      const Dtype* blob_data = net->blobs()[j]->cpu_data();
+      if (i == 0) {
+        data.push_back(blob_data);
+      } else {
+        EXPECT_EQ(data[j], blob_data) << net->blob_names()[j];
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestReshapeChangedOnly) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  vector<shared_ptr<Blob<Dtype> > > blobs;
+  vector<Dtype> expected_losses;
+  // Batches of 2, 3 and 2 again, each with the loss of a fresh net
+  for (int i = 0; i < 3; ++i) {
+    const int num = i == 1 ? 3 : 2;
+    blobs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(num, 3, 5, 5)));
+    blobs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(num, 3, 1, 1)));
+    filler.Fill(blobs[2 * i].get());
+    filler.Fill(blobs[2 * i + 1].get());
+    Caffe::set_random_seed(this->seed_);
+    this->InitStaticShapesNet(false);
+    this->net_->input_blobs()[0]->ReshapeLike(*blobs[2 * i]);
+    this->net_->input_blobs()[1]->ReshapeLike(*blobs[2 * i + 1]);
+    vector<Blob<Dtype>*> bottom;
+    bottom.push_back(blobs[2 * i].get());
+    bottom.push_back(blobs[2 * i + 1].get());
+    Dtype loss;
+    this->net_->Forward(bottom, &loss);
+    expected_losses.push_back(loss);
+  }
+  Caffe::set_random_seed(this->seed_);
+  this->InitStaticShapesNet(false);
+  const Dtype kErrorMargin = 1e-5;
+  for (int i = 0; i < 3; ++i) {
+    this->net_->input_blobs()[0]->ReshapeLike(*blobs[2 * i]);
+    this->net_->input_blobs()[1]->ReshapeLike(*blobs[2 * i + 1]);
+    if (i == 2) {
+      this->net_->Reshape();
+    }
+    vector<Blob<Dtype>*> bottom;
+    bottom.push_back(blobs[2 * i].get());
+    bottom.push_back(blobs[2 * i + 1].get());
+    // A second pass reshapes nothing and gives the same loss.
+    for (int j = 0; j < 2; ++j) {
+      Dtype loss;
+      this->net_->Forward(bottom, &loss);
+      EXPECT_NEAR(expected_losses[i], loss, kErrorMargin);
+    }
+    EXPECT_EQ(this->net_->blob_by_name("ip")->num(), blobs[2 * i]->num());
+  }
+}
+
+TYPED_TEST(NetTest, TestInferenceContexts) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(4, 6, 1, 1);
+  Blob<Dtype> label(4, 3, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&label);
+
+  this->InitBranchNet(1);
+  Dtype expected_loss;
+  this->net_->Forward(bottom, &expected_loss);
+  const int num_contexts = 4;
+  vector<shared_ptr<Net<Dtype> > > contexts;
+  for (int i = 0; i < num_contexts; ++i) {
+    contexts.push_back(this->net_->CreateInferenceContext());
+    const vector<shared_ptr<Blob<Dtype> > >& params = contexts[i]->params();
+    ASSERT_EQ(this->net_->params().size(), params.size());
+    for (int j = 0; j < params.size(); ++j) {
+      EXPECT_EQ(this->net_->params()[j]->data(), params[j]->data());
+    }
+    EXPECT_NE(this->net_->blob_by_name("concat")->data(),
+              contexts[i]->blob_by_name("concat")->data());
+  }
+  vector<Dtype> losses(num_contexts);
+  boost::thread_group threads;
+  for (int i = 0; i < num_contexts; ++i) {
+    threads.create_thread(boost::bind(&TestFixture::ForwardContext,
+        contexts[i].get(), Caffe::mode(), &bottom, &losses[i]));
+  }
+  threads.join_all();
+  for (int i = 0; i < num_contexts; ++i) {
+    EXPECT_EQ(expected_loss, losses[i]);
+  }
+}
+
+// Counts the occurrences of a substring
+static int count_substr(const string& text, const string& pattern) {
+  int count = 0;
+  for (size_t pos = text.find(pattern); pos != string::npos;
+       pos = text.find(pattern, pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+TYPED_TEST(NetTest, TestProfile) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->InitTinyNet(true);
+  this->net_->set_profile(true);
+  for (int iter = 0; iter < 2; ++iter) {
+    this->net_->ForwardPrefilled();
+    this->net_->Backward();
+  }
+  const string json = this->net_->ProfileJSON();
+  EXPECT_NE(string::npos, json.find(
+      "{\"name\": \"innerproduct\", \"type\": \"InnerProduct\""));
+  // Two forward passes of a 5x24 by 24x1000 product
+  EXPECT_NE(string::npos, json.find(
+      "\"forward\": {\"calls\": 2, "));
+  EXPECT_NE(string::npos, json.find("\"flops\": 480000.0"));
+  // Backward computes the gradients w.r.t. both the bottom and the weights
+  EXPECT_NE(string::npos, json.find("\"flops\": 960000.0"));
+  EXPECT_NE(string::npos, json.find(", \"transfers\": "));
+  EXPECT_NE(string::npos, json.find(
+      "{\"name\": \"innerproduct\", \"shape\": [5, 1000], "
+      "\"bytes\": " + boost::lexical_cast<string>(5000 * sizeof(Dtype))));
+  const string trace = this->net_->ProfileTrace();
+  EXPECT_EQ(6, count_substr(trace, "\"cat\": \"forward\""));
+  EXPECT_EQ(6, count_substr(trace, "\"cat\": \"backward\""));
+  this->net_->ClearProfile();
+  EXPECT_EQ(0, count_substr(this->net_->ProfileTrace(), "\"ph\""));
+  this->net_->set_profile(false);
+  this->net_->ForwardPrefilled();
+  EXPECT_EQ(0, count_substr(this->net_->ProfileTrace(), "\"ph\""));
+}
+
+TYPED_TEST(NetTest, TestMemoryJSON) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->InitTinyNet(true);
+  const string bytes = boost::lexical_cast<string>(5000 * sizeof(Dtype));
+  const string expected = "{\"name\": \"innerproduct\", \"data_bytes\": "
+      + bytes + ", \"diff_bytes\": " + bytes + "}";
+  // Nothing computed yet, but predicted from the shapes, for the forward
+  // pass alone of a TEST net
+  EXPECT_EQ(string::npos, this->net_->MemoryJSON().find(expected));
+  const string predicted = this->net_->MemoryJSON(true);
+  EXPECT_NE(string::npos, predicted.find(
+      "{\"name\": \"innerproduct\", \"data_bytes\": " + bytes
+      + ", \"diff_bytes\": 0}"));
+  this->net_->ForwardPrefilled();
+  this->net_->Backward();
+  const string allocated = this->net_->MemoryJSON();
+  EXPECT_NE(string::npos, allocated.find(expected));
+  // The weights of the 24x1000 product
+  EXPECT_NE(string::npos, allocated.find(
+      "{\"name\": \"innerproduct\", \"param_bytes\": "
+      + boost::lexical_cast<string>(2 * 25000 * sizeof(Dtype))));
+}
+
 class FilterNetTest : public ::testing::Test {
  protected:
   void RunFilterNetTest(
@@ -2317,6 +4357,41 @@ TYPED_TEST(NetTest, TestReshape) {
   }
 }
 
+TYPED_TEST(NetTest, TestWarmUp) {
+  typedef typename TypeParam::Dtype Dtype;
+  Caffe::set_random_seed(this->seed_);
+  this->InitReshapableNet();
+  vector<vector<int> > shapes(1, vector<int>(4));
+  shapes[0][0] = 2;
+  shapes[0][1] = 3;
+  shapes[0][2] = 9;
+  shapes[0][3] = 11;
+  this->net_->WarmUp(shapes);
+  Blob<Dtype>* input_blob = this->net_->input_blobs()[0];
+  EXPECT_EQ(input_blob->shape(), shapes[0]);
+  const vector<shared_ptr<Blob<Dtype> > >& blobs = this->net_->blobs();
+  for (int i = 0; i < blobs.size(); ++i) {
+    EXPECT_NE(blobs[i]->data()->head(), SyncedMemory::UNINITIALIZED)
+        << this->net_->blob_names()[i];
+  }
+  Blob<Dtype>* output_blob = this->net_->output_blobs()[0];
+  EXPECT_EQ(output_blob->num(), 2);
+  // A pass at the warmed shape matches a pass of a fresh net
+  vector<Dtype> output(output_blob->cpu_data(),
+                       output_blob->cpu_data() + output_blob->count());
+  Caffe::set_random_seed(this->seed_);
+  this->InitReshapableNet();
+  input_blob = this->net_->input_blobs()[0];
+  input_blob->Reshape(shapes[0]);
+  caffe_set(input_blob->count(), Dtype(0), input_blob->mutable_cpu_data());
+  this->net_->ForwardPrefilled();
+  output_blob = this->net_->output_blobs()[0];
+  ASSERT_EQ(output_blob->count(), output.size());
+  for (int i = 0; i < output.size(); ++i) {
+    EXPECT_NEAR(output[i], output_blob->cpu_data()[i], 1e-5);
+  }
+}
+
 TYPED_TEST(NetTest, TestSkipPropagateDown) {
   // check bottom_need_backward if propagate_down is true
   this->InitSkipPropNet(false);
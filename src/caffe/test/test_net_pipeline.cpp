@@ -0,0 +1,110 @@
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/parallel.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class NetPipelineTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  NetPipelineTest() {
+    int device = 0;
+#ifndef CPU_ONLY
+    if (Caffe::mode() == Caffe::GPU) {
+      CUDA_CHECK(cudaGetDevice(&device));
+    }
+#endif
+    // The loss in a second stage, on the same device
+    std::ostringstream proto;
+    proto <<
+        "name: 'PipelinedNet' "
+        "pipeline { device: " << device << " device: " << device << " "
+        "  stage_begin: 'loss' } "
+        "layer { "
+        "  name: 'data' "
+        "  type: 'DummyData' "
+        "  dummy_data_param { "
+        "    shape { dim: 2 dim: 3 } "
+        "    shape { dim: 2 dim: 2 } "
+        "    data_filler { type: 'constant' value: 1 } "
+        "    data_filler { type: 'constant' value: 0 } "
+        "  } "
+        "  top: 'data' "
+        "  top: 'label' "
+        "} "
+        "layer { "
+        "  name: 'ip' "
+        "  type: 'InnerProduct' "
+        "  inner_product_param { "
+        "    num_output: 2 "
+        "    weight_filler { type: 'gaussian' std: 1 } "
+        "    bias_filler { type: 'gaussian' std: 1 } "
+        "  } "
+        "  bottom: 'data' "
+        "  top: 'ip' "
+        "} "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'ip' "
+        "  bottom: 'label' "
+        "  top: 'loss' "
+        "} ";
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto.str(),
+                                                        &param_));
+    param_.mutable_state()->set_phase(TRAIN);
+  }
+
+  NetParameter param_;
+};
+
+TYPED_TEST_CASE(NetPipelineTest, TestDtypesAndDevices);
+
+TYPED_TEST(NetPipelineTest, TestForwardBackward) {
+  typedef typename TypeParam::Dtype Dtype;
+  Net<Dtype> net(this->param_);
+  EXPECT_EQ(2, net.num_stages());
+  Dtype loss;
+  net.ForwardPrefilled(&loss);
+  net.ClearParamDiffs();
+  net.Backward();
+  NetParameter trained;
+  net.ToProto(&trained);
+
+  NetPipeline<Dtype> pipeline(this->param_, 3);
+  ASSERT_EQ(3, pipeline.size());
+  pipeline.net(0)->CopyTrainedLayersFrom(trained);
+  for (int i = 1; i < pipeline.size(); ++i) {
+    EXPECT_EQ(pipeline.net(0)->params()[0]->data(),
+              pipeline.net(i)->params()[0]->data());
+    EXPECT_EQ(pipeline.net(0)->params()[0]->diff(),
+              pipeline.net(i)->params()[0]->diff());
+  }
+  for (int iter = 0; iter < 2; ++iter) {
+    pipeline.net(0)->ClearParamDiffs();
+    // The micro-batches read the same records, adding the same gradients
+    EXPECT_NEAR(3 * loss, pipeline.ForwardBackward(), 1e-4);
+    const vector<shared_ptr<Blob<Dtype> > >& params = net.params();
+    for (int i = 0; i < params.size(); ++i) {
+      const Blob<Dtype>& param = *pipeline.net(0)->params()[i];
+      ASSERT_EQ(params[i]->count(), param.count());
+      for (int j = 0; j < param.count(); ++j) {
+        EXPECT_NEAR(3 * params[i]->cpu_diff()[j], param.cpu_diff()[j], 1e-4);
+      }
+    }
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,114 @@
+#include <string>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/parallel.hpp"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class NetReplicasTest : public ::testing::Test {
+ protected:
+  NetReplicasTest() {
+    const string proto =
+        "name: 'ReplicatedNet' "
+        "layer { "
+        "  name: 'data' "
+        "  type: 'DummyData' "
+        "  dummy_data_param { "
+        "    shape { dim: 2 dim: 3 } "
+        "    shape { dim: 2 dim: 2 } "
+        "    shape { dim: 2 } "
+        "    data_filler { type: 'constant' value: 1 } "
+        "    data_filler { type: 'constant' value: 0 } "
+        "    data_filler { type: 'constant' value: 2 } "
+        "  } "
+        "  top: 'data' "
+        "  top: 'label' "
+        "  top: 'extra' "
+        "} "
+        "layer { "
+        "  name: 'ip' "
+        "  type: 'InnerProduct' "
+        "  inner_product_param { "
+        "    num_output: 2 "
+        "    weight_filler { type: 'gaussian' std: 1 } "
+        "    bias_filler { type: 'gaussian' std: 1 } "
+        "  } "
+        "  bottom: 'data' "
+        "  top: 'ip' "
+        "} "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'ip' "
+        "  bottom: 'label' "
+        "  top: 'loss' "
+        "} ";
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param_));
+    param_.mutable_state()->set_phase(TEST);
+    // Random weights, saved as a trained model would be
+    Caffe::set_mode(Caffe::CPU);
+    net_.reset(new Net<Dtype>(param_));
+    MakeTempFilename(&weights_);
+    NetParameter trained;
+    net_->ToProto(&trained);
+    WriteProtoToBinaryFile(trained, weights_);
+  }
+
+  NetParameter param_;
+  shared_ptr<Net<Dtype> > net_;
+  string weights_;
+};
+
+TYPED_TEST_CASE(NetReplicasTest, TestDtypes);
+
+TYPED_TEST(NetReplicasTest, TestWeights) {
+  const vector<int> devices(2, -1);
+  NetReplicas<TypeParam> replicas(this->param_, this->weights_, devices);
+  ASSERT_EQ(replicas.size(), 2);
+  const Blob<TypeParam>& weight = *this->net_->params()[0];
+  for (int i = 0; i < replicas.size(); ++i) {
+    const Blob<TypeParam>& replica_weight = *replicas.net(i).params()[0];
+    ASSERT_EQ(replica_weight.count(), weight.count());
+    EXPECT_NE(replica_weight.cpu_data(), weight.cpu_data());
+    for (int j = 0; j < weight.count(); ++j) {
+      EXPECT_EQ(replica_weight.cpu_data()[j], weight.cpu_data()[j]);
+    }
+  }
+}
+
+TYPED_TEST(NetReplicasTest, TestForward) {
+  TypeParam loss;
+  const vector<Blob<TypeParam>*>& result = this->net_->ForwardPrefilled(&loss);
+  vector<TypeParam> values;
+  for (int j = 0; j < result.size(); ++j) {
+    values.insert(values.end(), result[j]->cpu_data(),
+        result[j]->cpu_data() + result[j]->count());
+  }
+  ASSERT_EQ(values.size(), 3);
+  const vector<int> devices(3, -1);
+  NetReplicas<TypeParam> replicas(this->param_, this->weights_, devices);
+  vector<TypeParam> losses;
+  vector<vector<TypeParam> > outputs;
+  replicas.Forward(6, &losses, &outputs);
+  ASSERT_EQ(losses.size(), 6);
+  ASSERT_EQ(outputs.size(), 6);
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(losses[i], loss);
+    ASSERT_EQ(outputs[i].size(), values.size());
+    for (int j = 0; j < values.size(); ++j) {
+      EXPECT_EQ(outputs[i][j], values[j]);
+    }
+  }
+}
+
+}  // namespace caffe
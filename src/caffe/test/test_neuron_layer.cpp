@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <vector>
 
@@ -37,6 +38,40 @@ class NeuronLayerTest : public MultiDeviceTest<TypeParam> {
   vector<Blob<Dtype>*> blob_bottom_vec_;
   vector<Blob<Dtype>*> blob_top_vec_;
 
+  // Checks the outputs of a layer with approximate_math against those of
+  // the same layer without it.
+  void TestApproximateForward(Layer<Dtype>* exact, Layer<Dtype>* approximate) {
+    exact->SetUp(blob_bottom_vec_, blob_top_vec_);
+    exact->Forward(blob_bottom_vec_, blob_top_vec_);
+    Blob<Dtype> expected;
+    expected.CopyFrom(*blob_top_, false, true);
+    approximate->SetUp(blob_bottom_vec_, blob_top_vec_);
+    approximate->Forward(blob_bottom_vec_, blob_top_vec_);
+    const Dtype* top_data = blob_top_->cpu_data();
+    for (int i = 0; i < blob_top_->count(); ++i) {
+      const Dtype value = expected.cpu_data()[i];
+      EXPECT_NEAR(value, top_data[i], 1e-5 * std::abs(value));
+    }
+  }
+
+  // A chain of all the layers FusedElementwiseLayer applies
+  LayerParameter FusedElementwiseParam() {
+    LayerParameter layer_param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(
+        "type: 'FusedElementwise' fused_elementwise_param { "
+        "  layer { type: 'ReLU' relu_param { negative_slope: 0.1 } } "
+        "  layer { type: 'Power' power_param { power: 2 scale: 0.5 "
+        "      shift: 1 } } "
+        "  layer { type: 'Exp' exp_param { base: 2 scale: 0.3 shift: 1 } } "
+        "  layer { type: 'Log' log_param { shift: -2 } } "
+        "  layer { type: 'Sigmoid' } "
+        "  layer { type: 'TanH' } "
+        "  layer { type: 'Power' power_param { power: 3 shift: -0.5 } } "
+        "  layer { type: 'AbsVal' } "
+        "}", &layer_param));
+    return layer_param;
+  }
+
   void TestDropoutForward(const float dropout_ratio) {
     LayerParameter layer_param;
     // Fill in the given dropout_ratio, unless it's 0.5, in which case we don't
@@ -268,6 +303,15 @@ TYPED_TEST(NeuronLayerTest, TestSigmoidGradient) {
       this->blob_top_vec_);
 }
 
+TYPED_TEST(NeuronLayerTest, TestSigmoidApproximate) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  SigmoidLayer<Dtype> exact(layer_param);
+  layer_param.set_approximate_math(true);
+  SigmoidLayer<Dtype> approximate(layer_param);
+  this->TestApproximateForward(&exact, &approximate);
+}
+
 TYPED_TEST(NeuronLayerTest, TestTanH) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -300,6 +344,15 @@ TYPED_TEST(NeuronLayerTest, TestTanHGradient) {
       this->blob_top_vec_);
 }
 
+TYPED_TEST(NeuronLayerTest, TestTanHApproximate) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  TanHLayer<Dtype> exact(layer_param);
+  layer_param.set_approximate_math(true);
+  TanHLayer<Dtype> approximate(layer_param);
+  this->TestApproximateForward(&exact, &approximate);
+}
+
 TYPED_TEST(NeuronLayerTest, TestExpLayer) {
   typedef typename TypeParam::Dtype Dtype;
   // Test default base of "-1" -- should actually set base := e.
@@ -382,6 +435,17 @@ TYPED_TEST(NeuronLayerTest, TestExpGradientBase2Shift1Scale3) {
   this->TestExpGradient(kBase, kScale, kShift);
 }
 
+TYPED_TEST(NeuronLayerTest, TestExpApproximate) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_exp_param()->set_base(2);
+  layer_param.mutable_exp_param()->set_scale(3);
+  ExpLayer<Dtype> exact(layer_param);
+  layer_param.set_approximate_math(true);
+  ExpLayer<Dtype> approximate(layer_param);
+  this->TestApproximateForward(&exact, &approximate);
+}
+
 TYPED_TEST(NeuronLayerTest, TestLogLayer) {
   typedef typename TypeParam::Dtype Dtype;
   // Test default base of "-1" -- should actually set base := e.
@@ -491,6 +555,49 @@ TYPED_TEST(NeuronLayerTest, TestDropoutTestPhase) {
   }
 }
 
+TYPED_TEST(NeuronLayerTest, TestDropoutBackwardMask) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.set_phase(TRAIN);
+  DropoutLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  caffe_set(this->blob_top_->count(), Dtype(1),
+      this->blob_top_->mutable_cpu_diff());
+  vector<bool> propagate_down(1, true);
+  layer.Backward(this->blob_top_vec_, propagate_down, this->blob_bottom_vec_);
+  // The gradient goes through the inputs kept by the last forward only
+  const Dtype* top_data = this->blob_top_->cpu_data();
+  const Dtype* bottom_diff = this->blob_bottom_->cpu_diff();
+  for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+    EXPECT_EQ(top_data[i] != 0 ? Dtype(2) : Dtype(0), bottom_diff[i]);
+  }
+}
+
+TYPED_TEST(NeuronLayerTest, TestDropoutThreadsReproducible) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Large enough for the mask to be split between threads
+  this->blob_bottom_->Reshape(8, 4, 64, 64);
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  layer_param.set_phase(TRAIN);
+  DropoutLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  Caffe::set_random_seed(1701);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  Blob<Dtype> expected;
+  expected.CopyFrom(*this->blob_top_, false, true);
+  Caffe::set_cpu_threads(4);
+  Caffe::set_random_seed(1701);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  Caffe::set_cpu_threads(1);
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_EQ(expected.cpu_data()[i], this->blob_top_->cpu_data()[i]);
+  }
+}
+
 TYPED_TEST(NeuronLayerTest, TestDropoutGradient) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -535,6 +642,88 @@ TYPED_TEST(NeuronLayerTest, TestBNLLGradient) {
       this->blob_top_vec_);
 }
 
+TYPED_TEST(NeuronLayerTest, TestBNLLApproximate) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  BNLLLayer<Dtype> exact(layer_param);
+  layer_param.set_approximate_math(true);
+  BNLLLayer<Dtype> approximate(layer_param);
+  this->TestApproximateForward(&exact, &approximate);
+}
+
+TYPED_TEST(NeuronLayerTest, TestBNLLGradientApproximate) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.set_approximate_math(true);
+  BNLLLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientEltwise(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(NeuronLayerTest, TestFusedElementwise) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param = this->FusedElementwiseParam();
+  FusedElementwiseLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  // The same as the layers one after the other
+  Blob<Dtype> expected;
+  expected.CopyFrom(*this->blob_bottom_, false, true);
+  vector<Blob<Dtype>*> expected_vec(1, &expected);
+  const FusedElementwiseParameter& fused_param =
+      layer_param.fused_elementwise_param();
+  for (int i = 0; i < fused_param.layer_size(); ++i) {
+    shared_ptr<Layer<Dtype> > chained =
+        LayerRegistry<Dtype>::CreateLayer(fused_param.layer(i));
+    chained->SetUp(expected_vec, expected_vec);
+    chained->Forward(expected_vec, expected_vec);
+  }
+  const Dtype* top_data = this->blob_top_->cpu_data();
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    const Dtype value = expected.cpu_data()[i];
+    EXPECT_NEAR(value, top_data[i], 1e-5 * std::max(Dtype(1), std::abs(value)));
+  }
+}
+
+TYPED_TEST(NeuronLayerTest, TestFusedElementwiseGradient) {
+  typedef typename TypeParam::Dtype Dtype;
+  FusedElementwiseLayer<Dtype> layer(this->FusedElementwiseParam());
+  GradientChecker<Dtype> checker(1e-3, 1e-2, 1701, 0., 0.01);
+  checker.CheckGradientEltwise(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(NeuronLayerTest, TestFusedElementwiseInPlace) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param = this->FusedElementwiseParam();
+  FusedElementwiseLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  Blob<Dtype> diff;
+  diff.ReshapeLike(*this->blob_top_);
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(&diff);
+  caffe_copy(diff.count(), diff.cpu_data(),
+      this->blob_top_->mutable_cpu_diff());
+  vector<bool> propagate_down(1, true);
+  layer.Backward(this->blob_top_vec_, propagate_down, this->blob_bottom_vec_);
+  // In place, from the inputs kept
+  Blob<Dtype> in_place;
+  in_place.CopyFrom(*this->blob_bottom_, false, true);
+  vector<Blob<Dtype>*> in_place_vec(1, &in_place);
+  FusedElementwiseLayer<Dtype> in_place_layer(layer_param);
+  in_place_layer.SetUp(in_place_vec, in_place_vec);
+  in_place_layer.Forward(in_place_vec, in_place_vec);
+  caffe_copy(diff.count(), diff.cpu_data(), in_place.mutable_cpu_diff());
+  in_place_layer.Backward(in_place_vec, propagate_down, in_place_vec);
+  for (int i = 0; i < in_place.count(); ++i) {
+    EXPECT_EQ(this->blob_top_->cpu_data()[i], in_place.cpu_data()[i]);
+    EXPECT_EQ(this->blob_bottom_->cpu_diff()[i], in_place.cpu_diff()[i]);
+  }
+}
+
 TYPED_TEST(NeuronLayerTest, TestPReLUParam) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -0,0 +1,46 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/numa.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class NUMATest : public ::testing::Test {};
+
+TEST_F(NUMATest, TestParseCPUList) {
+  vector<int> cpus;
+  ASSERT_TRUE(ParseCPUList("0-3,8,10-11", &cpus));
+  const int expected[] = {0, 1, 2, 3, 8, 10, 11};
+  ASSERT_EQ(7, cpus.size());
+  for (int i = 0; i < cpus.size(); ++i) {
+    EXPECT_EQ(expected[i], cpus[i]);
+  }
+  ASSERT_TRUE(ParseCPUList("5", &cpus));
+  ASSERT_EQ(1, cpus.size());
+  EXPECT_EQ(5, cpus[0]);
+  EXPECT_FALSE(ParseCPUList("", &cpus));
+  EXPECT_FALSE(ParseCPUList("3-1", &cpus));
+  EXPECT_FALSE(ParseCPUList("0-3x", &cpus));
+}
+
+TEST_F(NUMATest, TestSharedPCIBridges) {
+  // Two GPUs behind the same switch, under root port 0000:00:02.0
+  const string switch0 =
+      "pci0000:00/0000:00:02.0/0000:03:00.0/0000:04:08.0/0000:06:00.0";
+  const string switch1 =
+      "pci0000:00/0000:00:02.0/0000:03:00.0/0000:04:10.0/0000:07:00.0";
+  // Behind another root port of the same root complex
+  const string port = "pci0000:00/0000:00:03.0/0000:08:00.0";
+  // Behind the root complex of the other socket
+  const string socket = "pci0000:80/0000:80:02.0/0000:82:00.0";
+  EXPECT_EQ(2, SharedPCIBridges(switch0, switch1));
+  EXPECT_EQ(0, SharedPCIBridges(switch0, port));
+  EXPECT_EQ(-1, SharedPCIBridges(switch0, socket));
+  EXPECT_EQ(-1, SharedPCIBridges(switch0, ""));
+}
+
+}  // namespace caffe
@@ -0,0 +1,87 @@
+#include <stdint.h>
+
+#include <cmath>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/philox.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class PhiloxTest : public ::testing::Test {};
+
+TEST_F(PhiloxTest, TestKnownAnswers) {
+  // The known answer vectors of Random123
+  uint32_t zeros[4] = {0, 0, 0, 0};
+  philox4x32_10(zeros, 0, 0);
+  EXPECT_EQ(0x6627e8d5u, zeros[0]);
+  EXPECT_EQ(0xe169c58du, zeros[1]);
+  EXPECT_EQ(0xbc57ac4cu, zeros[2]);
+  EXPECT_EQ(0x9b00dbd8u, zeros[3]);
+  uint32_t ones[4] = {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff};
+  philox4x32_10(ones, 0xffffffff, 0xffffffff);
+  EXPECT_EQ(0x408f276du, ones[0]);
+  EXPECT_EQ(0x41c83b0eu, ones[1]);
+  EXPECT_EQ(0xa20bc7c6u, ones[2]);
+  EXPECT_EQ(0x6d5451fdu, ones[3]);
+  uint32_t pi[4] = {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344};
+  philox4x32_10(pi, 0xa4093822, 0x299f31d0);
+  EXPECT_EQ(0xd16cfe09u, pi[0]);
+  EXPECT_EQ(0x94fdccebu, pi[1]);
+  EXPECT_EQ(0x5001e420u, pi[2]);
+  EXPECT_EQ(0x24126ea1u, pi[3]);
+}
+
+TEST_F(PhiloxTest, TestOffsets) {
+  const uint64_t key = 0x0123456789abcdefull;
+  for (int offset = 0; offset < 9; ++offset) {
+    PhiloxRNG rng(key, 0, offset);
+    for (int i = offset; i < 64; ++i) {
+      EXPECT_EQ(philox_value(key, i), rng());
+    }
+  }
+}
+
+TEST_F(PhiloxTest, TestStreams) {
+  const uint64_t key = 1701;
+  PhiloxRNG rng(key, 0);
+  PhiloxRNG other_rng(key, 1);
+  PhiloxRNG other_key_rng(key + 1, 0);
+  int same_stream = 0;
+  int same_key = 0;
+  for (int i = 0; i < 1000; ++i) {
+    const uint32_t value = rng();
+    same_stream += value == other_rng();
+    same_key += value == other_key_rng();
+  }
+  EXPECT_EQ(0, same_stream);
+  EXPECT_EQ(0, same_key);
+}
+
+TEST_F(PhiloxTest, TestUniform) {
+  PhiloxRNG rng(1701, 0);
+  const int sample_size = 10000;
+  double sum = 0;
+  for (int i = 0; i < sample_size; ++i) {
+    const float value = rng.uniform();
+    EXPECT_GE(value, 0.f);
+    EXPECT_LT(value, 1.f);
+    sum += value;
+  }
+  // Within 3.8 standard deviations, 1 / sqrt(12 sample_size), of 1 / 2
+  EXPECT_NEAR(0.5, sum / sample_size, 3.8 / sqrt(12. * sample_size));
+}
+
+TEST_F(PhiloxTest, TestKeysReproducible) {
+  Caffe::set_random_seed(1701);
+  const uint64_t key = caffe_rng_key();
+  Caffe::set_random_seed(1701);
+  EXPECT_EQ(key, caffe_rng_key());
+  EXPECT_NE(key, caffe_rng_key());
+}
+
+}  // namespace caffe
@@ -5,6 +5,7 @@
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
+#include "caffe/common_layers.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/vision_layers.hpp"
 
@@ -384,6 +385,28 @@ TYPED_TEST(PoolingLayerTest, TestSetup) {
   EXPECT_EQ(this->blob_top_->width(), 2);
 }
 
+TYPED_TEST(PoolingLayerTest, TestCost) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_kernel_size(3);
+  pooling_param->set_stride(2);
+  PoolingLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const double top = this->blob_top_->count();
+  EXPECT_EQ(9 * top,
+      layer.ForwardFlops(this->blob_bottom_vec_, this->blob_top_vec_));
+  EXPECT_EQ(top,
+      layer.BackwardFlops(this->blob_bottom_vec_, this->blob_top_vec_));
+  EXPECT_EQ((this->blob_bottom_->count() + top) * sizeof(Dtype),
+      layer.ForwardBytes(this->blob_bottom_vec_, this->blob_top_vec_));
+  pooling_param->set_pool(PoolingParameter_PoolMethod_AVE);
+  PoolingLayer<Dtype> average(layer_param);
+  average.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(9 * top,
+      average.BackwardFlops(this->blob_bottom_vec_, this->blob_top_vec_));
+}
+
 TYPED_TEST(PoolingLayerTest, TestSetupPadded) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -472,6 +495,59 @@ TYPED_TEST(PoolingLayerTest, TestGradientMax) {
   }
 }
 
+TYPED_TEST(PoolingLayerTest, TestGradientStride2Unpadded) {
+  typedef typename TypeParam::Dtype Dtype;
+  // The windows the CPU pools with kernels specialized for their size
+  for (int kernel = 2; kernel <= 3; kernel++) {
+    for (int pool = PoolingParameter_PoolMethod_MAX;
+         pool <= PoolingParameter_PoolMethod_AVE; pool++) {
+      LayerParameter layer_param;
+      PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+      pooling_param->set_kernel_size(kernel);
+      pooling_param->set_stride(2);
+      pooling_param->set_pool(PoolingParameter_PoolMethod(pool));
+      PoolingLayer<Dtype> layer(layer_param);
+      GradientChecker<Dtype> checker(1e-4, 1e-2);
+      checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+          this->blob_top_vec_);
+    }
+  }
+}
+
+TYPED_TEST(PoolingLayerTest, TestBackwardMaxTestPhase) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_kernel_size(3);
+  pooling_param->set_stride(2);
+  PoolingLayer<Dtype> train_layer(layer_param);
+  train_layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  train_layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  Blob<Dtype> train_top, train_bottom;
+  train_top.CopyFrom(*this->blob_top_, false, true);
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    this->blob_top_->mutable_cpu_diff()[i] = i;
+  }
+  vector<bool> propagate_down(1, true);
+  train_layer.Backward(this->blob_top_vec_, propagate_down,
+      this->blob_bottom_vec_);
+  train_bottom.CopyFrom(*this->blob_bottom_, true, true);
+  // At TEST phase the mask is only computed if backward runs
+  layer_param.set_phase(TEST);
+  PoolingLayer<Dtype> test_layer(layer_param);
+  test_layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  test_layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_EQ(train_top.cpu_data()[i], this->blob_top_->cpu_data()[i]);
+    this->blob_top_->mutable_cpu_diff()[i] = i;
+  }
+  test_layer.Backward(this->blob_top_vec_, propagate_down,
+      this->blob_bottom_vec_);
+  for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+    EXPECT_EQ(train_bottom.cpu_diff()[i], this->blob_bottom_->cpu_diff()[i]);
+  }
+}
+
 TYPED_TEST(PoolingLayerTest, TestForwardMaxPadded) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -606,6 +682,75 @@ TYPED_TEST(PoolingLayerTest, TestGradientAvePadded) {
   }
 }
 
+TYPED_TEST(PoolingLayerTest, TestForwardNHWC) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layout_param;
+  LayoutLayer<Dtype> layout(layout_param);
+  Blob<Dtype> bottom_nhwc, top_nhwc;
+  vector<Blob<Dtype>*> bottom_nhwc_vec(1, &bottom_nhwc);
+  vector<Blob<Dtype>*> top_nhwc_vec(1, &top_nhwc);
+  layout.SetUp(this->blob_bottom_vec_, bottom_nhwc_vec);
+  layout.Forward(this->blob_bottom_vec_, bottom_nhwc_vec);
+  for (int pool = 0; pool < 2; ++pool) {
+    LayerParameter layer_param;
+    PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+    pooling_param->set_kernel_size(3);
+    pooling_param->set_stride(2);
+    pooling_param->set_pad(1);
+    pooling_param->set_pool(pool ? PoolingParameter_PoolMethod_AVE :
+        PoolingParameter_PoolMethod_MAX);
+    PoolingLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    PoolingLayer<Dtype> layer_nhwc(layer_param);
+    layer_nhwc.SetUp(bottom_nhwc_vec, top_nhwc_vec);
+    EXPECT_EQ(NHWC, top_nhwc.layout());
+    EXPECT_EQ(this->blob_top_->shape(), top_nhwc.shape());
+    layer_nhwc.Forward(bottom_nhwc_vec, top_nhwc_vec);
+    for (int n = 0; n < top_nhwc.num(); ++n) {
+      for (int c = 0; c < top_nhwc.channels(); ++c) {
+        for (int h = 0; h < top_nhwc.height(); ++h) {
+          for (int w = 0; w < top_nhwc.width(); ++w) {
+            EXPECT_NEAR(this->blob_top_->data_at(n, c, h, w),
+                        top_nhwc.data_at(n, c, h, w), 1e-5);
+          }
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(PoolingLayerTest, TestGradientMaxNHWC) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_->set_layout(NHWC);
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_kernel_size(3);
+  pooling_param->set_stride(2);
+  pooling_param->set_pad(1);
+  pooling_param->set_pool(PoolingParameter_PoolMethod_MAX);
+  PoolingLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-4, 1e-2);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(PoolingLayerTest, TestGradientAveNHWC) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_->set_layout(NHWC);
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_kernel_h(3);
+  pooling_param->set_kernel_w(4);
+  pooling_param->set_stride(2);
+  pooling_param->set_pad(2);
+  pooling_param->set_pool(PoolingParameter_PoolMethod_AVE);
+  PoolingLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-2);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
 #ifdef USE_CUDNN
 template <typename Dtype>
 class CuDNNPoolingLayerTest : public GPUDeviceTest<Dtype> {
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/vision_layers.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class ROIPoolingLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  ROIPoolingLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 3, 12, 10)),
+        blob_bottom_rois_(new Blob<Dtype>(4, 5, 1, 1)),
+        blob_top_(new Blob<Dtype>()) {
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    // (image, x1, y1, x2, y2) in pixels of images twice as large: a box,
+    // one past the border, a single pixel and the whole second image
+    const Dtype rois[] = { 0, 2, 4, 13, 17,
+                           1, 10, 12, 30, 40,
+                           0, 6, 6, 6, 6,
+                           1, 0, 0, 19, 23 };
+    std::copy(rois, rois + 20, blob_bottom_rois_->mutable_cpu_data());
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_rois_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~ROIPoolingLayerTest() {
+    delete blob_bottom_;
+    delete blob_bottom_rois_;
+    delete blob_top_;
+  }
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_bottom_rois_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(ROIPoolingLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(ROIPoolingLayerTest, TestSetup) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_roi_pooling_param()->set_pooled_h(3);
+  layer_param.mutable_roi_pooling_param()->set_pooled_w(2);
+  ROIPoolingLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(4, this->blob_top_->num());
+  EXPECT_EQ(3, this->blob_top_->channels());
+  EXPECT_EQ(3, this->blob_top_->height());
+  EXPECT_EQ(2, this->blob_top_->width());
+}
+
+TYPED_TEST(ROIPoolingLayerTest, TestForward) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_roi_pooling_param()->set_pooled_h(3);
+  layer_param.mutable_roi_pooling_param()->set_pooled_w(2);
+  layer_param.mutable_roi_pooling_param()->set_spatial_scale(0.5);
+  ROIPoolingLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  // The first box is rows [2, 10) and columns [1, 8) of image 0, in bins
+  // of 8 / 3 by 7 / 2 rounded outwards
+  for (int c = 0; c < 3; ++c) {
+    Dtype max = -FLT_MAX;
+    for (int h = 2; h < 5; ++h) {
+      for (int w = 1; w < 5; ++w) {
+        max = std::max(max, this->blob_bottom_->data_at(0, c, h, w));
+      }
+    }
+    EXPECT_EQ(max, this->blob_top_->data_at(0, c, 0, 0));
+    max = -FLT_MAX;
+    for (int h = 7; h < 10; ++h) {
+      for (int w = 4; w < 8; ++w) {
+        max = std::max(max, this->blob_bottom_->data_at(0, c, h, w));
+      }
+    }
+    EXPECT_EQ(max, this->blob_top_->data_at(0, c, 2, 1));
+    // The box past the border is clipped, its bins outside of it 0
+    max = -FLT_MAX;
+    for (int h = 6; h < 11; ++h) {
+      for (int w = 5; w < 10; ++w) {
+        max = std::max(max, this->blob_bottom_->data_at(1, c, h, w));
+      }
+    }
+    EXPECT_EQ(max, this->blob_top_->data_at(1, c, 0, 0));
+    EXPECT_EQ(0, this->blob_top_->data_at(1, c, 2, 1));
+    // The single pixel is in every bin
+    for (int i = 0; i < 6; ++i) {
+      EXPECT_EQ(this->blob_bottom_->data_at(0, c, 3, 3),
+                this->blob_top_->data_at(2, c, i / 2, i % 2));
+    }
+  }
+}
+
+TYPED_TEST(ROIPoolingLayerTest, TestGradient) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_roi_pooling_param()->set_pooled_h(3);
+  layer_param.mutable_roi_pooling_param()->set_pooled_w(2);
+  layer_param.mutable_roi_pooling_param()->set_spatial_scale(0.5);
+  ROIPoolingLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-4, 1e-2);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, 0);
+}
+
+}  // namespace caffe
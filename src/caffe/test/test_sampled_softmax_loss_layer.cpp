@@ -0,0 +1,177 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/vision_layers.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class SampledSoftmaxWithLossLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  SampledSoftmaxWithLossLayerTest()
+      : blob_bottom_data_(new Blob<Dtype>(4, 3, 2, 1)),
+        blob_bottom_label_(new Blob<Dtype>(4, 1, 1, 1)),
+        blob_top_loss_(new Blob<Dtype>()) {
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_data_);
+    blob_bottom_vec_.push_back(blob_bottom_data_);
+    for (int i = 0; i < blob_bottom_label_->count(); ++i) {
+      blob_bottom_label_->mutable_cpu_data()[i] = caffe_rng_rand() % 10;
+    }
+    blob_bottom_vec_.push_back(blob_bottom_label_);
+    blob_top_vec_.push_back(blob_top_loss_);
+  }
+  virtual ~SampledSoftmaxWithLossLayerTest() {
+    delete blob_bottom_data_;
+    delete blob_bottom_label_;
+    delete blob_top_loss_;
+  }
+
+  void SetUpParam(LayerParameter* layer_param, int num_sampled) {
+    InnerProductParameter* ip_param =
+        layer_param->mutable_inner_product_param();
+    ip_param->set_num_output(10);
+    ip_param->mutable_weight_filler()->set_type("gaussian");
+    ip_param->mutable_bias_filler()->set_type("gaussian");
+    layer_param->mutable_sampled_softmax_param()->set_num_sampled(num_sampled);
+  }
+
+  // The loss of an InnerProductLayer followed by a SoftmaxWithLossLayer with
+  // the given weights.
+  Dtype FullLoss(const vector<shared_ptr<Blob<Dtype> > >& blobs) {
+    LayerParameter layer_param;
+    SetUpParam(&layer_param, 1);
+    InnerProductLayer<Dtype> ip_layer(layer_param);
+    Blob<Dtype> logits;
+    vector<Blob<Dtype>*> ip_top_vec(1, &logits);
+    vector<Blob<Dtype>*> ip_bottom_vec(1, blob_bottom_data_);
+    ip_layer.SetUp(ip_bottom_vec, ip_top_vec);
+    for (int i = 0; i < blobs.size(); ++i) {
+      ip_layer.blobs()[i]->CopyFrom(*blobs[i]);
+    }
+    ip_layer.Forward(ip_bottom_vec, ip_top_vec);
+    SoftmaxWithLossLayer<Dtype> loss_layer(layer_param);
+    vector<Blob<Dtype>*> loss_bottom_vec;
+    loss_bottom_vec.push_back(&logits);
+    loss_bottom_vec.push_back(blob_bottom_label_);
+    loss_layer.SetUp(loss_bottom_vec, blob_top_vec_);
+    return loss_layer.Forward(loss_bottom_vec, blob_top_vec_);
+  }
+
+  Blob<Dtype>* const blob_bottom_data_;
+  Blob<Dtype>* const blob_bottom_label_;
+  Blob<Dtype>* const blob_top_loss_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(SampledSoftmaxWithLossLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(SampledSoftmaxWithLossLayerTest, TestSetUp) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  this->SetUpParam(&layer_param, 3);
+  SampledSoftmaxWithLossLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // The parameters are those of an InnerProductLayer.
+  ASSERT_EQ(layer.blobs().size(), 2);
+  EXPECT_EQ(layer.blobs()[0]->num_axes(), 2);
+  EXPECT_EQ(layer.blobs()[0]->shape(0), 10);
+  EXPECT_EQ(layer.blobs()[0]->shape(1), 6);
+  EXPECT_EQ(layer.blobs()[1]->num_axes(), 1);
+  EXPECT_EQ(layer.blobs()[1]->shape(0), 10);
+  EXPECT_EQ(this->blob_top_loss_->count(), 1);
+}
+
+TYPED_TEST(SampledSoftmaxWithLossLayerTest, TestForwardTest) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.set_phase(TEST);
+  this->SetUpParam(&layer_param, 3);
+  SampledSoftmaxWithLossLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const Dtype loss = layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_NEAR(loss, this->FullLoss(layer.blobs()), 1e-4);
+}
+
+TYPED_TEST(SampledSoftmaxWithLossLayerTest, TestForwardAllSampled) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Drawing uniformly many more classes than there are, all are candidates
+  // with the same offset, so the loss is the full one.
+  LayerParameter layer_param;
+  this->SetUpParam(&layer_param, 1000);
+  layer_param.mutable_sampled_softmax_param()->set_sampler(
+      SampledSoftmaxParameter_Sampler_UNIFORM);
+  SampledSoftmaxWithLossLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const Dtype loss = layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_NEAR(loss, this->FullLoss(layer.blobs()), 1e-4);
+}
+
+TYPED_TEST(SampledSoftmaxWithLossLayerTest, TestBackwardSparse) {
+  typedef typename TypeParam::Dtype Dtype;
+  // With labels 0 to 3 and a single class drawn, only the rows of the labels
+  // and of that class get a gradient.
+  for (int i = 0; i < this->blob_bottom_label_->count(); ++i) {
+    this->blob_bottom_label_->mutable_cpu_data()[i] = i;
+  }
+  LayerParameter layer_param;
+  this->SetUpParam(&layer_param, 1);
+  SampledSoftmaxWithLossLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    caffe_set(layer.blobs()[i]->count(), Dtype(0),
+        layer.blobs()[i]->mutable_cpu_diff());
+  }
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  vector<bool> propagate_down(2, false);
+  propagate_down[0] = true;
+  layer.Backward(this->blob_top_vec_, propagate_down, this->blob_bottom_vec_);
+  const Blob<Dtype>& weight = *layer.blobs()[0];
+  int rows = 0;
+  for (int c = 0; c < weight.shape(0); ++c) {
+    bool nonzero = false;
+    for (int k = 0; k < weight.shape(1); ++k) {
+      nonzero = nonzero || weight.cpu_diff()[c * weight.shape(1) + k] != 0;
+    }
+    rows += nonzero;
+  }
+  EXPECT_GE(rows, 4);
+  EXPECT_LE(rows, 5);
+}
+
+TYPED_TEST(SampledSoftmaxWithLossLayerTest, TestGradient) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Log-uniform draws include all 10 classes with overwhelming probability,
+  // so the loss does not change from one forward to the next.
+  LayerParameter layer_param;
+  this->SetUpParam(&layer_param, 2000);
+  SampledSoftmaxWithLossLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-2, 1701);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, 0);
+}
+
+TYPED_TEST(SampledSoftmaxWithLossLayerTest, TestGradientTest) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.set_phase(TEST);
+  this->SetUpParam(&layer_param, 3);
+  layer_param.mutable_loss_param()->set_ignore_label(0);
+  SampledSoftmaxWithLossLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-2, 1701);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, 0);
+}
+
+}  // namespace caffe
@@ -118,6 +118,28 @@ TYPED_TEST(SliceLayerTest, TestSliceAcrossNum) {
   }
 }
 
+TYPED_TEST(SliceLayerTest, TestSliceAcrossNumView) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_slice_param()->set_axis(0);
+  layer_param.mutable_slice_param()->set_view(true);
+  SliceLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_0_);
+  const int top_count = this->blob_bottom_->count() / 2;
+  ASSERT_EQ(top_count, this->blob_top_0_->count());
+  ASSERT_EQ(top_count, this->blob_top_1_->count());
+  EXPECT_EQ(this->blob_bottom_->cpu_data(), this->blob_top_0_->cpu_data());
+  EXPECT_EQ(this->blob_bottom_->cpu_data() + top_count,
+      this->blob_top_1_->cpu_data());
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_0_);
+  for (int i = 0; i < top_count; ++i) {
+    EXPECT_EQ(this->blob_bottom_->cpu_data()[i],
+        this->blob_top_0_->cpu_data()[i]);
+    EXPECT_EQ(this->blob_bottom_->cpu_data()[i + top_count],
+        this->blob_top_1_->cpu_data()[i]);
+  }
+}
+
 TYPED_TEST(SliceLayerTest, TestSliceAcrossChannels) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -186,4 +208,17 @@ TYPED_TEST(SliceLayerTest, TestGradientAcrossChannels) {
     this->blob_top_vec_0_);
 }
 
+TYPED_TEST(SliceLayerTest, TestGradientAcrossNumView) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Gradient checks are slow; reduce blob size.
+  this->ReduceBottomBlobSize();
+  LayerParameter layer_param;
+  layer_param.mutable_slice_param()->set_axis(0);
+  layer_param.mutable_slice_param()->set_view(true);
+  SliceLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+    this->blob_top_vec_0_);
+}
+
 }  // namespace caffe
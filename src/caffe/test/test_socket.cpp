@@ -0,0 +1,116 @@
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/socket.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class SocketRingTest : public ::testing::Test {
+ protected:
+  SocketRingTest() : size_(3), count_(10) {
+    for (int i = 0; i < size_; ++i) {
+      hosts_.push_back("localhost:" + boost::lexical_cast<string>(27500 + i));
+    }
+  }
+
+  // Member rank sends rank + 1 at indices rank, rank + 2..., and nothing
+  // for the last member
+  void SparseMember(int rank) {
+    SocketRing ring(hosts_, rank);
+    vector<int> indices;
+    vector<Dtype> values;
+    for (int i = rank; i < count_ && rank < size_ - 1; i += 2) {
+      indices.push_back(i);
+      values.push_back(rank + 1);
+    }
+    vector<Dtype> data(count_, Dtype(-1));
+    ring.sparse_all_reduce(indices, values, &data[0], count_);
+    results_[rank] = data;
+  }
+
+  void RunSparse() {
+    results_.resize(size_);
+    boost::thread_group members;
+    for (int i = 0; i < size_; ++i) {
+      members.create_thread(boost::bind(&SocketRingTest::SparseMember, this,
+                                        i));
+    }
+    members.join_all();
+  }
+
+  // Member rank holds rank * count + i, so sums are easy to check
+  void Member(int rank, bool broadcast) {
+    SocketRing ring(hosts_, rank);
+    EXPECT_EQ(rank, ring.rank());
+    EXPECT_EQ(size_, ring.size());
+    vector<Dtype> data(count_);
+    for (int i = 0; i < count_; ++i) {
+      data[i] = rank * count_ + i;
+    }
+    if (broadcast) {
+      ring.broadcast(&data[0], count_);
+    } else {
+      ring.all_reduce(&data[0], count_);
+    }
+    results_[rank] = data;
+  }
+
+  void Run(bool broadcast) {
+    results_.resize(size_);
+    boost::thread_group members;
+    for (int i = 0; i < size_; ++i) {
+      members.create_thread(boost::bind(&SocketRingTest::Member, this, i,
+                                        broadcast));
+    }
+    members.join_all();
+  }
+
+  const int size_;
+  const int count_;
+  vector<string> hosts_;
+  vector<vector<Dtype> > results_;
+};
+
+TYPED_TEST_CASE(SocketRingTest, TestDtypes);
+
+TYPED_TEST(SocketRingTest, TestAllReduce) {
+  this->Run(false);
+  for (int r = 0; r < this->size_; ++r) {
+    for (int i = 0; i < this->count_; ++i) {
+      const int sum = this->size_ * i
+          + this->count_ * this->size_ * (this->size_ - 1) / 2;
+      EXPECT_EQ(sum, this->results_[r][i]);
+    }
+  }
+}
+
+TYPED_TEST(SocketRingTest, TestBroadcast) {
+  this->Run(true);
+  for (int r = 0; r < this->size_; ++r) {
+    for (int i = 0; i < this->count_; ++i) {
+      EXPECT_EQ(i, this->results_[r][i]);
+    }
+  }
+}
+
+TYPED_TEST(SocketRingTest, TestSparseAllReduce) {
+  this->RunSparse();
+  for (int r = 0; r < this->size_; ++r) {
+    for (int i = 0; i < this->count_; ++i) {
+      // Member 0 sends the even indices, member 1 the odd ones
+      EXPECT_EQ(i % 2 == 0 ? 1 : 2, this->results_[r][i]);
+    }
+  }
+}
+
+}  // namespace caffe
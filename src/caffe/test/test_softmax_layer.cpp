@@ -71,6 +71,24 @@ TYPED_TEST(SoftmaxLayerTest, TestForward) {
   }
 }
 
+TYPED_TEST(SoftmaxLayerTest, TestForwardApproximate) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  SoftmaxLayer<Dtype> exact(layer_param);
+  exact.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  exact.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  Blob<Dtype> expected;
+  expected.CopyFrom(*this->blob_top_, false, true);
+  layer_param.set_approximate_math(true);
+  SoftmaxLayer<Dtype> approximate(layer_param);
+  approximate.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  approximate.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    const Dtype value = expected.cpu_data()[i];
+    EXPECT_NEAR(value, this->blob_top_->cpu_data()[i], 1e-5 * value);
+  }
+}
+
 TYPED_TEST(SoftmaxLayerTest, TestGradient) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
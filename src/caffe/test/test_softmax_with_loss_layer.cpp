@@ -107,4 +107,37 @@ TYPED_TEST(SoftmaxWithLossLayerTest, TestGradientUnnormalized) {
       this->blob_top_vec_, 0);
 }
 
+TYPED_TEST(SoftmaxWithLossLayerTest, TestGradientTestPhase) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.set_phase(TEST);
+  layer_param.mutable_loss_param()->set_ignore_label(0);
+  SoftmaxWithLossLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-2, 1701);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, 0);
+}
+
+TYPED_TEST(SoftmaxWithLossLayerTest, TestGradientManyClasses) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Enough classes for a block per position on the GPU
+  const int num_classes = 300;
+  this->blob_bottom_data_->Reshape(3, num_classes, 1, 1);
+  this->blob_bottom_label_->Reshape(3, 1, 1, 1);
+  FillerParameter filler_param;
+  filler_param.set_std(10);
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(this->blob_bottom_data_);
+  for (int i = 0; i < this->blob_bottom_label_->count(); ++i) {
+    this->blob_bottom_label_->mutable_cpu_data()[i] =
+        caffe_rng_rand() % num_classes;
+  }
+  LayerParameter layer_param;
+  layer_param.add_loss_weight(3);
+  SoftmaxWithLossLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-2, 1701);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, 0);
+}
+
 }  // namespace caffe
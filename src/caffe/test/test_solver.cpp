@@ -8,6 +8,7 @@
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/solver.hpp"
+#include "caffe/util/io.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 
@@ -105,4 +106,307 @@ TYPED_TEST(SolverTest, TestInitTrainTestNets) {
   EXPECT_TRUE(this->solver_->test_nets()[1]->has_layer("accuracy"));
 }
 
+TYPED_TEST(SolverTest, TestAsyncTestNets) {
+  typedef typename TypeParam::Dtype Dtype;
+  const string& proto =
+     "test_interval: 5 "
+     "test_iter: 2 "
+     "test_async: true "
+     "max_iter: 10 "
+     "base_lr: 0.1 "
+     "lr_policy: 'fixed' "
+     "snapshot_after_train: false "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 5 dim: 3 } "
+     "      shape { dim: 5 } "
+     "      data_filler { type: 'gaussian' } "
+     "      data_filler { type: 'constant' value: 1 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 2 "
+     "      weight_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->InitSolverFromProtoString(proto);
+  ASSERT_EQ(1, this->solver_->test_nets().size());
+  this->solver_->Solve();
+  // The test nets hold a copy of the weights of the last test, at the end.
+  const vector<shared_ptr<Blob<Dtype> > >& params =
+      this->solver_->net()->params();
+  const vector<shared_ptr<Blob<Dtype> > >& test_params =
+      this->solver_->test_nets()[0]->params();
+  ASSERT_EQ(params.size(), test_params.size());
+  for (int i = 0; i < params.size(); ++i) {
+    EXPECT_NE(params[i]->cpu_data(), test_params[i]->cpu_data());
+    for (int j = 0; j < params[i]->count(); ++j) {
+      EXPECT_EQ(params[i]->cpu_data()[j], test_params[i]->cpu_data()[j]);
+    }
+  }
+}
+
+TYPED_TEST(SolverTest, TestShardUpdate) {
+  typedef typename TypeParam::Dtype Dtype;
+  const string& proto =
+     "base_lr: 0.1 "
+     "lr_policy: 'fixed' "
+     "weight_decay: 0.01 "
+     "random_seed: 1701 "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 4 dim: 3 } "
+     "      shape { dim: 4 dim: 2 } "
+     "      data_filler { type: 'constant' value: 1 } "
+     "      data_filler { type: 'constant' value: 0.5 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 2 "
+     "      weight_filler { type: 'gaussian' } "
+     "      bias_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'EuclideanLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  SolverParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  param.set_solver_mode(Caffe::mode() == Caffe::GPU
+      ? SolverParameter_SolverMode_GPU : SolverParameter_SolverMode_CPU);
+  // The same net, and gradients, for all, the seed being set by each solver
+  AdamSolver<Dtype> whole(param);
+  whole.Step(1);
+  AdamSolver<Dtype> first(param);
+  AdamSolver<Dtype> second(param);
+  vector<SGDSolver<Dtype>*> shards;
+  shards.push_back(&first);
+  shards.push_back(&second);
+  // The 6 weights, then the 2 biases, the cut splitting the weights
+  vector<size_t> bounds;
+  bounds.push_back(0);
+  bounds.push_back(5);
+  bounds.push_back(8);
+  first.ShardUpdate(shards, bounds);
+  first.Step(1);
+  second.Step(1);
+  EXPECT_EQ(5, first.history()[0]->count());
+  EXPECT_EQ(0, first.history()[1]->count());
+  EXPECT_EQ(1, second.history()[0]->count());
+  EXPECT_EQ(2, second.history()[1]->count());
+  // Each shard updated its elements as the whole solver did
+  const vector<Blob<Dtype>*>& params = whole.net()->learnable_params();
+  vector<shared_ptr<Blob<Dtype> > > history;
+  first.GatherHistory(&history);
+  ASSERT_EQ(whole.history().size(), history.size());
+  for (int i = 0, offset = 0; i < params.size(); ++i) {
+    for (int j = 0; j < params[i]->count(); ++j, ++offset) {
+      AdamSolver<Dtype>* shard = offset < 5 ? &first : &second;
+      const Blob<Dtype>& shard_param = *shard->net()->learnable_params()[i];
+      EXPECT_NEAR(params[i]->cpu_data()[j], shard_param.cpu_data()[j], 1e-6);
+      for (int k = i; k < history.size(); k += params.size()) {
+        EXPECT_NEAR(whole.history()[k]->cpu_data()[j],
+            history[k]->cpu_data()[j], 1e-6);
+      }
+    }
+  }
+}
+
+TYPED_TEST(SolverTest, TestStepTiming) {
+  const string& proto =
+     "base_lr: 0.01 "
+     "lr_policy: 'fixed' "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 64 dim: 256 } "
+     "      shape { dim: 64 dim: 256 } "
+     "      data_filler { type: 'gaussian' } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 256 "
+     "      weight_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'EuclideanLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  typedef Solver<typename TypeParam::Dtype> SolverType;
+  this->InitSolverFromProtoString(proto);
+  SolverType* solver = this->solver_.get();
+  solver->Step(1);
+  EXPECT_EQ(0, solver->step_time(SolverType::STEP_FORWARD));
+  solver->set_step_timing(true);
+  solver->Step(2);
+  EXPECT_GT(solver->step_time(SolverType::STEP_FORWARD), 0);
+  EXPECT_GT(solver->step_time(SolverType::STEP_BACKWARD), 0);
+  EXPECT_GT(solver->step_time(SolverType::STEP_UPDATE), 0);
+  // Restarts from zero
+  solver->set_step_timing(true);
+  EXPECT_EQ(0, solver->step_time(SolverType::STEP_FORWARD));
+  solver->set_step_timing(false);
+  solver->Step(1);
+  EXPECT_EQ(0, solver->step_time(SolverType::STEP_FORWARD));
+}
+
+TYPED_TEST(SolverTest, TestMetrics) {
+  const string& proto =
+     "base_lr: 0.01 "
+     "lr_policy: 'fixed' "
+     "iter_size: 2 "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 8 dim: 16 } "
+     "      shape { dim: 8 dim: 4 } "
+     "      data_filler { type: 'gaussian' } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 4 "
+     "      weight_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'EuclideanLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->InitSolverFromProtoString(proto);
+  shared_ptr<Metrics> metrics(new Metrics());
+  this->solver_->set_metrics(metrics);
+  this->solver_->Step(3);
+  EXPECT_EQ(3, metrics->get("caffe_train_iterations_total", ""));
+  EXPECT_EQ(3, metrics->get("caffe_train_iteration", ""));
+  EXPECT_EQ(3 * 2 * 8, metrics->get("caffe_train_items_total", ""));
+  EXPECT_GT(metrics->get("caffe_train_loss", ""), 0);
+  EXPECT_GT(metrics->get("caffe_train_step_seconds_total",
+                         "phase=\"forward\""), 0);
+  EXPECT_NE(string::npos,
+            metrics->text().find("# TYPE caffe_train_items_total counter"));
+}
+
+static bool stop_at_snapshot() {
+  return true;
+}
+
+TYPED_TEST(SolverTest, TestStopAtSnapshot) {
+  string snapshot_prefix;
+  MakeTempDir(&snapshot_prefix);
+  ostringstream proto;
+  proto <<
+     "base_lr: 0.01 "
+     "lr_policy: 'fixed' "
+     "global_iter_size: 4 "
+     "max_iter: 6 "
+     "snapshot: 2 "
+     "snapshot_prefix: '" << snapshot_prefix << "/' "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 2 dim: 3 } "
+     "      shape { dim: 2 dim: 2 } "
+     "      data_filler { type: 'gaussian' } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 2 "
+     "      weight_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'EuclideanLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  // The batches of an update are shared by the solvers
+  Caffe::set_solver_count(2);
+  this->InitSolverFromProtoString(proto.str());
+  Caffe::set_solver_count(1);
+  Solver<typename TypeParam::Dtype>* solver = this->solver_.get();
+  EXPECT_EQ(2, solver->param().iter_size());
+  solver->set_stop_at_snapshot(&stop_at_snapshot);
+  solver->Solve();
+  EXPECT_EQ(2, solver->iter());
+  const string state = solver->SnapshotStateFilename();
+  EXPECT_EQ(snapshot_prefix + "/_iter_2.solverstate", state);
+  // Resumes on a single solver running all the batches
+  this->InitSolverFromProtoString(proto.str());
+  EXPECT_EQ(4, this->solver_->param().iter_size());
+  this->solver_->Restore(state.c_str());
+  EXPECT_EQ(2, this->solver_->iter());
+}
+
 }  // namespace caffe
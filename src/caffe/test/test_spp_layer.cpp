@@ -127,5 +127,71 @@ TYPED_TEST(SPPLayerTest, TestGradient) {
       this->blob_top_vec_);
 }
 
+TYPED_TEST(SPPLayerTest, TestGradientAve) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  SPPParameter* spp_param = layer_param.mutable_spp_param();
+  spp_param->set_pyramid_height(3);
+  spp_param->set_pool(SPPParameter_PoolMethod_AVE);
+  SPPLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-4, 1e-2);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(SPPLayerTest, TestForwardMatchesPooling) {
+  typedef typename TypeParam::Dtype Dtype;
+  const int pyramid_height = 3;
+  for (int pool = 0; pool < 2; ++pool) {
+    LayerParameter layer_param;
+    SPPParameter* spp_param = layer_param.mutable_spp_param();
+    spp_param->set_pyramid_height(pyramid_height);
+    spp_param->set_pool(pool ? SPPParameter_PoolMethod_AVE :
+        SPPParameter_PoolMethod_MAX);
+    SPPLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    // Each level must hold what a PoolingLayer with the windows covering the
+    // entire image computes.
+    const int height = this->blob_bottom_->height();
+    const int width = this->blob_bottom_->width();
+    const int top_dim = this->blob_top_->count(1);
+    int level_begin = 0;
+    for (int l = 0; l < pyramid_height; ++l) {
+      const int num_bins = 1 << l;
+      const int kernel_h = (height + num_bins - 1) / num_bins;
+      const int kernel_w = (width + num_bins - 1) / num_bins;
+      LayerParameter pooling_layer_param;
+      PoolingParameter* pooling_param =
+          pooling_layer_param.mutable_pooling_param();
+      pooling_param->set_kernel_h(kernel_h);
+      pooling_param->set_kernel_w(kernel_w);
+      pooling_param->set_stride_h(kernel_h);
+      pooling_param->set_stride_w(kernel_w);
+      pooling_param->set_pad_h((kernel_h * num_bins - height + 1) / 2);
+      pooling_param->set_pad_w((kernel_w * num_bins - width + 1) / 2);
+      pooling_param->set_pool(pool ? PoolingParameter_PoolMethod_AVE :
+          PoolingParameter_PoolMethod_MAX);
+      PoolingLayer<Dtype> pooling_layer(pooling_layer_param);
+      Blob<Dtype> pooled;
+      vector<Blob<Dtype>*> pooled_vec(1, &pooled);
+      pooling_layer.SetUp(this->blob_bottom_vec_, pooled_vec);
+      pooling_layer.Forward(this->blob_bottom_vec_, pooled_vec);
+      const int level_dim = pooled.count(1);
+      ASSERT_EQ(this->blob_bottom_->channels() * num_bins * num_bins,
+                level_dim);
+      for (int n = 0; n < pooled.num(); ++n) {
+        for (int i = 0; i < level_dim; ++i) {
+          EXPECT_NEAR(pooled.cpu_data()[n * level_dim + i],
+              this->blob_top_->cpu_data()[n * top_dim + level_begin + i],
+              1e-5);
+        }
+      }
+      level_begin += level_dim;
+    }
+    EXPECT_EQ(top_dim, level_begin);
+  }
+}
 
 }  // namespace caffe
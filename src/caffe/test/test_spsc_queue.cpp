@@ -0,0 +1,62 @@
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/util/spsc_queue.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+// Pushes 0 to count - 1, parking whenever the queue is full.
+class ProducerThread : public InternalThread {
+ public:
+  ProducerThread(SPSCQueue<int>* queue, int count)
+      : queue_(queue), count_(count) {}
+  virtual ~ProducerThread() { StopInternalThread(); }
+
+ protected:
+  virtual void InternalThreadEntry() {
+    for (int i = 0; i < count_; ++i) {
+      queue_->push(i);
+    }
+  }
+
+  SPSCQueue<int>* queue_;
+  const int count_;
+};
+
+class SPSCQueueTest : public ::testing::Test {};
+
+TEST_F(SPSCQueueTest, TestPushPop) {
+  SPSCQueue<int> queue(3);
+  int value;
+  EXPECT_FALSE(queue.try_pop(&value));
+  // Rounded up to 4 slots
+  for (int i = 0; i < 4; ++i) {
+    queue.push(i);
+  }
+  EXPECT_EQ(4, queue.size());
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(i, queue.pop());
+  }
+  EXPECT_EQ(0, queue.size());
+  queue.push(4);
+  ASSERT_TRUE(queue.try_pop(&value));
+  EXPECT_EQ(4, value);
+  EXPECT_FALSE(queue.try_pop(&value));
+}
+
+TEST_F(SPSCQueueTest, TestThreads) {
+  const int count = 100000;
+  SPSCQueue<int> queue(4);
+  ProducerThread producer(&queue, count);
+  producer.StartInternalThread();
+  for (int i = 0; i < count; ++i) {
+    ASSERT_EQ(i, queue.pop());
+  }
+  producer.StopInternalThread();
+  EXPECT_EQ(0, queue.size());
+}
+
+}  // namespace caffe
@@ -68,6 +68,45 @@ TEST_F(SyncedMemoryTest, TestCPUWrite) {
   }
 }
 
+TEST_F(SyncedMemoryTest, TestView) {
+  shared_ptr<SyncedMemory> mem(new SyncedMemory(10));
+  SyncedMemory view(mem, 4, 6);
+  EXPECT_EQ(view.size(), 6);
+  EXPECT_EQ(view.head(), SyncedMemory::UNINITIALIZED);
+  caffe_memset(view.size(), 1, view.mutable_cpu_data());
+  EXPECT_EQ(mem->head(), SyncedMemory::HEAD_AT_CPU);
+  EXPECT_EQ(view.cpu_data(), static_cast<const char*>(mem->cpu_data()) + 4);
+  for (int i = 0; i < mem->size(); ++i) {
+    EXPECT_EQ((static_cast<const char*>(mem->cpu_data()))[i], i < 4 ? 0 : 1);
+  }
+}
+
+TEST_F(SyncedMemoryTest, TestHugePages) {
+  Caffe::set_mode(Caffe::CPU);
+  CaffeSetHugePages(1 << 20, false);
+  const HugePageStats start = CaffeHugePageStats();
+  {
+    // Below the threshold, from malloc
+    SyncedMemory small(1000);
+    small.mutable_cpu_data();
+    EXPECT_EQ(start.allocations, CaffeHugePageStats().allocations);
+    SyncedMemory large(3 << 20);
+    void* cpu_data = large.mutable_cpu_data();
+    const HugePageStats stats = CaffeHugePageStats();
+    if (stats.allocations > start.allocations) {
+      EXPECT_EQ(0, reinterpret_cast<size_t>(cpu_data) % (2 << 20));
+      EXPECT_EQ(start.used + (4 << 20), stats.used);
+      EXPECT_GE(stats.peak, stats.used);
+    }
+    for (int i = 0; i < large.size(); i += 4096) {
+      EXPECT_EQ(0, static_cast<char*>(cpu_data)[i]);
+    }
+    caffe_memset(large.size(), 1, cpu_data);
+  }
+  EXPECT_EQ(start.used, CaffeHugePageStats().used);
+  CaffeSetHugePages(0, false);
+}
+
 #ifndef CPU_ONLY  // GPU test
 
 TEST_F(SyncedMemoryTest, TestGPURead) {
@@ -121,6 +160,72 @@ TEST_F(SyncedMemoryTest, TestGPUWrite) {
   EXPECT_EQ(mem.head(), SyncedMemory::SYNCED);
 }
 
+TEST_F(SyncedMemoryTest, TestTransferCount) {
+  const TransferCount start = CaffeTransferCount();
+  SyncedMemory mem(10);
+  caffe_gpu_memset(mem.size(), 1, mem.mutable_gpu_data());
+  mem.cpu_data();
+  mem.cpu_data();
+  mem.mutable_cpu_data();
+  mem.gpu_data();
+  const TransferCount& count = CaffeTransferCount();
+  EXPECT_EQ(start.calls[0] + 1, count.calls[0]);
+  EXPECT_EQ(start.bytes[0] + 10, count.bytes[0]);
+  EXPECT_EQ(start.calls[1] + 1, count.calls[1]);
+  EXPECT_EQ(start.bytes[1] + 10, count.bytes[1]);
+}
+
+TEST_F(SyncedMemoryTest, TestManagedMemory) {
+  Caffe::set_mode(Caffe::GPU);
+  CaffeSetManagedMemory(true);
+  SyncedMemory mem(10);
+  void* gpu_data = mem.mutable_gpu_data();
+  caffe_gpu_memset(mem.size(), 1, gpu_data);
+  const void* cpu_data = mem.cpu_data();
+  EXPECT_EQ(mem.head(), SyncedMemory::SYNCED);
+  for (int i = 0; i < mem.size(); ++i) {
+    EXPECT_EQ((static_cast<const char*>(cpu_data))[i], 1);
+  }
+  // Both point to the same buffer when the device supports managed memory.
+  if (cpu_data == gpu_data) {
+    EXPECT_EQ(mem.mutable_cpu_data(), mem.gpu_data());
+  }
+  caffe_memset(mem.size(), 2, mem.mutable_cpu_data());
+  char recovered_value[10];
+  caffe_gpu_memcpy(10, mem.gpu_data(), recovered_value);
+  EXPECT_EQ(mem.head(), SyncedMemory::SYNCED);
+  for (int i = 0; i < mem.size(); ++i) {
+    EXPECT_EQ(recovered_value[i], 2);
+  }
+  CaffeSetManagedMemory(false);
+}
+
+TEST_F(SyncedMemoryTest, TestGPUMemoryReuse) {
+  SyncedMemory* mem = new SyncedMemory(1000);
+  void* gpu_data = mem->mutable_gpu_data();
+  caffe_gpu_memset(mem->size(), 1, gpu_data);
+  delete mem;
+  // Same size bucket, the block comes back from the cache, zeroed
+  mem = new SyncedMemory(900);
+  EXPECT_EQ(gpu_data, mem->gpu_data());
+  const void* cpu_data = mem->cpu_data();
+  for (int i = 0; i < mem->size(); ++i) {
+    EXPECT_EQ((static_cast<const char*>(cpu_data))[i], 0);
+  }
+  delete mem;
+}
+
+TEST_F(SyncedMemoryTest, TestPinnedMemoryReuse) {
+  Caffe::set_mode(Caffe::GPU);
+  SyncedMemory* mem = new SyncedMemory(1000);
+  void* cpu_data = mem->mutable_cpu_data();
+  delete mem;
+  mem = new SyncedMemory(900);
+  EXPECT_EQ(cpu_data, mem->cpu_data());
+  delete mem;
+  Caffe::set_mode(Caffe::CPU);
+}
+
 #endif
 
 }  // namespace caffe
@@ -0,0 +1,109 @@
+#include <boost/bind.hpp>
+
+#include <string>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/net.hpp"
+#include "caffe/util/thread_pool.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+static void Count(vector<int>* counts, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    ++(*counts)[i];
+  }
+}
+
+static void CountNested(vector<int>* counts, int width, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    vector<int> row(width, 0);
+    Caffe::thread_pool().run(width, 1, boost::bind(&Count, &row, _1, _2));
+    for (int j = 0; j < width; ++j) {
+      (*counts)[i * width + j] += row[j];
+    }
+  }
+}
+
+class ThreadPoolTest : public ::testing::Test {
+ protected:
+  virtual void TearDown() {
+    Caffe::set_cpu_threads(1);
+  }
+};
+
+TEST_F(ThreadPoolTest, TestRun) {
+  ThreadPool pool(4);
+  const int counts[] = {0, 1, 3, 4, 17, 1000};
+  for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+    for (int grain = 1; grain <= 8; grain *= 2) {
+      vector<int> items(counts[i], 0);
+      pool.run(counts[i], grain, boost::bind(&Count, &items, _1, _2));
+      for (int j = 0; j < counts[i]; ++j) {
+        EXPECT_EQ(1, items[j]);
+      }
+    }
+  }
+}
+
+TEST_F(ThreadPoolTest, TestNestedRun) {
+  Caffe::set_cpu_threads(4);
+  const int rows = 8;
+  const int width = 16;
+  vector<int> items(rows * width, 0);
+  Caffe::thread_pool().run(rows, 1,
+      boost::bind(&CountNested, &items, width, _1, _2));
+  for (int i = 0; i < rows * width; ++i) {
+    EXPECT_EQ(1, items[i]);
+  }
+}
+
+TEST_F(ThreadPoolTest, TestCPUThreads) {
+  EXPECT_EQ(1, Caffe::cpu_threads());
+  EXPECT_EQ(1, Caffe::thread_pool().size());
+  Caffe::set_cpu_threads(3);
+  EXPECT_EQ(3, Caffe::cpu_threads());
+  EXPECT_EQ(3, Caffe::thread_pool().size());
+}
+
+TEST_F(ThreadPoolTest, TestLayersMatchSerial) {
+  Caffe::set_mode(Caffe::CPU);
+  const string proto =
+      "input: 'data' "
+      "input_dim: 3 input_dim: 4 input_dim: 64 input_dim: 64 "
+      "layer { name: 'conv' type: 'Convolution' bottom: 'data' top: 'conv' "
+      "  convolution_param { num_output: 4 kernel_size: 3 pad: 1 "
+      "    weight_filler { type: 'gaussian' std: 0.1 } } } "
+      "layer { name: 'relu' type: 'ReLU' bottom: 'conv' top: 'relu' } "
+      "layer { name: 'sum' type: 'Eltwise' bottom: 'relu' bottom: 'data' "
+      "  top: 'sum' eltwise_param { operation: MAX } } "
+      "layer { name: 'norm' type: 'LRN' bottom: 'sum' top: 'norm' } "
+      "layer { name: 'pool' type: 'Pooling' bottom: 'norm' top: 'pool' "
+      "  pooling_param { pool: MAX kernel_size: 3 stride: 2 } } "
+      "layer { name: 'ave' type: 'Pooling' bottom: 'pool' top: 'ave' "
+      "  pooling_param { pool: AVE kernel_size: 2 stride: 2 } } "
+      "layer { name: 'prob' type: 'Softmax' bottom: 'ave' top: 'prob' } ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  Caffe::set_random_seed(1701);
+  Net<float> net(param);
+  FillerParameter filler_param;
+  GaussianFiller<float> filler(filler_param);
+  filler.Fill(net.input_blobs()[0]);
+  Blob<float> expected;
+  expected.CopyFrom(*net.ForwardPrefilled()[0], false, true);
+  Caffe::set_cpu_threads(4);
+  const Blob<float>* output = net.ForwardPrefilled()[0];
+  for (int i = 0; i < output->count(); ++i) {
+    EXPECT_EQ(expected.cpu_data()[i], output->cpu_data()[i]);
+  }
+}
+
+}  // namespace caffe
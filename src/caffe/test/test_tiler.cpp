@@ -0,0 +1,80 @@
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/net.hpp"
+#include "caffe/tiler.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class TilerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  // A fully convolutional net of an output stride of 2 and a receptive
+  // field of 8, taking tiles of 12x12, 2 at a time
+  shared_ptr<Net<Dtype> > MakeNet(int height, int width) {
+    std::ostringstream proto;
+    proto << "name: 'TilerNetwork' "
+          << "input: 'data' "
+          << "input_shape { dim: 2 dim: 2 dim: " << height << " dim: "
+          << width << " } "
+          << "layer { name: 'conv1' type: 'Convolution' "
+          << "  bottom: 'data' top: 'conv1' "
+          << "  convolution_param { num_output: 3 kernel_size: 3 pad: 1 "
+          << "    weight_filler { type: 'gaussian' std: 0.5 } "
+          << "    bias_filler { type: 'gaussian' std: 0.5 } } } "
+          << "layer { name: 'relu' type: 'ReLU' "
+          << "  bottom: 'conv1' top: 'conv1' } "
+          << "layer { name: 'pool' type: 'Pooling' "
+          << "  bottom: 'conv1' top: 'pool' "
+          << "  pooling_param { pool: MAX kernel_size: 2 stride: 2 } } "
+          << "layer { name: 'conv2' type: 'Convolution' "
+          << "  bottom: 'pool' top: 'conv2' "
+          << "  convolution_param { num_output: 2 kernel_size: 3 pad: 1 "
+          << "    weight_filler { type: 'gaussian' std: 0.5 } } } ";
+    NetParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto.str(), &param));
+    return shared_ptr<Net<Dtype> >(new Net<Dtype>(param));
+  }
+};
+
+TYPED_TEST_CASE(TilerTest, TestDtypesAndDevices);
+
+TYPED_TEST(TilerTest, TestStitchedAsWhole) {
+  typedef typename TypeParam::Dtype Dtype;
+  Blob<Dtype> image(1, 2, 23, 29);
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(&image);
+  shared_ptr<Net<Dtype> > net = this->MakeNet(12, 12);
+  Tiler<Dtype> tiler(net);
+  EXPECT_EQ(2, tiler.stride(0));
+  EXPECT_EQ(8, tiler.receptive_field(1));
+  BlobTileSource<Dtype> source(image);
+  Blob<Dtype> output;
+  tiler.Run(&source, &output);
+  EXPECT_GT(tiler.tiles(), 4);
+  EXPECT_LT(tiler.batches(), tiler.tiles());
+  // The same net over the whole image at once
+  shared_ptr<Net<Dtype> > whole = this->MakeNet(23, 29);
+  whole->ShareTrainedLayersWith(net.get());
+  whole->input_blobs()[0]->Reshape(1, 2, 23, 29);
+  vector<Blob<Dtype>*> bottom(1, &image);
+  const Blob<Dtype>& expected = *whole->Forward(bottom)[0];
+  ASSERT_EQ(expected.shape(), output.shape());
+  for (int i = 0; i < output.count(); ++i) {
+    EXPECT_NEAR(expected.cpu_data()[i], output.cpu_data()[i], 1e-4);
+  }
+}
+
+}  // namespace caffe
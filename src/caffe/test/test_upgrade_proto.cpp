@@ -2892,6 +2892,57 @@ TEST_F(NetUpgradeTest, TestImageNet) {
   this->RunV1UpgradeTest(expected_v1_proto, expected_v2_proto);
 }  // NOLINT(readability/fn_size)
 
+TEST_F(NetUpgradeTest, TestUpgradeMovesBlobs) {
+  const string& v0_proto =
+      "name: 'CaffeNet' "
+      "input: 'data' "
+      "layers { "
+      "  layer { "
+      "    name: 'pad1' "
+      "    type: 'padding' "
+      "    pad: 2 "
+      "  } "
+      "  bottom: 'data' "
+      "  top: 'pad1' "
+      "} "
+      "layers { "
+      "  layer { "
+      "    name: 'conv1' "
+      "    type: 'conv' "
+      "    num_output: 2 "
+      "    kernelsize: 1 "
+      "    blobs { num: 2 channels: 1 height: 1 width: 1 data: 1 data: 2 } "
+      "    blobs { num: 1 channels: 1 height: 1 width: 2 data: 3 data: 4 } "
+      "  } "
+      "  bottom: 'pad1' "
+      "  top: 'conv1' "
+      "} "
+      "layers { "
+      "  layer { "
+      "    name: 'fc2' "
+      "    type: 'innerproduct' "
+      "    num_output: 1 "
+      "    blobs { num: 1 channels: 1 height: 1 width: 2 data: 5 data: 6 } "
+      "  } "
+      "  bottom: 'conv1' "
+      "  top: 'fc2' "
+      "} ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(v0_proto, &param));
+  // The upgrades copying the blobs
+  NetParameter v1_param, expected_param;
+  UpgradeV0Net(param, &v1_param);
+  UpgradeV1Net(v1_param, &expected_param);
+  const float* conv_data = param.layers(1).layer().blobs(0).data().data();
+  const float* fc_data = param.layers(2).layer().blobs(0).data().data();
+  EXPECT_TRUE(UpgradeNetAsNeeded("test", &param));
+  EXPECT_EQ(expected_param.DebugString(), param.DebugString());
+  // The blobs were moved into the upgraded layers
+  ASSERT_EQ(param.layer_size(), 2);
+  EXPECT_EQ(conv_data, param.layer(0).blobs(0).data().data());
+  EXPECT_EQ(fc_data, param.layer(1).blobs(0).data().data());
+}
+
 TEST_F(NetUpgradeTest, TestUpgradeV1LayerType) {
   LayerParameter layer_param;
   shared_ptr<Layer<float> > layer;
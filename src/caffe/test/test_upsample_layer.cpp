@@ -0,0 +1,134 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/vision_layers.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class UpsampleLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  UpsampleLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 3, 4, 5)),
+        blob_top_(new Blob<Dtype>()),
+        blob_ref_(new Blob<Dtype>()) {
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~UpsampleLayerTest() {
+    delete blob_bottom_;
+    delete blob_top_;
+    delete blob_ref_;
+  }
+
+  // Against the fixed bilinear Deconvolution it replaces
+  void TestBilinear(int scale) {
+    LayerParameter layer_param;
+    layer_param.mutable_upsample_param()->set_scale(scale);
+    UpsampleLayer<Dtype> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    layer.Forward(blob_bottom_vec_, blob_top_vec_);
+    LayerParameter deconv_param;
+    ConvolutionParameter* convolution_param =
+        deconv_param.mutable_convolution_param();
+    convolution_param->set_kernel_size(2 * scale - scale % 2);
+    convolution_param->set_stride(scale);
+    convolution_param->set_pad(scale / 2);
+    convolution_param->set_num_output(3);
+    convolution_param->set_group(3);
+    convolution_param->set_bias_term(false);
+    convolution_param->mutable_weight_filler()->set_type("bilinear");
+    DeconvolutionLayer<Dtype> deconv(deconv_param);
+    vector<Blob<Dtype>*> ref_vec(1, blob_ref_);
+    deconv.SetUp(blob_bottom_vec_, ref_vec);
+    deconv.Forward(blob_bottom_vec_, ref_vec);
+    ASSERT_EQ(blob_ref_->shape(), blob_top_->shape());
+    for (int i = 0; i < blob_top_->count(); ++i) {
+      EXPECT_NEAR(blob_ref_->cpu_data()[i], blob_top_->cpu_data()[i], 1e-5);
+    }
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  Blob<Dtype>* const blob_ref_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(UpsampleLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(UpsampleLayerTest, TestSetup) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_upsample_param()->set_scale(3);
+  UpsampleLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(2, this->blob_top_->num());
+  EXPECT_EQ(3, this->blob_top_->channels());
+  EXPECT_EQ(12, this->blob_top_->height());
+  EXPECT_EQ(15, this->blob_top_->width());
+}
+
+TYPED_TEST(UpsampleLayerTest, TestForwardNearest) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_upsample_param()->set_mode(
+      UpsampleParameter_Mode_NEAREST);
+  UpsampleLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int n = 0; n < 2; ++n) {
+    for (int c = 0; c < 3; ++c) {
+      for (int h = 0; h < 8; ++h) {
+        for (int w = 0; w < 10; ++w) {
+          EXPECT_EQ(this->blob_bottom_->data_at(n, c, h / 2, w / 2),
+                    this->blob_top_->data_at(n, c, h, w));
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(UpsampleLayerTest, TestForwardBilinear2) {
+  this->TestBilinear(2);
+}
+
+TYPED_TEST(UpsampleLayerTest, TestForwardBilinear3) {
+  this->TestBilinear(3);
+}
+
+TYPED_TEST(UpsampleLayerTest, TestGradientBilinear) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  UpsampleLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(UpsampleLayerTest, TestGradientNearest) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_upsample_param()->set_scale(3);
+  layer_param.mutable_upsample_param()->set_mode(
+      UpsampleParameter_Mode_NEAREST);
+  UpsampleLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+}  // namespace caffe
@@ -0,0 +1,342 @@
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "caffe/tiler.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+// The tiles read ahead of the one the net runs
+static const int kTilePrefetch = 2;
+
+// The stride, receptive field and first pixel of the receptive field of a
+// blob along the height and width, in the input
+struct TileGeometry {
+  int stride[2], field[2], first[2];
+};
+
+template <typename Dtype>
+BlobTileSource<Dtype>::BlobTileSource(const Blob<Dtype>& image)
+    : image_(image) {
+  CHECK_EQ(image_.num_axes(), 4);
+  CHECK_EQ(image_.num(), 1) << "BlobTileSource holds a single image";
+}
+
+template <typename Dtype>
+void BlobTileSource<Dtype>::Read(int y, int x, int height, int width,
+    Dtype* data) {
+  CHECK_LE(y + height, image_.height());
+  CHECK_LE(x + width, image_.width());
+  for (int c = 0; c < image_.channels(); ++c) {
+    for (int h = 0; h < height; ++h) {
+      caffe_copy(width, image_.cpu_data() + image_.offset(0, c, y + h, x),
+          data + (c * height + h) * width);
+    }
+  }
+}
+
+template <typename Dtype>
+Tiler<Dtype>::Tiler(shared_ptr<Net<Dtype> > net)
+    : net_(net), source_(NULL) {
+  CHECK_EQ(net_->input_blobs().size(), 1)
+      << "Tiler needs a net with one input blob";
+  CHECK_GT(net_->output_blobs().size(), 0);
+  const Blob<Dtype>& input = *net_->input_blobs()[0];
+  CHECK_EQ(input.num_axes(), 4)
+      << "Tiler needs an input of num x channels x height x width";
+  input_shape_ = input.shape();
+  Trace();
+  for (int i = 0; i < kTilePrefetch; ++i) {
+    prefetch_.push_back(shared_ptr<TileBatch>(new TileBatch()));
+    prefetch_[i]->data.Reshape(input_shape_);
+    prefetch_[i]->data.mutable_cpu_data();
+    prefetch_free_.push(prefetch_[i].get());
+  }
+}
+
+template <typename Dtype>
+Tiler<Dtype>::~Tiler() {
+  StopInternalThread();
+}
+
+template <typename Dtype>
+void Tiler<Dtype>::Trace() {
+  map<const Blob<Dtype>*, TileGeometry> geometry;
+  TileGeometry input = {{1, 1}, {1, 1}, {0, 0}};
+  geometry[net_->input_blobs()[0]] = input;
+  for (int i = 0; i < net_->layers().size(); ++i) {
+    const vector<Blob<Dtype>*>& bottom = net_->bottom_vecs()[i];
+    const vector<Blob<Dtype>*>& top = net_->top_vecs()[i];
+    // The union of the receptive fields of the bottoms
+    bool known = !bottom.empty();
+    TileGeometry g;
+    for (int j = 0; known && j < bottom.size(); ++j) {
+      typename map<const Blob<Dtype>*, TileGeometry>::const_iterator it =
+          geometry.find(bottom[j]);
+      known = it != geometry.end() && bottom[j]->num_axes() == 4;
+      for (int a = 0; known && a < 2; ++a) {
+        const TileGeometry& b = it->second;
+        if (!j) {
+          g.stride[a] = b.stride[a];
+          g.field[a] = b.field[a];
+          g.first[a] = b.first[a];
+          continue;
+        }
+        known = b.stride[a] == g.stride[a];
+        const int last = std::max(g.first[a] + g.field[a],
+                                  b.first[a] + b.field[a]);
+        g.first[a] = std::min(g.first[a], b.first[a]);
+        g.field[a] = last - g.first[a];
+      }
+    }
+    const LayerParameter& param = net_->layers()[i]->layer_param();
+    int kernel[2], stride[2], pad[2];
+    if (param.type() == "Deconvolution" || (param.has_pooling_param()
+        && param.pooling_param().global_pooling())) {
+      known = false;
+    } else if (param.has_convolution_param()) {
+      const ConvolutionParameter& conv = param.convolution_param();
+      kernel[0] = conv.has_kernel_h() ? conv.kernel_h() : conv.kernel_size();
+      kernel[1] = conv.has_kernel_w() ? conv.kernel_w() : conv.kernel_size();
+      stride[0] = conv.has_stride_h() ? conv.stride_h() : conv.stride();
+      stride[1] = conv.has_stride_w() ? conv.stride_w() : conv.stride();
+      pad[0] = conv.has_pad_h() ? conv.pad_h() : conv.pad();
+      pad[1] = conv.has_pad_w() ? conv.pad_w() : conv.pad();
+    } else if (param.has_pooling_param()) {
+      const PoolingParameter& pool = param.pooling_param();
+      kernel[0] = pool.has_kernel_h() ? pool.kernel_h() : pool.kernel_size();
+      kernel[1] = pool.has_kernel_w() ? pool.kernel_w() : pool.kernel_size();
+      stride[0] = pool.has_stride_h() ? pool.stride_h() : pool.stride();
+      stride[1] = pool.has_stride_w() ? pool.stride_w() : pool.stride();
+      pad[0] = pool.has_pad_h() ? pool.pad_h() : pool.pad();
+      pad[1] = pool.has_pad_w() ? pool.pad_w() : pool.pad();
+    } else {
+      // Layers keeping the height and width of their bottoms, e.g. ReLU
+      for (int j = 0; known && j < top.size(); ++j) {
+        known = top[j]->num_axes() == 4
+            && top[j]->height() == bottom[0]->height()
+            && top[j]->width() == bottom[0]->width();
+      }
+      kernel[0] = kernel[1] = stride[0] = stride[1] = 1;
+      pad[0] = pad[1] = 0;
+    }
+    for (int a = 0; known && a < 2; ++a) {
+      g.first[a] -= pad[a] * g.stride[a];
+      g.field[a] += (kernel[a] - 1) * g.stride[a];
+      g.stride[a] *= stride[a];
+    }
+    for (int j = 0; j < top.size(); ++j) {
+      if (known) {
+        geometry[top[j]] = g;
+      } else {
+        geometry.erase(top[j]);
+      }
+    }
+  }
+  typename map<const Blob<Dtype>*, TileGeometry>::const_iterator it =
+      geometry.find(net_->output_blobs()[0]);
+  CHECK(it != geometry.end()) << "Tiler needs the first output of "
+      << net_->name() << " to follow from its input through Convolution and "
+      << "Pooling layers and layers keeping the height and width";
+  for (int a = 0; a < 2; ++a) {
+    stride_[a] = it->second.stride[a];
+    field_[a] = it->second.field[a];
+    first_[a] = it->second.first[a];
+  }
+  LOG(INFO) << "Tiling " << net_->name() << " with an output stride of "
+            << stride_[0] << "x" << stride_[1] << " and a receptive field of "
+            << field_[0] << "x" << field_[1];
+}
+
+template <typename Dtype>
+const vector<int>& Tiler<Dtype>::OutputShape(int height, int width) {
+  const std::pair<int, int> key(height, width);
+  typename map<std::pair<int, int>, vector<int> >::iterator it =
+      output_shapes_.find(key);
+  if (it != output_shapes_.end()) {
+    return it->second;
+  }
+  // The tiles are at most as large as the net was set up for, so that the
+  // net only reshapes within its memory.
+  net_->input_blobs()[0]->Reshape(1, input_shape_[1], height, width);
+  net_->Reshape();
+  const Blob<Dtype>& output = *net_->output_blobs()[0];
+  CHECK_EQ(output.num_axes(), 4);
+  return output_shapes_[key] = output.shape();
+}
+
+template <typename Dtype>
+void Tiler<Dtype>::Place(int axis, int length, vector<int>* origins,
+    vector<int>* lengths) const {
+  const int tile = input_shape_[2 + axis];
+  if (length <= tile) {
+    origins->push_back(0);
+    lengths->push_back(length);
+    return;
+  }
+  // The outputs of a tile inside the image whose receptive field lies
+  // within the tile, from the first to the last, a step apart
+  const int out = output_shapes_.find(std::make_pair(input_shape_[2],
+      input_shape_[3]))->second[2 + axis];
+  const int s = stride_[axis];
+  const int lowest = first_[axis] >= 0 ? 0 : (s - 1 - first_[axis]) / s;
+  const int room = tile - field_[axis] - first_[axis];
+  CHECK_GE(room, 0) << "The tiles of " << net_->name() << " are smaller "
+      << "than the receptive field of " << field_[axis];
+  const int highest = std::min(out - 1, room / s);
+  CHECK_GE(highest, lowest) << "The tiles of " << net_->name()
+      << " are too small for their receptive field";
+  const int step = (highest - lowest + 1) * s;
+  int origin = 0;
+  for (; origin + tile < length; origin += step) {
+    origins->push_back(origin);
+    lengths->push_back(tile);
+  }
+  // The last tile ends with the image, its origin a multiple of the stride
+  origin = std::min(origin, (length - tile + s - 1) / s * s);
+  origins->push_back(origin);
+  lengths->push_back(length - origin);
+}
+
+template <typename Dtype>
+void Tiler<Dtype>::Run(TileSource<Dtype>* source, Blob<Dtype>* output) {
+  CHECK_EQ(source->channels(), input_shape_[1])
+      << "The image needs the channels of the input of " << net_->name();
+  const int length[2] = {source->height(), source->width()};
+  OutputShape(input_shape_[2], input_shape_[3]);
+  vector<int> origins[2], lengths[2];
+  for (int a = 0; a < 2; ++a) {
+    Place(a, length[a], &origins[a], &lengths[a]);
+  }
+  tiles_.clear();
+  for (int r = 0; r < origins[0].size(); ++r) {
+    for (int c = 0; c < origins[1].size(); ++c) {
+      const int origin[2] = {origins[0][r], origins[1][c]};
+      const int size[2] = {lengths[0][r], lengths[1][c]};
+      const vector<int>& shape = OutputShape(size[0], size[1]);
+      // The outputs the tile keeps, those the border of the tile does not
+      // cut unless it is the border of the image
+      int lo[2], hi[2];
+      for (int a = 0; a < 2; ++a) {
+        const int s = stride_[a];
+        lo[a] = origin[a] == 0 || first_[a] >= 0 ? 0
+            : (s - 1 - first_[a]) / s;
+        hi[a] = shape[2 + a] - 1;
+        if (origin[a] + size[a] < length[a]) {
+          hi[a] = std::min(hi[a], (size[a] - field_[a] - first_[a]) / s);
+        }
+      }
+      Tile tile;
+      tile.y = origin[0];
+      tile.x = origin[1];
+      tile.height = size[0];
+      tile.width = size[1];
+      tile.out_y = lo[0];
+      tile.out_x = lo[1];
+      tile.out_height = hi[0] - lo[0] + 1;
+      tile.out_width = hi[1] - lo[1] + 1;
+      tile.to_y = origin[0] / stride_[0] + lo[0];
+      tile.to_x = origin[1] / stride_[1] + lo[1];
+      tiles_.push_back(tile);
+    }
+  }
+  // Consecutive tiles of the same shape, as many as the net takes at once
+  batches_.clear();
+  for (int begin = 0, end; begin < tiles_.size(); begin = end) {
+    for (end = begin + 1; end < tiles_.size()
+        && end - begin < input_shape_[0]
+        && tiles_[end].height == tiles_[begin].height
+        && tiles_[end].width == tiles_[begin].width; ++end) {}
+    batches_.push_back(std::make_pair(begin, end));
+  }
+  const Tile& last = tiles_.back();
+  const vector<int>& last_shape = OutputShape(last.height, last.width);
+  output->Reshape(1, last_shape[1], last.to_y + last.out_height,
+      last.to_x + last.out_width);
+  source_ = source;
+  StartInternalThread();
+  Blob<Dtype>* input = net_->input_blobs()[0];
+  for (int b = 0; b < batches_.size(); ++b) {
+    TileBatch* batch = prefetch_full_.pop("Tiler waiting for tiles");
+    input->ReshapeLike(batch->data);
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      caffe_copy(input->count(), batch->data.cpu_data(),
+          input->mutable_cpu_data());
+      break;
+    case Caffe::GPU:
+#ifndef CPU_ONLY
+      caffe_copy(input->count(), batch->data.gpu_data(),
+          input->mutable_gpu_data());
+#else
+      NO_GPU;
+#endif
+      break;
+    }
+    prefetch_free_.push(batch);
+    const Blob<Dtype>& out = *net_->ForwardPrefilled()[0];
+    const Dtype* out_data = out.cpu_data();
+    Dtype* output_data = output->mutable_cpu_data();
+    for (int i = batches_[b].first; i < batches_[b].second; ++i) {
+      const Tile& tile = tiles_[i];
+      const int n = i - batches_[b].first;
+      for (int c = 0; c < out.channels(); ++c) {
+        for (int h = 0; h < tile.out_height; ++h) {
+          caffe_copy(tile.out_width,
+              out_data + out.offset(n, c, tile.out_y + h, tile.out_x),
+              output_data + output->offset(0, c, tile.to_y + h, tile.to_x));
+        }
+      }
+    }
+  }
+  StopInternalThread();
+}
+
+template <typename Dtype>
+void Tiler<Dtype>::InternalThreadEntry() {
+#ifndef CPU_ONLY
+  cudaStream_t stream;
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  }
+#endif
+  try {
+    for (int b = 0; b < batches_.size() && !must_stop(); ++b) {
+      TileBatch* batch = prefetch_free_.pop();
+      batch->begin = batches_[b].first;
+      batch->end = batches_[b].second;
+      const Tile& first = tiles_[batch->begin];
+      batch->data.Reshape(batch->end - batch->begin, input_shape_[1],
+          first.height, first.width);
+      Dtype* data = batch->data.mutable_cpu_data();
+      for (int i = batch->begin; i < batch->end; ++i) {
+        const Tile& tile = tiles_[i];
+        source_->Read(tile.y, tile.x, tile.height, tile.width,
+            data + batch->data.offset(i - batch->begin));
+      }
+#ifndef CPU_ONLY
+      if (Caffe::mode() == Caffe::GPU) {
+        batch->data.data().get()->async_gpu_push(stream);
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+      }
+#endif
+      prefetch_full_.push(batch);
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamDestroy(stream));
+  }
+#endif
+}
+
+INSTANTIATE_CLASS(BlobTileSource);
+INSTANTIATE_CLASS(Tiler);
+
+}  // namespace caffe
@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <vector>
+
+#include "caffe/util/array_stats.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void ArrayStats<Dtype>::Compute(const vector<const Dtype*>& arrays,
+                                const vector<int>& counts) {
+  CHECK_EQ(arrays.size(), counts.size());
+  asums_.assign(arrays.size(), Dtype(0));
+  sumsqs_.assign(arrays.size(), Dtype(0));
+  if (Caffe::mode() == Caffe::CPU) {
+    for (int i = 0; i < arrays.size(); ++i) {
+      asums_[i] = caffe_cpu_asum(counts[i], arrays[i]);
+      sumsqs_[i] = caffe_cpu_dot(counts[i], arrays[i], arrays[i]);
+    }
+    return;
+  }
+#ifndef CPU_ONLY
+  if (arrays != arrays_ || counts != counts_) {
+    arrays_ = arrays;
+    counts_ = counts;
+    pointers_.reset(new SyncedMemory(
+        std::max<size_t>(arrays.size(), 1) * sizeof(Dtype*)));
+    std::copy(arrays.begin(), arrays.end(),
+        static_cast<const Dtype**>(pointers_->mutable_cpu_data()));
+    vector<int> chunks;
+    for (int i = 0; i < arrays.size(); ++i) {
+      for (int start = 0; start < counts[i]; start += kArrayStatsChunk) {
+        chunks.push_back(i);
+        chunks.push_back(start);
+        chunks.push_back(std::min(start + kArrayStatsChunk, counts[i]));
+      }
+    }
+    num_chunks_ = chunks.size() / 3;
+    chunks_.Reshape(vector<int>(1, std::max<int>(chunks.size(), 1)));
+    std::copy(chunks.begin(), chunks.end(), chunks_.mutable_cpu_data());
+    stats_.Reshape(vector<int>(1, std::max(2 * num_chunks_, 1)));
+  }
+  if (num_chunks_ == 0) {
+    return;
+  }
+  caffe_gpu_array_stats(num_chunks_, chunks_.gpu_data(),
+      static_cast<const Dtype* const*>(pointers_->gpu_data()),
+      stats_.mutable_gpu_data());
+  CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+  const Dtype* stats = stats_.cpu_data();
+  const int* chunks = chunks_.cpu_data();
+  for (int c = 0; c < num_chunks_; ++c) {
+    asums_[chunks[3 * c]] += stats[2 * c];
+    sumsqs_[chunks[3 * c]] += stats[2 * c + 1];
+  }
+#else
+  NO_GPU;
+#endif
+}
+
+INSTANTIATE_CLASS(ArrayStats);
+
+}  // namespace caffe
@@ -0,0 +1,62 @@
+#include <algorithm>
+
+#include "caffe/common.hpp"
+#include "caffe/util/array_stats.hpp"
+
+namespace caffe {
+
+// A block per chunk, its threads striding over the elements of the chunk
+// and then adding up their sums.
+template <typename Dtype>
+__global__ void ArrayStatsKernel(const int num_chunks, const int* chunks,
+    const Dtype* const* arrays, Dtype* stats) {
+  __shared__ Dtype asums[CAFFE_CUDA_NUM_THREADS];
+  __shared__ Dtype sumsqs[CAFFE_CUDA_NUM_THREADS];
+  for (int c = blockIdx.x; c < num_chunks; c += gridDim.x) {
+    const Dtype* array = arrays[chunks[3 * c]];
+    const int end = chunks[3 * c + 2];
+    Dtype asum = 0;
+    Dtype sumsq = 0;
+    for (int i = chunks[3 * c + 1] + threadIdx.x; i < end; i += blockDim.x) {
+      const Dtype value = array[i];
+      asum += abs(value);
+      sumsq += value * value;
+    }
+    asums[threadIdx.x] = asum;
+    sumsqs[threadIdx.x] = sumsq;
+    __syncthreads();
+    for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+      if (threadIdx.x < s) {
+        asums[threadIdx.x] += asums[threadIdx.x + s];
+        sumsqs[threadIdx.x] += sumsqs[threadIdx.x + s];
+      }
+      __syncthreads();
+    }
+    if (threadIdx.x == 0) {
+      stats[2 * c] = asums[0];
+      stats[2 * c + 1] = sumsqs[0];
+    }
+    __syncthreads();
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_array_stats(const int num_chunks, const int* chunks,
+    const Dtype* const* arrays, Dtype* stats) {
+  if (num_chunks == 0) {
+    return;
+  }
+  // Grids are at most 65535 blocks wide on older devices.
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  ArrayStatsKernel<Dtype><<<std::min(num_chunks, 65535),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(num_chunks, chunks,
+      arrays, stats);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_array_stats<float>(const int num_chunks,
+    const int* chunks, const float* const* arrays, float* stats);
+template void caffe_gpu_array_stats<double>(const int num_chunks,
+    const int* chunks, const double* const* arrays, double* stats);
+
+}  // namespace caffe
@@ -0,0 +1,358 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <map>
+
+#include "caffe/util/async_reader.hpp"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define CAFFE_IO_URING
+#endif
+
+namespace caffe {
+
+class AsyncReader::Read {
+ public:
+  int fd_;
+  uint64_t offset_;
+  size_t size_;
+  char* buffer_;
+  // The rest of the read, pushed to the ring
+  struct iovec iov_;
+  size_t done_;
+  // errno of the failure, or EIO past the end of the file
+  int error_;
+  bool finished_;
+};
+
+class AsyncReader::sync {
+ public:
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  boost::thread_group threads_;
+  // The reads for the threads to run
+  std::deque<Read*> queue_;
+  bool stop_;
+};
+
+// The queues shared with the kernel of an io_uring, empty if the kernel does
+// not support it
+class AsyncReader::Ring {
+ public:
+  explicit Ring(int entries);
+  ~Ring();
+
+  inline bool valid() const {
+    return fd_ >= 0;
+  }
+  // Queues a readv of the iovec, to submit on the next enter
+  void push(int fd, const struct iovec* iov, uint64_t offset,
+            uint64_t user_data);
+  // Submits the reads queued, waiting for at least min_complete completions
+  void enter(int submit, int min_complete);
+  // Takes the next completion, returning false if there is none
+  bool pop(uint64_t* user_data, int* result);
+
+ private:
+  int fd_;
+#ifdef CAFFE_IO_URING
+  void* sq_map_;
+  size_t sq_size_;
+  void* cq_map_;
+  size_t cq_size_;
+  struct io_uring_sqe* sqes_;
+  size_t sqes_size_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  struct io_uring_cqe* cqes_;
+#endif
+};
+
+#ifdef CAFFE_IO_URING
+
+AsyncReader::Ring::Ring(int entries)
+    : fd_(-1), sq_map_(MAP_FAILED), cq_map_(MAP_FAILED), sqes_(NULL) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd_ < 0) {
+    LOG(INFO) << "Reading with threads, as io_uring is not supported: "
+              << strerror(errno);
+    return;
+  }
+  sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size_ = params.cq_off.cqes +
+      params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+  }
+  sq_map_ = mmap(NULL, sq_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  cq_map_ = single ? sq_map_ : mmap(NULL, cq_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  CHECK(sq_map_ != MAP_FAILED && cq_map_ != MAP_FAILED &&
+        sqes != MAP_FAILED) << "Cannot map io_uring: " << strerror(errno);
+  sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+  char* sq = static_cast<char*>(sq_map_);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  char* cq = static_cast<char*>(cq_map_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+AsyncReader::Ring::~Ring() {
+  if (fd_ < 0) {
+    return;
+  }
+  munmap(sqes_, sqes_size_);
+  if (cq_map_ != sq_map_) {
+    munmap(cq_map_, cq_size_);
+  }
+  munmap(sq_map_, sq_size_);
+  close(fd_);
+}
+
+void AsyncReader::Ring::push(int fd, const struct iovec* iov,
+                             uint64_t offset, uint64_t user_data) {
+  // The only producer, so the tail is ours to read
+  const unsigned tail = *sq_tail_;
+  const unsigned index = tail & *sq_mask_;
+  struct io_uring_sqe* sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = reinterpret_cast<uintptr_t>(iov);
+  sqe->len = 1;
+  sqe->user_data = user_data;
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+}
+
+void AsyncReader::Ring::enter(int submit, int min_complete) {
+  const unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  for (;;) {
+    const int submitted = syscall(__NR_io_uring_enter, fd_, submit,
+        min_complete, flags, NULL, 0);
+    if (submitted < 0 && errno == EINTR) {
+      continue;
+    }
+    CHECK_GE(submitted, 0) << "Cannot submit reads: " << strerror(errno);
+    CHECK_EQ(submitted, submit) << "Cannot submit all reads";
+    return;
+  }
+}
+
+bool AsyncReader::Ring::pop(uint64_t* user_data, int* result) {
+  const unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  const struct io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+  *user_data = cqe->user_data;
+  *result = cqe->res;
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+#else
+
+AsyncReader::Ring::Ring(int entries) : fd_(-1) {
+}
+
+AsyncReader::Ring::~Ring() {
+}
+
+void AsyncReader::Ring::push(int fd, const struct iovec* iov,
+                             uint64_t offset, uint64_t user_data) {
+  NOT_IMPLEMENTED;
+}
+
+void AsyncReader::Ring::enter(int submit, int min_complete) {
+  NOT_IMPLEMENTED;
+}
+
+bool AsyncReader::Ring::pop(uint64_t* user_data, int* result) {
+  NOT_IMPLEMENTED;
+  return false;
+}
+
+#endif
+
+AsyncReader::AsyncReader(int depth, bool threads)
+    : depth_(depth), sync_(new sync()), next_id_(0), outstanding_(0) {
+  CHECK_GT(depth_, 0);
+  sync_->stop_ = false;
+  if (!threads) {
+    // Completions are reaped before the queue could overflow
+    ring_.reset(new Ring(depth_));
+  }
+  if (!uring()) {
+    for (int i = 0; i < depth_; ++i) {
+      sync_->threads_.create_thread(boost::bind(&AsyncReader::entry, this));
+    }
+  }
+}
+
+AsyncReader::~AsyncReader() {
+  if (uring()) {
+    while (outstanding_ > 0) {
+      reap();
+    }
+    return;
+  }
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    sync_->stop_ = true;
+  }
+  sync_->condition_.notify_all();
+  sync_->threads_.join_all();
+}
+
+bool AsyncReader::uring() const {
+  return ring_ && ring_->valid();
+}
+
+uint64_t AsyncReader::submit(int fd, uint64_t offset, size_t size,
+                             char* buffer) {
+  const uint64_t id = next_id_++;
+  shared_ptr<Read> read(new Read());
+  read->fd_ = fd;
+  read->offset_ = offset;
+  read->size_ = size;
+  read->buffer_ = buffer;
+  read->done_ = 0;
+  read->error_ = 0;
+  read->finished_ = size == 0;
+  reads_[id] = read;
+  if (read->finished_) {
+    return id;
+  }
+  if (uring()) {
+    while (outstanding_ >= depth_) {
+      reap();
+    }
+    push(id, read.get());
+    ring_->enter(1, 0);
+  } else {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    sync_->queue_.push_back(read.get());
+    sync_->condition_.notify_one();
+  }
+  return id;
+}
+
+void AsyncReader::wait(uint64_t id) {
+  std::map<uint64_t, shared_ptr<Read> >::iterator it = reads_.find(id);
+  CHECK(it != reads_.end()) << "Unknown read " << id;
+  const Read& read = *it->second;
+  if (uring()) {
+    while (!read.finished_) {
+      reap();
+    }
+  } else {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    while (!read.finished_) {
+      sync_->condition_.wait(lock);
+    }
+  }
+  CHECK_EQ(read.error_, 0) << "Cannot read " << read.size_
+      << " bytes at offset " << read.offset_ << ": " << strerror(read.error_);
+  reads_.erase(it);
+}
+
+void AsyncReader::push(uint64_t id, Read* read) {
+  read->iov_.iov_base = read->buffer_ + read->done_;
+  read->iov_.iov_len = read->size_ - read->done_;
+  ring_->push(read->fd_, &read->iov_, read->offset_ + read->done_, id);
+  ++outstanding_;
+}
+
+void AsyncReader::reap() {
+  ring_->enter(0, 1);
+  int resubmit = 0;
+  uint64_t id;
+  int result;
+  while (ring_->pop(&id, &result)) {
+    --outstanding_;
+    Read* read = reads_[id].get();
+    if (result == -EINTR || result == -EAGAIN) {
+      result = 0;
+    } else if (result < 0) {
+      read->error_ = -result;
+    } else if (result == 0) {
+      read->error_ = EIO;
+    }
+    read->done_ += std::max(result, 0);
+    if (read->error_ || read->done_ == read->size_) {
+      read->finished_ = true;
+    } else {
+      // The rest of a short read
+      push(id, read);
+      ++resubmit;
+    }
+  }
+  if (resubmit) {
+    ring_->enter(resubmit, 0);
+  }
+}
+
+void AsyncReader::entry() {
+  for (;;) {
+    Read* read;
+    {
+      boost::mutex::scoped_lock lock(sync_->mutex_);
+      while (sync_->queue_.empty() && !sync_->stop_) {
+        sync_->condition_.wait(lock);
+      }
+      if (sync_->queue_.empty()) {
+        return;
+      }
+      read = sync_->queue_.front();
+      sync_->queue_.pop_front();
+    }
+    int error = 0;
+    size_t done = 0;
+    while (done < read->size_) {
+      const ssize_t bytes = pread(read->fd_, read->buffer_ + done,
+          read->size_ - done, read->offset_ + done);
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes <= 0) {
+        error = bytes < 0 ? errno : EIO;
+        break;
+      }
+      done += bytes;
+    }
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    read->done_ = done;
+    read->error_ = error;
+    read->finished_ = true;
+    sync_->condition_.notify_all();
+  }
+}
+
+}  // namespace caffe
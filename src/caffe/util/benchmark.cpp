@@ -27,7 +27,7 @@ void Timer::Start() {
   if (!running()) {
     if (Caffe::mode() == Caffe::GPU) {
 #ifndef CPU_ONLY
-      CUDA_CHECK(cudaEventRecord(start_gpu_, 0));
+      CUDA_CHECK(cudaEventRecord(start_gpu_, Caffe::cuda_stream()));
 #else
       NO_GPU;
 #endif
@@ -43,7 +43,7 @@ void Timer::Stop() {
   if (running()) {
     if (Caffe::mode() == Caffe::GPU) {
 #ifndef CPU_ONLY
-      CUDA_CHECK(cudaEventRecord(stop_gpu_, 0));
+      CUDA_CHECK(cudaEventRecord(stop_gpu_, Caffe::cuda_stream()));
       CUDA_CHECK(cudaEventSynchronize(stop_gpu_));
 #else
       NO_GPU;
@@ -165,4 +165,129 @@ float CPUTimer::MicroSeconds() {
   return this->elapsed_microseconds_;
 }
 
+EventTimer::EventTimer(int capacity)
+    : gpu_(Caffe::mode() == Caffe::GPU), ring_(capacity), created_(0),
+      tail_(0), size_(0) {
+  CHECK_GT(capacity, 0);
+#ifdef CPU_ONLY
+  if (gpu_) {
+    NO_GPU;
+  }
+#endif
+}
+
+EventTimer::~EventTimer() {
+#ifndef CPU_ONLY
+  for (int i = 0; i < created_; ++i) {
+    CUDA_CHECK(cudaEventDestroy(ring_[i].start_gpu));
+    CUDA_CHECK(cudaEventDestroy(ring_[i].stop_gpu));
+  }
+#endif
+}
+
+void EventTimer::Start(int key) {
+  CHECK_GE(key, 0);
+  CHECK(open_.find(key) == open_.end()) << "Interval " << key
+      << " already started";
+  if (size_ == ring_.size()) {
+    Poll();
+  }
+  if (size_ == ring_.size()) {
+    CHECK(ReadOldest(true)) << "All the intervals of the timer are started";
+  }
+  const int slot = (tail_ + size_++) % ring_.size();
+  Interval& interval = ring_[slot];
+  interval.key = key;
+  interval.stopped = false;
+  if (gpu_) {
+#ifndef CPU_ONLY
+    if (slot == created_) {
+      // Timing events, the host sleeping rather than spinning on them
+      CUDA_CHECK(cudaEventCreateWithFlags(&interval.start_gpu,
+                                          cudaEventBlockingSync));
+      CUDA_CHECK(cudaEventCreateWithFlags(&interval.stop_gpu,
+                                          cudaEventBlockingSync));
+      ++created_;
+    }
+    CUDA_CHECK(cudaEventRecord(interval.start_gpu, Caffe::cuda_stream()));
+#endif
+  } else {
+    interval.start_cpu = boost::posix_time::microsec_clock::local_time();
+  }
+  open_[key] = slot;
+}
+
+void EventTimer::Stop(int key) {
+  std::map<int, int>::iterator open = open_.find(key);
+  CHECK(open != open_.end()) << "Interval " << key << " not started";
+  Interval& interval = ring_[open->second];
+  open_.erase(open);
+  if (gpu_) {
+#ifndef CPU_ONLY
+    CUDA_CHECK(cudaEventRecord(interval.stop_gpu, Caffe::cuda_stream()));
+#endif
+  } else {
+    interval.elapsed_us = (boost::posix_time::microsec_clock::local_time()
+        - interval.start_cpu).total_microseconds();
+  }
+  interval.stopped = true;
+}
+
+bool EventTimer::ReadOldest(bool wait) {
+  if (size_ == 0 || !ring_[tail_].stopped) {
+    return false;
+  }
+  Interval& interval = ring_[tail_];
+  if (gpu_) {
+#ifndef CPU_ONLY
+    if (wait) {
+      CUDA_CHECK(cudaEventSynchronize(interval.stop_gpu));
+    } else {
+      const cudaError_t status = cudaEventQuery(interval.stop_gpu);
+      if (status == cudaErrorNotReady) {
+        return false;
+      }
+      CUDA_CHECK(status);
+    }
+    float elapsed_ms;
+    CUDA_CHECK(cudaEventElapsedTime(&elapsed_ms, interval.start_gpu,
+                                    interval.stop_gpu));
+    interval.elapsed_us = elapsed_ms * 1000;
+#endif
+  }
+  if (interval.key >= totals_.size()) {
+    totals_.resize(interval.key + 1);
+    counts_.resize(interval.key + 1);
+  }
+  totals_[interval.key] += interval.elapsed_us;
+  ++counts_[interval.key];
+  tail_ = (tail_ + 1) % ring_.size();
+  --size_;
+  return true;
+}
+
+void EventTimer::Poll() {
+  while (ReadOldest(false)) {}
+}
+
+void EventTimer::Synchronize() {
+  while (ReadOldest(true)) {}
+}
+
+void EventTimer::Clear() {
+  tail_ = (tail_ + size_) % ring_.size();
+  size_ = 0;
+  open_.clear();
+  totals_.clear();
+  counts_.clear();
+}
+
+double EventTimer::MicroSeconds(int key) const {
+  return key < totals_.size() ? totals_[key] : 0;
+}
+
+int EventTimer::count(int key) const {
+  return key < counts_.size() ? counts_[key] : 0;
+}
+
 }  // namespace caffe
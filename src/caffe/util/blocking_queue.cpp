@@ -1,10 +1,13 @@
 #include <boost/thread.hpp>
 #include <string>
+#include <vector>
 
 #include "caffe/data_layers.hpp"
 #include "caffe/data_reader.hpp"
 #include "caffe/parallel.hpp"
+#include "caffe/tiler.hpp"
 #include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/device_thread.hpp"
 
 namespace caffe {
 
@@ -88,9 +91,15 @@ size_t BlockingQueue<T>::size() const {
 
 template class BlockingQueue<Batch<float>*>;
 template class BlockingQueue<Batch<double>*>;
+template class BlockingQueue<vector<shared_ptr<Blob<float> > >*>;
+template class BlockingQueue<vector<shared_ptr<Blob<double> > >*>;
+template class BlockingQueue<int>;
 template class BlockingQueue<Datum*>;
 template class BlockingQueue<shared_ptr<DataReader::QueuePair> >;
 template class BlockingQueue<P2PSync<float>*>;
 template class BlockingQueue<P2PSync<double>*>;
+template class BlockingQueue<boost::function<void()> >;
+template class BlockingQueue<Tiler<float>::TileBatch*>;
+template class BlockingQueue<Tiler<double>::TileBatch*>;
 
 }  // namespace caffe
@@ -1,4 +1,13 @@
 #ifdef USE_CUDNN
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <fstream>  // NOLINT(readability/streams)
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/syncedmem.hpp"
 #include "caffe/util/cudnn.hpp"
 
 namespace caffe {
@@ -18,6 +27,124 @@ const void* dataType<double>::one =
 const void* dataType<double>::zero =
     static_cast<void *>(&dataType<double>::zeroval);
 
+// Autotuned algorithms are shared by the layers of all threads.
+struct AlgoCache {
+  boost::mutex mutex;
+  std::map<string, int> algos;
+  string file;
+};
+static AlgoCache algo_cache;
+
+bool GetCachedAlgo(const string& key, int* algo) {
+  boost::mutex::scoped_lock lock(algo_cache.mutex);
+  std::map<string, int>::const_iterator it = algo_cache.algos.find(key);
+  if (it == algo_cache.algos.end()) {
+    return false;
+  }
+  *algo = it->second;
+  return true;
+}
+
+void CacheAlgo(const string& key, int algo) {
+  boost::mutex::scoped_lock lock(algo_cache.mutex);
+  algo_cache.algos[key] = algo;
+  if (!algo_cache.file.empty()) {
+    std::ofstream file(algo_cache.file.c_str(), std::ios::app);
+    file << key << " " << algo << std::endl;
+    CHECK(file) << "Cannot write the cuDNN algorithm cache "
+                << algo_cache.file;
+  }
+}
+
+void SetAlgoCacheFile(const string& path) {
+  boost::mutex::scoped_lock lock(algo_cache.mutex);
+  algo_cache.file = path;
+  // A missing file is created by the first algorithm tuned.
+  std::ifstream file(path.c_str());
+  string key;
+  int algo;
+  while (file >> key >> algo) {
+    algo_cache.algos[key] = algo;
+  }
+  LOG(INFO) << "Read " << algo_cache.algos.size() << " cuDNN algorithms from "
+            << path;
+}
+
+// The handles, their streams and the workspace a thread shares on a device
+struct SharedResources {
+  SharedResources() : workspace(NULL), workspace_size(0) { }
+  ~SharedResources() {
+    for (int i = 0; i < handles.size(); ++i) {
+      cudnnDestroy(handles[i]);
+      cudaStreamDestroy(streams[i]);
+    }
+    CaffeFreeGPU(workspace);
+  }
+
+  vector<cudnnHandle_t> handles;
+  vector<cudaStream_t> streams;
+  void* workspace;
+  size_t workspace_size;
+};
+
+// The resources of each device, for the thread
+typedef std::map<int, shared_ptr<SharedResources> > DeviceResources;
+static boost::thread_specific_ptr<DeviceResources> thread_resources_;
+
+static SharedResources* CurrentResources() {
+  if (!thread_resources_.get()) {
+    thread_resources_.reset(new DeviceResources());
+  }
+  int device;
+  CUDA_CHECK(cudaGetDevice(&device));
+  shared_ptr<SharedResources>& resources = (*thread_resources_)[device];
+  if (!resources) {
+    resources.reset(new SharedResources());
+  }
+  return resources.get();
+}
+
+static SharedResources* ResourcesWithHandle(int i) {
+  CHECK_GE(i, 0);
+  SharedResources* resources = CurrentResources();
+  while (resources->handles.size() <= i) {
+    cudaStream_t stream;
+    cudnnHandle_t handle;
+    CUDA_CHECK(cudaStreamCreate(&stream));
+    CUDNN_CHECK(cudnnCreate(&handle));
+    CUDNN_CHECK(cudnnSetStream(handle, stream));
+    resources->streams.push_back(stream);
+    resources->handles.push_back(handle);
+  }
+  return resources;
+}
+
+cudnnHandle_t SharedHandle(int i) {
+  return ResourcesWithHandle(i)->handles[i];
+}
+
+cudaStream_t SharedStream(int i) {
+  return ResourcesWithHandle(i)->streams[i];
+}
+
+void* SharedWorkspace(size_t size) {
+  SharedResources* resources = CurrentResources();
+  if (size > resources->workspace_size) {
+    // The layers run before may still use the smaller workspace, and the
+    // memory pool does not synchronize.
+    CUDA_CHECK(cudaDeviceSynchronize());
+    CUDA_CHECK(CaffeFreeGPU(resources->workspace));
+    resources->workspace = NULL;
+    resources->workspace_size = 0;
+    if (CaffeMallocGPU(&resources->workspace, size) != cudaSuccess) {
+      resources->workspace = NULL;
+      return NULL;
+    }
+    resources->workspace_size = size;
+  }
+  return resources->workspace;
+}
+
 }  // namespace cudnn
 }  // namespace caffe
 #endif
@@ -0,0 +1,61 @@
+#include <boost/thread.hpp>
+
+#include "caffe/util/data_stats.hpp"
+
+namespace caffe {
+
+class DataStats::sync {
+ public:
+  mutable boost::mutex mutex_;
+};
+
+DataStats::DataStats()
+    : sync_(new sync()) {
+  reset();
+}
+
+void DataStats::add(Counter counter, double value) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  totals_[counter] += value;
+  samples_[counter]++;
+}
+
+double DataStats::total(Counter counter) const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return totals_[counter];
+}
+
+size_t DataStats::samples(Counter counter) const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return samples_[counter];
+}
+
+void DataStats::take(DataStats* other) {
+  CHECK_NE(this, other);
+  double totals[NUM_COUNTERS];
+  size_t samples[NUM_COUNTERS];
+  {
+    boost::mutex::scoped_lock lock(other->sync_->mutex_);
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+      totals[i] = other->totals_[i];
+      samples[i] = other->samples_[i];
+      other->totals_[i] = 0;
+      other->samples_[i] = 0;
+    }
+  }
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  for (int i = 0; i < NUM_COUNTERS; ++i) {
+    totals_[i] += totals[i];
+    samples_[i] += samples[i];
+  }
+}
+
+void DataStats::reset() {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  for (int i = 0; i < NUM_COUNTERS; ++i) {
+    totals_[i] = 0;
+    samples_[i] = 0;
+  }
+}
+
+}  // namespace caffe
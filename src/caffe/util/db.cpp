@@ -1,17 +1,241 @@
 #include "caffe/util/db.hpp"
+#include "caffe/util/db_chunks.hpp"
 #include "caffe/util/db_leveldb.hpp"
 #include "caffe/util/db_lmdb.hpp"
+#include "caffe/util/db_records.hpp"
+#include "caffe/util/db_service.hpp"
 
+#include <unistd.h>
+
+#include <boost/random/uniform_real.hpp>
+#include <google/protobuf/io/coded_stream.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <string>
+#include <vector>
 
 namespace caffe { namespace db {
 
+RandomCursor::RandomCursor(DB* db, shared_ptr<const vector<string> > keys,
+    unsigned int seed, int readahead)
+    : cursor_(db->NewCursor()), keys_(keys), seed_(seed),
+      readahead_(readahead), epoch_(0), order_(keys->size()), position_(0) {
+  CHECK_GT(keys_->size(), 0) << "The database is empty";
+  if (readahead_ > 0) {
+    ahead_.reset(db->NewCursor());
+  }
+  SeekToFirst();
+}
+
+void RandomCursor::SeekToFirst() {
+  for (int i = 0; i < order_.size(); ++i) {
+    order_[i] = i;
+  }
+  rng_t rng(seed_ + epoch_++);
+  shuffle(order_.begin(), order_.end(), &rng);
+  position_ = 0;
+  Place(0);
+  for (int i = 1; i <= readahead_; ++i) {
+    ReadAhead(i);
+  }
+}
+
+void RandomCursor::Next() {
+  ++position_;
+  Place(position_);
+  ReadAhead(position_ + readahead_);
+}
+
+void RandomCursor::Place(size_t position) {
+  if (position < order_.size()) {
+    const string& key = (*keys_)[order_[position]];
+    CHECK(cursor_->Seek(key)) << "Cannot find the record of " << key;
+  }
+}
+
+void RandomCursor::ReadAhead(size_t position) {
+  if (ahead_ && position < order_.size() &&
+      ahead_->Seek((*keys_)[order_[position]])) {
+    ahead_->WillNeed();
+  }
+}
+
+shared_ptr<const vector<string> > RandomCursor::ReadKeys(DB* db) {
+  shared_ptr<vector<string> > keys(new vector<string>());
+  shared_ptr<Cursor> cursor(db->NewCursor());
+  for (cursor->SeekToFirst(); cursor->valid(); cursor->Next()) {
+    keys->push_back(cursor->key());
+  }
+  LOG(INFO) << "Read " << keys->size() << " keys";
+  return keys;
+}
+
+RangeCursor::RangeCursor(Cursor* cursor, const string& first,
+    size_t records)
+    : cursor_(cursor), first_(first), records_(records), position_(0) {
+  SeekToFirst();
+}
+
+void RangeCursor::SeekToFirst() {
+  CHECK(cursor_->Seek(first_)) << "Cannot find the record of " << first_;
+  position_ = 0;
+}
+
+void RangeCursor::Next() {
+  cursor_->Next();
+  ++position_;
+}
+
+bool RangeCursor::Seek(const string& key) {
+  LOG(FATAL) << "A range of records cannot seek";
+  return false;
+}
+
+MixCursor::MixCursor(const vector<Cursor*>& cursors,
+    const vector<float>& weights, unsigned int seed)
+    : seed_(seed), current_(0) {
+  CHECK_GT(cursors.size(), 0);
+  CHECK(weights.empty() || weights.size() == cursors.size())
+      << "Give either no weights or one per source";
+  double total = 0;
+  for (int i = 0; i < cursors.size(); ++i) {
+    cursors_.push_back(shared_ptr<Cursor>(cursors[i]));
+    const double weight = weights.empty() ? 1 : weights[i];
+    CHECK_GE(weight, 0) << "Source weights must not be negative";
+    total += weight;
+    cumulative_.push_back(total);
+  }
+  CHECK_GT(total, 0) << "Some source must have a positive weight";
+  SeekToFirst();
+}
+
+void MixCursor::SeekToFirst() {
+  for (int i = 0; i < cursors_.size(); ++i) {
+    cursors_[i]->SeekToFirst();
+    CHECK(cursors_[i]->valid()) << "Source " << i << " is empty";
+  }
+  rng_.seed(seed_);
+  Draw();
+}
+
+void MixCursor::Next() {
+  Cursor* cursor = cursors_[current_].get();
+  cursor->Next();
+  if (!cursor->valid()) {
+    cursor->SeekToFirst();
+  }
+  Draw();
+}
+
+void MixCursor::Draw() {
+  const double draw = boost::uniform_real<double>(0,
+      cumulative_.back())(rng_);
+  current_ = std::upper_bound(cumulative_.begin(), cumulative_.end(), draw)
+      - cumulative_.begin();
+  // The draw may round up to the total
+  current_ = std::min<int>(current_, cursors_.size() - 1);
+}
+
+bool MixCursor::Seek(const string& key) {
+  LOG(FATAL) << "A mix of sources cannot seek";
+  return false;
+}
+
+ShuffleBufferCursor::ShuffleBufferCursor(Cursor* cursor, int size,
+    unsigned int seed)
+    : cursor_(cursor), size_(size), seed_(seed), current_(0) {
+  CHECK_GT(size_, 0);
+  SeekToFirst();
+}
+
+void ShuffleBufferCursor::SeekToFirst() {
+  cursor_->SeekToFirst();
+  CHECK(cursor_->valid()) << "The database is empty";
+  rng_.seed(seed_);
+  keys_.clear();
+  values_.clear();
+  // Fills the buffer, with fewer records than its size if there are fewer
+  for (int i = 0; i < size_ && cursor_->valid(); ++i) {
+    keys_.push_back(string());
+    values_.push_back(string());
+    Read(i);
+  }
+  current_ = boost::uniform_int<int>(0, keys_.size() - 1)(rng_);
+}
+
+void ShuffleBufferCursor::Next() {
+  Read(current_);
+  current_ = boost::uniform_int<int>(0, keys_.size() - 1)(rng_);
+}
+
+void ShuffleBufferCursor::Read(int slot) {
+  if (!cursor_->valid()) {
+    cursor_->SeekToFirst();
+  }
+  keys_[slot] = cursor_->key();
+  values_[slot].assign(cursor_->value_data(), cursor_->value_size());
+  cursor_->Next();
+}
+
+bool ShuffleBufferCursor::Seek(const string& key) {
+  LOG(FATAL) << "A shuffle buffer cannot seek";
+  return false;
+}
+
+void AppendFixed32(uint32_t value, string* out) {
+  google::protobuf::uint8 bytes[4];
+  google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(value,
+      bytes);
+  out->append(reinterpret_cast<const char*>(bytes), 4);
+}
+
+void AppendFixed64(uint64_t value, string* out) {
+  google::protobuf::uint8 bytes[8];
+  google::protobuf::io::CodedOutputStream::WriteLittleEndian64ToArray(value,
+      bytes);
+  out->append(reinterpret_cast<const char*>(bytes), 8);
+}
+
+uint32_t Fixed32(const char* data) {
+  google::protobuf::uint32 value;
+  google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+      reinterpret_cast<const google::protobuf::uint8*>(data), &value);
+  return value;
+}
+
+uint64_t Fixed64(const char* data) {
+  google::protobuf::uint64 value;
+  google::protobuf::io::CodedInputStream::ReadLittleEndian64FromArray(
+      reinterpret_cast<const google::protobuf::uint8*>(data), &value);
+  return value;
+}
+
+void WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    CHECK_GT(written, 0) << "Cannot write the database: " << strerror(errno);
+    data += written;
+    size -= written;
+  }
+}
+
 DB* GetDB(DataParameter::DB backend) {
   switch (backend) {
   case DataParameter_DB_LEVELDB:
     return new LevelDB();
   case DataParameter_DB_LMDB:
     return new LMDB();
+  case DataParameter_DB_CHUNKS:
+    return new ChunkDB();
+  case DataParameter_DB_RECORDS:
+    return new RecordDB();
+  case DataParameter_DB_SERVICE:
+    return new ServiceDB();
   default:
     LOG(FATAL) << "Unknown database backend";
   }
@@ -22,10 +246,27 @@ DB* GetDB(const string& backend) {
     return new LevelDB();
   } else if (backend == "lmdb") {
     return new LMDB();
+  } else if (backend == "chunks") {
+    return new ChunkDB();
+  } else if (backend == "records") {
+    return new RecordDB();
+  } else if (backend == "service") {
+    return new ServiceDB();
   } else {
     LOG(FATAL) << "Unknown database backend";
   }
 }
 
+DB* GetDB(const DataParameter& param, int shard, int shards) {
+  if (param.backend() == DataParameter_DB_CHUNKS) {
+    ChunkDB* db = new ChunkDB();
+    db->set_readahead(param.chunk_readahead());
+    db->set_cache(param.chunk_cache());
+    db->set_shard(shard, shards);
+    return db;
+  }
+  return GetDB(param.backend());
+}
+
 }  // namespace db
 }  // namespace caffe
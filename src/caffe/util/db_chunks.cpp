@@ -0,0 +1,474 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "caffe/util/db_chunks.hpp"
+#include "caffe/util/socket.hpp"
+
+namespace caffe { namespace db {
+
+// Each record is its key size, value size, key then value. The chunks are
+// followed by the index, of each chunk its offset, size, number of records
+// and first key, then the last key of the file, and the file ends with
+// the offset of the index, the number of chunks, flags and a magic number.
+const uint32_t kChunkMagic = 0x4b4e4843;  // "CHNK"
+const size_t kTrailerSize = 20;
+const uint32_t kSortedFlag = 1;
+// Attempts of a request while the server is unavailable
+const int kHTTPAttempts = 6;
+
+class LocalChunkFile : public ChunkFile {
+ public:
+  explicit LocalChunkFile(const string& path)
+      : fd_(open(path.c_str(), O_RDONLY)) {
+    CHECK_GE(fd_, 0) << "Cannot open " << path << ": " << strerror(errno);
+    struct stat st;
+    CHECK_EQ(fstat(fd_, &st), 0) << strerror(errno);
+    size_ = st.st_size;
+  }
+  virtual ~LocalChunkFile() { close(fd_); }
+  virtual size_t size() { return size_; }
+  virtual void Read(size_t offset, size_t size, char* data) {
+    while (size > 0) {
+      const ssize_t read = pread(fd_, data, size, offset);
+      if (read < 0 && errno == EINTR) {
+        continue;
+      }
+      CHECK_GT(read, 0) << "Cannot read chunks: "
+          << (read ? strerror(errno) : "truncated file");
+      data += read;
+      offset += read;
+      size -= read;
+    }
+  }
+
+ protected:
+  const int fd_;
+  size_t size_;
+};
+
+// Each read is a GET of the range on a connection of its own, so that
+// reads run in parallel. Only plain HTTP is supported, e.g. through a
+// gateway of the object store on the local network.
+class HTTPChunkFile : public ChunkFile {
+ public:
+  explicit HTTPChunkFile(const string& url)
+      : url_(url), port_(80) {
+    const size_t begin = strlen("http://");
+    const size_t slash = url.find('/', begin);
+    host_ = url.substr(begin, slash - begin);
+    path_ = slash == string::npos ? "/" : url.substr(slash);
+    const size_t colon = host_.find(':');
+    name_ = host_.substr(0, colon);
+    if (colon != string::npos) {
+      port_ = boost::lexical_cast<int>(host_.substr(colon + 1));
+    }
+    // The content range of any byte gives the size of the file
+    char last;
+    size_ = Get("bytes=-1", 1, &last);
+  }
+  virtual size_t size() { return size_; }
+  virtual void Read(size_t offset, size_t size, char* data) {
+    if (size > 0) {
+      std::ostringstream range;
+      range << "bytes=" << offset << "-" << offset + size - 1;
+      Get(range.str(), size, data);
+    }
+  }
+
+ protected:
+  // Reads the size bytes of the range into data, returning the size of the
+  // file, retrying while the server is unavailable
+  size_t Get(const string& range, size_t size, char* data);
+
+  const string url_;
+  string host_;
+  string name_;
+  int port_;
+  string path_;
+  size_t size_;
+};
+
+static string ReadLine(Socket* socket) {
+  string line;
+  for (char c; socket->recv(&c, 1), c != '\n';) {
+    if (c != '\r') {
+      line += c;
+    }
+  }
+  return line;
+}
+
+size_t HTTPChunkFile::Get(const string& range, size_t size, char* data) {
+  for (int attempt = 1; ; ++attempt) {
+    shared_ptr<Socket> socket = Socket::connect(name_, port_);
+    std::ostringstream request;
+    request << "GET " << path_ << " HTTP/1.1\r\n"
+            << "Host: " << host_ << "\r\n"
+            << "Range: " << range << "\r\n"
+            << "Connection: close\r\n\r\n";
+    const string sent = request.str();
+    socket->send(sent.data(), sent.size());
+    const string status = ReadLine(socket.get());
+    int code = 0;
+    sscanf(status.c_str(), "HTTP/%*s %d", &code);
+    size_t length = 0;
+    size_t total = 0;
+    for (string line = ReadLine(socket.get()); !line.empty();
+         line = ReadLine(socket.get())) {
+      const size_t colon = line.find(':');
+      string name = line.substr(0, colon);
+      for (int i = 0; i < name.size(); ++i) {
+        name[i] = tolower(name[i]);
+      }
+      if (name == "content-length") {
+        length = strtoull(line.c_str() + colon + 1, NULL, 10);
+      } else if (name == "content-range") {
+        total = strtoull(line.c_str() + line.rfind('/') + 1, NULL, 10);
+      }
+    }
+    if (code >= 500 && attempt < kHTTPAttempts) {
+      LOG(WARNING) << "GET " << url_ << " returned " << status
+                   << ", retrying";
+      sleep(1 << attempt);
+      continue;
+    }
+    CHECK_EQ(code, 206) << "GET " << url_ << " " << range << " returned "
+        << status << ", the server must support range requests";
+    CHECK_EQ(length, size) << "Unexpected content length from " << url_;
+    socket->recv(data, size);
+    return total;
+  }
+}
+
+ChunkFile* ChunkFile::Open(const string& source) {
+  CHECK(source.find("https://") != 0) << "Cannot read " << source
+      << ", HTTPS is not supported, read through an HTTP endpoint";
+  if (source.find("http://") == 0) {
+    return new HTTPChunkFile(source);
+  }
+  return new LocalChunkFile(source);
+}
+
+// Reads the chunk from its copy in the cache if there, otherwise from the
+// file, then copies it to the cache
+static void ReadChunk(ChunkFile* file, const ChunkInfo& info,
+    const string& cached, string* data) {
+  data->resize(info.size);
+  struct stat st;
+  if (cached.size() && stat(cached.c_str(), &st) == 0 &&
+      st.st_size == info.size) {
+    LocalChunkFile(cached).Read(0, info.size, &(*data)[0]);
+    return;
+  }
+  file->Read(info.offset, info.size, &(*data)[0]);
+  if (cached.size()) {
+    // Written under a temporary name, so that others never read part of it
+    string temp = cached + ".XXXXXX";
+    const int fd = mkstemp(&temp[0]);
+    if (fd < 0) {
+      LOG(WARNING) << "Cannot cache chunk " << cached << ": "
+                   << strerror(errno);
+      return;
+    }
+    const bool written = write(fd, data->data(), data->size()) ==
+        static_cast<ssize_t>(data->size());
+    close(fd);
+    if (!written || rename(temp.c_str(), cached.c_str()) != 0) {
+      LOG(WARNING) << "Cannot cache chunk " << cached << ": "
+                   << strerror(errno);
+      unlink(temp.c_str());
+    }
+  }
+}
+
+struct ChunkCursor::Fetch {
+  int position;
+  string data;
+  shared_ptr<boost::thread> thread;
+};
+
+ChunkCursor::ChunkCursor(shared_ptr<ChunkFile> file,
+    shared_ptr<const vector<ChunkInfo> > index, const vector<int>& chunks,
+    bool sorted, int readahead, const string& cache)
+    : file_(file), index_(index), chunks_(chunks), sorted_(sorted),
+      readahead_(readahead), cache_(cache), next_fetch_(0), position_(0),
+      record_(0), offset_(0), key_(NULL), key_size_(0), value_(NULL),
+      value_size_(0) {
+  SeekToFirst();
+}
+
+ChunkCursor::~ChunkCursor() {
+  boost::this_thread::disable_interruption no_interruption;
+  Cancel();
+  if (current_ && current_->thread->joinable()) {
+    current_->thread->join();
+  }
+}
+
+void ChunkCursor::SeekToFirst() {
+  if (chunks_.empty()) {
+    position_ = 0;
+    return;
+  }
+  Load(0);
+}
+
+void ChunkCursor::Next() {
+  if (++record_ < (*index_)[chunks_[position_]].records) {
+    offset_ += 8 + key_size_ + value_size_;
+    Parse();
+  } else if (position_ + 1 < chunks_.size()) {
+    Load(position_ + 1);
+  } else {
+    position_ = chunks_.size();
+  }
+}
+
+bool ChunkCursor::Seek(const string& key) {
+  CHECK(sorted_) << "Seeking needs keys written in increasing order";
+  // The last chunk starting at or before the key
+  int begin = 0;
+  int end = chunks_.size();
+  while (begin < end) {
+    const int middle = (begin + end) / 2;
+    if ((*index_)[chunks_[middle]].first_key <= key) {
+      begin = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  if (begin > 0) {
+    Load(begin - 1);
+    const uint32_t records = (*index_)[chunks_[position_]].records;
+    for (;;) {
+      const int order = key.compare(0, string::npos, key_, key_size_);
+      if (order == 0) {
+        return true;
+      }
+      if (order < 0 || record_ + 1 == records) {
+        break;
+      }
+      Next();
+    }
+  }
+  position_ = chunks_.size();
+  return false;
+}
+
+void ChunkCursor::Load(int position) {
+  if (!current_ || current_->position != position) {
+    if (fetches_.empty() || fetches_.front()->position != position) {
+      Cancel();
+      next_fetch_ = position;
+      FetchNext();
+    }
+    current_ = fetches_.front();
+    fetches_.pop_front();
+    // Reads the next chunks while this one is parsed
+    while (fetches_.size() < std::min<size_t>(readahead_,
+                                              chunks_.size() - 1)) {
+      FetchNext();
+    }
+    current_->thread->join();
+  }
+  position_ = position;
+  record_ = 0;
+  offset_ = 0;
+  Parse();
+}
+
+void ChunkCursor::FetchNext() {
+  shared_ptr<Fetch> fetch(new Fetch());
+  fetch->position = next_fetch_;
+  const int chunk = chunks_[next_fetch_];
+  const string cached = cache_.size() ?
+      cache_ + boost::lexical_cast<string>(chunk) : "";
+  fetch->thread.reset(new boost::thread(&ReadChunk, file_.get(),
+      (*index_)[chunk], cached, &fetch->data));
+  fetches_.push_back(fetch);
+  next_fetch_ = (next_fetch_ + 1) % chunks_.size();
+}
+
+void ChunkCursor::Cancel() {
+  boost::this_thread::disable_interruption no_interruption;
+  for (int i = 0; i < fetches_.size(); ++i) {
+    fetches_[i]->thread->join();
+  }
+  fetches_.clear();
+}
+
+void ChunkCursor::Parse() {
+  const string& data = current_->data;
+  CHECK_LE(offset_ + 8, data.size()) << "Corrupt chunk";
+  key_size_ = Fixed32(data.data() + offset_);
+  value_size_ = Fixed32(data.data() + offset_ + 4);
+  CHECK_LE(offset_ + 8 + key_size_ + value_size_, data.size())
+      << "Corrupt chunk";
+  key_ = data.data() + offset_ + 8;
+  value_ = key_ + key_size_;
+}
+
+void ChunkTransaction::Put(const string& key, const string& value) {
+  db_->Put(key, value);
+}
+
+ChunkDB::ChunkDB(size_t chunk_size)
+    : chunk_size_(chunk_size), readahead_(4), shard_(0), shards_(1),
+      sorted_(true), fd_(-1), offset_(0) {
+}
+
+void ChunkDB::Open(const string& source, Mode mode) {
+  source_ = source;
+  if (mode == READ) {
+    file_.reset(ChunkFile::Open(source));
+    ReadIndex(file_.get());
+    LOG(INFO) << "Opened chunks " << source << " of " << index_->size()
+              << " chunks";
+    return;
+  }
+  CHECK(source.find("://") == string::npos)
+      << "Chunks are written to a local file, to upload then";
+  index_.reset(new vector<ChunkInfo>());
+  sorted_ = true;
+  offset_ = 0;
+  last_key_.clear();
+  struct stat st;
+  if (mode == WRITE && stat(source.c_str(), &st) == 0) {
+    // Appends chunks in place of the index, written again on closing
+    shared_ptr<ChunkFile> file(ChunkFile::Open(source));
+    offset_ = ReadIndex(file.get());
+    fd_ = open(source.c_str(), O_WRONLY | O_APPEND);
+    CHECK_GE(fd_, 0) << "Cannot open " << source << ": " << strerror(errno);
+    CHECK_EQ(ftruncate(fd_, offset_), 0) << strerror(errno);
+  } else {
+    fd_ = open(source.c_str(), O_WRONLY | O_CREAT |
+        (mode == NEW ? O_EXCL : O_TRUNC), 0664);
+    CHECK_GE(fd_, 0) << "Cannot create " << source << ": "
+        << strerror(errno);
+  }
+  chunk_.clear();
+  info_.records = 0;
+  LOG(INFO) << "Opened chunks " << source;
+}
+
+void ChunkDB::Close() {
+  if (fd_ >= 0) {
+    WriteChunk();
+    string index;
+    for (int i = 0; i < index_->size(); ++i) {
+      const ChunkInfo& info = (*index_)[i];
+      AppendFixed64(info.offset, &index);
+      AppendFixed32(info.size, &index);
+      AppendFixed32(info.records, &index);
+      AppendFixed32(info.first_key.size(), &index);
+      index += info.first_key;
+    }
+    AppendFixed32(last_key_.size(), &index);
+    index += last_key_;
+    AppendFixed64(offset_, &index);
+    AppendFixed32(index_->size(), &index);
+    AppendFixed32(sorted_ ? kSortedFlag : 0, &index);
+    AppendFixed32(kChunkMagic, &index);
+    WriteAll(fd_, index.data(), index.size());
+    CHECK_EQ(close(fd_), 0) << "Cannot write " << source_ << ": "
+        << strerror(errno);
+    fd_ = -1;
+  }
+  file_.reset();
+}
+
+ChunkCursor* ChunkDB::NewCursor() {
+  CHECK(file_) << "Open the database for reading";
+  vector<int> chunks;
+  for (int i = shard_; i < index_->size(); i += shards_) {
+    chunks.push_back(i);
+  }
+  CHECK(chunks.size() || index_->empty()) << "No chunks of " << source_
+      << " for shard " << shard_ << " of " << shards_
+      << ", write smaller chunks";
+  string cache;
+  if (cache_.size()) {
+    // Named after the source and its size, so that the chunks of a file
+    // written again are not read from the cache
+    std::ostringstream prefix;
+    prefix << cache_ << "/" << std::hex << boost::hash<string>()(
+        source_ + "@" + boost::lexical_cast<string>(file_->size())) << "_";
+    cache = prefix.str();
+  }
+  return new ChunkCursor(file_, index_, chunks, sorted_, readahead_, cache);
+}
+
+void ChunkDB::Put(const string& key, const string& value) {
+  CHECK_GE(fd_, 0) << "Open the database for writing";
+  if (index_->size() || info_.records) {
+    sorted_ = sorted_ && last_key_ < key;
+  }
+  if (info_.records == 0) {
+    info_.first_key = key;
+  }
+  AppendFixed32(key.size(), &chunk_);
+  AppendFixed32(value.size(), &chunk_);
+  chunk_ += key;
+  chunk_ += value;
+  ++info_.records;
+  last_key_ = key;
+  if (chunk_.size() >= chunk_size_) {
+    WriteChunk();
+  }
+}
+
+uint64_t ChunkDB::ReadIndex(ChunkFile* file) {
+  const size_t size = file->size();
+  char trailer[kTrailerSize];
+  if (size >= kTrailerSize) {
+    file->Read(size - kTrailerSize, kTrailerSize, trailer);
+  }
+  CHECK(size >= kTrailerSize && Fixed32(trailer + 16) == kChunkMagic)
+      << source_ << " is not a database of chunks, or was not closed";
+  const uint64_t offset = Fixed64(trailer);
+  CHECK_LE(offset, size - kTrailerSize) << "Corrupt index of " << source_;
+  index_.reset(new vector<ChunkInfo>(Fixed32(trailer + 8)));
+  sorted_ = Fixed32(trailer + 12) & kSortedFlag;
+  string data(size - kTrailerSize - offset, 0);
+  file->Read(offset, data.size(), &data[0]);
+  const char* p = data.data();
+  for (int i = 0; i < index_->size(); ++i) {
+    ChunkInfo& info = (*index_)[i];
+    info.offset = Fixed64(p);
+    info.size = Fixed32(p + 8);
+    info.records = Fixed32(p + 12);
+    info.first_key.assign(p + 20, Fixed32(p + 16));
+    p += 20 + info.first_key.size();
+  }
+  last_key_.assign(p + 4, Fixed32(p));
+  return offset;
+}
+
+void ChunkDB::WriteChunk() {
+  if (info_.records > 0) {
+    CHECK_LT(chunk_.size(), 1ULL << 32) << "Records too large for a chunk";
+    info_.offset = offset_;
+    info_.size = chunk_.size();
+    WriteAll(fd_, chunk_.data(), chunk_.size());
+    offset_ += chunk_.size();
+    index_->push_back(info_);
+    chunk_.clear();
+    info_.records = 0;
+  }
+}
+
+}  // namespace db
+}  // namespace caffe
@@ -1,6 +1,9 @@
 #include "caffe/util/db_lmdb.hpp"
 
+#include <stdint.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <string>
 
@@ -22,6 +25,14 @@ void LMDB::Open(const string& source, Mode mode) {
   LOG(INFO) << "Opened lmdb " << source;
 }
 
+void LMDBCursor::WillNeed() {
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(mdb_value_.mv_data);
+  const uintptr_t first = begin & ~(page - 1);
+  posix_madvise(reinterpret_cast<void*>(first),
+      begin + mdb_value_.mv_size - first, POSIX_MADV_WILLNEED);
+}
+
 LMDBCursor* LMDB::NewCursor() {
   MDB_txn* mdb_txn;
   MDB_cursor* mdb_cursor;
@@ -44,7 +55,8 @@ void LMDBTransaction::Put(const string& key, const string& value) {
   mdb_key.mv_size = key.size();
   mdb_value.mv_data = const_cast<char*>(value.data());
   mdb_value.mv_size = value.size();
-  MDB_CHECK(mdb_put(mdb_txn_, *mdb_dbi_, &mdb_key, &mdb_value, 0));
+  MDB_CHECK(mdb_put(mdb_txn_, *mdb_dbi_, &mdb_key, &mdb_value,
+                    append_ ? MDB_APPEND : 0));
 }
 
 }  // namespace db
@@ -0,0 +1,329 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/util/db_records.hpp"
+
+namespace caffe { namespace db {
+
+// The index starts with a magic number, a version and flags, then has for
+// each record the offset of its key in the data file and the sizes of its
+// key and value.
+const uint32_t kRecordMagic = 0x44524352;  // "RCRD"
+const uint32_t kRecordVersion = 1;
+const uint32_t kSortedFlag = 1;
+const size_t kHeaderSize = 16;
+const size_t kEntrySize = 16;
+
+// Advises the kernel to read the pages of the range from the file
+static void Advise(const char* data, size_t size) {
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(data);
+  const uintptr_t first = begin & ~(page - 1);
+  posix_madvise(reinterpret_cast<void*>(first), begin + size - first,
+                POSIX_MADV_WILLNEED);
+}
+
+void RecordCursor::SeekToFirst() {
+  Place(0, true);
+}
+
+void RecordCursor::Next() {
+  Place(record_ + 1, true);
+}
+
+bool RecordCursor::valid() {
+  return record_ < db_->records();
+}
+
+bool RecordCursor::Seek(const string& key) {
+  Place(db_->Find(key), false);
+  return valid();
+}
+
+void RecordCursor::WillNeed() {
+  if (valid()) {
+    db_->ReadAhead(record_);
+  }
+}
+
+void RecordCursor::Place(size_t record, bool sequential) {
+  record_ = record;
+  if (!sequential || record == 0) {
+    ahead_ = 0;
+  }
+  if (valid()) {
+    uint64_t offset;
+    db_->Entry(record_, &offset, &key_size_, &value_size_);
+    if (!sequential && db_->TakeAhead(record_, &buffer_)) {
+      key_ = buffer_.data();
+      return;
+    }
+    key_ = db_->data() + offset;
+    const uint64_t end = offset + key_size_ + value_size_;
+    if (sequential && end > ahead_) {
+      ahead_ = std::min<uint64_t>(std::max<uint64_t>(end,
+          offset + kReadahead), db_->data_size());
+      Advise(key_, ahead_ - offset);
+    }
+  }
+}
+
+void RecordTransaction::Put(const string& key, const string& value) {
+  data_ += key;
+  data_ += value;
+  sizes_.push_back(key.size());
+  sizes_.push_back(value.size());
+}
+
+void RecordTransaction::Commit() {
+  db_->Append(data_, sizes_);
+  data_.clear();
+  sizes_.clear();
+}
+
+RecordDB::RecordDB()
+    : data_fd_(-1), index_fd_(-1), data_(NULL), data_size_(0), index_(NULL),
+      index_size_(0), records_(0), sorted_(true), end_(0) {
+}
+
+static char* Map(int fd, size_t size) {
+  if (size == 0) {
+    return NULL;
+  }
+  void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  CHECK(map != MAP_FAILED) << "Cannot map the database: " << strerror(errno);
+  return static_cast<char*>(map);
+}
+
+void RecordDB::Open(const string& source, Mode mode) {
+  source_ = source;
+  struct stat st;
+  if (mode == NEW || (mode == WRITE && stat(source.c_str(), &st) != 0)) {
+    CHECK_EQ(mkdir(source.c_str(), 0744), 0) << "mkdir " << source
+        << " failed: " << strerror(errno);
+  }
+  const int flags = mode == READ ? O_RDONLY : O_RDWR | O_CREAT;
+  data_fd_ = open((source + "/data").c_str(), flags, 0664);
+  index_fd_ = open((source + "/index").c_str(), flags, 0664);
+  CHECK(data_fd_ >= 0 && index_fd_ >= 0) << "Cannot open " << source << ": "
+      << strerror(errno);
+  CHECK_EQ(fstat(index_fd_, &st), 0) << strerror(errno);
+  if (st.st_size == 0 && mode != READ) {
+    string header;
+    AppendFixed32(kRecordMagic, &header);
+    AppendFixed32(kRecordVersion, &header);
+    AppendFixed32(kSortedFlag, &header);
+    AppendFixed32(0, &header);
+    WriteAll(index_fd_, header.data(), header.size());
+    st.st_size = kHeaderSize;
+  }
+  char header[kHeaderSize];
+  CHECK(pread(index_fd_, header, kHeaderSize, 0) == kHeaderSize &&
+        Fixed32(header) == kRecordMagic) << source
+      << " is not a database of records";
+  CHECK_EQ(Fixed32(header + 4), kRecordVersion)
+      << "Unknown version of the database of records " << source;
+  sorted_ = Fixed32(header + 8) & kSortedFlag;
+  // Ignores the part of an entry the last commit did not write
+  records_ = (st.st_size - kHeaderSize) / kEntrySize;
+  if (mode == READ) {
+    index_size_ = st.st_size;
+    index_ = Map(index_fd_, index_size_);
+    CHECK_EQ(fstat(data_fd_, &st), 0) << strerror(errno);
+    data_size_ = st.st_size;
+    data_ = Map(data_fd_, data_size_);
+    if (records_ > 0) {
+      uint64_t offset;
+      uint32_t key_size, value_size;
+      Entry(records_ - 1, &offset, &key_size, &value_size);
+      CHECK_LE(offset + key_size + value_size, data_size_)
+          << "Truncated data file of " << source;
+    }
+    LOG(INFO) << "Opened records " << source << " of " << records_
+              << " records";
+    return;
+  }
+  // Appends after the last record, over what a failed commit left
+  end_ = 0;
+  last_key_.clear();
+  if (records_ > 0) {
+    char entry[kEntrySize];
+    CHECK_EQ(pread(index_fd_, entry, kEntrySize,
+                   kHeaderSize + (records_ - 1) * kEntrySize), kEntrySize);
+    last_key_.resize(Fixed32(entry + 8));
+    CHECK_EQ(pread(data_fd_, &last_key_[0], last_key_.size(),
+                   Fixed64(entry)), last_key_.size())
+        << "Truncated data file of " << source;
+    end_ = Fixed64(entry) + last_key_.size() + Fixed32(entry + 12);
+  }
+  const off_t index_end = kHeaderSize + records_ * kEntrySize;
+  CHECK(ftruncate(data_fd_, end_) == 0 && ftruncate(index_fd_, index_end) == 0
+        && lseek(data_fd_, end_, SEEK_SET) == end_
+        && lseek(index_fd_, index_end, SEEK_SET) == index_end)
+      << "Cannot write " << source << ": " << strerror(errno);
+  LOG(INFO) << "Opened records " << source;
+}
+
+void RecordDB::Close() {
+  {
+    // Waits for the reads outstanding, before their buffers and file go
+    boost::mutex::scoped_lock lock(ahead_mutex_);
+    reader_.reset();
+    ahead_.clear();
+    ahead_order_.clear();
+  }
+  if (data_) {
+    munmap(data_, data_size_);
+  }
+  if (index_) {
+    munmap(index_, index_size_);
+  }
+  if (data_fd_ >= 0) {
+    close(data_fd_);
+  }
+  if (index_fd_ >= 0) {
+    CHECK_EQ(close(index_fd_), 0) << "Cannot write " << source_ << ": "
+        << strerror(errno);
+  }
+  data_fd_ = index_fd_ = -1;
+  data_ = index_ = NULL;
+  data_size_ = index_size_ = records_ = 0;
+  order_.clear();
+}
+
+void RecordDB::Entry(size_t record, uint64_t* offset, uint32_t* key_size,
+    uint32_t* value_size) const {
+  const char* entry = index_ + kHeaderSize + record * kEntrySize;
+  *offset = Fixed64(entry);
+  *key_size = Fixed32(entry + 8);
+  *value_size = Fixed32(entry + 12);
+}
+
+string RecordDB::Key(size_t record) const {
+  uint64_t offset;
+  uint32_t key_size, value_size;
+  Entry(record, &offset, &key_size, &value_size);
+  return string(data_ + offset, key_size);
+}
+
+// Orders records by key
+class KeyLess {
+ public:
+  explicit KeyLess(const RecordDB* db) : db_(db) { }
+  bool operator()(uint32_t a, uint32_t b) const {
+    return db_->Key(a) < db_->Key(b);
+  }
+
+ private:
+  const RecordDB* db_;
+};
+
+size_t RecordDB::Find(const string& key) {
+  if (!sorted_) {
+    boost::mutex::scoped_lock lock(order_mutex_);
+    if (order_.size() != records_) {
+      LOG(INFO) << "Sorting the keys of " << source_ << " to find them";
+      order_.resize(records_);
+      for (size_t i = 0; i < records_; ++i) {
+        order_[i] = i;
+      }
+      std::sort(order_.begin(), order_.end(), KeyLess(this));
+    }
+  }
+  size_t begin = 0;
+  size_t end = records_;
+  while (begin < end) {
+    const size_t middle = (begin + end) / 2;
+    if (Key(sorted_ ? middle : order_[middle]) < key) {
+      begin = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  if (begin < records_) {
+    const size_t record = sorted_ ? begin : order_[begin];
+    if (Key(record) == key) {
+      return record;
+    }
+  }
+  return records_;
+}
+
+void RecordDB::ReadAhead(size_t record) {
+  boost::mutex::scoped_lock lock(ahead_mutex_);
+  if (ahead_.count(record)) {
+    return;
+  }
+  if (!reader_) {
+    reader_.reset(new AsyncReader(kReadDepth));
+  }
+  while (ahead_order_.size() >= kMaxAhead) {
+    std::map<size_t, std::pair<uint64_t, string> >::iterator it =
+        ahead_.find(ahead_order_.front());
+    ahead_order_.pop_front();
+    if (it != ahead_.end()) {
+      reader_->wait(it->second.first);
+      ahead_.erase(it);
+    }
+  }
+  uint64_t offset;
+  uint32_t key_size, value_size;
+  Entry(record, &offset, &key_size, &value_size);
+  std::pair<uint64_t, string>& ahead = ahead_[record];
+  ahead.second.resize(key_size + value_size);
+  ahead.first = reader_->submit(data_fd_, offset, ahead.second.size(),
+                                &ahead.second[0]);
+  ahead_order_.push_back(record);
+}
+
+bool RecordDB::TakeAhead(size_t record, string* buffer) {
+  boost::mutex::scoped_lock lock(ahead_mutex_);
+  std::map<size_t, std::pair<uint64_t, string> >::iterator it =
+      ahead_.find(record);
+  if (it == ahead_.end()) {
+    return false;
+  }
+  reader_->wait(it->second.first);
+  buffer->swap(it->second.second);
+  ahead_.erase(it);
+  return true;
+}
+
+void RecordDB::Append(const string& data, const vector<uint32_t>& sizes) {
+  CHECK(index_fd_ >= 0 && !index_) << "Open the database for writing";
+  const bool sorted = sorted_;
+  string index;
+  uint64_t offset = end_;
+  for (int i = 0; i < sizes.size(); i += 2) {
+    const string key = data.substr(offset - end_, sizes[i]);
+    if (records_ > 0 || i > 0) {
+      sorted_ = sorted_ && last_key_ < key;
+    }
+    last_key_ = key;
+    AppendFixed64(offset, &index);
+    AppendFixed32(sizes[i], &index);
+    AppendFixed32(sizes[i + 1], &index);
+    offset += sizes[i] + sizes[i + 1];
+  }
+  WriteAll(data_fd_, data.data(), data.size());
+  WriteAll(index_fd_, index.data(), index.size());
+  if (sorted != sorted_) {
+    string flags;
+    AppendFixed32(0, &flags);
+    CHECK_EQ(pwrite(index_fd_, flags.data(), flags.size(), 8), flags.size())
+        << "Cannot write " << source_ << ": " << strerror(errno);
+  }
+  end_ = offset;
+  records_ += sizes.size() / 2;
+}
+
+}  // namespace db
+}  // namespace caffe
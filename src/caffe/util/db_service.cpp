@@ -0,0 +1,309 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include "caffe/util/db_service.hpp"
+
+namespace caffe { namespace db {
+
+const uint32_t kServiceMagic = 0x56524553;  // "SERV"
+// Seconds readers wait for the service to be created
+const int kServiceTimeout = 60;
+
+// A reader is free if its pid is 0. Its position is the first record it has
+// not released, the writer not writing over it.
+struct ServiceReader {
+  int32_t pid;
+  uint64_t position;
+};
+
+// The start of the shared memory, followed by the slots. The writer sets
+// the magic number last, once the rest is initialized.
+struct ServiceDB::Header {
+  uint32_t magic;
+  // The pid of the writer, 0 once it closed the service
+  int32_t writer;
+  uint32_t slots;
+  uint64_t slot_size;
+  pthread_mutex_t mutex;
+  pthread_cond_t published;
+  pthread_cond_t released;
+  uint64_t written;
+  ServiceReader readers[ServiceDB::kReaders];
+};
+
+static bool Alive(int pid) {
+  return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// Locks the mutex of a service, recovering it from a process that exited
+// while holding it
+class ServiceLock {
+ public:
+  explicit ServiceLock(pthread_mutex_t* mutex) : mutex_(mutex) {
+    Recover(pthread_mutex_lock(mutex_));
+  }
+  ~ServiceLock() {
+    pthread_mutex_unlock(mutex_);
+  }
+  // Waits for the condition, at most a second so that callers can check
+  // the other processes are still alive, and whether they are interrupted
+  void Wait(pthread_cond_t* condition) {
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    const int status = pthread_cond_timedwait(condition, mutex_, &deadline);
+    if (status != ETIMEDOUT) {
+      Recover(status);
+    }
+  }
+
+ private:
+  void Recover(int status) {
+    if (status == EOWNERDEAD) {
+      pthread_mutex_consistent(mutex_);
+    } else {
+      CHECK_EQ(status, 0) << "Cannot lock the data service: "
+          << strerror(status);
+    }
+  }
+
+  pthread_mutex_t* mutex_;
+};
+
+ServiceCursor::ServiceCursor(ServiceDB* db)
+    : db_(db), reader_(-1), position_(0), published_(0) {
+  CHECK(db->header_ && !db->writer_) << "Open the service for reading";
+  ServiceDB::Header* header = db->header_;
+  {
+    ServiceLock lock(&header->mutex);
+    for (int i = 0; i < ServiceDB::kReaders && reader_ < 0; ++i) {
+      if (header->readers[i].pid == 0) {
+        reader_ = i;
+      }
+    }
+    CHECK_GE(reader_, 0) << "Too many readers of the data service "
+        << db->name_;
+    position_ = header->written;
+    header->readers[reader_].pid = getpid();
+    header->readers[reader_].position = position_;
+  }
+  // The writer waits for readers
+  pthread_cond_broadcast(&header->released);
+}
+
+ServiceCursor::~ServiceCursor() {
+  ServiceDB::Header* header = db_->header_;
+  {
+    ServiceLock lock(&header->mutex);
+    header->readers[reader_].pid = 0;
+  }
+  pthread_cond_broadcast(&header->released);
+}
+
+void ServiceCursor::Next() {
+  ServiceDB::Header* header = db_->header_;
+  {
+    ServiceLock lock(&header->mutex);
+    header->readers[reader_].position = ++position_;
+  }
+  pthread_cond_broadcast(&header->released);
+}
+
+string ServiceCursor::key() {
+  return boost::lexical_cast<string>(position_);
+}
+
+const char* ServiceCursor::value_data() {
+  Wait();
+  return db_->slot(position_) + sizeof(uint64_t);
+}
+
+size_t ServiceCursor::value_size() {
+  Wait();
+  return *reinterpret_cast<const uint64_t*>(db_->slot(position_));
+}
+
+bool ServiceCursor::Seek(const string& key) {
+  LOG(FATAL) << "The records of a data service cannot be sought";
+  return false;
+}
+
+void ServiceCursor::Wait() {
+  if (position_ < published_) {
+    return;
+  }
+  ServiceDB::Header* header = db_->header_;
+  ServiceLock lock(&header->mutex);
+  while (header->written <= position_) {
+    CHECK(header->writer && Alive(header->writer)) << "The data service "
+        << db_->name_ << " stopped";
+    lock.Wait(&header->published);
+    boost::this_thread::interruption_point();
+  }
+  published_ = header->written;
+}
+
+void ServiceTransaction::Put(const string& key, const string& value) {
+  db_->Publish(value);
+}
+
+ServiceDB::ServiceDB()
+    : writer_(false), slots_(kSlots), slot_size_(kSlotSize), header_(NULL),
+      data_(NULL), size_(0) {
+}
+
+void ServiceDB::Open(const string& source, Mode mode) {
+  name_ = source[0] == '/' ? source : "/" + source;
+  writer_ = mode != READ;
+  int fd;
+  if (writer_) {
+    // Replaces the memory of a writer that did not close it
+    shm_unlink(name_.c_str());
+    fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+    CHECK_GE(fd, 0) << "Cannot create the data service " << name_ << ": "
+        << strerror(errno);
+    size_ = sizeof(Header) + slots_ * (sizeof(uint64_t) + slot_size_);
+    CHECK_EQ(ftruncate(fd, size_), 0) << "Cannot allocate " << size_
+        << " bytes for the data service " << name_ << ": " << strerror(errno);
+  } else {
+    struct stat st;
+    for (int i = 0; ; ++i) {
+      fd = shm_open(name_.c_str(), O_RDWR, 0);
+      if (fd >= 0) {
+        CHECK_EQ(fstat(fd, &st), 0) << strerror(errno);
+        if (st.st_size >= sizeof(Header)) {
+          break;
+        }
+        close(fd);
+      } else {
+        CHECK_EQ(errno, ENOENT) << "Cannot open the data service " << name_
+            << ": " << strerror(errno);
+      }
+      CHECK_LT(i, kServiceTimeout) << "No data service " << name_;
+      if (i == 0) {
+        LOG(INFO) << "Waiting for the data service " << name_;
+      }
+      sleep(1);
+    }
+    size_ = st.st_size;
+  }
+  void* map = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  CHECK(map != MAP_FAILED) << "Cannot map the data service " << name_
+      << ": " << strerror(errno);
+  header_ = static_cast<Header*>(map);
+  data_ = static_cast<char*>(map) + sizeof(Header);
+  if (writer_) {
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header_->mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&header_->published, &cond_attr);
+    pthread_cond_init(&header_->released, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    header_->writer = getpid();
+    header_->slots = slots_;
+    header_->slot_size = slot_size_;
+    __sync_synchronize();
+    header_->magic = kServiceMagic;
+    LOG(INFO) << "Created the data service " << name_ << " of " << slots_
+              << " slots of " << slot_size_ << " bytes";
+    return;
+  }
+  volatile uint32_t* magic = &header_->magic;
+  for (int i = 0; *magic != kServiceMagic; ++i) {
+    CHECK_LT(i, kServiceTimeout) << name_ << " is not a data service";
+    sleep(1);
+  }
+  __sync_synchronize();
+  slots_ = header_->slots;
+  slot_size_ = header_->slot_size;
+  CHECK_EQ(size_, sizeof(Header) + slots_ * (sizeof(uint64_t) + slot_size_))
+      << "Truncated data service " << name_;
+  LOG(INFO) << "Opened the data service " << name_;
+}
+
+void ServiceDB::Close() {
+  if (!header_) {
+    return;
+  }
+  if (writer_) {
+    {
+      ServiceLock lock(&header_->mutex);
+      header_->writer = 0;
+    }
+    pthread_cond_broadcast(&header_->published);
+    // Readers keep their mapping
+    shm_unlink(name_.c_str());
+  }
+  munmap(header_, size_);
+  header_ = NULL;
+  data_ = NULL;
+  size_ = 0;
+}
+
+ServiceTransaction* ServiceDB::NewTransaction() {
+  CHECK(header_ && writer_) << "Open the service for writing";
+  return new ServiceTransaction(this);
+}
+
+void ServiceDB::Publish(const string& value) {
+  CHECK_LE(value.size(), slot_size_) << "Record of " << value.size()
+      << " bytes, larger than the slots of the data service " << name_;
+  // Only the writer changes written
+  const uint64_t record = header_->written;
+  {
+    // Waits for a reader, and for all to have released the record of the
+    // slot
+    ServiceLock lock(&header_->mutex);
+    for (;;) {
+      int readers = 0;
+      bool full = false;
+      for (int i = 0; i < kReaders; ++i) {
+        ServiceReader& reader = header_->readers[i];
+        if (reader.pid && !Alive(reader.pid)) {
+          LOG(WARNING) << "Process " << reader.pid << " reading " << name_
+                       << " exited";
+          reader.pid = 0;
+        }
+        if (reader.pid) {
+          ++readers;
+          full |= record >= reader.position + slots_;
+        }
+      }
+      if (readers > 0 && !full) {
+        break;
+      }
+      lock.Wait(&header_->released);
+      boost::this_thread::interruption_point();
+    }
+  }
+  char* data = slot(record);
+  *reinterpret_cast<uint64_t*>(data) = value.size();
+  memcpy(data + sizeof(uint64_t), value.data(), value.size());
+  {
+    ServiceLock lock(&header_->mutex);
+    header_->written = record + 1;
+  }
+  pthread_cond_broadcast(&header_->published);
+}
+
+}  // namespace db
+}  // namespace caffe
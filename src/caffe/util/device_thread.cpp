@@ -0,0 +1,65 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <map>
+
+#include "caffe/util/device_thread.hpp"
+
+namespace caffe {
+
+// Never destroyed, so that the threads outlive the nets using them until
+// the process exits
+static boost::mutex device_threads_mutex;
+static std::map<int, DeviceThread*>* device_threads =
+    new std::map<int, DeviceThread*>();
+
+DeviceThread* DeviceThread::Get(int device) {
+  boost::mutex::scoped_lock lock(device_threads_mutex);
+  DeviceThread*& thread = (*device_threads)[device];
+  if (!thread) {
+    thread = new DeviceThread(device);
+    thread->StartInternalThread();
+  }
+  return thread;
+}
+
+DeviceThread::DeviceThread(int device)
+    : device_(device) {
+}
+
+DeviceThread::~DeviceThread() {
+  StopInternalThread();
+}
+
+void DeviceThread::Run(const boost::function<void()>& work) {
+  queue_.push(work);
+}
+
+static void run_and_signal(const boost::function<void()>& work,
+    BlockingQueue<int>* done) {
+  work();
+  done->push(0);
+}
+
+void DeviceThread::RunAndWait(const boost::function<void()>& work) {
+  BlockingQueue<int> done;
+  queue_.push(boost::bind(&run_and_signal, work, &done));
+  done.pop();
+}
+
+void DeviceThread::InternalThreadEntry() {
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    Caffe::SetDevice(device_);
+  }
+#endif
+  try {
+    while (!must_stop()) {
+      const boost::function<void()> work = queue_.pop();
+      work();
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+}  // namespace caffe
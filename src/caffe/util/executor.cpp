@@ -0,0 +1,155 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <deque>
+#include <vector>
+
+#include "caffe/util/executor.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+class Executor::Task {
+ public:
+  boost::function<void()> run_;
+  Caffe::Brew mode_;
+  int device_;
+  int solver_count_;
+  bool root_solver_;
+};
+
+class Executor::sync {
+ public:
+  // The tasks submitted by a thread, by priority
+  class Queue {
+   public:
+    boost::mutex mutex_;
+    std::deque<Task> tasks_[2];
+  };
+
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  boost::thread_group threads_;
+  vector<shared_ptr<Queue> > queues_;
+  // Tasks in the queues not yet claimed by a thread
+  int pending_;
+  // The queue of the tasks submitted by threads outside of the executor
+  int next_queue_;
+  bool stop_;
+};
+
+// The index of the executor thread running, -1 on other threads
+static boost::thread_specific_ptr<int> executor_index;
+
+Executor::Executor(int size)
+    : size_(size),
+      sync_(new sync()) {
+  CHECK_GT(size_, 0);
+  sync_->pending_ = 0;
+  sync_->next_queue_ = 0;
+  sync_->stop_ = false;
+  for (int i = 0; i < size_; ++i) {
+    sync_->queues_.push_back(shared_ptr<sync::Queue>(new sync::Queue()));
+  }
+  for (int i = 0; i < size_; ++i) {
+    sync_->threads_.create_thread(boost::bind(&Executor::entry, this, i));
+  }
+}
+
+Executor::~Executor() {
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    sync_->stop_ = true;
+  }
+  sync_->condition_.notify_all();
+  sync_->threads_.join_all();
+}
+
+void Executor::submit(const boost::function<void()>& task,
+                      Priority priority) {
+  Task t;
+  t.run_ = task;
+  t.mode_ = Caffe::mode();
+  t.device_ = 0;
+#ifndef CPU_ONLY
+  CUDA_CHECK(cudaGetDevice(&t.device_));
+#endif
+  t.solver_count_ = Caffe::solver_count();
+  t.root_solver_ = Caffe::root_solver();
+  int index;
+  if (executor_index.get() && *executor_index >= 0) {
+    index = *executor_index;
+  } else {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    index = sync_->next_queue_;
+    sync_->next_queue_ = (index + 1) % size_;
+  }
+  {
+    sync::Queue& queue = *sync_->queues_[index];
+    boost::mutex::scoped_lock lock(queue.mutex_);
+    queue.tasks_[priority].push_back(t);
+  }
+  // Counted once queued, so that a thread claiming it finds it
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    ++sync_->pending_;
+  }
+  sync_->condition_.notify_one();
+}
+
+void Executor::take(int index, Task* task) {
+  for (;;) {
+    for (int priority = HIGH; priority <= LOW; ++priority) {
+      for (int i = 0; i < size_; ++i) {
+        sync::Queue& queue = *sync_->queues_[(index + i) % size_];
+        boost::mutex::scoped_lock lock(queue.mutex_);
+        std::deque<Task>& tasks = queue.tasks_[priority];
+        if (tasks.empty()) {
+          continue;
+        }
+        // The newest of its own, likely warm in its caches, the oldest of
+        // the others
+        if (i == 0) {
+          *task = tasks.back();
+          tasks.pop_back();
+        } else {
+          *task = tasks.front();
+          tasks.pop_front();
+        }
+        return;
+      }
+    }
+  }
+}
+
+void Executor::entry(int index) {
+  executor_index.reset(new int(index));
+  Caffe::set_random_seed(caffe_rng_rand());
+  int device = -1;
+  for (;;) {
+    {
+      boost::mutex::scoped_lock lock(sync_->mutex_);
+      while (sync_->pending_ == 0 && !sync_->stop_) {
+        sync_->condition_.wait(lock);
+      }
+      if (sync_->pending_ == 0) {
+        return;
+      }
+      --sync_->pending_;
+    }
+    Task task;
+    take(index, &task);
+#ifndef CPU_ONLY
+    if (task.device_ != device) {
+      Caffe::SetDevice(task.device_);
+    }
+#endif
+    device = task.device_;
+    Caffe::set_mode(task.mode_);
+    Caffe::set_solver_count(task.solver_count_);
+    Caffe::set_root_solver(task.root_solver_);
+    task.run_();
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,53 @@
+#include <algorithm>
+
+#include "caffe/common.hpp"
+#include "caffe/util/fused_update.hpp"
+
+namespace caffe {
+
+// A block per chunk, its threads striding over the elements of the chunk.
+template <typename Dtype>
+__global__ void FusedUpdateKernel(const int num_chunks, const int* chunks,
+    Dtype* const* params, const Dtype* mults,
+    const FusedUpdateConfig<Dtype> config) {
+  for (int c = blockIdx.x; c < num_chunks; c += gridDim.x) {
+    const int param = chunks[3 * c];
+    const int end = chunks[3 * c + 2];
+    Dtype* data = params[4 * param];
+    Dtype* diff = params[4 * param + 1];
+    Dtype* history = params[4 * param + 2];
+    Dtype* history2 = params[4 * param + 3];
+    const Dtype lr_mult = mults[2 * param];
+    const Dtype decay_mult = mults[2 * param + 1];
+    for (int i = chunks[3 * c + 1] + threadIdx.x; i < end; i += blockDim.x) {
+      const Dtype update = FusedUpdateValue(config, lr_mult, decay_mult,
+          data[i], diff[i], history + i, history2 ? history2 + i : NULL);
+      diff[i] = update;
+      data[i] -= update;
+    }
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_fused_update(const int num_chunks, const int* chunks,
+    Dtype* const* params, const Dtype* mults,
+    const FusedUpdateConfig<Dtype>& config) {
+  if (num_chunks == 0) {
+    return;
+  }
+  // Grids are at most 65535 blocks wide on older devices.
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  FusedUpdateKernel<Dtype><<<std::min(num_chunks, 65535),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(num_chunks, chunks,
+      params, mults, config);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_fused_update<float>(const int num_chunks,
+    const int* chunks, float* const* params, const float* mults,
+    const FusedUpdateConfig<float>& config);
+template void caffe_gpu_fused_update<double>(const int num_chunks,
+    const int* chunks, double* const* params, const double* mults,
+    const FusedUpdateConfig<double>& config);
+
+}  // namespace caffe
@@ -5,11 +5,8 @@
 
 namespace caffe {
 
-// Verifies format of data stored in HDF5 file and reshapes blob accordingly.
-template <typename Dtype>
-void hdf5_load_nd_dataset_helper(
-    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
-    Blob<Dtype>* blob) {
+std::vector<hsize_t> hdf5_get_nd_dataset_dims(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim) {
   // Verify that the dataset exists.
   CHECK(H5LTfind_dataset(file_id, dataset_name_))
       << "Failed to find HDF5 dataset " << dataset_name_;
@@ -28,7 +25,16 @@ void hdf5_load_nd_dataset_helper(
       file_id, dataset_name_, dims.data(), &class_, NULL);
   CHECK_GE(status, 0) << "Failed to get dataset info for " << dataset_name_;
   CHECK_EQ(class_, H5T_FLOAT) << "Expected float or double data";
+  return dims;
+}
 
+// Verifies format of data stored in HDF5 file and reshapes blob accordingly.
+template <typename Dtype>
+void hdf5_load_nd_dataset_helper(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    Blob<Dtype>* blob) {
+  std::vector<hsize_t> dims =
+      hdf5_get_nd_dataset_dims(file_id, dataset_name_, min_dim, max_dim);
   vector<int> blob_dims(dims.size());
   for (int i = 0; i < dims.size(); ++i) {
     blob_dims[i] = dims[i];
@@ -54,6 +60,55 @@ void hdf5_load_nd_dataset<double>(hid_t file_id, const char* dataset_name_,
   CHECK_GE(status, 0) << "Failed to read double dataset " << dataset_name_;
 }
 
+// Reads a hyperslab of rows, converted to mem_type
+template <typename Dtype>
+static void hdf5_load_rows(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    hsize_t start, hsize_t count, hid_t mem_type, Blob<Dtype>* blob) {
+  std::vector<hsize_t> dims =
+      hdf5_get_nd_dataset_dims(file_id, dataset_name_, min_dim, max_dim);
+  CHECK_LE(start + count, dims[0]) << "Rows out of range in "
+      << dataset_name_;
+  std::vector<hsize_t> offset(dims.size(), 0);
+  offset[0] = start;
+  dims[0] = count;
+  vector<int> blob_dims(dims.size());
+  for (int i = 0; i < dims.size(); ++i) {
+    blob_dims[i] = dims[i];
+  }
+  blob->Reshape(blob_dims);
+
+  hid_t dataset = H5Dopen2(file_id, dataset_name_, H5P_DEFAULT);
+  CHECK_GE(dataset, 0) << "Failed to open HDF5 dataset " << dataset_name_;
+  hid_t file_space = H5Dget_space(dataset);
+  herr_t status = H5Sselect_hyperslab(file_space, H5S_SELECT_SET,
+      offset.data(), NULL, dims.data(), NULL);
+  CHECK_GE(status, 0) << "Failed to select rows of " << dataset_name_;
+  hid_t mem_space = H5Screate_simple(dims.size(), dims.data(), NULL);
+  status = H5Dread(dataset, mem_type, mem_space, file_space, H5P_DEFAULT,
+      blob->mutable_cpu_data());
+  CHECK_GE(status, 0) << "Failed to read rows of " << dataset_name_;
+  H5Sclose(mem_space);
+  H5Sclose(file_space);
+  H5Dclose(dataset);
+}
+
+template <>
+void hdf5_load_nd_dataset_rows<float>(hid_t file_id,
+    const char* dataset_name_, int min_dim, int max_dim, hsize_t start,
+    hsize_t count, Blob<float>* blob) {
+  hdf5_load_rows(file_id, dataset_name_, min_dim, max_dim, start, count,
+      H5T_NATIVE_FLOAT, blob);
+}
+
+template <>
+void hdf5_load_nd_dataset_rows<double>(hid_t file_id,
+    const char* dataset_name_, int min_dim, int max_dim, hsize_t start,
+    hsize_t count, Blob<double>* blob) {
+  hdf5_load_rows(file_id, dataset_name_, min_dim, max_dim, start, count,
+      H5T_NATIVE_DOUBLE, blob);
+}
+
 template <>
 void hdf5_save_nd_dataset<float>(
     const hid_t file_id, const string& dataset_name, const Blob<float>& blob,
@@ -96,6 +151,92 @@ void hdf5_save_nd_dataset<double>(
   delete[] dims;
 }
 
+static hid_t hdf5_create_appendable(
+    hid_t file_id, const string& dataset_name, const vector<int>& shape,
+    int chunk_rows, int compression_level, hid_t mem_type) {
+  CHECK_GE(shape.size(), 1);
+  CHECK_GT(chunk_rows, 0);
+  std::vector<hsize_t> dims(shape.size());
+  std::vector<hsize_t> max_dims(shape.size());
+  std::vector<hsize_t> chunk_dims(shape.size());
+  for (int i = 0; i < shape.size(); ++i) {
+    dims[i] = max_dims[i] = chunk_dims[i] = shape[i];
+  }
+  dims[0] = 0;
+  max_dims[0] = H5S_UNLIMITED;
+  chunk_dims[0] = chunk_rows;
+  hid_t space = H5Screate_simple(dims.size(), dims.data(), max_dims.data());
+  hid_t properties = H5Pcreate(H5P_DATASET_CREATE);
+  herr_t status = H5Pset_chunk(properties, chunk_dims.size(),
+      chunk_dims.data());
+  CHECK_GE(status, 0) << "Failed to set the chunks of " << dataset_name;
+  if (compression_level > 0) {
+    status = H5Pset_deflate(properties, compression_level);
+    CHECK_GE(status, 0) << "Failed to set the compression of "
+        << dataset_name;
+  }
+  hid_t dataset = H5Dcreate2(file_id, dataset_name.c_str(), mem_type, space,
+      H5P_DEFAULT, properties, H5P_DEFAULT);
+  CHECK_GE(dataset, 0) << "Failed to make dataset " << dataset_name;
+  H5Pclose(properties);
+  H5Sclose(space);
+  return dataset;
+}
+
+template <>
+hid_t hdf5_create_appendable_dataset<float>(hid_t file_id,
+    const string& dataset_name, const Blob<float>& blob, int chunk_rows,
+    int compression_level) {
+  return hdf5_create_appendable(file_id, dataset_name, blob.shape(),
+      chunk_rows, compression_level, H5T_NATIVE_FLOAT);
+}
+
+template <>
+hid_t hdf5_create_appendable_dataset<double>(hid_t file_id,
+    const string& dataset_name, const Blob<double>& blob, int chunk_rows,
+    int compression_level) {
+  return hdf5_create_appendable(file_id, dataset_name, blob.shape(),
+      chunk_rows, compression_level, H5T_NATIVE_DOUBLE);
+}
+
+template <typename Dtype>
+static void hdf5_append_rows(hid_t dataset_id, hsize_t start,
+    const Blob<Dtype>& blob, hid_t mem_type) {
+  CHECK_GE(blob.num_axes(), 1);
+  std::vector<hsize_t> dims(blob.num_axes());
+  for (int i = 0; i < dims.size(); ++i) {
+    dims[i] = blob.shape(i);
+  }
+  std::vector<hsize_t> extent(dims);
+  extent[0] = start + dims[0];
+  herr_t status = H5Dset_extent(dataset_id, extent.data());
+  CHECK_GE(status, 0) << "Failed to extend dataset";
+  std::vector<hsize_t> offset(dims.size(), 0);
+  offset[0] = start;
+  hid_t file_space = H5Dget_space(dataset_id);
+  status = H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset.data(),
+      NULL, dims.data(), NULL);
+  CHECK_GE(status, 0) << "Failed to select appended rows";
+  hid_t mem_space = H5Screate_simple(dims.size(), dims.data(), NULL);
+  status = H5Dwrite(dataset_id, mem_type, mem_space, file_space, H5P_DEFAULT,
+      blob.cpu_data());
+  CHECK_GE(status, 0) << "Failed to append rows";
+  H5Sclose(mem_space);
+  H5Sclose(file_space);
+}
+
+template <>
+void hdf5_append_nd_dataset<float>(hid_t dataset_id, hsize_t start,
+    const Blob<float>& blob) {
+  hdf5_append_rows(dataset_id, start, blob, H5T_NATIVE_FLOAT);
+}
+
+template <>
+void hdf5_append_nd_dataset<double>(hid_t dataset_id, hsize_t start,
+    const Blob<double>& blob) {
+  hdf5_append_rows(dataset_id, start, blob, H5T_NATIVE_DOUBLE);
+}
+
 string hdf5_load_string(hid_t loc_id, const string& dataset_name) {
   // Get size of dataset
   size_t size;
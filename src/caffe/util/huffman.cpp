@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/huffman.hpp"
+
+namespace caffe {
+
+// The depth of each leaf of the Huffman tree of the counts, 0 if unused
+static int TreeDepths(const vector<uint64_t>& counts,
+    vector<uint32_t>* lengths) {
+  typedef std::pair<uint64_t, int> Node;
+  std::priority_queue<Node, vector<Node>, std::greater<Node> > queue;
+  const int symbols = counts.size();
+  // Leaves are the symbols, and the inner nodes follow them.
+  vector<int> parent(symbols, -1);
+  for (int s = 0; s < symbols; ++s) {
+    if (counts[s] > 0) {
+      queue.push(Node(counts[s], s));
+    }
+  }
+  lengths->assign(symbols, 0);
+  if (queue.size() == 1) {
+    (*lengths)[queue.top().second] = 1;
+    return 1;
+  }
+  while (queue.size() > 1) {
+    const Node a = queue.top();
+    queue.pop();
+    const Node b = queue.top();
+    queue.pop();
+    const int node = parent.size();
+    parent.push_back(-1);
+    parent[a.second] = node;
+    parent[b.second] = node;
+    queue.push(Node(a.first + b.first, node));
+  }
+  int max_length = 0;
+  for (int s = 0; s < symbols; ++s) {
+    if (counts[s] == 0) {
+      continue;
+    }
+    int length = 0;
+    for (int node = s; parent[node] >= 0; node = parent[node]) {
+      ++length;
+    }
+    (*lengths)[s] = length;
+    max_length = std::max(max_length, length);
+  }
+  return max_length;
+}
+
+void HuffmanCodeLengths(const vector<uint64_t>& counts, int max_bits,
+    vector<uint32_t>* lengths) {
+  CHECK_LE(max_bits, kHuffmanMaxBits);
+  vector<uint64_t> flattened(counts);
+  // Halving the counts, while keeping them nonzero, evens out the tree
+  // until it fits.
+  while (TreeDepths(flattened, lengths) > max_bits) {
+    for (int s = 0; s < flattened.size(); ++s) {
+      flattened[s] = (flattened[s] + 1) / 2;
+    }
+  }
+}
+
+void HuffmanEncode(const vector<uint32_t>& lengths, const uint8_t* symbols,
+    int n, string* bits) {
+  vector<uint32_t> codes(lengths.size());
+  uint32_t code = 0;
+  for (int length = 1; length <= kHuffmanMaxBits; ++length) {
+    for (int s = 0; s < lengths.size(); ++s) {
+      if (lengths[s] == length) {
+        codes[s] = code++;
+      }
+    }
+    code <<= 1;
+  }
+  uint64_t buffer = 0;
+  int buffered = 0;
+  for (int i = 0; i < n; ++i) {
+    const int length = lengths[symbols[i]];
+    CHECK_GT(length, 0) << "symbol " << static_cast<int>(symbols[i])
+        << " has no code";
+    buffer = (buffer << length) | codes[symbols[i]];
+    buffered += length;
+    while (buffered >= 8) {
+      buffered -= 8;
+      bits->push_back(static_cast<char>((buffer >> buffered) & 0xff));
+    }
+  }
+  if (buffered > 0) {
+    bits->push_back(static_cast<char>((buffer << (8 - buffered)) & 0xff));
+  }
+}
+
+void HuffmanDecode(const vector<uint32_t>& lengths, const string& bits,
+    int n, uint8_t* symbols) {
+  CHECK_LE(lengths.size(), 256) << "Huffman codes are for byte symbols";
+  // The number of codes of each length, and the symbols by code
+  vector<int> count(kHuffmanMaxBits + 1, 0);
+  vector<uint8_t> sorted;
+  for (int length = 1; length <= kHuffmanMaxBits; ++length) {
+    for (int s = 0; s < lengths.size(); ++s) {
+      if (lengths[s] == length) {
+        ++count[length];
+        sorted.push_back(s);
+      }
+    }
+  }
+  const int64_t total_bits = static_cast<int64_t>(bits.size()) * 8;
+  int64_t position = 0;
+  for (int i = 0; i < n; ++i) {
+    // The codes of each length start at first, and go to the symbols from
+    // index on.
+    int64_t code = 0;
+    int64_t first = 0;
+    int index = 0;
+    int length = 1;
+    for (; length <= kHuffmanMaxBits; ++length) {
+      CHECK_LT(position, total_bits) << "truncated Huffman codes";
+      code |= (bits[position >> 3] >> (7 - (position & 7))) & 1;
+      ++position;
+      if (code - first < count[length]) {
+        symbols[i] = sorted[index + code - first];
+        break;
+      }
+      index += count[length];
+      first = (first + count[length]) << 1;
+      code <<= 1;
+    }
+    CHECK_LE(length, kHuffmanMaxBits) << "invalid Huffman code";
+  }
+}
+
+}  // namespace caffe
@@ -1,12 +1,104 @@
+#include <boost/bind.hpp>
+
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
 
 #include "caffe/util/im2col.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 namespace caffe {
 
+// Sets [*begin, *end) to the positions of the output row whose input
+// position, position * stride - pad + offset, lies inside [0, size), so the
+// inner loops need no bounds checks
+static inline void valid_range(const int size, const int pad,
+    const int stride, const int offset, const int size_col, int* begin,
+    int* end) {
+  const int first = pad - offset;
+  const int last = size - 1 + pad - offset;
+  *begin = first <= 0 ? 0 : std::min(size_col, (first + stride - 1) / stride);
+  *end = last < 0 ? 0 : std::min(size_col, last / stride + 1);
+  *end = std::max(*begin, *end);
+}
+
+// Loop over the rows of the column matrix, run on the thread pool
+template <typename Dtype>
+class Im2colRows {
+ public:
+  Im2colRows(const Dtype* data_im, const int height, const int width,
+      const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+      const int stride_h, const int stride_w, Dtype* data_col)
+      : data_im_(data_im), height_(height), width_(width),
+        kernel_h_(kernel_h), kernel_w_(kernel_w), pad_h_(pad_h), pad_w_(pad_w),
+        stride_h_(stride_h), stride_w_(stride_w), data_col_(data_col) {
+    height_col_ = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+    width_col_ = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  }
+
+  // The strides of 1 and 2 of most 3x3 and 1x1 kernels are compile time
+  // constants, the copies of rows then being contiguous or of every other
+  // element, which the compiler vectorizes
+  void operator()(int begin, int end) const {
+    switch (stride_w_) {
+    case 1:
+      rows<1>(begin, end);
+      break;
+    case 2:
+      rows<2>(begin, end);
+      break;
+    default:
+      rows<0>(begin, end);
+    }
+  }
+
+ private:
+  // Stride is the horizontal stride, or 0 to read stride_w_
+  template <int Stride>
+  void rows(int begin, int end) const {
+    const int stride_w = Stride ? Stride : stride_w_;
+    for (int c = begin; c < end; ++c) {
+      int w_offset = c % kernel_w_;
+      int h_offset = (c / kernel_w_) % kernel_h_;
+      int c_im = c / kernel_h_ / kernel_w_;
+      int w_begin, w_end;
+      valid_range(width_, pad_w_, stride_w, w_offset, width_col_,
+          &w_begin, &w_end);
+      Dtype* col = data_col_ + c * height_col_ * width_col_;
+      for (int h = 0; h < height_col_; ++h, col += width_col_) {
+        int h_pad = h * stride_h_ - pad_h_ + h_offset;
+        if (h_pad < 0 || h_pad >= height_) {
+          for (int w = 0; w < width_col_; ++w) {
+            col[w] = 0;
+          }
+          continue;
+        }
+        const Dtype* im = data_im_ + (c_im * height_ + h_pad) * width_
+            + w_begin * stride_w - pad_w_ + w_offset;
+        for (int w = 0; w < w_begin; ++w) {
+          col[w] = 0;
+        }
+        for (int w = w_begin; w < w_end; ++w) {
+          col[w] = im[(w - w_begin) * stride_w];
+        }
+        for (int w = w_end; w < width_col_; ++w) {
+          col[w] = 0;
+        }
+      }
+    }
+  }
+
+  const Dtype* data_im_;
+  int height_, width_;
+  int kernel_h_, kernel_w_;
+  int pad_h_, pad_w_;
+  int stride_h_, stride_w_;
+  Dtype* data_col_;
+  int height_col_, width_col_;
+};
+
 template <typename Dtype>
 void im2col_cpu(const Dtype* data_im, const int channels,
     const int height, const int width, const int kernel_h, const int kernel_w,
@@ -16,22 +108,10 @@ void im2col_cpu(const Dtype* data_im, const int channels,
   int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
   int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
   int channels_col = channels * kernel_h * kernel_w;
-  for (int c = 0; c < channels_col; ++c) {
-    int w_offset = c % kernel_w;
-    int h_offset = (c / kernel_w) % kernel_h;
-    int c_im = c / kernel_h / kernel_w;
-    for (int h = 0; h < height_col; ++h) {
-      for (int w = 0; w < width_col; ++w) {
-        int h_pad = h * stride_h - pad_h + h_offset;
-        int w_pad = w * stride_w - pad_w + w_offset;
-        if (h_pad >= 0 && h_pad < height && w_pad >= 0 && w_pad < width)
-          data_col[(c * height_col + h) * width_col + w] =
-            data_im[(c_im * height + h_pad) * width + w_pad];
-        else
-          data_col[(c * height_col + h) * width_col + w] = 0;
-      }
-    }
-  }
+  Caffe::thread_pool().run(channels_col,
+      kParallelGrain / (height_col * width_col),
+      Im2colRows<Dtype>(data_im, height, width, kernel_h, kernel_w,
+                        pad_h, pad_w, stride_h, stride_w, data_col));
 }
 
 // Explicit instantiation
@@ -44,40 +124,464 @@ template void im2col_cpu<double>(const double* data_im, const int channels,
     const int pad_h, const int pad_w, const int stride_h,
     const int stride_w, double* data_col);
 
+// Loop over the image channels, which do not share columns, run on the
+// thread pool
+template <typename Dtype>
+class Col2imChannels {
+ public:
+  Col2imChannels(const Dtype* data_col, const int height, const int width,
+      const int patch_h, const int patch_w, const int pad_h, const int pad_w,
+      const int stride_h, const int stride_w, Dtype* data_im, bool accumulate)
+      : data_col_(data_col), height_(height), width_(width),
+        patch_h_(patch_h), patch_w_(patch_w), pad_h_(pad_h), pad_w_(pad_w),
+        stride_h_(stride_h), stride_w_(stride_w), data_im_(data_im),
+        accumulate_(accumulate) {
+    height_col_ = (height + 2 * pad_h - patch_h) / stride_h + 1;
+    width_col_ = (width + 2 * pad_w - patch_w) / stride_w + 1;
+  }
+
+  // Specialized on the stride as in Im2colRows
+  void operator()(int begin, int end) const {
+    if (!accumulate_) {
+      caffe_set(height_ * width_ * (end - begin), Dtype(0),
+          data_im_ + height_ * width_ * begin);
+    }
+    switch (stride_w_) {
+    case 1:
+      channels<1>(begin, end);
+      break;
+    case 2:
+      channels<2>(begin, end);
+      break;
+    default:
+      channels<0>(begin, end);
+    }
+  }
+
+ private:
+  template <int Stride>
+  void channels(int begin, int end) const {
+    const int stride_w = Stride ? Stride : stride_w_;
+    const int patch = patch_h_ * patch_w_;
+    for (int c = begin * patch; c < end * patch; ++c) {
+      int w_offset = c % patch_w_;
+      int h_offset = (c / patch_w_) % patch_h_;
+      int c_im = c / patch_h_ / patch_w_;
+      int w_begin, w_end;
+      valid_range(width_, pad_w_, stride_w, w_offset, width_col_,
+          &w_begin, &w_end);
+      const Dtype* col = data_col_ + c * height_col_ * width_col_;
+      for (int h = 0; h < height_col_; ++h, col += width_col_) {
+        int h_pad = h * stride_h_ - pad_h_ + h_offset;
+        if (h_pad < 0 || h_pad >= height_) {
+          continue;
+        }
+        Dtype* im = data_im_ + (c_im * height_ + h_pad) * width_
+            + w_begin * stride_w - pad_w_ + w_offset;
+        for (int w = w_begin; w < w_end; ++w) {
+          im[(w - w_begin) * stride_w] += col[w];
+        }
+      }
+    }
+  }
+
+  const Dtype* data_col_;
+  int height_, width_;
+  int patch_h_, patch_w_;
+  int pad_h_, pad_w_;
+  int stride_h_, stride_w_;
+  Dtype* data_im_;
+  bool accumulate_;
+  int height_col_, width_col_;
+};
+
 template <typename Dtype>
 void col2im_cpu(const Dtype* data_col, const int channels,
     const int height, const int width, const int patch_h, const int patch_w,
     const int pad_h, const int pad_w,
     const int stride_h, const int stride_w,
-    Dtype* data_im) {
-  caffe_set(height * width * channels, Dtype(0), data_im);
+    Dtype* data_im, bool accumulate) {
   int height_col = (height + 2 * pad_h - patch_h) / stride_h + 1;
   int width_col = (width + 2 * pad_w - patch_w) / stride_w + 1;
-  int channels_col = channels * patch_h * patch_w;
-  for (int c = 0; c < channels_col; ++c) {
-    int w_offset = c % patch_w;
-    int h_offset = (c / patch_w) % patch_h;
-    int c_im = c / patch_h / patch_w;
-    for (int h = 0; h < height_col; ++h) {
-      for (int w = 0; w < width_col; ++w) {
-        int h_pad = h * stride_h - pad_h + h_offset;
-        int w_pad = w * stride_w - pad_w + w_offset;
-        if (h_pad >= 0 && h_pad < height && w_pad >= 0 && w_pad < width)
-          data_im[(c_im * height + h_pad) * width + w_pad] +=
-              data_col[(c * height_col + h) * width_col + w];
-      }
-    }
-  }
+  Caffe::thread_pool().run(channels,
+      kParallelGrain / (patch_h * patch_w * height_col * width_col),
+      Col2imChannels<Dtype>(data_col, height, width, patch_h, patch_w,
+                            pad_h, pad_w, stride_h, stride_w, data_im,
+                            accumulate));
 }
 
 // Explicit instantiation
 template void col2im_cpu<float>(const float* data_col, const int channels,
     const int height, const int width, const int patch_h, const int patch_w,
     const int pad_h, const int pad_w, const int stride_h,
-    const int stride_w, float* data_im);
+    const int stride_w, float* data_im, bool accumulate);
 template void col2im_cpu<double>(const double* data_col, const int channels,
     const int height, const int width, const int patch_h, const int patch_w,
     const int pad_h, const int pad_w, const int stride_h,
-    const int stride_w, double* data_im);
+    const int stride_w, double* data_im, bool accumulate);
+
+// Loop over the rows of outputs of the NHWC column matrix, each row of the
+// matrix holding the channels of the pixels of the window of an output,
+// run on the thread pool
+template <typename Dtype>
+class Im2colNHWCRows {
+ public:
+  Im2colNHWCRows(const Dtype* data_im, const int channels, const int height,
+      const int width, const int kernel_h, const int kernel_w,
+      const int pad_h, const int pad_w, const int stride_h,
+      const int stride_w, Dtype* data_col)
+      : data_im_(data_im), channels_(channels), height_(height),
+        width_(width), kernel_h_(kernel_h), kernel_w_(kernel_w),
+        pad_h_(pad_h), pad_w_(pad_w), stride_h_(stride_h),
+        stride_w_(stride_w), data_col_(data_col) {
+    width_col_ = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  }
+
+  void operator()(int begin, int end) const {
+    const int kernel_dim = kernel_h_ * kernel_w_ * channels_;
+    for (int h_col = begin; h_col < end; ++h_col) {
+      for (int w_col = 0; w_col < width_col_; ++w_col) {
+        Dtype* col = data_col_ + (h_col * width_col_ + w_col) * kernel_dim;
+        for (int i = 0; i < kernel_h_; ++i) {
+          const int h = h_col * stride_h_ - pad_h_ + i;
+          for (int j = 0; j < kernel_w_; ++j, col += channels_) {
+            const int w = w_col * stride_w_ - pad_w_ + j;
+            if (h < 0 || h >= height_ || w < 0 || w >= width_) {
+              caffe_set(channels_, Dtype(0), col);
+            } else {
+              caffe_copy(channels_, data_im_ + (h * width_ + w) * channels_,
+                  col);
+            }
+          }
+        }
+      }
+    }
+  }
+
+ private:
+  const Dtype* data_im_;
+  int channels_, height_, width_;
+  int kernel_h_, kernel_w_;
+  int pad_h_, pad_w_;
+  int stride_h_, stride_w_;
+  Dtype* data_col_;
+  int width_col_;
+};
+
+template <typename Dtype>
+void im2col_nhwc_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_col) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  Caffe::thread_pool().run(height_col,
+      kParallelGrain / (width_col * kernel_h * kernel_w * channels),
+      Im2colNHWCRows<Dtype>(data_im, channels, height, width, kernel_h,
+                            kernel_w, pad_h, pad_w, stride_h, stride_w,
+                            data_col));
+}
+
+template void im2col_nhwc_cpu<float>(const float* data_im,
+    const int channels, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, float* data_col);
+template void im2col_nhwc_cpu<double>(const double* data_im,
+    const int channels, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, double* data_col);
+
+// Loop over the rows of the NHWC image, which each thread adds the windows
+// overlapping them into, run on the thread pool
+template <typename Dtype>
+class Col2imNHWCRows {
+ public:
+  Col2imNHWCRows(const Dtype* data_col, const int channels, const int height,
+      const int width, const int patch_h, const int patch_w, const int pad_h,
+      const int pad_w, const int stride_h, const int stride_w,
+      Dtype* data_im, bool accumulate)
+      : data_col_(data_col), channels_(channels), height_(height),
+        width_(width), patch_h_(patch_h), patch_w_(patch_w), pad_h_(pad_h),
+        pad_w_(pad_w), stride_h_(stride_h), stride_w_(stride_w),
+        data_im_(data_im), accumulate_(accumulate) {
+    height_col_ = (height + 2 * pad_h - patch_h) / stride_h + 1;
+    width_col_ = (width + 2 * pad_w - patch_w) / stride_w + 1;
+  }
+
+  void operator()(int begin, int end) const {
+    const int row = width_ * channels_;
+    if (!accumulate_) {
+      caffe_set(row * (end - begin), Dtype(0), data_im_ + row * begin);
+    }
+    const int patch_dim = patch_h_ * patch_w_ * channels_;
+    for (int h = begin; h < end; ++h) {
+      // The rows of windows with a row i at h
+      const int h_pad = h + pad_h_;
+      const int h_col_begin = h_pad < patch_h_ ? 0 :
+          (h_pad - patch_h_) / stride_h_ + 1;
+      const int h_col_end = std::min(h_pad / stride_h_ + 1, height_col_);
+      for (int h_col = h_col_begin; h_col < h_col_end; ++h_col) {
+        const int i = h_pad - h_col * stride_h_;
+        for (int w_col = 0; w_col < width_col_; ++w_col) {
+          const Dtype* col = data_col_
+              + (h_col * width_col_ + w_col) * patch_dim
+              + i * patch_w_ * channels_;
+          for (int j = 0; j < patch_w_; ++j, col += channels_) {
+            const int w = w_col * stride_w_ - pad_w_ + j;
+            if (w >= 0 && w < width_) {
+              caffe_axpy(channels_, Dtype(1), col,
+                  data_im_ + (h * width_ + w) * channels_);
+            }
+          }
+        }
+      }
+    }
+  }
+
+ private:
+  const Dtype* data_col_;
+  int channels_, height_, width_;
+  int patch_h_, patch_w_;
+  int pad_h_, pad_w_;
+  int stride_h_, stride_w_;
+  Dtype* data_im_;
+  bool accumulate_;
+  int height_col_, width_col_;
+};
+
+template <typename Dtype>
+void col2im_nhwc_cpu(const Dtype* data_col, const int channels,
+    const int height, const int width, const int patch_h, const int patch_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_im, bool accumulate) {
+  int width_col = (width + 2 * pad_w - patch_w) / stride_w + 1;
+  Caffe::thread_pool().run(height,
+      kParallelGrain / (width_col * patch_h * patch_w * channels),
+      Col2imNHWCRows<Dtype>(data_col, channels, height, width, patch_h,
+                            patch_w, pad_h, pad_w, stride_h, stride_w,
+                            data_im, accumulate));
+}
+
+template void col2im_nhwc_cpu<float>(const float* data_col,
+    const int channels, const int height, const int width, const int patch_h,
+    const int patch_w, const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, float* data_im, bool accumulate);
+template void col2im_nhwc_cpu<double>(const double* data_col,
+    const int channels, const int height, const int width, const int patch_h,
+    const int patch_w, const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, double* data_im, bool accumulate);
+
+// The geometry of grouped_conv_cpu, its loops over the output planes, the
+// image planes or the filters, which do not share results, run on the
+// thread pool. Each offset of the kernel is a scaled copy of strided image
+// rows into output rows, as in Im2colRows, without the columns.
+template <typename Dtype>
+class GroupedConv {
+ public:
+  GroupedConv(const int channels, const int height, const int width,
+      const int groups, const int out_channels, const int kernel_h,
+      const int kernel_w, const int pad_h, const int pad_w,
+      const int stride_h, const int stride_w)
+      : height_(height), width_(width), kernel_h_(kernel_h),
+        kernel_w_(kernel_w), pad_h_(pad_h), pad_w_(pad_w),
+        stride_h_(stride_h), stride_w_(stride_w) {
+    height_col_ = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+    width_col_ = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+    group_channels_ = channels / groups;
+    group_out_channels_ = out_channels / groups;
+  }
+
+  int height_col() const { return height_col_; }
+  int width_col() const { return width_col_; }
+
+  void forward(const Dtype* data_im, const Dtype* weights, Dtype* data_out,
+      int begin, int end) const {
+    const int kernel_dim = group_channels_ * kernel_h_ * kernel_w_;
+    for (int o = begin; o < end; ++o) {
+      const int g = o / group_out_channels_;
+      Dtype* out = data_out + o * height_col_ * width_col_;
+      caffe_set(height_col_ * width_col_, Dtype(0), out);
+      for (int c = 0; c < group_channels_; ++c) {
+        const Dtype* im =
+            data_im + (g * group_channels_ + c) * height_ * width_;
+        const Dtype* filter = weights + o * kernel_dim
+            + c * kernel_h_ * kernel_w_;
+        for (int i = 0; i < kernel_h_; ++i) {
+          for (int j = 0; j < kernel_w_; ++j) {
+            const Dtype weight = filter[i * kernel_w_ + j];
+            int w_begin, w_end;
+            valid_range(width_, pad_w_, stride_w_, j, width_col_,
+                &w_begin, &w_end);
+            for (int h = 0; h < height_col_; ++h) {
+              const int h_pad = h * stride_h_ - pad_h_ + i;
+              if (h_pad < 0 || h_pad >= height_) {
+                continue;
+              }
+              const Dtype* im_row = im + h_pad * width_ - pad_w_ + j;
+              Dtype* out_row = out + h * width_col_;
+              for (int w = w_begin; w < w_end; ++w) {
+                out_row[w] += weight * im_row[w * stride_w_];
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  void data(const Dtype* data_out, const Dtype* weights, Dtype* data_im,
+      bool accumulate, int begin, int end) const {
+    const int kernel_dim = group_channels_ * kernel_h_ * kernel_w_;
+    for (int c_im = begin; c_im < end; ++c_im) {
+      const int g = c_im / group_channels_;
+      const int c = c_im % group_channels_;
+      Dtype* im = data_im + c_im * height_ * width_;
+      if (!accumulate) {
+        caffe_set(height_ * width_, Dtype(0), im);
+      }
+      for (int o = g * group_out_channels_;
+           o < (g + 1) * group_out_channels_; ++o) {
+        const Dtype* out = data_out + o * height_col_ * width_col_;
+        const Dtype* filter = weights + o * kernel_dim
+            + c * kernel_h_ * kernel_w_;
+        for (int i = 0; i < kernel_h_; ++i) {
+          for (int j = 0; j < kernel_w_; ++j) {
+            const Dtype weight = filter[i * kernel_w_ + j];
+            int w_begin, w_end;
+            valid_range(width_, pad_w_, stride_w_, j, width_col_,
+                &w_begin, &w_end);
+            for (int h = 0; h < height_col_; ++h) {
+              const int h_pad = h * stride_h_ - pad_h_ + i;
+              if (h_pad < 0 || h_pad >= height_) {
+                continue;
+              }
+              Dtype* im_row = im + h_pad * width_ - pad_w_ + j;
+              const Dtype* out_row = out + h * width_col_;
+              for (int w = w_begin; w < w_end; ++w) {
+                im_row[w * stride_w_] += weight * out_row[w];
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  void weights(const Dtype* data_im, const Dtype* data_out, Dtype* weights,
+      int begin, int end) const {
+    for (int f = begin; f < end; ++f) {
+      const int o = f / group_channels_;
+      const int g = o / group_out_channels_;
+      const Dtype* im = data_im
+          + (g * group_channels_ + f % group_channels_) * height_ * width_;
+      const Dtype* out = data_out + o * height_col_ * width_col_;
+      Dtype* filter = weights + f * kernel_h_ * kernel_w_;
+      for (int i = 0; i < kernel_h_; ++i) {
+        for (int j = 0; j < kernel_w_; ++j) {
+          int w_begin, w_end;
+          valid_range(width_, pad_w_, stride_w_, j, width_col_,
+              &w_begin, &w_end);
+          Dtype sum = 0;
+          for (int h = 0; h < height_col_; ++h) {
+            const int h_pad = h * stride_h_ - pad_h_ + i;
+            if (h_pad < 0 || h_pad >= height_) {
+              continue;
+            }
+            const Dtype* im_row = im + h_pad * width_ - pad_w_ + j;
+            const Dtype* out_row = out + h * width_col_;
+            for (int w = w_begin; w < w_end; ++w) {
+              sum += out_row[w] * im_row[w * stride_w_];
+            }
+          }
+          filter[i * kernel_w_ + j] += sum;
+        }
+      }
+    }
+  }
+
+ private:
+  int height_, width_;
+  int kernel_h_, kernel_w_;
+  int pad_h_, pad_w_;
+  int stride_h_, stride_w_;
+  int height_col_, width_col_;
+  int group_channels_, group_out_channels_;
+};
+
+template <typename Dtype>
+void grouped_conv_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const Dtype* weights, Dtype* data_out) {
+  GroupedConv<Dtype> conv(channels, height, width, groups, out_channels,
+      kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w);
+  Caffe::thread_pool().run(out_channels, kParallelGrain /
+      (conv.height_col() * conv.width_col() * kernel_h * kernel_w
+       * (channels / groups)),
+      boost::bind(&GroupedConv<Dtype>::forward, &conv, data_im, weights,
+                  data_out, _1, _2));
+}
+
+template <typename Dtype>
+void grouped_conv_data_cpu(const Dtype* data_out, const int channels,
+    const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const Dtype* weights, Dtype* data_im, bool accumulate) {
+  GroupedConv<Dtype> conv(channels, height, width, groups, out_channels,
+      kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w);
+  Caffe::thread_pool().run(channels, kParallelGrain /
+      (conv.height_col() * conv.width_col() * kernel_h * kernel_w
+       * (out_channels / groups)),
+      boost::bind(&GroupedConv<Dtype>::data, &conv, data_out, weights,
+                  data_im, accumulate, _1, _2));
+}
+
+template <typename Dtype>
+void grouped_conv_weights_cpu(const Dtype* data_im, const Dtype* data_out,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* weights) {
+  GroupedConv<Dtype> conv(channels, height, width, groups, out_channels,
+      kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w);
+  Caffe::thread_pool().run(out_channels * (channels / groups),
+      kParallelGrain / (conv.height_col() * conv.width_col()
+                        * kernel_h * kernel_w),
+      boost::bind(&GroupedConv<Dtype>::weights, &conv, data_im, data_out,
+                  weights, _1, _2));
+}
+
+template void grouped_conv_cpu<float>(const float* data_im,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const float* weights, float* data_out);
+template void grouped_conv_cpu<double>(const double* data_im,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const double* weights, double* data_out);
+template void grouped_conv_data_cpu<float>(const float* data_out,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const float* weights, float* data_im, bool accumulate);
+template void grouped_conv_data_cpu<double>(const double* data_out,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const double* weights, double* data_im, bool accumulate);
+template void grouped_conv_weights_cpu<float>(const float* data_im,
+    const float* data_out, const int channels, const int height,
+    const int width, const int groups, const int out_channels,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, float* weights);
+template void grouped_conv_weights_cpu<double>(const double* data_im,
+    const double* data_out, const int channels, const int height,
+    const int width, const int groups, const int out_channels,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, double* weights);
 
 }  // namespace caffe
@@ -8,27 +8,35 @@
 
 namespace caffe {
 
-template <typename Dtype>
+// Kernel and Stride, when not 0, are the size and stride of square kernels
+// known at compile time, for which the loop over the kernel is unrolled
+template <typename Dtype, int Kernel, int Stride>
 __global__ void im2col_gpu_kernel(const int n, const Dtype* data_im,
     const int height, const int width, const int kernel_h, const int kernel_w,
     const int pad_h, const int pad_w,
     const int stride_h, const int stride_w,
     const int height_col, const int width_col,
     Dtype* data_col) {
+  const int kh = Kernel ? Kernel : kernel_h;
+  const int kw = Kernel ? Kernel : kernel_w;
+  const int sh = Stride ? Stride : stride_h;
+  const int sw = Stride ? Stride : stride_w;
   CUDA_KERNEL_LOOP(index, n) {
     int w_out = index % width_col;
     int h_index = index / width_col;
     int h_out = h_index % height_col;
     int channel_in = h_index / height_col;
-    int channel_out = channel_in * kernel_h * kernel_w;
-    int h_in = h_out * stride_h - pad_h;
-    int w_in = w_out * stride_w - pad_w;
+    int channel_out = channel_in * kh * kw;
+    int h_in = h_out * sh - pad_h;
+    int w_in = w_out * sw - pad_w;
     Dtype* data_col_ptr = data_col;
     data_col_ptr += (channel_out * height_col + h_out) * width_col + w_out;
     const Dtype* data_im_ptr = data_im;
     data_im_ptr += (channel_in * height + h_in) * width + w_in;
-    for (int i = 0; i < kernel_h; ++i) {
-      for (int j = 0; j < kernel_w; ++j) {
+#pragma unroll
+    for (int i = 0; i < kh; ++i) {
+#pragma unroll
+      for (int j = 0; j < kw; ++j) {
         int h = h_in + i;
         int w = w_in + j;
         *data_col_ptr = (h >= 0 && w >= 0 && h < height && w < width) ?
@@ -39,6 +47,21 @@ __global__ void im2col_gpu_kernel(const int n, const Dtype* data_im,
   }
 }
 
+template <typename Dtype, int Kernel, int Stride>
+static void im2col_gpu_launch(const int num_kernels, const Dtype* data_im,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w,
+    const int height_col, const int width_col,
+    Dtype* data_col) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  im2col_gpu_kernel<Dtype, Kernel, Stride><<<CAFFE_GET_BLOCKS(num_kernels),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+      num_kernels, data_im, height, width, kernel_h, kernel_w, pad_h,
+      pad_w, stride_h, stride_w, height_col,
+      width_col, data_col);
+}
+
 template <typename Dtype>
 void im2col_gpu(const Dtype* data_im, const int channels,
     const int height, const int width, const int kernel_h, const int kernel_w,
@@ -50,12 +73,26 @@ void im2col_gpu(const Dtype* data_im, const int channels,
   int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
   int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
   int num_kernels = channels * height_col * width_col;
-  // NOLINT_NEXT_LINE(whitespace/operators)
-  im2col_gpu_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_kernels),
-                             CAFFE_CUDA_NUM_THREADS>>>(
-      num_kernels, data_im, height, width, kernel_h, kernel_w, pad_h,
-      pad_w, stride_h, stride_w, height_col,
-      width_col, data_col);
+  // The square 3x3 and 1x1 kernels at a stride of 1 or 2 of most nets are
+  // specialized at compile time
+  const bool square = kernel_h == kernel_w && stride_h == stride_w;
+  if (square && kernel_h == 3 && stride_h == 1) {
+    im2col_gpu_launch<Dtype, 3, 1>(num_kernels, data_im, height, width,
+        kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w, height_col,
+        width_col, data_col);
+  } else if (square && kernel_h == 3 && stride_h == 2) {
+    im2col_gpu_launch<Dtype, 3, 2>(num_kernels, data_im, height, width,
+        kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w, height_col,
+        width_col, data_col);
+  } else if (square && kernel_h == 1 && stride_h == 2) {
+    im2col_gpu_launch<Dtype, 1, 2>(num_kernels, data_im, height, width,
+        kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w, height_col,
+        width_col, data_col);
+  } else {
+    im2col_gpu_launch<Dtype, 0, 0>(num_kernels, data_im, height, width,
+        kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w, height_col,
+        width_col, data_col);
+  }
   CUDA_POST_KERNEL_CHECK;
 }
 
@@ -77,7 +114,7 @@ __global__ void col2im_gpu_kernel(const int n, const Dtype* data_col,
     const int pad_h, const int pad_w,
     const int stride_h, const int stride_w,
     const int height_col, const int width_col,
-    Dtype* data_im) {
+    const bool accumulate, Dtype* data_im) {
   CUDA_KERNEL_LOOP(index, n) {
     Dtype val = 0;
     int w = index % width + pad_w;
@@ -108,7 +145,7 @@ __global__ void col2im_gpu_kernel(const int n, const Dtype* data_col,
         val += data_col[offset + h_col * coeff_h_col + w_col * coeff_w_col];
       }
     }
-    data_im[index] = val;
+    data_im[index] = accumulate ? data_im[index] + val : val;
   }
 }
 
@@ -116,7 +153,7 @@ template <typename Dtype>
 void col2im_gpu(const Dtype* data_col, const int channels,
     const int height, const int width, const int patch_h, const int patch_w,
     const int pad_h, const int pad_w, const int stride_h,
-    const int stride_w, Dtype* data_im) {
+    const int stride_w, Dtype* data_im, bool accumulate) {
   int height_col = (height + 2 * pad_h - patch_h) / stride_h + 1;
   int width_col = (width + 2 * pad_w - patch_w) / stride_w + 1;
   int num_kernels = channels * height * width;
@@ -124,10 +161,10 @@ void col2im_gpu(const Dtype* data_col, const int channels,
   // bottom dimension, and then in the kernel add up the top dimensions.
   // NOLINT_NEXT_LINE(whitespace/operators)
   col2im_gpu_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_kernels),
-                             CAFFE_CUDA_NUM_THREADS>>>(
+                             CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
       num_kernels, data_col, height, width, channels, patch_h, patch_w,
       pad_h, pad_w, stride_h, stride_w,
-      height_col, width_col, data_im);
+      height_col, width_col, accumulate, data_im);
   CUDA_POST_KERNEL_CHECK;
 }
 
@@ -135,10 +172,312 @@ void col2im_gpu(const Dtype* data_col, const int channels,
 template void col2im_gpu<float>(const float* data_col, const int channels,
     const int height, const int width, const int patch_h, const int patch_w,
     const int pad_h, const int pad_w, const int stride_h,
-    const int stride_w, float* data_im);
+    const int stride_w, float* data_im, bool accumulate);
 template void col2im_gpu<double>(const double* data_col, const int channels,
     const int height, const int width, const int patch_h, const int patch_w,
     const int pad_h, const int pad_w, const int stride_h,
-    const int stride_w, double* data_im);
+    const int stride_w, double* data_im, bool accumulate);
+
+// A thread per value of the NHWC column matrix, consecutive threads copying
+// the consecutive channels of a pixel
+template <typename Dtype>
+__global__ void im2col_nhwc_gpu_kernel(const int n, const Dtype* data_im,
+    const int channels, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int width_col,
+    Dtype* data_col) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int c = index % channels;
+    const int j = (index / channels) % kernel_w;
+    const int i = (index / channels / kernel_w) % kernel_h;
+    const int col = index / channels / kernel_w / kernel_h;
+    const int h = (col / width_col) * stride_h - pad_h + i;
+    const int w = (col % width_col) * stride_w - pad_w + j;
+    data_col[index] = (h >= 0 && h < height && w >= 0 && w < width) ?
+        data_im[(h * width + w) * channels + c] : 0;
+  }
+}
+
+template <typename Dtype>
+void im2col_nhwc_gpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_col) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  int num_kernels = height_col * width_col * kernel_h * kernel_w * channels;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  im2col_nhwc_gpu_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_kernels),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+      num_kernels, data_im, channels, height, width, kernel_h, kernel_w,
+      pad_h, pad_w, stride_h, stride_w, width_col, data_col);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void im2col_nhwc_gpu<float>(const float* data_im,
+    const int channels, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, float* data_col);
+template void im2col_nhwc_gpu<double>(const double* data_im,
+    const int channels, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, double* data_col);
+
+// A thread per value of the NHWC image, adding up the columns of the
+// windows over it as col2im_gpu_kernel does
+template <typename Dtype>
+__global__ void col2im_nhwc_gpu_kernel(const int n, const Dtype* data_col,
+    const int channels, const int height, const int width,
+    const int patch_h, const int patch_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_col,
+    const int width_col, const bool accumulate, Dtype* data_im) {
+  CUDA_KERNEL_LOOP(index, n) {
+    Dtype val = 0;
+    const int c = index % channels;
+    const int w = (index / channels) % width + pad_w;
+    const int h = index / channels / width + pad_h;
+    const int w_col_start = (w < patch_w) ? 0 : (w - patch_w) / stride_w + 1;
+    const int w_col_end = min(w / stride_w + 1, width_col);
+    const int h_col_start = (h < patch_h) ? 0 : (h - patch_h) / stride_h + 1;
+    const int h_col_end = min(h / stride_h + 1, height_col);
+    for (int h_col = h_col_start; h_col < h_col_end; ++h_col) {
+      for (int w_col = w_col_start; w_col < w_col_end; ++w_col) {
+        const int i = h - h_col * stride_h;
+        const int j = w - w_col * stride_w;
+        val += data_col[(((h_col * width_col + w_col) * patch_h + i)
+            * patch_w + j) * channels + c];
+      }
+    }
+    data_im[index] = accumulate ? data_im[index] + val : val;
+  }
+}
+
+template <typename Dtype>
+void col2im_nhwc_gpu(const Dtype* data_col, const int channels,
+    const int height, const int width, const int patch_h, const int patch_w,
+    const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, Dtype* data_im, bool accumulate) {
+  int height_col = (height + 2 * pad_h - patch_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - patch_w) / stride_w + 1;
+  int num_kernels = height * width * channels;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  col2im_nhwc_gpu_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_kernels),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+      num_kernels, data_col, channels, height, width, patch_h, patch_w,
+      pad_h, pad_w, stride_h, stride_w, height_col, width_col, accumulate,
+      data_im);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void col2im_nhwc_gpu<float>(const float* data_col,
+    const int channels, const int height, const int width, const int patch_h,
+    const int patch_w, const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, float* data_im, bool accumulate);
+template void col2im_nhwc_gpu<double>(const double* data_col,
+    const int channels, const int height, const int width, const int patch_h,
+    const int patch_w, const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, double* data_im, bool accumulate);
+
+// A thread per output of grouped_conv_gpu, summing its window over the
+// channels of its group
+template <typename Dtype>
+__global__ void grouped_conv_gpu_kernel(const int n, const Dtype* data_im,
+    const int height, const int width, const int group_channels,
+    const int group_out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_col, const int width_col, const Dtype* weights,
+    Dtype* data_out) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int w_col = index % width_col;
+    const int h_col = (index / width_col) % height_col;
+    const int o = index / width_col / height_col;
+    const int g = o / group_out_channels;
+    const Dtype* filter = weights + o * group_channels * kernel_h * kernel_w;
+    Dtype val = 0;
+    for (int c = 0; c < group_channels; ++c) {
+      const Dtype* im = data_im + (g * group_channels + c) * height * width;
+      for (int i = 0; i < kernel_h; ++i) {
+        const int h = h_col * stride_h - pad_h + i;
+        if (h < 0 || h >= height) {
+          continue;
+        }
+        for (int j = 0; j < kernel_w; ++j) {
+          const int w = w_col * stride_w - pad_w + j;
+          if (w >= 0 && w < width) {
+            val += filter[(c * kernel_h + i) * kernel_w + j]
+                * im[h * width + w];
+          }
+        }
+      }
+    }
+    data_out[index] = val;
+  }
+}
+
+template <typename Dtype>
+void grouped_conv_gpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const Dtype* weights, Dtype* data_out) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  int num_kernels = out_channels * height_col * width_col;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  grouped_conv_gpu_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_kernels),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+      num_kernels, data_im, height, width, channels / groups,
+      out_channels / groups, kernel_h, kernel_w, pad_h, pad_w, stride_h,
+      stride_w, height_col, width_col, weights, data_out);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void grouped_conv_gpu<float>(const float* data_im,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const float* weights, float* data_out);
+template void grouped_conv_gpu<double>(const double* data_im,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const double* weights, double* data_out);
+
+// A thread per value of the image, adding up the outputs of its group whose
+// windows cover it as col2im_gpu_kernel does
+template <typename Dtype>
+__global__ void grouped_conv_data_gpu_kernel(const int n,
+    const Dtype* data_out, const int height, const int width,
+    const int group_channels, const int group_out_channels,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_col,
+    const int width_col, const Dtype* weights, const bool accumulate,
+    Dtype* data_im) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int w = index % width + pad_w;
+    const int h = (index / width) % height + pad_h;
+    const int c_im = index / width / height;
+    const int g = c_im / group_channels;
+    const int c = c_im % group_channels;
+    const int w_col_start = (w < kernel_w) ? 0 : (w - kernel_w) / stride_w + 1;
+    const int w_col_end = min(w / stride_w + 1, width_col);
+    const int h_col_start = (h < kernel_h) ? 0 : (h - kernel_h) / stride_h + 1;
+    const int h_col_end = min(h / stride_h + 1, height_col);
+    Dtype val = 0;
+    for (int o = g * group_out_channels; o < (g + 1) * group_out_channels;
+         ++o) {
+      const Dtype* out = data_out + o * height_col * width_col;
+      const Dtype* filter = weights
+          + (o * group_channels + c) * kernel_h * kernel_w;
+      for (int h_col = h_col_start; h_col < h_col_end; ++h_col) {
+        for (int w_col = w_col_start; w_col < w_col_end; ++w_col) {
+          const int i = h - h_col * stride_h;
+          const int j = w - w_col * stride_w;
+          val += filter[i * kernel_w + j] * out[h_col * width_col + w_col];
+        }
+      }
+    }
+    data_im[index] = accumulate ? data_im[index] + val : val;
+  }
+}
+
+template <typename Dtype>
+void grouped_conv_data_gpu(const Dtype* data_out, const int channels,
+    const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const Dtype* weights, Dtype* data_im, bool accumulate) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  int num_kernels = channels * height * width;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  grouped_conv_data_gpu_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_kernels),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+      num_kernels, data_out, height, width, channels / groups,
+      out_channels / groups, kernel_h, kernel_w, pad_h, pad_w, stride_h,
+      stride_w, height_col, width_col, weights, accumulate, data_im);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void grouped_conv_data_gpu<float>(const float* data_out,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const float* weights, float* data_im, bool accumulate);
+template void grouped_conv_data_gpu<double>(const double* data_out,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const double* weights, double* data_im, bool accumulate);
+
+// A block per weight, its threads summing the products of the outputs with
+// the image under them over strided positions, then reducing the sums in
+// shared memory. A single block writes each weight, which needs no atomics.
+template <typename Dtype>
+__global__ void grouped_conv_weights_gpu_kernel(const Dtype* data_im,
+    const Dtype* data_out, const int height, const int width,
+    const int group_channels, const int group_out_channels,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_col,
+    const int width_col, Dtype* weights) {
+  __shared__ Dtype sums[CAFFE_CUDA_NUM_THREADS];
+  const int index = blockIdx.x;
+  const int j = index % kernel_w;
+  const int i = (index / kernel_w) % kernel_h;
+  const int f = index / kernel_w / kernel_h;
+  const int o = f / group_channels;
+  const int g = o / group_out_channels;
+  const Dtype* im = data_im
+      + (g * group_channels + f % group_channels) * height * width;
+  const Dtype* out = data_out + o * height_col * width_col;
+  Dtype sum = 0;
+  for (int p = threadIdx.x; p < height_col * width_col; p += blockDim.x) {
+    const int h = (p / width_col) * stride_h - pad_h + i;
+    const int w = (p % width_col) * stride_w - pad_w + j;
+    if (h >= 0 && h < height && w >= 0 && w < width) {
+      sum += out[p] * im[h * width + w];
+    }
+  }
+  sums[threadIdx.x] = sum;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      sums[threadIdx.x] += sums[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    weights[index] += sums[0];
+  }
+}
+
+template <typename Dtype>
+void grouped_conv_weights_gpu(const Dtype* data_im, const Dtype* data_out,
+    const int channels, const int height, const int width, const int groups,
+    const int out_channels, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* weights) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  int num_weights = out_channels * (channels / groups) * kernel_h * kernel_w;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  grouped_conv_weights_gpu_kernel<Dtype><<<num_weights,
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(
+      data_im, data_out, height, width, channels / groups,
+      out_channels / groups, kernel_h, kernel_w, pad_h, pad_w, stride_h,
+      stride_w, height_col, width_col, weights);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void grouped_conv_weights_gpu<float>(const float* data_im,
+    const float* data_out, const int channels, const int height,
+    const int width, const int groups, const int out_channels,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, float* weights);
+template void grouped_conv_weights_gpu<double>(const double* data_im,
+    const double* data_out, const int channels, const int height,
+    const int width, const int groups, const int out_channels,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, double* weights);
 
 }  // namespace caffe
@@ -0,0 +1,139 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "caffe/util/image_list.hpp"
+
+namespace caffe {
+
+// An index starts with a magic number, a version, flags and the numbers of
+// images and of bytes of names, followed by the offsets, the labels, the
+// sizes if flagged, then the names. Tables are in the byte order of the
+// machine, so that they are used in place.
+const uint32_t kImageListMagic = 0x5453494c;  // "LIST"
+const uint32_t kImageListVersion = 1;
+const uint32_t kSizesFlag = 1;
+const size_t kImageListHeader = 32;
+
+ImageList::ImageList()
+    : size_(0), offsets_(NULL), labels_(NULL), sizes_(NULL), names_(NULL),
+      map_(NULL), map_size_(0) {
+}
+
+bool ImageList::IsIndex(const string& path) {
+  std::ifstream file(path.c_str(), std::ios::binary);
+  uint32_t magic = 0;
+  file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+  return file && magic == kImageListMagic;
+}
+
+void ImageList::Open(const string& source, bool sizes) {
+  Close();
+  if (IsIndex(source)) {
+    Map(source);
+  } else {
+    Parse(source, sizes);
+  }
+}
+
+void ImageList::Parse(const string& source, bool sizes) {
+  std::ifstream infile(source.c_str());
+  CHECK(infile) << "Cannot open " << source;
+  string filename;
+  int label, height, width;
+  offsets_data_.push_back(0);
+  while (infile >> filename >> label) {
+    if (sizes) {
+      if (!(infile >> height >> width)) {
+        break;
+      }
+      sizes_data_.push_back(height);
+      sizes_data_.push_back(width);
+    }
+    names_data_ += filename;
+    offsets_data_.push_back(names_data_.size());
+    labels_data_.push_back(label);
+  }
+  size_ = labels_data_.size();
+  offsets_ = &offsets_data_[0];
+  labels_ = size_ ? &labels_data_[0] : NULL;
+  sizes_ = sizes && size_ ? &sizes_data_[0] : NULL;
+  names_ = names_data_.data();
+}
+
+void ImageList::Map(const string& source) {
+  const int fd = open(source.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0) << "Cannot open " << source << ": " << strerror(errno);
+  struct stat st;
+  CHECK_EQ(fstat(fd, &st), 0) << strerror(errno);
+  map_size_ = st.st_size;
+  CHECK_GE(map_size_, kImageListHeader) << "Truncated index " << source;
+  void* map = mmap(NULL, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  CHECK(map != MAP_FAILED) << "Cannot map " << source << ": "
+      << strerror(errno);
+  map_ = static_cast<char*>(map);
+  const uint32_t* header = reinterpret_cast<const uint32_t*>(map_);
+  CHECK_EQ(header[1], kImageListVersion)
+      << "Unknown version of the image index " << source;
+  const bool sizes = header[2] & kSizesFlag;
+  size_ = *reinterpret_cast<const uint64_t*>(map_ + 16);
+  const uint64_t names_size = *reinterpret_cast<const uint64_t*>(map_ + 24);
+  char* table = map_ + kImageListHeader;
+  offsets_ = reinterpret_cast<const uint64_t*>(table);
+  table += (size_ + 1) * sizeof(uint64_t);
+  labels_ = reinterpret_cast<const int32_t*>(table);
+  table += size_ * sizeof(int32_t);
+  sizes_ = sizes ? reinterpret_cast<const uint32_t*>(table) : NULL;
+  table += sizes ? 2 * size_ * sizeof(uint32_t) : 0;
+  names_ = table;
+  CHECK_EQ(table + names_size, map_ + map_size_)
+      << "Truncated index " << source;
+  LOG(INFO) << "Mapped the index " << source << " of " << size_ << " images";
+}
+
+void ImageList::Close() {
+  if (map_) {
+    munmap(map_, map_size_);
+  }
+  map_ = NULL;
+  map_size_ = 0;
+  size_ = 0;
+  offsets_ = NULL;
+  labels_ = NULL;
+  sizes_ = NULL;
+  names_ = NULL;
+  offsets_data_.clear();
+  labels_data_.clear();
+  sizes_data_.clear();
+  names_data_.clear();
+}
+
+void ImageList::Write(const string& path) const {
+  std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+  CHECK(file) << "Cannot open " << path;
+  uint32_t header[kImageListHeader / sizeof(uint32_t)] = {
+    kImageListMagic, kImageListVersion, has_sizes() ? kSizesFlag : 0, 0
+  };
+  const uint64_t counts[2] = { size_, offsets_[size_] };
+  memcpy(header + 4, counts, sizeof(counts));
+  file.write(reinterpret_cast<const char*>(header), kImageListHeader);
+  file.write(reinterpret_cast<const char*>(offsets_),
+             (size_ + 1) * sizeof(uint64_t));
+  file.write(reinterpret_cast<const char*>(labels_), size_ * sizeof(int32_t));
+  if (has_sizes()) {
+    file.write(reinterpret_cast<const char*>(sizes_),
+               2 * size_ * sizeof(uint32_t));
+  }
+  file.write(names_, offsets_[size_]);
+  CHECK(file) << "Cannot write " << path;
+}
+
+}  // namespace caffe
@@ -1,5 +1,8 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <fcntl.h>
 #include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/gzip_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/text_format.h>
 #include <opencv2/core/core.hpp>
@@ -7,9 +10,13 @@
 #include <opencv2/highgui/highgui_c.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <algorithm>
+#include <cstring>
 #include <fstream>  // NOLINT(readability/streams)
+#include <iterator>
 #include <string>
 #include <vector>
 
@@ -27,6 +34,8 @@ using google::protobuf::io::ZeroCopyInputStream;
 using google::protobuf::io::CodedInputStream;
 using google::protobuf::io::ZeroCopyOutputStream;
 using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::GzipInputStream;
+using google::protobuf::io::GzipOutputStream;
 using google::protobuf::Message;
 
 bool ReadProtoFromTextFile(const char* filename, Message* proto) {
@@ -67,6 +76,98 @@ void WriteProtoToBinaryFile(const Message& proto, const char* filename) {
   CHECK(proto.SerializeToOstream(&output));
 }
 
+vector<int> ShardBounds(const vector<size_t>& sizes, int shards) {
+  CHECK_GE(shards, 1);
+  size_t total = 0;
+  for (int i = 0; i < sizes.size(); ++i) {
+    total += sizes[i];
+  }
+  vector<int> bounds(1, 0);
+  size_t sum = 0;
+  for (int i = 0, k = 1; k < shards; ++k) {
+    // The first item past the k-th fraction of the total
+    const double target = static_cast<double>(total) * k / shards;
+    while (i < sizes.size() && sum + sizes[i] / 2.0 < target) {
+      sum += sizes[i++];
+    }
+    bounds.push_back(i);
+  }
+  bounds.push_back(sizes.size());
+  return bounds;
+}
+
+string ShardFilename(const string& filename, int shard, bool compressed) {
+  ostringstream name;
+  name << filename.substr(filename.find_last_of('/') + 1) << ".shard" << shard
+       << (compressed ? ".gz" : "");
+  return name.str();
+}
+
+string ShardPath(const string& filename, const string& shard) {
+  return filename.substr(0, filename.find_last_of('/') + 1) + shard;
+}
+
+static bool IsGzipFilename(const string& filename) {
+  return filename.size() >= 3 &&
+      filename.compare(filename.size() - 3, 3, ".gz") == 0;
+}
+
+static void WriteProtoToShard(const Message* proto, const string& filename) {
+  const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK_NE(fd, -1) << "Cannot write " << filename;
+  FileOutputStream raw_output(fd);
+  if (IsGzipFilename(filename)) {
+    GzipOutputStream::Options options;
+    options.format = GzipOutputStream::GZIP;
+    GzipOutputStream gzip_output(&raw_output, options);
+    CHECK(proto->SerializeToZeroCopyStream(&gzip_output))
+        << "Error writing " << filename;
+    CHECK(gzip_output.Close()) << "Error writing " << filename;
+  } else {
+    CHECK(proto->SerializeToZeroCopyStream(&raw_output))
+        << "Error writing " << filename;
+  }
+  CHECK(raw_output.Close()) << "Error writing " << filename;
+}
+
+static void ReadProtoFromShard(const string& filename, Message* proto) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  CHECK_NE(fd, -1) << "File not found: " << filename;
+  FileInputStream raw_input(fd);
+  shared_ptr<GzipInputStream> gzip_input;
+  if (IsGzipFilename(filename)) {
+    gzip_input.reset(new GzipInputStream(&raw_input));
+  }
+  CodedInputStream coded_input(gzip_input
+      ? static_cast<ZeroCopyInputStream*>(gzip_input.get()) : &raw_input);
+  coded_input.SetTotalBytesLimit(kProtoReadBytesLimit, 536870912);
+  CHECK(proto->ParseFromCodedStream(&coded_input))
+      << "Cannot parse " << filename;
+  close(fd);
+}
+
+void WriteProtosToBinaryFiles(const vector<const Message*>& protos,
+    const vector<string>& filenames) {
+  CHECK_EQ(protos.size(), filenames.size());
+  boost::thread_group threads;
+  for (int i = 0; i < protos.size(); ++i) {
+    threads.create_thread(boost::bind(&WriteProtoToShard, protos[i],
+        filenames[i]));
+  }
+  threads.join_all();
+}
+
+void ReadProtosFromBinaryFilesOrDie(const vector<string>& filenames,
+    const vector<Message*>& protos) {
+  CHECK_EQ(protos.size(), filenames.size());
+  boost::thread_group threads;
+  for (int i = 0; i < protos.size(); ++i) {
+    threads.create_thread(boost::bind(&ReadProtoFromShard, filenames[i],
+        protos[i]));
+  }
+  threads.join_all();
+}
+
 cv::Mat ReadImageToCVMat(const string& filename,
     const int height, const int width, const bool is_color) {
   cv::Mat cv_img;
@@ -85,6 +186,82 @@ cv::Mat ReadImageToCVMat(const string& filename,
   return cv_img;
 }
 
+// OpenCV decodes JPEGs at reduced sizes since 3.1
+#if !defined(CV_VERSION_EPOCH) && defined(CV_VERSION_MAJOR) && \
+    (CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 1))
+#define REDUCED_DECODE
+#endif
+
+#ifdef REDUCED_DECODE
+// Reads the size of a JPEG from its frame header, false if not a JPEG
+static bool jpeg_size(const string& buffer, int* height, int* width) {
+  const unsigned char* data =
+      reinterpret_cast<const unsigned char*>(buffer.data());
+  const size_t size = buffer.size();
+  if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    return false;
+  }
+  size_t pos = 2;
+  while (pos + 9 <= size) {
+    if (data[pos] != 0xFF) {
+      return false;
+    }
+    const unsigned char marker = data[pos + 1];
+    const size_t length = (data[pos + 2] << 8) | data[pos + 3];
+    // Start of frame markers, except DHT, JPG and DAC
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC) {
+      *height = (data[pos + 5] << 8) | data[pos + 6];
+      *width = (data[pos + 7] << 8) | data[pos + 8];
+      return true;
+    }
+    pos += 2 + length;
+  }
+  return false;
+}
+#endif
+
+cv::Mat ReadImageToCVMat(const string& filename,
+    const int height, const int width, const bool is_color,
+    const bool reduced_decode) {
+#ifdef REDUCED_DECODE
+  if (reduced_decode && height > 0 && width > 0) {
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+    const string buffer((std::istreambuf_iterator<char>(file)),
+                        std::istreambuf_iterator<char>());
+    int jpeg_height, jpeg_width;
+    if (jpeg_size(buffer, &jpeg_height, &jpeg_width)) {
+      int factor = 8;
+      while (factor > 1 && (jpeg_height / factor < height ||
+                            jpeg_width / factor < width)) {
+        factor /= 2;
+      }
+      int flag = is_color ? cv::IMREAD_COLOR : cv::IMREAD_GRAYSCALE;
+      if (factor == 2) {
+        flag = is_color ? cv::IMREAD_REDUCED_COLOR_2 :
+            cv::IMREAD_REDUCED_GRAYSCALE_2;
+      } else if (factor == 4) {
+        flag = is_color ? cv::IMREAD_REDUCED_COLOR_4 :
+            cv::IMREAD_REDUCED_GRAYSCALE_4;
+      } else if (factor == 8) {
+        flag = is_color ? cv::IMREAD_REDUCED_COLOR_8 :
+            cv::IMREAD_REDUCED_GRAYSCALE_8;
+      }
+      std::vector<char> data(buffer.begin(), buffer.end());
+      cv::Mat cv_img_origin = cv::imdecode(data, flag);
+      if (!cv_img_origin.data) {
+        LOG(ERROR) << "Could not decode file " << filename;
+        return cv_img_origin;
+      }
+      cv::Mat cv_img;
+      cv::resize(cv_img_origin, cv_img, cv::Size(width, height));
+      return cv_img;
+    }
+  }
+#endif
+  return ReadImageToCVMat(filename, height, width, is_color);
+}
+
 cv::Mat ReadImageToCVMat(const string& filename,
     const int height, const int width) {
   return ReadImageToCVMat(filename, height, width, true);
@@ -156,28 +333,29 @@ bool ReadFileToDatum(const string& filename, const int label,
   }
 }
 
-cv::Mat DecodeDatumToCVMatNative(const Datum& datum) {
-  cv::Mat cv_img;
+bool DecodeDatumToCVMat(const Datum& datum, int channels, cv::Mat* cv_img) {
   CHECK(datum.encoded()) << "Datum not encoded";
   const string& data = datum.data();
-  std::vector<char> vec_data(data.c_str(), data.c_str() + data.size());
-  cv_img = cv::imdecode(vec_data, -1);
-  if (!cv_img.data) {
+  // A header over the bytes of the datum
+  const cv::Mat buffer(1, data.size(), CV_8UC1,
+                       const_cast<char*>(data.data()));
+  const int cv_read_flag = channels == 3 ? CV_LOAD_IMAGE_COLOR :
+      channels == 1 ? CV_LOAD_IMAGE_GRAYSCALE : -1;
+  *cv_img = cv::imdecode(buffer, cv_read_flag);
+  if (!cv_img->data) {
     LOG(ERROR) << "Could not decode datum ";
+    return false;
   }
+  return true;
+}
+cv::Mat DecodeDatumToCVMatNative(const Datum& datum) {
+  cv::Mat cv_img;
+  DecodeDatumToCVMat(datum, 0, &cv_img);
   return cv_img;
 }
 cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color) {
   cv::Mat cv_img;
-  CHECK(datum.encoded()) << "Datum not encoded";
-  const string& data = datum.data();
-  std::vector<char> vec_data(data.c_str(), data.c_str() + data.size());
-  int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
-    CV_LOAD_IMAGE_GRAYSCALE);
-  cv_img = cv::imdecode(vec_data, cv_read_flag);
-  if (!cv_img.data) {
-    LOG(ERROR) << "Could not decode datum ";
-  }
+  DecodeDatumToCVMat(datum, is_color ? 3 : 1, &cv_img);
   return cv_img;
 }
 
@@ -214,7 +392,9 @@ void CVMatToDatum(const cv::Mat& cv_img, Datum* datum) {
   int datum_height = datum->height();
   int datum_width = datum->width();
   int datum_size = datum_channels * datum_height * datum_width;
-  std::string buffer(datum_size, ' ');
+  // Filled in place, keeping the capacity of a recycled datum
+  string& buffer = *datum->mutable_data();
+  buffer.resize(datum_size);
   for (int h = 0; h < datum_height; ++h) {
     const uchar* ptr = cv_img.ptr<uchar>(h);
     int img_index = 0;
@@ -225,8 +405,163 @@ void CVMatToDatum(const cv::Mat& cv_img, Datum* datum) {
       }
     }
   }
-  datum->set_data(buffer);
 }
 
+// The first byte of a serialized Datum is a field tag, and 0xff is not a
+// valid one.
+static const char kRawRecordMagic[4] = { '\xff', 'R', 'A', 'W' };
+
+enum RawRecordType { RAW_UINT8 = 0, RAW_FLOAT32 = 1 };
+
+struct RawRecordHeader {
+  char magic[4];
+  uint32_t type;
+  uint32_t encoded;
+  int32_t channels;
+  int32_t height;
+  int32_t width;
+  int32_t label;
+  uint32_t payload_size;  // In bytes
+};
+
+void DatumToRawRecord(const Datum& datum, string* record) {
+  RawRecordHeader header;
+  std::copy(kRawRecordMagic, kRawRecordMagic + sizeof(kRawRecordMagic),
+            header.magic);
+  const bool floats = datum.float_data_size() > 0;
+  header.type = floats ? RAW_FLOAT32 : RAW_UINT8;
+  header.encoded = datum.encoded();
+  header.channels = datum.channels();
+  header.height = datum.height();
+  header.width = datum.width();
+  header.label = datum.label();
+  header.payload_size = floats ?
+      datum.float_data_size() * sizeof(float) : datum.data().size();
+  record->resize(sizeof(header) + header.payload_size);
+  const char* header_bytes = reinterpret_cast<const char*>(&header);
+  std::copy(header_bytes, header_bytes + sizeof(header), record->begin());
+  const char* payload = floats ?
+      reinterpret_cast<const char*>(datum.float_data().data()) :
+      datum.data().data();
+  std::copy(payload, payload + header.payload_size,
+            record->begin() + sizeof(header));
+}
+
+bool IsRawRecord(const char* data, size_t size) {
+  return size >= sizeof(RawRecordHeader)
+      && memcmp(data, kRawRecordMagic, sizeof(kRawRecordMagic)) == 0;
+}
+
+bool ParseDatum(const char* data, size_t size, Datum* datum) {
+  if (!IsRawRecord(data, size)) {
+    return datum->ParseFromArray(data, size);
+  }
+  RawRecordHeader header;
+  std::copy(data, data + sizeof(header), reinterpret_cast<char*>(&header));
+  if (size != sizeof(header) + header.payload_size) {
+    return false;
+  }
+  const char* payload = data + sizeof(header);
+  datum->Clear();
+  datum->set_channels(header.channels);
+  datum->set_height(header.height);
+  datum->set_width(header.width);
+  datum->set_label(header.label);
+  datum->set_encoded(header.encoded);
+  if (header.type == RAW_FLOAT32) {
+    const int count = header.payload_size / sizeof(float);
+    datum->mutable_float_data()->Resize(count, 0);
+    std::copy(payload, payload + count * sizeof(float), reinterpret_cast<char*>(
+        datum->mutable_float_data()->mutable_data()));
+  } else if (header.type == RAW_UINT8) {
+    datum->set_data(payload, header.payload_size);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char kMappedWeightsMagic[8] = {'C', 'A', 'F', 'F', 'E', 'M', 'A', 'P'};
+
+// The shape of a blob, from the legacy dimensions if it has none
+static BlobShape ProtoShape(const BlobProto& proto) {
+  if (proto.has_shape()) {
+    return proto.shape();
+  }
+  BlobShape shape;
+  if (proto.has_num() || proto.has_channels() || proto.has_height() ||
+      proto.has_width()) {
+    shape.add_dim(proto.num());
+    shape.add_dim(proto.channels());
+    shape.add_dim(proto.height());
+    shape.add_dim(proto.width());
+  }
+  return shape;
+}
+
+static void WritePadding(size_t* offset, std::ostream* output) {
+  const size_t padding = (kMappedWeightsAlignment
+      - *offset % kMappedWeightsAlignment) % kMappedWeightsAlignment;
+  const string zeros(padding, 0);
+  output->write(zeros.data(), padding);
+  *offset += padding;
+}
+
+void WriteMappedWeights(const NetParameter& trained, const string& filename) {
+  NetParameter index;
+  for (int i = 0; i < trained.layer_size(); ++i) {
+    const LayerParameter& layer = trained.layer(i);
+    if (layer.blobs_size() == 0) {
+      continue;
+    }
+    LayerParameter* entry = index.add_layer();
+    entry->set_name(layer.name());
+    for (int j = 0; j < layer.blobs_size(); ++j) {
+      entry->add_blobs()->mutable_shape()->CopyFrom(
+          ProtoShape(layer.blobs(j)));
+    }
+  }
+  string header;
+  CHECK(index.SerializeToString(&header));
+  const uint64_t header_size = header.size();
+  std::ofstream output(filename.c_str(), ios::out | ios::trunc | ios::binary);
+  CHECK(output) << "Cannot write " << filename;
+  output.write(kMappedWeightsMagic, sizeof(kMappedWeightsMagic));
+  output.write(reinterpret_cast<const char*>(&header_size),
+      sizeof(header_size));
+  output.write(header.data(), header.size());
+  size_t offset = sizeof(kMappedWeightsMagic) + sizeof(header_size)
+      + header.size();
+  // Blob::FromProto reads every encoding of the values, e.g. int8 ones.
+  for (int i = 0; i < trained.layer_size(); ++i) {
+    const LayerParameter& layer = trained.layer(i);
+    for (int j = 0; j < layer.blobs_size(); ++j) {
+      WritePadding(&offset, &output);
+      Blob<float> blob;
+      blob.FromProto(layer.blobs(j));
+      const size_t bytes = blob.count() * sizeof(float);
+      output.write(reinterpret_cast<const char*>(blob.cpu_data()), bytes);
+      offset += bytes;
+    }
+  }
+  CHECK(output) << "Error writing " << filename;
+}
+
+MappedFile::MappedFile(const string& filename) : data_(), size_() {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  CHECK_NE(fd, -1) << "File not found: " << filename;
+  struct stat st;
+  CHECK_EQ(fstat(fd, &st), 0) << "Cannot stat " << filename;
+  size_ = st.st_size;
+  CHECK_GT(size_, 0) << "Empty file " << filename;
+  void* data = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  CHECK(data != MAP_FAILED) << "Cannot map " << filename;
+  data_ = static_cast<char*>(data);
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  munmap(data_, size_);
+}
 
 }  // namespace caffe
@@ -1,11 +1,17 @@
+#include <boost/bind.hpp>
 #include <boost/math/special_functions/next.hpp>
 #include <boost/random.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
 
 #include "caffe/common.hpp"
+#include "caffe/util/approx_math.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/philox.hpp"
 #include "caffe/util/rng.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 namespace caffe {
 
@@ -87,8 +93,10 @@ void caffe_copy(const int N, const Dtype* X, Dtype* Y) {
   if (X != Y) {
     if (Caffe::mode() == Caffe::GPU) {
 #ifndef CPU_ONLY
-      // NOLINT_NEXT_LINE(caffe/alt_fn)
-      CUDA_CHECK(cudaMemcpy(Y, X, sizeof(Dtype) * N, cudaMemcpyDefault));
+      const cudaStream_t stream = Caffe::cuda_stream();
+      CUDA_CHECK(cudaMemcpyAsync(Y, X, sizeof(Dtype) * N, cudaMemcpyDefault,
+                                 stream));
+      CUDA_CHECK(cudaStreamSynchronize(stream));
 #else
       NO_GPU;
 #endif
@@ -126,110 +134,190 @@ void caffe_cpu_axpby<double>(const int N, const double alpha, const double* X,
   cblas_daxpby(N, alpha, X, 1, beta, Y, 1);
 }
 
+// Call the vector function f of MKL, which vectorizes and threads large
+// vectors itself, or of mkl_alternate.hpp, whose plain loops are then spread
+// on the thread pool in chunks of at least kParallelGrain elements
+template <typename Dtype, typename Function>
+static void vector_unary_range(Function f, const Dtype* a, Dtype* y,
+    int begin, int end) {
+  f(end - begin, a + begin, y + begin);
+}
+
+template <typename Dtype, typename Function>
+static inline void vector_unary(Function f, const int n, const Dtype* a,
+    Dtype* y) {
+#ifdef USE_MKL
+  f(n, a, y);
+#else
+  Caffe::thread_pool().run(n, kParallelGrain,
+      boost::bind(&vector_unary_range<Dtype, Function>, f, a, y, _1, _2));
+#endif
+}
+
+template <typename Dtype, typename Param, typename Function>
+static void vector_param_range(Function f, const Dtype* a, const Param b,
+    Dtype* y, int begin, int end) {
+  f(end - begin, a + begin, b, y + begin);
+}
+
+template <typename Dtype, typename Param, typename Function>
+static inline void vector_param(Function f, const int n, const Dtype* a,
+    const Param b, Dtype* y) {
+#ifdef USE_MKL
+  f(n, a, b, y);
+#else
+  Caffe::thread_pool().run(n, kParallelGrain,
+      boost::bind(&vector_param_range<Dtype, Param, Function>, f, a, b, y,
+                  _1, _2));
+#endif
+}
+
+template <typename Dtype, typename Function>
+static void vector_binary_range(Function f, const Dtype* a, const Dtype* b,
+    Dtype* y, int begin, int end) {
+  f(end - begin, a + begin, b + begin, y + begin);
+}
+
+template <typename Dtype, typename Function>
+static inline void vector_binary(Function f, const int n, const Dtype* a,
+    const Dtype* b, Dtype* y) {
+#ifdef USE_MKL
+  f(n, a, b, y);
+#else
+  Caffe::thread_pool().run(n, kParallelGrain,
+      boost::bind(&vector_binary_range<Dtype, Function>, f, a, b, y,
+                  _1, _2));
+#endif
+}
+
 template <>
 void caffe_add<float>(const int n, const float* a, const float* b,
     float* y) {
-  vsAdd(n, a, b, y);
+  vector_binary(vsAdd, n, a, b, y);
 }
 
 template <>
 void caffe_add<double>(const int n, const double* a, const double* b,
     double* y) {
-  vdAdd(n, a, b, y);
+  vector_binary(vdAdd, n, a, b, y);
 }
 
 template <>
 void caffe_sub<float>(const int n, const float* a, const float* b,
     float* y) {
-  vsSub(n, a, b, y);
+  vector_binary(vsSub, n, a, b, y);
 }
 
 template <>
 void caffe_sub<double>(const int n, const double* a, const double* b,
     double* y) {
-  vdSub(n, a, b, y);
+  vector_binary(vdSub, n, a, b, y);
 }
 
 template <>
 void caffe_mul<float>(const int n, const float* a, const float* b,
     float* y) {
-  vsMul(n, a, b, y);
+  vector_binary(vsMul, n, a, b, y);
 }
 
 template <>
 void caffe_mul<double>(const int n, const double* a, const double* b,
     double* y) {
-  vdMul(n, a, b, y);
+  vector_binary(vdMul, n, a, b, y);
 }
 
 template <>
 void caffe_div<float>(const int n, const float* a, const float* b,
     float* y) {
-  vsDiv(n, a, b, y);
+  vector_binary(vsDiv, n, a, b, y);
 }
 
 template <>
 void caffe_div<double>(const int n, const double* a, const double* b,
     double* y) {
-  vdDiv(n, a, b, y);
+  vector_binary(vdDiv, n, a, b, y);
 }
 
 template <>
 void caffe_powx<float>(const int n, const float* a, const float b,
     float* y) {
-  vsPowx(n, a, b, y);
+  vector_param(vsPowx, n, a, b, y);
 }
 
 template <>
 void caffe_powx<double>(const int n, const double* a, const double b,
     double* y) {
-  vdPowx(n, a, b, y);
+  vector_param(vdPowx, n, a, b, y);
 }
 
 template <>
 void caffe_sqr<float>(const int n, const float* a, float* y) {
-  vsSqr(n, a, y);
+  vector_unary(vsSqr, n, a, y);
 }
 
 template <>
 void caffe_sqr<double>(const int n, const double* a, double* y) {
-  vdSqr(n, a, y);
+  vector_unary(vdSqr, n, a, y);
 }
 
 template <>
 void caffe_exp<float>(const int n, const float* a, float* y) {
-  vsExp(n, a, y);
+  vector_unary(vsExp, n, a, y);
 }
 
 template <>
 void caffe_exp<double>(const int n, const double* a, double* y) {
-  vdExp(n, a, y);
+  vector_unary(vdExp, n, a, y);
+}
+
+static void approx_exp_loop(const int n, const float* a, float* y) {
+  for (int i = 0; i < n; ++i) {
+    y[i] = approx_exp(a[i]);
+  }
+}
+
+// Threaded with or without MKL, whose vsExp is exact
+template <>
+void caffe_approx_exp<float>(const int n, const float* a, float* y) {
+  Caffe::thread_pool().run(n, kParallelGrain,
+      boost::bind(&vector_unary_range<float, void (*)(int, const float*,
+                  float*)>, &approx_exp_loop, a, y, _1, _2));
+}
+
+template <>
+void caffe_approx_exp<double>(const int n, const double* a, double* y) {
+  caffe_exp(n, a, y);
 }
 
 template <>
 void caffe_log<float>(const int n, const float* a, float* y) {
-  vsLn(n, a, y);
+  vector_unary(vsLn, n, a, y);
 }
 
 template <>
 void caffe_log<double>(const int n, const double* a, double* y) {
-  vdLn(n, a, y);
+  vector_unary(vdLn, n, a, y);
 }
 
 template <>
 void caffe_abs<float>(const int n, const float* a, float* y) {
-    vsAbs(n, a, y);
+  vector_unary(vsAbs, n, a, y);
 }
 
 template <>
 void caffe_abs<double>(const int n, const double* a, double* y) {
-    vdAbs(n, a, y);
+  vector_unary(vdAbs, n, a, y);
 }
 
 unsigned int caffe_rng_rand() {
   return (*caffe_rng())();
 }
 
+uint64_t caffe_rng_key() {
+  const uint64_t high = caffe_rng_rand();
+  return (high << 32) | caffe_rng_rand();
+}
+
 template <typename Dtype>
 Dtype caffe_nextafter(const Dtype b) {
   return boost::math::nextafter<Dtype>(
@@ -285,6 +373,75 @@ template
 void caffe_rng_gaussian<double>(const int n, const double mu,
                                 const double sigma, double* r);
 
+template <typename Dtype>
+static void philox_uniform_range(const Dtype a, const Dtype b,
+    const uint64_t key, Dtype* r, int begin, int end) {
+  PhiloxRNG rng(key, 0, begin);
+  for (int i = begin; i < end; ++i) {
+    r[i] = a + (b - a) * rng.uniform();
+  }
+}
+
+template <typename Dtype>
+void caffe_philox_uniform(const int n, const Dtype a, const Dtype b,
+                          const uint64_t key, Dtype* r) {
+  CHECK_GE(n, 0);
+  CHECK(r);
+  CHECK_LE(a, b);
+  Caffe::thread_pool().run(n, kParallelGrain,
+      boost::bind(&philox_uniform_range<Dtype>, a, b, key, r, _1, _2));
+}
+
+template
+void caffe_philox_uniform<float>(const int n, const float a, const float b,
+                                 const uint64_t key, float* r);
+
+template
+void caffe_philox_uniform<double>(const int n, const double a,
+                                  const double b, const uint64_t key,
+                                  double* r);
+
+// Values 2k and 2k + 1 are made of the Box-Muller transform of the values 2k
+// and 2k + 1 of the stream
+template <typename Dtype>
+static void philox_gaussian_range(const Dtype mu, const Dtype sigma,
+    const uint64_t key, Dtype* r, int begin, int end) {
+  const int first = begin - begin % 2;
+  PhiloxRNG rng(key, 0, first);
+  for (int i = first; i < end; i += 2) {
+    const uint32_t value0 = rng();
+    const uint32_t value1 = rng();
+    Dtype normal0, normal1;
+    philox_gaussians(value0, value1, &normal0, &normal1);
+    if (i >= begin) {
+      r[i] = mu + sigma * normal0;
+    }
+    if (i + 1 < end) {
+      r[i + 1] = mu + sigma * normal1;
+    }
+  }
+}
+
+template <typename Dtype>
+void caffe_philox_gaussian(const int n, const Dtype mu, const Dtype sigma,
+                           const uint64_t key, Dtype* r) {
+  CHECK_GE(n, 0);
+  CHECK(r);
+  CHECK_GT(sigma, 0);
+  Caffe::thread_pool().run(n, kParallelGrain,
+      boost::bind(&philox_gaussian_range<Dtype>, mu, sigma, key, r, _1, _2));
+}
+
+template
+void caffe_philox_gaussian<float>(const int n, const float mu,
+                                  const float sigma, const uint64_t key,
+                                  float* r);
+
+template
+void caffe_philox_gaussian<double>(const int n, const double mu,
+                                   const double sigma, const uint64_t key,
+                                   double* r);
+
 template <typename Dtype>
 void caffe_rng_bernoulli(const int n, const Dtype p, int* r) {
   CHECK_GE(n, 0);
@@ -394,4 +551,229 @@ void caffe_cpu_scale<double>(const int n, const double alpha, const double *x,
   cblas_dscal(n, alpha, y, 1);
 }
 
+template <typename Dtype>
+void caffe_cpu_bias_relu(const int n, const int channels, const int inner,
+    const Dtype* bias, const Dtype negative_slope, Dtype* y) {
+  for (int i = 0; i < n; ++i) {
+    const Dtype value = bias ? y[i] + bias[(i / inner) % channels] : y[i];
+    y[i] = value > 0 ? value : value * negative_slope;
+  }
+}
+
+template void caffe_cpu_bias_relu<float>(const int n, const int channels,
+    const int inner, const float* bias, const float negative_slope, float* y);
+template void caffe_cpu_bias_relu<double>(const int n, const int channels,
+    const int inner, const double* bias, const double negative_slope,
+    double* y);
+
+template <typename Dtype>
+void caffe_cpu_relu_backward(const int n, const Dtype* y,
+    const Dtype negative_slope, Dtype* diff) {
+  for (int i = 0; i < n; ++i) {
+    if (y[i] <= 0) {
+      diff[i] *= negative_slope;
+    }
+  }
+}
+
+template void caffe_cpu_relu_backward<float>(const int n, const float* y,
+    const float negative_slope, float* diff);
+template void caffe_cpu_relu_backward<double>(const int n, const double* y,
+    const double negative_slope, double* diff);
+
+template <typename Dtype>
+void caffe_cpu_transpose(const int num, const int rows, const int cols,
+    const Dtype* x, Dtype* y) {
+  for (int n = 0; n < num; ++n) {
+    for (int i = 0; i < rows; ++i) {
+      for (int j = 0; j < cols; ++j) {
+        y[j * rows + i] = x[i * cols + j];
+      }
+    }
+    x += rows * cols;
+    y += rows * cols;
+  }
+}
+
+template void caffe_cpu_transpose<float>(const int num, const int rows,
+    const int cols, const float* x, float* y);
+template void caffe_cpu_transpose<double>(const int num, const int rows,
+    const int cols, const double* x, double* y);
+
+template <typename Dtype>
+Dtype caffe_cpu_amax(const int n, const Dtype* x) {
+  Dtype amax = 0;
+  for (int i = 0; i < n; ++i) {
+    amax = std::max(amax, std::abs(x[i]));
+  }
+  return amax;
+}
+
+template float caffe_cpu_amax<float>(const int n, const float* x);
+template double caffe_cpu_amax<double>(const int n, const double* x);
+
+template <typename Dtype>
+void caffe_cpu_quantize(const int n, const Dtype scale, const Dtype* x,
+    int8_t* y) {
+  const Dtype inverse = scale > 0 ? Dtype(1) / scale : Dtype(0);
+  for (int i = 0; i < n; ++i) {
+    const Dtype value = std::floor(x[i] * inverse + Dtype(0.5));
+    y[i] = static_cast<int8_t>(
+        std::min(std::max(value, Dtype(-127)), Dtype(127)));
+  }
+}
+
+template void caffe_cpu_quantize<float>(const int n, const float scale,
+    const float* x, int8_t* y);
+template void caffe_cpu_quantize<double>(const int n, const double scale,
+    const double* x, int8_t* y);
+
+template <typename Dtype>
+void caffe_cpu_quantize_rows(const int rows, const int dim, const Dtype* x,
+    Dtype* scales, int8_t* y) {
+  for (int r = 0; r < rows; ++r) {
+    scales[r] = caffe_cpu_amax(dim, x + r * dim) / Dtype(127);
+    caffe_cpu_quantize(dim, scales[r], x + r * dim, y + r * dim);
+  }
+}
+
+template void caffe_cpu_quantize_rows<float>(const int rows, const int dim,
+    const float* x, float* scales, int8_t* y);
+template void caffe_cpu_quantize_rows<double>(const int rows, const int dim,
+    const double* x, double* scales, int8_t* y);
+
+void caffe_cpu_gemm_int8(const int M, const int N, const int K,
+    const int8_t* A, const int8_t* B, int32_t* C) {
+  // Each row of B is read once, against all of A, which stays in cache.
+  for (int n = 0; n < N; ++n) {
+    const int8_t* b = B + n * K;
+    for (int m = 0; m < M; ++m) {
+      const int8_t* a = A + m * K;
+      int32_t sum = 0;
+      for (int k = 0; k < K; ++k) {
+        sum += static_cast<int32_t>(a[k]) * b[k];
+      }
+      C[m * N + n] = sum;
+    }
+  }
+}
+
+template <typename Dtype>
+void caffe_cpu_csr_offsets(const int M, const int K, const Dtype* A,
+    int* offsets) {
+  int nonzeros = 0;
+  for (int m = 0; m < M; ++m) {
+    offsets[m] = nonzeros;
+    for (int k = 0; k < K; ++k) {
+      nonzeros += A[m * K + k] != 0;
+    }
+  }
+  offsets[M] = nonzeros;
+}
+
+template void caffe_cpu_csr_offsets<float>(const int M, const int K,
+    const float* A, int* offsets);
+template void caffe_cpu_csr_offsets<double>(const int M, const int K,
+    const double* A, int* offsets);
+
+template <typename Dtype>
+void caffe_cpu_csr(const int M, const int K, const Dtype* A, Dtype* values,
+    int* columns) {
+  int e = 0;
+  for (int i = 0; i < M * K; ++i) {
+    if (A[i] != 0) {
+      values[e] = A[i];
+      columns[e++] = i % K;
+    }
+  }
+}
+
+template void caffe_cpu_csr<float>(const int M, const int K, const float* A,
+    float* values, int* columns);
+template void caffe_cpu_csr<double>(const int M, const int K, const double* A,
+    double* values, int* columns);
+
+template <typename Dtype>
+void caffe_cpu_csrmm(const int M, const int N, const Dtype* values,
+    const int* columns, const int* offsets, const Dtype* B, Dtype* C) {
+  // Each nonzero adds its multiple of a contiguous row of B to that of C.
+  for (int m = 0; m < M; ++m) {
+    Dtype* c = C + m * N;
+    std::fill(c, c + N, Dtype(0));
+    for (int e = offsets[m]; e < offsets[m + 1]; ++e) {
+      const Dtype a = values[e];
+      const Dtype* b = B + columns[e] * N;
+      for (int n = 0; n < N; ++n) {
+        c[n] += a * b[n];
+      }
+    }
+  }
+}
+
+template void caffe_cpu_csrmm<float>(const int M, const int N,
+    const float* values, const int* columns, const int* offsets,
+    const float* B, float* C);
+template void caffe_cpu_csrmm<double>(const int M, const int N,
+    const double* values, const int* columns, const int* offsets,
+    const double* B, double* C);
+
+template <typename Dtype>
+void caffe_cpu_csrmm_trans(const int M, const int N, const int K,
+    const Dtype* B, const Dtype* values, const int* columns,
+    const int* offsets, Dtype* C) {
+  for (int m = 0; m < M; ++m) {
+    const Dtype* b = B + m * K;
+    for (int n = 0; n < N; ++n) {
+      Dtype sum = 0;
+      for (int e = offsets[n]; e < offsets[n + 1]; ++e) {
+        sum += values[e] * b[columns[e]];
+      }
+      C[m * N + n] = sum;
+    }
+  }
+}
+
+template void caffe_cpu_csrmm_trans<float>(const int M, const int N,
+    const int K, const float* B, const float* values, const int* columns,
+    const int* offsets, float* C);
+template void caffe_cpu_csrmm_trans<double>(const int M, const int N,
+    const int K, const double* B, const double* values, const int* columns,
+    const int* offsets, double* C);
+
+template <typename Dtype>
+void caffe_cpu_top_k(const int n, const int k, Dtype* x, Dtype* values,
+    int* indices) {
+  CHECK_LE(k, n);
+  if (k == 0) {
+    return;
+  }
+  // The k-th largest magnitude, those above it all taken, and as many equal
+  // to it as needed
+  vector<Dtype> magnitudes(n);
+  for (int i = 0; i < n; ++i) {
+    magnitudes[i] = std::fabs(x[i]);
+  }
+  std::nth_element(magnitudes.begin(), magnitudes.begin() + n - k,
+                   magnitudes.end());
+  const Dtype threshold = magnitudes[n - k];
+  int equal = k;
+  for (int i = n - k + 1; i < n; ++i) {
+    equal -= magnitudes[i] > threshold;
+  }
+  int e = 0;
+  for (int i = 0; i < n && e < k; ++i) {
+    const Dtype magnitude = std::fabs(x[i]);
+    if (magnitude > threshold || (magnitude == threshold && equal-- > 0)) {
+      values[e] = x[i];
+      indices[e++] = i;
+      x[i] = 0;
+    }
+  }
+}
+
+template void caffe_cpu_top_k<float>(const int n, const int k, float* x,
+    float* values, int* indices);
+template void caffe_cpu_top_k<double>(const int n, const int k, double* x,
+    double* values, int* indices);
+
 }  // namespace caffe
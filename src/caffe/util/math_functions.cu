@@ -1,3 +1,4 @@
+#include <cuda_fp16.h>
 #include <math_functions.h>  // CUDA's, not caffe's, for fabs, signbit
 #include <thrust/device_vector.h>
 #include <thrust/functional.h>  // thrust::plus
@@ -8,7 +9,9 @@
 #include <cstring>
 
 #include "caffe/common.hpp"
+#include "caffe/util/approx_math.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/philox.hpp"
 
 namespace caffe {
 
@@ -78,7 +81,9 @@ void caffe_gpu_axpy<double>(const int N, const double alpha, const double* X,
 
 void caffe_gpu_memcpy(const size_t N, const void* X, void* Y) {
   if (X != Y) {
-    CUDA_CHECK(cudaMemcpy(Y, X, N, cudaMemcpyDefault));  // NOLINT(caffe/alt_fn)
+    const cudaStream_t stream = Caffe::cuda_stream();
+    CUDA_CHECK(cudaMemcpyAsync(Y, X, N, cudaMemcpyDefault, stream));
+    CUDA_CHECK(cudaStreamSynchronize(stream));
   }
 }
 
@@ -118,6 +123,42 @@ void caffe_gpu_dot<double>(const int n, const double* x, const double* y,
   CUBLAS_CHECK(cublasDdot(Caffe::cublas_handle(), n, x, 1, y, 1, out));
 }
 
+// A single block, for the few values of loss tops
+template <typename Dtype>
+__global__ void dot_add_kernel(const int n, const Dtype* x, const Dtype* y,
+    Dtype* out) {
+  __shared__ Dtype sums[CAFFE_CUDA_NUM_THREADS];
+  Dtype sum = 0;
+  for (int i = threadIdx.x; i < n; i += blockDim.x) {
+    sum += x[i] * y[i];
+  }
+  sums[threadIdx.x] = sum;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      sums[threadIdx.x] += sums[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    *out += sums[0];
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_dot_add(const int n, const Dtype* x, const Dtype* y,
+    Dtype* out) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  dot_add_kernel<Dtype><<<1, CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(n, x, y, out);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_dot_add<float>(const int n, const float* x,
+    const float* y, float* out);
+template void caffe_gpu_dot_add<double>(const int n, const double* x,
+    const double* y, double* out);
+
 template <>
 void caffe_gpu_asum<float>(const int n, const float* x, float* y) {
   CUBLAS_CHECK(cublasSasum(Caffe::cublas_handle(), n, x, 1, y));
@@ -152,18 +193,44 @@ __global__ void set_kernel(const int n, const Dtype alpha, Dtype* y) {
 template <typename Dtype>
 void caffe_gpu_set(const int N, const Dtype alpha, Dtype* Y) {
   if (alpha == 0) {
-    CUDA_CHECK(cudaMemset(Y, 0, sizeof(Dtype) * N));  // NOLINT(caffe/alt_fn)
+    CUDA_CHECK(cudaMemsetAsync(Y, 0, sizeof(Dtype) * N,
+                               Caffe::cuda_stream()));
     return;
   }
   // NOLINT_NEXT_LINE(whitespace/operators)
-  set_kernel<Dtype><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, alpha, Y);
+  set_kernel<Dtype><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, alpha, Y);
 }
 
 template void caffe_gpu_set<int>(const int N, const int alpha, int* Y);
 template void caffe_gpu_set<float>(const int N, const float alpha, float* Y);
 template void caffe_gpu_set<double>(const int N, const double alpha, double* Y);
 
+template <typename Dtype>
+__global__ void set_rows_kernel(const int n, const int* rows,
+    const int row_size, const Dtype alpha, Dtype* y) {
+  CUDA_KERNEL_LOOP(index, n) {
+    y[rows[index / row_size] * row_size + index % row_size] = alpha;
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_set_rows(const int num_rows, const int* rows,
+    const int row_size, const Dtype alpha, Dtype* Y) {
+  const int n = num_rows * row_size;
+  if (n == 0) {
+    return;
+  }
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  set_rows_kernel<Dtype><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(n, rows, row_size, alpha, Y);
+}
+
+template void caffe_gpu_set_rows<float>(const int num_rows, const int* rows,
+    const int row_size, const float alpha, float* Y);
+template void caffe_gpu_set_rows<double>(const int num_rows, const int* rows,
+    const int row_size, const double alpha, double* Y);
+
 template <typename Dtype>
 __global__ void add_scalar_kernel(const int n, const Dtype alpha, Dtype* y) {
   CUDA_KERNEL_LOOP(index, n) {
@@ -174,15 +241,15 @@ __global__ void add_scalar_kernel(const int n, const Dtype alpha, Dtype* y) {
 template <>
 void caffe_gpu_add_scalar(const int N, const float alpha, float* Y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  add_scalar_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, alpha, Y);
+  add_scalar_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, alpha, Y);
 }
 
 template <>
 void caffe_gpu_add_scalar(const int N, const double alpha, double* Y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  add_scalar_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, alpha, Y);
+  add_scalar_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, alpha, Y);
 }
 
 template <typename Dtype>
@@ -197,16 +264,16 @@ template <>
 void caffe_gpu_add<float>(const int N, const float* a, const float* b,
     float* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  add_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, b, y);
+  add_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, b, y);
 }
 
 template <>
 void caffe_gpu_add<double>(const int N, const double* a, const double* b,
     double* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  add_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, b, y);
+  add_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, b, y);
 }
 
 template <typename Dtype>
@@ -221,16 +288,16 @@ template <>
 void caffe_gpu_sub<float>(const int N, const float* a, const float* b,
     float* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  sub_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, b, y);
+  sub_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, b, y);
 }
 
 template <>
 void caffe_gpu_sub<double>(const int N, const double* a, const double* b,
     double* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  sub_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, b, y);
+  sub_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, b, y);
 }
 
 template <typename Dtype>
@@ -245,16 +312,16 @@ template <>
 void caffe_gpu_mul<float>(const int N, const float* a,
     const float* b, float* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  mul_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, b, y);
+  mul_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, b, y);
 }
 
 template <>
 void caffe_gpu_mul<double>(const int N, const double* a,
     const double* b, double* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  mul_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, b, y);
+  mul_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, b, y);
 }
 
 template <typename Dtype>
@@ -269,16 +336,16 @@ template <>
 void caffe_gpu_div<float>(const int N, const float* a,
     const float* b, float* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  div_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, b, y);
+  div_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, b, y);
 }
 
 template <>
 void caffe_gpu_div<double>(const int N, const double* a,
     const double* b, double* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  div_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, b, y);
+  div_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, b, y);
 }
 
 template <typename Dtype>
@@ -291,15 +358,15 @@ __global__ void abs_kernel(const int n, const Dtype* a, Dtype* y) {
 template <>
 void caffe_gpu_abs<float>(const int N, const float* a, float* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  abs_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, y);
+  abs_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, y);
 }
 
 template <>
 void caffe_gpu_abs<double>(const int N, const double* a, double* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  abs_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, y);
+  abs_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, y);
 }
 
 
@@ -313,15 +380,33 @@ __global__ void exp_kernel(const int n, const Dtype* a, Dtype* y) {
 template <>
 void caffe_gpu_exp<float>(const int N, const float* a, float* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  exp_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, y);
+  exp_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, y);
 }
 
 template <>
 void caffe_gpu_exp<double>(const int N, const double* a, double* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  exp_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, y);
+  exp_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, y);
+}
+
+__global__ void approx_exp_kernel(const int n, const float* a, float* y) {
+  CUDA_KERNEL_LOOP(index, n) {
+    y[index] = approx_exp(a[index]);
+  }
+}
+
+template <>
+void caffe_gpu_approx_exp<float>(const int N, const float* a, float* y) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  approx_exp_kernel<<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, y);
+}
+
+template <>
+void caffe_gpu_approx_exp<double>(const int N, const double* a, double* y) {
+  caffe_gpu_exp(N, a, y);
 }
 
 template <typename Dtype>
@@ -334,15 +419,15 @@ __global__ void log_kernel(const int n, const Dtype* a, Dtype* y) {
 template <>
 void caffe_gpu_log<float>(const int N, const float* a, float* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  log_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, y);
+  log_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, y);
 }
 
 template <>
 void caffe_gpu_log<double>(const int N, const double* a, double* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  log_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, y);
+  log_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, y);
 }
 
 template <typename Dtype>
@@ -357,22 +442,216 @@ template <>
 void caffe_gpu_powx<float>(const int N, const float* a,
     const float alpha, float* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  powx_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, alpha, y);
+  powx_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, alpha, y);
 }
 
 template <>
 void caffe_gpu_powx<double>(const int N, const double* a,
     const double alpha, double* y) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  powx_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, a, alpha, y);
+  powx_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(N, a, alpha, y);
 }
 
 DEFINE_AND_INSTANTIATE_GPU_UNARY_FUNC(sign, y[index] = (Dtype(0) < x[index])
                                       - (x[index] < Dtype(0)));
 DEFINE_AND_INSTANTIATE_GPU_UNARY_FUNC(sgnbit, y[index] = signbit(x[index]));
 
+template <typename Dtype>
+__global__ void to_half_kernel(const int n, const Dtype* x, __half* y,
+    Dtype* residual) {
+  CUDA_KERNEL_LOOP(index, n) {
+    Dtype value = x[index];
+    if (residual) {
+      value += residual[index];
+    }
+    y[index] = __float2half(static_cast<float>(value));
+    if (residual) {
+      residual[index] = value - __half2float(y[index]);
+    }
+  }
+}
+
+template <typename Dtype>
+__global__ void from_half_kernel(const int n, const __half* x, Dtype* y) {
+  CUDA_KERNEL_LOOP(index, n) {
+    y[index] = __half2float(x[index]);
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_to_half(const int n, const Dtype* x, uint16_t* y,
+    Dtype* residual) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  to_half_kernel<Dtype><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(n, x, reinterpret_cast<__half*>(y), residual);
+}
+
+template void caffe_gpu_to_half<float>(const int n, const float* x,
+    uint16_t* y, float* residual);
+template void caffe_gpu_to_half<double>(const int n, const double* x,
+    uint16_t* y, double* residual);
+
+template <typename Dtype>
+void caffe_gpu_from_half(const int n, const uint16_t* x, Dtype* y) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  from_half_kernel<Dtype><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(n, reinterpret_cast<const __half*>(x), y);
+}
+
+template void caffe_gpu_from_half<float>(const int n, const uint16_t* x,
+    float* y);
+template void caffe_gpu_from_half<double>(const int n, const uint16_t* x,
+    double* y);
+
+template <typename Dtype>
+__global__ void bias_relu_kernel(const int n, const int channels,
+    const int inner, const Dtype* bias, const Dtype negative_slope,
+    Dtype* y) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const Dtype value = bias ?
+        y[index] + bias[(index / inner) % channels] : y[index];
+    y[index] = value > 0 ? value : value * negative_slope;
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_bias_relu(const int n, const int channels, const int inner,
+    const Dtype* bias, const Dtype negative_slope, Dtype* y) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  bias_relu_kernel<Dtype><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(n, channels, inner, bias, negative_slope, y);
+}
+
+template void caffe_gpu_bias_relu<float>(const int n, const int channels,
+    const int inner, const float* bias, const float negative_slope, float* y);
+template void caffe_gpu_bias_relu<double>(const int n, const int channels,
+    const int inner, const double* bias, const double negative_slope,
+    double* y);
+
+template <typename Dtype>
+__global__ void relu_backward_kernel(const int n, const Dtype* y,
+    const Dtype negative_slope, Dtype* diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    if (y[index] <= 0) {
+      diff[index] *= negative_slope;
+    }
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_relu_backward(const int n, const Dtype* y,
+    const Dtype negative_slope, Dtype* diff) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  relu_backward_kernel<Dtype><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(n, y, negative_slope, diff);
+}
+
+template void caffe_gpu_relu_backward<float>(const int n, const float* y,
+    const float negative_slope, float* diff);
+template void caffe_gpu_relu_backward<double>(const int n, const double* y,
+    const double negative_slope, double* diff);
+
+// A thread per element of y, for the writes to be coalesced
+template <typename Dtype>
+__global__ void transpose_kernel(const int n, const int rows, const int cols,
+    const Dtype* x, Dtype* y) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int i = index % rows;
+    const int j = (index / rows) % cols;
+    const int m = index / (rows * cols);
+    y[index] = x[(m * rows + i) * cols + j];
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_transpose(const int num, const int rows, const int cols,
+    const Dtype* x, Dtype* y) {
+  const int n = num * rows * cols;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  transpose_kernel<Dtype><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(n, rows, cols, x, y);
+}
+
+template void caffe_gpu_transpose<float>(const int num, const int rows,
+    const int cols, const float* x, float* y);
+template void caffe_gpu_transpose<double>(const int num, const int rows,
+    const int cols, const double* x, double* y);
+
+// A thread per output: those of a row of C share the nonzeros of the row of
+// A, and read consecutive values of each row of B.
+template <typename Dtype>
+__global__ void csrmm_kernel(const int n, const int N, const Dtype* values,
+    const int* columns, const int* offsets, const Dtype* B, Dtype* C) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int m = index / N;
+    const int col = index % N;
+    Dtype sum = 0;
+    for (int e = offsets[m]; e < offsets[m + 1]; ++e) {
+      sum += values[e] * B[columns[e] * N + col];
+    }
+    C[index] = sum;
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_csrmm(const int M, const int N, const Dtype* values,
+    const int* columns, const int* offsets, const Dtype* B, Dtype* C) {
+  const int n = M * N;
+  if (n == 0) {
+    return;
+  }
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  csrmm_kernel<Dtype><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(n, N, values, columns, offsets, B, C);
+}
+
+template void caffe_gpu_csrmm<float>(const int M, const int N,
+    const float* values, const int* columns, const int* offsets,
+    const float* B, float* C);
+template void caffe_gpu_csrmm<double>(const int M, const int N,
+    const double* values, const int* columns, const int* offsets,
+    const double* B, double* C);
+
+// A thread per output, those of a row of A being consecutive so that they
+// go through the same nonzeros together.
+template <typename Dtype>
+__global__ void csrmm_trans_kernel(const int n, const int M, const int N,
+    const int K, const Dtype* B, const Dtype* values, const int* columns,
+    const int* offsets, Dtype* C) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int row = index / M;
+    const int m = index % M;
+    const Dtype* b = B + m * K;
+    Dtype sum = 0;
+    for (int e = offsets[row]; e < offsets[row + 1]; ++e) {
+      sum += values[e] * b[columns[e]];
+    }
+    C[m * N + row] = sum;
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_csrmm_trans(const int M, const int N, const int K,
+    const Dtype* B, const Dtype* values, const int* columns,
+    const int* offsets, Dtype* C) {
+  const int n = M * N;
+  if (n == 0) {
+    return;
+  }
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  csrmm_trans_kernel<Dtype><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(n, M, N, K, B, values, columns, offsets, C);
+}
+
+template void caffe_gpu_csrmm_trans<float>(const int M, const int N,
+    const int K, const float* B, const float* values, const int* columns,
+    const int* offsets, float* C);
+template void caffe_gpu_csrmm_trans<double>(const int M, const int N,
+    const int K, const double* B, const double* values, const int* columns,
+    const int* offsets, double* C);
+
 __global__ void popc_kernel(const int n, const float* a,
     const float* b, uint8_t* y) {
   CUDA_KERNEL_LOOP(index, n) {
@@ -397,7 +676,8 @@ uint32_t caffe_gpu_hamming_distance<float>(const int n, const float* x,
   NOT_IMPLEMENTED;
   thrust::device_vector<uint8_t> popcounts(n);
   // NOLINT_NEXT_LINE(whitespace/operators)
-  popc_kernel<<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS>>>(
+  popc_kernel<<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(
       n, x, y, thrust::raw_pointer_cast(popcounts.data()));
   return thrust::reduce(popcounts.begin(), popcounts.end(),
                         (uint32_t) 0, thrust::plus<uint32_t>());
@@ -411,7 +691,8 @@ uint32_t caffe_gpu_hamming_distance<double>(const int n, const double* x,
   NOT_IMPLEMENTED;
   thrust::device_vector<uint8_t> popcounts(n);
   // NOLINT_NEXT_LINE(whitespace/operators)
-  popcll_kernel<<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS>>>(
+  popcll_kernel<<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0,
+      Caffe::cuda_stream()>>>(
       n, x, y, thrust::raw_pointer_cast(popcounts.data()));
   return thrust::reduce(popcounts.begin(), popcounts.end(),
                         /* NOLINT_NEXT_LINE(build/include_what_you_use) */
@@ -462,4 +743,61 @@ void caffe_gpu_rng_gaussian(const int n, const double mu, const double sigma,
       curandGenerateNormalDouble(Caffe::curand_generator(), r, n, mu, sigma));
 }
 
+// A thread per block of 4 values of the stream
+template <typename Dtype>
+__global__ void philox_uniform_kernel(const int n, const Dtype a,
+    const Dtype b, const uint64_t key, Dtype* r) {
+  CUDA_KERNEL_LOOP(block, (n + 3) / 4) {
+    uint32_t values[4];
+    philox_block(key, block, values);
+    for (int j = 0; j < 4 && block * 4 + j < n; ++j) {
+      r[block * 4 + j] = a + (b - a) * philox_uniform(values[j]);
+    }
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_philox_uniform(const int n, const Dtype a, const Dtype b,
+                              const uint64_t key, Dtype* r) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  philox_uniform_kernel<Dtype><<<CAFFE_GET_BLOCKS((n + 3) / 4),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(n, a, b, key, r);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_philox_uniform<float>(const int n, const float a,
+    const float b, const uint64_t key, float* r);
+template void caffe_gpu_philox_uniform<double>(const int n, const double a,
+    const double b, const uint64_t key, double* r);
+
+template <typename Dtype>
+__global__ void philox_gaussian_kernel(const int n, const Dtype mu,
+    const Dtype sigma, const uint64_t key, Dtype* r) {
+  CUDA_KERNEL_LOOP(block, (n + 3) / 4) {
+    uint32_t values[4];
+    philox_block(key, block, values);
+    Dtype normals[4];
+    philox_gaussians(values[0], values[1], &normals[0], &normals[1]);
+    philox_gaussians(values[2], values[3], &normals[2], &normals[3]);
+    for (int j = 0; j < 4 && block * 4 + j < n; ++j) {
+      r[block * 4 + j] = mu + sigma * normals[j];
+    }
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_philox_gaussian(const int n, const Dtype mu,
+                               const Dtype sigma, const uint64_t key,
+                               Dtype* r) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  philox_gaussian_kernel<Dtype><<<CAFFE_GET_BLOCKS((n + 3) / 4),
+      CAFFE_CUDA_NUM_THREADS, 0, Caffe::cuda_stream()>>>(n, mu, sigma, key, r);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_philox_gaussian<float>(const int n, const float mu,
+    const float sigma, const uint64_t key, float* r);
+template void caffe_gpu_philox_gaussian<double>(const int n, const double mu,
+    const double sigma, const uint64_t key, double* r);
+
 }  // namespace caffe
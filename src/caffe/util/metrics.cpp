@@ -0,0 +1,125 @@
+#include <boost/thread.hpp>
+
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include "caffe/util/metrics.hpp"
+#include "caffe/util/socket.hpp"
+
+namespace caffe {
+
+// Limit of the request headers
+static const size_t kMaxRequest = 8192;
+
+class Metrics::sync {
+ public:
+  mutable boost::mutex mutex_;
+};
+
+Metrics::Metrics()
+    : sync_(new sync()) {
+}
+
+void Metrics::set(const string& name, Type type, const string& labels,
+                  double value) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  std::pair<Type, std::map<string, double> >& metric = metrics_[name];
+  metric.first = type;
+  metric.second[labels] = value;
+}
+
+void Metrics::add(const string& name, Type type, const string& labels,
+                  double value) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  std::pair<Type, std::map<string, double> >& metric = metrics_[name];
+  metric.first = type;
+  metric.second[labels] += value;
+}
+
+double Metrics::get(const string& name, const string& labels) const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  std::map<string, std::pair<Type, std::map<string, double> > >::
+      const_iterator metric = metrics_.find(name);
+  if (metric == metrics_.end()) {
+    return 0;
+  }
+  std::map<string, double>::const_iterator series =
+      metric->second.second.find(labels);
+  return series == metric->second.second.end() ? 0 : series->second;
+}
+
+string Metrics::text() const {
+  std::ostringstream text;
+  text << std::setprecision(15);
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  for (std::map<string, std::pair<Type, std::map<string, double> > >::
+       const_iterator metric = metrics_.begin(); metric != metrics_.end();
+       ++metric) {
+    text << "# TYPE " << metric->first << " "
+         << (metric->second.first == COUNTER ? "counter" : "gauge") << "\n";
+    for (std::map<string, double>::const_iterator series =
+         metric->second.second.begin();
+         series != metric->second.second.end(); ++series) {
+      text << metric->first;
+      if (series->first.size()) {
+        text << "{" << series->first << "}";
+      }
+      text << " " << series->second << "\n";
+    }
+  }
+  return text.str();
+}
+
+void Metrics::Serve(int port) {
+  shared_ptr<Socket> listener = Socket::listen(port);
+  LOG(INFO) << "Serving metrics on port " << port;
+  boost::thread(&Metrics::Accept, this, listener).detach();
+}
+
+void Metrics::Accept(shared_ptr<Socket> listener) {
+  for (;;) {
+    shared_ptr<Socket> socket = listener->accept();
+    Answer(socket.get());
+  }
+}
+
+void Metrics::Answer(Socket* socket) {
+  // The request line and headers, up to the empty line ending them
+  string request;
+  while (request.size() < kMaxRequest &&
+         (request.size() < 4 ||
+          request.compare(request.size() - 4, 4, "\r\n\r\n"))) {
+    char c;
+    if (!socket->try_recv(&c, 1)) {
+      return;
+    }
+    request += c;
+  }
+  string method, path;
+  std::istringstream(request) >> method >> path;
+  int status = 200;
+  string body;
+  if (path != "/metrics") {
+    status = 404;
+  } else if (method != "GET") {
+    status = 405;
+  } else {
+    body = text();
+  }
+  std::ostringstream header;
+  header << "HTTP/1.1 " << status << " "
+         << (status == 200 ? "OK" : status == 404 ? "Not Found" :
+             "Method Not Allowed") << "\r\n"
+         << "Content-Type: text/plain; version=0.0.4\r\n"
+         << "Content-Length: " << body.size() << "\r\n"
+         << "Connection: close\r\n\r\n";
+  const string head = header.str();
+  if (socket->try_send(head.data(), head.size())) {
+    socket->try_send(body.data(), body.size());
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,194 @@
+#ifdef __linux__
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>  // NOLINT(readability/streams)
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "caffe/util/numa.hpp"
+
+namespace caffe {
+
+// Set once at startup, before the threads it is read by
+static bool numa_affinity = false;
+
+void SetNUMAAffinity(bool affinity) {
+  numa_affinity = affinity;
+}
+
+bool NUMAAffinity() {
+  return numa_affinity;
+}
+
+bool ParseCPUList(const string& list, vector<int>* cpus) {
+  cpus->clear();
+  std::stringstream stream(list);
+  string range;
+  while (std::getline(stream, range, ',')) {
+    int first, last;
+    char end;
+    const int fields = sscanf(range.c_str(), "%d-%d%c", &first, &last, &end);
+    if (fields == 1) {
+      last = first;
+    } else if (fields != 2 || first > last) {
+      return false;
+    }
+    if (first < 0) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(cpu);
+    }
+  }
+  return !cpus->empty();
+}
+
+vector<int> DeviceCPUs(int device, int* node) {
+  vector<int> cpus;
+  *node = -1;
+#if !defined(CPU_ONLY) && defined(__linux__)
+  char bus_id[32];
+  if (cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), device) != cudaSuccess) {
+    return cpus;
+  }
+  // CUDA prints the hexadecimal digits in upper case, sysfs in lower case
+  string path(bus_id);
+  std::transform(path.begin(), path.end(), path.begin(), ::tolower);
+  path = "/sys/bus/pci/devices/" + path + "/";
+  std::ifstream node_file((path + "numa_node").c_str());
+  if (!(node_file >> *node)) {
+    *node = -1;
+  }
+  std::ifstream cpus_file((path + "local_cpulist").c_str());
+  string list;
+  if (!std::getline(cpus_file, list) || !ParseCPUList(list, &cpus)) {
+    cpus.clear();
+  }
+#endif
+  return cpus;
+}
+
+string DevicePCIPath(int device) {
+  string path;
+#if !defined(CPU_ONLY) && defined(__linux__)
+  char bus_id[32];
+  if (cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), device) != cudaSuccess) {
+    return path;
+  }
+  string link(bus_id);
+  std::transform(link.begin(), link.end(), link.begin(), ::tolower);
+  link = "/sys/bus/pci/devices/" + link;
+  // The link resolves to e.g. /sys/devices/pci0000:00/.../0000:06:00.0
+  char resolved[PATH_MAX];
+  const string devices("/sys/devices/");
+  if (realpath(link.c_str(), resolved) &&
+      string(resolved).compare(0, devices.size(), devices) == 0) {
+    path = string(resolved).substr(devices.size());
+  }
+#endif
+  return path;
+}
+
+// Splits a PCI path at its slashes
+static vector<string> PCIComponents(const string& path) {
+  vector<string> components;
+  std::stringstream stream(path);
+  string component;
+  while (std::getline(stream, component, '/')) {
+    components.push_back(component);
+  }
+  return components;
+}
+
+int SharedPCIBridges(const string& path0, const string& path1) {
+  const vector<string> a = PCIComponents(path0);
+  const vector<string> b = PCIComponents(path1);
+  if (a.empty() || b.empty() || a[0] != b[0]) {
+    return -1;
+  }
+  // Not counting the host bridge, nor the devices themselves
+  int shared = 0;
+  while (shared + 2 < a.size() && shared + 2 < b.size() &&
+         a[shared + 1] == b[shared + 1]) {
+    ++shared;
+  }
+  return shared;
+}
+
+// Restricts the calling thread to cpus, those of a device or NUMA node
+// described by what, if known
+static void BindThreadToCPUs(const vector<int>& cpus, int node,
+    const string& what) {
+  if (cpus.empty()) {
+    LOG(WARNING) << "Unknown CPUs for " << what
+                 << ", not setting the thread affinity";
+    return;
+  }
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int i = 0; i < cpus.size(); ++i) {
+    if (cpus[i] < CPU_SETSIZE) {
+      CPU_SET(cpus[i], &set);
+    }
+  }
+  // Applies to the calling thread only
+  if (sched_setaffinity(0, sizeof(set), &set)) {
+    LOG(WARNING) << "Cannot set the thread affinity for " << what;
+    return;
+  }
+  DLOG(INFO) << "Thread of " << what << " bound to the "
+             << cpus.size() << " CPUs of NUMA node " << node;
+#endif
+}
+
+void BindThreadToDevice(int device) {
+  if (!numa_affinity) {
+    return;
+  }
+  int node;
+  const vector<int> cpus = DeviceCPUs(device, &node);
+  std::ostringstream what;
+  what << "device " << device;
+  BindThreadToCPUs(cpus, node, what.str());
+}
+
+// Reads a CPU or node list from a file of sysfs
+static vector<int> ReadSysList(const string& path) {
+  vector<int> list;
+#ifdef __linux__
+  std::ifstream file(path.c_str());
+  string line;
+  if (!std::getline(file, line) || !ParseCPUList(line, &list)) {
+    list.clear();
+  }
+#endif
+  return list;
+}
+
+vector<int> NUMANodes() {
+  return ReadSysList("/sys/devices/system/node/online");
+}
+
+vector<int> NodeCPUs(int node) {
+  std::ostringstream path;
+  path << "/sys/devices/system/node/node" << node << "/cpulist";
+  return ReadSysList(path.str());
+}
+
+void BindThreadToNode(int node) {
+  if (!numa_affinity) {
+    return;
+  }
+  std::ostringstream what;
+  what << "NUMA node " << node;
+  BindThreadToCPUs(NodeCPUs(node), node, what.str());
+}
+
+}  // namespace caffe
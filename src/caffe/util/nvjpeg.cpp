@@ -0,0 +1,95 @@
+#ifdef USE_NVJPEG
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/util/nvjpeg.hpp"
+
+namespace caffe {
+
+JPEGDecoder::JPEGDecoder()
+    : batch_size_(0), format_(NVJPEG_OUTPUT_UNCHANGED) {
+  NVJPEG_CHECK(nvjpegCreateSimple(&handle_));
+  NVJPEG_CHECK(nvjpegJpegStateCreate(handle_, &state_));
+  CUDA_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+}
+
+JPEGDecoder::~JPEGDecoder() {
+  cudaStreamDestroy(stream_);
+  nvjpegJpegStateDestroy(state_);
+  nvjpegDestroy(handle_);
+}
+
+bool JPEGDecoder::IsJPEG(const string& data) {
+  return data.size() > 2 && static_cast<unsigned char>(data[0]) == 0xFF
+      && static_cast<unsigned char>(data[1]) == 0xD8;
+}
+
+bool JPEGDecoder::Decode(const vector<const string*>& images, int channels,
+    vector<int>* shape, shared_ptr<SyncedMemory>* raw) {
+  const int num = images.size();
+  CHECK_GT(num, 0);
+  vector<const unsigned char*> data(num);
+  vector<size_t> lengths(num);
+  int height = 0;
+  int width = 0;
+  for (int i = 0; i < num; ++i) {
+    if (!IsJPEG(*images[i])) {
+      return false;
+    }
+    data[i] = reinterpret_cast<const unsigned char*>(images[i]->data());
+    lengths[i] = images[i]->size();
+    int components;
+    nvjpegChromaSubsampling_t subsampling;
+    int widths[NVJPEG_MAX_COMPONENT];
+    int heights[NVJPEG_MAX_COMPONENT];
+    if (nvjpegGetImageInfo(handle_, data[i], lengths[i], &components,
+        &subsampling, widths, heights) != NVJPEG_STATUS_SUCCESS) {
+      return false;
+    }
+    if (i == 0) {
+      height = heights[0];
+      width = widths[0];
+      if (channels == 0) {
+        channels = components == 1 ? 1 : 3;
+      }
+    } else if (heights[0] != height || widths[0] != width) {
+      return false;
+    }
+  }
+  CHECK(channels == 1 || channels == 3);
+  const nvjpegOutputFormat_t format = channels == 1 ? NVJPEG_OUTPUT_Y
+      : NVJPEG_OUTPUT_BGR;
+  if (num != batch_size_ || format != format_) {
+    NVJPEG_CHECK(nvjpegDecodeBatchedInitialize(handle_, state_, num, 1,
+        format));
+    batch_size_ = num;
+    format_ = format;
+  }
+  const size_t plane = static_cast<size_t>(height) * width;
+  const size_t size = channels * plane;
+  if (!*raw || (*raw)->size() < num * size) {
+    raw->reset(new SyncedMemory(num * size));
+  }
+  // Planar output, each channel a plane of the image in raw
+  uint8_t* pixels = static_cast<uint8_t*>((*raw)->mutable_gpu_data());
+  vector<nvjpegImage_t> destinations(num);
+  for (int i = 0; i < num; ++i) {
+    memset(&destinations[i], 0, sizeof(nvjpegImage_t));
+    for (int c = 0; c < channels; ++c) {
+      destinations[i].channel[c] = pixels + i * size + c * plane;
+      destinations[i].pitch[c] = width;
+    }
+  }
+  NVJPEG_CHECK(nvjpegDecodeBatched(handle_, state_, &data[0], &lengths[0],
+      &destinations[0], stream_));
+  CUDA_CHECK(cudaStreamSynchronize(stream_));
+  shape->resize(3);
+  (*shape)[0] = channels;
+  (*shape)[1] = height;
+  (*shape)[2] = width;
+  return true;
+}
+
+}  // namespace caffe
+#endif  // USE_NVJPEG
@@ -0,0 +1,128 @@
+#include "caffe/util/packed_gemm.hpp"
+
+#if defined(USE_MKL) && INTEL_MKL_VERSION >= 20170000
+#define PACKED_GEMM
+#endif
+
+namespace caffe {
+
+#ifdef PACKED_GEMM
+// The packed GEMM of MKL for each type
+static void gemm_alloc(CBLAS_IDENTIFIER id, int M, int N, int K,
+    float** packed) {
+  *packed = cblas_sgemm_alloc(id, M, N, K);
+}
+
+static void gemm_alloc(CBLAS_IDENTIFIER id, int M, int N, int K,
+    double** packed) {
+  *packed = cblas_dgemm_alloc(id, M, N, K);
+}
+
+static void gemm_pack(CBLAS_IDENTIFIER id, CBLAS_TRANSPOSE trans, int M,
+    int N, int K, const float* matrix, int ld, float* packed) {
+  cblas_sgemm_pack(CblasRowMajor, id, trans, M, N, K, 1.f, matrix, ld,
+      packed);
+}
+
+static void gemm_pack(CBLAS_IDENTIFIER id, CBLAS_TRANSPOSE trans, int M,
+    int N, int K, const double* matrix, int ld, double* packed) {
+  cblas_dgemm_pack(CblasRowMajor, id, trans, M, N, K, 1., matrix, ld,
+      packed);
+}
+
+static void gemm_compute(MKL_INT trans_a, MKL_INT trans_b, int M, int N,
+    int K, const float* A, int lda, const float* B, int ldb, float beta,
+    float* C) {
+  cblas_sgemm_compute(CblasRowMajor, trans_a, trans_b, M, N, K, A, lda, B,
+      ldb, beta, C, N);
+}
+
+static void gemm_compute(MKL_INT trans_a, MKL_INT trans_b, int M, int N,
+    int K, const double* A, int lda, const double* B, int ldb, double beta,
+    double* C) {
+  cblas_dgemm_compute(CblasRowMajor, trans_a, trans_b, M, N, K, A, lda, B,
+      ldb, beta, C, N);
+}
+
+static void gemm_free(float* packed) { cblas_sgemm_free(packed); }
+static void gemm_free(double* packed) { cblas_dgemm_free(packed); }
+#endif
+
+template <typename Dtype>
+PackedGemm<Dtype>::~PackedGemm() {
+  Free();
+}
+
+template <typename Dtype>
+void PackedGemm<Dtype>::Free() {
+#ifdef PACKED_GEMM
+  if (packed_) {
+    gemm_free(packed_);
+  }
+#endif
+  packed_ = NULL;
+  matrix_ = NULL;
+  memory_ = NULL;
+}
+
+// The leading dimensions of the row-major operands of caffe_cpu_gemm
+static int lda(CBLAS_TRANSPOSE trans, int M, int K) {
+  return trans == CblasNoTrans ? K : M;
+}
+
+static int ldb(CBLAS_TRANSPOSE trans, int N, int K) {
+  return trans == CblasNoTrans ? N : K;
+}
+
+template <typename Dtype>
+void PackedGemm<Dtype>::Pack(bool pack_a, CBLAS_TRANSPOSE trans, int M,
+    int N, int K, const Dtype* matrix, SyncedMemory* memory) {
+  if (matrix == matrix_ && memory == memory_ && memory->version() == version_
+      && pack_a == pack_a_ && trans == trans_ && M == M_ && N == N_
+      && K == K_) {
+    return;
+  }
+  Free();
+  matrix_ = matrix;
+  memory_ = memory;
+  version_ = memory->version();
+  pack_a_ = pack_a;
+  trans_ = trans;
+  M_ = M;
+  N_ = N;
+  K_ = K;
+#ifdef PACKED_GEMM
+  const CBLAS_IDENTIFIER id = pack_a ? CblasAMatrix : CblasBMatrix;
+  gemm_alloc(id, M, N, K, &packed_);
+  CHECK(packed_) << "Failed to allocate a packed matrix";
+  gemm_pack(id, trans, M, N, K, matrix,
+      pack_a ? lda(trans, M, K) : ldb(trans, N, K), packed_);
+#endif
+}
+
+template <typename Dtype>
+void PackedGemm<Dtype>::Gemm(CBLAS_TRANSPOSE trans, const Dtype* other,
+    Dtype beta, Dtype* C) const {
+  CHECK(matrix_) << "No matrix packed";
+#ifdef PACKED_GEMM
+  if (pack_a_) {
+    gemm_compute(CblasPacked, trans, M_, N_, K_, packed_,
+        lda(trans_, M_, K_), other, ldb(trans, N_, K_), beta, C);
+  } else {
+    gemm_compute(trans, CblasPacked, M_, N_, K_, other, lda(trans, M_, K_),
+        packed_, ldb(trans_, N_, K_), beta, C);
+  }
+#else
+  if (pack_a_) {
+    caffe_cpu_gemm<Dtype>(trans_, trans, M_, N_, K_, Dtype(1), matrix_, other,
+        beta, C);
+  } else {
+    caffe_cpu_gemm<Dtype>(trans, trans_, M_, N_, K_, Dtype(1), other, matrix_,
+        beta, C);
+  }
+#endif
+}
+
+INSTANTIATE_CLASS(PackedGemm);
+
+}  // namespace caffe
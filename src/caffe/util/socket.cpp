@@ -0,0 +1,264 @@
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/util/socket.hpp"
+
+namespace caffe {
+
+Socket::Socket(int fd)
+    : fd_(fd) {
+  CHECK_GE(fd_, 0) << strerror(errno);
+}
+
+Socket::~Socket() {
+  close(fd_);
+}
+
+shared_ptr<Socket> Socket::listen(int port, int backlog) {
+  shared_ptr<Socket> socket(new Socket(::socket(AF_INET, SOCK_STREAM, 0)));
+  int on = 1;
+  CHECK_EQ(setsockopt(socket->fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)),
+           0) << strerror(errno);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  CHECK_EQ(bind(socket->fd_, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)), 0) << "Cannot bind port " << port << ": "
+      << strerror(errno);
+  CHECK_EQ(::listen(socket->fd_, backlog), 0) << strerror(errno);
+  return socket;
+}
+
+shared_ptr<Socket> Socket::connect(const string& host, int port,
+                                   int timeout_seconds) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* info;
+  const string service = boost::lexical_cast<string>(port);
+  const int err = getaddrinfo(host.c_str(), service.c_str(), &hints, &info);
+  CHECK_EQ(err, 0) << "Cannot resolve " << host << ": " << gai_strerror(err);
+  shared_ptr<Socket> socket;
+  for (int attempt = 0; ; ++attempt) {
+    socket.reset(new Socket(::socket(AF_INET, SOCK_STREAM, 0)));
+    if (::connect(socket->fd_, info->ai_addr, info->ai_addrlen) == 0) {
+      break;
+    }
+    CHECK_LT(attempt, timeout_seconds) << "Cannot connect to " << host << ":"
+        << port << ": " << strerror(errno);
+    sleep(1);
+  }
+  freeaddrinfo(info);
+  return socket;
+}
+
+shared_ptr<Socket> Socket::accept() {
+  return shared_ptr<Socket>(new Socket(::accept(fd_, NULL, NULL)));
+}
+
+void Socket::send(const void* data, size_t size) {
+  CHECK(try_send(data, size)) << "Connection lost: " << strerror(errno);
+}
+
+void Socket::recv(void* data, size_t size) {
+  CHECK(try_recv(data, size)) << "Connection lost: " << strerror(errno);
+}
+
+bool Socket::try_send(const void* data, size_t size) {
+  const char* ptr = reinterpret_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t sent = ::send(fd_, ptr, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    ptr += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+bool Socket::try_recv(void* data, size_t size) {
+  char* ptr = reinterpret_cast<char*>(data);
+  while (size > 0) {
+    const ssize_t received = ::recv(fd_, ptr, size, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      // Closed by the peer, unless an error set errno
+      if (received == 0) {
+        errno = ECONNRESET;
+      }
+      return false;
+    }
+    ptr += received;
+    size -= received;
+  }
+  return true;
+}
+
+//
+
+static void parse_host(const string& host, string* name, int* port) {
+  const size_t colon = host.rfind(':');
+  CHECK(colon != string::npos) << "Expected host:port, got " << host;
+  *name = host.substr(0, colon);
+  *port = boost::lexical_cast<int>(host.substr(colon + 1));
+}
+
+SocketRing::SocketRing(const vector<string>& hosts, int rank)
+    : rank_(rank),
+      size_(hosts.size()) {
+  CHECK_GE(rank_, 0);
+  CHECK_LT(rank_, size_);
+  if (size_ == 1) {
+    return;
+  }
+  string name;
+  int port;
+  parse_host(hosts[rank_], &name, &port);
+  shared_ptr<Socket> listener(Socket::listen(port));
+
+  // Pending connections are queued by listen, so all members can connect
+  // before accepting.
+  parse_host(hosts[(rank_ + 1) % size_], &name, &port);
+  next_ = Socket::connect(name, port);
+  next_->send(&rank_, sizeof(rank_));
+  prev_ = listener->accept();
+  int prev;
+  prev_->recv(&prev, sizeof(prev));
+  CHECK_EQ(prev, (rank_ + size_ - 1) % size_)
+      << "Unexpected connection, check that all members use the same hosts";
+  LOG(INFO) << "Node " << rank_ << " connected to ring of " << size_;
+}
+
+void SocketRing::exchange(const void* send, size_t send_size,
+                          void* recv, size_t recv_size) {
+  boost::thread sender(boost::bind(&Socket::send, next_.get(), send,
+                                   send_size));
+  prev_->recv(recv, recv_size);
+  sender.join();
+}
+
+template<typename Dtype>
+void SocketRing::all_reduce(Dtype* data, size_t count) {
+  const int n = size_;
+  if (n == 1) {
+    return;
+  }
+  vector<size_t> begin(n + 1);
+  for (int i = 0; i <= n; ++i) {
+    begin[i] = count * i / n;
+  }
+  vector<Dtype> buffer(begin[1] + 1);
+  // Reduce-scatter, member r ends with the total of chunk r + 1
+  for (int step = 0; step < n - 1; ++step) {
+    const int send = ((rank_ - step) % n + n) % n;
+    const int recv = ((rank_ - step - 1) % n + n) % n;
+    const size_t send_count = begin[send + 1] - begin[send];
+    const size_t recv_count = begin[recv + 1] - begin[recv];
+    exchange(data + begin[send], send_count * sizeof(Dtype),
+             &buffer[0], recv_count * sizeof(Dtype));
+    for (size_t i = 0; i < recv_count; ++i) {
+      data[begin[recv] + i] += buffer[i];
+    }
+  }
+  // All-gather
+  for (int step = 0; step < n - 1; ++step) {
+    const int send = ((rank_ + 1 - step) % n + n) % n;
+    const int recv = ((rank_ - step) % n + n) % n;
+    const size_t send_count = begin[send + 1] - begin[send];
+    const size_t recv_count = begin[recv + 1] - begin[recv];
+    exchange(data + begin[send], send_count * sizeof(Dtype),
+             data + begin[recv], recv_count * sizeof(Dtype));
+  }
+}
+
+template<typename Dtype>
+void SocketRing::broadcast(Dtype* data, size_t count) {
+  if (size_ == 1) {
+    return;
+  }
+  if (rank_ > 0) {
+    prev_->recv(data, count * sizeof(Dtype));
+  }
+  if (rank_ < size_ - 1) {
+    next_->send(data, count * sizeof(Dtype));
+  }
+}
+
+template<typename Dtype>
+void SocketRing::sparse_all_reduce(const vector<int>& indices,
+                                   const vector<Dtype>& values, Dtype* data,
+                                   size_t count) {
+  CHECK_EQ(indices.size(), values.size());
+  const int n = size_;
+  const size_t pair_size = sizeof(int) + sizeof(Dtype);
+  // The pairs of each member, its values then its indices, so that both
+  // stay aligned
+  vector<vector<char> > pairs(n);
+  vector<char>& own = pairs[rank_];
+  own.resize(indices.size() * pair_size);
+  if (indices.size()) {
+    memcpy(&own[0], &values[0], values.size() * sizeof(Dtype));
+    memcpy(&own[values.size() * sizeof(Dtype)], &indices[0],
+           indices.size() * sizeof(int));
+  }
+  // Step s forwards the pairs received at step s - 1, member r ending with
+  // those of all members
+  for (int step = 0; step < n - 1; ++step) {
+    const int send = ((rank_ - step) % n + n) % n;
+    const int recv = ((rank_ - step - 1) % n + n) % n;
+    uint64_t send_size = pairs[send].size();
+    uint64_t recv_size;
+    exchange(&send_size, sizeof(send_size), &recv_size, sizeof(recv_size));
+    pairs[recv].resize(recv_size);
+    exchange(send_size ? &pairs[send][0] : NULL, send_size,
+             recv_size ? &pairs[recv][0] : NULL, recv_size);
+  }
+  std::fill(data, data + count, Dtype(0));
+  for (int r = 0; r < n; ++r) {
+    const size_t nonzeros = pairs[r].size() / pair_size;
+    if (nonzeros == 0) {
+      continue;
+    }
+    const Dtype* value = reinterpret_cast<const Dtype*>(&pairs[r][0]);
+    const int* index = reinterpret_cast<const int*>(
+        &pairs[r][nonzeros * sizeof(Dtype)]);
+    for (size_t i = 0; i < nonzeros; ++i) {
+      CHECK_LT(index[i], count) << "Sparse index out of range";
+      data[index[i]] += value[i];
+    }
+  }
+}
+
+template void SocketRing::all_reduce<float>(float* data, size_t count);
+template void SocketRing::all_reduce<double>(double* data, size_t count);
+template void SocketRing::broadcast<float>(float* data, size_t count);
+template void SocketRing::broadcast<double>(double* data, size_t count);
+template void SocketRing::sparse_all_reduce<float>(const vector<int>& indices,
+    const vector<float>& values, float* data, size_t count);
+template void SocketRing::sparse_all_reduce<double>(const vector<int>& indices,
+    const vector<double>& values, double* data, size_t count);
+
+}  // namespace caffe
@@ -0,0 +1,139 @@
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <string>
+
+#include "caffe/parallel.hpp"
+#include "caffe/util/spsc_queue.hpp"
+
+namespace caffe {
+
+// Checks of the queue before parking, much shorter than a park and unpark.
+// With a single core the other thread cannot move while this one spins.
+const int kSpins = 2048;
+const int kCacheLine = 64;
+
+static int Spins() {
+  static const int spins =
+      boost::thread::hardware_concurrency() > 1 ? kSpins : 0;
+  return spins;
+}
+
+// The positions only grow, the slot of a position being position & mask_.
+// Each is written by a single thread, on its own cache line.
+template<typename T>
+class SPSCQueue<T>::sync {
+ public:
+  sync() : head_(0), tail_(0), waiting_(0) {}
+
+  boost::atomic<size_t> head_;  // Next to pop, by the consumer
+  char pad0_[kCacheLine];
+  boost::atomic<size_t> tail_;  // Next to push, by the producer
+  char pad1_[kCacheLine];
+  boost::atomic<int> waiting_;  // Threads parked or about to park
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+};
+
+static size_t PowerOfTwo(size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  return size;
+}
+
+template<typename T>
+SPSCQueue<T>::SPSCQueue(size_t capacity)
+    : buffer_(PowerOfTwo(capacity)), mask_(buffer_.size() - 1),
+      sync_(new sync()) {
+}
+
+template<typename T>
+void SPSCQueue<T>::push(const T& t) {
+  size_t tail = sync_->tail_.load(boost::memory_order_relaxed);
+  if (tail - sync_->head_.load(boost::memory_order_acquire) > mask_) {
+    tail = wait(true, "");
+  }
+  buffer_[tail & mask_] = t;
+  sync_->tail_.store(tail + 1, boost::memory_order_release);
+  wake();
+}
+
+template<typename T>
+bool SPSCQueue<T>::try_pop(T* t) {
+  const size_t head = sync_->head_.load(boost::memory_order_relaxed);
+  if (sync_->tail_.load(boost::memory_order_acquire) == head) {
+    return false;
+  }
+  *t = buffer_[head & mask_];
+  sync_->head_.store(head + 1, boost::memory_order_release);
+  wake();
+  return true;
+}
+
+template<typename T>
+T SPSCQueue<T>::pop(const string& log_on_wait) {
+  size_t head = sync_->head_.load(boost::memory_order_relaxed);
+  if (sync_->tail_.load(boost::memory_order_acquire) == head) {
+    head = wait(false, log_on_wait);
+  }
+  T t = buffer_[head & mask_];
+  sync_->head_.store(head + 1, boost::memory_order_release);
+  wake();
+  return t;
+}
+
+template<typename T>
+size_t SPSCQueue<T>::size() const {
+  return sync_->tail_.load(boost::memory_order_acquire)
+      - sync_->head_.load(boost::memory_order_acquire);
+}
+
+template<typename T>
+size_t SPSCQueue<T>::wait(bool room, const string& log_on_wait) {
+  // The position of this thread, only it moves it
+  const size_t own = room ? sync_->tail_.load(boost::memory_order_relaxed)
+      : sync_->head_.load(boost::memory_order_relaxed);
+  boost::atomic<size_t>& other = room ? sync_->head_ : sync_->tail_;
+  const int spins = Spins();
+  for (int i = 0; i < spins; ++i) {
+    const size_t position = other.load(boost::memory_order_acquire);
+    if (room ? own - position <= mask_ : position != own) {
+      return own;
+    }
+  }
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  // Announced before the last check, so that the other thread, moving after
+  // it, sees the announce in wake() and unparks this one.
+  sync_->waiting_.fetch_add(1, boost::memory_order_seq_cst);
+  for (;;) {
+    const size_t position = other.load(boost::memory_order_seq_cst);
+    if (room ? own - position <= mask_ : position != own) {
+      break;
+    }
+    if (!log_on_wait.empty()) {
+      LOG_EVERY_N(INFO, 1000)<< log_on_wait;
+    }
+    sync_->condition_.wait(lock);
+  }
+  sync_->waiting_.fetch_sub(1, boost::memory_order_relaxed);
+  return own;
+}
+
+template<typename T>
+void SPSCQueue<T>::wake() {
+  // Orders the move of the position before the read of waiting_
+  boost::atomic_thread_fence(boost::memory_order_seq_cst);
+  if (sync_->waiting_.load(boost::memory_order_relaxed)) {
+    // Locking waits out a thread between its last check and its park
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    lock.unlock();
+    sync_->condition_.notify_all();
+  }
+}
+
+template class SPSCQueue<int>;
+template class SPSCQueue<P2PSync<float>*>;
+template class SPSCQueue<P2PSync<double>*>;
+
+}  // namespace caffe
@@ -0,0 +1,107 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+
+#include "caffe/util/thread_pool.hpp"
+
+namespace caffe {
+
+class ThreadPool::sync {
+ public:
+  boost::mutex mutex_;
+  boost::condition_variable start_;
+  boost::condition_variable done_;
+  boost::thread_group threads_;
+  // Incremented for each loop, so that threads do not run one twice
+  int generation_;
+  // Chunks of the current loop not processed yet
+  int pending_;
+  bool stop_;
+};
+
+ThreadPool::ThreadPool(int size)
+    : size_(size),
+      sync_(new sync()),
+      loop_(NULL),
+      count_(0),
+      chunks_(0),
+      running_(false) {
+  CHECK_GT(size_, 0);
+  sync_->generation_ = 0;
+  sync_->pending_ = 0;
+  sync_->stop_ = false;
+  // Chunk 0 is processed by the calling thread
+  for (int i = 1; i < size_; ++i) {
+    sync_->threads_.create_thread(boost::bind(&ThreadPool::entry, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    sync_->stop_ = true;
+  }
+  sync_->start_.notify_all();
+  sync_->threads_.join_all();
+}
+
+void ThreadPool::run_chunk(int index) {
+  const int begin = static_cast<int64_t>(count_) * index / chunks_;
+  const int end = static_cast<int64_t>(count_) * (index + 1) / chunks_;
+  (*loop_)(begin, end);
+}
+
+void ThreadPool::entry(int index) {
+  int generation = 0;
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  for (;;) {
+    while (sync_->generation_ == generation && !sync_->stop_) {
+      sync_->start_.wait(lock);
+    }
+    if (sync_->stop_) {
+      return;
+    }
+    generation = sync_->generation_;
+    if (index < chunks_) {
+      lock.unlock();
+      run_chunk(index);
+      lock.lock();
+      if (--sync_->pending_ == 0) {
+        sync_->done_.notify_one();
+      }
+    }
+  }
+}
+
+void ThreadPool::run(int count, int grain,
+                     const boost::function<void(int, int)>& loop) {
+  const int chunks = std::min(size_, std::max(1, count / std::max(grain, 1)));
+  if (chunks == 1 || running_) {
+    if (count > 0) {
+      loop(0, count);
+    }
+    return;
+  }
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    loop_ = &loop;
+    count_ = count;
+    chunks_ = chunks;
+    sync_->pending_ = chunks - 1;
+    ++sync_->generation_;
+  }
+  sync_->start_.notify_all();
+  running_ = true;
+  run_chunk(0);
+  running_ = false;
+  // The other chunks use the loop, so interrupting the wait, as a stopping
+  // prefetch thread would, cannot return before they are done
+  boost::this_thread::disable_interruption no_interruption;
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  while (sync_->pending_ > 0) {
+    sync_->done_.wait(lock);
+  }
+}
+
+}  // namespace caffe
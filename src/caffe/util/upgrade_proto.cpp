@@ -1,9 +1,18 @@
+#include <boost/thread/mutex.hpp>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/text_format.h>
+#include <stdint.h>
+#include <unistd.h>
 
+#include <cstdio>
+#include <fstream>  // NOLINT(readability/streams)
+#include <iomanip>
+#include <iterator>
 #include <map>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
@@ -583,15 +592,58 @@ void UpgradeNetDataTransformation(NetParameter* net_param) {
   }
 }
 
+typedef google::protobuf::RepeatedPtrField<BlobProto> LayerBlobs;
+
+// The upgrades copy the layers they upgrade, so the blobs of the layers are
+// swapped out of the net before and into the upgraded layers after, for the
+// weights of a model to be moved rather than copied. There is an entry for
+// each layer the upgrade makes, in order. The vector is sized before the
+// swaps, as growing it would copy the blobs.
+static void ReleaseV0Blobs(NetParameter* param, vector<LayerBlobs>* blobs) {
+  int kept = 0;
+  for (int i = 0; i < param->layers_size(); ++i) {
+    kept += (param->layers(i).layer().type() != "padding");
+  }
+  blobs->clear();
+  blobs->resize(kept);
+  for (int i = 0, j = 0; i < param->layers_size(); ++i) {
+    V1LayerParameter* layer = param->mutable_layers(i);
+    // Padding layers have no blobs and are removed by the upgrade
+    if (layer->layer().type() == "padding") {
+      continue;
+    }
+    if (layer->has_layer()) {
+      (*blobs)[j].Swap(layer->mutable_layer()->mutable_blobs());
+    }
+    ++j;
+  }
+}
+
+static void ReleaseV1Blobs(NetParameter* param, vector<LayerBlobs>* blobs) {
+  blobs->clear();
+  blobs->resize(param->layers_size());
+  for (int i = 0; i < param->layers_size(); ++i) {
+    (*blobs)[i].Swap(param->mutable_layers(i)->mutable_blobs());
+  }
+}
+
 bool UpgradeNetAsNeeded(const string& param_file, NetParameter* param) {
   bool success = true;
+  vector<LayerBlobs> blobs;
   if (NetNeedsV0ToV1Upgrade(*param)) {
     // NetParameter was specified using the old style (V0LayerParameter); try to
     // upgrade it.
     LOG(INFO) << "Attempting to upgrade input file specified using deprecated "
               << "V0LayerParameter: " << param_file;
-    NetParameter original_param(*param);
-    if (!UpgradeV0Net(original_param, param)) {
+    NetParameter original_param;
+    original_param.Swap(param);
+    ReleaseV0Blobs(&original_param, &blobs);
+    const bool upgraded = UpgradeV0Net(original_param, param);
+    CHECK_EQ(param->layers_size(), blobs.size());
+    for (int i = 0; i < blobs.size(); ++i) {
+      param->mutable_layers(i)->mutable_blobs()->Swap(&blobs[i]);
+    }
+    if (!upgraded) {
       success = false;
       LOG(ERROR) << "Warning: had one or more problems upgrading "
           << "V0NetParameter to NetParameter (see above); continuing anyway.";
@@ -617,8 +669,15 @@ bool UpgradeNetAsNeeded(const string& param_file, NetParameter* param) {
   if (NetNeedsV1ToV2Upgrade(*param)) {
     LOG(INFO) << "Attempting to upgrade input file specified using deprecated "
               << "V1LayerParameter: " << param_file;
-    NetParameter original_param(*param);
-    if (!UpgradeV1Net(original_param, param)) {
+    NetParameter original_param;
+    original_param.Swap(param);
+    ReleaseV1Blobs(&original_param, &blobs);
+    const bool upgraded = UpgradeV1Net(original_param, param);
+    CHECK_EQ(param->layer_size(), blobs.size());
+    for (int i = 0; i < blobs.size(); ++i) {
+      param->mutable_layer(i)->mutable_blobs()->Swap(&blobs[i]);
+    }
+    if (!upgraded) {
       success = false;
       LOG(ERROR) << "Warning: had one or more problems upgrading "
                  << "V1LayerParameter (see above); continuing anyway.";
@@ -934,7 +993,99 @@ void ReadNetParamsFromBinaryFileOrDie(const string& param_file,
                                       NetParameter* param) {
   CHECK(ReadProtoFromBinaryFile(param_file, param))
       << "Failed to parse NetParameter file: " << param_file;
+  if (NetNeedsUpgrade(*param) || NetNeedsDataUpgrade(*param)) {
+    LOG(WARNING) << "Upgrading " << param_file << " at each load; upgrade it "
+        << "once with ./build/tools/upgrade_net_proto_binary, to a .mmap "
+        << "file for the fastest loads.";
+  }
   UpgradeNetAsNeeded(param_file, param);
 }
 
+// The directory of the compiled nets, shared by all threads.
+struct NetCache {
+  boost::mutex mutex;
+  string dir;
+};
+static NetCache net_cache;
+
+// Changes the names of the cached nets when Net::Compile changes the nets it
+// makes, or the layers their parameters.
+const uint64_t kNetCacheVersion = 1;
+
+void SetNetCacheDir(const string& dir) {
+  boost::mutex::scoped_lock lock(net_cache.mutex);
+  net_cache.dir = dir;
+}
+
+// FNV-1a, the same in every run and build
+static uint64_t HashBytes(const char* data, size_t size, uint64_t hash) {
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(data[i]))
+        * uint64_t(0x100000001b3u);
+  }
+  return hash;
+}
+
+string NetCacheFile(const string& param_file, Phase phase) {
+  string dir;
+  {
+    boost::mutex::scoped_lock lock(net_cache.mutex);
+    dir = net_cache.dir;
+  }
+  if (dir.empty()) {
+    return "";
+  }
+  std::ifstream file(param_file.c_str(), std::ios::binary);
+  CHECK(file) << "File not found: " << param_file;
+  const string text((std::istreambuf_iterator<char>(file)),
+                    std::istreambuf_iterator<char>());
+  const int32_t key[] = {phase, static_cast<int32_t>(kNetCacheVersion)};
+  uint64_t hash = HashBytes(text.data(), text.size(),
+                            uint64_t(0xcbf29ce484222325u));
+  hash = HashBytes(reinterpret_cast<const char*>(key), sizeof(key), hash);
+  std::ostringstream filename;
+  filename << dir << "/" << std::hex << std::setfill('0') << std::setw(16)
+           << hash << ".net";
+  return filename.str();
+}
+
+bool ReadCachedNet(const string& param_file, Phase phase,
+    NetParameter* param) {
+  const string filename = NetCacheFile(param_file, phase);
+  if (filename.empty() || access(filename.c_str(), R_OK) != 0) {
+    return false;
+  }
+  if (!ReadProtoFromBinaryFile(filename, param) || !param->compiled()) {
+    LOG(WARNING) << "Ignoring the invalid cached net " << filename;
+    param->Clear();
+    return false;
+  }
+  LOG(INFO) << "Read net " << param_file << " compiled in " << filename;
+  return true;
+}
+
+void CacheNet(const string& param_file, Phase phase,
+    const NetParameter& param) {
+  const string filename = NetCacheFile(param_file, phase);
+  if (filename.empty()) {
+    return;
+  }
+  // Written to a file of this process, then renamed, so that processes
+  // sharing the directory only ever read whole nets.
+  std::ostringstream temp_filename;
+  temp_filename << filename << "." << getpid();
+  {
+    std::ofstream file(temp_filename.str().c_str(),
+                       std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!file || !param.SerializeToOstream(&file)) {
+      LOG(WARNING) << "Cannot write the cached net " << temp_filename.str();
+      return;
+    }
+  }
+  if (rename(temp_filename.str().c_str(), filename.c_str()) != 0) {
+    LOG(WARNING) << "Cannot write the cached net " << filename;
+    remove(temp_filename.str().c_str());
+  }
+}
+
 }  // namespace caffe
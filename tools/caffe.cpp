@@ -5,16 +5,26 @@ namespace bp = boost::python;
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
 #include <map>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "boost/algorithm/string.hpp"
+#include "boost/bind.hpp"
+#include "boost/thread.hpp"
 #include "caffe/caffe.hpp"
+#include "caffe/data_layers.hpp"
+#include "caffe/model_server.hpp"
+#include "caffe/util/numa.hpp"
+#include "caffe/util/upgrade_proto.hpp"
 
 using caffe::Blob;
 using caffe::Caffe;
+using caffe::DataStats;
 using caffe::Net;
 using caffe::Layer;
 using caffe::Solver;
@@ -34,11 +44,88 @@ DEFINE_string(model, "",
     "The model definition protocol buffer text file..");
 DEFINE_string(snapshot, "",
     "Optional; the snapshot solver state to resume training.");
+DEFINE_string(gpu_file, "",
+    "Optional; train on the device IDs listed in this file, separated by "
+    "','. It is read again at each snapshot: if the list changed, training "
+    "goes on from that snapshot on the new devices, in the same process.");
 DEFINE_string(weights, "",
     "Optional; the pretrained weights to initialize finetuning, "
     "separated by ','. Cannot be set simultaneously with snapshot.");
 DEFINE_int32(iterations, 50,
     "The number of iterations to run.");
+DEFINE_string(nodes, "",
+    "Optional; train on several machines, given as host:port separated by "
+    "','. Each machine runs the same command with its own -node_rank, on "
+    "its own shard of the training data.");
+DEFINE_int32(node_rank, 0,
+    "Optional; position of this machine in the -nodes list.");
+DEFINE_int32(cpu_threads, 1,
+    "Optional; the number of threads running CPU layers, per solver.");
+DEFINE_int32(executor_threads, 0,
+    "Optional; load the batches of all data layers on a pool of this many "
+    "threads shared by the process instead of threads of their own.");
+DEFINE_int32(cpu_solvers, 1,
+    "Optional; train on CPU with this many solvers, each on a thread of its "
+    "own computing the gradients of its share of the batch.");
+DEFINE_bool(numa_affinity, false,
+    "Optional; run the threads serving each GPU on the CPUs of its NUMA "
+    "node, keeping their pinned host memory on that node, and spread the "
+    "-cpu_solvers over the NUMA nodes.");
+DEFINE_bool(managed_memory, false,
+    "Optional; allocate the blobs as CUDA managed memory, migrating only the "
+    "pages the host touches and letting them exceed the GPU memory.");
+DEFINE_int32(huge_pages, 0,
+    "Optional; in CPU mode, back the blobs of at least this many MB with "
+    "huge pages, transparent ones unless -hugetlbfs.");
+DEFINE_bool(hugetlbfs, false,
+    "Optional; with -huge_pages, take the huge pages from the hugetlbfs "
+    "pool reserved in /proc/sys/vm/nr_hugepages while it lasts.");
+DEFINE_bool(fail_on_transfer, false,
+    "Optional; time: after the first iteration, stop at the first copy "
+    "between host and device a layer triggers by reading data on the side "
+    "it is not at.");
+DEFINE_string(cudnn_algo_cache, "",
+    "Optional; the file keeping the cuDNN algorithms autotuned by "
+    "Convolution layers with cudnn_autotune, across runs.");
+DEFINE_string(engine_cache, "",
+    "Optional; the file keeping the engines timed fastest for layers with "
+    "engine AUTO, across runs. Defaults to the -cudnn_algo_cache file with "
+    ".engines appended, if that is set.");
+DEFINE_string(net_cache, "",
+    "Optional; the directory keeping the nets compiled from -model "
+    "prototxts, so that later runs skip parsing and compiling them.");
+DEFINE_int32(clients, 64,
+    "The number of threads sending single items to serve.");
+DEFINE_int32(max_batch, 32,
+    "The largest batch of items served by one forward pass.");
+DEFINE_int32(max_delay_us, 2000,
+    "The longest time in microseconds an item waits for its batch to fill.");
+DEFINE_int32(port, 0,
+    "Optional; serve: the port to serve the -model nets on over HTTP, "
+    "instead of benchmarking them with -clients.");
+DEFINE_int32(metrics_port, 0,
+    "Optional; train: the port to serve the metrics of training on over "
+    "HTTP, at /metrics in the Prometheus text format.");
+DEFINE_int32(instances, 2,
+    "Optional; serve: the number of inference contexts of each net on each "
+    "device when serving on a -port.");
+DEFINE_int32(batch_size, 0,
+    "Optional; memory: the batch size of the inputs and data layers to size "
+    "the model for, instead of their own.");
+DEFINE_int32(memory_budget, 0,
+    "Optional; fit_batch: the memory in MB the model may use, by default 90% "
+    "of the free memory of the -gpu device.");
+DEFINE_string(phase, "TRAIN",
+    "Optional; fit_batch: size the model for TRAIN, forward and backward "
+    "passes, or for TEST, forward passes alone.");
+DEFINE_bool(batch_throughput, false,
+    "Optional; fit_batch: also time -iterations passes at each batch size "
+    "that fits, on the -gpu device.");
+DEFINE_string(prefetch, "",
+    "Optional; bench_data: the prefetch counts to sweep, separated by ','.");
+DEFINE_string(loader_threads, "",
+    "Optional; bench_data: the loader thread counts to sweep, separated by "
+    "','.");
 
 // A simple registry for caffe commands.
 typedef int (*BrewFunction)();
@@ -93,6 +180,22 @@ static void get_gpus(vector<int>* gpus) {
   }
 }
 
+// Parse a list of counts, or return the given default
+static vector<int> get_counts(const string& list, int count) {
+  vector<int> counts;
+  if (list.empty()) {
+    counts.push_back(count);
+    return counts;
+  }
+  vector<string> strings;
+  boost::split(strings, list, boost::is_any_of(","));
+  for (int i = 0; i < strings.size(); ++i) {
+    counts.push_back(boost::lexical_cast<int>(strings[i]));
+    CHECK_GT(counts.back(), 0);
+  }
+  return counts;
+}
+
 // caffe commands to call by
 //     caffe <command> <args>
 //
@@ -112,6 +215,38 @@ int device_query() {
 }
 RegisterBrewFunction(device_query);
 
+// Reads the GPU ids of -gpu_file. Returns false, leaving gpus as they are,
+// if the file cannot be read or lists no device.
+static bool read_gpu_file(vector<int>* gpus) {
+  std::ifstream file(FLAGS_gpu_file.c_str());
+  std::stringstream content;
+  content << file.rdbuf();
+  string list = content.str();
+  boost::trim(list);
+  if (!file || list.empty()) {
+    LOG(WARNING) << "Cannot read GPUs from " << FLAGS_gpu_file;
+    return false;
+  }
+  vector<string> strings;
+  boost::split(strings, list, boost::is_any_of(", \n"),
+               boost::token_compress_on);
+  gpus->clear();
+  for (int i = 0; i < strings.size(); ++i) {
+    gpus->push_back(boost::lexical_cast<int>(strings[i]));
+  }
+  return true;
+}
+
+// Called at each snapshot with -gpu_file, stops training if the GPUs changed
+static bool gpus_changed(vector<int>* gpus) {
+  vector<int> listed;
+  if (!read_gpu_file(&listed) || listed == *gpus) {
+    return false;
+  }
+  *gpus = listed;
+  return true;
+}
+
 // Load the weights from the specified caffemodel(s) into the train and
 // test nets.
 void CopyLayers(caffe::Solver<float>* solver, const std::string& model_list) {
@@ -135,10 +270,20 @@ int train() {
 
   caffe::SolverParameter solver_param;
   caffe::ReadProtoFromTextFileOrDie(FLAGS_solver, &solver_param);
+  vector<string> nodes;
+  if (FLAGS_nodes.size()) {
+    boost::split(nodes, FLAGS_nodes, boost::is_any_of(","));
+    Caffe::set_nodes(FLAGS_node_rank, nodes.size());
+  }
+  if (FLAGS_node_rank > 0) {
+    // All machines hold the same weights, only the first one snapshots
+    solver_param.set_snapshot(0);
+    solver_param.set_snapshot_after_train(false);
+  }
 
   // If the gpus flag is not provided, allow the mode and device to be set
   // in the solver prototxt.
-  if (FLAGS_gpu.size() == 0
+  if (FLAGS_gpu.size() == 0 && FLAGS_gpu_file.size() == 0
       && solver_param.solver_mode() == caffe::SolverParameter_SolverMode_GPU) {
       if (solver_param.has_device_id()) {
           FLAGS_gpu = ""  +
@@ -149,39 +294,96 @@ int train() {
   }
 
   vector<int> gpus;
-  get_gpus(&gpus);
-  if (gpus.size() == 0) {
-    Caffe::set_mode(Caffe::CPU);
-  } else {
-    ostringstream s;
-    for (int i = 0; i < gpus.size(); ++i) {
-      s << (i ? ", " : "") << gpus[i];
+  if (FLAGS_gpu_file.size()) {
+    CHECK(!FLAGS_gpu.size() && !FLAGS_nodes.size() && FLAGS_cpu_solvers == 1)
+        << "Give -gpu_file without -gpu, -nodes or -cpu_solvers.";
+    CHECK(read_gpu_file(&gpus));
+    // The solvers created again when the GPUs change reuse the parsed net
+    if (solver_param.has_net()) {
+      caffe::ReadNetParamsFromTextFileOrDie(solver_param.net(),
+          solver_param.mutable_net_param());
+      solver_param.clear_net();
     }
-    LOG(INFO) << "Using GPUs " << s.str();
+  } else {
+    get_gpus(&gpus);
+  }
+  CHECK(FLAGS_cpu_solvers == 1 || gpus.size() == 0)
+      << "Give either GPUs or CPU solvers to train on, not both.";
+  CHECK_GE(FLAGS_cpu_solvers, 1);
 
-    solver_param.set_device_id(gpus[0]);
-    Caffe::SetDevice(gpus[0]);
-    Caffe::set_mode(Caffe::GPU);
-    Caffe::set_solver_count(gpus.size());
+  // Served from a thread that runs until the process exits
+  static shared_ptr<caffe::Metrics> metrics;
+  if (FLAGS_metrics_port > 0) {
+    metrics.reset(new caffe::Metrics());
+    metrics->Serve(FLAGS_metrics_port);
   }
 
-  shared_ptr<Solver<float> > solver(caffe::GetSolver<float>(solver_param));
+  shared_ptr<Solver<float> > solver;
+  string resume = FLAGS_snapshot;
+  for (;;) {
+    if (gpus.size() == 0) {
+      Caffe::set_mode(Caffe::CPU);
+      Caffe::set_solver_count(FLAGS_cpu_solvers);
+    } else {
+      ostringstream s;
+      for (int i = 0; i < gpus.size(); ++i) {
+        s << (i ? ", " : "") << gpus[i];
+      }
+      LOG(INFO) << "Using GPUs " << s.str();
 
-  if (FLAGS_snapshot.size()) {
-    LOG(INFO) << "Resuming from " << FLAGS_snapshot;
-    solver->Restore(FLAGS_snapshot.c_str());
-  } else if (FLAGS_weights.size()) {
-    CopyLayers(solver.get(), FLAGS_weights);
-  }
+      solver_param.set_device_id(gpus[0]);
+      Caffe::SetDevice(gpus[0]);
+      Caffe::set_mode(Caffe::GPU);
+      Caffe::set_solver_count(gpus.size());
+    }
 
-  if (gpus.size() > 1) {
-    caffe::P2PSync<float> sync(solver, NULL, solver->param());
-    sync.run(gpus);
-  } else {
-    LOG(INFO) << "Starting Optimization";
-    solver->Solve();
+    // The data readers of the last solver stop before the new ones start,
+    // sharding the data for the new solver count
+    solver.reset();
+    solver.reset(caffe::GetSolver<float>(solver_param));
+
+    if (resume.size()) {
+      LOG(INFO) << "Resuming from " << resume;
+      solver->Restore(resume.c_str());
+    } else if (FLAGS_weights.size()) {
+      CopyLayers(solver.get(), FLAGS_weights);
+    }
+    if (metrics) {
+      solver->set_metrics(metrics);
+    }
+    vector<int> next_gpus(gpus);
+    if (FLAGS_gpu_file.size()) {
+      solver->set_stop_at_snapshot(boost::bind(&gpus_changed, &next_gpus));
+    }
+
+    if (FLAGS_nodes.size()) {
+      CHECK_GT(gpus.size(), 0) << "Multi-node training requires GPUs.";
+      caffe::NodeSync<float> sync(solver, solver->param(), nodes,
+                                  FLAGS_node_rank);
+      sync.run(gpus);
+    } else if (gpus.size() > 1) {
+      caffe::P2PSync<float> sync(solver, NULL, solver->param());
+      sync.run(gpus);
+    } else if (FLAGS_cpu_solvers > 1) {
+      caffe::CPUSync<float> sync(solver, NULL, solver->param());
+      sync.run();
+    } else {
+      LOG(INFO) << "Starting Optimization";
+      solver->Solve();
+    }
+    if (solver->iter() >= solver->param().max_iter()) {
+      break;
+    }
+    resume = solver->SnapshotStateFilename();
+    gpus = next_gpus;
   }
   LOG(INFO) << "Optimization Done.";
+#ifndef CPU_ONLY
+  if (gpus.size()) {
+    caffe::CaffeLogMemoryStats();
+  }
+#endif
+  caffe::CaffeLogHugePageStats();
   return 0;
 }
 RegisterBrewFunction(train);
@@ -192,36 +394,41 @@ int test() {
   CHECK_GT(FLAGS_model.size(), 0) << "Need a model definition to score.";
   CHECK_GT(FLAGS_weights.size(), 0) << "Need model weights to score.";
 
-  // Set device id and mode
+  // Set device ids and mode. With several GPUs each runs a replica of the
+  // net, and the iterations are spread over them.
   vector<int> gpus;
   get_gpus(&gpus);
   if (gpus.size() != 0) {
-    LOG(INFO) << "Use GPU with device ID " << gpus[0];
+    LOG(INFO) << "Use GPUs with device IDs " << FLAGS_gpu;
     Caffe::SetDevice(gpus[0]);
     Caffe::set_mode(Caffe::GPU);
   } else {
     LOG(INFO) << "Use CPU.";
     Caffe::set_mode(Caffe::CPU);
+    gpus.push_back(-1);
   }
-  // Instantiate the caffe net.
-  Net<float> caffe_net(FLAGS_model, caffe::TEST);
-  caffe_net.CopyTrainedLayersFrom(FLAGS_weights);
+  CHECK_EQ(FLAGS_iterations % gpus.size(), 0)
+      << "The iterations must be a multiple of the number of GPUs.";
+  // Instantiate the caffe nets.
+  caffe::NetParameter net_param;
+  caffe::ReadNetParamsFromTextFileOrDie(FLAGS_model, &net_param);
+  caffe::NetReplicas<float> replicas(net_param, FLAGS_weights, gpus);
+  const Net<float>& caffe_net = replicas.net(0);
   LOG(INFO) << "Running for " << FLAGS_iterations << " iterations.";
 
-  vector<Blob<float>* > bottom_vec;
+  vector<float> iter_losses;
+  vector<vector<float> > iter_outputs;
+  replicas.Forward(FLAGS_iterations, &iter_losses, &iter_outputs);
   vector<int> test_score_output_id;
   vector<float> test_score;
   float loss = 0;
   for (int i = 0; i < FLAGS_iterations; ++i) {
-    float iter_loss;
-    const vector<Blob<float>*>& result =
-        caffe_net.Forward(bottom_vec, &iter_loss);
-    loss += iter_loss;
+    loss += iter_losses[i];
     int idx = 0;
-    for (int j = 0; j < result.size(); ++j) {
-      const float* result_vec = result[j]->cpu_data();
-      for (int k = 0; k < result[j]->count(); ++k, ++idx) {
-        const float score = result_vec[k];
+    for (int j = 0; j < caffe_net.output_blobs().size(); ++j) {
+      const int count = caffe_net.output_blobs()[j]->count();
+      for (int k = 0; k < count; ++k, ++idx) {
+        const float score = iter_outputs[i][idx];
         if (i == 0) {
           test_score.push_back(score);
           test_score_output_id.push_back(j);
@@ -255,8 +462,191 @@ int test() {
 RegisterBrewFunction(test);
 
 
+// The total time the data layers of a net waited for batches since the last
+// call, in microseconds.
+static double data_wait(Net<float>* net) {
+  double wait = 0;
+  for (int i = 0; i < net->layers().size(); ++i) {
+    caffe::BasePrefetchingDataLayer<float>* layer =
+        dynamic_cast<caffe::BasePrefetchingDataLayer<float>*>(
+            net->layers()[i].get());
+    if (layer) {
+      DataStats stats;
+      layer->collect_data_stats(&stats);
+      wait += stats.total(DataStats::WAIT);
+    }
+  }
+  return wait;
+}
+
+// The bytes of device memory held by the data and diff of a blob
+static size_t gpu_bytes(const Blob<float>& blob) {
+  size_t bytes = 0;
+  const shared_ptr<caffe::SyncedMemory> memory[] = {blob.data(), blob.diff()};
+  for (int i = 0; i < 2; ++i) {
+    if (memory[i] && (memory[i]->head() == caffe::SyncedMemory::HEAD_AT_GPU
+        || memory[i]->head() == caffe::SyncedMemory::SYNCED)) {
+      bytes += memory[i]->size();
+    }
+  }
+  return bytes;
+}
+
+// Logs the device memory held by each blob and layer of a net. Blobs sharing
+// memory count for each of them.
+static void log_gpu_memory(Net<float>* net) {
+  LOG(INFO) << "Device memory per blob:";
+  for (int i = 0; i < net->blobs().size(); ++i) {
+    LOG(INFO) << std::setfill(' ') << std::setw(10) << net->blob_names()[i]
+              << "\t" << gpu_bytes(*net->blobs()[i]) / 1048576.0 << " MB";
+  }
+  LOG(INFO) << "Device memory per layer, for its params and tops:";
+  for (int i = 0; i < net->layers().size(); ++i) {
+    size_t params = 0;
+    size_t tops = 0;
+    const vector<shared_ptr<Blob<float> > >& blobs =
+        net->layers()[i]->blobs();
+    for (int j = 0; j < blobs.size(); ++j) {
+      params += gpu_bytes(*blobs[j]);
+    }
+    for (int j = 0; j < net->top_vecs()[i].size(); ++j) {
+      tops += gpu_bytes(*net->top_vecs()[i][j]);
+    }
+    LOG(INFO) << std::setfill(' ') << std::setw(10) << net->layer_names()[i]
+              << "\tparams: " << params / 1048576.0 << " MB, tops: "
+              << tops / 1048576.0 << " MB";
+  }
+#ifndef CPU_ONLY
+  caffe::CaffeLogMemoryStats();
+#endif
+}
+
+// Starts timing the root solver once the first iteration, which allocates
+// memory and fills the prefetch queues, is done.
+class StepTimingStart : public Solver<float>::Callback {
+ public:
+  explicit StepTimingStart(Solver<float>* solver)
+      : solver_(solver), started_(false) {}
+  // The implicit copies on the thread of the root solver when timing started
+  const caffe::TransferCount& transfers() const { return transfers_; }
+
+ protected:
+  virtual void on_start() {}
+  virtual void on_gradients_ready() {}
+  virtual void on_update_applied() {
+    if (!started_) {
+      data_wait(solver_->net().get());
+      solver_->set_step_timing(true);
+      solver_->net()->set_fail_on_transfer(FLAGS_fail_on_transfer);
+      transfers_ = caffe::CaffeTransferCount();
+      started_ = true;
+    }
+  }
+
+  Solver<float>* solver_;
+  bool started_;
+  caffe::TransferCount transfers_;
+};
+
+// Logs the implicit copies between host and device since start, per
+// iteration.
+static void log_transfers(const caffe::TransferCount& start) {
+  const caffe::TransferCount& end = caffe::CaffeTransferCount();
+  const char* names[] = {"to host", "to device"};
+  for (int i = 0; i < 2; ++i) {
+    LOG(INFO) << "Implicit copies " << names[i] << ": "
+              << (end.calls[i] - start.calls[i]) / FLAGS_iterations
+              << " per iteration, "
+              << (end.bytes[i] - start.bytes[i]) / 1048576 / FLAGS_iterations
+              << " MB, "
+              << (end.us[i] - start.us[i]) / 1000 / FLAGS_iterations
+              << " ms.";
+  }
+}
+
+// Time: full training iterations of a solver, with data, sync and update.
+static int time_solver() {
+  caffe::SolverParameter solver_param;
+  caffe::ReadProtoFromTextFileOrDie(FLAGS_solver, &solver_param);
+  // Plus the untimed first iteration
+  solver_param.set_max_iter(FLAGS_iterations + 1);
+  solver_param.set_snapshot_after_train(false);
+  // The data wait is taken from the counters of the data layers
+  solver_param.set_data_stats_interval(0);
+
+  vector<int> gpus;
+  get_gpus(&gpus);
+  if (gpus.size() != 0) {
+    LOG(INFO) << "Use " << gpus.size() << " GPUs, the first with device ID "
+              << gpus[0];
+    solver_param.set_device_id(gpus[0]);
+    Caffe::SetDevice(gpus[0]);
+    Caffe::set_mode(Caffe::GPU);
+    Caffe::set_solver_count(gpus.size());
+  } else {
+    LOG(INFO) << "Use CPU.";
+    Caffe::set_mode(Caffe::CPU);
+  }
+  shared_ptr<Solver<float> > solver(caffe::GetSolver<float>(solver_param));
+  if (FLAGS_weights.size()) {
+    CopyLayers(solver.get(), FLAGS_weights);
+  }
+  StepTimingStart start(solver.get());
+  LOG(INFO) << "*** Benchmark begins ***";
+  LOG(INFO) << "Testing for " << FLAGS_iterations << " iterations.";
+  if (gpus.size() > 1) {
+    caffe::P2PSync<float> sync(solver, NULL, solver->param());
+    // After the callback of the sync, which runs first
+    solver->add_callback(&start);
+    sync.run(gpus);
+  } else {
+    solver->add_callback(&start);
+    solver->Solve();
+  }
+  const char* names[] = {"test", "sync", "forward", "backward", "update",
+                         "snapshot"};
+  double total = 0;
+  for (int i = 0; i < Solver<float>::NUM_STEP_PHASES; ++i) {
+    total += solver->step_time(static_cast<Solver<float>::StepPhase>(i));
+  }
+  const double wait = data_wait(solver->net().get());
+  for (int i = 0; i < Solver<float>::NUM_STEP_PHASES; ++i) {
+    const double phase =
+        solver->step_time(static_cast<Solver<float>::StepPhase>(i));
+    ostringstream wait_msg;
+    if (i == Solver<float>::STEP_FORWARD) {
+      wait_msg << " (data wait " << wait / 1000 / FLAGS_iterations << " ms)";
+    }
+    LOG(INFO) << std::setfill(' ') << std::setw(10) << names[i] << ": "
+              << phase / 1000 / FLAGS_iterations << " ms per iteration, "
+              << 100 * phase / total << "%" << wait_msg.str();
+  }
+  LOG(INFO) << "Average iteration: " << total / 1000 / FLAGS_iterations
+            << " ms.";
+  // The batch of the first layer without bottoms, usually the data layer
+  Net<float>* net = solver->net().get();
+  for (int i = 0; i < net->layers().size(); ++i) {
+    if (net->bottom_vecs()[i].empty() && net->top_vecs()[i].size()) {
+      const int samples = net->top_vecs()[i][0]->shape(0)
+          * solver_param.iter_size() * std::max<int>(gpus.size(), 1);
+      LOG(INFO) << "Throughput: " << samples * FLAGS_iterations * 1e6 / total
+                << " samples/s.";
+      break;
+    }
+  }
+  if (Caffe::mode() == Caffe::GPU) {
+    log_transfers(start.transfers());
+    log_gpu_memory(net);
+  }
+  LOG(INFO) << "*** Benchmark ends ***";
+  return 0;
+}
+
 // Time: benchmark the execution time of a model.
 int time() {
+  if (FLAGS_solver.size()) {
+    return time_solver();
+  }
   CHECK_GT(FLAGS_model.size(), 0) << "Need a model definition to time.";
 
   // Set device id and mode
@@ -295,9 +685,12 @@ int time() {
   total_timer.Start();
   Timer forward_timer;
   Timer backward_timer;
-  Timer timer;
-  std::vector<double> forward_time_per_layer(layers.size(), 0.0);
-  std::vector<double> backward_time_per_layer(layers.size(), 0.0);
+  // Layer i forward, then layers.size() + i backward, read at the end so
+  // that timing the layers does not wait for each
+  caffe::EventTimer timer;
+  std::vector<int> transfers_per_layer(layers.size(), 0);
+  const caffe::TransferCount& transfers = caffe::CaffeTransferCount();
+  const caffe::TransferCount start_transfers = transfers;
   double forward_time = 0.0;
   double backward_time = 0.0;
   for (int j = 0; j < FLAGS_iterations; ++j) {
@@ -305,31 +698,63 @@ int time() {
     iter_timer.Start();
     forward_timer.Start();
     for (int i = 0; i < layers.size(); ++i) {
-      timer.Start();
+      const int calls = transfers.calls[0] + transfers.calls[1];
+      if (FLAGS_fail_on_transfer) {
+        caffe::CaffeFailOnTransfer(layers[i]->layer_param().name().c_str());
+      }
+      timer.Start(i);
       layers[i]->Forward(bottom_vecs[i], top_vecs[i]);
-      forward_time_per_layer[i] += timer.MicroSeconds();
+      timer.Stop(i);
+      transfers_per_layer[i] += transfers.calls[0] + transfers.calls[1]
+          - calls;
     }
     forward_time += forward_timer.MicroSeconds();
     backward_timer.Start();
     for (int i = layers.size() - 1; i >= 0; --i) {
-      timer.Start();
+      const int calls = transfers.calls[0] + transfers.calls[1];
+      if (FLAGS_fail_on_transfer) {
+        caffe::CaffeFailOnTransfer(layers[i]->layer_param().name().c_str());
+      }
+      timer.Start(layers.size() + i);
       layers[i]->Backward(top_vecs[i], bottom_need_backward[i],
                           bottom_vecs[i]);
-      backward_time_per_layer[i] += timer.MicroSeconds();
+      timer.Stop(layers.size() + i);
+      transfers_per_layer[i] += transfers.calls[0] + transfers.calls[1]
+          - calls;
     }
+    caffe::CaffeFailOnTransfer(NULL);
     backward_time += backward_timer.MicroSeconds();
     LOG(INFO) << "Iteration: " << j + 1 << " forward-backward time: "
       << iter_timer.MilliSeconds() << " ms.";
   }
-  LOG(INFO) << "Average time per layer: ";
+  timer.Synchronize();
+  LOG(INFO) << "Average time per layer, with the GFLOP/s and GB/s achieved: ";
   for (int i = 0; i < layers.size(); ++i) {
     const caffe::string& layername = layers[i]->layer_param().name();
+    const double forward_us = timer.MicroSeconds(i) / FLAGS_iterations;
+    const double backward_us =
+        timer.MicroSeconds(layers.size() + i) / FLAGS_iterations;
     LOG(INFO) << std::setfill(' ') << std::setw(10) << layername <<
-      "\tforward: " << forward_time_per_layer[i] / 1000 /
-      FLAGS_iterations << " ms.";
+      "\tforward: " << forward_us / 1000 << " ms, " <<
+      layers[i]->ForwardFlops(bottom_vecs[i], top_vecs[i]) / forward_us / 1000
+      << " GFLOP/s, " <<
+      layers[i]->ForwardBytes(bottom_vecs[i], top_vecs[i]) / forward_us / 1000
+      << " GB/s.";
     LOG(INFO) << std::setfill(' ') << std::setw(10) << layername  <<
-      "\tbackward: " << backward_time_per_layer[i] / 1000 /
-      FLAGS_iterations << " ms.";
+      "\tbackward: " << backward_us / 1000 << " ms, " <<
+      layers[i]->BackwardFlops(bottom_vecs[i], top_vecs[i]) / backward_us /
+      1000 << " GFLOP/s, " <<
+      layers[i]->BackwardBytes(bottom_vecs[i], top_vecs[i]) / backward_us /
+      1000 << " GB/s.";
+    if (transfers_per_layer[i]) {
+      LOG(INFO) << std::setfill(' ') << std::setw(10) << layername <<
+        "\timplicit host/device copies: " <<
+        transfers_per_layer[i] / static_cast<double>(FLAGS_iterations) <<
+        " per iteration.";
+    }
+  }
+  if (Caffe::mode() == Caffe::GPU) {
+    log_transfers(start_transfers);
   }
   total_timer.Stop();
   LOG(INFO) << "Average Forward pass: " << forward_time / 1000 /
@@ -339,11 +764,397 @@ int time() {
   LOG(INFO) << "Average Forward-Backward: " << total_timer.MilliSeconds() /
     FLAGS_iterations << " ms.";
   LOG(INFO) << "Total Time: " << total_timer.MilliSeconds() << " ms.";
+  caffe::CaffeLogHugePageStats();
   LOG(INFO) << "*** Benchmark ends ***";
   return 0;
 }
 RegisterBrewFunction(time);
 
+// Sends -iterations single random items to the batcher, timing each one.
+static void serve_client(caffe::Batcher<float>* batcher, int dim,
+                         vector<float>* latencies) {
+  vector<float> input(dim);
+  vector<float> output;
+  caffe::CPUTimer timer;
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    caffe::caffe_rng_uniform<float>(dim, -1, 1, &input[0]);
+    timer.Start();
+    batcher->Process(&input[0], &output);
+    latencies->push_back(timer.MicroSeconds());
+  }
+}
+
+// Serves the nets of -model, separated by ',', on -port, each named after
+// its net and with the weights of -weights at the same position.
+static int serve_models() {
+  vector<string> models;
+  vector<string> weights;
+  boost::split(models, FLAGS_model, boost::is_any_of(","));
+  if (FLAGS_weights.size()) {
+    boost::split(weights, FLAGS_weights, boost::is_any_of(","));
+    CHECK_EQ(weights.size(), models.size())
+        << "Give the weights of each model to serve.";
+  }
+  vector<int> devices;
+  get_gpus(&devices);
+  if (devices.size() == 0) {
+    devices.push_back(-1);
+  }
+  caffe::ModelServer server(FLAGS_max_batch, FLAGS_max_delay_us);
+  for (int i = 0; i < models.size(); ++i) {
+    caffe::NetParameter param;
+    caffe::ReadNetParamsFromTextFileOrDie(models[i], &param);
+    server.AddModel(param.name(), models[i], weights.size() ? weights[i] : "",
+                    devices, FLAGS_instances);
+  }
+  server.Serve(FLAGS_port);
+  return 0;
+}
+
+// serve: serves the nets on -port, or benchmarks batching, where clients
+// send items that are batched for the net.
+int serve() {
+  CHECK_GT(FLAGS_model.size(), 0) << "Need a model definition to serve.";
+  if (FLAGS_port > 0) {
+    return serve_models();
+  }
+
+  vector<int> gpus;
+  get_gpus(&gpus);
+  if (gpus.size() != 0) {
+    LOG(INFO) << "Use GPU with device ID " << gpus[0];
+    Caffe::SetDevice(gpus[0]);
+    Caffe::set_mode(Caffe::GPU);
+  } else {
+    LOG(INFO) << "Use CPU.";
+    Caffe::set_mode(Caffe::CPU);
+  }
+  shared_ptr<Net<float> > net(new Net<float>(FLAGS_model, caffe::TEST));
+  if (FLAGS_weights.size()) {
+    net->CopyTrainedLayersFrom(FLAGS_weights);
+  }
+  caffe::Batcher<float> batcher(net, FLAGS_max_batch, FLAGS_max_delay_us);
+  const int dim = net->input_blobs()[0]->count(1);
+
+  LOG(INFO) << "Serving " << FLAGS_iterations << " items to each of "
+            << FLAGS_clients << " clients.";
+  vector<vector<float> > latencies(FLAGS_clients);
+  caffe::CPUTimer total_timer;
+  total_timer.Start();
+  boost::thread_group clients;
+  for (int i = 0; i < FLAGS_clients; ++i) {
+    clients.create_thread(boost::bind(&serve_client, &batcher, dim,
+                                      &latencies[i]));
+  }
+  clients.join_all();
+  const float seconds = total_timer.MilliSeconds() / 1000;
+  vector<float> all;
+  for (int i = 0; i < FLAGS_clients; ++i) {
+    all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+  }
+  std::sort(all.begin(), all.end());
+  LOG(INFO) << "Batches: " << batcher.batches() << ", average size: "
+            << static_cast<float>(batcher.items()) / batcher.batches();
+  LOG(INFO) << "Throughput: " << all.size() / seconds << " items/s.";
+  LOG(INFO) << "Latency p50: " << all[all.size() / 2] / 1000 << " ms, p99: "
+            << all[all.size() * 99 / 100] / 1000 << " ms, max: "
+            << all.back() / 1000 << " ms.";
+  return 0;
+}
+RegisterBrewFunction(serve);
+
+// Drains -iterations batches from a data layer, after a first one to start
+// its threads and fill its queue.
+static void bench_data_layer(const caffe::LayerParameter& param,
+                             int prefetch, int loaders) {
+  shared_ptr<Layer<float> > layer =
+      caffe::LayerRegistry<float>::CreateLayer(param);
+  const vector<Blob<float>*> bottom;
+  vector<Blob<float>*> top;
+  vector<shared_ptr<Blob<float> > > blobs;
+  for (int i = 0; i < param.top_size(); ++i) {
+    blobs.push_back(shared_ptr<Blob<float> >(new Blob<float>()));
+    top.push_back(blobs.back().get());
+  }
+  layer->SetUp(bottom, top);
+  layer->Forward(bottom, top);
+  caffe::BasePrefetchingDataLayer<float>* prefetching =
+      dynamic_cast<caffe::BasePrefetchingDataLayer<float>*>(layer.get());
+  DataStats stats;
+  if (prefetching) {
+    // Leaves out the counters of setup and the first batch
+    prefetching->collect_data_stats(&stats);
+    stats.reset();
+  }
+  const int batch_size = top[0]->shape(0);
+  caffe::CPUTimer timer;
+  timer.Start();
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    layer->Forward(bottom, top);
+  }
+  const double seconds = timer.MicroSeconds() / 1000000;
+  LOG(INFO) << param.name() << " (" << param.type() << ", prefetch "
+            << prefetch << ", loader threads " << loaders << "): "
+            << FLAGS_iterations * batch_size / seconds
+            << " images/s, " << seconds * 1000 / FLAGS_iterations
+            << " ms per batch of " << batch_size << ".";
+  if (!prefetching) {
+    return;
+  }
+  prefetching->collect_data_stats(&stats);
+  const double batches = stats.samples(DataStats::WAIT);
+  if (!batches) {
+    return;
+  }
+  // Loaders of several threads add up: read, decode and transform are in
+  // thread time, above the time per batch when the threads overlap
+  LOG(INFO) << "  " << stats.total(DataStats::QUEUE_DEPTH) / batches
+            << " of " << prefetch << " batches ready, wait "
+            << stats.total(DataStats::WAIT) / batches / 1000 << " ms, read "
+            << stats.total(DataStats::READ) / batches / 1000 << " ms, decode "
+            << stats.total(DataStats::DECODE) / batches / 1000
+            << " ms, transform "
+            << stats.total(DataStats::TRANSFORM) / batches / 1000
+            << " ms per batch.";
+}
+
+// Benchmark: bench_data: the data layers of a model alone, without the net.
+int bench_data() {
+  CHECK_GT(FLAGS_model.size(), 0) << "Need a model definition to benchmark.";
+
+  vector<int> gpus;
+  get_gpus(&gpus);
+  if (gpus.size() != 0) {
+    LOG(INFO) << "Use GPU with device ID " << gpus[0];
+    Caffe::SetDevice(gpus[0]);
+    Caffe::set_mode(Caffe::GPU);
+  } else {
+    LOG(INFO) << "Use CPU.";
+    Caffe::set_mode(Caffe::CPU);
+  }
+  caffe::NetParameter param;
+  caffe::ReadNetParamsFromTextFileOrDie(FLAGS_model, &param);
+  param.mutable_state()->set_phase(caffe::TRAIN);
+  caffe::NetParameter filtered;
+  Net<float>::FilterNet(param, &filtered);
+  int layers = 0;
+  for (int i = 0; i < filtered.layer_size(); ++i) {
+    const caffe::LayerParameter& layer = filtered.layer(i);
+    const string& type = layer.type();
+    if (type != "Data" && type != "ImageData" && type != "WindowData" &&
+        type != "HDF5Data") {
+      continue;
+    }
+    ++layers;
+    // HDF5Data loads on a single thread, with its own prefetch
+    const bool hdf5 = type == "HDF5Data";
+    const vector<int> prefetch = get_counts(FLAGS_prefetch, hdf5 ?
+        layer.hdf5_data_param().prefetch() : layer.data_param().prefetch());
+    const vector<int> loaders = hdf5 ? vector<int>(1, 1) :
+        get_counts(FLAGS_loader_threads, layer.data_param().loader_threads());
+    for (int j = 0; j < prefetch.size(); ++j) {
+      for (int k = 0; k < loaders.size(); ++k) {
+        caffe::LayerParameter sweep(layer);
+        if (hdf5) {
+          sweep.mutable_hdf5_data_param()->set_prefetch(prefetch[j]);
+        } else {
+          sweep.mutable_data_param()->set_prefetch(prefetch[j]);
+          sweep.mutable_data_param()->set_loader_threads(loaders[k]);
+        }
+        bench_data_layer(sweep, prefetch[j], loaders[k]);
+      }
+    }
+  }
+  CHECK_GT(layers, 0) << "No data layer in the TRAIN phase of " << FLAGS_model;
+  return 0;
+}
+RegisterBrewFunction(bench_data);
+
+// Sets the batch size of the inputs and data layers of a net.
+static void set_batch_size(caffe::NetParameter* param, int batch_size) {
+  for (int i = 0; i < param->input_shape_size(); ++i) {
+    param->mutable_input_shape(i)->set_dim(0, batch_size);
+  }
+  // The legacy dimensions are 4 per input
+  for (int i = 0; i < param->input_dim_size(); i += 4) {
+    param->set_input_dim(i, batch_size);
+  }
+  for (int i = 0; i < param->layer_size(); ++i) {
+    caffe::LayerParameter* layer = param->mutable_layer(i);
+    if (layer->has_data_param()) {
+      layer->mutable_data_param()->set_batch_size(batch_size);
+    }
+    if (layer->has_image_data_param()) {
+      layer->mutable_image_data_param()->set_batch_size(batch_size);
+    }
+    if (layer->has_hdf5_data_param()) {
+      layer->mutable_hdf5_data_param()->set_batch_size(batch_size);
+    }
+    if (layer->has_memory_data_param()) {
+      layer->mutable_memory_data_param()->set_batch_size(batch_size);
+    }
+    if (layer->has_window_data_param()) {
+      layer->mutable_window_data_param()->set_batch_size(batch_size);
+    }
+    if (layer->has_dummy_data_param()) {
+      caffe::DummyDataParameter* dummy = layer->mutable_dummy_data_param();
+      for (int j = 0; j < dummy->shape_size(); ++j) {
+        dummy->mutable_shape(j)->set_dim(0, batch_size);
+      }
+      for (int j = 0; j < dummy->num_size(); ++j) {
+        dummy->set_num(j, batch_size);
+      }
+    }
+  }
+}
+
+// Memory: predict the memory of training a model from its shapes, setting
+// it up on the host alone.
+int memory() {
+  CHECK_GT(FLAGS_model.size(), 0) << "Need a model definition to size.";
+  caffe::NetParameter param;
+  caffe::ReadNetParamsFromTextFileOrDie(FLAGS_model, &param);
+  param.mutable_state()->set_phase(caffe::TRAIN);
+  if (FLAGS_batch_size > 0) {
+    set_batch_size(&param, FLAGS_batch_size);
+  }
+  // Only the params are filled on setup, in host memory
+  Caffe::set_mode(Caffe::CPU);
+  Net<float> net(param);
+  LOG(INFO) << "Memory of a forward and backward pass, in bytes:\n"
+            << net.MemoryJSON(true);
+  return 0;
+}
+RegisterBrewFunction(memory);
+
+// Returns the memory of a pass of the model at a batch size, allocated when
+// running on the GPU, where it optionally times passes, or else predicted.
+static size_t batch_memory(const caffe::NetParameter& model, int batch_size,
+                           double* samples_per_s) {
+  caffe::NetParameter param(model);
+  set_batch_size(&param, batch_size);
+  if (Caffe::mode() == Caffe::CPU) {
+    Net<float> net(param);
+    return net.MemoryBytes(true);
+  }
+  size_t peak = 0;
+#ifndef CPU_ONLY
+  size_t before;
+  caffe::CaffeResetGPUMemoryPeak();
+  caffe::CaffeGPUMemoryUsage(&before, &peak);
+  {
+    Net<float> net(param);
+    const bool backward = net.phase() == caffe::TRAIN;
+    net.ForwardPrefilled();
+    if (backward) {
+      net.Backward();
+    }
+    if (FLAGS_batch_throughput) {
+      Timer timer;
+      timer.Start();
+      for (int i = 0; i < FLAGS_iterations; ++i) {
+        net.ForwardPrefilled();
+        if (backward) {
+          net.Backward();
+        }
+      }
+      *samples_per_s = FLAGS_iterations * batch_size * 1e6
+          / timer.MicroSeconds();
+    }
+  }
+  size_t used;
+  caffe::CaffeGPUMemoryUsage(&used, &peak);
+  peak -= before;
+#else
+  NO_GPU;
+#endif
+  return peak;
+}
+
+// Fit batch: find the largest batch size of a model within a memory budget.
+int fit_batch() {
+  CHECK_GT(FLAGS_model.size(), 0) << "Need a model definition to fit.";
+  caffe::Phase phase;
+  CHECK(caffe::Phase_Parse(FLAGS_phase, &phase)) << "Unknown phase "
+      << FLAGS_phase;
+  vector<int> gpus;
+  get_gpus(&gpus);
+  size_t budget = static_cast<size_t>(FLAGS_memory_budget) << 20;
+  if (gpus.size() != 0) {
+    LOG(INFO) << "Use GPU with device ID " << gpus[0];
+    Caffe::SetDevice(gpus[0]);
+    Caffe::set_mode(Caffe::GPU);
+#ifndef CPU_ONLY
+    if (!budget) {
+      size_t free;
+      size_t total;
+      CUDA_CHECK(cudaMemGetInfo(&free, &total));
+      budget = free / 10 * 9;
+    }
+#endif
+  } else {
+    LOG(INFO) << "Use CPU, predicting the memory of a GPU from the shapes.";
+    Caffe::set_mode(Caffe::CPU);
+    CHECK_GT(budget, 0) << "Need a -memory_budget without -gpu.";
+  }
+  caffe::NetParameter param;
+  caffe::ReadNetParamsFromTextFileOrDie(FLAGS_model, &param);
+  param.mutable_state()->set_phase(phase);
+  // Doubles the batch size while it fits, then bisects. On the GPU, sizes
+  // whose memory extrapolated from the last two that fit exceeds the budget
+  // are not run, so as not to run out of memory.
+  std::map<int, size_t> fitting;
+  int fits = 0;
+  int fails = 0;
+  int best = 0;
+  double best_samples_per_s = 0;
+  const int kMaxBatch = 1 << 20;
+  for (int batch = 1; (!fails && fits < kMaxBatch) || fails - fits > 1;
+       batch = fails ? (fits + fails) / 2 : 2 * batch) {
+    if (Caffe::mode() == Caffe::GPU && fitting.size() >= 2) {
+      std::map<int, size_t>::const_iterator last = --fitting.end();
+      std::map<int, size_t>::const_iterator previous = last;
+      --previous;
+      const double slope = (static_cast<double>(last->second)
+          - previous->second) / (last->first - previous->first);
+      if (last->second + slope * (batch - last->first) > budget) {
+        LOG(INFO) << "Batch size " << batch << ": over the budget, "
+                  << "extrapolated.";
+        fails = batch;
+        continue;
+      }
+    }
+    double samples_per_s = 0;
+    const size_t bytes = batch_memory(param, batch, &samples_per_s);
+    ostringstream throughput;
+    if (samples_per_s) {
+      throughput << ", " << samples_per_s << " samples/s";
+      if (samples_per_s > best_samples_per_s && bytes <= budget) {
+        best = batch;
+        best_samples_per_s = samples_per_s;
+      }
+    }
+    LOG(INFO) << "Batch size " << batch << ": " << (bytes >> 20) << " MB"
+              << throughput.str() << ".";
+    if (bytes <= budget) {
+      fitting[batch] = bytes;
+      fits = batch;
+    } else {
+      fails = batch;
+    }
+    CHECK_GT(fits, 0) << "The model does not fit in " << (budget >> 20)
+        << " MB at batch size 1.";
+  }
+  LOG(INFO) << "Largest batch size within " << (budget >> 20) << " MB: "
+            << fits << ".";
+  if (best) {
+    LOG(INFO) << "Best throughput: batch size " << best << ", "
+              << best_samples_per_s << " samples/s.";
+  }
+  return 0;
+}
+RegisterBrewFunction(fit_batch);
+
 int main(int argc, char** argv) {
   // Print output to stderr (while still logging).
   FLAGS_alsologtostderr = 1;
@@ -354,9 +1165,34 @@ int main(int argc, char** argv) {
       "  train           train or finetune a model\n"
       "  test            score a model\n"
       "  device_query    show GPU diagnostic information\n"
-      "  time            benchmark model execution time");
+      "  time            benchmark model execution time\n"
+      "  serve           serve models over HTTP on -port, or benchmark\n"
+      "                  batched serving of single items\n"
+      "  bench_data      benchmark the data layers of a model alone\n"
+      "  memory          predict the memory of training a model\n"
+      "  fit_batch       find the largest batch size fitting in memory");
   // Run tool or show usage.
   caffe::GlobalInit(&argc, &argv);
+  Caffe::set_cpu_threads(FLAGS_cpu_threads);
+  Caffe::set_executor_threads(FLAGS_executor_threads);
+  caffe::SetNUMAAffinity(FLAGS_numa_affinity);
+  caffe::CaffeSetHugePages(static_cast<size_t>(FLAGS_huge_pages) << 20,
+                           FLAGS_hugetlbfs);
+#ifndef CPU_ONLY
+  caffe::CaffeSetManagedMemory(FLAGS_managed_memory);
+#endif
+#ifdef USE_CUDNN
+  if (FLAGS_cudnn_algo_cache.size()) {
+    caffe::cudnn::SetAlgoCacheFile(FLAGS_cudnn_algo_cache);
+  }
+#endif
+  if (FLAGS_engine_cache.empty() && FLAGS_cudnn_algo_cache.size()) {
+    FLAGS_engine_cache = FLAGS_cudnn_algo_cache + ".engines";
+  }
+  if (FLAGS_engine_cache.size()) {
+    caffe::SetEngineCacheFile(FLAGS_engine_cache);
+  }
+  caffe::SetNetCacheDir(FLAGS_net_cache);
   if (argc == 2) {
 #ifdef WITH_PYTHON_LAYER
     try {
@@ -364,6 +1200,8 @@ int main(int argc, char** argv) {
       return GetBrewFunction(caffe::string(argv[1]))();
 #ifdef WITH_PYTHON_LAYER
     } catch (bp::error_already_set) {
+      // The nets run with the GIL released
+      PyGILState_Ensure();
       PyErr_Print();
       return 1;
     }
@@ -0,0 +1,146 @@
+// This program compresses the weights of the Convolution, Deconvolution and
+// InnerProduct layers of a trained net to a codebook of at most 256 values
+// per blob, each weight stored as the Huffman code of its entry (see
+// BlobProto). The codebook is either spaced evenly over the range of the
+// weights (linear) or fitted to them by k-means, starting from the linear
+// one. Loading the weights decodes them, so the net runs as before.
+// Usage:
+//    compress_net weights_file levels linear|kmeans weights_file_out
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/lexical_cast.hpp"
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/huffman.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Blob;
+using caffe::BlobProto;
+using caffe::LayerParameter;
+using caffe::NetParameter;
+using std::string;
+using std::vector;
+
+// Lloyd iterations of k-means, each moving the entries to the mean of the
+// weights nearest them
+static const int kKMeansIterations = 20;
+
+// Longer codes are rare enough not to matter, and shorter ones decode faster.
+static const int kMaxCodeBits = 16;
+
+static bool Compressible(const LayerParameter& layer) {
+  return layer.type() == "Convolution" || layer.type() == "Deconvolution"
+      || layer.type() == "InnerProduct";
+}
+
+// Sets the code of each of the sorted values, that of its nearest entry of
+// the sorted codebook.
+static void Assign(const vector<std::pair<float, int> >& sorted,
+    const vector<float>& codebook, vector<uint8_t>* codes) {
+  int entry = 0;
+  for (int i = 0; i < sorted.size(); ++i) {
+    while (entry + 1 < codebook.size() && sorted[i].first
+           > (codebook[entry] + codebook[entry + 1]) / 2) {
+      ++entry;
+    }
+    (*codes)[sorted[i].second] = entry;
+  }
+}
+
+// Replaces the data of the blob by a codebook of the given number of entries
+// and the Huffman codes of the weights. Returns the bytes taken by these.
+static int Compress(int levels, bool kmeans, BlobProto* proto) {
+  Blob<float> blob;
+  blob.FromProto(*proto);
+  const int count = blob.count();
+  const float* data = blob.cpu_data();
+  vector<std::pair<float, int> > sorted(count);
+  for (int i = 0; i < count; ++i) {
+    sorted[i] = std::make_pair(data[i], i);
+  }
+  std::sort(sorted.begin(), sorted.end());
+  const float low = sorted.front().first;
+  const float high = sorted.back().first;
+  vector<float> codebook(levels);
+  for (int j = 0; j < levels; ++j) {
+    codebook[j] = low + (high - low) * j / (levels - 1);
+  }
+  vector<uint8_t> codes(count);
+  Assign(sorted, codebook, &codes);
+  for (int iter = 0; kmeans && iter < kKMeansIterations; ++iter) {
+    vector<double> sums(levels, 0);
+    vector<int> members(levels, 0);
+    for (int i = 0; i < count; ++i) {
+      sums[codes[i]] += data[i];
+      ++members[codes[i]];
+    }
+    for (int j = 0; j < levels; ++j) {
+      if (members[j] > 0) {
+        codebook[j] = sums[j] / members[j];
+      }
+    }
+    Assign(sorted, codebook, &codes);
+  }
+  vector<uint64_t> counts(levels, 0);
+  for (int i = 0; i < count; ++i) {
+    ++counts[codes[i]];
+  }
+  vector<uint32_t> lengths;
+  caffe::HuffmanCodeLengths(counts, kMaxCodeBits, &lengths);
+  string bits;
+  caffe::HuffmanEncode(lengths, &codes[0], count, &bits);
+  proto->clear_data();
+  proto->clear_double_data();
+  for (int j = 0; j < levels; ++j) {
+    proto->add_codebook(codebook[j]);
+    proto->add_code_bits(lengths[j]);
+  }
+  proto->set_code_data(bits);
+  return bits.size() + levels * 5;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc != 5) {
+    LOG(ERROR) << "Usage: compress_net weights_file levels linear|kmeans "
+               << "weights_file_out";
+    return 1;
+  }
+  NetParameter weights;
+  caffe::ReadNetParamsFromBinaryFileOrDie(argv[1], &weights);
+  const int levels = boost::lexical_cast<int>(argv[2]);
+  CHECK_GE(levels, 2);
+  CHECK_LE(levels, 256) << "Codes are a byte at most";
+  const string method(argv[3]);
+  CHECK(method == "linear" || method == "kmeans")
+      << "Unknown method " << method;
+  int64_t before = 0;
+  int64_t after = 0;
+  for (int i = 0; i < weights.layer_size(); ++i) {
+    LayerParameter* layer = weights.mutable_layer(i);
+    if (!Compressible(*layer) || layer->blobs_size() == 0) {
+      continue;
+    }
+    // Weights stored otherwise than as floats are kept as they are.
+    BlobProto* proto = layer->mutable_blobs(0);
+    if (proto->data_size() == 0 && proto->double_data_size() == 0) {
+      continue;
+    }
+    const int size = proto->ByteSize();
+    const int compressed = Compress(levels, method == "kmeans", proto);
+    LOG(INFO) << "Compressing layer " << layer->name() << " from " << size
+              << " to " << compressed << " bytes";
+    before += size;
+    after += compressed;
+  }
+  caffe::WriteProtoToBinaryFile(weights, argv[4]);
+  LOG(INFO) << "Compressed the weights from " << before << " to " << after
+            << " bytes";
+  return 0;
+}
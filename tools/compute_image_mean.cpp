@@ -1,10 +1,16 @@
 #include <stdint.h>
+#include <sys/stat.h>
 #include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "boost/bind.hpp"
 #include "boost/scoped_ptr.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
@@ -17,9 +23,89 @@ using namespace caffe;  // NOLINT(build/namespaces)
 using std::max;
 using std::pair;
 using boost::scoped_ptr;
+using boost::shared_ptr;
 
 DEFINE_string(backend, "lmdb",
         "The backend {leveldb, lmdb} containing the images");
+DEFINE_int32(threads, 0,
+        "Number of threads reading the images, 0 for one per core");
+DEFINE_int32(sample, 0,
+        "Only compute the mean and std of each channel, from this many "
+        "images picked at random, instead of the mean image");
+DEFINE_int32(seed, 1701, "Seed picking the images with -sample");
+DEFINE_string(sums, "",
+        "Optional: the file of the sums of the images, updated from the "
+        "records after the last one it counts, if it exists");
+
+// Sums of one shard of the images, reduced once all threads are done
+struct Sums {
+  Sums() : count(0) {}
+  std::vector<double> data;
+  std::vector<double> squares;
+  int count;
+  // The key of the last record of the database
+  std::string last_key;
+};
+
+// Thread t reads the images i with i % threads == t, and skips the others
+// without parsing them. With a sample, only the picked images are read.
+// Given a key, only the images after its record are read.
+static void accumulate(db::Cursor* cursor, int shard, int shards,
+                       int channels, int data_size,
+                       const std::vector<bool>* picked,
+                       const std::string& after, Sums* sums) {
+  const bool per_channel = picked != NULL;
+  const int dim = data_size / channels;
+  sums->data.assign(per_channel ? channels : data_size, 0.);
+  sums->squares.assign(per_channel ? channels : 0, 0.);
+  std::vector<float> values(data_size);
+  Datum datum;
+  if (after.size()) {
+    CHECK(cursor->Seek(after)) << "No record of the key " << after;
+    cursor->Next();
+  }
+  for (int i = 0; cursor->valid(); ++i, cursor->Next()) {
+    sums->last_key = cursor->key();
+    if (i % shards != shard || (per_channel && !(*picked)[i])) {
+      continue;
+    }
+    CHECK(ParseDatum(cursor->value_data(), cursor->value_size(), &datum));
+    DecodeDatumNative(&datum);
+    const std::string& data = datum.data();
+    const int size_in_datum = std::max<int>(datum.data().size(),
+        datum.float_data_size());
+    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
+        size_in_datum;
+    if (data.size() != 0) {
+      for (int j = 0; j < data_size; ++j) {
+        values[j] = static_cast<uint8_t>(data[j]);
+      }
+    } else {
+      std::copy(datum.float_data().begin(), datum.float_data().end(),
+                values.begin());
+    }
+    if (per_channel) {
+      for (int c = 0; c < channels; ++c) {
+        double sum = 0, squares = 0;
+        for (int j = c * dim; j < (c + 1) * dim; ++j) {
+          sum += values[j];
+          squares += values[j] * values[j];
+        }
+        sums->data[c] += sum;
+        sums->squares[c] += squares;
+      }
+    } else {
+      for (int j = 0; j < data_size; ++j) {
+        sums->data[j] += values[j];
+      }
+    }
+    if (++sums->count % 10000 == 0) {
+      LOG(INFO) << "Thread " << shard << " processed " << sums->count
+                << " files.";
+    }
+  }
+}
+
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
@@ -31,7 +117,9 @@ int main(int argc, char** argv) {
   gflags::SetUsageMessage("Compute the mean_image of a set of images given by"
         " a leveldb/lmdb\n"
         "Usage:\n"
-        "    compute_image_mean [FLAGS] INPUT_DB [OUTPUT_FILE]\n");
+        "    compute_image_mean [FLAGS] INPUT_DB [OUTPUT_FILE]\n"
+        "With -sums, only the images added since the sums were last written "
+        "are read.\n");
 
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
@@ -40,75 +128,150 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  // The sums of the records counted already
+  CHECK(FLAGS_sums.empty() || FLAGS_sample == 0)
+      << "Sums are not kept with -sample";
+  ImageSums stored;
+  struct stat info;
+  if (FLAGS_sums.size() && stat(FLAGS_sums.c_str(), &info) == 0) {
+    ReadProtoFromBinaryFileOrDie(FLAGS_sums, &stored);
+    LOG(INFO) << "Updating the sums of " << stored.count() << " files";
+  }
+
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
   db->Open(argv[1], db::READ);
   scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  if (stored.count() > 0) {
+    CHECK(cursor->Seek(stored.last_key())) << "No record of the key "
+        << stored.last_key() << " of " << FLAGS_sums;
+    cursor->Next();
+  }
 
-  BlobProto sum_blob;
-  int count = 0;
   // load first datum
   Datum datum;
-  datum.ParseFromString(cursor->value());
+  if (cursor->valid()) {
+    CHECK(ParseDatum(cursor->value_data(), cursor->value_size(), &datum));
+    if (DecodeDatumNative(&datum)) {
+      LOG(INFO) << "Decoding Datum";
+    }
+  } else {
+    CHECK_GT(stored.count(), 0) << "No image in " << argv[1];
+    datum.set_channels(stored.sum().channels());
+    datum.set_height(stored.sum().height());
+    datum.set_width(stored.sum().width());
+  }
+  if (stored.count() > 0) {
+    CHECK(datum.channels() == stored.sum().channels()
+          && datum.height() == stored.sum().height()
+          && datum.width() == stored.sum().width())
+        << "The images differ in size from those of " << FLAGS_sums;
+  }
+  const int channels = datum.channels();
+  const int dim = datum.height() * datum.width();
+  const int data_size = channels * dim;
 
-  if (DecodeDatumNative(&datum)) {
-    LOG(INFO) << "Decoding Datum";
+  // Pick the sample, counting the images without parsing them
+  std::vector<bool> picked;
+  if (FLAGS_sample > 0) {
+    int total = 0;
+    for (; cursor->valid(); cursor->Next()) {
+      ++total;
+    }
+    std::vector<int> order(total);
+    for (int i = 0; i < total; ++i) {
+      order[i] = i;
+    }
+    srand(FLAGS_seed);
+    std::random_shuffle(order.begin(), order.end());
+    picked.assign(total, false);
+    for (int i = 0; i < std::min(FLAGS_sample, total); ++i) {
+      picked[order[i]] = true;
+    }
+    LOG(INFO) << "Sampling " << std::min(FLAGS_sample, total) << " of "
+              << total << " files";
   }
 
-  sum_blob.set_num(1);
-  sum_blob.set_channels(datum.channels());
-  sum_blob.set_height(datum.height());
-  sum_blob.set_width(datum.width());
-  const int data_size = datum.channels() * datum.height() * datum.width();
-  int size_in_datum = std::max<int>(datum.data().size(),
-                                    datum.float_data_size());
-  for (int i = 0; i < size_in_datum; ++i) {
-    sum_blob.add_data(0.);
-  }
-  LOG(INFO) << "Starting Iteration";
-  while (cursor->valid()) {
-    Datum datum;
-    datum.ParseFromString(cursor->value());
-    DecodeDatumNative(&datum);
+  // Cursors are opened here, lmdb does not allow opening them concurrently
+  const int threads = FLAGS_threads > 0 ? FLAGS_threads :
+      std::max<int>(boost::thread::hardware_concurrency(), 1);
+  std::vector<shared_ptr<db::Cursor> > cursors(threads);
+  std::vector<Sums> sums(threads);
+  boost::thread_group readers;
+  LOG(INFO) << "Starting Iteration on " << threads << " threads";
+  for (int t = 0; t < threads; ++t) {
+    cursors[t].reset(db->NewCursor());
+    readers.create_thread(boost::bind(&accumulate, cursors[t].get(), t,
+        threads, channels, data_size, picked.size() ? &picked : NULL,
+        stored.last_key(), &sums[t]));
+  }
+  readers.join_all();
+  for (int t = 1; t < threads; ++t) {
+    for (int i = 0; i < sums[0].data.size(); ++i) {
+      sums[0].data[i] += sums[t].data[i];
+    }
+    for (int i = 0; i < sums[0].squares.size(); ++i) {
+      sums[0].squares[i] += sums[t].squares[i];
+    }
+    sums[0].count += sums[t].count;
+  }
+  LOG(INFO) << "Processed " << sums[0].count << " files.";
+  if (stored.count() > 0) {
+    CHECK_EQ(stored.sum().double_data_size(), data_size);
+    for (int i = 0; i < data_size; ++i) {
+      sums[0].data[i] += stored.sum().double_data(i);
+    }
+    if (sums[0].count == 0) {
+      sums[0].last_key = stored.last_key();
+    }
+  }
+  const int64_t count = sums[0].count + stored.count();
+  CHECK_GT(count, 0);
 
-    const std::string& data = datum.data();
-    size_in_datum = std::max<int>(datum.data().size(),
-        datum.float_data_size());
-    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
-        size_in_datum;
-    if (data.size() != 0) {
-      CHECK_EQ(data.size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) + (uint8_t)data[i]);
-      }
-    } else {
-      CHECK_EQ(datum.float_data_size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) +
-            static_cast<float>(datum.float_data(i)));
-      }
+  LOG(INFO) << "Number of channels: " << channels;
+  if (picked.size()) {
+    for (int c = 0; c < channels; ++c) {
+      const double n = static_cast<double>(count) * dim;
+      const double mean = sums[0].data[c] / n;
+      const double var = std::max(sums[0].squares[c] / n - mean * mean, 0.);
+      LOG(INFO) << "mean_value channel [" << c << "]:" << mean
+                << " std: " << sqrt(var);
     }
-    ++count;
-    if (count % 10000 == 0) {
-      LOG(INFO) << "Processed " << count << " files.";
+    if (argc == 3) {
+      LOG(WARNING) << "No mean image is written with -sample";
     }
-    cursor->Next();
+    return 0;
   }
 
-  if (count % 10000 != 0) {
-    LOG(INFO) << "Processed " << count << " files.";
+  if (FLAGS_sums.size()) {
+    ImageSums updated;
+    BlobProto* sum = updated.mutable_sum();
+    sum->set_num(1);
+    sum->set_channels(channels);
+    sum->set_height(datum.height());
+    sum->set_width(datum.width());
+    for (int i = 0; i < data_size; ++i) {
+      sum->add_double_data(sums[0].data[i]);
+    }
+    updated.set_count(count);
+    updated.set_last_key(sums[0].last_key);
+    LOG(INFO) << "Write the sums of " << count << " files to " << FLAGS_sums;
+    WriteProtoToBinaryFile(updated, FLAGS_sums);
   }
-  for (int i = 0; i < sum_blob.data_size(); ++i) {
-    sum_blob.set_data(i, sum_blob.data(i) / count);
+
+  BlobProto sum_blob;
+  sum_blob.set_num(1);
+  sum_blob.set_channels(datum.channels());
+  sum_blob.set_height(datum.height());
+  sum_blob.set_width(datum.width());
+  for (int i = 0; i < data_size; ++i) {
+    sum_blob.add_data(sums[0].data[i] / count);
   }
   // Write to disk
   if (argc == 3) {
     LOG(INFO) << "Write to " << argv[2];
     WriteProtoToBinaryFile(sum_blob, argv[2]);
   }
-  const int channels = sum_blob.channels();
-  const int dim = sum_blob.height() * sum_blob.width();
   std::vector<float> mean_values(channels, 0.0);
-  LOG(INFO) << "Number of channels: " << channels;
   for (int c = 0; c < channels; ++c) {
     for (int i = 0; i < dim; ++i) {
       mean_values[c] += sum_blob.data(dim * c + i);
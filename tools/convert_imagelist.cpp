@@ -0,0 +1,46 @@
+// This program converts the list of files and labels of an ImageData layer
+// to an index the layer maps instead of parsing the list.
+// Usage:
+//   convert_imagelist [FLAGS] LISTFILE INDEX
+//
+// where LISTFILE is a list of files as well as their labels, in the format as
+//   subfolder1/file1.JPEG 7
+//   ....
+// or with -sizes, followed by the height and width of each image.
+
+#include <string>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/util/image_list.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+
+DEFINE_bool(sizes, false,
+    "The list has the height and width of each image after its label");
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Convert a list of images to the index an\n"
+        "ImageData layer maps as its source.\n"
+        "Usage:\n"
+        "    convert_imagelist [FLAGS] LISTFILE INDEX\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc < 3) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/convert_imagelist");
+    return 1;
+  }
+
+  ImageList list;
+  list.Open(argv[1], FLAGS_sizes);
+  LOG(INFO) << "A total of " << list.size() << " images.";
+  list.Write(argv[2]);
+  return 0;
+}
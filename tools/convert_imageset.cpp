@@ -1,5 +1,5 @@
 // This program converts a set of images to a lmdb/leveldb by storing them
-// as Datum proto buffers.
+// as Datum proto buffers, or as raw records with -format raw.
 // Usage:
 //   convert_imageset [FLAGS] ROOTFOLDER/ LISTFILE DB_NAME
 //
@@ -7,14 +7,19 @@
 // should be a list of files as well as their labels, in the format as
 //   subfolder1/file1.JPEG 7
 //   ....
+// With -update, the images are added to the existing database DB_NAME,
+// after its records.
 
 #include <algorithm>
+#include <cstdlib>
 #include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "boost/bind.hpp"
 #include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
@@ -32,7 +37,7 @@ DEFINE_bool(gray, false,
 DEFINE_bool(shuffle, false,
     "Randomly shuffle the order of images and their labels");
 DEFINE_string(backend, "lmdb",
-        "The backend {lmdb, leveldb} for storing the result");
+        "The backend {lmdb, leveldb, chunks, records} for storing the result");
 DEFINE_int32(resize_width, 0, "Width images are resized to");
 DEFINE_int32(resize_height, 0, "Height images are resized to");
 DEFINE_bool(check_size, false,
@@ -41,6 +46,124 @@ DEFINE_bool(encoded, false,
     "When this option is on, the encoded image will be save in datum");
 DEFINE_string(encode_type, "",
     "Optional: What type should we encode the image as ('png','jpg',...).");
+DEFINE_string(format, "datum",
+    "The record format {datum, raw}. Raw records are read without parsing");
+DEFINE_int32(threads, 0,
+    "Number of threads reading and resizing images, 0 for one per core");
+DEFINE_int32(txn_size, 1000, "Number of images written per transaction");
+DEFINE_bool(append, false,
+    "Append the records, which are written in the order of their keys, "
+    "instead of inserting them. Faster with lmdb, for a new database or "
+    "with -update.");
+DEFINE_bool(update, false,
+    "Add the images to an existing database, numbering their keys after "
+    "the last of its keys");
+
+// Images are converted by worker threads into slots, which the writer takes
+// in the order of the list, so the database does not depend on the threads.
+struct Slot {
+  Slot() : ready(false), status(false) {}
+  bool ready;
+  bool status;
+  Datum datum;
+  string record;
+};
+
+class Converter {
+ public:
+  Converter(const vector<pair<string, int> >& lines, const string& root_folder,
+            int resize_height, int resize_width, bool is_color,
+            bool encoded, const string& encode_type, bool raw, int threads)
+      : lines_(lines), root_folder_(root_folder),
+        resize_height_(resize_height), resize_width_(resize_width),
+        is_color_(is_color), encoded_(encoded), encode_type_(encode_type),
+        raw_(raw), slots_(4 * threads), next_line_(0), written_(0) {
+    for (int i = 0; i < threads; ++i) {
+      workers_.create_thread(boost::bind(&Converter::work, this));
+    }
+  }
+  ~Converter() {
+    workers_.interrupt_all();
+    workers_.join_all();
+  }
+
+  // Waits for the image of a line, in order, the slot is valid until done
+  Slot* take(int line_id) {
+    Slot* slot = &slots_[line_id % slots_.size()];
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!slot->ready) {
+      condition_.wait(lock);
+    }
+    return slot;
+  }
+  void done(int line_id) {
+    boost::mutex::scoped_lock lock(mutex_);
+    slots_[line_id % slots_.size()].ready = false;
+    written_ = line_id + 1;
+    condition_.notify_all();
+  }
+
+ protected:
+  void work() {
+    while (true) {
+      int line_id;
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        line_id = next_line_++;
+        if (line_id >= lines_.size()) {
+          return;
+        }
+        while (line_id >= written_ + slots_.size()) {
+          condition_.wait(lock);
+        }
+      }
+      Slot* slot = &slots_[line_id % slots_.size()];
+      convert(line_id, slot);
+      boost::mutex::scoped_lock lock(mutex_);
+      slot->ready = true;
+      condition_.notify_all();
+    }
+  }
+
+  void convert(int line_id, Slot* slot) {
+    std::string enc = encode_type_;
+    if (encoded_ && !enc.size()) {
+      // Guess the encoding type from the file name
+      string fn = lines_[line_id].first;
+      size_t p = fn.rfind('.');
+      if ( p == fn.npos )
+        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
+      enc = fn.substr(p);
+      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+    }
+    slot->status = ReadImageToDatum(root_folder_ + lines_[line_id].first,
+        lines_[line_id].second, resize_height_, resize_width_, is_color_,
+        enc, &slot->datum);
+    if (!slot->status) {
+      return;
+    }
+    if (raw_) {
+      DatumToRawRecord(slot->datum, &slot->record);
+    } else {
+      CHECK(slot->datum.SerializeToString(&slot->record));
+    }
+  }
+
+  const vector<pair<string, int> >& lines_;
+  const string root_folder_;
+  const int resize_height_;
+  const int resize_width_;
+  const bool is_color_;
+  const bool encoded_;
+  const string encode_type_;
+  const bool raw_;
+  vector<Slot> slots_;
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  int next_line_;
+  int written_;
+  boost::thread_group workers_;
+};
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
@@ -66,6 +189,9 @@ int main(int argc, char** argv) {
   const bool check_size = FLAGS_check_size;
   const bool encoded = FLAGS_encoded;
   const string encode_type = FLAGS_encode_type;
+  CHECK(FLAGS_format == "datum" || FLAGS_format == "raw")
+      << "Unknown record format " << FLAGS_format;
+  const bool raw = FLAGS_format == "raw";
 
   std::ifstream infile(argv[2]);
   std::vector<std::pair<std::string, int> > lines;
@@ -87,14 +213,34 @@ int main(int argc, char** argv) {
   int resize_height = std::max<int>(0, FLAGS_resize_height);
   int resize_width = std::max<int>(0, FLAGS_resize_width);
 
-  // Create new DB
+  const int threads = FLAGS_threads > 0 ? FLAGS_threads :
+      std::max<int>(boost::thread::hardware_concurrency(), 1);
+  const int txn_size = FLAGS_txn_size;
+  CHECK_GT(txn_size, 0);
+
+  // Keys continue the numbering of the records of the database to update,
+  // so that they come after them, in the order of the list
+  int first_id = 0;
+  if (FLAGS_update) {
+    scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
+    db->Open(argv[3], db::READ);
+    scoped_ptr<db::Cursor> cursor(db->NewCursor());
+    int records = 0;
+    for (; cursor->valid(); cursor->Next(), ++records) {
+      first_id = std::max(first_id, atoi(cursor->key().c_str()) + 1);
+    }
+    LOG(INFO) << "Adding to " << records << " records, from key " << first_id;
+  }
+
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
-  db->Open(argv[3], db::NEW);
+  db->Open(argv[3], FLAGS_update ? db::WRITE : db::NEW);
   scoped_ptr<db::Transaction> txn(db->NewTransaction());
+  txn->set_append(FLAGS_append);
 
   // Storing to db
   std::string root_folder(argv[1]);
-  Datum datum;
+  Converter converter(lines, root_folder, resize_height, resize_width,
+                      is_color, encoded, encode_type, raw, threads);
   int count = 0;
   const int kMaxKeyLength = 256;
   char key_cstr[kMaxKeyLength];
@@ -102,21 +248,12 @@ int main(int argc, char** argv) {
   bool data_size_initialized = false;
 
   for (int line_id = 0; line_id < lines.size(); ++line_id) {
-    bool status;
-    std::string enc = encode_type;
-    if (encoded && !enc.size()) {
-      // Guess the encoding type from the file name
-      string fn = lines[line_id].first;
-      size_t p = fn.rfind('.');
-      if ( p == fn.npos )
-        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
-      enc = fn.substr(p);
-      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+    Slot* slot = converter.take(line_id);
+    if (slot->status == false) {
+      converter.done(line_id);
+      continue;
     }
-    status = ReadImageToDatum(root_folder + lines[line_id].first,
-        lines[line_id].second, resize_height, resize_width, is_color,
-        enc, &datum);
-    if (status == false) continue;
+    const Datum& datum = slot->datum;
     if (check_size) {
       if (!data_size_initialized) {
         data_size = datum.channels() * datum.height() * datum.width();
@@ -128,23 +265,23 @@ int main(int argc, char** argv) {
       }
     }
     // sequential
-    int length = snprintf(key_cstr, kMaxKeyLength, "%08d_%s", line_id,
-        lines[line_id].first.c_str());
+    int length = snprintf(key_cstr, kMaxKeyLength, "%08d_%s",
+        first_id + line_id, lines[line_id].first.c_str());
 
     // Put in db
-    string out;
-    CHECK(datum.SerializeToString(&out));
-    txn->Put(string(key_cstr, length), out);
+    txn->Put(string(key_cstr, length), slot->record);
+    converter.done(line_id);
 
-    if (++count % 1000 == 0) {
+    if (++count % txn_size == 0) {
       // Commit db
       txn->Commit();
       txn.reset(db->NewTransaction());
+      txn->set_append(FLAGS_append);
       LOG(ERROR) << "Processed " << count << " files.";
     }
   }
   // write the last batch
-  if (count % 1000 != 0) {
+  if (count % txn_size != 0) {
     txn->Commit();
     LOG(ERROR) << "Processed " << count << " files.";
   }
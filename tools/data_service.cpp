@@ -0,0 +1,128 @@
+// This program reads a database once for the jobs of a host, e.g. of a
+// hyperparameter sweep, decoding its images and publishing the decoded
+// records in shared memory, which Data layers of backend SERVICE read
+// instead of the database.
+// Usage:
+//   data_service [FLAGS] DB_NAME SERVICE_NAME
+//
+// The records are read in order, from the first again at the end, for as
+// long as the service runs. Jobs read the records published while they run.
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "boost/bind.hpp"
+#include "boost/scoped_ptr.hpp"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
+#include "caffe/util/db_service.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/thread_pool.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+using boost::scoped_ptr;
+
+DEFINE_string(backend, "lmdb",
+    "The backend {lmdb, leveldb, chunks, records} of the database");
+DEFINE_int32(channels, 0,
+    "Decode images in 3 or 1 channels, or in their own if 0");
+DEFINE_int32(threads, 0,
+    "Number of threads decoding images, 0 for one per core");
+DEFINE_int32(slots, db::ServiceDB::kSlots,
+    "Number of records in shared memory, that jobs can fall behind by");
+DEFINE_int32(slot_size, db::ServiceDB::kSlotSize >> 20,
+    "Size in MB of the slot of each record, at least that of the largest "
+    "decoded record");
+
+// Removes the shared memory when stopped, so that jobs stop too
+static char service_name[256];
+
+static void stop(int signal) {
+  shm_unlink(service_name);
+  _exit(1);
+}
+
+// Decodes the records [begin, end) into raw records
+static void decode(std::vector<string>* records, int channels, int begin,
+                   int end) {
+  Datum datum;
+  for (int i = begin; i < end; ++i) {
+    string* record = &(*records)[i];
+    CHECK(ParseDatum(record->data(), record->size(), &datum))
+        << "Cannot parse a datum";
+    if (datum.encoded()) {
+      if (channels) {
+        DecodeDatum(&datum, channels == 3);
+      } else {
+        DecodeDatumNative(&datum);
+      }
+    }
+    DatumToRawRecord(datum, record);
+  }
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Publish the decoded records of a database in\n"
+        "shared memory, for the Data layers of the jobs of the host.\n"
+        "Usage:\n"
+        "    data_service [FLAGS] DB_NAME SERVICE_NAME\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc < 3) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/data_service");
+    return 1;
+  }
+  CHECK(FLAGS_channels == 0 || FLAGS_channels == 1 || FLAGS_channels == 3)
+      << "Decode images in 0, 1 or 3 channels";
+  const int threads = FLAGS_threads > 0 ? FLAGS_threads :
+      sysconf(_SC_NPROCESSORS_ONLN);
+
+  scoped_ptr<db::DB> source(db::GetDB(FLAGS_backend));
+  source->Open(argv[1], db::READ);
+  scoped_ptr<db::Cursor> cursor(source->NewCursor());
+  db::ServiceDB service;
+  service.set_ring(FLAGS_slots, static_cast<size_t>(FLAGS_slot_size) << 20);
+  service.Open(argv[2], db::NEW);
+  scoped_ptr<db::Transaction> txn(service.NewTransaction());
+  const string name = argv[2][0] == '/' ? argv[2] : string("/") + argv[2];
+  strncpy(service_name, name.c_str(), sizeof(service_name) - 1);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  // Decodes batches of records on the threads, publishing them in order
+  ThreadPool pool(threads);
+  std::vector<string> records(threads * 8);
+  for (size_t batch = 1; ; ++batch) {
+    for (int i = 0; i < records.size(); ++i) {
+      if (!cursor->valid()) {
+        cursor->SeekToFirst();
+        CHECK(cursor->valid()) << "No records in " << argv[1];
+      }
+      records[i].assign(cursor->value_data(), cursor->value_size());
+      cursor->Next();
+    }
+    pool.run(records.size(), 1, boost::bind(&decode, &records,
+        FLAGS_channels, _1, _2));
+    for (int i = 0; i < records.size(); ++i) {
+      txn->Put(string(), records[i]);
+    }
+    if (batch % 1000 == 0) {
+      LOG(INFO) << "Published " << batch * records.size() << " records";
+    }
+  }
+  return 0;
+}
@@ -1,8 +1,13 @@
 #include <stdio.h>  // for snprintf
+#include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
 
 #include "boost/algorithm/string.hpp"
+#include "boost/bind.hpp"
+#include "boost/thread.hpp"
+#include "gflags/gflags.h"
 #include "google/protobuf/text_format.h"
 
 #include "caffe/blob.hpp"
@@ -10,17 +15,26 @@
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/db.hpp"
+#include "caffe/util/hdf5.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/upgrade_proto.hpp"
 #include "caffe/vision_layers.hpp"
 
 using caffe::Blob;
 using caffe::Caffe;
 using caffe::Datum;
 using caffe::Net;
+using caffe::NetParameter;
 using boost::shared_ptr;
 using std::string;
+using std::vector;
 namespace db = caffe::db;
 
+DEFINE_int32(serialize_threads, 2,
+    "Number of threads serializing the features to Datum records");
+DEFINE_int32(txn_size, 1000,
+    "Number of features written per transaction of a leveldb or lmdb");
+
 template<typename Dtype>
 int feature_extraction_pipeline(int argc, char** argv);
 
@@ -29,9 +43,311 @@ int main(int argc, char** argv) {
 //  return feature_extraction_pipeline<double>(argc, argv);
 }
 
+// The features of one blob for a batch, and their records once serialized
+template<typename Dtype>
+struct FeatureBatch {
+  vector<int> shape;
+  vector<Dtype> data;
+  vector<string> records;
+};
+
+// Batches are numbered worker by worker and go through a ring of slots:
+// forwarded by the net of their worker, serialized to Datum records if
+// written to a DB, then written by the main thread.
+template<typename Dtype>
+struct Slot {
+  enum State { FREE, FORWARDED, READY };
+  Slot() : state(FREE), batch(-1) {}
+  State state;
+  int batch;
+  vector<FeatureBatch<Dtype> > features;
+};
+
+template<typename Dtype>
+class Pipeline {
+ public:
+  Pipeline(const NetParameter& net_param, const string& weights,
+           const vector<string>& blob_names, const vector<int>& devices,
+           int batches, bool serialize, int serializers)
+      : net_param_(net_param), weights_(weights), blob_names_(blob_names),
+        devices_(devices), batches_(batches), serialize_(serialize),
+        slots_(4 * devices.size()), created_(0), next_serialize_(0),
+        written_(0) {
+    for (int i = 0; i < devices_.size(); ++i) {
+      threads_.create_thread(boost::bind(&Pipeline::forward, this, i));
+    }
+    for (int i = 0; serialize_ && i < serializers; ++i) {
+      threads_.create_thread(boost::bind(&Pipeline::serialize, this));
+    }
+  }
+  ~Pipeline() {
+    threads_.interrupt_all();
+    threads_.join_all();
+  }
+
+  // Waits for a batch, in order, the slot is valid until done
+  Slot<Dtype>* take(int batch) {
+    Slot<Dtype>* slot = &slots_[batch % slots_.size()];
+    boost::mutex::scoped_lock lock(mutex_);
+    while (slot->batch != batch || slot->state != Slot<Dtype>::READY) {
+      condition_.wait(lock);
+    }
+    return slot;
+  }
+  void done(int batch) {
+    boost::mutex::scoped_lock lock(mutex_);
+    slots_[batch % slots_.size()].state = Slot<Dtype>::FREE;
+    written_ = batch + 1;
+    condition_.notify_all();
+  }
+
+ protected:
+  // Worker i runs batches i, i + workers... of the total, on its device
+  void forward(int worker) {
+    if (devices_[worker] >= 0) {
+      Caffe::SetDevice(devices_[worker]);
+      Caffe::set_mode(Caffe::GPU);
+    } else {
+      Caffe::set_mode(Caffe::CPU);
+    }
+    // Data layers get the records of a source in the order they are created
+    boost::mutex::scoped_lock create_lock(mutex_);
+    while (created_ != worker) {
+      condition_.wait(create_lock);
+    }
+    Net<Dtype> net(net_param_);
+    ++created_;
+    condition_.notify_all();
+    create_lock.unlock();
+    net.CopyTrainedLayersFrom(weights_);
+    for (int i = 0; i < blob_names_.size(); ++i) {
+      CHECK(net.has_blob(blob_names_[i]))
+          << "Unknown feature blob name " << blob_names_[i]
+          << " in the network " << net_param_.name();
+    }
+    vector<Blob<Dtype>*> input_vec;
+    const int workers = devices_.size();
+    for (int batch = worker; batch < batches_; batch += workers) {
+      net.Forward(input_vec);
+      Slot<Dtype>* slot = &slots_[batch % slots_.size()];
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        while (batch >= written_ + slots_.size()) {
+          condition_.wait(lock);
+        }
+      }
+      slot->features.resize(blob_names_.size());
+      for (int i = 0; i < blob_names_.size(); ++i) {
+        const shared_ptr<Blob<Dtype> > blob =
+            net.blob_by_name(blob_names_[i]);
+        FeatureBatch<Dtype>& feature = slot->features[i];
+        feature.shape = blob->shape();
+        feature.data.assign(blob->cpu_data(),
+                            blob->cpu_data() + blob->count());
+      }
+      boost::mutex::scoped_lock lock(mutex_);
+      slot->batch = batch;
+      slot->state = serialize_ ? Slot<Dtype>::FORWARDED : Slot<Dtype>::READY;
+      condition_.notify_all();
+    }
+  }
+
+  void serialize() {
+    Datum datum;
+    while (true) {
+      int batch;
+      Slot<Dtype>* slot;
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        batch = next_serialize_++;
+        if (batch >= batches_) {
+          return;
+        }
+        slot = &slots_[batch % slots_.size()];
+        while (slot->batch != batch ||
+               slot->state != Slot<Dtype>::FORWARDED) {
+          condition_.wait(lock);
+        }
+      }
+      for (int i = 0; i < slot->features.size(); ++i) {
+        FeatureBatch<Dtype>& feature = slot->features[i];
+        Blob<Dtype> shape(feature.shape);
+        const int num = shape.num();
+        const int dim = shape.count() / num;
+        feature.records.resize(num);
+        for (int n = 0; n < num; ++n) {
+          datum.set_height(shape.height());
+          datum.set_width(shape.width());
+          datum.set_channels(shape.channels());
+          datum.clear_data();
+          datum.clear_float_data();
+          const Dtype* data = &feature.data[n * dim];
+          for (int d = 0; d < dim; ++d) {
+            datum.add_float_data(data[d]);
+          }
+          CHECK(datum.SerializeToString(&feature.records[n]));
+        }
+      }
+      boost::mutex::scoped_lock lock(mutex_);
+      slot->state = Slot<Dtype>::READY;
+      condition_.notify_all();
+    }
+  }
+
+  const NetParameter net_param_;
+  const string weights_;
+  const vector<string> blob_names_;
+  const vector<int> devices_;
+  const int batches_;
+  const bool serialize_;
+  vector<Slot<Dtype> > slots_;
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  int created_;
+  int next_serialize_;
+  int written_;
+  boost::thread_group threads_;
+};
+
+// Writes the features of one blob, item by item in the order of the inputs
+template<typename Dtype>
+class FeatureWriter {
+ public:
+  virtual ~FeatureWriter() {}
+  virtual void write(const FeatureBatch<Dtype>& feature, int n) = 0;
+  inline int count() const { return count_; }
+
+ protected:
+  FeatureWriter() : count_(0) {}
+  int count_;
+};
+
+// Datum records keyed by the index of their input
+template<typename Dtype>
+class DBWriter : public FeatureWriter<Dtype> {
+ public:
+  DBWriter(const string& db_type, const string& name, int txn_size)
+      : db_(db::GetDB(db_type)), txn_size_(txn_size) {
+    db_->Open(name, db::NEW);
+    txn_.reset(db_->NewTransaction());
+  }
+  virtual ~DBWriter() {
+    if (this->count_ % txn_size_ != 0) {
+      txn_->Commit();
+    }
+    db_->Close();
+  }
+  virtual void write(const FeatureBatch<Dtype>& feature, int n) {
+    const int kMaxKeyStrLength = 100;
+    char key_str[kMaxKeyStrLength];
+    int length = snprintf(key_str, kMaxKeyStrLength, "%010d", this->count_);
+    txn_->Put(std::string(key_str, length), feature.records[n]);
+    if (++this->count_ % txn_size_ == 0) {
+      txn_->Commit();
+      txn_.reset(db_->NewTransaction());
+    }
+  }
+
+ protected:
+  shared_ptr<db::DB> db_;
+  shared_ptr<db::Transaction> txn_;
+  const int txn_size_;
+};
+
+// A "data" dataset of one row per input, appended kRows at a time
+template<typename Dtype>
+class HDF5Writer : public FeatureWriter<Dtype> {
+ public:
+  explicit HDF5Writer(const string& name) : name_(name), dataset_id_(-1),
+      rows_(0) {
+    file_id_ = H5Fcreate(name.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
+                         H5P_DEFAULT);
+    CHECK_GE(file_id_, 0) << "Failed to open HDF5 file " << name;
+  }
+  virtual ~HDF5Writer() {
+    append();
+    if (dataset_id_ >= 0) {
+      H5Dclose(dataset_id_);
+    }
+    herr_t status = H5Fclose(file_id_);
+    CHECK_GE(status, 0) << "Failed to close HDF5 file " << name_;
+  }
+  virtual void write(const FeatureBatch<Dtype>& feature, int n) {
+    const int kRows = 1024;
+    if (rows_ == 0) {
+      vector<int> shape(feature.shape);
+      shape[0] = kRows;
+      pending_.Reshape(shape);
+    }
+    const int dim = pending_.count(1);
+    std::copy(&feature.data[n * dim], &feature.data[(n + 1) * dim],
+              pending_.mutable_cpu_data() + rows_ * dim);
+    ++this->count_;
+    if (++rows_ == kRows) {
+      append();
+    }
+  }
+
+ protected:
+  void append() {
+    if (rows_ == 0) {
+      return;
+    }
+    vector<int> shape(pending_.shape());
+    shape[0] = rows_;
+    pending_.Reshape(shape);
+    if (dataset_id_ < 0) {
+      dataset_id_ = caffe::hdf5_create_appendable_dataset(file_id_, "data",
+          pending_, rows_, 0);
+    }
+    caffe::hdf5_append_nd_dataset(dataset_id_, this->count_ - rows_,
+                                  pending_);
+    rows_ = 0;
+  }
+
+  const string name_;
+  hid_t file_id_;
+  hid_t dataset_id_;
+  Blob<Dtype> pending_;
+  int rows_;
+};
+
+// The float arrays of the inputs, one after the other
+template<typename Dtype>
+class RawWriter : public FeatureWriter<Dtype> {
+ public:
+  explicit RawWriter(const string& name)
+      : name_(name), file_(name.c_str(), std::ios::out | std::ios::binary) {
+    CHECK(file_.is_open()) << "Failed to open " << name;
+  }
+  virtual ~RawWriter() {
+    file_.close();
+    LOG(ERROR) << "Wrote " << this->count_ << " arrays of shape "
+        << Blob<Dtype>(shape_).shape_string() << " to " << name_;
+  }
+  virtual void write(const FeatureBatch<Dtype>& feature, int n) {
+    shape_ = feature.shape;
+    shape_[0] = 1;
+    const int dim = Blob<Dtype>(shape_).count();
+    file_.write(reinterpret_cast<const char*>(&feature.data[n * dim]),
+                dim * sizeof(Dtype));
+    CHECK(file_.good()) << "Failed to write " << name_;
+    ++this->count_;
+  }
+
+ protected:
+  const string name_;
+  std::ofstream file_;
+  vector<int> shape_;
+};
+
 template<typename Dtype>
 int feature_extraction_pipeline(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   const int num_required_args = 7;
   if (argc < num_required_args) {
     LOG(ERROR)<<
@@ -40,29 +356,39 @@ int feature_extraction_pipeline(int argc, char** argv) {
     "Usage: extract_features  pretrained_net_param"
     "  feature_extraction_proto_file  extract_feature_blob_name1[,name2,...]"
     "  save_feature_dataset_name1[,name2,...]  num_mini_batches  db_type"
-    "  [CPU/GPU] [DEVICE_ID=0]\n"
+    "  [CPU/GPU] [DEVICE_ID=0[,ID2,...]]\n"
     "Note: you can extract multiple features in one pass by specifying"
     " multiple feature blob names and dataset names seperated by ','."
     " The names cannot contain white space characters and the number of blobs"
-    " and datasets must be equal.";
+    " and datasets must be equal.\n"
+    "db_type is leveldb or lmdb for Datum records, hdf5 for a \"data\""
+    " dataset per file, or raw for the float arrays one after the other.\n"
+    "With several GPUs, each runs a net on its share of the records of the"
+    " Data layers.";
     return 1;
   }
   int arg_pos = num_required_args;
 
   arg_pos = num_required_args;
+  vector<int> devices;
   if (argc > arg_pos && strcmp(argv[arg_pos], "GPU") == 0) {
     LOG(ERROR)<< "Using GPU";
-    uint device_id = 0;
+    devices.push_back(0);
     if (argc > arg_pos + 1) {
-      device_id = atoi(argv[arg_pos + 1]);
-      CHECK_GE(device_id, 0);
+      vector<string> ids;
+      boost::split(ids, argv[arg_pos + 1], boost::is_any_of(","));
+      devices.clear();
+      for (int i = 0; i < ids.size(); ++i) {
+        devices.push_back(atoi(ids[i].c_str()));
+        CHECK_GE(devices.back(), 0);
+      }
+    }
+    for (int i = 0; i < devices.size(); ++i) {
+      LOG(ERROR) << "Using Device_id=" << devices[i];
     }
-    LOG(ERROR) << "Using Device_id=" << device_id;
-    Caffe::SetDevice(device_id);
-    Caffe::set_mode(Caffe::GPU);
   } else {
     LOG(ERROR) << "Using CPU";
-    Caffe::set_mode(Caffe::CPU);
+    devices.push_back(-1);
   }
 
   arg_pos = 0;  // the name of the executable
@@ -96,9 +422,16 @@ int feature_extraction_pipeline(int argc, char** argv) {
    }
    */
   std::string feature_extraction_proto(argv[++arg_pos]);
-  shared_ptr<Net<Dtype> > feature_extraction_net(
-      new Net<Dtype>(feature_extraction_proto, caffe::TEST));
-  feature_extraction_net->CopyTrainedLayersFrom(pretrained_binary_proto);
+  NetParameter net_param;
+  caffe::ReadNetParamsFromTextFileOrDie(feature_extraction_proto, &net_param);
+  net_param.mutable_state()->set_phase(caffe::TEST);
+  // The nets of the devices share the records of each Data layer
+  for (int i = 0; i < net_param.layer_size(); ++i) {
+    if (net_param.layer(i).has_data_param()) {
+      net_param.mutable_layer(i)->mutable_data_param()->set_readers(
+          devices.size());
+    }
+  }
 
   std::string extract_feature_blob_names(argv[++arg_pos]);
   std::vector<std::string> blob_names;
@@ -112,78 +445,63 @@ int feature_extraction_pipeline(int argc, char** argv) {
       " the number of blob names and dataset names must be equal";
   size_t num_features = blob_names.size();
 
-  for (size_t i = 0; i < num_features; i++) {
-    CHECK(feature_extraction_net->has_blob(blob_names[i]))
-        << "Unknown feature blob name " << blob_names[i]
-        << " in the network " << feature_extraction_proto;
-  }
-
   int num_mini_batches = atoi(argv[++arg_pos]);
+  CHECK_EQ(num_mini_batches % devices.size(), 0) <<
+      "num_mini_batches must be a multiple of the number of devices";
 
-  std::vector<shared_ptr<db::DB> > feature_dbs;
-  std::vector<shared_ptr<db::Transaction> > txns;
-  const char* db_type = argv[++arg_pos];
+  const string db_type = argv[++arg_pos];
+  const bool to_db = db_type != "hdf5" && db_type != "raw";
+  std::vector<shared_ptr<FeatureWriter<Dtype> > > writers;
   for (size_t i = 0; i < num_features; ++i) {
     LOG(INFO)<< "Opening dataset " << dataset_names[i];
-    shared_ptr<db::DB> db(db::GetDB(db_type));
-    db->Open(dataset_names.at(i), db::NEW);
-    feature_dbs.push_back(db);
-    shared_ptr<db::Transaction> txn(db->NewTransaction());
-    txns.push_back(txn);
+    FeatureWriter<Dtype>* writer;
+    if (db_type == "hdf5") {
+      writer = new HDF5Writer<Dtype>(dataset_names[i]);
+    } else if (db_type == "raw") {
+      writer = new RawWriter<Dtype>(dataset_names[i]);
+    } else {
+      writer = new DBWriter<Dtype>(db_type, dataset_names[i], FLAGS_txn_size);
+    }
+    writers.push_back(shared_ptr<FeatureWriter<Dtype> >(writer));
   }
 
   LOG(ERROR)<< "Extacting Features";
 
-  Datum datum;
-  const int kMaxKeyStrLength = 100;
-  char key_str[kMaxKeyStrLength];
-  std::vector<Blob<float>*> input_vec;
-  std::vector<int> image_indices(num_features, 0);
-  for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index) {
-    feature_extraction_net->Forward(input_vec);
+  // Forward on the devices, serializing and writing at the same time. The
+  // readers of a source get its records in turn, so the items of the batches
+  // of a round, one per device, are interleaved.
+  Pipeline<Dtype> pipeline(net_param, pretrained_binary_proto, blob_names,
+      devices, num_mini_batches, to_db, FLAGS_serialize_threads);
+  const int workers = devices.size();
+  vector<Slot<Dtype>*> round(workers);
+  for (int batch = 0; batch < num_mini_batches; batch += workers) {
+    for (int w = 0; w < workers; ++w) {
+      round[w] = pipeline.take(batch + w);
+    }
     for (int i = 0; i < num_features; ++i) {
-      const shared_ptr<Blob<Dtype> > feature_blob = feature_extraction_net
-          ->blob_by_name(blob_names[i]);
-      int batch_size = feature_blob->num();
-      int dim_features = feature_blob->count() / batch_size;
-      const Dtype* feature_blob_data;
+      const int batch_size = round[0]->features[i].shape[0];
+      const int before = writers[i]->count();
       for (int n = 0; n < batch_size; ++n) {
-        datum.set_height(feature_blob->height());
-        datum.set_width(feature_blob->width());
-        datum.set_channels(feature_blob->channels());
-        datum.clear_data();
-        datum.clear_float_data();
-        feature_blob_data = feature_blob->cpu_data() +
-            feature_blob->offset(n);
-        for (int d = 0; d < dim_features; ++d) {
-          datum.add_float_data(feature_blob_data[d]);
+        for (int w = 0; w < workers; ++w) {
+          writers[i]->write(round[w]->features[i], n);
         }
-        int length = snprintf(key_str, kMaxKeyStrLength, "%010d",
-            image_indices[i]);
-        string out;
-        CHECK(datum.SerializeToString(&out));
-        txns.at(i)->Put(std::string(key_str, length), out);
-        ++image_indices[i];
-        if (image_indices[i] % 1000 == 0) {
-          txns.at(i)->Commit();
-          txns.at(i).reset(feature_dbs.at(i)->NewTransaction());
-          LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-              " query images for feature blob " << blob_names[i];
-        }
-      }  // for (int n = 0; n < batch_size; ++n)
-    }  // for (int i = 0; i < num_features; ++i)
-  }  // for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index)
+      }
+      if (writers[i]->count() / 1000 > before / 1000) {
+        LOG(ERROR)<< "Extracted features of " << writers[i]->count() <<
+            " query images for feature blob " << blob_names[i];
+      }
+    }
+    for (int w = 0; w < workers; ++w) {
+      pipeline.done(batch + w);
+    }
+  }
   // write the last batch
   for (int i = 0; i < num_features; ++i) {
-    if (image_indices[i] % 1000 != 0) {
-      txns.at(i)->Commit();
-    }
-    LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
+    LOG(ERROR)<< "Extracted features of " << writers[i]->count() <<
         " query images for feature blob " << blob_names[i];
-    feature_dbs.at(i)->Close();
   }
+  writers.clear();
 
   LOG(ERROR)<< "Successfully extracted the features!";
   return 0;
 }
-
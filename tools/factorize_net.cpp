@@ -0,0 +1,261 @@
+// This program replaces the given InnerProduct and Convolution layers of a
+// trained net by two thinner layers of the given rank, through a truncated
+// SVD of the weights. An InnerProduct layer becomes one projecting on rank
+// outputs and one expanding them back; a Convolution becomes one of rank
+// filters of the same size and a 1x1 convolution combining them. The
+// parameter and FLOP reduction and the relative error of the weights are
+// reported for each layer.
+// Usage:
+//    factorize_net net_proto_file weights_file layer:rank[,layer:rank...]
+//        net_proto_file_out weights_file_out
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "boost/algorithm/string.hpp"
+#include "boost/lexical_cast.hpp"
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Blob;
+using caffe::LayerParameter;
+using caffe::Net;
+using caffe::NetParameter;
+using std::map;
+using std::string;
+using std::vector;
+
+// Subspace iterations, each multiplying by W W^T, which separates the
+// leading singular vectors by the square of their singular values' ratios.
+static const int kPowerIterations = 8;
+
+// Orthonormalizes the columns of the rows x cols matrix Q by modified
+// Gram-Schmidt.
+static void Orthonormalize(int rows, int cols, float* Q) {
+  for (int j = 0; j < cols; ++j) {
+    for (int i = 0; i < j; ++i) {
+      double dot = 0;
+      for (int r = 0; r < rows; ++r) {
+        dot += Q[r * cols + i] * Q[r * cols + j];
+      }
+      for (int r = 0; r < rows; ++r) {
+        Q[r * cols + j] -= dot * Q[r * cols + i];
+      }
+    }
+    double norm = 0;
+    for (int r = 0; r < rows; ++r) {
+      norm += Q[r * cols + j] * Q[r * cols + j];
+    }
+    norm = std::sqrt(norm);
+    for (int r = 0; r < rows; ++r) {
+      Q[r * cols + j] = norm > 0 ? Q[r * cols + j] / norm : 0;
+    }
+  }
+}
+
+// Factors the M x K matrix W as U * V, U being M x rank with orthonormal
+// columns spanning the leading left singular vectors of W, and V = U^T W.
+// Returns the relative Frobenius error of U * V.
+static float Factorize(int M, int K, int rank, const float* W, Blob<float>* U,
+    Blob<float>* V) {
+  using caffe::caffe_cpu_gemm;
+  vector<int> shape(2);
+  shape[0] = M;
+  shape[1] = rank;
+  U->Reshape(shape);
+  shape[0] = rank;
+  shape[1] = K;
+  V->Reshape(shape);
+  float* u = U->mutable_cpu_data();
+  float* v = V->mutable_cpu_data();
+  vector<float> z(K * rank);
+  caffe::caffe_rng_gaussian<float>(M * rank, 0, 1, u);
+  Orthonormalize(M, rank, u);
+  for (int i = 0; i < kPowerIterations; ++i) {
+    caffe_cpu_gemm<float>(CblasTrans, CblasNoTrans, K, rank, M, 1, W, u, 0,
+        &z[0]);
+    caffe_cpu_gemm<float>(CblasNoTrans, CblasNoTrans, M, rank, K, 1, W,
+        &z[0], 0, u);
+    Orthonormalize(M, rank, u);
+  }
+  caffe_cpu_gemm<float>(CblasTrans, CblasNoTrans, rank, K, M, 1, u, W, 0, v);
+  // The error is orthogonal to U * V, so its norm squared is the difference
+  // of theirs.
+  const float norm = caffe::caffe_cpu_dot(M * K, W, W);
+  const float kept = caffe::caffe_cpu_dot(rank * K, v, v);
+  return norm > 0 ? std::sqrt(std::max(norm - kept, 0.f) / norm) : 0;
+}
+
+// Replaces the layer by its two factors, the first of rank outputs.
+static void FactorizeLayer(const LayerParameter& layer, int rank,
+    vector<LayerParameter>* layers, float* error) {
+  const bool conv = layer.type() == "Convolution";
+  const int num_output = conv ? layer.convolution_param().num_output()
+      : layer.inner_product_param().num_output();
+  Blob<float> weights;
+  weights.FromProto(layer.blobs(0));
+  const int dim = weights.count() / num_output;
+  Blob<float> U, V;
+  *error = Factorize(num_output, dim, rank, weights.cpu_data(), &U, &V);
+
+  LayerParameter first(layer);
+  first.set_name(layer.name() + "_lowrank");
+  first.set_top(0, layer.top(0) + "_lowrank");
+  first.clear_blobs();
+  first.clear_loss_weight();
+  while (first.param_size() > 1) {
+    first.mutable_param()->RemoveLast();
+  }
+  LayerParameter second(layer);
+  second.set_bottom(0, first.top(0));
+  second.clear_blobs();
+  vector<int> shape = weights.shape();
+  shape[0] = rank;
+  V.Reshape(shape);
+  V.ToProto(first.add_blobs());
+  if (conv) {
+    first.mutable_convolution_param()->set_num_output(rank);
+    first.mutable_convolution_param()->set_bias_term(false);
+    first.mutable_convolution_param()->clear_fused_relu();
+    caffe::ConvolutionParameter* param = second.mutable_convolution_param();
+    param->clear_kernel_h();
+    param->clear_kernel_w();
+    param->clear_pad();
+    param->clear_pad_h();
+    param->clear_pad_w();
+    param->clear_stride();
+    param->clear_stride_h();
+    param->clear_stride_w();
+    param->set_kernel_size(1);
+    U.Reshape(num_output, rank, 1, 1);
+  } else {
+    first.mutable_inner_product_param()->set_num_output(rank);
+    first.mutable_inner_product_param()->set_bias_term(false);
+    first.mutable_inner_product_param()->clear_fused_relu();
+  }
+  U.ToProto(second.add_blobs());
+  for (int i = 1; i < layer.blobs_size(); ++i) {
+    second.add_blobs()->CopyFrom(layer.blobs(i));
+  }
+  layers->push_back(first);
+  layers->push_back(second);
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc != 6) {
+    LOG(ERROR) << "Usage: factorize_net net_proto_file weights_file "
+               << "layer:rank[,layer:rank...] net_proto_file_out "
+               << "weights_file_out";
+    return 1;
+  }
+  NetParameter param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[1], &param);
+  param.mutable_state()->set_phase(caffe::TEST);
+  map<string, int> ranks;
+  vector<string> specs;
+  boost::split(specs, argv[3], boost::is_any_of(","));
+  for (int i = 0; i < specs.size(); ++i) {
+    const size_t colon = specs[i].rfind(':');
+    CHECK_NE(colon, string::npos) << "Expected layer:rank, got " << specs[i];
+    ranks[specs[i].substr(0, colon)] =
+        boost::lexical_cast<int>(specs[i].substr(colon + 1));
+  }
+  Net<float> net(param);
+  net.CopyTrainedLayersFrom(argv[2]);
+  map<string, double> flops;
+  for (int i = 0; i < net.layers().size(); ++i) {
+    flops[net.layer_names()[i]] = net.layers()[i]->ForwardFlops(
+        net.bottom_vecs()[i], net.top_vecs()[i]);
+  }
+  NetParameter trained;
+  net.ToProto(&trained);
+  map<string, const LayerParameter*> trained_layers;
+  for (int i = 0; i < trained.layer_size(); ++i) {
+    trained_layers[trained.layer(i).name()] = &trained.layer(i);
+  }
+
+  // Rewrite the layers as written, without the splits Net::ToProto gives.
+  NetParameter filtered;
+  Net<float>::FilterNet(param, &filtered);
+  vector<LayerParameter> layers;
+  double total_params = 0, total_flops = 0;
+  double saved_params = 0, saved_flops = 0;
+  for (int i = 0; i < filtered.layer_size(); ++i) {
+    LayerParameter layer(filtered.layer(i));
+    const LayerParameter* trained_layer = trained_layers[layer.name()];
+    CHECK(trained_layer) << "Unknown layer " << layer.name();
+    layer.mutable_blobs()->CopyFrom(trained_layer->blobs());
+    for (int j = 0; j < layer.blobs_size(); ++j) {
+      Blob<float> blob;
+      blob.FromProto(layer.blobs(j));
+      total_params += blob.count();
+    }
+    total_flops += flops[layer.name()];
+    if (!ranks.count(layer.name())) {
+      layers.push_back(layer);
+      continue;
+    }
+    const int rank = ranks[layer.name()];
+    ranks.erase(layer.name());
+    const bool conv = layer.type() == "Convolution";
+    CHECK(conv || layer.type() == "InnerProduct") << layer.name()
+        << " is neither an InnerProduct nor a Convolution layer";
+    CHECK(!conv || layer.convolution_param().group() == 1) << layer.name()
+        << " is a group convolution";
+    CHECK(conv || (!layer.inner_product_param().has_sparse_dim()
+        && layer.inner_product_param().device_size() == 0)) << layer.name()
+        << " has sparse inputs or runs on several devices";
+    CHECK_EQ(layer.bottom_size(), 1) << layer.name() << " has several inputs";
+    const int num_output = conv ? layer.convolution_param().num_output()
+        : layer.inner_product_param().num_output();
+    Blob<float> weights;
+    weights.FromProto(layer.blobs(0));
+    const int dim = weights.count() / num_output;
+    CHECK_GT(rank, 0);
+    CHECK_LT(rank, std::min(num_output, dim)) << layer.name()
+        << " has no rank " << rank << " factorization";
+    // Both factors run over the positions of the layer, so its FLOPs scale
+    // as its weights.
+    const double ratio = static_cast<double>(rank) * (num_output + dim)
+        / (static_cast<double>(num_output) * dim);
+    if (ratio >= 1) {
+      LOG(WARNING) << "Rank " << rank << " factors of " << layer.name()
+                   << " are larger than its weights";
+    }
+    float error;
+    FactorizeLayer(layer, rank, &layers, &error);
+    saved_params += weights.count() * (1 - ratio);
+    saved_flops += flops[layer.name()] * (1 - ratio);
+    LOG(INFO) << "Factorizing layer " << layer.name() << " to rank " << rank
+              << ": " << weights.count() << " weights become "
+              << static_cast<int>(rank * (num_output + dim)) << ", "
+              << flops[layer.name()] / 1e6 << " MFLOPs become "
+              << flops[layer.name()] * ratio / 1e6 << ", relative error "
+              << error;
+  }
+  CHECK(ranks.empty()) << "Unknown layer " << ranks.begin()->first;
+  NetParameter weights(filtered);
+  weights.clear_layer();
+  for (int i = 0; i < layers.size(); ++i) {
+    weights.add_layer()->CopyFrom(layers[i]);
+  }
+  NetParameter deploy(weights);
+  for (int i = 0; i < deploy.layer_size(); ++i) {
+    deploy.mutable_layer(i)->clear_blobs();
+  }
+  caffe::WriteProtoToTextFile(deploy, argv[4]);
+  caffe::WriteProtoToBinaryFile(weights, argv[5]);
+  LOG(INFO) << "Parameters: " << total_params << " -> "
+            << total_params - saved_params << ", FLOPs: " << total_flops
+            << " -> " << total_flops - saved_flops;
+  return 0;
+}
@@ -0,0 +1,27 @@
+// This program rewrites trained weights as a mapped weights file, which nets
+// load by mapping it, using the values in place instead of parsing and
+// copying them. Processes mapping the same file share its pages.
+// Usage:
+//    map_weights weights_file weights_file_out.mmap
+
+#include <string>
+
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::NetParameter;
+using std::string;
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc != 3) {
+    LOG(ERROR) << "Usage: map_weights weights_file weights_file_out.mmap";
+    return 1;
+  }
+  NetParameter trained;
+  caffe::ReadNetParamsFromBinaryFileOrDie(argv[1], &trained);
+  caffe::WriteMappedWeights(trained, argv[2]);
+  LOG(INFO) << "Wrote " << trained.layer_size() << " layers to " << argv[2];
+  return 0;
+}
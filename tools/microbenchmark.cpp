@@ -0,0 +1,387 @@
+// This program times layers and math kernels in isolation, over a sweep of
+// shapes, in CPU and GPU mode and in float and double, and prints one CSV
+// line per measurement, for comparing builds.
+// Usage:
+//    microbenchmark [-gpu 0] [-iterations 10] [-filter Convolution]
+// The columns are: kind, name, shape, mode, type, pass, microseconds per
+// iteration.
+
+#include <cstdio>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "google/protobuf/text_format.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/im2col.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using caffe::Blob;
+using caffe::Caffe;
+using caffe::Datum;
+using caffe::Layer;
+using caffe::LayerParameter;
+using caffe::LayerRegistry;
+using caffe::Timer;
+using caffe::shared_ptr;
+using std::string;
+using std::vector;
+
+DEFINE_int32(gpu, -1,
+    "Optional; also run in GPU mode on the given device.");
+DEFINE_int32(iterations, 10,
+    "The number of timed iterations of each benchmark.");
+DEFINE_string(filter, "",
+    "Optional; only run the benchmarks whose name contains this.");
+
+// A layer to time, with the shapes of its bottoms for a batch of num
+struct LayerBenchmark {
+  const char* type;
+  const char* param;
+  int bottoms;
+  int channels;
+  int height;
+  int width;
+  int tops;
+  bool backward;
+};
+
+// Typical shapes of image classification nets
+static const LayerBenchmark kLayers[] = {
+  {"Convolution", "convolution_param { num_output: 64 kernel_size: 3 pad: 1 "
+      "weight_filler { type: 'gaussian' std: 0.01 } }", 1, 64, 56, 56, 1, true},
+  {"Convolution", "convolution_param { num_output: 64 kernel_size: 1 "
+      "weight_filler { type: 'gaussian' std: 0.01 } }", 1, 256, 28, 28, 1,
+      true},
+  {"Deconvolution", "convolution_param { num_output: 32 kernel_size: 4 "
+      "stride: 2 weight_filler { type: 'gaussian' std: 0.01 } }",
+      1, 64, 28, 28, 1, true},
+  {"InnerProduct", "inner_product_param { num_output: 1000 "
+      "weight_filler { type: 'gaussian' std: 0.01 } }", 1, 4096, 1, 1, 1,
+      true},
+  {"Pooling", "pooling_param { pool: MAX kernel_size: 3 stride: 2 }",
+      1, 64, 56, 56, 1, true},
+  {"Pooling", "pooling_param { pool: AVE kernel_size: 3 stride: 2 }",
+      1, 64, 56, 56, 1, true},
+  {"LRN", "lrn_param { local_size: 5 }", 1, 64, 56, 56, 1, true},
+  {"Im2col", "convolution_param { kernel_size: 3 pad: 1 }",
+      1, 64, 56, 56, 1, true},
+  {"ReLU", "", 1, 64, 56, 56, 1, true},
+  {"PReLU", "", 1, 64, 56, 56, 1, true},
+  {"Sigmoid", "", 1, 64, 56, 56, 1, true},
+  {"TanH", "", 1, 64, 56, 56, 1, true},
+  {"AbsVal", "", 1, 64, 56, 56, 1, true},
+  {"BNLL", "", 1, 64, 56, 56, 1, true},
+  {"Exp", "", 1, 64, 56, 56, 1, true},
+  {"Power", "power_param { power: 2 scale: 0.5 shift: 1 }",
+      1, 64, 56, 56, 1, true},
+  {"Threshold", "", 1, 64, 56, 56, 1, false},
+  {"Dropout", "", 1, 64, 56, 56, 1, true},
+  {"MVN", "", 1, 64, 56, 56, 1, true},
+  {"Softmax", "", 1, 1000, 1, 1, 1, true},
+  {"Eltwise", "eltwise_param { operation: SUM }", 2, 64, 56, 56, 1, true},
+  {"Eltwise", "eltwise_param { operation: PROD }", 2, 64, 56, 56, 1, true},
+  {"Concat", "", 2, 64, 28, 28, 1, true},
+  {"Slice", "", 1, 128, 28, 28, 2, true},
+  {"Split", "", 1, 64, 56, 56, 2, true},
+  {"Reduction", "reduction_param { axis: 1 }", 1, 64, 56, 56, 1, true},
+  {"SPP", "spp_param { pyramid_height: 3 }", 1, 64, 28, 28, 1, true},
+  // Small layers, where the per call overhead dominates
+  {"InnerProduct", "inner_product_param { num_output: 16 "
+      "weight_filler { type: 'gaussian' std: 0.01 } }", 1, 16, 1, 1, 1, true},
+  {"ReLU", "", 1, 16, 1, 1, 1, true},
+};
+
+static const int kNums[] = {1, 32};
+
+static bool Selected(const string& name) {
+  return name.find(FLAGS_filter) != string::npos;
+}
+
+static const char* ModeName() {
+  return Caffe::mode() == Caffe::GPU ? "GPU" : "CPU";
+}
+
+template <typename Dtype>
+static const char* TypeName();
+template <> const char* TypeName<float>() { return "float"; }
+template <> const char* TypeName<double>() { return "double"; }
+
+template <typename Dtype>
+static void Report(const string& kind, const string& name,
+    const string& shape, const string& pass, float microseconds) {
+  printf("%s,%s,%s,%s,%s,%s,%.2f\n", kind.c_str(), name.c_str(),
+      shape.c_str(), ModeName(), TypeName<Dtype>(), pass.c_str(),
+      microseconds);
+  fflush(stdout);
+}
+
+template <typename Dtype>
+static void Fill(Blob<Dtype>* blob, bool diff) {
+  caffe::FillerParameter param;
+  param.set_type("gaussian");
+  caffe::GaussianFiller<Dtype> filler(param);
+  if (!diff) {
+    filler.Fill(blob);
+    return;
+  }
+  Blob<Dtype> values(blob->shape());
+  filler.Fill(&values);
+  caffe::caffe_copy(values.count(), values.cpu_data(),
+      blob->mutable_cpu_diff());
+}
+
+template <typename Dtype>
+static void TimeLayer(const LayerBenchmark& benchmark, int num) {
+  LayerParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(benchmark.param,
+      &param));
+  param.set_type(benchmark.type);
+  param.set_name(benchmark.type);
+  vector<shared_ptr<Blob<Dtype> > > blobs;
+  vector<Blob<Dtype>*> bottom;
+  vector<Blob<Dtype>*> top;
+  for (int i = 0; i < benchmark.bottoms; ++i) {
+    blobs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(num,
+        benchmark.channels, benchmark.height, benchmark.width)));
+    Fill(blobs.back().get(), false);
+    bottom.push_back(blobs.back().get());
+  }
+  for (int i = 0; i < benchmark.tops; ++i) {
+    blobs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    top.push_back(blobs.back().get());
+  }
+  shared_ptr<Layer<Dtype> > layer = LayerRegistry<Dtype>::CreateLayer(param);
+  layer->SetUp(bottom, top);
+  const vector<bool> propagate_down(bottom.size(), true);
+  for (int i = 0; i < top.size(); ++i) {
+    Fill(top[i], true);
+  }
+  std::ostringstream shape;
+  shape << num << "x" << benchmark.channels << "x" << benchmark.height << "x"
+        << benchmark.width;
+  string name = benchmark.type;
+  if (*benchmark.param) {
+    // Tells the configurations of a type apart
+    name += "[" + string(benchmark.param).substr(0, 40) + "]";
+  }
+  for (int i = 0; i < name.size(); ++i) {
+    if (name[i] == ',') {
+      name[i] = ';';
+    }
+  }
+  // Untimed first passes allocate the buffers
+  layer->Forward(bottom, top);
+  if (benchmark.backward) {
+    layer->Backward(top, propagate_down, bottom);
+  }
+  Timer timer;
+  timer.Start();
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    layer->Forward(bottom, top);
+  }
+  timer.Stop();
+  Report<Dtype>("layer", name, shape.str(), "forward",
+      timer.MicroSeconds() / FLAGS_iterations);
+  if (benchmark.backward) {
+    timer.Start();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+      layer->Backward(top, propagate_down, bottom);
+    }
+    timer.Stop();
+    Report<Dtype>("layer", name, shape.str(), "backward",
+        timer.MicroSeconds() / FLAGS_iterations);
+  }
+}
+
+template <typename Dtype>
+static void TimeGemm(int size) {
+  Blob<Dtype> a(1, 1, size, size);
+  Blob<Dtype> b(1, 1, size, size);
+  Blob<Dtype> c(1, 1, size, size);
+  Fill(&a, false);
+  Fill(&b, false);
+  const bool gpu = Caffe::mode() == Caffe::GPU;
+  Timer timer;
+  for (int i = -1; i < FLAGS_iterations; ++i) {
+    if (i == 0) {
+      timer.Start();
+    }
+    if (gpu) {
+#ifndef CPU_ONLY
+      caffe::caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, size, size,
+          size, Dtype(1), a.gpu_data(), b.gpu_data(), Dtype(0),
+          c.mutable_gpu_data());
+#endif
+    } else {
+      caffe::caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, size, size,
+          size, Dtype(1), a.cpu_data(), b.cpu_data(), Dtype(0),
+          c.mutable_cpu_data());
+    }
+  }
+  timer.Stop();
+  std::ostringstream shape;
+  shape << size << "x" << size << "x" << size;
+  Report<Dtype>("math", "gemm", shape.str(), "forward",
+      timer.MicroSeconds() / FLAGS_iterations);
+}
+
+// Reads of the thread's context, made by most layers and math functions on
+// each call
+template <typename Dtype>
+static void TimeContext() {
+  const int kCalls = 1000;
+  volatile int sink = 0;
+  caffe::CPUTimer timer;
+  timer.Start();
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    for (int j = 0; j < kCalls; ++j) {
+      sink += Caffe::mode() + Caffe::root_solver();
+#ifndef CPU_ONLY
+      sink += Caffe::cublas_handle() != NULL;
+#endif
+    }
+  }
+  timer.Stop();
+  std::ostringstream shape;
+  shape << kCalls << " calls";
+  Report<Dtype>("context", "Caffe::Get", shape.str(), "forward",
+      timer.MicroSeconds() / FLAGS_iterations);
+}
+
+template <typename Dtype>
+static void TimeIm2col(int channels, int size, int kernel) {
+  Blob<Dtype> image(1, channels, size, size);
+  Blob<Dtype> col(1, channels * kernel * kernel, size, size);
+  Fill(&image, false);
+  const int pad = kernel / 2;
+  const bool gpu = Caffe::mode() == Caffe::GPU;
+  Timer timer;
+  for (int i = -1; i < FLAGS_iterations; ++i) {
+    if (i == 0) {
+      timer.Start();
+    }
+    if (gpu) {
+#ifndef CPU_ONLY
+      caffe::im2col_gpu(image.gpu_data(), channels, size, size, kernel,
+          kernel, pad, pad, 1, 1, col.mutable_gpu_data());
+#endif
+    } else {
+      caffe::im2col_cpu(image.cpu_data(), channels, size, size, kernel,
+          kernel, pad, pad, 1, 1, col.mutable_cpu_data());
+    }
+  }
+  timer.Stop();
+  std::ostringstream shape;
+  shape << channels << "x" << size << "x" << size << "/k" << kernel;
+  Report<Dtype>("math", "im2col", shape.str(), "forward",
+      timer.MicroSeconds() / FLAGS_iterations);
+}
+
+// Crops, mirrors and subtracts the mean of a batch of encoded bytes, as the
+// Data layer does on its prefetch threads.
+template <typename Dtype>
+static void TimeTransformer(int num) {
+  const int channels = 3;
+  const int size = 256;
+  const int crop = 224;
+  Datum datum;
+  datum.set_channels(channels);
+  datum.set_height(size);
+  datum.set_width(size);
+  string bytes(channels * size * size, 0);
+  for (int i = 0; i < bytes.size(); ++i) {
+    bytes[i] = static_cast<char>(caffe::caffe_rng_rand() % 256);
+  }
+  datum.set_data(bytes);
+  caffe::TransformationParameter param;
+  param.set_crop_size(crop);
+  param.set_mirror(true);
+  for (int c = 0; c < channels; ++c) {
+    param.add_mean_value(128);
+  }
+  caffe::DataTransformer<Dtype> transformer(param, caffe::TRAIN);
+  transformer.InitRand();
+  Blob<Dtype> batch(num, channels, crop, crop);
+  Blob<Dtype> item(1, channels, crop, crop);
+  // The transformer runs on the host in both modes
+  Timer timer;
+  timer.Start();
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    for (int n = 0; n < num; ++n) {
+      item.set_cpu_data(batch.mutable_cpu_data() + batch.offset(n));
+      transformer.Transform(datum, &item);
+    }
+  }
+  timer.Stop();
+  std::ostringstream shape;
+  shape << num << "x" << channels << "x" << size << "x" << size << "/crop"
+        << crop;
+  Report<Dtype>("data", "DataTransformer", shape.str(), "forward",
+      timer.MicroSeconds() / FLAGS_iterations);
+}
+
+template <typename Dtype>
+static void RunAll() {
+  std::set<string> covered;
+  for (int i = 0; i < sizeof(kLayers) / sizeof(kLayers[0]); ++i) {
+    covered.insert(kLayers[i].type);
+    if (!Selected(kLayers[i].type)) {
+      continue;
+    }
+    for (int j = 0; j < sizeof(kNums) / sizeof(kNums[0]); ++j) {
+      TimeLayer<Dtype>(kLayers[i], kNums[j]);
+    }
+  }
+  // The registered types without a benchmark, like data and loss layers,
+  // which need sources or labels
+  const vector<string> types = LayerRegistry<Dtype>::LayerTypeList();
+  for (int i = 0; i < types.size(); ++i) {
+    LOG_IF(INFO, !covered.count(types[i])) << "No benchmark for " << types[i];
+  }
+  if (Selected("gemm")) {
+    const int sizes[] = {64, 256, 1024};
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+      TimeGemm<Dtype>(sizes[i]);
+    }
+  }
+  if (Selected("im2col")) {
+    TimeIm2col<Dtype>(64, 56, 3);
+    TimeIm2col<Dtype>(256, 14, 3);
+  }
+  if (Selected("Caffe::Get")) {
+    TimeContext<Dtype>();
+  }
+  if (Selected("DataTransformer")) {
+    TimeTransformer<Dtype>(1);
+    TimeTransformer<Dtype>(32);
+  }
+}
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("times layers and math kernels\n"
+      "usage: microbenchmark [-gpu 0] [-iterations 10] [-filter name]");
+  caffe::GlobalInit(&argc, &argv);
+  CHECK_GT(FLAGS_iterations, 0);
+  printf("kind,name,shape,mode,type,pass,us\n");
+  Caffe::set_mode(Caffe::CPU);
+  RunAll<float>();
+  RunAll<double>();
+  if (FLAGS_gpu >= 0) {
+    Caffe::SetDevice(FLAGS_gpu);
+    Caffe::set_mode(Caffe::GPU);
+    RunAll<float>();
+    RunAll<double>();
+  }
+  return 0;
+}
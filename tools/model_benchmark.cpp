@@ -0,0 +1,324 @@
+// This program times forward passes, backward passes and solver steps of the
+// reference models on synthetic data, in CPU and GPU mode and at several
+// batch sizes, and writes their throughputs as JSON. Given the JSON of an
+// earlier run as a baseline, it fails on the throughputs that dropped, to
+// catch regressions in layers and solvers before a release.
+// Usage:
+//    model_benchmark [-gpu 0] [-batch_sizes 1,16] [-iterations 5]
+//        [-output results.json] [-baseline baseline.json] [-tolerance 0.1]
+// Run from the root of Caffe for the default -models.
+
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>  // NOLINT(readability/streams)
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/solver.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Caffe;
+using caffe::LayerParameter;
+using caffe::Net;
+using caffe::NetParameter;
+using caffe::Solver;
+using caffe::SolverParameter;
+using caffe::Timer;
+using caffe::shared_ptr;
+using std::string;
+using std::vector;
+
+DEFINE_string(models, "models/bvlc_alexnet,models/bvlc_reference_caffenet,"
+    "models/bvlc_googlenet,models/bvlc_reference_rcnn_ilsvrc13",
+    "The model directories to time: their train_val.prototxt and "
+    "solver.prototxt, or else their deploy.prototxt, forward only.");
+DEFINE_string(batch_sizes, "1,16",
+    "The batch sizes to time each model at.");
+DEFINE_int32(iterations, 5,
+    "The number of timed iterations of each pass, after an untimed one.");
+DEFINE_bool(cpu, true,
+    "Time the models in CPU mode.");
+DEFINE_int32(gpu, -1,
+    "Optional; also time the models in GPU mode on the given device.");
+DEFINE_string(output, "",
+    "Optional; the file to write the JSON results to, else stdout.");
+DEFINE_string(baseline, "",
+    "Optional; the JSON results of an earlier run to compare against.");
+DEFINE_double(tolerance, 0.1,
+    "The fraction of the baseline throughput a result may drop by.");
+
+// A timed pass of a model
+struct Result {
+  string model;
+  string mode;
+  int batch;
+  string pass;
+  double ms;
+  double samples_per_s;
+
+  // Identifies the measurement across runs
+  string name() const {
+    std::ostringstream name;
+    name << model << "/" << mode << "/" << batch << "/" << pass;
+    return name.str();
+  }
+};
+
+static bool Exists(const string& path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0;
+}
+
+static vector<int> ParseSizes(const string& list) {
+  vector<int> sizes;
+  std::istringstream stream(list);
+  string size;
+  while (std::getline(stream, size, ',')) {
+    sizes.push_back(atoi(size.c_str()));
+    CHECK_GT(sizes.back(), 0) << "Bad batch size " << size;
+  }
+  return sizes;
+}
+
+static vector<string> ParseModels(const string& list) {
+  vector<string> models;
+  std::istringstream stream(list);
+  string model;
+  while (std::getline(stream, model, ',')) {
+    models.push_back(model);
+  }
+  return models;
+}
+
+// Replaces the data layers of the net by DummyData layers of the same tops,
+// a batch of crop_size images and their labels, and sets the batch of its
+// inputs.
+static void SynthesizeData(NetParameter* param, int batch) {
+  for (int i = 0; i < param->input_shape_size(); ++i) {
+    param->mutable_input_shape(i)->set_dim(0, batch);
+  }
+  // The legacy dimensions are 4 per input
+  for (int i = 0; i < param->input_dim_size(); i += 4) {
+    param->set_input_dim(i, batch);
+  }
+  for (int i = 0; i < param->layer_size(); ++i) {
+    LayerParameter* layer = param->mutable_layer(i);
+    const string& type = layer->type();
+    if (type != "Data" && type != "ImageData" && type != "WindowData") {
+      continue;
+    }
+    const int crop = layer->transform_param().crop_size();
+    CHECK_GT(crop, 0) << "Layer " << layer->name()
+        << " needs a crop_size to shape its synthetic data";
+    LayerParameter dummy;
+    dummy.set_name(layer->name());
+    dummy.set_type("DummyData");
+    dummy.mutable_top()->CopyFrom(layer->top());
+    dummy.mutable_include()->CopyFrom(layer->include());
+    dummy.mutable_exclude()->CopyFrom(layer->exclude());
+    for (int j = 0; j < layer->top_size(); ++j) {
+      caffe::BlobShape* shape = dummy.mutable_dummy_data_param()->add_shape();
+      shape->add_dim(batch);
+      if (j == 0) {
+        shape->add_dim(3);
+        shape->add_dim(crop);
+        shape->add_dim(crop);
+      }
+      // Constant, so that DummyData does not refill them on each pass
+      dummy.mutable_dummy_data_param()->add_data_filler()->set_type(
+          "constant");
+    }
+    layer->CopyFrom(dummy);
+  }
+}
+
+static Result MakeResult(const string& model, int batch, const string& pass,
+                         double microseconds) {
+  Result result;
+  result.model = model;
+  result.mode = Caffe::mode() == Caffe::GPU ? "GPU" : "CPU";
+  result.batch = batch;
+  result.pass = pass;
+  result.ms = microseconds / 1000 / FLAGS_iterations;
+  result.samples_per_s = batch * FLAGS_iterations * 1e6 / microseconds;
+  LOG(INFO) << result.name() << ": " << result.ms << " ms, "
+            << result.samples_per_s << " samples/s";
+  return result;
+}
+
+static void TimeModel(const string& dir, int batch, vector<Result>* results) {
+  const string model = dir.substr(dir.find_last_of('/') + 1);
+  const string train_val = dir + "/train_val.prototxt";
+  const bool trains = Exists(train_val);
+  NetParameter net_param;
+  caffe::ReadNetParamsFromTextFileOrDie(
+      trains ? train_val : dir + "/deploy.prototxt", &net_param);
+  SynthesizeData(&net_param, batch);
+  net_param.mutable_state()->set_phase(caffe::TRAIN);
+  {
+    Net<float> net(net_param);
+    // The untimed first passes allocate the buffers
+    net.ForwardPrefilled();
+    if (trains) {
+      net.Backward();
+    }
+    Timer timer;
+    timer.Start();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+      net.ForwardPrefilled();
+    }
+    timer.Stop();
+    results->push_back(MakeResult(model, batch, "forward",
+        timer.MicroSeconds()));
+    if (!trains) {
+      return;
+    }
+    timer.Start();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+      net.Backward();
+    }
+    timer.Stop();
+    results->push_back(MakeResult(model, batch, "backward",
+        timer.MicroSeconds()));
+  }
+  SolverParameter solver_param;
+  const string solver_file = dir + "/solver.prototxt";
+  if (Exists(solver_file)) {
+    caffe::ReadProtoFromTextFileOrDie(solver_file, &solver_param);
+  }
+  solver_param.clear_net();
+  solver_param.mutable_net_param()->CopyFrom(net_param);
+  solver_param.clear_test_iter();
+  solver_param.clear_test_interval();
+  solver_param.set_display(0);
+  solver_param.set_snapshot(0);
+  solver_param.set_snapshot_after_train(false);
+  solver_param.set_max_iter(FLAGS_iterations + 1);
+  shared_ptr<Solver<float> > solver(caffe::GetSolver<float>(solver_param));
+  solver->Step(1);
+  Timer timer;
+  timer.Start();
+  solver->Step(FLAGS_iterations);
+  timer.Stop();
+  results->push_back(MakeResult(model, batch, "step", timer.MicroSeconds()));
+}
+
+static string ToJSON(const vector<Result>& results) {
+  std::ostringstream json;
+  json << "{\n  \"results\": [\n";
+  for (int i = 0; i < results.size(); ++i) {
+    const Result& result = results[i];
+    // One result per line, as ReadBaseline expects
+    json << "    {\"name\": \"" << result.name() << "\", \"model\": \""
+         << result.model << "\", \"mode\": \"" << result.mode
+         << "\", \"batch\": " << result.batch << ", \"pass\": \""
+         << result.pass << "\", \"ms\": " << result.ms
+         << ", \"samples_per_s\": " << result.samples_per_s << "}"
+         << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  json << "  ]\n}\n";
+  return json.str();
+}
+
+// The throughputs by name of the results of an earlier run, as written by
+// ToJSON
+static std::map<string, double> ReadBaseline(const string& path) {
+  std::ifstream file(path.c_str());
+  CHECK(file) << "Cannot read the baseline " << path;
+  std::map<string, double> baseline;
+  const string name_key = "\"name\": \"";
+  const string rate_key = "\"samples_per_s\": ";
+  string line;
+  while (std::getline(file, line)) {
+    const size_t name = line.find(name_key);
+    const size_t rate = line.find(rate_key);
+    if (name == string::npos || rate == string::npos) {
+      continue;
+    }
+    const size_t begin = name + name_key.size();
+    baseline[line.substr(begin, line.find('"', begin) - begin)] =
+        atof(line.c_str() + rate + rate_key.size());
+  }
+  return baseline;
+}
+
+// Returns the number of results slower than the baseline allows.
+static int Compare(const vector<Result>& results,
+                   const std::map<string, double>& baseline) {
+  int regressions = 0;
+  for (int i = 0; i < results.size(); ++i) {
+    std::map<string, double>::const_iterator it =
+        baseline.find(results[i].name());
+    if (it == baseline.end()) {
+      LOG(INFO) << "No baseline for " << results[i].name();
+      continue;
+    }
+    const double change = results[i].samples_per_s / it->second - 1;
+    if (change < -FLAGS_tolerance) {
+      LOG(ERROR) << "Regression of " << results[i].name() << ": "
+                 << results[i].samples_per_s << " samples/s, "
+                 << it->second << " in the baseline (" << 100 * change
+                 << "%)";
+      ++regressions;
+    }
+  }
+  return regressions;
+}
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("times the reference models on synthetic data\n"
+      "usage: model_benchmark [-gpu 0] [-batch_sizes 1,16] [-iterations 5]\n"
+      "    [-output results.json] [-baseline baseline.json]");
+  caffe::GlobalInit(&argc, &argv);
+  CHECK_GT(FLAGS_iterations, 0);
+  const vector<string> models = ParseModels(FLAGS_models);
+  const vector<int> batch_sizes = ParseSizes(FLAGS_batch_sizes);
+  vector<Caffe::Brew> modes;
+  if (FLAGS_cpu) {
+    modes.push_back(Caffe::CPU);
+  }
+  if (FLAGS_gpu >= 0) {
+    Caffe::SetDevice(FLAGS_gpu);
+    modes.push_back(Caffe::GPU);
+  }
+  vector<Result> results;
+  for (int m = 0; m < modes.size(); ++m) {
+    Caffe::set_mode(modes[m]);
+    for (int i = 0; i < models.size(); ++i) {
+      for (int j = 0; j < batch_sizes.size(); ++j) {
+        TimeModel(models[i], batch_sizes[j], &results);
+      }
+    }
+  }
+  const string json = ToJSON(results);
+  if (FLAGS_output.size()) {
+    std::ofstream file(FLAGS_output.c_str());
+    file << json;
+    CHECK(file) << "Cannot write " << FLAGS_output;
+  } else {
+    printf("%s", json.c_str());
+  }
+  if (FLAGS_baseline.size()) {
+    const int regressions = Compare(results, ReadBaseline(FLAGS_baseline));
+    if (regressions) {
+      LOG(ERROR) << regressions << " of " << results.size()
+                 << " results regressed by more than "
+                 << 100 * FLAGS_tolerance << "%";
+      return 1;
+    }
+    LOG(INFO) << "No result regressed by more than "
+              << 100 * FLAGS_tolerance << "%";
+  }
+  return 0;
+}
@@ -0,0 +1,255 @@
+// This program rewrites a trained net for deployment. Power layers computing
+// an affine function (power 1) of the outputs of the Convolution or
+// InnerProduct layer right before them, and BatchNorm layers normalizing
+// them with their moving averages, are folded into its weights and bias,
+// and Dropout and Split layers, which only pass their input on at TEST, are
+// removed.
+// Usage:
+//    optimize_net net_proto_file weights_file net_proto_file_out
+//        weights_file_out
+
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Blob;
+using caffe::LayerParameter;
+using caffe::Net;
+using caffe::NetParameter;
+using std::map;
+using std::string;
+using std::vector;
+
+// Whether a layer after the given one has the blob among its bottoms (tops)
+static bool UsedAfter(const vector<LayerParameter>& layers, int layer_id,
+    const string& blob_name, bool tops) {
+  for (int i = layer_id + 1; i < layers.size(); ++i) {
+    const int size = tops ? layers[i].top_size() : layers[i].bottom_size();
+    for (int j = 0; j < size; ++j) {
+      if ((tops ? layers[i].top(j) : layers[i].bottom(j)) == blob_name) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Drops the Dropout and Split layers, their consumers reading their bottom
+// instead, unless a later layer computes in place on that bottom.
+static int RemoveCopies(vector<LayerParameter>* layers) {
+  vector<LayerParameter> kept;
+  map<string, string> renamed;
+  int removed = 0;
+  for (int i = 0; i < layers->size(); ++i) {
+    LayerParameter& layer = (*layers)[i];
+    for (int j = 0; j < layer.bottom_size(); ++j) {
+      if (renamed.count(layer.bottom(j))) {
+        layer.set_bottom(j, renamed[layer.bottom(j)]);
+      }
+    }
+    if ((layer.type() == "Dropout" || layer.type() == "Split")
+        && layer.bottom_size() == 1 && layer.loss_weight_size() == 0
+        && !UsedAfter(*layers, i, layer.bottom(0), true)) {
+      for (int j = 0; j < layer.top_size(); ++j) {
+        if (layer.top(j) != layer.bottom(0)) {
+          renamed[layer.top(j)] = layer.bottom(0);
+        }
+      }
+      LOG(INFO) << "Removing layer " << layer.name();
+      ++removed;
+      continue;
+    }
+    for (int j = 0; j < layer.top_size(); ++j) {
+      renamed.erase(layer.top(j));
+    }
+    kept.push_back(layer);
+  }
+  layers->swap(kept);
+  return removed;
+}
+
+// Multiplies each output of a Convolution or InnerProduct layer by its scale
+// and adds its shift, through the weights and bias.
+static void FoldAffine(const vector<float>& scale, const vector<float>& shift,
+    LayerParameter* layer) {
+  const int num_output = scale.size();
+  Blob<float> blob;
+  blob.FromProto(layer->blobs(0));
+  const int dim = blob.count() / num_output;
+  for (int i = 0; i < num_output; ++i) {
+    caffe::caffe_scal(dim, scale[i], blob.mutable_cpu_data() + i * dim);
+  }
+  blob.ToProto(layer->mutable_blobs(0));
+  if (layer->blobs_size() > 1) {
+    blob.FromProto(layer->blobs(1));
+    float* bias = blob.mutable_cpu_data();
+    for (int i = 0; i < num_output; ++i) {
+      bias[i] = bias[i] * scale[i] + shift[i];
+    }
+  } else if (caffe::caffe_cpu_asum(num_output, &shift[0]) != 0) {
+    blob.Reshape(vector<int>(1, num_output));
+    caffe::caffe_copy(num_output, &shift[0], blob.mutable_cpu_data());
+    if (layer->type() == "Convolution") {
+      layer->mutable_convolution_param()->set_bias_term(true);
+    } else {
+      layer->mutable_inner_product_param()->set_bias_term(true);
+    }
+  } else {
+    return;
+  }
+  if (layer->blobs_size() < 2) {
+    layer->add_blobs();
+  }
+  blob.ToProto(layer->mutable_blobs(1));
+}
+
+// The per output scale and shift a Power layer of power 1, or a BatchNorm
+// layer using its moving averages, applies. False for other layers.
+static bool AffineOf(const LayerParameter& layer, int num_output,
+    vector<float>* scale, vector<float>* shift) {
+  if (layer.type() == "Power" && layer.power_param().power() == 1) {
+    scale->assign(num_output, layer.power_param().scale());
+    shift->assign(num_output, layer.power_param().shift());
+    return true;
+  }
+  const caffe::BatchNormParameter& param = layer.batch_norm_param();
+  if (layer.type() != "BatchNorm" || layer.blobs_size() != 3
+      || (param.has_use_global_stats() && !param.use_global_stats())
+      || layer.blobs(0).data_size() != num_output) {
+    return false;
+  }
+  const float factor = layer.blobs(2).data(0);
+  const float average = factor == 0 ? 0 : 1 / factor;
+  scale->resize(num_output);
+  shift->resize(num_output);
+  for (int i = 0; i < num_output; ++i) {
+    (*scale)[i] = 1 / std::sqrt(layer.blobs(1).data(i) * average
+        + param.eps());
+    (*shift)[i] = -layer.blobs(0).data(i) * average * (*scale)[i];
+  }
+  return true;
+}
+
+// Folds each affine layer that alone reads the outputs of the Convolution or
+// InnerProduct layer producing its bottom.
+static int FoldAffines(vector<LayerParameter>* layers) {
+  vector<bool> folded(layers->size(), false);
+  int count = 0;
+  for (int i = 0; i < layers->size(); ++i) {
+    const LayerParameter& affine = (*layers)[i];
+    if ((affine.type() != "Power" && affine.type() != "BatchNorm")
+        || affine.bottom_size() != 1 || affine.loss_weight_size() > 0) {
+      continue;
+    }
+    const string& blob_name = affine.bottom(0);
+    int producer = i - 1;
+    for (; producer >= 0; --producer) {
+      if (folded[producer]) {
+        continue;
+      }
+      const LayerParameter& layer = (*layers)[producer];
+      bool reads = false;
+      for (int j = 0; j < layer.bottom_size(); ++j) {
+        reads = reads || layer.bottom(j) == blob_name;
+      }
+      if (reads || (layer.top_size() > 0 && layer.top(0) == blob_name)) {
+        break;
+      }
+    }
+    if (producer < 0) {
+      continue;
+    }
+    LayerParameter* layer = &(*layers)[producer];
+    if ((layer->type() != "Convolution" && layer->type() != "InnerProduct")
+        || layer->top_size() != 1 || layer->top(0) != blob_name
+        || layer->blobs_size() == 0 || layer->loss_weight_size() > 0
+        || layer->convolution_param().has_fused_relu()
+        || layer->inner_product_param().has_fused_relu()
+        || layer->inner_product_param().device_size() > 0) {
+      continue;
+    }
+    // Out of place, nothing else may read the outputs before the layer.
+    if (affine.top(0) != blob_name && UsedAfter(*layers, i, blob_name, false)) {
+      continue;
+    }
+    const int num_output = layer->type() == "Convolution" ?
+        layer->convolution_param().num_output() :
+        layer->inner_product_param().num_output();
+    vector<float> scale, shift;
+    if (!AffineOf(affine, num_output, &scale, &shift)) {
+      continue;
+    }
+    FoldAffine(scale, shift, layer);
+    layer->set_top(0, affine.top(0));
+    folded[i] = true;
+    LOG(INFO) << "Folding layer " << affine.name() << " into "
+              << layer->name();
+    ++count;
+  }
+  vector<LayerParameter> kept;
+  for (int i = 0; i < layers->size(); ++i) {
+    if (!folded[i]) {
+      kept.push_back((*layers)[i]);
+    }
+  }
+  layers->swap(kept);
+  return count;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc != 5) {
+    LOG(ERROR) << "Usage: optimize_net net_proto_file weights_file "
+               << "net_proto_file_out weights_file_out";
+    return 1;
+  }
+  NetParameter param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[1], &param);
+  param.mutable_state()->set_phase(caffe::TEST);
+  Net<float> net(param);
+  net.CopyTrainedLayersFrom(argv[2]);
+  NetParameter trained;
+  net.ToProto(&trained);
+  map<string, const LayerParameter*> trained_layers;
+  for (int i = 0; i < trained.layer_size(); ++i) {
+    trained_layers[trained.layer(i).name()] = &trained.layer(i);
+  }
+
+  // Rewrite the layers as written, which Net::ToProto gives with the splits
+  // it inserted, along with their trained blobs.
+  NetParameter filtered;
+  Net<float>::FilterNet(param, &filtered);
+  vector<LayerParameter> layers;
+  for (int i = 0; i < filtered.layer_size(); ++i) {
+    layers.push_back(filtered.layer(i));
+    const LayerParameter* layer = trained_layers[filtered.layer(i).name()];
+    CHECK(layer) << "Unknown layer " << filtered.layer(i).name();
+    layers.back().mutable_blobs()->CopyFrom(layer->blobs());
+  }
+  const int removed = RemoveCopies(&layers);
+  const int folded = FoldAffines(&layers);
+
+  NetParameter weights(filtered);
+  weights.clear_layer();
+  for (int i = 0; i < layers.size(); ++i) {
+    weights.add_layer()->CopyFrom(layers[i]);
+  }
+  NetParameter deploy(weights);
+  for (int i = 0; i < deploy.layer_size(); ++i) {
+    deploy.mutable_layer(i)->clear_blobs();
+  }
+  caffe::WriteProtoToTextFile(deploy, argv[3]);
+  caffe::WriteProtoToBinaryFile(weights, argv[4]);
+  LOG(INFO) << "Removed " << removed << " layers and folded " << folded
+            << ", leaving " << layers.size() << " of " << filtered.layer_size();
+  return 0;
+}
@@ -0,0 +1,126 @@
+// This program prunes the weights of the Convolution and InnerProduct layers
+// of a trained net, zeroing the given fraction of each layer's weights with
+// the smallest magnitudes. The weights are stored as their nonzeros, and the
+// layers run on these only at TEST (see SparsityParameter).
+// Usage:
+//    prune_net net_proto_file weights_file sparsity net_proto_file_out
+//        weights_file_out
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/lexical_cast.hpp"
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Blob;
+using caffe::BlobProto;
+using caffe::LayerParameter;
+using caffe::Net;
+using caffe::NetParameter;
+using std::map;
+using std::string;
+using std::vector;
+
+static bool Prunable(const LayerParameter& layer) {
+  return layer.type() == "Convolution" || (layer.type() == "InnerProduct"
+      && !layer.inner_product_param().has_sparse_dim());
+}
+
+// Zeroes the given fraction of the weights with the smallest magnitudes, and
+// replaces the data by the nonzeros. Returns the fraction of zeros.
+static float PruneWeights(float sparsity, BlobProto* proto) {
+  Blob<float> blob;
+  blob.FromProto(*proto);
+  float* data = blob.mutable_cpu_data();
+  const int count = blob.count();
+  vector<std::pair<float, int> > magnitudes(count);
+  for (int i = 0; i < count; ++i) {
+    magnitudes[i] = std::make_pair(std::fabs(data[i]), i);
+  }
+  const int pruned = static_cast<int>(sparsity * count);
+  std::nth_element(magnitudes.begin(), magnitudes.begin() + pruned,
+      magnitudes.end());
+  for (int i = 0; i < pruned; ++i) {
+    data[magnitudes[i].second] = 0;
+  }
+  const int nonzeros = count - std::count(data, data + count, 0.f);
+  if (nonzeros == 0) {
+    // Kept dense, as a blob without nonzeros reads as one without data.
+    blob.ToProto(proto);
+    return 1;
+  }
+  proto->clear_data();
+  proto->clear_double_data();
+  proto->clear_sparse_data();
+  proto->clear_sparse_index();
+  int last = 0;
+  for (int i = 0; i < count; ++i) {
+    if (data[i] != 0) {
+      proto->add_sparse_data(data[i]);
+      proto->add_sparse_index(i - last);
+      last = i;
+    }
+  }
+  return 1 - static_cast<float>(nonzeros) / count;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc != 6) {
+    LOG(ERROR) << "Usage: prune_net net_proto_file weights_file sparsity "
+               << "net_proto_file_out weights_file_out";
+    return 1;
+  }
+  NetParameter param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[1], &param);
+  param.mutable_state()->set_phase(caffe::TEST);
+  const float sparsity = boost::lexical_cast<float>(argv[3]);
+  CHECK_GE(sparsity, 0);
+  CHECK_LT(sparsity, 1);
+  Net<float> net(param);
+  net.CopyTrainedLayersFrom(argv[2]);
+  NetParameter trained;
+  net.ToProto(&trained);
+  map<string, const LayerParameter*> trained_layers;
+  for (int i = 0; i < trained.layer_size(); ++i) {
+    trained_layers[trained.layer(i).name()] = &trained.layer(i);
+  }
+
+  // Rewrite the layers as written, without the splits Net::ToProto gives.
+  NetParameter filtered;
+  Net<float>::FilterNet(param, &filtered);
+  NetParameter weights(filtered);
+  int pruned = 0;
+  for (int i = 0; i < weights.layer_size(); ++i) {
+    LayerParameter* layer = weights.mutable_layer(i);
+    const LayerParameter* trained_layer = trained_layers[layer->name()];
+    CHECK(trained_layer) << "Unknown layer " << layer->name();
+    layer->mutable_blobs()->CopyFrom(trained_layer->blobs());
+    if (!Prunable(*layer) || layer->blobs_size() == 0) {
+      continue;
+    }
+    const float zeros = PruneWeights(sparsity, layer->mutable_blobs(0));
+    layer->mutable_sparsity_param();
+    LOG(INFO) << "Pruning layer " << layer->name() << " to " << zeros
+              << " of its weights zero";
+    ++pruned;
+  }
+  NetParameter deploy(weights);
+  for (int i = 0; i < deploy.layer_size(); ++i) {
+    deploy.mutable_layer(i)->clear_blobs();
+  }
+  caffe::WriteProtoToTextFile(deploy, argv[4]);
+  caffe::WriteProtoToBinaryFile(weights, argv[5]);
+  LOG(INFO) << "Pruned " << pruned << " of " << weights.layer_size()
+            << " layers";
+  return 0;
+}
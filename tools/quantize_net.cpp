@@ -0,0 +1,126 @@
+// This program rewrites a trained net to run its Convolution and InnerProduct
+// layers on int8 values at TEST. The range of the inputs of each is
+// calibrated over some batches of the net, giving its input_scale, and the
+// weights are stored as int8 values with a scale per output, which makes the
+// weights file about four times smaller.
+// Usage:
+//    quantize_net net_proto_file weights_file iterations net_proto_file_out
+//        weights_file_out
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "boost/lexical_cast.hpp"
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Blob;
+using caffe::BlobProto;
+using caffe::LayerParameter;
+using caffe::Net;
+using caffe::NetParameter;
+using std::map;
+using std::string;
+using std::vector;
+
+static bool Quantizable(const LayerParameter& layer) {
+  return layer.type() == "Convolution" || (layer.type() == "InnerProduct"
+      && !layer.inner_product_param().has_sparse_dim());
+}
+
+// Replaces the data of the weights, num_output rows, by int8 values and the
+// scale of each row.
+static void QuantizeWeights(int num_output, BlobProto* proto) {
+  Blob<float> blob;
+  blob.FromProto(*proto);
+  const int dim = blob.count() / num_output;
+  vector<float> scales(num_output);
+  string values(blob.count(), 0);
+  caffe::caffe_cpu_quantize_rows(num_output, dim, blob.cpu_data(), &scales[0],
+      reinterpret_cast<int8_t*>(&values[0]));
+  proto->clear_data();
+  proto->clear_double_data();
+  proto->set_int8_data(values);
+  for (int i = 0; i < num_output; ++i) {
+    proto->add_int8_scale(scales[i]);
+  }
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc != 6) {
+    LOG(ERROR) << "Usage: quantize_net net_proto_file weights_file "
+               << "iterations net_proto_file_out weights_file_out";
+    return 1;
+  }
+  NetParameter param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[1], &param);
+  param.mutable_state()->set_phase(caffe::TEST);
+  const int iterations = boost::lexical_cast<int>(argv[3]);
+  CHECK_GT(iterations, 0);
+  Net<float> net(param);
+  net.CopyTrainedLayersFrom(argv[2]);
+
+  // The largest absolute value of the inputs of each layer over the batches
+  map<string, float> ranges;
+  for (int iter = 0; iter < iterations; ++iter) {
+    net.ForwardPrefilled();
+    for (int i = 0; i < net.layers().size(); ++i) {
+      if (!Quantizable(net.layers()[i]->layer_param())) {
+        continue;
+      }
+      float& range = ranges[net.layer_names()[i]];
+      const vector<Blob<float>*>& bottom = net.bottom_vecs()[i];
+      for (int j = 0; j < bottom.size(); ++j) {
+        range = std::max(range,
+            caffe::caffe_cpu_amax(bottom[j]->count(), bottom[j]->cpu_data()));
+      }
+    }
+  }
+  NetParameter trained;
+  net.ToProto(&trained);
+  map<string, const LayerParameter*> trained_layers;
+  for (int i = 0; i < trained.layer_size(); ++i) {
+    trained_layers[trained.layer(i).name()] = &trained.layer(i);
+  }
+
+  // Rewrite the layers as written, without the splits Net::ToProto gives.
+  NetParameter filtered;
+  Net<float>::FilterNet(param, &filtered);
+  NetParameter weights(filtered);
+  int quantized = 0;
+  for (int i = 0; i < weights.layer_size(); ++i) {
+    LayerParameter* layer = weights.mutable_layer(i);
+    const LayerParameter* trained_layer = trained_layers[layer->name()];
+    CHECK(trained_layer) << "Unknown layer " << layer->name();
+    layer->mutable_blobs()->CopyFrom(trained_layer->blobs());
+    if (!Quantizable(*layer) || layer->blobs_size() == 0) {
+      continue;
+    }
+    const float range = ranges[layer->name()];
+    layer->mutable_quantization_param()->set_input_scale(range / 127);
+    const int num_output = layer->type() == "Convolution"
+        ? layer->convolution_param().num_output()
+        : layer->inner_product_param().num_output();
+    QuantizeWeights(num_output, layer->mutable_blobs(0));
+    LOG(INFO) << "Quantizing layer " << layer->name() << ", inputs up to "
+              << range;
+    ++quantized;
+  }
+  NetParameter deploy(weights);
+  for (int i = 0; i < deploy.layer_size(); ++i) {
+    deploy.mutable_layer(i)->clear_blobs();
+  }
+  caffe::WriteProtoToTextFile(deploy, argv[4]);
+  caffe::WriteProtoToBinaryFile(weights, argv[5]);
+  LOG(INFO) << "Quantized " << quantized << " of " << weights.layer_size()
+            << " layers";
+  return 0;
+}
@@ -0,0 +1,70 @@
+// This program times the hand-off of items between two threads by the
+// BlockingQueue and the SPSCQueue, as the ring all-reduce and the frozen
+// layers forward do each step: the items go back and forth, each side
+// waiting for the other.
+// Usage:
+//    queue_benchmark [hand_offs]
+
+#include <cstdlib>
+
+#include "caffe/internal_thread.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/spsc_queue.hpp"
+
+using caffe::BlockingQueue;
+using caffe::CPUTimer;
+using caffe::InternalThread;
+using caffe::SPSCQueue;
+
+// Sends back each item it receives, until a negative one.
+template <typename Queue>
+class EchoThread : public InternalThread {
+ public:
+  EchoThread(Queue* in, Queue* out) : in_(in), out_(out) {}
+  virtual ~EchoThread() { StopInternalThread(); }
+
+ protected:
+  virtual void InternalThreadEntry() {
+    for (int i = in_->pop(); i >= 0; i = in_->pop()) {
+      out_->push(i);
+    }
+  }
+
+  Queue* in_;
+  Queue* out_;
+};
+
+// Returns the microseconds of a round trip
+template <typename Queue>
+float RoundTrip(int hand_offs) {
+  Queue requests;
+  Queue replies;
+  EchoThread<Queue> echo(&requests, &replies);
+  echo.StartInternalThread();
+  CPUTimer timer;
+  timer.Start();
+  for (int i = 0; i < hand_offs; ++i) {
+    requests.push(i);
+    CHECK_EQ(replies.pop(), i);
+  }
+  timer.Stop();
+  requests.push(-1);
+  echo.StopInternalThread();
+  return timer.MicroSeconds() / hand_offs;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = 1;
+  const int hand_offs = argc > 1 ? atoi(argv[1]) : 100000;
+  if (argc > 2 || hand_offs <= 0) {
+    LOG(ERROR) << "Usage: queue_benchmark [hand_offs]";
+    return 1;
+  }
+  LOG(INFO) << "BlockingQueue round trip: "
+      << RoundTrip<BlockingQueue<int> >(hand_offs) << " us";
+  LOG(INFO) << "SPSCQueue round trip: "
+      << RoundTrip<SPSCQueue<int> >(hand_offs) << " us";
+  return 0;
+}
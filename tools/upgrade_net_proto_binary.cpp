@@ -1,4 +1,6 @@
 // This is a script to upgrade "V0" network prototxts to the new format.
+// An output file ending in .mmap is written as a mapped weights file, the
+// format nets load fastest (see map_weights).
 // Usage:
 //    upgrade_net_proto_binary v0_net_proto_file_in net_proto_file_out
 
@@ -42,8 +44,16 @@ int main(int argc, char** argv) {
     LOG(ERROR) << "File already in V1 proto format: " << argv[1];
   }
 
-  WriteProtoToBinaryFile(net_param, argv[2]);
-
-  LOG(ERROR) << "Wrote upgraded NetParameter binary proto to " << argv[2];
+  const string output_filename(argv[2]);
+  const string mapped_ext(".mmap");
+  if (output_filename.size() >= mapped_ext.size() &&
+      output_filename.compare(output_filename.size() - mapped_ext.size(),
+                              mapped_ext.size(), mapped_ext) == 0) {
+    WriteMappedWeights(net_param, output_filename);
+    LOG(ERROR) << "Wrote upgraded mapped weights to " << argv[2];
+  } else {
+    WriteProtoToBinaryFile(net_param, argv[2]);
+    LOG(ERROR) << "Wrote upgraded NetParameter binary proto to " << argv[2];
+  }
   return !success;
 }